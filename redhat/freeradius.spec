@@ -775,6 +775,7 @@ fi
 %doc %{_mandir}/man1/radlast.1.gz
 %doc %{_mandir}/man1/radtest.1.gz
 %doc %{_mandir}/man1/radwho.1.gz
+%doc %{_mandir}/man1/radutmp2db.1.gz
 %doc %{_mandir}/man1/radzap.1.gz
 %doc %{_mandir}/man1/dhcpclient.1.gz
 %doc %{_mandir}/man8/radsqlrelay.8.gz
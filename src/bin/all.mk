@@ -1,9 +1,11 @@
 SUBMAKEFILES := \
     radclient.mk \
+    raddetail.mk \
     radict.mk \
     radiusd.mk \
     radsniff.mk \
     radwho.mk \
+    radutmp2db.mk \
     radsnmp.mk \
     radlast.mk \
     radtest.mk \
@@ -56,6 +56,12 @@ static char *secret = NULL;
 static bool do_output = true;
 
 static rc_stats_t stats;
+static rc_latency_t latency;
+
+static int persec = 0;
+static fr_time_delta_t ramp = 0;
+static fr_time_t rate_start = 0;
+static fr_time_t rate_next = 0;
 
 static uint16_t server_port = 0;
 static int packet_code = FR_CODE_UNDEFINED;
@@ -171,12 +177,12 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  -F                     Print the file name, packet number and reply code.\n");
 	fprintf(stderr, "  -h                     Print usage help information.\n");
 	fprintf(stderr, "  -i <id>                Set request id to 'id'.  Values may be 0..255\n");
-	fprintf(stderr, "  -n <num>               Send N requests/s\n");
+	fprintf(stderr, "  -n <num>[:<ramp>]      Send N requests/s, increasing the rate linearly over 'ramp' seconds.\n");
 	fprintf(stderr, "  -p <num>               Send 'num' packets from a file in parallel.\n");
 	fprintf(stderr, "  -P <proto>             Use proto (tcp or udp) for transport.\n");
 	fprintf(stderr, "  -q                     Do not print anything out.\n");
 	fprintf(stderr, "  -r <retries>           If timeout, retry sending the packet 'retries' times.\n");
-	fprintf(stderr, "  -s                     Print out summary information of auth results.\n");
+	fprintf(stderr, "  -s                     Print out summary information of auth results, and response latencies.\n");
 	fprintf(stderr, "  -S <file>              read secret from file, not command line.\n");
 	fprintf(stderr, "  -t <timeout>           Wait 'timeout' seconds before retrying (may be a floating point number).\n");
 	fprintf(stderr, "  -v                     Show program version information.\n");
@@ -805,6 +811,90 @@ static int filename_walk(void *data, UNUSED void *uctx)
 }
 
 
+/** Record the time taken to receive a response
+ *
+ */
+static void latency_record(fr_time_delta_t value)
+{
+	unsigned int	idx;
+
+	if (value < 0) value = 0;
+
+	if (value < RC_LATENCY_SUB_BUCKETS) {
+		idx = value;
+	} else {
+		int shift = (63 - __builtin_clzll(value)) - RC_LATENCY_SUB_BITS;
+
+		idx = ((shift + 1) << RC_LATENCY_SUB_BITS) + ((value >> shift) & (RC_LATENCY_SUB_BUCKETS - 1));
+	}
+
+	latency.bucket[idx]++;
+	latency.count++;
+	if (value > latency.max) latency.max = value;
+}
+
+/** Return the smallest value which is larger than a percentage of the recorded values
+ *
+ */
+static fr_time_delta_t latency_percentile(double percent)
+{
+	uint64_t	target, seen = 0;
+	unsigned int	i;
+
+	if (!latency.count) return 0;
+
+	target = (latency.count * percent) / 100;
+	if (target >= latency.count) return latency.max;
+
+	for (i = 0; i < NUM_ELEMENTS(latency.bucket); i++) {
+		seen += latency.bucket[i];
+		if (seen > target) break;
+	}
+
+	if (i < RC_LATENCY_SUB_BUCKETS) return i;
+
+	return ((fr_time_delta_t)(RC_LATENCY_SUB_BUCKETS + (i & (RC_LATENCY_SUB_BUCKETS - 1)))) <<
+		((i >> RC_LATENCY_SUB_BITS) - 1);
+}
+
+/** Decide whether we're allowed to send a new request
+ *
+ * Requests are scheduled at fixed intervals from when the first one was sent,
+ * so time lost to a slow loop iteration is made up by sending the next few
+ * requests immediately, and the target rate is held.
+ *
+ * @param[in] now	The current time.
+ * @param[out] wait	How long until the next request may be sent.
+ * @return
+ *	- true if a request may be sent now.
+ *	- false if we need to wait.
+ */
+static bool rate_allow(fr_time_t now, fr_time_delta_t *wait)
+{
+	double	rate = persec;
+
+	if (!persec) return true;
+
+	if (!rate_start) rate_start = rate_next = now;
+
+	if (now < rate_next) {
+		*wait = rate_next - now;
+		return false;
+	}
+
+	/*
+	 *	Ramp the rate up linearly from one request
+	 *	per second.
+	 */
+	if (ramp && ((now - rate_start) < ramp)) {
+		rate = 1 + ((persec - 1) * ((double)(now - rate_start) / ramp));
+	}
+
+	rate_next += (fr_time_delta_t)(NSEC / rate);
+
+	return true;
+}
+
 /*
  *	Deallocate packet ID, etc.
  */
@@ -924,12 +1014,12 @@ static int send_one_packet(rc_request_t *request)
 			}
 		}
 
-		request->timestamp = time(NULL);
+		request->timestamp = request->sent = fr_time();
 		request->tries = 1;
 		request->resend++;
 
 	} else {		/* request->packet->id >= 0 */
-		fr_time_delta_t now = fr_time();
+		fr_time_t now = fr_time();
 
 		/*
 		 *	FIXME: Accounting packets are never retried!
@@ -948,8 +1038,8 @@ static int send_one_packet(rc_request_t *request)
 			 *	required to sleep.
 			 */
 			if ((sleep_time == -1) ||
-			    (sleep_time > (now - request->timestamp))) {
-				sleep_time = now - request->timestamp;
+			    (sleep_time > (timeout - (now - request->timestamp)))) {
+				sleep_time = timeout - (now - request->timestamp);
 			}
 			return 0;
 		}
@@ -978,6 +1068,7 @@ static int send_one_packet(rc_request_t *request)
 				request->done = true;
 			}
 			stats.lost++;
+			stats.timeouts++;
 			return -1;
 		}
 
@@ -986,6 +1077,7 @@ static int send_one_packet(rc_request_t *request)
 		 */
 		request->timestamp = now;
 		request->tries++;
+		stats.retransmits++;
 	}
 
 	/*
@@ -1084,6 +1176,8 @@ static int recv_one_packet(fr_time_t wait_time)
 		goto packet_done; /* shared secret is incorrect */
 	}
 
+	latency_record(fr_time() - request->sent);
+
 	if (print_filename) {
 		RDEBUG("%s response code %d", request->files->packets, reply->code);
 	}
@@ -1174,7 +1268,6 @@ int main(int argc, char **argv)
 	char		filesecret[256];
 	FILE		*fp;
 	int		do_summary = false;
-	int		persec = 0;
 	int		parallel = 1;
 	rc_request_t	*this;
 	int		force_af = AF_UNSPEC;
@@ -1276,8 +1369,21 @@ int main(int argc, char **argv)
 			break;
 
 		case 'n':
-			persec = atoi(optarg);
+		{
+			char *q;
+
+			persec = strtol(optarg, &q, 10);
 			if (persec <= 0) usage();
+
+			if (*q == ':') {
+				if (fr_time_delta_from_str(&ramp, q + 1, FR_TIME_RES_SEC) < 0) {
+					ERROR("Failed parsing ramp value %s", fr_strerror());
+					fr_exit_now(1);
+				}
+			} else if (*q) {
+				usage();
+			}
+		}
 			break;
 
 			/*
@@ -1586,6 +1692,20 @@ int main(int argc, char **argv)
 			}
 
 			if (n > 0) {
+				/*
+				 *	New requests are paced, retransmits
+				 *	aren't.
+				 */
+				if (!this->tries) {
+					fr_time_delta_t wait;
+
+					if (!rate_allow(fr_time(), &wait)) {
+						done = false;
+						if ((sleep_time == -1) || (sleep_time > wait)) sleep_time = wait;
+						continue;
+					}
+				}
+
 				n--;
 
 				/*
@@ -1596,42 +1716,18 @@ int main(int argc, char **argv)
 					break;
 				}
 
-				/*
-				 *	Wait a little before sending
-				 *	the next packet, if told to.
-				 */
-				if (persec) {
-					fr_time_delta_t psec;
-
-					psec = (persec == 1) ? fr_time_delta_from_sec(1) : (1000000 / persec);
-
-					/*
-					 *	Don't sleep elsewhere.
-					 */
-					sleep_time = 0;
-
-
-					/*
-					 *	Sleep for milliseconds,
-					 *	portably.
-					 *
-					 *	If we get an error or
-					 *	a signal, treat it like
-					 *	a normal timeout.
-					 */
-					select(0, NULL, NULL, NULL, &fr_time_delta_to_timeval(psec));
-				}
-
 				/*
 				 *	If we haven't sent this packet
 				 *	often enough, we're not done,
-				 *	and we shouldn't sleep.
+				 *	and we shouldn't sleep, unless
+				 *	we're waiting to send the next
+				 *	packet.
 				 */
 				if (this->resend < resend_count) {
 					int i;
 
 					done = false;
-					sleep_time = 0;
+					if (!persec) sleep_time = 0;
 
 					for (i = 0; i < 4; i++) {
 						((uint32_t *) this->packet->vector)[i] = fr_rand();
@@ -1690,6 +1786,25 @@ int main(int argc, char **argv)
 		      stats.passed,
 		      stats.failed
 		);
+
+		DEBUG("\tTimeouts      : %" PRIu64 "\n"
+		      "\tRetransmits   : %" PRIu64,
+		      stats.timeouts,
+		      stats.retransmits);
+
+		if (latency.count) {
+			DEBUG("Response latency (ms):\n"
+			      "\tp50           : %.3f\n"
+			      "\tp90           : %.3f\n"
+			      "\tp99           : %.3f\n"
+			      "\tp99.9         : %.3f\n"
+			      "\tMax           : %.3f",
+			      (double)latency_percentile(50) / 1000000,
+			      (double)latency_percentile(90) / 1000000,
+			      (double)latency_percentile(99) / 1000000,
+			      (double)latency_percentile(99.9) / 1000000,
+			      (double)latency.max / 1000000);
+		}
 	}
 
 	if ((stats.lost > 0) || (stats.failed > 0)) {
@@ -56,8 +56,25 @@ typedef struct {
 	uint64_t lost;			//!< Requests to which we received no response
 	uint64_t passed;		//!< Requests which passed a filter
 	uint64_t failed;		//!< Requests which failed a fitler
+	uint64_t timeouts;		//!< Requests which timed out after all retries.
+	uint64_t retransmits;		//!< Number of times a request was retransmitted.
 } rc_stats_t;
 
+#define RC_LATENCY_SUB_BITS	(5)
+#define RC_LATENCY_SUB_BUCKETS	(1 << RC_LATENCY_SUB_BITS)
+
+/** Log-linear histogram of response latencies
+ *
+ * Values are grouped by their most significant bit, and each group is split
+ * into #RC_LATENCY_SUB_BUCKETS linear buckets, so each bucket is accurate to
+ * within about 3%, whatever the magnitude of the value.
+ */
+typedef struct {
+	uint64_t	count;		//!< Total number of values recorded.
+	fr_time_delta_t	max;		//!< Largest value recorded.
+	uint64_t	bucket[64 * RC_LATENCY_SUB_BUCKETS];
+} rc_latency_t;
+
 typedef struct {
 	char const *packets;		//!< The file containing the request packet
 	char const *filters;		//!< The file containing the definition of the
@@ -75,7 +92,8 @@ struct rc_request {
 	rc_file_pair_t	*files;		//!< Request and response file names.
 
 	VALUE_PAIR	*password;	//!< Cleartext-Password
-	fr_time_delta_t	timestamp;
+	fr_time_t	timestamp;	//!< When the request was last (re)transmitted.
+	fr_time_t	sent;		//!< When the request was first transmitted.
 
 	RADIUS_PACKET	*packet;	//!< The outgoing request.
 	RADIUS_PACKET	*reply;		//!< The incoming response.
@@ -0,0 +1,525 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file raddetail.c
+ * @brief Convert detail files between the text and binary formats.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/base.h>
+#include <freeradius-devel/util/conf.h>
+#include <freeradius-devel/server/detail.h>
+#include <freeradius-devel/internal/internal.h>
+#include <freeradius-devel/autoconf.h>
+
+#include <time.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+#define DETAIL_LINE_MAX	8192
+
+typedef enum {
+	DETAIL_OUT_AUTO = 0,			//!< The opposite of the first record.
+	DETAIL_OUT_TEXT,
+	DETAIL_OUT_BINARY
+} detail_out_t;
+
+static fr_dict_t *dict_internal;
+static fr_dict_t *dict_protocol;
+
+DIAG_OFF(unused-macros)
+#define DEBUG(fmt, ...)		if (fr_log_fp && (fr_debug_lvl > 1)) fprintf(fr_log_fp , fmt "\n", ## __VA_ARGS__)
+#define INFO(fmt, ...)		if (fr_log_fp && (fr_debug_lvl > 0)) fprintf(fr_log_fp , fmt "\n", ## __VA_ARGS__)
+DIAG_ON(unused-macros)
+
+static void NEVER_RETURNS usage(int status)
+{
+	FILE *fp = status ? stderr : stdout;
+
+	fprintf(fp, "usage: raddetail [OPTS] [<input> [<output>]]\n");
+	fprintf(fp, "  -b               Write binary records.\n");
+	fprintf(fp, "  -t               Write text records.\n");
+	fprintf(fp, "  -D <dictdir>     Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(fp, "  -p <protocol>    Protocol of the records (defaults to radius).\n");
+	fprintf(fp, "  -x               Debugging mode.\n");
+	fprintf(fp, "\n");
+	fprintf(fp, "Convert detail files between the text and binary formats.  Input records may be\n");
+	fprintf(fp, "in either format.  If neither -b or -t are given, records are written in the\n");
+	fprintf(fp, "opposite format to the first record read.  The input and output default to\n");
+	fprintf(fp, "stdin and stdout.\n");
+
+	fr_exit_now(status);
+}
+
+/** Read one binary record
+ *
+ * @return
+ *	- 1 if a record was read.
+ *	- 0 at EOF.
+ *	- -1 on error.
+ */
+static int detail_read_binary(TALLOC_CTX *ctx, FILE *fp, fr_detail_binary_hdr_t *hdr, VALUE_PAIR **vps)
+{
+	uint8_t		header[FR_DETAIL_BINARY_HDR_LEN];
+	uint8_t		*buff, *p, *end;
+	fr_cursor_t	cursor;
+	size_t		len;
+
+	len = fread(header, 1, sizeof(header), fp);
+	if (len == 0) return 0;
+	if (len < sizeof(header)) {
+		fr_strerror_printf("Truncated binary record");
+		return -1;
+	}
+
+	if (fr_detail_binary_hdr_decode(hdr, header, sizeof(header)) < 0) return -1;
+
+	if (hdr->length > FR_DETAIL_BINARY_MAX_LEN) {
+		fr_strerror_printf("Binary record length %u is too large", hdr->length);
+		return -1;
+	}
+
+	if (!fr_dict_by_protocol_num(hdr->protocol)) {
+		fr_strerror_printf("Binary record is for protocol %u, which isn't loaded", hdr->protocol);
+		return -1;
+	}
+
+	len = hdr->length - FR_DETAIL_BINARY_HDR_LEN;
+	MEM(buff = talloc_array(ctx, uint8_t, len ? len : 1));
+	if (fread(buff, 1, len, fp) != len) {
+		fr_strerror_printf("Truncated binary record");
+		talloc_free(buff);
+		return -1;
+	}
+
+	p = buff;
+	end = buff + len;
+
+	fr_cursor_init(&cursor, vps);
+	while (p < end) {
+		fr_dict_t const	*dict;
+		ssize_t		slen;
+
+		switch (*p++) {
+		case FR_DETAIL_BINARY_DICT_PROTOCOL:
+			dict = fr_dict_by_protocol_num(hdr->protocol);
+			break;
+
+		case FR_DETAIL_BINARY_DICT_INTERNAL:
+			dict = dict_internal;
+			break;
+
+		default:
+			fr_strerror_printf("Unknown dictionary in binary record");
+			goto error;
+		}
+
+		slen = fr_internal_decode_pair(ctx, &cursor, dict, p, end - p, NULL);
+		if (slen <= 0) {
+		error:
+			fr_cursor_head(&cursor);
+			fr_cursor_free_list(&cursor);
+			talloc_free(buff);
+			return -1;
+		}
+		p += slen;
+	}
+
+	talloc_free(buff);
+	return 1;
+}
+
+/** Read one text record
+ *
+ * The packet metadata which rlm_detail writes as attributes is moved into
+ * the header, so that it's written to the header of binary records.
+ *
+ * @return
+ *	- 1 if a record was read.
+ *	- 0 at EOF.
+ *	- -1 on error.
+ */
+static int detail_read_text(TALLOC_CTX *ctx, FILE *fp, fr_detail_binary_hdr_t *hdr, VALUE_PAIR **vps)
+{
+	char			line[DETAIL_LINE_MAX];
+	fr_cursor_t		cursor;
+	fr_dict_attr_t const	*attr_packet_type;
+	bool			header = false;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->protocol = fr_dict_root(dict_protocol)->attr;
+	hdr->src_ipaddr.af = AF_INET;
+	hdr->src_ipaddr.prefix = 32;
+	hdr->src_ipaddr.addr.v4.s_addr = htonl(INADDR_NONE);
+	hdr->dst_ipaddr = hdr->src_ipaddr;
+
+	attr_packet_type = fr_dict_attr_by_name(dict_protocol, "Packet-Type");
+
+	fr_cursor_init(&cursor, vps);
+
+	while (fgets(line, sizeof(line), fp)) {
+		VALUE_PAIR	*vp;
+		char		*p;
+
+		p = strchr(line, '\n');
+		if (!p) {
+			if (!feof(fp)) {
+				fr_strerror_printf("Line too long");
+				goto error;
+			}
+		} else {
+			*p = '\0';
+		}
+
+		/*
+		 *	Blank lines end a record, or come before it.
+		 */
+		if (!line[0]) {
+			if (header) return 1;
+			continue;
+		}
+
+		if (!header) {
+			header = true;
+			continue;
+		}
+
+		if (line[0] != '\t') {
+			fr_strerror_printf("Malformed line: %s", line);
+			goto error;
+		}
+		p = line + 1;
+
+		/*
+		 *	proto_detail marks records it has processed by
+		 *	overwriting "Time" with "Done".
+		 */
+		if (strncmp(p, "Donestamp = ", 12) == 0) hdr->flags |= FR_DETAIL_BINARY_FLAG_DONE;
+
+		if ((strncmp(p, "Timestamp = ", 12) == 0) || (strncmp(p, "Donestamp = ", 12) == 0)) {
+			hdr->timestamp = ((fr_unix_time_t) strtoul(p + 12, NULL, 10)) * NSEC;
+			continue;
+		}
+
+		vp = NULL;
+		if ((fr_pair_list_afrom_str(ctx, dict_protocol, p, &vp) <= 0) || !vp) {
+			fr_strerror_printf_push("Failed parsing: %s", p);
+			goto error;
+		}
+
+		if (vp->da == attr_packet_type) {
+			hdr->code = vp->vp_uint32;
+
+		} else if (strncmp(vp->da->name, "Packet-Src-IP", 13) == 0) {
+			hdr->src_ipaddr = vp->vp_ip;
+
+		} else if (strncmp(vp->da->name, "Packet-Dst-IP", 13) == 0) {
+			hdr->dst_ipaddr = vp->vp_ip;
+
+		} else if (strcmp(vp->da->name, "Packet-Src-Port") == 0) {
+			hdr->src_port = vp->vp_uint16;
+
+		} else if (strcmp(vp->da->name, "Packet-Dst-Port") == 0) {
+			hdr->dst_port = vp->vp_uint16;
+
+		} else {
+			fr_cursor_append(&cursor, vp);
+			continue;
+		}
+
+		fr_pair_list_free(&vp);
+	}
+
+	if (ferror(fp)) {
+		fr_strerror_printf("Failed reading input: %s", fr_syserror(errno));
+	error:
+		fr_cursor_head(&cursor);
+		fr_cursor_free_list(&cursor);
+		return -1;
+	}
+
+	return header ? 1 : 0;
+}
+
+static int detail_write_binary(FILE *fp, fr_detail_binary_hdr_t *hdr, VALUE_PAIR *vps)
+{
+	uint8_t		buff[FR_DETAIL_BINARY_MAX_LEN];
+	uint8_t		*p, *end;
+	fr_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	fr_dict_t const	*dict;
+
+	dict = fr_dict_by_protocol_num(hdr->protocol);
+
+	p = buff + FR_DETAIL_BINARY_HDR_LEN;
+	end = buff + sizeof(buff);
+
+	for (vp = fr_cursor_init(&cursor, &vps);
+	     vp;
+	     vp = fr_cursor_current(&cursor)) {
+		ssize_t slen;
+
+		if (p >= end) {
+		too_big:
+			fr_strerror_printf_push("Record is too large");
+			return -1;
+		}
+
+		*p++ = (fr_dict_by_da(vp->da) == dict) ? FR_DETAIL_BINARY_DICT_PROTOCOL :
+							 FR_DETAIL_BINARY_DICT_INTERNAL;
+
+		slen = fr_internal_encode_pair(p, end - p, &cursor, NULL);
+		if (slen <= 0) goto too_big;
+		p += slen;
+	}
+
+	hdr->length = p - buff;
+	fr_detail_binary_hdr_encode(buff, hdr);
+
+	if (fwrite(buff, p - buff, 1, fp) != 1) {
+		fr_strerror_printf("Failed writing output: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void detail_write_addr(FILE *fp, char const *name, fr_ipaddr_t const *ipaddr)
+{
+	char buff[INET6_ADDRSTRLEN];
+
+	if ((ipaddr->af == AF_INET) && (ipaddr->addr.v4.s_addr == htonl(INADDR_NONE))) return;
+
+	fprintf(fp, "\t%s%s = %s\n", name, (ipaddr->af == AF_INET6) ? "IPv6-Address" : "IP-Address",
+		inet_ntop(ipaddr->af, &ipaddr->addr, buff, sizeof(buff)));
+}
+
+/** Write one text record, in the same format as rlm_detail
+ *
+ */
+static int detail_write_text(FILE *fp, fr_detail_binary_hdr_t const *hdr, VALUE_PAIR *vps)
+{
+	char			buff[64];
+	time_t			when = hdr->timestamp / NSEC;
+	struct tm		tm;
+	fr_cursor_t		cursor;
+	VALUE_PAIR		*vp;
+	fr_dict_attr_t const	*attr_packet_type;
+	fr_dict_enum_t const	*enumv = NULL;
+
+	strftime(buff, sizeof(buff), "%a %b %e %H:%M:%S %Y", localtime_r(&when, &tm));
+	fprintf(fp, "%s\n", buff);
+
+	attr_packet_type = fr_dict_attr_by_name(fr_dict_by_protocol_num(hdr->protocol), "Packet-Type");
+	if (attr_packet_type) enumv = fr_dict_enum_by_value(attr_packet_type, fr_box_uint32(hdr->code));
+	if (enumv) {
+		fprintf(fp, "\tPacket-Type = %s\n", enumv->name);
+	} else {
+		fprintf(fp, "\tPacket-Type = %u\n", hdr->code);
+	}
+
+	detail_write_addr(fp, "Packet-Src-", &hdr->src_ipaddr);
+	detail_write_addr(fp, "Packet-Dst-", &hdr->dst_ipaddr);
+	if (hdr->src_port) fprintf(fp, "\tPacket-Src-Port = %u\n", hdr->src_port);
+	if (hdr->dst_port) fprintf(fp, "\tPacket-Dst-Port = %u\n", hdr->dst_port);
+
+	for (vp = fr_cursor_init(&cursor, &vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		vp->op = T_OP_EQ;
+		fr_pair_fprint(fp, vp);
+	}
+
+	fprintf(fp, "\t%s = %lu\n", (hdr->flags & FR_DETAIL_BINARY_FLAG_DONE) ? "Donestamp" : "Timestamp",
+		(unsigned long) when);
+
+	if (fprintf(fp, "\n") < 0) {
+		fr_strerror_printf("Failed writing output: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char const		*dict_dir = DICTDIR;
+	char const		*protocol = "radius";
+	char			c;
+	int			ret = EXIT_FAILURE;
+	detail_out_t		out_format = DETAIL_OUT_AUTO;
+	FILE			*in = stdin, *out = stdout;
+	uint64_t		records = 0;
+
+	TALLOC_CTX		*autofree;
+
+	/*
+	 *	Must be called first, so the handler is called last
+	 */
+	fr_thread_local_atexit_setup();
+
+	autofree = talloc_autofree_context();
+
+#ifndef NDEBUG
+	if (fr_fault_setup(autofree, getenv("PANIC_ACTION"), argv[0]) < 0) {
+		fr_perror("raddetail");
+		fr_exit(EXIT_FAILURE);
+	}
+#endif
+
+	talloc_set_log_stderr();
+
+	fr_debug_lvl = 0;
+	fr_log_fp = stderr;
+
+	while ((c = getopt(argc, argv, "btD:p:xh")) != -1) switch (c) {
+		case 'b':
+			out_format = DETAIL_OUT_BINARY;
+			break;
+
+		case 't':
+			out_format = DETAIL_OUT_TEXT;
+			break;
+
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'p':
+			protocol = optarg;
+			break;
+
+		case 'x':
+			fr_debug_lvl++;
+			break;
+
+		case 'h':
+			usage(EXIT_SUCCESS);
+
+		default:
+			usage(EXIT_FAILURE);
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 2) usage(EXIT_FAILURE);
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror("raddetail");
+		goto finish;
+	}
+
+	if (!fr_dict_global_ctx_init(autofree, dict_dir)) {
+		fr_perror("raddetail");
+		goto finish;
+	}
+
+	if (fr_dict_internal_afrom_file(&dict_internal, FR_DICTIONARY_INTERNAL_DIR) < 0) {
+		fr_perror("raddetail");
+		goto finish;
+	}
+
+	if (fr_dict_protocol_afrom_file(&dict_protocol, protocol, NULL) < 0) {
+		fr_perror("raddetail");
+		goto finish;
+	}
+
+	if ((argc > 0) && (strcmp(argv[0], "-") != 0)) {
+		in = fopen(argv[0], "r");
+		if (!in) {
+			fr_perror("raddetail: Failed opening %s: %s", argv[0], fr_syserror(errno));
+			goto finish;
+		}
+	}
+
+	if ((argc > 1) && (strcmp(argv[1], "-") != 0)) {
+		out = fopen(argv[1], "w");
+		if (!out) {
+			fr_perror("raddetail: Failed opening %s: %s", argv[1], fr_syserror(errno));
+			goto finish;
+		}
+	}
+
+	for (;;) {
+		fr_detail_binary_hdr_t	hdr;
+		VALUE_PAIR		*vps = NULL;
+		TALLOC_CTX		*ctx;
+		int			next, rcode;
+		bool			binary;
+
+		next = getc(in);
+		if (next == EOF) break;
+		ungetc(next, in);
+
+		binary = (next == (uint8_t) FR_DETAIL_BINARY_MAGIC[0]);
+		if (out_format == DETAIL_OUT_AUTO) out_format = binary ? DETAIL_OUT_TEXT : DETAIL_OUT_BINARY;
+
+		MEM(ctx = talloc_new(autofree));
+		if (binary) {
+			rcode = detail_read_binary(ctx, in, &hdr, &vps);
+		} else {
+			rcode = detail_read_text(ctx, in, &hdr, &vps);
+		}
+		if (rcode < 0) {
+			fr_perror("raddetail: Failed reading record %" PRIu64, records + 1);
+			goto finish;
+		}
+		if (rcode == 0) {
+			talloc_free(ctx);
+			break;
+		}
+
+		if (out_format == DETAIL_OUT_BINARY) {
+			rcode = detail_write_binary(out, &hdr, vps);
+		} else {
+			rcode = detail_write_text(out, &hdr, vps);
+		}
+		talloc_free(ctx);
+
+		if (rcode < 0) {
+			fr_perror("raddetail: Failed writing record %" PRIu64, records + 1);
+			goto finish;
+		}
+
+		records++;
+	}
+
+	if (fflush(out) != 0) {
+		fr_perror("raddetail: Failed writing output: %s", fr_syserror(errno));
+		goto finish;
+	}
+
+	INFO("Converted %" PRIu64 " records", records);
+	ret = EXIT_SUCCESS;
+
+finish:
+	if (in && (in != stdin)) fclose(in);
+	if (out && (out != stdout)) fclose(out);
+
+	talloc_free(autofree);
+
+	return ret;
+}
@@ -51,8 +51,10 @@ DIAG_ON(unused-macros)
 static void usage(void)
 {
 	fprintf(stderr, "usage: radict [OPTS] <attribute> [attribute...]\n");
+	fprintf(stderr, "  -C <file>        Compile the dictionaries into a cache image.\n");
 	fprintf(stderr, "  -E               Export dictionary definitions.\n");
 	fprintf(stderr, "  -D <dictdir>     Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -I <file>        Print the contents of a cache image, and check it's up to date.\n");
 	fprintf(stderr, "  -x               Debugging mode.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Very simple interface to extract attribute definitions from FreeRADIUS dictionaries\n");
@@ -196,6 +198,8 @@ int main(int argc, char *argv[])
 	int		ret = 0;
 	bool		found = false;
 	bool		export = false;
+	char const	*cache_out = NULL;
+	char const	*cache_info = NULL;
 
 	TALLOC_CTX	*autofree;
 
@@ -217,7 +221,11 @@ int main(int argc, char *argv[])
 
 	fr_debug_lvl = 1;
 
-	while ((c = getopt(argc, argv, "ED:xh")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "C:ED:I:xh")) != -1) switch (c) {
+		case 'C':
+			cache_out = optarg;
+			break;
+
 		case 'E':
 			export = true;
 			break;
@@ -226,6 +234,10 @@ int main(int argc, char *argv[])
 			dict_dir = optarg;
 			break;
 
+		case 'I':
+			cache_info = optarg;
+			break;
+
 		case 'x':
 			fr_log_fp = stdout;
 			fr_debug_lvl++;
@@ -255,6 +267,21 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	if (cache_info) {
+		found = true;
+		if (fr_dict_cache_print(stdout, cache_info) < 0) {
+			fr_perror("radict");
+			ret = 1;
+		}
+		goto finish;
+	}
+
+	if (cache_out && (fr_dict_global_cache_record() < 0)) {
+		fr_perror("radict");
+		ret = 1;
+		goto finish;
+	}
+
 	INFO("Loading dictionary: %s/%s", dict_dir, FR_DICTIONARY_FILE);
 
 	if (fr_dict_internal_afrom_file(dict_end++, FR_DICTIONARY_INTERNAL_DIR) < 0) {
@@ -275,6 +302,16 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	if (cache_out) {
+		found = true;
+		if (fr_dict_global_cache_write(cache_out) < 0) {
+			fr_perror("radict");
+			ret = 1;
+			goto finish;
+		}
+		INFO("Wrote dictionary cache %s", cache_out);
+	}
+
 	if (export) {
 		fr_dict_t	**dict_p = dicts;
 
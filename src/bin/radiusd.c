@@ -31,11 +31,16 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/dependency.h>
+#include <freeradius-devel/server/handover.h>
 #include <freeradius-devel/server/map_proc.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/util/conf.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/log_async.h>
 #include <freeradius-devel/server/radmin.h>
+#include <freeradius-devel/server/resolver.h>
 #include <freeradius-devel/server/state.h>
+#include <freeradius-devel/server/trace.h>
 #include <freeradius-devel/server/virtual_servers.h>
 
 #include <freeradius-devel/tls/base.h>
@@ -132,6 +137,7 @@ static int talloc_config_set(main_config_t *config)
  */
 static int thread_instantiate(TALLOC_CTX *ctx, fr_event_list_t *el, UNUSED void *uctx)
 {
+	if (fr_resolver_thread_instantiate(ctx, el) < 0) return -1;
 	if (modules_thread_instantiate(ctx, el) < 0) return -1;
 	if (xlat_thread_instantiate(ctx) < 0) return -1;
 
@@ -145,6 +151,7 @@ static void thread_detach(UNUSED void *uctx)
 {
 	modules_thread_detach();
 	xlat_thread_detach();
+	fr_resolver_thread_detach();
 }
 
 #define EXIT_WITH_FAILURE \
@@ -333,7 +340,11 @@ int main(int argc, char *argv[])
 	}
 
 	/*  Process the options.  */
-	while ((c = getopt(argc, argv, "Cd:D:e:fhi:l:L:Mn:p:PrstTvxX")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "c:Cd:D:e:fhi:l:L:Mn:p:PrstTvxX")) != -1) switch (c) {
+		case 'c':
+			config->config_cache = talloc_typed_strdup(global_ctx, optarg);
+			break;
+
 		case 'C':
 			check_config = true;
 			config->spawn_workers = false;
@@ -548,6 +559,20 @@ int main(int argc, char *argv[])
 		EXIT_WITH_FAILURE;
 	}
 
+	/*
+	 *	Load the dictionaries from the image written by
+	 *	"radict -C", if there is one, and it's up to date.
+	 */
+	{
+		char *cache_file;
+
+		cache_file = talloc_asprintf(NULL, "%s/%s", config->dict_dir, FR_DICTIONARY_CACHE);
+		if ((access(cache_file, R_OK) == 0) && (fr_dict_global_cache_load(cache_file) < 0)) {
+			PWARN("Parsing dictionaries instead");
+		}
+		talloc_free(cache_file);
+	}
+
 #ifdef HAVE_OPENSSL_CRYPTO_H
 	if (fr_tls_dict_init() < 0) {
 		fr_perror("%s", program);
@@ -766,6 +791,33 @@ int main(int argc, char *argv[])
 	 */
 	if (log_global_init(&default_log, config->daemonize) < 0) EXIT_WITH_FAILURE;
 
+	/*
+	 *	Start the log thread.  This has to be done after
+	 *	we've forked, as threads don't survive fork().
+	 */
+	if (config->log_async && (fr_log_async_start(&default_log, config->log_async_buffer_size) < 0)) {
+		PERROR("Failed starting the log thread");
+		EXIT_WITH_FAILURE;
+	}
+
+	if (fr_trace_init(config->trace_sample_rate, config->trace_file) < 0) {
+		PERROR("Failed initialising request tracing");
+		EXIT_WITH_FAILURE;
+	}
+
+	if (fr_resolver_init(&config->resolver) < 0) {
+		PERROR("Failed starting the resolver");
+		EXIT_WITH_FAILURE;
+	}
+
+	/*
+	 *	Must be done before the network / worker threads
+	 *	are started.
+	 */
+	if (config->tsc_clock && (fr_time_tsc_enable() < 0)) {
+		PWARN("Failed enabling TSC clock, using the system clock");
+	}
+
 	/*
 	 *	Start the network / worker threads.
 	 */
@@ -774,9 +826,22 @@ int main(int argc, char *argv[])
 		fr_schedule_config_t *schedule;
 
 		schedule = talloc_zero(global_ctx, fr_schedule_config_t);
-		schedule->max_workers = config->max_networks;
-		schedule->max_networks = config->max_workers;
+		schedule->max_networks = config->max_networks;
+		schedule->max_workers = config->max_workers;
 		schedule->stats_interval = config->stats_interval;
+		schedule->work_stealing = config->work_stealing;
+		schedule->spin_time = config->spin_time;
+		schedule->max_queue_delay = config->max_queue_delay;
+		schedule->network_cpus = config->network_cpus;
+		schedule->worker_cpus = config->worker_cpus;
+		schedule->talloc_pool_size = config->talloc_pool_size;
+		schedule->ring_buffer_size = config->ring_buffer_size;
+		schedule->pools = config->worker_pools;
+
+		/*
+		 *	Must be set before any channels are created.
+		 */
+		fr_ring_buffer_memory_set(config->huge_pages, config->lock_memory);
 
 		/*
 		 *	Single server mode: use the global event list.
@@ -794,6 +859,15 @@ int main(int argc, char *argv[])
 			EXIT_WITH_FAILURE;
 		}
 
+		/*
+		 *	If another server is running, take over its
+		 *	sockets instead of opening new ones.
+		 */
+		if (config->handover_socket && (fr_handover_receive(config->handover_socket) < 0)) {
+			PERROR("Failed taking over listeners from the running server");
+			EXIT_WITH_FAILURE;
+		}
+
 		/*
 		 *	Tell the virtual servers to open their sockets.
 		 */
@@ -920,6 +994,18 @@ int main(int argc, char *argv[])
 #ifndef NDEBUG
 	if (exit_after > 0) fr_exit_after(main_loop_event_list(), 0, &exit_after);
 #endif
+	/*
+	 *  We're ready, so the previous server (if any) can stop.
+	 *  Then wait for the next one.
+	 */
+	if (config->handover_socket) {
+		fr_handover_complete();
+
+		if (fr_handover_listen(main_loop_event_list(), config->handover_socket) < 0) {
+			PWARN("Failed listening for a new server on %s", config->handover_socket);
+		}
+	}
+
 	/*
 	 *  Process requests until HUP or exit.
 	 */
@@ -958,6 +1044,8 @@ int main(int argc, char *argv[])
 
 	fr_radmin_stop();
 
+	fr_handover_free();
+
 	/*
 	 *   Fire signal and stop triggers after ignoring SIGTERM, so handlers are
 	 *   not killed with the rest of the process group, below.
@@ -970,13 +1058,26 @@ int main(int argc, char *argv[])
 	 *  to exit gracefully.  fr_schedule_destroy only returns once all
 	 *  threads have been joined.
 	 */
+	/*
+	 *  A new server has our listeners.  Stop reading from them,
+	 *  and finish the requests we already have.
+	 */
+	if (fr_handover_done()) {
+		INFO("Waiting for outstanding requests to finish");
+		if (fr_schedule_drain(sc, config->max_request_time) < 0) {
+			WARN("Timed out waiting for outstanding requests");
+		}
+	}
+
 	(void) fr_schedule_destroy(&sc);
 
 	/*
 	 *  We're exiting, so we can delete the PID file.
 	 *  (If it doesn't exist, we can ignore the error returned by unlink)
+	 *
+	 *  If a new server took over, the PID file is now its.
 	 */
-	if (config->daemonize) unlink(config->pid_file);
+	if (config->daemonize && !fr_handover_done()) unlink(config->pid_file);
 
 	/*
 	 *  Free memory in an explicit and consistent order
@@ -1013,6 +1114,23 @@ cleanup:
 	 */
 	(void) fr_schedule_destroy(&sc);
 
+	/*
+	 *	The workers have exited, so nothing is
+	 *	waiting for the resolver threads.
+	 */
+	fr_resolver_free();
+
+	/*
+	 *	Flush anything still queued for the log thread.
+	 */
+	fr_log_async_stop();
+
+	/*
+	 *	Traces may have been queued for the log thread,
+	 *	so only close the trace file once it's done.
+	 */
+	fr_trace_free();
+
 	/*
 	 *  Frees request specific logging resources which is OK
 	 *  because all the requests will have been stopped.
@@ -1081,6 +1199,8 @@ static void NEVER_RETURNS usage(main_config_t const *config, int status)
 
 	fprintf(output, "Usage: %s [options]\n", config->name);
 	fprintf(output, "Options:\n");
+	fprintf(output, "  -c <file>     Cache the parsed configuration in this file, and load it from there\n");
+	fprintf(output, "                when the configuration files haven't changed.\n");
 	fprintf(output, "  -C            Check configuration and exit.\n");
 	fprintf(stderr, "  -d <raddb>    Set configuration directory (defaults to " RADDBDIR ").\n");
 	fprintf(stderr, "  -D <dictdir>  Set main dictionary directory (defaults to " DICTDIR ").\n");
@@ -14,3 +14,58 @@ TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-io.a libfreeradius-util.a
 ifneq (,$(findstring darwin,$(TARGET_SYSTEM)))
 TGT_LDLIBS	+= -pagezero_size 10000 -image_base 100000000
 endif
+
+#
+#  Link modules into radiusd instead of loading them at run time, e.g.
+#
+#	make STATIC_MODULES="rlm_exec rlm_files proto_radius proto_radius_udp"
+#
+#  The listed modules are found in dl_static_modules[], and the
+#  shared objects aren't opened.  Any libraries the modules need
+#  must be added to LIBS.  Combine with -flto in CFLAGS and LDFLAGS
+#  to allow inlining across the server and the modules.
+#
+#  The table isn't regenerated when only STATIC_MODULES changes,
+#  run "make clean" first.
+#
+ifneq "$(STATIC_MODULES)" ""
+DL_STATIC_SRC	:= $(abspath $(BUILD_DIR)/make/dl_static.c)
+
+DL_STATIC_LIBS	:= $(foreach m,$(STATIC_MODULES),$(BUILD_DIR)/lib/.libs/$(m).a)
+
+SOURCES		+= $(DL_STATIC_SRC)
+TGT_LDFLAGS	+= -export-dynamic
+
+#
+#  Nothing in the server references the modules' symbols directly,
+#  so every object in their archives has to be pulled in.
+#
+ifneq (,$(findstring darwin,$(TARGET_SYSTEM)))
+TGT_LDLIBS	+= $(foreach l,$(DL_STATIC_LIBS),-Wl,-force_load,$(l))
+else
+TGT_LDLIBS	+= -Wl,--whole-archive $(DL_STATIC_LIBS) -Wl,--no-whole-archive
+endif
+
+$(DL_STATIC_SRC): $(MAKEFILE_LIST)
+	@mkdir -p $(dir $@)
+	@echo GEN $(notdir $@)
+	@( echo '#include <freeradius-devel/server/module.h>'; \
+	  echo '#include <freeradius-devel/server/protocol.h>'; \
+	  echo '#include <freeradius-devel/io/application.h>'; \
+	  echo '#include <freeradius-devel/io/app_io.h>'; \
+	  echo '#include <freeradius-devel/util/dl.h>'; \
+	  for m in $(STATIC_MODULES); do \
+	    case $$m in \
+	    rlm_*) type=module_t ;; \
+	    *) type=`sed -n "s/^\([a-z_]*_t\) $$m = {.*/\1/p" $(top_srcdir)/src/modules/*/$$m.c 2>/dev/null` ;; \
+	    esac; \
+	    if [ -z "$$type" ]; then echo "Can't find the definition of $$m" >&2; exit 1; fi; \
+	    echo "extern $$type $$m;"; \
+	  done; \
+	  echo 'dl_static_t const dl_static_modules[] = {'; \
+	  for m in $(STATIC_MODULES); do echo "	{ .name = \"$$m\", .sym = &$$m },"; done; \
+	  echo '	{ NULL }'; \
+	  echo '};' ) > $@ || { rm -f $@; exit 1; }
+
+$(BUILD_DIR)/bin/radiusd: $(foreach m,$(STATIC_MODULES),$(BUILD_DIR)/lib/$(m).la)
+endif
@@ -51,6 +51,7 @@ static char timestr[50];
 
 static rbtree_t *request_tree = NULL;
 static rbtree_t *link_tree = NULL;
+static rbtree_t *peer_tree = NULL;
 static fr_event_list_t *events;
 static bool cleanup;
 
@@ -641,6 +642,122 @@ static void rs_stats_print_code_fancy(rs_latency_t *stats, FR_CODE code)
 	}
 }
 
+static int rs_peer_cmp(void const *one, void const *two)
+{
+	rs_peer_t const *a = one, *b = two;
+
+	if (a->server != b->server) return a->server - b->server;
+
+	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+}
+
+/** Find or create the stats for a client or server
+ *
+ */
+static rs_peer_t *rs_peer_find(fr_ipaddr_t const *ipaddr, bool server)
+{
+	rs_peer_t	find, *peer;
+
+	find.ipaddr = *ipaddr;
+	find.server = server;
+
+	peer = rbtree_finddata(peer_tree, &find);
+	if (peer) return peer;
+
+	MEM(peer = talloc_zero(peer_tree, rs_peer_t));
+	peer->ipaddr = *ipaddr;
+	peer->server = server;
+
+	if (!rbtree_insert(peer_tree, peer)) {
+		talloc_free(peer);
+		return NULL;
+	}
+
+	return peer;
+}
+
+/** Record the latency of a linked request and response against the client and server
+ *
+ */
+static void rs_peer_update_latency(RADIUS_PACKET const *request, fr_time_delta_t latency)
+{
+	rs_peer_t	*peer[2];
+	uint64_t	usec;
+	unsigned int	idx, i;
+
+	usec = (latency > 0) ? fr_time_delta_to_usec(latency) : 0;
+
+	if (usec < (1 << RS_PEER_SUB_BITS)) {
+		idx = usec;
+	} else {
+		int shift = (63 - __builtin_clzll(usec)) - RS_PEER_SUB_BITS;
+
+		idx = ((shift + 1) << RS_PEER_SUB_BITS) + ((usec >> shift) & ((1 << RS_PEER_SUB_BITS) - 1));
+		if (idx >= RS_PEER_BUCKETS) idx = RS_PEER_BUCKETS - 1;
+	}
+
+	peer[0] = rs_peer_find(&request->src_ipaddr, false);
+	peer[1] = rs_peer_find(&request->dst_ipaddr, true);
+
+	for (i = 0; i < NUM_ELEMENTS(peer); i++) {
+		if (!peer[i]) continue;
+
+		peer[i]->interval.linked_total++;
+		peer[i]->interval.bucket[idx]++;
+		if (usec > peer[i]->interval.latency_high) peer[i]->interval.latency_high = usec;
+	}
+}
+
+/** Return the latency in milliseconds which a percentage of requests were faster than
+ *
+ */
+static double rs_peer_percentile(rs_peer_t const *peer, double percent)
+{
+	uint64_t	target, seen = 0;
+	unsigned int	i;
+
+	target = (peer->interval.linked_total * percent) / 100;
+	if (target >= peer->interval.linked_total) return peer->interval.latency_high / 1000.0;
+
+	for (i = 0; i < RS_PEER_BUCKETS; i++) {
+		seen += peer->interval.bucket[i];
+		if (seen > target) break;
+	}
+
+	if (i < (1 << RS_PEER_SUB_BITS)) return i / 1000.0;
+
+	return (((uint64_t)((1 << RS_PEER_SUB_BITS) + (i & ((1 << RS_PEER_SUB_BITS) - 1)))) <<
+		((i >> RS_PEER_SUB_BITS) - 1)) / 1000.0;
+}
+
+static int _rs_peer_print_fancy(void *data, UNUSED void *uctx)
+{
+	rs_peer_t	*peer = talloc_get_type_abort(data, rs_peer_t);
+	char		buffer[INET6_ADDRSTRLEN];
+
+	if (!peer->interval.linked_total && !peer->interval.lost_total) return 0;
+
+	inet_ntop(peer->ipaddr.af, &peer->ipaddr.addr, buffer, sizeof(buffer));
+
+	INFO("\t%-6s %-15s: linked %.3lf/s, lost %.3lf/s, p50 %.3lfms, p90 %.3lfms, p99 %.3lfms, high %.3lfms",
+	     peer->server ? "server" : "client", buffer,
+	     ((double) peer->interval.linked_total) / conf->stats.interval,
+	     ((double) peer->interval.lost_total) / conf->stats.interval,
+	     rs_peer_percentile(peer, 50), rs_peer_percentile(peer, 90), rs_peer_percentile(peer, 99),
+	     peer->interval.latency_high / 1000.0);
+
+	return 0;
+}
+
+static int _rs_peer_clear(void *data, UNUSED void *uctx)
+{
+	rs_peer_t	*peer = talloc_get_type_abort(data, rs_peer_t);
+
+	memset(&peer->interval, 0, sizeof(peer->interval));
+
+	return 0;
+}
+
 static void rs_stats_print_fancy(rs_update_t *this, rs_stats_t *stats, struct timeval *now)
 {
 	fr_pcap_t		*in_p;
@@ -686,6 +803,11 @@ static void rs_stats_print_fancy(rs_update_t *this, rs_stats_t *stats, struct ti
 			rs_stats_print_code_fancy(&stats->exchange[rs_useful_codes[i]], rs_useful_codes[i]);
 		}
 	}
+
+	if (peer_tree && (fr_debug_lvl > 0)) {
+		INFO("Client and server latency:");
+		rbtree_walk(peer_tree, RBTREE_IN_ORDER, _rs_peer_print_fancy, NULL);
+	}
 }
 
 static void rs_stats_print_csv_header(rs_update_t *this)
@@ -866,6 +988,7 @@ clear:
 		memset(&stats->exchange[rs_useful_codes[i]].interval, 0,
 		       sizeof(stats->exchange[rs_useful_codes[i]].interval));
 	}
+	if (peer_tree) rbtree_walk(peer_tree, RBTREE_IN_ORDER, _rs_peer_clear, NULL);
 
 	{
 		static fr_event_timer_t const *event;
@@ -1059,6 +1182,15 @@ static void rs_packet_cleanup(rs_request_t *request)
 
 			request->stats_req->interval.lost_total++;
 
+			if (peer_tree) {
+				rs_peer_t *peer;
+
+				peer = rs_peer_find(&packet->src_ipaddr, false);
+				if (peer) peer->interval.lost_total++;
+				peer = rs_peer_find(&packet->dst_ipaddr, true);
+				if (peer) peer->interval.lost_total++;
+			}
+
 			if (conf->event_flags & RS_LOST) {
 				/* @fixme We should use flags in the request to indicate whether it's been dumped
 				 * to a PCAP file or logged yet, this simplifies the body logging logic */
@@ -1770,6 +1902,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 */
 		rs_stats_update_latency(&stats->exchange[packet->code], &latency);
 		rs_stats_update_latency(&stats->exchange[original->expect->code], &latency);
+		if (peer_tree) rs_peer_update_latency(original->packet, packet->timestamp - original->packet->timestamp);
 
 		/*
 		 *	We're filtering on response, now print out the full data from the request
@@ -2187,6 +2320,7 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "stats options:\n");
 	fprintf(output, "  -W <interval>         Periodically write out statistics every <interval> seconds.\n");
 	fprintf(output, "  -E                    Print stats in CSV format.\n");
+	fprintf(output, "  -H                    Print latency percentiles for each client and server.\n");
 	fprintf(output, "  -T <timeout>          How many milliseconds before the request is counted as lost "
 		"(defaults to %i).\n", RS_DEFAULT_TIMEOUT);
 #ifdef HAVE_COLLECTDC_H
@@ -2270,7 +2404,7 @@ int main(int argc, char *argv[])
 	/*
 	 *  Get options
 	 */
-	while ((c = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != -1) {
+	while ((c = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hHi:I:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != -1) {
 		switch (c) {
 		case 'a':
 		{
@@ -2341,6 +2475,10 @@ int main(int argc, char *argv[])
 			conf->stats.out = RS_STATS_OUT_STDIO_CSV;
 			break;
 
+		case 'H':
+			conf->stats.peers = true;
+			break;
+
 		case 'f':
 			conf->pcap_filter = optarg;
 			break;
@@ -2680,6 +2818,18 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	/*
+	 *	Per client and server stats are only printed
+	 *	in the fancy output format.
+	 */
+	if (conf->stats.peers && conf->stats.interval && (conf->stats.out == RS_STATS_OUT_STDIO_FANCY)) {
+		peer_tree = rbtree_talloc_create(conf, rs_peer_cmp, rs_peer_t, NULL, 0);
+		if (!peer_tree) {
+			ERROR("Failed creating peer tree");
+			goto finish;
+		}
+	}
+
 	/*
 	 *	Get the default capture device
 	 */
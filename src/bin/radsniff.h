@@ -141,6 +141,26 @@ typedef struct {
 	} interval;
 } rs_latency_t;
 
+#define RS_PEER_SUB_BITS	4			//!< Each power of two is split into 2^RS_PEER_SUB_BITS buckets.
+#define RS_PEER_BUCKETS		((32 - RS_PEER_SUB_BITS + 1) << RS_PEER_SUB_BITS)	//!< Latencies up to 2^32us.
+
+/** Latency stats for a single client or server
+ *
+ * Latencies are in microseconds, and are recorded in a log-linear histogram
+ * which is reset at the end of each interval.
+ */
+typedef struct {
+	fr_ipaddr_t		ipaddr;			//!< Of the client or server.
+	bool			server;			//!< Whether this peer sent the responses.
+
+	struct {
+		uint64_t		linked_total;		//!< Request/response pairs over interval.
+		uint64_t		lost_total;		//!< Requests which got no response over interval.
+		uint64_t		latency_high;		//!< Latency high water mark.
+		uint32_t		bucket[RS_PEER_BUCKETS];	//!< Latency histogram.
+	} interval;
+} rs_peer_t;
+
 typedef struct {
 	uint64_t		min_length_packet;
 	uint64_t		min_length_field;
@@ -301,6 +321,7 @@ struct rs {
 	struct {
 		int			interval;		//!< Time between stats updates in seconds.
 		stats_out_t		out;			//!< Where to write stats.
+		bool			peers;			//!< Print latency stats for each client and server.
 		int			timeout;		//!< Maximum length of time we wait for a response.
 
 #ifdef HAVE_COLLECTDC_H
@@ -0,0 +1,163 @@
+/*
+ * radutmp2db.c	Convert a radutmp file to an indexed session database.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/radutmp.h>
+#include <freeradius-devel/server/radutmp_db.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+static char const *progname = "radutmp2db";
+
+/*
+ *	Print usage message and exit.
+ */
+static void NEVER_RETURNS usage(int status)
+{
+	FILE *output = status ? stderr : stdout;
+
+	fprintf(output, "Usage: %s [-h] [-m max_sessions] [-p permissions] <radutmp file> <database>\n", progname);
+	fprintf(output, "  -h                   Print this help message.\n");
+	fprintf(output, "  -m <max_sessions>    How many sessions the new database can hold (default 65536).\n");
+	fprintf(output, "  -p <permissions>     Permissions of the new database, in octal (default 0600).\n");
+	fprintf(output, "\n");
+	fprintf(output, "Copies the logged in sessions from a radutmp file into a new indexed\n");
+	fprintf(output, "session database.  The database must not already exist.  Stop the server\n");
+	fprintf(output, "before converting, and set 'indexed = yes' in the radutmp module after.\n");
+	fr_exit_now(status);
+}
+
+int main(int argc, char **argv)
+{
+	TALLOC_CTX	*autofree;
+	radutmp_db_t	*db;
+	struct radutmp	rt;
+	struct stat	st;
+	char const	*radutmp_file, *db_file;
+	unsigned long	max_sessions = 65536;
+	unsigned long	permissions = 0600;
+	char		*end;
+	int		c, fd;
+	unsigned int	count = 0;
+
+	autofree = talloc_autofree_context();
+
+	while ((c = getopt(argc, argv, "hm:p:")) != -1) switch (c) {
+		case 'h':
+			usage(EXIT_SUCCESS);	/* never returns */
+
+		case 'm':
+			max_sessions = strtoul(optarg, &end, 10);
+			if (*end || !max_sessions || (max_sessions > UINT32_MAX)) usage(EXIT_FAILURE);
+			break;
+
+		case 'p':
+			permissions = strtoul(optarg, &end, 8);
+			if (*end || (permissions > 07777)) usage(EXIT_FAILURE);
+			break;
+
+		default:
+			usage(EXIT_FAILURE);	/* never returns */
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2) usage(EXIT_FAILURE);
+
+	radutmp_file = argv[0];
+	db_file = argv[1];
+
+	switch (radutmp_db_check(radutmp_file)) {
+	case 0:
+		break;
+
+	case 1:
+		fprintf(stderr, "%s: %s is already an indexed session database\n", progname, radutmp_file);
+		fr_exit_now(EXIT_FAILURE);
+
+	default:
+		fr_perror("%s", progname);
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (stat(db_file, &st) == 0) {
+		fprintf(stderr, "%s: %s already exists\n", progname, db_file);
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Lock the radutmp file the same way the module does,
+	 *	in case the server is still writing to it.
+	 */
+	fd = open(radutmp_file, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "%s: Error opening %s: %s\n", progname, radutmp_file, fr_syserror(errno));
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (rad_lockfd(fd, sizeof(struct radutmp)) < 0) {
+		fprintf(stderr, "%s: Error locking %s: %s\n", progname, radutmp_file, fr_syserror(errno));
+		close(fd);
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	db = radutmp_db_open(autofree, db_file, true, (uint32_t)max_sessions, (mode_t)permissions);
+	if (!db) {
+		fr_perror("%s", progname);
+		close(fd);
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (radutmp_db_lock(db) < 0) goto error;
+
+	/*
+	 *	Logged out records only exist because the
+	 *	radutmp file never shrinks, so leave them
+	 *	behind.
+	 */
+	while (read(fd, &rt, sizeof(rt)) == sizeof(rt)) {
+		if (rt.type != P_LOGIN) continue;
+
+		if (radutmp_db_port_update(db, &rt) < 0) goto error;
+		count++;
+	}
+
+	radutmp_db_unlock(db);
+	talloc_free(db);
+	close(fd);		/* and implicitly release the lock */
+
+	printf("Converted %u session(s) from %s to %s\n", count, radutmp_file, db_file);
+
+	return EXIT_SUCCESS;
+
+error:
+	fr_perror("%s", progname);
+	talloc_free(db);
+	unlink(db_file);
+	close(fd);
+
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,5 @@
+TARGET		:= radutmp2db
+SOURCES		:= radutmp2db.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
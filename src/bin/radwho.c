@@ -27,6 +27,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/cf_parse.h>
 #include <freeradius-devel/server/radutmp.h>
+#include <freeradius-devel/server/radutmp_db.h>
 #include <freeradius-devel/server/sysutmp.h>
 
 #include <freeradius-devel/util/conf.h>
@@ -143,6 +144,44 @@ static char const *hostname(char *buf, size_t buflen, uint32_t ipaddr)
 }
 
 
+/*
+ *	Logged in sessions copied out of an indexed session database.
+ */
+typedef struct {
+	struct radutmp	*sessions;
+	size_t		num;
+	size_t		next;
+} radutmp_snapshot_t;
+
+static int radutmp_snapshot_add(struct radutmp const *ut, void *uctx)
+{
+	radutmp_snapshot_t *snap = uctx;
+
+	if (ut->type != P_LOGIN) return 0;
+
+	if (snap->num >= talloc_array_length(snap->sessions)) {
+		MEM(snap->sessions = talloc_realloc(NULL, snap->sessions, struct radutmp,
+						    snap->num ? snap->num * 2 : 64));
+	}
+	snap->sessions[snap->num++] = *ut;
+
+	return 0;
+}
+
+/*
+ *	Get the next record, from either a radutmp file, or a snapshot
+ *	of an indexed session database.
+ */
+static bool radutmp_next(struct radutmp *rt, FILE *fp, radutmp_snapshot_t *snap)
+{
+	if (fp) return (fread(rt, sizeof(*rt), 1, fp) == 1);
+
+	if (snap->next >= snap->num) return false;
+	*rt = snap->sessions[snap->next++];
+
+	return true;
+}
+
 /*
  *	Print usage message and exit.
  */
@@ -165,7 +204,8 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "  -s                   Show full name.\n");
 	fprintf(output, "  -S                   Hide shell users from radius.\n");
 	fprintf(output, "  -u <user>            Show entries matching the given user.\n");
-	fprintf(output, "  -U <user>            Like -u, but case-sensitive.\n");
+	fprintf(output, "  -U <user>            Like -u, but case-sensitive.  Matches the whole name\n");
+	fprintf(output, "                       with indexed session databases.\n");
 	fprintf(output, "  -Z                   Include accounting stop information in radius output.  Requires -R.\n");
 	fr_exit_now(status);
 }
@@ -177,7 +217,9 @@ static void NEVER_RETURNS usage(int status)
 int main(int argc, char **argv)
 {
 	CONF_SECTION		*maincs, *cs;
-	FILE			*fp;
+	FILE			*fp = NULL;
+	radutmp_snapshot_t	snap = { .sessions = NULL };
+	int			indexed;
 	struct			radutmp rt;
 	char			othername[256];
 	char			nasname[1024];
@@ -380,7 +422,40 @@ int main(int argc, char **argv)
 	/*
 	 *	Show the users logged in on the terminal server(s).
 	 */
-	if ((fp = fopen(radutmp_file, "r")) == NULL) {
+	indexed = radutmp_db_check(radutmp_file);
+	if (indexed < 0) {
+		fr_perror("%s", progname);
+		return 0;
+	}
+
+	/*
+	 *	Take a snapshot of the indexed session database.
+	 *	This doesn't lock the database, so the server can
+	 *	keep writing to it.
+	 */
+	if (indexed) {
+		radutmp_db_t	*db;
+		int		ret;
+
+		db = radutmp_db_open(autofree, radutmp_file, false, 0, 0);
+		if (!db) {
+			fr_perror("%s", progname);
+			return 0;
+		}
+
+		if (user && (user_cmp == 1)) {
+			ret = radutmp_db_user_walk(db, user, radutmp_snapshot_add, &snap);
+		} else {
+			ret = radutmp_db_walk(db, radutmp_snapshot_add, &snap);
+		}
+		talloc_free(db);
+
+		if (ret < 0) {
+			fr_perror("%s", progname);
+			return 0;
+		}
+
+	} else if ((fp = fopen(radutmp_file, "r")) == NULL) {
 		fr_perror("%s: Error reading %s: %s\n",
 			progname, radutmp_file, fr_syserror(errno));
 		return 0;
@@ -397,7 +472,7 @@ int main(int argc, char **argv)
 	/*
 	 *	Read the file, printing out active entries.
 	 */
-	while (fread(&rt, sizeof(rt), 1, fp) == 1) {
+	while (radutmp_next(&rt, fp, &snap)) {
 		char name[sizeof(rt.login) + 1];
 
 		if (rt.type != P_LOGIN) continue; /* hide logout sessions */
@@ -558,7 +633,8 @@ int main(int argc, char **argv)
 			}
 		}
 	}
-	fclose(fp);
+	if (fp) fclose(fp);
+	talloc_free(snap.sessions);
 
 	main_config_free(&config);
 
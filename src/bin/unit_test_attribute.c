@@ -182,6 +182,8 @@ typedef struct {
 	char const		*raddb_dir;
 	char const		*dict_dir;
 	CONF_SECTION		*features;		//!< Enabled features.
+	uint32_t		bench_iterations;	//!< How many times to repeat each encode-proto
+							///< and decode-proto test.  0 disables benchmarking.
 } command_config_t;
 
 typedef struct {
@@ -192,6 +194,10 @@ typedef struct {
 	int			lineno;			//!< Current line number.
 
 	uint32_t		test_count;		//!< How many tests we've executed in this file.
+
+	uint64_t		bench_ops;		//!< Encode/decode operations benchmarked in this file.
+	fr_time_delta_t		bench_time;		//!< Time spent in those operations.
+	uint64_t		bench_allocs;		//!< Talloc blocks allocated by those operations.
 	ssize_t			last_ret;		//!< Last return value.
 
 	uint8_t			*buffer;		//!< Temporary resizable buffer we use for
@@ -1324,6 +1330,75 @@ static size_t command_decode_pair(command_result_t *result, command_file_ctx_t *
 	RETURN_OK(p - data);
 }
 
+/** Repeatedly decode the same data, recording time taken and memory allocated
+ *
+ * Everything the decoder allocates is parented by a context which is freed
+ * after each iteration, so the number of blocks in that context is the
+ * number of allocations the decoder made.
+ */
+static void bench_decode_proto(command_file_ctx_t *cc, fr_test_point_proto_decode_t *tp,
+			       uint8_t const *data, size_t data_len, void *decoder_ctx)
+{
+	uint32_t	i;
+	fr_time_t	start;
+
+	for (i = 0; i < cc->config->bench_iterations; i++) {
+		TALLOC_CTX	*bench_ctx;
+		VALUE_PAIR	*head = NULL;
+
+		bench_ctx = talloc_named_const(cc->tmp_ctx, 0, "bench_ctx");
+
+		start = fr_time();
+		(void) tp->func(bench_ctx, &head, data, data_len, decoder_ctx);
+		cc->bench_time += fr_time() - start;
+
+		cc->bench_allocs += talloc_total_blocks(bench_ctx) - 1;
+		talloc_free(bench_ctx);
+	}
+	cc->bench_ops += cc->config->bench_iterations;
+}
+
+/** Repeatedly encode the same list of pairs, recording time taken and memory allocated
+ *
+ */
+static void bench_encode_proto(command_file_ctx_t *cc, fr_test_point_proto_encode_t *tp,
+			       VALUE_PAIR *head, void *encoder_ctx)
+{
+	uint32_t	i;
+	fr_time_t	start;
+
+	for (i = 0; i < cc->config->bench_iterations; i++) {
+		TALLOC_CTX	*bench_ctx;
+
+		bench_ctx = talloc_named_const(cc->tmp_ctx, 0, "bench_ctx");
+
+		start = fr_time();
+		(void) tp->func(bench_ctx, head, cc->buffer_start, cc->buffer_end - cc->buffer_start, encoder_ctx);
+		cc->bench_time += fr_time() - start;
+
+		cc->bench_allocs += talloc_total_blocks(bench_ctx) - 1;
+		talloc_free(bench_ctx);
+	}
+	cc->bench_ops += cc->config->bench_iterations;
+}
+
+/** Print the benchmark results for the file we just finished, and reset the counters
+ *
+ */
+static void bench_report(command_file_ctx_t *cc)
+{
+	if (!cc->bench_ops) return;
+
+	INFO("%s: %" PRIu64 " ops, %.1f ns/op, %.2f allocs/op",
+	     cc->filename, cc->bench_ops,
+	     (double)cc->bench_time / cc->bench_ops,
+	     (double)cc->bench_allocs / cc->bench_ops);
+
+	cc->bench_ops = 0;
+	cc->bench_time = 0;
+	cc->bench_allocs = 0;
+}
+
 static size_t command_decode_proto(command_result_t *result, command_file_ctx_t *cc,
 				  char *data, size_t data_used, char *in, size_t inlen)
 {
@@ -1381,6 +1456,12 @@ static size_t command_decode_proto(command_result_t *result, command_file_ctx_t
 		CLEAR_TEST_POINT(cc);
 		RETURN_OK_WITH_ERROR();
 	}
+
+	/*
+	 *	Only benchmark vectors which decode successfully,
+	 *	error paths aren't interesting.
+	 */
+	if (cc->config->bench_iterations) bench_decode_proto(cc, tp, to_dec, to_dec_end - to_dec, decoder_ctx);
 	/*
 	 *	Clear any spurious errors
 	 */
@@ -1750,12 +1831,19 @@ static size_t command_encode_proto(command_result_t *result, command_file_ctx_t
 	}
 
 	slen = tp->func(cc->tmp_ctx, head, cc->buffer_start, cc->buffer_end - cc->buffer_start, encoder_ctx);
-	fr_pair_list_free(&head);
 	cc->last_ret = slen;
 	if (slen < 0) {
+		fr_pair_list_free(&head);
 		CLEAR_TEST_POINT(cc);
 		RETURN_OK_WITH_ERROR();
 	}
+
+	/*
+	 *	Re-encoding overwrites the output buffer with
+	 *	identical data, so the result is unaffected.
+	 */
+	if (cc->config->bench_iterations) bench_encode_proto(cc, tp, head, encoder_ctx);
+	fr_pair_list_free(&head);
 	/*
 	 *	Clear any spurious errors
 	 */
@@ -2506,6 +2594,8 @@ static command_file_ctx_t *command_ctx_alloc(TALLOC_CTX *ctx,
 
 static void command_ctx_reset(command_file_ctx_t *cc, TALLOC_CTX *ctx)
 {
+	bench_report(cc);
+
 	talloc_free(cc->tmp_ctx);
 	cc->tmp_ctx = talloc_named_const(ctx, 0, "tmp_ctx");
 	cc->test_count = 0;
@@ -2648,7 +2738,10 @@ finish:
 	/*
 	 *	Free any residual resources we loaded.
 	 */
-	if (cc) fr_dict_free(&cc->active_dict);
+	if (cc) {
+		if (ret == 0) bench_report(cc);
+		fr_dict_free(&cc->active_dict);
+	}
 	fr_dict_global_ctx_set(config->dict_gctx);	/* Switch back to the main dict ctx */
 	unload_proto_library();
 	talloc_free(cc);
@@ -2660,6 +2753,7 @@ static void usage(char const *name)
 {
 	INFO("usage: %s [options] (-|<filename>[ <filename>])", name);
 	INFO("options:");
+	INFO("  -B <iterations>    Benchmark encode-proto and decode-proto, repeating each test <iterations> times.");
 	INFO("  -d <raddb>         Set user dictionary path (defaults to " RADDBDIR ").");
 	INFO("  -D <dictdir>       Set main dictionary path (defaults to " DICTDIR ").");
 	INFO("  -x                 Debugging mode.");
@@ -2745,7 +2839,11 @@ int main(int argc, char *argv[])
 	default_log.fd = STDOUT_FILENO;
 	default_log.print_level = false;
 
-	while ((c = getopt(argc, argv, "cd:D:fxMhr:")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "B:cd:D:fxMhr:")) != -1) switch (c) {
+		case 'B':
+			config.bench_iterations = strtoul(optarg, NULL, 10);
+			break;
+
 		case 'c':
 			do_commands = true;
 			break;
@@ -653,7 +653,7 @@ send_reply:
 	}
 }
 
-static REQUEST *request_clone(REQUEST *old)
+static REQUEST *request_clone(REQUEST *old, fr_event_list_t *el)
 {
 	REQUEST *request;
 
@@ -664,13 +664,245 @@ static REQUEST *request_clone(REQUEST *old)
 	if (!request->reply) request->reply = fr_radius_alloc(request, false);
 
 	memcpy(request->packet, old->packet, sizeof(*request->packet));
+	request->packet->vps = NULL;
 	(void) fr_pair_list_copy(request->packet, &request->packet->vps, old->packet->vps);
 	request->packet->timestamp = fr_time();
 	request->number = old->number++;
 
+	request->dict = old->dict;
+	request->client = old->client;
+	request->master_state = REQUEST_ACTIVE;
+	request->server_cs = old->server_cs;
+	request->config = old->config;
+	request->el = el;
+
 	return request;
 }
 
+/** State shared between the benchmark threads
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	int			done;			//!< Number of threads which have finished processing.
+	bool			release;		//!< Threads may now free their thread specific data.
+} bench_sync_t;
+
+/** A single benchmark thread
+ *
+ */
+typedef struct {
+	pthread_t		pthread_id;
+	bench_sync_t		*sync;
+	REQUEST			*template;		//!< Request to clone for each iteration.
+	int			count;			//!< Number of requests to process.
+	fr_time_delta_t		*latency;		//!< Time taken to process each request.
+	fr_time_t		start;			//!< When the thread started processing requests.
+	fr_time_t		stop;			//!< When the thread finished processing requests.
+	int			ret;
+} bench_thread_t;
+
+/** Process the same request repeatedly, recording how long each one took
+ *
+ */
+static int bench_loop(REQUEST *template, fr_event_list_t *el, fr_time_delta_t *latency, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		REQUEST		*request;
+		fr_time_t	start;
+
+		start = fr_time();
+		request = request_clone(template, el);
+		if (!request) return -1;
+
+		process(request);
+		talloc_free(request);
+		latency[i] = fr_time() - start;
+	}
+
+	return 0;
+}
+
+static void *bench_thread(void *arg)
+{
+	bench_thread_t		*bt = arg;
+	TALLOC_CTX		*thread_ctx;
+	fr_event_list_t		*el;
+
+	thread_ctx = talloc_new(NULL);
+	el = fr_event_list_alloc(thread_ctx, NULL, NULL);
+	if (!el ||
+	    (modules_thread_instantiate(thread_ctx, el) < 0) ||
+	    (xlat_thread_instantiate(thread_ctx) < 0)) {
+		bt->ret = -1;
+	} else {
+		bt->start = fr_time();
+		bt->ret = bench_loop(bt->template, el, bt->latency, bt->count);
+		bt->stop = fr_time();
+	}
+
+	/*
+	 *	Wait until the main thread has printed the
+	 *	profile, as it's discarded when the thread exits.
+	 */
+	pthread_mutex_lock(&bt->sync->mutex);
+	bt->sync->done++;
+	pthread_cond_broadcast(&bt->sync->cond);
+	while (!bt->sync->release) pthread_cond_wait(&bt->sync->cond, &bt->sync->mutex);
+	pthread_mutex_unlock(&bt->sync->mutex);
+
+	xlat_thread_detach();
+	modules_thread_detach();
+	talloc_free(thread_ctx);
+
+	return NULL;
+}
+
+static int latency_cmp(void const *one, void const *two)
+{
+	fr_time_delta_t const *a = one, *b = two;
+
+	return (*a > *b) - (*a < *b);
+}
+
+/** Print throughput and latency percentiles
+ *
+ */
+static void bench_report(fr_time_delta_t *latency, int count, int threads, fr_time_delta_t elapsed)
+{
+	qsort(latency, count, sizeof(latency[0]), latency_cmp);
+
+	INFO("Processed %i requests with %i thread(s) in %pV (%.1f requests/s)",
+	     count, threads, fr_box_time_delta(elapsed), elapsed ? ((double)count * NSEC) / elapsed : 0);
+	INFO("Latency p50 %pV, p90 %pV, p99 %pV, max %pV",
+	     fr_box_time_delta(latency[(count * 50) / 100]),
+	     fr_box_time_delta(latency[(count * 90) / 100]),
+	     fr_box_time_delta(latency[(count * 99) / 100]),
+	     fr_box_time_delta(latency[count - 1]));
+}
+
+/** Write the unlang profile to a file, or stdout
+ *
+ */
+static int bench_profile_write(char const *profile_file)
+{
+	FILE *fp;
+
+	if (strcmp(profile_file, "-") == 0) return unlang_profile_print(stdout);
+
+	fp = fopen(profile_file, "w");
+	if (!fp) {
+		ERROR("Failed writing %s: %s", profile_file, fr_syserror(errno));
+		return -1;
+	}
+	unlang_profile_print(fp);
+	fclose(fp);
+
+	return 0;
+}
+
+/** Run count copies of a request through the server, split across a number of threads
+ *
+ * With one thread, requests are processed by the main thread, using its event
+ * list and thread specific module instances.
+ *
+ * @param[in] template		to clone for each request.
+ * @param[in] el		of the main thread.
+ * @param[in] count		total number of requests to process.
+ * @param[in] threads		to process requests in.
+ * @param[in] profile_file	to write the unlang profile to, or NULL.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int bench_run(REQUEST *template, fr_event_list_t *el, int count, int threads, char const *profile_file)
+{
+	fr_time_delta_t		*latency;
+	bench_thread_t		*bt;
+	bench_sync_t		sync = { .done = 0 };
+	fr_time_t		start, stop;
+	int			i, offset, ret = 0;
+
+	MEM(latency = talloc_array(NULL, fr_time_delta_t, count));
+	if (profile_file) unlang_profile_rate_set(1);
+
+	if (threads <= 1) {
+		start = fr_time();
+		ret = bench_loop(template, el, latency, count);
+		stop = fr_time();
+
+		if (ret == 0) {
+			bench_report(latency, count, 1, stop - start);
+			if (profile_file) ret = bench_profile_write(profile_file);
+		}
+		goto finish;
+	}
+
+	pthread_mutex_init(&sync.mutex, NULL);
+	pthread_cond_init(&sync.cond, NULL);
+
+	MEM(bt = talloc_zero_array(latency, bench_thread_t, threads));
+	for (i = 0, offset = 0; i < threads; i++) {
+		bt[i].sync = &sync;
+		bt[i].count = (count / threads) + (i < (count % threads));
+		bt[i].latency = latency + offset;
+		offset += bt[i].count;
+
+		/*
+		 *	request_clone() updates the template, so
+		 *	each thread needs its own.
+		 */
+		MEM(bt[i].template = request_clone(template, NULL));
+		talloc_steal(bt, bt[i].template);
+
+		if (pthread_create(&bt[i].pthread_id, NULL, bench_thread, &bt[i]) != 0) {
+			ERROR("Failed creating thread: %s", fr_syserror(errno));
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	pthread_mutex_lock(&sync.mutex);
+	while (sync.done < threads) pthread_cond_wait(&sync.cond, &sync.mutex);
+	pthread_mutex_unlock(&sync.mutex);
+
+	/*
+	 *	Throughput is measured from when the first thread
+	 *	started processing requests, to when the last one
+	 *	finished, so thread instantiation isn't counted.
+	 */
+	start = bt[0].start;
+	stop = bt[0].stop;
+	for (i = 0; i < threads; i++) {
+		if (bt[i].ret < 0) ret = -1;
+		if (bt[i].start < start) start = bt[i].start;
+		if (bt[i].stop > stop) stop = bt[i].stop;
+	}
+
+	if (ret == 0) {
+		bench_report(latency, count, threads, stop - start);
+		if (profile_file) ret = bench_profile_write(profile_file);
+	}
+
+	pthread_mutex_lock(&sync.mutex);
+	sync.release = true;
+	pthread_cond_broadcast(&sync.cond);
+	pthread_mutex_unlock(&sync.mutex);
+
+	for (i = 0; i < threads; i++) pthread_join(bt[i].pthread_id, NULL);
+
+	pthread_cond_destroy(&sync.cond);
+	pthread_mutex_destroy(&sync.mutex);
+
+finish:
+	if (profile_file) unlang_profile_rate_set(0);
+	talloc_free(latency);
+
+	return ret;
+}
+
 /*
  *	The main guy.
  */
@@ -679,6 +911,8 @@ int main(int argc, char *argv[])
 	int			ret = EXIT_SUCCESS;
 	int			c;
 	int			count = 1;
+	int			threads = 1;
+	char const		*profile_file = NULL;
 	const char 		*input_file = NULL;
 	const char		*output_file = NULL;
 	const char		*filter_file = NULL;
@@ -752,7 +986,7 @@ int main(int argc, char *argv[])
 	default_log.print_level = true;
 
 	/*  Process the options.  */
-	while ((c = getopt(argc, argv, "c:d:D:f:hi:mMn:o:O:r:xX")) != -1) {
+	while ((c = getopt(argc, argv, "c:d:D:f:hi:mMn:o:O:p:r:t:xX")) != -1) {
 		switch (c) {
 			case 'c':
 				count = atoi(optarg);
@@ -799,10 +1033,18 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "Unknown option '%s'\n", optarg);
 				fr_exit_now(EXIT_FAILURE);
 
+			case 'p':
+				profile_file = optarg;
+				break;
+
 			case 'r':
 				receipt_file = optarg;
 				break;
 
+			case 't':
+				threads = atoi(optarg);
+				break;
+
 			case 'X':
 				fr_debug_lvl += 2;
 				default_log.print_level = true;
@@ -1079,20 +1321,22 @@ int main(int argc, char *argv[])
 		fclose(fp);
 	}
 
-	if (count == 1) {
-		process(request);
-	} else {
-		int i;
-		REQUEST *old = request_clone(request);
-		talloc_free(request);
+	/*
+	 *	When benchmarking, the request we read is used as a
+	 *	template, and is then processed as normal so we can
+	 *	check the reply.
+	 */
+	if ((count > 1) || (threads > 1) || profile_file) {
+		if (count < 1) count = 1;
 
-		for (i = 0; i < count; i++) {
-			request = request_clone(old);
-			process(request);
-			talloc_free(request);
+		if (bench_run(request, el, count, threads, profile_file) < 0) {
+			fprintf(stderr, "Failed running benchmark\n");
+			EXIT_WITH_FAILURE;
 		}
 	}
 
+	process(request);
+
 	if (!output_file || (strcmp(output_file, "-") == 0)) {
 		fp = stdout;
 	} else {
@@ -1194,7 +1438,8 @@ static void NEVER_RETURNS usage(main_config_t const *config, int status)
 
 	fprintf(output, "Usage: %s [options]\n", config->name);
 	fprintf(output, "Options:\n");
-	fprintf(output, "  -c <count>         Run packets through the interpreter <count> times\n");
+	fprintf(output, "  -c <count>         Run packets through the interpreter <count> times, and report\n");
+	fprintf(output, "                     throughput and latency.\n");
 	fprintf(output, "  -d <raddb_dir>     Configuration files are in \"raddb_dir/*\".\n");
 	fprintf(output, "  -D <dict_dir>      Dictionary files are in \"dict_dir/*\".\n");
 	fprintf(output, "  -f <file>          Filter reply against attributes in 'file'.\n");
@@ -1202,6 +1447,8 @@ static void NEVER_RETURNS usage(main_config_t const *config, int status)
 	fprintf(output, "  -i <file>          File containing request attributes.\n");
 	fprintf(output, "  -m                 On SIGINT or SIGQUIT exit cleanly instead of immediately.\n");
 	fprintf(output, "  -n <name>          Read raddb/name.conf instead of raddb/radiusd.conf.\n");
+	fprintf(output, "  -p <file>          Write the unlang profile of the '-c' requests to 'file' ('-' for stdout).\n");
+	fprintf(output, "  -t <threads>       Process the '-c' requests with <threads> threads.\n");
 	fprintf(output, "  -X                 Turn on full debugging.\n");
 	fprintf(output, "  -x                 Turn on additional debugging. (-xx gives more debugging).\n");
 	fprintf(output, "  -r <receipt_file>  Create the <receipt_file> as a 'success' exit.\n");
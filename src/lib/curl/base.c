@@ -52,6 +52,13 @@ CONF_PARSER fr_curl_tls_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+CONF_PARSER fr_curl_conn_config[] = {
+	{ FR_CONF_OFFSET("max", FR_TYPE_UINT32, fr_curl_conn_conf_t, max), .dflt = "8" },
+	{ FR_CONF_OFFSET("max_per_host", FR_TYPE_UINT32, fr_curl_conn_conf_t, max_per_host), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_streams", FR_TYPE_UINT32, fr_curl_conn_conf_t, max_streams), .dflt = "100" },
+	CONF_PARSER_TERMINATOR
+};
+
 /** Initialise global curl options
  *
  * libcurl is meant to performa reference counting, but still seems to
@@ -47,16 +47,34 @@ do {\
 	}\
 } while (0)
 
+/** Limits on the connections a multi-handle keeps
+ *
+ */
+typedef struct {
+	uint32_t		max;			//!< Maximum number of idle connections to cache.
+	uint32_t		max_per_host;		//!< Maximum connections to a single host.  0 is unlimited.
+	uint32_t		max_streams;		//!< Maximum concurrent HTTP/2 streams per connection.
+} fr_curl_conn_conf_t;
+
+/** Counters for connection reuse
+ *
+ */
+typedef struct {
+	uint64_t		requests;		//!< Transfers completed.
+	uint64_t		connections;		//!< New connections opened by those transfers.
+	uint64_t		reused;			//!< Transfers which used an existing connection.
+	uint64_t		handshakes;		//!< TLS handshakes performed.
+} fr_curl_io_stats_t;
+
 /** Uctx data for timer and I/O functions
  *
- * Seems like overkill for a single field, but I'm sure we'll need to
- * pass around other things later.
  */
 typedef struct {
 	fr_event_list_t		*el;			//!< Event list servicing I/O events.
 	fr_event_timer_t const	*ev;			//!< Multi-Handle timer.
 	uint64_t		transfers;		//!< How many transfers are current in progress.
 	CURLM			*mandle;		//!< The multi handle.
+	fr_curl_io_stats_t	stats;			//!< Connection reuse counters.
 } fr_curl_handle_t;
 
 /** Structure representing an individual request being passed to curl for processing
@@ -83,13 +101,15 @@ typedef struct {
 } fr_curl_tls_t;
 
 extern CONF_PARSER	 fr_curl_tls_config[];
+extern CONF_PARSER	 fr_curl_conn_config[];
 
 int			fr_curl_io_request_enqueue(fr_curl_handle_t *mhandle,
 						   REQUEST *request, fr_curl_io_request_t *creq);
 
 fr_curl_io_request_t	*fr_curl_io_request_alloc(TALLOC_CTX *ctx);
 
-fr_curl_handle_t	*fr_curl_io_init(TALLOC_CTX *ctx, fr_event_list_t *el, bool multiplex);
+fr_curl_handle_t	*fr_curl_io_init(TALLOC_CTX *ctx, fr_event_list_t *el, bool multiplex,
+					 fr_curl_conn_conf_t const *conf);
 
 int			fr_curl_init(void);
 
@@ -45,6 +45,64 @@ do {\
 	}\
 } while (0)
 
+/** Record whether a transfer reused a connection
+ *
+ * @param[in] mhandle	to update the stats of.
+ * @param[in] request	the transfer was performed for.
+ * @param[in] candle	which completed.
+ */
+static inline void _fr_curl_io_stats_update(fr_curl_handle_t *mhandle, REQUEST *request, CURL *candle)
+{
+	long		connects = 0;
+	double		appconnect = 0;
+	char const	*version = "unknown";
+
+	mhandle->stats.requests++;
+
+	/*
+	 *	NUM_CONNECTS is how many new connections the
+	 *	transfer had to open.  APPCONNECT is the time
+	 *	taken to complete the TLS handshake, which is
+	 *	zero if there wasn't one.
+	 */
+	if (curl_easy_getinfo(candle, CURLINFO_NUM_CONNECTS, &connects) != CURLE_OK) return;
+	(void) curl_easy_getinfo(candle, CURLINFO_APPCONNECT_TIME, &appconnect);
+#if CURL_AT_LEAST_VERSION(7,50,0)
+	{
+		long http_version = 0;
+
+		(void) curl_easy_getinfo(candle, CURLINFO_HTTP_VERSION, &http_version);
+		switch (http_version) {
+		case CURL_HTTP_VERSION_1_0:
+			version = "1.0";
+			break;
+
+		case CURL_HTTP_VERSION_1_1:
+			version = "1.1";
+			break;
+
+		case CURL_HTTP_VERSION_2_0:
+			version = "2";
+			break;
+
+		default:
+			break;
+		}
+	}
+#endif
+
+	if (connects == 0) {
+		mhandle->stats.reused++;
+	} else {
+		mhandle->stats.connections += connects;
+		if (appconnect > 0) mhandle->stats.handshakes++;
+	}
+
+	RDEBUG3("%s connection (HTTP version %s), %" PRIu64 " of %" PRIu64 " transfers reused connections",
+		connects ? (appconnect > 0 ? "New TLS" : "New") : "Reused", version,
+		mhandle->stats.reused, mhandle->stats.requests);
+}
+
 /** De-queue curl requests and wake up the requests that initiated them
  *
  * @param[in] mhandle	containing the event loop and request counter.
@@ -87,6 +145,8 @@ static inline void _fr_curl_io_demux(fr_curl_handle_t *mhandle, CURLM *mandle)
 			}
 			randle->result = m->data.result;
 
+			_fr_curl_io_stats_update(mhandle, request, candle);
+
 			/*
 			 *	Looks like this needs to be done last,
 			 *	else m->data.result ends up being junk.
@@ -437,6 +497,11 @@ fr_curl_io_request_t *fr_curl_io_request_alloc(TALLOC_CTX *ctx)
  */
 static int _mhandle_free(fr_curl_handle_t *mhandle)
 {
+	DEBUG2("multi-handle %p - %" PRIu64 " transfers, %" PRIu64 " reused a connection, "
+	       "%" PRIu64 " connections opened, %" PRIu64 " TLS handshakes",
+	       mhandle->mandle, mhandle->stats.requests, mhandle->stats.reused,
+	       mhandle->stats.connections, mhandle->stats.handshakes);
+
 	curl_multi_cleanup(mhandle->mandle);
 
 	return 0;
@@ -448,6 +513,8 @@ static int _mhandle_free(fr_curl_handle_t *mhandle)
  * @param[in] el		to initial.
  * @param[in] multiplex		Run multiple requests over the same connection simultaneously.
  *				HTTP/2 only.
+ * @param[in] conf		Limits on the number of connections.  May be NULL
+ *				to use libcurl's defaults.
  * @return
  *	- 0 on success.
  *	- -1 on error.
@@ -457,7 +524,8 @@ fr_curl_handle_t *fr_curl_io_init(TALLOC_CTX *ctx,
 #ifndef CURLPIPE_MULTIPLEX
 				   UNUSED
 #endif
-				   bool multiplex)
+				   bool multiplex,
+				   fr_curl_conn_conf_t const *conf)
 {
 	CURLMcode		ret;
 	CURLM			*mandle;
@@ -492,6 +560,21 @@ fr_curl_handle_t *fr_curl_io_init(TALLOC_CTX *ctx,
 	SET_MOPTION(mandle, CURLMOPT_PIPELINING, multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
 #endif
 
+	/*
+	 *	Connections are cached by the multi-handle, not
+	 *	the easy handles, so they're reused by any
+	 *	transfer this thread makes to the same host.
+	 */
+	if (conf) {
+		if (conf->max) SET_MOPTION(mandle, CURLMOPT_MAXCONNECTS, (long)conf->max);
+#if CURL_AT_LEAST_VERSION(7,30,0)
+		SET_MOPTION(mandle, CURLMOPT_MAX_HOST_CONNECTIONS, (long)conf->max_per_host);
+#endif
+#if CURL_AT_LEAST_VERSION(7,67,0)
+		if (conf->max_streams) SET_MOPTION(mandle, CURLMOPT_MAX_CONCURRENT_STREAMS, (long)conf->max_streams);
+#endif
+	}
+
 	return mhandle;
 
 error:
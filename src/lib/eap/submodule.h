@@ -45,6 +45,10 @@ typedef struct {
 	fr_dict_t const		**namespace;		//!< Namespace children should be allocated in.
 
 	bool			clone_parent_lists;	//!< HACK until all eap methods run their own sections.
+	bool			keep_subrequest;	//!< Keep the subrequest for the lifetime of the
+							///< #eap_session_t, instead of allocating a new one
+							///< every round.  Its session-state and request data
+							///< then stay with it between rounds.
 } rlm_eap_submodule_t;
 
 /** Private structure to hold handles and interfaces for an EAP method
@@ -79,6 +79,7 @@ fr_table_num_ordered_t const eap_tls_status_table[] = {
 	{ "established",		EAP_TLS_ESTABLISHED		},
 	{ "fail",			EAP_TLS_FAIL			},
 	{ "handled",			EAP_TLS_HANDLED			},
+	{ "yield",			EAP_TLS_YIELD			},
 
 	{ "start",			EAP_TLS_START_SEND		},
 	{ "request",			EAP_TLS_RECORD_SEND		},
@@ -112,8 +113,6 @@ int eap_tls_compose(REQUEST *request, eap_session_t *eap_session, eap_tls_status
 		    fr_tls_record_t *record, size_t record_len, size_t frag_len)
 {
 	eap_round_t		*eap_round = eap_session->this_round;
-	eap_tls_session_t	*eap_tls_session = talloc_get_type_abort(eap_session->opaque, eap_tls_session_t);
-	fr_tls_session_t		*tls_session = eap_tls_session->tls_session;
 	uint8_t			*p;
 	size_t			len = 1;	/* Flags */
 
@@ -185,7 +184,19 @@ int eap_tls_compose(REQUEST *request, eap_session_t *eap_session, eap_tls_status
 		p += sizeof(net_record_len);
 	}
 
-	if (record) tls_session->record_to_buff(record, p, frag_len);
+	/*
+	 *	Fragments are taken from the front of the record
+	 *	in order, so the fragment starts however much of
+	 *	the record we've already sent into the buffer.
+	 *	This avoids shuffling the rest of the record down
+	 *	after every fragment.
+	 */
+	if (record) {
+		fr_assert((frag_len <= record->used) && (record->used <= record_len));
+
+		memcpy(p, record->data + (record_len - record->used), frag_len);
+		record->used -= frag_len;
+	}
 
 	switch (status) {
 	case EAP_TLS_ACK_SEND:
@@ -823,6 +834,7 @@ ignore_length:
  * @return
  *	- EAP_TLS_FAIL if the message is invalid.
  *	- EAP_TLS_HANDLED if we need to send an additional request to the peer.
+ *	- EAP_TLS_YIELD if the handshake is waiting for an asynchronous crypto operation.
  *	- EAP_TLS_ESTABLISHED if the handshake completed successfully, and there's
  *	  no more data to send.
  */
@@ -840,6 +852,12 @@ static eap_tls_status_t eap_tls_handshake(REQUEST *request, eap_session_t *eap_s
 		return EAP_TLS_FAIL;
 	}
 
+	/*
+	 *	The engine paused the handshake, the caller
+	 *	needs to wait for the operation to complete.
+	 */
+	if (tls_session->async_pending) return EAP_TLS_YIELD;
+
 	/*
 	 *	FIXME: return success/fail.
 	 *
@@ -898,6 +916,7 @@ static eap_tls_status_t eap_tls_handshake(REQUEST *request, eap_session_t *eap_s
  * @return
  *	- EAP_TLS_ESTABLISHED
  *	- EAP_TLS_HANDLED
+ *	- EAP_TLS_YIELD
  */
 eap_tls_status_t eap_tls_process(REQUEST *request, eap_session_t *eap_session)
 {
@@ -915,6 +934,16 @@ eap_tls_status_t eap_tls_process(REQUEST *request, eap_session_t *eap_session)
 
 	RDEBUG2("Continuing EAP-TLS");
 
+	/*
+	 *	We're being resumed after an asynchronous crypto
+	 *	operation completed.  The record has already been
+	 *	ingested, so just continue the handshake.
+	 */
+	if (tls_session->async_pending) {
+		status = eap_tls_handshake(request, eap_session);
+		goto done;
+	}
+
 	/*
 	 *	Call eap_tls_verify to sanity check the incoming EAP data.
 	 */
@@ -949,8 +978,8 @@ eap_tls_status_t eap_tls_process(REQUEST *request, eap_session_t *eap_session)
 	 *	If the length included flag is set, we need to skip over the 4 byte
 	 *	message length field.
 	 *
-	 *	Next - Copy the fragment data into OpenSSL's dirty in buffer so that it
-	 *	can process it in a later call.
+	 *	Next - Write the fragment data straight into OpenSSL's input BIO, which
+	 *	buffers it until the record is complete and we process it.
 	 */
 	case EAP_TLS_RECORD_RECV_FIRST:
 	case EAP_TLS_RECORD_RECV_MORE:
@@ -963,14 +992,7 @@ eap_tls_status_t eap_tls_process(REQUEST *request, eap_session_t *eap_session)
 			data_len = this_round->response->type.length - 1;	/* flags */
 		}
 
-		/*
-		 *	Update the dirty_in buffer (data for reading by OpenSSL)
-		 *
-		 *	This buffer will contain partial data when M bit is set, and should
-		 * 	should only be reinitialized when M bit is not set.
-		 */
-		if ((tls_session->record_from_buff)(&tls_session->dirty_in, data, data_len) != data_len) {
-			REDEBUG("Exceeded maximum record size");
+		if (fr_tls_session_recv_fragment(request, tls_session, data, data_len) < 0) {
 			status = EAP_TLS_FAIL;
 			goto done;
 		}
@@ -1049,6 +1071,80 @@ eap_tls_status_t eap_tls_process(REQUEST *request, eap_session_t *eap_session)
 	return status;
 }
 
+static void eap_tls_async_fd_event(UNUSED void *instance, UNUSED void *thread, REQUEST *request,
+				   void *rctx, int fd)
+{
+	eap_tls_session_t	*eap_tls_session = talloc_get_type_abort(rctx, eap_tls_session_t);
+
+	(void) unlang_module_fd_delete(request, eap_tls_session, fd);
+	eap_tls_session->async_fd = -1;
+
+	unlang_interpret_resumable(request);
+}
+
+static void eap_tls_async_retry(UNUSED void *instance, UNUSED void *thread, REQUEST *request,
+				UNUSED void *rctx, UNUSED fr_time_t fired)
+{
+	unlang_interpret_resumable(request);
+}
+
+static void eap_tls_async_signal(UNUSED void *instance, UNUSED void *thread, REQUEST *request,
+				 void *rctx, fr_state_signal_t action)
+{
+	eap_tls_session_t	*eap_tls_session = talloc_get_type_abort(rctx, eap_tls_session_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (eap_tls_session->async_fd >= 0) {
+		(void) unlang_module_fd_delete(request, eap_tls_session, eap_tls_session->async_fd);
+		eap_tls_session->async_fd = -1;
+	} else {
+		(void) unlang_module_timeout_delete(request, eap_tls_session);
+	}
+}
+
+/** Yield until an asynchronous crypto operation completes
+ *
+ * Should be called by an EAP method's process function when #eap_tls_process
+ * returns EAP_TLS_YIELD.  The resume function should call the process function
+ * again, which will continue the handshake.
+ *
+ * @param[in] request		The current subrequest.
+ * @param[in] eap_session	with a handshake waiting on an asynchronous operation.
+ * @param[in] resume		function to call when the operation completes.
+ * @return
+ *	- RLM_MODULE_YIELD.
+ *	- RLM_MODULE_FAIL if we couldn't wait for the operation.
+ */
+rlm_rcode_t eap_tls_yield(REQUEST *request, eap_session_t *eap_session, fr_unlang_module_resume_t resume)
+{
+	eap_tls_session_t	*eap_tls_session = talloc_get_type_abort(eap_session->opaque, eap_tls_session_t);
+	int			fd;
+
+	fd = fr_tls_session_async_fd(eap_tls_session->tls_session);
+	if (fd >= 0) {
+		if (unlang_module_fd_add(request, eap_tls_async_fd_event, NULL, eap_tls_async_fd_event,
+					 eap_tls_session, fd) < 0) {
+			REDEBUG("Failed inserting asynchronous crypto FD");
+			return RLM_MODULE_FAIL;
+		}
+		eap_tls_session->async_fd = fd;
+	} else {
+		/*
+		 *	No ASYNC_JOB was available, so there's
+		 *	nothing to wait on.  Retry shortly.
+		 */
+		if (unlang_module_timeout_add(request, eap_tls_async_retry, eap_tls_session,
+					      fr_time() + fr_time_delta_from_msec(1)) < 0) {
+			REDEBUG("Failed inserting asynchronous crypto retry timer");
+			return RLM_MODULE_FAIL;
+		}
+		eap_tls_session->async_fd = -1;
+	}
+
+	return unlang_module_yield(request, resume, eap_tls_async_signal, eap_tls_session);
+}
+
 /** Create a new fr_tls_session_t associated with an #eap_session_t
  *
  * Creates a new server fr_tls_session_t and associates it with an #eap_session_t
@@ -1081,6 +1177,7 @@ eap_tls_session_t *eap_tls_session_init(REQUEST *request, eap_session_t *eap_ses
 	 *	Initial state.
 	 */
 	eap_tls_session->state = EAP_TLS_START_SEND;
+	eap_tls_session->async_fd = -1;
 
 	/*
 	 *	As per the RFC...
@@ -51,6 +51,8 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/tls/base.h>
 #include <freeradius-devel/eap/base.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/unlang/module.h>
 
 #define TLS_HEADER_LEN 4
 #define TLS_HEADER_LENGTH_FIELD_LEN 4
@@ -92,6 +94,8 @@ typedef enum {
 	EAP_TLS_ESTABLISHED,       			//!< Session established, send success (or start phase2).
 	EAP_TLS_FAIL,       				//!< Fail, send fail.
 	EAP_TLS_HANDLED,	  			//!< TLS code has handled it.
+	EAP_TLS_YIELD,					//!< Handshake is waiting for an asynchronous
+							///< crypto operation, call eap_tls_yield().
 
 	/*
 	 *	Composition states, we need to
@@ -146,6 +150,9 @@ typedef struct {
 	size_t			record_in_total_len;	//!< How long the peer indicated the complete tls record
 							//!< would be.
 	size_t			record_in_recvd_len;	//!< How much of the record we've received so far.
+
+	int			async_fd;		//!< FD we're waiting on for an asynchronous crypto
+							//!< operation to complete, or -1.
 } eap_tls_session_t;
 
 extern fr_table_num_ordered_t const eap_tls_status_table[];
@@ -156,6 +163,9 @@ extern size_t eap_tls_status_table_len;
  */
 eap_tls_status_t	eap_tls_process(REQUEST *request, eap_session_t *eap_session) CC_HINT(nonnull);
 
+rlm_rcode_t		eap_tls_yield(REQUEST *request, eap_session_t *eap_session,
+				      fr_unlang_module_resume_t resume) CC_HINT(nonnull);
+
 int			eap_tls_start(REQUEST *request, eap_session_t *eap_session) CC_HINT(nonnull);
 
 int			eap_tls_success(REQUEST *request, eap_session_t *eap_session,
@@ -11,6 +11,7 @@ SOURCES	:= \
 	fips186prf.c \
 	id.c \
 	vector.c \
+	vector_cache.c \
 	xlat.c
 
 TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-eap.a libfreeradius-util.a libfreeradius-sim.a
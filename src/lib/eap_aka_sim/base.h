@@ -109,6 +109,8 @@ typedef struct {
 	};
 } fr_aka_sim_vector_gsm_t;
 
+typedef struct fr_aka_sim_vector_cache_s fr_aka_sim_vector_cache_t;
+
 typedef struct {
 	uint8_t		autn[AKA_SIM_VECTOR_UMTS_AUTN_SIZE];	//!< Authentication vector from the AuC.
 	uint8_t		ck[AKA_SIM_VECTOR_UMTS_CK_SIZE];	//!< Ciphering key.
@@ -310,7 +312,8 @@ void		fr_aka_sim_crypto_keys_log(REQUEST *request, fr_aka_sim_keys_t *keys);
 int		fr_aka_sim_vector_gsm_from_attrs(REQUEST *request, VALUE_PAIR *vps,
 						 int idx,
 						 fr_aka_sim_keys_t *keys,
-						 fr_aka_sim_vector_src_t *src);
+						 fr_aka_sim_vector_src_t *src,
+						 fr_aka_sim_vector_cache_t *cache);
 
 int		fr_aka_sim_vector_umts_from_attrs(REQUEST *request, VALUE_PAIR *vps,
 						  fr_aka_sim_keys_t *keys,
@@ -328,6 +331,14 @@ int		fr_aka_sim_umts_resync_from_attrs(uint64_t *new_sqn,
 						  REQUEST *request, VALUE_PAIR *auts_vp,
 						  fr_aka_sim_keys_t *keys);
 
+/*
+ *	vector_cache.c
+ */
+fr_aka_sim_vector_cache_t *fr_aka_sim_vector_cache_alloc(TALLOC_CTX *ctx, uint32_t max_subscribers, uint32_t vectors);
+
+int		fr_aka_sim_vector_cache_pop(fr_aka_sim_vector_gsm_t *out, fr_aka_sim_vector_cache_t *cache,
+					    uint32_t version, uint8_t const ki[static 16], uint8_t const opc[16]);
+
 /*
  *	fips186prf.c
  */
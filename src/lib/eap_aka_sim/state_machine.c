@@ -1535,11 +1535,11 @@ static rlm_rcode_t sim_challenge_request_compose(eap_aka_sim_common_conf_t *inst
 
 	RDEBUG2("Acquiring GSM vector(s)");
 	if ((fr_aka_sim_vector_gsm_from_attrs(request, request->control, 0,
-					      &eap_aka_sim_session->keys, &src) != 0) ||
+					      &eap_aka_sim_session->keys, &src, inst->vector_cache) != 0) ||
 	    (fr_aka_sim_vector_gsm_from_attrs(request, request->control, 1,
-	    				      &eap_aka_sim_session->keys, &src) != 0) ||
+	    				      &eap_aka_sim_session->keys, &src, inst->vector_cache) != 0) ||
 	    (fr_aka_sim_vector_gsm_from_attrs(request, request->control, 2,
-	    				      &eap_aka_sim_session->keys, &src) != 0)) {
+	    				      &eap_aka_sim_session->keys, &src, inst->vector_cache) != 0)) {
 	    	REDEBUG("Failed retrieving SIM vectors");
 		return RLM_MODULE_FAIL;
 	}
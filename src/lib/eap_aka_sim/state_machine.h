@@ -173,6 +173,11 @@ typedef struct {
 	bool				strip_permanent_identity_hint;	//!< Control whether the hint byte is stripped
 									///< when populating Permanent-Identity.
 
+	uint32_t			vector_cache_max_subscribers;	//!< Maximum subscribers to precompute
+									///< triplets for.  0 disables the cache.
+	uint32_t			vector_cache_vectors;		//!< Triplets to hold per subscriber.
+	fr_aka_sim_vector_cache_t	*vector_cache;			//!< Precomputed triplets.
+
 	eap_aka_sim_actions_t		actions;			//!< Pre-compiled virtual server sections.
 } eap_aka_sim_common_conf_t;
 
@@ -75,11 +75,12 @@ static int vector_opc_from_op(REQUEST *request, uint8_t const **out, uint8_t opc
 	return 1;
 }
 
-static int vector_gsm_from_ki(REQUEST *request, VALUE_PAIR *vps, int idx, fr_aka_sim_keys_t *keys)
+static int vector_gsm_from_ki(REQUEST *request, VALUE_PAIR *vps, int idx, fr_aka_sim_keys_t *keys,
+			      fr_aka_sim_vector_cache_t *cache)
 {
 	VALUE_PAIR	*ki_vp, *version_vp;
 	uint8_t		opc_buff[MILENAGE_OPC_SIZE];
-	uint8_t	const	*opc_p;
+	uint8_t	const	*opc_p = NULL;
 	uint32_t	version;
 	int		i;
 
@@ -120,6 +121,15 @@ static int vector_gsm_from_ki(REQUEST *request, VALUE_PAIR *vps, int idx, fr_aka
 		}
 	}
 
+	/*
+	 *	Use a precomputed triplet if we have one
+	 */
+	if (cache && (fr_aka_sim_vector_cache_pop(&keys->gsm.vector[idx], cache,
+						  version, ki_vp->vp_octets, opc_p) == 0)) {
+		RDEBUG3("Using precomputed triplet");
+		goto done;
+	}
+
 	for (i = 0; i < AKA_SIM_VECTOR_GSM_RAND_SIZE; i += sizeof(uint32_t)) {
 		uint32_t rand = fr_rand();
 		memcpy(&keys->gsm.vector[idx].rand[i], &rand, sizeof(rand));
@@ -163,11 +173,12 @@ static int vector_gsm_from_ki(REQUEST *request, VALUE_PAIR *vps, int idx, fr_aka
 		return -1;
 	}
 
+done:
 	/*
 	 *	Store for completeness...
 	 */
 	memcpy(keys->auc.ki, ki_vp->vp_octets, sizeof(keys->auc.ki));
-	memcpy(keys->auc.opc, opc_p, sizeof(keys->auc.opc));
+	if (opc_p) memcpy(keys->auc.opc, opc_p, sizeof(keys->auc.opc));
 	keys->vector_src = AKA_SIM_VECTOR_SRC_KI;
 
 	return 0;
@@ -321,13 +332,16 @@ static int vector_gsm_from_quintuplets(REQUEST *request, VALUE_PAIR *vps,
  * @param[in] src		Forces triplets to be retrieved from a particular src
  *				and ensures if multiple triplets are being retrieved
  *				that they all come from the same src.
+ * @param[in] cache		of precomputed triplets to use when deriving triplets
+ *				from Ki.  May be NULL.
  * @return
  *	- 1	Vector could not be retrieved from the specified src.
  *	- 0	Vector was retrieved OK and written to the specified index.
  *	- -1	Error retrieving vector from the specified src.
  */
 int fr_aka_sim_vector_gsm_from_attrs(REQUEST *request, VALUE_PAIR *vps,
-				     int idx, fr_aka_sim_keys_t *keys, fr_aka_sim_vector_src_t *src)
+				     int idx, fr_aka_sim_keys_t *keys, fr_aka_sim_vector_src_t *src,
+				     fr_aka_sim_vector_cache_t *cache)
 {
 	int		ret;
 
@@ -337,7 +351,7 @@ int fr_aka_sim_vector_gsm_from_attrs(REQUEST *request, VALUE_PAIR *vps,
 	switch (*src) {
 	default:
 	case AKA_SIM_VECTOR_SRC_KI:
-		ret = vector_gsm_from_ki(request, vps, idx, keys);
+		ret = vector_gsm_from_ki(request, vps, idx, keys, cache);
 		if (ret == 0) {
 			*src = AKA_SIM_VECTOR_SRC_KI;
 			break;
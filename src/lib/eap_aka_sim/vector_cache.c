@@ -0,0 +1,434 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file src/lib/eap_aka_sim/vector_cache.c
+ * @brief Keep a stock of precomputed GSM triplets for subscribers whose Ki we hold.
+ *
+ * When the server acts as its own AuC, every full authentication would
+ * otherwise run COMP128 or Milenage three times before the challenge can
+ * be sent.  Instead we pop triplets from a per-subscriber stock, which a
+ * background thread refills when it runs low.
+ *
+ * Triplets have no sequence number, so any unused triplet with a fresh RAND
+ * is as good as one generated on demand.  Each triplet is only ever handed
+ * out once.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/metrics.h>
+#include <freeradius-devel/sim/comp128.h>
+#include <freeradius-devel/sim/milenage.h>
+#include <freeradius-devel/protocol/freeradius/freeradius.internal.sim.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <pthread.h>
+
+#include "base.h"
+
+/** The triplets we hold for a subscriber
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+	fr_dlist_t		refill_entry;		//!< Entry in the refill queue.
+
+	uint32_t		version;		//!< FR_SIM_ALGO_VERSION_VALUE_COMP128_*.
+	uint8_t			ki[MILENAGE_KI_SIZE];	//!< Subscriber key.
+	uint8_t			opc[MILENAGE_OPC_SIZE];	//!< Derived operator code, only used for COMP128-4.
+
+	fr_aka_sim_vector_gsm_t	*vectors;		//!< Precomputed triplets.
+	uint32_t		num;			//!< How many triplets are in the stock.
+
+	bool			refilling;		//!< Queued for, or being refilled by, the
+							///< refill thread.  Can't be evicted.
+} vector_cache_entry_t;
+
+/** Per-subscriber stocks of GSM triplets, shared by all workers
+ *
+ */
+struct fr_aka_sim_vector_cache_s {
+	uint32_t		max_subscribers;	//!< Maximum number of subscribers we hold stock for.
+	uint32_t		vectors;		//!< How many triplets to hold per subscriber.
+
+	pthread_mutex_t		mutex;			//!< Protects everything below.
+	pthread_cond_t		refill_cond;		//!< Signalled when an entry is queued for refill.
+
+	fr_hash_table_t		*ht;			//!< Entries by algorithm and keys.  Entries are
+							///< allocated in its ctx.
+	fr_dlist_head_t		lru;			//!< Most recently used at the head.
+	fr_dlist_head_t		refill;			//!< Entries to refill.
+
+	pthread_t		refill_thread;		//!< Generates triplets.
+	bool			refill_running;		//!< Whether the refill thread has been started.
+	bool			stop;			//!< Tell the refill thread to exit.
+
+	fr_metric_t		*metric;		//!< Lookups by result.
+};
+
+static uint32_t vector_cache_entry_hash(void const *data)
+{
+	vector_cache_entry_t const *entry = data;
+	uint32_t hash;
+
+	hash = fr_hash(&entry->version, sizeof(entry->version));
+	hash = fr_hash_update(entry->ki, sizeof(entry->ki), hash);
+	return fr_hash_update(entry->opc, sizeof(entry->opc), hash);
+}
+
+static int vector_cache_entry_cmp(void const *one, void const *two)
+{
+	vector_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->version > b->version) - (a->version < b->version);
+	if (ret != 0) return ret;
+
+	ret = memcmp(a->ki, b->ki, sizeof(a->ki));
+	if (ret != 0) return ret;
+
+	return memcmp(a->opc, b->opc, sizeof(a->opc));
+}
+
+static int _vector_cache_entry_free(vector_cache_entry_t *entry)
+{
+	memset(entry->ki, 0, sizeof(entry->ki));
+	memset(entry->opc, 0, sizeof(entry->opc));
+	if (entry->vectors) memset(entry->vectors, 0, talloc_get_size(entry->vectors));
+
+	return 0;
+}
+
+static int _vector_cache_free(fr_aka_sim_vector_cache_t *cache)
+{
+	if (cache->refill_running) {
+		pthread_mutex_lock(&cache->mutex);
+		cache->stop = true;
+		pthread_cond_signal(&cache->refill_cond);
+		pthread_mutex_unlock(&cache->mutex);
+
+		pthread_join(cache->refill_thread, NULL);
+	}
+
+	TALLOC_FREE(cache->ht);
+
+	pthread_cond_destroy(&cache->refill_cond);
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate a cache of precomputed GSM triplets
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_subscribers	Maximum number of subscribers to hold triplets for.
+ *				The least recently used subscriber is evicted to make room.
+ * @param[in] vectors		Number of triplets to hold for each subscriber.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+fr_aka_sim_vector_cache_t *fr_aka_sim_vector_cache_alloc(TALLOC_CTX *ctx, uint32_t max_subscribers, uint32_t vectors)
+{
+	fr_aka_sim_vector_cache_t	*cache;
+
+	MEM(cache = talloc_zero(ctx, fr_aka_sim_vector_cache_t));
+	cache->max_subscribers = max_subscribers;
+	cache->vectors = vectors;
+
+	cache->ht = fr_hash_table_create(cache, vector_cache_entry_hash, vector_cache_entry_cmp, NULL);
+	if (!cache->ht) {
+		talloc_free(cache);
+		return NULL;
+	}
+	fr_dlist_init(&cache->lru, vector_cache_entry_t, entry);
+	fr_dlist_init(&cache->refill, vector_cache_entry_t, refill_entry);
+
+	cache->metric = fr_metric_register("freeradius_eap_sim_vector_cache",
+					   "Full authentications using a precomputed triplet, or generating one.",
+					   FR_METRIC_COUNTER);
+	if (!cache->metric) {
+		talloc_free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	pthread_cond_init(&cache->refill_cond, NULL);
+	talloc_set_destructor(cache, _vector_cache_free);
+
+	return cache;
+}
+
+/** Generate triplets with fresh RAND values
+ *
+ * @param[out] out	Where to write the triplets.
+ * @param[in] num	Number of triplets to generate.
+ * @param[in] version	FR_SIM_ALGO_VERSION_VALUE_COMP128_*.
+ * @param[in] ki	Subscriber key.
+ * @param[in] opc	Derived operator code, only used for COMP128-4.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int vector_cache_generate(fr_aka_sim_vector_gsm_t *out, uint32_t num,
+				 uint32_t version, uint8_t const ki[MILENAGE_KI_SIZE],
+				 uint8_t const opc[MILENAGE_OPC_SIZE])
+{
+	uint8_t		rand[MILENAGE_BATCH_SIZE][MILENAGE_RAND_SIZE];
+	uint8_t		sres[MILENAGE_BATCH_SIZE][MILENAGE_SRES_SIZE];
+	uint8_t		kc[MILENAGE_BATCH_SIZE][MILENAGE_KC_SIZE];
+	uint32_t	done, batch, i;
+
+	for (done = 0; done < num; done += batch) {
+		batch = num - done;
+		if (batch > MILENAGE_BATCH_SIZE) batch = MILENAGE_BATCH_SIZE;
+
+		for (i = 0; i < batch; i++) fr_rand_buffer(rand[i], sizeof(rand[i]));
+
+		switch (version) {
+		case FR_SIM_ALGO_VERSION_VALUE_COMP128_1:
+			for (i = 0; i < batch; i++) comp128v1(sres[i], kc[i], ki, rand[i]);
+			break;
+
+		case FR_SIM_ALGO_VERSION_VALUE_COMP128_2:
+			for (i = 0; i < batch; i++) comp128v23(sres[i], kc[i], ki, rand[i], true);
+			break;
+
+		case FR_SIM_ALGO_VERSION_VALUE_COMP128_3:
+			for (i = 0; i < batch; i++) comp128v23(sres[i], kc[i], ki, rand[i], false);
+			break;
+
+		case FR_SIM_ALGO_VERSION_VALUE_COMP128_4:
+			if (milenage_gsm_generate_batch(sres, kc, opc, ki, rand, batch) < 0) return -1;
+			break;
+
+		default:
+			return -1;
+		}
+
+		for (i = 0; i < batch; i++) {
+			memcpy(out[done + i].rand, rand[i], sizeof(out[done + i].rand));
+			memcpy(out[done + i].sres, sres[i], sizeof(out[done + i].sres));
+			memcpy(out[done + i].kc, kc[i], sizeof(out[done + i].kc));
+		}
+	}
+
+	memset(sres, 0, sizeof(sres));
+	memset(kc, 0, sizeof(kc));
+
+	return 0;
+}
+
+/** Refill the stock of subscribers which are running low
+ *
+ */
+static void *vector_cache_refill_thread(void *arg)
+{
+	fr_aka_sim_vector_cache_t	*cache = talloc_get_type_abort(arg, fr_aka_sim_vector_cache_t);
+	vector_cache_entry_t		*entry;
+	fr_aka_sim_vector_gsm_t		*fresh;
+
+	MEM(fresh = talloc_array(NULL, fr_aka_sim_vector_gsm_t, cache->vectors));
+
+	pthread_mutex_lock(&cache->mutex);
+	for (;;) {
+		uint32_t	need, i;
+		int		ret;
+
+		if (cache->stop) break;
+
+		entry = fr_dlist_head(&cache->refill);
+		if (!entry) {
+			pthread_cond_wait(&cache->refill_cond, &cache->mutex);
+			continue;
+		}
+		fr_dlist_remove(&cache->refill, entry);
+		need = cache->vectors - entry->num;
+		pthread_mutex_unlock(&cache->mutex);
+
+		/*
+		 *	Entries being refilled can't be evicted,
+		 *	and workers only ever remove triplets, so
+		 *	it's safe to generate without the lock.
+		 */
+		ret = vector_cache_generate(fresh, need, entry->version, entry->ki, entry->opc);
+		if (ret < 0) {
+			PERROR("Failed precomputing GSM triplets");
+			need = 0;
+		}
+
+		pthread_mutex_lock(&cache->mutex);
+		for (i = 0; (i < need) && (entry->num < cache->vectors); i++) entry->vectors[entry->num++] = fresh[i];
+		entry->refilling = false;
+	}
+
+	/*
+	 *	Release anything still queued
+	 */
+	while ((entry = fr_dlist_head(&cache->refill))) {
+		fr_dlist_remove(&cache->refill, entry);
+		entry->refilling = false;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	memset(fresh, 0, talloc_get_size(fresh));
+	talloc_free(fresh);
+
+	return NULL;
+}
+
+/** Queue an entry to be refilled by the refill thread
+ *
+ * The thread is started on first use, as threads don't survive fork().
+ *
+ * @note Must be called with the cache locked.
+ */
+static void vector_cache_refill(fr_aka_sim_vector_cache_t *cache, vector_cache_entry_t *entry)
+{
+	if (entry->refilling) return;
+
+	if (!cache->refill_running) {
+		int ret;
+
+		ret = pthread_create(&cache->refill_thread, NULL, vector_cache_refill_thread, cache);
+		if (ret != 0) {
+			ERROR("Failed starting GSM triplet refill thread: %s", fr_syserror(ret));
+			return;
+		}
+		cache->refill_running = true;
+	}
+
+	entry->refilling = true;
+	fr_dlist_insert_tail(&cache->refill, entry);
+	pthread_cond_signal(&cache->refill_cond);
+}
+
+/** Find or create the entry for a subscriber
+ *
+ * @note Must be called with the cache locked.
+ */
+static vector_cache_entry_t *vector_cache_entry(fr_aka_sim_vector_cache_t *cache, vector_cache_entry_t *find)
+{
+	vector_cache_entry_t	*entry, *evict;
+
+	entry = fr_hash_table_finddata(cache->ht, find);
+	if (entry) {
+		fr_dlist_remove(&cache->lru, entry);
+		fr_dlist_insert_head(&cache->lru, entry);
+		return entry;
+	}
+
+	/*
+	 *	Evict the least recently used subscribers
+	 *	which aren't being refilled.
+	 */
+	evict = fr_dlist_tail(&cache->lru);
+	while (evict && (fr_dlist_num_elements(&cache->lru) >= cache->max_subscribers)) {
+		vector_cache_entry_t *prev = fr_dlist_prev(&cache->lru, evict);
+
+		if (!evict->refilling) {
+			fr_dlist_remove(&cache->lru, evict);
+			fr_hash_table_delete(cache->ht, evict);
+			talloc_free(evict);
+		}
+		evict = prev;
+	}
+
+	MEM(entry = talloc_zero(cache->ht, vector_cache_entry_t));
+	talloc_set_destructor(entry, _vector_cache_entry_free);
+	entry->version = find->version;
+	memcpy(entry->ki, find->ki, sizeof(entry->ki));
+	memcpy(entry->opc, find->opc, sizeof(entry->opc));
+	MEM(entry->vectors = talloc_array(entry, fr_aka_sim_vector_gsm_t, cache->vectors));
+
+	if (!fr_hash_table_insert(cache->ht, entry)) {
+		talloc_free(entry);
+		return NULL;
+	}
+	fr_dlist_insert_head(&cache->lru, entry);
+
+	return entry;
+}
+
+/** Take a precomputed triplet from a subscriber's stock
+ *
+ * If the stock is running low, it's refilled in the background.  If it's
+ * empty the caller should generate the triplet itself.
+ *
+ * @param[out] out	Where to write the triplet.
+ * @param[in] cache	to take the triplet from.
+ * @param[in] version	FR_SIM_ALGO_VERSION_VALUE_COMP128_*.
+ * @param[in] ki	Subscriber key.
+ * @param[in] opc	Derived operator code.  Required for COMP128-4, may be NULL otherwise.
+ * @return
+ *	- 0 if a triplet was written to out.
+ *	- 1 if no triplet was available.
+ */
+int fr_aka_sim_vector_cache_pop(fr_aka_sim_vector_gsm_t *out, fr_aka_sim_vector_cache_t *cache,
+				uint32_t version, uint8_t const ki[static MILENAGE_KI_SIZE],
+				uint8_t const opc[MILENAGE_OPC_SIZE])
+{
+	vector_cache_entry_t	find = { .version = version };
+	vector_cache_entry_t	*entry;
+	int			ret = 1;
+
+	switch (version) {
+	case FR_SIM_ALGO_VERSION_VALUE_COMP128_1:
+	case FR_SIM_ALGO_VERSION_VALUE_COMP128_2:
+	case FR_SIM_ALGO_VERSION_VALUE_COMP128_3:
+		break;
+
+	case FR_SIM_ALGO_VERSION_VALUE_COMP128_4:
+		if (!opc) return 1;
+		memcpy(find.opc, opc, sizeof(find.opc));
+		break;
+
+	default:
+		return 1;
+	}
+	memcpy(find.ki, ki, sizeof(find.ki));
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = vector_cache_entry(cache, &find);
+	if (entry) {
+		if (entry->num > 0) {
+			*out = entry->vectors[--entry->num];
+			memset(&entry->vectors[entry->num], 0, sizeof(entry->vectors[entry->num]));
+			ret = 0;
+		}
+
+		/*
+		 *	Refill once we're down to a third, which
+		 *	leaves enough for at least one more full
+		 *	authentication with the default settings.
+		 */
+		if (entry->num <= (cache->vectors / 3)) vector_cache_refill(cache, entry);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	memset(&find, 0, sizeof(find));
+
+	fr_metric_inc(fr_metric_series(cache->metric, ret == 0 ? "result=\"hit\"" : "result=\"miss\""), 1);
+
+	return ret;
+}
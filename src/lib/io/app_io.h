@@ -41,6 +41,9 @@ typedef struct {
 	size_t				default_reply_size;	//!< same for replies
 	size_t				thread_inst_size;	//!< thread-specific socket information size
 	bool				track_duplicates;	//!< track duplicate packets
+	bool				deferred_write;		//!< write() may queue a pointer to the reply,
+								//!< instead of copying it.  The reply is only
+								//!< released once flush() returns 0.
 
 	fr_io_open_t			open;		//!< Open a new socket for listening, or accept/connect a new
 							//!< connection.
@@ -57,6 +60,8 @@ typedef struct {
 	fr_io_encode_t			encode;		//!< Pack VALUE_PAIRs back into a byte array.
 
 	fr_io_signal_t			flush;		//!< Flush the data when the socket is ready for writing.
+							//!< Returns 1 if data is still queued, and the socket
+							//!< isn't writable.
 
 	fr_io_signal_t			error;		//!< There was an error on the socket.
 	fr_io_close_t			close;		//!< Close the transport.
@@ -70,6 +75,7 @@ typedef struct {
 	 *	Either in a buffer, or in a newly-allocated memory.
 	 */
 	fr_io_data_cmp_t		compare;	//!< compare two packets
+	fr_io_data_hash_t		hash;		//!< hash a packet, consistently with compare
 
 	fr_io_connection_set_t		connection_set;	//!< set src/dst IP/port of a connection
 	fr_io_network_get_t		network_get;	//!< get dynamic network information
@@ -39,7 +39,8 @@ typedef struct {
 
 struct fr_atomic_queue_s {
 	alignas(128) atomic_int64_t	head;
-	atomic_int64_t			tail;
+	alignas(128) atomic_int64_t	tail;		//!< On its own cache line, so that producers and
+							///< consumers don't contend for it.
 
 	size_t				size;
 
@@ -225,6 +226,280 @@ bool fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data)
 	return true;
 }
 
+/** Push multiple pointers into the atomic queue
+ *
+ * Reserves as many consecutive entries as are free (up to num) with
+ * a single CAS, and then fills them in.  The pointers are pushed in
+ * order, and popped in the same order.
+ *
+ * @param[in] aq	The atomic queue to add data to.
+ * @param[in] data	array of pointers to push.  Pushing stops at
+ *			the first NULL pointer.
+ * @param[in] num	number of pointers in the array.
+ * @return the number of pointers which were pushed.  Zero if the
+ *	queue is full.
+ */
+size_t fr_atomic_queue_push_n(fr_atomic_queue_t *aq, void * const *data, size_t num)
+{
+	int64_t head;
+	size_t	i, n;
+
+	for (n = 0; (n < num) && data[n]; n++);
+	if (n == 0) return 0;
+
+	head = load(aq->head);
+
+	for (;;) {
+		int64_t seq, diff;
+
+		seq = aquire(aq->entry[ head % aq->size ].seq);
+		diff = (seq - head);
+
+		/*
+		 *	The queue is full.
+		 */
+		if (diff < 0) return 0;
+
+		/*
+		 *	Someone else has already written to this entry.
+		 */
+		if (diff > 0) {
+			head = load(aq->head);
+			continue;
+		}
+
+		/*
+		 *	The first entry is free.  See how many of the
+		 *	following ones are free, too.
+		 */
+		for (i = 1; i < n; i++) {
+			if (aquire(aq->entry[ (head + i) % aq->size ].seq) != (int64_t) (head + i)) break;
+		}
+
+		if (atomic_compare_exchange_strong_explicit(&aq->head, &head, head + i,
+							    memory_order_release, memory_order_relaxed)) {
+			n = i;
+			break;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		fr_atomic_queue_entry_t *entry = &aq->entry[ (head + i) % aq->size ];
+
+		entry->data = data[i];
+		store(entry->seq, head + i + 1);
+	}
+
+	return n;
+}
+
+
+/** Pop multiple pointers from the atomic queue
+ *
+ * @param[in] aq	the atomic queue to retrieve data from.
+ * @param[out] data	where to write the pointers.
+ * @param[in] num	maximum number of pointers to pop.
+ * @return the number of pointers which were popped.  Zero if the
+ *	queue is empty.
+ */
+size_t fr_atomic_queue_pop_n(fr_atomic_queue_t *aq, void **data, size_t num)
+{
+	int64_t tail;
+	size_t	i, n;
+
+	if (num == 0) return 0;
+
+	tail = load(aq->tail);
+
+	for (;;) {
+		int64_t seq, diff;
+
+		seq = aquire(aq->entry[ tail % aq->size ].seq);
+		diff = (seq - (tail + 1));
+
+		/*
+		 *	The queue is empty.
+		 */
+		if (diff < 0) return 0;
+
+		if (diff > 0) {
+			tail = load(aq->tail);
+			continue;
+		}
+
+		/*
+		 *	The first entry is ready.  See how many of the
+		 *	following ones are ready, too.
+		 */
+		for (i = 1; i < num; i++) {
+			if (aquire(aq->entry[ (tail + i) % aq->size ].seq) != (int64_t) (tail + i + 1)) break;
+		}
+
+		if (atomic_compare_exchange_strong_explicit(&aq->tail, &tail, tail + i,
+							    memory_order_release, memory_order_relaxed)) {
+			n = i;
+			break;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		fr_atomic_queue_entry_t *entry = &aq->entry[ (tail + i) % aq->size ];
+
+		data[i] = entry->data;
+		store(entry->seq, tail + i + aq->size);
+	}
+
+	return n;
+}
+
+
+/** Push a pointer into an atomic queue which has only one producer
+ *
+ * The entries use the same sequence numbers as fr_atomic_queue_push(),
+ * so the single producer's entries can be read either by any number of
+ * consumers calling fr_atomic_queue_pop(), or by one consumer calling
+ * fr_atomic_queue_spsc_pop().  But as there is only one writer, the
+ * head doesn't need a CAS.
+ *
+ * @note The caller MUST ensure that only one thread ever pushes to
+ *	the queue, with any push function.  An SPSC push racing
+ *	fr_atomic_queue_push() or fr_atomic_queue_push_n() in another
+ *	thread corrupts the queue.
+ *
+ * @param[in] aq	The atomic queue to add data to.
+ * @param[in] data	to push.
+ * @return
+ *	- true on successful push
+ *	- false on queue full
+ */
+bool fr_atomic_queue_spsc_push(fr_atomic_queue_t *aq, void *data)
+{
+	int64_t head;
+	fr_atomic_queue_entry_t *entry;
+
+	if (!data) return false;
+
+	head = load(aq->head);
+	entry = &aq->entry[ head % aq->size ];
+
+	/*
+	 *	The consumer hasn't finished with this entry, so the
+	 *	queue is full.
+	 */
+	if (aquire(entry->seq) != head) return false;
+
+	entry->data = data;
+	store(entry->seq, head + 1);
+	store(aq->head, head + 1);
+
+	return true;
+}
+
+
+/** Push multiple pointers into an atomic queue which has only one producer
+ *
+ * @note The caller MUST ensure that only one thread ever pushes to
+ *	the queue, with any push function.  See fr_atomic_queue_spsc_push().
+ *
+ * @param[in] aq	The atomic queue to add data to.
+ * @param[in] data	array of pointers to push.  Pushing stops at
+ *			the first NULL pointer.
+ * @param[in] num	number of pointers in the array.
+ * @return the number of pointers which were pushed.  Zero if the
+ *	queue is full.
+ */
+size_t fr_atomic_queue_spsc_push_n(fr_atomic_queue_t *aq, void * const *data, size_t num)
+{
+	int64_t head;
+	size_t	i;
+
+	head = load(aq->head);
+
+	for (i = 0; (i < num) && data[i]; i++) {
+		fr_atomic_queue_entry_t *entry = &aq->entry[ (head + i) % aq->size ];
+
+		if (aquire(entry->seq) != (int64_t) (head + i)) break;
+
+		entry->data = data[i];
+		store(entry->seq, head + i + 1);
+	}
+
+	if (i > 0) store(aq->head, head + i);
+
+	return i;
+}
+
+
+/** Pop a pointer from an atomic queue which has only one consumer
+ *
+ * The entries may have been pushed either by any number of producers
+ * calling fr_atomic_queue_push(), or by one producer calling
+ * fr_atomic_queue_spsc_push().  But as there is only one reader, the
+ * tail doesn't need a CAS.
+ *
+ * @note The caller MUST ensure that only one thread ever pops from
+ *	the queue, with any pop function.  An SPSC pop racing
+ *	fr_atomic_queue_pop() or fr_atomic_queue_pop_n() in another
+ *	thread corrupts the queue.
+ *
+ * @param[in] aq	the atomic queue to retrieve data from.
+ * @param[out] p_data	where to write the data.
+ * @return
+ *	- true on successful pop
+ *	- false on queue empty
+ */
+bool fr_atomic_queue_spsc_pop(fr_atomic_queue_t *aq, void **p_data)
+{
+	int64_t tail;
+	fr_atomic_queue_entry_t *entry;
+
+	if (!p_data) return false;
+
+	tail = load(aq->tail);
+	entry = &aq->entry[ tail % aq->size ];
+
+	if (aquire(entry->seq) != (tail + 1)) return false;
+
+	*p_data = entry->data;
+	store(entry->seq, tail + aq->size);
+	store(aq->tail, tail + 1);
+
+	return true;
+}
+
+
+/** Pop multiple pointers from an atomic queue which has only one consumer
+ *
+ * @note The caller MUST ensure that only one thread ever pops from
+ *	the queue, with any pop function.  See fr_atomic_queue_spsc_pop().
+ *
+ * @param[in] aq	the atomic queue to retrieve data from.
+ * @param[out] data	where to write the pointers.
+ * @param[in] num	maximum number of pointers to pop.
+ * @return the number of pointers which were popped.  Zero if the
+ *	queue is empty.
+ */
+size_t fr_atomic_queue_spsc_pop_n(fr_atomic_queue_t *aq, void **data, size_t num)
+{
+	int64_t tail;
+	size_t	i;
+
+	tail = load(aq->tail);
+
+	for (i = 0; i < num; i++) {
+		fr_atomic_queue_entry_t *entry = &aq->entry[ (tail + i) % aq->size ];
+
+		if (aquire(entry->seq) != (int64_t) (tail + i + 1)) break;
+
+		data[i] = entry->data;
+		store(entry->seq, tail + i + aq->size);
+	}
+
+	if (i > 0) store(aq->tail, tail + i);
+
+	return i;
+}
+
 size_t fr_atomic_queue_size(fr_atomic_queue_t *aq)
 {
 	return aq->size;
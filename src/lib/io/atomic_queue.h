@@ -55,6 +55,14 @@ typedef struct fr_atomic_queue_s fr_atomic_queue_t;
 fr_atomic_queue_t	*fr_atomic_queue_create(TALLOC_CTX *ctx, size_t size);
 bool			fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data);
 bool			fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data);
+size_t			fr_atomic_queue_push_n(fr_atomic_queue_t *aq, void * const *data, size_t num);
+size_t			fr_atomic_queue_pop_n(fr_atomic_queue_t *aq, void **data, size_t num);
+
+bool			fr_atomic_queue_spsc_push(fr_atomic_queue_t *aq, void *data);
+bool			fr_atomic_queue_spsc_pop(fr_atomic_queue_t *aq, void **p_data);
+size_t			fr_atomic_queue_spsc_push_n(fr_atomic_queue_t *aq, void * const *data, size_t num);
+size_t			fr_atomic_queue_spsc_pop_n(fr_atomic_queue_t *aq, void **data, size_t num);
+
 size_t			fr_atomic_queue_size(fr_atomic_queue_t *aq);
 
 #ifndef NDEBUG
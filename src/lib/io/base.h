@@ -285,6 +285,19 @@ typedef void (*fr_io_data_vnode_t)(fr_listen_t *li, uint32_t fflags);
  */
 typedef int (*fr_io_data_cmp_t)(void const *instance, void *thread_instance, RADCLIENT *client, void const *packet1, void const *packet2);
 
+/**  Hash a packet for the dedup table.
+ *
+ * Packets which compare equal with the fr_io_data_cmp_t function
+ * MUST have the same hash.  The master IO handler mixes in the
+ * source and destination addresses, so this function only needs to
+ * hash the fields of the packet which the comparison function uses.
+ *
+ * @param[in] instance		the context for this function
+ * @param[in] packet		the packet
+ * @return the hash of the packet.
+ */
+typedef uint32_t (*fr_io_data_hash_t)(void const *instance, void const *packet);
+
 /**  Handle an error on the socket.
  *
  *  In general, the only thing to do on errors is to close the
@@ -79,6 +79,14 @@ size_t channel_direction_len = NUM_ELEMENTS(channel_direction);
  */
 #define ATOMIC_QUEUE_SIZE (1024)
 
+/** How many messages we pop from the atomic queue at a time
+ *
+ * Each end of a channel has exactly one reader and one writer, so
+ * we use the SPSC queue operations.  Messages are popped in batches
+ * into the reading end, and received from there in order.
+ */
+#define RECV_BATCH_SIZE (32)
+
 typedef enum fr_channel_signal_t {
 	FR_CHANNEL_SIGNAL_ERROR			= FR_CHANNEL_ERROR,
 	FR_CHANNEL_SIGNAL_DATA_TO_RESPONDER	= FR_CHANNEL_DATA_READY_RESPONDER,
@@ -129,8 +137,16 @@ typedef struct {
 
 	fr_atomic_queue_t	*aq;		//!< The queue of messages - visible only to this channel.
 
+	void			*recv_batch[RECV_BATCH_SIZE];	//!< Messages popped from the other end's queue,
+								///< which we haven't received yet.
+	unsigned int		recv_batch_next;		//!< Next message in recv_batch to receive.
+	unsigned int		recv_batch_num;			//!< Number of messages in recv_batch.
+
 	atomic_bool		active;		//!< Whether the channel is active.
 
+	atomic_bool		reader_sleeping; //!< The thread reading "aq" may be blocked in kevent(),
+						///< and needs a signal to see new messages.
+
 	fr_channel_stats_t	stats;		//!< channel statistics
 } fr_channel_end_t;
 
@@ -147,6 +163,9 @@ struct fr_channel_s {
 
 	bool			same_thread;	//!< are both ends in the same thread?
 
+	fr_time_delta_t		spin_time;	//!< How long each end polls the queues before it sleeps.
+						///< Zero means we always signal the other end.
+
 	fr_channel_end_t	end[2];		//!< Two ends of the channel.
 };
 
@@ -239,11 +258,13 @@ fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *requestor, fr_con
 	ch->end[TO_RESPONDER].stats.last_read_other = now;
 	ch->end[TO_RESPONDER].stats.last_sent_signal = now;
 	atomic_store(&ch->end[TO_RESPONDER].active, true);
+	atomic_store(&ch->end[TO_RESPONDER].reader_sleeping, true);
 
 	ch->end[TO_REQUESTOR].stats.last_write = now;
 	ch->end[TO_REQUESTOR].stats.last_read_other = now;
 	ch->end[TO_REQUESTOR].stats.last_sent_signal = now;
 	atomic_store(&ch->end[TO_REQUESTOR].active, true);
+	atomic_store(&ch->end[TO_REQUESTOR].reader_sleeping, true);
 
 	return ch;
 }
@@ -288,6 +309,68 @@ static int fr_channel_data_ready(fr_channel_t *ch, fr_time_t when, fr_channel_en
 	return fr_control_message_send(end->control, end->rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
 }
 
+/** Signal the other end, unless it's still polling the queue
+ *
+ * In adaptive mode the reader of a queue sets "reader_sleeping"
+ * before it blocks, and then checks the queue one last time.
+ * Whoever clears the flag sends the signal, so one wakeup covers
+ * every message pushed while the reader was asleep.
+ *
+ * @param[in] ch	the channel.
+ * @param[in] when	the data was ready.
+ * @param[in] end	of the channel that the message was written to.
+ * @param[in] which	signal to send.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int channel_signal(fr_channel_t *ch, fr_time_t when, fr_channel_end_t *end, fr_channel_signal_t which)
+{
+	if (ch->spin_time) {
+		/*
+		 *	Order the push to the queue before the check
+		 *	of the flag.  This pairs with the fence in
+		 *	channel_sleeping().
+		 */
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if (!atomic_load_explicit(&end->reader_sleeping, memory_order_relaxed) ||
+		    !atomic_exchange(&end->reader_sleeping, false)) {
+			MPRINT("Coalescing signal to %s\n",
+			       fr_table_str_by_value(channel_direction, end->direction, "<INVALID>"));
+			end->stats.coalesced++;
+			return 0;
+		}
+	}
+
+	return fr_channel_data_ready(ch, when, end, which);
+}
+
+/** Get the next message from a queue, popping a batch if we need more
+ *
+ * Received messages are taken from the batch before the queue is
+ * looked at again, so even if a recv callback re-enters the channel,
+ * messages are always received in order.
+ *
+ * @param[in] end	the reading end, which holds the batch.
+ * @param[in] aq	the queue to read.
+ * @param[out] p_cd	where to write the message.
+ * @return
+ *	- true if there was a message.
+ *	- false if the queue is empty.
+ */
+static inline bool channel_pop(fr_channel_end_t *end, fr_atomic_queue_t *aq, fr_channel_data_t **p_cd)
+{
+	if (end->recv_batch_next == end->recv_batch_num) {
+		end->recv_batch_next = 0;
+		end->recv_batch_num = fr_atomic_queue_spsc_pop_n(aq, end->recv_batch, RECV_BATCH_SIZE);
+		if (!end->recv_batch_num) return false;
+	}
+
+	*p_cd = end->recv_batch[end->recv_batch_next++];
+	return true;
+}
+
 #define IALPHA (8)
 #define RTT(_old, _new) ((_new + ((IALPHA - 1) * _old)) / IALPHA)
 
@@ -330,7 +413,7 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
 	 *	Push the message onto the queue for the other end.  If
 	 *	the push fails, the caller should try another queue.
 	 */
-	if (!fr_atomic_queue_push(requestor->aq, cd)) {
+	if (!fr_atomic_queue_spsc_push(requestor->aq, cd)) {
 		fr_strerror_printf("Failed pushing to atomic queue - full.  Queue contains %zu items",
 				   fr_atomic_queue_size(requestor->aq));
 		while (fr_channel_recv_reply(ch));
@@ -393,7 +476,7 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
 	 *	will pick up the message.
 	 */
 	MPRINT("REQUESTOR SIGNALS\n");
-	(void) fr_channel_data_ready(ch, when, requestor, FR_CHANNEL_SIGNAL_DATA_TO_RESPONDER);
+	(void) channel_signal(ch, when, requestor, FR_CHANNEL_SIGNAL_DATA_TO_RESPONDER);
 	return 0;
 }
 
@@ -418,7 +501,7 @@ bool fr_channel_recv_reply(fr_channel_t *ch)
 	/*
 	 *	It's OK for the queue to be empty.
 	 */
-	if (!fr_atomic_queue_pop(aq, (void **) &cd)) return false;
+	if (!channel_pop(requestor, aq, &cd)) return false;
 
 	/*
 	 *	We want an exponential moving average for round trip
@@ -480,7 +563,7 @@ bool fr_channel_recv_request(fr_channel_t *ch)
 	/*
 	 *	It's OK for the queue to be empty.
 	 */
-	if (!fr_atomic_queue_pop(aq, (void **) &cd)) return false;
+	if (!channel_pop(responder, aq, &cd)) return false;
 
 	fr_assert(cd->live.sequence > responder->ack);
 	fr_assert(cd->live.sequence >= responder->sequence); /* must have more requests than replies */
@@ -531,7 +614,7 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 	cd->live.sequence = sequence;
 	cd->live.ack = responder->ack;
 
-	if (!fr_atomic_queue_push(responder->aq, cd)) {
+	if (!fr_atomic_queue_spsc_push(responder->aq, cd)) {
 		fr_strerror_printf("Failed pushing to atomic queue - full.  Queue contains %zu items",
 				   fr_atomic_queue_size(responder->aq));
 		while (fr_channel_recv_request(ch));
@@ -565,7 +648,7 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 	 *	thread.
 	 */
 	if (responder->stats.outstanding == 0) {
-		(void) fr_channel_data_ready(ch, when, responder, FR_CHANNEL_SIGNAL_DATA_DONE_RESPONDER);
+		(void) channel_signal(ch, when, responder, FR_CHANNEL_SIGNAL_DATA_DONE_RESPONDER);
 		return 0;
 	}
 
@@ -605,7 +688,7 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 #endif
 
 	MPRINT("\tRESPONDER SIGNALS num_outstanding %"PRIu64"\n", responder->stats.outstanding);
-	(void) fr_channel_data_ready(ch, when, responder, FR_CHANNEL_SIGNAL_DATA_TO_REQUESTOR);
+	(void) channel_signal(ch, when, responder, FR_CHANNEL_SIGNAL_DATA_TO_REQUESTOR);
 	return 0;
 }
 
@@ -631,21 +714,65 @@ int fr_channel_null_reply(fr_channel_t *ch)
 
 
 
+/** Tell the writer of a queue that we're about to block
+ *
+ * Sets the flag, and then checks the queue one last time.  Any
+ * message pushed after the check sees the flag, and signals us.
+ *
+ * @param[in] end	whose queue we read.
+ * @param[in] ch	the channel.
+ * @param[in] recv	function which reads one message from the queue.
+ * @return
+ *	- 0 if it's OK to sleep.
+ *	- 1 if there were messages, which have now been received.
+ */
+static int channel_sleeping(fr_channel_end_t *end, fr_channel_t *ch, bool (*recv)(fr_channel_t *ch))
+{
+	atomic_store_explicit(&end->reader_sleeping, true, memory_order_relaxed);
+
+	/*
+	 *	Order the store of the flag before the pop.  This
+	 *	pairs with the fence in channel_signal().
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!recv(ch)) return 0;
+
+	/*
+	 *	We're not going to sleep after all.  If the writer
+	 *	has already cleared the flag, it's also sent a
+	 *	signal, which we'll get the next time we look at
+	 *	the kqueue.
+	 */
+	atomic_store_explicit(&end->reader_sleeping, false, memory_order_relaxed);
+	while (recv(ch));
+
+	return 1;
+}
+
 /** Signal a channel that the responder is sleeping
  *
  * This function should be called from the responders idle loop.
  * i.e. only when it has nothing else to do.
  *
+ * In adaptive mode (see fr_channel_spin_set()) no message is
+ * sent.  Instead the requestor is told that it must signal the
+ * next time it sends a request.
+ *
  * @param[in] ch	the channel to signal we're no longer listening on.
  * @return
  *	- <0 on error
  *	- 0 on success
+ *	- 1 if requests arrived while we were going to sleep.  They
+ *	  have been received, and the caller should not sleep.
  */
 int fr_channel_responder_sleeping(fr_channel_t *ch)
 {
 	fr_channel_end_t *responder;
 	fr_channel_control_t cc;
 
+	if (ch->spin_time) return channel_sleeping(&ch->end[TO_RESPONDER], ch, fr_channel_recv_request);
+
 	responder = &(ch->end[TO_REQUESTOR]);
 
 	/*
@@ -666,6 +793,78 @@ int fr_channel_responder_sleeping(fr_channel_t *ch)
 	return fr_control_message_send(responder->control, responder->rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
 }
 
+/** Signal a channel that the requestor is sleeping
+ *
+ * Only does anything in adaptive mode.  Otherwise the responder
+ * signals every reply, and the requestor doesn't need to say
+ * anything.
+ *
+ * @param[in] ch	the channel to signal we're no longer listening on.
+ * @return
+ *	- 0 on success
+ *	- 1 if replies arrived while we were going to sleep.  They
+ *	  have been received, and the caller should not sleep.
+ */
+int fr_channel_requestor_sleeping(fr_channel_t *ch)
+{
+	if (!ch->spin_time) return 0;
+
+	return channel_sleeping(&ch->end[TO_REQUESTOR], ch, fr_channel_recv_reply);
+}
+
+/** Tell the requestor that the responder is polling the channel again
+ *
+ * Should be called when the responder wakes up after calling
+ * fr_channel_responder_sleeping().  It's not required for
+ * correctness, but it avoids a spurious signal for the next request.
+ *
+ * @param[in] ch	the channel.
+ */
+void fr_channel_responder_awake(fr_channel_t *ch)
+{
+	atomic_store_explicit(&ch->end[TO_RESPONDER].reader_sleeping, false, memory_order_relaxed);
+}
+
+/** Tell the responder that the requestor is polling the channel again
+ *
+ * @param[in] ch	the channel.
+ */
+void fr_channel_requestor_awake(fr_channel_t *ch)
+{
+	atomic_store_explicit(&ch->end[TO_REQUESTOR].reader_sleeping, false, memory_order_relaxed);
+}
+
+/** Enable adaptive signalling on a channel
+ *
+ * Normally every message is followed by a signal to the other
+ * end, which at moderate load means one wakeup per packet.  In
+ * adaptive mode each end polls the queues for up to spin_time
+ * before it sleeps, and signals are only sent to an end which has
+ * declared itself asleep.
+ *
+ * Must be called before the channel is sent to the responder.
+ *
+ * @param[in] ch		the channel.
+ * @param[in] spin_time		how long each end should poll before sleeping.
+ *				Zero disables adaptive mode.
+ */
+void fr_channel_spin_set(fr_channel_t *ch, fr_time_delta_t spin_time)
+{
+	ch->spin_time = spin_time;
+}
+
+/** Return how long the ends of a channel should poll before sleeping
+ *
+ * @param[in] ch	the channel.
+ * @return
+ *	- 0 if the channel isn't in adaptive mode.
+ *	- the spin time.
+ */
+fr_time_delta_t fr_channel_spin_time(fr_channel_t const *ch)
+{
+	return ch->spin_time;
+}
+
 
 /** Service a control-plane message
  *
@@ -763,7 +962,7 @@ fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_c
 	 *	that there is data ready.
 	 */
 	MPRINT("REQUESTOR SIGNALS AFTER CE %d\n", cs);
-	rcode = fr_channel_data_ready(ch, when, requestor, FR_CHANNEL_SIGNAL_DATA_TO_RESPONDER);
+	rcode = channel_signal(ch, when, requestor, FR_CHANNEL_SIGNAL_DATA_TO_RESPONDER);
 	if (rcode < 0) return FR_CHANNEL_ERROR;
 
 	return ce;
@@ -958,11 +1157,35 @@ int fr_channel_signal_open(fr_channel_t *ch)
 	return fr_control_message_send(ch->end[TO_RESPONDER].control, ch->end[TO_RESPONDER].rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
 }
 
+/** Return the number of wakeups sent per packet, in each direction
+ *
+ * @param[in] ch			the channel.
+ * @param[out] to_responder		signals per request sent by the requestor.
+ * @param[out] to_requestor		signals per reply sent by the responder.
+ */
+void fr_channel_wakeups(fr_channel_t const *ch, double *to_responder, double *to_requestor)
+{
+	fr_channel_stats_t const *stats;
+
+	stats = &ch->end[TO_RESPONDER].stats;
+	*to_responder = stats->packets ? ((double) stats->signals) / stats->packets : 0;
+
+	stats = &ch->end[TO_REQUESTOR].stats;
+	*to_requestor = stats->packets ? ((double) stats->signals) / stats->packets : 0;
+}
+
 void fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char const *file, int line)
 {
+	double to_responder, to_requestor;
+
+	fr_channel_wakeups(ch, &to_responder, &to_requestor);
+
+
 	fr_log(log, L_INFO, file, line, "requestor\n");
 	fr_log(log, L_INFO, file, line, "\tsignals sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.signals);
 	fr_log(log, L_INFO, file, line, "\tsignals re-sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.resignals);
+	fr_log(log, L_INFO, file, line, "\tsignals coalesced = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.coalesced);
+	fr_log(log, L_INFO, file, line, "\twakeups per packet = %.3f\n", to_responder);
 	fr_log(log, L_INFO, file, line, "\tkevents checked = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.kevents);
 	fr_log(log, L_INFO, file, line, "\toutstanding = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.outstanding);
 	fr_log(log, L_INFO, file, line, "\tpackets processed = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.packets);
@@ -973,6 +1196,8 @@ void fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char cons
 
 	fr_log(log, L_INFO, file, line, "responder\n");
 	fr_log(log, L_INFO, file, line, "\tsignals sent = %" PRIu64"\n", ch->end[TO_REQUESTOR].stats.signals);
+	fr_log(log, L_INFO, file, line, "\tsignals coalesced = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.coalesced);
+	fr_log(log, L_INFO, file, line, "\twakeups per packet = %.3f\n", to_requestor);
 	fr_log(log, L_INFO, file, line, "\tkevents checked = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.kevents);
 	fr_log(log, L_INFO, file, line, "\tpackets processed = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.packets);
 	fr_log(log, L_INFO, file, line, "\tmessage interval (RTT) = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.message_interval);
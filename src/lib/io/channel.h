@@ -54,9 +54,9 @@ typedef struct fr_listen fr_listen_t;
 #include <freeradius-devel/io/control.h>
 #include <freeradius-devel/io/base.h>
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/kqueue.h>
 
 #include <sys/types.h>
-#include <sys/event.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -80,6 +80,7 @@ typedef struct {
 	uint64_t       		outstanding; 	//!< Number of outstanding requests with no reply.
 	uint64_t		signals;	//!< Number of kevent signals we've sent.
 	uint64_t		resignals;	//!< Number of signals resent.
+	uint64_t		coalesced;	//!< Number of signals skipped, because the other end was polling.
 
 	uint64_t		packets;	//!< Number of actual data packets.
 
@@ -127,12 +128,18 @@ typedef struct {
 		struct {
 			fr_time_t		recv_time;	//!< time original request was received (network -> worker)
 			bool			is_dup;		//!< dup, new, etc.
+			bool			handoff;	//!< was returned by another worker, don't return it again.
+			bool			traced;		//!< sampled for tracing (network -> worker)
 		} request;
 
 		struct {
 			fr_time_delta_t		cpu_time;	//!<  total CPU time, including predicted work, (only worker -> network)
 			fr_time_delta_t		processing_time;  //!< actual processing time for this packet (only worker -> network)
 			fr_time_t		request_time;	//!< timestamp of the request packet
+			fr_time_delta_t		queue_time;	//!< time the request waited before it first ran
+								///< (only worker -> network)
+			void			*handoff;	//!< unprocessed request (fr_channel_data_t) being
+								///< returned to the network for another worker.
 	        } reply;
 	};
 
@@ -170,6 +177,12 @@ int	fr_channel_set_recv_reply(fr_channel_t *ch, void *ctx, fr_channel_recv_callb
 int	fr_channel_set_recv_request(fr_channel_t *ch, void *ctx, fr_channel_recv_callback_t recv_reply) CC_HINT(nonnull(1,3));
 
 int	fr_channel_responder_sleeping(fr_channel_t *ch) CC_HINT(nonnull);
+int	fr_channel_requestor_sleeping(fr_channel_t *ch) CC_HINT(nonnull);
+void	fr_channel_responder_awake(fr_channel_t *ch) CC_HINT(nonnull);
+void	fr_channel_requestor_awake(fr_channel_t *ch) CC_HINT(nonnull);
+
+void		fr_channel_spin_set(fr_channel_t *ch, fr_time_delta_t spin_time) CC_HINT(nonnull);
+fr_time_delta_t	fr_channel_spin_time(fr_channel_t const *ch) CC_HINT(nonnull);
 
 int	fr_channel_service_kevent(fr_channel_t *ch, fr_control_t *c, struct kevent const *kev) CC_HINT(nonnull);
 fr_channel_event_t	fr_channel_service_message(fr_time_t when, fr_channel_t **p_channel, void const *data, size_t data_size) CC_HINT(nonnull);
@@ -187,6 +200,7 @@ void	fr_channel_requestor_uctx_add(fr_channel_t *ch, void *ctx) CC_HINT(nonnull)
 void	*fr_channel_requestor_uctx_get(fr_channel_t *ch) CC_HINT(nonnull);
 
 
+void	fr_channel_wakeups(fr_channel_t const *ch, double *to_responder, double *to_requestor) CC_HINT(nonnull);
 void	fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char const *file, int line);
 
 #ifdef __cplusplus
@@ -30,10 +30,10 @@ RCSID("$Id$")
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/kqueue.h>
 
 #include <fcntl.h>
 #include <string.h>
-#include <sys/event.h>
 
 #define FR_CONTROL_MAX_TYPES	(32)
 
@@ -83,6 +83,12 @@ struct fr_control_s {
 
 	int			pipe[2];       		//!< our pipes
 
+	atomic_bool		signalled;		//!< a wakeup is pending, senders don't need to write
+							///< to the pipe.  Cleared by the receiver before it
+							///< drains the queue.
+
+	fr_control_stats_t	stats;			//!< receiver side statistics
+
 #ifndef NDEBUG
 	uint32_t		armour;			//!< to protect ourself from deletion.
 #endif
@@ -95,7 +101,8 @@ struct fr_control_s {
 static void pipe_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
 {
 	fr_control_t *c = talloc_get_type_abort(uctx, fr_control_t);
-	ssize_t i, num;
+	ssize_t num;
+	uint64_t batch = 0;
 	fr_time_t now;
 	char read_buffer[256];
 	uint8_t	data[256];
@@ -103,14 +110,30 @@ static void pipe_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void
 	num = read(fd, read_buffer, sizeof(read_buffer));
 	if (num <= 0) return;
 
+	/*
+	 *	Clear the flag before draining the queue.  Any
+	 *	message pushed after we've looked at the queue
+	 *	will then see the flag clear, and wake us again.
+	 */
+	atomic_store(&c->signalled, false);
+
+	c->stats.wakeups++;
 	now = fr_time();
 
-	for (i = 0; i < num; i++) {
+	/*
+	 *	Senders only write to the pipe once per batch, so
+	 *	process everything in the queue, not one message
+	 *	per byte read.
+	 */
+	while (true) {
 		uint32_t id = 0;
-		size_t message_size;
+		ssize_t message_size;
 
 		message_size = fr_control_message_pop(c->aq, &id, data, sizeof(data));
-		if (!message_size) return;
+		if (message_size == 0) break;
+		if (message_size < 0) continue;
+
+		batch++;
 
 		if (id >= FR_CONTROL_MAX_TYPES) continue;
 
@@ -118,6 +141,9 @@ static void pipe_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void
 
 		c->type[id].callback(c->type[id].ctx, data, message_size, now);
 	}
+
+	c->stats.messages += batch;
+	if (batch > c->stats.max_batch) c->stats.max_batch = batch;
 }
 
 /** Free a control structure
@@ -358,6 +384,12 @@ int fr_control_message_send(fr_control_t *c, fr_ring_buffer_t *rb, uint32_t id,
 
 	if (fr_control_message_push(c, rb, id, data, data_size) < 0) return -1;
 
+	/*
+	 *	The receiver hasn't yet drained the queue since the
+	 *	last wakeup, so it will see this message too.
+	 */
+	if (atomic_exchange(&c->signalled, true)) return 0;
+
 	while (write(c->pipe[1], ".", 1) == 0) {
 		/* nothing */
 	}
@@ -473,6 +505,16 @@ int fr_control_callback_delete(fr_control_t *c, uint32_t id)
 	return 0;
 }
 
+/** Return the receiver side statistics
+ *
+ * @param[in] c the control structure
+ * @return the statistics.
+ */
+fr_control_stats_t const *fr_control_stats(fr_control_t const *c)
+{
+	return &c->stats;
+}
+
 int fr_control_same_thread(fr_control_t *c)
 {
 	c->same_thread = true;
@@ -44,6 +44,19 @@ extern "C" {
 typedef struct fr_control_s fr_control_t;
 typedef	void (*fr_control_callback_t)(void *ctx, void const *data, size_t data_size, fr_time_t now);
 
+/**
+ *  Receiver side statistics.
+ *
+ *  Messages sent while the receiver has a wakeup pending don't
+ *  cause another one, so messages / wakeups is the average batch.
+ */
+typedef struct {
+	uint64_t		wakeups;		//!< Times the receiver was woken up.
+	uint64_t		messages;		//!< Messages read from the queue, including those
+							///< with no registered callback.
+	uint64_t		max_batch;		//!< Most messages read in one wakeup.
+} fr_control_stats_t;
+
 /*
  *	A suggestion for max # of messages, and max message size.
  */
@@ -73,6 +86,8 @@ int fr_control_callback_delete(fr_control_t *c, uint32_t id) CC_HINT(nonnull);
 
 int fr_control_same_thread(fr_control_t *c);
 
+fr_control_stats_t const *fr_control_stats(fr_control_t const *c) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
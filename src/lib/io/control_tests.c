@@ -0,0 +1,124 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include <freeradius-devel/util/talloc.h>
+
+#include "control.c"
+
+#define TEST_ID_CALLBACK	1
+#define TEST_ID_NONE		2
+
+typedef struct {
+	fr_event_list_t		*el;
+	fr_atomic_queue_t	*aq;
+	fr_control_t		*control;
+	fr_ring_buffer_t	*rb;
+} test_ctx_t;
+
+static void test_callback(void *ctx, UNUSED void const *data, UNUSED size_t data_size, UNUSED fr_time_t now)
+{
+	(*(int *) ctx)++;
+}
+
+static test_ctx_t *test_init(TALLOC_CTX *ctx, int *called)
+{
+	test_ctx_t *t;
+
+	t = talloc_zero(ctx, test_ctx_t);
+
+	t->el = fr_event_list_alloc(t, NULL, NULL);
+	TEST_CHECK(t->el != NULL);
+
+	t->aq = fr_atomic_queue_create(t, 16);
+	TEST_CHECK(t->aq != NULL);
+
+	t->control = fr_control_create(t, t->el, t->aq);
+	TEST_CHECK(t->control != NULL);
+
+	t->rb = fr_ring_buffer_create(t, FR_CONTROL_MAX_MESSAGES * FR_CONTROL_MAX_SIZE);
+	TEST_CHECK(t->rb != NULL);
+
+	TEST_CHECK(fr_control_callback_add(t->control, TEST_ID_CALLBACK, called, test_callback) == 0);
+
+	return t;
+}
+
+/** Run the receiver until it has nothing left to read
+ *
+ */
+static void test_drain(test_ctx_t *t)
+{
+	while (fr_event_corral(t->el, fr_time(), false) > 0) fr_event_service(t->el);
+}
+
+static void test_stats_batch(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	test_ctx_t		*t;
+	fr_control_stats_t const *stats;
+	int			called = 0;
+	uint64_t		data = 0;
+	int			i;
+
+	t = test_init(ctx, &called);
+	stats = fr_control_stats(t->control);
+
+	TEST_CASE("Nothing is counted before the first wakeup");
+	TEST_CHECK(stats->wakeups == 0);
+	TEST_CHECK(stats->messages == 0);
+	TEST_CHECK(stats->max_batch == 0);
+
+	TEST_CASE("Messages sent before the receiver runs share one wakeup");
+	for (i = 0; i < 4; i++) {
+		TEST_CHECK(fr_control_message_send(t->control, t->rb, TEST_ID_CALLBACK, &data, sizeof(data)) == 0);
+	}
+	test_drain(t);
+
+	TEST_CHECK(called == 4);
+	TEST_CHECK(stats->wakeups == 1);
+	TEST_MSG("Expected 1 wakeup, got %" PRIu64, stats->wakeups);
+	TEST_CHECK(stats->messages == 4);
+	TEST_MSG("Expected 4 messages, got %" PRIu64, stats->messages);
+	TEST_CHECK(stats->max_batch == 4);
+
+	TEST_CASE("A smaller batch doesn't lower max_batch");
+	TEST_CHECK(fr_control_message_send(t->control, t->rb, TEST_ID_CALLBACK, &data, sizeof(data)) == 0);
+	test_drain(t);
+
+	TEST_CHECK(called == 5);
+	TEST_CHECK(stats->wakeups == 2);
+	TEST_CHECK(stats->messages == 5);
+	TEST_CHECK(stats->max_batch == 4);
+
+	talloc_free(ctx);
+}
+
+static void test_stats_no_callback(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	test_ctx_t		*t;
+	fr_control_stats_t const *stats;
+	int			called = 0;
+	uint64_t		data = 0;
+
+	t = test_init(ctx, &called);
+	stats = fr_control_stats(t->control);
+
+	TEST_CASE("Messages with no registered callback are still counted");
+	TEST_CHECK(fr_control_message_send(t->control, t->rb, TEST_ID_CALLBACK, &data, sizeof(data)) == 0);
+	TEST_CHECK(fr_control_message_send(t->control, t->rb, TEST_ID_NONE, &data, sizeof(data)) == 0);
+	test_drain(t);
+
+	TEST_CHECK(called == 1);
+	TEST_CHECK(stats->wakeups == 1);
+	TEST_CHECK(stats->messages == 2);
+	TEST_MSG("Expected 2 messages, got %" PRIu64, stats->messages);
+	TEST_CHECK(stats->max_batch == 2);
+
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "Stats - Batch",		test_stats_batch },
+	{ "Stats - No callback",	test_stats_no_callback },
+	{ NULL }
+};
@@ -0,0 +1,8 @@
+TARGET		:= control_tests
+
+SOURCES		:= control_tests.c
+
+TGT_LDLIBS	:= $(LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-io.a
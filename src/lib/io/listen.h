@@ -39,8 +39,26 @@ struct fr_listen {
 
 	bool			connected;		//!< is this for a connected socket?
 	bool			track_duplicates;	//!< do we track duplicate packets?
+	bool			deferred_write;		//!< replies must be kept until the transport is flushed.
+	bool			read_pending;		//!< the transport has buffered packets which
+							///< can be read without waiting for the socket.
+
+	char const		*worker_pool_name;	//!< pool of workers which run our packets.  NULL
+							///< for the server's pool, or the default one.
+	unsigned int		worker_pool;		//!< set from worker_pool_name by the scheduler.
+
+	fr_time_delta_t		reply_queue_time;	//!< for the reply being written, how long the
+							///< request waited before a worker ran it.
+	fr_time_t		reply_done;		//!< for the reply being written, when the worker
+							///< finished with it.
 	size_t			default_message_size;	//!< copied from app_io, but may be changed
 	size_t			num_messages;		//!< for the message ring buffer
+
+	uint64_t		client_cache_hit;	//!< client lookups answered by the master IO cache
+	uint64_t		client_cache_miss;	//!< client lookups which had to walk the trie
+
+	uint64_t		client_rate_limited;	//!< packets over a client's rate limit
+	uint64_t		rate_limited;		//!< packets over the socket's rate limit
 };
 
 /**
@@ -51,6 +69,7 @@ struct fr_async_s {
 	void			*process_inst;		//!< Instance data for the current state machine.
 
 	fr_time_t		recv_time;
+	fr_time_t		run_time;	//!< when the worker first ran the request.
 	fr_event_list_t		*el;
 
 	fr_time_tracking_t	tracking;
@@ -25,6 +25,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/io/load.h>
+#include <freeradius-devel/util/misc.h>
 
 /*
  *	We use *inverse* numbers to avoid numerical calculation issues.
@@ -116,7 +117,13 @@ static void load_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 {
 	fr_load_t *l = uctx;
 	fr_time_t delta;
-	int count;
+	fr_time_t when, late = 0;
+	int count, late_count = 0;
+
+	/*
+	 *	When this timer should have fired.
+	 */
+	when = (l->next < now) ? l->next : now;
 
 	/*
 	 *	Keep track of the overall maximum backlog for the
@@ -158,7 +165,8 @@ static void load_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 	 *	Otherwise, switch to a gated mode where we only send
 	 *	new packets once a reply comes in.
 	 */
-	if (((uint32_t) l->stats.backlog * 1000) < (l->pps * l->config->milliseconds)) {
+	if (l->config->open_loop ||
+	    (((uint32_t) l->stats.backlog * 1000) < (l->pps * l->config->milliseconds))) {
 		l->state = FR_LOAD_STATE_SENDING;
 		l->stats.blocked = false;
 		count = l->config->parallel;
@@ -167,7 +175,8 @@ static void load_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 		/*
 		 *	Limit "count" so that it doesn't over-run backlog.
 		 */
-		if (((uint32_t) ((count + l->stats.backlog) * 1000)) > (l->pps * l->config->milliseconds)) {
+		if (!l->config->open_loop &&
+		    (((uint32_t) ((count + l->stats.backlog) * 1000)) > (l->pps * l->config->milliseconds))) {
 			count = (count + l->stats.backlog) - ((l->pps * l->config->milliseconds) / 1000);
 		}
 
@@ -188,11 +197,17 @@ static void load_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 
 	/*
 	 *	Skip timers if we're too busy.
+	 *
+	 *	In open loop mode, the packets for the skipped timers
+	 *	are still sent, just late.
 	 */
 	l->next += l->delta;
 	if (l->next < now) {
+		late = l->next;
+
 		while ((l->next + l->delta) < now) {
 //			l->stats.skipped += l->count;
+			if (l->config->open_loop) late_count++;
 			l->next += l->delta;
 		}
 	}
@@ -206,7 +221,18 @@ static void load_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 		return;
 	}
 
-	if (count) fr_load_generator_send(l, now, count);
+	if (!l->config->open_loop) {
+		if (count) fr_load_generator_send(l, now, count);
+		return;
+	}
+
+	fr_load_generator_send(l, when, count);
+
+	while (late_count > 0) {
+		fr_load_generator_send(l, late, l->config->parallel);
+		late += l->delta;
+		late_count--;
+	}
 }
 
 
@@ -243,10 +269,88 @@ int fr_load_generator_stop(fr_load_t *l)
 }
 
 
+/** Add a value to a latency histogram
+ *
+ * @param[in] h		the histogram to update.
+ * @param[in] value	to add.  Negative values are counted as zero.
+ */
+void fr_load_histogram_add(fr_load_histogram_t *h, fr_time_delta_t value)
+{
+	uint64_t	v;
+	unsigned int	i, high;
+
+	if (value < 0) value = 0;
+	v = value;
+
+	if (v < (1 << FR_LOAD_HISTOGRAM_SUB_BITS)) {
+		i = v;
+	} else {
+		high = fr_high_bit_pos(v) - 1;
+		i = ((high - FR_LOAD_HISTOGRAM_SUB_BITS + 1) << FR_LOAD_HISTOGRAM_SUB_BITS) +
+		    ((v >> (high - FR_LOAD_HISTOGRAM_SUB_BITS)) & ((1 << FR_LOAD_HISTOGRAM_SUB_BITS) - 1));
+	}
+
+	h->bucket[i]++;
+	h->count++;
+	if (value > h->max) h->max = value;
+}
+
+/** Return the smallest value in a histogram bucket
+ *
+ */
+static uint64_t histogram_bucket_min(unsigned int i)
+{
+	unsigned int high;
+
+	if (i < (1 << FR_LOAD_HISTOGRAM_SUB_BITS)) return i;
+
+	high = (i >> FR_LOAD_HISTOGRAM_SUB_BITS) + FR_LOAD_HISTOGRAM_SUB_BITS - 1;
+
+	return ((uint64_t) ((1 << FR_LOAD_HISTOGRAM_SUB_BITS) + (i & ((1 << FR_LOAD_HISTOGRAM_SUB_BITS) - 1)))) <<
+		(high - FR_LOAD_HISTOGRAM_SUB_BITS);
+}
+
+/** Find a percentile in a latency histogram
+ *
+ * @param[in] h			the histogram to search.
+ * @param[in] percentile	to find, e.g. 99.9.
+ * @return the largest value in the bucket which holds the percentile,
+ *	or 0 if the histogram is empty.
+ */
+fr_time_delta_t fr_load_histogram_percentile(fr_load_histogram_t const *h, double percentile)
+{
+	uint64_t	target, total = 0;
+	unsigned int	i;
+
+	if (!h->count) return 0;
+
+	target = (h->count * percentile) / 100;
+	if (target < 1) target = 1;
+	if (target > h->count) target = h->count;
+
+	for (i = 0; i < FR_LOAD_HISTOGRAM_SIZE; i++) {
+		total += h->bucket[i];
+		if (total < target) continue;
+
+		if ((i + 1) == FR_LOAD_HISTOGRAM_SIZE) break;
+
+		if ((fr_time_delta_t) (histogram_bucket_min(i + 1) - 1) > h->max) break;
+
+		return histogram_bucket_min(i + 1) - 1;
+	}
+
+	return h->max;
+}
+
 /** Tell the load generator that we have a reply to a packet we sent.
  *
+ * @param[in] l			the load generator.
+ * @param[in] request_time	when the request was sent.
+ * @param[in] queue_time	how long the request waited before a worker ran it.
+ * @param[in] reply_done	when the worker finished with the request, or 0 if that isn't known.
  */
-fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_time)
+fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_time,
+					     fr_time_delta_t queue_time, fr_time_t reply_done)
 {
 	fr_time_t now;
 	fr_time_delta_t t;
@@ -264,6 +368,18 @@ fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_tim
 
 	l->stats.received++;
 
+	/*
+	 *	Split the latency into the time waiting for a worker,
+	 *	the time spent running, and the time spent getting
+	 *	the reply back out.
+	 */
+	fr_load_histogram_add(&l->stats.latency, t);
+	if (reply_done) {
+		fr_load_histogram_add(&l->stats.queue, queue_time);
+		fr_load_histogram_add(&l->stats.processing, reply_done - request_time - queue_time);
+		fr_load_histogram_add(&l->stats.write, now - reply_done);
+	}
+
 	/*
 	 *	t is in nanoseconds.
 	 */
@@ -330,7 +446,7 @@ size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer,
 
 	if (!l->header) {
 		l->header = true;
-		return snprintf(buffer, buflen, "\"time\",\"last_packet\",\"rtt\",\"rttvar\",\"pps\",\"pps_accepted\",\"sent\",\"received\",\"backlog\",\"max_backlog\",\"<usec\",\"us\",\"10us\",\"100us\",\"ms\",\"10ms\",\"100ms\",\"s\",\"blocked\"\n");
+		return snprintf(buffer, buflen, "\"time\",\"last_packet\",\"rtt\",\"rttvar\",\"pps\",\"pps_accepted\",\"sent\",\"received\",\"backlog\",\"max_backlog\",\"<usec\",\"us\",\"10us\",\"100us\",\"ms\",\"10ms\",\"100ms\",\"s\",\"blocked\",\"p50\",\"p99\",\"p999\"\n");
 	}
 
 
@@ -357,7 +473,8 @@ size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer,
 			"%d,%d,"
 			"%d,%d,"
 			"%d,%d,%d,%d,%d,%d,%d,%d,"
-			"%d\n",
+			"%d,"
+			"%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
 			now_f, last_send_f,
 			l->stats.rtt, l->stats.rttvar,
 			l->stats.pps, l->stats.pps_accepted,
@@ -365,7 +482,66 @@ size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer,
 			l->stats.backlog, l->stats.max_backlog,
 			l->stats.times[0], l->stats.times[1], l->stats.times[2], l->stats.times[3],
 			l->stats.times[4], l->stats.times[5], l->stats.times[6], l->stats.times[7],
-			l->stats.blocked);
+			l->stats.blocked,
+			fr_load_histogram_percentile(&l->stats.latency, 50),
+			fr_load_histogram_percentile(&l->stats.latency, 99),
+			fr_load_histogram_percentile(&l->stats.latency, 99.9));
+}
+
+/** Print one histogram as a JSON object
+ *
+ */
+static size_t histogram_sprint(fr_load_histogram_t const *h, char const *name, char *buffer, size_t buflen)
+{
+	int len;
+
+	len = snprintf(buffer, buflen,
+		       "\"%s\":{\"count\":%" PRIu64 ",\"p50\":%" PRIu64 ",\"p90\":%" PRIu64
+		       ",\"p99\":%" PRIu64 ",\"p999\":%" PRIu64 ",\"max\":%" PRIu64 "}",
+		       name, h->count,
+		       fr_load_histogram_percentile(h, 50), fr_load_histogram_percentile(h, 90),
+		       fr_load_histogram_percentile(h, 99), fr_load_histogram_percentile(h, 99.9),
+		       h->max);
+	if ((len < 0) || ((size_t) len >= buflen)) return buflen;
+
+	return len;
+}
+
+/** Print a summary of the whole test as one line of JSON
+ *
+ *  All times are in nanoseconds.
+ */
+size_t fr_load_generator_report_sprint(fr_load_t const *l, char *buffer, size_t buflen)
+{
+	char		*p = buffer, *end = buffer + buflen;
+	fr_time_t	end_time;
+	int		len;
+
+	end_time = l->stats.end ? l->stats.end : fr_time();
+
+	len = snprintf(p, end - p,
+		       "{\"duration\":%" PRIu64 ",\"open_loop\":%s,\"pps\":%d,"
+		       "\"sent\":%d,\"received\":%d,\"max_backlog\":%d,",
+		       end_time - l->stats.start, l->config->open_loop ? "true" : "false", l->stats.pps,
+		       l->stats.sent, l->stats.received, l->stats.max_backlog);
+	if ((len < 0) || (len >= (end - p))) return buflen;
+	p += len;
+
+	p += histogram_sprint(&l->stats.latency, "latency", p, end - p);
+	if ((end - p) < 2) return buflen;
+	*(p++) = ',';
+	p += histogram_sprint(&l->stats.queue, "queue", p, end - p);
+	if ((end - p) < 2) return buflen;
+	*(p++) = ',';
+	p += histogram_sprint(&l->stats.processing, "processing", p, end - p);
+	if ((end - p) < 2) return buflen;
+	*(p++) = ',';
+	p += histogram_sprint(&l->stats.write, "write", p, end - p);
+
+	len = snprintf(p, end - p, "}\n");
+	if ((len < 0) || (len >= (end - p))) return buflen;
+
+	return (p + len) - buffer;
 }
 
 fr_load_stats_t const * fr_load_generator_stats(fr_load_t const *l)
@@ -27,6 +27,7 @@ RCSIDH(load_h, "$Id$")
 
 #include <talloc.h>
 #include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/time.h>
 
 /** Load generation configuration.
  *
@@ -68,6 +69,14 @@ RCSIDH(load_h, "$Id$")
  *  "duration" seconds, even if the maximum backlog is currently
  *  reached.  This increase has the effect of also increasing the
  *  maximum backlog.
+ *
+ *  If "open_loop" is set, the backlog is ignored, and packets are
+ *  always sent at the configured rate.  Packets which should have
+ *  been sent while the generator was delayed are sent late, but are
+ *  timestamped with the time they *should* have been sent.  The
+ *  measured latency then includes the time spent waiting to be sent,
+ *  which avoids "coordinated omission", where a stalled server
+ *  causes the generator to stop measuring.
  */
 typedef struct {
 	uint32_t       	start_pps;	//!< start PPS
@@ -76,8 +85,24 @@ typedef struct {
 	uint32_t	step;		//!< how much to increase each load test by
 	uint32_t	parallel;	//!< how many packets in parallel to send
 	uint32_t	milliseconds;	//!< how many milliseconds of backlog to top out at
+	bool		open_loop;	//!< send at the configured rate, no matter what the backlog is
 } fr_load_config_t;
 
+/*
+ *	Latency histogram.  Values below 2^SUB_BITS nanoseconds have
+ *	their own bucket.  Above that, each power of 2 is split into
+ *	2^SUB_BITS linear buckets, so every bucket is within 1/16 of
+ *	the values it counts.
+ */
+#define FR_LOAD_HISTOGRAM_SUB_BITS	(4)
+#define FR_LOAD_HISTOGRAM_SIZE		((64 - FR_LOAD_HISTOGRAM_SUB_BITS + 1) << FR_LOAD_HISTOGRAM_SUB_BITS)
+
+typedef struct {
+	uint64_t	count;		//!< number of values
+	fr_time_delta_t	max;		//!< largest value
+	uint64_t	bucket[FR_LOAD_HISTOGRAM_SIZE];
+} fr_load_histogram_t;
+
 typedef struct {
 	fr_time_t	start;		//! when the test started
 	fr_time_t	end;		//!< when the test ended, due to last reply received
@@ -93,6 +118,11 @@ typedef struct {
 	int		max_backlog;	//!< maximum backlog we saw during the test
 	bool		blocked;	//!< whether or not we're blocked
 	int		times[8];	//!< response time in microseconds to tens of seconds
+
+	fr_load_histogram_t latency;	//!< from when the packet should have been sent, to the reply
+	fr_load_histogram_t queue;	//!< from the request being received, to a worker running it
+	fr_load_histogram_t processing;	//!< from a worker running the request, to it being done
+	fr_load_histogram_t write;	//!< from the worker being done, to the reply being written
 } fr_load_stats_t;
 
 typedef struct fr_load_s fr_load_t;
@@ -115,8 +145,15 @@ int fr_load_generator_start(fr_load_t *l) CC_HINT(nonnull);
 
 int fr_load_generator_stop(fr_load_t *l) CC_HINT(nonnull);
 
-fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_time) CC_HINT(nonnull);
+fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_time,
+					     fr_time_delta_t queue_time, fr_time_t reply_done) CC_HINT(nonnull);
 
 size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer, size_t buflen);
 
+size_t fr_load_generator_report_sprint(fr_load_t const *l, char *buffer, size_t buflen) CC_HINT(nonnull);
+
+void fr_load_histogram_add(fr_load_histogram_t *h, fr_time_delta_t value) CC_HINT(nonnull);
+
+fr_time_delta_t fr_load_histogram_percentile(fr_load_histogram_t const *h, double percentile) CC_HINT(nonnull);
+
 fr_load_stats_t const * fr_load_generator_stats(fr_load_t const *l) CC_HINT(nonnull);
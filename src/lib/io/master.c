@@ -23,6 +23,7 @@
  */
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/master.h>
+#include <freeradius-devel/io/track.h>
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
@@ -31,8 +32,34 @@
 #include <freeradius-devel/unlang/base.h>
 
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/socket.h>
 #include <freeradius-devel/util/syserror.h>
 
+/*
+ *	Number of entries in the per-thread client cache.  MUST be a
+ *	power of 2.
+ */
+#define CLIENT_CACHE_SIZE		(256)
+
+/** A token bucket, for rate limiting packets
+ *
+ *  Tokens are kept in units of 1/NSEC of a packet, so that refilling
+ *  the bucket is one multiplication.
+ */
+typedef struct {
+	uint64_t			tokens;				//!< current tokens, in packet-nanoseconds
+	fr_time_t			last;				//!< when we last refilled the bucket
+} fr_io_token_bucket_t;
+
+/** A cached lookup of a source address in the client trie
+ *
+ */
+typedef struct {
+	fr_ipaddr_t			src_ipaddr;			//!< source address of the packet
+	fr_io_client_t			*client;			//!< the client the trie returned
+	uint64_t			generation;			//!< trie generation when the entry was cached
+} fr_io_client_cache_t;
+
 typedef struct {
 	fr_event_list_t			*el;				//!< event list, for the master socket.
 	fr_network_t			*nr;				//!< network for the master socket
@@ -50,6 +77,13 @@ typedef struct {
 	// @todo - count num_nak_clients, and num_nak_connections, too
 	uint32_t			num_connections;		//!< number of dynamic connections
 	uint32_t			num_pending_packets;   		//!< number of pending packets
+	uint32_t			num_pending_clients;		//!< number of dynamic clients being defined
+
+	uint64_t			generation;			//!< incremented when clients are added to
+									///< or removed from the trie.
+	fr_io_client_cache_t		client_cache[CLIENT_CACHE_SIZE]; //!< direct-mapped cache in front of the trie
+
+	fr_io_token_bucket_t		bucket;				//!< rate limit for all clients of this socket
 } fr_io_thread_t;
 
 /** A saved packet
@@ -90,17 +124,20 @@ struct fr_io_client_s {
 	RADCLIENT			*radclient;	//!< old-style definition of this client
 
 	int				packets;	//!< number of packets using this client
+	uint32_t			outstanding;	//!< number of packets the workers haven't replied to
+	fr_io_token_bucket_t		bucket;		//!< rate limit for this client
 	int				pending_id;	//!< for pending clients
 	int				alive_id;	//!< for all clients
 
 	bool				use_connected;	//!< does this client allow connected sub-sockets?
 	bool				ready_to_delete; //!< are we ready to delete this client?
 	bool				in_trie;	//!< is the client in the trie?
+	bool				lookup;		//!< is the client counted in num_pending_clients?
 
 	fr_io_instance_t const		*inst;		//!< parent instance for master IO handler
 	fr_io_thread_t			*thread;
 	fr_event_timer_t const		*ev;		//!< when we clean up the client
-	rbtree_t			*table;		//!< tracking table for packets
+	fr_io_track_table_t		*table;		//!< tracking table for packets
 
 	fr_heap_t			*pending;	//!< pending packets for this client
 	fr_hash_table_t			*addresses;	//!< list of src/dst addresses used by this client
@@ -148,6 +185,8 @@ static fr_event_update_t resume_read[] = {
 	{ 0 }
 };
 
+static void packet_expiry_timer(fr_event_list_t *el, fr_time_t now, void *uctx);
+
 
 /*
  *  Return negative numbers to put 'one' at the top of the heap.
@@ -247,6 +286,36 @@ static int connection_cmp(void const *one, void const *two)
 }
 
 
+/** Hash a tracking entry
+ *
+ * This must be consistent with track_cmp().  Entries on connected
+ * sockets all have the same address, so we only hash the packet.
+ */
+static uint32_t track_hash(void const *ctx)
+{
+	uint32_t		hash = 0;
+	fr_io_track_t const	*track = ctx;
+	fr_io_client_t const	*client = track->client;
+	fr_app_io_t const	*app_io = client->inst->app_io;
+
+	if (!client->connection) {
+		hash = fr_hash(&track->address->src_ipaddr, sizeof(track->address->src_ipaddr));
+		hash = fr_hash_update(&track->address->src_port, sizeof(track->address->src_port), hash);
+		hash = fr_hash_update(&track->address->if_index, sizeof(track->address->if_index), hash);
+		hash = fr_hash_update(&track->address->dst_ipaddr, sizeof(track->address->dst_ipaddr), hash);
+		hash = fr_hash_update(&track->address->dst_port, sizeof(track->address->dst_port), hash);
+	}
+
+	/*
+	 *	Without a protocol-specific hash, every packet from
+	 *	the same address is in one probe sequence.  That's
+	 *	still correct, just slower.
+	 */
+	if (!app_io->hash) return hash;
+
+	return hash ^ app_io->hash(client->inst->app_io_instance, track->packet);
+}
+
 static int track_cmp(void const *one, void const *two)
 {
 	fr_io_track_t const *a = one;
@@ -375,6 +444,153 @@ error:
 #undef COPY_FIELD
 #undef DUP_FIELD
 
+/** A dynamic client, or a NAK, which is shared by all network threads
+ *
+ */
+typedef struct {
+	fr_ipaddr_t			src_ipaddr;	//!< packets come from this address
+	RADCLIENT			*radclient;	//!< client definition, or NULL for a NAK
+	fr_time_t			expires;	//!< when the entry can no longer be used
+	fr_dlist_t			entry;		//!< oldest entries are at the head
+} fr_io_shared_client_t;
+
+/** Dynamic client definitions shared by all network threads
+ *
+ *  Each network thread has it's own trie of clients.  Without this
+ *  cache, a client would be looked up once for each network thread
+ *  it sends packets to, and a denied client would be looked up again
+ *  on every thread.
+ */
+struct fr_io_shared_s {
+	pthread_mutex_t			mutex;
+	fr_hash_table_t			*ht;		//!< of fr_io_shared_client_t, by src_ipaddr
+	fr_dlist_head_t			list;		//!< of fr_io_shared_client_t, in insertion order
+};
+
+#define SHARED_CLIENTS_MAX	(65536)
+
+static uint32_t shared_client_hash(void const *ctx)
+{
+	fr_io_shared_client_t const *c = ctx;
+
+	return fr_hash(&c->src_ipaddr, sizeof(c->src_ipaddr));
+}
+
+static int shared_client_cmp(void const *one, void const *two)
+{
+	fr_io_shared_client_t const *a = one;
+	fr_io_shared_client_t const *b = two;
+
+	return fr_ipaddr_cmp(&a->src_ipaddr, &b->src_ipaddr);
+}
+
+static int _shared_free(fr_io_shared_t *shared)
+{
+	pthread_mutex_destroy(&shared->mutex);
+	return 0;
+}
+
+static void shared_client_remove(fr_io_shared_t *shared, fr_io_shared_client_t *c)
+{
+	(void) fr_hash_table_delete(shared->ht, c);
+	fr_dlist_remove(&shared->list, c);
+	talloc_free(c);
+}
+
+/** Look up a client in the shared cache
+ *
+ * @param[out] out	a copy of the client definition, allocated in ctx.
+ * @param[in] ctx	to allocate the copy in.
+ * @param[in] shared	cache of clients.
+ * @param[in] address	of the packet.
+ * @param[in] now	the current time.
+ * @return
+ *	- PR_CLIENT_INVALID if there is no entry.
+ *	- PR_CLIENT_NAK if the client is not allowed.
+ *	- PR_CLIENT_DYNAMIC if the client has been defined, and *out is set.
+ */
+static fr_io_client_state_t shared_client_find(RADCLIENT **out, TALLOC_CTX *ctx, fr_io_shared_t *shared,
+					       fr_io_address_t const *address, fr_time_t now)
+{
+	fr_io_shared_client_t my_c, *c;
+	fr_io_client_state_t state = PR_CLIENT_INVALID;
+
+	my_c.src_ipaddr = address->src_ipaddr;
+
+	pthread_mutex_lock(&shared->mutex);
+	c = fr_hash_table_finddata(shared->ht, &my_c);
+	if (!c) goto done;
+
+	if (c->expires <= now) {
+		shared_client_remove(shared, c);
+		goto done;
+	}
+
+	if (!c->radclient) {
+		state = PR_CLIENT_NAK;
+		goto done;
+	}
+
+	MEM(*out = radclient_clone(ctx, c->radclient));
+	state = PR_CLIENT_DYNAMIC;
+
+done:
+	pthread_mutex_unlock(&shared->mutex);
+	return state;
+}
+
+/** Add a client definition, or a NAK, to the shared cache
+ *
+ *  Any existing entry for the same address is replaced.
+ */
+static void shared_client_add(fr_io_shared_t *shared, fr_ipaddr_t const *src_ipaddr,
+			      RADCLIENT const *radclient, fr_time_t expires)
+{
+	fr_io_shared_client_t my_c, *c;
+	fr_time_t now = fr_time();
+
+	my_c.src_ipaddr = *src_ipaddr;
+
+	pthread_mutex_lock(&shared->mutex);
+	c = fr_hash_table_finddata(shared->ht, &my_c);
+	if (c) shared_client_remove(shared, c);
+
+	/*
+	 *	Entries have different lifetimes, so this doesn't
+	 *	catch all of the expired ones.  The rest are removed
+	 *	when they're found, or when the cache is full.
+	 */
+	while ((c = fr_dlist_head(&shared->list)) != NULL) {
+		if ((c->expires > now) && (fr_dlist_num_elements(&shared->list) < SHARED_CLIENTS_MAX)) break;
+
+		shared_client_remove(shared, c);
+	}
+
+	MEM(c = talloc_zero(shared, fr_io_shared_client_t));
+	c->src_ipaddr = *src_ipaddr;
+	c->expires = expires;
+	if (radclient) MEM(c->radclient = radclient_clone(c, radclient));
+
+	if (!fr_hash_table_insert(shared->ht, c)) {
+		talloc_free(c);
+	} else {
+		fr_dlist_insert_tail(&shared->list, c);
+	}
+	pthread_mutex_unlock(&shared->mutex);
+}
+
+/** The client is no longer being defined
+ *
+ */
+static void client_lookup_done(fr_io_client_t *client)
+{
+	if (!client->lookup) return;
+
+	fr_assert(client->thread->num_pending_clients > 0);
+	client->thread->num_pending_clients--;
+	client->lookup = false;
+}
+
 
 /** Count the number of connections used by active clients.
  *
@@ -499,8 +715,7 @@ static fr_io_connection_t *fr_io_connection_alloc(fr_io_instance_t const *inst,
 	 *	#todo - unify the code with static clients?
 	 */
 	if (inst->app_io->track_duplicates) {
-		MEM(connection->client->table = rbtree_talloc_create(client, track_cmp, fr_io_track_t,
-								     NULL, RBTREE_FLAG_NONE));
+		MEM(connection->client->table = fr_io_track_table_alloc(client, track_hash, track_cmp));
 	}
 
 	/*
@@ -825,7 +1040,7 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 	 */
 	memcpy(my_track.packet, packet, sizeof(my_track.packet));
 
-	if (client->inst->app_io->track_duplicates) track = rbtree_finddata(client->table, &my_track);
+	if (client->inst->app_io->track_duplicates) track = fr_io_track_table_find(client->table, &my_track);
 	if (!track) {
 		track = fr_dlist_head(&client->thread->track_list);
 		if (!track) {
@@ -851,6 +1066,18 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 		memcpy(track->packet, packet, sizeof(track->packet));
 		track->timestamp = recv_time;
 		track->packets = 1;
+
+		/*
+		 *	The entry stays in the table until the last
+		 *	packet using it is cleaned up, either by the
+		 *	cleanup_delay timer, or when it's freed.
+		 */
+		if (client->inst->app_io->track_duplicates &&
+		    (fr_io_track_table_insert(client->table, track) < 0)) {
+			talloc_free_children(track);
+			fr_dlist_insert_head(&client->thread->track_list, track);
+			return NULL;
+		}
 		return track;
 	}
 
@@ -955,7 +1182,7 @@ static int pending_free(fr_io_pending_packet_t *pending)
 	if (track->packets == 0) {
 		if (track->client->inst->app_io->track_duplicates) {
 			fr_assert(track->client->table != NULL);
-			(void) rbtree_deletebydata(track->client->table, track);
+			(void) fr_io_track_table_delete(track->client->table, track);
 		}
 
 		track_free(track);
@@ -1017,6 +1244,89 @@ static int8_t alive_client_cmp(void const *one, void const *two)
 	return fr_ipaddr_cmp(&a->src_ipaddr, &b->src_ipaddr);
 }
 
+/** Refill a bucket, and check whether it has a token
+ *
+ *  The token isn't taken, so that a packet which is rejected by
+ *  another bucket doesn't use up this one.  Call #token_bucket_take
+ *  once the packet has been accepted.
+ *
+ * @param[in] bucket	to check.
+ * @param[in] rate	refill rate, in packets per second.
+ * @param[in] burst	maximum number of tokens in the bucket.  Zero means
+ *			the same as rate.
+ * @param[in] now	the current time.
+ * @return
+ *	- true if there is a token, and the packet can be processed.
+ *	- false if the packet is over the limit.
+ */
+static bool token_bucket_check(fr_io_token_bucket_t *bucket, uint32_t rate, uint32_t burst, fr_time_t now)
+{
+	uint64_t	max;
+	fr_time_delta_t	elapsed;
+
+	if (!burst) burst = rate;
+	max = ((uint64_t) burst) * NSEC;
+
+	/*
+	 *	New buckets start off full.  If the bucket would have
+	 *	filled up by now, don't bother multiplying, which
+	 *	might overflow.
+	 */
+	elapsed = now - bucket->last;
+	if (!bucket->last || (now < bucket->last) || (elapsed >= (max / rate))) {
+		bucket->tokens = max;
+	} else {
+		bucket->tokens += elapsed * rate;
+		if (bucket->tokens > max) bucket->tokens = max;
+	}
+	bucket->last = now;
+
+	return (bucket->tokens >= NSEC);
+}
+
+/** Take a token from a bucket which #token_bucket_check said has one
+ *
+ */
+static inline void token_bucket_take(fr_io_token_bucket_t *bucket)
+{
+	bucket->tokens -= NSEC;
+}
+
+/** Find the client for a source address, checking the cache before the trie
+ *
+ *  Each entry records the trie generation when it was filled.  Adding
+ *  or removing a client bumps the generation, so stale entries never
+ *  match, and we don't have to find and clear them.
+ */
+static fr_io_client_t *client_cache_lookup(fr_io_thread_t *thread, fr_ipaddr_t const *ipaddr)
+{
+	uint32_t		hash;
+	fr_io_client_cache_t	*entry;
+
+	if (ipaddr->af == AF_INET) {
+		hash = fr_hash(&ipaddr->addr.v4, sizeof(ipaddr->addr.v4));
+	} else {
+		hash = fr_hash(&ipaddr->addr.v6, sizeof(ipaddr->addr.v6));
+	}
+
+	entry = &thread->client_cache[hash & (CLIENT_CACHE_SIZE - 1)];
+	if (entry->client && (entry->generation == thread->generation) &&
+	    (fr_ipaddr_cmp(&entry->src_ipaddr, ipaddr) == 0)) {
+		thread->listen->client_cache_hit++;
+		return entry->client;
+	}
+
+	thread->listen->client_cache_miss++;
+
+	entry->client = fr_trie_lookup(thread->trie, &ipaddr->addr, ipaddr->prefix);
+	if (!entry->client) return NULL;
+
+	entry->src_ipaddr = *ipaddr;
+	entry->generation = thread->generation;
+
+	return entry->client;
+}
+
 /*
  *	Remove a client from the list of "live" clients.
  *
@@ -1031,8 +1341,11 @@ static int _client_live_free(fr_io_client_t *client)
 
 	if (client->pending) TALLOC_FREE(client->pending);
 
+	client_lookup_done(client);
+
 	(void) fr_trie_remove(client->thread->trie, &client->src_ipaddr.addr, client->src_ipaddr.prefix);
 	(void) fr_heap_extract(client->thread->alive_clients, client);
+	client->thread->generation++;
 
 	return 0;
 }
@@ -1218,6 +1531,13 @@ do_read:
 		 */
 		packet_len = inst->app_io->read(child, (void **) &local_address, &recv_time,
 					  buffer, buffer_len, leftover, priority, is_dup);
+
+		/*
+		 *	Let the network side know if it should call
+		 *	us again without waiting for the socket.
+		 */
+		li->read_pending = child->read_pending;
+
 		if (packet_len <= 0) {
 			return packet_len;
 		}
@@ -1241,6 +1561,17 @@ do_read:
 		}
 		*priority = value;
 
+		/*
+		 *	The workers are falling behind.  Discard low
+		 *	priority packets before we spend any more time
+		 *	on them.
+		 */
+		if (!fr_network_admit(connection ? connection->nr : thread->nr, value)) {
+			DEBUG3("proto_%s - shedding packet from IP %pV, the server is overloaded",
+			       inst->app_io->name, fr_box_ipaddr(address.src_ipaddr));
+			return 0;
+		}
+
 		/*
 		 *	If the connection is pending, pause reading of
 		 *	more packets.  If mod_write() accepts the
@@ -1264,7 +1595,7 @@ do_read:
 	 *	connected socket).
 	 */
 	if (!connection) {
-		client = fr_trie_lookup(thread->trie, &address.src_ipaddr.addr, address.src_ipaddr.prefix);
+		client = client_cache_lookup(thread, &address.src_ipaddr);
 		fr_assert(!client || !client->connection);
 
 	} else {
@@ -1285,6 +1616,68 @@ do_read:
 		return 0;
 	}
 
+	/*
+	 *	Don't let one client use all of the workers.  Only
+	 *	Status-Server (or whatever else is "now") gets
+	 *	through.
+	 */
+	if (client && inst->max_client_outstanding && (accept_fd < 0) &&
+	    (client->outstanding >= inst->max_client_outstanding) && (*priority < PRIORITY_NOW)) {
+		DEBUG3("proto_%s - discarding packet from client %s, it has %u packets outstanding",
+		       inst->app_io->name, client->radclient->shortname, client->outstanding);
+		return 0;
+	}
+
+	/*
+	 *	Rate limit each client, and then all of the clients of
+	 *	this socket together.  This is cheap enough to do for
+	 *	every packet, including retransmissions, which are
+	 *	usually what a misbehaving NAS sends.
+	 *
+	 *	In dry-run mode, we only count the packets we would
+	 *	have discarded.
+	 */
+	if ((inst->max_client_rate || inst->max_rate) && (accept_fd < 0)) {
+		fr_time_t	now = recv_time ? recv_time : fr_time();
+		bool		client_limited = false, socket_limited = false;
+
+		/*
+		 *	Check both buckets before taking a token from
+		 *	either, so a packet rejected by one doesn't use
+		 *	up the other.
+		 */
+		if (client && inst->max_client_rate) {
+			client_limited = !token_bucket_check(&client->bucket, inst->max_client_rate,
+							     inst->max_client_burst, now);
+		}
+		if (inst->max_rate) {
+			socket_limited = !token_bucket_check(&thread->bucket, inst->max_rate, inst->max_burst, now);
+		}
+
+		if (client_limited) {
+			li->client_rate_limited++;
+
+			if (!inst->rate_limit_dry_run) {
+				DEBUG3("proto_%s - discarding packet from client %s, it is over max_client_rate",
+				       inst->app_io->name, client->radclient->shortname);
+				return 0;
+			}
+
+		} else if (socket_limited) {
+			li->rate_limited++;
+
+			if (!inst->rate_limit_dry_run) {
+				DEBUG3("proto_%s - discarding packet from IP %pV, the socket is over max_rate",
+				       inst->app_io->name, fr_box_ipaddr(address.src_ipaddr));
+				return 0;
+			}
+
+		} else {
+			if (client && inst->max_client_rate) token_bucket_take(&client->bucket);
+			if (inst->max_rate) token_bucket_take(&thread->bucket);
+		}
+	}
+
 	/*
 	 *	If there's no client, try to pull one from the global
 	 *	/ static client list.  Or if dynamic clients are
@@ -1336,6 +1729,53 @@ do_read:
 			 */
 			if (network->af == AF_UNSPEC) goto ignore;
 
+			/*
+			 *	Another network thread may have
+			 *	already defined (or denied) this
+			 *	client.  If so, use its answer, and
+			 *	don't run the dynamic client code
+			 *	again.
+			 */
+			state = shared_client_find(&radclient, thread, inst->shared, &address,
+						   recv_time ? recv_time : fr_time());
+			if (state == PR_CLIENT_NAK) {
+				DEBUG3("proto_%s - ignoring packet from client IP address %pV - "
+				       "it is in the negative cache",
+				       inst->app_io->name, fr_box_ipaddr(address.src_ipaddr));
+				if (accept_fd >= 0) close(accept_fd);
+				return 0;
+			}
+
+			/*
+			 *	New connections are defined one by
+			 *	one, so only packets can use the
+			 *	shared definition.
+			 */
+			if ((state == PR_CLIENT_DYNAMIC) && (accept_fd >= 0)) {
+				talloc_free(radclient);
+
+			} else if (state == PR_CLIENT_DYNAMIC) {
+				radclient->src_ipaddr = address.dst_ipaddr;
+				radclient->dynamic = true;
+				radclient->active = true;
+				goto alloc_client;
+			}
+
+			/*
+			 *	Don't let a flood of packets from
+			 *	unknown addresses tie up the dynamic
+			 *	client code, and whatever database
+			 *	it queries.  Connections are limited
+			 *	by max_connections instead.
+			 */
+			if ((accept_fd < 0) && inst->max_pending_clients &&
+			    (thread->num_pending_clients >= inst->max_pending_clients)) {
+				DEBUG("proto_%s - ignoring packet from client IP address %pV - "
+				      "too many dynamic clients are being defined",
+				      inst->app_io->name, fr_box_ipaddr(address.src_ipaddr));
+				return 0;
+			}
+
 			/*
 			 *	Allocate our local radclient as a
 			 *	placeholder for the dynamic client.
@@ -1356,6 +1796,7 @@ do_read:
 			return 0;
 		}
 
+	alloc_client:
 		/*
 		 *	Create our own local client.  This client
 		 *	holds our state which really shouldn't go into
@@ -1402,8 +1843,7 @@ do_read:
 		 */
 		if (inst->app_io->track_duplicates) {
 			fr_assert(inst->app_io->compare != NULL);
-			MEM(client->table = rbtree_talloc_create(client, track_cmp, fr_io_track_t,
-								 NULL, RBTREE_FLAG_NONE));
+			MEM(client->table = fr_io_track_table_alloc(client, track_hash, track_cmp));
 		}
 
 		/*
@@ -1430,6 +1870,12 @@ do_read:
 		}
 
 		client->in_trie = true;
+		thread->generation++;
+
+		if ((state == PR_CLIENT_PENDING) && (accept_fd < 0)) {
+			client->lookup = true;
+			thread->num_pending_clients++;
+		}
 
 		/*
 		 *	Track the live clients so that we can clean
@@ -1552,6 +1998,33 @@ have_client:
 			client->ready_to_delete = false;
 		}
 
+		/*
+		 *	The peer has already answered this packet.
+		 *	Send the same reply, instead of running the
+		 *	packet through the workers again.
+		 */
+		if (inst->replicate && !*is_dup && (client->state != PR_CLIENT_PENDING) &&
+		    (track->packets == 1) && !track->reply_len) {
+			track->reply_len = fr_io_replicate_find(track, &track->reply, inst->replicate,
+								&track->address->src_ipaddr, track->address->src_port,
+								track->packet);
+			if (track->reply_len) {
+				DEBUG("Sending reply from the peer server to ID %d from client %s",
+				      track->packet[1], client->radclient->shortname);
+				(void) inst->app_io->write(child, track, track->timestamp,
+							   track->reply, track->reply_len, 0);
+				packet_expiry_timer(connection ? connection->el : thread->el, 0, track);
+				return 0;
+			}
+		}
+
+		/*
+		 *	The worker will reply to this packet.
+		 *	Duplicates are answered from the tracking
+		 *	table, or discarded.
+		 */
+		if (!*is_dup && (client->state != PR_CLIENT_PENDING)) client->outstanding++;
+
 		/*
 		 *	Return the packet.
 		 */
@@ -1737,6 +2210,15 @@ static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, void *nr)
 		inst->app_io->event_list_set(child, el, nr);
 	}
 
+	/*
+	 *	One network thread reads announcements from the
+	 *	peer, for all of them.
+	 */
+	if (inst->replicate && !connection &&
+	    (fr_io_replicate_event_list_set(inst->replicate, thread, el) < 0)) {
+		PERROR("proto_%s - Failed adding replication socket", inst->app_io->name);
+	}
+
 	/*
 	 *	No dynamic clients AND no packet cleanups?  We don't
 	 *	need timers.
@@ -1950,8 +2432,8 @@ idle_timeout:
 	delay = inst->check_interval;
 
 reset_timer:
-	if (fr_event_timer_in(client, el, &client->ev,
-			      delay, client_expiry_timer, client) < 0) {
+	if (fr_event_timer_coarse_in(client, el, &client->ev,
+				     delay, client_expiry_timer, client) < 0) {
 		ERROR("proto_%s - Failed adding timeout for dynamic client %s.  It will be permanent!",
 		      inst->app_io->name, client->radclient->shortname);
 		return;
@@ -1972,9 +2454,9 @@ static void packet_expiry_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 	 *	packets, not just RADIUS ones.
 	 */
 	if (el && !now && inst->cleanup_delay) {
-		if (fr_event_timer_in(client, el, &track->ev,
-				      inst->cleanup_delay,
-				      packet_expiry_timer, track) == 0) {
+		if (fr_event_timer_coarse_in(client, el, &track->ev,
+					     inst->cleanup_delay,
+					     packet_expiry_timer, track) == 0) {
 			return;
 		}
 
@@ -1999,7 +2481,7 @@ static void packet_expiry_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 	track->packets--;
 
 	if (track->packets == 0) {
-		if (inst->app_io->track_duplicates) (void) rbtree_deletebydata(client->table, track);
+		if (inst->app_io->track_duplicates) (void) fr_io_track_table_delete(client->table, track);
 
 		track_free(track);
 	} else {
@@ -2062,6 +2544,8 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 	if (client->state != PR_CLIENT_PENDING) {
 		ssize_t packet_len;
 
+		if (client->outstanding > 0) client->outstanding--;
+
 		/*
 		 *	The request later received a conflicting
 		 *	packet, so we discard this one.
@@ -2102,8 +2586,22 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 		 *	via the underlying transport write.
 		 */
 
+		child->reply_queue_time = li->reply_queue_time;
+		child->reply_done = li->reply_done;
+
 		packet_len = inst->app_io->write(child, track, request_time,
 						 buffer, buffer_len, written);
+
+		/*
+		 *	The transport can't take the reply yet.  The
+		 *	network will try again when the socket is
+		 *	writable, so leave the packet as it is.
+		 */
+		if ((packet_len < 0) && (errno == EWOULDBLOCK)) {
+			client->outstanding++;
+			return packet_len;
+		}
+
 		if (packet_len > 0) {
 			fr_assert(buffer_len == (size_t) packet_len);
 
@@ -2116,6 +2614,12 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 				MEM(track->reply = talloc_memdup(track, buffer, buffer_len));
 				track->reply_len = buffer_len;
 			}
+
+			if (inst->replicate) {
+				fr_io_replicate_send(inst->replicate,
+						     &track->address->src_ipaddr, track->address->src_port,
+						     track->packet, buffer, buffer_len);
+			}
 		} else {
 			track->reply_len = 1; /* don't respond */
 		}
@@ -2156,6 +2660,15 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 		if (client->table) TALLOC_FREE(client->table);
 		fr_assert(client->packets == 0);
 
+		/*
+		 *	Tell the other network threads, so that they
+		 *	don't ask again.
+		 */
+		if (!connection) {
+			client_lookup_done(client);
+			shared_client_add(inst->shared, &client->src_ipaddr, NULL, fr_time() + inst->nak_lifetime);
+		}
+
 		/*
 		 *	If we're a connected UDP socket, allocate a
 		 *	new connection which is the place-holder for
@@ -2357,8 +2870,12 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 		 */
 		client->state = PR_CLIENT_DYNAMIC;
 		client->radclient->active = true;
+
+		shared_client_add(inst->shared, &client->src_ipaddr, client->radclient, fr_time() + inst->idle_timeout);
 	}
 
+	client_lookup_done(client);
+
 	/*
 	 *	Add this client to the master socket, so that
 	 *	mod_read() will see the pending client, pop the
@@ -2399,6 +2916,22 @@ reread:
 	return buffer_len;
 }
 
+/** Write any replies which the child has queued.
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	fr_io_instance_t const *inst;
+	fr_io_connection_t *connection;
+	fr_listen_t *child;
+
+	get_inst(li, &inst, NULL, &connection, &child);
+
+	if (!inst->app_io->flush) return 0;
+
+	return inst->app_io->flush(child);
+}
+
 /** Close the socket.
  *
  */
@@ -2539,6 +3072,12 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 			return -1;
 		}
 
+		MEM(inst->shared = talloc_zero(inst->dynamic_submodule, fr_io_shared_t));
+		(void) pthread_mutex_init(&inst->shared->mutex, NULL);
+		talloc_set_destructor(inst->shared, _shared_free);
+		MEM(inst->shared->ht = fr_hash_table_create(inst->shared, shared_client_hash, shared_client_cmp, NULL));
+		fr_dlist_talloc_init(&inst->shared->list, fr_io_shared_client_t, entry);
+
 		app_process = (fr_app_worker_t const *) inst->dynamic_submodule->module->common;
 
 		/*
@@ -2566,6 +3105,28 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		}
 	}
 
+	/*
+	 *	Share our replies with a peer, and answer duplicates
+	 *	of the packets it has replied to.
+	 */
+	if (inst->replicate_conf.ipaddr.af != AF_UNSPEC) {
+		if (!inst->app_io->track_duplicates) {
+			cf_log_err(conf, "Replication is not supported for \"proto_%s\"", inst->app_io->name);
+			return -1;
+		}
+
+		if (!inst->cleanup_delay) {
+			cf_log_err(conf, "Replication requires 'cleanup_delay' to be set");
+			return -1;
+		}
+
+		inst->replicate = fr_io_replicate_alloc(inst->submodule, &inst->replicate_conf, inst->cleanup_delay);
+		if (!inst->replicate) {
+			cf_log_perr(conf, "Failed opening replication socket");
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -2652,7 +3213,7 @@ fr_trie_t *fr_master_io_network(TALLOC_CTX *ctx, int af, fr_ipaddr_t *allow, fr_
 	 *	And now check denied networks.
 	 */
 	num = talloc_array_length(deny);
-	if (!num) return trie;
+	if (!num) goto done;
 
 	/*
 	 *	Since the default is to deny, you can only add
@@ -2725,6 +3286,14 @@ fr_trie_t *fr_master_io_network(TALLOC_CTX *ctx, int af, fr_ipaddr_t *allow, fr_
 		deny[i].af = AF_UNSPEC;
 	}
 
+done:
+	/*
+	 *	The trie is only looked up from now on, so pack it
+	 *	for faster lookups.  If that fails, the unpacked
+	 *	trie still works.
+	 */
+	(void) fr_trie_freeze(trie);
+
 	return trie;
 }
 
@@ -2758,25 +3327,24 @@ int fr_io_listen_free(fr_listen_t *li)
 	return 0;
 }
 
-int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
-			size_t default_message_size, size_t num_messages)
+/** Open one master listener, and add it to the scheduler
+ *
+ * @param[in] ctx			to allocate the listener in.
+ * @param[in] inst			of the master IO handler.
+ * @param[in] sc			the scheduler.
+ * @param[in] default_message_size	for the message ring buffer.
+ * @param[in] num_messages		for the message ring buffer.
+ * @param[in] shard			which network thread to use, or -1 for "any".
+ * @return
+ *	- NULL on error.
+ *	- the new listener on success.
+ */
+static fr_listen_t *master_io_listen_open(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
+					  size_t default_message_size, size_t num_messages, int shard)
 {
 	fr_listen_t	*li, *child;
 	fr_io_thread_t	*thread;
 
-	/*
-	 *	No IO paths, so we don't initialize them.
-	 */
-	if (!inst->app_io) {
-		fr_assert(!inst->dynamic_clients);
-		return 0;
-	}
-
-	if (!inst->app_io->thread_inst_size) {
-		fr_strerror_printf("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
-		return -1;
-	}
-
 	/*
 	 *	Build the #fr_listen_t.  This describes the complete
 	 *	path data takes from the socket to the decoder and
@@ -2800,6 +3368,7 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	li->app = inst->app;
 	li->app_instance = inst->app_instance;
 	li->server_cs = inst->server_cs;
+	li->worker_pool_name = inst->worker_pool;
 
 	/*
 	 *	Set configurable parameters for message ring buffer.
@@ -2831,6 +3400,7 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	li->thread_instance = thread;
 	li->app_io_instance = inst;
 	li->track_duplicates = inst->app_io->track_duplicates;
+	li->deferred_write = inst->app_io->deferred_write;
 
 	/*
 	 *	The child listener points to the *actual* IO path.
@@ -2879,7 +3449,7 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	if (inst->app_io->open(child) < 0) {
 		cf_log_err(inst->app_io_conf, "Failed opening %s interface", inst->app_io->name);
 		talloc_free(li);
-		return -1;
+		return NULL;
 	}
 
 	li->fd = child->fd;	/* copy this back up */
@@ -2892,9 +3462,10 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	li->name = child->name;
 
 	/*
-	 *	Record which socket we opened.
+	 *	Record which socket we opened.  The other sockets of
+	 *	a reuse_port group share the first one's address.
 	 */
-	if (child->app_io_addr) {
+	if (child->app_io_addr && (shard <= 0)) {
 		fr_listen_t *other;
 
 		other = listen_find_any(thread->child);
@@ -2905,7 +3476,7 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 			ERROR("got socket %d %d\n", child->app_io_addr->port, other->app_io_addr->port);
 
 			talloc_free(li);
-			return -1;
+			return NULL;
 		}
 
 		(void) listen_record(child);
@@ -2915,11 +3486,77 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	 *	Add the socket to the scheduler, where it might end up
 	 *	in a different thread.
 	 */
-	if (!fr_schedule_listen_add(sc, li)) {
-		talloc_free(li);
+	if (shard < 0) {
+		if (!fr_schedule_listen_add(sc, li)) {
+			talloc_free(li);
+			return NULL;
+		}
+	} else {
+		if (!fr_schedule_network_listen_add(sc, li, shard)) {
+			talloc_free(li);
+			return NULL;
+		}
+	}
+
+	return li;
+}
+
+int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
+			size_t default_message_size, size_t num_messages)
+{
+	fr_listen_t	*li;
+	unsigned int	i, num;
+
+	/*
+	 *	No IO paths, so we don't initialize them.
+	 */
+	if (!inst->app_io) {
+		fr_assert(!inst->dynamic_clients);
+		return 0;
+	}
+
+	if (!inst->app_io->thread_inst_size) {
+		fr_strerror_printf("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
 		return -1;
 	}
 
+	num = fr_schedule_num_networks(sc);
+	if (!inst->reuse_port || (num == 1)) {
+		if (!master_io_listen_open(ctx, inst, sc, default_message_size, num_messages, -1)) return -1;
+		return 0;
+	}
+
+	/*
+	 *	Open one socket per network thread, all bound to the
+	 *	same address.  The kernel distributes packets across
+	 *	the sockets, and each network thread then has its own
+	 *	client trie and duplicate detection.
+	 */
+	li = NULL;
+	for (i = 0; i < num; i++) {
+		fr_listen_t *shard;
+
+		shard = master_io_listen_open(ctx, inst, sc, default_message_size, num_messages, i);
+		if (!shard) return -1;
+
+		if (!li) li = shard;
+	}
+
+	/*
+	 *	Ensure that packets from a particular client always
+	 *	go to the same network thread.
+	 */
+	if (inst->steer_by_source) {
+		fr_io_thread_t *thread = talloc_get_type_abort(li->thread_instance, fr_io_thread_t);
+
+		if (!thread->child->app_io_addr ||
+		    (fr_socket_reuseport_steer(li->fd, thread->child->app_io_addr->ipaddr.af, num) < 0)) {
+			PWARN("Failed enabling 'steer_by_source' for %s", li->name);
+		}
+	}
+
+	DEBUG("Opened %u sockets for %s", num, li->name);
+
 	return 0;
 }
 
@@ -2937,6 +3574,7 @@ fr_app_io_t fr_master_app_io = {
 	.read			= mod_read,
 	.write			= mod_write,
 	.inject			= mod_inject,
+	.flush			= mod_flush,
 
 	.open			= mod_open,
 	.close			= mod_close,
@@ -30,6 +30,7 @@ RCSIDH(master_h, "$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/io/schedule.h>
 #include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/replicate.h>
 #include <freeradius-devel/util/trie.h>
 
 #ifdef __cplusplus
@@ -37,6 +38,7 @@ extern "C" {
 #endif
 
 typedef struct fr_io_client_s fr_io_client_t;
+typedef struct fr_io_shared_s fr_io_shared_t;
 
 typedef struct {
 	fr_event_timer_t const		*ev;		//!< when we clean up this tracking entry
@@ -80,7 +82,16 @@ typedef struct {
 
 	uint32_t			max_connections;		//!< maximum number of connections to allow
 	uint32_t			max_clients;			//!< maximum number of dynamic clients to allow
+	uint32_t			max_pending_clients;		//!< maximum number of dynamic clients being defined
+									///< at the same time, on each network thread
 	uint32_t			max_pending_packets;		//!< maximum number of pending packets
+	uint32_t			max_client_outstanding;		//!< maximum number of packets from one client
+									///< which the workers haven't replied to
+	uint32_t			max_client_rate;		//!< packets per second from one client
+	uint32_t			max_client_burst;		//!< packets from one client in a burst
+	uint32_t			max_rate;			//!< packets per second from all clients
+	uint32_t			max_burst;			//!< packets from all clients in a burst
+	bool				rate_limit_dry_run;		//!< only count packets over the rate limits
 
 	fr_time_delta_t			cleanup_delay;			//!< for Access-Request packets
 	fr_time_delta_t			idle_timeout;			//!< for dynamic clients
@@ -88,6 +99,13 @@ typedef struct {
 	fr_time_delta_t			check_interval;			//!< polling for closed sockets
 
 	bool				dynamic_clients;		//!< do we have dynamic clients.
+	bool				reuse_port;			//!< open one socket per network thread
+	bool				steer_by_source;		//!< steer packets by source IP to a socket
+
+	fr_io_replicate_conf_t		replicate_conf;			//!< peer to share replies with
+
+	char const			*worker_pool;			//!< workers which run our packets.  NULL
+									///< for the virtual server's pool.
 
 	CONF_SECTION			*server_cs;			//!< server CS for this listener
 
@@ -107,6 +125,9 @@ typedef struct {
 	char const			*transport;			//!< transport, typically name of IP proto
 
 	fr_trie_t const			*networks;     			//!< trie of allowed networks
+	fr_io_shared_t			*shared;			//!< dynamic clients and NAKs shared by all
+									///< network threads
+	fr_io_replicate_t		*replicate;			//!< replies sent by us, and by the peer
 } fr_io_instance_t;
 
 extern fr_app_io_t fr_master_app_io;
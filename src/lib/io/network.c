@@ -31,8 +31,10 @@ RCSID("$Id$")
 
 #include <talloc.h>
 
+#include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/event.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/probe.h>
 #include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/util/rbtree.h>
 #include <freeradius-devel/util/syserror.h>
@@ -46,6 +48,14 @@ RCSID("$Id$")
 #include <freeradius-devel/io/ring_buffer.h>
 #include <freeradius-devel/io/worker.h>
 
+#include <freeradius-devel/server/trace.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 #define MAX_WORKERS 64
 
 static _Thread_local fr_ring_buffer_t *fr_network_rb;
@@ -57,6 +67,11 @@ typedef struct {
 	fr_time_t		recv_time;
 } fr_network_inject_t;
 
+typedef struct {
+	fr_worker_t		*worker;
+	unsigned int		pool;
+} fr_network_worker_new_t;
+
 /** Associate a worker thread with a network thread
  *
  */
@@ -64,14 +79,33 @@ typedef struct {
 	int32_t			heap_id;		//!< workers are in a heap
 	fr_time_t		cpu_time;		//!< how much CPU time this worker has spent
 	fr_time_t		predicted;		//!< predicted processing time for one packet
+	fr_time_delta_t		latency;		//!< EWMA of the time from request to reply
+	uint64_t		outstanding;		//!< requests sent to this worker without a reply
 
 	bool			blocked;		//!< is this worker blocked?
+	unsigned int		pool;			//!< which worker pool this worker is in
 
 	fr_channel_t		*channel;		//!< channel to the worker
 	fr_worker_t		*worker;		//!< worker pointer
 	fr_io_stats_t		stats;
 } fr_network_worker_t;
 
+/** Worker selection policies
+ *
+ */
+typedef enum {
+	FR_NETWORK_POLICY_CPU = 0,			//!< lowest (predicted) CPU time
+	FR_NETWORK_POLICY_OUTSTANDING,			//!< fewest outstanding requests
+	FR_NETWORK_POLICY_LATENCY,			//!< lowest expected wait (outstanding * latency)
+} fr_network_policy_t;
+
+static fr_table_num_sorted_t const network_policy_table[] = {
+	{ "cpu",		FR_NETWORK_POLICY_CPU		},
+	{ "latency",		FR_NETWORK_POLICY_LATENCY	},
+	{ "outstanding",	FR_NETWORK_POLICY_OUTSTANDING	}
+};
+static size_t network_policy_table_len = NUM_ELEMENTS(network_policy_table);
+
 typedef struct {
 	fr_network_t		*nr;			//!< O(N) issues in talloc
 	int			number;			//!< unique ID
@@ -91,6 +125,11 @@ typedef struct {
 
 	fr_channel_data_t	*pending;		//!< the currently pending partial packet
 	fr_heap_t		*waiting;		//!< packets waiting to be written
+
+	fr_channel_data_t	**held;			//!< replies the transport has queued, but not written.
+	size_t			num_held;		//!< number of entries used in held.
+	size_t			max_held;		//!< number of entries allocated in held.
+	fr_dlist_t		flush_entry;		//!< in the list of sockets which need to be flushed
 	fr_io_stats_t		stats;
 } fr_network_socket_t;
 
@@ -112,6 +151,8 @@ struct fr_network_s {
 
 	bool			started;		//!< Set to true when the first worker is added.
 	bool			suspended;		//!< whether or not we're suspended.
+	bool			draining;		//!< we've stopped reading, and are finishing requests.
+	atomic_bool		drained;		//!< all requests have been finished.
 
 	fr_log_t const		*log;			//!< log destination
 	fr_log_lvl_t		lvl;			//!< debug log level
@@ -125,6 +166,8 @@ struct fr_network_s {
 	fr_event_list_t		*el;			//!< our event list
 
 	fr_heap_t		*replies;		//!< replies from the worker, ordered by priority / origin time
+	fr_dlist_head_t		flush;			//!< sockets which were written to during this pass
+							///< through the event loop.
 
 	fr_io_stats_t		stats;
 
@@ -135,8 +178,24 @@ struct fr_network_s {
 	int			num_blocked;		//!< number of blocked workers
 	int			num_pending_workers;	//!< number of workers we're waiting to start.
 	int			max_workers;		//!< maximum number of allowed workers
+	unsigned int		num_pools;		//!< one more than the highest worker pool.  If
+							///< there's only one, it isn't checked.
 	int			num_sockets;		//!< actually a counter...
 
+	fr_fast_rand_t		rand_ctx;		//!< for picking workers
+
+	fr_network_policy_t	policy;			//!< how we choose which worker gets a request
+
+	fr_time_delta_t		max_queue_delay;	//!< shed low priority packets above this delay
+	size_t			ring_buffer_size;	//!< minimum size of socket ring buffers
+	fr_time_delta_t		queue_delay;		//!< EWMA of the time requests wait in the workers
+							///< before they start running.
+	uint64_t		num_shed;		//!< packets refused by fr_network_admit()
+
+	fr_time_delta_t		spin_time;		//!< maximum time we poll the channels before sleeping
+	fr_time_delta_t		spin_budget;		//!< current time we poll the channels before sleeping
+	bool			sleeping;		//!< we've told the channels that we're sleeping
+
 	int			signal_pipe[2];		//!< Pipe for signalling the worker in an orderly way.
 							///< This is more deterministic than using async signals.
 
@@ -147,6 +206,12 @@ static void fr_network_post_event(fr_event_list_t *el, fr_time_t now, void *uctx
 static int fr_network_pre_event(void *ctx, fr_time_t wake);
 static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s);
 static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int flags, void *ctx);
+static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUSED int flags, void *ctx);
+static void fr_network_error(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUSED int flags,
+			     UNUSED int fd_errno, void *ctx);
+static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd);
+static void fr_network_drain_check(fr_network_t *nr);
+static int fr_network_handoff(fr_network_t *nr, fr_network_worker_t *from, fr_channel_data_t *cd);
 static int8_t reply_cmp(void const *one, void const *two)
 {
 	fr_channel_data_t const *a = one, *b = two;
@@ -266,10 +331,13 @@ int fr_network_directory_add(fr_network_t *nr, fr_listen_t *li)
  *
  * @param nr the network
  * @param worker the worker
+ * @param pool the worker is in.  Packets from a listener are only sent
+ *	to workers in the listener's pool.
  */
-int fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker)
+int fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker, unsigned int pool)
 {
-	fr_ring_buffer_t *rb;
+	fr_ring_buffer_t	*rb;
+	fr_network_worker_new_t	new;
 
 	rb = fr_network_rb_init();
 	if (!rb) return -1;
@@ -277,7 +345,10 @@ int fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker)
 	(void) talloc_get_type_abort(nr, fr_network_t);
 	(void) talloc_get_type_abort(worker, fr_worker_t);
 
-	return fr_control_message_send(nr->control, rb, FR_CONTROL_ID_WORKER, &worker, sizeof(worker));
+	new.worker = worker;
+	new.pool = pool;
+
+	return fr_control_message_send(nr->control, rb, FR_CONTROL_ID_WORKER, &new, sizeof(new));
 }
 
 /** Signal the network to read from a listener
@@ -367,7 +438,7 @@ static void fr_network_unsuspend(fr_network_t *nr)
 		{ 0 }
 	};
 
-	if (!nr->suspended) return;
+	if (!nr->suspended || nr->draining) return;
 
 	(void) rbtree_walk(nr->sockets, RBTREE_IN_ORDER, apply, resume_read);
 	nr->suspended = false;
@@ -401,6 +472,51 @@ static void fr_network_recv_reply(void *ctx, fr_channel_t *ch, fr_channel_data_t
 		worker->predicted = RTT(worker->predicted, cd->reply.processing_time);
 	}
 
+	if (worker->outstanding > 0) worker->outstanding--;
+
+	/*
+	 *	The worker is busy, and gave back a request it hasn't
+	 *	started.  Send it to someone else.
+	 */
+	if (cd->reply.handoff) {
+		fr_channel_data_t *request = cd->reply.handoff;
+
+		if (fr_network_handoff(nr, worker, request) == 0) {
+			fr_message_done(&cd->m);
+			return;
+		}
+
+		/*
+		 *	No one can take it.  Drop the request, and
+		 *	treat this message as an empty reply.
+		 */
+		PERROR("Failed sending returned packet to worker");
+		fr_message_done(&request->m);
+		nr->stats.dropped++;
+	}
+
+	/*
+	 *	The queueing delay is what tells us the workers are
+	 *	falling behind.  Unlike latency, it doesn't include
+	 *	time spent blocked on other systems.
+	 */
+	nr->queue_delay = RTT(nr->queue_delay, cd->reply.queue_time);
+
+	/*
+	 *	The latency includes time spent waiting in the
+	 *	worker's queue, and time spent blocked on other
+	 *	systems.  Neither of those shows up in cpu_time.
+	 */
+	if (cd->reply.request_time) {
+		fr_time_delta_t latency = fr_time() - cd->reply.request_time;
+
+		if (!worker->latency) {
+			worker->latency = latency;
+		} else {
+			worker->latency = RTT(worker->latency, latency);
+		}
+	}
+
 	/*
 	 *	Unblock the worker.
 	 */
@@ -484,6 +600,153 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 	}
 }
 
+/** Compare two workers according to the current selection policy
+ *
+ * @param[in] nr	the network
+ * @param[in] a		the first worker
+ * @param[in] b		the second worker
+ * @return
+ *	- <0 if "a" should be preferred over "b"
+ *	- 0 if they are equivalent
+ *	- >0 if "b" should be preferred over "a"
+ */
+static int8_t worker_cmp(fr_network_t const *nr, fr_network_worker_t const *a, fr_network_worker_t const *b)
+{
+	switch (nr->policy) {
+	case FR_NETWORK_POLICY_OUTSTANDING:
+		if (a->outstanding != b->outstanding) return (a->outstanding > b->outstanding) - (a->outstanding < b->outstanding);
+		break;
+
+	case FR_NETWORK_POLICY_LATENCY:
+	{
+		/*
+		 *	Expected wait for a new request.  An idle
+		 *	worker is always preferred, and a worker we
+		 *	know nothing about is treated as idle.
+		 */
+		fr_time_delta_t wait_a = a->outstanding * a->latency;
+		fr_time_delta_t wait_b = b->outstanding * b->latency;
+
+		if (wait_a != wait_b) return (wait_a > wait_b) - (wait_a < wait_b);
+		if (a->outstanding != b->outstanding) return (a->outstanding > b->outstanding) - (a->outstanding < b->outstanding);
+	}
+		break;
+
+	case FR_NETWORK_POLICY_CPU:
+		break;
+	}
+
+	return (a->cpu_time > b->cpu_time) - (a->cpu_time < b->cpu_time);
+}
+
+/** Send a request which was returned by a busy worker to another worker
+ *
+ * @param[in] nr	the network
+ * @param[in] from	the worker which returned the request
+ * @param[in] cd	the request
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int fr_network_handoff(fr_network_t *nr, fr_network_worker_t *from, fr_channel_data_t *cd)
+{
+	int			i;
+	fr_network_worker_t	*worker, *found = NULL;
+
+	/*
+	 *	Pick the least loaded worker other than the one which
+	 *	gave the request back.
+	 */
+	for (i = 0; i < nr->num_workers; i++) {
+		worker = nr->workers[i];
+		if (worker->blocked || (worker == from) || (worker->pool != from->pool)) continue;
+
+		if (!found || (worker->outstanding < found->outstanding)) found = worker;
+	}
+
+	if (found && (fr_channel_send_request(found->channel, cd) == 0)) {
+		found->stats.in++;
+		found->outstanding++;
+		found->cpu_time += found->predicted;
+		return 0;
+	}
+
+	/*
+	 *	No one else can take it.  Use the normal path, which
+	 *	may send it back to the original worker.  It won't be
+	 *	returned a second time.
+	 */
+	return fr_network_send_request(nr, cd);
+}
+
+/** Decide whether a new packet should be processed, or shed
+ *
+ *  Packets are shed based on how long requests are waiting in the
+ *  workers before they start running, and not on the channels being
+ *  full.  By the time the channels are full, every packet is delayed.
+ *
+ *  Low priority packets (e.g. Accounting-Request) are shed as soon as
+ *  the delay is above max_queue_delay, and normal priority packets
+ *  when it is above twice that.  High priority packets
+ *  (e.g. Access-Request and Status-Server) are never shed here.
+ *
+ *  This function is called by the master IO handler before it spends
+ *  any time tracking or decoding the packet.
+ *
+ * @param[in] nr	the network which read the packet.
+ * @param[in] priority	of the packet, from channel_packet_priority.
+ * @return
+ *	- true if the packet should be processed.
+ *	- false if it should be discarded.
+ */
+bool fr_network_admit(fr_network_t *nr, uint32_t priority)
+{
+	int		i;
+	fr_time_delta_t	limit;
+
+	if (!nr->max_queue_delay || (priority >= PRIORITY_HIGH)) return true;
+
+	limit = nr->max_queue_delay;
+	if (priority >= PRIORITY_NORMAL) limit *= 2;
+
+	if (nr->queue_delay <= limit) return true;
+
+	/*
+	 *	The delay is only updated when replies arrive.  If
+	 *	we've shed everything, there won't be any replies, so
+	 *	forget the old measurement.
+	 */
+	for (i = 0; i < nr->num_workers; i++) {
+		if (nr->workers[i]->outstanding) {
+			nr->num_shed++;
+			return false;
+		}
+	}
+
+	nr->queue_delay = 0;
+	return true;
+}
+
+/** Pick the best unblocked worker in a pool
+ *
+ *  A network has at most MAX_WORKERS workers, so a linear search is
+ *  cheap enough.
+ */
+static fr_network_worker_t *network_pool_worker(fr_network_t *nr, unsigned int pool)
+{
+	int			i;
+	fr_network_worker_t	*worker, *found = NULL;
+
+	for (i = 0; i < nr->num_workers; i++) {
+		worker = nr->workers[i];
+		if (worker->blocked || (worker->pool != pool)) continue;
+
+		if (!found || (worker_cmp(nr, worker, found) < 0)) found = worker;
+	}
+
+	return found;
+}
+
 /** Send a message on the "best" channel.
  *
  * @param nr the network
@@ -496,37 +759,48 @@ static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 	(void) talloc_get_type_abort(nr, fr_network_t);
 
 retry:
-	if (nr->num_workers == 1) {
+	/*
+	 *	The listener is bound to a worker pool, so only its
+	 *	workers can run the request.  If they're all blocked,
+	 *	the packet is dropped, and the other pools carry on.
+	 */
+	if (nr->num_pools > 1) {
+		worker = network_pool_worker(nr, cd->listen->worker_pool);
+		if (!worker) return -1;
+
+	} else if (nr->num_workers == 1) {
 		worker = nr->workers[0];
 		if (worker->blocked) return -1;
 
 	} else if (nr->num_blocked == 0) {
 		uint32_t one, two;
 
-		one = fr_rand() % nr->num_workers;
+		/*
+		 *	Worker selection doesn't need a CSPRNG.
+		 */
+		one = fr_fast_rand(&nr->rand_ctx) % nr->num_workers;
 		do {
-			two = fr_rand() % nr->num_workers;
+			two = fr_fast_rand(&nr->rand_ctx) % nr->num_workers;
 		} while (two == one);
 
-		if (nr->workers[one]->cpu_time < nr->workers[two]->cpu_time) {
+		if (worker_cmp(nr, nr->workers[one], nr->workers[two]) < 0) {
 			worker = nr->workers[one];
 		} else {
 			worker = nr->workers[two];
 		}
 	} else {
 		int i;
-		fr_time_t cpu_time = ~((fr_time_t) 0);
 		fr_network_worker_t *found = NULL;
 
 		/*
-		 *	Some workers are blocked.  Pick an active
-		 *	worker with low CPU time.
+		 *	Some workers are blocked.  Pick the best
+		 *	active worker.
 		 */
 		for (i = 0; i < nr->num_workers; i++) {
 			worker = nr->workers[i];
 			if (worker->blocked) continue;
 
-			if (worker->cpu_time < cpu_time) {
+			if (!found || (worker_cmp(nr, worker, found) < 0)) {
 				found = worker;
 			}
 		}
@@ -556,7 +830,10 @@ retry:
 		goto retry;
 	}
 
+	FR_PROBE2(channel_send, cd->request.recv_time, cd->m.data_size);
+
 	worker->stats.in++;
+	worker->outstanding++;
 
 	/*
 	 *	We're projecting that the worker will use more CPU
@@ -619,6 +896,12 @@ static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int f
 	if (!fr_cond_assert_msg(s->listen->fd == sockfd, "Expected listen->fd (%u) to be equal event fd (%u)",
 				s->listen->fd, sockfd)) return;
 
+	/*
+	 *	Re-adding the write callback resumes reads, so check
+	 *	here, too.
+	 */
+	if (nr->draining) return;
+
 	DEBUG3("Reading data from FD %u", sockfd);
 
 	if (!s->cd) {
@@ -640,13 +923,18 @@ next_message:
 	/*
 	 *	Poll this socket, but not too often.  We have to go
 	 *	service other sockets, too.
+	 *
+	 *	If the transport has already read packets from the
+	 *	socket, then we drain them.  The socket may not become
+	 *	readable again, so we might never be called back.
 	 */
-	if (num_messages > 16) {
+	if ((num_messages > 16) && !s->listen->read_pending) {
 		s->cd = cd;
 		return;
 	}
 
 	cd->request.is_dup = false;
+	cd->request.handoff = false;
 	cd->priority = PRIORITY_NORMAL;
 
 	/*
@@ -662,6 +950,15 @@ next_message:
 	data_size = s->listen->app_io->read(s->listen, &cd->packet_ctx, &cd->request.recv_time,
 					    cd->m.data, cd->m.rb_size, &s->leftover, &cd->priority, &cd->request.is_dup);
 	if (data_size == 0) {
+		/*
+		 *	The transport discarded a packet, but there
+		 *	are more buffered packets.  Go read them.
+		 */
+		if (s->listen->read_pending) {
+			num_messages++;
+			goto next_message;
+		}
+
 		/*
 		 *	Cache the message for later.  This is
 		 *	important for stream sockets, which can do
@@ -688,6 +985,8 @@ next_message:
 	s->cd = NULL;
 
 	DEBUG3("Read %zd byte(s) from FD %u", data_size, sockfd);
+	FR_PROBE4(packet_read, s->number, cd->request.recv_time, cd->m.data, data_size);
+	cd->request.traced = fr_trace_sample();
 	nr->stats.in++;
 	s->stats.in++;
 
@@ -764,6 +1063,24 @@ next_message:
 		num_messages++;
 		goto next_message;
 	}
+
+	/*
+	 *	The transport read multiple packets from the socket,
+	 *	and is holding on to them.  Allocate a new message and
+	 *	go read the next one.
+	 */
+	if (s->listen->read_pending) {
+		cd = (fr_channel_data_t *) fr_message_reserve(s->ms, s->listen->default_message_size);
+		if (!cd) {
+			ERROR("Failed allocating message size %zd! - Closing socket",
+			      s->listen->default_message_size);
+			fr_network_socket_dead(nr, s);
+			return;
+		}
+
+		num_messages++;
+		goto next_message;
+	}
 }
 
 
@@ -812,6 +1129,68 @@ static void fr_network_error(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 }
 
 
+/** Finish with a reply which the transport has accepted
+ *
+ *  Transports which set deferred_write may still be pointing at the
+ *  reply, so we keep it until the transport has been flushed.
+ */
+static void fr_network_reply_done(fr_network_socket_t *s, fr_channel_data_t *cd)
+{
+	if (!s->listen->deferred_write) {
+		fr_message_done(&cd->m);
+		return;
+	}
+
+	if (s->num_held == s->max_held) {
+		s->max_held = s->max_held ? (s->max_held * 2) : 16;
+		MEM(s->held = talloc_realloc(s, s->held, fr_channel_data_t *, s->max_held));
+	}
+
+	s->held[s->num_held++] = cd;
+}
+
+/** Release the replies which the transport has finished with
+ *
+ */
+static void fr_network_held_done(fr_network_socket_t *s)
+{
+	size_t i;
+
+	for (i = 0; i < s->num_held; i++) fr_message_done(&s->held[i]->m);
+	s->num_held = 0;
+}
+
+/** Tell the transport to write any replies it has queued
+ *
+ *  On error, the caller should mark the socket as dead.
+ *
+ * @param[in] nr	the network.
+ * @param[in] s		the socket to flush.
+ * @return
+ *	- <0 on error.
+ *	- 0 if everything has been written.
+ *	- 1 if the socket isn't writable.  We'll be called again when it is.
+ */
+static int fr_network_flush(fr_network_t *nr, fr_network_socket_t *s)
+{
+	int rcode;
+
+	rcode = s->listen->app_io->flush(s->listen);
+	if (rcode > 0) {
+		if (fr_event_fd_insert(nr, nr->el, s->listen->fd,
+				       fr_network_read,
+				       fr_network_write,
+				       fr_network_error,
+				       s) == 0) return 1;
+
+		fr_strerror_printf_push("Failed adding write callback to event loop");
+		rcode = -1;
+	}
+
+	fr_network_held_done(s);
+	return rcode;
+}
+
 /** Write packets to the network.
  *
  * @param el the event list
@@ -828,7 +1207,23 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 
 	(void) talloc_get_type_abort(nr, fr_network_t);
 
-	fr_assert(s->pending != NULL);
+	fr_assert((s->pending != NULL) || (s->num_held > 0));
+
+	/*
+	 *	Finish writing the replies which the transport has
+	 *	queued, before we give it any more.
+	 */
+	if (s->num_held) {
+		int rcode = fr_network_flush(nr, s);
+
+		if (rcode > 0) return;
+
+		if (rcode < 0) {
+			PERROR("Failed flushing socket %d", s->listen->fd);
+			fr_network_socket_dead(nr, s);
+			return;
+		}
+	}
 
 	/*
 	 *	@todo - this code is much the same as in
@@ -840,7 +1235,7 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 	 *	Start with the currently pending message, and then
 	 *	work through the priority heap.
 	 */
-	for (cd = s->pending;
+	for (cd = s->pending ? s->pending : fr_heap_pop(s->waiting);
 	     cd != NULL;
 	     cd = fr_heap_pop(s->waiting)) {
 		int rcode;
@@ -848,9 +1243,13 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 		fr_assert(li == cd->listen);
 		fr_assert(cd->m.status == FR_MESSAGE_LOCALIZED);
 
+		li->reply_queue_time = cd->reply.queue_time;
+		li->reply_done = cd->m.when;
+
 		rcode = li->app_io->write(li, cd->packet_ctx,
 					  cd->reply.request_time,
 					  cd->m.data, cd->m.data_size, 0);
+		FR_PROBE3(packet_write, s->number, cd->reply.request_time, rcode);
 		if (rcode < 0) {
 
 			/*
@@ -894,7 +1293,7 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 		/*
 		 *	Reset for the next message.
 		 */
-		fr_message_done(&cd->m);
+		fr_network_reply_done(s, cd);
 		nr->stats.out++;
 		s->stats.out++;
 
@@ -908,6 +1307,23 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 		}
 	}
 
+	/*
+	 *	Write any replies which the transport has queued.
+	 *	If they can't all be written, then we're called again
+	 *	when the socket is writable.
+	 */
+	if (li->app_io->flush) {
+		int rcode = fr_network_flush(nr, s);
+
+		if (rcode > 0) return;
+
+		if (rcode < 0) {
+			PERROR("Failed flushing socket %d", s->listen->fd);
+			fr_network_socket_dead(nr, s);
+			return;
+		}
+	}
+
 	/*
 	 *	We've successfully written all of the packets.  Remove
 	 *	the write callback.
@@ -929,6 +1345,7 @@ static int _network_socket_free(fr_network_socket_t *s)
 
 	rbtree_deletebydata(nr->sockets, s);
 	rbtree_deletebydata(nr->sockets_by_num, s);
+	if (fr_dlist_entry_in_list(&s->flush_entry)) fr_dlist_remove(&nr->flush, s);
 
 	fr_event_fd_delete(nr->el, s->listen->fd, s->filter);
 
@@ -943,6 +1360,8 @@ static int _network_socket_free(fr_network_socket_t *s)
 		s->pending = NULL;
 	}
 
+	fr_network_held_done(s);
+
 	/*
 	 *	Clean up any queued entries.
 	 */
@@ -994,6 +1413,7 @@ static void fr_network_listen_callback(void *ctx, void const *data, size_t data_
 	if (num_messages < 8) num_messages = 8;
 
 	size = s->listen->default_message_size * num_messages;
+	if (size < nr->ring_buffer_size) size = nr->ring_buffer_size;
 	if (size < (1 << 17)) size = (1 << 17);
 	if (size > (100 * 1024 * 1024)) size = (100 * 1024 * 1024);
 
@@ -1109,21 +1529,33 @@ static void fr_network_worker_started_callback(void *ctx, void const *data, size
 	fr_network_t *nr = ctx;
 	fr_worker_t *worker;
 	fr_network_worker_t *w;
+	fr_network_worker_new_t new;
 
-	fr_assert(data_size == sizeof(worker));
+	fr_assert(data_size == sizeof(new));
 
-	memcpy(&worker, data, data_size);
-	(void) talloc_get_type_abort(worker, fr_worker_t);
+	memcpy(&new, data, data_size);
+	worker = talloc_get_type_abort(new.worker, fr_worker_t);
 
 	MEM(w = talloc_zero(nr, fr_network_worker_t));
 
 	w->worker = worker;
+	w->pool = new.pool;
+	if (new.pool >= nr->num_pools) nr->num_pools = new.pool + 1;
 	w->channel = fr_worker_channel_create(worker, w, nr->control);
 	fr_fatal_assert_msg(w->channel, "Failed creating new channel");
 
 	fr_channel_requestor_uctx_add(w->channel, w);
 	fr_channel_set_recv_reply(w->channel, nr, fr_network_recv_reply);
 
+	/*
+	 *	The workers decide whether or not the channels
+	 *	use adaptive signalling.
+	 */
+	if (fr_channel_spin_time(w->channel) > nr->spin_time) {
+		nr->spin_time = fr_channel_spin_time(w->channel);
+		nr->spin_budget = nr->spin_time;
+	}
+
 	nr->num_workers++;
 	nr->started = true;
 
@@ -1205,13 +1637,13 @@ static int fr_network_pre_event(void *ctx, UNUSED fr_time_t wake)
 static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
 {
 	fr_channel_data_t *cd;
+	fr_network_socket_t *s;
 	fr_network_t *nr = talloc_get_type_abort(uctx, fr_network_t);
 
 	while ((cd = fr_heap_pop(nr->replies)) != NULL) {
 		ssize_t rcode;
 		fr_listen_t *li;
 		fr_message_t *lm;
-		fr_network_socket_t *s;
 
 		li = cd->listen;
 
@@ -1284,9 +1716,13 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 		 *	The write function is responsible for ensuring
 		 *	that NAKs are not written to the network.
 		 */
+		li->reply_queue_time = cd->reply.queue_time;
+		li->reply_done = cd->m.when;
+
 		rcode = li->app_io->write(li, cd->packet_ctx,
 					  cd->reply.request_time,
 					  cd->m.data, cd->m.data_size, 0);
+		FR_PROBE3(packet_write, s->number, cd->reply.request_time, rcode);
 		if (rcode < 0) {
 			s->pending = 0;
 
@@ -1347,7 +1783,7 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 		}
 
 		DEBUG3("Sending reply on FD %u", s->listen->fd);
-		fr_message_done(&cd->m);
+		fr_network_reply_done(s, cd);
 		s->pending = NULL;
 		s->written = 0;
 
@@ -1355,8 +1791,41 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 		 *	As a special case, allow write() to return
 		 *	"0", which means "close the socket".
 		 */
-		if (rcode == 0) fr_network_socket_dead(nr, s);
+		if (rcode == 0) {
+			fr_network_socket_dead(nr, s);
+			continue;
+		}
+
+		/*
+		 *	The transport may have queued the reply, so
+		 *	that it can write many replies at once.
+		 */
+		if (li->app_io->flush && !fr_dlist_entry_in_list(&s->flush_entry)) {
+			fr_dlist_insert_tail(&nr->flush, s);
+		}
+	}
+
+	/*
+	 *	We've drained all of the replies.  Tell the transports
+	 *	to write any replies they've queued.
+	 */
+	while ((s = fr_dlist_head(&nr->flush)) != NULL) {
+		fr_dlist_remove(&nr->flush, s);
+
+		if (s->dead) continue;
+
+		/*
+		 *	Handle failures the same way as
+		 *	fr_network_write() does, so the socket goes
+		 *	through the normal teardown.
+		 */
+		if (fr_network_flush(nr, s) < 0) {
+			PERROR("Failed flushing socket %d", s->listen->fd);
+			fr_network_socket_dead(nr, s);
+		}
 	}
+
+	if (nr->draining) fr_network_drain_check(nr);
 }
 
 /** Stop a network thread in an orderly way
@@ -1446,7 +1915,19 @@ static void _signal_pipe_read(UNUSED fr_event_list_t *el, int fd, UNUSED int fla
 		return;
 	}
 
-	fr_assert(buff = 1);
+	/*
+	 *	Stop reading packets, but keep processing the ones
+	 *	we've already read.
+	 */
+	if (buff == 0x02) {
+		DEBUG2("Signalled to drain");
+		nr->draining = true;
+		fr_network_suspend(nr);
+		fr_network_drain_check(nr);
+		return;
+	}
+
+	fr_assert(buff == 1);
 
 	/*
 	 *	fr_network_stop() will signal the workers
@@ -1462,6 +1943,99 @@ static void _signal_pipe_read(UNUSED fr_event_list_t *el, int fd, UNUSED int fla
 	fr_network_destroy(nr);
 }
 
+/** Check whether a draining network has finished all of its requests
+ *
+ * @param[in] nr	the network
+ */
+static void fr_network_drain_check(fr_network_t *nr)
+{
+	int i;
+
+	if (atomic_load_explicit(&nr->drained, memory_order_relaxed)) return;
+
+	if (fr_heap_num_elements(nr->replies) > 0) return;
+
+	for (i = 0; i < nr->num_workers; i++) {
+		if (nr->workers[i] && nr->workers[i]->outstanding) return;
+	}
+
+	DEBUG2("All requests have been finished");
+	atomic_store_explicit(&nr->drained, true, memory_order_release);
+}
+
+/** Poll the worker channels for a while, and if there's nothing there, tell them we're sleeping
+ *
+ * As with the workers, the time we spend polling doubles every time
+ * we find a reply, and halves every time we don't.  We only poll if
+ * there are requests outstanding, as otherwise no replies can arrive.
+ *
+ * @param[in] nr	the network
+ * @return
+ *	- true if we received replies, and should not sleep.
+ *	- false if it's OK to sleep.
+ */
+static bool fr_network_spin(fr_network_t *nr)
+{
+	int		i;
+	bool		found = false, outstanding = false;
+	fr_time_t	start;
+
+	for (i = 0; i < nr->num_workers; i++) {
+		if (nr->workers[i] && nr->workers[i]->outstanding) {
+			outstanding = true;
+			break;
+		}
+	}
+
+	if (outstanding) {
+		start = fr_time();
+		do {
+			for (i = 0; i < nr->num_workers; i++) {
+				if (!nr->workers[i]) continue;
+
+				while (fr_channel_recv_reply(nr->workers[i]->channel)) found = true;
+			}
+		} while (!found && ((fr_time() - start) < nr->spin_budget));
+
+		if (found) {
+			nr->spin_budget *= 2;
+			if (nr->spin_budget > nr->spin_time) nr->spin_budget = nr->spin_time;
+			return true;
+		}
+
+		nr->spin_budget /= 2;
+		if (nr->spin_budget < (nr->spin_time / 16)) nr->spin_budget = nr->spin_time / 16;
+	}
+
+	/*
+	 *	Tell the workers that they have to wake us up.
+	 */
+	for (i = 0; i < nr->num_workers; i++) {
+		if (!nr->workers[i]) continue;
+
+		if (fr_channel_requestor_sleeping(nr->workers[i]->channel) > 0) found = true;
+	}
+	nr->sleeping = true;
+
+	return found;
+}
+
+/** Tell the worker channels that we're polling them again
+ *
+ * @param[in] nr	the network
+ */
+static void fr_network_awake(fr_network_t *nr)
+{
+	int i;
+
+	for (i = 0; i < nr->num_workers; i++) {
+		if (!nr->workers[i]) continue;
+
+		fr_channel_requestor_awake(nr->workers[i]->channel);
+	}
+	nr->sleeping = false;
+}
+
 /** The main network worker function.
  *
  * @param[in] nr the network data structure to run.
@@ -1478,6 +2052,13 @@ void fr_network(fr_network_t *nr)
 		 */
 		wait_for_event = (fr_heap_num_elements(nr->replies) == 0);
 
+		/*
+		 *	Adaptive signalling.  Poll the channels for a
+		 *	while before sleeping, so that the workers
+		 *	don't have to wake us up for every reply.
+		 */
+		if (wait_for_event && nr->spin_time) wait_for_event = !fr_network_spin(nr);
+
 		/*
 		 *	Check the event list.  If there's an error
 		 *	(e.g. exit), we stop looping and clean up.
@@ -1488,6 +2069,8 @@ void fr_network(fr_network_t *nr)
 		       num_events == -1 ? 0 : num_events, num_events == -1 ? " - event loop exiting" : "");
 		if (num_events < 0) break;
 
+		if (nr->sleeping) fr_network_awake(nr);
+
 		/*
 		 *	Service outstanding events.
 		 */
@@ -1517,6 +2100,40 @@ int fr_network_exit(fr_network_t *nr)
 	return 0;
 }
 
+/** Signal a network thread to stop reading packets
+ *
+ * The network continues processing the requests it has already read,
+ * and writing their replies.  fr_network_drained() says when they're
+ * all done.
+ *
+ * @note Request to drain will be processed asynchronously.
+ *
+ * @param[in] nr the network data structure to manage
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_network_drain(fr_network_t *nr)
+{
+	if (write(nr->signal_pipe[1], &(uint8_t){ 0x02 }, 1) < 0) {
+		fr_strerror_printf("Failed signalling network thread to drain - %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Whether a draining network has finished all of its requests
+ *
+ * May be called from any thread.
+ *
+ * @param[in] nr the network data structure to check
+ */
+bool fr_network_drained(fr_network_t *nr)
+{
+	return atomic_load_explicit(&nr->drained, memory_order_acquire);
+}
+
 /** Free any resources associated with a network thread
  *
  */
@@ -1535,12 +2152,13 @@ static int _fr_network_free(fr_network_t *nr)
  * @param[in] name	Networker identifier.
  * @param[in] logger	The destination for all logging messages
  * @param[in] lvl	Log level
+ * @param[in] config	Optional configuration for the network.
  * @return
  *	- NULL on error
  *	- fr_network_t on success
  */
 fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const *name,
-				fr_log_t const *logger, fr_log_lvl_t lvl)
+				fr_log_t const *logger, fr_log_lvl_t lvl, fr_network_config_t const *config)
 {
 	fr_network_t *nr;
 
@@ -1557,8 +2175,14 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 	nr->lvl = lvl;
 	nr->max_workers = MAX_WORKERS;
 	nr->num_workers = 0;
+	nr->rand_ctx.a = fr_rand();
+	nr->rand_ctx.b = fr_rand();
 	nr->signal_pipe[0] = -1;
 	nr->signal_pipe[1] = -1;
+	if (config) {
+		nr->max_queue_delay = config->max_queue_delay;
+		nr->ring_buffer_size = config->ring_buffer_size;
+	}
 
 	nr->aq_control = fr_atomic_queue_create(nr, 1024);
 	if (!nr->aq_control) {
@@ -1634,6 +2258,8 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 		goto fail2;
 	}
 
+	fr_dlist_talloc_init(&nr->flush, fr_network_socket_t, flush_entry);
+
 	if (fr_event_pre_insert(nr->el, fr_network_pre_event, nr) < 0) {
 		fr_strerror_printf("Failed adding pre-check to event list");
 		goto fail2;
@@ -1692,12 +2318,67 @@ void fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log)
 static int cmd_stats_self(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
 {
 	fr_network_t const *nr = ctx;
+	fr_control_stats_t const *control = fr_control_stats(nr->control);
 
 	fprintf(fp, "count.in\t%" PRIu64 "\n", nr->stats.in);
 	fprintf(fp, "count.out\t%" PRIu64 "\n", nr->stats.out);
 	fprintf(fp, "count.dup\t%" PRIu64 "\n", nr->stats.dup);
 	fprintf(fp, "count.dropped\t%" PRIu64 "\n", nr->stats.dropped);
+	fprintf(fp, "count.shed\t%" PRIu64 "\n", nr->num_shed);
 	fprintf(fp, "count.sockets\t%u\n", rbtree_num_elements(nr->sockets));
+	fprintf(fp, "queue_delay\t%" PRIu64 "\n", (uint64_t) nr->queue_delay);
+	fprintf(fp, "policy\t%s\n", fr_table_str_by_value(network_policy_table, nr->policy, "<INVALID>"));
+	fprintf(fp, "control.wakeups\t%" PRIu64 "\n", control->wakeups);
+	fprintf(fp, "control.messages\t%" PRIu64 "\n", control->messages);
+	fprintf(fp, "control.max_batch\t%" PRIu64 "\n", control->max_batch);
+
+	return 0;
+}
+
+/** Print the network's view of each of its workers
+ *
+ * @todo - note that this isn't thread-safe!
+ */
+void fr_network_workers_print(fr_network_t const *nr, FILE *fp)
+{
+	int i;
+
+	for (i = 0; i < nr->num_workers; i++) {
+		fr_network_worker_t const *worker = nr->workers[i];
+		double to_worker, to_network;
+
+		fr_channel_wakeups(worker->channel, &to_worker, &to_network);
+
+		fprintf(fp, "%d\toutstanding %" PRIu64 "\tlatency %" PRIu64 "\tcpu %" PRIu64
+			"\twakeups %.3f/%.3f%s\n",
+			i, worker->outstanding, (uint64_t) worker->latency, (uint64_t) worker->cpu_time,
+			to_worker, to_network, worker->blocked ? "\tblocked" : "");
+	}
+}
+
+static int cmd_stats_workers(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_network_workers_print(ctx, fp);
+
+	return 0;
+}
+
+static int cmd_set_policy(UNUSED FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
+{
+	fr_network_t *nr = ctx;
+	fr_network_policy_t policy;
+
+	policy = fr_table_value_by_str(network_policy_table, info->argv[0], -1);
+	if ((int) policy < 0) {
+		fprintf(fp_err, "Unknown policy '%s'\n", info->argv[0]);
+		return -1;
+	}
+
+	/*
+	 *	A single aligned write, which the network thread
+	 *	picks up the next time it chooses a worker.
+	 */
+	nr->policy = policy;
 
 	return 0;
 }
@@ -1741,6 +2422,10 @@ static int cmd_stats_socket(FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t con
 	fprintf(fp, "count.out\t%" PRIu64 "\n", s->stats.out);
 	fprintf(fp, "count.dup\t%" PRIu64 "\n", s->stats.dup);
 	fprintf(fp, "count.dropped\t%" PRIu64 "\n", s->stats.dropped);
+	fprintf(fp, "client_cache.hit\t%" PRIu64 "\n", s->listen->client_cache_hit);
+	fprintf(fp, "client_cache.miss\t%" PRIu64 "\n", s->listen->client_cache_miss);
+	fprintf(fp, "rate_limited.client\t%" PRIu64 "\n", s->listen->client_rate_limited);
+	fprintf(fp, "rate_limited.socket\t%" PRIu64 "\n", s->listen->rate_limited);
 
 	return 0;
 }
@@ -1763,6 +2448,15 @@ fr_cmd_table_t cmd_network_table[] = {
 		.read_only = true
 	},
 
+	{
+		.parent = "stats network",
+		.add_name = true,
+		.name = "workers",
+		.func = cmd_stats_workers,
+		.help = "Show worker selection statistics for a specific network thread.",
+		.read_only = true
+	},
+
 	{
 		.parent = "stats network",
 		.add_name = true,
@@ -1790,5 +2484,22 @@ fr_cmd_table_t cmd_network_table[] = {
 		.read_only = true
 	},
 
+	{
+		.parent = "set",
+		.name = "network",
+		.help = "Change network thread settings.",
+		.read_only = false
+	},
+
+	{
+		.parent = "set network",
+		.add_name = true,
+		.name = "policy",
+		.syntax = "(cpu|latency|outstanding)",
+		.func = cmd_set_policy,
+		.help = "Change how the network thread chooses a worker for each request.",
+		.read_only = false
+	},
+
 	CMD_TABLE_END
 };
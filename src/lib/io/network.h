@@ -42,23 +42,38 @@ typedef struct fr_network_s fr_network_t;
 extern "C" {
 #endif
 
+typedef struct {
+	fr_time_delta_t	max_queue_delay;	//!< shed low priority packets when the workers' queueing
+						///< delay is above this.  Zero means never shed.
+
+	size_t		ring_buffer_size;	//!< create socket ring buffers at least this large,
+						///< so they don't need to grow under load.
+} fr_network_config_t;
+
 int		fr_network_listen_add(fr_network_t *nr, fr_listen_t *li) CC_HINT(nonnull);
 
 int		fr_network_socket_delete(fr_network_t *nr, fr_listen_t *li);
 
 int		fr_network_directory_add(fr_network_t *nr, fr_listen_t *li) CC_HINT(nonnull);
 
-int		fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker) CC_HINT(nonnull);
+int		fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker, unsigned int pool) CC_HINT(nonnull);
 
 void		fr_network_listen_read(fr_network_t *nr, fr_listen_t *li) CC_HINT(nonnull);
 
+bool		fr_network_admit(fr_network_t *nr, uint32_t priority) CC_HINT(nonnull);
+
 int		fr_network_listen_inject(fr_network_t *nr, fr_listen_t *li, uint8_t const *packet, size_t packet_len, fr_time_t recv_time);
 
 fr_network_t	*fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el,
-				   char const *nr, fr_log_t const *logger, fr_log_lvl_t lvl) CC_HINT(nonnull(2,4));
+				   char const *nr, fr_log_t const *logger, fr_log_lvl_t lvl,
+				   fr_network_config_t const *config) CC_HINT(nonnull(2,4));
 
 int		fr_network_exit(fr_network_t *nr) CC_HINT(nonnull);
 
+int		fr_network_drain(fr_network_t *nr) CC_HINT(nonnull);
+
+bool		fr_network_drained(fr_network_t *nr) CC_HINT(nonnull);
+
 int		fr_network_destroy(fr_network_t *nr) CC_HINT(nonnull);
 
 void		fr_network(fr_network_t *nr) CC_HINT(nonnull);
@@ -67,6 +82,8 @@ int		fr_network_stats(fr_network_t const *nr, int num, uint64_t *stats) CC_HINT(
 
 void		fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log) CC_HINT(nonnull);
 
+void		fr_network_workers_print(fr_network_t const *nr, FILE *fp) CC_HINT(nonnull);
+
 extern fr_cmd_table_t cmd_network_table[];
 
 #ifdef __cplusplus
@@ -0,0 +1,519 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Share replies with a peer server, so that it can answer duplicates.
+ * @file io/replicate.c
+ *
+ * When two servers share a virtual IP, or a NAS fails over between
+ * them, a retransmitted request can arrive at the server which did
+ * not see the original.  That server would run the whole policy
+ * again, which for accounting means a second copy of the record.
+ *
+ * Each time the master IO layer sends a reply, it announces the
+ * (client, request header, reply) tuple to the peer in one UDP
+ * datagram.  The peer keeps the tuples for cleanup_delay, and answers
+ * a matching request with the same reply, without running it through
+ * the workers.
+ *
+ * Announcements are signed with HMAC-MD5, as they cause us to send
+ * packets.  They are best effort.  If one is lost, the peer just
+ * processes the duplicate as it would have done anyways.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/replicate.h>
+
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/md5.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/socket.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <netinet/in.h>
+#include <pthread.h>
+
+/*
+ *	Layout of an announcement.  All fields are in network byte
+ *	order.  The reply follows the header.
+ */
+#define REPLICATE_VERSION	(1)
+#define REPLICATE_HDR_LEN	(64)
+#define REPLICATE_MAX_REPLY	(4096)
+
+#define REPLICATE_OFF_VERSION	(0)
+#define REPLICATE_OFF_AF	(1)
+#define REPLICATE_OFF_REPLY_LEN	(2)
+#define REPLICATE_OFF_SENDER	(4)
+#define REPLICATE_OFF_ADDR	(8)
+#define REPLICATE_OFF_PORT	(24)
+#define REPLICATE_OFF_PACKET	(26)
+#define REPLICATE_OFF_DIGEST	(46)
+
+/*
+ *	Same limit as for the shared dynamic clients.  All entries
+ *	have the same lifetime, so the oldest is always at the head of
+ *	the list.
+ */
+#define REPLICATE_ENTRIES_MAX	(65536)
+
+/*
+ *	Maximum number of announcements to read on each wakeup.
+ */
+#define REPLICATE_READ_MAX	(64)
+
+/** A reply sent by the peer
+ *
+ */
+typedef struct {
+	uint8_t			af;		//!< of the client.
+	uint8_t			addr[16];	//!< of the client.
+	uint16_t		port;		//!< of the client.
+	uint8_t			packet[20];	//!< request header.
+
+	fr_time_t		expires;	//!< when the entry can no longer be used.
+	uint8_t			*reply;		//!< the peer sent.
+	size_t			reply_len;	//!< length of the reply.
+	fr_dlist_t		entry;		//!< oldest entries are at the head.
+} fr_io_replicate_entry_t;
+
+struct fr_io_replicate_s {
+	int			fd;		//!< for sending and receiving announcements.
+	struct sockaddr_storage	peer;		//!< where we send announcements.
+	socklen_t		peer_len;	//!< length of the peer address.
+	uint32_t		sender;		//!< random ID, so that we ignore our own announcements.
+
+	uint8_t const		*secret;	//!< for signing announcements.
+	size_t			secret_len;	//!< length of the secret.
+	fr_time_delta_t		lifetime;	//!< of received entries.
+
+	pthread_mutex_t		mutex;		//!< the table is shared by all network threads.
+	bool			listening;	//!< the socket has been added to an event list.
+	fr_hash_table_t		*ht;		//!< of fr_io_replicate_entry_t.
+	fr_dlist_head_t		list;		//!< of fr_io_replicate_entry_t, in insertion order.
+};
+
+CONF_PARSER const fr_io_replicate_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, fr_io_replicate_conf_t, ipaddr) },
+	{ FR_CONF_OFFSET("src_ipaddr", FR_TYPE_COMBO_IP_ADDR, fr_io_replicate_conf_t, src_ipaddr) },
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, fr_io_replicate_conf_t, port) },
+	{ FR_CONF_OFFSET("secret", FR_TYPE_STRING | FR_TYPE_SECRET, fr_io_replicate_conf_t, secret) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static uint32_t replicate_hash(void const *ctx)
+{
+	fr_io_replicate_entry_t const *e = ctx;
+	uint32_t hash;
+
+	hash = fr_hash(e->addr, sizeof(e->addr));
+	hash = fr_hash_update(&e->port, sizeof(e->port), hash);
+	return fr_hash_update(e->packet, sizeof(e->packet), hash);
+}
+
+static int replicate_cmp(void const *one, void const *two)
+{
+	fr_io_replicate_entry_t const *a = one;
+	fr_io_replicate_entry_t const *b = two;
+	int rcode;
+
+	rcode = (a->af > b->af) - (a->af < b->af);
+	if (rcode != 0) return rcode;
+
+	rcode = (a->port > b->port) - (a->port < b->port);
+	if (rcode != 0) return rcode;
+
+	rcode = memcmp(a->addr, b->addr, sizeof(a->addr));
+	if (rcode != 0) return rcode;
+
+	return memcmp(a->packet, b->packet, sizeof(a->packet));
+}
+
+/** Fill in the key of an entry
+ *
+ */
+static void replicate_key(fr_io_replicate_entry_t *e, fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
+			  uint8_t const *packet)
+{
+	memset(e, 0, sizeof(*e));
+
+	if (src_ipaddr->af == AF_INET) {
+		e->af = 4;
+		memcpy(e->addr, &src_ipaddr->addr.v4, sizeof(src_ipaddr->addr.v4));
+	} else {
+		e->af = 6;
+		memcpy(e->addr, &src_ipaddr->addr.v6, sizeof(src_ipaddr->addr.v6));
+	}
+	e->port = src_port;
+	memcpy(e->packet, packet, sizeof(e->packet));
+}
+
+static void replicate_remove(fr_io_replicate_t *rep, fr_io_replicate_entry_t *e)
+{
+	(void) fr_hash_table_delete(rep->ht, e);
+	fr_dlist_remove(&rep->list, e);
+	talloc_free(e);
+}
+
+/** Add an entry from the peer, replacing any existing one
+ *
+ */
+static void replicate_add(fr_io_replicate_t *rep, fr_io_replicate_entry_t const *key,
+			  uint8_t const *reply, size_t reply_len)
+{
+	fr_io_replicate_entry_t *e;
+	fr_time_t now = fr_time();
+
+	pthread_mutex_lock(&rep->mutex);
+	e = fr_hash_table_finddata(rep->ht, key);
+	if (e) replicate_remove(rep, e);
+
+	while ((e = fr_dlist_head(&rep->list)) != NULL) {
+		if ((e->expires > now) && (fr_dlist_num_elements(&rep->list) < REPLICATE_ENTRIES_MAX)) break;
+
+		replicate_remove(rep, e);
+	}
+
+	MEM(e = talloc(rep, fr_io_replicate_entry_t));
+	memcpy(e, key, sizeof(*e));
+	e->expires = now + rep->lifetime;
+	MEM(e->reply = talloc_memdup(e, reply, reply_len));
+	e->reply_len = reply_len;
+
+	if (!fr_hash_table_insert(rep->ht, e)) {
+		talloc_free(e);
+	} else {
+		fr_dlist_insert_tail(&rep->list, e);
+	}
+	pthread_mutex_unlock(&rep->mutex);
+}
+
+/** Sign an announcement
+ *
+ * The digest field of the announcement MUST be zero when this is called.
+ */
+static void replicate_sign(uint8_t digest[static MD5_DIGEST_LENGTH], fr_io_replicate_t const *rep,
+			   uint8_t const *data, size_t data_len)
+{
+	fr_hmac_md5(digest, data, data_len, rep->secret, rep->secret_len);
+}
+
+/** Read announcements from the peer
+ *
+ */
+static void replicate_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_io_replicate_t	*rep = talloc_get_type_abort(uctx, fr_io_replicate_t);
+	uint8_t			buffer[REPLICATE_HDR_LEN + REPLICATE_MAX_REPLY];
+	uint8_t			digest[MD5_DIGEST_LENGTH], expected[MD5_DIGEST_LENGTH];
+	fr_io_replicate_entry_t	key;
+	int			i;
+
+	for (i = 0; i < REPLICATE_READ_MAX; i++) {
+		ssize_t		data_len;
+		size_t		reply_len;
+
+		data_len = recv(fd, buffer, sizeof(buffer), 0);
+		if (data_len < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return;
+
+			ERROR("Failed reading replication announcement: %s", fr_syserror(errno));
+			return;
+		}
+
+		if ((size_t) data_len < REPLICATE_HDR_LEN) continue;
+		if (buffer[REPLICATE_OFF_VERSION] != REPLICATE_VERSION) continue;
+		if ((buffer[REPLICATE_OFF_AF] != 4) && (buffer[REPLICATE_OFF_AF] != 6)) continue;
+
+		/*
+		 *	Multicast loopback is off, but another listener
+		 *	on this host may have joined the same group.
+		 */
+		if (memcmp(buffer + REPLICATE_OFF_SENDER, &rep->sender, sizeof(rep->sender)) == 0) continue;
+
+		reply_len = (buffer[REPLICATE_OFF_REPLY_LEN] << 8) | buffer[REPLICATE_OFF_REPLY_LEN + 1];
+		if ((reply_len < 20) || ((size_t) data_len != (REPLICATE_HDR_LEN + reply_len))) continue;
+
+		memcpy(digest, buffer + REPLICATE_OFF_DIGEST, sizeof(digest));
+		memset(buffer + REPLICATE_OFF_DIGEST, 0, MD5_DIGEST_LENGTH);
+		replicate_sign(expected, rep, buffer, data_len);
+		if (fr_digest_cmp(digest, expected, sizeof(digest)) != 0) {
+			DEBUG2("Ignoring replication announcement with invalid signature");
+			continue;
+		}
+
+		memset(&key, 0, sizeof(key));
+		key.af = buffer[REPLICATE_OFF_AF];
+		memcpy(key.addr, buffer + REPLICATE_OFF_ADDR, sizeof(key.addr));
+		key.port = (buffer[REPLICATE_OFF_PORT] << 8) | buffer[REPLICATE_OFF_PORT + 1];
+		memcpy(key.packet, buffer + REPLICATE_OFF_PACKET, sizeof(key.packet));
+
+		replicate_add(rep, &key, buffer + REPLICATE_HDR_LEN, reply_len);
+	}
+}
+
+static void replicate_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno,
+			    UNUSED void *uctx)
+{
+	ERROR("Replication socket failed: %s", fr_syserror(fd_errno));
+}
+
+static int _replicate_free(fr_io_replicate_t *rep)
+{
+	if (rep->fd >= 0) close(rep->fd);
+	pthread_mutex_destroy(&rep->mutex);
+	return 0;
+}
+
+/** Join the peer's multicast group
+ *
+ */
+static int replicate_join(fr_io_replicate_t *rep, fr_io_replicate_conf_t const *conf)
+{
+	int on = 0;
+
+	if (conf->ipaddr.af == AF_INET) {
+		struct ip_mreq mreq;
+
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.imr_multiaddr = conf->ipaddr.addr.v4;
+		if (conf->src_ipaddr.af == AF_INET) mreq.imr_interface = conf->src_ipaddr.addr.v4;
+
+		if (setsockopt(rep->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) goto error;
+		if (setsockopt(rep->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &on, sizeof(on)) < 0) goto error;
+		return 0;
+	}
+
+	{
+		struct ipv6_mreq mreq;
+
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.ipv6mr_multiaddr = conf->ipaddr.addr.v6;
+		mreq.ipv6mr_interface = conf->ipaddr.scope_id;
+
+		if (setsockopt(rep->fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) < 0) goto error;
+		if (setsockopt(rep->fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &on, sizeof(on)) < 0) goto error;
+	}
+	return 0;
+
+error:
+	fr_strerror_printf("Failed joining multicast group: %s", fr_syserror(errno));
+	return -1;
+}
+
+static bool replicate_is_multicast(fr_ipaddr_t const *ipaddr)
+{
+	if (ipaddr->af == AF_INET) return IN_MULTICAST(ntohl(ipaddr->addr.v4.s_addr));
+
+	return IN6_IS_ADDR_MULTICAST(&ipaddr->addr.v6);
+}
+
+/** Open the replication socket
+ *
+ * @param[in] ctx	to allocate the replication state in.
+ * @param[in] conf	of the peer.  conf->ipaddr MUST be set.
+ * @param[in] lifetime	of the entries we receive from the peer.
+ * @return
+ *	- The replication state on success.
+ *	- NULL on error.
+ */
+fr_io_replicate_t *fr_io_replicate_alloc(TALLOC_CTX *ctx, fr_io_replicate_conf_t const *conf,
+					 fr_time_delta_t lifetime)
+{
+	fr_io_replicate_t	*rep;
+	fr_ipaddr_t		src_ipaddr;
+	uint16_t		port = conf->port;
+
+	fr_assert(conf->ipaddr.af != AF_UNSPEC);
+
+	if (!conf->secret || !*conf->secret) {
+		fr_strerror_printf("A 'secret' must be set for replication");
+		return NULL;
+	}
+
+	if (!conf->port) {
+		fr_strerror_printf("A 'port' must be set for replication");
+		return NULL;
+	}
+
+	/*
+	 *	Listen on all addresses unless told otherwise.
+	 *	Multicast announcements are sent to the group
+	 *	address, so we can't bind to a unicast one.
+	 */
+	if (conf->src_ipaddr.af != AF_UNSPEC) {
+		if (conf->src_ipaddr.af != conf->ipaddr.af) {
+			fr_strerror_printf("'ipaddr' and 'src_ipaddr' must be of the same address family");
+			return NULL;
+		}
+		src_ipaddr = conf->src_ipaddr;
+	} else {
+		memset(&src_ipaddr, 0, sizeof(src_ipaddr));
+		src_ipaddr.af = conf->ipaddr.af;
+		src_ipaddr.prefix = (src_ipaddr.af == AF_INET) ? 32 : 128;
+	}
+
+	MEM(rep = talloc_zero(ctx, fr_io_replicate_t));
+	rep->fd = -1;
+	(void) pthread_mutex_init(&rep->mutex, NULL);
+	talloc_set_destructor(rep, _replicate_free);
+
+	MEM(rep->ht = fr_hash_table_create(rep, replicate_hash, replicate_cmp, NULL));
+	fr_dlist_talloc_init(&rep->list, fr_io_replicate_entry_t, entry);
+
+	rep->sender = fr_rand();
+	rep->secret = (uint8_t const *) conf->secret;
+	rep->secret_len = talloc_array_length(conf->secret) - 1;
+	rep->lifetime = lifetime;
+
+	if (fr_ipaddr_to_sockaddr(&conf->ipaddr, conf->port, &rep->peer, &rep->peer_len) < 0) goto error;
+
+	if (replicate_is_multicast(&conf->ipaddr)) {
+		memset(&src_ipaddr.addr, 0, sizeof(src_ipaddr.addr));
+	}
+
+	rep->fd = fr_socket_server_udp(&src_ipaddr, &port, NULL, true);
+	if (rep->fd < 0) goto error;
+
+	if (fr_socket_bind(rep->fd, &src_ipaddr, &port, NULL) < 0) goto error;
+
+	if (replicate_is_multicast(&conf->ipaddr) && (replicate_join(rep, conf) < 0)) goto error;
+
+	return rep;
+
+error:
+	talloc_free(rep);
+	return NULL;
+}
+
+/** Read announcements from the peer in this event list
+ *
+ *  Only one network thread needs to read the socket, as the table is
+ *  shared.  The first one to call this function wins.
+ *
+ * @param[in] rep	the replication state.
+ * @param[in] ctx	the read callback is removed when this is freed.
+ * @param[in] el	to insert the socket into.
+ * @return
+ *	- 0 on success, or if another thread is already reading the socket.
+ *	- -1 on error.
+ */
+int fr_io_replicate_event_list_set(fr_io_replicate_t *rep, TALLOC_CTX *ctx, fr_event_list_t *el)
+{
+	int rcode = 0;
+
+	pthread_mutex_lock(&rep->mutex);
+	if (!rep->listening) {
+		rcode = fr_event_fd_insert(ctx, el, rep->fd, replicate_read, NULL, replicate_error, rep);
+		if (rcode == 0) rep->listening = true;
+	}
+	pthread_mutex_unlock(&rep->mutex);
+
+	return rcode;
+}
+
+/** Tell the peer about a reply we sent
+ *
+ * @param[in] rep		the replication state.
+ * @param[in] src_ipaddr	of the client.
+ * @param[in] src_port		of the client.
+ * @param[in] packet		the first 20 octets of the request.
+ * @param[in] reply		we sent to the client.
+ * @param[in] reply_len		length of the reply.
+ */
+void fr_io_replicate_send(fr_io_replicate_t *rep,
+			  fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
+			  uint8_t const *packet,
+			  uint8_t const *reply, size_t reply_len)
+{
+	uint8_t			buffer[REPLICATE_HDR_LEN + REPLICATE_MAX_REPLY];
+	uint8_t			digest[MD5_DIGEST_LENGTH];
+	fr_io_replicate_entry_t	key;
+
+	if ((reply_len < 20) || (reply_len > REPLICATE_MAX_REPLY)) return;
+
+	replicate_key(&key, src_ipaddr, src_port, packet);
+
+	memset(buffer, 0, REPLICATE_HDR_LEN);
+	buffer[REPLICATE_OFF_VERSION] = REPLICATE_VERSION;
+	buffer[REPLICATE_OFF_AF] = key.af;
+	buffer[REPLICATE_OFF_REPLY_LEN] = (reply_len >> 8) & 0xff;
+	buffer[REPLICATE_OFF_REPLY_LEN + 1] = reply_len & 0xff;
+	memcpy(buffer + REPLICATE_OFF_SENDER, &rep->sender, sizeof(rep->sender));
+	memcpy(buffer + REPLICATE_OFF_ADDR, key.addr, sizeof(key.addr));
+	buffer[REPLICATE_OFF_PORT] = (src_port >> 8) & 0xff;
+	buffer[REPLICATE_OFF_PORT + 1] = src_port & 0xff;
+	memcpy(buffer + REPLICATE_OFF_PACKET, key.packet, sizeof(key.packet));
+	memcpy(buffer + REPLICATE_HDR_LEN, reply, reply_len);
+
+	replicate_sign(digest, rep, buffer, REPLICATE_HDR_LEN + reply_len);
+	memcpy(buffer + REPLICATE_OFF_DIGEST, digest, sizeof(digest));
+
+	/*
+	 *	Best effort.  If the announcement is lost, the peer
+	 *	runs the duplicate through the workers.
+	 */
+	if (sendto(rep->fd, buffer, REPLICATE_HDR_LEN + reply_len, 0,
+		   (struct sockaddr *) &rep->peer, rep->peer_len) < 0) {
+		DEBUG3("Failed sending replication announcement: %s", fr_syserror(errno));
+	}
+}
+
+/** Find a reply the peer sent for this request
+ *
+ * @param[in] ctx		to allocate the reply in.
+ * @param[out] reply		a copy of the peer's reply.
+ * @param[in] rep		the replication state.
+ * @param[in] src_ipaddr	of the client.
+ * @param[in] src_port		of the client.
+ * @param[in] packet		the first 20 octets of the request.
+ * @return
+ *	- 0 if the peer hasn't answered this request.
+ *	- the length of *reply.
+ */
+size_t fr_io_replicate_find(TALLOC_CTX *ctx, uint8_t **reply, fr_io_replicate_t *rep,
+			    fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
+			    uint8_t const *packet)
+{
+	fr_io_replicate_entry_t	key, *e;
+	size_t			reply_len = 0;
+
+	replicate_key(&key, src_ipaddr, src_port, packet);
+
+	pthread_mutex_lock(&rep->mutex);
+	e = fr_hash_table_finddata(rep->ht, &key);
+	if (!e) goto done;
+
+	if (e->expires <= fr_time()) {
+		replicate_remove(rep, e);
+		goto done;
+	}
+
+	MEM(*reply = talloc_memdup(ctx, e->reply, e->reply_len));
+	reply_len = e->reply_len;
+
+done:
+	pthread_mutex_unlock(&rep->mutex);
+	return reply_len;
+}
@@ -0,0 +1,74 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file io/replicate.h
+ * @brief Share replies with a peer server, so that it can answer duplicates.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(replicate_h, "$Id$")
+
+#include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/time.h>
+
+#include <talloc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_io_replicate_s fr_io_replicate_t;
+
+/** Configuration for replicating replies to a peer
+ *
+ */
+typedef struct {
+	fr_ipaddr_t		ipaddr;		//!< of the peer, or a multicast group.  AF_UNSPEC if
+						///< replication is disabled.
+	fr_ipaddr_t		src_ipaddr;	//!< we receive announcements from the peer on.
+	uint16_t		port;		//!< used by both ends.
+	char const		*secret;	//!< for signing announcements.
+} fr_io_replicate_conf_t;
+
+/** Config parser definitions to populate a fr_io_replicate_conf_t
+ *
+ */
+extern CONF_PARSER const fr_io_replicate_config[];
+
+fr_io_replicate_t	*fr_io_replicate_alloc(TALLOC_CTX *ctx, fr_io_replicate_conf_t const *conf,
+					       fr_time_delta_t lifetime) CC_HINT(nonnull);
+
+int			fr_io_replicate_event_list_set(fr_io_replicate_t *rep, TALLOC_CTX *ctx,
+						       fr_event_list_t *el) CC_HINT(nonnull);
+
+void			fr_io_replicate_send(fr_io_replicate_t *rep,
+					     fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
+					     uint8_t const *packet,
+					     uint8_t const *reply, size_t reply_len) CC_HINT(nonnull);
+
+size_t			fr_io_replicate_find(TALLOC_CTX *ctx, uint8_t **reply, fr_io_replicate_t *rep,
+					     fr_ipaddr_t const *src_ipaddr, uint16_t src_port,
+					     uint8_t const *packet) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
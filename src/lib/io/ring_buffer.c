@@ -27,7 +27,11 @@ RCSID("$Id$")
 #include <freeradius-devel/io/ring_buffer.h>
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/syserror.h>
 #include <string.h>
+#include <sys/mman.h>
+
+#define RING_BUFFER_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
 
 /*
  *	Ring buffers are allocated in a block.
@@ -43,8 +47,87 @@ struct fr_ring_buffer_s {
 	size_t		reserved;	//!< amount of reserved data at write_offset
 
 	bool		closed;		//!< whether allocations are closed
+	bool		mapped;		//!< whether the buffer was mmap'd
 };
 
+static bool	rb_huge_pages;		//!< Back ring buffers with huge pages.
+static bool	rb_lock;		//!< mlock() ring buffers.
+
+/** Set how the memory for ring buffers is allocated
+ *
+ *  Applies to all ring buffers created afterwards, so it should be
+ *  called once, before any threads are started.
+ *
+ *  Huge pages avoid TLB misses when the buffers are large, and locking
+ *  avoids page faults the first time each page is written, i.e. at a
+ *  traffic spike.  Both work best when the buffers are created at their
+ *  expected peak size, so that they never need to be resized.
+ *
+ * @param[in] huge_pages	Try MAP_HUGETLB, and fall back to transparent huge pages.
+ * @param[in] lock		mlock() the buffers.
+ */
+void fr_ring_buffer_memory_set(bool huge_pages, bool lock)
+{
+	rb_huge_pages = huge_pages;
+	rb_lock = lock;
+}
+
+static int _ring_buffer_free(fr_ring_buffer_t *rb)
+{
+	if (rb->mapped) (void) munmap(rb->buffer, rb->size);
+
+	return 0;
+}
+
+/** mmap the buffer, using huge pages if we can
+ *
+ */
+static int ring_buffer_map(fr_ring_buffer_t *rb, size_t size)
+{
+	void *buffer = MAP_FAILED;
+
+	/*
+	 *	Huge pages need the mapping to be a multiple of
+	 *	the huge page size.  The size is already a power of
+	 *	2, so that's the same as being at least one page.
+	 */
+	if (rb_huge_pages && (size < RING_BUFFER_HUGE_PAGE_SIZE)) size = RING_BUFFER_HUGE_PAGE_SIZE;
+
+#ifdef MAP_HUGETLB
+	if (rb_huge_pages) buffer = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+	/*
+	 *	No reserved huge pages, ask for transparent ones.
+	 */
+	if (buffer == MAP_FAILED) {
+		buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buffer == MAP_FAILED) {
+			fr_strerror_printf("Failed mapping ring buffer: %s", fr_syserror(errno));
+			return -1;
+		}
+
+#ifdef MADV_HUGEPAGE
+		if (rb_huge_pages) (void) madvise(buffer, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	if (rb_lock && (mlock(buffer, size) < 0)) {
+		fr_strerror_printf("Failed locking ring buffer of %zu bytes: %s.  Check RLIMIT_MEMLOCK",
+				   size, fr_syserror(errno));
+		(void) munmap(buffer, size);
+		return -1;
+	}
+
+	rb->buffer = buffer;
+	rb->size = size;
+	rb->mapped = true;
+	talloc_set_destructor(rb, _ring_buffer_free);
+
+	return 0;
+}
+
 /** Create a ring buffer.
  *
  *  The size provided will be rounded up to the next highest power of
@@ -91,6 +174,15 @@ fr_ring_buffer_t *fr_ring_buffer_create(TALLOC_CTX *ctx, size_t size)
 	size |= size >> 16;
 	size++;
 
+	if (rb_huge_pages || rb_lock) {
+		if (ring_buffer_map(rb, size) < 0) {
+			talloc_free(rb);
+			return NULL;
+		}
+
+		return rb;
+	}
+
 	rb->buffer = talloc_array(rb, uint8_t, size);
 	if (!rb->buffer) {
 		talloc_free(rb);
@@ -36,6 +36,8 @@ extern "C" {
 
 typedef struct fr_ring_buffer_s fr_ring_buffer_t;
 
+void			fr_ring_buffer_memory_set(bool huge_pages, bool lock);
+
 fr_ring_buffer_t	*fr_ring_buffer_create(TALLOC_CTX *ctx, size_t size);
 
 uint8_t			*fr_ring_buffer_reserve(fr_ring_buffer_t *rb, size_t size) CC_HINT(nonnull);
@@ -28,14 +28,20 @@ RCSID("$Id$")
 
 #include <freeradius-devel/autoconf.h>
 
+#include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/server/metrics.h>
 #include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/rbtree.h>
 #include <freeradius-devel/util/syserror.h>
-#include <freeradius-devel/server/trigger.h>
 
 #include <pthread.h>
 
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#  include <sched.h>
+#  include <sys/syscall.h>
+#endif
+
 /*
  *	Other OS's have sem_init, OS X doesn't.
  */
@@ -64,6 +70,12 @@ RCSID("$Id$")
 
 #define SEM_WAIT_INTR(_x) do {if (sem_wait(_x) == 0) break;} while (errno == EINTR)
 
+#ifdef CPU_SETSIZE
+#  define CPU_LIMIT CPU_SETSIZE
+#else
+#  define CPU_LIMIT 1024
+#endif
+
 /**
  *  Track the child thread status.
  */
@@ -75,6 +87,20 @@ typedef enum fr_schedule_child_status_t {
 	FR_CHILD_FAIL				//!< failed, and in the exited queue
 } fr_schedule_child_status_t;
 
+/** A group of workers which only run requests from the listeners bound to it
+ *
+ */
+typedef struct {
+	unsigned int	id;			//!< index into the scheduler's pools.  0 is the default pool.
+	char const	*name;			//!< of the pool
+
+	uint32_t	max_workers;		//!< number of workers in the pool
+	uint32_t	max_requests;		//!< each worker runs at once
+
+	int		*cpu;			//!< CPUs for the pool's workers
+	unsigned int	num_cpu;		//!< number of entries in cpu
+} fr_schedule_pool_t;
+
 /** Scheduler specific information for worker threads
  *
  * Wraps a fr_worker_t, tracking additional information that
@@ -86,6 +112,8 @@ typedef struct {
 	pthread_t	pthread_id;		//!< the thread of this worker
 
 	unsigned int	id;			//!< a unique ID
+	fr_schedule_pool_t *pool;		//!< the worker is in
+	unsigned int	pool_index;		//!< of the worker in its pool, for CPU pinning
 	int		uses;			//!< how many network threads are using it
 	fr_time_t	cpu_time;		//!< how much CPU time this worker has used
 
@@ -115,6 +143,16 @@ typedef struct {
 	fr_event_timer_t const *ev;		//!< timer for stats_interval
 } fr_schedule_network_t;
 
+/** The metrics as they were the last time "show perf" was run
+ *
+ */
+typedef struct {
+	fr_time_t		when;			//!< when the snapshot was taken
+	fr_metric_value_t	*modules;		//!< per-module call durations
+	size_t			num_modules;
+	fr_metric_value_t	*clients;		//!< per-client request durations
+	size_t			num_clients;
+} fr_schedule_perf_t;
 
 /**
  *  The scheduler
@@ -143,7 +181,20 @@ struct fr_schedule_s {
 	fr_network_t	*single_network;	//!< for single-threaded mode
 	fr_worker_t	*single_worker;		//!< for single-threaded mode
 
-	fr_schedule_network_t *sn;		//!< pointer to the (one) network thread
+	int		*network_cpu;		//!< CPUs for network threads, from config->network_cpus
+	unsigned int	num_network_cpu;	//!< number of entries in network_cpu
+	int		*worker_cpu;		//!< CPUs for worker threads, from config->worker_cpus
+	unsigned int	num_worker_cpu;		//!< number of entries in worker_cpu
+
+	fr_schedule_pool_t *pools;		//!< the default worker pool, then the named ones
+	unsigned int	num_pools;		//!< number of entries in pools
+
+	fr_schedule_network_t **networks;	//!< array of network threads
+	unsigned int	num_networks;		//!< how many network threads are running
+	unsigned int	next_network;		//!< round-robin counter for fr_schedule_listen_add()
+
+	pthread_mutex_t	perf_mutex;		//!< serialises "show perf"
+	fr_schedule_perf_t *perf;		//!< previous "show perf" snapshot
 };
 
 static _Thread_local int worker_id;		//!< Internal ID of the current worker thread.
@@ -157,6 +208,116 @@ int fr_schedule_worker_id(void)
 	return worker_id;
 }
 
+/** Parse a list of CPUs
+ *
+ * The list is a comma separated set of CPU numbers or ranges, e.g.
+ * "0-3,8,10-11".
+ *
+ * @param[in] ctx	to allocate the array in.
+ * @param[out] out	array of CPU numbers.
+ * @param[out] num	number of entries in the array.
+ * @param[in] str	to parse.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int schedule_cpu_list_parse(TALLOC_CTX *ctx, int **out, unsigned int *num, char const *str)
+{
+	char const	*p = str;
+	int		*cpus = NULL;
+	unsigned int	count = 0;
+
+	*out = NULL;
+	*num = 0;
+
+	if (!str || !*str) return 0;
+
+	while (*p) {
+		char		*end;
+		unsigned long	first, last, i;
+
+		first = strtoul(p, &end, 10);
+		if (end == p) goto invalid;
+
+		last = first;
+		p = end;
+		if (*p == '-') {
+			p++;
+			last = strtoul(p, &end, 10);
+			if ((end == p) || (last < first)) goto invalid;
+			p = end;
+		}
+
+		if (last >= CPU_LIMIT) {
+			fr_strerror_printf("CPU %lu in \"%s\" is larger than the maximum of %u", last, str, CPU_LIMIT - 1);
+			talloc_free(cpus);
+			return -1;
+		}
+
+		for (i = first; i <= last; i++) {
+			MEM(cpus = talloc_realloc(ctx, cpus, int, count + 1));
+			cpus[count++] = i;
+		}
+
+		if (!*p) break;
+		if (*p != ',') goto invalid;
+		p++;
+	}
+
+	*out = cpus;
+	*num = count;
+	return 0;
+
+invalid:
+	fr_strerror_printf("Invalid CPU list \"%s\" at \"%s\"", str, p);
+	talloc_free(cpus);
+	return -1;
+}
+
+/** Pin the current thread to a CPU, and log where it ended up
+ *
+ * This is done at the start of each thread, before it allocates
+ * anything.  The thread's message sets and ring buffers are then
+ * first-touched on the CPU's NUMA node, and are allocated there.
+ *
+ * @param[in] sc	the scheduler.
+ * @param[in] name	of the thread, for logging.
+ * @param[in] cpus	array of CPUs.
+ * @param[in] num	number of entries in the array.
+ * @param[in] id	of the thread.  It is pinned to cpus[id % num].
+ */
+static void schedule_thread_pin(fr_schedule_t *sc, char const *name, int const *cpus, unsigned int num, unsigned int id)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t	set;
+	int		ret;
+	unsigned int	cpu = 0, node = 0;
+
+	if (!num) return;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpus[id % num], &set);
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret != 0) {
+		WARN("%s - Failed pinning to CPU %d: %s", name, cpus[id % num], fr_syserror(ret));
+		return;
+	}
+
+#ifdef SYS_getcpu
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+		INFO("%s - Pinned to CPU %u (NUMA node %u)", name, cpu, node);
+		return;
+	}
+#endif
+	INFO("%s - Pinned to CPU %d", name, cpus[id % num]);
+#else
+	if (!num) return;
+
+	WARN("%s - Pinning threads to CPUs is not supported on this platform", name);
+#endif
+}
+
 /** Entry point for worker threads
  *
  * @param[in] arg	the fr_schedule_worker_t
@@ -168,19 +329,27 @@ static void *fr_schedule_worker_thread(void *arg)
 	fr_schedule_worker_t		*sw = talloc_get_type_abort(arg, fr_schedule_worker_t);
 	fr_schedule_t			*sc = sw->sc;
 	fr_schedule_child_status_t	status = FR_CHILD_FAIL;
+	unsigned int			i;
+	fr_worker_config_t		worker_config;
 	char worker_name[32];
 
 	worker_id = sw->id;		/* Store the current worker ID */
 
 	snprintf(worker_name, sizeof(worker_name), "Worker %d", sw->id);
 
+	schedule_thread_pin(sc, worker_name, sw->pool->cpu, sw->pool->num_cpu, sw->pool_index);
+
 	sw->ctx = ctx = talloc_init("%s", worker_name);
 	if (!ctx) {
 		ERROR("%s - Failed allocating memory", worker_name);
 		goto fail;
 	}
 
-	INFO("%s - Starting", worker_name);
+	if (!sw->pool->id) {
+		INFO("%s - Starting", worker_name);
+	} else {
+		INFO("%s - Starting in pool %s", worker_name, sw->pool->name);
+	}
 
 	sw->el = fr_event_list_alloc(ctx, NULL, NULL);
 	if (!sw->el) {
@@ -189,7 +358,15 @@ static void *fr_schedule_worker_thread(void *arg)
 	}
 
 
-	sw->worker = fr_worker_create(ctx, sw->el, worker_name, sc->log, sc->lvl, NULL);
+	worker_config = (fr_worker_config_t) {
+		.max_requests = sw->pool->max_requests,
+		.steal = sc->config->work_stealing,
+		.spin_time = sc->config->spin_time,
+		.talloc_pool_size = sc->config->talloc_pool_size,
+		.ring_buffer_size = sc->config->ring_buffer_size,
+	};
+
+	sw->worker = fr_worker_create(ctx, sw->el, worker_name, sc->log, sc->lvl, &worker_config);
 	if (!sw->worker) {
 		PERROR("%s - Failed creating worker", worker_name);
 		goto fail;
@@ -215,7 +392,13 @@ static void *fr_schedule_worker_thread(void *arg)
 
 	sw->status = FR_CHILD_RUNNING;
 
-	(void) fr_network_worker_add(sc->sn->nr, sw->worker);
+	/*
+	 *	Every network thread can send packets to every
+	 *	worker, so long as the listener is in the worker's pool.
+	 */
+	for (i = 0; i < sc->num_networks; i++) {
+		(void) fr_network_worker_add(sc->networks[i]->nr, sw->worker, sw->pool->id);
+	}
 
 	DEBUG3("%s - Started", worker_name);
 
@@ -283,11 +466,14 @@ static void *fr_schedule_network_thread(void *arg)
 	fr_schedule_child_status_t	status = FR_CHILD_FAIL;
 	fr_event_list_t			*el;
 	char				network_name[32];
+	fr_network_config_t		network_config;
 
 	snprintf(network_name, sizeof(network_name), "Network %d", sn->id);
 
 	INFO("%s - Starting", network_name);
 
+	schedule_thread_pin(sc, network_name, sc->network_cpu, sc->num_network_cpu, sn->id);
+
 	sn->ctx = ctx = talloc_init("%s", network_name);
 	if (!ctx) {
 		ERROR("%s - Failed allocating memory", network_name);
@@ -300,7 +486,12 @@ static void *fr_schedule_network_thread(void *arg)
 		goto fail;
 	}
 
-	sn->nr = fr_network_create(ctx, el, network_name, sc->log, sc->lvl);
+	network_config = (fr_network_config_t) {
+		.max_queue_delay = sc->config->max_queue_delay,
+		.ring_buffer_size = sc->config->ring_buffer_size,
+	};
+
+	sn->nr = fr_network_create(ctx, el, network_name, sc->log, sc->lvl, &network_config);
 	if (!sn->nr) {
 		PERROR("%s - Failed creating network", network_name);
 		goto fail;
@@ -379,6 +570,269 @@ int fr_schedule_pthread_create(pthread_t *thread, void *(*func)(void *), void *a
 	return 0;
 }
 
+/** Subtract the previous snapshot from the current values
+ *
+ * Both arrays are ordered by labels.  Series which are new since
+ * the snapshot are left as-is.
+ */
+static void perf_delta(fr_metric_value_t *values, size_t num, fr_metric_value_t const *prev, size_t num_prev)
+{
+	size_t i = 0, j = 0;
+
+	while ((i < num) && (j < num_prev)) {
+		int ret = strcmp(values[i].labels, prev[j].labels);
+
+		if (ret < 0) {
+			i++;
+			continue;
+		}
+
+		if (ret > 0) {
+			j++;
+			continue;
+		}
+
+		values[i].count = (values[i].count > prev[j].count) ? values[i].count - prev[j].count : 0;
+		values[i].sum = (values[i].sum > prev[j].sum) ? values[i].sum - prev[j].sum : 0;
+		i++;
+		j++;
+	}
+}
+
+static int perf_cmp_slowest(void const *one, void const *two)
+{
+	fr_metric_value_t const *a = one, *b = two;
+	uint64_t avg_a = a->count ? a->sum / a->count : 0;
+	uint64_t avg_b = b->count ? b->sum / b->count : 0;
+
+	return (avg_a < avg_b) - (avg_a > avg_b);
+}
+
+static int perf_cmp_busiest(void const *one, void const *two)
+{
+	fr_metric_value_t const *a = one, *b = two;
+
+	return (a->count < b->count) - (a->count > b->count);
+}
+
+static void perf_top_print(FILE *fp, fr_metric_value_t *values, size_t num,
+			   int (*cmp)(void const *, void const *), unsigned int top, fr_time_delta_t period)
+{
+	size_t i;
+
+	qsort(values, num, sizeof(values[0]), cmp);
+
+	for (i = 0; (i < num) && (i < top); i++) {
+		if (!values[i].count) break;
+
+		fprintf(fp, "\t%s\tcalls %" PRIu64 "\trate %.1f/s\tavg %.3f ms\n",
+			values[i].labels, values[i].count,
+			period ? ((double) values[i].count * NSEC) / period : 0,
+			((double) values[i].sum / values[i].count) / 1000000);
+	}
+}
+
+/** Fetch the values of a metric, and the change since the last snapshot
+ *
+ * @param[in] ctx	to allocate the snapshot in.
+ * @param[out] snapshot	the raw values, to keep for next time.
+ * @param[out] delta	the change since prev.
+ * @param[in] name	of the metric.
+ * @param[in] prev	values from the previous snapshot.
+ * @param[in] num_prev	number of previous values.
+ * @return the number of values.
+ */
+static size_t perf_fetch(TALLOC_CTX *ctx, fr_metric_value_t **snapshot, fr_metric_value_t **delta,
+			 char const *name, fr_metric_value_t const *prev, size_t num_prev)
+{
+	fr_metric_t	*metric;
+	size_t		num;
+
+	*snapshot = *delta = NULL;
+
+	metric = fr_metric_find(name);
+	if (!metric) return 0;
+
+	num = fr_metric_values(ctx, snapshot, metric);
+	if (!num) return 0;
+
+	/*
+	 *	The labels are shared with the snapshot, which
+	 *	lives at least as long as the delta.
+	 */
+	MEM(*delta = talloc_memdup(ctx, *snapshot, num * sizeof((*snapshot)[0])));
+	perf_delta(*delta, num, prev, num_prev);
+
+	return num;
+}
+
+static int cmd_show_perf(FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
+{
+	fr_schedule_t		*sc = ctx;
+	fr_schedule_perf_t	*perf, *prev;
+	fr_schedule_worker_t	*sw;
+	fr_metric_value_t	*modules, *clients;
+	fr_time_delta_t		period;
+	unsigned int		i, top = 5;
+	char			title[128];
+
+	if (info->argc > 0) {
+		top = atoi(info->argv[0]);
+		if (!top) {
+			fprintf(fp_err, "Number of entries must be greater than zero\n");
+			return -1;
+		}
+	}
+
+	/*
+	 *	Network threads, and how they see their workers.
+	 *
+	 *	@todo - note that this isn't thread-safe!
+	 */
+	if (sc->el) {
+		fprintf(fp, "network 0\n");
+		fr_network_workers_print(sc->single_network, fp);
+	} else {
+		for (i = 0; i < sc->num_networks; i++) {
+			if (sc->networks[i]->status != FR_CHILD_RUNNING) continue;
+
+			fprintf(fp, "network %u\n", i);
+			fr_network_workers_print(sc->networks[i]->nr, fp);
+		}
+	}
+
+	fprintf(fp, "\n");
+	if (sc->el) {
+		fr_worker_perf_print(sc->single_worker, fp);
+	} else {
+		for (sw = fr_dlist_head(&sc->workers);
+		     sw != NULL;
+		     sw = fr_dlist_next(&sc->workers, sw)) {
+			if (sw->status != FR_CHILD_RUNNING) continue;
+
+			fr_worker_perf_print(sw->worker, fp);
+		}
+	}
+
+	/*
+	 *	Rates are since the previous "show perf", so running
+	 *	the command periodically gives a live view.
+	 */
+	pthread_mutex_lock(&sc->perf_mutex);
+	prev = sc->perf;
+
+	MEM(perf = talloc_zero(sc, fr_schedule_perf_t));
+	perf->when = fr_time();
+	perf->num_modules = perf_fetch(perf, &perf->modules, &modules, "freeradius_module_call_duration_seconds",
+				       prev ? prev->modules : NULL, prev ? prev->num_modules : 0);
+	perf->num_clients = perf_fetch(perf, &perf->clients, &clients, "freeradius_client_request_duration_seconds",
+				       prev ? prev->clients : NULL, prev ? prev->num_clients : 0);
+
+	period = prev ? perf->when - prev->when : 0;
+	if (period) {
+		snprintf(title, sizeof(title), "over the last %.3f s", (double) period / NSEC);
+	} else {
+		strlcpy(title, "since startup", sizeof(title));
+	}
+
+	fprintf(fp, "\nslowest modules %s\n", title);
+	perf_top_print(fp, modules, perf->num_modules, perf_cmp_slowest, top, period);
+
+	fprintf(fp, "\nslowest clients %s\n", title);
+	perf_top_print(fp, clients, perf->num_clients, perf_cmp_slowest, top, period);
+
+	fprintf(fp, "\nbusiest clients %s\n", title);
+	perf_top_print(fp, clients, perf->num_clients, perf_cmp_busiest, top, period);
+
+	talloc_free(modules);
+	talloc_free(clients);
+	talloc_free(prev);
+	sc->perf = perf;
+	pthread_mutex_unlock(&sc->perf_mutex);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_perf_table[] = {
+	{
+		.parent = "show",
+		.name = "perf",
+		.syntax = "[INTEGER]",
+		.func = cmd_show_perf,
+		.help = "Show worker load, and the slowest modules and clients since the last 'show perf'.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
+
+/** Set up the default worker pool, and the named ones
+ *
+ * @param[in] sc	the scheduler.
+ * @return
+ *	- the total number of workers.
+ *	- 0 on error.
+ */
+static unsigned int schedule_pools_init(fr_schedule_t *sc)
+{
+	size_t		i, j, num = talloc_array_length(sc->config->pools);
+	unsigned int	total = sc->config->max_workers;
+
+	MEM(sc->pools = talloc_zero_array(sc, fr_schedule_pool_t, num + 1));
+	sc->num_pools = num + 1;
+
+	sc->pools[0] = (fr_schedule_pool_t) {
+		.name = "default",
+		.max_workers = sc->config->max_workers,
+		.cpu = sc->worker_cpu,
+		.num_cpu = sc->num_worker_cpu
+	};
+
+	for (i = 0; i < num; i++) {
+		fr_schedule_pool_config_t const	*conf = sc->config->pools[i];
+		fr_schedule_pool_t		*pool = &sc->pools[i + 1];
+
+		if (!conf->name) {
+			fr_strerror_printf("Worker pools must have a name");
+			return 0;
+		}
+
+		for (j = 0; j <= i; j++) {
+			if (strcmp(sc->pools[j].name, conf->name) == 0) {
+				fr_strerror_printf("Worker pool \"%s\" is already defined", conf->name);
+				return 0;
+			}
+		}
+
+		pool->id = i + 1;
+		pool->name = conf->name;
+		pool->max_workers = conf->max_workers;
+		if (pool->max_workers < 1) pool->max_workers = 1;
+		pool->max_requests = conf->max_requests;
+
+		/*
+		 *	Pools with no CPUs of their own share the
+		 *	default pool's CPUs.
+		 */
+		if (!conf->worker_cpus) {
+			pool->cpu = sc->worker_cpu;
+			pool->num_cpu = sc->num_worker_cpu;
+		} else if (schedule_cpu_list_parse(sc, &pool->cpu, &pool->num_cpu, conf->worker_cpus) < 0) {
+			fr_strerror_printf_push("Invalid CPU list for worker pool \"%s\"", conf->name);
+			return 0;
+		}
+
+		total += pool->max_workers;
+	}
+
+	if (total > 64) {
+		fr_strerror_printf("Too many workers (%u) in all of the worker pools, the limit is 64", total);
+		return 0;
+	}
+
+	return total;
+}
+
 /** Create a scheduler and spawn the child threads.
  *
  * @param[in] ctx				talloc context.
@@ -399,7 +853,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 				  fr_schedule_thread_detach_t worker_thread_detach,
 				  fr_schedule_config_t *config)
 {
-	unsigned int i;
+	unsigned int i, j, k, num_workers;
 	fr_schedule_worker_t *sw, *next;
 	fr_schedule_t *sc;
 
@@ -409,11 +863,6 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		return NULL;
 	}
 
-	/*
-	 *	Glue workers into the trigger code.
-	 */
-	trigger_worker_request_add = fr_worker_request_add;
-
 	sc->config = config;
 	sc->el = el;
 	sc->log = logger;
@@ -422,12 +871,20 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 	sc->worker_thread_instantiate = worker_thread_instantiate;
 	sc->worker_thread_detach = worker_thread_detach;
 	sc->running = true;
+	pthread_mutex_init(&sc->perf_mutex, NULL);
 
 	/*
 	 *	If we're single-threaded, create network / worker, and insert them into the event loop.
 	 */
 	if (el) {
-		sc->single_network = fr_network_create(sc, el, "Network", sc->log, sc->lvl);
+		fr_network_config_t network_config = { 0 };
+
+		if (config) {
+			network_config.max_queue_delay = config->max_queue_delay;
+			network_config.ring_buffer_size = config->ring_buffer_size;
+		}
+
+		sc->single_network = fr_network_create(sc, el, "Network", sc->log, sc->lvl, &network_config);
 		if (!sc->single_network) {
 			PERROR("Failed creating network");
 		pre_instantiate_st_fail:
@@ -468,7 +925,12 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 			goto st_fail;
 		}
 
-		(void) fr_network_worker_add(sc->single_network, sc->single_worker);
+		if (fr_command_register_hook(NULL, NULL, sc, cmd_perf_table) < 0) {
+			PERROR("Failed adding scheduler commands");
+			goto st_fail;
+		}
+
+		(void) fr_network_worker_add(sc->single_network, sc->single_worker, 0);
 		DEBUG("Scheduler created in single-threaded mode");
 
 		if (fr_event_pre_insert(el, fr_worker_pre_event, sc->single_worker) < 0) {
@@ -497,12 +959,27 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 	} else {
 		sc->config = config;
 
-		if (sc->config->max_networks != 1) sc->config->max_networks = 1;
+		if (sc->config->max_networks < 1) sc->config->max_networks = 1;
+		if (sc->config->max_networks > 32) sc->config->max_networks = 32;
 		if (sc->config->max_workers < 1) sc->config->max_workers = 1;
 		if (sc->config->max_workers > 64) sc->config->max_workers = 64;
 
 	}
 
+	if ((schedule_cpu_list_parse(sc, &sc->network_cpu, &sc->num_network_cpu, sc->config->network_cpus) < 0) ||
+	    (schedule_cpu_list_parse(sc, &sc->worker_cpu, &sc->num_worker_cpu, sc->config->worker_cpus) < 0)) {
+		PERROR("Failed parsing thread CPU list");
+		talloc_free(sc);
+		return NULL;
+	}
+
+	num_workers = schedule_pools_init(sc);
+	if (!num_workers) {
+		PERROR("Failed creating worker pools");
+		talloc_free(sc);
+		return NULL;
+	}
+
 	/*
 	 *	Create the list which holds the workers.
 	 */
@@ -523,52 +1000,69 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 	}
 
 	/*
-	 *	Create the network thread first.
-	 *	@todo - create multiple network threads
+	 *	Create the network threads first.  The workers add
+	 *	themselves to each network as they start.
 	 */
-	sc->sn = talloc_zero(sc, fr_schedule_network_t);
-	sc->sn->sc = sc;
-	sc->sn->id = 0;
+	MEM(sc->networks = talloc_zero_array(sc, fr_schedule_network_t *, sc->config->max_networks));
 
-	if (fr_schedule_pthread_create(&sc->sn->pthread_id, fr_schedule_network_thread, sc->sn) < 0) {
-		PERROR("Failed creating network thread");
-		goto fail;
-	}
+	for (i = 0; i < sc->config->max_networks; i++) {
+		fr_schedule_network_t *sn;
 
-	SEM_WAIT_INTR(&sc->network_sem);
-	if (sc->sn->status != FR_CHILD_RUNNING) {
-	fail:
-		if (sc->sn->ctx) TALLOC_FREE(sc->sn->ctx);
-		TALLOC_FREE(sc->sn);
-		fr_schedule_destroy(&sc);
-		return NULL;
+		DEBUG3("Creating %u/%u networks", i, sc->config->max_networks);
+
+		MEM(sn = talloc_zero(sc, fr_schedule_network_t));
+		sn->sc = sc;
+		sn->id = i;
+
+		if (fr_schedule_pthread_create(&sn->pthread_id, fr_schedule_network_thread, sn) < 0) {
+			PERROR("Failed creating network thread %u", i);
+			talloc_free(sn);
+			goto fail;
+		}
+
+		SEM_WAIT_INTR(&sc->network_sem);
+		if (sn->status != FR_CHILD_RUNNING) {
+			if (sn->ctx) TALLOC_FREE(sn->ctx);
+			talloc_free(sn);
+		fail:
+			fr_schedule_destroy(&sc);
+			return NULL;
+		}
+
+		sc->networks[sc->num_networks++] = sn;
 	}
 
 	/*
-	 *	Create all of the workers.
+	 *	Create all of the workers, pool by pool.  Worker IDs
+	 *	are unique across all of the pools.
 	 */
-	for (i = 0; i < sc->config->max_workers; i++) {
-		DEBUG3("Creating %u/%u workers", i, sc->config->max_workers);
-
-		/*
-		 *	Create a worker "glue" structure
-		 */
-		sw = talloc_zero(sc, fr_schedule_worker_t);
-		if (!sw) {
-			ERROR("Worker %u - Failed allocating memory", i);
-			break;
-		}
+	for (i = 0, j = 0; j < sc->num_pools; j++) {
+		for (k = 0; k < sc->pools[j].max_workers; k++, i++) {
+			DEBUG3("Creating %u/%u workers", i, num_workers);
+
+			/*
+			 *	Create a worker "glue" structure
+			 */
+			sw = talloc_zero(sc, fr_schedule_worker_t);
+			if (!sw) {
+				ERROR("Worker %u - Failed allocating memory", i);
+				goto create_done;
+			}
 
-		sw->id = i;
-		sw->sc = sc;
-		sw->status = FR_CHILD_INITIALIZING;
-		fr_dlist_insert_head(&sc->workers, sw);
+			sw->id = i;
+			sw->pool = &sc->pools[j];
+			sw->pool_index = k;
+			sw->sc = sc;
+			sw->status = FR_CHILD_INITIALIZING;
+			fr_dlist_insert_head(&sc->workers, sw);
 
-		if (fr_schedule_pthread_create(&sw->pthread_id, fr_schedule_worker_thread, sw) < 0) {
-			ERROR("Failed creating worker %u: %s", i, fr_strerror());
-			break;
+			if (fr_schedule_pthread_create(&sw->pthread_id, fr_schedule_worker_thread, sw) < 0) {
+				ERROR("Failed creating worker %u: %s", i, fr_strerror());
+				goto create_done;
+			}
 		}
 	}
+create_done:
 
 
 	/*
@@ -600,7 +1094,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 	/*
 	 *	Failed to start some workers, refuse to do anything!
 	 */
-	if ((unsigned int)fr_dlist_num_elements(&sc->workers) < sc->config->max_workers) {
+	if ((unsigned int)fr_dlist_num_elements(&sc->workers) < num_workers) {
 		fr_schedule_destroy(&sc);
 		return NULL;
 	}
@@ -619,17 +1113,88 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		}
 	}
 
-	if (fr_command_register_hook(NULL, "0", sc->sn->nr, cmd_network_table) < 0) {
-		PERROR("Failed adding network commands");
+	for (i = 0; i < sc->num_networks; i++) {
+		char buffer[32];
+
+		snprintf(buffer, sizeof(buffer), "%u", i);
+		if (fr_command_register_hook(NULL, buffer, sc->networks[i]->nr, cmd_network_table) < 0) {
+			PERROR("Failed adding network commands");
+			goto st_fail;
+		}
+	}
+
+	if (fr_command_register_hook(NULL, NULL, sc, cmd_perf_table) < 0) {
+		PERROR("Failed adding scheduler commands");
 		goto st_fail;
 	}
 
 	if (sc) INFO("Scheduler created successfully with %u networks and %u workers",
-		     sc->config->max_networks, (unsigned int)fr_dlist_num_elements(&sc->workers));
+		     sc->num_networks, (unsigned int)fr_dlist_num_elements(&sc->workers));
 
 	return sc;
 }
 
+/** Stop reading packets, and wait for the outstanding requests to finish
+ *
+ * This is used when another server process has taken over our
+ * listeners.  The caller should then call fr_schedule_destroy().
+ *
+ * @param[in] sc	the scheduler
+ * @param[in] timeout	how long to wait for the requests to finish.
+ * @return
+ *	- <0 if the requests didn't finish in time
+ *	- 0 on success
+ */
+int fr_schedule_drain(fr_schedule_t *sc, fr_time_delta_t timeout)
+{
+	unsigned int	i;
+	fr_time_t	end = fr_time() + timeout;
+
+	/*
+	 *	Single threaded mode: the requests only make progress
+	 *	if we service the event list.
+	 */
+	if (sc->el) {
+		if (fr_network_drain(sc->single_network) < 0) return -1;
+
+		while (!fr_network_drained(sc->single_network)) {
+			if (fr_time() > end) return -1;
+
+			if (fr_event_corral(sc->el, fr_time(), false) > 0) {
+				fr_event_service(sc->el);
+			} else {
+				usleep(1000);
+			}
+		}
+
+		return 0;
+	}
+
+	if (!fr_cond_assert(sc->networks)) return -1;
+
+	for (i = 0; i < sc->num_networks; i++) {
+		fr_schedule_network_t *sn = sc->networks[i];
+
+		if (sn->status != FR_CHILD_RUNNING) continue;
+
+		if (fr_network_drain(sn->nr) < 0) return -1;
+	}
+
+	for (i = 0; i < sc->num_networks; i++) {
+		fr_schedule_network_t *sn = sc->networks[i];
+
+		if (sn->status != FR_CHILD_RUNNING) continue;
+
+		while (!fr_network_drained(sn->nr)) {
+			if (fr_time() > end) return -1;
+
+			usleep(1000);
+		}
+	}
+
+	return 0;
+}
+
 /** Destroy a scheduler, and tell its child threads to exit.
  *
  * @param[in] sc_to_free the scheduler
@@ -660,17 +1225,20 @@ int fr_schedule_destroy(fr_schedule_t **sc_to_free)
 		goto done;
 	}
 
-	if (!fr_cond_assert(sc->sn)) return -1;
-	if (!fr_cond_assert(fr_dlist_num_elements(&sc->workers) > 0)) return -1;
+	if (!fr_cond_assert(sc->networks)) return -1;
 
 	/*
-	 *	If the network thread is running, tell it to exit, and
-	 *	wait for it to do so.  Once it's exited, we know that
-	 *	this thread can use the network channels to tell the
-	 *	workers that the network side is going away.
+	 *	If the network threads are running, tell them to exit,
+	 *	and wait for them to do so.  Once they've exited, we
+	 *	know that this thread can use the network channels to
+	 *	tell the workers that the network side is going away.
 	 */
-	if (sc->sn->status == FR_CHILD_RUNNING) {
-		fr_fatal_assert_msg(fr_network_exit(sc->sn->nr) == 0, "%s", fr_strerror());
+	for (i = 0; i < sc->num_networks; i++) {
+		fr_schedule_network_t *sn = sc->networks[i];
+
+		if (sn->status != FR_CHILD_RUNNING) continue;
+
+		fr_fatal_assert_msg(fr_network_exit(sn->nr) == 0, "%s", fr_strerror());
 		SEM_WAIT_INTR(&sc->network_sem);
 	}
 
@@ -708,7 +1276,16 @@ int fr_schedule_destroy(fr_schedule_t **sc_to_free)
 		talloc_free(sw->ctx);
 	}
 
-	TALLOC_FREE(sc->sn->ctx);
+	for (i = 0; i < sc->num_networks; i++) {
+		fr_schedule_network_t *sn = sc->networks[i];
+
+		if (pthread_join(sn->pthread_id, NULL) != 0) {
+			ERROR("Failed joining network %i: %s", sn->id, fr_syserror(errno));
+		} else {
+			DEBUG2("Network %i joined (cleaned up)", sn->id);
+		}
+		TALLOC_FREE(sn->ctx);
+	}
 
 	sem_destroy(&sc->network_sem);
 	sem_destroy(&sc->worker_sem);
@@ -717,6 +1294,7 @@ done:
 	 *	Now that all of the workers are done, we can return to
 	 *	the caller, and have it dlclose() the modules.
 	 */
+	pthread_mutex_destroy(&sc->perf_mutex);
 	talloc_free(sc);
 	*sc_to_free = NULL;
 
@@ -732,6 +1310,74 @@ done:
  *	- the fr_network_t that the socket was added to.
  */
 fr_network_t *fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li)
+{
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) return fr_schedule_network_listen_add(sc, li, 0);
+
+	/*
+	 *	Spread listeners across the network threads.
+	 */
+	return fr_schedule_network_listen_add(sc, li, sc->next_network++ % sc->num_networks);
+}
+
+/** Bind a listener to the worker pool named in its configuration
+ *
+ * The listener's own worker_pool_name is used if set.  Otherwise,
+ * the "worker_pool" of its virtual server, and otherwise the default
+ * pool.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] li the listener
+ * @return
+ *	- 0 on success.
+ *	- -1 if there is no such pool.
+ */
+static int schedule_listen_pool(fr_schedule_t *sc, fr_listen_t *li)
+{
+	char const	*name = li->worker_pool_name;
+	unsigned int	i;
+
+	li->worker_pool = 0;
+
+	if (!name && li->server_cs) {
+		CONF_PAIR *cp;
+
+		cp = cf_pair_find(li->server_cs, "worker_pool");
+		if (cp) name = cf_pair_value(cp);
+	}
+
+	/*
+	 *	There's only one worker in single-threaded mode.
+	 */
+	if (!name || sc->el) return 0;
+
+	for (i = 0; i < sc->num_pools; i++) {
+		if (strcmp(sc->pools[i].name, name) != 0) continue;
+
+		li->worker_pool = i;
+		return 0;
+	}
+
+	fr_strerror_printf("No worker pool named \"%s\"", name);
+	return -1;
+}
+
+/** Add a fr_listen_t to a specific network thread of a scheduler
+ *
+ * This is used when multiple sockets are bound to the same address
+ * (i.e. SO_REUSEPORT), and each one should be serviced by a
+ * different network thread.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] li the ctx and callbacks for the transport.
+ * @param[in] id of the network thread, which must be less than
+ *	#fr_schedule_num_networks.
+ * @return
+ *	- NULL on error
+ *	- the fr_network_t that the socket was added to.
+ */
+fr_network_t *fr_schedule_network_listen_add(fr_schedule_t *sc, fr_listen_t *li, unsigned int id)
 {
 	fr_network_t *nr;
 
@@ -740,14 +1386,34 @@ fr_network_t *fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li)
 	if (sc->el) {
 		nr = sc->single_network;
 	} else {
-		nr = sc->sn->nr;
+		if (id >= sc->num_networks) {
+			fr_strerror_printf("Invalid network thread %u", id);
+			return NULL;
+		}
+		nr = sc->networks[id]->nr;
 	}
 
+	if (schedule_listen_pool(sc, li) < 0) return NULL;
+
 	if (fr_network_listen_add(nr, li) < 0) return NULL;
 
 	return nr;
 }
 
+/** Return the number of network threads in a scheduler
+ *
+ * @param[in] sc the scheduler
+ * @return the number of network threads.
+ */
+unsigned int fr_schedule_num_networks(fr_schedule_t *sc)
+{
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) return 1;
+
+	return sc->num_networks;
+}
+
 /** Add a directory NOTE_EXTEND to a scheduler.
  *
  * @param[in] sc the scheduler
@@ -765,9 +1431,11 @@ fr_network_t *fr_schedule_directory_add(fr_schedule_t *sc, fr_listen_t *li)
 	if (sc->el) {
 		nr = sc->single_network;
 	} else {
-		nr = sc->sn->nr;
+		nr = sc->networks[0]->nr;
 	}
 
+	if (schedule_listen_pool(sc, li) < 0) return NULL;
+
 	if (fr_network_directory_add(nr, li) < 0) return NULL;
 
 	return nr;
@@ -60,11 +60,40 @@ typedef int (*fr_schedule_thread_instantiate_t)(TALLOC_CTX *ctx, fr_event_list_t
  */
 typedef void (*fr_schedule_thread_detach_t)(void *uctx);
 
+/** A named group of workers, which only runs requests from the listeners bound to it
+ *
+ */
+typedef struct fr_schedule_pool_config_s {
+	char const	*name;			//!< from "pool <name> { ... }"
+
+	uint32_t	max_workers;		//!< number of worker threads in this pool
+
+	uint32_t	max_requests;		//!< each worker in the pool runs at once.  0 is the default.
+
+	char const	*worker_cpus;		//!< CPUs to pin this pool's workers to.  NULL means the
+						///< same CPUs as the default pool.
+} fr_schedule_pool_config_t;
+
 typedef struct {
 	uint32_t	max_networks;		//!< number of network threads
 	uint32_t	max_workers;		//!< number of network threads
 
 	fr_time_delta_t	stats_interval;		//!< print channel statistics
+
+	bool		work_stealing;		//!< idle workers take requests from busy ones
+
+	fr_time_delta_t	spin_time;		//!< how long threads poll their channels before sleeping
+
+	fr_time_delta_t	max_queue_delay;	//!< shed low priority packets above this queueing delay
+
+	char const	*network_cpus;		//!< CPUs to pin network threads to, e.g. "0-1"
+	char const	*worker_cpus;		//!< CPUs to pin worker threads to, e.g. "2-7,10"
+
+	size_t		talloc_pool_size;	//!< memory each request reserves for its pairs.
+
+	size_t		ring_buffer_size;	//!< expected peak size of each channel's ring buffers.
+
+	fr_schedule_pool_config_t **pools;	//!< named worker pools, in addition to the default one.
 } fr_schedule_config_t;
 
 int			fr_schedule_worker_id(void);
@@ -75,9 +104,12 @@ fr_schedule_t		*fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_
 					    fr_schedule_thread_detach_t worked_thread_detach,
 					    fr_schedule_config_t *config) CC_HINT(nonnull(3));
 /* schedulers are async, so there's no fr_schedule_run() */
+int			fr_schedule_drain(fr_schedule_t *sc, fr_time_delta_t timeout) CC_HINT(nonnull);
 int			fr_schedule_destroy(fr_schedule_t **sc);
 
 fr_network_t		*fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
+fr_network_t		*fr_schedule_network_listen_add(fr_schedule_t *sc, fr_listen_t *li, unsigned int id) CC_HINT(nonnull);
+unsigned int		fr_schedule_num_networks(fr_schedule_t *sc) CC_HINT(nonnull);
 fr_network_t		*fr_schedule_directory_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
 #ifdef __cplusplus
 }
@@ -0,0 +1,272 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Open addressing hash table for tracking packets.
+ * @file io/track.c
+ *
+ * The master IO layer looks up every packet it reads in the tracking
+ * table for its client, to catch duplicates.  A NAS which has thousands
+ * of outstanding packets makes a tree walk cost several cache misses per
+ * packet.  Instead, we use linear probing over a flat array of slots.
+ * Each slot caches the full hash of its entry, so that we only call the
+ * comparison function when the hashes match.
+ *
+ * Deleted slots become tombstones, which are reused by the next insert
+ * that probes over them.  A tombstone followed by an empty slot is
+ * itself made empty, so a table which is mostly cleaned up by timers
+ * doesn't fill up with tombstones.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/track.h>
+#include <freeradius-devel/util/strerror.h>
+
+#define TRACK_TABLE_MIN_SIZE	(64)
+
+/*
+ *	A deleted slot.  Lookups continue probing past it, and
+ *	inserts may reuse it.
+ */
+static uint8_t track_tombstone;
+#define TOMBSTONE ((void *) &track_tombstone)
+
+typedef struct {
+	uint32_t		hash;		//!< Full hash of the data.
+	void			*data;		//!< NULL if the slot is empty, or TOMBSTONE.
+} fr_io_track_slot_t;
+
+struct fr_io_track_table_s {
+	uint32_t		mask;		//!< Number of slots - 1.  The number of slots is a power of 2.
+	uint32_t		num_elements;	//!< Number of live entries.
+	uint32_t		num_used;	//!< Number of live entries, plus tombstones.
+
+	fr_hash_table_hash_t	hash;		//!< Hashes an entry.
+	fr_hash_table_cmp_t	cmp;		//!< Compares two entries.
+
+	fr_io_track_slot_t	*slot;		//!< Array of slots.
+};
+
+/** Allocate a tracking table
+ *
+ * @param[in] ctx	to allocate the table in.
+ * @param[in] hash	function for entries.
+ * @param[in] cmp	function for entries.  Entries which compare
+ *			equal MUST have the same hash.
+ * @return
+ *	- NULL on error.
+ *	- the new table.
+ */
+fr_io_track_table_t *fr_io_track_table_alloc(TALLOC_CTX *ctx, fr_hash_table_hash_t hash, fr_hash_table_cmp_t cmp)
+{
+	fr_io_track_table_t *table;
+
+	table = talloc_zero(ctx, fr_io_track_table_t);
+	if (!table) {
+	nomem:
+		fr_strerror_printf("Failed allocating memory");
+		return NULL;
+	}
+
+	table->slot = talloc_zero_array(table, fr_io_track_slot_t, TRACK_TABLE_MIN_SIZE);
+	if (!table->slot) {
+		talloc_free(table);
+		goto nomem;
+	}
+
+	table->mask = TRACK_TABLE_MIN_SIZE - 1;
+	table->hash = hash;
+	table->cmp = cmp;
+
+	return table;
+}
+
+/** Rebuild the table with a new number of slots, discarding tombstones
+ *
+ */
+static int track_table_resize(fr_io_track_table_t *table, uint32_t size)
+{
+	uint32_t		i, j, mask = size - 1;
+	fr_io_track_slot_t	*slot;
+
+	slot = talloc_zero_array(table, fr_io_track_slot_t, size);
+	if (!slot) {
+		fr_strerror_printf("Failed allocating memory");
+		return -1;
+	}
+
+	for (i = 0; i <= table->mask; i++) {
+		if (!table->slot[i].data || (table->slot[i].data == TOMBSTONE)) continue;
+
+		for (j = table->slot[i].hash & mask; slot[j].data; j = (j + 1) & mask);
+
+		slot[j] = table->slot[i];
+	}
+
+	talloc_free(table->slot);
+	table->slot = slot;
+	table->mask = mask;
+	table->num_used = table->num_elements;
+
+	return 0;
+}
+
+/** Find an entry in the table
+ *
+ * @param[in] table	to search.
+ * @param[in] key	an entry which compares equal to the one we want.
+ * @return
+ *	- NULL if there is no matching entry.
+ *	- the matching entry.
+ */
+void *fr_io_track_table_find(fr_io_track_table_t *table, void const *key)
+{
+	uint32_t		hash, i;
+	fr_io_track_slot_t	*slot;
+
+	hash = table->hash(key);
+
+	for (i = hash & table->mask; ; i = (i + 1) & table->mask) {
+		slot = &table->slot[i];
+
+		if (!slot->data) return NULL;
+
+		if ((slot->data != TOMBSTONE) && (slot->hash == hash) &&
+		    (table->cmp(key, slot->data) == 0)) return slot->data;
+	}
+}
+
+/** Insert an entry into the table
+ *
+ * The first tombstone we probe over is reused for the new entry.
+ *
+ * @param[in] table	to insert into.
+ * @param[in] data	to insert.
+ * @return
+ *	- 0 on success.
+ *	- -1 if a matching entry already exists, or on allocation failure.
+ */
+int fr_io_track_table_insert(fr_io_track_table_t *table, void *data)
+{
+	uint32_t		hash, i;
+	fr_io_track_slot_t	*slot, *reuse = NULL;
+
+	/*
+	 *	Keep the load factor (including tombstones) at or
+	 *	below 3/4.  If most of the used slots are tombstones,
+	 *	just clean them out.
+	 */
+	if (((table->num_used + 1) * 4) > ((table->mask + 1) * 3)) {
+		uint32_t size = table->mask + 1;
+
+		if ((table->num_elements * 2) >= size) size *= 2;
+
+		if (track_table_resize(table, size) < 0) return -1;
+	}
+
+	hash = table->hash(data);
+
+	for (i = hash & table->mask; ; i = (i + 1) & table->mask) {
+		slot = &table->slot[i];
+
+		if (!slot->data) break;
+
+		if (slot->data == TOMBSTONE) {
+			if (!reuse) reuse = slot;
+			continue;
+		}
+
+		if ((slot->hash == hash) && (table->cmp(data, slot->data) == 0)) {
+			fr_strerror_printf("Entry already exists");
+			return -1;
+		}
+	}
+
+	if (reuse) {
+		slot = reuse;
+	} else {
+		table->num_used++;
+	}
+
+	slot->hash = hash;
+	slot->data = data;
+	table->num_elements++;
+
+	return 0;
+}
+
+/** Delete an entry from the table
+ *
+ * @param[in] table	to delete from.
+ * @param[in] data	the entry to delete.  This is compared by pointer,
+ *			not with the comparison function.
+ * @return
+ *	- true if the entry was deleted.
+ *	- false if it wasn't in the table.
+ */
+bool fr_io_track_table_delete(fr_io_track_table_t *table, void const *data)
+{
+	uint32_t		hash, i;
+	fr_io_track_slot_t	*slot;
+
+	hash = table->hash(data);
+
+	for (i = hash & table->mask; ; i = (i + 1) & table->mask) {
+		slot = &table->slot[i];
+
+		if (!slot->data) return false;
+
+		if (slot->data == data) break;
+	}
+
+	table->num_elements--;
+
+	/*
+	 *	If the next slot is in use, other entries may have
+	 *	probed past this one, so leave a tombstone.
+	 */
+	if (table->slot[(i + 1) & table->mask].data) {
+		slot->data = TOMBSTONE;
+		return true;
+	}
+
+	/*
+	 *	Otherwise this slot, and any tombstones before it,
+	 *	are at the end of a probe sequence, and can be
+	 *	emptied.
+	 */
+	do {
+		table->slot[i].data = NULL;
+		table->num_used--;
+		i = (i - 1) & table->mask;
+	} while (table->slot[i].data == TOMBSTONE);
+
+	return true;
+}
+
+/** Return the number of entries in the table
+ *
+ * @param[in] table	to check.
+ * @return the number of entries.
+ */
+uint32_t fr_io_track_table_num_elements(fr_io_track_table_t const *table)
+{
+	return table->num_elements;
+}
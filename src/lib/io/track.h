@@ -0,0 +1,53 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file io/track.h
+ * @brief Open addressing hash table for tracking packets.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(track_h, "$Id$")
+
+#include <freeradius-devel/util/hash.h>
+
+#include <talloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_io_track_table_s fr_io_track_table_t;
+
+fr_io_track_table_t	*fr_io_track_table_alloc(TALLOC_CTX *ctx, fr_hash_table_hash_t hash,
+						 fr_hash_table_cmp_t cmp) CC_HINT(nonnull(2,3));
+
+void			*fr_io_track_table_find(fr_io_track_table_t *table, void const *key) CC_HINT(nonnull);
+
+int			fr_io_track_table_insert(fr_io_track_table_t *table, void *data) CC_HINT(nonnull);
+
+bool			fr_io_track_table_delete(fr_io_track_table_t *table, void const *data) CC_HINT(nonnull);
+
+uint32_t		fr_io_track_table_num_elements(fr_io_track_table_t const *table) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
@@ -59,8 +59,19 @@ RCSID("$Id$")
 #include <freeradius-devel/io/channel.h>
 #include <freeradius-devel/io/message.h>
 #include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/server/client.h>
+#include <freeradius-devel/server/metrics.h>
+#include <freeradius-devel/server/trace.h>
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/probe.h>
+#include <freeradius-devel/util/regex.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
 
 #ifdef WITH_VERIFY_PTR
 static void worker_verify(fr_worker_t *worker);
@@ -71,6 +82,14 @@ static void worker_verify(fr_worker_t *worker);
 
 static _Thread_local fr_worker_t *thread_local_worker;
 
+/** Number of workers which are idle, and can take work from a busy worker
+ *
+ * This is only a hint.  Busy workers claim one "idle" token per
+ * request they hand back, so that they don't all give their work
+ * to the same idle worker.
+ */
+static atomic_uint_fast32_t worker_num_idle = ATOMIC_VAR_INIT(0);
+
 /**
  *  A worker which takes packets from a master, and processes them.
  */
@@ -94,8 +113,10 @@ struct fr_worker_s {
 	int			num_channels;	//!< actual number of channels
 
 	fr_heap_t      		*runnable;	//!< current runnable requests which we've spent time processing
+	fr_heap_t		*backlog;	//!< messages we haven't started yet (work stealing only)
 	fr_heap_t		*time_order;	//!< time ordered heap of requests
 	rbtree_t		*dedup;		//!< de-dup tree
+	rbtree_t		*metrics;	//!< cached metric series by server and packet type
 
 	fr_io_stats_t		stats;		//!< input / output stats
 	fr_time_elapsed_t	cpu_time;	//!< histogram of total CPU time per request
@@ -107,17 +128,44 @@ struct fr_worker_s {
 	fr_time_delta_t		predicted;	//!< How long we predict a request will take to execute.
 	fr_time_tracking_t	tracking;	//!< how much time the worker has spent doing things.
 
+#ifdef HAVE_REGEX
+	fr_regex_cache_stats_t const *regex_cache;	//!< this thread's regex cache statistics
+#endif
+
 	bool			was_sleeping;	//!< used to suppress multiple sleep signals in a row
+	bool			idle;		//!< we've added ourselves to worker_num_idle
+	bool			sleeping;	//!< we've told our channels that we're sleeping
 	bool			exiting;	//!< are we exiting?
 
 	fr_time_t		checked_timeout; //!< when we last checked the tails of the queues
 
+	fr_time_delta_t		spin_budget;	//!< how long we poll channels before sleeping
+
 	fr_event_timer_t const	*ev_cleanup;	//!< timer for max_request_time
 
 	fr_channel_t		**channel;	//!< list of channels
 };
 
+/** Metric series for requests to a virtual server, of a particular type
+ *
+ */
+typedef struct {
+	CONF_SECTION const	*server_cs;	//!< Virtual server.
+	unsigned int		code;		//!< Request packet code.
+	unsigned int		reply_code;	//!< Reply packet code.
+
+	fr_metric_series_t	*requests;	//!< Count of requests.
+	fr_metric_series_t	*duration;	//!< From receiving the request to sending the reply.
+} worker_metrics_t;
+
+static pthread_once_t worker_metrics_once = PTHREAD_ONCE_INIT;
+static fr_metric_t *worker_requests_metric;
+static fr_metric_t *worker_duration_metric;
+static fr_metric_t *worker_client_metric;
+static fr_metric_t *worker_client_duration_metric;
+
 static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now);
+static void worker_backlog_purge(fr_worker_t *worker, fr_channel_t *ch);
 
 /** Callback which handles a message being received on the worker side.
  *
@@ -132,6 +180,17 @@ static void worker_recv_request(void *ctx, fr_channel_t *ch, fr_channel_data_t *
 	worker->stats.in++;
 	DEBUG3("Received request %" PRIu64 "", worker->stats.in);
 	cd->channel.ch = ch;
+
+	/*
+	 *	When work stealing, we don't decode the packet until
+	 *	we're ready to run it.  That way another worker can
+	 *	take it if we're busy.
+	 */
+	if (worker->backlog && !cd->request.handoff) {
+		(void) fr_heap_insert(worker->backlog, cd);
+		return;
+	}
+
 	worker_request_bootstrap(worker, cd, fr_time());
 }
 
@@ -241,6 +300,8 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 
 			ms = fr_channel_responder_uctx_get(ch);
 
+			if (worker->backlog) worker_backlog_purge(worker, ch);
+
 			fr_channel_responder_ack_close(ch);
 			fr_assert(ms != NULL);
 			fr_message_set_gc(ms);
@@ -334,6 +395,8 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 	reply->reply.cpu_time = worker->tracking.running_total;
 	reply->reply.processing_time = 10; /* @todo - set to something better? */
 	reply->reply.request_time = cd->request.recv_time;
+	reply->reply.queue_time = 0;
+	reply->reply.handoff = NULL;
 
 	reply->listen = cd->listen;
 	reply->packet_ctx = cd->packet_ctx;
@@ -353,6 +416,139 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 	worker->stats.out++;
 }
 
+/** Return a request we haven't started to the network thread
+ *
+ * The network thread then sends it to a different worker.  The
+ * original message is not marked as done, as the other worker will
+ * do that.
+ *
+ * @param[in] worker	the worker
+ * @param[in] cd	the message to return
+ * @param[in] now	when the message is returned
+ */
+static void worker_handoff(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now)
+{
+	fr_channel_data_t	*reply;
+	fr_channel_t		*ch;
+	fr_message_set_t	*ms;
+
+	ch = cd->channel.ch;
+
+	if (!fr_cond_assert_msg(fr_channel_active(ch), "Wanted to return request but channel has been closed")) {
+		fr_message_done(&cd->m);
+		return;
+	}
+
+	ms = fr_channel_responder_uctx_get(ch);
+	fr_assert(ms != NULL);
+
+	reply = (fr_channel_data_t *) fr_message_reserve(ms, 0);
+	fr_assert(reply != NULL);
+
+	reply->m.when = now;
+	reply->reply.cpu_time = worker->tracking.running_total;
+	reply->reply.processing_time = 0;
+	reply->reply.request_time = cd->request.recv_time;
+	reply->reply.queue_time = 0;
+	reply->reply.handoff = cd;
+
+	reply->listen = cd->listen;
+	reply->packet_ctx = cd->packet_ctx;
+
+	cd->request.handoff = true;
+
+	if (fr_channel_send_reply(ch, reply) < 0) {
+		DEBUG2("Failed returning request to channel");
+		fr_message_done(&cd->m);
+	}
+
+	worker->stats.out++;
+}
+
+/** Remove messages for a closed channel from the backlog
+ *
+ * @param[in] worker	the worker
+ * @param[in] ch	the channel which is closing
+ */
+static void worker_backlog_purge(fr_worker_t *worker, fr_channel_t *ch)
+{
+	fr_heap_iter_t		iter;
+	fr_channel_data_t	*cd;
+
+redo:
+	for (cd = fr_heap_iter_init(worker->backlog, &iter);
+	     cd != NULL;
+	     cd = fr_heap_iter_next(worker->backlog, &iter)) {
+		if (cd->channel.ch != ch) continue;
+
+		(void) fr_heap_extract(worker->backlog, cd);
+		fr_message_done(&cd->m);
+		goto redo;
+	}
+}
+
+/** Mark ourselves as idle, or busy
+ *
+ * @param[in] worker	the worker
+ * @param[in] idle	whether or not we have any work to do
+ */
+static void worker_idle_set(fr_worker_t *worker, bool idle)
+{
+	uint_fast32_t num;
+
+	if (idle == worker->idle) return;
+	worker->idle = idle;
+
+	if (idle) {
+		atomic_fetch_add_explicit(&worker_num_idle, 1, memory_order_relaxed);
+		return;
+	}
+
+	/*
+	 *	Take back our token, unless a busy worker has
+	 *	already claimed it.
+	 */
+	num = atomic_load_explicit(&worker_num_idle, memory_order_relaxed);
+	while ((num > 0) &&
+	       !atomic_compare_exchange_weak_explicit(&worker_num_idle, &num, num - 1,
+						      memory_order_relaxed, memory_order_relaxed));
+}
+
+/** Start requests from the backlog, or give them away
+ *
+ * If we have nothing runnable, start the next request in the backlog.
+ * Otherwise, we're busy, and we give the oldest requests away, one
+ * for each idle worker.
+ *
+ * @param[in] worker	the worker
+ * @param[in] now	the current time
+ */
+static void worker_backlog_service(fr_worker_t *worker, fr_time_t now)
+{
+	fr_channel_data_t *cd;
+
+	if (!worker->backlog || !fr_heap_num_elements(worker->backlog)) return;
+
+	if (fr_heap_num_elements(worker->runnable) == 0) {
+		cd = fr_heap_pop(worker->backlog);
+		worker_request_bootstrap(worker, cd, now);
+		return;
+	}
+
+	while ((cd = fr_heap_peek(worker->backlog)) != NULL) {
+		uint_fast32_t num;
+
+		num = atomic_load_explicit(&worker_num_idle, memory_order_relaxed);
+		do {
+			if (num == 0) return;
+		} while (!atomic_compare_exchange_weak_explicit(&worker_num_idle, &num, num - 1,
+								memory_order_relaxed, memory_order_relaxed));
+
+		(void) fr_heap_pop(worker->backlog);
+		worker_handoff(worker, cd, now);
+	}
+}
+
 static void worker_max_request_timer(fr_worker_t *worker);
 
 
@@ -363,6 +559,107 @@ static void worker_max_request_timer(fr_worker_t *worker);
  * @param[in] size		The maximum size of the reply data
  * @param[in] now		The current time
  */
+static void worker_metrics_register(void)
+{
+	worker_requests_metric = fr_metric_register("freeradius_requests",
+						    "Requests processed, by virtual server, packet type, and reply type.",
+						    FR_METRIC_COUNTER);
+	worker_duration_metric = fr_metric_register("freeradius_request_duration_seconds",
+						    "Time from receiving a request to sending the reply.",
+						    FR_METRIC_HISTOGRAM);
+	worker_client_metric = fr_metric_register("freeradius_client_requests",
+						  "Requests processed, by client.",
+						  FR_METRIC_COUNTER);
+	worker_client_duration_metric = fr_metric_register("freeradius_client_request_duration_seconds",
+							   "Time from receiving a request to sending the reply, by client.",
+							   FR_METRIC_HISTOGRAM);
+}
+
+static int worker_metrics_cmp(void const *one, void const *two)
+{
+	worker_metrics_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->server_cs > b->server_cs) - (a->server_cs < b->server_cs);
+	if (ret != 0) return ret;
+
+	ret = (a->code > b->code) - (a->code < b->code);
+	if (ret != 0) return ret;
+
+	return (a->reply_code > b->reply_code) - (a->reply_code < b->reply_code);
+}
+
+/** Write the name of a packet type as a label value
+ *
+ */
+static void worker_metrics_packet_type(char *out, size_t outlen, REQUEST *request, unsigned int code)
+{
+	fr_dict_attr_t const	*da;
+	fr_dict_enum_t const	*enumv = NULL;
+
+	da = fr_dict_attr_by_name(request->dict, "Packet-Type");
+	if (da) enumv = fr_dict_enum_by_value(da, fr_box_uint32(code));
+
+	if (enumv) {
+		fr_metric_label_escape(out, outlen, enumv->name);
+	} else {
+		snprintf(out, outlen, "%u", code);
+	}
+}
+
+/** Update the metrics for a request we're replying to
+ *
+ * The series are cached in the worker, so in the common case this is
+ * one tree lookup.
+ */
+static void worker_metrics_update(fr_worker_t *worker, REQUEST *request, fr_time_t now)
+{
+	worker_metrics_t	find, *wm;
+	char			server[128], labels[512];
+
+	find.server_cs = request->server_cs;
+	find.code = request->packet->code;
+	find.reply_code = request->reply->code;
+
+	wm = rbtree_finddata(worker->metrics, &find);
+	if (!wm) {
+		char type[64], reply[64];
+
+		MEM(wm = talloc(worker->metrics, worker_metrics_t));
+		*wm = find;
+
+		fr_metric_label_escape(server, sizeof(server),
+				       request->server_cs ? cf_section_name2(request->server_cs) : "none");
+		worker_metrics_packet_type(type, sizeof(type), request, find.code);
+		worker_metrics_packet_type(reply, sizeof(reply), request, find.reply_code);
+
+		snprintf(labels, sizeof(labels), "server=\"%s\",type=\"%s\",reply=\"%s\"", server, type, reply);
+		wm->requests = fr_metric_series(worker_requests_metric, labels);
+
+		snprintf(labels, sizeof(labels), "server=\"%s\",type=\"%s\"", server, type);
+		wm->duration = fr_metric_series(worker_duration_metric, labels);
+
+		(void) rbtree_insert(worker->metrics, wm);
+	}
+
+	fr_metric_inc(wm->requests, 1);
+	if (now > request->async->recv_time) fr_metric_observe(wm->duration, now - request->async->recv_time);
+
+	/*
+	 *	Clients may be dynamic, so we don't cache
+	 *	pointers to them.
+	 */
+	if (request->client && request->client->shortname) {
+		fr_metric_label_escape(server, sizeof(server), request->client->shortname);
+		snprintf(labels, sizeof(labels), "client=\"%s\"", server);
+		fr_metric_inc(fr_metric_series(worker_client_metric, labels), 1);
+		if (now > request->async->recv_time) {
+			fr_metric_observe(fr_metric_series(worker_client_duration_metric, labels),
+					  now - request->async->recv_time);
+		}
+	}
+}
+
 static void worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t size, fr_time_t now)
 {
 	fr_channel_data_t *reply;
@@ -435,6 +732,8 @@ static void worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t size
 		 */
 		fr_assert((size_t) slen <= reply->m.rb_size);
 		(void) fr_message_alloc(ms, &reply->m, slen);
+
+		FR_PROBE4(reply_encode, request->number, request->reply->code, request->async->recv_time, slen);
 	}
 
 	/*
@@ -453,6 +752,11 @@ static void worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t size
 	reply->reply.cpu_time = worker->tracking.running_total;
 	reply->reply.processing_time = request->async->tracking.running_total;
 	reply->reply.request_time = request->async->recv_time;
+	reply->reply.queue_time = 0;
+	if (request->async->run_time > request->async->recv_time) {
+		reply->reply.queue_time = request->async->run_time - request->async->recv_time;
+	}
+	reply->reply.handoff = NULL;
 
 	reply->listen = request->async->listen;
 	reply->packet_ctx = request->async->packet_ctx;
@@ -463,6 +767,9 @@ static void worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t size
 	fr_time_elapsed_update(&worker->cpu_time, now, now + reply->reply.processing_time);
 	fr_time_elapsed_update(&worker->wall_clock, reply->reply.request_time, now);
 
+	worker_metrics_update(worker, request, now);
+	if (request->trace) fr_trace_finish(request, now);
+
 	RDEBUG("Finished request");
 
 	/*
@@ -615,8 +922,8 @@ static void worker_max_request_timer(fr_worker_t *worker)
 	cleanup += worker->config.max_request_time;
 
 	DEBUG2("Resetting cleanup timer to +%pV", fr_box_time_delta(worker->config.max_request_time));
-	if (fr_event_timer_at(worker, worker->el, &worker->ev_cleanup,
-			      cleanup, worker_max_request_time, worker) < 0) {
+	if (fr_event_timer_coarse_at(worker, worker->el, &worker->ev_cleanup,
+				     cleanup, worker_max_request_time, worker) < 0) {
 		ERROR("Failed inserting max_request_time timer");
 	}
 }
@@ -757,6 +1064,9 @@ nak:
 		return;
 	}
 
+	FR_PROBE3(request_start, request->number, request->packet->code, request->async->recv_time);
+	if (cd->request.traced) fr_trace_start(request, request->async->recv_time);
+
 	/*
 	 *	We're done with this message.
 	 */
@@ -874,6 +1184,7 @@ redo:
 	REQUEST_VERIFY(request);
 	fr_assert(request->runnable_id < 0);
 	fr_time_tracking_resume(&request->async->tracking, now);
+	if (!request->async->run_time) request->async->run_time = now;
 
 	fr_assert(request->parent == NULL);
 	fr_assert(request->async->process != NULL);
@@ -973,6 +1284,20 @@ static int8_t worker_runnable_cmp(void const *one, void const *two)
 	return (a->async->recv_time > b->async->recv_time) - (a->async->recv_time < b->async->recv_time);
 }
 
+/**
+ *  Track a message in the "backlog" heap.
+ */
+static int8_t worker_backlog_cmp(void const *one, void const *two)
+{
+	fr_channel_data_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->priority > b->priority) - (a->priority < b->priority);
+	if (ret != 0) return ret;
+
+	return (a->request.recv_time > b->request.recv_time) - (a->request.recv_time < b->request.recv_time);
+}
+
 /**
  *  Track a REQUEST in the "time_order" heap.
  */
@@ -1033,6 +1358,15 @@ void fr_worker_destroy(fr_worker_t *worker)
 	}
 	fr_assert(fr_heap_num_elements(worker->runnable) == 0);
 
+	/*
+	 *	Requests we never started.
+	 */
+	if (worker->backlog) {
+		fr_channel_data_t *cd;
+
+		while ((cd = fr_heap_pop(worker->backlog)) != NULL) fr_message_done(&cd->m);
+	}
+
 	/*
 	 *	Signal the channels that we're closing.
 	 *
@@ -1087,13 +1421,31 @@ nomem:
 		if (worker->config._x > _max) worker->config._x = _max; \
        } while (0)
 
-	CHECK_CONFIG(max_requests,(1 << 20),(1 << 30));
+	/*
+	 *	Workers in a pool may be limited to fewer requests.
+	 */
+	if (!worker->config.max_requests) worker->config.max_requests = (1 << 20);
+	CHECK_CONFIG(max_requests, 64, (1 << 30));
 	CHECK_CONFIG(max_channels, 64, 1024);
 	CHECK_CONFIG(talloc_pool_size, 4096, 65536);
 	CHECK_CONFIG(message_set_size, 1024, 8192);
-	CHECK_CONFIG(ring_buffer_size, (1 << 17), (1 << 20));
+	CHECK_CONFIG(ring_buffer_size, (1 << 17), (1 << 30));
 	CHECK_CONFIG(max_request_time, fr_time_delta_from_sec(30), fr_time_delta_from_sec(60));
 
+	/*
+	 *	Requests are allocated in this thread, so their
+	 *	packets and pairs come from memory reserved in each
+	 *	request.
+	 */
+	request_pool_size_set(worker->config.talloc_pool_size);
+
+#ifdef HAVE_REGEX
+	worker->regex_cache = regex_cache_stats();
+#endif
+
+	if (worker->config.spin_time > fr_time_delta_from_msec(1)) worker->config.spin_time = fr_time_delta_from_msec(1);
+	worker->spin_budget = worker->config.spin_time;
+
 	worker->channel = talloc_zero_array(worker, fr_channel_t *, worker->config.max_channels);
 	if (!worker->channel) {
 		talloc_free(worker);
@@ -1143,18 +1495,100 @@ nomem:
 		goto fail;
 	}
 
+	if (worker->config.steal) {
+		worker->backlog = fr_heap_create(worker, worker_backlog_cmp, fr_channel_data_t, channel.heap_id);
+		if (!worker->backlog) {
+			fr_strerror_printf("Failed creating backlog heap");
+			goto fail;
+		}
+	}
+
 	worker->dedup = rbtree_talloc_create(worker, worker_dedup_cmp, REQUEST, NULL, RBTREE_FLAG_NONE);
 	if (!worker->dedup) {
 		fr_strerror_printf("Failed creating de_dup tree");
 		goto fail;
 	}
 
+	worker->metrics = rbtree_talloc_create(worker, worker_metrics_cmp, worker_metrics_t, NULL, RBTREE_FLAG_NONE);
+	if (!worker->metrics) {
+		fr_strerror_printf("Failed creating metrics tree");
+		goto fail;
+	}
+	pthread_once(&worker_metrics_once, worker_metrics_register);
+
 	thread_local_worker = worker;
 
 	return worker;
 }
 
 
+/** Poll our channels for a while, and if there's nothing there, tell them we're sleeping
+ *
+ * The time we spend polling adapts.  It doubles every time we find
+ * a request, and halves every time we don't, so that an idle worker
+ * doesn't spend much CPU, and a busy one rarely needs a wakeup.
+ *
+ * @param[in] worker	the worker
+ * @return
+ *	- true if we received requests, and should not sleep.
+ *	- false if it's OK to sleep.
+ */
+static bool worker_spin(fr_worker_t *worker)
+{
+	int		i, seen;
+	bool		found = false;
+	fr_time_t	start;
+
+	start = fr_time();
+	do {
+		for (i = 0, seen = 0; (i < worker->config.max_channels) && (seen < worker->num_channels); i++) {
+			if (!worker->channel[i]) continue;
+			seen++;
+
+			while (fr_channel_recv_request(worker->channel[i])) found = true;
+		}
+	} while (!found && ((fr_time() - start) < worker->spin_budget));
+
+	if (found) {
+		worker->spin_budget *= 2;
+		if (worker->spin_budget > worker->config.spin_time) worker->spin_budget = worker->config.spin_time;
+		return true;
+	}
+
+	worker->spin_budget /= 2;
+	if (worker->spin_budget < (worker->config.spin_time / 16)) worker->spin_budget = worker->config.spin_time / 16;
+
+	/*
+	 *	Nothing arrived while we were polling.  Tell the
+	 *	network thread it has to wake us up.  Any requests
+	 *	which raced with that are received here.
+	 */
+	for (i = 0; i < worker->config.max_channels; i++) {
+		if (!worker->channel[i]) continue;
+
+		if (fr_channel_responder_sleeping(worker->channel[i]) > 0) found = true;
+	}
+	worker->sleeping = true;
+
+	return found;
+}
+
+/** Tell our channels that we're polling them again
+ *
+ * @param[in] worker	the worker
+ */
+static void worker_awake(fr_worker_t *worker)
+{
+	int i;
+
+	for (i = 0; i < worker->config.max_channels; i++) {
+		if (!worker->channel[i]) continue;
+
+		fr_channel_responder_awake(worker->channel[i]);
+	}
+	worker->sleeping = false;
+}
+
 /** The main loop and entry point of the worker thread.
  *
  * @param[in] worker the worker data structure to manage
@@ -1173,10 +1607,20 @@ void fr_worker(fr_worker_t *worker)
 		 *	There are runnable requests.  We still service
 		 *	the event loop, but we don't wait for events.
 		 */
-		wait_for_event = (fr_heap_num_elements(worker->runnable) == 0);
+		wait_for_event = (fr_heap_num_elements(worker->runnable) == 0) &&
+				 (!worker->backlog || (fr_heap_num_elements(worker->backlog) == 0));
 		if (wait_for_event) {
 			DEBUG4("Ready to process requests");
 		}
+		if (worker->backlog) worker_idle_set(worker, wait_for_event);
+
+		/*
+		 *	Adaptive signalling.  Poll the channels for a
+		 *	while before sleeping, so that the network
+		 *	thread doesn't have to wake us up for every
+		 *	packet.
+		 */
+		if (wait_for_event && worker->config.spin_time) wait_for_event = !worker_spin(worker);
 
 		/*
 		 *	Check the event list.  If there's an error
@@ -1189,6 +1633,8 @@ void fr_worker(fr_worker_t *worker)
 			break;
 		}
 
+		if (worker->sleeping) worker_awake(worker);
+
 		DEBUG3("%u event(s) pending%s",
 		       num_events == -1 ? 0 : num_events, num_events == -1 ? " - event loop exiting" : "");
 
@@ -1200,11 +1646,19 @@ void fr_worker(fr_worker_t *worker)
 			fr_event_service(worker->el);
 		}
 
+		/*
+		 *	Start (or give away) requests we haven't
+		 *	looked at yet.
+		 */
+		worker_backlog_service(worker, fr_time());
+
 		/*
 		 *	Run any outstanding requests.
 		 */
 		worker_run_request(worker, fr_time());
 	}
+
+	if (worker->backlog) worker_idle_set(worker, false);
 }
 
 /** Pre-event handler
@@ -1317,6 +1771,7 @@ fr_channel_t *fr_worker_channel_create(fr_worker_t *worker, TALLOC_CTX *ctx, fr_
 	if (!ch) return NULL;
 
 	fr_channel_set_recv_request(ch, worker, worker_recv_request);
+	fr_channel_spin_set(ch, worker->config.spin_time);
 
 	/*
 	 *	Tell the worker about the channel
@@ -1378,6 +1833,23 @@ int fr_worker_stats(fr_worker_t const *worker, int num, uint64_t *stats)
 	return 6;
 }
 
+/** Print a one line summary of the worker's load
+ *
+ * Called from other threads, so the values may be slightly stale.
+ */
+void fr_worker_perf_print(fr_worker_t const *worker, FILE *fp)
+{
+	uint64_t	active = worker->num_active;
+	unsigned int	runnable = fr_heap_num_elements(worker->runnable);
+	fr_time_t	used = worker->tracking.running_total;
+
+	fprintf(fp, "%s\tin %" PRIu64 "\tout %" PRIu64 "\tactive %" PRIu64 "\trunnable %u\tyielded %" PRIu64
+		"\tcpu %u.%06u\n",
+		worker->name, worker->stats.in, worker->stats.out, active, runnable,
+		(active > runnable) ? active - runnable : 0,
+		(unsigned int) (used / NSEC), (unsigned int) (used % NSEC) / 1000);
+}
+
 static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
 {
 	fr_worker_t const *worker = ctx;
@@ -1391,6 +1863,14 @@ static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_inf
 		fprintf(fp, "count.naks\t\t\t%" PRIu64 "\n", worker->num_naks);
 		fprintf(fp, "count.active\t\t\t%" PRIu64 "\n", worker->num_active);
 		fprintf(fp, "count.runnable\t\t\t%u\n", fr_heap_num_elements(worker->runnable));
+		fprintf(fp, "count.control_wakeups\t\t%" PRIu64 "\n", fr_control_stats(worker->control)->wakeups);
+		fprintf(fp, "count.control_messages\t\t%" PRIu64 "\n", fr_control_stats(worker->control)->messages);
+		fprintf(fp, "count.control_max_batch\t\t%" PRIu64 "\n", fr_control_stats(worker->control)->max_batch);
+#ifdef HAVE_REGEX
+		fprintf(fp, "count.regex_cache_hit\t\t%" PRIu64 "\n", worker->regex_cache->hits);
+		fprintf(fp, "count.regex_cache_miss\t\t%" PRIu64 "\n", worker->regex_cache->misses);
+		fprintf(fp, "count.regex_cache_evict\t\t%" PRIu64 "\n", worker->regex_cache->evictions);
+#endif
 	}
 
 	if ((info->argc == 0) || (strcmp(info->argv[0], "cpu") == 0)) {
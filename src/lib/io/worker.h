@@ -61,11 +61,17 @@ typedef struct {
 	int		max_channels;		//!< maximum number of channels
 
 	int             message_set_size;	//!< default start number of messages
-	int             ring_buffer_size;	//!< default start size for the ring buffers
+	int             ring_buffer_size;	//!< default start size for the ring buffers.  Set it to
+						///< the expected peak, so they don't need to grow.
 
 	fr_time_delta_t	max_request_time;	//!< maximum time a request can be processed
 
 	size_t		talloc_pool_size;	//!< for each request
+
+	bool		steal;			//!< let idle workers take requests we haven't started yet.
+
+	fr_time_delta_t	spin_time;		//!< poll channels for this long before sleeping.
+						///< Zero means the network always wakes us up.
 } fr_worker_config_t;
 
 fr_worker_t	*fr_worker_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const *name,
@@ -85,6 +91,8 @@ fr_channel_t	*fr_worker_channel_create(fr_worker_t *worker, TALLOC_CTX *ctx, fr_
 
 int		fr_worker_stats(fr_worker_t const *worker, int num, uint64_t *stats) CC_HINT(nonnull);
 
+void		fr_worker_perf_print(fr_worker_t const *worker, FILE *fp) CC_HINT(nonnull);
+
 /*
  *	From src/lib/server/module.h.  Copied here as that file
  *	includes schedule.h, which includes this file.  But that
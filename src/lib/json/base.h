@@ -42,6 +42,7 @@ RCSIDH(json_h, "$Id$")
 #  include "json_missing.h"
 
 #  include <freeradius-devel/server/base.h>
+#  include <freeradius-devel/util/sbuff.h>
 
 extern fr_table_num_sorted_t const fr_json_format_table[];
 extern size_t fr_json_format_table_len;
@@ -255,6 +256,8 @@ size_t    	fr_json_from_pair(char *out, size_t outlen, VALUE_PAIR const *vp);
 
 void		fr_json_version_print(void);
 
+ssize_t		fr_json_print_pair_list(fr_sbuff_t *out, VALUE_PAIR *vps, fr_json_format_t const *format);
+
 char		*fr_json_afrom_pair_list(TALLOC_CTX *ctx, VALUE_PAIR *vps,
 					 fr_json_format_t const *format);
 
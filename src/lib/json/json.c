@@ -38,7 +38,12 @@ fr_table_num_sorted_t const fr_json_format_table[] = {
 };
 size_t fr_json_format_table_len = NUM_ELEMENTS(fr_json_format_table);
 
+/** Initial buffer size for fr_json_afrom_pair_list, the buffer will be grown as needed
+ */
+#define JSON_PRINT_INITIAL_SIZE	256
+
 static fr_json_format_t const default_json_format = {
+	.output_mode = JSON_MODE_OBJECT,
 	.attr = { .prefix = NULL },
 	.value = { .value_as_array = true },
 };
@@ -372,83 +377,381 @@ void fr_json_version_print(void)
 }
 
 
-/** Convert VALUE_PAIR into a JSON object
+/** Characters which must be escaped in JSON strings
+ *
+ * Zero means the character can be copied verbatim, anything else is
+ * the character to write after the '\\', or 'u' for a \\u00XX escape.
+ *
+ * '/' is escaped to match the output of json-c.
+ */
+static uint8_t const json_escape_table[UINT8_MAX + 1] = {
+	[0x00 ... 0x07] = 'u', ['\b'] = 'b', ['\t'] = 't', ['\n'] = 'n',
+	[0x0b] = 'u', ['\f'] = 'f', ['\r'] = 'r', [0x0e ... 0x1f] = 'u',
+	['"'] = '"', ['\\'] = '\\', ['/'] = '/'
+};
+
+#define JSON_SWAR_ONES	(~(uint64_t)0 / UINT8_MAX)	//!< 0x0101010101010101
+#define JSON_SWAR_HIGH	(JSON_SWAR_ONES * 0x80)		//!< 0x8080808080808080
+
+/** Return true if any byte in the word is zero
+ */
+#define JSON_SWAR_HAS_ZERO(_v)		(((_v) - JSON_SWAR_ONES) & ~(_v) & JSON_SWAR_HIGH)
+
+/** Return true if any byte in the word is less than _n (_n <= 128)
+ */
+#define JSON_SWAR_HAS_LESS(_v, _n)	(((_v) - (JSON_SWAR_ONES * (_n))) & ~(_v) & JSON_SWAR_HIGH)
+
+/** Find the length of the run of characters which can be copied without escaping
+ *
+ * Checks eight bytes at a time, falling back to the lookup table for
+ * the word containing the first character that needs escaping.
+ *
+ * @param[in] in	string to scan.
+ * @param[in] end	of string.
+ * @return Number of bytes that can be copied verbatim.
+ */
+static inline size_t json_escape_span(char const *in, char const *end)
+{
+	char const *p = in;
+
+	while ((end - p) >= (ssize_t)sizeof(uint64_t)) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		if (JSON_SWAR_HAS_LESS(v, 0x20) ||
+		    JSON_SWAR_HAS_ZERO(v ^ (JSON_SWAR_ONES * '"')) ||
+		    JSON_SWAR_HAS_ZERO(v ^ (JSON_SWAR_ONES * '\\')) ||
+		    JSON_SWAR_HAS_ZERO(v ^ (JSON_SWAR_ONES * '/'))) break;
+		p += sizeof(v);
+	}
+
+	while ((p < end) && !json_escape_table[(uint8_t)*p]) p++;
+
+	return p - in;
+}
+
+/** Ensure there's enough room in the sbuff to write len bytes
+ *
+ * Extendable sbuffs are grown by doubling the talloced buffer.
+ *
+ * @param[in] out	sbuff to check.
+ * @param[in] len	we want to write.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the sbuff is not extendable, and is too small.
+ */
+static inline int json_sbuff_reserve(fr_sbuff_t *out, size_t len)
+{
+	size_t	used, alloc;
+	char	*buff;
+
+	if ((size_t)(out->end - out->p) >= len) return 0;
+
+	if (!out->is_extendable) {
+		fr_strerror_printf("Insufficient buffer space to write JSON document");
+		return -1;
+	}
+
+	used = out->p - out->start;
+	alloc = talloc_array_length(out->start);
+	if (alloc < 2) alloc = 2;
+	while ((alloc - 1 - used) < len) alloc *= 2;
+
+	MEM(buff = talloc_realloc(NULL, out->start_m, char, alloc));
+	out->start_m = buff;
+	out->p_m = buff + used;
+	out->end_m = buff + alloc - 1;	/* Always leave room for \0 byte */
+
+	return 0;
+}
+
+/** Copy len bytes into the sbuff verbatim
+ */
+static inline int json_sbuff_in_bstrncpy(fr_sbuff_t *out, char const *in, size_t len)
+{
+	if (json_sbuff_reserve(out, len) < 0) return -1;
+
+	memcpy(out->p_m, in, len);
+	out->p_m += len;
+
+	return 0;
+}
+
+#define json_sbuff_in_char(_out, _c)	json_sbuff_in_bstrncpy(_out, &(char){ _c }, 1)
+#define json_sbuff_in_strcpy_literal(_out, _str) json_sbuff_in_bstrncpy(_out, _str, sizeof(_str) - 1)
+
+#define JSON_SBUFF_RETURN(_x) do { if ((_x) < 0) return -1; } while (0)
+
+/** Write a string to the sbuff, escaping it so it's suitable for use as a JSON string
+ *
+ * Surrounding quotes are not added.
+ *
+ * @param[in] out	sbuff to write to.
+ * @param[in] in	string to escape.
+ * @param[in] inlen	length of the string.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int json_sbuff_in_escaped(fr_sbuff_t *out, char const *in, size_t inlen)
+{
+	char const	*p = in, *end = in + inlen;
+	size_t		len;
+
+	while (p < end) {
+		uint8_t c;
+
+		len = json_escape_span(p, end);
+		if (len) {
+			JSON_SBUFF_RETURN(json_sbuff_in_bstrncpy(out, p, len));
+			p += len;
+			if (p == end) break;
+		}
+
+		c = (uint8_t)*p++;
+		if (json_escape_table[c] == 'u') {
+			char buff[7];
+
+			snprintf(buff, sizeof(buff), "\\u%04x", c);
+			JSON_SBUFF_RETURN(json_sbuff_in_bstrncpy(out, buff, 6));
+			continue;
+		}
+
+		JSON_SBUFF_RETURN(json_sbuff_in_bstrncpy(out, (char[]){ '\\', json_escape_table[c] }, 2));
+	}
+
+	return 0;
+}
+
+/** Write a string to the sbuff as a quoted JSON string
+ */
+static inline int json_sbuff_in_string(fr_sbuff_t *out, char const *in, size_t inlen)
+{
+	JSON_SBUFF_RETURN(json_sbuff_in_char(out, '"'));
+	JSON_SBUFF_RETURN(json_sbuff_in_escaped(out, in, inlen));
+	return json_sbuff_in_char(out, '"');
+}
+
+/** Write an attribute name as a quoted JSON string, adding the format's prefix
+ *
+ * If the format "attr.prefix" string is set then it's prepended to the
+ * attribute name with a ':' delimiter.
+ *
+ * @param[in] out	sbuff to write to.
+ * @param[in] vp	whose name we're writing.
+ * @param[in] format	json format structure.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static inline int json_sbuff_in_attr_name(fr_sbuff_t *out, VALUE_PAIR const *vp, fr_json_format_t const *format)
+{
+	JSON_SBUFF_RETURN(json_sbuff_in_char(out, '"'));
+	if (format->attr.prefix) {
+		JSON_SBUFF_RETURN(json_sbuff_in_escaped(out, format->attr.prefix, strlen(format->attr.prefix)));
+		JSON_SBUFF_RETURN(json_sbuff_in_char(out, ':'));
+	}
+	JSON_SBUFF_RETURN(json_sbuff_in_escaped(out, vp->da->name, strlen(vp->da->name)));
+	return json_sbuff_in_char(out, '"');
+}
+
+/** Write the type of an attribute as a quoted JSON string
+ */
+static inline int json_sbuff_in_attr_type(fr_sbuff_t *out, VALUE_PAIR const *vp)
+{
+	char const *type = fr_table_str_by_value(fr_value_box_type_table, vp->vp_type, "<INVALID>");
+
+	return json_sbuff_in_string(out, type, strlen(type));
+}
+
+/** Write the presentation format of a value box as a quoted JSON string
+ *
+ * Uses a stack buffer, only allocating if the printed value is too long.
+ */
+static int json_sbuff_in_value_box_str(fr_sbuff_t *out, fr_value_box_t const *vb)
+{
+	char	buff[1024];
+	char	*tmp;
+	size_t	len;
+	int	ret;
+
+	len = fr_value_box_snprint(buff, sizeof(buff), vb, '\0');
+	if (!is_truncated(len, sizeof(buff))) return json_sbuff_in_string(out, buff, len);
+
+	tmp = fr_value_box_asprint(NULL, vb, '\0');
+	if (!tmp) {
+		fr_strerror_printf("Failed to convert attribute value to JSON string");
+		return -1;
+	}
+	ret = json_sbuff_in_string(out, tmp, talloc_array_length(tmp) - 1);
+	talloc_free(tmp);
+
+	return ret;
+}
+
+/** Write the value of a VALUE_PAIR as a JSON value
  *
  * If format.value.enum_as_int is set, and the given VP is an enum
- * value, the integer value is returned as a json_object rather
- * than the text representation.
+ * value, the integer value is written rather than the text
+ * representation.
  *
  * If format.value.always_string is set then a numeric value pair
- * will be returned as a JSON string object.
+ * will be written as a JSON string.
  *
- * @param[in] ctx	Talloc context.
- * @param[out] out	returned json object.
- * @param[in] vp	to get the value of.
- * @param[in] format	format definition, or NULL.
+ * @param[in] out	sbuff to write to.
+ * @param[in] vp	to write the value of.
+ * @param[in] format	json format structure.
  * @return
- *	- 1 if 'out' is the integer enum value, 0 otherwise
- *	- -1 on error.
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static int json_afrom_value_box(TALLOC_CTX *ctx, json_object **out,
-				VALUE_PAIR *vp, fr_json_format_t const *format)
+static int json_sbuff_in_pair_value(fr_sbuff_t *out, VALUE_PAIR *vp, fr_json_format_t const *format)
 {
-	struct json_object	*obj;
-	fr_value_box_t const	*vb;
-	fr_value_box_t		vb_str;
-	int			is_enum = 0;
+	fr_value_box_t const	*vb = &vp->data;
+	fr_value_box_t		tmp;
+	char			buff[32];
+	int			len;
 
 	fr_assert(vp);
 
-	vb = &vp->data;
-
-	if (format && format->value.enum_as_int) {
-		is_enum = fr_pair_value_enum_box(&vb, vp);
-		fr_assert(is_enum >= 0);
+	/*
+	 *	If we're writing enums as integers, then
+	 *	we must not convert the value back into its
+	 *	presentation format below.
+	 */
+	if (format->value.enum_as_int && (fr_pair_value_enum_box(&vb, vp) == 1)) {
+		tmp = *vb;
+		tmp.enumv = NULL;
+		vb = &tmp;
 	}
 
-	if (format && format->value.always_string) {
-		if (fr_value_box_cast(ctx, &vb_str, FR_TYPE_STRING, NULL, vb) == 0) {
-			vb = &vb_str;
-		} else {
-			return -1;
+	if (format->value.always_string) {
+		switch (vb->type) {
+		case FR_TYPE_STRING:
+			return json_sbuff_in_string(out, vb->vb_strvalue, vb->vb_length);
+
+		/*
+		 *	Casting octets to a string gives the raw bytes.
+		 */
+		case FR_TYPE_OCTETS:
+			return json_sbuff_in_string(out, (char const *)vb->vb_octets, vb->vb_length);
+
+		default:
+			return json_sbuff_in_value_box_str(out, vb);
 		}
 	}
 
-	MEM(obj = json_object_from_value_box(ctx, vb));
+	/*
+	 *	We're converting to PRESENTATION format
+	 *	so any attributes with enumeration values
+	 *	should be converted to string types.
+	 */
+	if (vb->enumv && fr_dict_enum_by_value(vb->enumv, vb)) return json_sbuff_in_value_box_str(out, vb);
+
+	switch (vb->type) {
+	case FR_TYPE_STRING:
+		return json_sbuff_in_string(out, vb->vb_strvalue, vb->vb_length);
+
+	case FR_TYPE_BOOL:
+		if (vb->vb_bool) return json_sbuff_in_strcpy_literal(out, "true");
+		return json_sbuff_in_strcpy_literal(out, "false");
+
+	case FR_TYPE_UINT8:
+		len = snprintf(buff, sizeof(buff), "%u", vb->vb_uint8);
+		break;
 
-	if (format && format->value.always_string) {
-		fr_value_box_clear(&vb_str);
+	case FR_TYPE_UINT16:
+		len = snprintf(buff, sizeof(buff), "%u", vb->vb_uint16);
+		break;
+
+	case FR_TYPE_UINT32:
+		len = snprintf(buff, sizeof(buff), "%u", vb->vb_uint32);
+		break;
+
+	case FR_TYPE_UINT64:
+		if (vb->vb_uint64 > INT64_MAX) return json_sbuff_in_value_box_str(out, vb);
+		len = snprintf(buff, sizeof(buff), "%" PRIu64, vb->vb_uint64);
+		break;
+
+	case FR_TYPE_INT8:
+		len = snprintf(buff, sizeof(buff), "%i", vb->vb_int8);
+		break;
+
+	case FR_TYPE_INT16:
+		len = snprintf(buff, sizeof(buff), "%i", vb->vb_int16);
+		break;
+
+	case FR_TYPE_INT32:
+		len = snprintf(buff, sizeof(buff), "%i", vb->vb_int32);
+		break;
+
+	case FR_TYPE_INT64:
+		len = snprintf(buff, sizeof(buff), "%" PRIi64, vb->vb_int64);
+		break;
+
+	default:
+		return json_sbuff_in_value_box_str(out, vb);
 	}
 
-	*out = obj;
-	return is_enum;
+	return json_sbuff_in_bstrncpy(out, buff, len);
 }
 
+/** Return true if two attributes will be written with the same name
+ */
+static inline bool json_pair_name_cmp(VALUE_PAIR const *a, VALUE_PAIR const *b)
+{
+	return (a->da == b->da) || (strcmp(a->da->name, b->da->name) == 0);
+}
 
-/** Add prefix to attribute name
- *
- * If the format "attr.prefix" string is set then prepend this
- * to the given attribute name, otherwise return name unchanged.
+/** Return true if an attribute with the same name as vp appears before it in the list
+ */
+static inline bool json_pair_name_seen(VALUE_PAIR const *vps, VALUE_PAIR const *vp)
+{
+	VALUE_PAIR const *p;
+
+	for (p = vps; p && (p != vp); p = p->next) if (json_pair_name_cmp(p, vp)) return true;
+
+	return false;
+}
+
+/** Return true if an attribute with the same name as vp appears after it in the list
+ */
+static inline bool json_pair_name_more(VALUE_PAIR const *vp)
+{
+	VALUE_PAIR const *p;
+
+	for (p = vp->next; p; p = p->next) if (json_pair_name_cmp(p, vp)) return true;
+
+	return false;
+}
+
+/** Write the values of all attributes with the same name as vp, starting at vp
  *
- * @param[out] buf where to write the new name, if set
- * @param[in] buf_len length of buf
- * @param[in] name original attribute name
- * @param[in] format json format structure
- * @return pointer to name, or buf if the prefix was added
+ * @param[in] out	sbuff to write to.
+ * @param[in] vp	first instance of the attribute.
+ * @param[in] format	json format structure.
+ * @param[in] as_array	Write the values as a JSON array, otherwise only
+ *			the value of vp is written.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static inline char const *attr_name_with_prefix(char *buf, size_t buf_len, const char *name, fr_json_format_t const *format)
+static inline int json_sbuff_in_pair_values(fr_sbuff_t *out, VALUE_PAIR *vp,
+					    fr_json_format_t const *format, bool as_array)
 {
-	int len;
+	VALUE_PAIR *p;
 
-	if (!format->attr.prefix) return name;
+	if (!as_array) return json_sbuff_in_pair_value(out, vp, format);
 
-	len = snprintf(buf, buf_len, "%s:%s", format->attr.prefix, name);
+	JSON_SBUFF_RETURN(json_sbuff_in_char(out, '['));
+	JSON_SBUFF_RETURN(json_sbuff_in_pair_value(out, vp, format));
+	for (p = vp->next; p; p = p->next) {
+		if (!json_pair_name_cmp(p, vp)) continue;
 
-	if (len == (int)strlen(buf)) {
-		return buf;
+		JSON_SBUFF_RETURN(json_sbuff_in_char(out, ','));
+		JSON_SBUFF_RETURN(json_sbuff_in_pair_value(out, p, format));
 	}
-
-	return name;
+	return json_sbuff_in_char(out, ']');
 }
 
 
@@ -507,454 +810,182 @@ bool fr_json_format_verify(fr_json_format_t const *format, bool verbose)
 }
 
 
-/** Returns a JSON object representation of a list of value pairs
+/** Write a JSON representation of a list of value pairs, grouping values by attribute
  *
- * The result is a struct json_object, which should be free'd with
- * json_object_put() by the caller. Intended to only be called by
- * fr_json_afrom_pair_list().
+ * Generates JSON_MODE_OBJECT, JSON_MODE_OBJECT_SIMPLE and JSON_MODE_ARRAY
+ * output.  mode is always a constant, so each caller gets its own copy
+ * of the function with the branches for the other modes removed.
  *
- * This function generates the "object" format, JSON_MODE_OBJECT.
- * @see fr_json_format_s
+ * Values are grouped by scanning the list for other attributes with the
+ * same name, instead of building an intermediary tree of JSON objects.
+ * Attribute lists are short, so this is faster than allocating.
  *
- * @param[in] ctx	Talloc context.
+ * @param[in] out	sbuff to write to.
  * @param[in] vps	a list of value pairs.
  * @param[in] format	Formatting control, must be set.
- * @return JSON object with the generated representation.
+ * @param[in] mode	The output mode to generate.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static json_object *json_object_afrom_pair_list(TALLOC_CTX *ctx, VALUE_PAIR *vps,
-						fr_json_format_t const *format)
+static inline CC_HINT(always_inline) int json_print_pair_list_grouped(fr_sbuff_t *out, VALUE_PAIR *vps,
+								   fr_json_format_t const *format,
+								   json_mode_type_t const mode)
 {
-	fr_cursor_t		cursor;
-	VALUE_PAIR		*vp;
-	struct json_object	*obj;
-	char			buf[FR_DICT_ATTR_MAX_NAME_LEN + 32];
-
-	/* Check format and type */
-	fr_assert(format);
-	fr_assert(format->output_mode == JSON_MODE_OBJECT);
+	VALUE_PAIR	*vp;
+	bool		first = true;
 
-	MEM(obj = json_object_new_object());
+	/*
+	 *	In "array" mode attribute values are only grouped
+	 *	if values should be written in a list format.
+	 */
+	bool		grouped = (mode != JSON_MODE_ARRAY) || format->value.value_as_array;
 
-	for (vp = fr_cursor_init(&cursor, &vps);
-	     vp;
-	     vp = fr_cursor_next(&cursor)) {
-		char const		*attr_name;
-		struct json_object	*vp_object, *values, *value, *type_name;
+	JSON_SBUFF_RETURN(json_sbuff_in_char(out, (mode == JSON_MODE_ARRAY) ? '[' : '{'));
 
-		/*
-		 *	Get attribute name and value.
-		 */
-		attr_name = attr_name_with_prefix(buf, sizeof(buf), vp->da->name, format);
+	for (vp = vps; vp; vp = vp->next) {
+		bool as_array = format->value.value_as_array;
 
-		if (json_afrom_value_box(ctx, &value, vp, format) < 0) {
-			fr_strerror_printf("Failed to convert attribute value to JSON object");
-		error:
-			json_object_put(obj);
-			return NULL;
-		}
-
-		/*
-		 *	Look in the table to see if we already have
-		 *	a key for the attribute we're working on.
-		 */
-		if (!json_object_object_get_ex(obj, attr_name, &vp_object)) {
+		if (grouped) {
 			/*
-			 *	Wasn't there, so create a new object for this attribute.
+			 *	Already written out along with
+			 *	the first instance of the attribute.
 			 */
-			MEM(vp_object = json_object_new_object());
-			json_object_object_add(obj, attr_name, vp_object);
+			if (json_pair_name_seen(vps, vp)) continue;
 
-			/*
-			 *	Add "type" to newly created keys.
-			 */
-			MEM(type_name = json_object_new_string(fr_table_str_by_value(fr_value_box_type_table,
-										     vp->vp_type, "<INVALID>")));
-			json_object_object_add(vp_object, "type", type_name);
-
-			/*
-			 *	Create a "value" array to hold any attribute values for this attribute...
-			 */
-			if (format->value.value_as_array) {
-				MEM(values = json_object_new_array());
-				json_object_object_add(vp_object, "value", values);
-			} else {
-				/*
-				 *	...unless this is the first time we've seen the attribute and
-				 *	value_as_array is false, in which case just add the value directly
-				 *	and move on to the next attribute.
-				 */
-				json_object_object_add(vp_object, "value", value);
-				continue;
-			}
-		} else {
-			/*
-			 *	Find the 'values' array to add the current value to.
-			 */
-			if (!fr_cond_assert(json_object_object_get_ex(vp_object, "value", &values))) {
-				fr_strerror_printf("Inconsistent JSON tree");
-				goto error;
-			}
-
-			/*
-			 *	If value_as_array is no set then "values" may not be an array, so it will
-			 *	need converting to an array to add this extra attribute.
-			 */
-			if (!format->value.value_as_array) {
-				json_type		type;
-				struct json_object	*convert_value = values;
-
-				/* Check "values" type */
-				type = json_object_get_type(values);
-
-				/* It wasn't an array, so turn it into one with the old value as the first entry */
-				if (type != json_type_array) {
-					MEM(values = json_object_new_array());
-					json_object_array_add(values, json_object_get(convert_value));
-					json_object_object_del(vp_object, "value");
-					json_object_object_add(vp_object, "value", values);
-				}
-			}
+			if (!as_array) as_array = json_pair_name_more(vp);
 		}
 
-		/*
-		 *	Append to the JSON array.
-		 */
-		json_object_array_add(values, value);
-	}
-
-	return obj;
-}
-
+		if (!first) JSON_SBUFF_RETURN(json_sbuff_in_char(out, ','));
+		first = false;
 
-/** Returns a JSON object representation of a list of value pairs
- *
- * The result is a struct json_object, which should be free'd with
- * json_object_put() by the caller. Intended to only be called by
- * fr_json_afrom_pair_list().
- *
- * This function generates the "simple object" format, JSON_MODE_OBJECT_SIMPLE.
- * @see fr_json_format_s
- *
- * @param[in] ctx	Talloc context.
- * @param[in] vps	a list of value pairs.
- * @param[in] format	Formatting control, must be set.
- * @return JSON object with the generated representation.
- */
-static json_object *json_smplobj_afrom_pair_list(TALLOC_CTX *ctx, VALUE_PAIR *vps,
-						 fr_json_format_t const *format)
-{
-	fr_cursor_t		cursor;
-	VALUE_PAIR		*vp;
-	struct json_object	*obj;
-	char			buf[FR_DICT_ATTR_MAX_NAME_LEN + 32];
-	json_type		type;
-
-	/* Check format and type */
-	fr_assert(format);
-	fr_assert(format->output_mode == JSON_MODE_OBJECT_SIMPLE);
-
-	MEM(obj = json_object_new_object());
+		switch (mode) {
+		case JSON_MODE_OBJECT:
+			JSON_SBUFF_RETURN(json_sbuff_in_attr_name(out, vp, format));
+			JSON_SBUFF_RETURN(json_sbuff_in_strcpy_literal(out, ":{\"type\":"));
+			JSON_SBUFF_RETURN(json_sbuff_in_attr_type(out, vp));
+			JSON_SBUFF_RETURN(json_sbuff_in_strcpy_literal(out, ",\"value\":"));
+			break;
 
-	for (vp = fr_cursor_init(&cursor, &vps);
-	     vp;
-	     vp = fr_cursor_next(&cursor)) {
-		char const		*attr_name;
-		struct json_object	*vp_object, *value;
-		struct json_object	*values = NULL;
-		bool			add_single = false;
+		case JSON_MODE_OBJECT_SIMPLE:
+			JSON_SBUFF_RETURN(json_sbuff_in_attr_name(out, vp, format));
+			JSON_SBUFF_RETURN(json_sbuff_in_char(out, ':'));
+			break;
 
-		/*
-		 *	Get attribute name and value.
-		 */
-		attr_name = attr_name_with_prefix(buf, sizeof(buf), vp->da->name, format);
+		case JSON_MODE_ARRAY:
+			JSON_SBUFF_RETURN(json_sbuff_in_strcpy_literal(out, "{\"name\":"));
+			JSON_SBUFF_RETURN(json_sbuff_in_attr_name(out, vp, format));
+			JSON_SBUFF_RETURN(json_sbuff_in_strcpy_literal(out, ",\"type\":"));
+			JSON_SBUFF_RETURN(json_sbuff_in_attr_type(out, vp));
+			JSON_SBUFF_RETURN(json_sbuff_in_strcpy_literal(out, ",\"value\":"));
+			break;
 
-		if (json_afrom_value_box(ctx, &value, vp, format) < 0) {
-			fr_strerror_printf("Failed to convert attribute value to JSON object");
-			json_object_put(obj);
-			return NULL;
+		default:
+			fr_assert(0);
+			return -1;
 		}
 
-		/*
-		 *	See if we already have a key in the table we're working on,
-		 *	if not then create a new one.
-		 */
-		if (!json_object_object_get_ex(obj, attr_name, &vp_object)) {
-			if (format->value.value_as_array) {
-				/*
-				 *	We have been asked to ensure /all/ values are lists,
-				 *	even if there's only one attribute.
-				 */
-				MEM(values = json_object_new_array());
-				json_object_object_add(obj, attr_name, values);
-			} else {
-				/*
-				 *	Deal with it later on.
-				 */
-				add_single = true;
-			}
-		/*
-		 *	If we do have the key already, get its value array.
-		 */
-		} else {
-			type = json_object_get_type(vp_object);
-
-			if (type == json_type_array) {
-				values = vp_object;
-			} else {
-				/*
-				 *	We've seen one of these before, but didn't add
-				 *	it as an array the first time. Sort that out.
-				 */
-				MEM(values = json_object_new_array());
-				json_object_array_add(values, json_object_get(vp_object));
-				json_object_object_del(obj, attr_name);
-				json_object_object_add(obj, attr_name, values);
-			}
-		}
+		JSON_SBUFF_RETURN(json_sbuff_in_pair_values(out, vp, format, as_array));
 
-		if (add_single) {
-			/*
-			 *	Only ever used the first time adding a new
-			 *	attribute when "value_as_array" is not set.
-			 */
-			json_object_object_add(obj, attr_name, value);
-		} else {
-			/*
-			 *	Otherwise we're always appending to a JSON array.
-			 */
-			json_object_array_add(values, value);
-		}
+		if (mode != JSON_MODE_OBJECT_SIMPLE) JSON_SBUFF_RETURN(json_sbuff_in_char(out, '}'));
 	}
 
-	return obj;
+	return json_sbuff_in_char(out, (mode == JSON_MODE_ARRAY) ? ']' : '}');
 }
 
-
-/** Returns a JSON array representation of a list of value pairs
+/** Write a JSON array of the values or names of a list of value pairs
  *
- * The result is a struct json_object, which should be free'd with
- * json_object_put() by the caller. Intended to only be called by
- * fr_json_afrom_pair_list().
+ * Generates JSON_MODE_ARRAY_OF_VALUES and JSON_MODE_ARRAY_OF_NAMES output,
+ * listing either just the attribute values, or just the attribute names
+ * in order.
  *
- * This function generates the "array" format, JSON_MODE_ARRAY.
- * @see fr_json_format_s
- *
- * @param[in] ctx	Talloc context.
+ * @param[in] out	sbuff to write to.
  * @param[in] vps	a list of value pairs.
  * @param[in] format	Formatting control, must be set.
- * @return JSON object with the generated representation.
+ * @param[in] mode	The output mode to generate.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static struct json_object *json_array_afrom_pair_list(TALLOC_CTX *ctx, VALUE_PAIR *vps,
-						      fr_json_format_t const *format)
+static inline CC_HINT(always_inline) int json_print_pair_list_flat(fr_sbuff_t *out, VALUE_PAIR *vps,
+								fr_json_format_t const *format,
+								json_mode_type_t const mode)
 {
-	fr_cursor_t		cursor;
-	VALUE_PAIR		*vp;
-	struct json_object	*obj;
-	struct json_object	*seen_attributes = NULL;
-	char			buf[FR_DICT_ATTR_MAX_NAME_LEN + 32];
-
-	/* Check format and type */
-	fr_assert(format);
-	fr_assert(format->output_mode == JSON_MODE_ARRAY);
+	VALUE_PAIR *vp;
 
-	MEM(obj = json_object_new_array());
+	JSON_SBUFF_RETURN(json_sbuff_in_char(out, '['));
 
-	/*
-	 *	If attribute values should be in a list format, then keep track
-	 *	of the attributes we've previously seen in a JSON object.
-	 */
-	if (format->value.value_as_array) {
-		seen_attributes = json_object_new_object();
-	}
+	for (vp = vps; vp; vp = vp->next) {
+		if (vp != vps) JSON_SBUFF_RETURN(json_sbuff_in_char(out, ','));
 
-	for (vp = fr_cursor_init(&cursor, &vps);
-	     vp;
-	     vp = fr_cursor_next(&cursor)) {
-		char const		*attr_name;
-		struct json_object	*name, *value, *type_name;
-		struct json_object	*values = NULL;
-		struct json_object	*attrobj = NULL;
-		bool			already_seen = false;
-
-		/*
-		 *	Get attribute name and value.
-		 */
-		attr_name = attr_name_with_prefix(buf, sizeof(buf), vp->da->name, format);
-
-		if (json_afrom_value_box(ctx, &value, vp, format) < 0) {
-			fr_strerror_printf("Failed to convert attribute value to JSON object");
-			json_object_put(obj);
-			return NULL;
-		}
-
-		if (format->value.value_as_array) {
-			/*
-			 *	Try and find this attribute in the "seen_attributes" object. If it is
-			 *	there then get the "values" array to add this attribute value to.
-			 */
-			already_seen = json_object_object_get_ex(seen_attributes, attr_name, &values);
-		}
-
-		/*
-		 *	If we're adding all attributes to the toplevel array, or we're adding values
-		 *	to an array of an existing attribute but haven't seen it before, then we need
-		 *	to create a new JSON object for this attribute.
-		 */
-		if (!format->value.value_as_array || !already_seen) {
-			/*
-			 * Create object and add it to top-level array
-			 */
-			MEM(attrobj = json_object_new_object());
-			json_object_array_add(obj, attrobj);
-
-			/*
-			 * Add the attribute name in the "name" key and the type in the "type" key
-			 */
-			MEM(name = json_object_new_string(attr_name));
-			json_object_object_add(attrobj, "name", name);
-
-			MEM(type_name = json_object_new_string(fr_table_str_by_value(fr_value_box_type_table,
-										     vp->vp_type, "<INVALID>")));
-			json_object_object_add(attrobj, "type", type_name);
-		}
-
-		if (format->value.value_as_array) {
-			/*
-			 *	We're adding values to an array for the first copy of this attribute
-			 *	that we saw. First time around we need to create an array.
-			 */
-			if (!already_seen) {
-				MEM(values = json_object_new_array());
-				/*
-				 * Add "value":[] key to the attribute object
-				 */
-				json_object_object_add(attrobj, "value", values);
-
-				/*
-				 * Also add to "seen_attributes" to check later
-				 */
-				json_object_object_add(seen_attributes, attr_name, json_object_get(values));
-			}
-
-			/*
-			 *	Always add the value to the respective "values" array.
-			 */
-			json_object_array_add(values, value);
+		if (mode == JSON_MODE_ARRAY_OF_NAMES) {
+			JSON_SBUFF_RETURN(json_sbuff_in_attr_name(out, vp, format));
 		} else {
-			/*
-			 * This is simpler; just add a "value": key to the attribute object.
-			 */
-			json_object_object_add(attrobj, "value", value);
+			JSON_SBUFF_RETURN(json_sbuff_in_pair_value(out, vp, format));
 		}
-
-	}
-
-	/*
-	 *	No longer need the "seen_attributes" object, it was just used for tracking.
-	 */
-	if (format->value.value_as_array) {
-		json_object_put(seen_attributes);
 	}
 
-	return obj;
+	return json_sbuff_in_char(out, ']');
 }
 
-
-/** Returns a JSON array of a list of value pairs
+/** Write a JSON document representing a list of value pairs to an sbuff
  *
- * The result is a struct json_object, which should be free'd with
- * json_object_put() by the caller. Intended to only be called by
- * fr_json_afrom_pair_list().
+ * The document is written directly from the pair list, without building
+ * an intermediary tree of json-c objects.  If the sbuff is extendable
+ * (i.e. was initialised with fr_sbuff_aprint_talloc_init) the buffer
+ * will be grown as needed, otherwise the function will fail if the
+ * document doesn't fit.
  *
- * This function generates the "array_of_values" format,
- * JSON_MODE_ARRAY_OF_VALUES, listing just the attribute values. 
- * @see fr_json_format_s
+ * On success the output is \0 terminated.
  *
- * @param[in] ctx	Talloc context.
+ * @see fr_json_afrom_pair_list
+ *
+ * @param[in] out	sbuff to write to.
  * @param[in] vps	a list of value pairs.
- * @param[in] format	Formatting control, must be set.
- * @return JSON object with the generated representation.
+ * @param[in] format	Formatting control, can be NULL to use default format.
+ * @return
+ *	- The number of bytes written on success.
+ *	- -1 on failure.
  */
-static struct json_object *json_value_array_afrom_pair_list(TALLOC_CTX *ctx, VALUE_PAIR *vps,
-							    fr_json_format_t const *format)
+ssize_t fr_json_print_pair_list(fr_sbuff_t *out, VALUE_PAIR *vps, fr_json_format_t const *format)
 {
-	fr_cursor_t		cursor;
-	VALUE_PAIR		*vp;
-	struct json_object	*obj;
-
-	/* Check format and type */
-	fr_assert(format);
-	fr_assert(format->output_mode == JSON_MODE_ARRAY_OF_VALUES);
-
-	MEM(obj = json_object_new_array());
-
-	/*
-	 *	This array format is very simple - just add all the
-	 *	attribute values to the array in order.
-	 */
-	for (vp = fr_cursor_init(&cursor, &vps);
-	     vp;
-	     vp = fr_cursor_next(&cursor)) {
-		struct json_object	*value;
-
-		if (json_afrom_value_box(ctx, &value, vp, format) < 0) {
-			fr_strerror_printf("Failed to convert attribute value to JSON object");
-			json_object_put(obj);
-			return NULL;
-		}
-
-		json_object_array_add(obj, value);
-	}
-
-	return obj;
-}
+	char const	*start = out->p;
+	int		ret;
 
+	if (!format) format = &default_json_format;
 
-/** Returns a JSON array of a list of value pairs
- *
- * The result is a struct json_object, which should be free'd with
- * json_object_put() by the caller. Intended to only be called by
- * fr_json_afrom_pair_list().
- *
- * This function generates the "array_of_names" format,
- * JSON_MODE_ARRAY_OF_NAMES, listing just the attribute names. 
- * @see fr_json_format_s
- *
- * @param[in] ctx	Talloc context.
- * @param[in] vps	a list of value pairs.
- * @param[in] format	Formatting control, must be set.
- * @return JSON object with the generated representation.
- */
-static struct json_object *json_attr_array_afrom_pair_list(UNUSED TALLOC_CTX *ctx, VALUE_PAIR *vps,
-							   fr_json_format_t const *format)
-{
-	fr_cursor_t		cursor;
-	VALUE_PAIR		*vp;
-	struct json_object	*obj;
-	char			buf[FR_DICT_ATTR_MAX_NAME_LEN + 32];
+	switch (format->output_mode) {
+	case JSON_MODE_OBJECT:
+		ret = json_print_pair_list_grouped(out, vps, format, JSON_MODE_OBJECT);
+		break;
 
-	/* Check format and type */
-	fr_assert(format);
-	fr_assert(format->output_mode == JSON_MODE_ARRAY_OF_NAMES);
+	case JSON_MODE_OBJECT_SIMPLE:
+		ret = json_print_pair_list_grouped(out, vps, format, JSON_MODE_OBJECT_SIMPLE);
+		break;
 
-	MEM(obj = json_object_new_array());
+	case JSON_MODE_ARRAY:
+		ret = json_print_pair_list_grouped(out, vps, format, JSON_MODE_ARRAY);
+		break;
 
-	/*
-	 *	Add all the attribute names to the array in order.
-	 */
-	for (vp = fr_cursor_init(&cursor, &vps);
-	     vp;
-	     vp = fr_cursor_next(&cursor)) {
-		char const		*attr_name;
-		struct json_object	*value;
+	case JSON_MODE_ARRAY_OF_VALUES:
+		ret = json_print_pair_list_flat(out, vps, format, JSON_MODE_ARRAY_OF_VALUES);
+		break;
 
-		attr_name = attr_name_with_prefix(buf, sizeof(buf), vp->da->name, format);
-		value = json_object_new_string(attr_name);
+	case JSON_MODE_ARRAY_OF_NAMES:
+		ret = json_print_pair_list_flat(out, vps, format, JSON_MODE_ARRAY_OF_NAMES);
+		break;
 
-		json_object_array_add(obj, value);
+	default:
+		/* This should never happen */
+		fr_assert(0);
+		fr_strerror_printf("Invalid JSON output mode");
+		return -1;
 	}
+	if (ret < 0) return -1;
+
+	*out->p_m = '\0';	/* Space for this is always reserved */
 
-	return obj;
+	return out->p - start;
 }
 
 
@@ -988,45 +1019,30 @@ static struct json_object *json_attr_array_afrom_pair_list(UNUSED TALLOC_CTX *ct
  * @param[in] ctx	Talloc context.
  * @param[in] vps	a list of value pairs.
  * @param[in] format	Formatting control, can be NULL to use default format.
- * @return JSON string representation of the value pairs
+ * @return
+ *	- JSON string representation of the value pairs.
+ *	- NULL on error.
  */
 char *fr_json_afrom_pair_list(TALLOC_CTX *ctx, VALUE_PAIR *vps,
 			      fr_json_format_t const *format)
 {
-	struct json_object	*obj = NULL;
-	const char		*p;
-	char			*out;
+	fr_sbuff_t	sbuff;
+	ssize_t		slen;
+	char		*out;
 
-	if (!format) format = &default_json_format;
+	fr_sbuff_aprint_talloc_init(&sbuff, ctx, JSON_PRINT_INITIAL_SIZE);
 
-	switch (format->output_mode) {
-	case JSON_MODE_OBJECT:
-		MEM(obj = json_object_afrom_pair_list(ctx, vps, format));
-		break;
-	case JSON_MODE_OBJECT_SIMPLE:
-		MEM(obj = json_smplobj_afrom_pair_list(ctx, vps, format));
-		break;
-	case JSON_MODE_ARRAY:
-		MEM(obj = json_array_afrom_pair_list(ctx, vps, format));
-		break;
-	case JSON_MODE_ARRAY_OF_VALUES:
-		MEM(obj = json_value_array_afrom_pair_list(ctx, vps, format));
-		break;
-	case JSON_MODE_ARRAY_OF_NAMES:
-		MEM(obj = json_attr_array_afrom_pair_list(ctx, vps, format));
-		break;
-	default:
-		/* This should never happen */
-		fr_assert(0);
+	slen = fr_json_print_pair_list(&sbuff, vps, format);
+	if (slen < 0) {
+		talloc_free(sbuff.start_m);
+		return NULL;
 	}
 
-	MEM(p = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN));
-	MEM(out = talloc_strdup(ctx, p));
-
 	/*
-	 * Free the JSON structure, it's not needed any more
+	 *	Trim the buffer, so talloc_array_length()
+	 *	gives the length of the document + 1.
 	 */
-	json_object_put(obj);
+	MEM(out = talloc_realloc(NULL, sbuff.start_m, char, slen + 1));
 
 	return out;
 }
@@ -12,6 +12,7 @@
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/connection.h>
 #include <freeradius-devel/server/map.h>
+#include <freeradius-devel/server/trunk.h>
 
 #define LDAP_DEPRECATED 0	/* Quiet warnings about LDAP_DEPRECATED not being defined */
 
@@ -300,6 +301,10 @@ typedef struct {
 
 	fr_ldap_state_t		state;			//!< LDAP connection state machine.
 
+	rbtree_t		*queries;		//!< Queries sent on this handle, keyed by msgid.
+							///< Used by the trunk demuxer to match results
+							///< with the queries that produced them.
+
 	void			*uctx;			//!< User data associated with the handle.
 } fr_ldap_connection_t;
 
@@ -352,6 +357,47 @@ typedef enum {
 							//!< exit, and retry the operation with a NULL cookie.
 } fr_ldap_rcode_t;
 
+typedef struct fr_ldap_query_s fr_ldap_query_t;
+
+/** Called when a trunked query completes, or fails
+ *
+ * Should mark the request as runnable, if there's a request.
+ *
+ * @param[in] request	the query was issued for.
+ * @param[in] query	containing the result.  query->result may be stolen
+ *			by setting it to NULL, otherwise it's freed with the query.
+ * @param[in] rctx	passed to #fr_ldap_trunk_search.
+ */
+typedef void (*fr_ldap_query_callback_t)(REQUEST *request, fr_ldap_query_t *query, void *rctx);
+
+/** A search sent over a trunk
+ *
+ */
+struct fr_ldap_query_s {
+	char const		*base_dn;		//!< to search under.
+	int			scope;			//!< of the search.
+	char const		*filter;		//!< to apply.  May be NULL.
+	char const * const	*attrs;			//!< to retrieve.  Must remain valid until the query completes.
+	LDAPControl		*serverctrls[LDAP_MAX_CONTROLS];	//!< Extra controls to pass to the server.
+
+	int			msgid;			//!< libldap message ID, valid whilst the query is sent.
+	fr_trunk_request_t	*treq;			//!< Trunk request this query is associated with.
+
+	fr_ldap_query_callback_t callback;		//!< Called on completion or failure.
+	void			*rctx;			//!< Passed to the callback.
+
+	fr_ldap_rcode_t		status;			//!< Result of the query.
+	LDAPMessage		*result;		//!< Message chain returned by the server.  Only set
+							///< if status is LDAP_PROC_SUCCESS.
+};
+
+typedef struct fr_ldap_trunk_s fr_ldap_trunk_t;
+
+#define FR_LDAP_UUID_LENGTH		16		//!< Length of an entryUUID.
+
+typedef struct fr_ldap_replica_s fr_ldap_replica_t;
+typedef struct fr_ldap_replica_entry_s fr_ldap_replica_entry_t;
+
 /*
  *	Tables for resolving strings to LDAP constants
  */
@@ -497,7 +543,7 @@ fr_ldap_rcode_t	 fr_ldap_sasl_interactive(REQUEST *request,
 fr_ldap_connection_t *fr_ldap_connection_alloc(TALLOC_CTX *ctx);
 
 fr_connection_t	*fr_ldap_connection_state_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
-					        fr_ldap_config_t const *config, char *log_prefix);
+					        fr_ldap_config_t const *config, char const *log_prefix);
 
 int		fr_ldap_connection_configure(fr_ldap_connection_t *c, fr_ldap_config_t const *config);
 
@@ -538,6 +584,51 @@ int		fr_ldap_bind_async(fr_ldap_connection_t *c,
 				   char const *bind_dn, char const *password,
 				   LDAPControl **serverctrls, LDAPControl **clientctrls);
 
+/*
+ *	trunk.c - Multiplexed searches
+ */
+fr_ldap_trunk_t	*fr_ldap_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+				     fr_ldap_config_t const *config, fr_trunk_conf_t const *tconf,
+				     char const *log_prefix);
+
+fr_ldap_query_t	*fr_ldap_trunk_search(TALLOC_CTX *ctx, fr_ldap_trunk_t *ttrunk, REQUEST *request,
+				      char const *base_dn, int scope, char const *filter, char const * const *attrs,
+				      LDAPControl **serverctrls,
+				      fr_ldap_query_callback_t callback, void *rctx);
+
+void		fr_ldap_query_cancel(fr_ldap_query_t *query);
+
+/*
+ *	replica.c - In-memory copy of part of a directory
+ */
+fr_ldap_replica_t	*fr_ldap_replica_acquire(char const *name);
+
+void		fr_ldap_replica_detach(fr_ldap_replica_t *replica);
+
+void		fr_ldap_replica_index_add(fr_ldap_replica_t *replica, char const *attr);
+
+void		fr_ldap_replica_refresh_start(fr_ldap_replica_t *replica);
+
+void		fr_ldap_replica_refresh_done(fr_ldap_replica_t *replica);
+
+int		fr_ldap_replica_entry_update(fr_ldap_replica_t *replica, fr_ldap_connection_t *conn,
+					     uint8_t const uuid[FR_LDAP_UUID_LENGTH], LDAPMessage *msg);
+
+void		fr_ldap_replica_entry_delete(fr_ldap_replica_t *replica, uint8_t const uuid[FR_LDAP_UUID_LENGTH]);
+
+fr_ldap_replica_entry_t const *fr_ldap_replica_find(fr_ldap_replica_t *replica, char const *attr, char const *value);
+
+fr_ldap_replica_entry_t const *fr_ldap_replica_find_by_dn(fr_ldap_replica_t *replica, char const *dn);
+
+void		fr_ldap_replica_unlock(fr_ldap_replica_t *replica);
+
+char const	*fr_ldap_replica_entry_dn(fr_ldap_replica_entry_t const *entry);
+
+int		fr_ldap_replica_entry_values(fr_ldap_result_t *out, fr_ldap_replica_entry_t const *entry,
+					     char const *attr);
+
+int		fr_ldap_replica_map_do(REQUEST *request, char const *valuepair_attr,
+				       fr_ldap_map_exp_t const *expanded, fr_ldap_replica_entry_t const *entry);
 
 /*
  *	uti.c - Utility functions
@@ -311,6 +311,9 @@ int fr_ldap_map_do(REQUEST *request, fr_ldap_connection_t *conn,
 
 	fr_ldap_result_t	result;
 	char const		*name;
+	map_batch_t		batch;
+
+	map_batch_init(&batch, request);
 
 	for (map = expanded->maps; map != NULL; map = map->next) {
 		int ret;
@@ -338,8 +341,12 @@ int fr_ldap_map_do(REQUEST *request, fr_ldap_connection_t *conn,
 		 *	a case of the dst being incorrect for the current
 		 *	request context
 		 */
-		ret = map_to_request(request, map, fr_ldap_map_getvalue, &result);
-		if (ret == -1) return -1;	/* Fail */
+		ret = map_batch_add(&batch, map, fr_ldap_map_getvalue, &result);
+		if (ret == -1) {
+			ldap_value_free_len(result.values);
+			map_batch_commit(&batch);
+			return -1;	/* Fail */
+		}
 
 		/*
 		 *	How many maps we've processed
@@ -349,6 +356,7 @@ int fr_ldap_map_do(REQUEST *request, fr_ldap_connection_t *conn,
 	next:
 		ldap_value_free_len(result.values);
 	}
+	map_batch_commit(&batch);
 
 
 	/*
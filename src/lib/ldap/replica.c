@@ -0,0 +1,684 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file lib/ldap/replica.c
+ * @brief In-memory copy of part of a directory, maintained from sync events
+ *
+ * A replica is written by the listener receiving sync notifications (proto_ldap_sync),
+ * and read by modules (rlm_ldap) which want to look up entries without going to the
+ * directory.
+ *
+ * Replicas are found by name, so writers and readers don't need to know about each
+ * other, or be instantiated in any particular order.
+ *
+ * Entries are indexed by UUID (for applying sync events), by DN, and by the values of
+ * any attributes readers register with #fr_ldap_replica_index_add.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+USES_APPLE_DEPRECATED_API
+
+#include <freeradius-devel/ldap/base.h>
+#include <freeradius-devel/util/debug.h>
+
+#include <pthread.h>
+
+/** The values of one attribute in an entry
+ *
+ */
+typedef struct {
+	char			*name;			//!< Of the attribute.
+	struct berval		**values;		//!< NULL terminated, so the array looks like one
+							///< produced by ldap_get_values_len.
+	int			count;			//!< Number of values.
+} ldap_replica_attr_t;
+
+struct fr_ldap_replica_entry_s {
+	uint8_t			uuid[FR_LDAP_UUID_LENGTH];	//!< Identifies the entry in sync events.
+	char			*dn;			//!< Normalised DN of the entry.
+	ldap_replica_attr_t	*attrs;			//!< Attributes we were sent.
+	uint64_t		generation;		//!< Refresh the entry was last seen in.
+};
+
+/** Maps an attribute value to the entry holding it
+ *
+ */
+typedef struct {
+	char const		*attr;			//!< Indexed attribute.
+	uint8_t			*value;			//!< Lowercased copy of the value.
+	size_t			value_len;		//!< Length of the value.
+
+	fr_ldap_replica_entry_t	*entry;			//!< Entry with this value.  NULL if more than one
+							///< entry has it, in which case lookups miss, and
+							///< the directory gets to decide what's correct.
+	unsigned int		count;			//!< How many entries have this value.
+} ldap_replica_index_t;
+
+struct fr_ldap_replica_s {
+	char const		*name;			//!< Used to find the replica.
+	unsigned int		refs;			//!< Number of readers and writers using the replica.
+
+	pthread_rwlock_t	lock;			//!< One writer, many readers.
+
+	rbtree_t		*by_uuid;		//!< Entries by UUID.
+	rbtree_t		*by_dn;			//!< Entries by DN.
+	rbtree_t		*index;			//!< Entries by attribute value.
+	char const		**index_attrs;		//!< Attributes to index.
+
+	uint64_t		generation;		//!< Current refresh.
+	bool			ready;			//!< A complete refresh has been performed.
+};
+
+static rbtree_t		*replicas;
+static pthread_mutex_t	replicas_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int _ldap_replica_cmp(void const *one, void const *two)
+{
+	fr_ldap_replica_t const *a = one, *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+static int _ldap_replica_uuid_cmp(void const *one, void const *two)
+{
+	fr_ldap_replica_entry_t const *a = one, *b = two;
+
+	return memcmp(a->uuid, b->uuid, sizeof(a->uuid));
+}
+
+static int _ldap_replica_dn_cmp(void const *one, void const *two)
+{
+	fr_ldap_replica_entry_t const *a = one, *b = two;
+
+	return strcasecmp(a->dn, b->dn);
+}
+
+static int _ldap_replica_index_cmp(void const *one, void const *two)
+{
+	ldap_replica_index_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcasecmp(a->attr, b->attr);
+	if (ret != 0) return ret;
+
+	ret = (a->value_len > b->value_len) - (a->value_len < b->value_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->value, b->value, a->value_len);
+}
+
+/** Lowercase a value so index lookups are case insensitive
+ *
+ */
+static uint8_t *ldap_replica_index_value(TALLOC_CTX *ctx, char const *value, size_t len)
+{
+	uint8_t	*out;
+	size_t	i;
+
+	MEM(out = talloc_array(ctx, uint8_t, len ? len : 1));
+	for (i = 0; i < len; i++) out[i] = tolower((uint8_t)value[i]);
+
+	return out;
+}
+
+/** Is the attribute indexed
+ *
+ * @return The replica's copy of the attribute name, or NULL.
+ */
+static char const *ldap_replica_indexed(fr_ldap_replica_t const *replica, char const *attr)
+{
+	size_t i;
+
+	for (i = 0; i < talloc_array_length(replica->index_attrs); i++) {
+		if (strcasecmp(replica->index_attrs[i], attr) == 0) return replica->index_attrs[i];
+	}
+
+	return NULL;
+}
+
+/** Add or remove an entry's values from the attribute index
+ *
+ */
+static void ldap_replica_index_update(fr_ldap_replica_t *replica, fr_ldap_replica_entry_t *entry, bool add)
+{
+	size_t i;
+
+	for (i = 0; i < talloc_array_length(entry->attrs); i++) {
+		ldap_replica_attr_t	*attr = &entry->attrs[i];
+		ldap_replica_index_t	find, *node;
+		int			j;
+
+		find.attr = ldap_replica_indexed(replica, attr->name);
+		if (!find.attr) continue;
+
+		for (j = 0; j < attr->count; j++) {
+			find.value = ldap_replica_index_value(NULL, attr->values[j]->bv_val, attr->values[j]->bv_len);
+			find.value_len = attr->values[j]->bv_len;
+
+			node = rbtree_finddata(replica->index, &find);
+			if (add) {
+				if (node) {
+					node->entry = NULL;
+					node->count++;
+				} else {
+					MEM(node = talloc(replica, ldap_replica_index_t));
+					node->attr = find.attr;
+					node->value = talloc_steal(node, find.value);
+					node->value_len = find.value_len;
+					node->entry = entry;
+					node->count = 1;
+					find.value = NULL;
+					rbtree_insert(replica->index, node);
+				}
+			} else if (node) {
+				if (--node->count == 0) {
+					rbtree_deletebydata(replica->index, node);
+					talloc_free(node);
+				} else if (node->entry == entry) {
+					node->entry = NULL;
+				}
+			}
+			talloc_free(find.value);
+		}
+	}
+}
+
+/** Remove an entry from all the indexes and free it
+ *
+ * @note Must be called with the write lock held.
+ */
+static void ldap_replica_entry_remove(fr_ldap_replica_t *replica, fr_ldap_replica_entry_t *entry)
+{
+	ldap_replica_index_update(replica, entry, false);
+	rbtree_deletebydata(replica->by_dn, entry);
+	rbtree_deletebydata(replica->by_uuid, entry);
+	talloc_free(entry);
+}
+
+static int _ldap_replica_free(fr_ldap_replica_t *replica)
+{
+	pthread_rwlock_destroy(&replica->lock);
+
+	return 0;
+}
+
+/** Find or create a replica
+ *
+ * Every call must be balanced with a call to #fr_ldap_replica_detach.
+ *
+ * @param[in] name	of the replica.
+ * @return
+ *	- The replica.
+ *	- NULL on error.
+ */
+fr_ldap_replica_t *fr_ldap_replica_acquire(char const *name)
+{
+	fr_ldap_replica_t	find = { .name = name }, *replica;
+
+	pthread_mutex_lock(&replicas_mutex);
+	if (!replicas) {
+		replicas = rbtree_talloc_create(NULL, _ldap_replica_cmp, fr_ldap_replica_t, NULL, 0);
+		if (!replicas) {
+		error:
+			pthread_mutex_unlock(&replicas_mutex);
+			fr_strerror_printf("Failed allocating LDAP replica \"%s\"", name);
+			return NULL;
+		}
+	}
+
+	replica = rbtree_finddata(replicas, &find);
+	if (replica) {
+		replica->refs++;
+		pthread_mutex_unlock(&replicas_mutex);
+		return replica;
+	}
+
+	MEM(replica = talloc_zero(replicas, fr_ldap_replica_t));
+	replica->name = talloc_typed_strdup(replica, name);
+	replica->by_uuid = rbtree_talloc_create(replica, _ldap_replica_uuid_cmp, fr_ldap_replica_entry_t, NULL, 0);
+	replica->by_dn = rbtree_talloc_create(replica, _ldap_replica_dn_cmp, fr_ldap_replica_entry_t, NULL, 0);
+	replica->index = rbtree_talloc_create(replica, _ldap_replica_index_cmp, ldap_replica_index_t, NULL, 0);
+	if (!replica->by_uuid || !replica->by_dn || !replica->index) {
+		talloc_free(replica);
+		goto error;
+	}
+	MEM(replica->index_attrs = talloc_array(replica, char const *, 0));
+	pthread_rwlock_init(&replica->lock, NULL);
+	talloc_set_destructor(replica, _ldap_replica_free);
+	replica->refs = 1;
+
+	rbtree_insert(replicas, replica);
+	pthread_mutex_unlock(&replicas_mutex);
+
+	return replica;
+}
+
+/** Stop using a replica, freeing it if nothing else is
+ *
+ * @param[in] replica	to detach from.
+ */
+void fr_ldap_replica_detach(fr_ldap_replica_t *replica)
+{
+	pthread_mutex_lock(&replicas_mutex);
+	if (--replica->refs > 0) {
+		pthread_mutex_unlock(&replicas_mutex);
+		return;
+	}
+
+	rbtree_deletebydata(replicas, replica);
+	talloc_free(replica);
+
+	if (rbtree_num_elements(replicas) == 0) TALLOC_FREE(replicas);
+	pthread_mutex_unlock(&replicas_mutex);
+}
+
+/** Index the values of an attribute, so entries can be found with #fr_ldap_replica_find
+ *
+ * Should be called before the replica is populated, otherwise the index
+ * has to be rebuilt.  Values are compared case insensitively.
+ *
+ * @param[in] replica	to add the index to.
+ * @param[in] attr	to index.
+ */
+void fr_ldap_replica_index_add(fr_ldap_replica_t *replica, char const *attr)
+{
+	size_t			len;
+	uint32_t		i, num;
+	void			**list;
+
+	pthread_rwlock_wrlock(&replica->lock);
+	if (ldap_replica_indexed(replica, attr)) {
+		pthread_rwlock_unlock(&replica->lock);
+		return;
+	}
+
+	len = talloc_array_length(replica->index_attrs);
+	MEM(replica->index_attrs = talloc_realloc(replica, replica->index_attrs, char const *, len + 1));
+	replica->index_attrs[len] = talloc_typed_strdup(replica->index_attrs, attr);
+
+	/*
+	 *	Throw away the old index, and rebuild
+	 *	it with the new attribute.
+	 */
+	num = rbtree_flatten(NULL, &list, replica->index, RBTREE_IN_ORDER);
+	for (i = 0; i < num; i++) {
+		rbtree_deletebydata(replica->index, list[i]);
+		talloc_free(list[i]);
+	}
+	talloc_free(list);
+
+	num = rbtree_flatten(NULL, &list, replica->by_uuid, RBTREE_IN_ORDER);
+	for (i = 0; i < num; i++) ldap_replica_index_update(replica, list[i], true);
+	talloc_free(list);
+
+	pthread_rwlock_unlock(&replica->lock);
+}
+
+/** Start a complete refresh of the replica
+ *
+ * Entries which aren't added, modified or marked as present before
+ * #fr_ldap_replica_refresh_done is called, are removed.
+ *
+ * Until the first refresh completes, lookups always miss.
+ *
+ * @param[in] replica	being refreshed.
+ */
+void fr_ldap_replica_refresh_start(fr_ldap_replica_t *replica)
+{
+	pthread_rwlock_wrlock(&replica->lock);
+	replica->generation++;
+	pthread_rwlock_unlock(&replica->lock);
+
+	DEBUG2("LDAP replica \"%s\" - Refresh started", replica->name);
+}
+
+/** Complete a refresh, removing entries the directory no longer has
+ *
+ * @param[in] replica	which has been refreshed.
+ */
+void fr_ldap_replica_refresh_done(fr_ldap_replica_t *replica)
+{
+	uint32_t	i, num, removed = 0;
+	void		**list;
+
+	pthread_rwlock_wrlock(&replica->lock);
+	num = rbtree_flatten(NULL, &list, replica->by_uuid, RBTREE_IN_ORDER);
+	for (i = 0; i < num; i++) {
+		fr_ldap_replica_entry_t *entry = list[i];
+
+		if (entry->generation == replica->generation) continue;
+
+		ldap_replica_entry_remove(replica, entry);
+		removed++;
+	}
+	talloc_free(list);
+	replica->ready = true;
+	num = rbtree_num_elements(replica->by_uuid);
+	pthread_rwlock_unlock(&replica->lock);
+
+	DEBUG2("LDAP replica \"%s\" - Refresh complete, %u entries, %u stale entries removed",
+	       replica->name, num, removed);
+}
+
+/** Add, replace, or mark an entry as present
+ *
+ * @param[in] replica	to update.
+ * @param[in] conn	the entry was received on.
+ * @param[in] uuid	of the entry.
+ * @param[in] msg	containing the entry.  If NULL, an existing entry is
+ *			marked as present in the current refresh.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_ldap_replica_entry_update(fr_ldap_replica_t *replica, fr_ldap_connection_t *conn,
+				 uint8_t const uuid[FR_LDAP_UUID_LENGTH], LDAPMessage *msg)
+{
+	fr_ldap_replica_entry_t	*entry, *old;
+	BerElement		*ber = NULL;
+	char			*name, *dn;
+	size_t			num = 0;
+
+	if (!msg) {
+		fr_ldap_replica_entry_t find;
+
+		memcpy(find.uuid, uuid, sizeof(find.uuid));
+
+		pthread_rwlock_wrlock(&replica->lock);
+		entry = rbtree_finddata(replica->by_uuid, &find);
+		if (entry) entry->generation = replica->generation;
+		pthread_rwlock_unlock(&replica->lock);
+
+		return 0;
+	}
+
+	dn = ldap_get_dn(conn->handle, msg);
+	if (!dn) {
+		int ldap_errno;
+
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		fr_strerror_printf("Retrieving entry DN failed: %s", ldap_err2string(ldap_errno));
+		return -1;
+	}
+
+	/*
+	 *	Build the new entry without holding
+	 *	the lock, so readers aren't held up.
+	 */
+	MEM(entry = talloc_zero(NULL, fr_ldap_replica_entry_t));
+	memcpy(entry->uuid, uuid, sizeof(entry->uuid));
+	entry->dn = talloc_typed_strdup(entry, dn);
+	fr_ldap_util_normalise_dn(entry->dn, entry->dn);
+	ldap_memfree(dn);
+
+	MEM(entry->attrs = talloc_array(entry, ldap_replica_attr_t, 0));
+	for (name = ldap_first_attribute(conn->handle, msg, &ber);
+	     name;
+	     name = ldap_next_attribute(conn->handle, msg, ber)) {
+		struct berval		**values;
+		ldap_replica_attr_t	*attr;
+		int			i;
+
+		values = ldap_get_values_len(conn->handle, msg, name);
+		if (!values) {
+			ldap_memfree(name);
+			continue;
+		}
+
+		MEM(entry->attrs = talloc_realloc(entry, entry->attrs, ldap_replica_attr_t, num + 1));
+		attr = &entry->attrs[num++];
+		attr->name = talloc_typed_strdup(entry->attrs, name);
+		attr->count = ldap_count_values_len(values);
+		MEM(attr->values = talloc_zero_array(entry->attrs, struct berval *, attr->count + 1));
+		for (i = 0; i < attr->count; i++) {
+			MEM(attr->values[i] = talloc(attr->values, struct berval));
+			attr->values[i]->bv_len = values[i]->bv_len;
+			MEM(attr->values[i]->bv_val = talloc_memdup(attr->values[i],
+								     values[i]->bv_val, values[i]->bv_len + 1));
+			attr->values[i]->bv_val[values[i]->bv_len] = '\0';
+		}
+
+		ldap_value_free_len(values);
+		ldap_memfree(name);
+	}
+	if (ber) ber_free(ber, 0);
+
+	pthread_rwlock_wrlock(&replica->lock);
+	old = rbtree_finddata(replica->by_uuid, entry);
+	if (old) ldap_replica_entry_remove(replica, old);
+
+	/*
+	 *	Renamed entries can leave an old
+	 *	entry with the same DN behind, if the
+	 *	server reused it.
+	 */
+	old = rbtree_finddata(replica->by_dn, entry);
+	if (old) ldap_replica_entry_remove(replica, old);
+
+	entry->generation = replica->generation;
+	talloc_steal(replica, entry);
+	rbtree_insert(replica->by_uuid, entry);
+	rbtree_insert(replica->by_dn, entry);
+	ldap_replica_index_update(replica, entry, true);
+	pthread_rwlock_unlock(&replica->lock);
+
+	return 0;
+}
+
+/** Remove an entry
+ *
+ * @param[in] replica	to remove the entry from.
+ * @param[in] uuid	of the entry.
+ */
+void fr_ldap_replica_entry_delete(fr_ldap_replica_t *replica, uint8_t const uuid[FR_LDAP_UUID_LENGTH])
+{
+	fr_ldap_replica_entry_t find, *entry;
+
+	memcpy(find.uuid, uuid, sizeof(find.uuid));
+
+	pthread_rwlock_wrlock(&replica->lock);
+	entry = rbtree_finddata(replica->by_uuid, &find);
+	if (entry) ldap_replica_entry_remove(replica, entry);
+	pthread_rwlock_unlock(&replica->lock);
+}
+
+/** Find an entry by the value of an indexed attribute
+ *
+ * If an entry is returned, the replica is locked for reading, and
+ * #fr_ldap_replica_unlock must be called once the caller has finished
+ * with the entry.
+ *
+ * @param[in] replica	to search.
+ * @param[in] attr	to search on.  Must have been added with #fr_ldap_replica_index_add.
+ * @param[in] value	to search for.
+ * @return
+ *	- The entry.
+ *	- NULL if the replica isn't ready, no entry has the value, or more than one does.
+ */
+fr_ldap_replica_entry_t const *fr_ldap_replica_find(fr_ldap_replica_t *replica, char const *attr, char const *value)
+{
+	ldap_replica_index_t	find, *node;
+
+	pthread_rwlock_rdlock(&replica->lock);
+	if (!replica->ready) goto miss;
+
+	find.attr = ldap_replica_indexed(replica, attr);
+	if (!find.attr) goto miss;
+
+	find.value_len = strlen(value);
+	find.value = ldap_replica_index_value(NULL, value, find.value_len);
+	node = rbtree_finddata(replica->index, &find);
+	talloc_free(find.value);
+
+	if (!node || !node->entry) {
+	miss:
+		pthread_rwlock_unlock(&replica->lock);
+		return NULL;
+	}
+
+	return node->entry;
+}
+
+/** Find an entry by DN
+ *
+ * @copydetails fr_ldap_replica_find
+ *
+ * @param[in] replica	to search.
+ * @param[in] dn	to search for.
+ * @return
+ *	- The entry.
+ *	- NULL if the replica isn't ready, or no entry has the DN.
+ */
+fr_ldap_replica_entry_t const *fr_ldap_replica_find_by_dn(fr_ldap_replica_t *replica, char const *dn)
+{
+	fr_ldap_replica_entry_t	find, *entry;
+
+	pthread_rwlock_rdlock(&replica->lock);
+	if (!replica->ready) {
+		pthread_rwlock_unlock(&replica->lock);
+		return NULL;
+	}
+
+	find.dn = talloc_typed_strdup(NULL, dn);
+	fr_ldap_util_normalise_dn(find.dn, find.dn);
+	entry = rbtree_finddata(replica->by_dn, &find);
+	talloc_free(find.dn);
+
+	if (!entry) pthread_rwlock_unlock(&replica->lock);
+
+	return entry;
+}
+
+/** Release the read lock acquired by a successful lookup
+ *
+ * @param[in] replica	the entry was found in.
+ */
+void fr_ldap_replica_unlock(fr_ldap_replica_t *replica)
+{
+	pthread_rwlock_unlock(&replica->lock);
+}
+
+/** Return the DN of a replica entry
+ *
+ */
+char const *fr_ldap_replica_entry_dn(fr_ldap_replica_entry_t const *entry)
+{
+	return entry->dn;
+}
+
+/** Return the values of an attribute in a replica entry
+ *
+ * @param[out] out	Where to write the values.  Must not be freed.
+ * @param[in] entry	to retrieve values from.
+ * @param[in] attr	to retrieve.
+ * @return The number of values.
+ */
+int fr_ldap_replica_entry_values(fr_ldap_result_t *out, fr_ldap_replica_entry_t const *entry, char const *attr)
+{
+	size_t i;
+
+	for (i = 0; i < talloc_array_length(entry->attrs); i++) {
+		if (strcasecmp(entry->attrs[i].name, attr) != 0) continue;
+
+		out->values = entry->attrs[i].values;
+		out->count = entry->attrs[i].count;
+		return out->count;
+	}
+
+	out->values = NULL;
+	out->count = 0;
+
+	return 0;
+}
+
+/** Convert attribute map into valuepairs using a replica entry
+ *
+ * Equivalent of #fr_ldap_map_do, for entries that came from a replica
+ * instead of a search.
+ *
+ * @param[in] request		Current request.
+ * @param[in] valuepair_attr	Treat attribute with this name as holding complete AVP definitions.
+ * @param[in] expanded		attributes (rhs of map).
+ * @param[in] entry		to retrieve attributes from.
+ * @return
+ *	- Number of maps successfully applied.
+ *	- -1 on failure.
+ */
+int fr_ldap_replica_map_do(REQUEST *request, char const *valuepair_attr,
+			   fr_ldap_map_exp_t const *expanded, fr_ldap_replica_entry_t const *entry)
+{
+	vp_map_t const		*map;
+	unsigned int		total = 0;
+	int			applied = 0;
+
+	fr_ldap_result_t	result;
+	char const		*name;
+	map_batch_t		batch;
+
+	map_batch_init(&batch, request);
+
+	for (map = expanded->maps; map != NULL; map = map->next) {
+		name = expanded->attrs[total++];
+
+		if (fr_ldap_replica_entry_values(&result, entry, name) == 0) {
+			RDEBUG3("Attribute \"%s\" not found in LDAP object", name);
+			continue;
+		}
+
+		if (map_batch_add(&batch, map, fr_ldap_map_getvalue, &result) == -1) {
+			map_batch_commit(&batch);
+			return -1;
+		}
+
+		applied++;
+	}
+	map_batch_commit(&batch);
+
+	if (valuepair_attr) {
+		int i;
+
+		fr_ldap_replica_entry_values(&result, entry, valuepair_attr);
+		for (i = 0; i < result.count; i++) {
+			vp_map_t	*attr;
+			char const	*value = result.values[i]->bv_val;	/* Always \0 terminated */
+
+			vp_tmpl_rules_t parse_rules = {
+				.dict_def = request->dict,
+				.prefix = VP_ATTR_REF_PREFIX_AUTO,
+			};
+
+			RDEBUG3("Parsing attribute string '%s'", value);
+			if (map_afrom_attr_str(request, &attr, value,
+					       &parse_rules, &parse_rules) < 0) {
+				RWDEBUG("Failed parsing '%s' value \"%s\" as valuepair (%s), skipping...",
+					fr_strerror(), valuepair_attr, value);
+				continue;
+			}
+			if (map_to_request(request, attr, map_to_vp, NULL) < 0) {
+				RWDEBUG("Failed adding \"%s\" to request, skipping...", value);
+			} else {
+				applied++;
+			}
+			talloc_free(attr);
+		}
+	}
+
+	return applied;
+}
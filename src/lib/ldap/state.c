@@ -109,12 +109,13 @@ again:
 	 */
 	case FR_LDAP_STATE_BIND:
 		STATE_TRANSITION(FR_LDAP_STATE_RUN);
-	/*
-		if (fr_ldap_mux_async(c) < 0) {
-			STATE_TRANSITION(FR_LDAP_STATE_ERROR);
-			goto again;
-		}
-	 */
+
+		/*
+		 *	The trunk installs its own mux/demux
+		 *	I/O handlers when it sees the connection
+		 *	come up.
+		 */
+		fr_connection_signal_connected(c->conn);
 		break;
 
 	/*
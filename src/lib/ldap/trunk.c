@@ -0,0 +1,416 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file lib/ldap/trunk.c
+ * @brief Multiplex searches over a trunk of LDAP connections
+ *
+ * Searches are written with ldap_search_ext, and the msgid libldap returns is
+ * used to match the results read by the demuxer with the query that produced them.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+USES_APPLE_DEPRECATED_API
+
+#include <freeradius-devel/ldap/base.h>
+#include <freeradius-devel/util/debug.h>
+
+struct fr_ldap_trunk_s {
+	fr_ldap_config_t const	*config;		//!< Used to bind and configure new connections.
+	fr_trunk_t		*trunk;			//!< Connections to the directory.
+};
+
+/** Compare two queries by msgid
+ *
+ */
+static int _ldap_query_cmp(void const *one, void const *two)
+{
+	fr_ldap_query_t const *a = one, *b = two;
+
+	return (a->msgid > b->msgid) - (a->msgid < b->msgid);
+}
+
+/** Free any result we're still holding on to
+ *
+ */
+static int _ldap_query_free(fr_ldap_query_t *query)
+{
+	if (query->result) ldap_msgfree(query->result);
+
+	return 0;
+}
+
+/** Allocate a new connection for the trunk
+ *
+ * The connection binds as the admin user, and signals that it's connected
+ * once the bind is complete.
+ */
+static fr_connection_t *_ldap_trunk_connection_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+						     UNUSED fr_connection_conf_t const *conf,
+						     char const *log_prefix, void *uctx)
+{
+	fr_ldap_trunk_t *ttrunk = talloc_get_type_abort(uctx, fr_ldap_trunk_t);
+
+	return fr_ldap_connection_state_alloc(tconn, el, ttrunk->config, log_prefix);
+}
+
+/** There's data to read on the libldap handle
+ *
+ */
+static void _ldap_trunk_io_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t *tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_readable(tconn);
+}
+
+/** The libldap handle's file descriptor errored
+ *
+ */
+static void _ldap_trunk_io_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				 int fd_errno, void *uctx)
+{
+	fr_trunk_connection_t *tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	ERROR("%s - Connection failed: %s", tconn->conn->log_prefix, fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(tconn->conn, FR_CONNECTION_FAILED);
+}
+
+/** Install or remove the I/O handlers for a connection
+ *
+ * The trunk is always writable, so we only ever need to be told when
+ * there are results to read.
+ */
+static void _ldap_trunk_connection_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+					  fr_event_list_t *el,
+					  fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	fr_ldap_connection_t	*c = talloc_get_type_abort(conn->h, fr_ldap_connection_t);
+	int			fd = -1;
+
+	if ((ldap_get_option(c->handle, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS) || (fd < 0)) {
+		ERROR("%s - Failed retrieving file descriptor from libldap handle", conn->log_prefix);
+	error:
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	if (!(notify_on & FR_TRUNK_CONN_EVENT_READ)) {
+		(void) fr_event_fd_delete(el, fd, FR_EVENT_FILTER_IO);
+		return;
+	}
+
+	if (fr_event_fd_insert(c, el, fd,
+			       _ldap_trunk_io_read,
+			       NULL,
+			       _ldap_trunk_io_error,
+			       tconn) < 0) {
+		PERROR("%s - Failed inserting read handler", conn->log_prefix);
+		goto error;
+	}
+}
+
+/** Write every pending search to the connection
+ *
+ * Because the trunk is in always writable mode, this is called as soon
+ * as a query is enqueued.  libldap buffers the request, so all we need
+ * to do is record the msgid so that the demuxer can find the query again.
+ */
+static void _ldap_trunk_request_mux(UNUSED fr_event_list_t *el,
+				    fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	fr_ldap_connection_t	*c = talloc_get_type_abort(conn->h, fr_ldap_connection_t);
+	fr_trunk_request_t	*treq;
+	fr_ldap_query_t		*query;
+	REQUEST			*request;
+
+	if (!c->queries) MEM(c->queries = rbtree_talloc_create(c, _ldap_query_cmp, fr_ldap_query_t, NULL, 0));
+
+	for (;;) {
+		int ldap_errno;
+
+		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) return;
+		if (!treq) break;
+
+		query = talloc_get_type_abort(treq->preq, fr_ldap_query_t);
+		request = treq->request;
+
+		if (fr_ldap_search_async(&query->msgid, request, &c, query->base_dn, query->scope, query->filter,
+					 query->attrs, query->serverctrls, NULL) == LDAP_PROC_SUCCESS) {
+			if (!rbtree_insert(c->queries, query)) {
+				ROPTIONAL(RERROR, ERROR, "Duplicate LDAP msgid %i", query->msgid);
+				ldap_abandon_ext(c->handle, query->msgid, NULL, NULL);
+				fr_trunk_request_signal_fail(treq);
+				continue;
+			}
+			fr_trunk_request_signal_sent(treq);
+			continue;
+		}
+
+		/*
+		 *	If the server has gone away, every other
+		 *	search written to this handle would fail
+		 *	too.  Let the trunk move the queries
+		 *	elsewhere.
+		 */
+		ldap_get_option(c->handle, LDAP_OPT_ERROR_NUMBER, &ldap_errno);
+		if (ldap_errno == LDAP_SERVER_DOWN) {
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		fr_trunk_request_signal_fail(treq);
+	}
+}
+
+/** Read every complete result from the connection, and match it to its query
+ *
+ */
+static void _ldap_trunk_request_demux(UNUSED fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	fr_ldap_connection_t	*c = talloc_get_type_abort(conn->h, fr_ldap_connection_t);
+
+	for (;;) {
+		LDAPMessage	*result = NULL, *msg;
+		fr_ldap_query_t	*query;
+		int		ret;
+
+		/*
+		 *	Zero timeout means poll, so this returns
+		 *	0 as soon as there are no more complete
+		 *	results buffered.
+		 */
+		ret = ldap_result(c->handle, LDAP_RES_ANY, LDAP_MSG_ALL, &(struct timeval){ 0, 0 }, &result);
+		if (ret == 0) return;
+		if (ret < 0) {
+			ERROR("%s - Failed reading results: %s", conn->log_prefix, fr_ldap_error_str(c));
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		query = c->queries ? rbtree_finddata(c->queries, &(fr_ldap_query_t){ .msgid = ldap_msgid(result) }) :
+				     NULL;
+		if (!query) {
+			DEBUG3("%s - Ignoring result for msgid %i", conn->log_prefix, ldap_msgid(result));
+			ldap_msgfree(result);
+			continue;
+		}
+		rbtree_deletebydata(c->queries, query);
+
+		query->status = LDAP_PROC_SUCCESS;
+		for (msg = ldap_first_message(c->handle, result);
+		     msg;
+		     msg = ldap_next_message(c->handle, msg)) {
+			query->status = fr_ldap_error_check(NULL, c, msg, query->base_dn);
+			if (query->status != LDAP_PROC_SUCCESS) break;
+		}
+
+		/*
+		 *	As with fr_ldap_search, a base DN that doesn't
+		 *	exist is just a search that found nothing.
+		 */
+		switch (query->status) {
+		case LDAP_PROC_SUCCESS:
+		case LDAP_PROC_BAD_DN:
+			ret = ldap_count_entries(c->handle, result);
+			if (ret < 0) {
+				query->status = LDAP_PROC_ERROR;
+			} else if (ret == 0) {
+				query->status = LDAP_PROC_NO_RESULT;
+			} else {
+				query->status = LDAP_PROC_SUCCESS;
+				query->result = result;
+				result = NULL;
+			}
+			break;
+
+		default:
+			break;
+		}
+		if (result) ldap_msgfree(result);
+
+		fr_trunk_request_signal_complete(query->treq);
+	}
+}
+
+/** Remove a sent query from the tracking tree
+ *
+ * If the request was cancelled we tell the server to stop processing the search.
+ * If the query is being moved to another connection it's written again with a
+ * new msgid, so we just forget about the current one.
+ */
+static void _ldap_trunk_request_cancel(fr_connection_t *conn, void *preq,
+				       fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
+{
+	fr_ldap_query_t		*query = talloc_get_type_abort(preq, fr_ldap_query_t);
+	fr_ldap_connection_t	*c = conn->h;
+
+	if (c && c->queries) rbtree_deletebydata(c->queries, query);
+
+	if ((reason == FR_TRUNK_CANCEL_REASON_SIGNAL) && c && c->handle) {
+		ldap_abandon_ext(c->handle, query->msgid, NULL, NULL);
+	}
+
+	query->msgid = 0;
+}
+
+/** Signal the API client that the query completed
+ *
+ */
+static void _ldap_trunk_request_complete(REQUEST *request, void *preq, UNUSED void *rctx, UNUSED void *uctx)
+{
+	fr_ldap_query_t *query = talloc_get_type_abort(preq, fr_ldap_query_t);
+
+	if (query->callback) query->callback(request, query, query->rctx);
+}
+
+/** Signal the API client that the query couldn't be sent, or the connection failed
+ *
+ */
+static void _ldap_trunk_request_fail(REQUEST *request, void *preq, UNUSED void *rctx,
+				     UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	fr_ldap_query_t *query = talloc_get_type_abort(preq, fr_ldap_query_t);
+
+	query->status = LDAP_PROC_BAD_CONN;
+	if (query->callback) query->callback(request, query, query->rctx);
+}
+
+/** Free the query, and any result that wasn't stolen
+ *
+ */
+static void _ldap_trunk_request_free(UNUSED REQUEST *request, void *preq, UNUSED void *uctx)
+{
+	fr_ldap_query_t *query = talloc_get_type_abort(preq, fr_ldap_query_t);
+
+	talloc_free(query);
+}
+
+/** Allocate a trunk of connections to an LDAP directory
+ *
+ * All connections bind as the admin identity from the config, so the trunk
+ * can only be used for searches made with those credentials.
+ *
+ * @param[in] ctx		to allocate the trunk in.
+ * @param[in] el		to insert I/O and timer events into.
+ * @param[in] config		of the LDAP connections.
+ * @param[in] tconf		controlling how many connections are opened.
+ * @param[in] log_prefix	to prepend to connection log messages.
+ * @return
+ *	- A new trunk on success.
+ *	- NULL on failure.
+ */
+fr_ldap_trunk_t *fr_ldap_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+				     fr_ldap_config_t const *config, fr_trunk_conf_t const *tconf,
+				     char const *log_prefix)
+{
+	fr_ldap_trunk_t		*ttrunk;
+	fr_trunk_conf_t		*our_tconf;
+	fr_trunk_io_funcs_t	io_funcs = {
+					.connection_alloc	= _ldap_trunk_connection_alloc,
+					.connection_notify	= _ldap_trunk_connection_notify,
+					.request_mux		= _ldap_trunk_request_mux,
+					.request_demux		= _ldap_trunk_request_demux,
+					.request_cancel		= _ldap_trunk_request_cancel,
+					.request_complete	= _ldap_trunk_request_complete,
+					.request_fail		= _ldap_trunk_request_fail,
+					.request_free		= _ldap_trunk_request_free
+				};
+
+	MEM(ttrunk = talloc_zero(ctx, fr_ldap_trunk_t));
+	ttrunk->config = config;
+
+	MEM(our_tconf = talloc_memdup(ttrunk, tconf, sizeof(*tconf)));
+	our_tconf->always_writable = true;
+
+	ttrunk->trunk = fr_trunk_alloc(ttrunk, el, &io_funcs, our_tconf, log_prefix, ttrunk, false);
+	if (!ttrunk->trunk) {
+		talloc_free(ttrunk);
+		return NULL;
+	}
+
+	return ttrunk;
+}
+
+/** Enqueue a search on a trunk
+ *
+ * The callback is called once the result has been received, or the search
+ * has failed.  Either way query->status should be checked before using
+ * query->result.
+ *
+ * @param[in] ctx		to allocate the query in.
+ * @param[in] ttrunk		to enqueue the search on.
+ * @param[in] request		the search is being performed for.
+ * @param[in] base_dn		to search under.  Copied.
+ * @param[in] scope		of the search (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter		to use, should be pre-escaped.  Copied.  May be NULL.
+ * @param[in] attrs		to retrieve.  Must remain valid until the callback is called.
+ * @param[in] serverctrls	Extra controls to pass to the server.  May be NULL.
+ * @param[in] callback		to call on completion.
+ * @param[in] rctx		to pass to the callback.
+ * @return
+ *	- A new query on success.  This is freed by the trunk once the callback returns.
+ *	- NULL if the query couldn't be enqueued.
+ */
+fr_ldap_query_t *fr_ldap_trunk_search(TALLOC_CTX *ctx, fr_ldap_trunk_t *ttrunk, REQUEST *request,
+				      char const *base_dn, int scope, char const *filter, char const * const *attrs,
+				      LDAPControl **serverctrls,
+				      fr_ldap_query_callback_t callback, void *rctx)
+{
+	fr_ldap_query_t	*query;
+	size_t		i;
+
+	MEM(query = talloc_zero(ctx, fr_ldap_query_t));
+	talloc_set_destructor(query, _ldap_query_free);
+
+	query->base_dn = talloc_typed_strdup(query, base_dn);
+	query->scope = scope;
+	if (filter) query->filter = talloc_typed_strdup(query, filter);
+	query->attrs = attrs;
+	query->callback = callback;
+	query->rctx = rctx;
+	query->status = LDAP_PROC_ERROR;
+
+	for (i = 0; serverctrls && serverctrls[i] && (i < (NUM_ELEMENTS(query->serverctrls) - 1)); i++) {
+		query->serverctrls[i] = serverctrls[i];
+	}
+
+	switch (fr_trunk_request_enqueue(&query->treq, ttrunk->trunk, request, query, rctx)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		return query;
+
+	default:
+		ROPTIONAL(REDEBUG, ERROR, "Failed enqueuing LDAP search");
+		talloc_free(query);
+		return NULL;
+	}
+}
+
+/** Cancel a query which has not yet completed
+ *
+ * The callback will not be called, and the trunk frees the query.
+ */
+void fr_ldap_query_cancel(fr_ldap_query_t *query)
+{
+	if (!query->treq) return;
+
+	fr_trunk_request_signal_cancel(query->treq);
+}
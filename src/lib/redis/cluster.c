@@ -85,9 +85,10 @@
  *   indexes in the fr_redis_cluster_t.node array.  We use 8bit unsigned integers instead of
  *   pointers to save space.  Using pointers, the node[] array would need 784K, using IDs
  *   it uses 112K.  Still not light on memory, but a bit more acceptable.
- *   Currently the key_slot array is shadowed by key_slot_pending, used to stage new key_slot
- *   mappings.  This doubles the memory used.  We may want to consider allocating key_slot_pending
- *   only during remappings and freeing it after.
+ *   There are two key_slot tables.  One is published for workers to read, the other is used
+ *   to stage the next mapping.  Once complete, the staged table is published with a single
+ *   atomic pointer store, so looking up a key slot never takes a lock.  This doubles the
+ *   memory used.
  *
  * Mapping/Remapping the cluster
  * -----------------------------
@@ -103,9 +104,9 @@
  *     4. Connecting to nodes that were in the result, but not in the tree.
  *        Note: If we can't connect to any of the masters, we count the map as invalid, roll
  *        back any newly connected nodes, and error out. Slave failure is OK.
- *     5. Mapping keyslot ranges to nodes in the key_slot_pending array.
+ *     5. Mapping keyslot ranges to nodes in the unpublished key_slot table.
  *     6. Verifying there are no holes in the ranges (if there are, we roll back and error out).
- *     7. Applying the new keyslot ranges.
+ *     7. Publishing the new keyslot table.
  *     8. Removing nodes no longer used by the key slots, and adding them back to the free
  *        nodes queue.
  *
@@ -153,6 +154,12 @@
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 #include "base.h"
 #include "cluster.h"
 #include "crc16.h"
@@ -241,10 +248,12 @@ struct fr_redis_cluster {
 	VALUE_PAIR		*trigger_args;		//!< Arguments to pass to triggers.
 	bool			triggers_enabled;	//!< Whether triggers are enabled.
 
-	bool			remapping;		//!< True when cluster is being remapped.
+	atomic_bool		remapping;		//!< True when cluster is being remapped.  Only the
+							//!< worker which sets this may remap the cluster.
 	bool			remap_needed;		//!< Set true if at least one cluster node is definitely
 							//!< unreachable. Set false on successful remap.
 	time_t			last_updated;		//!< Last time the cluster mappings were updated.
+							//!< Only accessed by the worker remapping the cluster.
 	CONF_SECTION		*module;		//!< Module configuration.
 
 	fr_redis_conf_t		*conf;			//!< Base configuration data such as the database number
@@ -256,8 +265,9 @@ struct fr_redis_cluster {
 	fr_fifo_t		*free_nodes;		//!< Queue of free nodes (or nodes waiting to be reused).
 	rbtree_t		*used_nodes;		//!< Tree of used nodes.
 
-	fr_redis_cluster_key_slot_t	key_slot[KEY_SLOTS];		//!< Lookup table of slots to pools.
-	fr_redis_cluster_key_slot_t	key_slot_pending[KEY_SLOTS];	//!< Pending key slot table.
+	fr_redis_cluster_key_slot_t	key_slot_map[2][KEY_SLOTS];	//!< Published and pending key slot tables.
+	_Atomic(fr_redis_cluster_key_slot_t *)	key_slot;		//!< Published lookup table of slots to pools.
+									//!< One of key_slot_map.
 
 	pthread_mutex_t		mutex;			//!< Mutex to synchronise cluster operations.
 };
@@ -271,6 +281,25 @@ fr_table_num_sorted_t const fr_redis_cluster_rcodes_table[] = {
 };
 size_t fr_redis_cluster_rcodes_table_len = NUM_ELEMENTS(fr_redis_cluster_rcodes_table);
 
+/** Return the key slot table workers should use
+ *
+ * The table is replaced, not modified, when the cluster is remapped.  The
+ * table which was replaced isn't written to again until the next remap, and
+ * remaps are limited to one a second.
+ */
+static inline fr_redis_cluster_key_slot_t *cluster_key_slot_table(fr_redis_cluster_t *cluster)
+{
+	return atomic_load_explicit(&cluster->key_slot, memory_order_acquire);
+}
+
+/** Return the index of a key slot, in whichever table it belongs to
+ *
+ */
+static inline size_t cluster_key_slot_index(fr_redis_cluster_t *cluster, fr_redis_cluster_key_slot_t const *key_slot)
+{
+	return (key_slot - cluster->key_slot_map[0]) % KEY_SLOTS;
+}
+
 /** Resolve key to key slot
  *
  * Identical to the example implementation, except it uses memchr which will
@@ -525,6 +554,7 @@ static fr_redis_cluster_rcode_t cluster_map_apply(fr_redis_cluster_t *cluster, r
 	uint8_t		r = 0;
 
 	fr_redis_cluster_rcode_t	rcode;
+	fr_redis_cluster_key_slot_t	*key_slot_pending;
 
 	uint8_t		rollback[UINT8_MAX];		// Set of nodes to re-add to the queue on failure.
 	bool		active[UINT8_MAX];		// Set of nodes active in the new cluster map.
@@ -568,12 +598,12 @@ do { \
 	memset(active, 0, sizeof(active));
 	memset(master, 0, sizeof(master));
 
-	cluster->remapping = true;
-
 	/*
-	 *	Must be cleared with the mutex held
+	 *	Stage the new map in whichever table isn't
+	 *	published.  Must be cleared with the mutex held.
 	 */
-	memset(&cluster->key_slot_pending, 0, sizeof(cluster->key_slot_pending));
+	key_slot_pending = cluster->key_slot_map[(cluster_key_slot_table(cluster) == cluster->key_slot_map[0])];
+	memset(key_slot_pending, 0, sizeof(cluster->key_slot_map[0]));
 
 	/*
 	 *	Insert new nodes and markup the keyslot indexes
@@ -616,7 +646,6 @@ do { \
 			fr_strerror_printf("Reached maximum connected nodes");
 			rcode = FR_REDIS_CLUSTER_RCODE_FAILED;
 		error:
-			cluster->remapping = false;
 			cluster->last_updated = time(NULL);
 			/* Re-insert new nodes back into the free_nodes queue */
 			for (i = 0; i < r; i++) SET_INACTIVE(&cluster->node[rollback[i]]);
@@ -677,8 +706,7 @@ do { \
 		 *	specified by the range for this map.
 		 */
 		for (k = map->element[0]->integer; k <= map->element[1]->integer; k++) {
-			memcpy(&cluster->key_slot_pending[k], &tmpl_slot,
-			       sizeof(*(cluster->key_slot_pending)));
+			memcpy(&key_slot_pending[k], &tmpl_slot, sizeof(*key_slot_pending));
 		}
 	}
 
@@ -694,7 +722,7 @@ do { \
 	 *	error out.
 	 */
 	for (i = 0; i < KEY_SLOTS; i++) {
-		if (cluster->key_slot_pending[i].master == 0) {
+		if (key_slot_pending[i].master == 0) {
 			fr_strerror_printf("Cluster is misconfigured, no node assigned for key %zu", i);
 			rcode = FR_REDIS_CLUSTER_RCODE_BAD_INPUT;
 			goto error;
@@ -703,14 +731,15 @@ do { \
 
 	/*
 	 *	We have connections/pools for all the nodes in
-	 *	the new map, apply it to the live cluster.
+	 *	the new map, publish it to the live cluster.
 	 *
-	 *	Other workers may be using the key slot table,
-	 *	but that's ok. Nodes and pools are never freed,
-	 *	so the worst that will happen, is they'll hit
-	 *	the wrong node for the key, and get redirected.
+	 *	Other workers may still be using key slots from
+	 *	the previous table, but that's ok. Nodes and pools
+	 *	are never freed, so the worst that will happen, is
+	 *	they'll hit the wrong node for the key, and get
+	 *	redirected.
 	 */
-	memcpy(&cluster->key_slot, &cluster->key_slot_pending, sizeof(cluster->key_slot));
+	atomic_store_explicit(&cluster->key_slot, key_slot_pending, memory_order_release);
 
 	/*
 	 *	Anything not in the active set of nodes gets
@@ -743,7 +772,6 @@ do { \
 		}
 	}
 
-	cluster->remapping = false;
 	cluster->last_updated = time(NULL);
 
 	/*
@@ -976,6 +1004,12 @@ static fr_redis_cluster_rcode_t cluster_map_get(redisReply **out, fr_redis_conn_
 }
 
 /** Perform a runtime remap of the cluster
+ *
+ * Only one worker remaps the cluster at a time.  Other workers asking for
+ * a remap while one is in progress, or within a second of the last one,
+ * return immediately and continue using the published key slot table.
+ * This stops a storm of redirects turning into a storm of 'cluster slots'
+ * commands.
  *
  * @note Errors may be retrieved with fr_strerror().
  * @note Must be called with the cluster mutex free.
@@ -996,20 +1030,25 @@ fr_redis_cluster_rcode_t fr_redis_cluster_remap(REQUEST *request, fr_redis_clust
 	redisReply	*map;
 	fr_redis_cluster_rcode_t	ret;
 	size_t		i, j;
+	bool		remapping = false;
 
 	/*
-	 *	If the cluster was remapped very recently, or is being
-	 *	remapped it's unlikely that it needs remapping again.
+	 *	If the cluster is being remapped it's unlikely
+	 *	that it needs remapping again.  Checked before
+	 *	the exchange to avoid contending on the flag.
 	 */
-	if (cluster->remapping) {
-	in_progress:
+	if (atomic_load_explicit(&cluster->remapping, memory_order_relaxed) ||
+	    !atomic_compare_exchange_strong(&cluster->remapping, &remapping, true)) {
 		RDEBUG2("Cluster remapping in progress, ignoring remap request");
 		return FR_REDIS_CLUSTER_RCODE_IGNORED;
 	}
 
+	/*
+	 *	Nor if it was remapped very recently.
+	 */
 	now = time(NULL);
 	if (now == cluster->last_updated) {
-	too_soon:
+		atomic_store(&cluster->remapping, false);
 		RWARN("Cluster was updated less than a second ago, ignoring remap request");
 		return FR_REDIS_CLUSTER_RCODE_IGNORED;
 	}
@@ -1024,10 +1063,14 @@ fr_redis_cluster_rcode_t fr_redis_cluster_remap(REQUEST *request, fr_redis_clust
 	case FR_REDIS_CLUSTER_RCODE_BAD_INPUT:		/* Validation error */
 	case FR_REDIS_CLUSTER_RCODE_NO_CONNECTION:		/* Connection error */
 	case FR_REDIS_CLUSTER_RCODE_FAILED:			/* Error issuing command */
+		cluster->last_updated = now;
+		atomic_store(&cluster->remapping, false);
 		return ret;
 
 	case FR_REDIS_CLUSTER_RCODE_IGNORED:		/* Clustering not enabled, or not supported */
 		cluster->remap_needed = false;
+		cluster->last_updated = now;
+		atomic_store(&cluster->remapping, false);
 		return FR_REDIS_CLUSTER_RCODE_IGNORED;
 
 	case FR_REDIS_CLUSTER_RCODE_SUCCESS:		/* Success */
@@ -1058,25 +1101,14 @@ fr_redis_cluster_rcode_t fr_redis_cluster_remap(REQUEST *request, fr_redis_clust
 	}
 
 	/*
-	 *	Check again that the cluster isn't being
-	 *	remapped, or was remapped too recently,
-	 *	now we hold the mutex and the state of
-	 *	those variables is synchronized.
+	 *	The mutex protects the node structures, which
+	 *	are also modified when processing redirects.
 	 */
 	pthread_mutex_lock(&cluster->mutex);
-	if (cluster->remapping) {
-		pthread_mutex_unlock(&cluster->mutex);
-		fr_redis_reply_free(&map);	/* Free the map */
-		goto in_progress;
-	}
-	if (now == cluster->last_updated) {
-		pthread_mutex_unlock(&cluster->mutex);
-		fr_redis_reply_free(&map);	/* Free the map */
-		goto too_soon;
-	}
 	ret = cluster_map_apply(cluster, map);
 	if (ret == FR_REDIS_CLUSTER_RCODE_SUCCESS) cluster->remap_needed = false;	/* Change on successful remap */
 	pthread_mutex_unlock(&cluster->mutex);
+	atomic_store(&cluster->remapping, false);
 
 	fr_redis_reply_free(&map);	/* Free the map */
 	if (ret < 0) return FR_REDIS_CLUSTER_RCODE_FAILED;
@@ -1566,11 +1598,11 @@ void *fr_redis_cluster_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delt
 fr_redis_cluster_key_slot_t const *fr_redis_cluster_slot_by_key(fr_redis_cluster_t *cluster, REQUEST *request,
 								uint8_t const *key, size_t key_len)
 {
-	fr_redis_cluster_key_slot_t *key_slot;
+	fr_redis_cluster_key_slot_t *key_slot, *table = cluster_key_slot_table(cluster);
 
 	if (!key || (key_len == 0)) {
-		key_slot = &cluster->key_slot[(uint16_t)(fr_rand() & (KEY_SLOTS - 1))];
-		RDEBUG2("Key rand() -> slot %zu", key_slot - cluster->key_slot);
+		key_slot = &table[(uint16_t)(fr_rand() & (KEY_SLOTS - 1))];
+		RDEBUG2("Key rand() -> slot %zu", key_slot - table);
 
 		return key_slot;
 	}
@@ -1580,15 +1612,15 @@ fr_redis_cluster_key_slot_t const *fr_redis_cluster_slot_by_key(fr_redis_cluster
 	 *	without clustering.
 	 */
 	if (rbtree_num_elements(cluster->used_nodes) > 1) {
-		key_slot = &cluster->key_slot[cluster_key_hash(key, key_len)];
+		key_slot = &table[cluster_key_hash(key, key_len)];
 		RDEBUG2("Key \"%pV\" -> slot %zu",
-			fr_box_strvalue_len((char const *)key, key_len), key_slot - cluster->key_slot);
+			fr_box_strvalue_len((char const *)key, key_len), key_slot - table);
 
 		return key_slot;
 	}
 	RDEBUG3("Single node available, skipping key selection");
 
-	return &cluster->key_slot[0];
+	return &table[0];
 }
 
 /** Return the master node that would be used for a particular key
@@ -1739,7 +1771,8 @@ again:
 			*conn = fr_pool_connection_get(node->pool, request);
 			if (!*conn) {
 				RDEBUG2("[%i] No connections available (key slot %zu slave %i)",
-					node->id, key_slot - cluster->key_slot, (first + i) % key_slot->slave_num);
+					node->id, cluster_key_slot_index(cluster, key_slot),
+					(first + i) % key_slot->slave_num);
 				cluster->remap_needed = true;
 				continue;	/* Continue until we find a live pool */
 			}
@@ -1759,7 +1792,7 @@ again:
 	*conn = fr_pool_connection_get(node->pool, request);
 	if (!*conn) {
 		RDEBUG2("[%i] No connections available (key slot %zu master)",
-			node->id, key_slot - cluster->key_slot);
+			node->id, cluster_key_slot_index(cluster, key_slot));
 		cluster->remap_needed = true;
 
 		if (cluster_node_find_live(&node, conn, request, cluster, node) < 0) return REDIS_RCODE_RECONNECT;
@@ -2359,6 +2392,9 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 
 	cluster->conf = conf;
 
+	atomic_init(&cluster->remapping, false);
+	atomic_init(&cluster->key_slot, cluster->key_slot_map[0]);
+
 	pthread_mutex_init(&cluster->mutex, NULL);
 	talloc_set_destructor(cluster, _fr_redis_cluster_free);
 
@@ -2522,7 +2558,7 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 	 *	hopefully we'll get one when we start processing
 	 *	requests.
 	 */
-	for (s = 0; s < KEY_SLOTS; s++) cluster->key_slot[s].master = (s % (uint16_t) num_nodes) + 1;
+	for (s = 0; s < KEY_SLOTS; s++) cluster->key_slot_map[0][s].master = (s % (uint16_t) num_nodes) + 1;
 
 	return cluster;
 }
@@ -27,6 +27,8 @@
 
 #include <freeradius-devel/server/connection.h>
 #include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/rbtree.h>
 
 #include "pipeline.h"
 #include "io.h"
@@ -42,8 +44,20 @@ struct fr_redis_cluster_thread_s {
 	char				*log_prefix;	//!< Common log prefix to use for all cluster related
 							///< messages.
 	bool				delay_start;	//!< Prevent connections from spawning immediately.
+	rbtree_t			*nodes;		//!< Trunks to individual nodes, keyed by address,
+							///< created as the nodes are used.
 };
 
+/** Pipelined connections to a single cluster node
+ *
+ */
+typedef struct {
+	fr_ipaddr_t			ipaddr;		//!< Address of the node.
+	uint16_t			port;		//!< Port of the node.
+	fr_redis_io_conf_t		io_conf;	//!< Where the pipelined connections go.
+	fr_redis_trunk_t		*trunk;		//!< Pipelined connections to the node.
+} fr_redis_cluster_trunk_t;
+
 /** The thread local free list
  *
  * Any entries remaining in the list will be freed when the thread is joined
@@ -72,6 +86,7 @@ struct fr_redis_command_s {
 
 	char const			*str;		//!< The command string.
 	size_t				len;		//!< Length of the command string.
+	bool				formatted;	//!< str is in the Redis protocol format.
 
 	uint64_t			sqn;		//!< The sequence number of the command.  This is only
 							///< valid for a specific handle, and is unique within
@@ -262,38 +277,111 @@ fr_redis_command_set_t *fr_redis_command_set_alloc(TALLOC_CTX *ctx,
  */
 static int _redis_command_free(fr_redis_command_t *cmd)
 {
-	//if (cmd->result) fr_redis_reply_free(&cmd->result);
+	if (cmd->result) fr_redis_reply_free(&cmd->result);
 
 	return 0;
 }
 
+/** Copy a reply
+ *
+ * hiredis frees replies as soon as the reply callback returns, so we need
+ * our own copy if the reply is to be available after the whole command set
+ * completes.
+ *
+ * The copy is allocated with malloc so that it can be freed with
+ * #fr_redis_reply_free.
+ *
+ * @param[in] in	reply to copy.
+ * @return
+ *	- A copy of the reply.
+ *	- NULL on error.
+ */
+static redisReply *redis_reply_copy(redisReply const *in)
+{
+	redisReply	*out;
+	size_t		i;
+
+	out = calloc(1, sizeof(*out));
+	if (!out) return NULL;
+
+	out->type = in->type;
+	out->integer = in->integer;
+
+	switch (in->type) {
+	case REDIS_REPLY_STRING:
+	case REDIS_REPLY_STATUS:
+	case REDIS_REPLY_ERROR:
+		out->str = malloc(in->len + 1);
+		if (!out->str) goto error;
+		memcpy(out->str, in->str, in->len);
+		out->str[in->len] = '\0';
+		out->len = in->len;
+		break;
+
+	case REDIS_REPLY_ARRAY:
+		if (!in->elements) break;
+
+		out->element = calloc(in->elements, sizeof(redisReply *));
+		if (!out->element) goto error;
+		out->elements = in->elements;
+
+		for (i = 0; i < in->elements; i++) {
+			out->element[i] = redis_reply_copy(in->element[i]);
+			if (!out->element[i]) goto error;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return out;
+
+error:
+	fr_redis_reply_free(&out);
+	return NULL;
+}
+
 redisReply *fr_redis_command_get_result(fr_redis_command_t *cmd)
 {
 	return cmd->result;
 }
 
-/** Add a preformatted/expanded command to the command set
- *
- * The command must either be entirely static, or parented by the command set.
+/** Retrieve the reply to a command, and check whether the command succeeded
  *
- * @note Caller should disallow "SUBSCRIBE" et al, if they're not appropriate.
- * 	 As subscribing to a stream where we're not expecting it would break
- * 	 things, badly.
+ * @param[out] out	Where to write the reply.  Only valid until the command
+ *			set is freed.
+ * @param[in] request	The current request.
+ * @param[in] cmd	from the list of completed commands.  May be NULL if the
+ *			list was shorter than expected.
+ * @return
+ *	- REDIS_RCODE_RECONNECT if no reply was received.
+ *	- The status of the command, as returned by #fr_redis_command_status.
+ */
+fr_redis_rcode_t fr_redis_command_reply(redisReply **out, REQUEST *request, fr_redis_command_t *cmd)
+{
+	*out = cmd ? cmd->result : NULL;
+	if (!*out) {
+		REDEBUG("No reply received from server");
+		return REDIS_RCODE_RECONNECT;
+	}
+
+	return fr_redis_command_status(NULL, *out);
+}
+
+/** Determine the type of a command, checking transaction blocks are balanced
  *
- * @param[in] cmds	Command set to add command to.
- * @param[in] cmd_str	A fully expanded/formatted command to send to redis.
- *			Must be static, or have the same lifetime as the
- *			command set (allocated with the command set as the parent).
- * @param[in] cmd_len	Length of the command.
+ * @param[out] out	The type of the command.
+ * @param[in] cmds	Command set the command is being added to.
+ * @param[in] cmd_str	The command.
  * @return
  *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
- *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ *	- FR_REDIS_PIPELINE_OK if the command can be enqueued.
  */
-fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
-							     char const *cmd_str, size_t cmd_len)
+static fr_redis_pipeline_status_t redis_command_type(fr_redis_command_type_t *out,
+						     fr_redis_command_set_t *cmds, char const *cmd_str)
 {
 	REQUEST			*request = cmds->request;
-	fr_redis_command_t	*cmd;
 	fr_redis_command_type_t	type = FR_REDIS_COMMAND_NORMAL;
 
 	/*
@@ -366,6 +454,38 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 		break;
 	}
 
+	*out = type;
+
+	return FR_REDIS_PIPELINE_OK;
+}
+
+/** Add a preformatted/expanded command to the command set
+ *
+ * The command must either be entirely static, or parented by the command set.
+ *
+ * @note Caller should disallow "SUBSCRIBE" et al, if they're not appropriate.
+ * 	 As subscribing to a stream where we're not expecting it would break
+ * 	 things, badly.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] cmd_str	A fully expanded/formatted command to send to redis.
+ *			Must be static, or have the same lifetime as the
+ *			command set (allocated with the command set as the parent).
+ * @param[in] cmd_len	Length of the command.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
+							     char const *cmd_str, size_t cmd_len)
+{
+	fr_redis_command_t	*cmd;
+	fr_redis_command_type_t	type;
+	fr_redis_pipeline_status_t status;
+
+	status = redis_command_type(&type, cmds, cmd_str);
+	if (status != FR_REDIS_PIPELINE_OK) return status;
+
 	MEM(cmd = talloc_zero(cmds, fr_redis_command_t));
 	talloc_set_destructor(cmd, _redis_command_free);
 	cmd->cmds = cmds;
@@ -377,6 +497,48 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 	return FR_REDIS_PIPELINE_OK;
 }
 
+/** Add a command, made up of separate arguments, to the command set
+ *
+ * Unlike #fr_redis_command_preformatted_add, the arguments may contain
+ * spaces or binary data, e.g. keys.  The arguments are copied.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] argc	Number of arguments, including the command.
+ * @param[in] argv	The command, then its arguments.
+ * @param[in] argv_len	Length of each argument.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued,
+ *	  or the command couldn't be formatted.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_argv_add(fr_redis_command_set_t *cmds,
+						     int argc, char const **argv, size_t const *argv_len)
+{
+	fr_redis_command_t	*cmd;
+	fr_redis_command_type_t	type;
+	fr_redis_pipeline_status_t status;
+	char			*formatted;
+	int			len;
+
+	status = redis_command_type(&type, cmds, argv[0]);
+	if (status != FR_REDIS_PIPELINE_OK) return status;
+
+	len = redisFormatCommandArgv(&formatted, argc, argv, argv_len);
+	if (len < 0) return FR_REDIS_PIPELINE_BAD_CMDS;
+
+	MEM(cmd = talloc_zero(cmds, fr_redis_command_t));
+	talloc_set_destructor(cmd, _redis_command_free);
+	cmd->cmds = cmds;
+	cmd->type = type;
+	MEM(cmd->str = talloc_memdup(cmd, formatted, len));
+	cmd->len = len;
+	cmd->formatted = true;
+	redisFreeCommand(formatted);
+	fr_dlist_insert_tail(&cmds->pending, cmd);
+
+	return FR_REDIS_PIPELINE_OK;
+}
+
 /** Enqueue a command set on a specific trunk
  *
  * The command set may be passed around several trunks before it is complete.
@@ -409,6 +571,20 @@ fr_redis_pipeline_status_t redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, f
 	}
 }
 
+/** Cancel a command set which was previously enqueued
+ *
+ * The complete and fail callbacks will not be called.  Any replies
+ * to commands which were already sent are ignored.
+ *
+ * @param[in] cmds	to cancel.
+ */
+void fr_redis_command_set_cancel(fr_redis_command_set_t *cmds)
+{
+	if (!cmds->treq) return;
+
+	fr_trunk_request_signal_cancel(cmds->treq);
+}
+
 /** Callback for for receiving Redis replies
  *
  * This is called by hiredis for each response is receives.  privData is set to the
@@ -436,7 +612,6 @@ static void _redis_pipeline_demux(struct redisAsyncContext *ac, void *vreply, vo
 	 */
 	if (!fr_redis_connection_process_response(h)) {
 		DEBUG4("Ignoring response with SQN %"PRIu64, (h->rsp_sqn - 1));	/* Already incremented */
-		fr_redis_reply_free((redisReply **)&reply);
 		return;
 	}
 
@@ -447,7 +622,7 @@ static void _redis_pipeline_demux(struct redisAsyncContext *ac, void *vreply, vo
 	 */
 	cmd = talloc_get_type_abort(privdata, fr_redis_command_t);
 	cmds = cmd->cmds;
-	cmd->result = reply;
+	if (reply) cmd->result = redis_reply_copy(reply);	/* hiredis frees the original */
 
 	fr_dlist_remove(&cmds->sent, cmd);
 	fr_dlist_insert_tail(&cmds->completed, cmd);
@@ -480,37 +655,57 @@ static fr_connection_t *_redis_pipeline_connection_alloc(fr_trunk_connection_t *
  * @param[in] conn		Connection handle containing the fr_redis_handle_t.
  * @param[in] uctx		fr_redis_cluster_t.  Unused.
  */
-static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+static void _redis_pipeline_mux(UNUSED fr_event_list_t *el,
+				fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
 {
 	fr_trunk_request_t	*treq;
 	fr_redis_command_set_t 	*cmds;
 	fr_redis_command_t	*cmd;
 	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
 	REQUEST			*request;
+	int			ret;
 
-	treq = fr_trunk_connection_pop_request(&request, (void *)&cmds, NULL, tconn);
-	while ((cmd = fr_dlist_head(&cmds->pending))) {
-		/*
-		 *	If this fails it probably means the connection
-		 *	is disconnecting, but if that's happening then
-		 *	we shouldn't be enqueueing new requests?
-		 */
-		if (unlikely(redisAsyncCommand(h->ac, _redis_pipeline_demux, cmd, "%s", cmd->str) != REDIS_OK)) {
-			ROPTIONAL(ERROR, REDEBUG, "Unexpected error queueing REDIS command");
+	/*
+	 *	Write every command set that's pending, so that
+	 *	command sets from many requests share the same
+	 *	round trip.
+	 */
+	for (;;) {
+		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) return;
+		if (!treq) break;
+
+		request = treq->request;
+		cmds = talloc_get_type_abort(treq->preq, fr_redis_command_set_t);
+
+		while ((cmd = fr_dlist_head(&cmds->pending))) {
+			if (cmd->formatted) {
+				ret = redisAsyncFormattedCommand(h->ac, _redis_pipeline_demux, cmd, cmd->str, cmd->len);
+			} else {
+				ret = redisAsyncCommand(h->ac, _redis_pipeline_demux, cmd, "%s", cmd->str);
+			}
 
-			while ((cmd = fr_dlist_head(&cmds->sent))) {
-				fr_redis_connection_ignore_response(h, cmd->sqn);
-				fr_dlist_remove(&cmds->sent, cmd);
-				fr_dlist_insert_tail(&cmds->pending, cmd);
+			/*
+			 *	If this fails it probably means the connection
+			 *	is disconnecting, but if that's happening then
+			 *	we shouldn't be enqueueing new requests?
+			 */
+			if (unlikely(ret != REDIS_OK)) {
+				ROPTIONAL(ERROR, REDEBUG, "Unexpected error queueing REDIS command");
+
+				while ((cmd = fr_dlist_head(&cmds->sent))) {
+					fr_redis_connection_ignore_response(h, cmd->sqn);
+					fr_dlist_remove(&cmds->sent, cmd);
+					fr_dlist_insert_tail(&cmds->pending, cmd);
+				}
+				fr_trunk_request_signal_fail(treq);
+				return;
 			}
-			fr_trunk_request_signal_fail(treq);
-			return;
+			cmd->sqn = fr_redis_connection_sent_request(h);
+			fr_dlist_remove(&cmds->pending, cmd);
+			fr_dlist_insert_tail(&cmds->sent, cmd);
 		}
-		cmd->sqn = fr_redis_connection_sent_request(h);
-		fr_dlist_remove(&cmds->pending, cmd);
-		fr_dlist_insert_tail(&cmds->sent, cmd);
+		fr_trunk_request_signal_sent(treq);
 	}
-	fr_trunk_request_signal_sent(treq);
 }
 
 /** Deal with cancellation of sent requests
@@ -519,7 +714,7 @@ static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *c
  * on why the commands were cancelled, we either tell the handle to ignore
  * them, or move them back into the pending list.
  */
-static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_trunk_request_t *treq, void *preq,
+static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, void *preq,
 					       fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
@@ -541,6 +736,7 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 	 *	execution by another handle.
 	 */
 	case FR_TRUNK_CANCEL_REASON_MOVE:
+	case FR_TRUNK_CANCEL_REASON_REQUEUE:
 		fr_dlist_move(&cmds->pending, &cmds->sent);
 		return;
 
@@ -564,6 +760,7 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 			fr_redis_connection_ignore_response(h, cmd->sqn);
 		}
 	}
+		return;
 
 	case FR_TRUNK_CANCEL_REASON_NONE:
 		fr_assert(0);
@@ -586,7 +783,7 @@ static void _redis_pipeline_command_set_complete(UNUSED REQUEST *request, void *
  *
  */
 static void _redis_pipeline_command_set_fail(UNUSED REQUEST *request, void *preq,
-					     UNUSED void *rctx, UNUSED void *uctx)
+					     UNUSED void *rctx, UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
@@ -638,6 +835,17 @@ fr_redis_trunk_t *fr_redis_trunk_alloc(fr_redis_cluster_thread_t *cluster_thread
 	return rtrunk;
 }
 
+static int _redis_cluster_trunk_cmp(void const *one, void const *two)
+{
+	fr_redis_cluster_trunk_t const	*a = one, *b = two;
+	int				ret;
+
+	ret = fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+	if (ret != 0) return ret;
+
+	return (a->port > b->port) - (a->port < b->port);
+}
+
 /** Allocate per-thread, per-cluster instance
  *
  * This structure represents all the connections for a given thread for a given cluster.
@@ -655,8 +863,153 @@ fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_eve
 
 	cluster_thread->el = el;
 	cluster_thread->tconf = our_tconf;
+	MEM(cluster_thread->nodes = rbtree_talloc_create(cluster_thread, _redis_cluster_trunk_cmp,
+							  fr_redis_cluster_trunk_t, NULL, 0));
 
 	return cluster_thread;
 }
 
+/** Find the pipelined connections to a node
+ *
+ * Connections to a node are created the first time this thread sends
+ * commands to it.
+ *
+ * @param[in] cluster_thread	Holding this thread's connections to the cluster.
+ * @param[in] request		The current request.
+ * @param[in] ipaddr		of the node.
+ * @param[in] port		of the node.
+ * @return
+ *	- The trunk for the node.
+ *	- NULL if connections couldn't be created.
+ */
+fr_redis_trunk_t *fr_redis_cluster_trunk_by_addr(fr_redis_cluster_thread_t *cluster_thread, REQUEST *request,
+						 fr_ipaddr_t const *ipaddr, uint16_t port)
+{
+	fr_redis_cluster_trunk_t	find, *found;
+	char				buffer[FR_IPADDR_STRLEN];
+
+	memset(&find, 0, sizeof(find));
+	find.ipaddr = *ipaddr;
+	find.port = port;
 
+	found = rbtree_finddata(cluster_thread->nodes, &find);
+	if (found) return found->trunk;
+
+	MEM(found = talloc_zero(cluster_thread->nodes, fr_redis_cluster_trunk_t));
+	found->ipaddr = find.ipaddr;
+	found->port = find.port;
+
+	fr_inet_ntop(buffer, sizeof(buffer), &found->ipaddr);
+	found->io_conf.hostname = talloc_typed_strdup(found, buffer);
+	found->io_conf.port = found->port;
+
+	found->trunk = fr_redis_trunk_alloc(cluster_thread, &found->io_conf);
+	if (!found->trunk) {
+		RERROR("Failed creating pipelined connections to %s:%u", buffer, found->port);
+		talloc_free(found);
+		return NULL;
+	}
+
+	if (!rbtree_insert(cluster_thread->nodes, found)) {
+		talloc_free(found->trunk);
+		talloc_free(found);
+		return NULL;
+	}
+
+	return found->trunk;
+}
+
+/** Find the pipelined connections to the master serving a key
+ *
+ * @param[in] cluster_thread	Holding this thread's connections to the cluster.
+ * @param[in] cluster		to find the master in.
+ * @param[in] request		The current request.
+ * @param[in] key		to find the master for.
+ * @param[in] key_len		Length of the key.
+ * @return
+ *	- The trunk for the node.
+ *	- NULL if the node is unknown, or connections couldn't be created.
+ */
+fr_redis_trunk_t *fr_redis_cluster_trunk_by_key(fr_redis_cluster_thread_t *cluster_thread,
+						fr_redis_cluster_t *cluster, REQUEST *request,
+						uint8_t const *key, size_t key_len)
+{
+	fr_redis_cluster_key_slot_t const	*key_slot;
+	fr_redis_cluster_node_t const		*node;
+	fr_ipaddr_t				ipaddr;
+	uint16_t				port;
+
+	key_slot = fr_redis_cluster_slot_by_key(cluster, request, key, key_len);
+	node = fr_redis_cluster_master(cluster, key_slot);
+	if ((fr_redis_cluster_ipaddr(&ipaddr, node) < 0) || (fr_redis_cluster_port(&port, node) < 0)) return NULL;
+
+	return fr_redis_cluster_trunk_by_addr(cluster_thread, request, &ipaddr, port);
+}
+
+/** Whether a pipelined command which failed should be retried with #fr_redis_trunk_sync
+ *
+ * Pipelined commands aren't redirected.  If the cluster has been remapped,
+ * or we couldn't talk to the node, the synchronous path follows redirects,
+ * and updates the cluster map for subsequent requests.
+ *
+ * @param[in] status	of the pipelined command.
+ * @return true if the command should be retried.
+ */
+bool fr_redis_trunk_retry(fr_redis_rcode_t status)
+{
+	switch (status) {
+	case REDIS_RCODE_MOVE:
+	case REDIS_RCODE_ASK:
+	case REDIS_RCODE_TRY_AGAIN:
+	case REDIS_RCODE_RECONNECT:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/** Run a command over the connection pool, following redirects
+ *
+ * Used if pipelined connections aren't available, or the cluster
+ * has been remapped.
+ *
+ * @param[in] cluster		to send the command to.
+ * @param[in] request		The current request.
+ * @param[in] key		the command operates on.
+ * @param[in] key_len		Length of the key.
+ * @param[in] argc		Redis command argument count.
+ * @param[in] argv		Redis command arguments.
+ * @param[in] reply_handler	Called with the reply if the command succeeded.
+ * @param[in] uctx		passed to the reply_handler.
+ * @return
+ *	- The result of the reply_handler.
+ *	- The status of the command if it failed.
+ */
+fr_redis_rcode_t fr_redis_trunk_sync(fr_redis_cluster_t *cluster, REQUEST *request,
+				     uint8_t const *key, size_t key_len, int argc, char const **argv,
+				     fr_redis_reply_handler_t reply_handler, void *uctx)
+{
+	fr_redis_conn_t			*conn;
+	fr_redis_cluster_state_t	state;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL;
+	fr_redis_rcode_t		s_ret;
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, cluster, request, key, key_len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, cluster, request, status, &reply)) {
+		reply = redisCommandArgv(conn->handle, argc, argv, NULL);
+		status = fr_redis_command_status(conn, reply);
+	}
+	if (s_ret != REDIS_RCODE_SUCCESS) {
+		fr_redis_reply_free(&reply);
+		return s_ret;
+	}
+	if (!fr_cond_assert(reply)) return REDIS_RCODE_ERROR;
+
+	status = reply_handler(request, reply, uctx);
+	fr_redis_reply_free(&reply);
+
+	return status;
+}
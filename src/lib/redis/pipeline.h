@@ -31,6 +31,8 @@ RCSIDH(redis_pipeline_h, "$Id$")
 #include <freeradius-devel/server/connection.h>
 #include <freeradius-devel/server/request.h>
 #include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/redis/base.h>
+#include <freeradius-devel/redis/cluster.h>
 #include <freeradius-devel/redis/io.h>
 #include <hiredis/async.h>
 
@@ -63,16 +65,30 @@ typedef void (*fr_redis_command_set_complete_t)(REQUEST *request, fr_dlist_head_
  */
 typedef void (*fr_redis_command_set_fail_t)(REQUEST *request, fr_dlist_head_t *completed, void *rctx);
 
+/** Interpret the reply to a command which succeeded
+ *
+ * Called for both pipelined and synchronous commands, so the reply
+ * must not be kept.
+ */
+typedef fr_redis_rcode_t (*fr_redis_reply_handler_t)(REQUEST *request, redisReply *reply, void *uctx);
+
 fr_redis_pipeline_status_t	fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
 							     	  char const *cmd_str, size_t cmd_len);
 
+fr_redis_pipeline_status_t	fr_redis_command_argv_add(fr_redis_command_set_t *cmds,
+							  int argc, char const **argv, size_t const *argv_len);
+
 /*
  *	TEMPORARY
  */
 fr_redis_pipeline_status_t redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, fr_redis_command_set_t *cmds);
 
+void				fr_redis_command_set_cancel(fr_redis_command_set_t *cmds);
+
 redisReply *fr_redis_command_get_result(fr_redis_command_t *cmd);
 
+fr_redis_rcode_t		fr_redis_command_reply(redisReply **out, REQUEST *request, fr_redis_command_t *cmd);
+
 fr_redis_command_set_t		*fr_redis_command_set_alloc(TALLOC_CTX *ctx,
 							    REQUEST *request,
 							    fr_redis_command_set_complete_t complete,
@@ -85,6 +101,20 @@ fr_redis_trunk_t		*fr_redis_trunk_alloc(fr_redis_cluster_thread_t *rtcluster,
 fr_redis_cluster_thread_t	*fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 							       fr_trunk_conf_t const *tconf);
 
+fr_redis_trunk_t		*fr_redis_cluster_trunk_by_addr(fr_redis_cluster_thread_t *cluster_thread,
+								REQUEST *request,
+								fr_ipaddr_t const *ipaddr, uint16_t port);
+
+fr_redis_trunk_t		*fr_redis_cluster_trunk_by_key(fr_redis_cluster_thread_t *cluster_thread,
+							       fr_redis_cluster_t *cluster, REQUEST *request,
+							       uint8_t const *key, size_t key_len);
+
+bool				fr_redis_trunk_retry(fr_redis_rcode_t status);
+
+fr_redis_rcode_t		fr_redis_trunk_sync(fr_redis_cluster_t *cluster, REQUEST *request,
+						    uint8_t const *key, size_t key_len, int argc, char const **argv,
+						    fr_redis_reply_handler_t reply_handler, void *uctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,3 +1,9 @@
 SUBMAKEFILES := \
 	libfreeradius-server.mk \
-	trunk_tests.mk
+	metrics_tests.mk \
+	reload_tests.mk \
+	request_data_tests.mk \
+	trace_tests.mk \
+	trunk_bench.mk \
+	trunk_tests.mk \
+	users_file_tests.mk
@@ -43,6 +43,11 @@ int server_init(CONF_SECTION *cs)
 	 */
 	if (trigger_exec_init(cs) < 0) return -1;
 
+	/*
+	 *	Register the commands for reading metrics
+	 */
+	if (fr_metric_init() < 0) return -1;
+
 	/*
 	 *	Instantiate "permanent" paircmps
 	 */
@@ -126,4 +131,9 @@ void server_free(void)
 	 *	Free information associated with the virtual servers.
 	 */
 	virtual_servers_free();
+
+	/*
+	 *	Free metrics, now nothing is updating them.
+	 */
+	fr_metric_free();
 }
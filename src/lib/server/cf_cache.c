@@ -0,0 +1,828 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Cache of the parsed configuration
+ *
+ * The cache holds every pair and section which #cf_file_read added to
+ * the root section, after variable expansion, along with a SHA1 hash
+ * of every file which was read, and of everything else the result
+ * depended on (directory listings, globs, optional files and $ENV{}
+ * references).
+ *
+ * When the cache is loaded, all of the hashes are checked before the
+ * tree is touched.  If anything has changed, the cache is refused and
+ * the files are parsed as normal.  Otherwise the tree is rebuilt
+ * without tokenising or expanding anything.  ON_READ callbacks are run
+ * in the same order as they were when the files were parsed, and the
+ * conditions for "if" and "elsif" are tokenised again, as they're
+ * stored as data on the section.
+ *
+ * Records are text, one per line, with strings written as
+ * `<length>:<bytes>`, so that they can contain anything.
+ *
+ * @file src/lib/server/cf_cache.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/cf_file.h>
+#include <freeradius-devel/server/cf_priv.h>
+#include <freeradius-devel/server/cond.h>
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/sha1.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/version.h>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_DIRENT_H
+#  include <dirent.h>
+#endif
+
+#ifdef HAVE_GLOB_H
+#  include <glob.h>
+#endif
+
+#define CF_CACHE_MAGIC		"FRCONFC"
+#define CF_CACHE_VERSION	(1)
+
+typedef char cf_cache_digest_t[(SHA1_DIGEST_LENGTH * 2) + 1];
+
+/** Position in a cache which is being loaded
+ *
+ */
+typedef struct {
+	char		*p;		//!< Next byte to parse.
+	char		*end;		//!< End of the cache.
+} cf_cache_in_t;
+
+/** A file record, which is turned into a #cf_file_t once the tree has been built
+ *
+ */
+typedef struct {
+	char const	*filename;	//!< Of the file.
+	int		section;	//!< Index of the section the file was read into.
+	bool		from_dir;	//!< Whether the file was read from a directory.
+} cf_cache_file_t;
+
+static void cf_cache_digest_final(cf_cache_digest_t out, fr_sha1_ctx *ctx)
+{
+	uint8_t digest[SHA1_DIGEST_LENGTH];
+
+	fr_sha1_final(digest, ctx);
+	fr_bin2hex(out, digest, sizeof(digest));
+}
+
+/** Hash the contents of a file
+ *
+ */
+static int cf_cache_file_digest(cf_cache_digest_t out, char const *filename)
+{
+	int		fd;
+	ssize_t		slen;
+	uint8_t		buffer[8192];
+	fr_sha1_ctx	ctx;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	fr_sha1_init(&ctx);
+	while ((slen = read(fd, buffer, sizeof(buffer))) > 0) fr_sha1_update(&ctx, buffer, slen);
+	close(fd);
+
+	if (slen < 0) {
+		fr_strerror_printf("Failed reading %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	cf_cache_digest_final(out, &ctx);
+	return 0;
+}
+
+#ifdef HAVE_DIRENT_H
+static int _name_cmp(void const *a, void const *b)
+{
+	return strcmp(*((char const * const *)a), *((char const * const *)b));
+}
+#endif
+
+/** Hash the current state of something other than a file's contents
+ *
+ * Strings are hashed with their trailing NUL, so that e.g. an empty
+ * environment variable is different to an unset one.
+ */
+static int cf_cache_dep_digest(cf_cache_digest_t out, cf_file_dep_t const *dep)
+{
+	fr_sha1_ctx	ctx;
+	struct stat	sb;
+	char const	*value;
+
+	fr_sha1_init(&ctx);
+
+	switch (dep->type) {
+	case CF_FILE_DEP_ENV:
+		value = getenv(dep->name);
+		if (value) fr_sha1_update(&ctx, (uint8_t const *) value, strlen(value) + 1);
+		break;
+
+	case CF_FILE_DEP_INCLUDE:
+#ifdef HAVE_GLOB_H
+		if (strchr(dep->name, '*') != NULL) {
+			glob_t	gl;
+			size_t	i;
+
+			if (glob(dep->name, GLOB_ERR | GLOB_NOESCAPE, NULL, &gl) != 0) break;
+
+			for (i = 0; i < gl.gl_pathc; i++) {
+				fr_sha1_update(&ctx, (uint8_t const *) gl.gl_pathv[i], strlen(gl.gl_pathv[i]) + 1);
+			}
+			globfree(&gl);
+			break;
+		}
+#endif
+
+		/*
+		 *	Missing files hash to nothing.
+		 */
+		if (stat(dep->name, &sb) < 0) break;
+		fr_sha1_update(&ctx, (uint8_t const *) "+", 1);
+
+#ifdef HAVE_DIRENT_H
+		if (S_ISDIR(sb.st_mode)) {
+			DIR		*dir;
+			struct dirent	*dp;
+			char		**names = NULL;
+			size_t		num = 0, i;
+
+			dir = opendir(dep->name);
+			if (!dir) {
+				fr_strerror_printf("Failed reading directory %s: %s", dep->name, fr_syserror(errno));
+				return -1;
+			}
+
+			while ((dp = readdir(dir)) != NULL) {
+				if (dp->d_name[0] == '.') continue;
+
+				MEM(names = talloc_realloc(NULL, names, char *, num + 1));
+				MEM(names[num++] = talloc_typed_strdup(names, dp->d_name));
+			}
+			closedir(dir);
+
+			if (num) qsort(names, num, sizeof(*names), _name_cmp);
+			for (i = 0; i < num; i++) fr_sha1_update(&ctx, (uint8_t const *) names[i], strlen(names[i]) + 1);
+			talloc_free(names);
+		}
+#endif
+		break;
+	}
+
+	cf_cache_digest_final(out, &ctx);
+	return 0;
+}
+
+static void cf_cache_write_str(FILE *fp, char const *str)
+{
+	if (!str) {
+		fputs(" -", fp);
+		return;
+	}
+
+	fprintf(fp, " %zu:%s", strlen(str), str);
+}
+
+/** Write a list of items, and all of their children
+ *
+ */
+static void cf_cache_write_items(FILE *fp, CONF_ITEM const *ci)
+{
+	for (; ci; ci = ci->next) {
+		switch (ci->type) {
+		case CONF_ITEM_PAIR:
+		{
+			CONF_PAIR const *cp = cf_item_to_pair(ci);
+
+			fprintf(fp, "P %d", ci->lineno);
+			cf_cache_write_str(fp, ci->filename);
+			cf_cache_write_str(fp, cp->attr);
+			cf_cache_write_str(fp, cp->value);
+			fprintf(fp, " %d %d %d %d\n", cp->op, cp->lhs_quote, cp->rhs_quote, cp->pass2);
+		}
+			break;
+
+		case CONF_ITEM_SECTION:
+		{
+			CONF_SECTION const	*cs = cf_item_to_section(ci);
+			int			i;
+
+			fprintf(fp, "S %d", ci->lineno);
+			cf_cache_write_str(fp, ci->filename);
+			cf_cache_write_str(fp, cs->name1);
+			cf_cache_write_str(fp, cs->name2);
+			fprintf(fp, " %d %d", cs->name2_quote, cs->argc);
+			for (i = 0; i < cs->argc; i++) {
+				fprintf(fp, " %d", cs->argv_quote[i]);
+				cf_cache_write_str(fp, cs->argv[i]);
+			}
+			fputc('\n', fp);
+
+			cf_cache_write_items(fp, cs->item.child);
+			fputs("}\n", fp);
+		}
+			break;
+
+		/*
+		 *	Data is either re-created by ON_READ
+		 *	callbacks, or by us.
+		 */
+		default:
+			break;
+		}
+	}
+}
+
+/** Find the index of a section, in the order sections are written to the cache
+ *
+ * @return
+ *	- true if the section was found.
+ *	- false if it wasn't.
+ */
+static bool cf_cache_section_index(int *idx, CONF_ITEM const *ci, CONF_SECTION const *cs)
+{
+	for (; ci; ci = ci->next) {
+		if (ci->type != CONF_ITEM_SECTION) continue;
+
+		(*idx)++;
+		if (ci == cf_section_to_item(cs)) return true;
+
+		if (cf_cache_section_index(idx, ci->child, cs)) return true;
+	}
+
+	return false;
+}
+
+/** Write the configuration read by #cf_file_read to a cache
+ *
+ * The cache is written to a temporary file, and renamed into place,
+ * so that servers starting at the same time never see a partial cache.
+ * As the configuration contains secrets, the cache is only readable by
+ * its owner.
+ *
+ * @param[in] cs	any section of the configuration.
+ * @param[in] cache	file to write.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cf_file_cache_write(CONF_SECTION *cs, char const *cache)
+{
+	CONF_SECTION		*top = cf_root(cs);
+	rbtree_t		*files, *deps;
+	cf_file_stats_t		*stats;
+	cf_file_t		**file_list = NULL;
+	cf_file_dep_t		**dep_list = NULL;
+	uint32_t		num_files, num_deps, i;
+	cf_cache_digest_t	digest;
+	char			*tmp;
+	int			fd;
+	FILE			*fp;
+
+	files = cf_data_value(cf_data_find(top, rbtree_t, "filename"));
+	deps = cf_data_value(cf_data_find(top, rbtree_t, "deps"));
+	stats = cf_data_value(cf_data_find(top, cf_file_stats_t, "stats"));
+	if (!files || !deps || !stats || stats->cached) {
+		fr_strerror_printf("Configuration was not parsed from files");
+		return -1;
+	}
+
+	MEM(tmp = talloc_asprintf(NULL, "%s.tmp", cache));
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fr_strerror_printf("Failed creating %s: %s", tmp, fr_syserror(errno));
+		talloc_free(tmp);
+		return -1;
+	}
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		fr_strerror_printf("Failed creating %s: %s", tmp, fr_syserror(errno));
+		close(fd);
+		goto error;
+	}
+
+	fprintf(fp, CF_CACHE_MAGIC " %d %" PRIx64, CF_CACHE_VERSION, (uint64_t) RADIUSD_MAGIC_NUMBER);
+	cf_cache_write_str(fp, top->item.filename);
+	fputc('\n', fp);
+
+	num_files = rbtree_flatten(tmp, (void ***)&file_list, files, RBTREE_IN_ORDER);
+	for (i = 0; i < num_files; i++) {
+		int idx = 0;
+
+		if (cf_cache_file_digest(digest, file_list[i]->filename) < 0) goto error_close;
+
+		if ((file_list[i]->cs != top) && !cf_cache_section_index(&idx, stats->first, file_list[i]->cs)) idx = 0;
+
+		fprintf(fp, "F %d %d", file_list[i]->from_dir, idx);
+		cf_cache_write_str(fp, digest);
+		cf_cache_write_str(fp, file_list[i]->filename);
+		fputc('\n', fp);
+	}
+
+	num_deps = rbtree_flatten(tmp, (void ***)&dep_list, deps, RBTREE_IN_ORDER);
+	for (i = 0; i < num_deps; i++) {
+		if (cf_cache_dep_digest(digest, dep_list[i]) < 0) goto error_close;
+
+		fputc((dep_list[i]->type == CF_FILE_DEP_ENV) ? 'E' : 'I', fp);
+		cf_cache_write_str(fp, digest);
+		cf_cache_write_str(fp, dep_list[i]->name);
+		fputc('\n', fp);
+	}
+
+	fputs("T\n", fp);
+	cf_cache_write_items(fp, stats->first);
+	fputs(".\n", fp);
+
+	if ((fflush(fp) != 0) || ferror(fp) || (fsync(fileno(fp)) < 0)) {
+		fr_strerror_printf("Failed writing %s: %s", tmp, fr_syserror(errno));
+	error_close:
+		fclose(fp);
+	error:
+		unlink(tmp);
+		talloc_free(tmp);
+		return -1;
+	}
+
+	if (rename(tmp, cache) < 0) {
+		fr_strerror_printf("Failed renaming %s to %s: %s", tmp, cache, fr_syserror(errno));
+		goto error_close;
+	}
+
+	fclose(fp);
+	talloc_free(tmp);
+
+	return 0;
+}
+
+static bool cf_cache_sep(cf_cache_in_t *in)
+{
+	if ((in->p >= in->end) || ((*in->p != ' ') && (*in->p != '\n'))) return false;
+
+	in->p++;
+	return true;
+}
+
+static bool cf_cache_int(cf_cache_in_t *in, int *out)
+{
+	char	*q;
+	long	num;
+
+	if ((in->p >= in->end) || !isdigit((int) *in->p)) return false;
+
+	num = strtol(in->p, &q, 10);
+	if ((num < 0) || (num > INT32_MAX)) return false;
+
+	in->p = q;
+	*out = num;
+
+	return cf_cache_sep(in);
+}
+
+/** Parse a string, and NUL terminate it in place
+ *
+ */
+static bool cf_cache_str(cf_cache_in_t *in, char const **out)
+{
+	char	*q;
+	size_t	len;
+
+	if ((in->p < in->end) && (*in->p == '-')) {
+		in->p++;
+		*out = NULL;
+		return cf_cache_sep(in);
+	}
+
+	if ((in->p >= in->end) || !isdigit((int) *in->p)) return false;
+
+	len = strtoul(in->p, &q, 10);
+	if ((q >= in->end) || (*q != ':') || (len >= (size_t) (in->end - q))) return false;
+
+	in->p = q + 1;
+	*out = in->p;
+	in->p += len;
+
+	if (!cf_cache_sep(in)) return false;
+	in->p[-1] = '\0';
+
+	return true;
+}
+
+static bool cf_cache_token(cf_cache_in_t *in, FR_TOKEN *out)
+{
+	int num;
+
+	if (!cf_cache_int(in, &num) || (num >= T_TOKEN_LAST)) return false;
+
+	*out = num;
+	return true;
+}
+
+/** Add a section from the cache
+ *
+ */
+static CONF_SECTION *cf_cache_section_add(cf_cache_in_t *in, CONF_SECTION *parent)
+{
+	CONF_SECTION	*cs;
+	char const	*filename, *name1, *name2;
+	FR_TOKEN	name2_quote;
+	int		lineno, argc, i;
+	bool		is_if;
+
+	if (!cf_cache_int(in, &lineno) || !cf_cache_str(in, &filename) || !cf_cache_str(in, &name1) ||
+	    !name1 || !cf_cache_str(in, &name2) || !cf_cache_token(in, &name2_quote) ||
+	    !cf_cache_int(in, &argc)) {
+	corrupt:
+		fr_strerror_printf("Configuration cache is corrupt");
+		return NULL;
+	}
+
+	/*
+	 *	process_if() creates the section before the
+	 *	condition is parsed, so do the same thing here.
+	 *	ON_READ callbacks then see the same section.
+	 */
+	is_if = ((strcmp(name1, "if") == 0) || (strcmp(name1, "elsif") == 0));
+
+	cs = cf_section_alloc(parent, parent, name1, is_if ? NULL : name2);
+	if (!cs) {
+		fr_strerror_printf_push("Failed allocating section %s", name1);
+		return NULL;
+	}
+	cf_filename_set(cs, filename);
+	cf_lineno_set(cs, lineno);
+
+	if (is_if && name2) MEM(cs->name2 = talloc_typed_strdup(cs, name2));
+	cs->name2_quote = name2_quote;
+
+	if (argc > 0) {
+		MEM(cs->argv = talloc_array(cs, char const *, argc));
+		MEM(cs->argv_quote = talloc_array(cs, FR_TOKEN, argc));
+
+		for (i = 0; i < argc; i++) {
+			char const *argv;
+
+			if (!cf_cache_token(in, &cs->argv_quote[i]) || !cf_cache_str(in, &argv)) goto corrupt;
+			if (argv) MEM(cs->argv[i] = talloc_typed_strdup(cs->argv, argv));
+		}
+		cs->argc = argc;
+	}
+
+	if (is_if) {
+		fr_cond_t		*cond = NULL;
+		char const		*error = NULL;
+		CONF_DATA const		*cd;
+		fr_dict_t const		*dict;
+
+		if (!cs->name2) goto corrupt;
+
+		cd = cf_data_find_in_parent(parent, fr_dict_t **, "dictionary");
+		if (!cd) {
+			dict = fr_dict_internal();	/* HACK - To fix policy sections */
+		} else {
+			dict = *((fr_dict_t **)cf_data_value(cd));
+		}
+
+		if (fr_cond_tokenize(cs, &cond, &error, dict, cs->name2, strlen(cs->name2)) <= 0) {
+			fr_strerror_printf("%s[%d]: Failed parsing condition: %s", filename, lineno,
+					   error ? error : "unknown error");
+			return NULL;
+		}
+		cf_data_add(cs, cond, NULL, false);
+	}
+
+	return cs;
+}
+
+/** Add a pair from the cache
+ *
+ */
+static int cf_cache_pair_add(cf_cache_in_t *in, CONF_SECTION *parent)
+{
+	CONF_PAIR	*cp;
+	CONF_DATA const	*cd;
+	CONF_PARSER	*rule;
+	char const	*filename, *attr, *value;
+	FR_TOKEN	op, lhs_quote, rhs_quote;
+	int		lineno, pass2;
+
+	if (!cf_cache_int(in, &lineno) || !cf_cache_str(in, &filename) || !cf_cache_str(in, &attr) || !attr ||
+	    !cf_cache_str(in, &value) || !cf_cache_token(in, &op) || !cf_cache_token(in, &lhs_quote) ||
+	    !cf_cache_token(in, &rhs_quote) || !cf_cache_int(in, &pass2)) {
+		fr_strerror_printf("Configuration cache is corrupt");
+		return -1;
+	}
+
+	cp = cf_pair_alloc(parent, attr, value, op, lhs_quote, rhs_quote);
+	if (!cp) {
+		fr_strerror_printf_push("Failed allocating pair %s", attr);
+		return -1;
+	}
+	cf_filename_set(cp, filename);
+	cf_lineno_set(cp, lineno);
+	cp->pass2 = (pass2 != 0);
+	cf_item_add(parent, &(cp->item));
+
+	/*
+	 *	Same as add_pair() in cf_file.c
+	 */
+	cd = cf_data_find(CF_TO_ITEM(parent), CONF_PARSER, attr);
+	if (!cd) return 0;
+
+	rule = cf_data_value(cd);
+	if ((rule->type & FR_TYPE_ON_READ) == 0) return 0;
+
+	return rule->func(parent, NULL, NULL, cf_pair_to_item(cp), rule);
+}
+
+/** Read the whole of a cache into memory
+ *
+ */
+static char *cf_cache_slurp(char const *cache, size_t *len)
+{
+	int		fd;
+	struct stat	sb;
+	char		*buffer;
+	ssize_t		slen;
+	size_t		total = 0;
+
+	fd = open(cache, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening configuration cache %s: %s", cache, fr_syserror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &sb) < 0) {
+		fr_strerror_printf("Failed stating configuration cache %s: %s", cache, fr_syserror(errno));
+	error:
+		close(fd);
+		return NULL;
+	}
+
+#ifdef S_IWOTH
+	if ((sb.st_mode & S_IWOTH) != 0) {
+		fr_strerror_printf("Configuration cache %s is globally writable", cache);
+		goto error;
+	}
+#endif
+
+	buffer = talloc_array(NULL, char, sb.st_size + 1);
+	if (!buffer) {
+		fr_strerror_printf("Out of memory");
+		goto error;
+	}
+
+	while (total < (size_t) sb.st_size) {
+		slen = read(fd, buffer + total, sb.st_size - total);
+		if (slen <= 0) {
+			fr_strerror_printf("Failed reading configuration cache %s: %s", cache,
+					   (slen < 0) ? fr_syserror(errno) : "Unexpected end of file");
+			talloc_free(buffer);
+			goto error;
+		}
+		total += slen;
+	}
+	close(fd);
+
+	buffer[total] = '\0';
+	*len = total;
+
+	return buffer;
+}
+
+/** Load a configuration from a cache written by #cf_file_cache_write
+ *
+ * Everything the cached configuration depends on is checked before the
+ * section is modified, so if the cache is refused, the caller can go
+ * on to call #cf_file_read.
+ *
+ * @param[in] cs	root section to add the configuration to.
+ * @param[in] filename	of the main configuration file.
+ * @param[in] cache	file to load.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the cache can't be used.  cs has not been modified.
+ *	- -2 if the configuration couldn't be built.  cs has been modified, and must be freed.
+ */
+int cf_file_cache_load(CONF_SECTION *cs, char const *filename, char const *cache)
+{
+	char			*buffer;
+	size_t			len;
+	cf_cache_in_t		in;
+	cf_cache_file_t		*files = NULL;
+	CONF_SECTION		**sections = NULL;
+	CONF_SECTION		*parent = cs;
+	cf_file_stats_t		*stats;
+	rbtree_t		*tree;
+	CONF_ITEM		*last;
+	cf_cache_digest_t	digest;
+	char const		*str, *name;
+	int			num_files = 0, num_sections = 1, version, i;
+	uint64_t		lib_magic;
+	fr_time_t		start = fr_time();
+	int			ret = -1;
+
+	buffer = cf_cache_slurp(cache, &len);
+	if (!buffer) return -1;
+
+	in.p = buffer;
+	in.end = buffer + len;
+
+	/*
+	 *	Check the header.
+	 */
+	if ((len < sizeof(CF_CACHE_MAGIC)) || (memcmp(buffer, CF_CACHE_MAGIC " ", sizeof(CF_CACHE_MAGIC)) != 0)) {
+		fr_strerror_printf("%s is not a configuration cache", cache);
+		goto finish;
+	}
+	in.p += sizeof(CF_CACHE_MAGIC);
+
+	if (!cf_cache_int(&in, &version) || (version != CF_CACHE_VERSION)) {
+		fr_strerror_printf("Configuration cache version is not supported");
+		goto finish;
+	}
+
+	lib_magic = strtoull(in.p, &in.p, 16);
+	if (!cf_cache_sep(&in) || (lib_magic != RADIUSD_MAGIC_NUMBER)) {
+		fr_strerror_printf("Configuration cache was written by a different build");
+		goto finish;
+	}
+
+	if (!cf_cache_str(&in, &str) || !str || (strcmp(str, filename) != 0)) {
+		fr_strerror_printf("Configuration cache is for a different configuration file");
+		goto finish;
+	}
+
+	/*
+	 *	Check everything the configuration depends on.
+	 */
+	while ((in.p < in.end) && (*in.p != 'T')) {
+		char type = *in.p++;
+
+		if (!cf_cache_sep(&in)) goto corrupt;
+
+		switch (type) {
+		case 'F':
+		{
+			int from_dir, idx;
+
+			if (!cf_cache_int(&in, &from_dir) || !cf_cache_int(&in, &idx) ||
+			    !cf_cache_str(&in, &str) || !str || !cf_cache_str(&in, &name) || !name) goto corrupt;
+
+			if ((cf_cache_file_digest(digest, name) < 0) || (strcmp(digest, str) != 0)) {
+			changed:
+				fr_strerror_printf("Configuration cache is out of date, %s has changed", name);
+				goto finish;
+			}
+
+			MEM(files = talloc_realloc(buffer, files, cf_cache_file_t, num_files + 1));
+			files[num_files].filename = name;
+			files[num_files].section = idx;
+			files[num_files].from_dir = (from_dir != 0);
+			num_files++;
+		}
+			break;
+
+		case 'E':
+		case 'I':
+		{
+			cf_file_dep_t dep;
+
+			if (!cf_cache_str(&in, &str) || !str || !cf_cache_str(&in, &name) || !name) goto corrupt;
+
+			dep.type = (type == 'E') ? CF_FILE_DEP_ENV : CF_FILE_DEP_INCLUDE;
+			dep.name = name;
+
+			if ((cf_cache_dep_digest(digest, &dep) < 0) || (strcmp(digest, str) != 0)) goto changed;
+		}
+			break;
+
+		default:
+			goto corrupt;
+		}
+	}
+
+	if ((in.p >= in.end) || (num_files == 0)) goto corrupt;
+	in.p++;
+	if (!cf_cache_sep(&in)) goto corrupt;
+
+	/*
+	 *	From here on, we're modifying the section, so
+	 *	errors are fatal.
+	 */
+	ret = -2;
+
+	for (last = cs->item.child; last && last->next; last = last->next);
+
+	MEM(sections = talloc_array(buffer, CONF_SECTION *, 16));
+	sections[0] = cs;
+
+	while ((in.p < in.end) && (*in.p != '.')) {
+		char type = *in.p++;
+
+		if (!cf_cache_sep(&in)) goto corrupt;
+
+		switch (type) {
+		case 'S':
+			parent = cf_cache_section_add(&in, parent);
+			if (!parent) goto finish;
+
+			if ((size_t) num_sections == talloc_array_length(sections)) {
+				MEM(sections = talloc_realloc(buffer, sections, CONF_SECTION *, num_sections * 2));
+			}
+			sections[num_sections++] = parent;
+			break;
+
+		case 'P':
+			if (cf_cache_pair_add(&in, parent) < 0) goto finish;
+			break;
+
+		case '}':
+			if (parent == cs) goto corrupt;
+
+			parent = cf_item_to_section(parent->item.parent);
+			break;
+
+		default:
+			goto corrupt;
+		}
+	}
+
+	if ((in.p >= in.end) || (parent != cs)) {
+	corrupt:
+		fr_strerror_printf("Configuration cache is corrupt");
+		goto finish;
+	}
+
+	cs->item.filename = talloc_typed_strdup(cs, filename);
+
+	/*
+	 *	Re-create the data cf_file_read() would have added.
+	 */
+	MEM(tree = rbtree_talloc_create(cs, cf_file_cmp, cf_file_t, NULL, 0));
+	cf_data_add(cs, tree, "filename", false);
+
+	for (i = 0; i < num_files; i++) {
+		cf_file_t *file;
+
+		if ((files[i].section < 0) || (files[i].section >= num_sections)) goto corrupt;
+
+		MEM(file = talloc_zero(tree, cf_file_t));
+		file->filename = talloc_typed_strdup(file, files[i].filename);
+		file->cs = sections[files[i].section];
+		file->from_dir = files[i].from_dir;
+
+		if (stat(file->filename, &file->buf) < 0) {
+			fr_strerror_printf("Failed stating %s: %s", file->filename, fr_syserror(errno));
+			goto finish;
+		}
+
+		if (!rbtree_insert(tree, file)) talloc_free(file);
+	}
+
+	MEM(tree = rbtree_talloc_create(cs, cf_file_dep_cmp, cf_file_dep_t, NULL, 0));
+	cf_data_add(cs, tree, "deps", false);
+
+	MEM(stats = talloc_zero(cs, cf_file_stats_t));
+	stats->cached = true;
+	stats->first = last ? last->next : cs->item.child;
+	stats->tokenise = fr_time() - start;
+	cf_data_add(cs, stats, "stats", false);
+
+	ret = 0;
+
+finish:
+	talloc_free(buffer);
+
+	return ret;
+}
@@ -120,6 +120,7 @@ typedef struct {
 
 	int		braces;
 	bool		from_dir;		//!< this file was read from $include foo/
+	cf_file_t	*file;			//!< file we're reading, for recording parse times
 } cf_stack_frame_t;
 
 /*
@@ -134,9 +135,44 @@ typedef struct {
 	int		depth;			//!< stack depth
 	char const	*ptr;			//!< current parse pointer
 	char		*fill;			//!< where we start filling the buffer from
+	cf_file_t	*file;			//!< file which is being charged for parse time
+	fr_time_t	when;			//!< when we started charging the current file
 	cf_stack_frame_t frame[MAX_STACK];	//!< stack frames
 } cf_stack_t;
 
+/*
+ *	Record something other than a file's contents which the
+ *	parsed configuration depends on.
+ */
+static void cf_file_dep_add(CONF_SECTION const *cs, cf_file_dep_type_t type, char const *name)
+{
+	rbtree_t	*tree;
+	cf_file_dep_t	*dep;
+
+	tree = cf_data_value(cf_data_find(cf_root(cs), rbtree_t, "deps"));
+	if (!tree) return;
+
+	if (rbtree_finddata(tree, &(cf_file_dep_t){ .type = type, .name = name })) return;
+
+	MEM(dep = talloc(tree, cf_file_dep_t));
+	dep->type = type;
+	dep->name = talloc_typed_strdup(dep, name);
+	if (!rbtree_insert(tree, dep)) talloc_free(dep);
+}
+
+/*
+ *	Charge the time since the last call to the file we were
+ *	reading, and start charging "next".
+ */
+static inline void cf_file_time_charge(cf_stack_t *stack, cf_file_t *next)
+{
+	fr_time_t now = fr_time();
+
+	if (stack->file) stack->file->parse_time += now - stack->when;
+	stack->file = next;
+	stack->when = now;
+}
+
 /*
  *	Expand the variables in an input string.
  *
@@ -361,6 +397,8 @@ char const *cf_expand_variables(char const *cf, int lineno,
 			memcpy(name, ptr, next - ptr);
 			name[next - ptr] = '\0';
 
+			if (parent_cs) cf_file_dep_add(parent_cs, CF_FILE_DEP_ENV, name);
+
 			/*
 			 *	Get the environment variable.
 			 *	If none exists, then make it an empty string.
@@ -483,7 +521,7 @@ static bool cf_template_merge(CONF_SECTION *cs, CONF_SECTION const *template)
 /*
  *	Functions for tracking filenames.
  */
-static int _filename_cmp(void const *a, void const *b)
+int cf_file_cmp(void const *a, void const *b)
 {
 	cf_file_t const *one = a, *two = b;
 	int ret;
@@ -494,9 +532,20 @@ static int _filename_cmp(void const *a, void const *b)
 	return (one->buf.st_ino < two->buf.st_ino) - (one->buf.st_ino > two->buf.st_ino);
 }
 
-static int cf_file_open(CONF_SECTION *cs, char const *filename, bool from_dir, FILE **fp_p)
+int cf_file_dep_cmp(void const *a, void const *b)
 {
-	cf_file_t *file;
+	cf_file_dep_t const *one = a, *two = b;
+	int ret;
+
+	ret = (one->type < two->type) - (one->type > two->type);
+	if (ret != 0) return ret;
+
+	return strcmp(one->name, two->name);
+}
+
+static int cf_file_open(CONF_SECTION *cs, char const *filename, bool from_dir, FILE **fp_p, cf_file_t **file_p)
+{
+	cf_file_t *file, *old;
 	CONF_SECTION *top;
 	rbtree_t *tree;
 	int fd;
@@ -549,6 +598,7 @@ static int cf_file_open(CONF_SECTION *cs, char const *filename, bool from_dir, F
 	file->filename = talloc_strdup(file, filename);	/* The rest of the code expects this to be a talloced buffer */
 	file->cs = cs;
 	file->from_dir = from_dir;
+	file->parse_time = 0;
 
 	if (fstat(fd, &file->buf) == 0) {
 #ifdef S_IWOTH
@@ -569,9 +619,14 @@ static int cf_file_open(CONF_SECTION *cs, char const *filename, bool from_dir, F
 	 *
 	 *	Though the admin should really use templates for that.
 	 */
-	if (!rbtree_insert(tree, file)) talloc_free(file);
+	if (!rbtree_insert(tree, file)) {
+		old = rbtree_finddata(tree, file);
+		talloc_free(file);
+		file = old;
+	}
 
 	*fp_p = fp;
+	*file_p = file;
 	return 0;
 }
 
@@ -923,6 +978,15 @@ static int process_include(cf_stack_t *stack, CONF_SECTION *parent, char const *
 		}
 	}
 
+	/*
+	 *	The contents of directories, the results of globs
+	 *	and the existence of optional files can all change
+	 *	without any of the files we've read changing.
+	 */
+	if (!required || (strchr(value, '*') != NULL) || (value[strlen(value) - 1] == '/')) {
+		cf_file_dep_add(parent, CF_FILE_DEP_INCLUDE, value);
+	}
+
 	if (strchr(value, '*') != 0) {
 #ifndef HAVE_GLOB_H
 		ERROR("%s[%d]: Filename globbing is not supported.", frame->filename, frame->lineno);
@@ -1952,6 +2016,8 @@ static int cf_file_include(cf_stack_t *stack)
 	int		rcode;
 
 do_frame:
+	cf_file_time_charge(stack, NULL);
+
 	frame = &stack->frame[stack->depth];
 	parent = frame->current; /* add items here */
 
@@ -2013,7 +2079,7 @@ do_frame:
 	 *	stack by another function.
 	 */
 	if (!frame->fp) {
-		rcode = cf_file_open(frame->parent, frame->filename, frame->from_dir, &frame->fp);
+		rcode = cf_file_open(frame->parent, frame->filename, frame->from_dir, &frame->fp, &frame->file);
 		if (rcode < 0) return -1;
 
 		/*
@@ -2025,6 +2091,7 @@ do_frame:
 			goto pop_stack;
 		}
 	};
+	stack->file = frame->file;
 
 	/*
 	 *	Read, checking for line continuations ('\\' at EOL)
@@ -2120,6 +2187,8 @@ pop_stack:
 		goto do_frame;
 	}
 
+	cf_file_time_charge(stack, NULL);
+
 	return 0;
 }
 
@@ -2167,6 +2236,8 @@ int cf_file_read(CONF_SECTION *cs, char const *filename)
 	rbtree_t	*tree;
 	cf_stack_t	stack;
 	cf_stack_frame_t	*frame;
+	cf_file_stats_t	*stats;
+	fr_time_t	start;
 
 	cp = cf_pair_alloc(cs, "confdir", filename, T_OP_EQ, T_BARE_WORD, T_SINGLE_QUOTED_STRING);
 	if (!cp) return -1;
@@ -2176,13 +2247,23 @@ int cf_file_read(CONF_SECTION *cs, char const *filename)
 
 	cf_item_add(cs, &(cp->item));
 
-	MEM(tree = rbtree_talloc_create(cs, _filename_cmp, cf_file_t, NULL, 0));
+	MEM(tree = rbtree_talloc_create(cs, cf_file_cmp, cf_file_t, NULL, 0));
 
 	cf_data_add(cs, tree, "filename", false);
 
+	MEM(tree = rbtree_talloc_create(cs, cf_file_dep_cmp, cf_file_dep_t, NULL, 0));
+
+	cf_data_add(cs, tree, "deps", false);
+
+	MEM(stats = talloc_zero(cs, cf_file_stats_t));
+	stats->first = cf_pair_to_item(cp);
+
+	cf_data_add(cs, stats, "stats", false);
+
 #ifndef NDEBUG
 	memset(&stack, 0, sizeof(stack));
 #endif
+	stack.file = NULL;
 
 	/*
 	 *	Allocate temporary buffers on the heap (so we don't use *all* the stack space)
@@ -2201,10 +2282,12 @@ int cf_file_read(CONF_SECTION *cs, char const *filename)
 	frame->filename = talloc_strdup(frame->parent, filename);
 	cs->item.filename = frame->filename;
 
+	start = fr_time();
 	if (cf_file_include(&stack) < 0) {
 		cf_stack_cleanup(&stack);
 		return -1;
 	}
+	stats->tokenise = fr_time() - start;
 
 	talloc_free(stack.buff);
 
@@ -2212,10 +2295,12 @@ int cf_file_read(CONF_SECTION *cs, char const *filename)
 	 *	Now that we've read the file, go back through it and
 	 *	expand the variables.
 	 */
+	start = fr_time();
 	if (cf_section_pass2(cs) < 0) {
 		cf_log_err(cs, "Parsing config items failed");
 		return -1;
 	}
+	stats->pass2 = fr_time() - start;
 
 	return 0;
 }
@@ -2263,6 +2348,72 @@ int cf_file_changed(CONF_SECTION *cs, rb_walker_t callback)
 	return cb.rcode;
 }
 
+static int _file_time_cmp(void const *a, void const *b)
+{
+	cf_file_t const *file_a = *((cf_file_t const * const *)a);
+	cf_file_t const *file_b = *((cf_file_t const * const *)b);
+
+	return (file_a->parse_time < file_b->parse_time) - (file_a->parse_time > file_b->parse_time);
+}
+
+/** Report how long it took to read the configuration
+ *
+ * Printed in debug mode, and written to fp, if it's not NULL.  Each
+ * file is charged for the time spent tokenising it, but not for the
+ * time spent in any files it includes.  Slowest files are listed first.
+ *
+ * @param[in] cs	any section of the configuration.
+ * @param[in] fp	to write tab separated times to.  May be NULL.
+ */
+void cf_file_profile(CONF_SECTION *cs, FILE *fp)
+{
+	CONF_SECTION	*top;
+	rbtree_t	*tree;
+	cf_file_stats_t	*stats;
+	cf_file_t	**files;
+	uint32_t	num, i;
+
+	if (!fp && !DEBUG_ENABLED) return;
+
+	top = cf_root(cs);
+	tree = cf_data_value(cf_data_find(top, rbtree_t, "filename"));
+	stats = cf_data_value(cf_data_find(top, cf_file_stats_t, "stats"));
+	if (!tree || !stats) return;
+
+	DEBUG("#### Configuration parse times ####");
+	if (stats->cached) {
+		DEBUG("  Loaded %u files from cache in %.3fms", rbtree_num_elements(tree),
+		      (double)fr_time_delta_to_usec(stats->tokenise) / 1000);
+		if (fp) {
+			fprintf(fp, "phase\tcache\t%" PRId64 "\n", fr_time_delta_to_usec(stats->tokenise));
+			fflush(fp);
+		}
+		return;
+	}
+
+	num = rbtree_flatten(NULL, (void ***)&files, tree, RBTREE_IN_ORDER);
+	qsort(files, num, sizeof(*files), _file_time_cmp);
+
+	for (i = 0; i < num; i++) {
+		DEBUG("  %-48s %8.3fms", files[i]->filename,
+		      (double)fr_time_delta_to_usec(files[i]->parse_time) / 1000);
+
+		if (fp) fprintf(fp, "file\t%s\t%" PRId64 "\n", files[i]->filename,
+				fr_time_delta_to_usec(files[i]->parse_time));
+	}
+	talloc_free(files);
+
+	DEBUG("  Tokenised %u files in %.3fms, pass2 took %.3fms", num,
+	      (double)fr_time_delta_to_usec(stats->tokenise) / 1000,
+	      (double)fr_time_delta_to_usec(stats->pass2) / 1000);
+
+	if (fp) {
+		fprintf(fp, "phase\ttokenise\t%" PRId64 "\n", fr_time_delta_to_usec(stats->tokenise));
+		fprintf(fp, "phase\tpass2\t%" PRId64 "\n", fr_time_delta_to_usec(stats->pass2));
+		fflush(fp);
+	}
+}
+
 
 static char const parse_tabs[] = "																																																																																																																																																																																																								";
 
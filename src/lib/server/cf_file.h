@@ -54,6 +54,13 @@ void		cf_file_free(CONF_SECTION *cs);
 bool		cf_file_check(CONF_SECTION *cs, char const *filename, bool check_perms);
 void		cf_file_check_user(uid_t uid, gid_t gid);
 int		cf_file_changed(CONF_SECTION *cs, rb_walker_t callback);
+void		cf_file_profile(CONF_SECTION *cs, FILE *fp);
+
+/*
+ *	Parsed config caching
+ */
+int		cf_file_cache_load(CONF_SECTION *cs, char const *filename, char const *cache);
+int		cf_file_cache_write(CONF_SECTION *cs, char const *cache);
 
 /*
  *	Config file writing
@@ -31,6 +31,7 @@ RCSIDH(cf_priv_h, "$Id$")
 #include <freeradius-devel/server/cf_parse.h>
 #include <freeradius-devel/util/rbtree.h>
 #include <freeradius-devel/util/cursor.h>
+#include <freeradius-devel/util/time.h>
 
 typedef enum conf_type {
 	CONF_ITEM_INVALID = 0,
@@ -118,10 +119,40 @@ typedef struct {
 	CONF_SECTION		*cs;		//!< CONF_SECTION associated with the file
 	struct stat		buf;		//!< stat about the file
 	bool			from_dir;	//!< was read from a directory
+	fr_time_delta_t		parse_time;	//!< Time spent tokenising the file, excluding any files
+						//!< it includes.
 } cf_file_t;
 
+/** Things other than the contents of a file, which affect how the config is parsed
+ *
+ * Recorded so the parsed configuration can be cached.
+ */
+typedef enum {
+	CF_FILE_DEP_INCLUDE = 0,			//!< $INCLUDE of a directory or glob, or $-INCLUDE.
+	CF_FILE_DEP_ENV					//!< $ENV{} reference.
+} cf_file_dep_type_t;
+
+typedef struct {
+	cf_file_dep_type_t	type;		//!< What kind of dependency this is.
+	char const		*name;		//!< Path, glob, or environment variable name.
+} cf_file_dep_t;
+
+/** Time spent in each phase of reading a configuration file
+ *
+ */
+typedef struct {
+	fr_time_delta_t		tokenise;	//!< Time spent reading and tokenising files.
+	fr_time_delta_t		pass2;		//!< Time spent expanding variables in pass2.
+	bool			cached;		//!< The configuration was loaded from the cache, and
+						//!< tokenise is how long that took.
+	CONF_ITEM		*first;		//!< First item added to the root section.
+} cf_file_stats_t;
+
 CONF_ITEM *cf_remove(CONF_ITEM *parent, CONF_ITEM *child);
 
+int cf_file_cmp(void const *a, void const *b);
+int cf_file_dep_cmp(void const *a, void const *b);
+
 #ifdef __cplusplus
 }
 #endif
@@ -170,25 +170,16 @@ static fr_trie_t *clients_trie(RADCLIENT_LIST const *clients, fr_ipaddr_t const
 }
 #endif	/* WITH_TRIE */
 
-/** Add a client to a RADCLIENT_LIST
+/** Find the client list a client should be added to
  *
  * @param clients list to add client to, may be NULL if global client list is being used.
  * @param client to add.
  * @return
- *	- true on success.
- *	- false on failure.
+ *	- The client list.
+ *	- NULL on error.
  */
-bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
+static RADCLIENT_LIST *client_list_select(RADCLIENT_LIST *clients, RADCLIENT *client)
 {
-#ifdef WITH_TRIE
-	fr_trie_t *trie;
-#else
-#endif
-	RADCLIENT *old;
-	char buffer[FR_IPADDR_PREFIX_STRLEN];
-
-	if (!client) return false;
-
 	/*
 	 *	Hack to fixup wildcard clients
 	 *
@@ -210,99 +201,168 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 		fr_assert(0);
 	}
 
-	fr_inet_ntop_prefix(buffer, sizeof(buffer), &client->ipaddr);
-	DEBUG3("Adding client %s (%s) to prefix tree %i", buffer, client->longname, client->ipaddr.prefix);
+	if (clients) return clients;
 
 	/*
 	 *	If "clients" is NULL, it means add to the global list,
 	 *	unless we're trying to add it to a virtual server...
 	 */
-	if (!clients) {
-		if (client->server != NULL) {
-			CONF_SECTION *cs;
-			CONF_SECTION *subcs;
+	if (client->server != NULL) {
+		CONF_SECTION *cs;
+		CONF_SECTION *subcs;
 
-			if (!client->cs) {
-				ERROR("Failed to find configuration section in client.  Ignoring 'virtual_server' directive");
-				return false;
-			}
+		/*
+		 *	Clients which weren't parsed from a
+		 *	CONF_SECTION have already found their virtual
+		 *	server.
+		 */
+		if (client->server_cs) {
+			cs = client->server_cs;
 
+		} else if (!client->cs) {
+			ERROR("Failed to find configuration section in client.  Ignoring 'virtual_server' directive");
+			return NULL;
+
+		} else {
 			cs = cf_section_find(cf_root(client->cs), "server", client->server);
 			if (!cs) {
 				ERROR("Failed to find virtual server %s", client->server);
-				return false;
+				return NULL;
 			}
+		}
 
-			/*
-			 *	If this server has no "listen" section, add the clients
-			 *	to the global client list.
-			 */
-			subcs = cf_section_find(cs, "listen", NULL);
-			if (!subcs) goto global_clients;
+		/*
+		 *	If this server has no "listen" section, add the clients
+		 *	to the global client list.
+		 */
+		subcs = cf_section_find(cs, "listen", NULL);
+		if (!subcs) goto global_clients;
 
-			/*
-			 *	If the client list already exists, use that.
-			 *	Otherwise, create a new client list.
-			 */
-			clients = cf_data_value(cf_data_find(cs, RADCLIENT_LIST, NULL));
+		/*
+		 *	If the client list already exists, use that.
+		 *	Otherwise, create a new client list.
+		 */
+		clients = cf_data_value(cf_data_find(cs, RADCLIENT_LIST, NULL));
+		if (!clients) {
+			clients = client_list_init(cs);
 			if (!clients) {
-				clients = client_list_init(cs);
-				if (!clients) {
-					ERROR("Out of memory");
-					return false;
-				}
-
-				if (!cf_data_add(cs, clients, NULL, true)) {
-					ERROR("Failed to associate clients with virtual server %s", client->server);
-					talloc_free(clients);
-					return false;
-				}
+				ERROR("Out of memory");
+				return NULL;
 			}
 
-		} else {
-		global_clients:
-			/*
-			 *	Initialize the global list, if not done already.
-			 */
-			if (!root_clients) {
-				root_clients = client_list_init(NULL);
-				if (!root_clients) return false;
+			if (!cf_data_add(cs, clients, NULL, true)) {
+				ERROR("Failed to associate clients with virtual server %s", client->server);
+				talloc_free(clients);
+				return NULL;
 			}
-			clients = root_clients;
 		}
-	}
 
-#define namecmp(a) ((!old->a && !client->a) || (old->a && client->a && (strcmp(old->a, client->a) == 0)))
-
-#ifdef WITH_TRIE
-	trie = clients_trie(clients, &client->ipaddr, client->proto);
+		return clients;
+	}
 
+global_clients:
 	/*
-	 *	Cannot insert the same client twice.
+	 *	Initialize the global list, if not done already.
 	 */
-	old = fr_trie_match(trie, &client->ipaddr.addr, client->ipaddr.prefix);
+	if (!root_clients) {
+		root_clients = client_list_init(NULL);
+		if (!root_clients) return NULL;
+	}
 
-#else  /* WITH_TRIE */
+	return root_clients;
+}
 
+/** Find a client with exactly the same address and prefix as another one
+ *
+ */
+static RADCLIENT *client_list_find_exact(RADCLIENT_LIST *clients, RADCLIENT *client)
+{
+#ifdef WITH_TRIE
+	return fr_trie_match(clients_trie(clients, &client->ipaddr, client->proto),
+			     &client->ipaddr.addr, client->ipaddr.prefix);
+#else
 	if (!clients->tree[client->ipaddr.prefix]) {
 		clients->tree[client->ipaddr.prefix] = rbtree_talloc_create(clients, client_cmp, RADCLIENT,
 									    NULL, RBTREE_FLAG_NONE);
-		if (!clients->tree[client->ipaddr.prefix]) {
-			return false;
-		}
+		if (!clients->tree[client->ipaddr.prefix]) return NULL;
 	}
 
-	old = rbtree_finddata(clients->tree[client->ipaddr.prefix], client);
+	return rbtree_finddata(clients->tree[client->ipaddr.prefix], client);
+#endif
+}
+
+/** Check if two clients have the same configuration
+ *
+ */
+static bool client_same_config(RADCLIENT const *old, RADCLIENT const *client)
+{
+#define namecmp(a) ((!old->a && !client->a) || (old->a && client->a && (strcmp(old->a, client->a) == 0)))
+	return (namecmp(longname) && namecmp(secret) &&
+		namecmp(shortname) && namecmp(nas_type) &&
+		namecmp(server) &&
+		(old->message_authenticator == client->message_authenticator));
+#undef namecmp
+}
+
+/** Insert a client into a client list, and make the list own it
+ *
+ */
+static bool client_list_insert(RADCLIENT_LIST *clients, RADCLIENT *client)
+{
+#ifdef WITH_TRIE
+	/*
+	 *	Other error adding client: likely is fatal.
+	 */
+	if (fr_trie_insert(clients_trie(clients, &client->ipaddr, client->proto),
+			   &client->ipaddr.addr, client->ipaddr.prefix, client) < 0) {
+		return false;
+	}
+#else
+	if (!clients->tree[client->ipaddr.prefix] ||
+	    !rbtree_insert(clients->tree[client->ipaddr.prefix], client)) {
+		return false;
+	}
 #endif
+
+	/*
+	 *	@todo - do we want to do this for dynamic clients?
+	 */
+	(void) talloc_steal(clients, client); /* reparent it */
+
+	return true;
+}
+
+/** Add a client to a RADCLIENT_LIST
+ *
+ * @param clients list to add client to, may be NULL if global client list is being used.
+ * @param client to add.
+ * @return
+ *	- true on success.
+ *	- false on failure.
+ */
+bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
+{
+	RADCLIENT *old;
+	char buffer[FR_IPADDR_PREFIX_STRLEN];
+
+	if (!client) return false;
+
+	clients = client_list_select(clients, client);
+	if (!clients) return false;
+
+	fr_inet_ntop_prefix(buffer, sizeof(buffer), &client->ipaddr);
+	DEBUG3("Adding client %s (%s) to prefix tree %i", buffer, client->longname, client->ipaddr.prefix);
+
+	/*
+	 *	Cannot insert the same client twice.
+	 */
+	old = client_list_find_exact(clients, client);
 	if (old) {
 		/*
 		 *	If it's a complete duplicate, then free the new
 		 *	one, and return "OK".
 		 */
-		if (namecmp(longname) && namecmp(secret) &&
-		    namecmp(shortname) && namecmp(nas_type) &&
-		    namecmp(server) &&
-		    (old->message_authenticator == client->message_authenticator)) {
+		if (client_same_config(old, client)) {
 			WARN("Ignoring duplicate client %s", client->longname);
 			client_free(client);
 			return true;
@@ -312,29 +372,67 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 		client_free(client);
 		return false;
 	}
-#undef namecmp
 
-#ifdef WITH_TRIE
-	/*
-	 *	Other error adding client: likely is fatal.
-	 */
-	if (fr_trie_insert(trie, &client->ipaddr.addr, client->ipaddr.prefix, client) < 0) {
+	if (!client_list_insert(clients, client)) {
 		client_free(client);
 		return false;
 	}
-#else
-	if (!rbtree_insert(clients->tree[client->ipaddr.prefix], client)) {
+
+	return true;
+}
+
+/** Add a client to a RADCLIENT_LIST, replacing any existing client with the same address
+ *
+ * This allows clients loaded from a database to be refreshed, without
+ * reloading all of them.  Only the clients which have changed are
+ * replaced.
+ *
+ * The replaced client is left in the list's talloc context, and is
+ * freed with the list.  Listeners may still be copying it.
+ *
+ * @param clients list to add client to, may be NULL if global client list is being used.
+ * @param client to add.  Is freed if it isn't added.
+ * @return
+ *	- 1 if the client was added, or replaced an existing client.
+ *	- 0 if an identical client already exists.
+ *	- -1 on failure.
+ */
+int client_update(RADCLIENT_LIST *clients, RADCLIENT *client)
+{
+	RADCLIENT *old;
+
+	if (!client) return -1;
+
+	clients = client_list_select(clients, client);
+	if (!clients) {
+	error:
 		client_free(client);
-		return false;
+		return -1;
 	}
+
+	old = client_list_find_exact(clients, client);
+	if (old) {
+		if (client_same_config(old, client)) {
+			client_free(client);
+			return 0;
+		}
+
+		DEBUG2("Replacing client %s", old->longname);
+
+#ifdef WITH_TRIE
+		(void) fr_trie_remove(clients_trie(clients, &old->ipaddr, old->proto),
+				      &old->ipaddr.addr, old->ipaddr.prefix);
+#else
+		(void) rbtree_deletebydata(clients->tree[old->ipaddr.prefix], old);
 #endif
+	}
 
-	/*
-	 *	@todo - do we want to do this for dynamic clients?
-	 */
-	(void) talloc_steal(clients, client); /* reparent it */
+	if (!client_list_insert(clients, client)) {
+		ERROR("Failed to add client %s", client->shortname);
+		goto error;
+	}
 
-	return true;
+	return 1;
 }
 
 
@@ -936,6 +1034,241 @@ RADCLIENT *client_afrom_query(TALLOC_CTX *ctx, char const *identifier, char cons
 	return c;
 }
 
+/** Client configuration items which client_afrom_map() sets directly
+ *
+ */
+typedef enum {
+	CLIENT_MAP_IPADDR = 0,
+	CLIENT_MAP_IPV4ADDR,
+	CLIENT_MAP_IPV6ADDR,
+	CLIENT_MAP_SECRET,
+	CLIENT_MAP_SHORTNAME,
+	CLIENT_MAP_NAS_TYPE,
+	CLIENT_MAP_VIRTUAL_SERVER,
+	CLIENT_MAP_REQUIRE_MA,
+	CLIENT_MAP_PROTO,
+	CLIENT_MAP_MAX
+} client_map_item_t;
+
+static char const *client_map_items[CLIENT_MAP_MAX] = {
+	[CLIENT_MAP_IPADDR]		= "ipaddr",
+	[CLIENT_MAP_IPV4ADDR]		= "ipv4addr",
+	[CLIENT_MAP_IPV6ADDR]		= "ipv6addr",
+	[CLIENT_MAP_SECRET]		= "secret",
+	[CLIENT_MAP_SHORTNAME]		= "shortname",
+	[CLIENT_MAP_NAS_TYPE]		= "nas_type",
+	[CLIENT_MAP_VIRTUAL_SERVER]	= "virtual_server",
+	[CLIENT_MAP_REQUIRE_MA]		= "require_message_authenticator",
+	[CLIENT_MAP_PROTO]		= "proto"
+};
+
+static int client_map_item(char const *attr)
+{
+	int i;
+
+	for (i = 0; i < CLIENT_MAP_MAX; i++) {
+		if (strcmp(attr, client_map_items[i]) == 0) return i;
+	}
+
+	return -1;
+}
+
+/** Check that a template or mapping section only contains items client_afrom_map() can set directly
+ *
+ */
+static bool client_map_is_direct(CONF_SECTION const *cs)
+{
+	CONF_ITEM const *ci;
+
+	if (!cs) return true;
+
+	for (ci = cf_item_next(cs, NULL);
+	     ci != NULL;
+	     ci = cf_item_next(cs, ci)) {
+		if (!cf_item_is_pair(ci)) return false;
+		if (client_map_item(cf_pair_attr(cf_item_to_pair(ci))) < 0) return false;
+	}
+
+	return true;
+}
+
+/** Allocate a new client from a row or entry returned by a database
+ *
+ * When the template and mapping sections contain only the common client
+ * configuration items (addresses, secret, shortname, nas_type,
+ * virtual_server, require_message_authenticator and proto), the values
+ * are copied straight into a new RADCLIENT.  This avoids building and
+ * parsing a CONF_SECTION for every client, which dominates the time
+ * taken to load large numbers of clients.
+ *
+ * Otherwise a CONF_SECTION is built with client_map_section(), and
+ * parsed with client_afrom_cs().
+ *
+ * @param[in] ctx	to allocate the client in.
+ * @param[in] name	of the client.
+ * @param[in] tmpl	default values for the client.  May be NULL.
+ * @param[in] map	of client configuration items to database attributes.
+ * @param[in] func	to call to retrieve values.  Must return a talloced buffer.
+ * @param[in] data	to pass to func, usually a result pointer.
+ * @return
+ *	- New client on success.
+ *	- NULL on error.
+ */
+RADCLIENT *client_afrom_map(TALLOC_CTX *ctx, char const *name, CONF_SECTION *tmpl,
+			    CONF_SECTION const *map, client_value_cb_t func, void *data)
+{
+	RADCLIENT	*c;
+	CONF_ITEM const	*ci;
+	char const	*value[CLIENT_MAP_MAX] = { NULL };
+	char		*mapped[CLIENT_MAP_MAX] = { NULL };
+	char		buffer[128];
+	int		i;
+
+	if (!client_map_is_direct(tmpl) || !client_map_is_direct(map)) {
+		CONF_SECTION *cs;
+
+		cs = tmpl ? cf_section_dup(NULL, NULL, tmpl, "client", name, true) :
+			    cf_section_alloc(NULL, NULL, "client", name);
+
+		if (client_map_section(cs, map, func, data) < 0) {
+			talloc_free(cs);
+			return NULL;
+		}
+
+		c = client_afrom_cs(ctx, cs, NULL);
+		if (!c) {
+			talloc_free(cs);
+			return NULL;
+		}
+
+		/*
+		 *	Client parents the CONF_SECTION which defined it
+		 */
+		talloc_steal(c, cs);
+
+		return c;
+	}
+
+	/*
+	 *	Template values first, then the mapped ones override
+	 *	them.
+	 */
+	if (tmpl) for (ci = cf_item_next(tmpl, NULL);
+		       ci != NULL;
+		       ci = cf_item_next(tmpl, ci)) {
+		CONF_PAIR const *cp = cf_item_to_pair(ci);
+
+		value[client_map_item(cf_pair_attr(cp))] = cf_pair_value(cp);
+	}
+
+	c = NULL;
+	for (ci = cf_item_next(map, NULL);
+	     ci != NULL;
+	     ci = cf_item_next(map, ci)) {
+		CONF_PAIR const	*cp = cf_item_to_pair(ci);
+		char		*v;
+
+		if (func(&v, cp, data) < 0) {
+			ERROR("Failed performing mapping \"%s\" = \"%s\"", cf_pair_attr(cp), cf_pair_value(cp));
+			goto error;
+		}
+		if (!v) continue;
+
+		i = client_map_item(cf_pair_attr(cp));
+		talloc_free(mapped[i]);
+		value[i] = mapped[i] = v;
+	}
+
+	c = talloc_zero(ctx, RADCLIENT);
+	if (!c) goto error;
+
+	if (value[CLIENT_MAP_IPADDR]) {
+		if (fr_inet_pton(&c->ipaddr, value[CLIENT_MAP_IPADDR], -1, AF_UNSPEC, true, true) < 0) goto ip_error;
+
+	} else if (value[CLIENT_MAP_IPV4ADDR]) {
+		if (fr_inet_pton(&c->ipaddr, value[CLIENT_MAP_IPV4ADDR], -1, AF_INET, true, true) < 0) goto ip_error;
+
+	} else if (value[CLIENT_MAP_IPV6ADDR]) {
+		if (fr_inet_pton(&c->ipaddr, value[CLIENT_MAP_IPV6ADDR], -1, AF_INET6, true, true) < 0) {
+		ip_error:
+			PERROR("Failed parsing IP address of client %s", name);
+			goto error;
+		}
+
+	} else {
+		ERROR("No 'ipaddr' or 'ipv4addr' or 'ipv6addr' found in client %s", name);
+		goto error;
+	}
+
+	fr_inet_ntoh(&c->ipaddr, buffer, sizeof(buffer));
+	c->longname = talloc_typed_strdup(c, buffer);
+	c->shortname = talloc_typed_strdup(c, value[CLIENT_MAP_SHORTNAME] ? value[CLIENT_MAP_SHORTNAME] : name);
+
+	if (value[CLIENT_MAP_SECRET]) c->secret = talloc_typed_strdup(c, value[CLIENT_MAP_SECRET]);
+	if (value[CLIENT_MAP_NAS_TYPE]) c->nas_type = talloc_typed_strdup(c, value[CLIENT_MAP_NAS_TYPE]);
+
+	if (value[CLIENT_MAP_VIRTUAL_SERVER]) {
+		c->server = talloc_typed_strdup(c, value[CLIENT_MAP_VIRTUAL_SERVER]);
+		c->server_cs = virtual_server_find(c->server);
+		if (!c->server_cs) {
+			ERROR("Failed to find virtual server %s for client %s", c->server, name);
+			goto error;
+		}
+	}
+
+	if (value[CLIENT_MAP_REQUIRE_MA]) {
+		char const *v = value[CLIENT_MAP_REQUIRE_MA];
+
+		if ((strcasecmp(v, "yes") == 0) || (strcasecmp(v, "true") == 0) || (strcasecmp(v, "on") == 0)) {
+			c->message_authenticator = true;
+
+		} else if ((strcasecmp(v, "no") != 0) && (strcasecmp(v, "false") != 0) && (strcasecmp(v, "off") != 0)) {
+			ERROR("Invalid value \"%s\" for require_message_authenticator in client %s", v, name);
+			goto error;
+		}
+	}
+
+	c->proto = IPPROTO_UDP;
+	if (value[CLIENT_MAP_PROTO]) {
+		char const *v = value[CLIENT_MAP_PROTO];
+
+		if (strcmp(v, "udp") == 0) {
+			/* do nothing */
+
+		} else if (strcmp(v, "tcp") == 0) {
+			c->proto = IPPROTO_TCP;
+#ifdef WITH_TLS
+		} else if (strcmp(v, "tls") == 0) {
+			c->proto = IPPROTO_TCP;
+			c->tls_required = true;
+			c->secret = talloc_typed_strdup(c, "radsec");
+#endif
+		} else if (strcmp(v, "*") == 0) {
+			c->proto = IPPROTO_IP; /* fake for dual */
+
+		} else {
+			ERROR("Unknown proto \"%s\" in client %s", v, name);
+			goto error;
+		}
+	}
+
+	/*
+	 *	The same defaults as the "limit" subsection.
+	 */
+	c->limit.max_connections = 16;
+	c->limit.idle_timeout = 30;
+
+	for (i = 0; i < CLIENT_MAP_MAX; i++) talloc_free(mapped[i]);
+
+	return c;
+
+error:
+	for (i = 0; i < CLIENT_MAP_MAX; i++) talloc_free(mapped[i]);
+	talloc_free(c);
+
+	return NULL;
+}
+
 /** Create a new client, consuming all attributes in the control list of the request
  *
  * @param ctx the talloc context
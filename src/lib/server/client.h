@@ -129,6 +129,8 @@ void		client_free(RADCLIENT *client);
 
 bool		client_add(RADCLIENT_LIST *clients, RADCLIENT *client);
 
+int		client_update(RADCLIENT_LIST *clients, RADCLIENT *client);
+
 #ifdef WITH_DYNAMIC_CLIENTS
 void		client_delete(RADCLIENT_LIST *clients, RADCLIENT *client);
 
@@ -139,6 +141,9 @@ int		client_map_section(CONF_SECTION *out, CONF_SECTION const *map, client_value
 
 RADCLIENT	*client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, CONF_SECTION *server_cs);
 
+RADCLIENT	*client_afrom_map(TALLOC_CTX *ctx, char const *name, CONF_SECTION *tmpl,
+				  CONF_SECTION const *map, client_value_cb_t func, void *data);
+
 RADCLIENT	*client_afrom_query(TALLOC_CTX *ctx, char const *identifier, char const *secret, char const *shortname,
 				    char const *type, char const *server, bool require_ma)
 		CC_HINT(nonnull(2, 3));
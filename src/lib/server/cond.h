@@ -31,6 +31,7 @@ extern "C" {
 
 #include <freeradius-devel/server/tmpl.h>
 #include <freeradius-devel/server/map.h>
+#include <freeradius-devel/util/rbtree.h>
 
 #ifndef RADIUSD_H
 /*
@@ -87,6 +88,11 @@ struct fr_cond_s {
 
 	fr_cond_op_t		next_op;
 	fr_cond_t		*next;
+
+	bool			cmp_direct;	//!< Both operands have the same type, so compare
+						///< them without normalising.
+	rbtree_t		*set;		//!< Values of the '||' chain of '==' comparisons
+						///< which starts here, and ends the list.
 };
 
 ssize_t fr_cond_tokenize(CONF_SECTION *cs, fr_cond_t **head, char const **error,
@@ -35,12 +35,25 @@ RCSID("$Id$")
 #include <ctype.h>
 
 #ifdef WITH_UNLANG
+
+/** How many '==' comparisons an '||' chain needs before we use a set
+ *
+ * Shorter chains are faster to evaluate one comparison at a time.
+ */
+#define COND_SET_MIN	4
+
 #ifdef WITH_EVAL_DEBUG
 #  define EVAL_DEBUG(fmt, ...) printf("EVAL: ");printf(fmt, ## __VA_ARGS__);printf("\n");fflush(stdout)
 #else
 #  define EVAL_DEBUG(...)
 #endif
 
+static int cond_eval_tmpl_cached(REQUEST *request, int modreturn, int depth, vp_tmpl_t const *vpt,
+				 tmpl_cache_t *cache);
+static int cond_eval_map_cached(REQUEST *request, int modreturn, int depth, fr_cond_t const *c,
+				tmpl_cache_t *cache);
+static int cond_eval_cached(REQUEST *request, int modreturn, int depth, fr_cond_t const *c, tmpl_cache_t *cache);
+
 static bool all_digits(char const *string)
 {
 	char const *p = string;
@@ -69,7 +82,18 @@ static bool all_digits(char const *string)
  *	- 0 for "no match".
  *	- 1 for "match".
  */
-int cond_eval_tmpl(REQUEST *request, int modreturn, UNUSED int depth, vp_tmpl_t const *vpt)
+int cond_eval_tmpl(REQUEST *request, int modreturn, int depth, vp_tmpl_t const *vpt)
+{
+	return cond_eval_tmpl_cached(request, modreturn, depth, vpt, NULL);
+}
+
+/** Evaluate a template, remembering attribute lookups
+ *
+ * @copydetails cond_eval_tmpl
+ * @param[in] cache	of attribute lookups.  May be NULL.
+ */
+static int cond_eval_tmpl_cached(REQUEST *request, int modreturn, UNUSED int depth, vp_tmpl_t const *vpt,
+				 tmpl_cache_t *cache)
 {
 	int rcode = -1;
 	int modcode;
@@ -97,7 +121,7 @@ int cond_eval_tmpl(REQUEST *request, int modreturn, UNUSED int depth, vp_tmpl_t
 
 	case TMPL_TYPE_ATTR:
 	case TMPL_TYPE_LIST:
-		if (tmpl_find_vp(NULL, request, vpt) == 0) {
+		if (tmpl_find_vp_cached(NULL, request, vpt, cache) == 0) {
 			rcode = true;
 		} else {
 			rcode = false;
@@ -111,6 +135,11 @@ int cond_eval_tmpl(REQUEST *request, int modreturn, UNUSED int depth, vp_tmpl_t
 		char *p;
 
 		if (!*vpt->name) return false;
+
+		/*
+		 *	Expansions may modify the pair lists.
+		 */
+		tmpl_cache_clear(cache);
 		rcode = tmpl_aexpand(request, &p, request, vpt, NULL, NULL);
 		if (rcode < 0) {
 			EVAL_DEBUG("FAIL %d", __LINE__);
@@ -157,7 +186,7 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 	uint32_t	subcaptures;
 	int		ret;
 
-	regex_t		*preg, *rreg = NULL;
+	regex_t		*preg;
 	fr_regmatch_t	*regmatch;
 
 	if (!fr_cond_assert(lhs != NULL)) return -1;
@@ -173,15 +202,14 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 	default:
 		if (!fr_cond_assert(rhs && rhs->type == FR_TYPE_STRING)) return -1;
 		if (!fr_cond_assert(rhs && rhs->vb_strvalue)) return -1;
-		slen = regex_compile(request, &rreg, rhs->vb_strvalue, rhs->datum.length,
-				     &map->rhs->tmpl_regex_flags, true, true);
+		slen = regex_compile_cached(&preg, rhs->vb_strvalue, rhs->datum.length,
+					    &map->rhs->tmpl_regex_flags, true);
 		if (slen <= 0) {
 			REMARKER(rhs->vb_strvalue, -slen, "%s", fr_strerror());
 			EVAL_DEBUG("FAIL %d", __LINE__);
 
 			return -1;
 		}
-		preg = rreg;
 		break;
 	}
 
@@ -214,7 +242,6 @@ static int cond_do_regex(REQUEST *request, fr_cond_t const *c,
 	}
 
 	talloc_free(regmatch);	/* free if not consumed */
-	if (preg) talloc_free(rreg);
 
 	return ret;
 }
@@ -375,6 +402,15 @@ static int cond_normalise_and_cmp(REQUEST *request, fr_cond_t const *c, fr_value
 
 	xlat_escape_t		escape = NULL;
 
+	/*
+	 *	The literal was cast to the attribute's type when
+	 *	the condition was compiled, so there's nothing to do.
+	 */
+	if (c->cmp_direct) {
+		EVAL_DEBUG("CMP WITHOUT NORMALISATION");
+		return fr_value_box_cmp_op(map->op, lhs, &map->rhs->tmpl_value);
+	}
+
 	/*
 	 *	Cast operand to correct type.
 	 *
@@ -389,7 +425,7 @@ do {\
 		EVAL_DEBUG("CASTING " #_s " FROM %s TO %s",\
 			   fr_table_str_by_value(fr_value_box_type_table, _s->type, "<INVALID>"),\
 			   fr_table_str_by_value(fr_value_box_type_table, cast_type, "<INVALID>"));\
-		if (fr_value_box_cast(request, &_s ## _cast, cast_type, cast, _s) < 0) {\
+		if (fr_value_box_cast_func(cast_type, _s->type)(request, &_s ## _cast, cast_type, cast, _s) < 0) {\
 			RPEDEBUG("Failed casting " #_s " operand");\
 			rcode = -1;\
 			goto finish;\
@@ -583,7 +619,18 @@ finish:
  *	- 0 for "no match".
  *	- 1 for "match".
  */
-int cond_eval_map(REQUEST *request, UNUSED int modreturn, UNUSED int depth, fr_cond_t const *c)
+int cond_eval_map(REQUEST *request, int modreturn, int depth, fr_cond_t const *c)
+{
+	return cond_eval_map_cached(request, modreturn, depth, c, NULL);
+}
+
+/** Evaluate a map, remembering attribute lookups
+ *
+ * @copydetails cond_eval_map
+ * @param[in] cache	of attribute lookups.  May be NULL.
+ */
+static int cond_eval_map_cached(REQUEST *request, UNUSED int modreturn, UNUSED int depth, fr_cond_t const *c,
+				tmpl_cache_t *cache)
 {
 	int rcode = 0;
 
@@ -615,6 +662,18 @@ int cond_eval_map(REQUEST *request, UNUSED int modreturn, UNUSED int depth, fr_c
 			rcode = cond_normalise_and_cmp(request, c, NULL);
 			break;
 		}
+
+		/*
+		 *	References which can only match one attribute
+		 *	may have been resolved earlier in the condition.
+		 */
+		if (cache && tmpl_is_attr(map->lhs) &&
+		    (map->lhs->tmpl_num != NUM_ALL) && (map->lhs->tmpl_num != NUM_COUNT)) {
+			rcode = tmpl_find_vp_cached(&vp, request, map->lhs, cache);
+			if (rcode == 0) rcode = cond_normalise_and_cmp(request, c, &vp->data);
+			break;
+		}
+
 		for (vp = tmpl_cursor_init(&rcode, &cursor, request, map->lhs);
 		     vp;
 	     	     vp = fr_cursor_next(&cursor)) {
@@ -675,11 +734,63 @@ int cond_eval_map(REQUEST *request, UNUSED int modreturn, UNUSED int depth, fr_c
 		break;
 	}
 
+	/*
+	 *	Anything other than attribute references and
+	 *	literals may have modified the pair lists.
+	 */
+	if (cache &&
+	    ((c->pass2_fixup == PASS2_PAIRCOMPARE) ||
+	     !(tmpl_is_attr(map->lhs) || tmpl_is_list(map->lhs) || tmpl_is_data(map->lhs)) ||
+	     !(tmpl_is_attr(map->rhs) || tmpl_is_list(map->rhs) || tmpl_is_data(map->rhs)))) {
+		tmpl_cache_clear(cache);
+	}
+
 	EVAL_DEBUG("<<<");
 
 	return rcode;
 }
 
+/** Evaluate an '||' chain of '==' comparisons, by looking the attribute up in its set of values
+ *
+ * @param[in] request	the REQUEST
+ * @param[in] c		the first condition in the chain.
+ * @param[in] cache	of attribute lookups.
+ * @return
+ *	- <0 if the attribute wasn't found.
+ *	- 0 for "no match".
+ *	- 1 for "match".
+ */
+static int cond_eval_set(REQUEST *request, fr_cond_t const *c, tmpl_cache_t *cache)
+{
+	vp_tmpl_t const	*vpt = c->data.map->lhs;
+	VALUE_PAIR	*vp;
+	fr_cursor_t	cursor;
+	int		rcode;
+
+	EVAL_DEBUG(">>> SET %u VALUES", rbtree_num_elements(c->set));
+
+	/*
+	 *	Mirrors cond_eval_map_cached(), so that each
+	 *	comparison in the chain would have seen the same
+	 *	attributes.
+	 */
+	if (vpt->tmpl_num != NUM_ALL) {
+		rcode = tmpl_find_vp_cached(&vp, request, vpt, cache);
+		if (rcode < 0) return rcode;
+
+		return (rbtree_finddata(c->set, &vp->data) != NULL);
+	}
+
+	for (vp = tmpl_cursor_init(&rcode, &cursor, request, vpt);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		if (rbtree_finddata(c->set, &vp->data)) return 1;
+		rcode = 0;
+	}
+
+	return rcode;
+}
+
 /** Evaluate a fr_cond_t;
  *
  * @param[in] request the REQUEST
@@ -693,6 +804,26 @@ int cond_eval_map(REQUEST *request, UNUSED int modreturn, UNUSED int depth, fr_c
  *	- 1 for "match".
  */
 int cond_eval(REQUEST *request, int modreturn, int depth, fr_cond_t const *c)
+{
+	tmpl_cache_t	cache;
+
+	/*
+	 *	Nothing in a condition modifies the pair lists
+	 *	other than expansions, which clear the cache, so
+	 *	repeated references to the same attribute can
+	 *	share one lookup.
+	 */
+	cache.used = 0;
+
+	return cond_eval_cached(request, modreturn, depth, c, &cache);
+}
+
+/** Evaluate a fr_cond_t, remembering attribute lookups
+ *
+ * @copydetails cond_eval
+ * @param[in] cache	of attribute lookups.
+ */
+static int cond_eval_cached(REQUEST *request, int modreturn, int depth, fr_cond_t const *c, tmpl_cache_t *cache)
 {
 	int rcode = -1;
 #ifdef WITH_EVAL_DEBUG
@@ -703,19 +834,24 @@ int cond_eval(REQUEST *request, int modreturn, int depth, fr_cond_t const *c)
 #endif
 
 	while (c) {
+		/*
+		 *	The rest of the list is one set lookup.
+		 */
+		if (c->set) return cond_eval_set(request, c, cache);
+
 		switch (c->type) {
 		case COND_TYPE_EXISTS:
-			rcode = cond_eval_tmpl(request, modreturn, depth, c->data.vpt);
+			rcode = cond_eval_tmpl_cached(request, modreturn, depth, c->data.vpt, cache);
 			/* Existence checks are special, because we expect them to fail */
 			if (rcode < 0) rcode = 0;
 			break;
 
 		case COND_TYPE_MAP:
-			rcode = cond_eval_map(request, modreturn, depth, c);
+			rcode = cond_eval_map_cached(request, modreturn, depth, c, cache);
 			break;
 
 		case COND_TYPE_CHILD:
-			rcode = cond_eval(request, modreturn, depth + 1, c->data.child);
+			rcode = cond_eval_cached(request, modreturn, depth + 1, c->data.child, cache);
 			break;
 
 		case COND_TYPE_TRUE:
@@ -754,4 +890,122 @@ int cond_eval(REQUEST *request, int modreturn, int depth, fr_cond_t const *c)
 	}
 	return rcode;
 }
+
+/** Whether '==' in fr_value_box_cmp_op() gives the same result as fr_value_box_cmp()
+ *
+ */
+static bool cond_type_settable(fr_type_t type)
+{
+	switch (type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+	case FR_TYPE_UINT8:
+	case FR_TYPE_UINT16:
+	case FR_TYPE_UINT32:
+	case FR_TYPE_UINT64:
+	case FR_TYPE_INT32:
+	case FR_TYPE_IPV4_ADDR:
+	case FR_TYPE_IPV6_ADDR:
+	case FR_TYPE_IFID:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/** Whether a condition compares an attribute with a literal of the same type
+ *
+ */
+static bool cond_cmp_direct(fr_cond_t const *c)
+{
+	vp_map_t const *map;
+
+	if (c->type != COND_TYPE_MAP) return false;
+	map = c->data.map;
+
+	return ((c->pass2_fixup == PASS2_FIXUP_NONE) && !c->cast &&
+		tmpl_is_attr(map->lhs) && tmpl_is_data(map->rhs) &&
+		(map->lhs->tmpl_num != NUM_COUNT) &&
+		(map->rhs->tmpl_value_type == map->lhs->tmpl_da->type) &&
+		(map->op != T_OP_REG_EQ) && (map->op != T_OP_REG_NE));
+}
+
+/** Whether a condition can be part of the same set as the first one in a chain
+ *
+ */
+static bool cond_set_member(fr_cond_t const *c, fr_cond_t const *first)
+{
+	vp_tmpl_t const *vpt, *first_vpt;
+
+	if (!c->cmp_direct || c->negate || (c->data.map->op != T_OP_CMP_EQ)) return false;
+
+	vpt = c->data.map->lhs;
+	first_vpt = first->data.map->lhs;
+
+	return (cond_type_settable(vpt->tmpl_da->type) &&
+		(vpt->tmpl_da == first_vpt->tmpl_da) &&
+		(vpt->tmpl_request == first_vpt->tmpl_request) &&
+		(vpt->tmpl_list == first_vpt->tmpl_list) &&
+		(vpt->tmpl_num == first_vpt->tmpl_num) &&
+		(vpt->tmpl_tag == first_vpt->tmpl_tag));
+}
+
+static int cond_set_cmp(void const *a, void const *b)
+{
+	return fr_value_box_cmp(a, b);
+}
+
+/** Prepare a condition for faster evaluation
+ *
+ * Must be called after all pass2 fixups have been done.
+ *
+ * - Comparisons of an attribute with a literal of the same type are
+ *   marked as not needing normalisation.
+ * - An '||' chain of '==' comparisons of the same attribute with
+ *   literals, which ends the list, is turned into a single lookup in
+ *   a set of the literal values.
+ *
+ * @param[in] head	of the condition list.
+ */
+void cond_eval_prepare(fr_cond_t *head)
+{
+	fr_cond_t	*c, *start = NULL;
+	unsigned int	num = 0;
+
+	for (c = head; c; c = c->next) {
+		if (c->type == COND_TYPE_CHILD) cond_eval_prepare(c->data.child);
+
+		c->cmp_direct = cond_cmp_direct(c);
+
+		if (start && cond_set_member(c, start)) {
+			num++;
+		} else if (cond_set_member(c, c)) {
+			start = c;
+			num = 1;
+		} else {
+			start = NULL;
+		}
+
+		/*
+		 *	The chain must run to the end of the list, as
+		 *	it's evaluated as one value.
+		 */
+		if (c->next_op == COND_AND) start = NULL;
+
+		if (c->next_op == COND_NONE) break;
+	}
+
+	if (!start || (num < COND_SET_MIN) || start->set) return;
+
+	MEM(start->set = rbtree_create(start, cond_set_cmp, NULL, RBTREE_FLAG_NONE));
+	for (c = start; c; c = c->next) {
+		/*
+		 *	Duplicate values fail to insert, which is fine.
+		 */
+		(void) rbtree_insert(start->set, &c->data.map->rhs->tmpl_value);
+
+		if (c->next_op == COND_NONE) break;
+	}
+}
 #endif
@@ -504,6 +504,7 @@ static ssize_t cond_check_attrs(fr_cond_t *c, char const *start,
 				return_rhs("Cannot find type for attribute");
 			}
 			c->data.map->lhs->tmpl_da = da;
+			tmpl_link(c->data.map->lhs);
 		}
 	} /* attr to literal comparison */
 
@@ -36,6 +36,7 @@ typedef struct fr_connection_s fr_connection_t;
 
 #include <freeradius-devel/util/base.h>
 #include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/socket.h>
 
 #ifdef HAVE_STDATOMIC_H
 #  include <stdatomic.h>
@@ -1423,6 +1424,283 @@ int fr_connection_signal_on_fd(fr_connection_t *conn, int fd)
 	return 0;
 }
 
+typedef struct connection_race_s connection_race_t;
+
+/** One connection attempt in a race
+ *
+ */
+typedef struct {
+	connection_race_t	*race;			//!< Race this attempt belongs to.
+	fr_ipaddr_t		ipaddr;			//!< Destination of this attempt.
+	int			fd;			//!< Socket, or -1 if not started or finished.
+} connection_race_attempt_t;
+
+/** Parallel connection attempts to the addresses of a single destination
+ *
+ */
+struct connection_race_s {
+	fr_connection_t		*conn;			//!< Connection the winning socket is passed to.
+	fr_ipaddr_t		src_ipaddr;		//!< To bind attempts to.
+	uint16_t		port;			//!< To connect to.
+	fr_time_delta_t		attempt_delay;		//!< Stagger between starting attempts.
+
+	connection_race_attempt_t *attempts;		//!< Addresses, in the order they'll be tried.
+	size_t			num;			//!< How many attempts there are.
+	size_t			next;			//!< The next attempt to start.
+	size_t			pending;		//!< How many attempts are in progress.
+
+	fr_event_timer_t const	*ev;			//!< Starts the next attempt.
+
+	fr_connection_race_won_t won;			//!< Called with the winning socket.
+	void			*uctx;			//!< Passed to won.
+};
+
+static void connection_race_next(connection_race_t *race);
+
+static void _connection_race_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	connection_race_next(talloc_get_type_abort(uctx, connection_race_t));
+}
+
+static void connection_race_attempt_close(connection_race_t *race, connection_race_attempt_t *attempt)
+{
+	if (attempt->fd < 0) return;
+
+	fr_event_fd_delete(race->conn->pub.el, attempt->fd, FR_EVENT_FILTER_IO);
+	close(attempt->fd);
+	attempt->fd = -1;
+	race->pending--;
+}
+
+/** An attempt failed, start the next one immediately, or fail the connection if none are left
+ *
+ */
+static void connection_race_attempt_failed(connection_race_attempt_t *attempt, int fd_errno)
+{
+	connection_race_t	*race = attempt->race;
+	fr_connection_t		*conn = race->conn;
+
+	DEBUG2("Connection attempt to %pV port %u failed: %s",
+	       fr_box_ipaddr(attempt->ipaddr), race->port, fr_syserror(fd_errno));
+	connection_race_attempt_close(race, attempt);
+
+	if (race->next < race->num) {
+		fr_event_timer_delete(&race->ev);
+		connection_race_next(race);
+	}
+	if (race->pending) return;
+
+	ERROR("All connection attempts failed");
+	connection_state_enter_failed(conn);		/* Frees the race */
+}
+
+static void _connection_race_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				   int fd_errno, void *uctx)
+{
+	connection_race_attempt_failed(uctx, fd_errno);
+}
+
+/** An attempt's socket became writable, the first one to connect wins
+ *
+ */
+static void _connection_race_writable(fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	connection_race_attempt_t	*attempt = uctx;
+	connection_race_t		*race = attempt->race;
+	fr_connection_t			*conn = race->conn;
+	int				error = 0;
+	socklen_t			socklen = sizeof(error);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&error, &socklen) < 0) error = errno;
+	if (error) {
+		connection_race_attempt_failed(attempt, error);
+		return;
+	}
+
+	DEBUG2("Connected to %pV port %u", fr_box_ipaddr(attempt->ipaddr), race->port);
+
+	/*
+	 *	The winner's socket now belongs to the
+	 *	caller.  The losers are closed when the
+	 *	race is freed on entering the connected
+	 *	state.
+	 */
+	fr_event_fd_delete(el, fd, FR_EVENT_FILTER_IO);
+	attempt->fd = -1;
+	race->pending--;
+
+	race->won(conn, fd, &attempt->ipaddr, race->uctx);
+
+	connection_state_enter_connected(conn);
+}
+
+/** Start the next attempt that gets as far as connect()
+ *
+ * If there are more attempts after it, a timer starts the one after
+ * that if this one hasn't connected within the attempt delay.
+ */
+static void connection_race_next(connection_race_t *race)
+{
+	fr_connection_t		*conn = race->conn;
+
+	while (race->next < race->num) {
+		connection_race_attempt_t	*attempt = &race->attempts[race->next++];
+		int				fd;
+
+		fd = fr_socket_client_tcp(&race->src_ipaddr, &attempt->ipaddr, race->port, true);
+		if (fd < 0) {
+			PWARN("Connection attempt to %pV port %u failed",
+			      fr_box_ipaddr(attempt->ipaddr), race->port);
+			continue;
+		}
+
+		if (fr_event_fd_insert(race, conn->pub.el, fd,
+				       NULL,
+				       _connection_race_writable,
+				       _connection_race_error,
+				       attempt) < 0) {
+			PERROR("Failed inserting fd (%u) into event loop %p", fd, conn->pub.el);
+			close(fd);
+			continue;
+		}
+
+		DEBUG2("Connecting to %pV port %u", fr_box_ipaddr(attempt->ipaddr), race->port);
+		attempt->fd = fd;
+		race->pending++;
+		break;
+	}
+
+	if ((race->next < race->num) && race->attempt_delay &&
+	    (fr_event_timer_in(race, conn->pub.el, &race->ev, race->attempt_delay,
+			       _connection_race_timer, race) < 0)) {
+		PERROR("Failed inserting connection attempt timer");
+	}
+}
+
+static int _connection_race_free(connection_race_t *race)
+{
+	size_t i;
+
+	fr_event_timer_delete(&race->ev);
+	for (i = 0; i < race->num; i++) connection_race_attempt_close(race, &race->attempts[i]);
+
+	return 0;
+}
+
+/** Free the race, closing any losing attempts, once the connection is connected or closed
+ *
+ */
+static void _connection_race_cleanup(fr_connection_t *conn,
+				     UNUSED fr_connection_state_t prev, fr_connection_state_t state, void *uctx)
+{
+	switch (state) {
+	case FR_CONNECTION_STATE_CLOSED:
+		fr_connection_del_watch_pre(conn, FR_CONNECTION_STATE_CONNECTED, _connection_race_cleanup);
+		break;
+
+	case FR_CONNECTION_STATE_CONNECTED:
+		fr_connection_del_watch_pre(conn, FR_CONNECTION_STATE_CLOSED, _connection_race_cleanup);
+		break;
+
+	default:
+		fr_assert(0);
+		break;
+	}
+
+	talloc_free(uctx);
+}
+
+/** Race TCP connections to several addresses for the same destination
+ *
+ * Implements the connection attempt part of "Happy Eyeballs" (RFC 8305).
+ * Attempts are started one at a time, alternating between address families,
+ * starting with the family of the first address, so a broken IPv6 (or IPv4)
+ * path costs at most one attempt delay, not a full connection timeout.
+ * The next attempt starts early if the current one fails outright.
+ *
+ * The first attempt to complete wins.  Its socket is passed to the won callback,
+ * which should record it in the connection handle, then the connection enters
+ * the connected state.  All other attempts are abandoned.
+ *
+ * If every attempt fails, the connection enters the failed state.
+ *
+ * Should be called from the connection's init callback, in place of
+ * #fr_connection_signal_on_fd.  Fast Open is not used, as it would
+ * make every attempt appear to connect immediately.
+ *
+ * @param[in] conn		being initialised.
+ * @param[in] src_ipaddr	to bind attempts to, may be NULL.
+ * @param[in] dst_ipaddr	Addresses to try.
+ * @param[in] num		How many addresses there are.
+ * @param[in] port		to connect to.
+ * @param[in] attempt_delay	How long to wait for an attempt before starting the next one.
+ *				RFC 8305 recommends 250ms.
+ * @param[in] won		Called with the socket of the winning attempt.
+ * @param[in] uctx		to pass to won.
+ * @return
+ *	- 0 on success, at least one attempt is in progress.
+ *	- -1 on failure, no attempts could be started.
+ */
+int fr_connection_race_on_fd(fr_connection_t *conn, fr_ipaddr_t const *src_ipaddr,
+			     fr_ipaddr_t const dst_ipaddr[], size_t num, uint16_t port,
+			     fr_time_delta_t attempt_delay,
+			     fr_connection_race_won_t won, void const *uctx)
+{
+	connection_race_t	*race;
+	size_t			i, j, k;
+	int			af;
+
+	if (!num) {
+		fr_strerror_printf("No addresses to connect to");
+		return -1;
+	}
+
+	MEM(race = talloc_zero(conn, connection_race_t));
+	talloc_set_destructor(race, _connection_race_free);
+	race->conn = conn;
+	if (src_ipaddr) race->src_ipaddr = *src_ipaddr;
+	race->port = port;
+	race->attempt_delay = attempt_delay;
+	race->won = won;
+	memcpy(&race->uctx, &uctx, sizeof(race->uctx));
+
+	/*
+	 *	Interleave the address families, preserving
+	 *	the order of addresses within each family.
+	 *
+	 *	i is the next address of the preferred family,
+	 *	j is the next address of any other family.
+	 */
+	MEM(race->attempts = talloc_array(race, connection_race_attempt_t, num));
+	af = dst_ipaddr[0].af;
+	for (i = 0, j = 0, k = 0; k < num; k++) {
+		bool preferred = (k % 2) == 0;
+
+		while ((i < num) && (dst_ipaddr[i].af != af)) i++;
+		while ((j < num) && (dst_ipaddr[j].af == af)) j++;
+
+		if ((preferred && (i < num)) || (j >= num)) {
+			race->attempts[k].ipaddr = dst_ipaddr[i++];
+		} else {
+			race->attempts[k].ipaddr = dst_ipaddr[j++];
+		}
+		race->attempts[k].race = race;
+		race->attempts[k].fd = -1;
+	}
+	race->num = num;
+
+	connection_race_next(race);
+	if (!race->pending) {
+		talloc_free(race);
+		return -1;
+	}
+
+	fr_connection_add_watch_pre(conn, FR_CONNECTION_STATE_CLOSED, _connection_race_cleanup, true, race);
+	fr_connection_add_watch_pre(conn, FR_CONNECTION_STATE_CONNECTED, _connection_race_cleanup, true, race);
+
+	return 0;
+}
+
 /** Close a connection if it's freed
  *
  * @param[in] conn to free.
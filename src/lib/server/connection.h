@@ -29,6 +29,7 @@ extern "C" {
 #endif
 
 #include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/inet.h>
 #include <freeradius-devel/util/table.h>
 
 #include <talloc.h>
@@ -177,6 +178,15 @@ typedef fr_connection_state_t (*fr_connection_failed_t)(void *h, fr_connection_s
  */
 typedef void (*fr_connection_close_t)(fr_event_list_t *el, void *h, void *uctx);
 
+/** Receive the socket that won a connection race
+ *
+ * @param[in] conn	being connected.
+ * @param[in] fd	of the connected socket.  Now owned by the caller.
+ * @param[in] ipaddr	the socket is connected to.
+ * @param[in] uctx	passed to #fr_connection_race_on_fd.
+ */
+typedef void (*fr_connection_race_won_t)(fr_connection_t *conn, int fd, fr_ipaddr_t const *ipaddr, void *uctx);
+
 /** Holds a complete set of functions for a connection
  *
  */
@@ -257,6 +267,11 @@ void			fr_connection_signals_resume(fr_connection_t *conn);
  * @{
  */
 int			fr_connection_signal_on_fd(fr_connection_t *conn, int fd);
+
+int			fr_connection_race_on_fd(fr_connection_t *conn, fr_ipaddr_t const *src_ipaddr,
+						 fr_ipaddr_t const dst_ipaddr[], size_t num, uint16_t port,
+						 fr_time_delta_t attempt_delay,
+						 fr_connection_race_won_t won, void const *uctx);
 /** @} */
 
 /** @name Allocate a new connection
@@ -0,0 +1,229 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/detail.h
+ * @brief Binary detail file records.
+ *
+ * A binary detail record is a fixed size header, followed by the attributes
+ * of the packet.  Each attribute is a byte saying which dictionary it's from,
+ * followed by the attribute in the internal protocol encoding.
+ *
+ * All header fields are in network byte order:
+ *
+ @verbatim
+   0                   1                   2                   3
+   0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |     0xfe      |      'F'      |      'R'      |      'D'      |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |          Length of the record, including this header          |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |    Version    |     Flags     | Address family|   Reserved    |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |                          Packet code                          |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |                 Timestamp (nanoseconds, 64 bits)              |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |          Source port          |       Destination port        |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |                  Source address (16 octets)                   |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |                Destination address (16 octets)                |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |                        Protocol number                        |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |  Attributes ...
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ @endverbatim
+ *
+ * The first byte can never start a text detail record, so readers can tell
+ * the formats apart record by record.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(server_detail_h, "$Id$")
+
+#include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/net.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FR_DETAIL_BINARY_MAGIC		"\xfe" "FRD"
+#define FR_DETAIL_BINARY_MAGIC_LEN	4
+#define FR_DETAIL_BINARY_VERSION	1
+#define FR_DETAIL_BINARY_HDR_LEN	64
+
+#define FR_DETAIL_BINARY_MAX_LEN	65536		//!< Largest record we write or accept.
+
+#define FR_DETAIL_BINARY_OFFSET_FLAGS	9		//!< Readers update the flags in place.
+
+#define FR_DETAIL_BINARY_FLAG_DONE	0x01		//!< The record has been processed.
+
+/*
+ *	Which dictionary each attribute is from.
+ */
+#define FR_DETAIL_BINARY_DICT_PROTOCOL	0		//!< The dictionary of the protocol number in the header.
+#define FR_DETAIL_BINARY_DICT_INTERNAL	1		//!< The internal dictionary.
+
+/** The header of a binary detail record
+ *
+ */
+typedef struct {
+	uint32_t	length;				//!< Of the whole record.
+	uint8_t		flags;				//!< FR_DETAIL_BINARY_FLAG_*.
+	uint32_t	code;				//!< Of the packet.
+	fr_unix_time_t	timestamp;			//!< When the packet was received, in nanoseconds since the epoch.
+	fr_ipaddr_t	src_ipaddr;			//!< Where the packet came from.
+	fr_ipaddr_t	dst_ipaddr;			//!< Where the packet was sent to.
+	uint16_t	src_port;
+	uint16_t	dst_port;
+	uint32_t	protocol;			//!< Number of the protocol dictionary.
+} fr_detail_binary_hdr_t;
+
+static inline void fr_detail_binary_addr_encode(uint8_t out[static 16], fr_ipaddr_t const *ipaddr)
+{
+	memset(out, 0, 16);
+
+	switch (ipaddr->af) {
+	case AF_INET:
+		memcpy(out, &ipaddr->addr.v4.s_addr, 4);
+		break;
+
+	case AF_INET6:
+		memcpy(out, ipaddr->addr.v6.s6_addr, 16);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static inline void fr_detail_binary_addr_decode(fr_ipaddr_t *ipaddr, int af, uint8_t const in[static 16])
+{
+	memset(ipaddr, 0, sizeof(*ipaddr));
+
+	switch (af) {
+	case AF_INET:
+		ipaddr->af = AF_INET;
+		ipaddr->prefix = 32;
+		memcpy(&ipaddr->addr.v4.s_addr, in, 4);
+		break;
+
+	case AF_INET6:
+		ipaddr->af = AF_INET6;
+		ipaddr->prefix = 128;
+		memcpy(ipaddr->addr.v6.s6_addr, in, 16);
+		break;
+
+	default:
+		ipaddr->af = AF_INET;
+		ipaddr->prefix = 32;
+		ipaddr->addr.v4.s_addr = htonl(INADDR_NONE);
+		break;
+	}
+}
+
+/** Write the header of a binary detail record
+ *
+ * @param[out] out	Where to write the header.
+ * @param[in] hdr	to write.
+ */
+static inline void fr_detail_binary_hdr_encode(uint8_t out[static FR_DETAIL_BINARY_HDR_LEN],
+					       fr_detail_binary_hdr_t const *hdr)
+{
+	memcpy(out, FR_DETAIL_BINARY_MAGIC, FR_DETAIL_BINARY_MAGIC_LEN);
+	fr_net_from_uint32(out + 4, hdr->length);
+	out[8] = FR_DETAIL_BINARY_VERSION;
+	out[FR_DETAIL_BINARY_OFFSET_FLAGS] = hdr->flags;
+	out[10] = (hdr->src_ipaddr.af == AF_INET6) ? 6 : (hdr->src_ipaddr.af == AF_INET) ? 4 : 0;
+	out[11] = 0;
+	fr_net_from_uint32(out + 12, hdr->code);
+	fr_net_from_uint64(out + 16, hdr->timestamp);
+	fr_net_from_uint16(out + 24, hdr->src_port);
+	fr_net_from_uint16(out + 26, hdr->dst_port);
+	fr_detail_binary_addr_encode(out + 28, &hdr->src_ipaddr);
+	fr_detail_binary_addr_encode(out + 44, &hdr->dst_ipaddr);
+	fr_net_from_uint32(out + 60, hdr->protocol);
+}
+
+/** Read the header of a binary detail record
+ *
+ * @param[out] hdr	The decoded header.
+ * @param[in] data	The start of the record.
+ * @param[in] data_len	How much data is available.
+ * @return
+ *	- 0 on success.
+ *	- -1 if this isn't a binary record, or the header is malformed.
+ */
+static inline int fr_detail_binary_hdr_decode(fr_detail_binary_hdr_t *hdr, uint8_t const *data, size_t data_len)
+{
+	int af;
+
+	if ((data_len < FR_DETAIL_BINARY_HDR_LEN) ||
+	    (memcmp(data, FR_DETAIL_BINARY_MAGIC, FR_DETAIL_BINARY_MAGIC_LEN) != 0)) {
+		fr_strerror_printf("Not a binary detail record");
+		return -1;
+	}
+
+	if (data[8] != FR_DETAIL_BINARY_VERSION) {
+		fr_strerror_printf("Unknown binary detail record version %u", data[8]);
+		return -1;
+	}
+
+	hdr->length = fr_net_to_uint32(data + 4);
+	if (hdr->length < FR_DETAIL_BINARY_HDR_LEN) {
+		fr_strerror_printf("Binary detail record length %u is too small", hdr->length);
+		return -1;
+	}
+
+	hdr->flags = data[FR_DETAIL_BINARY_OFFSET_FLAGS];
+
+	switch (data[10]) {
+	case 4:
+		af = AF_INET;
+		break;
+
+	case 6:
+		af = AF_INET6;
+		break;
+
+	default:
+		af = AF_UNSPEC;
+		break;
+	}
+
+	hdr->code = fr_net_to_uint32(data + 12);
+	hdr->timestamp = fr_net_to_uint64(data + 16);
+	hdr->src_port = fr_net_to_uint16(data + 24);
+	hdr->dst_port = fr_net_to_uint16(data + 26);
+	fr_detail_binary_addr_decode(&hdr->src_ipaddr, af, data + 28);
+	fr_detail_binary_addr_decode(&hdr->dst_ipaddr, af, data + 44);
+	hdr->protocol = fr_net_to_uint32(data + 60);
+
+	return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
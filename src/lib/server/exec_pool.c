@@ -0,0 +1,833 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Pools of persistent helper processes
+ *
+ * Instead of forking a new process for every request, a pool starts
+ * a fixed number of long lived helpers, and writes requests to their
+ * stdin.  Each helper processes one request at a time, writing its
+ * reply to stdout.  Requests are queued when all helpers are busy.
+ *
+ * Pools are per-thread, and all I/O is done via the thread's event
+ * list, so callers yield while the helper is working.  Helpers which
+ * exit, close their stdout, time out, or write a malformed reply are
+ * killed, and restarted after `restart_delay`.
+ *
+ * @file src/lib/server/exec_pool.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "%s - "
+#define LOG_PREFIX_ARGS pool->log_prefix
+
+#include <freeradius-devel/server/exec.h>
+#include <freeradius-devel/server/exec_pool.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/table.h>
+
+#include <signal.h>
+
+#ifdef HAVE_SYS_WAIT_H
+#	include <sys/wait.h>
+#endif
+
+#define EXEC_POOL_MAX_REPLY	(65536)		//!< Largest reply we'll accept from a helper.
+
+typedef struct {
+	fr_exec_pool_t		*pool;			//!< Pool this helper belongs to.
+	unsigned int		id;			//!< Index of the helper in the pool.
+
+	pid_t			pid;			//!< Of the helper, or -1 if it's not running.
+	int			to_child;		//!< Helper's stdin.
+	int			from_child;		//!< Helper's stdout.
+	bool			writable;		//!< Whether we're waiting for to_child to be writable.
+
+	fr_event_pid_t const	*ev_pid;		//!< Notifies us when the helper exits.
+	fr_event_timer_t const	*ev_restart;		//!< Restarts the helper.
+
+	fr_exec_pool_req_t	*preq;			//!< Request being processed.  NULL if the request
+							///< was freed before the helper replied.
+	bool			busy;			//!< Whether the helper owes us a reply.
+	uint8_t const		*out;			//!< Next byte of the request to write.
+	size_t			out_left;		//!< Bytes of the request left to write.
+
+	uint8_t			*buff;			//!< Reply data read so far.
+	size_t			used;			//!< Bytes used in buff.
+} fr_exec_pool_helper_t;
+
+struct fr_exec_pool_s {
+	fr_exec_pool_conf_t const	*conf;		//!< Pool configuration.
+	fr_event_list_t			*el;		//!< Thread's event list.
+	char const			*log_prefix;	//!< Prefix for log messages.
+
+	fr_exec_pool_helper_t		**helpers;	//!< Array of helpers.
+	fr_dlist_head_t			queue;		//!< Requests waiting for a free helper.
+	uint32_t			num_queued;	//!< Number of requests in the queue.
+};
+
+struct fr_exec_pool_req_s {
+	fr_exec_pool_t			*pool;		//!< Pool the request was submitted to.
+	REQUEST				*request;	//!< Request the exchange is for.
+	fr_exec_pool_helper_t		*helper;	//!< Helper processing the request.
+	fr_dlist_t			entry;		//!< Entry in the queue.
+
+	fr_exec_pool_req_state_t	state;		//!< What's happened to the request.
+
+	uint8_t				*data;		//!< Framed request.
+	size_t				data_len;	//!< Length of the framed request.
+	uint8_t				*reply;		//!< \0 terminated reply, without framing.
+	size_t				reply_len;	//!< Length of the reply.
+
+	fr_event_timer_t const		*ev;		//!< Timeout for the exchange.
+
+	fr_exec_pool_complete_t		complete;	//!< Called when the exchange completes.
+	void				*uctx;		//!< Passed to complete.
+};
+
+static fr_table_num_sorted_t const fr_exec_pool_proto_table[] = {
+	{ "length",	FR_EXEC_POOL_PROTO_LENGTH	},
+	{ "line",	FR_EXEC_POOL_PROTO_LINE		}
+};
+static size_t fr_exec_pool_proto_table_len = NUM_ELEMENTS(fr_exec_pool_proto_table);
+
+CONF_PARSER const fr_exec_pool_config[] = {
+	{ FR_CONF_OFFSET("program", FR_TYPE_STRING, fr_exec_pool_conf_t, program) },
+	{ FR_CONF_OFFSET("num_helpers", FR_TYPE_UINT32, fr_exec_pool_conf_t, num_helpers), .dflt = "2" },
+	{ FR_CONF_OFFSET("protocol", FR_TYPE_INT32, fr_exec_pool_conf_t, protocol),
+	  .func = cf_table_parse_int,
+	  .uctx = &(cf_table_parse_ctx_t){ .table = fr_exec_pool_proto_table, .len = &fr_exec_pool_proto_table_len },
+	  .dflt = "line" },
+	{ FR_CONF_OFFSET("terminator", FR_TYPE_STRING, fr_exec_pool_conf_t, terminator) },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, fr_exec_pool_conf_t, timeout), .dflt = "5" },
+	{ FR_CONF_OFFSET("restart_delay", FR_TYPE_TIME_DELTA, fr_exec_pool_conf_t, restart_delay), .dflt = "1" },
+	{ FR_CONF_OFFSET("max_queued", FR_TYPE_UINT32, fr_exec_pool_conf_t, max_queued), .dflt = "1024" },
+	CONF_PARSER_TERMINATOR
+};
+
+static void helper_start(fr_exec_pool_helper_t *helper);
+static void helper_write(fr_exec_pool_helper_t *helper);
+static void _exec_pool_req_failed(fr_event_list_t *el, fr_time_t now, void *uctx);
+
+/** Mark a request as complete and tell the caller
+ *
+ */
+static void req_finish(fr_exec_pool_req_t *preq, fr_exec_pool_req_state_t state)
+{
+	preq->state = state;
+	preq->helper = NULL;
+	fr_event_timer_delete(&preq->ev);
+
+	preq->complete(preq->request, preq, preq->uctx);
+}
+
+/** Stop listening to a helper's pipes, and close them
+ *
+ */
+static void helper_close(fr_exec_pool_helper_t *helper)
+{
+	fr_exec_pool_t *pool = helper->pool;
+
+	if (helper->from_child >= 0) {
+		(void) fr_event_fd_delete(pool->el, helper->from_child, FR_EVENT_FILTER_IO);
+		close(helper->from_child);
+		helper->from_child = -1;
+	}
+
+	if (helper->to_child >= 0) {
+		if (helper->writable) (void) fr_event_fd_delete(pool->el, helper->to_child, FR_EVENT_FILTER_IO);
+		close(helper->to_child);
+		helper->to_child = -1;
+	}
+	helper->writable = false;
+	helper->out = NULL;
+	helper->out_left = 0;
+	helper->used = 0;
+}
+
+/** Close a helper's pipes and kill it
+ *
+ * The helper is restarted when we're notified that it exited.
+ */
+static void helper_kill(fr_exec_pool_helper_t *helper)
+{
+	helper_close(helper);
+
+	if (helper->pid > 0) kill(helper->pid, SIGKILL);
+}
+
+/** Kill a helper, failing the request it was processing
+ *
+ */
+static void helper_fail(fr_exec_pool_helper_t *helper, fr_exec_pool_req_state_t state)
+{
+	fr_exec_pool_req_t *preq = helper->preq;
+
+	helper->preq = NULL;
+	helper->busy = false;
+	helper_kill(helper);
+
+	if (preq) req_finish(preq, state);
+}
+
+/** Give queued requests to idle helpers
+ *
+ */
+static void pool_dispatch(fr_exec_pool_t *pool)
+{
+	uint32_t i;
+
+	for (i = 0; (i < pool->conf->num_helpers) && (pool->num_queued > 0); i++) {
+		fr_exec_pool_helper_t	*helper = pool->helpers[i];
+		fr_exec_pool_req_t	*preq;
+
+		if ((helper->to_child < 0) || helper->busy) continue;
+
+		preq = fr_dlist_head(&pool->queue);
+		fr_dlist_remove(&pool->queue, preq);
+		pool->num_queued--;
+
+		helper->preq = preq;
+		helper->busy = true;
+		helper->out = preq->data;
+		helper->out_left = preq->data_len;
+		helper->used = 0;
+
+		preq->helper = helper;
+		preq->state = FR_EXEC_POOL_REQ_SENT;
+
+		helper_write(helper);
+	}
+}
+
+static void _helper_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	helper_write(talloc_get_type_abort(uctx, fr_exec_pool_helper_t));
+}
+
+static void _helper_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	fr_exec_pool_helper_t	*helper = uctx;
+	fr_exec_pool_t		*pool = helper->pool;
+
+	if (fd_errno) {
+		ERROR("Helper %u (pid %ld) pipe error - %s", helper->id, (long)helper->pid, fr_syserror(fd_errno));
+	} else {
+		ERROR("Helper %u (pid %ld) closed its pipes", helper->id, (long)helper->pid);
+	}
+	helper_fail(helper, FR_EXEC_POOL_REQ_FAILED);
+}
+
+/** Write as much of the current request as the pipe will take
+ *
+ * If the write fails before any of the request was written, the request
+ * goes back to the head of the queue for another helper.
+ */
+static void helper_write(fr_exec_pool_helper_t *helper)
+{
+	fr_exec_pool_t	*pool = helper->pool;
+	ssize_t		slen;
+
+	while (helper->out_left > 0) {
+		slen = write(helper->to_child, helper->out, helper->out_left);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			if (errno == EAGAIN) {
+				if (helper->writable) return;
+
+				if (fr_event_fd_insert(pool, pool->el, helper->to_child,
+						       NULL, _helper_writable, _helper_error, helper) < 0) {
+					PERROR("Helper %u (pid %ld) failed inserting write event",
+					       helper->id, (long)helper->pid);
+					break;
+				}
+				helper->writable = true;
+				return;
+			}
+
+			ERROR("Helper %u (pid %ld) write failed - %s", helper->id, (long)helper->pid, fr_syserror(errno));
+			break;
+		}
+
+		helper->out += slen;
+		helper->out_left -= slen;
+	}
+
+	if (helper->out_left == 0) {
+		if (helper->writable) {
+			(void) fr_event_fd_delete(pool->el, helper->to_child, FR_EVENT_FILTER_IO);
+			helper->writable = false;
+		}
+		return;
+	}
+
+	/*
+	 *	Write failed.  If nothing was written the helper
+	 *	never saw the request, and it's safe to give it to
+	 *	another one.  Otherwise we can't know what the helper
+	 *	did with it, so it's failed.
+	 */
+	if (helper->preq && (helper->out == helper->preq->data)) {
+		fr_exec_pool_req_t *preq = helper->preq;
+
+		helper->preq = NULL;
+		helper->busy = false;
+		helper_kill(helper);
+
+		preq->helper = NULL;
+		preq->state = FR_EXEC_POOL_REQ_QUEUED;
+		fr_dlist_insert_head(&pool->queue, preq);
+		pool->num_queued++;
+		pool_dispatch(pool);
+		return;
+	}
+
+	/*
+	 *	We may have been called from fr_exec_pool_enqueue(),
+	 *	so report the failure from the event loop.
+	 */
+	if (helper->preq) {
+		fr_exec_pool_req_t *preq = helper->preq;
+
+		helper->preq = NULL;
+		preq->helper = NULL;
+		preq->state = FR_EXEC_POOL_REQ_FAILED;
+
+		if (fr_event_timer_in(preq, pool->el, &preq->ev, 0, _exec_pool_req_failed, preq) < 0) {
+			PERROR("Failed inserting helper failure event");
+		}
+	}
+	helper->busy = false;
+	helper_kill(helper);
+}
+
+/** Find the end of a complete reply in the helper's buffer
+ *
+ * @param[out] start		Offset of the reply.
+ * @param[out] len		Length of the reply.
+ * @param[in] helper		to check.
+ * @return
+ *	- >0 the number of bytes the framed reply occupies.
+ *	- 0 if the reply is incomplete.
+ *	- -1 if the reply is malformed.
+ */
+static ssize_t helper_reply_find(size_t *start, size_t *len, fr_exec_pool_helper_t *helper)
+{
+	fr_exec_pool_conf_t const	*conf = helper->pool->conf;
+	uint8_t				*p, *end, *nl;
+	uint32_t			msg_len;
+
+	p = helper->buff;
+	end = helper->buff + helper->used;
+
+	switch (conf->protocol) {
+	case FR_EXEC_POOL_PROTO_LENGTH:
+		if (helper->used < sizeof(msg_len)) return 0;
+
+		memcpy(&msg_len, p, sizeof(msg_len));
+		msg_len = ntohl(msg_len);
+		if (msg_len > (EXEC_POOL_MAX_REPLY - sizeof(msg_len))) return -1;
+		if (helper->used < (sizeof(msg_len) + msg_len)) return 0;
+
+		*start = sizeof(msg_len);
+		*len = msg_len;
+		return sizeof(msg_len) + msg_len;
+
+	case FR_EXEC_POOL_PROTO_LINE:
+		while ((nl = memchr(p, '\n', end - p))) {
+			size_t line_len = nl - p;
+
+			if ((line_len > 0) && (p[line_len - 1] == '\r')) line_len--;
+
+			/*
+			 *	Single line replies.
+			 */
+			if (!conf->terminator) {
+				*start = 0;
+				*len = line_len;
+				return (nl + 1) - helper->buff;
+			}
+
+			/*
+			 *	Multi-line replies end at the terminator.
+			 */
+			if ((line_len == strlen(conf->terminator)) &&
+			    (memcmp(p, conf->terminator, line_len) == 0)) {
+				*start = 0;
+				*len = p - helper->buff;
+				return (nl + 1) - helper->buff;
+			}
+
+			p = nl + 1;
+		}
+		return 0;
+	}
+
+	return -1;
+}
+
+static void _helper_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_exec_pool_helper_t	*helper = talloc_get_type_abort(uctx, fr_exec_pool_helper_t);
+	fr_exec_pool_t		*pool = helper->pool;
+	ssize_t			slen;
+	size_t			start = 0, len = 0;
+
+	slen = read(helper->from_child, helper->buff + helper->used, EXEC_POOL_MAX_REPLY - helper->used);
+	if (slen < 0) {
+		if ((errno == EINTR) || (errno == EAGAIN)) return;
+
+		ERROR("Helper %u (pid %ld) read failed - %s", helper->id, (long)helper->pid, fr_syserror(errno));
+		helper_fail(helper, FR_EXEC_POOL_REQ_FAILED);
+		return;
+	}
+
+	if (slen == 0) {
+		ERROR("Helper %u (pid %ld) closed its stdout", helper->id, (long)helper->pid);
+		helper_fail(helper, FR_EXEC_POOL_REQ_FAILED);
+		return;
+	}
+
+	helper->used += slen;
+
+	slen = helper_reply_find(&start, &len, helper);
+	if (slen == 0) {
+		if (helper->used < EXEC_POOL_MAX_REPLY) return;
+
+		ERROR("Helper %u (pid %ld) reply too long (maximum %u bytes)",
+		      helper->id, (long)helper->pid, EXEC_POOL_MAX_REPLY);
+		helper_fail(helper, FR_EXEC_POOL_REQ_FAILED);
+		return;
+	}
+
+	/*
+	 *	Anything a helper writes when it's not been asked
+	 *	something means we've lost track of which reply
+	 *	belongs to which request.
+	 */
+	if ((slen < 0) || !helper->busy || ((size_t)slen != helper->used)) {
+		ERROR("Helper %u (pid %ld) wrote %s", helper->id, (long)helper->pid,
+		      slen < 0 ? "a malformed reply" : "unsolicited data");
+		helper_fail(helper, FR_EXEC_POOL_REQ_FAILED);
+		return;
+	}
+
+	helper->busy = false;
+	helper->used = 0;
+
+	/*
+	 *	The request was freed while the helper was working.
+	 */
+	if (!helper->preq) {
+		pool_dispatch(pool);
+		return;
+	}
+
+	{
+		fr_exec_pool_req_t *preq = helper->preq;
+
+		helper->preq = NULL;
+
+		MEM(preq->reply = talloc_array(preq, uint8_t, len + 1));
+		memcpy(preq->reply, helper->buff + start, len);
+		preq->reply[len] = '\0';
+		preq->reply_len = len;
+
+		req_finish(preq, FR_EXEC_POOL_REQ_DONE);
+	}
+
+	pool_dispatch(pool);
+}
+
+static void _helper_restart(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	helper_start(talloc_get_type_abort(uctx, fr_exec_pool_helper_t));
+}
+
+static void helper_restart_schedule(fr_exec_pool_helper_t *helper)
+{
+	fr_exec_pool_t *pool = helper->pool;
+
+	if (fr_event_timer_in(pool, pool->el, &helper->ev_restart, pool->conf->restart_delay,
+			      _helper_restart, helper) < 0) {
+		PERROR("Helper %u failed inserting restart timer", helper->id);
+	}
+}
+
+static void _helper_exit(UNUSED fr_event_list_t *el, pid_t pid, int status, void *uctx)
+{
+	fr_exec_pool_helper_t	*helper = talloc_get_type_abort(uctx, fr_exec_pool_helper_t);
+	fr_exec_pool_t		*pool = helper->pool;
+
+	(void) waitpid(pid, &status, WNOHANG);	/* Reap it */
+
+	talloc_const_free(helper->ev_pid);
+	helper->ev_pid = NULL;
+	helper->pid = -1;
+
+	if (WIFEXITED(status)) {
+		WARN("Helper %u (pid %ld) exited with status %i", helper->id, (long)pid, WEXITSTATUS(status));
+	} else if (WIFSIGNALED(status)) {
+		WARN("Helper %u (pid %ld) exited with signal %i", helper->id, (long)pid, WTERMSIG(status));
+	}
+
+	/*
+	 *	Exited without closing its stdout first.
+	 */
+	if ((helper->from_child >= 0) || helper->busy) helper_fail(helper, FR_EXEC_POOL_REQ_FAILED);
+
+	helper_restart_schedule(helper);
+}
+
+/** Start a helper, and register its pipes with the event loop
+ *
+ */
+static void helper_start(fr_exec_pool_helper_t *helper)
+{
+	fr_exec_pool_t	*pool = helper->pool;
+	pid_t		pid;
+
+	fr_assert(helper->pid < 0);
+
+	pid = radius_start_program(pool->conf->program, NULL, true, &helper->to_child, &helper->from_child,
+				   NULL, false);
+	if (pid < 0) {
+		PERROR("Helper %u failed to start", helper->id);
+		helper->to_child = helper->from_child = -1;
+		helper_restart_schedule(helper);
+		return;
+	}
+	helper->pid = pid;
+
+	fr_nonblock(helper->to_child);
+	fr_nonblock(helper->from_child);
+
+	if (fr_event_fd_insert(pool, pool->el, helper->from_child,
+			       _helper_read, NULL, _helper_error, helper) < 0) {
+		PERROR("Helper %u (pid %ld) failed inserting read event", helper->id, (long)pid);
+	error:
+		helper_kill(helper);
+		fr_exec_waitpid(pid);
+		helper->pid = -1;
+		helper_restart_schedule(helper);
+		return;
+	}
+
+	/*
+	 *	If the helper has already exited this calls
+	 *	_helper_exit() immediately.
+	 */
+	if (fr_event_pid_wait(pool, pool->el, &helper->ev_pid, pid, _helper_exit, helper) < 0) {
+		PERROR("Helper %u (pid %ld) failed inserting exit event", helper->id, (long)pid);
+		goto error;
+	}
+	if (helper->pid < 0) return;
+
+	DEBUG2("Helper %u started (pid %ld)", helper->id, (long)pid);
+
+	pool_dispatch(pool);
+}
+
+/** Stop all helpers, handing their PIDs to the global reaper
+ *
+ */
+static int _exec_pool_free(fr_exec_pool_t *pool)
+{
+	uint32_t i;
+
+	for (i = 0; i < pool->conf->num_helpers; i++) {
+		fr_exec_pool_helper_t *helper = pool->helpers[i];
+
+		fr_event_timer_delete(&helper->ev_restart);
+		helper_close(helper);
+
+		if (helper->pid > 0) {
+			TALLOC_FREE(helper->ev_pid);
+			kill(helper->pid, SIGTERM);
+			fr_exec_waitpid(helper->pid);
+			helper->pid = -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Free a request, removing it from the queue, or detaching it from its helper
+ *
+ */
+static int _exec_pool_req_free(fr_exec_pool_req_t *preq)
+{
+	fr_exec_pool_t		*pool = preq->pool;
+	fr_exec_pool_helper_t	*helper = preq->helper;
+
+	switch (preq->state) {
+	case FR_EXEC_POOL_REQ_QUEUED:
+		fr_dlist_remove(&pool->queue, preq);
+		pool->num_queued--;
+		break;
+
+	case FR_EXEC_POOL_REQ_SENT:
+		if (!helper) break;
+
+		helper->preq = NULL;
+
+		/*
+		 *	The helper has the whole request, let it
+		 *	finish, and discard the reply.  Otherwise
+		 *	the rest of the request is about to be freed
+		 *	from under it.
+		 */
+		if (helper->out_left > 0) {
+			helper->busy = false;
+			helper_kill(helper);
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static void _exec_pool_req_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_exec_pool_req_t	*preq = talloc_get_type_abort(uctx, fr_exec_pool_req_t);
+	fr_exec_pool_t		*pool = preq->pool;
+	REQUEST			*request = preq->request;
+
+	preq->ev = NULL;
+
+	switch (preq->state) {
+	case FR_EXEC_POOL_REQ_QUEUED:
+		RERROR("Timeout waiting for a free helper");
+		fr_dlist_remove(&pool->queue, preq);
+		pool->num_queued--;
+		req_finish(preq, FR_EXEC_POOL_REQ_TIMEOUT);
+		return;
+
+	case FR_EXEC_POOL_REQ_SENT:
+		RERROR("Timeout waiting for helper %u (pid %ld) - killing it",
+		       preq->helper->id, (long)preq->helper->pid);
+		helper_fail(preq->helper, FR_EXEC_POOL_REQ_TIMEOUT);
+		return;
+
+	default:
+		fr_assert(0);
+		return;
+	}
+}
+
+static void _exec_pool_req_failed(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_exec_pool_req_t *preq = talloc_get_type_abort(uctx, fr_exec_pool_req_t);
+
+	preq->ev = NULL;
+	req_finish(preq, FR_EXEC_POOL_REQ_FAILED);
+}
+
+/** Allocate a pool, and start its helpers
+ *
+ * Should be called from a module's thread_instantiate callback.
+ *
+ * @param[in] ctx		to allocate the pool in.
+ * @param[in] el		Thread's event list.
+ * @param[in] conf		Pool configuration.  Must remain valid for the lifetime of the pool.
+ * @param[in] log_prefix	Prefix for log messages.
+ * @return
+ *	- A new pool on success.
+ *	- NULL on failure.
+ */
+fr_exec_pool_t *fr_exec_pool_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+				   fr_exec_pool_conf_t const *conf, char const *log_prefix)
+{
+	fr_exec_pool_t	*pool;
+	uint32_t	i;
+
+	if (!conf->program || !conf->num_helpers) {
+		fr_strerror_printf("No helper program configured");
+		return NULL;
+	}
+
+	MEM(pool = talloc_zero(ctx, fr_exec_pool_t));
+	pool->conf = conf;
+	pool->el = el;
+	pool->log_prefix = talloc_typed_strdup(pool, log_prefix);
+	fr_dlist_talloc_init(&pool->queue, fr_exec_pool_req_t, entry);
+
+	MEM(pool->helpers = talloc_zero_array(pool, fr_exec_pool_helper_t *, conf->num_helpers));
+	for (i = 0; i < conf->num_helpers; i++) {
+		fr_exec_pool_helper_t *helper;
+
+		MEM(helper = talloc_zero(pool->helpers, fr_exec_pool_helper_t));
+		helper->pool = pool;
+		helper->id = i;
+		helper->pid = -1;
+		helper->to_child = helper->from_child = -1;
+		MEM(helper->buff = talloc_array(helper, uint8_t, EXEC_POOL_MAX_REPLY));
+
+		pool->helpers[i] = helper;
+	}
+	talloc_set_destructor(pool, _exec_pool_free);
+
+	for (i = 0; i < conf->num_helpers; i++) helper_start(pool->helpers[i]);
+
+	return pool;
+}
+
+/** Submit a request to the pool
+ *
+ * The complete callback is never called from within this function.
+ * Freeing the returned handle cancels the request.
+ *
+ * @param[in] ctx		to allocate the handle in.  Usually the module's rctx.
+ * @param[in] pool		to submit the request to.
+ * @param[in] request		the exchange is for.
+ * @param[in] data		to write to the helper.  For line based helpers a
+ *				trailing newline is added if it's missing.
+ * @param[in] data_len		Length of data.
+ * @param[in] complete		called when the exchange completes.
+ * @param[in] uctx		passed to complete.
+ * @return
+ *	- A new request handle.
+ *	- NULL if the queue is full.
+ */
+fr_exec_pool_req_t *fr_exec_pool_enqueue(TALLOC_CTX *ctx, fr_exec_pool_t *pool, REQUEST *request,
+					 uint8_t const *data, size_t data_len,
+					 fr_exec_pool_complete_t complete, void *uctx)
+{
+	fr_exec_pool_req_t	*preq;
+	uint8_t			*p;
+
+	if (pool->conf->max_queued && (pool->num_queued >= pool->conf->max_queued)) {
+		RERROR("Too many requests waiting for a helper (%u)", pool->num_queued);
+		return NULL;
+	}
+
+	MEM(preq = talloc_zero(ctx, fr_exec_pool_req_t));
+	preq->pool = pool;
+	preq->request = request;
+	preq->complete = complete;
+	preq->uctx = uctx;
+
+	switch (pool->conf->protocol) {
+	case FR_EXEC_POOL_PROTO_LENGTH:
+	{
+		uint32_t msg_len = htonl((uint32_t)data_len);
+
+		preq->data_len = sizeof(msg_len) + data_len;
+		MEM(preq->data = p = talloc_array(preq, uint8_t, preq->data_len));
+		memcpy(p, &msg_len, sizeof(msg_len));
+		memcpy(p + sizeof(msg_len), data, data_len);
+	}
+		break;
+
+	case FR_EXEC_POOL_PROTO_LINE:
+	default:
+	{
+		bool add_nl = !data_len || (data[data_len - 1] != '\n');
+
+		preq->data_len = data_len + add_nl;
+		MEM(preq->data = p = talloc_array(preq, uint8_t, preq->data_len));
+		memcpy(p, data, data_len);
+		if (add_nl) p[data_len] = '\n';
+	}
+		break;
+	}
+
+	if (fr_event_timer_in(preq, pool->el, &preq->ev, pool->conf->timeout,
+			      _exec_pool_req_timeout, preq) < 0) {
+		RPERROR("Failed inserting helper timeout");
+		talloc_free(preq);
+		return NULL;
+	}
+
+	preq->state = FR_EXEC_POOL_REQ_QUEUED;
+	fr_dlist_insert_tail(&pool->queue, preq);
+	pool->num_queued++;
+	talloc_set_destructor(preq, _exec_pool_req_free);
+
+	RDEBUG3("Submitting %zu bytes to helper pool", data_len);
+
+	/*
+	 *	Write failures are either retried on another helper,
+	 *	or reported from the event loop, so complete is never
+	 *	called before we return.
+	 */
+	pool_dispatch(pool);
+
+	return preq;
+}
+
+/** Get the result of an exchange
+ *
+ * @param[out] out		Where to write a pointer to the reply.  The reply is
+ *				\0 terminated, and owned by the handle.  May be NULL.
+ * @param[out] outlen		Length of the reply.  May be NULL.
+ * @param[in] preq		to get the result from.
+ * @return The state of the exchange.  Only #FR_EXEC_POOL_REQ_DONE has a reply.
+ */
+fr_exec_pool_req_state_t fr_exec_pool_req_result(uint8_t const **out, size_t *outlen, fr_exec_pool_req_t const *preq)
+{
+	if (out) *out = preq->reply;
+	if (outlen) *outlen = preq->reply_len;
+
+	return preq->state;
+}
+
+/** Check a pool configuration is sane
+ *
+ * @param[in] cs		the configuration was parsed from.
+ * @param[in] conf		to check.
+ * @return
+ *	- 0 if the configuration is valid.
+ *	- -1 if it isn't.
+ */
+int fr_exec_pool_conf_check(CONF_SECTION *cs, fr_exec_pool_conf_t *conf)
+{
+	if (!conf->program || !*conf->program) {
+		cf_log_err(cs, "A helper 'program' must be set");
+		return -1;
+	}
+
+	if ((conf->num_helpers < 1) || (conf->num_helpers > 256)) {
+		cf_log_err(cs, "'num_helpers' must be between 1 and 256");
+		return -1;
+	}
+
+	if (conf->timeout < fr_time_delta_from_msec(10)) {
+		cf_log_err(cs, "'timeout' '%pVs' is too small (minimum: 0.01s)", fr_box_time_delta(conf->timeout));
+		return -1;
+	}
+
+	if (conf->restart_delay < fr_time_delta_from_msec(10)) {
+		cf_log_err(cs, "'restart_delay' '%pVs' is too small (minimum: 0.01s)",
+			   fr_box_time_delta(conf->restart_delay));
+		return -1;
+	}
+
+	if (conf->terminator && (conf->protocol != FR_EXEC_POOL_PROTO_LINE)) {
+		cf_log_err(cs, "'terminator' can only be used with 'protocol = line'");
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,100 @@
+#pragma once
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/exec_pool.h
+ * @brief Pools of persistent helper processes.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(exec_pool_h, "$Id$")
+
+#include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/util/event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_exec_pool_s fr_exec_pool_t;
+typedef struct fr_exec_pool_req_s fr_exec_pool_req_t;
+
+/** How requests and replies are framed on the helper's stdin and stdout
+ *
+ */
+typedef enum {
+	FR_EXEC_POOL_PROTO_LINE = 0,			//!< Newline delimited.  The reply is a single line,
+							///< or every line up to one matching the terminator.
+	FR_EXEC_POOL_PROTO_LENGTH			//!< Each message is prefixed with a 32bit network
+							///< order length field.
+} fr_exec_pool_proto_t;
+
+/** The state of a request submitted to a helper pool
+ *
+ */
+typedef enum {
+	FR_EXEC_POOL_REQ_QUEUED = 0,			//!< Waiting for a free helper.
+	FR_EXEC_POOL_REQ_SENT,				//!< Written to a helper, waiting for the reply.
+	FR_EXEC_POOL_REQ_DONE,				//!< Reply received.
+	FR_EXEC_POOL_REQ_FAILED,			//!< Helper exited, or wrote a malformed reply.
+	FR_EXEC_POOL_REQ_TIMEOUT			//!< No reply within the configured timeout.
+} fr_exec_pool_req_state_t;
+
+/** Configuration for a pool of helper processes
+ *
+ */
+typedef struct {
+	char const		*program;		//!< Program and arguments.  Not expanded.
+	uint32_t		num_helpers;		//!< Helpers to run in each thread.
+	fr_exec_pool_proto_t	protocol;		//!< How messages are framed.
+	char const		*terminator;		//!< Line which ends a multi-line reply.
+	fr_time_delta_t		timeout;		//!< How long a request may wait for its reply.
+	fr_time_delta_t		restart_delay;		//!< How long to wait before restarting a helper
+							///< which exited.
+	uint32_t		max_queued;		//!< Maximum number of requests waiting for a helper.
+} fr_exec_pool_conf_t;
+
+/** Called when a request completes, fails, or times out
+ *
+ * Typically calls unlang_interpret_resumable() for the request.
+ *
+ * @param[in] request	the request was submitted for.
+ * @param[in] preq	that completed.  Retrieve the reply with #fr_exec_pool_req_result.
+ * @param[in] uctx	passed to #fr_exec_pool_enqueue.
+ */
+typedef void (*fr_exec_pool_complete_t)(REQUEST *request, fr_exec_pool_req_t *preq, void *uctx);
+
+extern CONF_PARSER const fr_exec_pool_config[];
+
+fr_exec_pool_t			*fr_exec_pool_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+						    fr_exec_pool_conf_t const *conf, char const *log_prefix);
+
+fr_exec_pool_req_t		*fr_exec_pool_enqueue(TALLOC_CTX *ctx, fr_exec_pool_t *pool, REQUEST *request,
+						      uint8_t const *data, size_t data_len,
+						      fr_exec_pool_complete_t complete, void *uctx);
+
+fr_exec_pool_req_state_t	fr_exec_pool_req_result(uint8_t const **out, size_t *outlen,
+							fr_exec_pool_req_t const *preq);
+
+int				fr_exec_pool_conf_check(CONF_SECTION *cs, fr_exec_pool_conf_t *conf);
+
+#ifdef __cplusplus
+}
+#endif
@@ -210,11 +210,11 @@ void exfile_enable_triggers(exfile_t *ef, CONF_SECTION *conf, char const *trigge
  *	Try to open the file. It it doesn't exist, try to
  *	create it's parent directories.
  */
-static int exfile_open_mkdir(exfile_t *ef, char const *filename, mode_t permissions)
+static int exfile_open_mkdir(exfile_t *ef, char const *filename, mode_t permissions, int flags)
 {
 	int fd;
 
-	fd = open(filename, O_RDWR | O_CREAT, permissions);
+	fd = open(filename, O_RDWR | O_CREAT | flags, permissions);
 	if (fd < 0) {
 		mode_t dirperm;
 		char *p, *dir;
@@ -249,7 +249,7 @@ static int exfile_open_mkdir(exfile_t *ef, char const *filename, mode_t permissi
 		}
 		talloc_free(dir);
 
-		fd = open(filename, O_RDWR | O_CREAT, permissions);
+		fd = open(filename, O_RDWR | O_CREAT | flags, permissions);
 		if (fd < 0) {
 			fr_strerror_printf("Failed to open file %s: %s", filename, fr_syserror(errno));
 			return -1;
@@ -287,7 +287,7 @@ int exfile_open(exfile_t *ef, REQUEST *request, char const *filename, mode_t per
 	 *	No locking: just return a new FD.
 	 */
 	if (!ef->locking) {
-		found = exfile_open_mkdir(ef, filename, permissions);
+		found = exfile_open_mkdir(ef, filename, permissions, 0);
 		if (found < 0) return -1;
 
 		(void) lseek(found, 0, SEEK_END);
@@ -398,7 +398,7 @@ int exfile_open(exfile_t *ef, REQUEST *request, char const *filename, mode_t per
 	ef->entries[i].fd = -1;
 
 reopen:
-	ef->entries[i].fd = exfile_open_mkdir(ef, filename, permissions);
+	ef->entries[i].fd = exfile_open_mkdir(ef, filename, permissions, 0);
 	if (ef->entries[i].fd < 0) goto error;
 
 	exfile_trigger_exec(ef, request, &ef->entries[i], "open");
@@ -552,3 +552,441 @@ int exfile_close(exfile_t *ef, REQUEST *request, int fd)
 	fr_strerror_printf("Attempt to unlock file which is not tracked");
 	return -1;
 }
+
+/** A file written to by a single thread, and the data waiting to be written to it
+ *
+ */
+typedef struct {
+	exfile_entry_t		entry;			//!< File descriptor and identity of the file.
+	mode_t			permissions;		//!< To use when (re-)opening the file.
+	uint8_t			*buff;			//!< Data waiting to be written.
+	size_t			used;			//!< How much of the buffer is in use.
+} exfile_thread_entry_t;
+
+struct exfile_thread_s {
+	exfile_t		*ef;			//!< Shared handle, for config and triggers.
+	fr_event_list_t		*el;			//!< Event list to run the flush timer in.
+	fr_event_timer_t const	*ev;			//!< Flush timer, armed when there is data buffered.
+	size_t			buffer_size;		//!< Size of each per-file buffer.
+	fr_time_delta_t		flush_delay;		//!< Maximum time data sits in a buffer.
+	gid_t			group;			//!< Group to set on newly opened files, or -1.
+	bool			durable;		//!< Sync each file after writing to it.
+	time_t			last_cleaned;		//!< Last time idle file descriptors were closed.
+	exfile_thread_entry_t	*entries;		//!< Files this thread writes to.
+};
+
+/*
+ *	fdatasync() skips the metadata updates fsync() does, but isn't
+ *	available everywhere.
+ */
+static inline int exfile_datasync(int fd)
+{
+#if defined(_POSIX_SYNCHRONIZED_IO) && (_POSIX_SYNCHRONIZED_IO > 0)
+	return fdatasync(fd);
+#else
+	return fsync(fd);
+#endif
+}
+
+static void exfile_thread_entry_close(exfile_thread_t *eft, REQUEST *request, exfile_thread_entry_t *entry)
+{
+	if (entry->entry.fd < 0) return;
+
+	close(entry->entry.fd);
+	entry->entry.fd = -1;
+
+	exfile_trigger_exec(eft->ef, request, &entry->entry, "close");
+}
+
+/** Open the file for an entry, or re-open it if it has been rotated
+ *
+ * Rotation is detected by comparing the filename with the file we have open,
+ * so every thread notices independently, on its next flush.
+ */
+static int exfile_thread_entry_open(exfile_thread_t *eft, REQUEST *request, exfile_thread_entry_t *entry)
+{
+	struct stat st;
+
+	if (entry->entry.fd >= 0) {
+		if ((stat(entry->entry.filename, &st) == 0) &&
+		    (st.st_dev == entry->entry.st_dev) &&
+		    (st.st_ino == entry->entry.st_ino)) return 0;
+
+		exfile_thread_entry_close(eft, request, entry);
+	}
+
+	/*
+	 *	O_APPEND means each write() lands atomically at the
+	 *	end of the file, even when other threads have their
+	 *	own descriptors for the same file.
+	 */
+	entry->entry.fd = exfile_open_mkdir(eft->ef, entry->entry.filename, entry->permissions, O_APPEND);
+	if (entry->entry.fd < 0) return -1;
+
+	if (fstat(entry->entry.fd, &st) < 0) {
+		fr_strerror_printf("Failed to stat file %s: %s", entry->entry.filename, fr_syserror(errno));
+		close(entry->entry.fd);
+		entry->entry.fd = -1;
+		return -1;
+	}
+
+	entry->entry.st_dev = st.st_dev;
+	entry->entry.st_ino = st.st_ino;
+
+	if ((eft->group != (gid_t) -1) && (fchown(entry->entry.fd, -1, eft->group) < 0)) {
+		ROPTIONAL(RWARN, WARN, "Unable to change system group of \"%s\": %s",
+			  entry->entry.filename, fr_syserror(errno));
+	}
+
+	exfile_trigger_exec(eft->ef, request, &entry->entry, "open");
+
+	return 0;
+}
+
+/** Write out the buffered data for an entry, with a single write()
+ *
+ * If the exfile handle was created with locking enabled, the file is locked
+ * for the duration of the write, so that readers such as the detail file
+ * reader never see a partial entry.
+ */
+static int exfile_thread_entry_flush(exfile_thread_t *eft, REQUEST *request, exfile_thread_entry_t *entry)
+{
+	int		tries;
+	size_t		done = 0;
+	ssize_t		slen;
+	struct stat	st;
+	int		ret = 0;
+
+	if (!entry->used) return 0;
+
+	for (tries = 0; tries < MAX_TRY_LOCK; tries++) {
+		if (exfile_thread_entry_open(eft, request, entry) < 0) goto error;
+
+		if (!eft->ef->locking) break;
+
+		/*
+		 *	Lock from the start of the file.  As with
+		 *	exfile_open(), failing to get the lock means a
+		 *	reader has probably renamed the file, so we
+		 *	re-open it and try again.
+		 */
+		(void) lseek(entry->entry.fd, 0, SEEK_SET);
+		if (rad_lockfd_nonblock(entry->entry.fd, 0) < 0) {
+			if (errno != EAGAIN) {
+				fr_strerror_printf("Failed to lock file %s: %s",
+						   entry->entry.filename, fr_syserror(errno));
+				goto error;
+			}
+			exfile_thread_entry_close(eft, request, entry);
+			continue;
+		}
+
+		/*
+		 *	The file may have been renamed or deleted before
+		 *	we got the lock.  If so, re-open it.
+		 */
+		if ((stat(entry->entry.filename, &st) == 0) &&
+		    (st.st_dev == entry->entry.st_dev) &&
+		    (st.st_ino == entry->entry.st_ino)) break;
+
+		(void) rad_unlockfd(entry->entry.fd, 0);
+		exfile_thread_entry_close(eft, request, entry);
+	}
+
+	if (tries >= MAX_TRY_LOCK) {
+		fr_strerror_printf("Failed to lock file %s: too many tries", entry->entry.filename);
+		goto error;
+	}
+
+	if (eft->ef->locking) exfile_trigger_exec(eft->ef, request, &entry->entry, "reserve");
+
+	while (done < entry->used) {
+		slen = write(entry->entry.fd, entry->buff + done, entry->used - done);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			fr_strerror_printf("Failed writing to file %s: %s", entry->entry.filename, fr_syserror(errno));
+			ret = -1;
+			break;
+		}
+		done += slen;
+	}
+
+	/*
+	 *	One sync covers every entry in the buffer, so the
+	 *	cost is shared by all of them.
+	 */
+	if (eft->durable && (ret == 0) && (exfile_datasync(entry->entry.fd) < 0)) {
+		fr_strerror_printf("Failed syncing file %s: %s", entry->entry.filename, fr_syserror(errno));
+		ret = -1;
+	}
+
+	if (eft->ef->locking) {
+		(void) lseek(entry->entry.fd, 0, SEEK_SET);
+		(void) rad_unlockfd(entry->entry.fd, 0);
+		exfile_trigger_exec(eft->ef, request, &entry->entry, "release");
+	}
+
+	/*
+	 *	Whatever happened, the data is gone.  Keeping it
+	 *	around would just mean the buffer grows without
+	 *	bound when the disk is full.
+	 */
+	entry->used = 0;
+	entry->entry.last_used = time(NULL);
+
+	return ret;
+
+error:
+	entry->used = 0;
+	return -1;
+}
+
+static void exfile_thread_cleanup(exfile_thread_t *eft, REQUEST *request, time_t now)
+{
+	uint32_t i;
+
+	for (i = 0; i < eft->ef->max_entries; i++) {
+		exfile_thread_entry_t *entry = &eft->entries[i];
+
+		if (!entry->entry.filename || entry->used) continue;
+		if ((entry->entry.last_used + eft->ef->max_idle) >= now) continue;
+
+		exfile_thread_entry_close(eft, request, entry);
+		entry->entry.hash = 0;
+		TALLOC_FREE(entry->entry.filename);
+	}
+
+	eft->last_cleaned = now;
+}
+
+/** Write out all buffered data for a thread
+ *
+ * @param[in] eft	to flush.
+ * @param[in] request	The current request.  May be NULL.
+ * @return
+ *	- 0 on success.
+ *	- -1 if one or more files could not be written to.
+ */
+int exfile_thread_flush(exfile_thread_t *eft, REQUEST *request)
+{
+	uint32_t	i;
+	int		ret = 0;
+	time_t		now;
+
+	if (eft->ev) fr_event_timer_delete(&eft->ev);
+
+	for (i = 0; i < eft->ef->max_entries; i++) {
+		if (exfile_thread_entry_flush(eft, request, &eft->entries[i]) < 0) {
+			ROPTIONAL(RPERROR, PERROR, "Failed flushing buffered data");
+			ret = -1;
+		}
+	}
+
+	now = time(NULL);
+	if (now > (eft->last_cleaned + 1)) exfile_thread_cleanup(eft, request, now);
+
+	return ret;
+}
+
+static void _exfile_thread_flush_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	exfile_thread_t *eft = talloc_get_type_abort(uctx, exfile_thread_t);
+
+	eft->ev = NULL;
+	(void) exfile_thread_flush(eft, NULL);
+}
+
+static int _exfile_thread_free(exfile_thread_t *eft)
+{
+	uint32_t i;
+
+	(void) exfile_thread_flush(eft, NULL);
+
+	for (i = 0; i < eft->ef->max_entries; i++) {
+		if (!eft->entries[i].entry.filename) continue;
+
+		exfile_thread_entry_close(eft, NULL, &eft->entries[i]);
+	}
+
+	return 0;
+}
+
+/** Allocate a handle which buffers writes for a single thread
+ *
+ * Each thread owns its own file descriptors and write buffers, so writing
+ * an entry is just a copy into memory.  Buffered data is written out when
+ * a buffer fills, or when flush_delay expires, whichever comes first.
+ *
+ * The entry limit, idle timeout, locking and triggers are taken from the
+ * shared exfile handle.
+ *
+ * @param[in] ctx		to allocate the handle in.  Usually the module's thread instance.
+ * @param[in] ef		shared handle returned from exfile_init().
+ * @param[in] el		event list serviced by this thread.
+ * @param[in] buffer_size	how much data to buffer for each file.
+ * @param[in] flush_delay	maximum time data sits in a buffer before being written.
+ * @param[in] group		to set on files this thread opens, or -1 to leave unchanged.
+ * @return
+ *	- new handle.
+ *	- NULL on error.
+ */
+exfile_thread_t *exfile_thread_alloc(TALLOC_CTX *ctx, exfile_t *ef, fr_event_list_t *el,
+				     size_t buffer_size, fr_time_delta_t flush_delay, gid_t group)
+{
+	exfile_thread_t	*eft;
+	uint32_t	i;
+
+	eft = talloc_zero(ctx, exfile_thread_t);
+	if (!eft) return NULL;
+
+	eft->ef = ef;
+	eft->el = el;
+	eft->buffer_size = buffer_size;
+	eft->flush_delay = flush_delay;
+	eft->group = group;
+
+	eft->entries = talloc_zero_array(eft, exfile_thread_entry_t, ef->max_entries);
+	if (!eft->entries) {
+		talloc_free(eft);
+		return NULL;
+	}
+
+	for (i = 0; i < ef->max_entries; i++) eft->entries[i].entry.fd = -1;
+
+	talloc_set_destructor(eft, _exfile_thread_free);
+
+	return eft;
+}
+
+/** Make buffered data durable when it's written out
+ *
+ * When enabled, every write of a buffer is followed by an fdatasync() of
+ * the file, and the write is only successful if the sync is.  Once
+ * #exfile_thread_flush returns 0, everything previously passed to
+ * #exfile_thread_writev is on stable storage.
+ *
+ * @param[in] eft	to change.
+ * @param[in] durable	whether to sync files after writing to them.
+ */
+void exfile_thread_durable(exfile_thread_t *eft, bool durable)
+{
+	eft->durable = durable;
+}
+
+/** Find the entry for a file, or create one
+ *
+ * If all entries are in use, the least recently flushed one is written
+ * out and closed.
+ */
+static exfile_thread_entry_t *exfile_thread_entry_find(exfile_thread_t *eft, REQUEST *request,
+						       char const *filename, mode_t permissions)
+{
+	uint32_t		i, hash;
+	exfile_thread_entry_t	*entry, *unused = NULL, *oldest = NULL;
+
+	hash = fr_hash_string(filename);
+
+	for (i = 0; i < eft->ef->max_entries; i++) {
+		entry = &eft->entries[i];
+
+		if (!entry->entry.filename) {
+			if (!unused) unused = entry;
+			continue;
+		}
+
+		if ((entry->entry.hash == hash) && (strcmp(entry->entry.filename, filename) == 0)) return entry;
+
+		if (!oldest || (entry->entry.last_used < oldest->entry.last_used)) oldest = entry;
+	}
+
+	if (!unused) {
+		if (exfile_thread_entry_flush(eft, request, oldest) < 0) {
+			RPERROR("Failed flushing buffered data");
+		}
+		exfile_thread_entry_close(eft, request, oldest);
+		TALLOC_FREE(oldest->entry.filename);
+		unused = oldest;
+	}
+
+	entry = unused;
+	entry->entry.hash = hash;
+	entry->entry.fd = -1;
+	entry->entry.last_used = time(NULL);
+	entry->permissions = permissions;
+	MEM(entry->entry.filename = talloc_typed_strdup(eft->entries, filename));
+	if (!entry->buff) MEM(entry->buff = talloc_array(eft->entries, uint8_t, eft->buffer_size));
+
+	return entry;
+}
+
+/** Buffer data to be written to a file
+ *
+ * The data is only copied into the thread's buffer for the file.  It is written
+ * out as a single unit, so each call to this function is never interleaved with
+ * data written by other threads.
+ *
+ * @param[in] eft		thread handle returned from exfile_thread_alloc().
+ * @param[in] request		The current request.
+ * @param[in] filename		the file to write to.
+ * @param[in] permissions	to use if the file needs to be created.
+ * @param[in] vector		data to write.
+ * @param[in] iovcnt		number of elements in vector.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int exfile_thread_writev(exfile_thread_t *eft, REQUEST *request, char const *filename, mode_t permissions,
+			 struct iovec const *vector, int iovcnt)
+{
+	exfile_thread_entry_t	*entry;
+	size_t			len = 0;
+	int			i;
+
+	for (i = 0; i < iovcnt; i++) len += vector[i].iov_len;
+	if (!len) return 0;
+
+	entry = exfile_thread_entry_find(eft, request, filename, permissions);
+
+	/*
+	 *	Not enough room, write out what's already there.
+	 */
+	if ((entry->used + len) > eft->buffer_size) {
+		if (exfile_thread_entry_flush(eft, request, entry) < 0) {
+			RPERROR("Failed flushing buffered data");
+		}
+
+		/*
+		 *	Too big to buffer.  Grow the buffer, so the
+		 *	data still goes out in one write().
+		 */
+		if (len > eft->buffer_size) {
+			MEM(entry->buff = talloc_realloc(eft->entries, entry->buff, uint8_t, len));
+		}
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(entry->buff + entry->used, vector[i].iov_base, vector[i].iov_len);
+		entry->used += vector[i].iov_len;
+	}
+
+	/*
+	 *	Oversized entries go out immediately, and the buffer
+	 *	goes back to its normal size.
+	 */
+	if (entry->used > eft->buffer_size) {
+		int ret;
+
+		ret = exfile_thread_entry_flush(eft, request, entry);
+		MEM(entry->buff = talloc_realloc(eft->entries, entry->buff, uint8_t, eft->buffer_size));
+		return ret;
+	}
+
+	if (!eft->ev &&
+	    (fr_event_timer_in(eft, eft->el, &eft->ev, eft->flush_delay, _exfile_thread_flush_timer, eft) < 0)) {
+		RPERROR("Failed inserting flush timer, writing immediately");
+		return exfile_thread_entry_flush(eft, request, entry);
+	}
+
+	return 0;
+}
@@ -26,6 +26,9 @@
 RCSIDH(exfile_h, "$Id$")
 
 #include <freeradius-devel/server/request.h>
+#include <freeradius-devel/util/event.h>
+
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -45,6 +48,21 @@ int		exfile_open(exfile_t *lf, REQUEST *request, char const *filename,
 
 int		exfile_close(exfile_t *lf, REQUEST *request, int fd);
 
+/*
+ *	One thread buffering writes to one or more files.
+ */
+typedef struct exfile_thread_s exfile_thread_t;
+
+exfile_thread_t	*exfile_thread_alloc(TALLOC_CTX *ctx, exfile_t *ef, fr_event_list_t *el,
+				     size_t buffer_size, fr_time_delta_t flush_delay, gid_t group);
+
+int		exfile_thread_writev(exfile_thread_t *eft, REQUEST *request, char const *filename,
+				     mode_t permissions, struct iovec const *vector, int iovcnt);
+
+int		exfile_thread_flush(exfile_thread_t *eft, REQUEST *request);
+
+void		exfile_thread_durable(exfile_thread_t *eft, bool durable);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,527 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file handover.c
+ * @brief Pass listener sockets from a running server to its replacement.
+ *
+ * When "handover_socket" is set, the server listens on a UNIX socket
+ * for a new server process.  The new process instantiates all of its
+ * modules, and then connects to the socket.  The running server sends
+ * it every listener socket it has registered, using SCM_RIGHTS.  The
+ * new process adopts the sockets which match its own listeners, instead
+ * of opening new ones, and tells the running server once it's ready.
+ * The running server then stops reading packets, finishes the requests
+ * it already has, and exits.
+ *
+ * Because the sockets are never closed, packets which arrive during the
+ * restart wait in the socket buffers instead of being dropped.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/handover.h>
+#include <freeradius-devel/server/main_loop.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/socket.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define HANDOVER_KEY_LEN	(128)
+
+/** What goes over the UNIX socket for each listener
+ *
+ * The socket itself is sent as ancillary data.  A record with an
+ * empty key ends the list.
+ */
+typedef struct {
+	char		key[HANDOVER_KEY_LEN];	//!< protocol, address, port, and interface.
+} handover_record_t;
+
+typedef struct {
+	char		key[HANDOVER_KEY_LEN];
+	int		fd;
+} handover_fd_t;
+
+static handover_fd_t	*handover_ours;			//!< Our listeners, to give to the next server.
+static handover_fd_t	*handover_theirs;		//!< Listeners from the previous server.
+
+static int		handover_prev = -1;		//!< Connection to the previous server.
+static int		handover_listen_fd = -1;	//!< Where the next server connects to us.
+static int		handover_next = -1;		//!< Connection to the next server.
+static char		*handover_path;			//!< Of our UNIX socket.
+static fr_event_list_t	*handover_el;
+static bool		handover_complete;		//!< The next server has taken over.
+
+static int handover_key(char out[HANDOVER_KEY_LEN], int proto, fr_ipaddr_t const *ipaddr, uint16_t port,
+			char const *interface)
+{
+	char	buffer[FR_IPADDR_STRLEN];
+	int	len;
+
+	fr_inet_ntop(buffer, sizeof(buffer), ipaddr);
+
+	len = snprintf(out, HANDOVER_KEY_LEN, "%i %s %u %s", proto, buffer, port, interface ? interface : "*");
+	if ((len < 0) || (len >= HANDOVER_KEY_LEN)) {
+		fr_strerror_printf("Interface name is too long");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int handover_fd_append(handover_fd_t **array, char const *key, int fd)
+{
+	size_t		num = talloc_array_length(*array);
+	handover_fd_t	*new;
+
+	new = talloc_realloc(NULL, *array, handover_fd_t, num + 1);
+	if (!new) {
+		fr_strerror_printf("Failed allocating memory");
+		return -1;
+	}
+
+	strlcpy(new[num].key, key, sizeof(new[num].key));
+	new[num].fd = fd;
+	*array = new;
+
+	return 0;
+}
+
+/** Register a listener socket, so it can be given to the next server
+ *
+ * @param[in] proto	IPPROTO_UDP or IPPROTO_TCP.
+ * @param[in] ipaddr	the socket is bound to.
+ * @param[in] port	the socket is bound to.
+ * @param[in] interface	the socket is bound to, or NULL.
+ * @param[in] fd	of the socket.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_handover_fd_add(int proto, fr_ipaddr_t const *ipaddr, uint16_t port, char const *interface, int fd)
+{
+	char key[HANDOVER_KEY_LEN];
+
+	if (handover_key(key, proto, ipaddr, port, interface) < 0) return -1;
+
+	return handover_fd_append(&handover_ours, key, fd);
+}
+
+/** Find a socket from the previous server, which is bound to the given address
+ *
+ * The socket is removed from the list of sockets we received, and now
+ * belongs to the caller.  If the previous server had several sockets
+ * bound to the same address, they're returned in the order it sent them.
+ *
+ * @param[in] proto	IPPROTO_UDP or IPPROTO_TCP.
+ * @param[in] ipaddr	the socket should be bound to.
+ * @param[in] port	the socket should be bound to.
+ * @param[in] interface	the socket should be bound to, or NULL.
+ * @return
+ *	- >= 0 the socket.
+ *	- -1 if there is no matching socket.
+ */
+int fr_handover_fd_find(int proto, fr_ipaddr_t const *ipaddr, uint16_t port, char const *interface)
+{
+	char	key[HANDOVER_KEY_LEN];
+	size_t	i, num = talloc_array_length(handover_theirs);
+	int	fd;
+
+	if (!num) return -1;
+
+	if (handover_key(key, proto, ipaddr, port, interface) < 0) return -1;
+
+	for (i = 0; i < num; i++) {
+		if (strcmp(handover_theirs[i].key, key) != 0) continue;
+
+		fd = handover_theirs[i].fd;
+		memmove(&handover_theirs[i], &handover_theirs[i + 1], (num - i - 1) * sizeof(handover_theirs[0]));
+		handover_theirs = talloc_realloc(NULL, handover_theirs, handover_fd_t, num - 1);
+
+		DEBUG("Using listener socket %s from the previous server", key);
+		return fd;
+	}
+
+	return -1;
+}
+
+static int handover_send(int sockfd, char const *key, int fd)
+{
+	handover_record_t	record;
+	struct msghdr		msg;
+	struct iovec		iov;
+	struct cmsghdr		*cmsg;
+	union {
+		struct cmsghdr	align;
+		uint8_t		buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	memset(&record, 0, sizeof(record));
+	strlcpy(record.key, key, sizeof(record.key));
+
+	iov.iov_base = &record;
+	iov.iov_len = sizeof(record);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (fd >= 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	}
+
+	if (sendmsg(sockfd, &msg, 0) != (ssize_t) sizeof(record)) {
+		fr_strerror_printf("Failed sending listener socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int handover_recv(int sockfd, char key[HANDOVER_KEY_LEN], int *fd_p)
+{
+	handover_record_t	record;
+	size_t			total = 0;
+	ssize_t			rcode;
+	struct msghdr		msg;
+	struct iovec		iov;
+	struct cmsghdr		*cmsg;
+	union {
+		struct cmsghdr	align;
+		uint8_t		buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	*fd_p = -1;
+
+	/*
+	 *	Stream sockets can split the record.  The descriptor
+	 *	arrives with the first part of it.
+	 */
+	while (total < sizeof(record)) {
+		iov.iov_base = ((uint8_t *) &record) + total;
+		iov.iov_len = sizeof(record) - total;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+
+		rcode = recvmsg(sockfd, &msg, 0);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			fr_strerror_printf("Failed reading listener socket: %s", fr_syserror(errno));
+		error:
+			if (*fd_p >= 0) close(*fd_p);
+			*fd_p = -1;
+			return -1;
+		}
+
+		if (rcode == 0) {
+			fr_strerror_printf("Running server closed the connection");
+			goto error;
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS) ||
+			    (cmsg->cmsg_len < CMSG_LEN(sizeof(int)))) continue;
+
+			if (*fd_p >= 0) close(*fd_p);
+			memcpy(fd_p, CMSG_DATA(cmsg), sizeof(*fd_p));
+		}
+
+		total += rcode;
+	}
+
+	record.key[sizeof(record.key) - 1] = '\0';
+	strlcpy(key, record.key, HANDOVER_KEY_LEN);
+
+	return 0;
+}
+
+/** Get the listener sockets from a running server
+ *
+ * This should be called after the modules have been instantiated, and
+ * before the listeners are opened.
+ *
+ * @param[in] path	of the running server's UNIX socket.
+ * @return
+ *	- 1 if we received the sockets.
+ *	- 0 if there is no running server.
+ *	- -1 on failure.
+ */
+int fr_handover_receive(char const *path)
+{
+	int	sockfd, fd;
+	char	key[HANDOVER_KEY_LEN];
+
+	/*
+	 *	No server is running, or it didn't exit cleanly.
+	 *	Either way, we open our own sockets.
+	 */
+	sockfd = fr_socket_client_unix(path, false);
+	if (sockfd < 0) {
+		DEBUG("Not taking over listeners: %s", fr_strerror());
+		return 0;
+	}
+
+	while (true) {
+		if (handover_recv(sockfd, key, &fd) < 0) {
+		error:
+			close(sockfd);
+			fr_handover_complete();
+			return -1;
+		}
+
+		if (!key[0]) break;
+
+		if (fd < 0) {
+			fr_strerror_printf("Running server didn't send a socket for %s", key);
+			goto error;
+		}
+
+		if (handover_fd_append(&handover_theirs, key, fd) < 0) {
+			close(fd);
+			goto error;
+		}
+	}
+
+	handover_prev = sockfd;
+
+	INFO("Received %zu listener sockets from the running server", talloc_array_length(handover_theirs));
+
+	return 1;
+}
+
+/** Tell the previous server that we're ready
+ *
+ * Any sockets from the previous server which we didn't use are closed.
+ * The previous server then stops reading packets, and exits once it
+ * has finished the requests it's already processing.
+ */
+void fr_handover_complete(void)
+{
+	size_t i;
+
+	for (i = 0; i < talloc_array_length(handover_theirs); i++) {
+		DEBUG("Closing unused listener socket %s from the previous server", handover_theirs[i].key);
+		close(handover_theirs[i].fd);
+	}
+	TALLOC_FREE(handover_theirs);
+
+	if (handover_prev < 0) return;
+
+	if (write(handover_prev, &(uint8_t){ 0x01 }, 1) < 0) {
+		WARN("Failed telling the previous server to stop: %s", fr_syserror(errno));
+	}
+
+	close(handover_prev);
+	handover_prev = -1;
+}
+
+static void handover_next_close(void)
+{
+	if (handover_next < 0) return;
+
+	(void) fr_event_fd_delete(handover_el, handover_next, FR_EVENT_FILTER_IO);
+	close(handover_next);
+	handover_next = -1;
+}
+
+/** The next server has either taken over, or gone away
+ *
+ */
+static void handover_ack(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, UNUSED void *uctx)
+{
+	uint8_t		c;
+	ssize_t		rcode;
+
+	rcode = read(fd, &c, sizeof(c));
+	if ((rcode < 0) && ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK))) return;
+
+	handover_next_close();
+
+	if (rcode <= 0) {
+		WARN("New server exited before taking over the listeners, continuing");
+		return;
+	}
+
+	INFO("New server has taken over the listeners, finishing outstanding requests");
+	handover_complete = true;
+	main_loop_signal_raise(RADIUS_SIGNAL_SELF_TERM);
+}
+
+static void handover_ack_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+			       UNUSED int fd_errno, UNUSED void *uctx)
+{
+	handover_next_close();
+
+	WARN("New server exited before taking over the listeners, continuing");
+}
+
+/** A new server has connected, send it our listeners
+ *
+ */
+static void handover_accept(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, UNUSED void *uctx)
+{
+	int	sockfd;
+	size_t	i, num = talloc_array_length(handover_ours);
+
+	sockfd = accept(fd, NULL, NULL);
+	if (sockfd < 0) return;
+
+	if (handover_next >= 0) {
+		WARN("Refusing handover to a second new server");
+		close(sockfd);
+		return;
+	}
+
+	if (fr_blocking(sockfd) < 0) {
+	error:
+		PWARN("Failed handing over listeners");
+		close(sockfd);
+		return;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (handover_send(sockfd, handover_ours[i].key, handover_ours[i].fd) < 0) goto error;
+	}
+	if (handover_send(sockfd, "", -1) < 0) goto error;
+
+	if (fr_event_fd_insert(NULL, handover_el, sockfd, handover_ack, NULL, handover_ack_error, NULL) < 0) {
+		goto error;
+	}
+	handover_next = sockfd;
+
+	INFO("Sent %zu listener sockets to a new server, waiting for it to start", num);
+}
+
+/** Listen for a new server which wants to take over our listeners
+ *
+ * Any existing UNIX socket at the path is replaced.
+ *
+ * @param[in] el	to run the UNIX socket in.
+ * @param[in] path	of the UNIX socket.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_handover_listen(fr_event_list_t *el, char const *path)
+{
+	int			sockfd;
+	size_t			len;
+	struct sockaddr_un	sun;
+
+	len = strlen(path);
+	if (len >= sizeof(sun.sun_path)) {
+		fr_strerror_printf("Path too long, maximum length is %zu", sizeof(sun.sun_path) - 1);
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, path, len + 1);
+
+	sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sockfd < 0) {
+		fr_strerror_printf("Failed creating UNIX socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	The previous server's socket, if any, is no longer
+	 *	needed.
+	 */
+	(void) unlink(path);
+
+	if (bind(sockfd, (struct sockaddr *) &sun, SUN_LEN(&sun)) < 0) {
+		fr_strerror_printf("Failed binding to %s: %s", path, fr_syserror(errno));
+	error:
+		close(sockfd);
+		return -1;
+	}
+
+	if (chmod(path, S_IRUSR | S_IWUSR) < 0) {
+		fr_strerror_printf("Failed setting permissions on %s: %s", path, fr_syserror(errno));
+		(void) unlink(path);
+		goto error;
+	}
+
+	if ((listen(sockfd, 1) < 0) || (fr_nonblock(sockfd) < 0) ||
+	    (fcntl(sockfd, F_SETFD, FD_CLOEXEC) < 0)) {
+		fr_strerror_printf("Failed listening on %s: %s", path, fr_syserror(errno));
+		(void) unlink(path);
+		goto error;
+	}
+
+	if (fr_event_fd_insert(NULL, el, sockfd, handover_accept, NULL, NULL, NULL) < 0) {
+		(void) unlink(path);
+		goto error;
+	}
+
+	handover_listen_fd = sockfd;
+	handover_el = el;
+	handover_path = talloc_strdup(NULL, path);
+
+	return 0;
+}
+
+/** Whether a new server has taken over our listeners
+ *
+ * If so, the new server owns the PID file, and the UNIX socket.
+ */
+bool fr_handover_done(void)
+{
+	return handover_complete;
+}
+
+/** Stop listening for a new server
+ *
+ */
+void fr_handover_free(void)
+{
+	handover_next_close();
+
+	if (handover_listen_fd >= 0) {
+		(void) fr_event_fd_delete(handover_el, handover_listen_fd, FR_EVENT_FILTER_IO);
+		close(handover_listen_fd);
+		handover_listen_fd = -1;
+
+		if (!handover_complete) (void) unlink(handover_path);
+	}
+
+	TALLOC_FREE(handover_path);
+	TALLOC_FREE(handover_ours);
+	fr_handover_complete();
+}
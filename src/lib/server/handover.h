@@ -0,0 +1,51 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/handover.h
+ * @brief Pass listener sockets from a running server to its replacement.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(handover_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/inet.h>
+
+int	fr_handover_fd_add(int proto, fr_ipaddr_t const *ipaddr, uint16_t port, char const *interface, int fd);
+
+int	fr_handover_fd_find(int proto, fr_ipaddr_t const *ipaddr, uint16_t port, char const *interface);
+
+int	fr_handover_receive(char const *path);
+
+void	fr_handover_complete(void);
+
+int	fr_handover_listen(fr_event_list_t *el, char const *path);
+
+bool	fr_handover_done(void);
+
+void	fr_handover_free(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,6 +3,7 @@ TARGET		:= libfreeradius-server.a
 SOURCES	:= \
 	base.c \
 	auth.c \
+	cf_cache.c \
 	cf_file.c \
 	cf_parse.c \
 	cf_util.c \
@@ -15,25 +16,33 @@ SOURCES	:= \
 	dependency.c \
 	dl_module.c \
 	exec.c \
+	exec_pool.c \
 	exfile.c \
+	handover.c \
 	log.c \
 	main_config.c \
 	main_loop.c \
 	map_proc.c \
 	map.c \
+	metrics.c \
 	module.c \
+	offload.c \
 	paircmp.c \
 	pairmove.c \
 	password.c \
 	pool.c \
+	radutmp_db.c \
 	rcode.c \
+	reload.c \
 	regex.c \
 	request_data.c \
 	request.c \
+	resolver.c \
 	snmp.c \
 	state.c \
 	stats.c \
 	tmpl.c \
+	trace.c \
 	trigger.c \
 	trunk.c \
 	users_file.c \
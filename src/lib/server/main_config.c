@@ -25,6 +25,7 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/io/schedule.h>
 #include <freeradius-devel/server/cf_file.h>
 #include <freeradius-devel/server/cond.h>
 #include <freeradius-devel/server/client.h>
@@ -85,6 +86,8 @@ static int talloc_pool_size_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF
 
 static int max_request_time_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 
+static int ring_buffer_size_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
+
 static int name_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 
 #ifdef HAVE_SETUID
@@ -142,10 +145,18 @@ static const CONF_PARSER log_config[] = {
 	{ FR_CONF_OFFSET("line_number", FR_TYPE_BOOL, main_config_t, log_line_number) },
 	{ FR_CONF_OFFSET("timestamp", FR_TYPE_BOOL, main_config_t, log_timestamp) },
 	{ FR_CONF_OFFSET("use_utc", FR_TYPE_BOOL, main_config_t, log_dates_utc) },
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, main_config_t, log_async), .dflt = "no" },
+	{ FR_CONF_OFFSET("async_buffer_size", FR_TYPE_SIZE, main_config_t, log_async_buffer_size), .dflt = "1M" },
 	CONF_PARSER_TERMINATOR
 };
 
 
+static const CONF_PARSER trace_config[] = {
+	{ FR_CONF_OFFSET("sample_rate", FR_TYPE_UINT32, main_config_t, trace_sample_rate), .dflt = "0" },
+	{ FR_CONF_OFFSET("file", FR_TYPE_STRING, main_config_t, trace_file), .dflt = "${logdir}/trace.json" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER resources[] = {
 	/*
 	 *	Don't set a default here.  It's set in the code, below.  This means that
@@ -158,6 +169,15 @@ static const CONF_PARSER resources[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER worker_pool_config[] = {
+	{ FR_CONF_OFFSET("num_workers", FR_TYPE_UINT32, fr_schedule_pool_config_t, max_workers), .dflt = STRINGIFY(1),
+	  .func = num_workers_parse },
+	{ FR_CONF_OFFSET("max_requests", FR_TYPE_UINT32, fr_schedule_pool_config_t, max_requests), .dflt = "0" },
+	{ FR_CONF_OFFSET("worker_cpus", FR_TYPE_STRING, fr_schedule_pool_config_t, worker_cpus) },
+
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER thread_config[] = {
 	{ FR_CONF_OFFSET("num_networks", FR_TYPE_UINT32, main_config_t, max_networks), .dflt = STRINGIFY(1),
 	  .func = num_networks_parse },
@@ -166,6 +186,27 @@ static const CONF_PARSER thread_config[] = {
 
 	{ FR_CONF_OFFSET("stats_interval | FR_TYPE_HIDDEN", FR_TYPE_TIME_DELTA, main_config_t, stats_interval), },
 
+	{ FR_CONF_OFFSET("work_stealing", FR_TYPE_BOOL, main_config_t, work_stealing), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("spin_time", FR_TYPE_TIME_DELTA, main_config_t, spin_time) },
+
+	{ FR_CONF_OFFSET("max_queue_delay", FR_TYPE_TIME_DELTA, main_config_t, max_queue_delay) },
+
+	{ FR_CONF_OFFSET("network_cpus", FR_TYPE_STRING, main_config_t, network_cpus) },
+	{ FR_CONF_OFFSET("worker_cpus", FR_TYPE_STRING, main_config_t, worker_cpus) },
+
+	{ FR_CONF_OFFSET("ring_buffer_size", FR_TYPE_SIZE, main_config_t, ring_buffer_size), .func = ring_buffer_size_parse },
+	{ FR_CONF_OFFSET("huge_pages", FR_TYPE_BOOL, main_config_t, huge_pages), .dflt = "no" },
+	{ FR_CONF_OFFSET("lock_memory", FR_TYPE_BOOL, main_config_t, lock_memory), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("tsc_clock", FR_TYPE_BOOL, main_config_t, tsc_clock), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("instantiate_threads", FR_TYPE_UINT32, main_config_t, instantiate_threads), .dflt = STRINGIFY(1) },
+
+	{ FR_CONF_OFFSET("worker_pool", FR_TYPE_SUBSECTION | FR_TYPE_MULTI | FR_TYPE_OK_MISSING, main_config_t, worker_pools),
+	  .subcs_size = sizeof(fr_schedule_pool_config_t), .subcs_type = "fr_schedule_pool_config_t",
+	  .subcs = (void const *) worker_pool_config, .ident2 = CF_IDENT_ANY },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -188,11 +229,17 @@ static const CONF_PARSER server_config[] = {
 	{ FR_CONF_OFFSET("hostname_lookups", FR_TYPE_BOOL, main_config_t, hostname_lookups), .dflt = "yes", .func = hostname_lookups_parse },
 	{ FR_CONF_OFFSET("max_request_time", FR_TYPE_TIME_DELTA, main_config_t, max_request_time), .dflt = STRINGIFY(MAX_REQUEST_TIME), .func = max_request_time_parse },
 	{ FR_CONF_OFFSET("pidfile", FR_TYPE_STRING, main_config_t, pid_file), .dflt = "${run_dir}/radiusd.pid"},
+	{ FR_CONF_OFFSET("handover_socket", FR_TYPE_STRING, main_config_t, handover_socket) },
+	{ FR_CONF_OFFSET("startup_report", FR_TYPE_STRING, main_config_t, startup_report) },
 
 	{ FR_CONF_OFFSET("debug_level", FR_TYPE_UINT32 | FR_TYPE_HIDDEN, main_config_t, debug_level), .dflt = "0" },
 
 	{ FR_CONF_POINTER("log", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) log_config },
 
+	{ FR_CONF_POINTER("trace", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) trace_config },
+
+	{ FR_CONF_OFFSET("resolver", FR_TYPE_SUBSECTION, main_config_t, resolver), .subcs = (void const *) fr_resolver_config },
+
 	{ FR_CONF_POINTER("resources", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) resources },
 
 	{ FR_CONF_POINTER("thread", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) thread_config, .ident2 = CF_IDENT_ANY },
@@ -321,6 +368,23 @@ static int talloc_pool_size_parse(TALLOC_CTX *ctx, void *out, void *parent,
 	return 0;
 }
 
+static int ring_buffer_size_parse(TALLOC_CTX *ctx, void *out, void *parent,
+				  CONF_ITEM *ci, CONF_PARSER const *rule)
+{
+	int	ret;
+	size_t	value;
+
+	if ((ret = cf_pair_parse_value(ctx, out, parent, ci, rule)) < 0) return ret;
+
+	memcpy(&value, out, sizeof(value));
+
+	FR_SIZE_BOUND_CHECK("thread.ring_buffer_size", value, <=, (size_t)(1 << 30));
+
+	memcpy(out, &value, sizeof(value));
+
+	return 0;
+}
+
 static int max_request_time_parse(TALLOC_CTX *ctx, void *out, void *parent,
 				  CONF_ITEM *ci, CONF_PARSER const *rule)
 {
@@ -436,7 +500,8 @@ static int num_networks_parse(TALLOC_CTX *ctx, void *out, void *parent,
 
 	memcpy(&value, out, sizeof(value));
 
-	FR_INTEGER_BOUND_CHECK("thread.num_networks", value, ==, 1);
+	FR_INTEGER_BOUND_CHECK("thread.num_networks", value, >=, 1);
+	FR_INTEGER_BOUND_CHECK("thread.num_networks", value, <=, 32);
 
 	memcpy(out, &value, sizeof(value));
 
@@ -1019,11 +1084,38 @@ do {\
 
 	/* Read the configuration file */
 	snprintf(buffer, sizeof(buffer), "%.200s/%.50s.conf", config->raddb_dir, config->name);
+
+	/*
+	 *	Use the cached configuration if it's up to date.
+	 *	Otherwise parse the files, and update the cache.
+	 */
+	if (config->config_cache) {
+		switch (cf_file_cache_load(cs, buffer, config->config_cache)) {
+		case 0:
+			DEBUG("Loaded configuration from cache %s", config->config_cache);
+			goto cached;
+
+		case -1:
+			DEBUG("Not using configuration cache: %s", fr_strerror());
+			break;
+
+		default:
+			PERROR("Failed loading configuration cache %s", config->config_cache);
+			goto failure;
+		}
+	}
+
 	if (cf_file_read(cs, buffer) < 0) {
 		ERROR("Error reading or parsing %s", buffer);
 		goto failure;
 	}
 
+	if (config->config_cache && (cf_file_cache_write(cs, config->config_cache) < 0)) {
+		PWARN("Failed writing configuration cache");
+	}
+
+cached:
+
 	/*
 	 *	Do any fixups here that might be used in references
 	 */
@@ -1189,6 +1281,34 @@ do {\
 	DEBUG("Parsing main configuration.");
 	if (cf_section_parse(config, config, cs) < 0) goto failure;
 
+	/*
+	 *	Worker pools are named by their sections, which
+	 *	virtual servers and listeners refer to.
+	 */
+	if (config->worker_pools) {
+		CONF_SECTION	*thread_cs, *pool_cs = NULL;
+		size_t		i;
+
+		thread_cs = cf_section_find(cs, "thread", CF_IDENT_ANY);
+		for (i = 0; i < talloc_array_length(config->worker_pools); i++) {
+			pool_cs = cf_section_find_next(thread_cs, pool_cs, "worker_pool", CF_IDENT_ANY);
+			if (!fr_cond_assert(pool_cs)) goto failure;
+
+			config->worker_pools[i]->name = cf_section_name2(pool_cs);
+			if (!config->worker_pools[i]->name) {
+				cf_log_err(pool_cs, "A worker_pool section must have a name");
+				goto failure;
+			}
+		}
+	}
+
+	if (config->startup_report) {
+		config->startup_report_fp = fopen(config->startup_report, "w");
+		if (!config->startup_report_fp) WARN("Failed opening startup report \"%s\": %s",
+						     config->startup_report, fr_syserror(errno));
+	}
+	cf_file_profile(cs, config->startup_report_fp);
+
 	/*
 	 *	Reset the colourisation state.
 	 */
@@ -1254,6 +1374,7 @@ int main_config_free(main_config_t **config)
 	 */
 	TALLOC_FREE((*config)->root_cs);
 	talloc_decrease_ref_count((*config)->dict);
+	if ((*config)->startup_report_fp) fclose((*config)->startup_report_fp);
 	TALLOC_FREE(*config);
 
 	return 0;
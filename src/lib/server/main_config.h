@@ -39,6 +39,7 @@ typedef struct main_config_s main_config_t;
 extern main_config_t const *main_config;		//!< Global configuration singleton.
 
 #include <freeradius-devel/server/cf_util.h>
+#include <freeradius-devel/server/resolver.h>
 #include <freeradius-devel/server/tmpl.h>
 
 #include <freeradius-devel/util/dict.h>
@@ -57,6 +58,8 @@ struct main_config_s {
 	bool		daemonize;			//!< Should the server daemonize on startup.
 	bool		spawn_workers;			//!< Should the server spawn threads.
 	char const      *pid_file;			//!< Path to write out PID file.
+	char const	*handover_socket;		//!< Path of the UNIX socket used to pass listeners
+							///< to a new server process.
 
 	fr_time_delta_t	max_request_time;		//!< How long a request can be processed for before
 							//!< timing out.
@@ -90,6 +93,14 @@ struct main_config_s {
 
 	int32_t		syslog_facility;
 
+	bool		log_async;			//!< Write log messages from a dedicated thread.
+	size_t		log_async_buffer_size;		//!< Size of each thread's log message ring.
+
+	uint32_t	trace_sample_rate;		//!< Trace one request in this many, 0 for none.
+	char const	*trace_file;			//!< Where traced requests are written.
+
+	fr_resolver_conf_t resolver;			//!< Shared hostname cache.
+
 	char const	*dict_dir;			//!< Where to load dictionaries from.
 
 	size_t		talloc_pool_size;		//!< Size of pool to allocate to hold each #REQUEST.
@@ -137,6 +148,22 @@ struct main_config_s {
 	uint32_t	max_networks;			//!< for the scheduler
 	uint32_t	max_workers;			//!< for the scheduler
 	fr_time_delta_t	stats_interval;			//!< for the scheduler
+	bool		work_stealing;			//!< for the scheduler
+	fr_time_delta_t	spin_time;			//!< for the scheduler
+	fr_time_delta_t	max_queue_delay;		//!< for the scheduler
+	char const	*network_cpus;			//!< for the scheduler
+	char const	*worker_cpus;			//!< for the scheduler
+	size_t		ring_buffer_size;		//!< for the scheduler
+	struct fr_schedule_pool_config_s **worker_pools;	//!< for the scheduler
+	bool		huge_pages;			//!< Back ring buffers with huge pages.
+	bool		lock_memory;			//!< mlock() ring buffers.
+	bool		tsc_clock;			//!< Use the TSC for fr_time().
+
+	uint32_t	instantiate_threads;		//!< Threads used to instantiate modules.
+	char const	*startup_report;		//!< File to write startup times to.
+	FILE		*startup_report_fp;		//!< Open handle for startup_report.
+
+	char const	*config_cache;			//!< File to cache the parsed configuration in.
 
 };
 
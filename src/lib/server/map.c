@@ -2244,14 +2244,21 @@ int map_to_vp(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request, vp_map_t cons
 		 */
 		if (tmpl_is_attr(map->lhs) &&
 		    (map->rhs->tmpl_da->type != map->lhs->tmpl_da->type)) {
-			fr_cursor_t to;
+			fr_cursor_t			to;
+			fr_value_box_cast_func_t	cast;
+
+			/*
+			 *	Every source attribute has the same
+			 *	type, so pick the cast function once.
+			 */
+			cast = fr_value_box_cast_func(map->lhs->tmpl_da->type, map->rhs->tmpl_da->type);
 
 			(void) fr_cursor_init(&to, out);
 			for (; vp; vp = fr_cursor_current(&from)) {
 				MEM(n = fr_pair_afrom_da(ctx, map->lhs->tmpl_da));
 
-				if (fr_value_box_cast(n, &n->data,
-						      map->lhs->tmpl_da->type, map->lhs->tmpl_da, &vp->data) < 0) {
+				if (cast(n, &n->data,
+					 map->lhs->tmpl_da->type, map->lhs->tmpl_da, &vp->data) < 0) {
 					RPEDEBUG("Attribute conversion failed");
 					fr_pair_list_free(&found);
 					talloc_free(n);
@@ -2769,6 +2776,109 @@ finish:
 	return rcode;
 }
 
+/** Initialise a batch of maps
+ *
+ * @param[out] batch	to initialise.
+ * @param[in] request	the maps will be applied to.
+ */
+void map_batch_init(map_batch_t *batch, REQUEST *request)
+{
+	batch->request = request;
+	batch->list = NULL;
+	batch->head = NULL;
+	batch->tail = &batch->head;
+}
+
+/** Apply a map as part of a batch
+ *
+ * Maps which add (+=) to an attribute have their pairs created by func
+ * directly in the context of the destination list, and held in the batch
+ * until #map_batch_commit is called, or a map for a different list is
+ * added.  Any other map commits the batch, and is then applied immediately
+ * with #map_to_request, so the order in which maps are applied is
+ * preserved.
+ *
+ * Pending pairs are not in the request, so func must not rely on seeing
+ * the results of earlier maps in the same batch.
+ *
+ * @param[in] batch	to add the map to.
+ * @param[in] map	to apply.
+ * @param[in] func	to retrieve module specific values and convert them to
+ *			#VALUE_PAIR.
+ * @param[in] uctx	to be passed to func.
+ * @return
+ *	- -1 if the operation failed.
+ *	- -2 in the source attribute wasn't valid.
+ *	- 0 on success.
+ */
+int map_batch_add(map_batch_t *batch, vp_map_t const *map, radius_map_getvalue_t func, void *uctx)
+{
+	REQUEST		*request = batch->request;
+	REQUEST		*context = request;
+	VALUE_PAIR	**list, *head = NULL, *vp;
+	int		rcode;
+
+	MAP_VERIFY(map);
+
+	if ((map->op != T_OP_ADD) || !tmpl_is_attr(map->lhs) || tmpl_is_null(map->rhs)) {
+	apply:
+		map_batch_commit(batch);
+		return map_to_request(request, map, func, uctx);
+	}
+
+	/*
+	 *	Let map_to_request() produce the errors
+	 *	for invalid destinations.
+	 */
+	if (radius_request(&context, map->lhs->tmpl_request) < 0) goto apply;
+
+	list = radius_list(context, map->lhs->tmpl_list);
+	if (!list) goto apply;
+
+	if (list != batch->list) {
+		map_batch_commit(batch);
+		batch->list = list;
+	}
+
+	rcode = func(radius_list_ctx(context, map->lhs->tmpl_list), &head, request, map, uctx);
+	if (rcode < 0) {
+		fr_assert(!head);
+		return rcode;
+	}
+	if (!head) {
+		RDEBUG2("%.*s skipped: No values available", (int)map->lhs->len, map->lhs->name);
+		return 0;
+	}
+
+	*batch->tail = head;
+	for (vp = head; vp; vp = vp->next) {
+		VP_VERIFY(vp);
+
+		if (map->lhs->tmpl_tag != TAG_ANY) vp->tag = map->lhs->tmpl_tag;
+		if (RDEBUG_ENABLED) map_debug_log(request, map, vp);
+
+		batch->tail = &vp->next;
+	}
+
+	return 0;
+}
+
+/** Add the pending pairs of a batch to their list
+ *
+ * Must be called once all maps have been added to the batch, including
+ * when adding a map failed.
+ *
+ * @param[in] batch	to commit.
+ */
+void map_batch_commit(map_batch_t *batch)
+{
+	if (batch->head) fr_pair_add(batch->list, batch->head);
+
+	batch->list = NULL;
+	batch->head = NULL;
+	batch->tail = &batch->head;
+}
+
 /**  Print a map to a string
  *
  * @param[out] need	The buffer space we would have needed to
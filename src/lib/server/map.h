@@ -93,6 +93,19 @@ typedef int (*map_validate_t)(vp_map_t *map, void *ctx);
 typedef int (*radius_map_getvalue_t)(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request,
 				     vp_map_t const *map, void *uctx);
 
+/** Pairs produced by multiple maps, waiting to be added to their list
+ *
+ * Consecutive maps which add to the same list have their pairs gathered
+ * here, and added to the list in one pass by #map_batch_commit, instead
+ * of walking the list once per map.
+ */
+typedef struct {
+	REQUEST			*request;	//!< The maps are being applied to.
+	VALUE_PAIR		**list;		//!< The pending pairs will be added to.
+	VALUE_PAIR		*head;		//!< Of the pending pairs.
+	VALUE_PAIR		**tail;		//!< Where the next pending pair is linked.
+} map_batch_t;
+
 int		map_afrom_cp(TALLOC_CTX *ctx, vp_map_t **out, CONF_PAIR *cp,
 			     vp_tmpl_rules_t const *lhs_rules, vp_tmpl_rules_t const *rhs_rules);
 
@@ -130,6 +143,13 @@ int		map_to_list_mod(TALLOC_CTX *ctx, vp_list_mod_t **out,
 int		map_to_request(REQUEST *request, vp_map_t const *map,
 			       radius_map_getvalue_t func, void *ctx);
 
+void		map_batch_init(map_batch_t *batch, REQUEST *request);
+
+int		map_batch_add(map_batch_t *batch, vp_map_t const *map,
+			      radius_map_getvalue_t func, void *uctx);
+
+void		map_batch_commit(map_batch_t *batch);
+
 size_t		map_snprint(size_t *need, char *out, size_t outlen, vp_map_t const *map);
 
 void		map_debug_log(REQUEST *request, vp_map_t const *map,
@@ -0,0 +1,765 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/metrics.c
+ * @brief Per-thread counters and histograms, aggregated when read.
+ *
+ * A metric is a named counter or histogram, registered once.  Each thread
+ * which updates a metric gets its own series for each set of labels it
+ * uses.  A series has exactly one writer, so updating it is a relaxed
+ * load and store, with no locks and no read-modify-write instructions.
+ *
+ * New series are pushed onto the metric's list with a compare and swap.
+ * Series are never removed, so readers can walk the list without locking.
+ * Values are only summed across threads when they're read, either by
+ * #fr_metric_sum, or by #fr_metric_print which writes every metric in
+ * the OpenMetrics text format (as used by Prometheus).
+ *
+ * Histograms also keep a finer, log-linear set of buckets, which
+ * #fr_metric_quantile uses to estimate percentiles.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/metrics.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/rbtree.h>
+#include <freeradius-devel/util/thread_local.h>
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** Upper bounds of the histogram buckets
+ *
+ * The last bucket has no upper bound.
+ */
+static struct {
+	fr_time_delta_t	le;
+	char const	*name;
+} const metric_buckets[] = {
+	{ 100 * 1000,			"0.0001" },
+	{ 250 * 1000,			"0.00025" },
+	{ 500 * 1000,			"0.0005" },
+	{ 1000 * 1000,			"0.001" },
+	{ 2500 * 1000,			"0.0025" },
+	{ 5000 * 1000,			"0.005" },
+	{ 10 * 1000 * 1000,		"0.01" },
+	{ 25 * 1000 * 1000,		"0.025" },
+	{ 50 * 1000 * 1000,		"0.05" },
+	{ 100 * 1000 * 1000,		"0.1" },
+	{ 250 * 1000 * 1000,		"0.25" },
+	{ 500 * 1000 * 1000,		"0.5" },
+	{ NSEC,				"1" },
+	{ 2500 * (fr_time_delta_t) 1000 * 1000,	"2.5" },
+	{ 5 * (fr_time_delta_t) NSEC,	"5" },
+	{ 10 * (fr_time_delta_t) NSEC,	"10" },
+};
+
+#define METRIC_NUM_BUCKETS	(NUM_ELEMENTS(metric_buckets) + 1)
+
+/*
+ *	Log-linear buckets for estimating quantiles.  Observations are
+ *	recorded in units of 1024ns, and each power of two is split into
+ *	8 equal buckets.  So a bucket is never wider than 1/8th of its
+ *	lower bound, and the estimates are within ~12% of the real value
+ *	up to ~34s.  Larger observations all go in the last bucket.
+ */
+#define METRIC_FINE_SHIFT	10
+#define METRIC_FINE_SUB_BITS	3
+#define METRIC_FINE_SUB		(1 << METRIC_FINE_SUB_BITS)
+#define METRIC_FINE_MAX_BIT	25
+#define METRIC_FINE_NUM_BUCKETS	((METRIC_FINE_MAX_BIT - METRIC_FINE_SUB_BITS + 2) * METRIC_FINE_SUB)
+
+struct fr_metric_s {
+	fr_dlist_t			entry;		//!< Entry in the list of registered metrics.
+	char const			*name;		//!< e.g. freeradius_requests.
+	char const			*help;		//!< Description of the metric.
+	fr_metric_type_t		type;		//!< Counter, histogram or gauge.
+	_Atomic(fr_metric_series_t *)	series;		//!< Every series, from every thread.
+};
+
+struct fr_metric_series_s {
+	fr_metric_t			*metric;	//!< This series belongs to.
+	char const			*labels;	//!< e.g. server="default",type="Access-Request".
+	uint32_t			hash;		//!< Of the labels.
+	fr_metric_series_t		*next;		//!< Next series of the same metric.
+
+	_Atomic(uint64_t)		count;		//!< Value of a counter or gauge, or the number
+							///< of observations in a histogram.
+	_Atomic(uint64_t)		sum;		//!< Sum of observations, in nanoseconds.
+	_Atomic(uint64_t)		bucket[METRIC_NUM_BUCKETS];	//!< Observations in each bucket.
+	_Atomic(uint64_t)		fine[];		//!< Log-linear buckets, histograms only.
+};
+
+/** Sum of a set of series with the same labels
+ *
+ */
+typedef struct {
+	char const			*labels;
+	uint64_t			count;
+	uint64_t			sum;
+	uint64_t			bucket[METRIC_NUM_BUCKETS];
+} metric_agg_t;
+
+static pthread_mutex_t			metric_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_head_t			metric_list;		//!< Protected by metric_mutex.
+static bool				metric_list_init;
+
+static _Atomic(uint32_t)			metric_generation;	//!< Incremented when metrics are freed.
+
+/** Lookup tree for the series owned by a thread
+ *
+ * Only ever accessed by its owner.
+ */
+typedef struct {
+	rbtree_t			*tree;
+	uint32_t			generation;	//!< Of the series in the tree.
+} metric_thread_t;
+
+static _Thread_local metric_thread_t	*metric_thread;
+
+static int metric_series_cmp(void const *one, void const *two)
+{
+	fr_metric_series_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->metric > b->metric) - (a->metric < b->metric);
+	if (ret != 0) return ret;
+
+	ret = (a->hash > b->hash) - (a->hash < b->hash);
+	if (ret != 0) return ret;
+
+	return strcmp(a->labels, b->labels);
+}
+
+static int metric_agg_cmp(void const *one, void const *two)
+{
+	metric_agg_t const *a = one, *b = two;
+
+	return strcmp(a->labels, b->labels);
+}
+
+static void _metric_thread_free(void *arg)
+{
+	talloc_free(arg);
+}
+
+/** Register a metric
+ *
+ * Registering a metric which already exists returns the existing metric,
+ * so that multiple instances of a module can share it.
+ *
+ * @param[in] name	of the metric.  Should be prefixed with "freeradius_".
+ *			Counters should not include the "_total" suffix.
+ * @param[in] help	text describing the metric.
+ * @param[in] type	of the metric.
+ * @return
+ *	- The metric.
+ *	- NULL if a metric with the same name, but a different type exists.
+ */
+fr_metric_t *fr_metric_register(char const *name, char const *help, fr_metric_type_t type)
+{
+	fr_metric_t *metric;
+
+	pthread_mutex_lock(&metric_mutex);
+	if (!metric_list_init) {
+		fr_dlist_init(&metric_list, fr_metric_t, entry);
+		metric_list_init = true;
+	}
+
+	for (metric = fr_dlist_head(&metric_list);
+	     metric != NULL;
+	     metric = fr_dlist_next(&metric_list, metric)) {
+		if (strcmp(metric->name, name) != 0) continue;
+
+		if (metric->type != type) {
+			fr_strerror_printf("Metric \"%s\" already registered with a different type", name);
+			metric = NULL;
+		}
+		pthread_mutex_unlock(&metric_mutex);
+		return metric;
+	}
+
+	MEM(metric = talloc_zero(NULL, fr_metric_t));
+	metric->name = talloc_typed_strdup(metric, name);
+	metric->help = talloc_typed_strdup(metric, help);
+	metric->type = type;
+	atomic_init(&metric->series, NULL);
+
+	fr_dlist_insert_tail(&metric_list, metric);
+	pthread_mutex_unlock(&metric_mutex);
+
+	return metric;
+}
+
+/** Return the calling thread's series of a metric for a set of labels
+ *
+ * The series is created if this is the first time the calling thread has
+ * used these labels.  Callers in the hot path should cache the result.
+ *
+ * @param[in] metric	to find the series for.
+ * @param[in] labels	comma separated list of name="value" pairs.  Use ""
+ *			for no labels.  Values must be escaped with
+ *			#fr_metric_label_escape if they may contain quotes.
+ * @return The series.
+ */
+fr_metric_series_t *fr_metric_series(fr_metric_t *metric, char const *labels)
+{
+	metric_thread_t		*mt = metric_thread;
+	uint32_t		generation = atomic_load_explicit(&metric_generation, memory_order_relaxed);
+	fr_metric_series_t	find, *series, *head;
+
+	if (!mt) {
+		MEM(mt = talloc_zero(NULL, metric_thread_t));
+		fr_thread_local_set_destructor(metric_thread, _metric_thread_free, mt);
+	}
+
+	/*
+	 *	Metrics were freed since we last looked,
+	 *	so the series in the tree are gone.
+	 */
+	if (!mt->tree || (mt->generation != generation)) {
+		talloc_free(mt->tree);
+		MEM(mt->tree = rbtree_talloc_create(mt, metric_series_cmp, fr_metric_series_t, NULL, 0));
+		mt->generation = generation;
+	}
+
+	find.metric = metric;
+	find.labels = labels;
+	find.hash = fr_hash_string(labels);
+
+	series = rbtree_finddata(mt->tree, &find);
+	if (series) return series;
+
+	/*
+	 *	Series outlive the thread which created them, so
+	 *	they're not parented by anything thread specific.
+	 */
+	if (metric->type == FR_METRIC_HISTOGRAM) {
+		MEM(series = talloc_zero_size(NULL, sizeof(*series) + (sizeof(series->fine[0]) * METRIC_FINE_NUM_BUCKETS)));
+		talloc_set_type(series, fr_metric_series_t);
+	} else {
+		MEM(series = talloc_zero(NULL, fr_metric_series_t));
+	}
+	series->metric = metric;
+	series->labels = talloc_typed_strdup(series, labels);
+	series->hash = find.hash;
+
+	/*
+	 *	Publish the series.  The release ordering ensures
+	 *	readers see the initialised fields.
+	 */
+	head = atomic_load_explicit(&metric->series, memory_order_relaxed);
+	do {
+		series->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&metric->series, &head, series,
+							memory_order_release, memory_order_relaxed));
+
+	(void) rbtree_insert(mt->tree, series);
+
+	return series;
+}
+
+/** Add to a counter
+ *
+ * Must only be called by the thread which retrieved the series.
+ */
+void fr_metric_inc(fr_metric_series_t *series, uint64_t n)
+{
+	atomic_store_explicit(&series->count,
+			      atomic_load_explicit(&series->count, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/** Return the log-linear bucket for an observation
+ *
+ */
+static inline size_t metric_fine_bucket(fr_time_delta_t value)
+{
+	uint64_t	units;
+	int		msb;
+
+	if (value <= 0) return 0;
+
+	units = ((uint64_t) value) >> METRIC_FINE_SHIFT;
+	if (units < METRIC_FINE_SUB) return units;
+
+	msb = fr_high_bit_pos(units) - 1;
+	if (msb > METRIC_FINE_MAX_BIT) return METRIC_FINE_NUM_BUCKETS - 1;
+
+	return ((msb - METRIC_FINE_SUB_BITS + 1) * METRIC_FINE_SUB) +
+		((units >> (msb - METRIC_FINE_SUB_BITS)) & (METRIC_FINE_SUB - 1));
+}
+
+/** Return the lower bound and width of a log-linear bucket, in nanoseconds
+ *
+ */
+static inline void metric_fine_bounds(fr_time_delta_t *low, fr_time_delta_t *width, size_t bucket)
+{
+	int	shift;
+
+	if (bucket < METRIC_FINE_SUB) {
+		*low = bucket << METRIC_FINE_SHIFT;
+		*width = 1 << METRIC_FINE_SHIFT;
+		return;
+	}
+
+	shift = (bucket / METRIC_FINE_SUB) - 1;
+	*low = ((fr_time_delta_t) (METRIC_FINE_SUB + (bucket % METRIC_FINE_SUB)) << shift) << METRIC_FINE_SHIFT;
+	*width = ((fr_time_delta_t) 1 << shift) << METRIC_FINE_SHIFT;
+}
+
+/** Record an observation in a histogram
+ *
+ * Must only be called by the thread which retrieved the series.
+ */
+void fr_metric_observe(fr_metric_series_t *series, fr_time_delta_t value)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_ELEMENTS(metric_buckets); i++) {
+		if (value <= metric_buckets[i].le) break;
+	}
+
+	atomic_store_explicit(&series->bucket[i],
+			      atomic_load_explicit(&series->bucket[i], memory_order_relaxed) + 1, memory_order_relaxed);
+
+	i = metric_fine_bucket(value);
+	atomic_store_explicit(&series->fine[i],
+			      atomic_load_explicit(&series->fine[i], memory_order_relaxed) + 1, memory_order_relaxed);
+
+	atomic_store_explicit(&series->sum,
+			      atomic_load_explicit(&series->sum, memory_order_relaxed) + value, memory_order_relaxed);
+	atomic_store_explicit(&series->count,
+			      atomic_load_explicit(&series->count, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+/** Set the value of a gauge
+ *
+ * Each thread sets its own value.  The values are summed when read.
+ *
+ * Must only be called by the thread which retrieved the series.
+ */
+void fr_metric_set(fr_metric_series_t *series, uint64_t value)
+{
+	atomic_store_explicit(&series->count, value, memory_order_relaxed);
+}
+
+/** Sum a counter across all threads
+ *
+ * @param[in] metric	to sum.
+ * @param[in] labels	of the series to sum.
+ * @return The total of the counter, or the number of observations for a histogram.
+ */
+uint64_t fr_metric_sum(fr_metric_t const *metric, char const *labels)
+{
+	fr_metric_series_t	*series;
+	uint32_t		hash = fr_hash_string(labels);
+	uint64_t		total = 0;
+
+	for (series = atomic_load_explicit(&metric->series, memory_order_acquire);
+	     series != NULL;
+	     series = series->next) {
+		if ((series->hash != hash) || (strcmp(series->labels, labels) != 0)) continue;
+
+		total += atomic_load_explicit(&series->count, memory_order_relaxed);
+	}
+
+	return total;
+}
+
+/** Estimate a quantile of a histogram, across all threads
+ *
+ * The estimate is interpolated within the log-linear bucket holding the
+ * requested rank, so it's within ~12% of the real value.
+ *
+ * @param[in] metric	to read.  Must be a histogram.
+ * @param[in] labels	of the series to read.
+ * @param[in] q		quantile to estimate, from 0 to 1, e.g. 0.99 for the 99th percentile.
+ * @return
+ *	- The estimated value.
+ *	- -1 if there have been no observations.
+ */
+fr_time_delta_t fr_metric_quantile(fr_metric_t const *metric, char const *labels, double q)
+{
+	fr_metric_series_t	*series;
+	uint32_t		hash = fr_hash_string(labels);
+	uint64_t		fine[METRIC_FINE_NUM_BUCKETS];
+	uint64_t		total = 0, rank, seen = 0;
+	fr_time_delta_t		low, width;
+	size_t			i;
+
+	if (metric->type != FR_METRIC_HISTOGRAM) return -1;
+
+	memset(fine, 0, sizeof(fine));
+
+	for (series = atomic_load_explicit(&metric->series, memory_order_acquire);
+	     series != NULL;
+	     series = series->next) {
+		if ((series->hash != hash) || (strcmp(series->labels, labels) != 0)) continue;
+
+		for (i = 0; i < METRIC_FINE_NUM_BUCKETS; i++) {
+			uint64_t n = atomic_load_explicit(&series->fine[i], memory_order_relaxed);
+
+			fine[i] += n;
+			total += n;
+		}
+	}
+
+	if (!total) return -1;
+
+	if (q < 0) q = 0;
+	if (q > 1) q = 1;
+
+	rank = (uint64_t) (q * total);
+	if ((double) rank < (q * total)) rank++;
+	if (rank < 1) rank = 1;
+
+	for (i = 0; i < (METRIC_FINE_NUM_BUCKETS - 1); i++) {
+		if ((seen + fine[i]) >= rank) break;
+		seen += fine[i];
+	}
+
+	metric_fine_bounds(&low, &width, i);
+
+	/*
+	 *	Observations in the last bucket have no upper bound.
+	 */
+	if (!fine[i] || (i == (METRIC_FINE_NUM_BUCKETS - 1))) return low;
+
+	return low + (fr_time_delta_t) (((double) width * (rank - seen)) / fine[i]);
+}
+
+/** Escape a label value
+ *
+ * @param[out] out	Where to write the escaped value.
+ * @param[in] outlen	Size of out.
+ * @param[in] in	Value to escape.
+ * @return The length of the escaped value.  Truncated if >= outlen.
+ */
+size_t fr_metric_label_escape(char *out, size_t outlen, char const *in)
+{
+	char const	*p;
+	size_t		len = 0;
+
+	for (p = in; *p; p++) {
+		char c = *p;
+		bool escape = ((c == '"') || (c == '\\') || (c == '\n'));
+
+		if (escape) {
+			if ((len + 1) < outlen) out[len] = '\\';
+			len++;
+			if (c == '\n') c = 'n';
+		}
+
+		if ((len + 1) < outlen) out[len] = c;
+		len++;
+	}
+
+	if (outlen) out[(len < outlen) ? len : outlen - 1] = '\0';
+
+	return len;
+}
+
+static int _metric_agg_print_counter(void *data, void *uctx)
+{
+	metric_agg_t	*agg = data;
+	FILE		*fp = ((void **)uctx)[0];
+	fr_metric_t	*metric = ((void **)uctx)[1];
+
+	fprintf(fp, "%s_total%s%s%s %" PRIu64 "\n", metric->name,
+		*agg->labels ? "{" : "", agg->labels, *agg->labels ? "}" : "", agg->count);
+
+	return 0;
+}
+
+static int _metric_agg_print_gauge(void *data, void *uctx)
+{
+	metric_agg_t	*agg = data;
+	FILE		*fp = ((void **)uctx)[0];
+	fr_metric_t	*metric = ((void **)uctx)[1];
+
+	fprintf(fp, "%s%s%s%s %" PRIu64 "\n", metric->name,
+		*agg->labels ? "{" : "", agg->labels, *agg->labels ? "}" : "", agg->count);
+
+	return 0;
+}
+
+static int _metric_agg_print_histogram(void *data, void *uctx)
+{
+	metric_agg_t	*agg = data;
+	FILE		*fp = ((void **)uctx)[0];
+	fr_metric_t	*metric = ((void **)uctx)[1];
+	char const	*sep = *agg->labels ? "," : "";
+	uint64_t	cumulative = 0;
+	size_t		i;
+
+	for (i = 0; i < METRIC_NUM_BUCKETS; i++) {
+		cumulative += agg->bucket[i];
+		fprintf(fp, "%s_bucket{%s%sle=\"%s\"} %" PRIu64 "\n", metric->name, agg->labels, sep,
+			(i < NUM_ELEMENTS(metric_buckets)) ? metric_buckets[i].name : "+Inf", cumulative);
+	}
+
+	fprintf(fp, "%s_count%s%s%s %" PRIu64 "\n", metric->name,
+		*agg->labels ? "{" : "", agg->labels, *agg->labels ? "}" : "", agg->count);
+	fprintf(fp, "%s_sum%s%s%s %" PRIu64 ".%09" PRIu64 "\n", metric->name,
+		*agg->labels ? "{" : "", agg->labels, *agg->labels ? "}" : "",
+		agg->sum / NSEC, agg->sum % NSEC);
+
+	return 0;
+}
+
+/** Sum the series from each thread, returning a tree of #metric_agg_t ordered by labels
+ *
+ */
+static rbtree_t *metric_aggregate(TALLOC_CTX *ctx, fr_metric_t const *metric)
+{
+	rbtree_t		*tree;
+	fr_metric_series_t	*series;
+
+	MEM(tree = rbtree_talloc_create(ctx, metric_agg_cmp, metric_agg_t, NULL, 0));
+
+	for (series = atomic_load_explicit(&metric->series, memory_order_acquire);
+	     series != NULL;
+	     series = series->next) {
+		metric_agg_t	find, *agg;
+		size_t		i;
+
+		find.labels = series->labels;
+		agg = rbtree_finddata(tree, &find);
+		if (!agg) {
+			MEM(agg = talloc_zero(tree, metric_agg_t));
+			agg->labels = series->labels;
+			(void) rbtree_insert(tree, agg);
+		}
+
+		agg->count += atomic_load_explicit(&series->count, memory_order_relaxed);
+		if (metric->type != FR_METRIC_HISTOGRAM) continue;
+
+		agg->sum += atomic_load_explicit(&series->sum, memory_order_relaxed);
+		for (i = 0; i < METRIC_NUM_BUCKETS; i++) {
+			agg->bucket[i] += atomic_load_explicit(&series->bucket[i], memory_order_relaxed);
+		}
+	}
+
+	return tree;
+}
+
+/** Print one metric, summing the series from each thread
+ *
+ */
+static void metric_print(FILE *fp, fr_metric_t *metric)
+{
+	TALLOC_CTX		*ctx;
+	rbtree_t		*tree;
+	void			*uctx[2] = { fp, metric };
+	char const		*type;
+	rb_walker_t		print;
+
+	switch (metric->type) {
+	case FR_METRIC_HISTOGRAM:
+		type = "histogram";
+		print = _metric_agg_print_histogram;
+		break;
+
+	case FR_METRIC_GAUGE:
+		type = "gauge";
+		print = _metric_agg_print_gauge;
+		break;
+
+	default:
+		type = "counter";
+		print = _metric_agg_print_counter;
+		break;
+	}
+
+	MEM(ctx = talloc_init_const("metrics"));
+	tree = metric_aggregate(ctx, metric);
+
+	fprintf(fp, "# TYPE %s %s\n", metric->name, type);
+	fprintf(fp, "# HELP %s %s\n", metric->name, metric->help);
+
+	(void) rbtree_walk(tree, RBTREE_IN_ORDER, print, uctx);
+
+	talloc_free(ctx);
+}
+
+/** Print all metrics in the OpenMetrics text format
+ *
+ * @param[in] fp	to write to.
+ * @return 0.
+ */
+int fr_metric_print(FILE *fp)
+{
+	fr_metric_t *metric;
+
+	pthread_mutex_lock(&metric_mutex);
+	if (metric_list_init) {
+		for (metric = fr_dlist_head(&metric_list);
+		     metric != NULL;
+		     metric = fr_dlist_next(&metric_list, metric)) {
+			metric_print(fp, metric);
+		}
+	}
+	pthread_mutex_unlock(&metric_mutex);
+
+	fprintf(fp, "# EOF\n");
+
+	return 0;
+}
+
+typedef struct {
+	fr_metric_value_t	*values;		//!< Array being filled, and the ctx for the labels.
+	size_t			num;			//!< Entries filled so far.
+} metric_values_ctx_t;
+
+static int _metric_agg_to_value(void *data, void *uctx)
+{
+	metric_agg_t		*agg = data;
+	metric_values_ctx_t	*vctx = uctx;
+	fr_metric_value_t	*value = &vctx->values[vctx->num++];
+
+	value->labels = talloc_typed_strdup(vctx->values, agg->labels);
+	value->count = agg->count;
+	value->sum = agg->sum;
+
+	return 0;
+}
+
+/** Find a registered metric by name
+ *
+ * @param[in] name	of the metric.
+ * @return
+ *	- The metric.
+ *	- NULL if no metric with that name has been registered.
+ */
+fr_metric_t *fr_metric_find(char const *name)
+{
+	fr_metric_t *metric = NULL;
+
+	pthread_mutex_lock(&metric_mutex);
+	if (metric_list_init) {
+		for (metric = fr_dlist_head(&metric_list);
+		     metric != NULL;
+		     metric = fr_dlist_next(&metric_list, metric)) {
+			if (strcmp(metric->name, name) == 0) break;
+		}
+	}
+	pthread_mutex_unlock(&metric_mutex);
+
+	return metric;
+}
+
+/** Return the current value of every series of a metric, summed across threads
+ *
+ * @param[in] ctx	to allocate the array in.
+ * @param[out] out	Array of values, ordered by labels.
+ * @param[in] metric	to read.
+ * @return The number of entries in the array.
+ */
+size_t fr_metric_values(TALLOC_CTX *ctx, fr_metric_value_t **out, fr_metric_t const *metric)
+{
+	TALLOC_CTX		*tmp_ctx;
+	rbtree_t		*tree;
+	metric_values_ctx_t	vctx = { .num = 0 };
+	size_t			num;
+
+	MEM(tmp_ctx = talloc_init_const("metrics"));
+	tree = metric_aggregate(tmp_ctx, metric);
+
+	num = rbtree_num_elements(tree);
+	MEM(vctx.values = talloc_zero_array(ctx, fr_metric_value_t, num));
+	(void) rbtree_walk(tree, RBTREE_IN_ORDER, _metric_agg_to_value, &vctx);
+
+	talloc_free(tmp_ctx);
+
+	*out = vctx.values;
+	return num;
+}
+
+static int cmd_show_metrics(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	return fr_metric_print(fp);
+}
+
+static fr_cmd_table_t cmd_table[] = {
+	{
+		.parent = "show",
+		.name = "metrics",
+		.func = cmd_show_metrics,
+		.help = "Show statistics in the OpenMetrics (Prometheus) text format.",
+		.read_only = true,
+	},
+
+	CMD_TABLE_END
+};
+
+/** Register the commands for reading metrics
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_metric_init(void)
+{
+	if (fr_command_register_hook(NULL, NULL, NULL, cmd_table) < 0) {
+		PERROR("Failed registering radmin commands for metrics");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Free all metrics, and their series
+ *
+ * Must only be called once no other threads are using metrics.
+ */
+void fr_metric_free(void)
+{
+	fr_metric_t		*metric;
+	fr_metric_series_t	*series, *next;
+
+	pthread_mutex_lock(&metric_mutex);
+	if (!metric_list_init) {
+		pthread_mutex_unlock(&metric_mutex);
+		return;
+	}
+
+	while ((metric = fr_dlist_head(&metric_list))) {
+		fr_dlist_remove(&metric_list, metric);
+
+		for (series = atomic_load_explicit(&metric->series, memory_order_acquire);
+		     series != NULL;
+		     series = next) {
+			next = series->next;
+			talloc_free(series);
+		}
+		talloc_free(metric);
+	}
+	atomic_fetch_add_explicit(&metric_generation, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&metric_mutex);
+}
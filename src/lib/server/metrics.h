@@ -0,0 +1,85 @@
+#pragma once
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/metrics.h
+ * @brief Per-thread counters and histograms, aggregated when read.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(metrics_h, "$Id$")
+
+#include <freeradius-devel/util/time.h>
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_metric_s fr_metric_t;
+typedef struct fr_metric_series_s fr_metric_series_t;
+
+/** The type of a metric
+ *
+ */
+typedef enum {
+	FR_METRIC_COUNTER = 0,				//!< Monotonically increasing count.
+	FR_METRIC_HISTOGRAM,				//!< Distribution of durations.
+	FR_METRIC_GAUGE					//!< Current value, e.g. memory in use.
+} fr_metric_type_t;
+
+/** The value of one series, summed across threads
+ *
+ */
+typedef struct {
+	char const		*labels;		//!< Of the series.
+	uint64_t		count;			//!< Value of a counter, or number of observations.
+	uint64_t		sum;			//!< Sum of observations in nanoseconds (histograms only).
+} fr_metric_value_t;
+
+int			fr_metric_init(void);
+
+void			fr_metric_free(void);
+
+fr_metric_t		*fr_metric_register(char const *name, char const *help, fr_metric_type_t type);
+
+fr_metric_series_t	*fr_metric_series(fr_metric_t *metric, char const *labels);
+
+void			fr_metric_inc(fr_metric_series_t *series, uint64_t n);
+
+void			fr_metric_observe(fr_metric_series_t *series, fr_time_delta_t value);
+
+void			fr_metric_set(fr_metric_series_t *series, uint64_t value);
+
+uint64_t		fr_metric_sum(fr_metric_t const *metric, char const *labels);
+
+fr_time_delta_t		fr_metric_quantile(fr_metric_t const *metric, char const *labels, double q);
+
+fr_metric_t		*fr_metric_find(char const *name);
+
+size_t			fr_metric_values(TALLOC_CTX *ctx, fr_metric_value_t **out, fr_metric_t const *metric);
+
+size_t			fr_metric_label_escape(char *out, size_t outlen, char const *in);
+
+int			fr_metric_print(FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,291 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include "metrics.c"
+
+#define TEST_THREADS		4
+#define TEST_INCREMENTS		100000
+
+/** Read everything fr_metric_print() writes
+ *
+ */
+static char *test_print(TALLOC_CTX *ctx)
+{
+	FILE	*fp;
+	char	buffer[8192];
+	size_t	len;
+
+	fp = tmpfile();
+	TEST_CHECK(fp != NULL);
+	if (!fp) return NULL;
+
+	fr_metric_print(fp);
+	rewind(fp);
+
+	len = fread(buffer, 1, sizeof(buffer) - 1, fp);
+	buffer[len] = '\0';
+	fclose(fp);
+
+	return talloc_typed_strdup(ctx, buffer);
+}
+
+static void test_counter(void)
+{
+	fr_metric_t		*metric;
+	fr_metric_series_t	*a, *b;
+
+	metric = fr_metric_register("test_counter", "A counter.", FR_METRIC_COUNTER);
+	TEST_CHECK(metric != NULL);
+
+	TEST_CASE("Registering the same name returns the same metric");
+	TEST_CHECK(fr_metric_register("test_counter", "A counter.", FR_METRIC_COUNTER) == metric);
+	TEST_CHECK(fr_metric_register("test_counter", "A counter.", FR_METRIC_HISTOGRAM) == NULL);
+
+	TEST_CASE("Series are per label set");
+	a = fr_metric_series(metric, "type=\"a\"");
+	b = fr_metric_series(metric, "type=\"b\"");
+	TEST_CHECK(a != b);
+	TEST_CHECK(fr_metric_series(metric, "type=\"a\"") == a);
+
+	fr_metric_inc(a, 2);
+	fr_metric_inc(a, 3);
+	fr_metric_inc(b, 1);
+
+	TEST_CHECK(fr_metric_sum(metric, "type=\"a\"") == 5);
+	TEST_CHECK(fr_metric_sum(metric, "type=\"b\"") == 1);
+	TEST_CHECK(fr_metric_sum(metric, "type=\"c\"") == 0);
+
+	fr_metric_free();
+}
+
+static void *test_thread(void *arg)
+{
+	fr_metric_t		*metric = arg;
+	fr_metric_series_t	*series;
+	int			i;
+
+	series = fr_metric_series(metric, "");
+	for (i = 0; i < TEST_INCREMENTS; i++) fr_metric_inc(series, 1);
+
+	return NULL;
+}
+
+static void test_counter_threads(void)
+{
+	fr_metric_t	*metric;
+	pthread_t	threads[TEST_THREADS];
+	int		i;
+
+	metric = fr_metric_register("test_counter", "A counter.", FR_METRIC_COUNTER);
+
+	TEST_CASE("Each thread has its own series, which are summed when read");
+	for (i = 0; i < TEST_THREADS; i++) {
+		TEST_CHECK(pthread_create(&threads[i], NULL, test_thread, metric) == 0);
+	}
+	for (i = 0; i < TEST_THREADS; i++) pthread_join(threads[i], NULL);
+
+	TEST_CHECK(fr_metric_sum(metric, "") == (TEST_THREADS * TEST_INCREMENTS));
+	TEST_MSG("Expected %u, got %" PRIu64, TEST_THREADS * TEST_INCREMENTS, fr_metric_sum(metric, ""));
+
+	fr_metric_free();
+}
+
+static void test_histogram(void)
+{
+	TALLOC_CTX		*ctx;
+	fr_metric_t		*metric;
+	fr_metric_series_t	*series;
+	char			*out;
+
+	ctx = talloc_init_const("test");
+
+	metric = fr_metric_register("test_duration_seconds", "A histogram.", FR_METRIC_HISTOGRAM);
+	series = fr_metric_series(metric, "server=\"default\"");
+
+	fr_metric_observe(series, fr_time_delta_from_usec(50));
+	fr_metric_observe(series, fr_time_delta_from_msec(3));
+	fr_metric_observe(series, fr_time_delta_from_sec(60));
+
+	TEST_CHECK(fr_metric_sum(metric, "server=\"default\"") == 3);
+
+	TEST_CASE("Buckets are cumulative, and the last has no upper bound");
+	out = test_print(ctx);
+	TEST_CHECK(out && strstr(out, "# TYPE test_duration_seconds histogram\n"));
+	TEST_CHECK(out && strstr(out, "test_duration_seconds_bucket{server=\"default\",le=\"0.0001\"} 1\n"));
+	TEST_CHECK(out && strstr(out, "test_duration_seconds_bucket{server=\"default\",le=\"0.0025\"} 1\n"));
+	TEST_CHECK(out && strstr(out, "test_duration_seconds_bucket{server=\"default\",le=\"0.005\"} 2\n"));
+	TEST_CHECK(out && strstr(out, "test_duration_seconds_bucket{server=\"default\",le=\"10\"} 2\n"));
+	TEST_CHECK(out && strstr(out, "test_duration_seconds_bucket{server=\"default\",le=\"+Inf\"} 3\n"));
+	TEST_CHECK(out && strstr(out, "test_duration_seconds_count{server=\"default\"} 3\n"));
+	TEST_CHECK(out && strstr(out, "test_duration_seconds_sum{server=\"default\"} 60.003050000\n"));
+	TEST_MSG("%s", out);
+
+	talloc_free(ctx);
+	fr_metric_free();
+}
+
+/** Check an estimate is within the error of the log-linear buckets
+ *
+ */
+static bool test_close(fr_time_delta_t estimate, fr_time_delta_t expected)
+{
+	fr_time_delta_t error = expected / 8;
+
+	if (error < 1024) error = 1024;
+
+	return (estimate >= (expected - error)) && (estimate <= (expected + error));
+}
+
+static void test_quantile(void)
+{
+	fr_metric_t		*metric;
+	fr_metric_series_t	*series;
+	fr_time_delta_t		estimate;
+	int			i;
+
+	metric = fr_metric_register("test_duration_seconds", "A histogram.", FR_METRIC_HISTOGRAM);
+
+	TEST_CASE("No observations");
+	TEST_CHECK(fr_metric_quantile(metric, "", 0.5) < 0);
+
+	/*
+	 *	1ms to 1000ms, in 1ms steps.
+	 */
+	series = fr_metric_series(metric, "");
+	for (i = 1; i <= 1000; i++) fr_metric_observe(series, fr_time_delta_from_msec(i));
+
+	TEST_CASE("Quantiles are estimated within the bucket error");
+	estimate = fr_metric_quantile(metric, "", 0.5);
+	TEST_CHECK(test_close(estimate, fr_time_delta_from_msec(500)));
+	TEST_MSG("p50 %" PRId64, estimate);
+
+	estimate = fr_metric_quantile(metric, "", 0.99);
+	TEST_CHECK(test_close(estimate, fr_time_delta_from_msec(990)));
+	TEST_MSG("p99 %" PRId64, estimate);
+
+	estimate = fr_metric_quantile(metric, "", 0);
+	TEST_CHECK(test_close(estimate, fr_time_delta_from_msec(1)));
+	TEST_MSG("p0 %" PRId64, estimate);
+
+	TEST_CASE("Small observations");
+	series = fr_metric_series(metric, "server=\"small\"");
+	for (i = 0; i < 10; i++) fr_metric_observe(series, fr_time_delta_from_usec(3));
+	estimate = fr_metric_quantile(metric, "server=\"small\"", 0.9);
+	TEST_CHECK(test_close(estimate, fr_time_delta_from_usec(3)));
+	TEST_MSG("p90 %" PRId64, estimate);
+
+	TEST_CASE("Observations past the last bucket");
+	series = fr_metric_series(metric, "server=\"slow\"");
+	fr_metric_observe(series, fr_time_delta_from_sec(3600));
+	TEST_CHECK(fr_metric_quantile(metric, "server=\"slow\"", 1) > fr_time_delta_from_sec(30));
+
+	TEST_CASE("Counters have no quantiles");
+	TEST_CHECK(fr_metric_quantile(fr_metric_register("test_counter", "A counter.", FR_METRIC_COUNTER), "", 0.5) < 0);
+
+	fr_metric_free();
+}
+
+static void test_gauge(void)
+{
+	TALLOC_CTX		*ctx;
+	fr_metric_t		*metric;
+	fr_metric_series_t	*series;
+	char			*out;
+
+	ctx = talloc_init_const("test");
+
+	metric = fr_metric_register("test_bytes", "A gauge.", FR_METRIC_GAUGE);
+	series = fr_metric_series(metric, "module=\"sql\"");
+
+	TEST_CASE("Setting a gauge replaces its value");
+	fr_metric_set(series, 1024);
+	fr_metric_set(series, 512);
+	TEST_CHECK(fr_metric_sum(metric, "module=\"sql\"") == 512);
+
+	TEST_CASE("Gauges have no suffix");
+	out = test_print(ctx);
+	TEST_CHECK(out && (strcmp(out,
+				  "# TYPE test_bytes gauge\n"
+				  "# HELP test_bytes A gauge.\n"
+				  "test_bytes{module=\"sql\"} 512\n"
+				  "# EOF\n") == 0));
+	TEST_MSG("%s", out);
+
+	talloc_free(ctx);
+	fr_metric_free();
+}
+
+static void test_print_counter(void)
+{
+	TALLOC_CTX		*ctx;
+	fr_metric_t		*metric;
+	char			*out;
+	char			buffer[64];
+
+	ctx = talloc_init_const("test");
+
+	metric = fr_metric_register("test_requests", "Requests.", FR_METRIC_COUNTER);
+	fr_metric_inc(fr_metric_series(metric, "type=\"b\""), 2);
+	fr_metric_inc(fr_metric_series(metric, "type=\"a\""), 1);
+	fr_metric_inc(fr_metric_series(fr_metric_register("test_other", "Other.", FR_METRIC_COUNTER), ""), 7);
+
+	TEST_CASE("Counters have a _total suffix, and series are sorted by label");
+	out = test_print(ctx);
+	TEST_CHECK(out && (strcmp(out,
+				  "# TYPE test_requests counter\n"
+				  "# HELP test_requests Requests.\n"
+				  "test_requests_total{type=\"a\"} 1\n"
+				  "test_requests_total{type=\"b\"} 2\n"
+				  "# TYPE test_other counter\n"
+				  "# HELP test_other Other.\n"
+				  "test_other_total 7\n"
+				  "# EOF\n") == 0));
+	TEST_MSG("%s", out);
+
+	TEST_CASE("Label values are escaped");
+	TEST_CHECK(fr_metric_label_escape(buffer, sizeof(buffer), "a\"b\\c\nd") == 10);
+	TEST_CHECK(strcmp(buffer, "a\\\"b\\\\c\\nd") == 0);
+	TEST_CHECK(fr_metric_label_escape(buffer, 4, "\"\"\"") == 6);
+	TEST_CHECK(strcmp(buffer, "\\\"\\") == 0);
+
+	talloc_free(ctx);
+	fr_metric_free();
+}
+
+static void test_speed(void)
+{
+	fr_metric_t		*metric;
+	fr_metric_series_t	*series;
+	fr_time_t		start, stop;
+	int			i, loops = 10000000;
+
+	metric = fr_metric_register("test_speed", "Speed.", FR_METRIC_HISTOGRAM);
+	series = fr_metric_series(metric, "");
+
+	start = fr_time();
+	for (i = 0; i < loops; i++) fr_metric_observe(series, i & 0xffffff);
+	stop = fr_time();
+
+	TEST_CHECK(fr_metric_sum(metric, "") == (uint64_t)loops);
+
+	if (test_verbose_level__ >= 1) {
+		INFO("%i observations in %pV (%.2f ns each)",
+		     loops, fr_box_time_delta(stop - start), (double)(stop - start) / loops);
+	}
+
+	fr_metric_free();
+}
+
+TEST_LIST = {
+	{ "Counter",			test_counter },
+	{ "Counter - Threads",		test_counter_threads },
+	{ "Histogram",			test_histogram },
+	{ "Quantile",			test_quantile },
+	{ "Gauge",			test_gauge },
+	{ "Print",			test_print_counter },
+
+	/*
+	 *	Performance tests
+	 */
+	{ "Speed Test - Observe",	test_speed },
+	{ NULL }
+};
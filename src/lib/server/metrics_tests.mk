@@ -0,0 +1,8 @@
+TARGET		:= metrics_tests
+
+SOURCES		:= metrics_tests.c
+
+TGT_LDLIBS	:= $(LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-unlang.a
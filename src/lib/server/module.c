@@ -31,6 +31,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/cf_file.h>
 #include <freeradius-devel/server/cond.h>
+#include <freeradius-devel/server/metrics.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/radmin.h>
 #include <freeradius-devel/server/request_data.h>
@@ -60,6 +61,17 @@ static fr_cmd_table_t cmd_module_table[];
 
 static int _module_instantiate(void *instance, UNUSED void *ctx);
 
+/** Optional "resources" section of a module's configuration
+ *
+ * If the section exists, the module's resource use is measured.
+ */
+static const CONF_PARSER module_resources_config[] = {
+	{ FR_CONF_OFFSET("max_cpu_time", FR_TYPE_TIME_DELTA, module_resources_t, max_cpu_time), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_request_memory", FR_TYPE_SIZE, module_resources_t, max_request_memory), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_thread_memory", FR_TYPE_SIZE, module_resources_t, max_thread_memory), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
 /*
  *	Ordered by component
  */
@@ -184,6 +196,73 @@ static int cmd_set_module_status(UNUSED FILE *fp, FILE *fp_err, void *ctx, fr_cm
 }
 
 
+/** Find the value of a metric for one module
+ *
+ */
+static bool module_metric_value(fr_metric_value_t *out, TALLOC_CTX *ctx, char const *name, char const *labels)
+{
+	fr_metric_t		*metric;
+	fr_metric_value_t	*values;
+	size_t			i, num;
+
+	metric = fr_metric_find(name);
+	if (!metric) return false;
+
+	num = fr_metric_values(ctx, &values, metric);
+	for (i = 0; i < num; i++) {
+		if (strcmp(values[i].labels, labels) != 0) continue;
+
+		*out = values[i];
+		return true;
+	}
+
+	return false;
+}
+
+static int cmd_show_module_resources(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	module_instance_t	*mi = ctx;
+	TALLOC_CTX		*tmp;
+	fr_metric_value_t	cpu = {}, yield = {}, request_memory = {}, thread_memory = {};
+	char			name[128], labels[256];
+
+	if (!mi->resources) {
+		fprintf(fp, "Resource accounting is not enabled.  Add a \"resources\" section to enable it.\n");
+		return 0;
+	}
+
+	fr_metric_label_escape(name, sizeof(name), mi->name);
+	snprintf(labels, sizeof(labels), "module=\"%s\"", name);
+
+	MEM(tmp = talloc_init_const("module_resources"));
+	(void) module_metric_value(&cpu, tmp, MODULE_METRIC_CPU_TIME, labels);
+	(void) module_metric_value(&yield, tmp, MODULE_METRIC_YIELD_TIME, labels);
+	(void) module_metric_value(&request_memory, tmp, MODULE_METRIC_REQUEST_MEMORY, labels);
+	(void) module_metric_value(&thread_memory, tmp, MODULE_METRIC_THREAD_MEMORY, labels);
+	talloc_free(tmp);
+
+	fprintf(fp, "calls\t\t\t%" PRIu64 "\n", cpu.count);
+	fprintf(fp, "cpu time\t\t%.6f s\t(avg %.3f ms)\n", (double) cpu.sum / NSEC,
+		cpu.count ? ((double) cpu.sum / cpu.count) / 1000000 : 0);
+	fprintf(fp, "yield time\t\t%.6f s\t(avg %.3f ms)\n", (double) yield.sum / NSEC,
+		yield.count ? ((double) yield.sum / yield.count) / 1000000 : 0);
+	fprintf(fp, "request memory\t\t%" PRIu64 " bytes\t(avg %" PRIu64 ")\n", request_memory.count,
+		cpu.count ? request_memory.count / cpu.count : 0);
+	fprintf(fp, "thread memory\t\t%" PRIu64 " bytes\n", thread_memory.count);
+
+	if (mi->resources->max_cpu_time) {
+		fprintf(fp, "max_cpu_time\t\t%.6f s\n", (double) mi->resources->max_cpu_time / NSEC);
+	}
+	if (mi->resources->max_request_memory) {
+		fprintf(fp, "max_request_memory\t%zu bytes\n", mi->resources->max_request_memory);
+	}
+	if (mi->resources->max_thread_memory) {
+		fprintf(fp, "max_thread_memory\t%zu bytes\n", mi->resources->max_thread_memory);
+	}
+
+	return 0;
+}
+
 static fr_cmd_table_t cmd_module_table[] = {
 	{
 		.parent = "show module",
@@ -204,6 +283,15 @@ static fr_cmd_table_t cmd_module_table[] = {
 		.read_only = true,
 	},
 
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "resources",
+		.func = cmd_show_module_resources,
+		.help = "Show the CPU time and memory used by a module.",
+		.read_only = true,
+	},
+
 	{
 		.parent = "set module",
 		.add_name = true,
@@ -658,6 +746,36 @@ int module_instance_read_only(void *inst, char const *name)
 	return rcode;
 }
 
+/** Declare that a module instance must be instantiated after another
+ *
+ * Should be called from the module's bootstrap function.  The other module
+ * doesn't need to have been bootstrapped yet, so it's only looked up when
+ * modules are instantiated.
+ *
+ * @param[in] instance	data of the module which has the dependency.
+ * @param[in] name	of the module instance it depends on.
+ * @return
+ *	- 0 on success.
+ *	- -1 if instance isn't module instance data.
+ */
+int module_instance_depends(void const *instance, char const *name)
+{
+	module_instance_t	*mi;
+	size_t			num;
+
+	mi = module_by_data(instance);
+	if (!mi) {
+		fr_strerror_printf("Not module instance data");
+		return -1;
+	}
+
+	num = talloc_array_length(mi->depends);
+	MEM(mi->depends = talloc_realloc(mi, mi->depends, char const *, num + 1));
+	MEM(mi->depends[num] = talloc_typed_strdup(mi->depends, name));
+
+	return 0;
+}
+
 /** Find an existing module instance by its name and parent
  *
  * @param[in] parent		to qualify search with.
@@ -1298,20 +1416,19 @@ void modules_thread_detach(void)
 	TALLOC_FREE(module_thread_inst_array);
 }
 
-/** Complete module setup by calling its instantiate function
+/** Prepare a module for instantiation
  *
- * @param[in] instance	of module to complete instantiation for.
- * @param[in] ctx	modules section, containing instance data.
+ * Registers the module's radmin commands, and compiles the config items
+ * marked as XLAT.  This touches global state, so is always done by the
+ * main thread.
+ *
+ * @param[in] mi	to prepare.
  * @return
  *	- 0 on success.
  *	- -1 on failure.
  */
-static int _module_instantiate(void *instance, UNUSED void *ctx)
+static int module_instantiate_prepare(module_instance_t *mi)
 {
-	module_instance_t *mi = talloc_get_type_abort(instance, module_instance_t);
-
-	if (mi->instantiated) return 0;
-
 	if (fr_command_register_hook(NULL, mi->name, mi, cmd_module_table) < 0) {
 		ERROR("Failed registering radmin commands for module %s - %s",
 		      mi->name, fr_strerror());
@@ -1325,23 +1442,48 @@ static int _module_instantiate(void *instance, UNUSED void *ctx)
 	if (mi->module->config && (cf_section_parse_pass2(mi->dl_inst->data,
 							  mi->dl_inst->conf) < 0)) return -1;
 
+	return 0;
+}
+
+/** Call a module's instantiate method
+ *
+ * May be called from a thread other than the main thread, if the
+ * module is marked with #RLM_TYPE_PARALLEL.
+ *
+ * @param[in] mi	to instantiate.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int module_instantiate_call(module_instance_t *mi)
+{
+	fr_time_t start;
+
+	if (!mi->module->instantiate) return 0;
+
+	cf_log_debug(mi->dl_inst->conf, "Instantiating module \"%s\"", mi->name);
+
 	/*
-	 *	Call the instantiate method, if any.
+	 *	Call the module's instantiation routine.
 	 */
-	if (mi->module->instantiate) {
-		cf_log_debug(mi->dl_inst->conf, "Instantiating module \"%s\"", mi->name);
-
-		/*
-		 *	Call the module's instantiation routine.
-		 */
-		if ((mi->module->instantiate)(mi->dl_inst->data, mi->dl_inst->conf) < 0) {
-			cf_log_err(mi->dl_inst->conf, "Instantiation failed for module \"%s\"",
-				   mi->name);
+	start = fr_time();
+	if ((mi->module->instantiate)(mi->dl_inst->data, mi->dl_inst->conf) < 0) {
+		cf_log_err(mi->dl_inst->conf, "Instantiation failed for module \"%s\"",
+			   mi->name);
 
-			return -1;
-		}
+		return -1;
 	}
+	mi->instantiate_time = fr_time() - start;
+
+	return 0;
+}
 
+/** Mark a module as instantiated
+ *
+ * @param[in] mi	which was instantiated.
+ */
+static void module_instantiate_finish(module_instance_t *mi)
+{
 	/*
 	 *	If we're threaded, check if the module is thread-safe.
 	 *
@@ -1361,24 +1503,283 @@ static int _module_instantiate(void *instance, UNUSED void *ctx)
 #endif
 
 	mi->instantiated = true;
+}
+
+/** Complete module setup by calling its instantiate function
+ *
+ * @param[in] instance	of module to complete instantiation for.
+ * @param[in] ctx	modules section, containing instance data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int _module_instantiate(void *instance, UNUSED void *ctx)
+{
+	module_instance_t *mi = talloc_get_type_abort(instance, module_instance_t);
+
+	if (mi->instantiated) return 0;
+
+	if (module_instantiate_prepare(mi) < 0) return -1;
+
+	if (module_instantiate_call(mi) < 0) return -1;
+
+	module_instantiate_finish(mi);
 
 	return 0;
 }
 
+/** Modules which are being instantiated in parallel
+ *
+ */
+typedef struct {
+	module_instance_t	**mi;		//!< Modules to instantiate.
+	size_t			num;		//!< Number of modules in the batch.
+	size_t			next;		//!< Next module to instantiate.
+	bool			failed;		//!< One or more modules failed to instantiate.
+	pthread_mutex_t		mutex;		//!< Protects next and failed.
+} module_instantiate_batch_t;
+
+static void *module_instantiate_thread(void *uctx)
+{
+	module_instantiate_batch_t	*batch = uctx;
+	module_instance_t		*mi;
+
+	for (;;) {
+		pthread_mutex_lock(&batch->mutex);
+		if (batch->next >= batch->num) {
+			pthread_mutex_unlock(&batch->mutex);
+			break;
+		}
+		mi = batch->mi[batch->next++];
+		pthread_mutex_unlock(&batch->mutex);
+
+		if (module_instantiate_call(mi) < 0) {
+			pthread_mutex_lock(&batch->mutex);
+			batch->failed = true;
+			pthread_mutex_unlock(&batch->mutex);
+		}
+	}
+
+	return NULL;
+}
+
+/** Instantiate a batch of modules using multiple threads
+ *
+ * @param[in] batch	of modules to instantiate.
+ * @return
+ *	- 0 on success.
+ *	- -1 if any module failed to instantiate.
+ */
+static int module_instantiate_batch(module_instantiate_batch_t *batch)
+{
+	pthread_t	*threads;
+	size_t		num_threads, i, started;
+
+	if (batch->num == 0) return 0;
+
+	num_threads = main_config->instantiate_threads;
+	if (num_threads > batch->num) num_threads = batch->num;
+
+	batch->next = 0;
+	batch->failed = false;
+	pthread_mutex_init(&batch->mutex, NULL);
+
+	DEBUG2("Instantiating %zu modules using %zu threads", batch->num, num_threads);
+
+	MEM(threads = talloc_array(NULL, pthread_t, num_threads));
+	for (started = 0; started < num_threads; started++) {
+		if (pthread_create(&threads[started], NULL, module_instantiate_thread, batch) != 0) {
+			WARN("Failed creating instantiation thread: %s", fr_syserror(errno));
+			break;
+		}
+	}
+
+	/*
+	 *	If we couldn't start any threads, the main
+	 *	thread does all the work.
+	 */
+	if (started == 0) (void) module_instantiate_thread(batch);
+
+	for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+	talloc_free(threads);
+
+	pthread_mutex_destroy(&batch->mutex);
+
+	if (batch->failed) return -1;
+
+	for (i = 0; i < batch->num; i++) module_instantiate_finish(batch->mi[i]);
+
+	return 0;
+}
+
+/** Whether all the modules a module depends on have been instantiated
+ *
+ * @param[in] mi	to check.
+ * @return
+ *	- 1 if all the dependencies have been instantiated.
+ *	- 0 if one or more dependencies haven't been instantiated.
+ *	- -1 if a dependency doesn't exist.
+ */
+static int module_dependencies_instantiated(module_instance_t const *mi)
+{
+	size_t i, num = talloc_array_length(mi->depends);
+
+	for (i = 0; i < num; i++) {
+		module_instance_t *dep;
+
+		dep = module_by_name(NULL, mi->depends[i]);
+		if (!dep) {
+			cf_log_err(mi->dl_inst->conf, "Module \"%s\" depends on unknown module \"%s\"",
+				   mi->name, mi->depends[i]);
+			return -1;
+		}
+		if (!dep->instantiated) return 0;
+	}
+
+	return 1;
+}
+
+static int _module_collect(void *instance, void *ctx)
+{
+	module_instance_t	***p = ctx;
+
+	*((*p)++) = talloc_get_type_abort(instance, module_instance_t);
+
+	return 0;
+}
+
+static int _module_report_cmp(void const *a, void const *b)
+{
+	module_instance_t const *mi_a = *((module_instance_t const * const *)a);
+	module_instance_t const *mi_b = *((module_instance_t const * const *)b);
+	fr_time_delta_t time_a = mi_a->bootstrap_time + mi_a->instantiate_time;
+	fr_time_delta_t time_b = mi_b->bootstrap_time + mi_b->instantiate_time;
+
+	return (time_a < time_b) - (time_a > time_b);
+}
+
+/** Report how long each module took to start
+ *
+ * Printed in debug mode, and written to the file specified by
+ * `startup_report`, if set.  Slowest modules are listed first.
+ *
+ * @param[in] mi	array of all modules.
+ * @param[in] num	number of modules.
+ * @param[in] elapsed	wall clock time taken to instantiate all modules.
+ */
+static void modules_startup_report(module_instance_t **mi, size_t num, fr_time_delta_t elapsed)
+{
+	FILE	*fp = main_config->startup_report_fp;
+	size_t	i;
+
+	if (!fp && !DEBUG_ENABLED) return;
+
+	qsort(mi, num, sizeof(*mi), _module_report_cmp);
+
+	DEBUG("#### Module startup times ####");
+	for (i = 0; i < num; i++) {
+		DEBUG("  %-32s bootstrap %8.3fms  instantiate %8.3fms", mi[i]->name,
+		      (double)fr_time_delta_to_usec(mi[i]->bootstrap_time) / 1000,
+		      (double)fr_time_delta_to_usec(mi[i]->instantiate_time) / 1000);
+
+		if (fp) fprintf(fp, "module\t%s\t%" PRId64 "\t%" PRId64 "\n", mi[i]->name,
+				fr_time_delta_to_usec(mi[i]->bootstrap_time),
+				fr_time_delta_to_usec(mi[i]->instantiate_time));
+	}
+	DEBUG("  Instantiated %zu modules in %.3fms", num, (double)fr_time_delta_to_usec(elapsed) / 1000);
+
+	if (fp) fflush(fp);
+}
+
 /** Completes instantiation of modules
  *
  * Allows the module to initialise connection pools, and complete any registrations that depend on
  * attributes created during the bootstrap phase.
  *
+ * Modules are instantiated in name order, except where a module has declared it depends on
+ * another with #module_instance_depends.  If `thread.instantiate_threads` is greater than one,
+ * modules marked #RLM_TYPE_PARALLEL are instantiated concurrently, once their dependencies
+ * have been instantiated.
+ *
  * @return
  *	- 0 on success.
  *	- -1 on failure.
  */
 int modules_instantiate(void)
 {
+	module_instance_t		**all, **p;
+	module_instantiate_batch_t	batch = { .num = 0 };
+	size_t				num, i, remaining;
+	bool				parallel, progress;
+	fr_time_t			start = fr_time();
+	int				ret = -1;
+
 	DEBUG2("#### Instantiating modules ####");
 
-	if (rbtree_walk(module_instance_name_tree, RBTREE_IN_ORDER, _module_instantiate, NULL) < 0) return -1;
+	parallel = main_config->spawn_workers && (main_config->instantiate_threads > 1);
+
+	num = rbtree_num_elements(module_instance_name_tree);
+	MEM(all = talloc_array(NULL, module_instance_t *, num));
+	MEM(batch.mi = talloc_array(all, module_instance_t *, num));
+	p = all;
+	(void) rbtree_walk(module_instance_name_tree, RBTREE_IN_ORDER, _module_collect, &p);
+
+	do {
+		progress = false;
+		batch.num = 0;
+
+		for (i = 0; i < num; i++) {
+			int deps;
+
+			if (all[i]->instantiated) continue;
+
+			deps = module_dependencies_instantiated(all[i]);
+			if (deps < 0) goto finish;
+			if (deps == 0) continue;
+
+			/*
+			 *	Modules using another module's pool
+			 *	may instantiate it, so have to be run
+			 *	by the main thread.
+			 */
+			if (parallel && (all[i]->module->type & RLM_TYPE_PARALLEL) &&
+			    !cf_pair_find(all[i]->dl_inst->conf, "pool")) {
+				batch.mi[batch.num++] = all[i];
+				continue;
+			}
+
+			if (_module_instantiate(all[i], NULL) < 0) goto finish;
+			progress = true;
+		}
+
+		/*
+		 *	Serial modules may have instantiated some
+		 *	of the batch already, via module references.
+		 */
+		for (i = 0; i < batch.num; i++) {
+			if (batch.mi[i]->instantiated) {
+				batch.mi[i--] = batch.mi[--batch.num];
+				continue;
+			}
+			if (module_instantiate_prepare(batch.mi[i]) < 0) goto finish;
+		}
+
+		if (module_instantiate_batch(&batch) < 0) goto finish;
+		if (batch.num > 0) progress = true;
+
+		for (i = 0, remaining = 0; i < num; i++) if (!all[i]->instantiated) remaining++;
+	} while (remaining && progress);
+
+	if (remaining) {
+		for (i = 0; i < num; i++) {
+			if (all[i]->instantiated) continue;
+			cf_log_err(all[i]->dl_inst->conf, "Module \"%s\" is part of a dependency loop",
+				   all[i]->name);
+		}
+		goto finish;
+	}
+
+	modules_startup_report(all, num, fr_time() - start);
 
 #ifndef NDEBUG
 	{
@@ -1394,7 +1795,12 @@ int modules_instantiate(void)
 	}
 #endif
 
-	return 0;
+	ret = 0;
+
+finish:
+	talloc_free(all);
+
+	return ret;
 }
 
 /** Recursive component of module_instance_name
@@ -1567,6 +1973,25 @@ module_instance_t *module_bootstrap(module_instance_t const *parent, CONF_SECTIO
 	mi->name = talloc_typed_strdup(mi, inst_name);
 	talloc_free(inst_name);	/* Avoid stealing */
 
+	/*
+	 *	Resource accounting is expensive, so it's only
+	 *	done for modules which ask for it.
+	 */
+	{
+		CONF_SECTION *resources;
+
+		resources = cf_section_find(cs, "resources", NULL);
+		if (resources) {
+			MEM(mi->resources = talloc_zero(mi, module_resources_t));
+			if ((cf_section_rules_push(resources, module_resources_config) < 0) ||
+			    (cf_section_parse(mi->resources, mi->resources, resources) < 0)) {
+				cf_log_err(resources, "Invalid resources section for module \"%s\"", mi->name);
+				talloc_free(mi);
+				return NULL;
+			}
+		}
+	}
+
 	mi->module = (module_t const *)mi->dl_inst->module->common;
 	if (!mi->module) {
 		cf_log_err(cs, "Missing public structure for \"%s\"", inst_name);
@@ -1600,6 +2025,8 @@ module_instance_t *module_bootstrap(module_instance_t const *parent, CONF_SECTIO
 	 *	submodules.
 	 */
 	if (mi->module->bootstrap) {
+		fr_time_t start = fr_time();
+
 		cf_log_debug(mi->dl_inst->conf, "Bootstrapping module \"%s\"", mi->name);
 
 	    	if ((mi->module->bootstrap)(mi->dl_inst->data, cs) < 0) {
@@ -1607,6 +2034,7 @@ module_instance_t *module_bootstrap(module_instance_t const *parent, CONF_SECTIO
 			talloc_free(mi);
 			return NULL;
 		}
+		mi->bootstrap_time = fr_time() - start;
 	}
 
 	return mi;
@@ -42,6 +42,8 @@ typedef struct module_thread_instance_s  module_thread_instance_t;
 #include <freeradius-devel/server/components.h>
 #include <freeradius-devel/server/dl_module.h>
 #include <freeradius-devel/server/exfile.h>
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/server/metrics.h>
 #include <freeradius-devel/server/pool.h>
 #include <freeradius-devel/server/rcode.h>
 
@@ -63,6 +65,10 @@ extern const char *section_type_value[MOD_COUNT];
 						//!< Server will protect calls
 						//!< with mutex.
 #define RLM_TYPE_RESUMABLE     	(1 << 2) 	//!< does yield / resume
+#define RLM_TYPE_PARALLEL	(1 << 3)	//!< Module's instantiate function only modifies its
+						//!< own instance data, e.g. opening connections or
+						//!< reading files, so may run at the same time as
+						//!< other modules with this flag.
 
 /** Module section callback
  *
@@ -120,6 +126,23 @@ typedef int (*module_thread_instantiate_t)(CONF_SECTION const *mod_cs, void *ins
  */
 typedef int (*module_thread_detach_t)(fr_event_list_t *el, void *thread);
 
+/** Module load callback
+ *
+ * Reports how busy a module instance is, as seen from the current
+ * thread.  Used by "load-balance least-loaded" to send requests to
+ * the module which will likely respond soonest.
+ *
+ * @param[in] instance		data, specific to an instantiated module.
+ * @param[in] thread		data specific to this module instance.
+ * @return
+ *	- A relative score, lower is less loaded.  Scores are only
+ *	  compared between instances of the same module.
+ *	- #MODULE_LOAD_UNAVAILABLE if the module can't currently process requests.
+ */
+typedef uint64_t (*module_load_t)(void const *instance, void *thread);
+
+#define MODULE_LOAD_UNAVAILABLE	UINT64_MAX
+
 #define FR_MODULE_COMMON \
 	struct { \
 		module_instantiate_t		bootstrap;		\
@@ -175,8 +198,33 @@ struct rad_module_s {
 	module_method_t			methods[MOD_COUNT];	//!< Pointers to the various section callbacks.
 	module_method_names_t const	*method_names;		//!< named methods
 	fr_dict_t const			**dict;			//!< pointer to local fr_dict_t*
+
+	module_load_t			load_score;		//!< Report how busy the module is.
 };
 
+/** Names of the metrics recorded for module instances with a "resources" section
+ *
+ */
+#define MODULE_METRIC_CPU_TIME		"freeradius_module_cpu_seconds"
+#define MODULE_METRIC_YIELD_TIME	"freeradius_module_yield_duration_seconds"
+#define MODULE_METRIC_REQUEST_MEMORY	"freeradius_module_request_memory_bytes"
+#define MODULE_METRIC_THREAD_MEMORY	"freeradius_module_thread_memory_bytes"
+
+/** Soft limits on the resources used by a module instance
+ *
+ * Parsed from the "resources" subsection of the module's configuration.
+ * If that subsection is present, the CPU time, yield time and memory
+ * used by each call to the module are recorded.  A limit of 0 means
+ * usage is recorded, but never warned about.
+ */
+typedef struct {
+	fr_time_delta_t			max_cpu_time;		//!< Warn when a call uses more CPU time.
+	size_t				max_request_memory;	//!< Warn when a call allocates more from
+								///< the request.
+	size_t				max_thread_memory;	//!< Warn when a thread's instance data grows
+								///< larger than this.
+} module_resources_t;
+
 /** Per instance data
  *
  * Per-instance data structure, to correlate the modules with the
@@ -204,6 +252,15 @@ struct module_instance_s {
 							//!< has been set to true.
 	bool				in_name_tree;	//!< Whether this is in the name lookup tree.
 	bool				in_data_tree;	//!< Whether this is in the data lookup tree.
+
+	char const			**depends;	//!< Names of module instances which must be
+							///< instantiated before this one.
+
+	fr_time_delta_t			bootstrap_time;	//!< How long the module took to bootstrap.
+	fr_time_delta_t			instantiate_time;	//!< How long the module took to instantiate.
+
+	module_resources_t		*resources;	//!< Resource accounting limits.  NULL unless
+							///< resource accounting is enabled.
 };
 
 /** Per thread per instance data
@@ -224,6 +281,21 @@ struct module_thread_instance_s {
 
 	uint64_t			total_calls;	//! total number of times we've been called
 	uint64_t			active_callers; //! number of active callers.  i.e. number of current yields
+
+	fr_metric_series_t		*calls[RLM_MODULE_NUMCODES];	//!< Completed calls by result.
+									///< Created on first use.
+	fr_metric_series_t		*call_time;	//!< Time from call to completion, including
+							///< any time spent yielded.
+
+	/*
+	 *	Only used if the module has a "resources" section.
+	 */
+	fr_metric_series_t		*cpu_time;	//!< CPU time used by each call.
+	fr_metric_series_t		*yield_time;	//!< Time each call spent yielded.
+	fr_metric_series_t		*request_memory;	//!< Bytes allocated from requests.
+	fr_metric_series_t		*thread_memory;	//!< Size of the thread instance data.
+	uint64_t			accounted_calls;	//!< Calls since the thread memory was measured.
+	fr_rate_limit_t			resources_log;	//!< Rate limits soft limit warnings.
 };
 
 /** Map string values to module state method
@@ -268,6 +340,8 @@ bool		module_section_type_set(REQUEST *request, fr_dict_attr_t const *type_da, f
 
 int		module_instance_read_only(TALLOC_CTX *ctx, char const *name);
 
+int		module_instance_depends(void const *instance, char const *name);
+
 /** @} */
 
 /** @name Module and module thread lookup
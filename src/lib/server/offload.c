@@ -0,0 +1,671 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Run blocking library calls on dedicated executor threads
+ *
+ * Some libraries (libwbclient being the canonical example) only offer
+ * blocking APIs.  Calling them from a worker stalls every other request
+ * the worker owns.  An offload pool owns a small, fixed set of executor
+ * threads, each with its own library handle.  Workers submit calls to a
+ * shared queue and yield, the executor runs the call, and hands the
+ * result back to the worker via a pipe on the worker's event list.
+ *
+ * Calls are tagged with a key (i.e. a domain), and at most `max_per_key`
+ * calls for a key run at once, so one slow backend can't tie up every
+ * executor.
+ *
+ * The request data is only touched by the executor while the call is
+ * running.  Everything else, including freeing, happens in the worker
+ * which submitted the call.  If a worker cancels a call which is
+ * running, the handle is orphaned, and freed when the executor returns it.
+ *
+ * @file src/lib/server/offload.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "%s - "
+#define LOG_PREFIX_ARGS pool->name
+
+#include <freeradius-devel/server/metrics.h>
+#include <freeradius-devel/server/offload.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/rbtree.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <pthread.h>
+
+/** Where a request currently is
+ *
+ * Protected by the pool mutex.
+ */
+typedef enum {
+	OFFLOAD_REQ_NONE = 0,				//!< Owned solely by the worker.
+	OFFLOAD_REQ_IN_QUEUE,				//!< In the pool's queue.
+	OFFLOAD_REQ_IN_EXECUTOR,			//!< Being run by an executor.
+	OFFLOAD_REQ_IN_DONE				//!< In the worker's done list.
+} fr_offload_req_where_t;
+
+typedef struct {
+	char const		*name;			//!< Of the key.
+	uint32_t		running;		//!< Calls for this key being run.
+} fr_offload_key_t;
+
+struct fr_offload_s {
+	fr_offload_conf_t const		*conf;		//!< Pool configuration.
+	char const			*name;		//!< Of the pool, used for logging and metrics.
+
+	fr_offload_resource_alloc_t	resource_alloc;	//!< Creates executor resources.
+	fr_offload_resource_free_t	resource_free;	//!< Frees executor resources.
+	void				*uctx;		//!< Passed to the resource callbacks.
+
+	pthread_mutex_t			mutex;		//!< Protects everything below, and the
+							///< done lists of every thread handle.
+	pthread_cond_t			work;		//!< Signalled when requests are queued, or
+							///< key slots become free.
+	pthread_cond_t			done;		//!< Signalled when an executor finishes a call.
+
+	pthread_t			*threads;	//!< Executor threads.
+	uint32_t			num_started;	//!< How many executors we started.
+	bool				shutdown;	//!< Tells the executors to exit.
+
+	fr_dlist_head_t			queue;		//!< Requests waiting for an executor.
+	uint32_t			num_queued;	//!< Number of requests in the queue.
+	rbtree_t			*keys;		//!< Of #fr_offload_key_t.  Isolated talloc
+							///< hierarchy, only touched with the mutex held.
+
+	fr_metric_t			*wait_time;	//!< Time requests spend queued.
+	fr_metric_t			*call_time;	//!< Time the calls take.
+	fr_metric_t			*calls;		//!< Calls by key and result.
+};
+
+struct fr_offload_thread_s {
+	fr_offload_t			*pool;		//!< Pool requests are submitted to.
+	fr_event_list_t			*el;		//!< Worker's event list.
+
+	int				pipe[2];	//!< Executors write here to wake the worker.
+	fr_dlist_head_t			done;		//!< Requests returned by the executors.
+	bool				signalled;	//!< Whether the pipe has been written to since
+							///< the worker last drained it.
+	uint32_t			num_executing;	//!< Requests from this thread being run.
+};
+
+struct fr_offload_req_s {
+	fr_offload_thread_t		*ot;		//!< Handle the request was submitted through.
+	REQUEST				*request;	//!< Request the call is for.
+	fr_offload_key_t		*key;		//!< Used to limit concurrency.
+	fr_dlist_t			entry;		//!< Entry in the queue, or the done list.
+
+	fr_offload_req_where_t		where;		//!< Who has the request.
+	fr_offload_req_state_t		state;		//!< What's happened to the request.
+	bool				released;	//!< The caller freed the request while it was running.
+
+	fr_offload_func_t		func;		//!< To run.
+	void				*data;		//!< Passed to func.
+	int				ret;		//!< Returned by func.
+
+	fr_time_t			queued;		//!< When the request was queued.
+	fr_time_t			started;	//!< When an executor picked up the request.
+	fr_time_t			finished;	//!< When func returned.
+
+	fr_event_timer_t const		*ev;		//!< Timeout for the call.
+
+	fr_offload_complete_t		complete;	//!< Called when the call completes.
+	void				*uctx;		//!< Passed to complete.
+};
+
+CONF_PARSER const fr_offload_config[] = {
+	{ FR_CONF_OFFSET("num_threads", FR_TYPE_UINT32, fr_offload_conf_t, num_threads), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_per_key", FR_TYPE_UINT32, fr_offload_conf_t, max_per_key), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_queued", FR_TYPE_UINT32, fr_offload_conf_t, max_queued), .dflt = "1024" },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, fr_offload_conf_t, timeout), .dflt = "10" },
+	CONF_PARSER_TERMINATOR
+};
+
+static int offload_key_cmp(void const *one, void const *two)
+{
+	fr_offload_key_t const *a = one, *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+/** Find the oldest queued request whose key isn't at its limit
+ *
+ * Must be called with the pool mutex held.
+ */
+static fr_offload_req_t *offload_next(fr_offload_t *pool)
+{
+	fr_offload_req_t *oreq = NULL;
+
+	while ((oreq = fr_dlist_next(&pool->queue, oreq))) {
+		if (!pool->conf->max_per_key || (oreq->key->running < pool->conf->max_per_key)) return oreq;
+	}
+
+	return NULL;
+}
+
+/** Executor thread main loop
+ *
+ */
+static void *offload_executor(void *arg)
+{
+	fr_offload_t		*pool = arg;
+	fr_offload_req_t	*oreq;
+	void			*resource;
+
+	resource = pool->resource_alloc(pool->uctx);
+	if (!resource) {
+		PERROR("Failed creating executor resource");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		fr_offload_thread_t	*ot;
+		int			ret;
+
+		while (!pool->shutdown && !(oreq = offload_next(pool))) pthread_cond_wait(&pool->work, &pool->mutex);
+		if (pool->shutdown) break;
+
+		fr_dlist_remove(&pool->queue, oreq);
+		pool->num_queued--;
+		oreq->where = OFFLOAD_REQ_IN_EXECUTOR;
+		oreq->state = FR_OFFLOAD_REQ_RUNNING;
+		oreq->key->running++;
+		oreq->ot->num_executing++;
+		oreq->started = fr_time();
+		pthread_mutex_unlock(&pool->mutex);
+
+		ret = oreq->func(resource, oreq->data);
+
+		pthread_mutex_lock(&pool->mutex);
+		oreq->ret = ret;
+		oreq->finished = fr_time();
+		oreq->key->running--;
+
+		/*
+		 *	State stays RUNNING, the worker decides
+		 *	what happened when it drains the list.
+		 */
+		ot = oreq->ot;
+		ot->num_executing--;
+		oreq->where = OFFLOAD_REQ_IN_DONE;
+		fr_dlist_insert_tail(&ot->done, oreq);
+
+		if (!ot->signalled) {
+			ot->signalled = true;
+			if ((write(ot->pipe[1], "", 1) < 0) && (errno != EAGAIN)) {
+				ERROR("Failed waking worker: %s", fr_syserror(errno));
+			}
+		}
+
+		/*
+		 *	The key slot we just freed may let another
+		 *	executor pick up a request.
+		 */
+		if (pool->conf->max_per_key) pthread_cond_signal(&pool->work);
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (pool->resource_free) pool->resource_free(resource, pool->uctx);
+
+	return NULL;
+}
+
+/** Record metrics for a completed request
+ *
+ * Series are looked up per call, as keys aren't known in advance.
+ */
+static void offload_metrics(fr_offload_req_t *oreq, char const *result)
+{
+	fr_offload_t	*pool = oreq->ot->pool;
+	char		name[128], key[128];
+	char		labels[512];
+
+	fr_metric_label_escape(name, sizeof(name), pool->name);
+	fr_metric_label_escape(key, sizeof(key), oreq->key ? oreq->key->name : "");
+
+	if (oreq->started) {
+		snprintf(labels, sizeof(labels), "pool=\"%s\",key=\"%s\"", name, key);
+		fr_metric_observe(fr_metric_series(pool->wait_time, labels), oreq->started - oreq->queued);
+		if (oreq->finished) fr_metric_observe(fr_metric_series(pool->call_time, labels),
+						      oreq->finished - oreq->started);
+	}
+
+	snprintf(labels, sizeof(labels), "pool=\"%s\",key=\"%s\",result=\"%s\"", name, key, result);
+	fr_metric_inc(fr_metric_series(pool->calls, labels), 1);
+}
+
+/** Process requests returned by the executors
+ *
+ */
+static void _offload_drain(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_offload_thread_t	*ot = talloc_get_type_abort(uctx, fr_offload_thread_t);
+	fr_offload_t		*pool = ot->pool;
+	fr_offload_req_t	*oreq;
+	fr_dlist_head_t		done;
+	uint8_t			buff[64];
+
+	while (read(fd, buff, sizeof(buff)) > 0);
+
+	fr_dlist_talloc_init(&done, fr_offload_req_t, entry);
+
+	pthread_mutex_lock(&pool->mutex);
+	ot->signalled = false;
+	while ((oreq = fr_dlist_head(&ot->done))) {
+		fr_dlist_remove(&ot->done, oreq);
+		oreq->where = OFFLOAD_REQ_NONE;
+		fr_dlist_insert_tail(&done, oreq);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	while ((oreq = fr_dlist_head(&done))) {
+		fr_dlist_remove(&done, oreq);
+
+		/*
+		 *	Caller gave up on the request
+		 *	while it was running.
+		 */
+		if (oreq->released) {
+			talloc_set_destructor(oreq, NULL);
+			talloc_free(oreq);
+			continue;
+		}
+
+		/*
+		 *	Caller was already told about the
+		 *	timeout, and will free the request.
+		 */
+		if (oreq->state == FR_OFFLOAD_REQ_TIMEOUT) continue;
+
+		fr_event_timer_delete(&oreq->ev);
+		oreq->state = FR_OFFLOAD_REQ_DONE;
+		offload_metrics(oreq, "done");
+		oreq->complete(oreq->request, oreq, oreq->uctx);
+	}
+}
+
+static void _offload_req_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_offload_req_t	*oreq = talloc_get_type_abort(uctx, fr_offload_req_t);
+	fr_offload_t		*pool = oreq->ot->pool;
+	REQUEST			*request = oreq->request;
+
+	oreq->ev = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	switch (oreq->where) {
+	case OFFLOAD_REQ_IN_QUEUE:
+		RERROR("Timeout waiting for a free executor");
+		fr_dlist_remove(&pool->queue, oreq);
+		pool->num_queued--;
+		oreq->where = OFFLOAD_REQ_NONE;
+		break;
+
+	case OFFLOAD_REQ_IN_EXECUTOR:
+		RERROR("Timeout waiting for call to return");
+		break;
+
+	/*
+	 *	Returned, but not drained yet.  Call
+	 *	it a timeout, the drain will skip it.
+	 */
+	default:
+		break;
+	}
+	oreq->state = FR_OFFLOAD_REQ_TIMEOUT;
+	pthread_mutex_unlock(&pool->mutex);
+
+	offload_metrics(oreq, "timeout");
+	oreq->complete(oreq->request, oreq, oreq->uctx);
+}
+
+/** Free a request, removing it from the queue, or orphaning it if it's running
+ *
+ */
+static int _offload_req_free(fr_offload_req_t *oreq)
+{
+	fr_offload_thread_t	*ot = oreq->ot;
+	fr_offload_t		*pool = ot->pool;
+	int			ret = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	switch (oreq->where) {
+	case OFFLOAD_REQ_IN_QUEUE:
+		fr_dlist_remove(&pool->queue, oreq);
+		pool->num_queued--;
+		break;
+
+	case OFFLOAD_REQ_IN_DONE:
+		fr_dlist_remove(&ot->done, oreq);
+		break;
+
+	/*
+	 *	The executor owns the data until the
+	 *	call returns.  Free it when it does.
+	 */
+	case OFFLOAD_REQ_IN_EXECUTOR:
+		oreq->released = true;
+		ret = -1;
+		break;
+
+	default:
+		break;
+	}
+	oreq->where = OFFLOAD_REQ_NONE;
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (ret < 0) fr_event_timer_delete(&oreq->ev);
+
+	return ret;
+}
+
+/** Remove this thread's queued requests, and wait for its running ones
+ *
+ */
+static int _offload_thread_free(fr_offload_thread_t *ot)
+{
+	fr_offload_t		*pool = ot->pool;
+	fr_offload_req_t	*oreq, *next;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (oreq = fr_dlist_head(&pool->queue); oreq; oreq = next) {
+		next = fr_dlist_next(&pool->queue, oreq);
+		if (oreq->ot != ot) continue;
+
+		fr_dlist_remove(&pool->queue, oreq);
+		pool->num_queued--;
+		oreq->where = OFFLOAD_REQ_NONE;
+	}
+
+	while (ot->num_executing > 0) pthread_cond_wait(&pool->done, &pool->mutex);
+
+	/*
+	 *	Orphans can be freed now, the rest
+	 *	are freed with the thread handle.
+	 */
+	while ((oreq = fr_dlist_head(&ot->done))) {
+		fr_dlist_remove(&ot->done, oreq);
+		oreq->where = OFFLOAD_REQ_NONE;
+		if (oreq->released) {
+			talloc_set_destructor(oreq, NULL);
+			talloc_free(oreq);
+		}
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	(void) fr_event_fd_delete(ot->el, ot->pipe[0], FR_EVENT_FILTER_IO);
+	close(ot->pipe[0]);
+	close(ot->pipe[1]);
+
+	return 0;
+}
+
+/** Stop the executors
+ *
+ */
+static int _offload_free(fr_offload_t *pool)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_started; i++) pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->mutex);
+
+	talloc_free(pool->keys);
+
+	return 0;
+}
+
+/** Allocate an offload pool
+ *
+ * Should be called from a module's instantiate callback.  The executors
+ * are started when the first worker calls #fr_offload_thread_alloc, so
+ * they're not lost when the server forks into the background.
+ *
+ * @param[in] ctx		to allocate the pool in.
+ * @param[in] conf		Pool configuration.  Must remain valid for the lifetime of the pool.
+ * @param[in] name		of the pool.  Used as a log prefix, and as a metric label.
+ * @param[in] resource_alloc	Creates the resource each executor passes to calls.
+ * @param[in] resource_free	Frees executor resources.  May be NULL.
+ * @param[in] uctx		passed to the resource callbacks.
+ * @return
+ *	- A new pool on success.
+ *	- NULL on failure.
+ */
+fr_offload_t *fr_offload_alloc(TALLOC_CTX *ctx, fr_offload_conf_t const *conf, char const *name,
+			       fr_offload_resource_alloc_t resource_alloc,
+			       fr_offload_resource_free_t resource_free, void *uctx)
+{
+	fr_offload_t *pool;
+
+	if (!conf->num_threads) {
+		fr_strerror_printf("No executor threads configured");
+		return NULL;
+	}
+
+	MEM(pool = talloc_zero(ctx, fr_offload_t));
+	pool->conf = conf;
+	pool->name = talloc_typed_strdup(pool, name);
+	pool->resource_alloc = resource_alloc;
+	pool->resource_free = resource_free;
+	pool->uctx = uctx;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	fr_dlist_talloc_init(&pool->queue, fr_offload_req_t, entry);
+	MEM(pool->keys = rbtree_talloc_create(NULL, offload_key_cmp, fr_offload_key_t, NULL, 0));
+	MEM(pool->threads = talloc_zero_array(pool, pthread_t, conf->num_threads));
+
+	pool->wait_time = fr_metric_register("freeradius_offload_wait_time",
+					     "Time calls spent waiting for an executor", FR_METRIC_HISTOGRAM);
+	pool->call_time = fr_metric_register("freeradius_offload_call_time",
+					     "Time executors spent running calls", FR_METRIC_HISTOGRAM);
+	pool->calls = fr_metric_register("freeradius_offload_calls",
+					 "Offloaded calls by result", FR_METRIC_COUNTER);
+	if (!pool->wait_time || !pool->call_time || !pool->calls) {
+		talloc_free(pool->keys);
+		talloc_free(pool);
+		return NULL;
+	}
+
+	talloc_set_destructor(pool, _offload_free);
+
+	return pool;
+}
+
+/** Allocate a worker's handle for submitting requests to a pool
+ *
+ * Should be called from a module's thread_instantiate callback.
+ *
+ * @param[in] ctx		to allocate the handle in.
+ * @param[in] pool		to submit requests to.
+ * @param[in] el		Thread's event list.
+ * @return
+ *	- A new handle on success.
+ *	- NULL on failure.
+ */
+fr_offload_thread_t *fr_offload_thread_alloc(TALLOC_CTX *ctx, fr_offload_t *pool, fr_event_list_t *el)
+{
+	fr_offload_thread_t *ot;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->num_started < pool->conf->num_threads) {
+		int ret;
+
+		ret = pthread_create(&pool->threads[pool->num_started], NULL, offload_executor, pool);
+		if (ret != 0) {
+			pthread_mutex_unlock(&pool->mutex);
+			fr_strerror_printf("Failed starting executor thread: %s", fr_syserror(ret));
+			return NULL;
+		}
+		pool->num_started++;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	MEM(ot = talloc_zero(ctx, fr_offload_thread_t));
+	ot->pool = pool;
+	ot->el = el;
+	fr_dlist_talloc_init(&ot->done, fr_offload_req_t, entry);
+
+	if (pipe(ot->pipe) < 0) {
+		fr_strerror_printf("Failed creating wakeup pipe: %s", fr_syserror(errno));
+		talloc_free(ot);
+		return NULL;
+	}
+	fr_nonblock(ot->pipe[0]);
+	fr_nonblock(ot->pipe[1]);
+
+	if (fr_event_fd_insert(ot, el, ot->pipe[0], _offload_drain, NULL, NULL, ot) < 0) {
+		fr_strerror_printf_push("Failed inserting wakeup pipe");
+		close(ot->pipe[0]);
+		close(ot->pipe[1]);
+		talloc_free(ot);
+		return NULL;
+	}
+	talloc_set_destructor(ot, _offload_thread_free);
+
+	return ot;
+}
+
+/** Submit a call to the pool
+ *
+ * The complete callback is never called from within this function.
+ * The returned handle must be freed by the caller once the call completes.
+ * Freeing it earlier cancels the call.
+ *
+ * @param[in] ot		Worker's handle for the pool.
+ * @param[in] request		the call is for.
+ * @param[in] key		to limit concurrency on, i.e. a domain.  May be NULL.
+ * @param[in] func		to run on an executor.
+ * @param[in] data		passed to func.  Must be a talloc chunk, or NULL.
+ *				The returned handle takes ownership of it, and it's
+ *				freed immediately if the call can't be queued.
+ * @param[in] complete		called when the call returns or times out.
+ * @param[in] uctx		passed to complete.
+ * @return
+ *	- A new request handle.
+ *	- NULL if the queue is full.
+ */
+fr_offload_req_t *fr_offload_enqueue(fr_offload_thread_t *ot, REQUEST *request, char const *key,
+				     fr_offload_func_t func, void *data,
+				     fr_offload_complete_t complete, void *uctx)
+{
+	fr_offload_t		*pool = ot->pool;
+	fr_offload_req_t	*oreq;
+	fr_offload_key_t	find, *found;
+
+	MEM(oreq = talloc_zero(ot, fr_offload_req_t));
+	oreq->ot = ot;
+	oreq->request = request;
+	oreq->func = func;
+	oreq->data = data;
+	oreq->complete = complete;
+	oreq->uctx = uctx;
+	if (data) talloc_steal(oreq, data);
+
+	if (fr_event_timer_in(oreq, ot->el, &oreq->ev, pool->conf->timeout,
+			      _offload_req_timeout, oreq) < 0) {
+		RPERROR("Failed inserting offload timeout");
+		talloc_free(oreq);
+		return NULL;
+	}
+
+	find.name = key ? key : "";
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->conf->max_queued && (pool->num_queued >= pool->conf->max_queued)) {
+		pthread_mutex_unlock(&pool->mutex);
+		RERROR("Too many calls waiting for an executor (%u)", pool->num_queued);
+		offload_metrics(oreq, "rejected");
+		talloc_free(oreq);
+		return NULL;
+	}
+
+	found = rbtree_finddata(pool->keys, &find);
+	if (!found) {
+		MEM(found = talloc_zero(pool->keys, fr_offload_key_t));
+		found->name = talloc_typed_strdup(found, find.name);
+		(void) rbtree_insert(pool->keys, found);
+	}
+	oreq->key = found;
+
+	oreq->queued = fr_time();
+	oreq->state = FR_OFFLOAD_REQ_QUEUED;
+	oreq->where = OFFLOAD_REQ_IN_QUEUE;
+	fr_dlist_insert_tail(&pool->queue, oreq);
+	pool->num_queued++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
+
+	talloc_set_destructor(oreq, _offload_req_free);
+
+	RDEBUG3("Submitted call to executor pool \"%s\"", pool->name);
+
+	return oreq;
+}
+
+/** Get the result of a call
+ *
+ * @param[out] ret		Value returned by the call.  May be NULL.
+ * @param[out] data		The data passed to #fr_offload_enqueue.  May be NULL.
+ * @param[in] oreq		to get the result from.
+ * @return The state of the call.  Only #FR_OFFLOAD_REQ_DONE has a valid ret.
+ */
+fr_offload_req_state_t fr_offload_req_result(int *ret, void **data, fr_offload_req_t const *oreq)
+{
+	if (ret) *ret = oreq->ret;
+	if (data) *data = oreq->data;
+
+	return oreq->state;
+}
+
+/** Check a pool configuration is sane
+ *
+ * @param[in] cs		the configuration was parsed from.
+ * @param[in] conf		to check.
+ * @return
+ *	- 0 if the configuration is valid.
+ *	- -1 if it isn't.
+ */
+int fr_offload_conf_check(CONF_SECTION *cs, fr_offload_conf_t *conf)
+{
+	if (conf->num_threads > 256) {
+		cf_log_err(cs, "'num_threads' must be between 0 and 256");
+		return -1;
+	}
+
+	if (conf->timeout < fr_time_delta_from_msec(10)) {
+		cf_log_err(cs, "'timeout' '%pVs' is too small (minimum: 0.01s)", fr_box_time_delta(conf->timeout));
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/offload.h
+ * @brief Run blocking library calls on dedicated executor threads.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(offload_h, "$Id$")
+
+#include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/util/event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_offload_s fr_offload_t;
+typedef struct fr_offload_thread_s fr_offload_thread_t;
+typedef struct fr_offload_req_s fr_offload_req_t;
+
+/** The state of a call submitted to an offload pool
+ *
+ */
+typedef enum {
+	FR_OFFLOAD_REQ_QUEUED = 0,			//!< Waiting for an executor.
+	FR_OFFLOAD_REQ_RUNNING,				//!< Being run by an executor.
+	FR_OFFLOAD_REQ_DONE,				//!< Call returned.
+	FR_OFFLOAD_REQ_TIMEOUT				//!< Call didn't return within the configured timeout.
+} fr_offload_req_state_t;
+
+/** Configuration for an offload pool
+ *
+ */
+typedef struct {
+	uint32_t		num_threads;		//!< Executor threads.  0 disables offloading.
+	uint32_t		max_per_key;		//!< Maximum calls running concurrently for a key.
+							///< 0 for no limit.
+	uint32_t		max_queued;		//!< Maximum number of calls waiting for an executor.
+	fr_time_delta_t		timeout;		//!< How long a request may wait for a call to return.
+} fr_offload_conf_t;
+
+/** Create the per-executor resource passed to every call, i.e. a library handle
+ *
+ * Called from the executor thread when it starts.
+ *
+ * @param[in] uctx	passed to #fr_offload_alloc.
+ * @return
+ *	- The resource.
+ *	- NULL on error.  The executor will exit.
+ */
+typedef void *(*fr_offload_resource_alloc_t)(void *uctx);
+
+/** Free a per-executor resource
+ *
+ * Called from the executor thread when it exits.
+ */
+typedef void (*fr_offload_resource_free_t)(void *resource, void *uctx);
+
+/** A blocking call to run on an executor thread
+ *
+ * Must not access the request, or allocate memory from any talloc
+ * context the worker thread uses.
+ *
+ * @param[in] resource	of the executor running the call.
+ * @param[in] data	passed to #fr_offload_enqueue.
+ * @return A result, retrieved with #fr_offload_req_result.
+ */
+typedef int (*fr_offload_func_t)(void *resource, void *data);
+
+/** Called in the worker thread when a call returns or times out
+ *
+ * Typically calls unlang_interpret_resumable() for the request.
+ *
+ * @param[in] request	the call was made for.
+ * @param[in] oreq	that completed.
+ * @param[in] uctx	passed to #fr_offload_enqueue.
+ */
+typedef void (*fr_offload_complete_t)(REQUEST *request, fr_offload_req_t *oreq, void *uctx);
+
+extern CONF_PARSER const fr_offload_config[];
+
+fr_offload_t		*fr_offload_alloc(TALLOC_CTX *ctx, fr_offload_conf_t const *conf, char const *name,
+					  fr_offload_resource_alloc_t resource_alloc,
+					  fr_offload_resource_free_t resource_free, void *uctx);
+
+fr_offload_thread_t	*fr_offload_thread_alloc(TALLOC_CTX *ctx, fr_offload_t *pool, fr_event_list_t *el);
+
+fr_offload_req_t	*fr_offload_enqueue(fr_offload_thread_t *ot, REQUEST *request, char const *key,
+					    fr_offload_func_t func, void *data,
+					    fr_offload_complete_t complete, void *uctx);
+
+fr_offload_req_state_t	fr_offload_req_result(int *ret, void **data, fr_offload_req_t const *oreq);
+
+int			fr_offload_conf_check(CONF_SECTION *cs, fr_offload_conf_t *conf);
+
+#ifdef __cplusplus
+}
+#endif
@@ -340,7 +340,6 @@ int paircmp_pairs(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *vp)
 			REDEBUG("Error stringifying operand for regular expression");
 
 		regex_error:
-			talloc_free(preg);
 			talloc_free(expr);
 			talloc_free(value);
 			return -2;
@@ -349,8 +348,7 @@ int paircmp_pairs(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *vp)
 		/*
 		 *	Include substring matches.
 		 */
-		slen = regex_compile(request, &preg, expr_p, talloc_array_length(expr_p) - 1,
-				     NULL, true, true);
+		slen = regex_compile_cached(&preg, expr_p, talloc_array_length(expr_p) - 1, NULL, true);
 		if (slen <= 0) {
 			REMARKER(expr_p, -slen, "%s", fr_strerror());
 
@@ -382,7 +380,6 @@ int paircmp_pairs(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *vp)
 		}
 
 		talloc_free(regmatch);
-		talloc_free(preg);
 		talloc_free(expr);
 		talloc_free(value);
 
@@ -730,6 +727,27 @@ int paircmp_find(fr_dict_attr_t const *da)
 	return false;
 }
 
+/** Check whether paircmp() compares an attribute by value
+ *
+ * If this returns true, check items for the attribute only match if an
+ * attribute of the same type is present in the request list, and
+ * #paircmp_pairs compares equal to it.
+ *
+ * @param[in] da	to check.
+ * @return
+ *	- true if the attribute is compared by value.
+ *	- false if the attribute is skipped, or has its own comparison function.
+ */
+bool paircmp_by_value(fr_dict_attr_t const *da)
+{
+	if ((da == attr_crypt_password) ||
+	    (da == attr_auth_type) ||
+	    (da == attr_strip_user_name) ||
+	    (da == attr_user_password)) return false;
+
+	return !paircmp_find(da);
+}
+
 /** Register a function as compare function
  *
  * @param[in] name		the attribute comparison to register.
@@ -43,6 +43,8 @@ int		paircmp(REQUEST *request, VALUE_PAIR *req_list, VALUE_PAIR *check, VALUE_PA
 
 int		paircmp_find(fr_dict_attr_t const *da);
 
+bool		paircmp_by_value(fr_dict_attr_t const *da);
+
 int		paircmp_register_by_name(char const *name, fr_dict_attr_t const *from,
 					 bool first_only, RAD_COMPARE_FUNC func, void *instance);
 
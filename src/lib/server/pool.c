@@ -37,6 +37,12 @@ RCSID("$Id$")
 
 #include <time.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 typedef struct fr_pool_connection_s fr_pool_connection_t;
 
 static int connection_check(fr_pool_t *pool, REQUEST *request);
@@ -110,6 +116,12 @@ struct fr_pool_s {
 	bool		spread;			//!< If true we spread requests over the connections,
 						//!< using the connection released longest ago, first.
 
+	uint32_t	num_partitions;		//!< How many sub-pools to split the connections between.
+	fr_pool_t	**partition;		//!< Sub-pools, each with their own mutex and share of
+						//!< the connection limits.  NULL if the pool isn't
+						//!< partitioned.
+	fr_pool_t	*parent;		//!< Pool this is a partition of.
+
 	fr_heap_t	*heap;			//!< For the next connection heap
 
 	fr_pool_connection_t	*head;		//!< Start of the connection list.
@@ -163,6 +175,7 @@ static const CONF_PARSER pool_config[] = {
 	{ FR_CONF_OFFSET("held_trigger_max", FR_TYPE_TIME_DELTA, fr_pool_t, held_trigger_max), .dflt = "0.5" },
 	{ FR_CONF_OFFSET("retry_delay", FR_TYPE_TIME_DELTA, fr_pool_t, retry_delay), .dflt = "1" },
 	{ FR_CONF_OFFSET("spread", FR_TYPE_BOOL, fr_pool_t, spread), .dflt = "no" },
+	{ FR_CONF_OFFSET("partitions", FR_TYPE_UINT32, fr_pool_t, num_partitions), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -184,6 +197,27 @@ static int8_t last_released_cmp(void const *one, void const *two)
 	return fr_time_cmp(a->last_released, b->last_released);
 }
 
+static atomic_uint_fast32_t	pool_thread_next;	//!< Number to give to the next thread using a pool.
+static _Thread_local uint32_t	pool_thread_num;	//!< This thread's number, 0 if unassigned.
+
+/** Return the partition the current thread should use
+ *
+ * Threads are numbered in the order they first use a partitioned pool,
+ * so with as many partitions as workers, each worker gets a partition
+ * to itself.
+ *
+ * @param[in] pool	to return the partition of.
+ * @return the partition, or the pool itself if it isn't partitioned.
+ */
+static inline fr_pool_t *pool_partition(fr_pool_t *pool)
+{
+	if (!pool->partition) return pool;
+
+	if (unlikely(!pool_thread_num)) pool_thread_num = atomic_fetch_add(&pool_thread_next, 1) + 1;
+
+	return pool->partition[(pool_thread_num - 1) % pool->num_partitions];
+}
+
 /** Removes a connection from the connection list
  *
  * @note Must be called with the mutex held.
@@ -306,6 +340,50 @@ static fr_pool_connection_t *connection_find(fr_pool_t *pool, void *conn)
 	return NULL;
 }
 
+/** Find a connection handle in the partition which owns it
+ *
+ * Connections are usually released by the thread which reserved them,
+ * so the current thread's partition is searched first.
+ *
+ * @note Will return with the mutex of the owning partition held.
+ * @note Must be called with all mutexes free.
+ *
+ * @param[out] out	Partition owning the connection.
+ * @param[in] pool	to search in.
+ * @param[in] conn	handle to search for.
+ * @return
+ *	- Connection containing the specified handle.
+ *	- NULL if non if connection was found.
+ */
+static fr_pool_connection_t *connection_find_partition(fr_pool_t **out, fr_pool_t *pool, void *conn)
+{
+	fr_pool_connection_t	*this;
+	fr_pool_t		*part;
+	uint32_t		i;
+
+	if (!pool) return NULL;
+
+	part = pool_partition(pool);
+
+	this = connection_find(part, conn);
+	if (this || !pool->partition) {
+		*out = part;
+		return this;
+	}
+
+	for (i = 0; i < pool->num_partitions; i++) {
+		if (pool->partition[i] == part) continue;
+
+		this = connection_find(pool->partition[i], conn);
+		if (this) {
+			*out = pool->partition[i];
+			return this;
+		}
+	}
+
+	return NULL;
+}
+
 /** Spawns a new connection
  *
  * Spawns a new connection using the create callback, and returns it for
@@ -791,6 +869,37 @@ done:
 	return 1;
 }
 
+/** Complain that no connections are available
+ *
+ * @note Must be called with the mutex held, will release mutex before returning.
+ *
+ * @param[in] pool	that's at its connection limit.
+ * @param[in] request	The current request.
+ * @param[in] now	Current time.
+ */
+static void connection_at_max(fr_pool_t *pool, REQUEST *request, fr_time_t now)
+{
+	bool complain = false;
+
+	/*
+	 *	Rate-limit complaints.
+	 */
+	if ((now - pool->state.last_at_max) > NSEC) {
+		complain = true;
+		pool->state.last_at_max = now;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+	if (!fr_rate_limit_enabled() || complain) {
+		ROPTIONAL(RERROR, ERROR, "No connections available and at max connection limit");
+		/*
+		 *	Must be done inside the mutex, reconnect callback
+		 *	may modify args.
+		 */
+		fr_pool_trigger_exec(pool, request, "none");
+	}
+}
+
 /** Get a connection from the connection pool
  *
  * @note Must be called with the mutex free.
@@ -798,11 +907,12 @@ done:
  * @param[in] pool	to reserve the connection from.
  * @param[in] request	The current request.
  * @param[in] spawn	whether to spawn a new connection
+ * @param[in] complain	whether to complain if the pool is at its connection limit.
  * @return
  *	- A pointer to the connection handle.
  *	- NULL on error.
  */
-static void *connection_get_internal(fr_pool_t *pool, REQUEST *request, bool spawn)
+static void *connection_get_internal(fr_pool_t *pool, REQUEST *request, bool spawn, bool complain)
 {
 	fr_time_t now;
 	fr_pool_connection_t *this;
@@ -833,26 +943,12 @@ static void *connection_get_internal(fr_pool_t *pool, REQUEST *request, bool spa
 	}
 
 	if (pool->state.num == pool->max) {
-		bool complain = false;
-
-		/*
-		 *	Rate-limit complaints.
-		 */
-		if ((now - pool->state.last_at_max) > NSEC) {
-			complain = true;
-			pool->state.last_at_max = now;
-		}
-
-		pthread_mutex_unlock(&pool->mutex);
-		if (!fr_rate_limit_enabled() || complain) {
-			ROPTIONAL(RERROR, ERROR, "No connections available and at max connection limit");
-			/*
-			 *	Must be done inside the mutex, reconnect callback
-			 *	may modify args.
-			 */
-			fr_pool_trigger_exec(pool, request, "none");
+		if (!complain) {
+			pthread_mutex_unlock(&pool->mutex);
+			return NULL;
 		}
 
+		connection_at_max(pool, request, now);
 		return NULL;
 	}
 
@@ -908,9 +1004,104 @@ void fr_pool_enable_triggers(fr_pool_t *pool, char const *trigger_prefix, VALUE_
 
 	fr_pair_list_free(&pool->trigger_args);
 
-	if (!trigger_args) return;
+	if (trigger_args) MEM(fr_pair_list_copy(pool, &pool->trigger_args, trigger_args) >= 0);
+
+	/*
+	 *	Partitions fire the per-connection triggers,
+	 *	using the configuration of the pool.
+	 */
+	if (pool->partition) {
+		uint32_t i;
 
-	MEM(fr_pair_list_copy(pool, &pool->trigger_args, trigger_args) >= 0);
+		for (i = 0; i < pool->num_partitions; i++) {
+			pool->partition[i]->triggers_enabled = true;
+			pool->partition[i]->trigger_prefix = pool->trigger_prefix;
+			pool->partition[i]->trigger_args = pool->trigger_args;
+		}
+	}
+}
+
+/** Return a partition's share of a limit
+ *
+ * Spreads the remainder over the first partitions, so the
+ * shares add up to the limit.
+ */
+static inline uint32_t pool_partition_share(uint32_t limit, uint32_t num_partitions, uint32_t i)
+{
+	return (limit / num_partitions) + ((i < (limit % num_partitions)) ? 1 : 0);
+}
+
+/** Allocate the partitions of a pool
+ *
+ * Each partition is a pool in its own right, with its own mutex, connection
+ * list and heap, and a share of the connection limits.  Everything else is
+ * copied from the pool.
+ *
+ * @param[in] pool	to partition.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int pool_partitions_alloc(fr_pool_t *pool)
+{
+	uint32_t i;
+
+	MEM(pool->partition = talloc_zero_array(pool, fr_pool_t *, pool->num_partitions));
+
+	for (i = 0; i < pool->num_partitions; i++) {
+		fr_pool_t *part;
+
+		/*
+		 *	In the NULL ctx for the same reason
+		 *	as the pool.  They're freed by
+		 *	fr_pool_free().
+		 */
+		MEM(part = talloc_zero(NULL, fr_pool_t));
+
+		part->parent = pool;
+		part->cs = pool->cs;
+		part->opaque = pool->opaque;
+		part->create = pool->create;
+		part->alive = pool->alive;
+		part->log_prefix = pool->log_prefix;
+
+		part->start = pool_partition_share(pool->start, pool->num_partitions, i);
+		part->min = pool_partition_share(pool->min, pool->num_partitions, i);
+		part->max = pool_partition_share(pool->max, pool->num_partitions, i);
+		part->spare = pool_partition_share(pool->spare, pool->num_partitions, i);
+		if (pool->max_pending) {
+			part->max_pending = pool_partition_share(pool->max_pending, pool->num_partitions, i);
+			if (!part->max_pending) part->max_pending = 1;
+		}
+		part->pending_window = (part->max_pending > 0) ? part->max_pending : part->max;
+
+		part->max_uses = pool->max_uses;
+		part->retry_delay = pool->retry_delay;
+		part->cleanup_interval = pool->cleanup_interval;
+		part->delay_interval = pool->delay_interval;
+		part->lifetime = pool->lifetime;
+		part->idle_timeout = pool->idle_timeout;
+		part->connect_timeout = pool->connect_timeout;
+		part->held_trigger_min = pool->held_trigger_min;
+		part->held_trigger_max = pool->held_trigger_max;
+		part->spread = pool->spread;
+
+		part->heap = fr_heap_talloc_create(part, pool->spread ? last_released_cmp : last_reserved_cmp,
+						   fr_pool_connection_t, heap_id);
+		if (!part->heap) {
+			ERROR("%s: Failed creating connection heap", __FUNCTION__);
+			talloc_free(part);
+			return -1;
+		}
+
+		pthread_mutex_init(&part->mutex, NULL);
+		pthread_cond_init(&part->done_spawn, NULL);
+		pthread_cond_init(&part->done_reconnecting, NULL);
+
+		pool->partition[i] = part;
+	}
+
+	return 0;
 }
 
 /** Create a new connection pool
@@ -1078,26 +1269,33 @@ fr_pool_t *fr_pool_init(TALLOC_CTX *ctx,
 	 */
 	if (check_config) {
 		pool->start = pool->min = pool->max = 1;
+		pool->num_partitions = 0;
 		return pool;
 	}
 
+	/*
+	 *	Each partition needs at least one connection.
+	 */
+	if (pool->num_partitions > 1) {
+		if (pool->num_partitions > pool->max) {
+			cf_log_err(cs, "Cannot set 'partitions' to more than 'max'");
+			goto error;
+		}
+
+		if (pool_partitions_alloc(pool) < 0) goto error;
+	}
+
 	return pool;
 }
 
-int fr_pool_start(fr_pool_t *pool)
+/** Spawn the initial connections for a pool or partition
+ *
+ */
+static int pool_spawn_start(fr_pool_t *pool)
 {
 	uint32_t		i;
 	fr_pool_connection_t 	*this;
 
-	/*
-	 *	Don't spawn any connections
-	 */
-	if (check_config) return 0;
-
-	/*
-	 *	Create all of the connections, unless the admin says
-	 *	not to.
-	 */
 	for (i = 0; i < pool->start; i++) {
 		/*
 		 *	Call time() once for each spawn attempt as there
@@ -1110,6 +1308,30 @@ int fr_pool_start(fr_pool_t *pool)
 		}
 	}
 
+	return 0;
+}
+
+int fr_pool_start(fr_pool_t *pool)
+{
+	/*
+	 *	Don't spawn any connections
+	 */
+	if (check_config) return 0;
+
+	/*
+	 *	Create all of the connections, unless the admin says
+	 *	not to.
+	 */
+	if (pool->partition) {
+		uint32_t i;
+
+		for (i = 0; i < pool->num_partitions; i++) {
+			if (pool_spawn_start(pool->partition[i]) < 0) return -1;
+		}
+	} else if (pool_spawn_start(pool) < 0) {
+		return -1;
+	}
+
 	fr_pool_trigger_exec(pool, NULL, "start");
 
 	return 0;
@@ -1143,6 +1365,42 @@ fr_pool_t *fr_pool_copy(TALLOC_CTX *ctx, fr_pool_t *pool, void *opaque)
  */
 fr_pool_state_t const *fr_pool_state(fr_pool_t *pool)
 {
+	uint32_t i;
+
+	if (!pool->partition) return &pool->state;
+
+	/*
+	 *	Sum the counters of the partitions.  The
+	 *	timestamps are the most recent of any
+	 *	partition.
+	 */
+	pthread_mutex_lock(&pool->mutex);
+	pool->state.pending = pool->state.num = pool->state.active = 0;
+	pool->state.count = 0;
+	pool->state.reconnecting = false;
+
+	for (i = 0; i < pool->num_partitions; i++) {
+		fr_pool_state_t const *part = &pool->partition[i]->state;
+
+		pool->state.pending += part->pending;
+		pool->state.num += part->num;
+		pool->state.active += part->active;
+		pool->state.count += part->count;
+		if (part->reconnecting) pool->state.reconnecting = true;
+
+#define STATE_LATEST(_field) if (part->_field > pool->state._field) pool->state._field = part->_field
+		STATE_LATEST(last_checked);
+		STATE_LATEST(last_spawned);
+		STATE_LATEST(last_failed);
+		STATE_LATEST(last_throttled);
+		STATE_LATEST(last_released);
+		STATE_LATEST(last_closed);
+		STATE_LATEST(last_held_min);
+		STATE_LATEST(last_held_max);
+#undef STATE_LATEST
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
 	return &pool->state;
 }
 
@@ -1214,44 +1472,63 @@ void fr_pool_reconnect_func(fr_pool_t *pool, fr_pool_reconnect_t reconnect)
  */
 int fr_pool_reconnect(fr_pool_t *pool, REQUEST *request)
 {
-	uint32_t		i;
+	uint32_t		i, j, num;
+	fr_pool_t		**parts;
 	fr_pool_connection_t	*this;
 	time_t			now;
-
-	pthread_mutex_lock(&pool->mutex);
+	int			ret = 0;
 
 	/*
-	 *	Pause new spawn attempts (we release the mutex
-	 *	during our cond wait).
+	 *	A partitioned pool is reconnected by reconnecting
+	 *	all of its partitions at the same time.  Partitions
+	 *	are always locked in order.
 	 */
-	pool->state.reconnecting = true;
+	if (pool->partition) {
+		parts = pool->partition;
+		num = pool->num_partitions;
+	} else {
+		parts = &pool;
+		num = 1;
+	}
 
-	/*
-	 *	When the loop exits, we'll hold the lock for the pool,
-	 *	and we're guaranteed the connection create callback
-	 *	will not be using the opaque data.
-	 */
-	while (pool->state.pending) pthread_cond_wait(&pool->done_spawn, &pool->mutex);
+	for (i = 0; i < num; i++) {
+		pthread_mutex_lock(&parts[i]->mutex);
 
-	/*
-	 *	We want to ensure at least 'start' connections
-	 *	have been reconnected. We can't call reconnect
-	 *	because, we might get the same connection each
-	 *	time we reserve one, so we close 'start'
-	 *	connections, and then attempt to spawn them again.
-	 */
-	for (i = 0; i < pool->start; i++) {
-		this = fr_heap_peek(pool->heap);
-		if (!this) break;	/* There wasn't 'start' connections available */
+		/*
+		 *	Pause new spawn attempts (we release the mutex
+		 *	during our cond wait).
+		 */
+		parts[i]->state.reconnecting = true;
 
-		connection_close_internal(pool, request, this);
+		/*
+		 *	When the loop exits, we'll hold the lock for the pool,
+		 *	and we're guaranteed the connection create callback
+		 *	will not be using the opaque data.
+		 */
+		while (parts[i]->state.pending) pthread_cond_wait(&parts[i]->done_spawn, &parts[i]->mutex);
 	}
 
-	/*
-	 *	Mark all remaining connections in the pool as
-	 *	requiring reconnection.
-	 */
-	for (this = pool->head; this; this = this->next) this->needs_reconnecting = true;
+	for (i = 0; i < num; i++) {
+		/*
+		 *	We want to ensure at least 'start' connections
+		 *	have been reconnected. We can't call reconnect
+		 *	because, we might get the same connection each
+		 *	time we reserve one, so we close 'start'
+		 *	connections, and then attempt to spawn them again.
+		 */
+		for (j = 0; j < parts[i]->start; j++) {
+			this = fr_heap_peek(parts[i]->heap);
+			if (!this) break;	/* There wasn't 'start' connections available */
+
+			connection_close_internal(parts[i], request, this);
+		}
+
+		/*
+		 *	Mark all remaining connections in the pool as
+		 *	requiring reconnection.
+		 */
+		for (this = parts[i]->head; this; this = this->next) this->needs_reconnecting = true;
+	}
 
 	/*
 	 *	Call the reconnect callback (if one's set)
@@ -1270,21 +1547,28 @@ int fr_pool_reconnect(fr_pool_t *pool, REQUEST *request)
 	 *	Allow new spawn attempts, and wakeup any threads
 	 *	waiting to spawn new connections.
 	 */
-	pool->state.reconnecting = false;
-	pthread_cond_broadcast(&pool->done_reconnecting);
-	pthread_mutex_unlock(&pool->mutex);
+	for (i = num; i > 0; i--) {
+		parts[i - 1]->state.reconnecting = false;
+		pthread_cond_broadcast(&parts[i - 1]->done_reconnecting);
+		pthread_mutex_unlock(&parts[i - 1]->mutex);
+	}
 
 	now = time(NULL);
 
 	/*
 	 *	Now attempt to spawn 'start' connections.
 	 */
-	for (i = 0; i < pool->start; i++) {
-		this = connection_spawn(pool, request, now, false, true);
-		if (!this) return -1;
+	for (i = 0; i < num; i++) {
+		for (j = 0; j < parts[i]->start; j++) {
+			this = connection_spawn(parts[i], request, now, false, true);
+			if (!this) {
+				ret = -1;
+				break;
+			}
+		}
 	}
 
-	return 0;
+	return ret;
 }
 
 /** Delete a connection pool
@@ -1314,6 +1598,13 @@ void fr_pool_free(fr_pool_t *pool)
 
 	DEBUG2("Removing connection pool");
 
+	if (pool->partition) {
+		uint32_t i;
+
+		for (i = 0; i < pool->num_partitions; i++) fr_pool_free(pool->partition[i]);
+		TALLOC_FREE(pool->partition);
+	}
+
 	pthread_mutex_lock(&pool->mutex);
 
 	/*
@@ -1326,7 +1617,7 @@ void fr_pool_free(fr_pool_t *pool)
 		connection_close_internal(pool, NULL, this);
 	}
 
-	fr_pool_trigger_exec(pool, NULL, "stop");
+	if (!pool->parent) fr_pool_trigger_exec(pool, NULL, "stop");
 
 	fr_assert(pool->head == NULL);
 	fr_assert(pool->tail == NULL);
@@ -1361,7 +1652,37 @@ void fr_pool_free(fr_pool_t *pool)
  */
 void *fr_pool_connection_get(fr_pool_t *pool, REQUEST *request)
 {
-	return connection_get_internal(pool, request, true);
+	fr_pool_t	*part;
+	void		*conn;
+	uint32_t	i;
+
+	if (!pool) return NULL;
+
+	if (!pool->partition) return connection_get_internal(pool, request, true, true);
+
+	part = pool_partition(pool);
+	conn = connection_get_internal(part, request, true, false);
+	if (conn) return conn;
+
+	/*
+	 *	Slow path.  This thread's partition is exhausted,
+	 *	borrow an idle connection from another partition.
+	 *	It's returned to its own partition when released.
+	 */
+	for (i = 0; i < pool->num_partitions; i++) {
+		if (pool->partition[i] == part) continue;
+
+		conn = connection_get_internal(pool->partition[i], request, false, false);
+		if (conn) {
+			ROPTIONAL(RDEBUG2, DEBUG2, "Borrowed connection from partition %u", i);
+			return conn;
+		}
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	connection_at_max(pool, request, fr_time());
+
+	return NULL;
 }
 
 /** Release a connection
@@ -1380,7 +1701,10 @@ void fr_pool_connection_release(fr_pool_t *pool, REQUEST *request, void *conn)
 	fr_time_delta_t		held;
 	bool			trigger_min = false, trigger_max = false;
 
-	this = connection_find(pool, conn);
+	/*
+	 *	From here on, pool is the partition owning the connection
+	 */
+	this = connection_find_partition(&pool, pool, conn);
 	if (!this) return;
 
 	this->in_use = false;
@@ -1472,24 +1796,25 @@ void fr_pool_connection_release(fr_pool_t *pool, REQUEST *request, void *conn)
 void *fr_pool_connection_reconnect(fr_pool_t *pool, REQUEST *request, void *conn)
 {
 	fr_pool_connection_t	*this;
+	fr_pool_t		*part;
 
 	if (!pool || !conn) return NULL;
 
 	/*
-	 *	If connection_find is successful the pool is now locked
+	 *	If connection_find_partition is successful the partition is now locked
 	 */
-	this = connection_find(pool, conn);
+	this = connection_find_partition(&part, pool, conn);
 	if (!this) return NULL;
 
 	ROPTIONAL(RINFO, INFO, "Deleting inviable connection (%" PRIu64 ")", this->number);
 
-	connection_close_internal(pool, request, this);
-	connection_check(pool, request);			/* Whilst we still have the lock (will release the lock) */
+	connection_close_internal(part, request, this);
+	connection_check(part, request);			/* Whilst we still have the lock (will release the lock) */
 
 	/*
 	 *	Return an existing connection or spawn a new one.
 	 */
-	return connection_get_internal(pool, request, true);
+	return fr_pool_connection_get(pool, request);
 }
 
 /** Delete a connection from the connection pool.
@@ -1510,7 +1835,10 @@ int fr_pool_connection_close(fr_pool_t *pool, REQUEST *request, void *conn)
 {
 	fr_pool_connection_t *this;
 
-	this = connection_find(pool, conn);
+	/*
+	 *	From here on, pool is the partition owning the connection
+	 */
+	this = connection_find_partition(&pool, pool, conn);
 	if (!this) return 0;
 
 	/*
@@ -0,0 +1,706 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/radutmp_db.c
+ * @brief Indexed, memory mapped session database using radutmp records.
+ *
+ * The classic radutmp file is a flat array of records, which has to be
+ * scanned from the start for every accounting packet.  This database
+ * stores the same records, but in a fixed size memory mapped file, with
+ * two indexes alongside them:
+ *
+ *   - An open addressing hash table keyed by (NAS-IP-Address, NAS-Port).
+ *     A record is bound to its NAS/port combination for the life of the
+ *     file, so entries are never removed, and the table never needs to
+ *     be rehashed.
+ *   - A table of hash chains keyed by login name.
+ *
+ * Writers serialise on a lock over the file header.  Readers (radwho,
+ * and lookups in the server) never lock.  Each record carries a
+ * sequence number which is odd while the record is being written, so a
+ * reader copies the record and retries if the sequence number changed.
+ * Changes to the login chains bump a generation counter in the header
+ * in the same way.
+ *
+ * File layout:
+ @verbatim
+   +--------------------+
+   | header             |
+   +--------------------+
+   | records            | max_sessions * radutmp_db_entry_t
+   +--------------------+
+   | port index         | index_size * uint32_t
+   +--------------------+
+   | login index        | index_size * uint32_t
+   +--------------------+
+ @endverbatim
+ *
+ * Index slots, and chain links, hold record number + 1, so that 0 means
+ * empty.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/radutmp_db.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#define RADUTMP_DB_MAGIC	0x52554442	//!< "RUDB"
+#define RADUTMP_DB_VERSION	1
+
+#define RADUTMP_DB_MAX_SESSIONS	(1 << 24)	//!< Keeps the file size, and the indexes, sane.
+
+#define RADUTMP_DB_SPINS	100000		//!< How many times a reader retries before
+						///< deciding a writer died mid-update.
+
+/** Header at the start of the session database
+ *
+ */
+typedef struct {
+	uint32_t		magic;			//!< Identifies the file as an indexed session database.
+	uint32_t		version;		//!< Of the file layout.
+	uint32_t		max_sessions;		//!< Number of record slots.
+	uint32_t		index_size;		//!< Number of slots in each index.  A power of 2.
+	_Atomic(uint32_t)	used;			//!< Record slots handed out so far.
+	_Atomic(uint32_t)	login_gen;		//!< Odd while a login chain is being changed.
+	uint8_t			pad[40];
+} radutmp_db_header_t;
+
+/** A record, and the information needed to read it consistently
+ *
+ */
+typedef struct {
+	_Atomic(uint32_t)	seq;			//!< Odd while the record is being written.
+	_Atomic(uint32_t)	login_next;		//!< Next record in the same login chain.
+	uint32_t		login_bucket;		//!< Login chain the record is in, + 1.  Writer only.
+	uint32_t		pad;
+	struct radutmp		ut;			//!< The session.
+} radutmp_db_entry_t;
+
+struct radutmp_db_s {
+	char const		*filename;		//!< We opened.
+	int			fd;			//!< Of the database, used for locking.
+	bool			writable;		//!< Whether we opened the database for writing.
+
+	uint8_t			*map;			//!< Start of the mapping.
+	size_t			map_len;		//!< Length of the mapping.
+
+	radutmp_db_header_t	*header;		//!< At the start of the mapping.
+	radutmp_db_entry_t	*entries;		//!< Array of max_sessions records.
+	_Atomic(uint32_t)	*port_index;		//!< Slots, keyed by NAS address and port.
+	_Atomic(uint32_t)	*login_index;		//!< Chain heads, keyed by login.
+	uint32_t		mask;			//!< index_size - 1.
+};
+
+/** Calculate the size of the database file
+ *
+ */
+static size_t radutmp_db_len(uint32_t max_sessions, uint32_t index_size)
+{
+	return sizeof(radutmp_db_header_t) +
+	       ((size_t)max_sessions * sizeof(radutmp_db_entry_t)) +
+	       ((size_t)index_size * sizeof(uint32_t) * 2);
+}
+
+static uint32_t radutmp_db_port_hash(uint32_t nas_address, uint32_t nas_port)
+{
+	uint32_t key[2] = { nas_address, nas_port };
+
+	return fr_hash(key, sizeof(key));
+}
+
+static uint32_t radutmp_db_login_hash(char const *login)
+{
+	return fr_hash(login, strnlen(login, RUT_NAMESIZE));
+}
+
+/** Copy a record out of the database, without locking
+ *
+ * @param[out] out	Where to write the copy.
+ * @param[in] db	to read from.
+ * @param[in] entry	to copy.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the record never stopped changing.
+ */
+static int radutmp_db_entry_read(struct radutmp *out, radutmp_db_t *db, radutmp_db_entry_t *entry)
+{
+	uint32_t	before, after;
+	int		i;
+
+	for (i = 0; i < RADUTMP_DB_SPINS; i++) {
+		before = atomic_load_explicit(&entry->seq, memory_order_acquire);
+		if (before & 0x01) {
+			sched_yield();
+			continue;
+		}
+
+		memcpy(out, &entry->ut, sizeof(*out));
+
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+		if (before == after) return 0;
+	}
+
+	fr_strerror_printf("Record %zu in session database %s is stuck mid-update",
+			   (size_t)(entry - db->entries), db->filename);
+	return -1;
+}
+
+/** Overwrite a record, making the change visible to readers
+ *
+ */
+static void radutmp_db_entry_write(radutmp_db_entry_t *entry, struct radutmp const *ut)
+{
+	uint32_t seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&entry->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	memcpy(&entry->ut, ut, sizeof(entry->ut));
+
+	atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+}
+
+/** Move a record to the login chain matching its current login
+ *
+ * Readers walking the chains retry if login_gen changes, so they never
+ * miss records which are moved while they're walking.
+ */
+static void radutmp_db_login_link(radutmp_db_t *db, uint32_t idx)
+{
+	radutmp_db_entry_t	*entry = &db->entries[idx];
+	uint32_t		bucket = radutmp_db_login_hash(entry->ut.login) & db->mask;
+	uint32_t		gen;
+
+	if (entry->login_bucket == (bucket + 1)) return;
+
+	gen = atomic_load_explicit(&db->header->login_gen, memory_order_relaxed);
+	atomic_store_explicit(&db->header->login_gen, gen + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	/*
+	 *	Unlink from the old chain
+	 */
+	if (entry->login_bucket) {
+		_Atomic(uint32_t)	*prev = &db->login_index[entry->login_bucket - 1];
+		uint32_t		i;
+
+		while ((i = atomic_load_explicit(prev, memory_order_relaxed))) {
+			if (i == (idx + 1)) {
+				atomic_store_explicit(prev, atomic_load_explicit(&entry->login_next,
+										 memory_order_relaxed),
+						      memory_order_relaxed);
+				break;
+			}
+			prev = &db->entries[i - 1].login_next;
+		}
+	}
+
+	/*
+	 *	...and push onto the head of the new one.
+	 */
+	atomic_store_explicit(&entry->login_next,
+			      atomic_load_explicit(&db->login_index[bucket], memory_order_relaxed),
+			      memory_order_relaxed);
+	atomic_store_explicit(&db->login_index[bucket], idx + 1, memory_order_relaxed);
+	entry->login_bucket = bucket + 1;
+
+	atomic_store_explicit(&db->header->login_gen, gen + 2, memory_order_release);
+}
+
+/** Find the port index slot for a NAS address and port
+ *
+ * @param[out] idx		The record bound to the NAS and port, or
+ *				UINT32_MAX if there isn't one yet.
+ * @param[in] db		to search.
+ * @param[in] nas_address	to search for.
+ * @param[in] nas_port		to search for.
+ * @return
+ *	- The slot containing the record, or the empty slot where
+ *	  it should be added.
+ *	- NULL if reading a record failed.
+ */
+static _Atomic(uint32_t) *radutmp_db_port_slot(uint32_t *idx, radutmp_db_t *db,
+					       uint32_t nas_address, uint32_t nas_port)
+{
+	uint32_t	i, slot, value;
+	struct radutmp	ut;
+
+	*idx = UINT32_MAX;
+
+	slot = radutmp_db_port_hash(nas_address, nas_port) & db->mask;
+
+	/*
+	 *	The index is at least twice the size of the
+	 *	record array, so there's always an empty slot.
+	 */
+	for (i = 0; i <= db->mask; i++, slot = (slot + 1) & db->mask) {
+		value = atomic_load_explicit(&db->port_index[slot], memory_order_acquire);
+		if (!value) return &db->port_index[slot];
+
+		if (value > db->header->max_sessions) {
+			fr_strerror_printf("Session database %s has a corrupt port index", db->filename);
+			return NULL;
+		}
+
+		/*
+		 *	The NAS address and port of a record
+		 *	never change, but the rest of it
+		 *	may be changing under us.
+		 */
+		if (radutmp_db_entry_read(&ut, db, &db->entries[value - 1]) < 0) return NULL;
+		if ((ut.nas_address != nas_address) || (ut.nas_port != nas_port)) continue;
+
+		*idx = value - 1;
+		return &db->port_index[slot];
+	}
+
+	fr_strerror_printf("Session database %s has a corrupt port index", db->filename);
+	return NULL;
+}
+
+/** Check whether a file is an indexed session database
+ *
+ * @param[in] filename	to check.
+ * @return
+ *	- 1 if the file is an indexed session database.
+ *	- 0 if it's something else, i.e. a classic radutmp file.
+ *	- -1 if the file couldn't be read.
+ */
+int radutmp_db_check(char const *filename)
+{
+	int		fd;
+	uint32_t	magic;
+	ssize_t		len;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	len = read(fd, &magic, sizeof(magic));
+	close(fd);
+	if (len < 0) {
+		fr_strerror_printf("Failed reading %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	return ((len == sizeof(magic)) && (magic == RADUTMP_DB_MAGIC));
+}
+
+static int _radutmp_db_free(radutmp_db_t *db)
+{
+	if (db->map) munmap(db->map, db->map_len);
+	if (db->fd >= 0) close(db->fd);
+
+	return 0;
+}
+
+/** Open, or create, an indexed session database
+ *
+ * @param[in] ctx		to allocate the handle in.
+ * @param[in] filename		of the database.
+ * @param[in] writable		Open the database for writing, creating it if
+ *				it doesn't exist.
+ * @param[in] max_sessions	The number of sessions a new database can hold.
+ *				Ignored if the database already exists.
+ * @param[in] mode		Permissions for a new database.
+ * @return
+ *	- A handle for the database.
+ *	- NULL on error.
+ */
+radutmp_db_t *radutmp_db_open(TALLOC_CTX *ctx, char const *filename, bool writable,
+			      uint32_t max_sessions, mode_t mode)
+{
+	radutmp_db_t		*db;
+	radutmp_db_header_t	header;
+	struct stat		st;
+	bool			created = false;
+	uint32_t		index_size;
+
+	MEM(db = talloc_zero(ctx, radutmp_db_t));
+	db->fd = -1;
+	db->writable = writable;
+	talloc_set_destructor(db, _radutmp_db_free);
+	MEM(db->filename = talloc_strdup(db, filename));
+
+	db->fd = open(filename, writable ? (O_RDWR | O_CREAT) : O_RDONLY, mode);
+	if (db->fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", filename, fr_syserror(errno));
+		goto error;
+	}
+
+	/*
+	 *	Stop two writers racing to initialise a new file.
+	 */
+	if (writable && (radutmp_db_lock(db) < 0)) goto error;
+
+	if (fstat(db->fd, &st) < 0) {
+		fr_strerror_printf("Failed examining %s: %s", filename, fr_syserror(errno));
+		goto error_unlock;
+	}
+
+	if (st.st_size == 0) {
+		if (!writable) {
+			fr_strerror_printf("Session database %s is empty", filename);
+			goto error;
+		}
+
+		if ((max_sessions == 0) || (max_sessions > RADUTMP_DB_MAX_SESSIONS)) {
+			fr_strerror_printf("Session database size must be between 1 and %u sessions",
+					   RADUTMP_DB_MAX_SESSIONS);
+			goto error_unlock;
+		}
+
+		for (index_size = 1; index_size < (max_sessions * 2); index_size <<= 1);
+
+		memset(&header, 0, sizeof(header));
+		header.magic = RADUTMP_DB_MAGIC;
+		header.version = RADUTMP_DB_VERSION;
+		header.max_sessions = max_sessions;
+		header.index_size = index_size;
+
+		db->map_len = radutmp_db_len(max_sessions, index_size);
+		if (ftruncate(db->fd, db->map_len) < 0) {
+			fr_strerror_printf("Failed sizing %s: %s", filename, fr_syserror(errno));
+			goto error_unlock;
+		}
+		created = true;
+	} else {
+		ssize_t len;
+
+		len = pread(db->fd, &header, sizeof(header), 0);
+		if ((len != sizeof(header)) || (header.magic != RADUTMP_DB_MAGIC)) {
+			fr_strerror_printf("%s is not an indexed session database", filename);
+			goto error_unlock;
+		}
+
+		if (header.version != RADUTMP_DB_VERSION) {
+			fr_strerror_printf("Session database %s has version %u, expected %u",
+					   filename, header.version, RADUTMP_DB_VERSION);
+			goto error_unlock;
+		}
+
+		if ((header.max_sessions == 0) || (header.max_sessions > RADUTMP_DB_MAX_SESSIONS) ||
+		    (header.index_size < (header.max_sessions * 2)) ||
+		    (header.index_size & (header.index_size - 1))) {
+			fr_strerror_printf("Session database %s has a corrupt header", filename);
+			goto error_unlock;
+		}
+
+		db->map_len = radutmp_db_len(header.max_sessions, header.index_size);
+		if ((size_t)st.st_size != db->map_len) {
+			fr_strerror_printf("Session database %s is truncated", filename);
+			goto error_unlock;
+		}
+	}
+
+	db->map = mmap(NULL, db->map_len, writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+		       MAP_SHARED, db->fd, 0);
+	if (db->map == MAP_FAILED) {
+		db->map = NULL;
+		fr_strerror_printf("Failed mapping %s: %s", filename, fr_syserror(errno));
+		goto error_unlock;
+	}
+
+	db->header = (radutmp_db_header_t *)db->map;
+	db->entries = (radutmp_db_entry_t *)(db->map + sizeof(radutmp_db_header_t));
+	db->port_index = (_Atomic(uint32_t) *)(db->entries + header.max_sessions);
+	db->login_index = db->port_index + header.index_size;
+	db->mask = header.index_size - 1;
+
+	/*
+	 *	The rest of the file is zeroed by ftruncate.
+	 */
+	if (created) memcpy(db->header, &header, sizeof(header));
+
+	if (writable) radutmp_db_unlock(db);
+
+	return db;
+
+error_unlock:
+	if (writable) radutmp_db_unlock(db);
+error:
+	talloc_free(db);
+	return NULL;
+}
+
+/** Return the filename of an open session database
+ *
+ */
+char const *radutmp_db_filename(radutmp_db_t const *db)
+{
+	return db->filename;
+}
+
+/** Lock the database for writing
+ *
+ * Must be held around calls to the functions which modify the database.
+ */
+int radutmp_db_lock(radutmp_db_t *db)
+{
+	if (rad_lockfd(db->fd, sizeof(radutmp_db_header_t)) < 0) {
+		fr_strerror_printf("Failed locking %s: %s", db->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Unlock the database
+ *
+ */
+int radutmp_db_unlock(radutmp_db_t *db)
+{
+	if (rad_unlockfd(db->fd, sizeof(radutmp_db_header_t)) < 0) {
+		fr_strerror_printf("Failed unlocking %s: %s", db->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Find the record for a NAS port, without locking
+ *
+ * @param[out] out		Where to write a copy of the record.
+ * @param[in] db		to search.
+ * @param[in] nas_address	to search for.
+ * @param[in] nas_port		to search for.
+ * @return
+ *	- 1 if a record was found.
+ *	- 0 if no record was found.
+ *	- -1 on error.
+ */
+int radutmp_db_port_find(struct radutmp *out, radutmp_db_t *db, uint32_t nas_address, uint32_t nas_port)
+{
+	uint32_t idx;
+
+	if (!radutmp_db_port_slot(&idx, db, nas_address, nas_port)) return -1;
+	if (idx == UINT32_MAX) return 0;
+
+	return (radutmp_db_entry_read(out, db, &db->entries[idx]) < 0) ? -1 : 1;
+}
+
+/** Write the record for a NAS port, adding it if the NAS port hasn't been seen before
+ *
+ * @note The caller must hold the lock.
+ *
+ * @param[in] db	to update.
+ * @param[in] ut	The new record.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error, or if the database is full.
+ */
+int radutmp_db_port_update(radutmp_db_t *db, struct radutmp const *ut)
+{
+	_Atomic(uint32_t)	*slot;
+	uint32_t		idx;
+
+	fr_assert(db->writable);
+
+	slot = radutmp_db_port_slot(&idx, db, ut->nas_address, ut->nas_port);
+	if (!slot) return -1;
+
+	if (idx != UINT32_MAX) {
+		radutmp_db_entry_write(&db->entries[idx], ut);
+		radutmp_db_login_link(db, idx);
+		return 0;
+	}
+
+	idx = atomic_load_explicit(&db->header->used, memory_order_relaxed);
+	if (idx >= db->header->max_sessions) {
+		fr_strerror_printf("Session database %s is full (%u sessions)",
+				   db->filename, db->header->max_sessions);
+		return -1;
+	}
+
+	/*
+	 *	Fill in the record before anything
+	 *	points to it.
+	 */
+	radutmp_db_entry_write(&db->entries[idx], ut);
+	radutmp_db_login_link(db, idx);
+
+	atomic_store_explicit(&db->header->used, idx + 1, memory_order_release);
+	atomic_store_explicit(slot, idx + 1, memory_order_release);
+
+	return 0;
+}
+
+/** Mark all sessions on a NAS as logged out
+ *
+ * @note The caller must hold the lock.
+ *
+ * @param[in] db		to update.
+ * @param[in] nas_address	of the NAS.  0 for all NASs.
+ * @param[in] t			to record as the logout time.
+ * @return the number of sessions zapped.
+ */
+int radutmp_db_zap(radutmp_db_t *db, uint32_t nas_address, time_t t)
+{
+	uint32_t	i, used;
+	int		count = 0;
+
+	fr_assert(db->writable);
+
+	used = atomic_load_explicit(&db->header->used, memory_order_relaxed);
+	for (i = 0; i < used; i++) {
+		struct radutmp ut;
+
+		/*
+		 *	We hold the lock, so the record
+		 *	can't change under us.
+		 */
+		memcpy(&ut, &db->entries[i].ut, sizeof(ut));
+		if (((nas_address != 0) && (nas_address != ut.nas_address)) || (ut.type != P_LOGIN)) continue;
+
+		ut.type = P_IDLE;
+		ut.time = t;
+		radutmp_db_entry_write(&db->entries[i], &ut);
+		count++;
+	}
+
+	return count;
+}
+
+/** Call a function for every record in the database, without locking
+ *
+ * Records which are logged out are included, so the walker should
+ * check ut->type.
+ *
+ * @param[in] db	to walk.
+ * @param[in] walker	to call.
+ * @param[in] uctx	to pass to the walker.
+ * @return
+ *	- 0 on success.
+ *	- The return code of the walker if it stopped the walk.
+ *	- -1 if a record couldn't be read.
+ */
+int radutmp_db_walk(radutmp_db_t *db, radutmp_db_walk_t walker, void *uctx)
+{
+	uint32_t	i, used;
+	int		ret;
+
+	used = atomic_load_explicit(&db->header->used, memory_order_acquire);
+	for (i = 0; i < used; i++) {
+		struct radutmp ut;
+
+		if (radutmp_db_entry_read(&ut, db, &db->entries[i]) < 0) return -1;
+
+		ret = walker(&ut, uctx);
+		if (ret < 0) return ret;
+	}
+
+	return 0;
+}
+
+/** Call a function for every session of a user, without locking
+ *
+ * Only records which are logged in, and where the login matches
+ * exactly, are passed to the walker.
+ *
+ * @param[in] db	to search.
+ * @param[in] login	to search for.
+ * @param[in] walker	to call.
+ * @param[in] uctx	to pass to the walker.
+ * @return
+ *	- 0 on success.
+ *	- The return code of the walker if it stopped the walk.
+ *	- -1 if the login chain couldn't be read.
+ */
+int radutmp_db_user_walk(radutmp_db_t *db, char const *login, radutmp_db_walk_t walker, void *uctx)
+{
+	struct radutmp	*found = NULL;
+	uint32_t	bucket = radutmp_db_login_hash(login) & db->mask;
+	uint32_t	before, after, idx, steps, num = 0, i;
+	int		tries, ret = 0;
+
+	/*
+	 *	Gather the matching records first, so that the
+	 *	walker isn't called twice for the same record
+	 *	if the chain changes under us, and we have to
+	 *	go around again.
+	 */
+	for (tries = 0; tries < RADUTMP_DB_SPINS; tries++) {
+		before = atomic_load_explicit(&db->header->login_gen, memory_order_acquire);
+		if (before & 0x01) {
+			sched_yield();
+			continue;
+		}
+
+		num = 0;
+		idx = atomic_load_explicit(&db->login_index[bucket], memory_order_acquire);
+		for (steps = 0; idx && (steps < db->header->max_sessions); steps++) {
+			struct radutmp ut;
+
+			if (idx > db->header->max_sessions) break;
+
+			if (radutmp_db_entry_read(&ut, db, &db->entries[idx - 1]) < 0) {
+				talloc_free(found);
+				return -1;
+			}
+
+			if ((ut.type == P_LOGIN) && (strncmp(ut.login, login, RUT_NAMESIZE) == 0)) {
+				if (!found || (num >= talloc_array_length(found))) {
+					MEM(found = talloc_realloc(NULL, found, struct radutmp, num ? num * 2 : 8));
+				}
+				found[num++] = ut;
+			}
+
+			idx = atomic_load_explicit(&db->entries[idx - 1].login_next, memory_order_acquire);
+		}
+
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(&db->header->login_gen, memory_order_relaxed);
+		if (before == after) break;
+	}
+
+	if (tries == RADUTMP_DB_SPINS) {
+		fr_strerror_printf("Login chains in session database %s never stopped changing", db->filename);
+		talloc_free(found);
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		ret = walker(&found[i], uctx);
+		if (ret < 0) break;
+	}
+	talloc_free(found);
+
+	return (ret < 0) ? ret : 0;
+}
@@ -0,0 +1,74 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/radutmp_db.h
+ * @brief Indexed, memory mapped session database using radutmp records.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(radutmp_db_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/server/radutmp.h>
+
+#include <talloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct radutmp_db_s radutmp_db_t;
+
+/** Called for every record in the session database
+ *
+ * @param[in] ut	A consistent copy of the record.
+ * @param[in] uctx	passed to the walk function.
+ * @return
+ *	- 0 to continue walking.
+ *	- <0 to stop.
+ */
+typedef int (*radutmp_db_walk_t)(struct radutmp const *ut, void *uctx);
+
+int		radutmp_db_check(char const *filename);
+
+radutmp_db_t	*radutmp_db_open(TALLOC_CTX *ctx, char const *filename, bool writable,
+				 uint32_t max_sessions, mode_t mode);
+
+char const	*radutmp_db_filename(radutmp_db_t const *db);
+
+int		radutmp_db_lock(radutmp_db_t *db);
+
+int		radutmp_db_unlock(radutmp_db_t *db);
+
+int		radutmp_db_port_find(struct radutmp *out, radutmp_db_t *db, uint32_t nas_address, uint32_t nas_port);
+
+int		radutmp_db_port_update(radutmp_db_t *db, struct radutmp const *ut);
+
+int		radutmp_db_zap(radutmp_db_t *db, uint32_t nas_address, time_t t);
+
+int		radutmp_db_walk(radutmp_db_t *db, radutmp_db_walk_t walker, void *uctx);
+
+int		radutmp_db_user_walk(radutmp_db_t *db, char const *login, radutmp_db_walk_t walker, void *uctx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -45,6 +45,7 @@ typedef struct {
  * Allows use of %{n} expansions.
  *
  * @note If preg was runtime-compiled, it will be consumed and *preg will be set to NULL.
+ *	Expressions from #regex_compile_cached are referenced, not consumed.
  * @note regmatch will be consumed and *regmatch will be set to NULL.
  * @note Their lifetimes will be bound to the match request data.
  *
@@ -82,10 +83,14 @@ void regex_sub_to_request(REQUEST *request, regex_t **preg, fr_regmatch_t **regm
 	MEM(new_rc = talloc(request, fr_regcapture_t));
 
 	/*
-	 *	Steal runtime pregs, leave precompiled ones
+	 *	Steal runtime pregs, leave precompiled ones, and
+	 *	hold a reference to cached ones so they survive
+	 *	being evicted.
 	 */
 #if defined(HAVE_REGEX_PCRE) || defined(HAVE_REGEX_PCRE2)
-	if (!(*preg)->precompiled) {
+	if ((*preg)->cached) {
+		MEM(new_rc->preg = talloc_reference(new_rc, *preg));
+	} else if (!(*preg)->precompiled) {
 		new_rc->preg = talloc_steal(new_rc, *preg);
 		*preg = NULL;
 	} else {
@@ -0,0 +1,502 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Reload data files in the background when they change
+ *
+ * Modules such as rlm_files build an index from one or more data files
+ * at startup.  Rebuilding that index used to need a HUP, which re-reads
+ * everything, and blocks request processing while it does.
+ *
+ * A reload handle owns the current version of a module's parsed data.
+ * A watcher thread watches the files with kqueue vnode filters, and when
+ * they change, calls the module's parse function to build a new version.
+ * The new version is published with an atomic pointer swap, so workers
+ * never wait for a parse.
+ *
+ * Old versions are retired RCU style.  Workers bracket their use of the
+ * data with #fr_reload_read_lock and #fr_reload_read_unlock, which record
+ * the global epoch the worker entered its read section in.  After a swap,
+ * the watcher advances the epoch, and waits until no worker is still in a
+ * read section it entered before the swap.  The old version is then
+ * freed.  Readers never take locks or perform read-modify-write operations.
+ *
+ * @file src/lib/server/reload.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "%s - "
+#define LOG_PREFIX_ARGS reload->name
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/reload.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/thread_local.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** How long to wait for writes to a file to settle before parsing it
+ *
+ * Editors and deployment tools often write a file in several steps,
+ * or replace it with a rename.
+ */
+#define RELOAD_SETTLE_DELAY	(NSEC)
+
+/** A thread which reads data published by reload handles
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the list of readers.
+	_Atomic(uint64_t)	active;			//!< Epoch the current read section started in.
+							///< 0 if not in a read section.
+	unsigned int		depth;			//!< Nested read sections.
+} reload_reader_t;
+
+static _Thread_local reload_reader_t	*reload_reader;
+
+static pthread_mutex_t			reader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_head_t			reader_list;	//!< Every thread which has entered a read section.
+static bool				reader_list_init;
+static _Atomic(uint64_t)		reload_epoch = 1;
+
+struct fr_reload_s {
+	char const		*name;			//!< For log messages.
+
+	char const		**filenames;		//!< Files to watch.
+	int			*fds;			//!< Watching each file.  -1 if the file isn't open.
+	size_t			num_files;
+	bool			watch;			//!< Whether we watch the files at all.
+
+	fr_reload_parse_t	parse;			//!< Builds a new version of the data.
+	void			*uctx;			//!< Passed to parse.
+
+	_Atomic(void *)		data;			//!< The current version.
+
+	pthread_mutex_t		mutex;			//!< Serialises starting the watcher.
+	pthread_t		thread;			//!< Watches the files, and parses them.
+	bool			running;		//!< Whether the watcher has been started.
+	int			pipe[2];		//!< Written to, to stop the watcher.
+
+	/*
+	 *	Only used by the watcher thread.
+	 */
+	fr_event_list_t		*el;			//!< Watcher's event list.
+	fr_event_timer_t const	*ev;			//!< Waiting for writes to settle.
+	bool			reopen;			//!< A file was deleted or replaced.
+};
+
+static void _reload_reader_free(void *arg)
+{
+	reload_reader_t *rr = arg;
+
+	pthread_mutex_lock(&reader_mutex);
+	fr_dlist_remove(&reader_list, rr);
+	pthread_mutex_unlock(&reader_mutex);
+
+	talloc_free(rr);
+}
+
+/** Register the calling thread as a reader
+ *
+ */
+static reload_reader_t *reload_reader_alloc(void)
+{
+	reload_reader_t *rr;
+
+	MEM(rr = talloc_zero(NULL, reload_reader_t));
+	atomic_init(&rr->active, 0);
+
+	pthread_mutex_lock(&reader_mutex);
+	if (!reader_list_init) {
+		fr_dlist_init(&reader_list, reload_reader_t, entry);
+		reader_list_init = true;
+	}
+	fr_dlist_insert_tail(&reader_list, rr);
+	pthread_mutex_unlock(&reader_mutex);
+
+	fr_thread_local_set_destructor(reload_reader, _reload_reader_free, rr);
+
+	return rr;
+}
+
+/** Wait until no reader can still be using data which was unpublished before this call
+ *
+ */
+static void reload_synchronize(void)
+{
+	uint64_t	epoch;
+
+	epoch = atomic_fetch_add(&reload_epoch, 1) + 1;
+
+	for (;;) {
+		reload_reader_t	*rr = NULL;
+		bool		busy = false;
+
+		pthread_mutex_lock(&reader_mutex);
+		if (!reader_list_init) {
+			pthread_mutex_unlock(&reader_mutex);
+			return;
+		}
+
+		while ((rr = fr_dlist_next(&reader_list, rr))) {
+			uint64_t active = atomic_load(&rr->active);
+
+			if (active && (active < epoch)) {
+				busy = true;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&reader_mutex);
+
+		if (!busy) return;
+
+		/*
+		 *	Read sections are a single lookup,
+		 *	so this won't spin for long.
+		 */
+		usleep(1000);
+	}
+}
+
+/** Enter a read section, and return the current version of the data
+ *
+ * The data remains valid until the matching #fr_reload_read_unlock.
+ * Read sections may be nested, but must not span a yield.
+ *
+ * @param[in] reload	to get the data for.
+ * @return The current version of the data.
+ */
+void *fr_reload_read_lock(fr_reload_t *reload)
+{
+	reload_reader_t *rr = reload_reader;
+
+	if (unlikely(!rr)) rr = reload_reader_alloc();
+
+	if (rr->depth++ == 0) atomic_store(&rr->active, atomic_load(&reload_epoch));
+
+	return atomic_load(&reload->data);
+}
+
+/** Leave a read section
+ *
+ * @param[in] reload	the data was read from.
+ */
+void fr_reload_read_unlock(UNUSED fr_reload_t *reload)
+{
+	reload_reader_t *rr = reload_reader;
+
+	fr_assert(rr && rr->depth);
+
+	if (--rr->depth == 0) atomic_store(&rr->active, 0);
+}
+
+/** Parse the files, and publish the new version
+ *
+ */
+static void reload_parse(fr_reload_t *reload)
+{
+	void	*new, *old;
+
+	DEBUG("Files changed, reloading");
+
+	if (reload->parse(&new, reload->uctx) < 0) {
+		PERROR("Failed reloading, continuing with the previous version");
+		return;
+	}
+
+	old = atomic_exchange(&reload->data, new);
+	reload_synchronize();
+	talloc_free(old);
+
+	INFO("Reloaded");
+}
+
+static void _reload_changed(fr_event_list_t *el, int fd, int flags, void *uctx);
+static void _reload_replaced(fr_event_list_t *el, int fd, int flags, void *uctx);
+
+/** Open any files which aren't being watched, and watch them
+ *
+ * @return
+ *	- 0 if all files are being watched.
+ *	- -1 if one or more couldn't be opened.
+ */
+static int reload_watch(fr_reload_t *reload)
+{
+	fr_event_vnode_func_t	funcs = {
+					.write = _reload_changed,
+					.extend = _reload_changed,
+					.attrib = _reload_changed,
+					.delete = _reload_replaced,
+					.rename = _reload_replaced
+				};
+	size_t			i;
+	int			oflag, ret = 0;
+
+#ifdef O_EVTONLY
+	oflag = O_EVTONLY;
+#else
+	oflag = O_RDONLY;
+#endif
+
+	for (i = 0; i < reload->num_files; i++) {
+		if (reload->fds[i] >= 0) continue;
+
+		reload->fds[i] = open(reload->filenames[i], oflag);
+		if (reload->fds[i] < 0) {
+			DEBUG("Failed opening %s: %s", reload->filenames[i], fr_syserror(errno));
+			ret = -1;
+			continue;
+		}
+
+		if (fr_event_filter_insert(reload->el, reload->el, reload->fds[i], FR_EVENT_FILTER_VNODE,
+					   &funcs, NULL, reload) < 0) {
+			PERROR("Failed watching %s", reload->filenames[i]);
+			close(reload->fds[i]);
+			reload->fds[i] = -1;
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+/** Stop watching a file which has been deleted or replaced
+ *
+ */
+static void reload_unwatch(fr_reload_t *reload, int fd)
+{
+	size_t i;
+
+	for (i = 0; i < reload->num_files; i++) {
+		if (reload->fds[i] != fd) continue;
+
+		(void) fr_event_fd_delete(reload->el, fd, FR_EVENT_FILTER_VNODE);
+		close(fd);
+		reload->fds[i] = -1;
+		return;
+	}
+}
+
+static void _reload_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_reload_t	*reload = talloc_get_type_abort(uctx, fr_reload_t);
+
+	/*
+	 *	Wait for replaced files to reappear,
+	 *	there's no point parsing half the data.
+	 */
+	if (reload->reopen) {
+		if (reload_watch(reload) < 0) {
+			if (fr_event_timer_in(reload->el, reload->el, &reload->ev, RELOAD_SETTLE_DELAY,
+					      _reload_timer, reload) < 0) {
+				PERROR("Failed inserting reload timer");
+			}
+			return;
+		}
+		reload->reopen = false;
+	}
+
+	reload_parse(reload);
+}
+
+/** (Re)start the settle timer
+ *
+ */
+static void reload_schedule(fr_reload_t *reload)
+{
+	if (fr_event_timer_in(reload->el, reload->el, &reload->ev, RELOAD_SETTLE_DELAY, _reload_timer, reload) < 0) {
+		PERROR("Failed inserting reload timer");
+	}
+}
+
+static void _reload_changed(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_reload_t	*reload = talloc_get_type_abort(uctx, fr_reload_t);
+
+	reload_schedule(reload);
+}
+
+static void _reload_replaced(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_reload_t	*reload = talloc_get_type_abort(uctx, fr_reload_t);
+
+	reload_unwatch(reload, fd);
+	reload->reopen = true;
+	reload_schedule(reload);
+}
+
+static void _reload_stop(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, UNUSED void *uctx)
+{
+	fr_event_loop_exit(el, 1);
+}
+
+static void *reload_watcher(void *arg)
+{
+	fr_reload_t	*reload = talloc_get_type_abort(arg, fr_reload_t);
+	size_t		i;
+
+	reload->el = fr_event_list_alloc(NULL, NULL, NULL);
+	if (!reload->el) {
+		PERROR("Failed allocating event list, files will not be reloaded");
+		return NULL;
+	}
+
+	if (fr_event_fd_insert(reload->el, reload->el, reload->pipe[0], _reload_stop, NULL, NULL, reload) < 0) {
+		PERROR("Failed inserting stop pipe, files will not be reloaded");
+		goto done;
+	}
+
+	if (reload_watch(reload) < 0) {
+		reload->reopen = true;
+		reload_schedule(reload);
+	}
+
+	(void) fr_event_loop(reload->el);
+
+done:
+	for (i = 0; i < reload->num_files; i++) {
+		if (reload->fds[i] < 0) continue;
+
+		(void) fr_event_fd_delete(reload->el, reload->fds[i], FR_EVENT_FILTER_VNODE);
+		close(reload->fds[i]);
+		reload->fds[i] = -1;
+	}
+	TALLOC_FREE(reload->el);
+
+	return NULL;
+}
+
+static int _reload_free(fr_reload_t *reload)
+{
+	if (reload->running) {
+		if (write(reload->pipe[1], "", 1) < 0) {
+			ERROR("Failed stopping watcher: %s", fr_syserror(errno));
+		} else {
+			pthread_join(reload->thread, NULL);
+		}
+	}
+
+	if (reload->pipe[0] >= 0) close(reload->pipe[0]);
+	if (reload->pipe[1] >= 0) close(reload->pipe[1]);
+	pthread_mutex_destroy(&reload->mutex);
+
+	talloc_free(atomic_load(&reload->data));
+
+	return 0;
+}
+
+/** Parse a set of files, and optionally reload them when they change
+ *
+ * @param[in] ctx		to allocate the handle in.
+ * @param[in] name		for log messages, usually the module instance name.
+ * @param[in] filenames		to watch.  Copied.
+ * @param[in] num_files		in filenames.
+ * @param[in] watch		whether to watch the files.  If false, the data
+ *				is parsed once, and never changes.
+ * @param[in] parse		builds the data from the files.
+ * @param[in] uctx		passed to parse.  Must remain valid for the
+ *				lifetime of the handle.
+ * @return
+ *	- A new handle, with the initial version of the data.
+ *	- NULL if the files couldn't be parsed.
+ */
+fr_reload_t *fr_reload_alloc(TALLOC_CTX *ctx, char const *name,
+			     char const * const *filenames, size_t num_files, bool watch,
+			     fr_reload_parse_t parse, void *uctx)
+{
+	fr_reload_t	*reload;
+	void		*data;
+	size_t		i;
+
+	if (parse(&data, uctx) < 0) return NULL;
+
+	MEM(reload = talloc_zero(ctx, fr_reload_t));
+	reload->name = talloc_typed_strdup(reload, name);
+	reload->num_files = num_files;
+	reload->watch = watch && (num_files > 0);
+	reload->parse = parse;
+	reload->uctx = uctx;
+	reload->pipe[0] = reload->pipe[1] = -1;
+	atomic_init(&reload->data, data);
+
+	MEM(reload->filenames = talloc_array(reload, char const *, num_files));
+	MEM(reload->fds = talloc_array(reload, int, num_files));
+	for (i = 0; i < num_files; i++) {
+		reload->filenames[i] = talloc_typed_strdup(reload->filenames, filenames[i]);
+		reload->fds[i] = -1;
+	}
+
+	pthread_mutex_init(&reload->mutex, NULL);
+	talloc_set_destructor(reload, _reload_free);
+
+	return reload;
+}
+
+/** Start watching the files
+ *
+ * Should be called from a module's thread_instantiate callback, as
+ * threads don't survive fork().  Only the first call has any effect.
+ *
+ * @param[in] reload	to start watching the files of.
+ * @return
+ *	- 0 on success, or if the files aren't being watched.
+ *	- -1 on failure.
+ */
+int fr_reload_start(fr_reload_t *reload)
+{
+	int ret;
+
+	if (!reload->watch) return 0;
+
+	pthread_mutex_lock(&reload->mutex);
+	if (reload->running) {
+		pthread_mutex_unlock(&reload->mutex);
+		return 0;
+	}
+
+	if (pipe(reload->pipe) < 0) {
+		pthread_mutex_unlock(&reload->mutex);
+		fr_strerror_printf("Failed creating stop pipe: %s", fr_syserror(errno));
+		return -1;
+	}
+	fr_nonblock(reload->pipe[0]);
+
+	ret = pthread_create(&reload->thread, NULL, reload_watcher, reload);
+	if (ret != 0) {
+		close(reload->pipe[0]);
+		close(reload->pipe[1]);
+		reload->pipe[0] = reload->pipe[1] = -1;
+		pthread_mutex_unlock(&reload->mutex);
+		fr_strerror_printf("Failed starting watcher thread: %s", fr_syserror(ret));
+		return -1;
+	}
+	reload->running = true;
+	pthread_mutex_unlock(&reload->mutex);
+
+	return 0;
+}
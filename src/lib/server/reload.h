@@ -0,0 +1,64 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/reload.h
+ * @brief Reload data files in the background when they change.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(reload_h, "$Id$")
+
+#include <freeradius-devel/util/talloc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_reload_s fr_reload_t;
+
+/** Parse the watched files into a new version of the data
+ *
+ * Called once from #fr_reload_alloc, and then from the watcher thread each
+ * time the files change.  When called from the watcher thread, it must not
+ * modify anything workers may be reading.
+ *
+ * @param[out] out	The new data.  Must be a talloc chunk with no parent,
+ *			it's freed with talloc_free() once no worker can be
+ *			using it.
+ * @param[in] uctx	passed to #fr_reload_alloc.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The previous version continues to be used.
+ */
+typedef int (*fr_reload_parse_t)(void **out, void *uctx);
+
+fr_reload_t	*fr_reload_alloc(TALLOC_CTX *ctx, char const *name,
+				 char const * const *filenames, size_t num_files, bool watch,
+				 fr_reload_parse_t parse, void *uctx);
+
+int		fr_reload_start(fr_reload_t *reload);
+
+void		*fr_reload_read_lock(fr_reload_t *reload);
+
+void		fr_reload_read_unlock(fr_reload_t *reload);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,199 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include "reload.c"
+
+/** The "parsed" contents of a test file
+ *
+ */
+typedef struct {
+	char		*contents;
+} test_data_t;
+
+static int test_data_freed;
+
+static int _test_data_free(UNUSED test_data_t *data)
+{
+	test_data_freed++;
+	return 0;
+}
+
+/** Read the whole file, failing if it contains "bad"
+ *
+ */
+static int test_parse(void **out, void *uctx)
+{
+	char const	*filename = uctx;
+	test_data_t	*data;
+	FILE		*fp;
+	char		buffer[256];
+	size_t		len;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fr_strerror_printf("Failed opening %s", filename);
+		return -1;
+	}
+	len = fread(buffer, 1, sizeof(buffer) - 1, fp);
+	buffer[len] = '\0';
+	fclose(fp);
+
+	if (strstr(buffer, "bad")) {
+		fr_strerror_printf("Bad contents");
+		return -1;
+	}
+
+	MEM(data = talloc_zero(NULL, test_data_t));
+	data->contents = talloc_typed_strdup(data, buffer);
+	talloc_set_destructor(data, _test_data_free);
+
+	*out = data;
+	return 0;
+}
+
+static void test_write(char const *filename, char const *contents)
+{
+	FILE *fp;
+
+	fp = fopen(filename, "w");
+	TEST_CHECK(fp != NULL);
+	if (!fp) return;
+
+	fputs(contents, fp);
+	fclose(fp);
+}
+
+static char *test_file(void)
+{
+	char	*filename;
+	int	fd;
+
+	MEM(filename = talloc_typed_strdup(NULL, "/tmp/reload_tests.XXXXXX"));
+	fd = mkstemp(filename);
+	TEST_CHECK(fd >= 0);
+	close(fd);
+
+	return filename;
+}
+
+/** Wait for the published contents to change from what they were
+ *
+ */
+static bool test_wait_for(fr_reload_t *reload, char const *contents)
+{
+	int i;
+
+	for (i = 0; i < 50; i++) {
+		test_data_t	*data;
+		bool		match;
+
+		data = fr_reload_read_lock(reload);
+		match = (strcmp(data->contents, contents) == 0);
+		fr_reload_read_unlock(reload);
+
+		if (match) return true;
+
+		usleep(100 * 1000);
+	}
+
+	return false;
+}
+
+static void test_static(void)
+{
+	fr_reload_t	*reload;
+	test_data_t	*data, *nested;
+	char		*filename = test_file();
+
+	test_write(filename, "one");
+
+	reload = fr_reload_alloc(NULL, "test", (char const * const *)&filename, 1, false, test_parse, filename);
+	TEST_CHECK(reload != NULL);
+	if (!reload) return;
+
+	TEST_CHECK(fr_reload_start(reload) == 0);
+
+	TEST_CASE("Initial contents are published");
+	data = fr_reload_read_lock(reload);
+	TEST_CHECK(strcmp(data->contents, "one") == 0);
+
+	TEST_CASE("Read sections nest");
+	nested = fr_reload_read_lock(reload);
+	TEST_CHECK(nested == data);
+	fr_reload_read_unlock(reload);
+	TEST_CHECK(atomic_load(&reload_reader->active) != 0);
+	fr_reload_read_unlock(reload);
+	TEST_CHECK(atomic_load(&reload_reader->active) == 0);
+
+	test_data_freed = 0;
+	talloc_free(reload);
+	TEST_CHECK(test_data_freed == 1);
+
+	unlink(filename);
+	talloc_free(filename);
+}
+
+static void test_parse_failure(void)
+{
+	char		*filename = test_file();
+	fr_reload_t	*reload;
+
+	test_write(filename, "bad");
+
+	TEST_CASE("Failing initial parse fails allocation");
+	reload = fr_reload_alloc(NULL, "test", (char const * const *)&filename, 1, false, test_parse, filename);
+	TEST_CHECK(reload == NULL);
+
+	unlink(filename);
+	talloc_free(filename);
+}
+
+static void test_watch(void)
+{
+	fr_reload_t	*reload;
+	char		*filename = test_file();
+
+	test_write(filename, "one");
+
+	reload = fr_reload_alloc(NULL, "test", (char const * const *)&filename, 1, true, test_parse, filename);
+	TEST_CHECK(reload != NULL);
+	if (!reload) return;
+
+	TEST_CHECK(fr_reload_start(reload) == 0);
+	usleep(100 * 1000);	/* Let the watcher open the file */
+
+	test_data_freed = 0;
+
+	TEST_CASE("Changed contents are published");
+	test_write(filename, "two");
+	TEST_CHECK(test_wait_for(reload, "two"));
+
+	TEST_CASE("The previous version is freed");
+	TEST_CHECK(test_data_freed == 1);
+
+	TEST_CASE("Contents which fail to parse are ignored");
+	test_write(filename, "bad");
+	usleep(2500 * 1000);
+	TEST_CHECK(test_wait_for(reload, "two"));
+
+	TEST_CASE("Replaced files are watched again");
+	{
+		char	tmp[64];
+
+		snprintf(tmp, sizeof(tmp), "%s.new", filename);
+		test_write(tmp, "three");
+		TEST_CHECK(rename(tmp, filename) == 0);
+	}
+	TEST_CHECK(test_wait_for(reload, "three"));
+
+	talloc_free(reload);
+	unlink(filename);
+	talloc_free(filename);
+}
+
+TEST_LIST = {
+	{ "Static",			test_static },
+	{ "Parse failure",		test_parse_failure },
+	{ "Watch",			test_watch },
+
+	{ NULL }
+};
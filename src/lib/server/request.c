@@ -34,6 +34,67 @@ RCSID("$Id$")
  */
 static _Thread_local fr_dlist_head_t *request_free_list; /* macro */
 
+/** How much memory new requests reserve for their packets, pairs, and values
+ *
+ * Allocations from the reserved memory are just a pointer bump, and
+ * are all released together when the request is freed, or returned
+ * to the free list.
+ */
+static _Thread_local size_t request_pool_size;
+
+/** The most memory we've seen a request use, rounded up to a multiple of REQUEST_POOL_ROUND
+ *
+ * New requests reserve at least this much, so that requests which
+ * need more than the configured size don't fall back to malloc.
+ * This includes the memory for the stack and packets.
+ */
+static _Thread_local size_t request_pool_hwm;
+
+/** Counter so that we only measure some requests, measuring is a walk over all their children
+ *
+ */
+static _Thread_local uint32_t request_pool_sample;
+
+/** Rough size of each allocation in the reserved memory, used to size talloc's headers
+ *
+ */
+#define REQUEST_POOL_OBJECT_SIZE	(128)
+
+/** Memory every request needs, regardless of how many pairs it has
+ *
+ */
+#define REQUEST_POOL_BASE		((UNLANG_FRAME_PRE_ALLOC * UNLANG_STACK_MAX) +	/* Stack memory */ \
+					 (sizeof(RADIUS_PACKET) * 2) +	/* packets */ \
+					 128)				/* extra */
+
+#define REQUEST_POOL_ROUND		(1024)
+#define REQUEST_POOL_SIZE_MAX		(REQUEST_POOL_BASE + 65536)
+#define REQUEST_POOL_SAMPLE		(0x3f)
+
+/** Record how much memory a request used, and return the size of pool new requests should have
+ *
+ * @param[in] request	to measure.  May be NULL to just return the size.
+ * @return the total size of the pool new requests should have.
+ */
+static inline size_t request_pool_size_update(REQUEST *request)
+{
+	size_t size;
+
+	if (request && ((request_pool_sample++ & REQUEST_POOL_SAMPLE) == 0)) {
+		size_t used;
+
+		used = talloc_total_size(request);
+		if (used > request_pool_hwm) {
+			used = (used + REQUEST_POOL_ROUND - 1) & ~((size_t) REQUEST_POOL_ROUND - 1);
+			request_pool_hwm = (used < REQUEST_POOL_SIZE_MAX) ? used : REQUEST_POOL_SIZE_MAX;
+		}
+	}
+
+	size = REQUEST_POOL_BASE + request_pool_size;
+
+	return (request_pool_hwm > size) ? request_pool_hwm : size;
+}
+
 /** Setup logging and other fields for a request
  *
  * @param[in] file		the request was allocated in.
@@ -118,9 +179,11 @@ static int _request_free(REQUEST *request)
 	 *	We keep a buffer of <active> + N requests per
 	 *	thread, to avoid spurious allocations.
 	 */
-	if (fr_dlist_num_elements(request_free_list) <= 256) {
+	if ((fr_dlist_num_elements(request_free_list) <= 256) &&
+	    (request_pool_size_update(request) <= request->pool_size)) {
 		TALLOC_CTX		*state_ctx;
 		fr_dlist_head_t		*free_list;
+		size_t			pool_size;
 
 		/*
 		 *	Ensure any data associated
@@ -132,14 +195,18 @@ static int _request_free(REQUEST *request)
 			talloc_free_children(request->state_ctx);
 		}
 		free_list = request_free_list;
+		pool_size = request->pool_size;
 
 		/*
-		 *	Reinitialise the request
+		 *	Reinitialise the request.  This resets the
+		 *	pool, so everything the request allocated
+		 *	is released at once.
 		 */
 		talloc_free_children(request);
 		memset(request, 0, sizeof(*request));
 		request->component = "free_list";
 		request->state_ctx = state_ctx;		/* Use the old, now cleared, state_ctx */
+		request->pool_size = pool_size;
 
 		/*
 		 *	Reinsert into the free list
@@ -151,6 +218,11 @@ static int _request_free(REQUEST *request)
  	}
 
 	/*
+	 *	Either the free list is full, or the request's pool
+	 *	is smaller than requests are now using.  In the
+	 *	second case the request is replaced with a larger
+	 *	one the next time a request is allocated.
+	 *
 	 *	Ensure anything that might reference the request is
 	 *	freed before it is.
 	 */
@@ -208,6 +280,18 @@ static void _request_free_list_free_on_exit(void *arg)
 	talloc_free(list);
 }
 
+/** Set how much memory requests allocated by this thread reserve for their pairs
+ *
+ * Only requests which are newly allocated use the new size.  Requests
+ * already in the free list keep their existing memory.
+ *
+ * @param[in] size	in bytes.  0 means reserve nothing extra.
+ */
+void request_pool_size_set(size_t size)
+{
+	request_pool_size = size;
+}
+
 /** Create a new REQUEST data structure
  *
  */
@@ -215,6 +299,7 @@ REQUEST *_request_alloc(char const *file, int line, TALLOC_CTX *ctx)
 {
 	REQUEST			*request;
 	fr_dlist_head_t		*free_list;
+	size_t			pool_size;
 
 	/*
 	 *	Setup the free list, or return the free
@@ -230,6 +315,8 @@ REQUEST *_request_alloc(char const *file, int line, TALLOC_CTX *ctx)
 
 	request = fr_dlist_head(free_list);
 	if (!request) {
+		pool_size = request_pool_size_update(NULL);
+
 		/*
 		 *	Only allocate requests in the NULL
 		 *	ctx.  There's no scenario where it's
@@ -243,11 +330,10 @@ REQUEST *_request_alloc(char const *file, int line, TALLOC_CTX *ctx)
 							1 + 				/* Stack pool */
 							UNLANG_STACK_MAX + 		/* Stack Frames */
 							2 + 				/* packets */
-							10,				/* extra */
-							(UNLANG_FRAME_PRE_ALLOC * UNLANG_STACK_MAX) +	/* Stack memory */
-							(sizeof(RADIUS_PACKET) * 2) +	/* packets */
-							128				/* extra */
-							));
+							10 +				/* extra */
+							((pool_size - REQUEST_POOL_BASE) / REQUEST_POOL_OBJECT_SIZE), /* pairs and values */
+							pool_size));
+		request->pool_size = pool_size;
 		talloc_set_destructor(request, _request_free);
 	} else {
 		/*
@@ -297,6 +383,41 @@ REQUEST *_request_local_alloc(char const *file, int line, TALLOC_CTX *ctx)
 	return request;
 }
 
+/** Fill in the packet fields of a fake request from its parent
+ *
+ */
+static void request_fake_packets_init(REQUEST *request, REQUEST *fake)
+{
+	/*
+	 *	Fill in the fake request.
+	 */
+	fake->packet->sockfd = -1;
+	fake->packet->src_ipaddr = request->packet->src_ipaddr;
+	fake->packet->src_port = request->packet->src_port;
+	fake->packet->dst_ipaddr = request->packet->dst_ipaddr;
+	fake->packet->dst_port = 0;
+
+	/*
+	 *	This isn't STRICTLY required, as the fake request MUST NEVER
+	 *	be put into the request list.  However, it's still reasonable
+	 *	practice.
+	 */
+	fake->packet->id = fake->number & 0xff;
+	fake->packet->code = request->packet->code;
+	fake->packet->timestamp = request->packet->timestamp;
+
+	/*
+	 *	Fill in the fake reply, based on the fake request.
+	 */
+	fake->reply->sockfd = fake->packet->sockfd;
+	fake->reply->src_ipaddr = fake->packet->dst_ipaddr;
+	fake->reply->src_port = fake->packet->dst_port;
+	fake->reply->dst_ipaddr = fake->packet->src_ipaddr;
+	fake->reply->dst_port = fake->packet->src_port;
+	fake->reply->id = fake->packet->id;
+	fake->reply->code = 0; /* UNKNOWN code */
+}
+
 static REQUEST *request_init_fake(char const *file, int line, REQUEST *request, REQUEST *fake)
 {
 	fake->number = request->child_number++;
@@ -332,40 +453,13 @@ static REQUEST *request_init_fake(char const *file, int line, REQUEST *request,
 
 	fake->master_state = REQUEST_ACTIVE;
 
-	/*
-	 *	Fill in the fake request.
-	 */
-	fake->packet->sockfd = -1;
-	fake->packet->src_ipaddr = request->packet->src_ipaddr;
-	fake->packet->src_port = request->packet->src_port;
-	fake->packet->dst_ipaddr = request->packet->dst_ipaddr;
-	fake->packet->dst_port = 0;
-
-	/*
-	 *	This isn't STRICTLY required, as the fake request MUST NEVER
-	 *	be put into the request list.  However, it's still reasonable
-	 *	practice.
-	 */
-	fake->packet->id = fake->number & 0xff;
-	fake->packet->code = request->packet->code;
-	fake->packet->timestamp = request->packet->timestamp;
+	request_fake_packets_init(request, fake);
 
 	/*
 	 *	Required for new identity support
 	 */
 	fake->listener = request->listener;
 
-	/*
-	 *	Fill in the fake reply, based on the fake request.
-	 */
-	fake->reply->sockfd = fake->packet->sockfd;
-	fake->reply->src_ipaddr = fake->packet->dst_ipaddr;
-	fake->reply->src_port = fake->packet->dst_port;
-	fake->reply->dst_ipaddr = fake->packet->src_ipaddr;
-	fake->reply->dst_port = fake->packet->src_port;
-	fake->reply->id = fake->packet->id;
-	fake->reply->code = 0; /* UNKNOWN code */
-
 	/*
 	 *	Copy debug information.
 	 */
@@ -440,6 +534,65 @@ REQUEST *_request_alloc_detachable(char const *file, int line, REQUEST *request,
 	return fake;
 }
 
+/** Re-attach a detached subrequest to a new parent
+ *
+ * Allows a detachable subrequest to be kept across multiple rounds of a
+ * conversation (i.e. the inner-tunnel of PEAP and TTLS), instead of
+ * allocating a new one, and moving its session-state and persistable
+ * request data in and out of the parent each round.
+ *
+ * The request and reply lists, and the control list, are emptied.
+ * The session-state list and any request data the subrequest holds
+ * are left alone.
+ *
+ * @param[in] request		to attach the subrequest to.
+ * @param[in] fake		subrequest previously detached with
+ *				#request_detach.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int request_reattach(REQUEST *request, REQUEST *fake)
+{
+	fr_assert(fake->parent == NULL);
+
+	fake->number = request->child_number++;
+	talloc_const_free(fake->name);
+	fake->name = talloc_typed_asprintf(fake, "%s.%" PRIu64 , request->name, fake->number);
+
+	fake->parent = request;
+	fake->config = request->config;
+	fake->client = request->client;
+	fake->server_cs = request->server_cs;
+	fake->listener = request->listener;
+
+	fake->master_state = REQUEST_ACTIVE;
+
+	fr_pair_list_free(&fake->packet->vps);
+	fr_pair_list_free(&fake->reply->vps);
+	fr_pair_list_free(&fake->control);
+	request_fake_packets_init(request, fake);
+
+	/*
+	 *	Copy debug information, but keep our
+	 *	own copy of the log destination.
+	 */
+	fake->log.lvl = request->log.lvl;
+	fake->log.unlang_indent = 0;
+	fake->log.module_indent = 0;
+	memcpy(fake->log.dst, request->log.dst, sizeof(*fake->log.dst));
+
+	/*
+	 *	Same association as request_alloc_detachable.
+	 */
+	if (request_data_talloc_add(request, fake, 0, REQUEST, fake, true, true, false) < 0) {
+		fake->parent = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Unlink a subrequest from its parent
  *
  * @note This should be used for requests in preparation for freeing them.
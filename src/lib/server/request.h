@@ -34,6 +34,7 @@ extern "C" {
 
 typedef struct fr_async_s fr_async_t;
 typedef struct fr_request_s REQUEST;
+typedef struct fr_trace_s fr_trace_t;
 
 typedef struct rad_listen rad_listen_t;
 typedef struct rad_client RADCLIENT;
@@ -96,6 +97,8 @@ struct fr_request_s {
 	fr_request_state_t	request_state;	//!< state for the various protocol handlers.
 
 	fr_dlist_head_t		data;		//!< Request metadata.
+	struct request_data_index_s *data_index;	//!< Index of request metadata, built once
+							///< the list gets long.
 
 	rad_listen_t		*listener;	//!< The listener that received the request.
 	RADCLIENT		*client;	//!< The client that originally sent us the request.
@@ -151,11 +154,16 @@ struct fr_request_s {
 
 	fr_async_t		*async;		//!< for new async listeners
 
+	fr_trace_t		*trace;		//!< Spans recorded for this request.  NULL unless
+						//!< the request was sampled for tracing.
+
 	char const		*alloc_file;	//!< File the request was allocated in.
 
 	int			alloc_line;	//!< Line the request was allocated on.
 
 	fr_dlist_t		free_entry;	//!< Request's entry in the free list.
+
+	size_t			pool_size;	//!< Size of the talloc pool the request was allocated with.
 };				/* REQUEST typedef */
 
 #ifdef WITH_VERIFY_PTR
@@ -179,6 +187,8 @@ struct fr_request_s {
 #define RAD_REQUEST_OPTION_CTX	(1 << 1)
 #define RAD_REQUEST_OPTION_DETAIL (1 << 2)
 
+void		request_pool_size_set(size_t size);
+
 #define		request_alloc(_ctx) _request_alloc( __FILE__, __LINE__, _ctx)
 REQUEST		*_request_alloc(char const *file, int line, TALLOC_CTX *ctx);
 
@@ -191,6 +201,8 @@ REQUEST		*_request_alloc_fake(char const *file, int line, REQUEST *parent, fr_di
 #define		request_alloc_detachable(_request, _namespace) _request_alloc_detachable(__FILE__, __LINE__, _request, _namespace)
 REQUEST		*_request_alloc_detachable(char const *file, int line, REQUEST *request, fr_dict_t const *namespace);
 
+int		request_reattach(REQUEST *request, REQUEST *fake);
+
 int		request_detach(REQUEST *fake, bool will_free);
 
 #ifdef WITH_VERIFY_PTR
@@ -25,13 +25,23 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/server/request_data.h>
 
+/** How many entries the request data list must have before it's indexed
+ *
+ * Below this, walking the list is as fast as hashing the key.
+ */
+#define REQUEST_DATA_INDEX_MIN	8
+
+typedef struct request_data_index_s request_data_index_t;
+
 /** Per-request opaque data, added by modules
  *
  */
 struct request_data_s {
 	fr_dlist_t	list;			//!< Next opaque request data struct linked to this request.
+	request_data_index_t *index;		//!< Index this entry is in, NULL if not indexed.
 
 	void const	*unique_ptr;		//!< Key to lookup request data.
 	int		unique_int;		//!< Alternative key to lookup request data.
@@ -48,6 +58,172 @@ struct request_data_s {
 #endif
 };
 
+/** Open addressing index over the request data list of a request
+ *
+ * Uses linear probing, with backward shift deletion so there are no
+ * tombstones.  Kept at most half full.
+ */
+struct request_data_index_s {
+	request_data_t	**slots;		//!< Entries, NULL if the slot is empty.
+	uint32_t	mask;			//!< Number of slots - 1.
+	uint32_t	used;			//!< Number of slots in use.
+};
+
+static inline uint32_t request_data_hash(void const *unique_ptr, int unique_int)
+{
+	return fr_hash_update(&unique_int, sizeof(unique_int), fr_hash(&unique_ptr, sizeof(unique_ptr)));
+}
+
+/** Unlink any entries still in the index, so they don't reference it after it's freed
+ *
+ */
+static int _request_data_index_free(request_data_index_t *index)
+{
+	uint32_t i;
+
+	for (i = 0; i <= index->mask; i++) if (index->slots[i]) index->slots[i]->index = NULL;
+
+	return 0;
+}
+
+static request_data_t *request_data_index_find(request_data_index_t *index, void const *unique_ptr, int unique_int)
+{
+	uint32_t	i = request_data_hash(unique_ptr, unique_int) & index->mask;
+	request_data_t	*rd;
+
+	while ((rd = index->slots[i])) {
+		if ((rd->unique_ptr == unique_ptr) && (rd->unique_int == unique_int)) return rd;
+		i = (i + 1) & index->mask;
+	}
+
+	return NULL;
+}
+
+static void request_data_index_slot_set(request_data_index_t *index, request_data_t *rd)
+{
+	uint32_t i = request_data_hash(rd->unique_ptr, rd->unique_int) & index->mask;
+
+	while (index->slots[i]) i = (i + 1) & index->mask;
+	index->slots[i] = rd;
+}
+
+static void request_data_index_insert(request_data_index_t *index, request_data_t *rd)
+{
+	/*
+	 *	Double the number of slots, and
+	 *	re-insert everything.
+	 */
+	if (((index->used + 1) * 2) > (index->mask + 1)) {
+		request_data_t	**old = index->slots;
+		uint32_t	i, old_mask = index->mask;
+
+		index->mask = ((index->mask + 1) * 2) - 1;
+		MEM(index->slots = talloc_zero_array(index, request_data_t *, index->mask + 1));
+
+		for (i = 0; i <= old_mask; i++) if (old[i]) request_data_index_slot_set(index, old[i]);
+		talloc_free(old);
+	}
+
+	request_data_index_slot_set(index, rd);
+	rd->index = index;
+	index->used++;
+}
+
+/** Remove an entry from the index it's in
+ *
+ * Entries after it in the same probe sequence are shifted back,
+ * so that lookups don't stop early at the slot it leaves empty.
+ */
+static void request_data_index_remove(request_data_t *rd)
+{
+	request_data_index_t	*index = rd->index;
+	uint32_t		i, j, k;
+
+	if (!index) return;
+
+	i = request_data_hash(rd->unique_ptr, rd->unique_int) & index->mask;
+	while (index->slots[i] != rd) {
+		if (!fr_cond_assert(index->slots[i])) return;
+		i = (i + 1) & index->mask;
+	}
+
+	for (j = (i + 1) & index->mask; index->slots[j]; j = (j + 1) & index->mask) {
+		k = request_data_hash(index->slots[j]->unique_ptr, index->slots[j]->unique_int) & index->mask;
+
+		/*
+		 *	Entry at j can only move back to i if its
+		 *	home slot k isn't cyclically within (i, j].
+		 */
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j))) continue;
+
+		index->slots[i] = index->slots[j];
+		i = j;
+	}
+	index->slots[i] = NULL;
+
+	rd->index = NULL;
+	index->used--;
+}
+
+/** (Re)build the index for a request's data
+ *
+ * Called after entries have been added to, or removed from, the
+ * request data list in bulk.  Does nothing if the list is too
+ * short to be worth indexing.
+ */
+static void request_data_index_rebuild(REQUEST *request)
+{
+	request_data_index_t	*index = request->data_index;
+	request_data_t		*rd = NULL;
+
+	if (!index) {
+		if (fr_dlist_num_elements(&request->data) < REQUEST_DATA_INDEX_MIN) return;
+
+		MEM(index = talloc_zero(request, request_data_index_t));
+		talloc_set_destructor(index, _request_data_index_free);
+		index->mask = 15;
+		MEM(index->slots = talloc_zero_array(index, request_data_t *, index->mask + 1));
+		request->data_index = index;
+	} else {
+		uint32_t i;
+
+		for (i = 0; i <= index->mask; i++) {
+			if (!index->slots[i]) continue;
+			index->slots[i]->index = NULL;
+			index->slots[i] = NULL;
+		}
+		index->used = 0;
+	}
+
+	while ((rd = fr_dlist_next(&request->data, rd))) request_data_index_insert(index, rd);
+}
+
+/** Find request data in a request's list, using the index if there is one
+ *
+ */
+static request_data_t *request_data_find(REQUEST *request, void const *unique_ptr, int unique_int)
+{
+	request_data_t	*rd = NULL;
+
+	if (request->data_index) return request_data_index_find(request->data_index, unique_ptr, unique_int);
+
+	while ((rd = fr_dlist_next(&request->data, rd))) {
+		if ((rd->unique_ptr == unique_ptr) && (rd->unique_int == unique_int)) return rd;
+	}
+
+	return NULL;
+}
+
+/** Remove request data from a request's list, and its index
+ *
+ * @return the previous entry in the list.
+ */
+static inline request_data_t *request_data_unlink(REQUEST *request, request_data_t *rd)
+{
+	request_data_index_remove(rd);
+	return fr_dlist_remove(&request->data, rd);
+}
+
 static char *request_data_description(TALLOC_CTX *ctx, request_data_t *rd)
 {
 		char *where;
@@ -122,6 +298,7 @@ static int _request_data_free(request_data_t *rd)
 	 *	of never running into use after free errors/
 	 */
 	fr_dlist_entry_unlink(&rd->list);
+	request_data_index_remove(rd);
 
 	if (DEBUG_ENABLED4) desc = request_data_description(rd, rd);
 
@@ -205,10 +382,9 @@ int _request_data_add(REQUEST *request, void const *unique_ptr, int unique_int,
 	if (type) opaque = _talloc_get_type_abort(opaque, type, __location__);
 #endif
 
-	while ((rd = fr_dlist_next(&request->data, rd))) {
-		if ((rd->unique_ptr != unique_ptr) || (rd->unique_int != unique_int)) continue;
-
-		fr_dlist_remove(&request->data, rd);	/* Unlink from the list */
+	rd = request_data_find(request, unique_ptr, unique_int);
+	if (rd) {
+		request_data_unlink(request, rd);	/* Unlink from the list */
 
 		/*
 		 *	If caller requires custom behaviour on free
@@ -229,8 +405,6 @@ int _request_data_add(REQUEST *request, void const *unique_ptr, int unique_int,
 			rd->free_on_parent = false;
 			TALLOC_FREE(rd);
 		}
-
-		break;	/* replace the existing entry */
 	}
 
 	/*
@@ -265,6 +439,11 @@ int _request_data_add(REQUEST *request, void const *unique_ptr, int unique_int,
 #endif
 
 	fr_dlist_insert_head(&request->data, rd);
+	if (request->data_index) {
+		request_data_index_insert(request->data_index, rd);
+	} else {
+		request_data_index_rebuild(request);
+	}
 
 	RDEBUG4("%s: %s%s%p at %p:%i, free_on_replace: %s, free_on_parent: %s, persist: %s",
 		__FUNCTION__,
@@ -295,15 +474,14 @@ void *request_data_get(REQUEST *request, void const *unique_ptr, int unique_int)
 
 	if (!request) return NULL;
 
-	while ((rd = fr_dlist_next(&request->data, rd))) {
+	rd = request_data_find(request, unique_ptr, unique_int);
+	if (rd) {
 		void *ptr;
 
-		if ((rd->unique_ptr != unique_ptr) || (rd->unique_int != unique_int)) continue;
-
 		ptr = rd->opaque;
 
 		rd->free_on_parent = false;	/* Don't free opaque data we're handing back */
-		fr_dlist_remove(&request->data, rd);
+		request_data_unlink(request, rd);
 
 #ifndef TALLOC_GET_TYPE_ABORT_NOOP
 		if (rd->type) ptr = _talloc_get_type_abort(ptr, rd->type, __location__);
@@ -342,9 +520,8 @@ void *request_data_reference(REQUEST *request, void const *unique_ptr, int uniqu
 
 	if (!request) return NULL;
 
-	while ((rd = fr_dlist_next(&request->data, rd))) {
-		if ((rd->unique_ptr != unique_ptr) || (rd->unique_int != unique_int)) continue;
-
+	rd = request_data_find(request, unique_ptr, unique_int);
+	if (rd) {
 #ifndef TALLOC_GET_TYPE_ABORT_NOOP
 		if (rd->type) rd->opaque = _talloc_get_type_abort(rd->opaque, rd->type, __location__);
 #endif
@@ -377,7 +554,7 @@ int request_data_by_persistance(fr_dlist_head_t *out, REQUEST *request, bool per
 	while ((rd = fr_dlist_next(&request->data, rd))) {
 		if (rd->persist != persist) continue;
 
-		prev = fr_dlist_remove(&request->data, rd);
+		prev = request_data_unlink(request, rd);
 		fr_dlist_insert_tail(out, rd);
 		rd = prev;
 	}
@@ -405,7 +582,7 @@ int request_data_by_persistance_reparent(TALLOC_CTX *ctx, fr_dlist_head_t *out,
 	while ((rd = fr_dlist_next(&request->data, rd))) {
 		if (rd->persist != persist) continue;
 
-		prev = fr_dlist_remove(&request->data, rd);
+		prev = request_data_unlink(request, rd);
 
 		new = request_data_alloc(ctx);
 		memcpy(new, rd, sizeof(*new));
@@ -414,6 +591,7 @@ int request_data_by_persistance_reparent(TALLOC_CTX *ctx, fr_dlist_head_t *out,
 		 *	Clear the list pointers...
 		 */
 		memset(&new->list, 0, sizeof(new->list));
+		new->index = NULL;
 		rd->free_on_parent = false;
 		talloc_free(rd);
 
@@ -425,7 +603,10 @@ int request_data_by_persistance_reparent(TALLOC_CTX *ctx, fr_dlist_head_t *out,
 		rd = prev;
 	}
 
-	if (!out) fr_dlist_move(&request->data, &head);
+	if (!out) {
+		fr_dlist_move(&request->data, &head);
+		request_data_index_rebuild(request);
+	}
 
 	return count;
 }
@@ -461,6 +642,7 @@ int request_data_by_persistance_count(REQUEST *request, bool persist)
 void request_data_restore(REQUEST *request, fr_dlist_head_t *in)
 {
 	fr_dlist_move(&request->data, in);
+	request_data_index_rebuild(request);
 }
 
 /** Used for removing data from subrequests that are about to be freed
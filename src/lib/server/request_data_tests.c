@@ -0,0 +1,115 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include "request_data.c"
+
+#define TEST_ENTRIES	64
+
+static int test_keys[4];
+
+/** Check every entry can be found through the index, and by walking the list
+ *
+ */
+static void test_check_entries(REQUEST *request, int *opaque, bool const *present)
+{
+	int i;
+
+	for (i = 0; i < TEST_ENTRIES; i++) {
+		void *found = request_data_reference(request, &test_keys[i % 4], i);
+
+		if (present[i]) {
+			TEST_CHECK(found == &opaque[i]);
+			TEST_MSG("Entry %i missing", i);
+		} else {
+			TEST_CHECK(found == NULL);
+			TEST_MSG("Entry %i should have been removed", i);
+		}
+	}
+}
+
+static void test_add_get(void)
+{
+	TALLOC_CTX	*ctx = talloc_init_const("test");
+	REQUEST		*request;
+	int		opaque[TEST_ENTRIES], other;
+	bool		present[TEST_ENTRIES];
+	int		i;
+
+	request = request_alloc(ctx);
+
+	TEST_CASE("Short lists are not indexed");
+	for (i = 0; i < REQUEST_DATA_INDEX_MIN - 1; i++) {
+		TEST_CHECK(request_data_add(request, &test_keys[i % 4], i, &opaque[i], false, false, false) == 0);
+		present[i] = true;
+	}
+	TEST_CHECK(request->data_index == NULL);
+
+	TEST_CASE("Long lists are indexed");
+	for (; i < TEST_ENTRIES; i++) {
+		TEST_CHECK(request_data_add(request, &test_keys[i % 4], i, &opaque[i], false, false, false) == 0);
+		present[i] = true;
+	}
+	TEST_CHECK(request->data_index != NULL);
+	TEST_CHECK(request->data_index->used == TEST_ENTRIES);
+	test_check_entries(request, opaque, present);
+
+	TEST_CASE("Replacing an entry doesn't duplicate it");
+	TEST_CHECK(request_data_add(request, &test_keys[1], 5, &other, false, false, false) == 0);
+	TEST_CHECK(request_data_reference(request, &test_keys[1], 5) == &other);
+	TEST_CHECK(fr_dlist_num_elements(&request->data) == TEST_ENTRIES);
+	TEST_CHECK(request->data_index->used == TEST_ENTRIES);
+	TEST_CHECK(request_data_add(request, &test_keys[1], 5, &opaque[5], false, false, false) == 0);
+
+	TEST_CASE("Removed entries can't be found, others still can");
+	for (i = 0; i < TEST_ENTRIES; i += 3) {
+		TEST_CHECK(request_data_get(request, &test_keys[i % 4], i) == &opaque[i]);
+		present[i] = false;
+	}
+	test_check_entries(request, opaque, present);
+	TEST_CHECK(request->data_index->used == fr_dlist_num_elements(&request->data));
+
+	talloc_free(ctx);
+}
+
+static void test_persistence(void)
+{
+	TALLOC_CTX	*ctx = talloc_init_const("test");
+	REQUEST		*request;
+	int		opaque[TEST_ENTRIES];
+	bool		present[TEST_ENTRIES];
+	fr_dlist_head_t	head;
+	int		i;
+
+	request = request_alloc(ctx);
+
+	for (i = 0; i < TEST_ENTRIES; i++) {
+		TEST_CHECK(request_data_add(request, &test_keys[i % 4], i, &opaque[i], false, false, (i % 2)) == 0);
+		present[i] = true;
+	}
+
+	TEST_CASE("Pulling out persistable data removes it from the index");
+	fr_dlist_talloc_init(&head, request_data_t, list);
+	request_data_by_persistance(&head, request, true);
+	for (i = 0; i < TEST_ENTRIES; i++) present[i] = !(i % 2);
+	test_check_entries(request, opaque, present);
+
+	TEST_CASE("Restoring persistable data adds it back to the index");
+	request_data_restore(request, &head);
+	for (i = 0; i < TEST_ENTRIES; i++) present[i] = true;
+	test_check_entries(request, opaque, present);
+	TEST_CHECK(request->data_index->used == TEST_ENTRIES);
+
+	TEST_CASE("Freeing the state_ctx removes persistable data from the index");
+	talloc_free_children(request->state_ctx);
+	for (i = 0; i < TEST_ENTRIES; i++) present[i] = !(i % 2);
+	test_check_entries(request, opaque, present);
+	TEST_CHECK(request->data_index->used == fr_dlist_num_elements(&request->data));
+
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "Add and get",	test_add_get },
+	{ "Persistence",	test_persistence },
+
+	{ NULL }
+};
@@ -0,0 +1,8 @@
+TARGET		:= request_data_tests
+
+SOURCES		:= request_data_tests.c
+
+TGT_LDLIBS	:= $(LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-unlang.a
@@ -0,0 +1,844 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Process-wide hostname cache, with lookups which don't block workers
+ *
+ * getaddrinfo() blocks, and has no cache of its own.  Instead, names are
+ * looked up by a small set of resolver threads, and the answers are
+ * shared by everything in the process until their TTL expires.
+ *
+ * Workers first check the cache with #fr_resolver_cached.  On a miss,
+ * #fr_resolver_resolve queues the name and the request yields.  Only one
+ * lookup runs for a name, however many requests are waiting for it.  When
+ * it completes, each waiting worker is woken via a pipe on its event list.
+ *
+ * Names which are looked up often in the last 10% of their TTL are
+ * refreshed in the background, so they don't expire while in use.
+ *
+ * Addresses come from getaddrinfo(), so /etc/hosts and the rest of the
+ * system configuration are honoured.  Where libresolv is available, the
+ * TTL is taken from a DNS query for the same name.
+ *
+ * @file src/lib/server/resolver.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "resolver - "
+
+#include <freeradius-devel/server/metrics.h>
+#include <freeradius-devel/server/resolver.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <ctype.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#ifdef HAVE_LIBRESOLV
+#  include <arpa/nameser.h>
+#  include <resolv.h>
+#endif
+
+/** Where a request currently is
+ *
+ * Protected by the resolver mutex.
+ */
+typedef enum {
+	RESOLVER_REQ_NONE = 0,				//!< Owned solely by the worker.
+	RESOLVER_REQ_WAITING,				//!< In the waiters list of a name.
+	RESOLVER_REQ_DONE				//!< In the worker's done list.
+} resolver_req_where_t;
+
+/** A cached name
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+	fr_dlist_t		queue_entry;		//!< Entry in the lookup queue.
+
+	char const		*name;			//!< Lowercased.
+	int			af;			//!< AF_INET, AF_INET6, or AF_UNSPEC for either.
+
+	fr_ipaddr_t		addrs[FR_RESOLVER_MAX_ADDRS];
+	int			num;			//!< Addresses, 0 if the name doesn't exist,
+							///< -1 if it's never been looked up.
+	fr_time_delta_t		ttl;			//!< Of the last answer.
+	fr_time_t		expires;		//!< When the answer expires.
+	uint32_t		hits;			//!< Lookups since the last answer.
+
+	bool			busy;			//!< Queued for, or being looked up by, a
+							///< resolver thread.  Can't be evicted.
+	fr_dlist_head_t		waiters;		//!< Requests waiting for the answer.
+} resolver_entry_t;
+
+/** The resolver, shared by all threads
+ *
+ */
+typedef struct {
+	fr_resolver_conf_t const *conf;
+
+	pthread_mutex_t		mutex;			//!< Protects everything below, and the done
+							///< lists of every thread.
+	pthread_cond_t		work;			//!< Signalled when names are queued.
+
+	fr_hash_table_t		*ht;			//!< Entries by name and family.  Entries are
+							///< allocated in its ctx.
+	fr_dlist_head_t		lru;			//!< Most recently used at the head.
+	fr_dlist_head_t		queue;			//!< Names to look up.
+
+	pthread_t		*threads;		//!< Resolver threads.
+	uint32_t		num_started;		//!< How many resolver threads we started.
+	bool			shutdown;		//!< Tells the resolver threads to exit.
+
+	fr_metric_t		*lookups;		//!< Lookups by result.
+	fr_metric_t		*query_time;		//!< Time taken to look up names.
+} fr_resolver_t;
+
+/** A worker's handle for the resolver
+ *
+ */
+typedef struct {
+	fr_event_list_t		*el;			//!< Worker's event list.
+
+	int			pipe[2];		//!< Resolver threads write here to wake the worker.
+	fr_dlist_head_t		done;			//!< Requests with an answer.
+	bool			signalled;		//!< Whether the pipe has been written to since
+							///< the worker last drained it.
+} fr_resolver_thread_t;
+
+struct fr_resolver_req_s {
+	fr_resolver_thread_t	*rt;			//!< Handle the request was submitted through.
+	REQUEST			*request;		//!< Request the lookup is for.
+	resolver_entry_t	*pending;		//!< Name we're waiting for.
+	fr_dlist_t		entry;			//!< Entry in the waiters list, or the done list.
+	resolver_req_where_t	where;			//!< Who has the request.
+
+	fr_ipaddr_t		addrs[FR_RESOLVER_MAX_ADDRS];
+	int			ret;			//!< Addresses, 0 if the name doesn't exist,
+							///< -1 if the lookup failed or timed out.
+
+	fr_event_timer_t const	*ev;			//!< Timeout for the lookup.
+
+	fr_resolver_complete_t	complete;		//!< Called when the lookup completes.
+	void			*uctx;			//!< Passed to complete.
+};
+
+static fr_resolver_t			*resolver;
+static _Thread_local fr_resolver_thread_t	*resolver_thread;
+
+CONF_PARSER const fr_resolver_config[] = {
+	{ FR_CONF_OFFSET("num_threads", FR_TYPE_UINT32, fr_resolver_conf_t, num_threads), .dflt = "2" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, fr_resolver_conf_t, max_entries), .dflt = "4096" },
+	{ FR_CONF_OFFSET("min_ttl", FR_TYPE_TIME_DELTA, fr_resolver_conf_t, min_ttl), .dflt = "5" },
+	{ FR_CONF_OFFSET("max_ttl", FR_TYPE_TIME_DELTA, fr_resolver_conf_t, max_ttl), .dflt = "86400" },
+	{ FR_CONF_OFFSET("default_ttl", FR_TYPE_TIME_DELTA, fr_resolver_conf_t, default_ttl), .dflt = "300" },
+	{ FR_CONF_OFFSET("negative_ttl", FR_TYPE_TIME_DELTA, fr_resolver_conf_t, negative_ttl), .dflt = "30" },
+	{ FR_CONF_OFFSET("prefetch_hits", FR_TYPE_UINT32, fr_resolver_conf_t, prefetch_hits), .dflt = "2" },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, fr_resolver_conf_t, timeout), .dflt = "5" },
+	CONF_PARSER_TERMINATOR
+};
+
+static uint32_t resolver_entry_hash(void const *data)
+{
+	resolver_entry_t const *entry = data;
+
+	return fr_hash_update(&entry->af, sizeof(entry->af), fr_hash_string(entry->name));
+}
+
+static int resolver_entry_cmp(void const *one, void const *two)
+{
+	resolver_entry_t const *a = one, *b = two;
+
+	if (a->af != b->af) return (a->af > b->af) - (a->af < b->af);
+
+	return strcmp(a->name, b->name);
+}
+
+#ifdef HAVE_LIBRESOLV
+/** Find the TTL of the DNS records for a name
+ *
+ * @return
+ *	- The lowest TTL of the matching records.
+ *	- -1 if there are none.
+ */
+static fr_time_delta_t resolver_query_ttl(char const *name, int af)
+{
+	struct __res_state	rs;
+	uint8_t			answer[NS_PACKETSZ * 4];
+	ns_msg			msg;
+	ns_rr			rr;
+	int			len, i, type = (af == AF_INET6) ? ns_t_aaaa : ns_t_a;
+	int64_t			ttl = -1;
+
+	memset(&rs, 0, sizeof(rs));
+	if (res_ninit(&rs) < 0) return -1;
+
+	len = res_nsearch(&rs, name, ns_c_in, type, answer, sizeof(answer));
+	res_nclose(&rs);
+	if (len < 0) return -1;
+
+	if (ns_initparse(answer, len, &msg) < 0) return -1;
+
+	for (i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+		if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) break;
+		if (ns_rr_type(rr) != type) continue;
+		if ((ttl < 0) || (ns_rr_ttl(rr) < ttl)) ttl = ns_rr_ttl(rr);
+	}
+
+	return (ttl < 0) ? -1 : fr_time_delta_from_sec(ttl);
+}
+#endif
+
+/** Look up a name, blocking until we have an answer
+ *
+ * @param[out] out	Where to write the addresses.
+ * @param[out] ttl	How long the answer may be cached for.
+ * @param[in] conf	Resolver configuration.
+ * @param[in] name	to look up.
+ * @param[in] af	AF_INET, AF_INET6, or AF_UNSPEC for either.
+ * @return
+ *	- The number of addresses.
+ *	- 0 if the name doesn't exist.
+ *	- -1 on temporary failure.
+ */
+static int resolver_query(fr_ipaddr_t out[FR_RESOLVER_MAX_ADDRS], fr_time_delta_t *ttl,
+			  fr_resolver_conf_t const *conf, char const *name, int af)
+{
+	struct addrinfo		hints, *res, *ai;
+	int			ret, num = 0, i;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = af;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	ret = getaddrinfo(name, NULL, &hints, &res);
+	switch (ret) {
+	case 0:
+		break;
+
+	case EAI_NONAME:
+#ifdef EAI_NODATA
+	case EAI_NODATA:
+#endif
+		*ttl = conf->negative_ttl;
+		return 0;
+
+	default:
+		DEBUG2("Failed resolving \"%s\": %s", name, gai_strerror(ret));
+		return -1;
+	}
+
+	for (ai = res; ai && (num < FR_RESOLVER_MAX_ADDRS); ai = ai->ai_next) {
+		fr_ipaddr_t ipaddr;
+
+		if (fr_ipaddr_from_sockaddr((struct sockaddr_storage *)ai->ai_addr, ai->ai_addrlen,
+					    &ipaddr, NULL) < 0) continue;
+
+		for (i = 0; i < num; i++) if (fr_ipaddr_cmp(&out[i], &ipaddr) == 0) break;
+		if (i < num) continue;
+
+		out[num++] = ipaddr;
+	}
+	freeaddrinfo(res);
+
+	if (num == 0) {
+		*ttl = conf->negative_ttl;
+		return 0;
+	}
+
+	*ttl = -1;
+#ifdef HAVE_LIBRESOLV
+	*ttl = resolver_query_ttl(name, out[0].af);
+#endif
+	if (*ttl < 0) *ttl = conf->default_ttl;
+	if (*ttl < conf->min_ttl) *ttl = conf->min_ttl;
+	if (*ttl > conf->max_ttl) *ttl = conf->max_ttl;
+
+	return num;
+}
+
+/** Record an answer
+ *
+ * If the lookup failed, and we have a previous answer, it's used for
+ * a while longer rather than failing every request.
+ *
+ * @note Must be called with the resolver locked.
+ */
+static void resolver_entry_update(resolver_entry_t *entry, int num, fr_ipaddr_t const addrs[],
+				  fr_time_delta_t ttl, fr_time_t now)
+{
+	fr_resolver_conf_t const *conf = resolver->conf;
+
+	entry->hits = 0;
+
+	if (num < 0) {
+		entry->expires = now + conf->negative_ttl;
+		if (entry->num < 0) entry->num = 0;
+		return;
+	}
+
+	if (num > 0) memcpy(entry->addrs, addrs, sizeof(entry->addrs[0]) * num);
+	entry->num = num;
+	entry->ttl = ttl;
+	entry->expires = now + ttl;
+}
+
+/** Queue a name to be looked up
+ *
+ * @note Must be called with the resolver locked.
+ */
+static void resolver_entry_queue(resolver_entry_t *entry)
+{
+	if (entry->busy) return;
+
+	entry->busy = true;
+	fr_dlist_insert_tail(&resolver->queue, entry);
+	pthread_cond_signal(&resolver->work);
+}
+
+/** Find or create the entry for a name, and mark it as recently used
+ *
+ * @note Must be called with the resolver locked.
+ */
+static resolver_entry_t *resolver_entry(char const *name, int af, bool create)
+{
+	resolver_entry_t	find, *entry, *evict;
+	char			buffer[256], *p;
+
+	strlcpy(buffer, name, sizeof(buffer));
+	for (p = buffer; *p; p++) *p = tolower((uint8_t) *p);
+
+	find.name = buffer;
+	find.af = af;
+
+	entry = fr_hash_table_finddata(resolver->ht, &find);
+	if (entry) {
+		fr_dlist_remove(&resolver->lru, entry);
+		fr_dlist_insert_head(&resolver->lru, entry);
+		return entry;
+	}
+	if (!create) return NULL;
+
+	/*
+	 *	Evict the least recently used names
+	 *	which aren't being looked up.
+	 */
+	evict = fr_dlist_tail(&resolver->lru);
+	while (evict && (fr_dlist_num_elements(&resolver->lru) >= resolver->conf->max_entries)) {
+		resolver_entry_t *prev = fr_dlist_prev(&resolver->lru, evict);
+
+		if (!evict->busy) {
+			fr_dlist_remove(&resolver->lru, evict);
+			fr_hash_table_delete(resolver->ht, evict);
+			talloc_free(evict);
+		}
+		evict = prev;
+	}
+
+	MEM(entry = talloc_zero(resolver->ht, resolver_entry_t));
+	entry->name = talloc_typed_strdup(entry, buffer);
+	entry->af = af;
+	entry->num = -1;
+	fr_dlist_talloc_init(&entry->waiters, fr_resolver_req_t, entry);
+
+	if (!fr_hash_table_insert(resolver->ht, entry)) {
+		talloc_free(entry);
+		return NULL;
+	}
+	fr_dlist_insert_head(&resolver->lru, entry);
+
+	return entry;
+}
+
+/** Copy a cached answer, refreshing it early if it's in demand
+ *
+ * @note Must be called with the resolver locked.
+ * @return
+ *	- The number of addresses, or 0 if the name doesn't exist.
+ *	- -1 if we have no answer, or it's expired.
+ */
+static int resolver_entry_read(fr_ipaddr_t out[], size_t outlen, resolver_entry_t *entry, fr_time_t now)
+{
+	fr_resolver_conf_t const	*conf = resolver->conf;
+	int				num;
+
+	if ((entry->num < 0) || (now >= entry->expires)) return -1;
+
+	entry->hits++;
+	if (conf->prefetch_hits && (entry->num > 0) && (entry->hits >= conf->prefetch_hits) &&
+	    ((entry->expires - now) < (entry->ttl / 10))) {
+		fr_metric_inc(fr_metric_series(resolver->lookups, "result=\"prefetch\""), 1);
+		resolver_entry_queue(entry);
+	}
+
+	num = entry->num;
+	if ((size_t) num > outlen) num = outlen;
+	if (num > 0) memcpy(out, entry->addrs, sizeof(out[0]) * num);
+
+	return num;
+}
+
+/** Resolver thread main loop
+ *
+ */
+static void *resolver_main(UNUSED void *arg)
+{
+	fr_resolver_conf_t const	*conf = resolver->conf;
+	resolver_entry_t		*entry;
+	fr_resolver_req_t		*rreq;
+
+	pthread_mutex_lock(&resolver->mutex);
+	for (;;) {
+		fr_ipaddr_t	addrs[FR_RESOLVER_MAX_ADDRS];
+		fr_time_delta_t	ttl = 0;
+		fr_time_t	start;
+		char		name[256];
+		int		af, num;
+
+		while (!resolver->shutdown && !(entry = fr_dlist_head(&resolver->queue))) {
+			pthread_cond_wait(&resolver->work, &resolver->mutex);
+		}
+		if (resolver->shutdown) break;
+
+		fr_dlist_remove(&resolver->queue, entry);
+		strlcpy(name, entry->name, sizeof(name));
+		af = entry->af;
+		pthread_mutex_unlock(&resolver->mutex);
+
+		start = fr_time();
+		num = resolver_query(addrs, &ttl, conf, name, af);
+		fr_metric_observe(fr_metric_series(resolver->query_time, NULL), fr_time() - start);
+
+		pthread_mutex_lock(&resolver->mutex);
+		resolver_entry_update(entry, num, addrs, ttl, fr_time());
+		entry->busy = false;
+
+		while ((rreq = fr_dlist_head(&entry->waiters))) {
+			fr_resolver_thread_t *rt = rreq->rt;
+
+			fr_dlist_remove(&entry->waiters, rreq);
+			rreq->pending = NULL;
+			/*
+			 *	Failures get the previous answer
+			 *	if there is one.
+			 */
+			if (entry->num > 0) {
+				rreq->ret = entry->num;
+			} else {
+				rreq->ret = (num < 0) ? -1 : 0;
+			}
+			if (rreq->ret > 0) memcpy(rreq->addrs, entry->addrs, sizeof(rreq->addrs[0]) * rreq->ret);
+
+			rreq->where = RESOLVER_REQ_DONE;
+			fr_dlist_insert_tail(&rt->done, rreq);
+
+			if (!rt->signalled) {
+				rt->signalled = true;
+				if ((write(rt->pipe[1], "", 1) < 0) && (errno != EAGAIN)) {
+					ERROR("Failed waking worker: %s", fr_syserror(errno));
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&resolver->mutex);
+
+	return NULL;
+}
+
+/** Process requests with an answer
+ *
+ */
+static void _resolver_drain(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_resolver_thread_t	*rt = talloc_get_type_abort(uctx, fr_resolver_thread_t);
+	fr_resolver_req_t	*rreq;
+	fr_dlist_head_t		done;
+	uint8_t			buff[64];
+
+	while (read(fd, buff, sizeof(buff)) > 0);
+
+	fr_dlist_talloc_init(&done, fr_resolver_req_t, entry);
+
+	pthread_mutex_lock(&resolver->mutex);
+	rt->signalled = false;
+	while ((rreq = fr_dlist_head(&rt->done))) {
+		fr_dlist_remove(&rt->done, rreq);
+		rreq->where = RESOLVER_REQ_NONE;
+		fr_dlist_insert_tail(&done, rreq);
+	}
+	pthread_mutex_unlock(&resolver->mutex);
+
+	while ((rreq = fr_dlist_head(&done))) {
+		fr_dlist_remove(&done, rreq);
+		fr_event_timer_delete(&rreq->ev);
+		rreq->complete(rreq->request, rreq, rreq->uctx);
+	}
+}
+
+/** Stop waiting for a lookup
+ *
+ * @note Must be called with the resolver locked.
+ */
+static void resolver_req_remove(fr_resolver_req_t *rreq)
+{
+	switch (rreq->where) {
+	case RESOLVER_REQ_WAITING:
+		fr_dlist_remove(&rreq->pending->waiters, rreq);
+		rreq->pending = NULL;
+		break;
+
+	case RESOLVER_REQ_DONE:
+		fr_dlist_remove(&rreq->rt->done, rreq);
+		break;
+
+	default:
+		break;
+	}
+	rreq->where = RESOLVER_REQ_NONE;
+}
+
+static void _resolver_req_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_resolver_req_t	*rreq = talloc_get_type_abort(uctx, fr_resolver_req_t);
+	REQUEST			*request = rreq->request;
+
+	rreq->ev = NULL;
+
+	pthread_mutex_lock(&resolver->mutex);
+	if (rreq->where == RESOLVER_REQ_WAITING) {
+		RERROR("Timeout resolving \"%s\"", rreq->pending->name);
+		fr_metric_inc(fr_metric_series(resolver->lookups, "result=\"timeout\""), 1);
+		rreq->ret = -1;
+	}
+	resolver_req_remove(rreq);
+	pthread_mutex_unlock(&resolver->mutex);
+
+	rreq->complete(rreq->request, rreq, rreq->uctx);
+}
+
+static int _resolver_req_free(fr_resolver_req_t *rreq)
+{
+	pthread_mutex_lock(&resolver->mutex);
+	resolver_req_remove(rreq);
+	pthread_mutex_unlock(&resolver->mutex);
+
+	return 0;
+}
+
+/** Remove this thread's requests from the names they're waiting for
+ *
+ */
+static int _resolver_thread_free(fr_resolver_thread_t *rt)
+{
+	resolver_entry_t	*entry = NULL;
+	fr_resolver_req_t	*rreq, *next;
+
+	pthread_mutex_lock(&resolver->mutex);
+	while ((entry = fr_dlist_next(&resolver->lru, entry))) {
+		for (rreq = fr_dlist_head(&entry->waiters); rreq; rreq = next) {
+			next = fr_dlist_next(&entry->waiters, rreq);
+			if (rreq->rt == rt) resolver_req_remove(rreq);
+		}
+	}
+	while ((rreq = fr_dlist_head(&rt->done))) resolver_req_remove(rreq);
+	pthread_mutex_unlock(&resolver->mutex);
+
+	(void) fr_event_fd_delete(rt->el, rt->pipe[0], FR_EVENT_FILTER_IO);
+	close(rt->pipe[0]);
+	close(rt->pipe[1]);
+
+	if (resolver_thread == rt) resolver_thread = NULL;
+
+	return 0;
+}
+
+/** Start the resolver threads
+ *
+ * Must be called after the server has forked into the background,
+ * as threads don't survive fork().
+ *
+ * @param[in] conf	Resolver configuration.  Must remain valid until #fr_resolver_free.
+ * @return
+ *	- 0 on success, or if the resolver is disabled.
+ *	- -1 on failure.
+ */
+int fr_resolver_init(fr_resolver_conf_t const *conf)
+{
+	uint32_t i;
+
+	if (resolver || !conf->num_threads) return 0;
+
+	MEM(resolver = talloc_zero(NULL, fr_resolver_t));
+	resolver->conf = conf;
+
+	resolver->ht = fr_hash_table_create(resolver, resolver_entry_hash, resolver_entry_cmp, NULL);
+	if (!resolver->ht) {
+	error:
+		TALLOC_FREE(resolver);
+		return -1;
+	}
+	fr_dlist_talloc_init(&resolver->lru, resolver_entry_t, entry);
+	fr_dlist_talloc_init(&resolver->queue, resolver_entry_t, queue_entry);
+
+	resolver->lookups = fr_metric_register("freeradius_resolver_lookups",
+					       "Name lookups by result", FR_METRIC_COUNTER);
+	resolver->query_time = fr_metric_register("freeradius_resolver_query_time",
+						  "Time taken to resolve names", FR_METRIC_HISTOGRAM);
+	if (!resolver->lookups || !resolver->query_time) goto error;
+
+	pthread_mutex_init(&resolver->mutex, NULL);
+	pthread_cond_init(&resolver->work, NULL);
+
+	MEM(resolver->threads = talloc_zero_array(resolver, pthread_t, conf->num_threads));
+	for (i = 0; i < conf->num_threads; i++) {
+		int ret;
+
+		ret = pthread_create(&resolver->threads[i], NULL, resolver_main, NULL);
+		if (ret != 0) {
+			fr_strerror_printf("Failed starting resolver thread: %s", fr_syserror(ret));
+			fr_resolver_free();
+			return -1;
+		}
+		resolver->num_started++;
+	}
+
+	return 0;
+}
+
+/** Stop the resolver threads, and free the cache
+ *
+ * Must be called after the workers have exited.
+ */
+void fr_resolver_free(void)
+{
+	uint32_t i;
+
+	if (!resolver) return;
+
+	pthread_mutex_lock(&resolver->mutex);
+	resolver->shutdown = true;
+	pthread_cond_broadcast(&resolver->work);
+	pthread_mutex_unlock(&resolver->mutex);
+
+	for (i = 0; i < resolver->num_started; i++) pthread_join(resolver->threads[i], NULL);
+
+	pthread_cond_destroy(&resolver->work);
+	pthread_mutex_destroy(&resolver->mutex);
+
+	TALLOC_FREE(resolver);
+}
+
+/** Allocate the calling worker's handle for the resolver
+ *
+ * @param[in] ctx	to allocate the handle in.
+ * @param[in] el	Thread's event list.
+ * @return
+ *	- 0 on success, or if the resolver is disabled.
+ *	- -1 on failure.
+ */
+int fr_resolver_thread_instantiate(TALLOC_CTX *ctx, fr_event_list_t *el)
+{
+	fr_resolver_thread_t *rt;
+
+	if (!resolver) return 0;
+
+	MEM(rt = talloc_zero(ctx, fr_resolver_thread_t));
+	rt->el = el;
+	fr_dlist_talloc_init(&rt->done, fr_resolver_req_t, entry);
+
+	if (pipe(rt->pipe) < 0) {
+		fr_strerror_printf("Failed creating wakeup pipe: %s", fr_syserror(errno));
+		talloc_free(rt);
+		return -1;
+	}
+	fr_nonblock(rt->pipe[0]);
+	fr_nonblock(rt->pipe[1]);
+
+	if (fr_event_fd_insert(rt, el, rt->pipe[0], _resolver_drain, NULL, NULL, rt) < 0) {
+		fr_strerror_printf_push("Failed inserting wakeup pipe");
+		close(rt->pipe[0]);
+		close(rt->pipe[1]);
+		talloc_free(rt);
+		return -1;
+	}
+	talloc_set_destructor(rt, _resolver_thread_free);
+
+	resolver_thread = rt;
+
+	return 0;
+}
+
+/** Free the calling worker's handle for the resolver
+ *
+ */
+void fr_resolver_thread_detach(void)
+{
+	TALLOC_FREE(resolver_thread);
+}
+
+/** Get the addresses for a name from the cache, without blocking
+ *
+ * @param[out] out	Where to write the addresses.
+ * @param[in] outlen	Number of elements in out.
+ * @param[in] name	to look up.
+ * @param[in] af	AF_INET, AF_INET6, or AF_UNSPEC for either.
+ * @return
+ *	- The number of addresses written to out.
+ *	- 0 if the name is known not to exist.
+ *	- -1 if the name isn't cached, or the resolver is disabled.
+ */
+int fr_resolver_cached(fr_ipaddr_t out[], size_t outlen, char const *name, int af)
+{
+	resolver_entry_t	*entry;
+	int			ret = -1;
+
+	if (!resolver) return -1;
+
+	pthread_mutex_lock(&resolver->mutex);
+	entry = resolver_entry(name, af, false);
+	if (entry) ret = resolver_entry_read(out, outlen, entry, fr_time());
+	pthread_mutex_unlock(&resolver->mutex);
+
+	fr_metric_inc(fr_metric_series(resolver->lookups, (ret < 0) ? "result=\"miss\"" : "result=\"hit\""), 1);
+
+	return ret;
+}
+
+/** Get the addresses for a name, blocking if they're not cached
+ *
+ * For use outside of workers, i.e. when parsing the configuration.
+ * The answer is added to the cache.  If the resolver is disabled,
+ * the name is looked up every time.
+ *
+ * @param[out] out	Where to write the addresses.
+ * @param[in] outlen	Number of elements in out.
+ * @param[in] name	to look up.
+ * @param[in] af	AF_INET, AF_INET6, or AF_UNSPEC for either.
+ * @return
+ *	- The number of addresses written to out.
+ *	- 0 if the name doesn't exist.
+ *	- -1 on failure.
+ */
+int fr_resolver_lookup(fr_ipaddr_t out[], size_t outlen, char const *name, int af)
+{
+	static fr_resolver_conf_t const	defaults = { 0 };
+	fr_ipaddr_t			addrs[FR_RESOLVER_MAX_ADDRS];
+	fr_time_delta_t			ttl;
+	resolver_entry_t		*entry;
+	int				num;
+
+	num = fr_resolver_cached(out, outlen, name, af);
+	if (num >= 0) return num;
+
+	num = resolver_query(addrs, &ttl, resolver ? resolver->conf : &defaults, name, af);
+
+	if (resolver) {
+		pthread_mutex_lock(&resolver->mutex);
+		entry = resolver_entry(name, af, true);
+		if (entry) resolver_entry_update(entry, num, addrs, ttl, fr_time());
+		pthread_mutex_unlock(&resolver->mutex);
+	}
+
+	if (num <= 0) return num;
+
+	if ((size_t) num > outlen) num = outlen;
+	memcpy(out, addrs, sizeof(out[0]) * num);
+
+	return num;
+}
+
+/** Look up a name from a worker, without blocking
+ *
+ * Callers should try #fr_resolver_cached first.  The complete callback
+ * is never called from within this function.  The returned handle must
+ * be freed by the caller once the lookup completes.  Freeing it earlier
+ * cancels the lookup.
+ *
+ * @param[in] request	the lookup is for.
+ * @param[in] name	to look up.
+ * @param[in] af	AF_INET, AF_INET6, or AF_UNSPEC for either.
+ * @param[in] complete	called when the lookup completes or times out.
+ * @param[in] uctx	passed to complete.
+ * @return
+ *	- A new request handle.
+ *	- NULL if the resolver is disabled, or on error.
+ */
+fr_resolver_req_t *fr_resolver_resolve(REQUEST *request, char const *name, int af,
+				       fr_resolver_complete_t complete, void *uctx)
+{
+	fr_resolver_thread_t	*rt = resolver_thread;
+	fr_resolver_req_t	*rreq;
+	resolver_entry_t	*entry;
+
+	if (!resolver || !rt) {
+		REDEBUG("Resolver is not running");
+		return NULL;
+	}
+
+	MEM(rreq = talloc_zero(request, fr_resolver_req_t));
+	rreq->rt = rt;
+	rreq->request = request;
+	rreq->complete = complete;
+	rreq->uctx = uctx;
+
+	if (fr_event_timer_in(rreq, rt->el, &rreq->ev, resolver->conf->timeout,
+			      _resolver_req_timeout, rreq) < 0) {
+		RPERROR("Failed inserting resolver timeout");
+		talloc_free(rreq);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&resolver->mutex);
+	entry = resolver_entry(name, af, true);
+	if (!entry) {
+		pthread_mutex_unlock(&resolver->mutex);
+		REDEBUG("Failed adding \"%s\" to the resolver cache", name);
+		talloc_free(rreq);
+		return NULL;
+	}
+	rreq->pending = entry;
+	rreq->where = RESOLVER_REQ_WAITING;
+	fr_dlist_insert_tail(&entry->waiters, rreq);
+	resolver_entry_queue(entry);
+	pthread_mutex_unlock(&resolver->mutex);
+
+	talloc_set_destructor(rreq, _resolver_req_free);
+
+	RDEBUG3("Resolving \"%s\"", name);
+
+	return rreq;
+}
+
+/** Get the result of a lookup
+ *
+ * @param[out] out	The addresses.  Valid until the handle is freed.
+ * @param[in] rreq	to get the result from.
+ * @return
+ *	- The number of addresses.
+ *	- 0 if the name doesn't exist.
+ *	- -1 if the lookup failed or timed out.
+ */
+int fr_resolver_req_result(fr_ipaddr_t const **out, fr_resolver_req_t const *rreq)
+{
+	*out = rreq->addrs;
+
+	return rreq->ret;
+}
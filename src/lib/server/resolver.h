@@ -0,0 +1,87 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/resolver.h
+ * @brief Process-wide hostname cache, with lookups which don't block workers.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(resolver_h, "$Id$")
+
+#include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/inet.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FR_RESOLVER_MAX_ADDRS	8			//!< Most addresses kept for a name.
+
+typedef struct fr_resolver_req_s fr_resolver_req_t;
+
+/** Configuration for the resolver
+ *
+ */
+typedef struct {
+	uint32_t		num_threads;		//!< Threads running lookups.  0 disables the resolver.
+	uint32_t		max_entries;		//!< Maximum number of names to cache.
+	fr_time_delta_t		min_ttl;		//!< Lower bound on how long answers are cached.
+	fr_time_delta_t		max_ttl;		//!< Upper bound on how long answers are cached.
+	fr_time_delta_t		default_ttl;		//!< For answers with no TTL, i.e. from /etc/hosts.
+	fr_time_delta_t		negative_ttl;		//!< How long to cache names which don't resolve.
+	uint32_t		prefetch_hits;		//!< Lookups needed in the last 10% of the TTL
+							///< before a name is refreshed early.  0 disables.
+	fr_time_delta_t		timeout;		//!< How long a request waits for a lookup.
+} fr_resolver_conf_t;
+
+/** Called in the worker thread when a lookup completes or times out
+ *
+ * Typically calls unlang_interpret_resumable() for the request.
+ *
+ * @param[in] request	the lookup was made for.
+ * @param[in] rreq	that completed.  Retrieve the addresses with #fr_resolver_req_result.
+ * @param[in] uctx	passed to #fr_resolver_resolve.
+ */
+typedef void (*fr_resolver_complete_t)(REQUEST *request, fr_resolver_req_t *rreq, void *uctx);
+
+extern CONF_PARSER const fr_resolver_config[];
+
+int			fr_resolver_init(fr_resolver_conf_t const *conf);
+
+void			fr_resolver_free(void);
+
+int			fr_resolver_thread_instantiate(TALLOC_CTX *ctx, fr_event_list_t *el);
+
+void			fr_resolver_thread_detach(void);
+
+int			fr_resolver_cached(fr_ipaddr_t out[], size_t outlen, char const *name, int af);
+
+int			fr_resolver_lookup(fr_ipaddr_t out[], size_t outlen, char const *name, int af);
+
+fr_resolver_req_t	*fr_resolver_resolve(REQUEST *request, char const *name, int af,
+					     fr_resolver_complete_t complete, void *uctx);
+
+int			fr_resolver_req_result(fr_ipaddr_t const **out, fr_resolver_req_t const *rreq);
+
+#ifdef __cplusplus
+}
+#endif
@@ -55,6 +55,12 @@ RCSID("$Id$")
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 /** Holds a state value, and associated VALUE_PAIRs and data
  *
  */
@@ -112,28 +118,46 @@ typedef struct {
 	REQUEST			*thawed;			//!< The request that thawed this entry.
 } fr_state_entry_t;
 
-struct fr_state_tree_s {
-	uint64_t		id;				//!< Next ID to assign.
-	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
-								//!< timeout.
-	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
+/** One shard of the state tree
+ *
+ * Entries are distributed between shards by a hash of their state value,
+ * so concurrent lookups for different sessions rarely contend for the
+ * same mutex.
+ */
+typedef struct {
 	rbtree_t		*tree;				//!< rbtree used to lookup state value.
 	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
+	uint64_t		timed_out;			//!< Number of states in this shard that were
+								//!< cleaned up due to timeout.
+
+	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	fr_time_t		locked;				//!< When the mutex was last acquired.
+	uint64_t		lock_count;			//!< How many times the mutex has been acquired.
+	fr_time_delta_t		lock_time;			//!< Total time the mutex has been held.
+} fr_state_shard_t;
+
+#define STATE_TREE_SHARDS	16				//!< Must be a power of 2.
+
+struct fr_state_tree_s {
+	atomic_uint_fast64_t	id;				//!< Next ID to assign.
+	atomic_uint_fast32_t	num_entries;			//!< Number of entries in all shards.
+	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
 
 	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
 
-	bool			thread_safe;			//!< Whether we lock the tree whilst modifying it.
-	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	bool			thread_safe;			//!< Whether we lock the shards whilst modifying them.
 
 	uint8_t			server_id;			//!< ID to use for load balancing.
 
 	fr_dict_attr_t const	*da;				//!< State attribute used.
-};
 
-#define PTHREAD_MUTEX_LOCK if (state->thread_safe) pthread_mutex_lock
-#define PTHREAD_MUTEX_UNLOCK if (state->thread_safe) pthread_mutex_unlock
+	fr_state_backend_t const *backend;			//!< Optional external store, shared with
+								//!< other servers.
 
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+	fr_state_shard_t	shards[STATE_TREE_SHARDS];	//!< Entries, distributed by state value.
+};
+
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry);
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -145,27 +169,65 @@ static int state_entry_cmp(void const *one, void const *two)
 	return memcmp(a->state, b->state, sizeof(a->state));
 }
 
+/** Return the shard responsible for a state value
+ *
+ */
+static inline fr_state_shard_t *state_shard(fr_state_tree_t *state, fr_state_entry_t const *entry)
+{
+	return &state->shards[fr_hash(entry->state, sizeof(entry->state)) & (STATE_TREE_SHARDS - 1)];
+}
+
+/** Lock a shard, recording when it was locked
+ *
+ */
+static inline void state_shard_lock(fr_state_tree_t *state, fr_state_shard_t *shard)
+{
+	if (!state->thread_safe) return;
+
+	pthread_mutex_lock(&shard->mutex);
+	shard->locked = fr_time();
+	shard->lock_count++;
+}
+
+/** Unlock a shard, adding the time it was held to the shard's stats
+ *
+ */
+static inline void state_shard_unlock(fr_state_tree_t *state, fr_state_shard_t *shard)
+{
+	if (!state->thread_safe) return;
+
+	shard->lock_time += fr_time() - shard->locked;
+	pthread_mutex_unlock(&shard->mutex);
+}
+
 /** Free the state tree
  *
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
-	fr_state_entry_t *entry;
-
-	if (state->thread_safe) pthread_mutex_destroy(&state->mutex);
+	fr_state_entry_t	*entry;
+	size_t			i;
 
 	DEBUG4("Freeing state tree %p", state);
 
-	while ((entry = fr_dlist_head(&state->to_expire))) {
-		DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
-		state_entry_unlink(state, entry);
-		talloc_free(entry);
-	}
+	for (i = 0; i < STATE_TREE_SHARDS; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
 
-	/*
-	 *	Free the rbtree
-	 */
-	talloc_free(state->tree);
+		if (!shard->tree) continue;
+
+		if (state->thread_safe) pthread_mutex_destroy(&shard->mutex);
+
+		while ((entry = fr_dlist_head(&shard->to_expire))) {
+			DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
+			state_entry_unlink(state, shard, entry);
+			talloc_free(entry);
+		}
+
+		/*
+		 *	Free the rbtree
+		 */
+		talloc_free(shard->tree);
+	}
 
 	return 0;
 }
@@ -186,12 +248,16 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 				    uint32_t max_sessions, uint32_t timeout, uint8_t server_id)
 {
 	fr_state_tree_t *state;
+	size_t		i;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
 
 	state->max_sessions = max_sessions;
 	state->timeout = timeout;
+	state->thread_safe = thread_safe;
+	atomic_init(&state->id, 0);
+	atomic_init(&state->num_entries, 0);
 
 	/*
 	 *	Create a break in the contexts.
@@ -201,47 +267,67 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 	 *	tree.
 	 */
 	talloc_link_ctx(ctx, state);
+	talloc_set_destructor(state, _state_tree_free);
 
-	if (thread_safe && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
-		talloc_free(state);
-		return NULL;
-	}
+	for (i = 0; i < STATE_TREE_SHARDS; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
 
-	fr_dlist_talloc_init(&state->to_expire, fr_state_entry_t, list);
+		fr_dlist_talloc_init(&shard->to_expire, fr_state_entry_t, list);
 
-	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
-	 */
-	state->tree = rbtree_talloc_create(NULL, state_entry_cmp, fr_state_entry_t, NULL, 0);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
+		/*
+		 *	We need to do controlled freeing of the
+		 *	rbtree, so that all the state entries
+		 *	are freed before it's destroyed.  Hence
+		 *	it being parented from the NULL ctx.
+		 */
+		shard->tree = rbtree_talloc_create(NULL, state_entry_cmp, fr_state_entry_t, NULL, 0);
+		if (!shard->tree) {
+			talloc_free(state);
+			return NULL;
+		}
+
+		if (thread_safe && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			talloc_free(shard->tree);
+			shard->tree = NULL;
+			talloc_free(state);
+			return NULL;
+		}
 	}
-	talloc_set_destructor(state, _state_tree_free);
 
 	state->da = da;		/* Remember which attribute we use to load/store state */
 	state->server_id = server_id;
-	state->thread_safe = thread_safe;
 
 	return state;
 }
 
+/** Set an external store for session-state
+ *
+ * Must be called before the tree is used.
+ *
+ * @param[in] state	tree to set the backend for.
+ * @param[in] backend	to store session-state in.  NULL to only
+ *			keep state locally.
+ */
+void fr_state_tree_backend_set(fr_state_tree_t *state, fr_state_backend_t const *backend)
+{
+	state->backend = backend;
+}
+
 /** Unlink an entry and remove if from the tree
  *
+ * @note Called with the shard's mutex held.
  */
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry)
 {
 	/*
 	 *	Check the memory is still valid
 	 */
 	(void) talloc_get_type_abort(entry, fr_state_entry_t);
 
-	fr_dlist_remove(&state->to_expire, entry);
+	fr_dlist_remove(&shard->to_expire, entry);
 
-	rbtree_deletebydata(state->tree, entry);
+	rbtree_deletebydata(shard->tree, entry);
+	atomic_fetch_sub(&state->num_entries, 1);
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
@@ -284,76 +370,37 @@ static int _state_entry_free(fr_state_entry_t *entry)
 	return 0;
 }
 
-/** Create a new state entry
+/** Clean up timed out entries in a shard
  *
- * @note Called with the mutex held.
+ * @note Called with the shard's mutex free.
  */
-static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *request,
-					    RADIUS_PACKET *packet, fr_state_entry_t *old)
+static void state_shard_expire(fr_state_tree_t *state, fr_state_shard_t *shard, REQUEST *request, time_t now)
 {
-	size_t			i;
-	uint32_t		x;
-	time_t			now = time(NULL);
-	VALUE_PAIR		*vp;
 	fr_state_entry_t	*entry, *next;
-
-	uint8_t			old_state[sizeof(old->state)];
-	int			old_tries = 0;
 	uint64_t		timed_out = 0;
-	bool			too_many = false;
 	fr_dlist_head_t		to_free;
 
 	fr_dlist_init(&to_free, fr_state_entry_t, list);
 
-	/*
-	 *	Clean up old entries.
-	 */
-	for (entry = fr_dlist_head(&state->to_expire);
+	state_shard_lock(state, shard);
+	for (entry = fr_dlist_head(&shard->to_expire);
 	     entry != NULL;
 	     entry = next) {
 		(void)talloc_get_type_abort(entry, fr_state_entry_t);	/* Allow examination */
-		next = fr_dlist_next(&state->to_expire, entry);		/* Advance *before* potential unlinking */
-
-		if (entry == old) continue;
+		next = fr_dlist_next(&shard->to_expire, entry);		/* Advance *before* potential unlinking */
 
 		/*
-		 *	Too old, we can delete it.
+		 *	The list is ordered by cleanup time, so
+		 *	stop at the first entry which is still live.
 		 */
-		if (entry->cleanup < now) {
-			state_entry_unlink(state, entry);
-			fr_dlist_insert_tail(&to_free, entry);
-			timed_out++;
-			continue;
-		}
+		if (entry->cleanup >= now) break;
 
-		break;
+		state_entry_unlink(state, shard, entry);
+		fr_dlist_insert_tail(&to_free, entry);
+		timed_out++;
 	}
-
-	state->timed_out += timed_out;
-
-	if (!old && (rbtree_num_elements(state->tree) >= (uint32_t) state->max_sessions)) too_many = true;
-
-	/*
-	 *	Record the information from the old state, we may base the
-	 *	new state off the old one.
-	 *
-	 *	Once we release the mutex, the state of old becomes indeterminate
-	 *	so we have to grab the values now.
-	 */
-	if (old) {
-		old_tries = old->tries;
-
-		memcpy(old_state, old->state, sizeof(old_state));
-
-		/*
-		 *	The old one isn't used any more, so we can free it.
-		 */
-		if (fr_dlist_empty(&old->data)) {
-			state_entry_unlink(state, old);
-			fr_dlist_insert_tail(&to_free, old);
-		}
-	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	shard->timed_out += timed_out;
+	state_shard_unlock(state, shard);
 
 	if (timed_out > 0) RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
 
@@ -371,32 +418,44 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 		fr_dlist_remove(&to_free, entry);
 		talloc_free(entry);
 	}
+}
 
-	/*
-	 *	Have to do this post-cleanup, else we end up returning with
-	 *	a list full of entries to free with none of them being
-	 *	freed which is bad...
-	 */
-	if (too_many) {
-		RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
-		       state->max_sessions);
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
+/** Create a new state entry
+ *
+ * @note Called with all mutexes free.  On success, returns with the
+ *	mutex of the shard the entry was inserted into held.
+ *
+ * @param[out] shard_out	Shard the entry was inserted into.
+ * @param[in] state		tree to insert the entry into.
+ * @param[in] request		the entry is being created for.
+ * @param[in] packet		to add the State attribute to.
+ * @param[in] old_state		Value of the previous state in the sequence.
+ *				NULL if this is the first round.
+ * @param[in] old_tries		Number of rounds in the previous state.
+ * @return
+ *	- The new entry.
+ *	- NULL on failure.
+ */
+static fr_state_entry_t *state_entry_create(fr_state_shard_t **shard_out, fr_state_tree_t *state, REQUEST *request,
+					    RADIUS_PACKET *packet, uint8_t const *old_state, int old_tries)
+{
+	size_t			i;
+	uint32_t		x;
+	time_t			now = time(NULL);
+	VALUE_PAIR		*vp;
+	fr_state_entry_t	*entry;
+	fr_state_shard_t	*shard;
 
 	/*
 	 *	Allocation doesn't need to occur inside the critical region
 	 *	and would add significantly to contention.
 	 */
 	entry = talloc_zero(NULL, fr_state_entry_t);
-	if (!entry) {
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
+	if (!entry) return NULL;
 
 	request_data_list_init(&entry->data);
 	talloc_set_destructor(entry, _state_entry_free);
-	entry->id = state->id++;
+	entry->id = atomic_fetch_add(&state->id, 1);
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -445,7 +504,7 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 		 *	16 octets of randomness should be enough to
 		 *	have a globally unique state.
 		 */
-		if (old) {
+		if (old_state) {
 			memcpy(entry->state, old_state, sizeof(entry->state));
 			entry->tries = old_tries + 1;
 		/*
@@ -483,8 +542,6 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	DEBUG4("State ID %" PRIu64 " created, value 0x%pH, expires %" PRIu64 "s",
 	       entry->id, fr_box_octets(entry->state, sizeof(entry->state)), (uint64_t)entry->cleanup - now);
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
 	/*
 	 *	XOR the server hash with four bytes of random data.
 	 *	We XOR is again before resolving, to ensure state lookups
@@ -493,57 +550,92 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 */
 	*((uint32_t *)(&entry->state_comp.server_hash)) ^= fr_hash_string(cf_section_name2(request->server_cs));
 
-	if (!rbtree_insert(state->tree, entry)) {
-		RERROR("Failed inserting state entry - Insertion into state tree failed");
+	shard = state_shard(state, entry);
+
+	state_shard_expire(state, shard, request, now);
+
+	/*
+	 *	Have to do this post-cleanup, else expired
+	 *	entries would count towards the limit.
+	 */
+	if (!old_state && (atomic_load(&state->num_entries) >= state->max_sessions)) {
+		RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
+		       state->max_sessions);
+	error:
 		fr_pair_delete_by_da(&packet->vps, state->da);
 		talloc_free(entry);
 		return NULL;
 	}
 
+	state_shard_lock(state, shard);
+	if (!rbtree_insert(shard->tree, entry)) {
+		state_shard_unlock(state, shard);
+		RERROR("Failed inserting state entry - Insertion into state tree failed");
+		goto error;
+	}
+	atomic_fetch_add(&state->num_entries, 1);
+
 	/*
 	 *	Link it to the end of the list, which is implicitely
 	 *	ordered by cleanup time.
 	 */
-	fr_dlist_insert_tail(&state->to_expire, entry);
+	fr_dlist_insert_tail(&shard->to_expire, entry);
+
+	*shard_out = shard;
 
 	return entry;
 }
 
-/** Find the entry, based on the State attribute
+/** Find the shard which would hold a State value
  *
+ * @param[out] find	Populated with the value to search the shard for.
+ * @param[in] state	tree to search.
+ * @param[in] request	the State value was received in.
+ * @param[in] vb	State value.
+ * @return the shard to search.
  */
-static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *request, fr_value_box_t const *vb)
+static fr_state_shard_t *state_shard_by_value(fr_state_entry_t *find, fr_state_tree_t *state,
+					      REQUEST *request, fr_value_box_t const *vb)
 {
-	fr_state_entry_t *entry, my_entry;
-
 	/*
 	 *	Assume our own State first.
 	 */
-	if (vb->vb_length == sizeof(my_entry.state)) {
-		memcpy(my_entry.state, vb->vb_octets, sizeof(my_entry.state));
+	if (vb->vb_length == sizeof(find->state)) {
+		memcpy(find->state, vb->vb_octets, sizeof(find->state));
 
 		/*
 		 *	Too big?  Get the MD5 hash, in order
 		 *	to depend on the entire contents of State.
 		 */
-	} else if (vb->vb_length > sizeof(my_entry.state)) {
-		fr_md5_calc(my_entry.state, vb->vb_octets, vb->vb_length);
+	} else if (vb->vb_length > sizeof(find->state)) {
+		fr_md5_calc(find->state, vb->vb_octets, vb->vb_length);
 
 		/*
 		 *	Too small?  Use the whole thing, and
-		 *	set the rest of my_entry.state to zero.
+		 *	set the rest of find->state to zero.
 		 */
 	} else {
-		memcpy(my_entry.state, vb->vb_octets, vb->vb_length);
-		memset(&my_entry.state[vb->vb_length], 0, sizeof(my_entry.state) - vb->vb_length);
+		memcpy(find->state, vb->vb_octets, vb->vb_length);
+		memset(&find->state[vb->vb_length], 0, sizeof(find->state) - vb->vb_length);
 	}
 
 	/*
 	 *	Make it unique for different virtual servers handling the same request
 	 */
-	my_entry.state_comp.server_hash ^= fr_hash_string(cf_section_name2(request->server_cs));
+	find->state_comp.server_hash ^= fr_hash_string(cf_section_name2(request->server_cs));
 
-	entry = rbtree_finddata(state->tree, &my_entry);
+	return state_shard(state, find);
+}
+
+/** Find the entry, based on the State attribute
+ *
+ * @note Called with the shard's mutex held.
+ */
+static fr_state_entry_t *state_entry_find(fr_state_shard_t *shard, fr_state_entry_t const *find)
+{
+	fr_state_entry_t *entry;
+
+	entry = rbtree_finddata(shard->tree, find);
 
 	if (entry) (void) talloc_get_type_abort(entry, fr_state_entry_t);
 
@@ -555,20 +647,26 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *reque
  */
 void fr_state_discard(fr_state_tree_t *state, REQUEST *request)
 {
-	fr_state_entry_t	*entry;
+	fr_state_entry_t	*entry, find;
+	fr_state_shard_t	*shard;
 	VALUE_PAIR		*vp;
 
 	vp = fr_pair_find_by_da(request->packet->vps, state->da, TAG_ANY);
 	if (!vp) return;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, request, &vp->data);
+	shard = state_shard_by_value(&find, state, request, &vp->data);
+
+	state_shard_lock(state, shard);
+	entry = state_entry_find(shard, &find);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		state_shard_unlock(state, shard);
 		return;
 	}
-	state_entry_unlink(state, entry);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_entry_unlink(state, shard, entry);
+	state_shard_unlock(state, shard);
+
+	if (state->backend) (void) state->backend->discard(state->backend->uctx, request,
+							    find.state, sizeof(find.state));
 
 	/*
 	 *	If fr_state_to_request was never called, this ensures
@@ -605,7 +703,8 @@ void fr_state_discard(fr_state_tree_t *state, REQUEST *request)
  */
 void fr_state_to_request(fr_state_tree_t *state, REQUEST *request)
 {
-	fr_state_entry_t	*entry;
+	fr_state_entry_t	*entry, find;
+	fr_state_shard_t	*shard;
 	TALLOC_CTX		*old_ctx = NULL;
 	VALUE_PAIR		*vp;
 
@@ -621,13 +720,15 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request)
 		return;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, request, &vp->data);
+	shard = state_shard_by_value(&find, state, request, &vp->data);
+
+	state_shard_lock(state, shard);
+	entry = state_entry_find(shard, &find);
 	if (entry) {
 		(void)talloc_get_type_abort(entry, fr_state_entry_t);
 		if (entry->thawed) {
 			REDEBUG("State entry has already been thawed by a request %"PRIu64, entry->thawed->number);
-			PTHREAD_MUTEX_UNLOCK(&state->mutex);
+			state_shard_unlock(state, shard);
 			return;
 		}
 		if (request->state_ctx) old_ctx = request->state_ctx;	/* Store for later freeing */
@@ -643,7 +744,29 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request)
 		entry->vps = NULL;
 		entry->thawed = request;
 	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_shard_unlock(state, shard);
+
+	/*
+	 *	The conversation may have started on
+	 *	another server.
+	 */
+	if (!entry && state->backend) {
+		TALLOC_CTX	*state_ctx;
+		VALUE_PAIR	*vps = NULL;
+
+		MEM(state_ctx = talloc_init_const("session-state"));
+		if (state->backend->fetch(state_ctx, &vps, state->backend->uctx, request,
+					  find.state, sizeof(find.state)) == 1) {
+			RDEBUG2("Restored &session-state from %s", state->backend->name);
+
+			if (request->state_ctx) old_ctx = request->state_ctx;	/* Store for later freeing */
+			if (request->seq_start == 0) request->seq_start = request->number;
+			request->state_ctx = state_ctx;
+			request->state = vps;
+		} else {
+			talloc_free(state_ctx);
+		}
+	}
 
 	if (request->state) {
 		RDEBUG2("Restored &session-state");
@@ -671,9 +794,14 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request)
  */
 int fr_request_to_state(fr_state_tree_t *state, REQUEST *request)
 {
-	fr_state_entry_t	*entry, *old = NULL;
+	fr_state_entry_t	*entry, *old = NULL, find;
+	fr_state_shard_t	*shard;
 	fr_dlist_head_t		data;
-	VALUE_PAIR		*vp;
+	VALUE_PAIR		*vp, *vps;
+	uint8_t			old_state[sizeof(find.state)];
+	uint8_t			key[sizeof(find.state)];
+	int			old_tries = 0;
+	bool			have_old = false;
 
 	request_data_list_init(&data);
 	request_data_by_persistance(&data, request, true);
@@ -686,13 +814,39 @@ int fr_request_to_state(fr_state_tree_t *state, REQUEST *request)
 	}
 
 	vp = fr_pair_find_by_da(request->packet->vps, state->da, TAG_ANY);
+	if (vp) {
+		shard = state_shard_by_value(&find, state, request, &vp->data);
+
+		/*
+		 *	Record the information from the old state, we may base the
+		 *	new state off the old one.
+		 *
+		 *	Once we release the mutex, the state of old becomes indeterminate
+		 *	so we have to grab the values now.
+		 */
+		state_shard_lock(state, shard);
+		old = state_entry_find(shard, &find);
+		if (old) {
+			have_old = true;
+			old_tries = old->tries;
+			memcpy(old_state, old->state, sizeof(old_state));
+
+			/*
+			 *	The old one isn't used any more, so we can free it.
+			 */
+			if (fr_dlist_empty(&old->data)) {
+				state_entry_unlink(state, shard, old);
+			} else {
+				old = NULL;
+			}
+		}
+		state_shard_unlock(state, shard);
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	if (vp) old = state_entry_find(state, request, &vp->data);
+		talloc_free(old);
+	}
 
-	entry = state_entry_create(state, request, request->reply, old);
+	entry = state_entry_create(&shard, state, request, request->reply, have_old ? old_state : NULL, old_tries);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
 		RERROR("Creating state entry failed");
 		request_data_restore(request, &data);	/* Put it back again */
 		return -1;
@@ -709,7 +863,22 @@ int fr_request_to_state(fr_state_tree_t *state, REQUEST *request)
 	request->state_ctx = NULL;
 	request->state = NULL;
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	/*
+	 *	The reply containing the new State value
+	 *	hasn't been sent yet, so nothing else can
+	 *	find the entry until we return.
+	 */
+	memcpy(key, entry->state, sizeof(key));
+	vps = entry->vps;
+
+	state_shard_unlock(state, shard);
+
+	if (state->backend && vps &&
+	    (state->backend->insert(state->backend->uctx, request, key, sizeof(key), vps,
+				    fr_time_delta_from_sec(state->timeout)) < 0)) {
+		RWARN("Failed storing &session-state in %s, conversation can only continue on this server",
+		      state->backend->name);
+	}
 
 	RDEBUG3("RADIUS State - saved");
 	REQUEST_VERIFY(request);
@@ -826,6 +995,13 @@ void fr_state_detach(REQUEST *request, bool will_free)
 		return;
 	}
 
+	/*
+	 *	The child already owns its state, i.e. it
+	 *	never had state restored from the parent.
+	 *	Nothing to move.
+	 */
+	if (request->state_ctx != request->parent->state_ctx) return;
+
 	MEM(new_state_ctx = talloc_init_const("session-state"));
 	request_data_by_persistance_reparent(new_state_ctx, NULL, request, true);
 	request_data_by_persistance_reparent(new_state_ctx, NULL, request, false);
@@ -834,13 +1010,6 @@ void fr_state_detach(REQUEST *request, bool will_free)
 	fr_pair_list_free(&request->state);
 
 	request->state = vps;
-
-	/*
-	 *	...again, should probably
-	 *	not happen and should probably
-	 *	be an assert.
-	 */
-	if (request->state_ctx != request->parent->state_ctx) talloc_free(request->state_ctx);
 	request->state_ctx = new_state_ctx;
 }
 
@@ -849,7 +1018,7 @@ void fr_state_detach(REQUEST *request, bool will_free)
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	return atomic_load(&state->id);
 }
 
 /** Return number of entries that timed out
@@ -857,7 +1026,12 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	uint64_t	timed_out = 0;
+	size_t		i;
+
+	for (i = 0; i < STATE_TREE_SHARDS; i++) timed_out += state->shards[i].timed_out;
+
+	return timed_out;
 }
 
 /** Return number of entries we're currently tracking
@@ -865,5 +1039,33 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return (uint32_t)rbtree_num_elements(state->tree);
+	return atomic_load(&state->num_entries);
+}
+
+/** Return the total time the state tree's mutexes have been held
+ *
+ * Always zero if the tree is not thread safe.
+ */
+fr_time_delta_t fr_state_lock_time(fr_state_tree_t *state)
+{
+	fr_time_delta_t	lock_time = 0;
+	size_t		i;
+
+	for (i = 0; i < STATE_TREE_SHARDS; i++) lock_time += state->shards[i].lock_time;
+
+	return lock_time;
+}
+
+/** Return the number of times the state tree's mutexes have been acquired
+ *
+ * Divide #fr_state_lock_time by this, to get the average hold time.
+ */
+uint64_t fr_state_lock_count(fr_state_tree_t *state)
+{
+	uint64_t	count = 0;
+	size_t		i;
+
+	for (i = 0; i < STATE_TREE_SHARDS; i++) count += state->shards[i].lock_count;
+
+	return count;
 }
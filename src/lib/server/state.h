@@ -35,9 +35,72 @@ extern "C" {
 
 typedef struct fr_state_tree_s fr_state_tree_t;
 
+/** External store for session-state
+ *
+ * Allows a conversation to continue on a different server to the one
+ * which created the state entry.  The local state tree is always
+ * searched first.
+ *
+ * Only session-state attributes are stored.  Persistable request data
+ * never leaves the server which created it.
+ *
+ * Backends are provided by modules, which add a talloced #fr_state_backend_t
+ * to their configuration section with cf_data_add().
+ */
+typedef struct {
+	char const	*name;				//!< Of the backend, for debug messages.
+
+	/** Store a copy of the session-state attributes for a State value
+	 *
+	 * @param[in] uctx	Backend's instance data.
+	 * @param[in] request	the state is being saved for.
+	 * @param[in] key	State value.
+	 * @param[in] key_len	Length of the State value.
+	 * @param[in] vps	session-state attributes.
+	 * @param[in] lifetime	How long to keep the entry for.
+	 * @return
+	 *	- 0 on success.
+	 *	- -1 on failure.
+	 */
+	int		(*insert)(void *uctx, REQUEST *request, uint8_t const *key, size_t key_len,
+				 VALUE_PAIR *vps, fr_time_delta_t lifetime);
+
+	/** Retrieve, and remove, the session-state attributes for a State value
+	 *
+	 * @param[in] ctx	to allocate the attributes in.
+	 * @param[out] out	Where to write the attributes.
+	 * @param[in] uctx	Backend's instance data.
+	 * @param[in] request	the state is being restored for.
+	 * @param[in] key	State value.
+	 * @param[in] key_len	Length of the State value.
+	 * @return
+	 *	- 1 if an entry was found.
+	 *	- 0 if no entry was found.
+	 *	- -1 on failure.
+	 */
+	int		(*fetch)(TALLOC_CTX *ctx, VALUE_PAIR **out, void *uctx, REQUEST *request,
+				 uint8_t const *key, size_t key_len);
+
+	/** Remove the session-state attributes for a State value
+	 *
+	 * @param[in] uctx	Backend's instance data.
+	 * @param[in] request	the state is being discarded for.
+	 * @param[in] key	State value.
+	 * @param[in] key_len	Length of the State value.
+	 * @return
+	 *	- 0 on success.
+	 *	- -1 on failure.
+	 */
+	int		(*discard)(void *uctx, REQUEST *request, uint8_t const *key, size_t key_len);
+
+	void		*uctx;				//!< Passed to the callbacks.
+} fr_state_backend_t;
+
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, bool thread_safe,
 				    uint32_t max_sessions, uint32_t timeout, uint8_t server_id);
 
+void	fr_state_tree_backend_set(fr_state_tree_t *state, fr_state_backend_t const *backend);
+
 void	fr_state_discard(fr_state_tree_t *state, REQUEST *request);
 
 void	fr_state_to_request(fr_state_tree_t *state, REQUEST *request);
@@ -52,6 +115,8 @@ void	fr_state_detach(REQUEST *request, bool will_free);
 uint64_t fr_state_entries_created(fr_state_tree_t *state);
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state);
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state);
+fr_time_delta_t fr_state_lock_time(fr_state_tree_t *state);
+uint64_t fr_state_lock_count(fr_state_tree_t *state);
 
 #ifdef __cplusplus
 }
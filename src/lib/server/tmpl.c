@@ -533,6 +533,8 @@ void tmpl_from_da(vp_tmpl_t *vpt, fr_dict_attr_t const *da, int8_t tag, int num,
 		vpt->tmpl_tag = tag;
 	}
 	vpt->tmpl_num = num;
+
+	tmpl_link(vpt);
 }
 
 /** Create a #vp_tmpl_t from a #fr_value_box_t
@@ -995,6 +997,8 @@ finish:
 	 */
 	if (tmpl_is_attr(vpt) && vpt->tmpl_da->flags.is_unknown) vpt->tmpl_da = vpt->tmpl_unknown;
 
+	tmpl_link(vpt);
+
 	TMPL_VERIFY(vpt);	/* Because we want to ensure we produced something sane */
 
 	*out = vpt;
@@ -1451,6 +1455,7 @@ int tmpl_define_unknown_attr(vp_tmpl_t *vpt)
 	da = fr_dict_unknown_add(fr_dict_unconst(fr_dict_internal()), vpt->tmpl_da);
 	if (!da) return -1;
 	vpt->tmpl_da = da;
+	tmpl_link(vpt);
 
 	return 0;
 }
@@ -1514,6 +1519,7 @@ int tmpl_define_undefined_attr(fr_dict_t *dict_def, vp_tmpl_t *vpt,
 
 	vpt->tmpl_da = da;
 	vpt->type = TMPL_TYPE_ATTR;
+	tmpl_link(vpt);
 
 	return 0;
 }
@@ -1766,7 +1772,7 @@ ssize_t _tmpl_to_type(void *out,
 		/*
 		 *	Data type conversion...
 		 */
-		ret = fr_value_box_cast(ctx, &value_from_cast, dst_type, NULL, to_cast);
+		ret = fr_value_box_cast_func(dst_type, src_type)(ctx, &value_from_cast, dst_type, NULL, to_cast);
 		if (ret < 0) goto error;
 
 
@@ -2048,7 +2054,7 @@ ssize_t _tmpl_to_atype(TALLOC_CTX *ctx, void *out,
 	 *	Don't dup the buffers unless we need to.
 	 */
 	if ((to_cast->type != dst_type) || needs_dup) {
-		ret = fr_value_box_cast(ctx, &from_cast, dst_type, NULL, to_cast);
+		ret = fr_value_box_cast_func(dst_type, to_cast->type)(ctx, &from_cast, dst_type, NULL, to_cast);
 		if (ret < 0) goto error;
 	} else {
 		switch (to_cast->type) {
@@ -2406,6 +2412,86 @@ static void *_tmpl_cursor_next(void **prev, void *curr, void *ctx)
 	return NULL;
 }
 
+/** Iterator for references where only the attribute needs to be compared
+ *
+ * Selected by #tmpl_link for bare, [*] and [#] references to attributes
+ * which either aren't tagged, or where any tag matches.
+ */
+static void *_tmpl_cursor_da_next(void **prev, void *curr, void *ctx)
+{
+	VALUE_PAIR		*c, *p;
+	vp_tmpl_t const		*vpt = ctx;
+	fr_dict_attr_t const	*da = vpt->tmpl_da;
+
+	if (!curr) return NULL;
+
+	if ((vpt->tmpl_num == NUM_ANY) && *prev) {	/* Bare attribute ref */
+	null_result:
+		*prev = curr;
+		return NULL;
+	}
+
+	for (c = curr, p = *prev; c; p = c, c = c->next) {
+		VP_VERIFY(c);
+		if (c->da == da) {
+			*prev = p;
+			return c;
+		}
+	}
+	goto null_result;
+}
+
+/** Resolve the runtime behaviour of an attribute reference
+ *
+ * Selects an iterator specialised for the type of reference, so that
+ * evaluating it doesn't need to decode the array and tag specifiers
+ * for every pair in the list.
+ *
+ * Should be called once the tmpl's #fr_dict_attr_t is final, i.e.
+ * after any undefined attributes have been resolved.  If the reference
+ * is changed afterwards, the link is ignored until this is called again.
+ *
+ * @param[in] vpt	to link.  Anything other than a #TMPL_TYPE_ATTR
+ *			is left alone.
+ */
+void tmpl_link(vp_tmpl_t *vpt)
+{
+	if (!tmpl_is_attr(vpt)) return;
+
+	vpt->data.attribute.link.da = vpt->tmpl_da;
+	vpt->data.attribute.link.num = vpt->tmpl_num;
+	vpt->data.attribute.link.tag = vpt->tmpl_tag;
+
+	switch (vpt->tmpl_num) {
+	case NUM_ANY:
+	case NUM_ALL:
+	case NUM_COUNT:
+		if (!vpt->tmpl_da->flags.has_tag || (vpt->tmpl_tag == TAG_ANY)) {
+			vpt->data.attribute.link.iter = _tmpl_cursor_da_next;
+			break;
+		}
+		/* FALL-THROUGH */
+
+	default:
+		vpt->data.attribute.link.iter = _tmpl_cursor_next;
+		break;
+	}
+}
+
+/** Return the iterator to use for a reference
+ *
+ */
+static inline fr_cursor_iter_t tmpl_cursor_iter(vp_tmpl_t const *vpt)
+{
+	if (tmpl_is_attr(vpt) &&
+	    vpt->data.attribute.link.iter &&
+	    (vpt->data.attribute.link.da == vpt->tmpl_da) &&
+	    (vpt->data.attribute.link.num == vpt->tmpl_num) &&
+	    (vpt->data.attribute.link.tag == vpt->tmpl_tag)) return vpt->data.attribute.link.iter;
+
+	return _tmpl_cursor_next;
+}
+
 /** Initialise a #fr_cursor_t to the #VALUE_PAIR specified by a #vp_tmpl_t
  *
  * This makes iterating over the one or more #VALUE_PAIR specified by a #vp_tmpl_t
@@ -2453,7 +2539,7 @@ VALUE_PAIR *tmpl_cursor_init(int *err, fr_cursor_t *cursor, REQUEST *request, vp
 		return NULL;
 	}
 
-	vp = fr_cursor_talloc_iter_init(cursor, vps, _tmpl_cursor_next, vpt, VALUE_PAIR);
+	vp = fr_cursor_talloc_iter_init(cursor, vps, tmpl_cursor_iter(vpt), vpt, VALUE_PAIR);
 	if (!vp) {
 		if (err) {
 			*err = -1;
@@ -2543,6 +2629,65 @@ int tmpl_find_vp(VALUE_PAIR **out, REQUEST *request, vp_tmpl_t const *vpt)
 	return err;
 }
 
+/** Returns the first VP matching a #vp_tmpl_t, remembering the result
+ *
+ * If an equivalent reference has already been resolved in the same request,
+ * the previous result is returned without searching the list again.
+ *
+ * @param[out] out	where to write the retrieved vp.
+ * @param[in] request	The current #REQUEST.
+ * @param[in] vpt	specifying the #VALUE_PAIR type/tag to find.
+ * @param[in] cache	of previous results.  If NULL or if vpt isn't a
+ *			#TMPL_TYPE_ATTR this is the same as #tmpl_find_vp.
+ * @return the same values as #tmpl_find_vp.
+ */
+int tmpl_find_vp_cached(VALUE_PAIR **out, REQUEST *request, vp_tmpl_t const *vpt, tmpl_cache_t *cache)
+{
+	REQUEST		*current = request;
+	VALUE_PAIR	*vp;
+	unsigned int	i;
+	int		err;
+
+	if (!cache || !tmpl_is_attr(vpt) || (radius_request(&current, vpt->tmpl_request) < 0)) {
+		return tmpl_find_vp(out, request, vpt);
+	}
+
+	for (i = 0; i < cache->used; i++) {
+		vp_tmpl_t const *cached = cache->entry[i].vpt;
+
+		if ((cache->entry[i].request != current) ||
+		    (cached->tmpl_da != vpt->tmpl_da) ||
+		    (cached->tmpl_list != vpt->tmpl_list) ||
+		    (cached->tmpl_num != vpt->tmpl_num) ||
+		    (cached->tmpl_tag != vpt->tmpl_tag)) continue;
+
+		vp = cache->entry[i].vp;
+		if (out) *out = vp;
+		if (!vp) {
+			fr_strerror_printf("No matching \"%s\" pairs found", vpt->tmpl_da->name);
+			return -1;
+		}
+		return 0;
+	}
+
+	err = tmpl_find_vp(&vp, request, vpt);
+	if (out) *out = vp;
+
+	/*
+	 *	Don't remember missing lists or requests,
+	 *	they're errors, and should be reported as
+	 *	such every time.
+	 */
+	if (((err == 0) || (err == -1)) && (cache->used < NUM_ELEMENTS(cache->entry))) {
+		cache->entry[cache->used].request = current;
+		cache->entry[cache->used].vpt = vpt;
+		cache->entry[cache->used].vp = vp;
+		cache->used++;
+	}
+
+	return err;
+}
+
 /** Returns the first VP matching a #vp_tmpl_t, or if no VPs match, creates a new one.
  *
  * @param[out] out where to write the retrieved or created vp.
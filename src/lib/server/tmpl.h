@@ -200,6 +200,19 @@ struct vp_tmpl_s {
 			} unknown;
 			int			num;			 //!< For array references.
 			int8_t			tag;			 //!< For tag references.
+
+			/** Written by tmpl_link()
+			 *
+			 * Only used whilst da, num and tag still match
+			 * the fields above, as callers are free to
+			 * modify the reference after it's been linked.
+			 */
+			struct {
+				fr_dict_attr_t const	*da;		//!< Attribute the iterator was selected for.
+				int			num;		//!< Array reference the iterator was selected for.
+				int8_t			tag;		//!< Tag reference the iterator was selected for.
+				fr_cursor_iter_t	iter;		//!< Specialised iterator for this reference.
+			} link;
 		} attribute;
 
 		/*
@@ -257,6 +270,35 @@ struct vp_tmpl_s {
 #endif
 /** @} */
 
+/** Number of references #tmpl_cache_t remembers
+ *
+ */
+#define TMPL_CACHE_SIZE			8
+
+/** Remembers the first match for attribute references
+ *
+ * Lets repeated references to the same attribute, e.g. multiple comparisons
+ * against &User-Name in one condition, skip walking the pair list.
+ *
+ * @note Entries are only valid whilst the lists they were found in are
+ *	not modified.  The owner must call #tmpl_cache_clear whenever that
+ *	may have happened, i.e. after anything which could run an xlat,
+ *	exec or module.
+ */
+typedef struct {
+	unsigned int			used;			//!< Number of entries in use.
+	struct {
+		REQUEST			*request;		//!< The reference was resolved in.
+		vp_tmpl_t const		*vpt;			//!< The reference, or an equivalent one.
+		VALUE_PAIR		*vp;			//!< The first match, or NULL if there was none.
+	} entry[TMPL_CACHE_SIZE];
+} tmpl_cache_t;
+
+/** Invalidate all entries in a #tmpl_cache_t
+ *
+ */
+#define tmpl_cache_clear(_cache)	do { if (_cache) (_cache)->used = 0; } while (0)
+
 #ifndef WITH_VERIFY_PTR
 #  define TMPL_VERIFY(_x)
 #else
@@ -508,8 +550,13 @@ int			tmpl_copy_vps(TALLOC_CTX *ctx, VALUE_PAIR **out, REQUEST *request,
 
 int			tmpl_find_vp(VALUE_PAIR **out, REQUEST *request, vp_tmpl_t const *vpt);
 
+int			tmpl_find_vp_cached(VALUE_PAIR **out, REQUEST *request, vp_tmpl_t const *vpt,
+					    tmpl_cache_t *cache);
+
 int			tmpl_find_or_add_vp(VALUE_PAIR **out, REQUEST *request, vp_tmpl_t const *vpt);
 
+void			tmpl_link(vp_tmpl_t *vpt);
+
 int			tmpl_define_unknown_attr(vp_tmpl_t *vpt);
 
 int			tmpl_define_undefined_attr(fr_dict_t *dict, vp_tmpl_t *vpt,
@@ -0,0 +1,374 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/trace.c
+ * @brief Sampled per-request tracing.
+ *
+ * The network thread decides whether a packet is traced, using
+ * #fr_trace_sample.  The worker then calls #fr_trace_start for sampled
+ * requests, which sets request->trace.  Everything else checks that
+ * pointer first, so requests which aren't sampled pay for one branch
+ * at each span.
+ *
+ * Spans nest.  A span started while another is open becomes its child,
+ * and #fr_trace_context_print gives the W3C "traceparent" for the
+ * innermost open span, so that backends can continue the trace.
+ *
+ * When the reply is sent, #fr_trace_finish writes every span of the
+ * request as one line of Zipkin v2 JSON.  The write goes through the
+ * asynchronous log pipeline if it's running, so workers don't block
+ * on the trace file.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/trace.h>
+#include <freeradius-devel/util/log_async.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#define TRACE_SPANS_INIT	8
+
+/** One timed operation within a request
+ *
+ */
+typedef struct {
+	uint64_t		id;			//!< Of this span.
+	int			parent;			//!< Index of the parent span, or -1 for the root.
+	char const		*name;			//!< Must outlive the request.
+	fr_trace_span_kind_t	kind;			//!< What the span represents.
+	fr_time_t		start;
+	fr_time_t		end;			//!< 0 while the span is open.
+	bool			error;			//!< Whether the operation failed.
+} fr_trace_span_t;
+
+struct fr_trace_s {
+	uint64_t		trace_id[2];		//!< 128 bit trace ID.
+	fr_trace_span_t		*spans;			//!< Array of spans, the root is first.
+	int			num_spans;		//!< Number of spans used.
+	int			current;		//!< Innermost open span.
+};
+
+static uint32_t			trace_sample_rate;	//!< Trace one request in this many.
+static int			trace_fd = -1;		//!< Where the spans are written.
+static _Thread_local uint32_t	trace_count;		//!< Packets seen since the last one sampled.
+
+/** Open the trace file, and enable sampling
+ *
+ * @param[in] sample_rate	Trace one in this many requests.  0 disables tracing.
+ * @param[in] file		to append spans to.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_trace_init(uint32_t sample_rate, char const *file)
+{
+	if (!sample_rate) return 0;
+
+	if (!file) {
+		fr_strerror_printf("A trace file must be set");
+		return -1;
+	}
+
+	trace_fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+	if (trace_fd < 0) {
+		fr_strerror_printf("Failed opening trace file %s: %s", file, fr_syserror(errno));
+		return -1;
+	}
+
+	trace_sample_rate = sample_rate;
+
+	return 0;
+}
+
+/** Stop tracing, and close the trace file
+ *
+ * Should be called after the log pipeline has been flushed.
+ */
+void fr_trace_free(void)
+{
+	trace_sample_rate = 0;
+
+	if (trace_fd >= 0) {
+		close(trace_fd);
+		trace_fd = -1;
+	}
+}
+
+/** Decide whether to trace a packet
+ *
+ * Called by the network thread for each packet it reads.
+ */
+bool fr_trace_sample(void)
+{
+	if (likely(!trace_sample_rate)) return false;
+
+	if (++trace_count < trace_sample_rate) return false;
+
+	trace_count = 0;
+	return true;
+}
+
+static inline uint64_t trace_id_rand(void)
+{
+	uint64_t id;
+
+	do {
+		id = ((uint64_t) fr_rand() << 32) | fr_rand();
+	} while (!id);
+
+	return id;
+}
+
+static int trace_span_alloc(fr_trace_t *trace, char const *name, fr_trace_span_kind_t kind, fr_time_t when)
+{
+	fr_trace_span_t	*span;
+	size_t		size = talloc_array_length(trace->spans);
+
+	if ((size_t) trace->num_spans >= size) {
+		MEM(trace->spans = talloc_realloc(trace, trace->spans, fr_trace_span_t, size * 2));
+	}
+
+	span = &trace->spans[trace->num_spans];
+	*span = (fr_trace_span_t) {
+		.id = trace_id_rand(),
+		.parent = trace->current,
+		.name = name,
+		.kind = kind,
+		.start = when
+	};
+
+	trace->current = trace->num_spans;
+
+	return trace->num_spans++;
+}
+
+/** Start tracing a request
+ *
+ * Creates the root span, which lasts until #fr_trace_finish.
+ *
+ * @param[in] request	to trace.
+ * @param[in] when	the request was received.
+ */
+void fr_trace_start(REQUEST *request, fr_time_t when)
+{
+	fr_trace_t *trace;
+
+	MEM(trace = talloc_zero(request, fr_trace_t));
+	MEM(trace->spans = talloc_array(trace, fr_trace_span_t, TRACE_SPANS_INIT));
+	trace->trace_id[0] = trace_id_rand();
+	trace->trace_id[1] = trace_id_rand();
+	trace->current = -1;
+
+	(void) trace_span_alloc(trace, request->server_cs ? cf_section_name2(request->server_cs) : "request",
+				FR_TRACE_SPAN_SERVER, when);
+
+	request->trace = trace;
+}
+
+/** Start a span, as a child of the innermost open span
+ *
+ * @param[in] request	being traced.
+ * @param[in] name	of the span.  Must outlive the request.
+ * @param[in] kind	of span.
+ * @return
+ *	- The span, to pass to #fr_trace_span_end.
+ *	- -1 if the request isn't being traced.
+ */
+int fr_trace_span_start(REQUEST *request, char const *name, fr_trace_span_kind_t kind)
+{
+	if (!request->trace) return -1;
+
+	return trace_span_alloc(request->trace, name, kind, fr_time());
+}
+
+/** End a span
+ *
+ * @param[in] request	being traced.
+ * @param[in] span	returned by #fr_trace_span_start.
+ * @param[in] error	whether the operation failed.
+ */
+void fr_trace_span_end(REQUEST *request, int span, bool error)
+{
+	fr_trace_t	*trace = request->trace;
+	fr_trace_span_t	*s;
+
+	if (!trace || (span < 0) || (span >= trace->num_spans)) return;
+
+	s = &trace->spans[span];
+	if (s->end) return;
+
+	s->end = fr_time();
+	s->error = error;
+
+	if (trace->current == span) trace->current = s->parent;
+}
+
+/** Print the W3C trace context for the innermost open span
+ *
+ * The result is the value of a "traceparent" HTTP header.
+ *
+ * @param[out] out	Where to write the trace context.
+ * @param[in] outlen	Length of the output buffer.
+ * @param[in] request	being traced.
+ * @return
+ *	- The length of the trace context.
+ *	- 0 if the request isn't being traced.
+ */
+size_t fr_trace_context_print(char *out, size_t outlen, REQUEST *request)
+{
+	fr_trace_t	*trace = request->trace;
+	int		len;
+
+	if (!outlen) return 0;
+	*out = '\0';
+
+	if (!trace || (trace->current < 0)) return 0;
+
+	len = snprintf(out, outlen, "00-%016" PRIx64 "%016" PRIx64 "-%016" PRIx64 "-01",
+		       trace->trace_id[0], trace->trace_id[1], trace->spans[trace->current].id);
+	if ((len < 0) || ((size_t) len >= outlen)) {
+		*out = '\0';
+		return 0;
+	}
+
+	return len;
+}
+
+/** Append a JSON string to a talloc buffer
+ *
+ */
+static char *trace_json_str(char *buff, char const *in)
+{
+	char const *p;
+
+	buff = talloc_strdup_append_buffer(buff, "\"");
+
+	for (p = in; *p; p++) {
+		switch (*p) {
+		case '"':
+			buff = talloc_strdup_append_buffer(buff, "\\\"");
+			break;
+
+		case '\\':
+			buff = talloc_strdup_append_buffer(buff, "\\\\");
+			break;
+
+		default:
+			if ((uint8_t) *p < 0x20) {
+				buff = talloc_asprintf_append_buffer(buff, "\\u%04x", (uint8_t) *p);
+				break;
+			}
+			buff = talloc_strndup_append_buffer(buff, p, 1);
+			break;
+		}
+	}
+
+	return talloc_strdup_append_buffer(buff, "\"");
+}
+
+/** End the root span, and write all of the request's spans
+ *
+ * Any spans which are still open (e.g. for cancelled operations) are
+ * closed as errors.
+ *
+ * @param[in] request	being traced.
+ * @param[in] when	the reply was sent.
+ */
+void fr_trace_finish(REQUEST *request, fr_time_t when)
+{
+	fr_trace_t	*trace = request->trace;
+	char		*buff;
+	size_t		len;
+	int		i;
+
+	if (!trace) return;
+
+	MEM(buff = talloc_strdup(trace, "["));
+
+	for (i = 0; i < trace->num_spans; i++) {
+		fr_trace_span_t *s = &trace->spans[i];
+
+		if (!s->end) {
+			s->end = when;
+			s->error = (i != 0);
+		}
+
+		buff = talloc_asprintf_append_buffer(buff,
+						     "%s{\"traceId\":\"%016" PRIx64 "%016" PRIx64 "\","
+						     "\"id\":\"%016" PRIx64 "\",",
+						     i ? "," : "", trace->trace_id[0], trace->trace_id[1], s->id);
+		if (s->parent >= 0) {
+			buff = talloc_asprintf_append_buffer(buff, "\"parentId\":\"%016" PRIx64 "\",",
+							     trace->spans[s->parent].id);
+		}
+
+		buff = talloc_strdup_append_buffer(buff, "\"name\":");
+		buff = trace_json_str(buff, s->name ? s->name : "");
+
+		switch (s->kind) {
+		case FR_TRACE_SPAN_SERVER:
+			buff = talloc_strdup_append_buffer(buff, ",\"kind\":\"SERVER\"");
+			break;
+
+		case FR_TRACE_SPAN_CLIENT:
+			buff = talloc_strdup_append_buffer(buff, ",\"kind\":\"CLIENT\"");
+			break;
+
+		default:
+			break;
+		}
+
+		buff = talloc_asprintf_append_buffer(buff,
+						     ",\"timestamp\":%" PRId64 ",\"duration\":%" PRIu64
+						     ",\"localEndpoint\":{\"serviceName\":\"freeradius\"}",
+						     fr_time_to_usec(s->start),
+						     (uint64_t) ((s->end > s->start) ? (s->end - s->start) / 1000 : 0));
+
+		if (i == 0) {
+			buff = talloc_asprintf_append_buffer(buff,
+							     ",\"tags\":{\"request.number\":\"%" PRIu64 "\","
+							     "\"packet.code\":\"%u\",\"reply.code\":\"%u\"}",
+							     request->number,
+							     request->packet ? request->packet->code : 0,
+							     request->reply ? request->reply->code : 0);
+		} else if (s->error) {
+			buff = talloc_strdup_append_buffer(buff, ",\"tags\":{\"error\":\"true\"}");
+		}
+
+		buff = talloc_strdup_append_buffer(buff, "}");
+	}
+
+	buff = talloc_strdup_append_buffer(buff, "]\n");
+	len = talloc_array_length(buff) - 1;
+
+	if ((trace_fd >= 0) && !fr_log_async_enqueue(trace_fd, 0, buff, len)) {
+		if (write(trace_fd, buff, len) < 0) {
+			RDEBUG2("Failed writing trace: %s", fr_syserror(errno));
+		}
+	}
+
+	talloc_free(trace);
+	request->trace = NULL;
+}
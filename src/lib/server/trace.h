@@ -0,0 +1,76 @@
+#pragma once
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/trace.h
+ * @brief Sampled per-request tracing.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(trace_h, "$Id$")
+
+#include <freeradius-devel/util/time.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_trace_s fr_trace_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#include <freeradius-devel/server/request.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** What a span represents, as in the Zipkin / OpenTelemetry "kind"
+ *
+ */
+typedef enum {
+	FR_TRACE_SPAN_INTERNAL = 0,			//!< Work done inside the server.
+	FR_TRACE_SPAN_SERVER,				//!< Processing a request we received.
+	FR_TRACE_SPAN_CLIENT				//!< Waiting for a request we sent to a backend.
+} fr_trace_span_kind_t;
+
+int		fr_trace_init(uint32_t sample_rate, char const *file);
+
+void		fr_trace_free(void);
+
+bool		fr_trace_sample(void);
+
+void		fr_trace_start(REQUEST *request, fr_time_t when) CC_HINT(nonnull);
+
+int		fr_trace_span_start(REQUEST *request, char const *name, fr_trace_span_kind_t kind) CC_HINT(nonnull);
+
+void		fr_trace_span_end(REQUEST *request, int span, bool error) CC_HINT(nonnull);
+
+size_t		fr_trace_context_print(char *out, size_t outlen, REQUEST *request) CC_HINT(nonnull);
+
+void		fr_trace_finish(REQUEST *request, fr_time_t when) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
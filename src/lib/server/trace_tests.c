@@ -0,0 +1,126 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include "trace.c"
+
+/** Start tracing to a temporary file
+ *
+ */
+static int test_init(char *path, size_t len, uint32_t sample_rate)
+{
+	int fd;
+
+	strlcpy(path, "/tmp/trace_tests.XXXXXX", len);
+	fd = mkstemp(path);
+	TEST_CHECK(fd >= 0);
+	if (fd < 0) return -1;
+	close(fd);
+
+	TEST_CHECK(fr_trace_init(sample_rate, path) == 0);
+	return 0;
+}
+
+/** Read everything written to the trace file
+ *
+ */
+static char *test_read(TALLOC_CTX *ctx, char const *path)
+{
+	FILE	*fp;
+	char	buffer[8192];
+	size_t	len;
+
+	fp = fopen(path, "r");
+	TEST_CHECK(fp != NULL);
+	if (!fp) return NULL;
+
+	len = fread(buffer, 1, sizeof(buffer) - 1, fp);
+	buffer[len] = '\0';
+	fclose(fp);
+
+	return talloc_typed_strdup(ctx, buffer);
+}
+
+static void test_sample(void)
+{
+	char	path[64];
+	int	i, sampled = 0;
+
+	TEST_CASE("Nothing is sampled when tracing is disabled");
+	for (i = 0; i < 100; i++) TEST_CHECK(!fr_trace_sample());
+
+	if (test_init(path, sizeof(path), 4) < 0) return;
+
+	TEST_CASE("One in sample_rate requests is sampled");
+	for (i = 0; i < 100; i++) if (fr_trace_sample()) sampled++;
+	TEST_CHECK(sampled == 25);
+	TEST_MSG("Expected 25, got %i", sampled);
+
+	fr_trace_free();
+	unlink(path);
+}
+
+static void test_spans(void)
+{
+	TALLOC_CTX	*ctx;
+	REQUEST		*request;
+	char		path[64];
+	char		root[64], child[64];
+	char		*out;
+	int		span, inner;
+
+	ctx = talloc_init_const("test");
+	if (test_init(path, sizeof(path), 1) < 0) return;
+
+	request = talloc_zero(ctx, REQUEST);
+	request->number = 42;
+
+	TEST_CASE("Requests which aren't traced have no spans, or trace context");
+	TEST_CHECK(fr_trace_span_start(request, "ignored", FR_TRACE_SPAN_INTERNAL) < 0);
+	TEST_CHECK(fr_trace_context_print(root, sizeof(root), request) == 0);
+	TEST_CHECK(root[0] == '\0');
+
+	fr_trace_start(request, fr_time());
+	TEST_CHECK(request->trace != NULL);
+
+	TEST_CASE("The trace context is in the W3C traceparent format");
+	TEST_CHECK(fr_trace_context_print(root, sizeof(root), request) == 55);
+	TEST_CHECK(strncmp(root, "00-", 3) == 0);
+	TEST_CHECK(strcmp(root + 52, "-01") == 0);
+	TEST_MSG("%s", root);
+
+	TEST_CASE("Spans nest, and the trace context follows the innermost");
+	span = fr_trace_span_start(request, "rest", FR_TRACE_SPAN_INTERNAL);
+	TEST_CHECK(span > 0);
+	inner = fr_trace_span_start(request, "rest \"backend\"", FR_TRACE_SPAN_CLIENT);
+	TEST_CHECK(inner > span);
+	TEST_CHECK(request->trace->spans[inner].parent == span);
+
+	TEST_CHECK(fr_trace_context_print(child, sizeof(child), request) == 55);
+	TEST_CHECK(strncmp(root, child, 36) == 0);		/* Same trace ID */
+	TEST_CHECK(strcmp(root + 36, child + 36) != 0);		/* Different span */
+
+	fr_trace_span_end(request, inner, true);
+	fr_trace_span_end(request, span, false);
+	TEST_CHECK(request->trace->current == 0);
+
+	TEST_CASE("Finishing writes the spans as one line of JSON");
+	fr_trace_finish(request, fr_time());
+	TEST_CHECK(request->trace == NULL);
+
+	out = test_read(ctx, path);
+	TEST_CHECK(out && (out[0] == '[') && (strcmp(out + strlen(out) - 2, "]\n") == 0));
+	TEST_CHECK(out && strstr(out, "\"name\":\"rest\""));
+	TEST_CHECK(out && strstr(out, "\"name\":\"rest \\\"backend\\\"\",\"kind\":\"CLIENT\""));
+	TEST_CHECK(out && strstr(out, "\"request.number\":\"42\""));
+	TEST_CHECK(out && strstr(out, "\"error\":\"true\""));
+	TEST_MSG("%s", out);
+
+	fr_trace_free();
+	unlink(path);
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "Sample",			test_sample },
+	{ "Spans",			test_spans },
+	{ NULL }
+};
@@ -28,13 +28,9 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/cf_parse.h>
 #include <freeradius-devel/util/debug.h>
-#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/dlist.h>
 
-/*
- *	Public "thunk" API so that the various binaries can link to
- *	libfreeradius-server.a, and don't need to be linked to libfreeradius-io.a
- */
-fr_trigger_worker_t trigger_worker_request_add = NULL;
+#include <pthread.h>
 
 /** Whether triggers are enabled globally
  *
@@ -43,18 +39,55 @@ static bool			triggers_init;
 static CONF_SECTION const	*trigger_exec_main, *trigger_exec_subcs;
 static rbtree_t			*trigger_last_fired_tree;
 static pthread_mutex_t		*trigger_mutex;
+static fr_dict_attr_t const	*trigger_event_count_da;
 
 #define REQUEST_INDEX_TRIGGER_NAME	1
 #define REQUEST_INDEX_TRIGGER_ARGS	2
 
+/** A trigger waiting to be run by the executor thread
+ *
+ * Everything the trigger needs is copied, as the caller's request, and
+ * arguments, will likely be gone by the time it runs.
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the executor's queue.
+	char			*name;		//!< The trigger name, e.g. modules.ldap.pool.open.
+	char const		*value;		//!< The command to run.  Points into the config.
+	CONF_SECTION const	*subcs;		//!< Trigger section the command was found in.
+	VALUE_PAIR		*args;		//!< Available via %{trigger:<arg>}.
+	VALUE_PAIR		*vps;		//!< Copy of the triggering request's attributes.
+	fr_log_lvl_t		lvl;		//!< Log level of the triggering request.
+} trigger_job_t;
+
 /** Describes a rate limiting entry for a trigger
  *
  */
 typedef struct {
 	CONF_ITEM	*ci;		//!< Config item this rate limit counter is associated with.
-	time_t		last_fired;	//!< When this trigger last fired.
+	fr_time_t	last_fired;	//!< When this trigger last fired.
+	fr_time_delta_t	interval;	//!< Minimum time between executions of this trigger.
+	uint32_t	suppressed;	//!< How many events have been coalesced since last_fired.
+	trigger_job_t	*pending;	//!< The most recent suppressed event.  Run with a count
+					///< of suppressed events once the interval expires.
 } trigger_last_fired_t;
 
+/** The trigger executor
+ *
+ * Triggers are expanded and forked from a dedicated thread, so that a storm
+ * of events (connections failing, for example) doesn't tie up the workers.
+ *
+ * All fields are protected by #trigger_mutex.
+ */
+static struct {
+	pthread_t		thread;
+	pthread_cond_t		cond;		//!< Signalled when there's work, or we're stopping.
+	pid_t			pid;		//!< Process the thread was started in.
+	bool			running;
+	fr_dlist_head_t		queue;		//!< Of #trigger_job_t.
+	fr_time_t		next_flush;	//!< When the next pending coalesced event is due.
+						///< 0 if there are none.
+} trigger_executor = { .cond = PTHREAD_COND_INITIALIZER };
+
 /** Retrieve attributes from a special trigger list
  *
  */
@@ -126,6 +159,202 @@ static int _trigger_last_fired_cmp(void const *a, void const *b)
 	return (lf_a->ci < lf_b->ci) - (lf_a->ci > lf_b->ci);
 }
 
+/** Run a trigger from the executor thread
+ *
+ * The command is expanded synchronously, with the trigger arguments
+ * available via the trigger xlat, and the program is run without waiting
+ * for it to complete.
+ */
+static void trigger_run(trigger_job_t *job)
+{
+	REQUEST	*request;
+
+	/*
+	 *	radius_start_program always needs a request.
+	 */
+	request = request_alloc(job);
+	memcpy(&request->server_cs, &job->subcs, sizeof(job->subcs)); /* completely wrong, but we need to use _something_ */
+
+	request->log.dst = talloc_zero(request, log_dst_t);
+	request->log.dst->func = vlog_request;
+	request->log.dst->uctx = &default_log;
+	request->log.lvl = job->lvl;
+
+	/*
+	 *	Add the args to the request data, so they can be picked up by the
+	 *	trigger_xlat function.
+	 */
+	if ((job->args && (request_data_add(request, &trigger_exec_main, REQUEST_INDEX_TRIGGER_ARGS, job->args,
+					    false, false, false) < 0)) ||
+	    (request_data_add(request, &trigger_exec_main, REQUEST_INDEX_TRIGGER_NAME, job->name,
+			      false, false, false) < 0)) {
+		talloc_free(request);
+		return;
+	}
+
+	if (job->vps) (void) fr_pair_list_copy(request->packet, &request->packet->vps, job->vps);
+
+	RDEBUG("Running trigger %s", job->value);
+
+	if (radius_start_program(job->value, request, false, NULL, NULL, NULL, false) < 0) {
+		RPERROR("Failed trigger %s", job->name);
+	}
+
+	talloc_free(request);
+}
+
+/** Add a count of the events a trigger represents to its arguments
+ *
+ */
+static void trigger_job_count(trigger_job_t *job, uint32_t count)
+{
+	VALUE_PAIR *vp;
+
+	if (!trigger_event_count_da) return;
+
+	MEM(vp = fr_pair_afrom_da(job, trigger_event_count_da));
+	vp->vp_uint32 = count;
+	fr_pair_add(&job->args, vp);
+}
+
+/** Queue coalesced events whose rate limiting interval has expired
+ *
+ * Must be called with #trigger_mutex held.
+ */
+static int _trigger_flush(void *data, void *uctx)
+{
+	trigger_last_fired_t	*found = talloc_get_type_abort(data, trigger_last_fired_t);
+	fr_time_t		now = *((fr_time_t *)uctx);
+	fr_time_t		when;
+	trigger_job_t		*job;
+
+	if (!found->pending) return 0;
+
+	when = found->last_fired + found->interval;
+	if (now && (when > now)) {
+		if (!trigger_executor.next_flush || (when < trigger_executor.next_flush)) {
+			trigger_executor.next_flush = when;
+		}
+		return 0;
+	}
+
+	job = talloc_steal(NULL, found->pending);
+	trigger_job_count(job, found->suppressed);
+	fr_dlist_insert_tail(&trigger_executor.queue, job);
+
+	found->pending = NULL;
+	found->suppressed = 0;
+	found->last_fired = now ? now : fr_time();
+
+	return 0;
+}
+
+/** Queue any coalesced events which are due
+ *
+ * Must be called with #trigger_mutex held.
+ *
+ * @param[in] now	Current time, or 0 to queue all coalesced events.
+ */
+static void trigger_flush(fr_time_t now)
+{
+	if (!trigger_executor.next_flush || (now && (trigger_executor.next_flush > now))) return;
+
+	trigger_executor.next_flush = 0;
+	(void) rbtree_walk(trigger_last_fired_tree, RBTREE_IN_ORDER, _trigger_flush, &now);
+}
+
+/** Run queued triggers until we're told to stop
+ *
+ */
+static void *trigger_executor_main(UNUSED void *arg)
+{
+	trigger_job_t *job;
+
+	pthread_mutex_lock(trigger_mutex);
+	for (;;) {
+		trigger_flush(trigger_executor.running ? fr_time() : 0);
+
+		job = fr_dlist_head(&trigger_executor.queue);
+		if (job) {
+			fr_dlist_remove(&trigger_executor.queue, job);
+			pthread_mutex_unlock(trigger_mutex);
+
+			trigger_run(job);
+			talloc_free(job);
+
+			pthread_mutex_lock(trigger_mutex);
+			continue;
+		}
+
+		if (!trigger_executor.running) break;
+
+		if (trigger_executor.next_flush) {
+			struct timespec ts = fr_time_to_timespec(trigger_executor.next_flush);
+
+			pthread_cond_timedwait(&trigger_executor.cond, trigger_mutex, &ts);
+		} else {
+			pthread_cond_wait(&trigger_executor.cond, trigger_mutex);
+		}
+	}
+	pthread_mutex_unlock(trigger_mutex);
+
+	return NULL;
+}
+
+/** Hand a trigger to the executor thread, starting it if required
+ *
+ * The thread is started on first use, as triggers may be fired before
+ * the server daemonizes, and threads don't survive fork().
+ *
+ * Must be called with #trigger_mutex held.
+ */
+static int trigger_dispatch(trigger_job_t *job)
+{
+	if (!trigger_executor.running || (trigger_executor.pid != getpid())) {
+		fr_dlist_init(&trigger_executor.queue, trigger_job_t, entry);
+
+		if (pthread_create(&trigger_executor.thread, NULL, trigger_executor_main, NULL) != 0) {
+			ERROR("Failed creating trigger executor thread: %s", fr_syserror(errno));
+			trigger_executor.running = false;
+			return -1;
+		}
+		trigger_executor.pid = getpid();
+		trigger_executor.running = true;
+	}
+
+	fr_dlist_insert_tail(&trigger_executor.queue, job);
+	pthread_cond_signal(&trigger_executor.cond);
+
+	return 0;
+}
+
+/** Find the rate limiting interval for a trigger
+ *
+ * The closest "rate_limit_interval" item in the trigger's section, or one
+ * of its parents, is used.  If there isn't one, the trigger fires at most
+ * once per second.
+ */
+static fr_time_delta_t trigger_rate_limit_interval(CONF_ITEM const *ci, CONF_SECTION const *subcs)
+{
+	CONF_SECTION const	*cs;
+	CONF_PAIR		*cp;
+	fr_time_delta_t		interval;
+
+	for (cs = cf_item_to_section(cf_parent(ci)); cs; cs = cf_item_to_section(cf_parent(cs))) {
+		cp = cf_pair_find(cs, "rate_limit_interval");
+		if (cp) {
+			if (fr_time_delta_from_str(&interval, cf_pair_value(cp), FR_TIME_RES_SEC) == 0) return interval;
+
+			cf_log_perr(cp, "Invalid rate_limit_interval, using 1s");
+			break;
+		}
+
+		if (cs == subcs) break;
+	}
+
+	return fr_time_delta_from_sec(1);
+}
+
 /** Set the global trigger section trigger_exec will search in, and register xlats
  *
  * This function exists because triggers are used by the connection pool, which
@@ -163,6 +392,9 @@ int trigger_exec_init(CONF_SECTION const *cs)
 	pthread_mutex_init(trigger_mutex, 0);
 	talloc_set_destructor(trigger_mutex, _mutex_free);
 
+	trigger_event_count_da = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal()), FR_TRIGGER_EVENT_COUNT);
+	if (!trigger_event_count_da) WARN("Incomplete dictionary: Missing definition for \"Trigger-Event-Count\"");
+
 	triggers_init = true;
 
 	return 0;
@@ -170,11 +402,26 @@ int trigger_exec_init(CONF_SECTION const *cs)
 
 /** Free trigger resources
  *
+ * Any queued triggers, and coalesced events, are run before the executor
+ * thread exits.
  */
 void trigger_exec_free(void)
 {
+	if (trigger_mutex) {
+		bool running;
+
+		pthread_mutex_lock(trigger_mutex);
+		running = trigger_executor.running && (trigger_executor.pid == getpid());
+		trigger_executor.running = false;
+		pthread_cond_signal(&trigger_executor.cond);
+		pthread_mutex_unlock(trigger_mutex);
+
+		if (running) pthread_join(trigger_executor.thread, NULL);
+	}
+
 	TALLOC_FREE(trigger_last_fired_tree);
 	TALLOC_FREE(trigger_mutex);
+	triggers_init = false;
 }
 
 /** Return whether triggers are enabled
@@ -185,64 +432,15 @@ bool trigger_enabled(void)
 	return triggers_init;
 }
 
-typedef struct {
-	char		*name;
-	xlat_exp_t	*xlat;
-	VALUE_PAIR	*vps;
-	fr_value_box_t	*box;
-	bool		expanded;
-} fr_trigger_t;
-
-static rlm_rcode_t trigger_process(void *instance, UNUSED void *thread, REQUEST *request)
-{
-	fr_trigger_t *ctx = instance;
-	rlm_rcode_t rcode;
-
-	if (!ctx->expanded) {
-		RDEBUG("Running trigger %s", ctx->name);
-
-		/*
-		 *	Bootstrap these for simpliciy.
-		 */
-		(void) fr_pair_list_copy(request->packet, &request->packet->vps, ctx->vps);
-
-		unlang_interpret_push_instruction(request, NULL, RLM_MODULE_REJECT, UNLANG_TOP_FRAME);
-
-		unlang_xlat_push(request, &ctx->box, request, ctx->xlat, true);
-		ctx->expanded = true;
-
-		/*
-		 *	Run the interpreter.
-		 */
-		rcode = unlang_interpret(request);
-
-		if (request->master_state == REQUEST_STOP_PROCESSING) return RLM_MODULE_HANDLED;
-
-		if (rcode == RLM_MODULE_YIELD) return RLM_MODULE_YIELD;
-
-		/*
-		 *	Always fall through, no matter what the return code is.
-		 */
-	}
-
-	if (!ctx->box) {
-		RERROR("Failed trigger %s - did not expand to anything", ctx->name);
-		return RLM_MODULE_FAIL;
-	}
-
-	/*
-	 *	Execute the program without waiting for results.
-	 */
-	if (fr_exec_nowait(request, ctx->box, NULL) < 0) {
-		RERROR("Failed trigger %s - %s", ctx->name, fr_strerror());
-		return RLM_MODULE_FAIL;
-	}
-
-	return RLM_MODULE_OK;
-}
-
-
 /** Execute a trigger - call an executable to process an event
+ *
+ * The trigger is run asynchronously, by a dedicated executor thread.
+ *
+ * If rate limiting is enabled, the trigger is run at most once per
+ * "rate_limit_interval" (1 second by default).  Events which occur within
+ * the interval are coalesced.  Once the interval expires, the trigger is
+ * run once with the arguments of the most recent event, and the number of
+ * events it represents in the Trigger-Event-Count argument.
  *
  * @note Calls to this function will be ignored if #trigger_exec_init has not been called.
  *
@@ -255,6 +453,7 @@ static rlm_rcode_t trigger_process(void *instance, UNUSED void *thread, REQUEST
  *			e.g. module.ldap.pool.start.
  * @param rate_limit	whether to rate limit triggers.
  * @param args		to make available via the @verbatim %{trigger:<arg>} @endverbatim xlat.
+ *			Copied, so may be freed as soon as this function returns.
  * @return 		- 0 on success.
  *			- -1 on failure.
  */
@@ -268,14 +467,13 @@ int trigger_exec(REQUEST *request, CONF_SECTION const *cs, char const *name, boo
 	char const		*attr;
 	char const		*value;
 
-	REQUEST			*fake;
-	fr_trigger_t		*ctx;
-	ssize_t			slen;
+	trigger_job_t		*job, *old = NULL;
+	int			ret = 0;
 
 	/*
 	 *	noop if trigger_exec_init was never called
 	 */
-	if (!triggers_init || !trigger_worker_request_add) return 0;
+	if (!triggers_init) return 0;
 
 	/*
 	 *	Use global "trigger" section if no local config is given.
@@ -334,107 +532,83 @@ int trigger_exec(REQUEST *request, CONF_SECTION const *cs, char const *name, boo
 	 */
 	if (check_config) return 0;
 
+	/*
+	 *	Copy everything the trigger needs, as the
+	 *	executor may not get to it for a while.
+	 */
+	MEM(job = talloc_zero(NULL, trigger_job_t));
+	job->name = talloc_typed_strdup(job, name);
+	job->value = value;
+	job->subcs = subcs;
+	if (args) (void) fr_pair_list_copy(job, &job->args, args);
+	if (request) {
+		if (request->packet->vps) (void) fr_pair_list_copy(job, &job->vps, request->packet->vps);
+		job->lvl = request->log.lvl;
+	} else {
+		job->lvl = fr_debug_lvl;
+	}
+
+	pthread_mutex_lock(trigger_mutex);
+
 	/*
 	 *	Perform periodic rate_limiting.
 	 */
 	if (rate_limit) {
 		trigger_last_fired_t	find, *found;
-		time_t			now = time(NULL);
+		fr_time_t		now = fr_time();
 
 		find.ci = ci;
 
-		pthread_mutex_lock(trigger_mutex);
-
 		found = rbtree_finddata(trigger_last_fired_tree, &find);
 		if (!found) {
-			MEM(found = talloc(NULL, trigger_last_fired_t));
+			MEM(found = talloc_zero(NULL, trigger_last_fired_t));
 			found->ci = ci;
-			found->last_fired = 0;
+			found->interval = trigger_rate_limit_interval(ci, subcs);
 
 			rbtree_insert(trigger_last_fired_tree, found);
-		}
-
-		pthread_mutex_unlock(trigger_mutex);
 
 		/*
-		 *	Send the rate_limited traps at most once per second.
+		 *	Fired too recently.  Replace any pending
+		 *	event with this one, so the coalesced
+		 *	event has the most recent arguments.
 		 */
-		if (found->last_fired == now) return -1;
-		found->last_fired = now;
-	}
-
-	/*
-	 *	radius_exec_program always needs a request.
-	 */
-	fake = request_alloc(NULL);
-	memcpy(&fake->server_cs, &subcs, sizeof(subcs)); /* completely wrong, but we need to use _something_ */
-
-	/*
-	 *	Add the args to the request data, so they can be picked up by the
-	 *	trigger_xlat function.
-	 */
-	if (args && (request_data_add(fake, &trigger_exec_main, REQUEST_INDEX_TRIGGER_ARGS, args,
-				      false, false, false) < 0)) {
-		talloc_free(fake);
-		return -1;
-	}
-
-	{
-		void *name_tmp;
-
-		memcpy(&name_tmp, &name, sizeof(name_tmp));
-
-		if (request_data_add(fake, &trigger_exec_main, REQUEST_INDEX_TRIGGER_NAME,
-				     name_tmp, false, false, false) < 0) {
-			talloc_free(fake);
-			return -1;
-		}
-	}
-
-	MEM(ctx = talloc_zero(fake, fr_trigger_t));
-	ctx->name = talloc_strdup(ctx, value);
-
-	if (request) {
-		if (request->packet->vps) {
-			(void) fr_pair_list_copy(ctx, &ctx->vps, request->packet->vps);
+		} else if ((now - found->last_fired) < found->interval) {
+			old = found->pending;
+			found->pending = talloc_steal(found, job);
+
+			if (found->suppressed++ == 0) {
+				fr_time_t when = found->last_fired + found->interval;
+
+				if (!trigger_executor.next_flush || (when < trigger_executor.next_flush)) {
+					trigger_executor.next_flush = when;
+					pthread_cond_signal(&trigger_executor.cond);
+				}
+			}
+			pthread_mutex_unlock(trigger_mutex);
+
+			talloc_free(old);
+			return 0;
 		}
 
-		fake->log = request->log;
-	} else {
-		fake->log.dst = talloc_zero(fake, log_dst_t);
-		fake->log.dst->func = vlog_request;
-		fake->log.dst->uctx = &default_log;
-		fake->log.lvl = fr_debug_lvl;
+		/*
+		 *	This event supersedes any pending one.
+		 */
+		trigger_job_count(job, found->suppressed + 1);
+		old = found->pending;
+		found->pending = NULL;
+		found->suppressed = 0;
+		found->last_fired = now;
 	}
 
-	slen = xlat_tokenize_argv(ctx, &ctx->xlat, ctx->name, talloc_array_length(ctx->name) - 1, NULL);
-	if (slen <= 0) {
-		char *spaces, *text;
-
-		fr_canonicalize_error(ctx, &spaces, &text, slen, fr_strerror());
-
-		cf_log_err(cp, "Syntax error");
-		cf_log_err(cp, "%s", ctx->name);
-		cf_log_err(cp, "%s^ %s", spaces, text);
-
-		talloc_free(fake);
-		talloc_free(spaces);
-		talloc_free(text);
-		return -1;
+	if (trigger_dispatch(job) < 0) {
+		talloc_free(job);
+		ret = -1;
 	}
+	pthread_mutex_unlock(trigger_mutex);
 
-	/*
-	 *	Run the trigger asynchronously.
-	 */
-	if (trigger_worker_request_add(fake, trigger_process, ctx) < 0) {
-		talloc_free(fake);
-		return -1;
-	}
+	talloc_free(old);
 
-	/*
-	 *	Otherwise the worker cleans up the fake request.
-	 */
-	return 0;
+	return ret;
 }
 
 /** Create trigger arguments to describe the server the pool connects to
@@ -52,9 +52,6 @@ bool		trigger_enabled(void);
 
 VALUE_PAIR	*trigger_args_afrom_server(TALLOC_CTX *ctx, char const *server, uint16_t port);
 
-typedef int (*fr_trigger_worker_t)(REQUEST *request, module_method_t process, void *ctx);
-extern fr_trigger_worker_t trigger_worker_request_add;
-
 #ifdef __cplusplus
 }
 #endif
@@ -38,6 +38,7 @@ typedef struct fr_trunk_s fr_trunk_t;
 #include <freeradius-devel/server/trunk.h>
 
 #include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/server/trace.h>
 #include <freeradius-devel/server/trigger.h>
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/misc.h>
@@ -111,9 +112,17 @@ struct fr_trunk_request_s {
 
 	fr_time_t		last_freed;		//!< Last time this request was freed.
 
+	fr_time_t		last_backlog;		//!< Last time this request entered the backlog.
+
+	fr_time_t		last_sent;		//!< Last time this request was sent.  Only recorded
+							///< when scaling on latency.
+
 	bool			bound_to_conn;		//!< Fail the request if there's an attempt to
 							///< re-enqueue it.
 
+	int			span;			//!< Trace span from enqueue to completion, if the
+							///< request is traced.
+
 #ifndef NDEBUG
 	fr_dlist_head_t		log;			//!< State change log.
 #endif
@@ -162,12 +171,18 @@ struct fr_trunk_connection_s {
  	 */
  	uint64_t		sent_count;		//!< The number of requests that have been sent using
  							///< this connection.
+
+	fr_time_delta_t		latency;		//!< Exponentially weighted moving average of the time
+							///< between a request being sent and completing.
  	/** @} */
 
 	/** @name Timers
 	 * @{
  	 */
   	fr_event_timer_t const	*lifetime_ev;		//!< Maximum time this connection can be open.
+
+	fr_event_timer_t const	*batch_ev;		//!< Writes are held until this fires, so that
+							///< multiple requests can be written together.
   	/** @} */
 };
 
@@ -266,9 +281,21 @@ struct fr_trunk_s {
 
 	bool			managing_connections;	//!< Whether the trunk is allowed to manage
 							///< (open/close) connections.
+
+	fr_time_t		latency_high;		//!< When latency or backlog age went above target.
+							///< 0 if it's not currently above target.
+
+	fr_time_t		latency_low;		//!< When latency went below the low watermark.
+							///< 0 if it's not currently below it.
 	/** @} */
 };
 
+static fr_table_num_sorted_t const fr_trunk_scaling_table[] = {
+	{ "latency",	FR_TRUNK_SCALING_LATENCY	},
+	{ "requests",	FR_TRUNK_SCALING_REQUESTS	}
+};
+static size_t fr_trunk_scaling_table_len = NUM_ELEMENTS(fr_trunk_scaling_table);
+
 static CONF_PARSER const fr_trunk_config_request[] = {
 	{ FR_CONF_OFFSET("per_connection_max", FR_TYPE_UINT32, fr_trunk_conf_t, max_req_per_conn), .dflt = "2000" },
 	{ FR_CONF_OFFSET("per_connection_target", FR_TYPE_UINT32, fr_trunk_conf_t, target_req_per_conn), .dflt = "1000" },
@@ -287,6 +314,7 @@ static CONF_PARSER const fr_trunk_config_connection[] = {
 CONF_PARSER const fr_trunk_config[] = {
 	{ FR_CONF_OFFSET("start", FR_TYPE_UINT16, fr_trunk_conf_t, start), .dflt = "5" },
 	{ FR_CONF_OFFSET("min", FR_TYPE_UINT16, fr_trunk_conf_t, min), .dflt = "1" },
+	{ FR_CONF_OFFSET("warm", FR_TYPE_UINT16, fr_trunk_conf_t, warm), .dflt = "0" },
 	{ FR_CONF_OFFSET("max", FR_TYPE_UINT16, fr_trunk_conf_t, max), .dflt = "5" },
 	{ FR_CONF_OFFSET("connecting", FR_TYPE_UINT16, fr_trunk_conf_t, connecting), .dflt = "2" },
 	{ FR_CONF_OFFSET("uses", FR_TYPE_UINT64, fr_trunk_conf_t, max_uses), .dflt = "0" },
@@ -297,6 +325,15 @@ CONF_PARSER const fr_trunk_config[] = {
 
 	{ FR_CONF_OFFSET("manage_interval", FR_TYPE_TIME_DELTA, fr_trunk_conf_t, manage_interval), .dflt = "0.2" },
 
+	{ FR_CONF_OFFSET("scaling", FR_TYPE_INT32, fr_trunk_conf_t, scaling),
+	  .func = cf_table_parse_int,
+	  .uctx = &(cf_table_parse_ctx_t){ .table = fr_trunk_scaling_table, .len = &fr_trunk_scaling_table_len },
+	  .dflt = "requests" },
+	{ FR_CONF_OFFSET("target_latency", FR_TYPE_TIME_DELTA, fr_trunk_conf_t, target_latency), .dflt = "0.1" },
+	{ FR_CONF_OFFSET("max_backlog_age", FR_TYPE_TIME_DELTA, fr_trunk_conf_t, max_backlog_age), .dflt = "0.05" },
+
+	{ FR_CONF_OFFSET("batch_window", FR_TYPE_TIME_DELTA, fr_trunk_conf_t, batch_window), .dflt = "0" },
+
 	{ FR_CONF_OFFSET("connection", FR_TYPE_SUBSECTION, fr_trunk_conf_t, conn_conf), .subcs = (void const *) fr_trunk_config_connection, .subcs_size = sizeof(fr_trunk_config_connection) },
 	{ FR_CONF_POINTER("request", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) fr_trunk_config_request },
 
@@ -396,6 +433,10 @@ static size_t fr_trunk_connection_events_len = NUM_ELEMENTS(fr_trunk_connection_
 	} \
 } while (0)
 
+#define SCALE_TRIGGER(_name) do { \
+	if (trunk->pub.triggers) trigger_exec(NULL, NULL, _name, true, NULL); \
+} while (0)
+
 #define CONN_STATE_TRANSITION(_new, _log) \
 do { \
 	_log("[%" PRIu64 "] Trunk connection changed state %s -> %s", \
@@ -705,6 +746,7 @@ static inline void trunk_connection_auto_full(fr_trunk_connection_t *tconn);
 static inline void trunk_connection_auto_unfull(fr_trunk_connection_t *tconn);
 static inline void trunk_connection_readable(fr_trunk_connection_t *tconn);
 static inline void trunk_connection_writable(fr_trunk_connection_t *tconn);
+static void _trunk_connection_batch_expire(fr_event_list_t *el, fr_time_t now, void *uctx);
 static void trunk_connection_event_update(fr_trunk_connection_t *tconn);
 static void trunk_connection_enter_full(fr_trunk_connection_t *tconn);
 static void trunk_connection_enter_inactive(fr_trunk_connection_t *tconn);
@@ -741,6 +783,30 @@ static int8_t _trunk_request_prioritise(void const *a, void const *b)
 	return treq_a->pub.trunk->funcs.request_prioritise(treq_a->pub.preq, treq_b->pub.preq);
 }
 
+/** Start timing a request to the backend, if the request is being traced
+ *
+ */
+static inline void trunk_request_span_start(fr_trunk_request_t *treq)
+{
+	REQUEST *request = treq->pub.request;
+
+	if (likely(!request || !request->trace) || (treq->span >= 0)) return;
+
+	treq->span = fr_trace_span_start(request, request->module ? request->module : "trunk",
+					 FR_TRACE_SPAN_CLIENT);
+}
+
+/** Stop timing a request to the backend
+ *
+ */
+static inline void trunk_request_span_end(fr_trunk_request_t *treq, bool error)
+{
+	if (likely(treq->span < 0)) return;
+
+	fr_trace_span_end(treq->pub.request, treq->span, error);
+	treq->span = -1;
+}
+
 /** Remove a request from all connection lists
  *
  * A common function used by init, fail, complete state functions to disassociate
@@ -892,13 +958,14 @@ static void trunk_request_enter_backlog(fr_trunk_request_t *treq)
 
 	REQUEST_STATE_TRANSITION(FR_TRUNK_REQUEST_STATE_BACKLOG);
 	fr_heap_insert(trunk->backlog, treq);	/* Insert into the backlog heap */
+	treq->last_backlog = fr_time();
 
 	/*
 	 *	New requests in the backlog alters the
 	 *	ratio of requests to connections, so we
 	 *	need to recalculate.
 	 */
-	trunk_requests_per_connnection(NULL, NULL, trunk, fr_time());
+	trunk_requests_per_connnection(NULL, NULL, trunk, treq->last_backlog);
 
 	/*
 	 *	To reduce latency, if there's no connections
@@ -978,6 +1045,20 @@ static void trunk_request_enter_pending(fr_trunk_request_t *treq, fr_trunk_conne
 	 */
 	if (tconn->pub.state == FR_TRUNK_CONN_ACTIVE) CONN_REORDER(tconn);
 
+	/*
+	 *	If this is the first request waiting to be written,
+	 *	hold writes on the connection until the batch window
+	 *	expires, so that requests enqueued shortly after can
+	 *	be written by the same call to request_mux.
+	 */
+	if ((trunk->conf.batch_window > 0) && !tconn->batch_ev && !tconn->partial &&
+	    (fr_heap_num_elements(tconn->pending) == 1)) {
+		if (fr_event_timer_in(tconn, trunk->el, &tconn->batch_ev,
+				      trunk->conf.batch_window, _trunk_connection_batch_expire, tconn) < 0) {
+			PERROR("Failed inserting batch timer, writing request immediately");
+		}
+	}
+
 	/*
 	 *	We have a new request, see if we need to register
 	 *	for I/O events.
@@ -1046,6 +1127,7 @@ static void trunk_request_enter_sent(fr_trunk_request_t *treq)
 	 *	Update the connection's sent stats
 	 */
 	tconn->sent_count++;
+	if (trunk->conf.scaling == FR_TRUNK_SCALING_LATENCY) treq->last_sent = fr_time();
 
 	/*
 	 *	Enforces max_uses
@@ -1256,6 +1338,23 @@ static void trunk_request_enter_complete(fr_trunk_request_t *treq)
 
 	switch (treq->pub.state) {
 	case FR_TRUNK_REQUEST_STATE_SENT:
+		/*
+		 *	Update the connection's moving average
+		 *	latency, with the same 1/8 gain TCP uses
+		 *	for its smoothed RTT.
+		 */
+		if (treq->last_sent) {
+			fr_time_delta_t sample = fr_time() - treq->last_sent;
+
+			if (!tconn->latency) {
+				tconn->latency = sample;
+			} else {
+				tconn->latency += (sample - tconn->latency) / 8;
+			}
+		}
+		trunk_request_remove_from_conn(treq);
+		break;
+
 	case FR_TRUNK_REQUEST_STATE_PENDING:
 		trunk_request_remove_from_conn(treq);
 		break;
@@ -1265,6 +1364,7 @@ static void trunk_request_enter_complete(fr_trunk_request_t *treq)
 	}
 
 	REQUEST_STATE_TRANSITION(FR_TRUNK_REQUEST_STATE_COMPLETE);
+	trunk_request_span_end(treq, false);
 	DO_REQUEST_COMPLETE(treq);
 	fr_trunk_request_free(&treq);	/* Free the request */
 }
@@ -1296,6 +1396,7 @@ static void trunk_request_enter_failed(fr_trunk_request_t *treq)
 	}
 
 	REQUEST_STATE_TRANSITION(FR_TRUNK_REQUEST_STATE_FAILED);
+	trunk_request_span_end(treq, true);
 	DO_REQUEST_FAIL(treq, prev);
 	fr_trunk_request_free(&treq);	/* Free the request */
 }
@@ -2182,6 +2283,8 @@ fr_trunk_request_t *fr_trunk_request_alloc(fr_trunk_t *trunk, REQUEST *request)
 
 	trunk->pub.req_alloc++;
 	treq->id = atomic_fetch_add_explicit(&request_counter, 1, memory_order_relaxed);
+	treq->last_sent = 0;
+	treq->span = -1;
 	/* heap_id	- initialised when treq inserted into pending */
 	/* list		- empty */
 	/* preq		- populated later */
@@ -2271,6 +2374,7 @@ fr_trunk_enqueue_t fr_trunk_request_enqueue(fr_trunk_request_t **treq_out, fr_tr
 		}
 		treq->pub.preq = preq;
 		treq->pub.rctx = rctx;
+		trunk_request_span_start(treq);
 		if (trunk->conf.always_writable) {
 			fr_connection_signals_pause(tconn->pub.conn);
 			trunk_request_enter_pending(treq, tconn);
@@ -2289,6 +2393,7 @@ fr_trunk_enqueue_t fr_trunk_request_enqueue(fr_trunk_request_t **treq_out, fr_tr
 		}
 		treq->pub.preq = preq;
 		treq->pub.rctx = rctx;
+		trunk_request_span_start(treq);
 		trunk_request_enter_backlog(treq);
 		break;
 
@@ -2597,6 +2702,23 @@ static inline void trunk_connection_auto_unfull(fr_trunk_connection_t *tconn)
 	if (!trunk_connection_is_full(tconn)) trunk_connection_enter_active(tconn);
 }
 
+/** Record a sample in a connection's histogram, and the trunk wide histogram
+ *
+ * @param[in] conn_hist		Connection histogram to update.
+ * @param[in] trunk_hist	Trunk histogram to update.
+ * @param[in] sample		to record.
+ */
+static inline void trunk_histogram_add(fr_trunk_histogram_t *conn_hist, fr_trunk_histogram_t *trunk_hist,
+				       uint64_t sample)
+{
+	uint8_t bucket = fr_high_bit_pos(sample);
+
+	if (bucket >= FR_TRUNK_HISTOGRAM_BUCKETS) bucket = FR_TRUNK_HISTOGRAM_BUCKETS - 1;
+
+	conn_hist->bucket[bucket]++;
+	trunk_hist->bucket[bucket]++;
+}
+
 /** A connection is readable.  Call the request_demux function to read pending requests
  *
  */
@@ -2612,7 +2734,8 @@ static inline void trunk_connection_readable(fr_trunk_connection_t *tconn)
  */
 static inline void trunk_connection_writable(fr_trunk_connection_t *tconn)
 {
-	fr_trunk_t *trunk = tconn->pub.trunk;
+	fr_trunk_t	*trunk = tconn->pub.trunk;
+	uint64_t	sent_count;
 
 	/*
 	 *	Call the cancel_sent function (if we have one)
@@ -2627,7 +2750,44 @@ static inline void trunk_connection_writable(fr_trunk_connection_t *tconn)
 	if (!fr_trunk_request_count_by_connection(tconn,
 						  FR_TRUNK_REQUEST_STATE_PENDING |
 						  FR_TRUNK_REQUEST_STATE_PARTIAL)) return;
+
+	/*
+	 *	Still waiting for more requests to batch
+	 */
+	if (tconn->batch_ev) return;
+
+	/*
+	 *	Don't let the connection be freed until
+	 *	we've recorded how much was written.
+	 */
+	fr_connection_signals_pause(tconn->pub.conn);
+	sent_count = tconn->sent_count;
 	DO_REQUEST_MUX(tconn);
+	trunk_histogram_add(&tconn->pub.req_per_write, &trunk->pub.req_per_write, tconn->sent_count - sent_count);
+	trunk_histogram_add(&tconn->pub.depth, &trunk->pub.depth, fr_dlist_num_elements(&tconn->sent));
+	fr_connection_signals_resume(tconn->pub.conn);
+}
+
+/** The batch window for a connection has expired, write any requests we were holding
+ *
+ */
+static void _trunk_connection_batch_expire(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	fr_trunk_t		*trunk = tconn->pub.trunk;
+
+	if (!(tconn->pub.state & (FR_TRUNK_CONN_SERVICEABLE | FR_TRUNK_CONN_FULL))) return;
+
+	DEBUG4("[%" PRIu64 "] Batch window expired with %u request(s) pending",
+	       tconn->pub.conn->id, fr_heap_num_elements(tconn->pending));
+
+	/*
+	 *	If the connection is always writable write
+	 *	the requests now, otherwise register for
+	 *	write events and wait to be signalled.
+	 */
+	if (trunk->conf.always_writable) trunk_connection_writable(tconn);
+	trunk_connection_event_update(tconn);
 }
 
 /** Update the registrations for I/O events we're interested in
@@ -2656,7 +2816,7 @@ static void trunk_connection_event_update(fr_trunk_connection_t *tconn)
 		 *	If the connection is always writable,
 		 *	then we don't care about write events.
 		 */
-		if (!trunk->conf.always_writable &&
+		if (!trunk->conf.always_writable && !tconn->batch_ev &&
 		    fr_trunk_request_count_by_connection(tconn,
 							 FR_TRUNK_REQUEST_STATE_PARTIAL |
 						       	 FR_TRUNK_REQUEST_STATE_PENDING |
@@ -3205,6 +3365,11 @@ static void _trunk_connection_on_closed(UNUSED fr_connection_t *conn,
 	 */
 	if (trunk->conf.lifetime > 0) fr_event_timer_delete(&tconn->lifetime_ev);
 
+	/*
+	 *	Remove the batch event
+	 */
+	if (trunk->conf.batch_window > 0) fr_event_timer_delete(&tconn->batch_ev);
+
 	/*
 	 *	Remove the I/O events
 	 */
@@ -3728,6 +3893,263 @@ static void trunk_rebalance(fr_trunk_t *trunk)
 	       					 FR_TRUNK_REQUEST_STATE_PENDING, 1, false));
 }
 
+/** Add a connection on behalf of the scaling policy
+ *
+ * Reactivates a draining connection if there is one, otherwise opens a new
+ * connection, provided we haven't opened one within 'open_delay'.
+ *
+ * @param[in] trunk	to add a connection to.
+ * @param[in] now	the current time.
+ */
+static void trunk_scale_up(fr_trunk_t *trunk, fr_time_t now)
+{
+	fr_trunk_connection_t *tconn;
+
+	/*
+	 *	If we've got a connection in the draining list
+	 *      move it back into the active list if we've
+	 *      been requested to add a connection back in.
+	 */
+	tconn = fr_dlist_head(&trunk->draining);
+	if (tconn) {
+		if (trunk_connection_is_full(tconn)) {
+			trunk_connection_enter_full(tconn);
+		} else {
+			trunk_connection_enter_active(tconn);
+		}
+		goto done;
+	}
+
+	/*
+	 *	Implement delay if there's no connections that
+	 *	could be immediately re-activated.
+	 */
+	if ((trunk->pub.last_open + trunk->conf.open_delay) > now) {
+		DEBUG4("Not opening connection - Need to wait %pVs before opening another connection.  "
+		       "It's been %pVs",
+		       fr_box_time_delta(trunk->conf.open_delay),
+		       fr_box_time_delta(now - trunk->pub.last_open));
+		return;
+	}
+
+	/* last_open set by trunk_connection_spawn */
+	if (trunk_connection_spawn(trunk, now) < 0) return;
+
+done:
+	trunk->pub.scale_up++;
+	SCALE_TRIGGER("pool.scale_up");
+}
+
+/** Remove a connection on behalf of the scaling policy
+ *
+ * Provided we haven't closed a connection within 'close_delay', drains
+ * an inactive connection, halts a connecting connection, or drains an
+ * active connection, in that order of preference.
+ *
+ * @param[in] trunk	to remove a connection from.
+ * @param[in] now	the current time.
+ */
+static void trunk_scale_down(fr_trunk_t *trunk, fr_time_t now)
+{
+	fr_trunk_connection_t *tconn;
+
+	if ((trunk->pub.last_closed + trunk->conf.close_delay) > now) {
+		DEBUG4("Not closing connection - Need to wait %pVs before closing another connection.  "
+		       "It's been %pVs",
+		       fr_box_time_delta(trunk->conf.close_delay),
+		       fr_box_time_delta(now - trunk->pub.last_closed));
+		return;
+	}
+
+	/*
+	 *	Inactive connections get counted in the
+	 *	set of viable connections, but are likely
+	 *	to be congested or dead, so we drain
+	 *	(and possibly eventually free) those first.
+	 */
+	if ((tconn = fr_dlist_tail(&trunk->inactive))) {
+		trunk_connection_enter_inactive_draining(tconn);
+
+	/*
+	 *	It is possible to have too may connecting
+	 *	connections when the connections are
+	 *	taking a while to open and the number
+	 *	of requests decreases.
+	 */
+	} else if ((tconn = fr_dlist_tail(&trunk->connecting))) {
+		fr_connection_signal_halt(tconn->pub.conn);	/* Also frees the tconn */
+
+	/*
+	 *	Finally if there are no "connecting"
+	 *	connections to close, and no "inactive"
+	 *	connections, start draining "active"
+	 *	connections.
+	 */
+	} else if ((tconn = fr_heap_peek_tail(trunk->active))) {
+		trunk_connection_enter_draining(tconn);
+	}
+
+	trunk->pub.last_closed = now;
+
+	if (!tconn) return;
+
+	trunk->pub.scale_down++;
+	SCALE_TRIGGER("pool.scale_down");
+}
+
+/** Update the latency and backlog age statistics for the trunk
+ *
+ * Latency is the mean of the moving averages of the connections which
+ * are carrying requests.
+ *
+ * @param[in] trunk	to update statistics for.
+ * @param[in] now	the current time.
+ */
+static void trunk_latency_update(fr_trunk_t *trunk, fr_time_t now)
+{
+	fr_trunk_connection_t	*tconn;
+	fr_trunk_request_t	*treq;
+	fr_heap_iter_t		iter;
+	fr_time_delta_t		total = 0;
+	fr_time_t		oldest = now;
+	unsigned int		count = 0;
+
+	for (tconn = fr_heap_iter_init(trunk->active, &iter);
+	     tconn;
+	     tconn = fr_heap_iter_next(trunk->active, &iter)) {
+		if (!tconn->latency) continue;
+		total += tconn->latency;
+		count++;
+	}
+
+	for (tconn = fr_dlist_head(&trunk->full);
+	     tconn;
+	     tconn = fr_dlist_next(&trunk->full, tconn)) {
+		if (!tconn->latency) continue;
+		total += tconn->latency;
+		count++;
+	}
+
+	trunk->pub.latency = count ? (total / count) : 0;
+
+	for (treq = fr_heap_iter_init(trunk->backlog, &iter);
+	     treq;
+	     treq = fr_heap_iter_next(trunk->backlog, &iter)) {
+		if (treq->last_backlog < oldest) oldest = treq->last_backlog;
+	}
+
+	trunk->pub.backlog_age = now - oldest;
+}
+
+/** Latency based scaling policy
+ *
+ * Connections are added when the average request latency goes above
+ * 'target_latency', or when a request has been waiting in the backlog
+ * for longer than 'max_backlog_age', and this has been the case for at
+ * least 'open_delay'.
+ *
+ * Connections are removed when there's no backlog, and the trunk is
+ * either idle, or its average latency has stayed below half of
+ * 'target_latency' for at least 'close_delay'.  The gap between the two
+ * thresholds stops the trunk flapping between N and N+1 connections.
+ *
+ * @param[in] trunk	to manage.
+ * @param[in] now	the current time.
+ */
+static void trunk_manage_latency(fr_trunk_t *trunk, fr_time_t now)
+{
+	uint32_t	req_count;
+	uint16_t	conn_count;
+	bool		backlog_high, latency_high, low;
+
+	trunk_requests_per_connnection(&conn_count, &req_count, trunk, now);
+	trunk_latency_update(trunk, now);
+
+	backlog_high = trunk->conf.max_backlog_age && (trunk->pub.backlog_age > trunk->conf.max_backlog_age);
+	latency_high = req_count && trunk->conf.target_latency && (trunk->pub.latency > trunk->conf.target_latency);
+	low = (fr_heap_num_elements(trunk->backlog) == 0) &&
+	      (!req_count || (trunk->conf.target_latency && (trunk->pub.latency < (trunk->conf.target_latency / 2))));
+
+	if (backlog_high || latency_high) {
+		trunk->latency_low = 0;
+		if (!trunk->latency_high) trunk->latency_high = now;
+
+		if ((trunk->conf.connecting > 0) &&
+		    (fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_CONNECTING) >= trunk->conf.connecting)) {
+			DEBUG4("Not opening connection - Too many (%u) connections in the connecting state",
+			       trunk->conf.connecting);
+			return;
+		}
+
+		if ((trunk->conf.max > 0) && (conn_count >= trunk->conf.max)) {
+			DEBUG4("Not opening connection - Have %u connections, need %u or below",
+			       conn_count, trunk->conf.max);
+			return;
+		}
+
+		/*
+		 *	Only apply hysteresis if we have at least
+		 *	one available connection.
+		 */
+		if (conn_count && ((trunk->latency_high + trunk->conf.open_delay) > now)) {
+			DEBUG4("Not opening connection - Need to be above target for %pVs.  It's been %pVs",
+			       fr_box_time_delta(trunk->conf.open_delay),
+			       fr_box_time_delta(now - trunk->latency_high));
+			return;
+		}
+
+		DEBUG4("Adding connection - Latency %pVs (target %pVs), oldest backlog entry %pVs (max %pVs)",
+		       fr_box_time_delta(trunk->pub.latency), fr_box_time_delta(trunk->conf.target_latency),
+		       fr_box_time_delta(trunk->pub.backlog_age), fr_box_time_delta(trunk->conf.max_backlog_age));
+		trunk_scale_up(trunk, now);
+		return;
+	}
+
+	/*
+	 *	No connections, but we have requests
+	 */
+	if (!conn_count) {
+		trunk->latency_high = trunk->latency_low = 0;
+		if (req_count) trunk_scale_up(trunk, now);
+		return;
+	}
+
+	if (!low) {
+		trunk->latency_high = trunk->latency_low = 0;
+		return;
+	}
+
+	trunk->latency_high = 0;
+	if (!trunk->latency_low) trunk->latency_low = now;
+
+	if ((trunk->latency_low + trunk->conf.close_delay) > now) {
+		DEBUG4("Not closing connection - Need to be below target for %pVs. It's been %pVs",
+		       fr_box_time_delta(trunk->conf.close_delay),
+		       fr_box_time_delta(now - trunk->latency_low));
+		return;
+	}
+
+	if ((trunk->conf.min > 0) && ((conn_count - 1) < trunk->conf.min)) {
+		DEBUG4("Not closing connection - Have %u connections, need %u or above",
+		       conn_count, trunk->conf.min);
+		return;
+	}
+
+	/*
+	 *	Never close the last connection while there
+	 *	are still requests outstanding.
+	 */
+	if ((conn_count == 1) && req_count) {
+		DEBUG4("Not closing connection - Would leave no connections "
+		       "and there are still %u outstanding requests", req_count);
+		return;
+	}
+
+	DEBUG4("Closing connection - Latency %pVs below %pVs", fr_box_time_delta(trunk->pub.latency),
+	       fr_box_time_delta(trunk->conf.target_latency / 2));
+	trunk_scale_down(trunk, now);
+}
+
 /** Implements the algorithm we use to manage requests per connection levels
  *
  * This is executed periodically using a timer event, and opens/closes
@@ -3766,7 +4188,64 @@ static void trunk_rebalance(fr_trunk_t *trunk)
  * - Return if closing a new connection will take us above the load target.
  * - Return if we last closed a connection within 'closed_delay'.
  * - Otherwise we move a connection to draining state.
+ *
+ * If the trunk is configured with 'scaling = latency', the decision is
+ * instead made by #trunk_manage_latency.
+ */
+/** Keep the configured number of warm connections open, or opening
+ *
+ * Runs regardless of load, so that connections lost to a backend failure
+ * or restart are replaced before the next burst of requests needs them,
+ * and those requests don't pay for connection setup.
+ *
+ * Draining connections are reactivated in preference to spawning new ones.
+ * New connections are subject to the 'connecting' throttle and to 'max'.
+ *
+ * @param[in] trunk	to top up.
+ * @param[in] now	the current time.
  */
+static void trunk_manage_warm(fr_trunk_t *trunk, fr_time_t now)
+{
+	fr_trunk_connection_t	*tconn;
+	uint16_t		warm;
+
+	if (!trunk->conf.warm) return;
+
+	warm = fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_INIT | FR_TRUNK_CONN_CONNECTING |
+						  FR_TRUNK_CONN_ACTIVE | FR_TRUNK_CONN_CLOSED |
+						  FR_TRUNK_CONN_FULL | FR_TRUNK_CONN_INACTIVE);
+	while (warm < trunk->conf.warm) {
+		tconn = fr_dlist_head(&trunk->draining);
+		if (tconn) {
+			if (trunk_connection_is_full(tconn)) {
+				trunk_connection_enter_full(tconn);
+			} else {
+				trunk_connection_enter_active(tconn);
+			}
+			warm++;
+			continue;
+		}
+
+		if ((trunk->conf.connecting > 0) &&
+		    (fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_CONNECTING) >=
+		     trunk->conf.connecting)) {
+			DEBUG4("Not opening warm connection - Too many (%u) connections in the connecting state",
+			       trunk->conf.connecting);
+			return;
+		}
+
+		if ((trunk->conf.max > 0) &&
+		    (fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_ALL) >= trunk->conf.max)) {
+			DEBUG4("Not opening warm connection - Already at max (%u) connections", trunk->conf.max);
+			return;
+		}
+
+		DEBUG3("Opening warm connection - Have %u, want %u", warm, trunk->conf.warm);
+		if (trunk_connection_spawn(trunk, now) < 0) return;
+		warm++;
+	}
+}
+
 static void trunk_manage(fr_trunk_t *trunk, fr_time_t now, char const *caller)
 {
 	fr_trunk_connection_t	*tconn = NULL;
@@ -3812,6 +4291,13 @@ static void trunk_manage(fr_trunk_t *trunk, fr_time_t now, char const *caller)
 	 */
 	if (!trunk->managing_connections) return;
 
+	trunk_manage_warm(trunk, now);
+
+	if (trunk->conf.scaling == FR_TRUNK_SCALING_LATENCY) {
+		trunk_manage_latency(trunk, now);
+		return;
+	}
+
 	/*
 	 *	We're above the target requests per connection
 	 *	spawn more connections!
@@ -3895,37 +4381,9 @@ static void trunk_manage(fr_trunk_t *trunk, fr_time_t now, char const *caller)
 			return;
 		}
 
-		/*
-		 *	If we've got a connection in the draining list
-		 *      move it back into the active list if we've
-		 *      been requested to add a connection back in.
-		 */
-		tconn = fr_dlist_head(&trunk->draining);
-		if (tconn) {
-			if (trunk_connection_is_full(tconn)) {
-				trunk_connection_enter_full(tconn);
-			} else {
-				trunk_connection_enter_active(tconn);
-			}
-			return;
-		}
-
-		/*
-		 *	Implement delay if there's no connections that
-		 *	could be immediately re-activated.
-		 */
-		if ((trunk->pub.last_open + trunk->conf.open_delay) > now) {
-			DEBUG4("Not opening connection - Need to wait %pVs before opening another connection.  "
-			       "It's been %pVs",
-			       fr_box_time_delta(trunk->conf.open_delay),
-			       fr_box_time_delta(now - trunk->pub.last_open));
-			return;
-		}
-
-		DEBUG4("Opening connection - Above target requests per connection (now %u, target %u)",
+		DEBUG4("Adding connection - Above target requests per connection (now %u, target %u)",
 		       ROUND_UP_DIV(req_count, conn_count), trunk->conf.target_req_per_conn);
-		/* last_open set by trunk_connection_spawn */
-		(void)trunk_connection_spawn(trunk, now);
+		trunk_scale_up(trunk, now);
 	}
 
 	/*
@@ -3994,46 +4452,7 @@ static void trunk_manage(fr_trunk_t *trunk, fr_time_t now, char const *caller)
 		       ROUND_UP_DIV(req_count, conn_count), trunk->conf.target_req_per_conn);
 
 	close:
-		if ((trunk->pub.last_closed + trunk->conf.close_delay) > now) {
-			DEBUG4("Not closing connection - Need to wait %pVs before closing another connection.  "
-			       "It's been %pVs",
-			       fr_box_time_delta(trunk->conf.close_delay),
-			       fr_box_time_delta(now - trunk->pub.last_closed));
-			return;
-		}
-
-		/*
-		 *	Inactive connections get counted in the
-		 *	set of viable connections, but are likely
-		 *	to be congested or dead, so we drain
-		 *	(and possibly eventually free) those first.
-		 */
-		if ((tconn = fr_dlist_tail(&trunk->inactive))) {
-			trunk_connection_enter_inactive_draining(tconn);
-
-		/*
-		 *	It is possible to have too may connecting
-		 *	connections when the connections are
-		 *	taking a while to open and the number
-		 *	of requests decreases.
-		 */
-		} else if ((tconn = fr_dlist_tail(&trunk->connecting))) {
-			fr_connection_signal_halt(tconn->pub.conn);	/* Also frees the tconn */
-
-		/*
-		 *	Finally if there are no "connecting"
-		 *	connections to close, and no "inactive"
-		 *	connections, start draining "active"
-		 *	connections.
-		 */
-		} else if ((tconn = fr_heap_peek_tail(trunk->active))) {
-			trunk_connection_enter_draining(tconn);
-		}
-
-		trunk->pub.last_closed = now;
-
-
-		return;
+		trunk_scale_down(trunk, now);
 	}
 }
 
@@ -4459,6 +4878,14 @@ fr_trunk_t *fr_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 
 	memcpy(&trunk->conf, conf, sizeof(trunk->conf));
 
+	/*
+	 *	Warm connections must not be closed by
+	 *	the scaling policy as soon as they're
+	 *	opened.
+	 */
+	if ((trunk->conf.max > 0) && (trunk->conf.warm > trunk->conf.max)) trunk->conf.warm = trunk->conf.max;
+	if (trunk->conf.warm > trunk->conf.min) trunk->conf.min = trunk->conf.warm;
+
 	memcpy(&trunk->uctx, &uctx, sizeof(trunk->uctx));
 	talloc_set_destructor(trunk, _trunk_free);
 
@@ -184,6 +184,30 @@ typedef enum {
 	FR_TRUNK_REQUEST_STATE_CANCEL_COMPLETE \
 )
 
+/** How the trunk decides when to open and close connections
+ *
+ */
+typedef enum {
+	FR_TRUNK_SCALING_REQUESTS = 0,			//!< Scale on the average number of outstanding
+							///< requests per connection.
+	FR_TRUNK_SCALING_LATENCY			//!< Scale on request latency, and the age of the
+							///< oldest request in the backlog.
+} fr_trunk_scaling_t;
+
+/** Number of buckets in a #fr_trunk_histogram_t
+ *
+ */
+#define FR_TRUNK_HISTOGRAM_BUCKETS	8
+
+/** Power of two histogram of per-write counts
+ *
+ * Bucket 0 counts samples of 0, bucket n counts samples in the range
+ * 2^(n-1) to (2^n) - 1.  The last bucket counts all larger samples.
+ */
+typedef struct {
+	uint64_t		bucket[FR_TRUNK_HISTOGRAM_BUCKETS];
+} fr_trunk_histogram_t;
+
 /** Common configuration parameters for a trunk
  *
  */
@@ -194,6 +218,10 @@ typedef struct {
 
 	uint16_t		min;			//!< Shouldn't let connections drop below this number.
 
+	uint16_t		warm;			//!< How many connections to keep open or opening at all
+							///< times, regardless of load.  Connections lost to
+							///< failures are replaced in the background.
+
 	uint16_t		max;			//!< Maximum number of connections in the trunk.
 
 	uint16_t		connecting;		//!< Maximum number of connections that can be in the
@@ -225,6 +253,23 @@ typedef struct {
 	fr_time_delta_t		manage_interval;	//!< How often we run the management algorithm to
 							///< open/close connections.
 
+	fr_trunk_scaling_t	scaling;		//!< Which policy decides when to open and close
+							///< connections.
+
+	fr_time_delta_t		target_latency;		//!< #FR_TRUNK_SCALING_LATENCY - Open connections if
+							///< the average request latency goes above this.
+							///< Close them if it stays below half of it.
+
+	fr_time_delta_t		max_backlog_age;	//!< #FR_TRUNK_SCALING_LATENCY - Open connections if
+							///< a request has been in the backlog for longer
+							///< than this.
+
+	fr_time_delta_t		batch_window;		//!< How long to hold writes on a connection after
+							///< the first request is enqueued on it, so that
+							///< requests arriving shortly after can be written
+							///< in the same call to request_mux.
+							///< Zero disables batching.
+
 	unsigned		req_pool_headers;	//!< How many chunk headers the talloc pool allocated
 							///< with the treq should contain.
 
@@ -286,6 +331,24 @@ struct fr_trunk_pub_s {
 	uint64_t _CONST		req_alloc_new;		//!< How many requests we've allocated.
 
 	uint64_t _CONST		req_alloc_reused;	//!< How many requests were reused.
+
+	fr_time_delta_t _CONST	latency;		//!< Average of the per-connection moving average
+							///< request latency, as of the last management run.
+
+	fr_time_delta_t _CONST	backlog_age;		//!< Age of the oldest request in the backlog,
+							///< as of the last management run.
+
+	uint64_t _CONST		scale_up;		//!< How many times the scaling policy added a
+							///< connection.
+
+	uint64_t _CONST		scale_down;		//!< How many times the scaling policy removed a
+							///< connection.
+
+	fr_trunk_histogram_t _CONST req_per_write;	//!< Requests sent per call to request_mux, across
+							///< all connections.
+
+	fr_trunk_histogram_t _CONST depth;		//!< Requests in flight on a connection after each
+							///< call to request_mux, across all connections.
 	/** @} */
 
 	bool _CONST		triggers;		//!< do we run the triggers?
@@ -327,6 +390,14 @@ struct fr_trunk_connection_pub_s {
 	fr_connection_t		* _CONST conn;		//!< The underlying connection.
 
 	fr_trunk_t		* _CONST trunk;		//!< Trunk this connection belongs to.
+
+	/** @name Statistics
+	 * @{
+ 	 */
+	fr_trunk_histogram_t _CONST req_per_write;	//!< Requests sent per call to request_mux.
+
+	fr_trunk_histogram_t _CONST depth;		//!< Requests in flight after each call to request_mux.
+	/** @} */
 };
 
 /** Config parser definitions to populate a fr_trunk_conf_t
@@ -0,0 +1,5 @@
+/*
+ *	The trunk_tests speed tests, sized for benchmarking.
+ */
+#define TRUNK_BENCH
+#include "trunk_tests.c"
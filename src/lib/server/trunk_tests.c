@@ -13,6 +13,7 @@ typedef struct {
 	bool			freed;			//!< Seen by the free callback.
 	bool			signal_partial;		//!< Muxer should signal that this request is partially written.
 	bool			signal_cancel_partial;	//!< Muxer should signal that this request is partially cancelled.
+	bool			ignore_response;	//!< Demuxer should drop the response, leaving the request sent.
 } test_proto_request_t;
 
 typedef struct {
@@ -122,6 +123,7 @@ static void test_demux(UNUSED fr_trunk_connection_t *tconn, fr_connection_t *con
 			break;
 
 		case FR_TRUNK_REQUEST_STATE_SENT:
+			if (preq->ignore_response) break;
 			fr_trunk_request_signal_complete(preq->treq);
 			break;
 
@@ -1372,6 +1374,54 @@ static void test_connection_start_on_enqueue(void)
 	talloc_free(preq);
 }
 
+static void test_connection_levels_warm(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_trunk_t		*trunk;
+	fr_event_list_t		*el;
+	fr_trunk_conf_t		conf = {
+					.start = 0,	/* No connections on start */
+					.min = 0,
+					.warm = 2,
+					.max = 4,
+					.close_delay = NSEC * 0.5,
+					.manage_interval = NSEC * 0.5
+				};
+
+	DEBUG_LVL_SET;
+
+	el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_event_list_set_time_func(el, test_time);
+
+	test_time_base += NSEC * 0.5;	/* Need to provide a timer starting value above zero */
+
+	trunk = test_setup_trunk(ctx, el, &conf, true, NULL);
+
+	TEST_CASE("C0 - Nothing spawned until management runs");
+	TEST_CHECK(fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_ALL) == 0);
+
+	TEST_CASE("C0 - Management should top up to warm with no requests");
+	test_time_base += NSEC * 0.5;
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+
+	TEST_CHECK(fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_CONNECTING) == 2);
+
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+
+	TEST_CHECK(fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_ACTIVE) == 2);
+
+	TEST_CASE("C2 active - Idle warm connections MUST NOT be closed");
+	test_time_base += NSEC * 2;
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+
+	TEST_CHECK(fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_ACTIVE) == 2);
+
+	talloc_free(ctx);
+}
+
 static void test_connection_rebalance_requests(void)
 {
 	TALLOC_CTX		*ctx = talloc_init_const("test");
@@ -1722,6 +1772,155 @@ static void test_connection_levels_alternating_edges(void)
 }
 
 #undef fr_time	/* Need to the real time */
+static void test_connection_levels_latency(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_trunk_t		*trunk;
+	fr_event_list_t		*el;
+	fr_trunk_conf_t		conf = {
+					.start = 0, 			/* No connections on start */
+					.min = 0,
+					.max = 3,
+					.scaling = FR_TRUNK_SCALING_LATENCY,
+					.target_latency = NSEC * 0.1,
+					.max_backlog_age = NSEC * 0.05,
+					.manage_interval = (fr_time_delta_t)NSEC * 100	/* Only run when we call trunk_manage() */
+				};
+	test_proto_request_t	*preq_a, *preq_b;
+	fr_trunk_request_t	*treq_a = NULL, *treq_b = NULL;
+
+	DEBUG_LVL_SET;
+
+	el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_event_list_set_time_func(el, test_time);
+
+	test_time_base += NSEC * 0.5;	/* Need to provide a timer starting value above zero */
+
+	trunk = test_setup_trunk(ctx, el, &conf, true, NULL);
+
+	TEST_CASE("C0, R1 - Enqueue should spawn");
+	ALLOC_REQ(a);
+	TEST_CHECK(fr_trunk_request_enqueue(&treq_a, trunk, NULL, preq_a, NULL) == FR_TRUNK_ENQUEUE_IN_BACKLOG);
+	TEST_CHECK(fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_CONNECTING) == 1);
+	TEST_CHECK(trunk->pub.scale_up == 1);
+
+	/*
+	 *	Open the connection, and send the request
+	 */
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+	TEST_CHECK(fr_trunk_request_count_by_state(trunk, FR_TRUNK_CONN_ALL, FR_TRUNK_REQUEST_STATE_SENT) == 1);
+
+	/*
+	 *	The response takes 500ms to arrive
+	 */
+	test_time_base += NSEC * 0.5;
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+	TEST_CHECK(preq_a->completed == true);
+
+	TEST_CASE("C1 active, R1, latency above target - Should spawn");
+	ALLOC_REQ(b);
+	TEST_CHECK(fr_trunk_request_enqueue(&treq_b, trunk, NULL, preq_b, NULL) == FR_TRUNK_ENQUEUE_OK);
+	trunk_manage(trunk, test_time_base, __FUNCTION__);
+	TEST_CHECK(trunk->pub.latency == NSEC * 0.5);
+	TEST_MSG("Expected latency %" PRId64 " got %" PRId64, (int64_t)(NSEC * 0.5), trunk->pub.latency);
+	TEST_CHECK(fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_CONNECTING) == 1);
+	TEST_CHECK(trunk->pub.scale_up == 2);
+
+	/*
+	 *	Open the new connection, and complete the
+	 *	outstanding request.
+	 */
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+	TEST_CHECK(preq_b->completed == true);
+
+	TEST_CASE("C2 active, R0, idle - Should close");
+	TEST_CHECK(fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_ACTIVE) == 2);
+	test_time_base += NSEC * 0.5;
+	trunk_manage(trunk, test_time_base, __FUNCTION__);
+	TEST_CHECK(trunk->pub.scale_down == 1);
+	TEST_CHECK(fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_ACTIVE) == 1);
+
+	talloc_free(trunk);
+	talloc_free(ctx);
+}
+
+static void test_enqueue_batch_window(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_trunk_t		*trunk;
+	fr_event_list_t		*el;
+	fr_trunk_conf_t		conf = {
+					.start = 1,
+					.min = 1,
+					.max = 1,
+					.batch_window = NSEC * 0.1,
+					.manage_interval = (fr_time_delta_t)NSEC * 100	/* Only run when we call trunk_manage() */
+				};
+	test_proto_request_t	*preq_a, *preq_b, *preq_c;
+	fr_trunk_request_t	*treq_a = NULL, *treq_b = NULL, *treq_c = NULL;
+
+	DEBUG_LVL_SET;
+
+	el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_event_list_set_time_func(el, test_time);
+
+	test_time_base += NSEC * 0.5;	/* Need to provide a timer starting value above zero */
+
+	trunk = test_setup_trunk(ctx, el, &conf, true, NULL);
+
+	/*
+	 *	Open the connection
+	 */
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+	TEST_CHECK(fr_trunk_connection_count_by_state(trunk, FR_TRUNK_CONN_ACTIVE) == 1);
+
+	TEST_CASE("C1, R3 - Writes should be held for the batch window");
+	ALLOC_REQ(a);
+	TEST_CHECK(fr_trunk_request_enqueue(&treq_a, trunk, NULL, preq_a, NULL) == FR_TRUNK_ENQUEUE_OK);
+	ALLOC_REQ(b);
+	TEST_CHECK(fr_trunk_request_enqueue(&treq_b, trunk, NULL, preq_b, NULL) == FR_TRUNK_ENQUEUE_OK);
+	ALLOC_REQ(c);
+	TEST_CHECK(fr_trunk_request_enqueue(&treq_c, trunk, NULL, preq_c, NULL) == FR_TRUNK_ENQUEUE_OK);
+
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+	TEST_CHECK(fr_trunk_request_count_by_state(trunk, FR_TRUNK_CONN_ALL, FR_TRUNK_REQUEST_STATE_PENDING) == 3);
+
+	TEST_CASE("C1, R3 - Batch window expired, all requests should be written together");
+	test_time_base += NSEC * 0.2;
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);		/* Batch timer fires */
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);		/* Writable */
+	TEST_CHECK(fr_trunk_request_count_by_state(trunk, FR_TRUNK_CONN_ALL, FR_TRUNK_REQUEST_STATE_SENT) == 3);
+	TEST_CHECK(trunk->pub.req_per_write.bucket[2] == 1);	/* 2-3 requests */
+	TEST_MSG("Expected one write of 2-3 requests");
+	TEST_CHECK(trunk->pub.depth.bucket[2] == 1);
+
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);		/* Readable */
+	TEST_CHECK(preq_a->completed == true);
+	TEST_CHECK(preq_b->completed == true);
+	TEST_CHECK(preq_c->completed == true);
+
+	talloc_free(trunk);
+	talloc_free(ctx);
+}
+
 static void test_enqueue_and_io_speed(void)
 {
 	TALLOC_CTX		*ctx = talloc_init_const("test");
@@ -1828,6 +2027,390 @@ static void test_enqueue_and_io_speed(void)
 	talloc_free(ctx);
 }
 
+/*
+ *	Benchmarks for the individual request state paths.
+ *
+ *	The defaults are sized to keep the unit tests quick.
+ *	trunk_bench raises them, and both can be overridden with
+ *	TRUNK_BENCH_CONNS, TRUNK_BENCH_INFLIGHT, TRUNK_BENCH_REQUESTS
+ *	and TRUNK_BENCH_LATENCY (in microseconds).
+ */
+#ifdef TRUNK_BENCH
+#  define BENCH_CONNS		4
+#  define BENCH_INFLIGHT	10000
+#  define BENCH_REQUESTS	1000000
+#  define BENCH_VERBOSE		0
+#else
+#  define BENCH_CONNS		4
+#  define BENCH_INFLIGHT	1000
+#  define BENCH_REQUESTS	10000
+#  define BENCH_VERBOSE		1
+#endif
+
+typedef struct {
+	TALLOC_CTX		*ctx;			//!< Everything for this run is allocated here.
+	fr_event_list_t		*el;
+	fr_trunk_t		*trunk;
+	fr_trunk_request_t	**treq_array;		//!< Requests currently in flight.
+	test_proto_stats_t	stats;
+
+	unsigned int		conns;			//!< Connections in the trunk.
+	unsigned int		inflight;		//!< Maximum requests enqueued at once.
+	unsigned int		requests;		//!< Requests to run through the state path.
+	fr_time_delta_t		latency;		//!< How far the clock moves on each pass of the event loop.
+} test_bench_t;
+
+static unsigned int test_bench_env(char const *name, unsigned int dflt, bool zero)
+{
+	char const	*value = getenv(name);
+	char		*end;
+	unsigned long	num;
+
+	if (!value) return dflt;
+
+	num = strtoul(value, &end, 10);
+	if (*end || (!zero && !num) || (num > UINT32_MAX)) return dflt;
+
+	return num;
+}
+
+static void test_bench_init(test_bench_t *bench, bool with_cancel_mux)
+{
+	fr_trunk_conf_t		conf = {
+					.req_pool_headers = 1,
+					.req_pool_size = sizeof(test_proto_request_t),
+					.backlog_on_failed_conn = true,
+					.manage_interval = NSEC * 0.5
+				};
+	unsigned int		i;
+
+	DEBUG_LVL_SET;
+
+	memset(bench, 0, sizeof(*bench));
+	bench->conns = test_bench_env("TRUNK_BENCH_CONNS", BENCH_CONNS, false);
+	bench->inflight = test_bench_env("TRUNK_BENCH_INFLIGHT", BENCH_INFLIGHT, false);
+	bench->requests = test_bench_env("TRUNK_BENCH_REQUESTS", BENCH_REQUESTS, false);
+	bench->latency = (fr_time_delta_t)test_bench_env("TRUNK_BENCH_LATENCY", 0, true) * 1000;
+
+	if (bench->conns > UINT16_MAX) bench->conns = UINT16_MAX;
+	if (bench->inflight > bench->requests) bench->inflight = bench->requests;
+
+	conf.start = conf.min = conf.max = bench->conns;
+
+	bench->ctx = talloc_init_const("bench");
+	bench->el = fr_event_list_alloc(bench->ctx, NULL, NULL);
+	fr_event_list_set_time_func(bench->el, test_time);
+
+	test_time_base += NSEC * 0.5;	/* Need to provide a timer starting value above zero */
+
+	bench->trunk = test_setup_trunk(bench->ctx, bench->el, &conf, with_cancel_mux, &bench->stats);
+
+	/*
+	 *	Open the connections
+	 */
+	fr_event_corral(bench->el, test_time_base, false);
+	fr_event_service(bench->el);
+
+	/*
+	 *	Fill the request free list, so we're measuring
+	 *	the steady state, not the first allocations.
+	 */
+	MEM(bench->treq_array = talloc_array(bench->ctx, fr_trunk_request_t *, bench->inflight));
+	for (i = 0; i < bench->inflight; i++) bench->treq_array[i] = fr_trunk_request_alloc(bench->trunk, NULL);
+	for (i = 0; i < bench->inflight; i++) fr_trunk_request_free(&bench->treq_array[i]);
+}
+
+/** Enqueue a batch of requests, recording them in the treq_array
+ *
+ */
+static void test_bench_enqueue(test_bench_t *bench, unsigned int count, bool ignore_response)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		fr_trunk_request_t	*treq;
+		test_proto_request_t	*preq;
+
+		treq = fr_trunk_request_alloc(bench->trunk, NULL);
+		preq = talloc_zero(treq, test_proto_request_t);
+		preq->treq = treq;
+		preq->ignore_response = ignore_response;
+		fr_trunk_request_enqueue(&treq, bench->trunk, NULL, preq, NULL);
+		bench->treq_array[i] = treq;
+	}
+}
+
+/** Run the event loop until the trunk has freed the requests
+ *
+ * The clock moves on by the configured latency with each pass, so
+ * the trunk sees responses arrive that long after they were sent.
+ */
+static void test_bench_drain(test_bench_t *bench, uint64_t freed)
+{
+	unsigned int passes = 0;
+
+	while ((bench->stats.freed < freed) && (passes++ < 1000000)) {
+		test_time_base += bench->latency;
+		if (fr_event_corral(bench->el, test_time_base, false) == 0) {
+			test_time_base += NSEC / 1000;	/* Only timers left */
+			continue;
+		}
+		fr_event_service(bench->el);
+	}
+	TEST_CHECK(bench->stats.freed == freed);
+	TEST_MSG("Expected %" PRIu64 " freed requests, got %" PRIu64, freed, bench->stats.freed);
+}
+
+/** Run the event loop until all the requests have been written
+ *
+ */
+static void test_bench_send(test_bench_t *bench, unsigned int count)
+{
+	unsigned int passes = 0;
+
+	while ((fr_trunk_request_count_by_state(bench->trunk, FR_TRUNK_CONN_ALL,
+						FR_TRUNK_REQUEST_STATE_SENT) < count) && (passes++ < 1000000)) {
+		test_time_base += bench->latency;
+		if (fr_event_corral(bench->el, test_time_base, false) == 0) continue;
+		fr_event_service(bench->el);
+	}
+}
+
+static void test_bench_report(test_bench_t *bench, char const *path,
+			      fr_time_delta_t elapsed, size_t blocks, uint64_t alloc_new)
+{
+	fr_trunk_t	*trunk = bench->trunk;	/* Used by the log prefix */
+
+	if (test_verbose_level__ < BENCH_VERBOSE) return;
+
+	if (!blocks) {
+		INFO("%-16s %8.1f ns/req (%u conns, %u in-flight, %u requests, %" PRId64 "us latency)",
+		     path, (double)elapsed / bench->requests,
+		     bench->conns, bench->inflight, bench->requests, (int64_t)(bench->latency / 1000));
+		return;
+	}
+
+	INFO("%-16s %8.1f ns/req, %5.2f blocks/req, %5.3f new treq/req "
+	     "(%u conns, %u in-flight, %u requests, %" PRId64 "us latency)",
+	     path, (double)elapsed / bench->requests,
+	     (double)blocks / bench->inflight, (double)alloc_new / bench->requests,
+	     bench->conns, bench->inflight, bench->requests, (int64_t)(bench->latency / 1000));
+}
+
+static void test_bench_free(test_bench_t *bench)
+{
+	talloc_free(bench->ctx);
+}
+
+/** PENDING -> SENT -> COMPLETE, measuring enqueue and I/O separately
+ *
+ */
+static void test_bench_complete(void)
+{
+	test_bench_t		bench;
+	unsigned int		done, count;
+	fr_time_delta_t		enqueue_time = 0, io_time = 0;
+	size_t			base, blocks = 0;
+	uint64_t		alloc_new;
+	fr_time_t		start;
+
+	test_bench_init(&bench, false);
+	alloc_new = bench.trunk->pub.req_alloc_new;
+	base = talloc_total_blocks(bench.ctx);
+
+	for (done = 0; done < bench.requests; done += count) {
+		count = bench.requests - done;
+		if (count > bench.inflight) count = bench.inflight;
+
+		start = fr_time();
+		test_bench_enqueue(&bench, count, false);
+		enqueue_time += fr_time() - start;
+
+		if (!blocks) blocks = talloc_total_blocks(bench.ctx) - base;
+
+		start = fr_time();
+		test_bench_drain(&bench, done + count);
+		io_time += fr_time() - start;
+	}
+
+	TEST_CHECK(bench.stats.completed == bench.requests);
+	TEST_CHECK(bench.stats.failed == 0);
+
+	alloc_new = bench.trunk->pub.req_alloc_new - alloc_new;
+	test_bench_report(&bench, "enqueue", enqueue_time, blocks, alloc_new);
+	test_bench_report(&bench, "mux/demux", io_time, blocks, alloc_new);
+
+	test_bench_free(&bench);
+}
+
+/** PENDING -> UNASSIGNED, cancelled before they're written
+ *
+ */
+static void test_bench_cancel_pending(void)
+{
+	test_bench_t		bench;
+	unsigned int		done, count, i;
+	fr_time_delta_t		cancel_time = 0;
+	fr_time_t		start;
+
+	test_bench_init(&bench, false);
+
+	for (done = 0; done < bench.requests; done += count) {
+		count = bench.requests - done;
+		if (count > bench.inflight) count = bench.inflight;
+
+		test_bench_enqueue(&bench, count, false);
+
+		start = fr_time();
+		for (i = 0; i < count; i++) fr_trunk_request_signal_cancel(bench.treq_array[i]);
+		cancel_time += fr_time() - start;
+	}
+
+	TEST_CHECK(bench.stats.freed == bench.requests);
+	TEST_CHECK(bench.stats.completed == 0);
+
+	test_bench_report(&bench, "cancel pending", cancel_time, 0, 0);
+
+	test_bench_free(&bench);
+}
+
+/** SENT -> CANCEL -> CANCEL_SENT -> CANCEL_COMPLETE
+ *
+ */
+static void test_bench_cancel_sent(void)
+{
+	test_bench_t		bench;
+	unsigned int		done, count, i;
+	fr_time_delta_t		cancel_time = 0;
+	fr_time_t		start;
+
+	test_bench_init(&bench, true);
+
+	for (done = 0; done < bench.requests; done += count) {
+		count = bench.requests - done;
+		if (count > bench.inflight) count = bench.inflight;
+
+		test_bench_enqueue(&bench, count, true);
+		test_bench_send(&bench, count);
+
+		start = fr_time();
+		for (i = 0; i < count; i++) fr_trunk_request_signal_cancel(bench.treq_array[i]);
+		test_bench_drain(&bench, done + count);
+		cancel_time += fr_time() - start;
+	}
+
+	TEST_CHECK(bench.stats.cancelled == bench.requests);
+	TEST_CHECK(bench.stats.completed == 0);
+
+	test_bench_report(&bench, "cancel sent", cancel_time, 0, 0);
+
+	test_bench_free(&bench);
+}
+
+/** Collect the active connections, as signalling them reorders the heap
+ *
+ */
+static unsigned int test_bench_conns(fr_trunk_connection_t **out, test_bench_t *bench)
+{
+	fr_trunk_connection_t	*tconn;
+	fr_heap_iter_t		iter;
+	unsigned int		i = 0;
+
+	for (tconn = fr_heap_iter_init(bench->trunk->active, &iter);
+	     tconn && (i < bench->conns);
+	     tconn = fr_heap_iter_next(bench->trunk->active, &iter)) out[i++] = tconn;
+
+	return i;
+}
+
+/** PENDING -> PENDING on another connection (or BACKLOG) as connections fail
+ *
+ */
+static void test_bench_requeue(void)
+{
+	test_bench_t		bench;
+	fr_trunk_connection_t	**tconns;
+	unsigned int		done, count, i, num;
+	fr_time_delta_t		requeue_time = 0;
+	fr_time_t		start;
+
+	test_bench_init(&bench, false);
+	MEM(tconns = talloc_array(bench.ctx, fr_trunk_connection_t *, bench.conns));
+
+	for (done = 0; done < bench.requests; done += count) {
+		count = bench.requests - done;
+		if (count > bench.inflight) count = bench.inflight;
+
+		test_bench_enqueue(&bench, count, false);
+		num = test_bench_conns(tconns, &bench);
+
+		start = fr_time();
+		for (i = 0; i < num; i++) fr_trunk_connection_signal_reconnect(tconns[i], FR_CONNECTION_FAILED);
+		requeue_time += fr_time() - start;
+
+		test_bench_drain(&bench, done + count);
+	}
+
+	TEST_CHECK(bench.stats.completed == bench.requests);
+
+	test_bench_report(&bench, "requeue", requeue_time, 0, 0);
+
+	test_bench_free(&bench);
+}
+
+/** PENDING -> PENDING on another connection as connections become active
+ *
+ */
+static void test_bench_rebalance(void)
+{
+	test_bench_t		bench;
+	fr_trunk_connection_t	**tconns;
+	unsigned int		done, count, i, num;
+	fr_time_delta_t		rebalance_time = 0;
+	fr_time_t		start;
+
+	test_bench_init(&bench, false);
+	MEM(tconns = talloc_array(bench.ctx, fr_trunk_connection_t *, bench.conns));
+
+	for (done = 0; done < bench.requests; done += count) {
+		count = bench.requests - done;
+		if (count > bench.inflight) count = bench.inflight;
+
+		/*
+		 *	Everything lands on the first connection...
+		 */
+		num = test_bench_conns(tconns, &bench);
+		for (i = 1; i < num; i++) fr_trunk_connection_signal_inactive(tconns[i]);
+		test_bench_enqueue(&bench, count, false);
+
+		/*
+		 *	...and is spread over the others as they
+		 *	become active again.
+		 */
+		start = fr_time();
+		for (i = 1; i < num; i++) fr_trunk_connection_signal_active(tconns[i]);
+		rebalance_time += fr_time() - start;
+
+		test_bench_drain(&bench, done + count);
+	}
+
+	TEST_CHECK(bench.stats.completed == bench.requests);
+
+	test_bench_report(&bench, "rebalance", rebalance_time, 0, 0);
+
+	test_bench_free(&bench);
+}
+
+#ifdef TRUNK_BENCH
+TEST_LIST = {
+	{ "Bench - Complete",				test_bench_complete },
+	{ "Bench - Cancel pending",			test_bench_cancel_pending },
+	{ "Bench - Cancel sent",			test_bench_cancel_sent },
+	{ "Bench - Requeue",				test_bench_requeue },
+	{ "Bench - Rebalance",				test_bench_rebalance },
+	{ NULL }
+};
+#else
 /*
  *	Connection spawning
  */
@@ -1850,6 +2433,7 @@ TEST_LIST = {
 	{ "Enqueue - Basic",				test_enqueue_basic },
 	{ "Enqueue - Cancellation points",		test_enqueue_cancellation_points },
 	{ "Enqueue - Partial state transitions",	test_partial_to_complete_states },
+	{ "Enqueue - Batch window",			test_enqueue_batch_window },
 	{ "Requeue - On reconnect",			test_requeue_on_reconnect },
 
 	/*
@@ -1863,10 +2447,18 @@ TEST_LIST = {
 	{ "Spawn - Test connection start on enqueue",	test_connection_start_on_enqueue },
 	{ "Spawn - Connection levels max",		test_connection_levels_max },
 	{ "Spawn - Connection levels alternating edges",test_connection_levels_alternating_edges },
+	{ "Spawn - Connection levels latency",		test_connection_levels_latency },
+	{ "Spawn - Connection levels warm",		test_connection_levels_warm },
 
 	/*
 	 *	Performance tests
 	 */
 	{ "Speed Test - Enqueue, and I/O",		test_enqueue_and_io_speed },
+	{ "Speed Test - Complete",			test_bench_complete },
+	{ "Speed Test - Cancel pending",		test_bench_cancel_pending },
+	{ "Speed Test - Cancel sent",			test_bench_cancel_sent },
+	{ "Speed Test - Requeue",			test_bench_requeue },
+	{ "Speed Test - Rebalance",			test_bench_rebalance },
 	{ NULL }
 };
+#endif
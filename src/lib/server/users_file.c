@@ -27,9 +27,11 @@ RCSID("$Id$")
 #include <freeradius-devel/server/log.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/users_file.h>
+#include <freeradius-devel/server/paircmp.h>
 
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/pair_legacy.h>
+#include <freeradius-devel/util/rbtree.h>
 #include <freeradius-devel/util/syserror.h>
 
 #include <sys/stat.h>
@@ -364,3 +366,418 @@ parse_again:
 	*list = pl;
 	return 0;
 }
+
+/** DEFAULT entries sharing the same indexed value
+ *
+ */
+typedef struct {
+	fr_value_box_t		value;			//!< Value to match, or the prefix as a string.
+	uint32_t		*entries;		//!< DEFAULT entry numbers, in file order.
+} pairlist_index_value_t;
+
+/** Index of DEFAULT entries by the value of a single attribute
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;			//!< Attribute compared by the indexed check items.
+	rbtree_t		*values;		//!< Entries with a '==' check item, keyed by value.
+	rbtree_t		*prefixes;		//!< Entries with a '=~ "^literal"' check item,
+							///< keyed by the literal.
+	size_t			max_prefix;		//!< Length of the longest prefix.
+} pairlist_index_t;
+
+struct pairlist_db_s {
+	rbtree_t		*users;			//!< Entries for named users, keyed by name.
+
+	PAIR_LIST		**defaults;		//!< DEFAULT entries, in file order.
+	uint32_t		num_defaults;		//!< How many DEFAULT entries there are.
+
+	size_t			words;			//!< Length of the candidate bitmaps.
+	uint64_t		*always;		//!< DEFAULT entries which couldn't be indexed, and
+							///< must always be checked.
+
+	pairlist_index_t	*index;			//!< One index per attribute.
+};
+
+#define BITMAP_SET(_map, _bit)	((_map)[(_bit) / 64] |= ((uint64_t)1 << ((_bit) % 64)))
+
+static int pairlist_name_cmp(void const *a, void const *b)
+{
+	return strcmp(((PAIR_LIST const *)a)->name, ((PAIR_LIST const *)b)->name);
+}
+
+static int pairlist_value_cmp(void const *a, void const *b)
+{
+	return fr_value_box_cmp(&((pairlist_index_value_t const *)a)->value,
+				&((pairlist_index_value_t const *)b)->value);
+}
+
+static int pairlist_prefix_cmp(void const *a, void const *b)
+{
+	fr_value_box_t const	*my_a = &((pairlist_index_value_t const *)a)->value;
+	fr_value_box_t const	*my_b = &((pairlist_index_value_t const *)b)->value;
+	int			ret;
+
+	ret = memcmp(my_a->vb_strvalue, my_b->vb_strvalue, my_a->vb_length < my_b->vb_length ?
+		     my_a->vb_length : my_b->vb_length);
+	if (ret != 0) return ret;
+
+	return (my_a->vb_length > my_b->vb_length) - (my_a->vb_length < my_b->vb_length);
+}
+
+/** Whether equality comparisons in paircmp_pairs() give the same result as fr_value_box_cmp()
+ *
+ */
+static bool pairlist_type_indexable(fr_type_t type)
+{
+	switch (type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+	case FR_TYPE_UINT8:
+	case FR_TYPE_UINT16:
+	case FR_TYPE_UINT32:
+	case FR_TYPE_UINT64:
+	case FR_TYPE_INT32:
+	case FR_TYPE_IPV4_ADDR:
+	case FR_TYPE_IPV6_ADDR:
+	case FR_TYPE_IFID:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/** Get the index for an attribute, creating it if it doesn't exist
+ *
+ */
+static pairlist_index_t *pairlist_index_get(pairlist_db_t *db, fr_dict_attr_t const *da)
+{
+	size_t			i, len = talloc_array_length(db->index);
+	pairlist_index_t	*idx;
+
+	for (i = 0; i < len; i++) if (db->index[i].da == da) return &db->index[i];
+
+	MEM(db->index = talloc_realloc(db, db->index, pairlist_index_t, len + 1));
+	idx = &db->index[len];
+	memset(idx, 0, sizeof(*idx));
+	idx->da = da;
+
+	return idx;
+}
+
+/** Record that a DEFAULT entry can only match if the request contains a value
+ *
+ */
+static void pairlist_index_insert(rbtree_t *tree, fr_value_box_t const *value, uint32_t num)
+{
+	pairlist_index_value_t	*found, find = { .value = *value };
+	size_t			len;
+
+	found = rbtree_finddata(tree, &find);
+	if (!found) {
+		MEM(found = talloc_zero(tree, pairlist_index_value_t));
+		MEM(fr_value_box_copy(found, &found->value, value) == 0);
+		MEM(found->entries = talloc_array(found, uint32_t, 0));
+		MEM(rbtree_insert(tree, found));
+	}
+
+	len = talloc_array_length(found->entries);
+	MEM(found->entries = talloc_realloc(found, found->entries, uint32_t, len + 1));
+	found->entries[len] = num;
+}
+
+/** Return the literal value of a check item, if it has one
+ *
+ * Double quoted values are marked for expansion, but if they contain
+ * nothing which would be expanded, their value is known now.
+ */
+static int pairlist_check_value(TALLOC_CTX *ctx, fr_value_box_t *out, VALUE_PAIR const *vp)
+{
+	fr_type_t type = vp->vp_type;
+
+	switch (vp->type) {
+	case VT_DATA:
+		return fr_value_box_copy(ctx, out, &vp->data);
+
+	case VT_XLAT:
+		if (strchr(vp->xlat, '%') || strchr(vp->xlat, '\\')) return -1;
+
+		return fr_value_box_from_str(ctx, out, &type, vp->da, vp->xlat, -1, '"', false);
+
+	default:
+		return -1;
+	}
+}
+
+#ifdef HAVE_REGEX
+/** Return the literal prefix matched by a regular expression, if it only matches a prefix
+ *
+ */
+static bool pairlist_check_prefix(char const **out, size_t *outlen, VALUE_PAIR const *vp)
+{
+	char const *p;
+
+	if (vp->type != VT_XLAT) return false;
+
+	p = vp->xlat;
+	if (*p++ != '^') return false;
+	if (strpbrk(p, ".[]()*+?{}|\\$^%")) return false;
+	if (!*p) return false;
+
+	*out = p;
+	*outlen = strlen(p);
+
+	return true;
+}
+#endif
+
+/** Add a DEFAULT entry to the index for one of its check items
+ *
+ * The entry can only be indexed by a check item which must match for the
+ * entry to match, and which can be matched against the request without
+ * being evaluated.
+ *
+ * @return
+ *	- true if the entry was indexed.
+ *	- false if the entry must always be checked.
+ */
+static bool pairlist_entry_index(pairlist_db_t *db, PAIR_LIST const *pl, uint32_t num)
+{
+	VALUE_PAIR		*vp;
+	pairlist_index_t	*idx;
+
+	for (vp = pl->check; vp; vp = vp->next) {
+		fr_value_box_t	value;
+
+		if (vp->op != T_OP_CMP_EQ) continue;
+		if (vp->da->flags.has_tag || !pairlist_type_indexable(vp->vp_type)) continue;
+		if (!paircmp_by_value(vp->da)) continue;
+		if (pairlist_check_value(NULL, &value, vp) < 0) continue;
+
+		idx = pairlist_index_get(db, vp->da);
+		if (!idx->values) MEM(idx->values = rbtree_create(db, pairlist_value_cmp, NULL, RBTREE_FLAG_NONE));
+		pairlist_index_insert(idx->values, &value, num);
+		fr_value_box_clear(&value);
+
+		return true;
+	}
+
+#ifdef HAVE_REGEX
+	for (vp = pl->check; vp; vp = vp->next) {
+		char const	*prefix;
+		size_t		len;
+
+		if (vp->op != T_OP_REG_EQ) continue;
+		if (vp->da->flags.has_tag || (vp->vp_type != FR_TYPE_STRING)) continue;
+		if (!paircmp_by_value(vp->da)) continue;
+		if (!pairlist_check_prefix(&prefix, &len, vp)) continue;
+
+		idx = pairlist_index_get(db, vp->da);
+		if (!idx->prefixes) MEM(idx->prefixes = rbtree_create(db, pairlist_prefix_cmp, NULL, RBTREE_FLAG_NONE));
+		pairlist_index_insert(idx->prefixes, fr_box_strvalue_len(prefix, len), num);
+		if (len > idx->max_prefix) idx->max_prefix = len;
+
+		return true;
+	}
+#endif
+
+	return false;
+}
+
+/** Compile a list of entries read by pairlist_read()
+ *
+ * Entries for named users are grouped by name.  DEFAULT entries with a
+ * '==' check item, or a regular expression which only matches a literal
+ * prefix, are indexed by the value of that check item.  Entries which
+ * can't be indexed are always checked.
+ *
+ * @param[in] ctx	to allocate the database in.
+ * @param[out] out	Where to write the database.
+ * @param[in,out] list	of entries.  The entries are reparented to the database,
+ *			and the list is set to NULL.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int pairlist_db_alloc(TALLOC_CTX *ctx, pairlist_db_t **out, PAIR_LIST **list)
+{
+	pairlist_db_t	*db;
+	PAIR_LIST	*entry, *next, *user_list;
+	uint32_t	num_defaults = 0, num_indexed = 0;
+
+	MEM(db = talloc_zero(ctx, pairlist_db_t));
+	MEM(db->users = rbtree_create(db, pairlist_name_cmp, NULL, RBTREE_FLAG_NONE));
+
+	for (entry = *list; entry; entry = entry->next) if (strcmp(entry->name, "DEFAULT") == 0) num_defaults++;
+
+	db->words = (num_defaults + 63) / 64;
+	MEM(db->defaults = talloc_array(db, PAIR_LIST *, num_defaults));
+	MEM(db->always = talloc_zero_array(db, uint64_t, db->words));
+	MEM(db->index = talloc_array(db, pairlist_index_t, 0));
+
+	for (entry = *list; entry; entry = next) {
+		next = entry->next;
+		entry->next = NULL;
+		talloc_steal(db, entry);
+
+		/*
+		 *	DEFAULT entries are checked in file order,
+		 *	skipping those the index says can't match.
+		 */
+		if (strcmp(entry->name, "DEFAULT") == 0) {
+			db->defaults[db->num_defaults] = entry;
+			if (pairlist_entry_index(db, entry, db->num_defaults)) {
+				num_indexed++;
+			} else {
+				BITMAP_SET(db->always, db->num_defaults);
+			}
+			db->num_defaults++;
+			continue;
+		}
+
+		user_list = rbtree_finddata(db->users, entry);
+		if (!user_list) {
+			if (!rbtree_insert(db->users, entry)) {
+				for (entry = next; entry; entry = entry->next) talloc_steal(db, entry);
+				talloc_free(db);
+				*list = NULL;
+				return -1;
+			}
+		} else {
+			while (user_list->next) user_list = user_list->next;
+			user_list->next = entry;
+		}
+	}
+	*list = NULL;
+
+	DEBUG2("Indexed %u of %u DEFAULT entries on %zu attribute(s)",
+	       num_indexed, num_defaults, talloc_array_length(db->index));
+
+	*out = db;
+
+	return 0;
+}
+
+/** Mark DEFAULT entries as candidates
+ *
+ */
+static inline void pairlist_db_mark(uint64_t *candidates, rbtree_t *tree, fr_value_box_t const *value)
+{
+	pairlist_index_value_t	*found, find = { .value = *value };
+	size_t			i, len;
+
+	found = rbtree_finddata(tree, &find);
+	if (!found) return;
+
+	len = talloc_array_length(found->entries);
+	for (i = 0; i < len; i++) BITMAP_SET(candidates, found->entries[i]);
+}
+
+/** Start iterating over the entries which may match a request
+ *
+ * Entries for the name, and DEFAULT entries which may match, are
+ * returned in the order they appear in the file.  The caller is
+ * still responsible for checking whether each entry matches.
+ *
+ * @param[in] ctx		to allocate temporary state in.
+ * @param[out] cursor		to initialise.  Must be freed with
+ *				#pairlist_db_cursor_free.
+ * @param[in] db		to iterate over.
+ * @param[in] name		to find entries for.
+ * @param[in] request_list	the entries will be checked against.
+ * @return
+ *	- The first entry.
+ *	- NULL if no entries may match.
+ */
+PAIR_LIST const *pairlist_db_cursor_init(TALLOC_CTX *ctx, pairlist_db_cursor_t *cursor, pairlist_db_t const *db,
+					 char const *name, VALUE_PAIR *request_list)
+{
+	PAIR_LIST	find = { .name = name };
+	size_t		i, len;
+
+	memset(cursor, 0, sizeof(*cursor));
+	cursor->db = db;
+	cursor->user = rbtree_finddata(db->users, &find);
+
+	if (!db->num_defaults) return pairlist_db_cursor_next(cursor);
+
+	MEM(cursor->candidates = talloc_memdup(ctx, db->always, db->words * sizeof(uint64_t)));
+
+	len = talloc_array_length(db->index);
+	for (i = 0; i < len; i++) {
+		pairlist_index_t const	*idx = &db->index[i];
+		VALUE_PAIR		*vp;
+
+		/*
+		 *	paircmp() checks every instance of the
+		 *	attribute, so any of them may match.
+		 */
+		for (vp = request_list; vp; vp = vp->next) {
+			if (vp->da != idx->da) continue;
+
+			if (idx->values) pairlist_db_mark(cursor->candidates, idx->values, &vp->data);
+
+			if (idx->prefixes) {
+				size_t j, max;
+
+				max = vp->vp_length < idx->max_prefix ? vp->vp_length : idx->max_prefix;
+				for (j = 1; j <= max; j++) {
+					pairlist_db_mark(cursor->candidates, idx->prefixes,
+							 fr_box_strvalue_len(vp->vp_strvalue, j));
+				}
+			}
+		}
+	}
+
+	return pairlist_db_cursor_next(cursor);
+}
+
+/** Return the next entry which may match a request
+ *
+ * @param[in] cursor	to advance.
+ * @return
+ *	- The next entry.
+ *	- NULL if there are no more entries.
+ */
+PAIR_LIST const *pairlist_db_cursor_next(pairlist_db_cursor_t *cursor)
+{
+	pairlist_db_t const	*db = cursor->db;
+	PAIR_LIST const		*user = cursor->user, *def = NULL;
+
+	/*
+	 *	Skip to the next candidate DEFAULT entry
+	 */
+	while (cursor->def < db->num_defaults) {
+		uint64_t word = cursor->candidates[cursor->def / 64] >> (cursor->def % 64);
+
+		if (!word) {
+			cursor->def = ((cursor->def / 64) + 1) * 64;
+			continue;
+		}
+
+		while (!(word & 1)) {
+			word >>= 1;
+			cursor->def++;
+		}
+		def = db->defaults[cursor->def];
+		break;
+	}
+
+	if (user && (!def || (user->order < def->order))) {
+		cursor->user = user->next;
+		return user;
+	}
+
+	if (def) cursor->def++;
+
+	return def;
+}
+
+/** Free any temporary state associated with a cursor
+ *
+ */
+void pairlist_db_cursor_free(pairlist_db_cursor_t *cursor)
+{
+	TALLOC_FREE(cursor->candidates);
+}
@@ -43,10 +43,37 @@ typedef struct pair_list {
 	struct pair_list	*next;
 } PAIR_LIST;
 
+/** Compiled form of a users file
+ *
+ * Entries are indexed by name.  DEFAULT entries are additionally indexed
+ * by the value of one of their check items, so that entries which cannot
+ * match a request are skipped without being evaluated.
+ */
+typedef struct pairlist_db_s pairlist_db_t;
+
+/** Iterates over the entries which may match a request, in file order
+ *
+ */
+typedef struct {
+	pairlist_db_t const	*db;			//!< Database we're iterating over.
+	PAIR_LIST const		*user;			//!< Next entry matching the name.
+	uint32_t		def;			//!< Next DEFAULT entry to check.
+	uint64_t		*candidates;		//!< Bitmap of DEFAULT entries which may match.
+} pairlist_db_cursor_t;
+
 /* users_file.c */
 int		pairlist_read(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *file, PAIR_LIST **list, int complain);
 void		pairlist_free(PAIR_LIST **);
 
+int		pairlist_db_alloc(TALLOC_CTX *ctx, pairlist_db_t **out, PAIR_LIST **list);
+
+PAIR_LIST const	*pairlist_db_cursor_init(TALLOC_CTX *ctx, pairlist_db_cursor_t *cursor, pairlist_db_t const *db,
+					 char const *name, VALUE_PAIR *request_list);
+
+PAIR_LIST const	*pairlist_db_cursor_next(pairlist_db_cursor_t *cursor);
+
+void		pairlist_db_cursor_free(pairlist_db_cursor_t *cursor);
+
 #ifdef __cplusplus
 }
 #endif
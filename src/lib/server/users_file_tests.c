@@ -0,0 +1,325 @@
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/conf.h>
+
+#include "users_file.c"
+
+#ifndef TEST_DICT_DIR
+#  define TEST_DICT_DIR "share/dictionary"
+#endif
+
+static TALLOC_CTX	*test_ctx;
+static fr_dict_t	*test_dict_internal;
+static fr_dict_t	*test_dict_radius;
+
+static void test_init(void)
+{
+	if (test_ctx) return;
+
+	test_ctx = talloc_autofree_context();
+
+	if (!fr_dict_global_ctx_init(test_ctx, TEST_DICT_DIR) ||
+	    (fr_dict_internal_afrom_file(&test_dict_internal, FR_DICTIONARY_INTERNAL_DIR) < 0) ||
+	    (fr_dict_protocol_afrom_file(&test_dict_radius, "radius", NULL) < 0)) {
+		fr_perror("users_file_tests");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/** Append an entry to a list, as pairlist_read() would
+ *
+ * The entry number is used as both the order, and the line number.
+ */
+static void test_entry_add(TALLOC_CTX *ctx, PAIR_LIST ***tail, int *num, char const *name, char const *check)
+{
+	PAIR_LIST	*pl;
+
+	MEM(pl = talloc_zero(ctx, PAIR_LIST));
+	pl->name = talloc_typed_strdup(pl, name);
+	pl->order = pl->lineno = (*num)++;
+	if (check) TEST_CHECK(fr_pair_list_afrom_str(pl, test_dict_radius, check, &pl->check) == T_EOL);
+
+	**tail = pl;
+	*tail = &pl->next;
+}
+
+/** Check the cursor returns the expected entries, in order
+ *
+ */
+static void test_cursor_check(pairlist_db_t *db, char const *name, VALUE_PAIR *request_list,
+			      int const *expected, size_t expected_len)
+{
+	pairlist_db_cursor_t	cursor;
+	PAIR_LIST const		*pl;
+	size_t			i = 0;
+
+	for (pl = pairlist_db_cursor_init(NULL, &cursor, db, name, request_list);
+	     pl;
+	     pl = pairlist_db_cursor_next(&cursor), i++) {
+		if (!TEST_CHECK(i < expected_len)) break;
+		TEST_CHECK(pl->lineno == expected[i]);
+		TEST_MSG("Entry %zu - Expected %i, got %i", i, expected[i], pl->lineno);
+	}
+	pairlist_db_cursor_free(&cursor);
+
+	TEST_CHECK(i == expected_len);
+	TEST_MSG("Expected %zu entries, got %zu", expected_len, i);
+}
+
+static void test_index_equality(void)
+{
+	TALLOC_CTX	*ctx;
+	PAIR_LIST	*list = NULL, **tail = &list;
+	int		num = 0;
+	pairlist_db_t	*db;
+	VALUE_PAIR	*request_list = NULL;
+
+	test_init();
+	ctx = talloc_init_const("test");
+
+	test_entry_add(ctx, &tail, &num, "DEFAULT", "NAS-IP-Address == 192.0.2.1");		/* 0 */
+	test_entry_add(ctx, &tail, &num, "bob", NULL);						/* 1 */
+	test_entry_add(ctx, &tail, &num, "DEFAULT", "NAS-IP-Address == 192.0.2.2");		/* 2 */
+	test_entry_add(ctx, &tail, &num, "DEFAULT", "Service-Type == Framed-User");		/* 3 */
+	test_entry_add(ctx, &tail, &num, "DEFAULT", "Called-Station-Id != 'foo'");		/* 4 */
+	test_entry_add(ctx, &tail, &num, "alice", NULL);					/* 5 */
+	test_entry_add(ctx, &tail, &num, "bob", NULL);						/* 6 */
+	test_entry_add(ctx, &tail, &num, "DEFAULT", "Calling-Station-Id == \"00-11\"");		/* 7 */
+	test_entry_add(ctx, &tail, &num, "DEFAULT",
+		       "NAS-IP-Address == 192.0.2.1, Service-Type == Login-User");			/* 8 */
+
+	TEST_CASE("Compile");
+	TEST_CHECK(pairlist_db_alloc(ctx, &db, &list) == 0);
+	TEST_CHECK(list == NULL);
+	TEST_CHECK(db->num_defaults == 6);
+	TEST_CHECK(talloc_array_length(db->index) == 3);
+
+	TEST_CASE("Named user, and matching DEFAULT entries in file order");
+	TEST_CHECK(fr_pair_list_afrom_str(ctx, test_dict_radius,
+					  "NAS-IP-Address = 192.0.2.1, Calling-Station-Id = '00-11'",
+					  &request_list) == T_EOL);
+	{
+		int const expected[] = { 0, 1, 4, 6, 7, 8 };
+
+		test_cursor_check(db, "bob", request_list, expected, NUM_ELEMENTS(expected));
+	}
+	fr_pair_list_free(&request_list);
+
+	TEST_CASE("Any instance of an attribute may match");
+	TEST_CHECK(fr_pair_list_afrom_str(ctx, test_dict_radius,
+					  "NAS-IP-Address = 192.0.2.1, NAS-IP-Address = 192.0.2.2, Service-Type = Framed-User",
+					  &request_list) == T_EOL);
+	{
+		int const expected[] = { 0, 2, 3, 4, 5, 8 };
+
+		test_cursor_check(db, "alice", request_list, expected, NUM_ELEMENTS(expected));
+	}
+	fr_pair_list_free(&request_list);
+
+	TEST_CASE("Unknown user, only unindexed DEFAULT entries");
+	{
+		int const expected[] = { 4 };
+
+		test_cursor_check(db, "eve", NULL, expected, NUM_ELEMENTS(expected));
+	}
+
+	talloc_free(ctx);
+}
+
+#ifdef HAVE_REGEX
+static void test_index_prefix(void)
+{
+	TALLOC_CTX	*ctx;
+	PAIR_LIST	*list = NULL, **tail = &list;
+	int		num = 0;
+	pairlist_db_t	*db;
+	VALUE_PAIR	*request_list = NULL;
+
+	test_init();
+	ctx = talloc_init_const("test");
+
+	test_entry_add(ctx, &tail, &num, "DEFAULT", "Called-Station-Id =~ \"^00-11\"");		/* 0 */
+	test_entry_add(ctx, &tail, &num, "DEFAULT", "Called-Station-Id =~ \"^00-22\"");		/* 1 */
+	test_entry_add(ctx, &tail, &num, "DEFAULT", "Called-Station-Id =~ \"^00-11-22\"");	/* 2 */
+	test_entry_add(ctx, &tail, &num, "DEFAULT", "Called-Station-Id =~ \"^00.11\"");		/* 3 */
+	test_entry_add(ctx, &tail, &num, "DEFAULT", "Called-Station-Id =~ \"00-11$\"");		/* 4 */
+
+	TEST_CASE("Compile");
+	TEST_CHECK(pairlist_db_alloc(ctx, &db, &list) == 0);
+	TEST_CHECK(db->num_defaults == 5);
+
+	TEST_CASE("Prefixes of the value match, and unindexed regexes are always checked");
+	TEST_CHECK(fr_pair_list_afrom_str(ctx, test_dict_radius, "Called-Station-Id = '00-11-22-33'",
+					  &request_list) == T_EOL);
+	{
+		int const expected[] = { 0, 2, 3, 4 };
+
+		test_cursor_check(db, "DEFAULT", request_list, expected, NUM_ELEMENTS(expected));
+	}
+
+	talloc_free(ctx);
+}
+#endif
+
+static void test_parse(void)
+{
+	TALLOC_CTX	*ctx;
+	VALUE_PAIR	*list = NULL, *vp;
+	fr_cursor_t	cursor;
+
+	test_init();
+	ctx = talloc_init_const("test");
+
+	TEST_CASE("Bare words, tags and operators");
+	TEST_CHECK(fr_pair_list_afrom_str(ctx, test_dict_radius,
+					  "User-Name = bob,Session-Timeout:=3600 , Tunnel-Type:3 = VLAN, "
+					  "NAS-Port-Id !* ANY, Framed-IP-Address == 192.0.2.1 # comment",
+					  &list) == T_EOL);
+	vp = fr_cursor_init(&cursor, &list);
+	TEST_CHECK(vp && (vp->op == T_OP_EQ) && (strcmp(vp->vp_strvalue, "bob") == 0));
+	vp = fr_cursor_next(&cursor);
+	TEST_CHECK(vp && (vp->op == T_OP_SET) && (vp->vp_uint32 == 3600));
+	vp = fr_cursor_next(&cursor);
+	TEST_CHECK(vp && (vp->tag == 3) && (vp->vp_uint32 == 13));
+	vp = fr_cursor_next(&cursor);
+	TEST_CHECK(vp && (vp->op == T_OP_CMP_FALSE));
+	vp = fr_cursor_next(&cursor);
+	TEST_CHECK(vp && (vp->op == T_OP_CMP_EQ) && (vp->vp_ipv4addr == htonl(0xc0000201)));
+	TEST_CHECK(fr_cursor_next(&cursor) == NULL);
+	fr_pair_list_free(&list);
+
+	TEST_CASE("Quoted strings, and xlats");
+	TEST_CHECK(fr_pair_list_afrom_str(ctx, test_dict_radius,
+					  "Reply-Message = 'a, b', Filter-Id = \"%{User-Name}\"", &list) == T_EOL);
+	vp = fr_cursor_init(&cursor, &list);
+	TEST_CHECK(vp && (strcmp(vp->vp_strvalue, "a, b") == 0));
+	vp = fr_cursor_next(&cursor);
+	TEST_CHECK(vp && (vp->type == VT_XLAT));
+	fr_pair_list_free(&list);
+
+	TEST_CASE("Unknown attributes, and errors");
+	TEST_CHECK(fr_pair_list_afrom_str(ctx, test_dict_radius, "Attr-26.9.1 = 0x01", &list) == T_EOL);
+	TEST_CHECK(list && list->da->flags.is_unknown);
+	fr_pair_list_free(&list);
+	TEST_CHECK(fr_pair_list_afrom_str(ctx, test_dict_radius, "Session-Timeout = bob", &list) == T_INVALID);
+	TEST_CHECK(fr_pair_list_afrom_str(ctx, test_dict_radius, "Tunnel-Type:99 = VLAN", &list) == T_INVALID);
+	TEST_CHECK(fr_pair_list_afrom_str(ctx, test_dict_radius, "User-Name = bob Reply-Message = x", &list) == T_INVALID);
+	TEST_CHECK(list == NULL);
+
+	talloc_free(ctx);
+}
+
+static void test_parse_speed(void)
+{
+	TALLOC_CTX	*ctx;
+	VALUE_PAIR	*list = NULL;
+	char		buffer[256];
+	int		i, lines = 100000;
+	size_t		blocks = 0;
+	fr_time_t	start, stop;
+
+	test_init();
+	ctx = talloc_init_const("test");
+
+	start = fr_time();
+	for (i = 0; i < lines; i++) {
+		snprintf(buffer, sizeof(buffer),
+			 "User-Name = user%i, NAS-IP-Address = 10.0.%i.%i, NAS-Port = %i, "
+			 "Called-Station-Id = \"00-11-22-33-44-55\", Service-Type = Framed-User",
+			 i, (i / 256) % 256, i % 256, i);
+		if (!TEST_CHECK(fr_pair_list_afrom_str(ctx, test_dict_radius, buffer, &list) == T_EOL)) break;
+
+		blocks += talloc_total_blocks(ctx) - 1;
+		fr_pair_list_free(&list);
+	}
+	stop = fr_time();
+
+	if (test_verbose_level__ >= 1) {
+		INFO("%i lines in %pV, %.2f ns and %.2f allocations per line",
+		     lines, fr_box_time_delta(stop - start),
+		     (double)(stop - start) / lines, (double)blocks / lines);
+	}
+
+	talloc_free(ctx);
+}
+
+static void test_index_speed(void)
+{
+	TALLOC_CTX		*ctx;
+	PAIR_LIST		*list = NULL, **tail = &list;
+	int			num = 0;
+	pairlist_db_t		*db;
+	VALUE_PAIR		*request_list = NULL;
+	char			buffer[256];
+	int			i;
+	int			users = 30000, lookups = 100000;
+	uint64_t		checked = 0;
+	fr_time_t		start, stop;
+	pairlist_db_cursor_t	cursor;
+	PAIR_LIST const		*pl;
+
+	test_init();
+	ctx = talloc_init_const("test");
+
+	/*
+	 *	One DEFAULT matching on NAS-IP-Address and one
+	 *	matching on a Called-Station-Id prefix for every
+	 *	60 users.
+	 */
+	for (i = 0; i < users; i++) {
+		snprintf(buffer, sizeof(buffer), "user%i", i);
+		test_entry_add(ctx, &tail, &num, buffer, NULL);
+
+		if ((i % 60) != 0) continue;
+
+		snprintf(buffer, sizeof(buffer), "NAS-IP-Address == 10.0.%i.%i", (i / 256) % 256, i % 256);
+		test_entry_add(ctx, &tail, &num, "DEFAULT", buffer);
+
+		snprintf(buffer, sizeof(buffer), "Called-Station-Id =~ \"^00-%02x\"", i % 256);
+		test_entry_add(ctx, &tail, &num, "DEFAULT", buffer);
+	}
+
+	TEST_CHECK(pairlist_db_alloc(ctx, &db, &list) == 0);
+	TEST_CHECK(fr_pair_list_afrom_str(ctx, test_dict_radius,
+					  "NAS-IP-Address = 10.0.0.60, Called-Station-Id = '00-3c-00-00-00-00'",
+					  &request_list) == T_EOL);
+
+	start = fr_time();
+	for (i = 0; i < lookups; i++) {
+		snprintf(buffer, sizeof(buffer), "user%i", i % users);
+
+		for (pl = pairlist_db_cursor_init(ctx, &cursor, db, buffer, request_list);
+		     pl;
+		     pl = pairlist_db_cursor_next(&cursor)) checked++;
+		pairlist_db_cursor_free(&cursor);
+	}
+	stop = fr_time();
+
+	if (test_verbose_level__ >= 1) {
+		INFO("%i users, %u DEFAULT entries", users, db->num_defaults);
+		INFO("%i lookups in %pV, %.2f entries checked per lookup (previously %u)",
+		     lookups, fr_box_time_delta(stop - start), (double)checked / lookups, db->num_defaults + 1);
+	}
+
+	/*
+	 *	The user, one NAS-IP-Address match, and every
+	 *	Called-Station-Id prefix match.
+	 */
+	TEST_CHECK(checked < ((uint64_t)lookups * 16));
+
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "Parse",			test_parse },
+	{ "Index - Equality",		test_index_equality },
+#ifdef HAVE_REGEX
+	{ "Index - Prefix",		test_index_prefix },
+#endif
+
+	/*
+	 *	Performance tests
+	 */
+	{ "Speed Test - Parse",		test_parse_speed },
+	{ "Speed Test - Lookup",	test_index_speed },
+	{ NULL }
+};
@@ -0,0 +1,9 @@
+TARGET		:= users_file_tests
+
+SOURCES		:= users_file_tests.c
+
+TGT_LDLIBS	:= $(LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-unlang.a
+SRC_CFLAGS	+= -DTEST_DICT_DIR=\"$(top_srcdir)/share/dictionary\"
@@ -90,6 +90,18 @@ static CONF_SECTION *virtual_server_root;
 
 static rbtree_t *listen_addr_root = NULL;
 
+/** How long it took to compile a section
+ *
+ */
+typedef struct {
+	CONF_SECTION const	*cs;			//!< Section which was compiled.
+	fr_time_delta_t		compile_time;		//!< Time taken by unlang_compile().
+} virtual_server_compile_time_t;
+
+/** Compile times for sections, reported and freed by virtual_servers_instantiate()
+ */
+static virtual_server_compile_time_t *compile_times = NULL;
+
 /** Lookup allowed section names for modules
  */
 static rbtree_t *server_section_name_tree = NULL;
@@ -493,6 +505,68 @@ bool listen_record(fr_listen_t *li)
 }
 
 
+static void virtual_server_compile_time_add(CONF_SECTION const *cs, fr_time_t start)
+{
+	size_t num = talloc_array_length(compile_times);
+
+	MEM(compile_times = talloc_realloc(NULL, compile_times, virtual_server_compile_time_t, num + 1));
+	compile_times[num].cs = cs;
+	compile_times[num].compile_time = fr_time() - start;
+}
+
+static int _compile_time_cmp(void const *a, void const *b)
+{
+	virtual_server_compile_time_t const *ct_a = a, *ct_b = b;
+
+	return (ct_a->compile_time < ct_b->compile_time) - (ct_a->compile_time > ct_b->compile_time);
+}
+
+/** Report how long each section took to compile
+ *
+ * Printed in debug mode, and written to the file specified by
+ * `startup_report`, if set.  Slowest sections are listed first.
+ *
+ * @param[in] elapsed	wall clock time taken to instantiate all virtual servers.
+ */
+static void virtual_servers_compile_report(fr_time_delta_t elapsed)
+{
+	FILE	*fp = main_config->startup_report_fp;
+	size_t	i, num = talloc_array_length(compile_times);
+
+	if (!fp && !DEBUG_ENABLED) goto finish;
+
+	if (num) qsort(compile_times, num, sizeof(*compile_times), _compile_time_cmp);
+
+	DEBUG("#### Policy compile times ####");
+	for (i = 0; i < num; i++) {
+		CONF_SECTION const	*cs = compile_times[i].cs;
+		CONF_SECTION const	*server_cs;
+		char const		*server, *name2;
+
+		for (server_cs = cf_item_to_section(cf_parent(cs));
+		     server_cs && (strcmp(cf_section_name1(server_cs), "server") != 0);
+		     server_cs = cf_item_to_section(cf_parent(server_cs)));
+		server = server_cs ? cf_section_name2(server_cs) : "";
+		name2 = cf_section_name2(cs);
+		if (!name2) name2 = "";
+
+		DEBUG("  %-24s %s %-32s %8.3fms", server, cf_section_name1(cs), name2,
+		      (double)fr_time_delta_to_usec(compile_times[i].compile_time) / 1000);
+
+		if (fp) fprintf(fp, "section\t%s\t%s %s\t%" PRId64 "\n", server, cf_section_name1(cs), name2,
+				fr_time_delta_to_usec(compile_times[i].compile_time));
+	}
+	DEBUG("  Compiled %zu sections in %.3fms", num, (double)fr_time_delta_to_usec(elapsed) / 1000);
+
+	if (fp) {
+		fprintf(fp, "phase\tcompile\t%" PRId64 "\n", fr_time_delta_to_usec(elapsed));
+		fflush(fp);
+	}
+
+finish:
+	TALLOC_FREE(compile_times);
+}
+
 /** Instantiate all the virtual servers
  *
  * @return
@@ -503,6 +577,7 @@ int virtual_servers_instantiate(void)
 {
 	size_t		i, server_cnt = virtual_servers ? talloc_array_length(virtual_servers) : 0;
 	rbtree_t	*vns_tree = cf_data_value(cf_data_find(virtual_server_root, rbtree_t, "vns_tree"));
+	fr_time_t	start = fr_time();
 
 	fr_assert(virtual_servers);
 
@@ -618,6 +693,8 @@ int virtual_servers_instantiate(void)
 		}
 	}
 
+	virtual_servers_compile_report(fr_time() - start);
+
 	return 0;
 }
 
@@ -1267,6 +1344,7 @@ int virtual_server_compile_sections(CONF_SECTION *server, virtual_server_compile
 	for (i = 0; list[i].name != NULL; i++) {
 		int rcode;
 		CONF_SECTION *bad;
+		fr_time_t start;
 
 		/*
 		 *	We are looking for a specific subsection.
@@ -1294,8 +1372,10 @@ int virtual_server_compile_sections(CONF_SECTION *server, virtual_server_compile
 				return -1;
 			}
 
+			start = fr_time();
 			rcode = unlang_compile(subcs, list[i].component, rules, &instruction);
 			if (rcode < 0) return -1;
+			if (rcode == 0) virtual_server_compile_time_add(subcs, start);
 
 			/*
 			 *	Cache the CONF_SECTION which was found.
@@ -1332,8 +1412,10 @@ int virtual_server_compile_sections(CONF_SECTION *server, virtual_server_compile
 			bad = cf_section_find_next(server, subcs, list[i].name, name2);
 			if (bad) goto forbidden;
 
+			start = fr_time();
 			rcode = unlang_compile(subcs, list[i].component, rules, NULL);
 			if (rcode < 0) return -1;
+			if (rcode == 0) virtual_server_compile_time_add(subcs, start);
 
 			/*
 			 *	Note that we don't store the
@@ -396,6 +396,96 @@ int milenage_gsm_generate(uint8_t sres[MILENAGE_SRES_SIZE],
 	return 0;
 }
 
+/** Generate multiple GSM-Milenage (3GPP TS 55.205) authentication triplets for a subscriber
+ *
+ * Produces the same output as calling #milenage_gsm_generate for each RAND,
+ * but the key schedule is only computed once, and the blocks for all the
+ * vectors in a batch are passed to the cipher together, so implementations
+ * using AES-NI or similar can process them in parallel.
+ *
+ * @param[out] sres	Array of num buffers for SRES.
+ * @param[out] kc	Array of num buffers for Kc.
+ * @param[in] opc	128-bit operator variant algorithm configuration field (encr.).
+ * @param[in] ki	128-bit subscriber key.
+ * @param[in] rand	Array of num 128-bit random challenges.
+ * @param[in] num	Number of triplets to generate.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int milenage_gsm_generate_batch(uint8_t sres[][MILENAGE_SRES_SIZE], uint8_t kc[][MILENAGE_KC_SIZE],
+				uint8_t const opc[MILENAGE_OPC_SIZE],
+				uint8_t const ki[MILENAGE_KI_SIZE],
+				uint8_t const rand[][MILENAGE_RAND_SIZE], size_t num)
+{
+	uint8_t		temp[MILENAGE_BATCH_SIZE][16];
+	uint8_t		in[MILENAGE_BATCH_SIZE * 3][16], out[MILENAGE_BATCH_SIZE * 3][16];
+	EVP_CIPHER_CTX	*evp_ctx;
+	size_t		done, batch, i;
+	int		j, len;
+
+	evp_ctx = EVP_CIPHER_CTX_new();
+	if (!evp_ctx) {
+		tls_strerror_printf("Failed allocating EVP context");
+		return -1;
+	}
+
+	if (unlikely(EVP_EncryptInit_ex(evp_ctx, EVP_aes_128_ecb(), NULL, ki, NULL) != 1)) {
+		tls_strerror_printf("Failed initialising AES-128-ECB context");
+	error:
+		EVP_CIPHER_CTX_free(evp_ctx);
+		return -1;
+	}
+	EVP_CIPHER_CTX_set_padding(evp_ctx, 0);
+
+	for (done = 0; done < num; done += batch) {
+		batch = num - done;
+		if (batch > MILENAGE_BATCH_SIZE) batch = MILENAGE_BATCH_SIZE;
+
+		/* TEMP = E_K(RAND XOR OP_C) */
+		for (i = 0; i < batch; i++) {
+			for (j = 0; j < 16; j++) in[i][j] = rand[done + i][j] ^ opc[j];
+		}
+		if (unlikely(EVP_EncryptUpdate(evp_ctx, temp[0], &len, in[0], batch * 16) != 1)) {
+		encrypt_error:
+			tls_strerror_printf("Failed encrypting data");
+			goto error;
+		}
+
+		/*
+		 *	Inputs for f2, f3 and f4, see milenage_f2345
+		 */
+		for (i = 0; i < batch; i++) {
+			uint8_t	*f2 = in[i * 3], *f3 = in[(i * 3) + 1], *f4 = in[(i * 3) + 2];
+
+			for (j = 0; j < 16; j++) {
+				f2[j] = temp[i][j] ^ opc[j];
+				f3[(j + 12) % 16] = temp[i][j] ^ opc[j];
+				f4[(j + 8) % 16] = temp[i][j] ^ opc[j];
+			}
+			f2[15] ^= 1;
+			f3[15] ^= 2;
+			f4[15] ^= 4;
+		}
+		if (unlikely(EVP_EncryptUpdate(evp_ctx, out[0], &len, in[0], batch * 3 * 16) != 1)) goto encrypt_error;
+
+		for (i = 0; i < batch; i++) {
+			uint8_t	*res = out[i * 3] + 8, *ck = out[(i * 3) + 1], *ik = out[(i * 3) + 2];
+
+			for (j = 0; j < 16; j++) {
+				out[i * 3][j] ^= opc[j];
+				ck[j] ^= opc[j];
+				ik[j] ^= opc[j];
+			}
+
+			milenage_gsm_from_umts(sres[done + i], kc[done + i], ik, ck, res);
+		}
+	}
+	EVP_CIPHER_CTX_free(evp_ctx);
+
+	return 0;
+}
+
 /** Milenage check
  *
  * @param[out] ik	Buffer for IK = 128-bit integrity key (f4), or NULL.
@@ -635,9 +725,33 @@ void test_set_19(void)
 	TEST_CHECK(memcmp(ak_resync, ak_resync, sizeof(ak_resync_out)) == 0);
 }
 
+void test_gsm_batch(void)
+{
+	uint8_t ki[]		= { 0x46, 0x5b, 0x5c, 0xe8, 0xb1, 0x99, 0xb4, 0x9f,
+				    0xaa, 0x5f, 0x0a, 0x2e, 0xe2, 0x38, 0xa6, 0xbc };
+	uint8_t opc[]		= { 0xcd, 0x63, 0xcb, 0x71, 0x95, 0x4a, 0x9f, 0x4e,
+				    0x48, 0xa5, 0x99, 0x4e, 0x37, 0xa0, 0x2b, 0xaf };
+	uint8_t rand[MILENAGE_BATCH_SIZE + 3][MILENAGE_RAND_SIZE];
+	uint8_t sres[MILENAGE_BATCH_SIZE + 3][MILENAGE_SRES_SIZE], kc[MILENAGE_BATCH_SIZE + 3][MILENAGE_KC_SIZE];
+	uint8_t sres_out[MILENAGE_SRES_SIZE], kc_out[MILENAGE_KC_SIZE];
+	size_t	i;
+
+	for (i = 0; i < sizeof(rand); i++) rand[i / MILENAGE_RAND_SIZE][i % MILENAGE_RAND_SIZE] = i * 7;
+
+	TEST_CHECK(milenage_gsm_generate_batch(sres, kc, opc, ki, rand, NUM_ELEMENTS(rand)) == 0);
+
+	for (i = 0; i < NUM_ELEMENTS(rand); i++) {
+		TEST_CASE("Batch matches single");
+		TEST_CHECK(milenage_gsm_generate(sres_out, kc_out, opc, ki, rand[i]) == 0);
+		TEST_CHECK(memcmp(sres_out, sres[i], sizeof(sres_out)) == 0);
+		TEST_CHECK(memcmp(kc_out, kc[i], sizeof(kc_out)) == 0);
+	}
+}
+
 TEST_LIST = {
 	{ "test_set_1",		test_set_1 },
 	{ "test_set_19",	test_set_19 },
+	{ "test_gsm_batch",	test_gsm_batch },
 	{ NULL }
 };
 #endif
@@ -46,6 +46,9 @@
 #define MILENAGE_SRES_SIZE	4
 #define MILENAGE_KC_SIZE	8
 
+#define MILENAGE_BATCH_SIZE	8		//!< Triplets generated per cipher call by
+						///< milenage_gsm_generate_batch().
+
 int	milenage_opc_generate(uint8_t opc[MILENAGE_OPC_SIZE],
 			      uint8_t const op[MILENAGE_OP_SIZE],
 			      uint8_t const ki[MILENAGE_KI_SIZE]);
@@ -78,6 +81,11 @@ int	milenage_gsm_generate(uint8_t sres[MILENAGE_SRES_SIZE], uint8_t kc[MILENAGE_
 			      uint8_t const ki[MILENAGE_KI_SIZE],
 			      uint8_t const rand[MILENAGE_RAND_SIZE]);
 
+int	milenage_gsm_generate_batch(uint8_t sres[][MILENAGE_SRES_SIZE], uint8_t kc[][MILENAGE_KC_SIZE],
+				    uint8_t const opc[MILENAGE_OPC_SIZE],
+				    uint8_t const ki[MILENAGE_KI_SIZE],
+				    uint8_t const rand[][MILENAGE_RAND_SIZE], size_t num);
+
 int	milenage_check(uint8_t ik[MILENAGE_IK_SIZE],
 		       uint8_t ck[MILENAGE_CK_SIZE],
 		       uint8_t res[MILENAGE_RES_SIZE],
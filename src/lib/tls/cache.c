@@ -31,12 +31,231 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/unlang/base.h>
 
+#include <pthread.h>
+
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#endif
+
 #include "base.h"
 #include "missing.h"
 #include "attrs.h"
 
+/** Number of independently locked partitions in the in-memory cache
+ *
+ * Workers looking up different sessions will usually hit different
+ * stripes, so contend far less than with a single lock.
+ */
+#define FR_TLS_CACHE_STRIPES		32
+
+/** An entry in the in-memory cache
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the stripe's LRU list.
+	uint8_t			*id;			//!< Session ID, or ticket ID.
+	size_t			id_len;			//!< Length of the ID.
+	uint8_t			*blob;			//!< Serialised session.  Zero length for tickets, where
+							///< the entry only records authentication completed.
+	time_t			expires;		//!< When the entry can no longer be used.
+} fr_tls_cache_entry_t;
+
+/** One partition of the in-memory cache
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;			//!< Protects everything below.
+	fr_hash_table_t		*ht;			//!< Entries by ID.  Entries are allocated in its ctx.
+	fr_dlist_head_t		lru;			//!< Most recently used at the head.
+	uint32_t		max_entries;		//!< Maximum number of entries in this stripe.
+} fr_tls_cache_stripe_t;
+
+struct fr_tls_cache_store_s {
+	fr_tls_cache_stripe_t	stripe[FR_TLS_CACHE_STRIPES];
+};
+
+static uint32_t cache_entry_hash(void const *data)
+{
+	fr_tls_cache_entry_t const *entry = data;
+
+	return fr_hash(entry->id, entry->id_len);
+}
+
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	fr_tls_cache_entry_t const *a = one, *b = two;
+
+	if (a->id_len < b->id_len) return -1;
+	if (a->id_len > b->id_len) return +1;
+
+	return memcmp(a->id, b->id, a->id_len);
+}
+
+static void cache_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int _cache_store_free(fr_tls_cache_store_t *store)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_ELEMENTS(store->stripe); i++) pthread_mutex_destroy(&store->stripe[i].mutex);
+
+	return 0;
+}
+
+/** Allocate the in-memory session cache
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_entries	Maximum number of sessions to hold.  The least recently used sessions
+ *				are evicted to make room for new ones.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+fr_tls_cache_store_t *fr_tls_cache_store_alloc(TALLOC_CTX *ctx, uint32_t max_entries)
+{
+	fr_tls_cache_store_t	*store;
+	size_t			i;
+
+	MEM(store = talloc_zero(ctx, fr_tls_cache_store_t));
+
+	for (i = 0; i < NUM_ELEMENTS(store->stripe); i++) {
+		fr_tls_cache_stripe_t *stripe = &store->stripe[i];
+
+		stripe->ht = fr_hash_table_create(store, cache_entry_hash, cache_entry_cmp, cache_entry_free);
+		if (!stripe->ht) {
+			talloc_free(store);
+			return NULL;
+		}
+		fr_dlist_init(&stripe->lru, fr_tls_cache_entry_t, entry);
+		stripe->max_entries = (max_entries + (FR_TLS_CACHE_STRIPES - 1)) / FR_TLS_CACHE_STRIPES;
+		pthread_mutex_init(&stripe->mutex, NULL);
+	}
+	talloc_set_destructor(store, _cache_store_free);
+
+	return store;
+}
+
+static inline fr_tls_cache_stripe_t *cache_store_stripe(fr_tls_cache_store_t *store, uint8_t const *id, size_t id_len)
+{
+	return &store->stripe[fr_hash(id, id_len) % FR_TLS_CACHE_STRIPES];
+}
+
+/** Remove an entry from a stripe and free it
+ *
+ * @note Must be called with the stripe locked.
+ */
+static inline void cache_stripe_entry_free(fr_tls_cache_stripe_t *stripe, fr_tls_cache_entry_t *entry)
+{
+	fr_dlist_remove(&stripe->lru, entry);
+	fr_hash_table_delete(stripe->ht, entry);
+}
+
+/** Add a session to the in-memory cache, replacing any existing entry with the same ID
+ *
+ * @param[in] store	to add the session to.
+ * @param[in] id	of the session.
+ * @param[in] id_len	Length of the ID.
+ * @param[in] blob	Serialised session.
+ * @param[in] blob_len	Length of the serialised session.
+ * @param[in] lifetime	How long the session may be resumed for.
+ */
+static void cache_store_insert(fr_tls_cache_store_t *store, uint8_t const *id, size_t id_len,
+			       uint8_t const *blob, size_t blob_len, time_t lifetime)
+{
+	fr_tls_cache_stripe_t	*stripe = cache_store_stripe(store, id, id_len);
+	fr_tls_cache_entry_t	find = { .id_len = id_len };
+	fr_tls_cache_entry_t	*entry;
+
+	memcpy(&find.id, &id, sizeof(find.id));	/* const issues */
+
+	pthread_mutex_lock(&stripe->mutex);
+	entry = fr_hash_table_finddata(stripe->ht, &find);
+	if (entry) cache_stripe_entry_free(stripe, entry);
+
+	while (fr_dlist_num_elements(&stripe->lru) >= stripe->max_entries) {
+		cache_stripe_entry_free(stripe, fr_dlist_tail(&stripe->lru));
+	}
+
+	MEM(entry = talloc_zero(stripe->ht, fr_tls_cache_entry_t));
+	MEM(entry->id = talloc_memdup(entry, id, id_len));
+	entry->id_len = id_len;
+	MEM(entry->blob = talloc_array(entry, uint8_t, blob_len));
+	if (blob_len) memcpy(entry->blob, blob, blob_len);
+	entry->expires = time(NULL) + lifetime;
+
+	if (!fr_hash_table_insert(stripe->ht, entry)) {
+		talloc_free(entry);
+	} else {
+		fr_dlist_insert_head(&stripe->lru, entry);
+	}
+	pthread_mutex_unlock(&stripe->mutex);
+}
+
+/** Find a session in the in-memory cache
+ *
+ * @param[in] ctx	to allocate the copy of the serialised session in.
+ * @param[in] store	to search.
+ * @param[in] id	of the session.
+ * @param[in] id_len	Length of the ID.
+ * @return
+ *	- A copy of the serialised session.  May be zero length.
+ *	- NULL if no unexpired session was found.
+ */
+static uint8_t *cache_store_find(TALLOC_CTX *ctx, fr_tls_cache_store_t *store, uint8_t const *id, size_t id_len)
+{
+	fr_tls_cache_stripe_t	*stripe = cache_store_stripe(store, id, id_len);
+	fr_tls_cache_entry_t	find = { .id_len = id_len };
+	fr_tls_cache_entry_t	*entry;
+	uint8_t			*blob = NULL;
+
+	memcpy(&find.id, &id, sizeof(find.id));	/* const issues */
+
+	pthread_mutex_lock(&stripe->mutex);
+	entry = fr_hash_table_finddata(stripe->ht, &find);
+	if (entry) {
+		if (entry->expires <= time(NULL)) {
+			cache_stripe_entry_free(stripe, entry);
+		} else {
+			fr_dlist_remove(&stripe->lru, entry);
+			fr_dlist_insert_head(&stripe->lru, entry);
+			MEM(blob = talloc_array(ctx, uint8_t, talloc_array_length(entry->blob)));
+			memcpy(blob, entry->blob, talloc_array_length(entry->blob));
+		}
+	}
+	pthread_mutex_unlock(&stripe->mutex);
+
+	return blob;
+}
+
+/** Remove a session from the in-memory cache
+ *
+ * @param[in] store	to remove the session from.
+ * @param[in] id	of the session.
+ * @param[in] id_len	Length of the ID.
+ */
+static void cache_store_remove(fr_tls_cache_store_t *store, uint8_t const *id, size_t id_len)
+{
+	fr_tls_cache_stripe_t	*stripe = cache_store_stripe(store, id, id_len);
+	fr_tls_cache_entry_t	find = { .id_len = id_len };
+	fr_tls_cache_entry_t	*entry;
+
+	memcpy(&find.id, &id, sizeof(find.id));	/* const issues */
+
+	pthread_mutex_lock(&stripe->mutex);
+	entry = fr_hash_table_finddata(stripe->ht, &find);
+	if (entry) cache_stripe_entry_free(stripe, entry);
+	pthread_mutex_unlock(&stripe->mutex);
+}
+
 /** Add attributes identifying the TLS session to be acted upon, and the action to be performed
  *
  * Adds the following attributes to the request:
@@ -239,10 +458,16 @@ static int fr_tls_cache_serialize(SSL *ssl, SSL_SESSION *sess)
 	}
 	tls_session->session_blob = data;
 
+	/*
+	 *	So fr_tls_cache_delete can find the tls_session
+	 *	if resumption is later denied.
+	 */
+	SSL_SESSION_set_ex_data(sess, FR_TLS_EX_INDEX_TLS_SESSION, tls_session);
+
 	return 0;
 }
 
-/** Call the specified virtual server to write session data to the cache
+/** Write session data to the in-memory cache, and call the specified virtual server to write it
  *
  * @note Should be called after all authentication methods have completed.
  *
@@ -253,6 +478,9 @@ static int fr_tls_cache_serialize(SSL *ssl, SSL_SESSION *sess)
  * progress, the supplicant could resume the session (and get access) even if phase2
  * never completed.
  *
+ * For the same reason, when the client was issued a session ticket, we write an empty
+ * entry keyed by the ticket ID.  The ticket is only accepted if that entry exists.
+ *
  * @param[in] request		The current request.
  * @param[in] tls_session	to write to the cache.
  * @return
@@ -265,16 +493,34 @@ int fr_tls_cache_write(REQUEST *request, fr_tls_session_t *tls_session)
 	fr_tls_conf_t	*conf;
 	int		ret = 0;
 	VALUE_PAIR	*vp;
+	uint8_t const	*id, *blob;
+	size_t		id_len, blob_len;
 
 	conf = SSL_get_ex_data(tls_session->ssl, FR_TLS_EX_INDEX_CONF);
 
-	if (!tls_session->session_blob || !tls_session->session_id) {
+	if (tls_session->ticket_id) {
+		id = tls_session->ticket_id;
+		id_len = talloc_array_length(tls_session->ticket_id);
+		blob = (uint8_t const *)"";
+		blob_len = 0;
+	} else if (!tls_session->session_blob || !tls_session->session_id) {
 		RDEBUG2("No session data available to cache");
 		return 1;
+	} else {
+		id = tls_session->session_id;
+		id_len = talloc_array_length(tls_session->session_id);
+		blob = tls_session->session_blob;
+		blob_len = talloc_array_length(tls_session->session_blob);
+	}
+
+	if (conf->session_cache_store) {
+		RDEBUG2("Writing %s to the in-memory cache", tls_session->ticket_id ? "ticket ID" : "session");
+		cache_store_insert(conf->session_cache_store, id, id_len, blob, blob_len, conf->session_cache_lifetime);
 	}
 
-	if (fr_tls_cache_session_id_to_vp(request, tls_session->session_id,
-				       talloc_array_length(tls_session->session_id)) < 0) {
+	if (!conf->session_cache.store) return 0;
+
+	if (fr_tls_cache_session_id_to_vp(request, id, id_len) < 0) {
 		RWDEBUG("Failed adding session key to the request");
 		return -1;
 	}
@@ -283,7 +529,7 @@ int fr_tls_cache_write(REQUEST *request, fr_tls_session_t *tls_session)
 	 *	Put the SSL data into an attribute.
 	 */
 	MEM(vp = fr_pair_afrom_da(request->state_ctx, attr_tls_session_data));
-	fr_pair_value_memcpy(vp, tls_session->session_blob, talloc_array_length(tls_session->session_blob), false);
+	fr_pair_value_memcpy(vp, blob, blob_len, false);
 	RINDENT();
 	RDEBUG2("&session-state:%pP", vp);
 	REXDENT();
@@ -311,7 +557,10 @@ int fr_tls_cache_write(REQUEST *request, fr_tls_session_t *tls_session)
 	return ret;
 }
 
-/** Read session data from the cache
+/** Read session data from the in-memory cache, or the virtual server
+ *
+ * Sessions read from the virtual server are added to the in-memory cache,
+ * so other workers resuming the same session don't need to call it again.
  *
  * @param[in] ssl session state.
  * @param[in] key to retrieve session data for.
@@ -335,47 +584,75 @@ static SSL_SESSION *fr_tls_cache_read(SSL *ssl,
 	REQUEST			*request;
 	unsigned char const	**p;
 	uint8_t const		*q;
-	VALUE_PAIR		*vp;
-	SSL_SESSION		*sess;
+	VALUE_PAIR		*vp = NULL;
+	SSL_SESSION		*sess = NULL;
+	uint8_t			*blob = NULL;
+	size_t			len;
 
 	request = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
 	conf = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
 
-	if (fr_tls_cache_session_id_to_vp(request, key, key_len) < 0) {
-		RWDEBUG("Failed adding session key to the request");
-		return NULL;
+	*copy = 0;
+
+	if (conf->session_cache_store) {
+		blob = cache_store_find(request, conf->session_cache_store, key, key_len);
+		if (blob) RDEBUG2("Found session in the in-memory cache");
 	}
 
-	*copy = 0;
+	if (!blob) {
+		if (!conf->session_cache.load) {
+			RDEBUG2("No cached session found");
+			return NULL;
+		}
 
-	/*
-	 *	Call the virtual server to read the session
-	 */
-	switch (fr_tls_cache_process(request, conf->session_cache.load)) {
-	case RLM_MODULE_OK:
-	case RLM_MODULE_UPDATED:
-		break;
+		if (fr_tls_cache_session_id_to_vp(request, key, key_len) < 0) {
+			RWDEBUG("Failed adding session key to the request");
+			return NULL;
+		}
 
-	default:
-		RWDEBUG("Failed acquiring session data");
-		return NULL;
-	}
+		/*
+		 *	Call the virtual server to read the session
+		 */
+		switch (fr_tls_cache_process(request, conf->session_cache.load)) {
+		case RLM_MODULE_OK:
+		case RLM_MODULE_UPDATED:
+			break;
+
+		default:
+			RWDEBUG("Failed acquiring session data");
+			return NULL;
+		}
 
-	vp = fr_pair_find_by_da(request->state, attr_tls_session_data, TAG_ANY);
-	if (!vp) {
-		RWDEBUG("No cached session found");
-		return NULL;
+		vp = fr_pair_find_by_da(request->state, attr_tls_session_data, TAG_ANY);
+		if (!vp) {
+			RWDEBUG("No cached session found");
+			return NULL;
+		}
 	}
 
-	q = vp->vp_octets;	/* openssl will mutate q, so we can't use vp_octets directly */
+	if (blob) {
+		q = blob;		/* openssl will mutate q, so we can't use blob directly */
+		len = talloc_array_length(blob);
+	} else {
+		q = vp->vp_octets;	/* openssl will mutate q, so we can't use vp_octets directly */
+		len = vp->vp_length;
+	}
 	p = (unsigned char const **)&q;
 
-	sess = d2i_SSL_SESSION(NULL, p, vp->vp_length);
+	sess = d2i_SSL_SESSION(NULL, p, len);
 	if (!sess) {
 		RWDEBUG("Failed loading persisted session: %s", ERR_error_string(ERR_get_error(), NULL));
-		return NULL;
+		goto finish;
+	}
+	RDEBUG3("Read %zu bytes of session data.  Session deserialized successfully", len);
+
+	if (vp && conf->session_cache_store) {
+		time_t remaining;
+
+		remaining = (SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess)) - time(NULL);
+		if (remaining > 0) cache_store_insert(conf->session_cache_store, key, key_len,
+						      vp->vp_octets, vp->vp_length, remaining);
 	}
-	RDEBUG3("Read %zu bytes of session data.  Session deserialized successfully", vp->vp_length);
 
 	/*
 	 *	OpenSSL's API is very inconsistent.
@@ -404,6 +681,9 @@ static SSL_SESSION *fr_tls_cache_read(SSL *ssl,
 		SSL_SESSION_set_timeout(sess, 0);
 	}
 
+finish:
+	talloc_free(blob);
+
 	/*
 	 *	Ensure that the session data can't be used by anyone else.
 	 */
@@ -412,7 +692,7 @@ static SSL_SESSION *fr_tls_cache_read(SSL *ssl,
 	return sess;
 }
 
-/** Delete session data from the cache
+/** Delete session data from the in-memory cache, and the virtual server
  *
  * @param[in] ctx Current ssl context.
  * @param[in] sess to be deleted.
@@ -443,6 +723,26 @@ static void fr_tls_cache_delete(SSL_CTX *ctx, SSL_SESSION *sess)
 		return;
 	}
 
+	if (conf->session_cache_store) cache_store_remove(conf->session_cache_store, key, (size_t)key_len);
+
+	/*
+	 *	Stop the ticket being used to resume the session
+	 */
+	if (tls_session->ticket_id) {
+		size_t ticket_id_len = talloc_array_length(tls_session->ticket_id);
+
+		if (conf->session_cache_store) cache_store_remove(conf->session_cache_store,
+								  tls_session->ticket_id, ticket_id_len);
+
+		if (conf->session_cache.clear &&
+		    (fr_tls_cache_session_id_to_vp(request, tls_session->ticket_id, ticket_id_len) == 0)) {
+			(void)fr_tls_cache_process(request, conf->session_cache.clear);
+		}
+		TALLOC_FREE(tls_session->ticket_id);
+	}
+
+	if (!conf->session_cache.clear) return;
+
 	if (fr_tls_cache_session_id_to_vp(request, key, (size_t)key_len) < 0) {
 		RWDEBUG("Failed adding session key to the request");
 		goto error;
@@ -549,16 +849,292 @@ int fr_tls_cache_disable_cb(SSL *ssl,
 	return 0;
 }
 
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+/** Derive the ticket keys for a rotation period
+ *
+ * Every server sharing the ticket secret derives the same keys for the
+ * same period, so tickets issued by one can be decrypted by any other,
+ * without the keys ever needing to be distributed.
+ *
+ * @param[out] name	Identifies the keys in the ticket.
+ * @param[out] aes_key	Encrypts the ticket.
+ * @param[out] mac_key	Authenticates the ticket.
+ * @param[in] conf	holding the ticket secret.
+ * @param[in] epoch	The rotation period, i.e. the current time divided by the rotation interval.
+ */
+static void cache_ticket_keys(uint8_t name[16], uint8_t aes_key[32], uint8_t mac_key[32],
+			      fr_tls_conf_t const *conf, uint64_t epoch)
+{
+	uint8_t		in[9], out[SHA256_DIGEST_LENGTH];
+	unsigned int	out_len;
+	size_t		i;
+
+	for (i = 0; i < 8; i++) in[i + 1] = (epoch >> (56 - (i * 8))) & 0xff;
+
+	in[0] = 'n';
+	HMAC(EVP_sha256(), conf->session_ticket_key, sizeof(conf->session_ticket_key), in, sizeof(in), out, &out_len);
+	memcpy(name, out, 16);
+
+	in[0] = 'e';
+	HMAC(EVP_sha256(), conf->session_ticket_key, sizeof(conf->session_ticket_key), in, sizeof(in), aes_key, &out_len);
+
+	in[0] = 'm';
+	HMAC(EVP_sha256(), conf->session_ticket_key, sizeof(conf->session_ticket_key), in, sizeof(in), mac_key, &out_len);
+}
+
+/** Encrypt or decrypt a session ticket using the keys for the current rotation period
+ *
+ * Tickets encrypted with the keys of the previous period (or the next, to allow for
+ * clock skew between servers) are accepted, but the client is issued with a new one.
+ *
+ * @return
+ *	- 2 the ticket was decrypted and should be renewed.
+ *	- 1 the ticket was encrypted, or decrypted.
+ *	- 0 the ticket keys are unknown, perform a full handshake.
+ *	- -1 on error.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int fr_tls_cache_ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+				      EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *mac_ctx, int enc)
+#else
+static int fr_tls_cache_ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+				      EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *mac_ctx, int enc)
+#endif
+{
+	fr_tls_conf_t	*conf;
+	uint8_t		name[16], aes_key[32], mac_key[32];
+	uint64_t	now;
+	int		i, ret = 0;
+
+	conf = talloc_get_type_abort(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)), fr_tls_conf_t);
+	now = (uint64_t)time(NULL) / conf->session_ticket_rotation;
+
+	if (enc) {
+		cache_ticket_keys(name, aes_key, mac_key, conf, now);
+		memcpy(key_name, name, sizeof(name));
+
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) return -1;
+		if (EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, aes_key, iv) != 1) return -1;
+		ret = 1;
+	} else {
+		static int const offset[] = { 0, -1, +1 };
+
+		for (i = 0; i < (int)NUM_ELEMENTS(offset); i++) {
+			cache_ticket_keys(name, aes_key, mac_key, conf, now + offset[i]);
+			if (memcmp(key_name, name, sizeof(name)) != 0) continue;
+
+			if (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, aes_key, iv) != 1) return -1;
+			ret = (offset[i] == 0) ? 1 : 2;
+			break;
+		}
+		if (ret == 0) return 0;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	{
+		OSSL_PARAM params[3];
+
+		params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, mac_key, sizeof(mac_key));
+		params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+		params[2] = OSSL_PARAM_construct_end();
+		if (EVP_MAC_CTX_set_params(mac_ctx, params) != 1) return -1;
+	}
+#else
+	if (HMAC_Init_ex(mac_ctx, mac_key, sizeof(mac_key), EVP_sha256(), NULL) != 1) return -1;
+#endif
+
+	return ret;
+}
+
+/** Add a ticket ID to a session ticket before it's issued
+ *
+ * The ticket ID identifies the entry fr_tls_cache_write creates once
+ * authentication has completed.
+ *
+ * @param[in] ssl	session state.
+ * @param[in] arg	unused.
+ * @return
+ *	- 1 on success.
+ *	- 0 on failure, which aborts the handshake.
+ */
+static int fr_tls_cache_ticket_gen(SSL *ssl, UNUSED void *arg)
+{
+	fr_tls_session_t	*tls_session;
+	SSL_SESSION		*sess;
+	void			*data;
+	size_t			len;
+
+	tls_session = talloc_get_type_abort(SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_TLS_SESSION), fr_tls_session_t);
+	sess = SSL_get_session(ssl);
+	if (!sess) return 0;
+
+	/*
+	 *	Resumed sessions keep their existing ticket ID
+	 */
+	if (!tls_session->ticket_id &&
+	    (SSL_SESSION_get0_ticket_appdata(sess, &data, &len) == 1) && data && (len > 0)) {
+		MEM(tls_session->ticket_id = talloc_memdup(tls_session, data, len));
+	}
+
+	if (!tls_session->ticket_id) {
+		MEM(tls_session->ticket_id = talloc_array(tls_session, uint8_t, SSL_MAX_SSL_SESSION_ID_LENGTH));
+		if (RAND_bytes(tls_session->ticket_id, SSL_MAX_SSL_SESSION_ID_LENGTH) != 1) {
+			TALLOC_FREE(tls_session->ticket_id);
+			return 0;
+		}
+	}
+
+	SSL_SESSION_set_ex_data(sess, FR_TLS_EX_INDEX_TLS_SESSION, tls_session);
+
+	return SSL_SESSION_set1_ticket_appdata(sess, tls_session->ticket_id,
+					       talloc_array_length(tls_session->ticket_id));
+}
+
+/** Decide whether a decrypted session ticket can be used to resume a session
+ *
+ * Tickets are issued during the handshake, before any inner authentication
+ * has run, so a ticket is only accepted if fr_tls_cache_write recorded that
+ * the session it was issued for completed authentication.
+ *
+ * @param[in] ssl		session state.
+ * @param[in] sess		decrypted from the ticket.
+ * @param[in] keyname		unused.
+ * @param[in] keyname_len	unused.
+ * @param[in] status		of ticket decryption.
+ * @param[in] arg		unused.
+ * @return what OpenSSL should do with the ticket.
+ */
+static SSL_TICKET_RETURN fr_tls_cache_ticket_dec(SSL *ssl, SSL_SESSION *sess,
+						 UNUSED unsigned char const *keyname, UNUSED size_t keyname_len,
+						 SSL_TICKET_STATUS status, UNUSED void *arg)
+{
+	fr_tls_conf_t		*conf;
+	fr_tls_session_t	*tls_session;
+	REQUEST			*request;
+	void			*data;
+	size_t			len;
+	bool			found = false;
+
+	switch (status) {
+	case SSL_TICKET_EMPTY:
+	case SSL_TICKET_NO_DECRYPT:
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+
+	case SSL_TICKET_SUCCESS:
+	case SSL_TICKET_SUCCESS_RENEW:
+		break;
+
+	default:
+		return SSL_TICKET_RETURN_ABORT;
+	}
+
+	request = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
+	conf = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
+	tls_session = talloc_get_type_abort(SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_TLS_SESSION), fr_tls_session_t);
+
+	if ((SSL_SESSION_get0_ticket_appdata(sess, &data, &len) != 1) || !data || (len == 0)) {
+		RDEBUG2("Session ticket has no ticket ID, performing full handshake");
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+	}
+
+	if (conf->session_cache_store) {
+		uint8_t *blob;
+
+		blob = cache_store_find(request, conf->session_cache_store, data, len);
+		if (blob) {
+			RDEBUG2("Found ticket ID in the in-memory cache");
+			found = true;
+			talloc_free(blob);
+		}
+	}
+
+	if (!found && conf->session_cache.load && (fr_tls_cache_session_id_to_vp(request, data, len) == 0)) {
+		switch (fr_tls_cache_process(request, conf->session_cache.load)) {
+		case RLM_MODULE_OK:
+		case RLM_MODULE_UPDATED:
+			found = (fr_pair_find_by_da(request->state, attr_tls_session_data, TAG_ANY) != NULL);
+			break;
+
+		default:
+			break;
+		}
+		fr_pair_delete_by_da(&request->state, attr_tls_session_data);
+	}
+
+	if (!found) {
+		RDEBUG2("Session ticket was not issued to an authenticated session, or has expired, "
+			"performing full handshake");
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+	}
+
+	TALLOC_FREE(tls_session->ticket_id);
+	MEM(tls_session->ticket_id = talloc_memdup(tls_session, data, len));
+	SSL_SESSION_set_ex_data(sess, FR_TLS_EX_INDEX_TLS_SESSION, tls_session);
+
+	return (status == SSL_TICKET_SUCCESS) ? SSL_TICKET_RETURN_USE : SSL_TICKET_RETURN_USE_RENEW;
+}
+#endif
+
+/** Check the session cache configuration, and allocate the in-memory cache
+ *
+ * @param[in] conf	to check.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_tls_cache_conf_init(fr_tls_conf_t *conf)
+{
+	if (conf->session_cache_max_entries) {
+		conf->session_cache_store = fr_tls_cache_store_alloc(conf, conf->session_cache_max_entries);
+		if (!conf->session_cache_store) {
+			ERROR("Failed allocating in-memory session cache");
+			return -1;
+		}
+	}
+
+	if (!conf->session_tickets) return 0;
+
+#if OPENSSL_VERSION_NUMBER < 0x10101000L
+	ERROR("Session tickets require OpenSSL >= 1.1.1");
+	return -1;
+#else
+	if (!conf->session_cache_store && !conf->session_cache_server) {
+		ERROR("Session tickets require 'max_entries' or 'virtual_server' to be set, "
+		      "so that tickets are only accepted from clients which completed authentication");
+		return -1;
+	}
+
+	if (!conf->session_ticket_rotation) {
+		ERROR("'ticket_rotation' must be greater than zero");
+		return -1;
+	}
+
+	if (conf->session_ticket_secret) {
+		if (EVP_Digest(conf->session_ticket_secret, strlen(conf->session_ticket_secret),
+			       conf->session_ticket_key, NULL, EVP_sha256(), NULL) != 1) {
+			ERROR("Failed hashing 'ticket_secret'");
+			return -1;
+		}
+	} else {
+		WARN("No 'ticket_secret' set, session tickets will only be accepted by this server");
+		if (RAND_bytes(conf->session_ticket_key, sizeof(conf->session_ticket_key)) != 1) {
+			ERROR("Failed generating session ticket secret");
+			return -1;
+		}
+	}
+
+	return 0;
+#endif
+}
+
 /** Sets callbacks on a SSL_CTX to enable/disable session resumption
  *
  * @param ctx			to modify.
- * @param enabled		Whether session caching should be enabled.
- * @param lifetime		The maximum period a cached session remains
- *				valid for.
+ * @param conf			containing the session cache configuration.
  */
-void fr_tls_cache_init(SSL_CTX *ctx, bool enabled, uint32_t lifetime)
+void fr_tls_cache_init(SSL_CTX *ctx, fr_tls_conf_t const *conf)
 {
-	if (!enabled) {
+	if (!conf->session_cache_server && !conf->session_cache_store) {
 #if OPENSSL_VERSION_NUMBER >= 0x10101000L
 		/*
 		 *	This controls the number of stateful or stateless tickets
@@ -578,10 +1154,20 @@ void fr_tls_cache_init(SSL_CTX *ctx, bool enabled, uint32_t lifetime)
 	SSL_CTX_set_quiet_shutdown(ctx, 1);
 
 	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
-	SSL_CTX_set_timeout(ctx, lifetime);
+	SSL_CTX_set_timeout(ctx, conf->session_cache_lifetime);
 
 #if OPENSSL_VERSION_NUMBER >= 0x10101000L
 	SSL_CTX_set_num_tickets(ctx, 1);
+
+	if (conf->session_tickets) {
+		SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#  if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, fr_tls_cache_ticket_key_cb);
+#  else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, fr_tls_cache_ticket_key_cb);
+#  endif
+		SSL_CTX_set_session_ticket_cb(ctx, fr_tls_cache_ticket_gen, fr_tls_cache_ticket_dec, NULL);
+	}
 #endif
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
 	SSL_CTX_set_not_resumable_session_callback(ctx, fr_tls_cache_disable_cb);
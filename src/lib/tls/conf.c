@@ -71,6 +71,11 @@ static CONF_PARSER cache_config[] = {
 			 .dflt = "%{EAP-Type}%{Virtual-Server}", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, fr_tls_conf_t, session_cache_lifetime), .dflt = "86400" },
 	{ FR_CONF_OFFSET("verify", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_verify), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, fr_tls_conf_t, session_cache_max_entries), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("tickets", FR_TYPE_BOOL, fr_tls_conf_t, session_tickets), .dflt = "no" },
+	{ FR_CONF_OFFSET("ticket_secret", FR_TYPE_STRING | FR_TYPE_SECRET, fr_tls_conf_t, session_ticket_secret) },
+	{ FR_CONF_OFFSET("ticket_rotation", FR_TYPE_UINT32, fr_tls_conf_t, session_ticket_rotation), .dflt = "3600" },
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
 	{ FR_CONF_OFFSET("require_extended_master_secret", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_require_extms), .dflt = "yes" },
@@ -78,7 +83,6 @@ static CONF_PARSER cache_config[] = {
 #endif
 
 	{ FR_CONF_DEPRECATED("enable", FR_TYPE_BOOL, fr_tls_conf_t, NULL) },
-	{ FR_CONF_DEPRECATED("max_entries", FR_TYPE_UINT32, fr_tls_conf_t, NULL) },
 	{ FR_CONF_DEPRECATED("persist_dir", FR_TYPE_STRING, fr_tls_conf_t, NULL) },
 
 	CONF_PARSER_TERMINATOR
@@ -101,6 +105,8 @@ static CONF_PARSER ocsp_config[] = {
 	{ FR_CONF_OFFSET("use_nonce", FR_TYPE_BOOL, fr_tls_ocsp_conf_t, use_nonce), .dflt = "yes" },
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, timeout), .dflt = "yes" },
 	{ FR_CONF_OFFSET("softfail", FR_TYPE_BOOL, fr_tls_ocsp_conf_t, softfail), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, cache_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("prefetch", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, cache_prefetch), .dflt = "60" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -141,6 +147,9 @@ CONF_PARSER fr_tls_server_config[] = {
 #endif
 	{ FR_CONF_OFFSET("dh_file", FR_TYPE_FILE_INPUT, fr_tls_conf_t, dh_file) },
 	{ FR_CONF_OFFSET("fragment_size", FR_TYPE_UINT32, fr_tls_conf_t, fragment_size), .dflt = "1024" },
+#ifdef SSL_MODE_ASYNC
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, fr_tls_conf_t, async), .dflt = "no" },
+#endif
 
 	{ FR_CONF_OFFSET("disable_single_dh_use", FR_TYPE_BOOL, fr_tls_conf_t, disable_single_dh_use) },
 	{ FR_CONF_OFFSET("check_crl", FR_TYPE_BOOL, fr_tls_conf_t, check_crl), .dflt = "no" },
@@ -153,6 +162,9 @@ CONF_PARSER fr_tls_server_config[] = {
 	{ FR_CONF_OFFSET("cipher_server_preference", FR_TYPE_BOOL, fr_tls_conf_t, cipher_server_preference), .dflt = "yes" },
 #ifdef SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS
 	{ FR_CONF_OFFSET("allow_renegotiation", FR_TYPE_BOOL, fr_tls_conf_t, allow_renegotiation), .dflt = "no" },
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+	{ FR_CONF_OFFSET("ktls", FR_TYPE_BOOL, fr_tls_conf_t, ktls), .dflt = "no" },
 #endif
 	{ FR_CONF_OFFSET("check_cert_issuer", FR_TYPE_STRING, fr_tls_conf_t, check_cert_issuer) },
 	{ FR_CONF_OFFSET("require_client_cert", FR_TYPE_BOOL, fr_tls_conf_t, require_client_cert) },
@@ -197,6 +209,9 @@ CONF_PARSER fr_tls_client_config[] = {
 	{ FR_CONF_OFFSET("check_cert_cn", FR_TYPE_STRING, fr_tls_conf_t, check_cert_cn) },
 	{ FR_CONF_OFFSET("cipher_list", FR_TYPE_STRING, fr_tls_conf_t, cipher_list) },
 	{ FR_CONF_OFFSET("check_cert_issuer", FR_TYPE_STRING, fr_tls_conf_t, check_cert_issuer) },
+#ifdef SSL_OP_ENABLE_KTLS
+	{ FR_CONF_OFFSET("ktls", FR_TYPE_BOOL, fr_tls_conf_t, ktls), .dflt = "no" },
+#endif
 
 #ifndef OPENSSL_NO_ECDH
 	{ FR_CONF_OFFSET("ecdh_curve", FR_TYPE_STRING, fr_tls_conf_t, ecdh_curve), .dflt = "prime256v1" },
@@ -370,6 +385,12 @@ static int _conf_server_free(fr_tls_conf_t *conf)
 	for (i = 0; i < conf->ctx_count; i++) SSL_CTX_free(conf->ctx[i]);
 
 #ifdef HAVE_OPENSSL_OCSP_H
+	/*
+	 *	Stops the prefetch threads, which use the config
+	 */
+	TALLOC_FREE(conf->ocsp.cache_store);
+	TALLOC_FREE(conf->staple.cache_store);
+
 	if (conf->ocsp.store) X509_STORE_free(conf->ocsp.store);
 	conf->ocsp.store = NULL;
 	if (conf->staple.store) X509_STORE_free(conf->staple.store);
@@ -432,6 +453,8 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 	if (conf_cert_admin_password(conf) < 0) goto error;
 #endif
 
+	if (fr_tls_cache_conf_init(conf) < 0) goto error;
+
 	conf->ctx_count = fr_tls_max_threads * 2; /* Reduce contention */
 	if (!conf->ctx_count) conf->ctx_count = 1;
 
@@ -458,11 +481,21 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 	if (conf->ocsp.enable) {
 		conf->ocsp.store = conf_ocsp_revocation_store(conf);
 		if (conf->ocsp.store == NULL) goto error;
+
+		if (conf->ocsp.cache_max_entries) {
+			conf->ocsp.cache_store = fr_tls_ocsp_cache_alloc(conf, &conf->ocsp, "ocsp");
+			if (!conf->ocsp.cache_store) goto error;
+		}
 	}
 
 	if (conf->staple.enable) {
 		conf->staple.store = conf_ocsp_revocation_store(conf);
 		if (conf->staple.store == NULL) goto error;
+
+		if (conf->staple.cache_max_entries) {
+			conf->staple.cache_store = fr_tls_ocsp_cache_alloc(conf, &conf->staple, "staple");
+			if (!conf->staple.cache_store) goto error;
+		}
 	}
 #endif /*HAVE_OPENSSL_OCSP_H*/
 
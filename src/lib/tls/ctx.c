@@ -425,6 +425,15 @@ SSL_CTX *fr_tls_ctx_alloc(fr_tls_conf_t const *conf, bool client)
 			mode |= SSL_MODE_AUTO_RETRY;
 		}
 
+#ifdef SSL_MODE_ASYNC
+		/*
+		 *	Run handshakes as ASYNC_JOBs, so that engines
+		 *	which support it can pause the handshake whilst
+		 *	they perform crypto operations.
+		 */
+		if (conf->async && !client) mode |= SSL_MODE_ASYNC;
+#endif
+
 		if (mode) SSL_CTX_set_mode(ctx, mode);
 	}
 
@@ -709,6 +718,19 @@ post_ca:
 		ctx_options |= SSL_OP_CIPHER_SERVER_PREFERENCE;
 	}
 
+#ifdef SSL_OP_ENABLE_KTLS
+	/*
+	 *	Once the handshake completes, OpenSSL moves record
+	 *	encryption into the kernel (TLS_TX / TLS_RX), if the
+	 *	kernel and the negotiated cipher support it.  It
+	 *	silently falls back to userspace otherwise.
+	 *
+	 *	This only applies to sessions bound to a socket.
+	 *	Sessions using memory BIOs (i.e. EAP) are unaffected.
+	 */
+	if (conf->ktls) ctx_options |= SSL_OP_ENABLE_KTLS;
+#endif
+
 	SSL_CTX_set_options(ctx, ctx_options);
 
 	/*
@@ -844,7 +866,7 @@ post_ca:
 	/*
 	 *	Setup session caching
 	 */
-	fr_tls_cache_init(ctx, conf->session_cache_server ? true : false, conf->session_cache_lifetime);
+	fr_tls_cache_init(ctx, conf);
 
 	return ctx;
 }
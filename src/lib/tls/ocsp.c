@@ -29,14 +29,20 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #ifdef HAVE_OPENSSL_OCSP_H
 #define LOG_PREFIX "tls - ocsp - "
 
+#include <freeradius-devel/server/metrics.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/pair.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/syserror.h>
 
 #include <freeradius-devel/unlang/compile.h>
 
+#include <pthread.h>
+
 #include <openssl/ocsp.h>
 
 #include "attrs.h"
@@ -326,107 +332,375 @@ int fr_tls_ocsp_staple_cb(SSL *ssl, void *data)
 	return ret;
 }
 
-/** Sends a OCSP request to a defined OCSP responder
+/** A cached OCSP response
  *
  */
-int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
-		   X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
-		   fr_tls_ocsp_conf_t *conf, bool staple_response)
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+	fr_dlist_t		prefetch_entry;		//!< Entry in the prefetch queue.
+
+	uint8_t			*id;			//!< DER encoded OCSP_CERTID.
+	size_t			id_len;			//!< Length of the ID.
+
+	uint8_t			*resp;			//!< DER encoded OCSP response, NULL if we don't have one.
+	int			cert_status;		//!< V_OCSP_CERTSTATUS_* from the response.
+	time_t			next_update;		//!< When the response expires.
+
+	bool			fetching;		//!< A worker or the prefetch thread is retrieving
+							///< a response.  Other lookups wait for it.
+
+	X509_STORE		*store;			//!< References held whilst queued for prefetch.
+	X509			*issuer_cert;
+	X509			*client_cert;
+} ocsp_cache_entry_t;
+
+/** Cache of OCSP responses, shared by all workers using a #fr_tls_ocsp_conf_t
+ *
+ */
+struct fr_tls_ocsp_cache_s {
+	fr_tls_ocsp_conf_t	*conf;			//!< We're caching responses for.
+
+	pthread_mutex_t		mutex;			//!< Protects everything below.
+	pthread_cond_t		fetched;		//!< Signalled when a fetch completes.
+	pthread_cond_t		prefetch_cond;		//!< Signalled when an entry is queued for prefetch.
+
+	fr_hash_table_t		*ht;			//!< Entries by certificate ID.  Entries are
+							///< allocated in its ctx.
+	fr_dlist_head_t		lru;			//!< Most recently used at the head.
+	fr_dlist_head_t		prefetch;		//!< Entries to refresh.
+
+	pthread_t		prefetch_thread;	//!< Refreshes responses before they expire.
+	bool			prefetch_running;	//!< Whether the prefetch thread has been started.
+	bool			stop;			//!< Tell the prefetch thread to exit.
+
+	fr_metric_t		*metric;		//!< Lookups by result.
+	char const		*labels[3];		//!< hit, miss and stale.
+};
+
+typedef enum {
+	OCSP_CACHE_HIT = 0,
+	OCSP_CACHE_MISS,
+	OCSP_CACHE_STALE
+} ocsp_cache_result_t;
+
+static uint32_t ocsp_cache_entry_hash(void const *data)
 {
-	OCSP_CERTID	*certid;
-	OCSP_REQUEST	*req = NULL;
-	OCSP_RESPONSE	*resp = NULL;
-	OCSP_BASICRESP	*bresp = NULL;
-	char		*host = NULL;
-	char		*port = NULL;
-	char		*path = NULL;
-	char		host_header[1024];
-	int		use_ssl = -1;
-	long		this_fudge = OCSP_MAX_VALIDITY_PERIOD, this_max_age = -1;
-	BIO		*conn = NULL, *ssl_log = NULL;
-	ocsp_status_t   ocsp_status = OCSP_STATUS_FAILED;
-	ocsp_status_t	status;
-	ASN1_GENERALIZEDTIME *rev, *this_update, *next_update;
-	int		reason;
-	OCSP_REQ_CTX	*ctx;
-	int		rc;
+	ocsp_cache_entry_t const *entry = data;
 
-	fr_time_t	start;
-	VALUE_PAIR	*vp;
+	return fr_hash(entry->id, entry->id_len);
+}
 
-	if (conf->cache_server) switch (fr_tls_cache_process(request, conf->cache.load)) {
-	case RLM_MODULE_REJECT:
-		REDEBUG("Told to force OCSP validation failure from cached response");
-		return OCSP_STATUS_FAILED;
+static int ocsp_cache_entry_cmp(void const *one, void const *two)
+{
+	ocsp_cache_entry_t const *a = one, *b = two;
+
+	if (a->id_len < b->id_len) return -1;
+	if (a->id_len > b->id_len) return +1;
+
+	return memcmp(a->id, b->id, a->id_len);
+}
+
+static void ocsp_cache_entry_certs_free(ocsp_cache_entry_t *entry)
+{
+	if (entry->store) X509_STORE_free(entry->store);
+	if (entry->issuer_cert) X509_free(entry->issuer_cert);
+	if (entry->client_cert) X509_free(entry->client_cert);
+	entry->store = NULL;
+	entry->issuer_cert = entry->client_cert = NULL;
+}
+
+static void ocsp_cache_entry_free(void *data)
+{
+	ocsp_cache_entry_t *entry = data;
+
+	ocsp_cache_entry_certs_free(entry);
+	talloc_free(entry);
+}
+
+static int _ocsp_cache_free(fr_tls_ocsp_cache_t *cache)
+{
+	if (cache->prefetch_running) {
+		pthread_mutex_lock(&cache->mutex);
+		cache->stop = true;
+		pthread_cond_signal(&cache->prefetch_cond);
+		pthread_mutex_unlock(&cache->mutex);
+
+		pthread_join(cache->prefetch_thread, NULL);
+	}
+
+	TALLOC_FREE(cache->ht);
+
+	pthread_cond_destroy(&cache->prefetch_cond);
+	pthread_cond_destroy(&cache->fetched);
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate a cache for OCSP responses
+ *
+ * @param[in] ctx	to allocate the cache in.  Must be freed before conf.
+ * @param[in] conf	to cache responses for.
+ * @param[in] type	Either "ocsp" or "staple".  Used to label metrics.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+fr_tls_ocsp_cache_t *fr_tls_ocsp_cache_alloc(TALLOC_CTX *ctx, fr_tls_ocsp_conf_t *conf, char const *type)
+{
+	fr_tls_ocsp_cache_t	*cache;
+
+	MEM(cache = talloc_zero(ctx, fr_tls_ocsp_cache_t));
+	cache->conf = conf;
+
+	cache->ht = fr_hash_table_create(cache, ocsp_cache_entry_hash, ocsp_cache_entry_cmp, ocsp_cache_entry_free);
+	if (!cache->ht) {
+		talloc_free(cache);
+		return NULL;
+	}
+	fr_dlist_init(&cache->lru, ocsp_cache_entry_t, entry);
+	fr_dlist_init(&cache->prefetch, ocsp_cache_entry_t, prefetch_entry);
+
+	cache->metric = fr_metric_register("freeradius_tls_ocsp_cache",
+					   "OCSP responses found in the cache, not found, or expired.",
+					   FR_METRIC_COUNTER);
+	if (!cache->metric) {
+		talloc_free(cache);
+		return NULL;
+	}
+	cache->labels[OCSP_CACHE_HIT] = talloc_typed_asprintf(cache, "type=\"%s\",result=\"hit\"", type);
+	cache->labels[OCSP_CACHE_MISS] = talloc_typed_asprintf(cache, "type=\"%s\",result=\"miss\"", type);
+	cache->labels[OCSP_CACHE_STALE] = talloc_typed_asprintf(cache, "type=\"%s\",result=\"stale\"", type);
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	pthread_cond_init(&cache->fetched, NULL);
+	pthread_cond_init(&cache->prefetch_cond, NULL);
+	talloc_set_destructor(cache, _ocsp_cache_free);
+
+	return cache;
+}
+
+/** Find or create the cache entry for a certificate
+ *
+ * @note Must be called with the cache locked.
+ */
+static ocsp_cache_entry_t *ocsp_cache_entry(fr_tls_ocsp_cache_t *cache, uint8_t const *id, size_t id_len)
+{
+	ocsp_cache_entry_t	find = { .id_len = id_len };
+	ocsp_cache_entry_t	*entry, *evict;
+
+	memcpy(&find.id, &id, sizeof(find.id));	/* const issues */
+
+	entry = fr_hash_table_finddata(cache->ht, &find);
+	if (entry) {
+		fr_dlist_remove(&cache->lru, entry);
+		fr_dlist_insert_head(&cache->lru, entry);
+		return entry;
+	}
 
-	case RLM_MODULE_OK:
-	case RLM_MODULE_UPDATED:
 	/*
-	 *	These are fine for OCSP too, we don't *expect* to always
-	 *	have a cached OCSP status.
+	 *	Evict the least recently used entries that
+	 *	nothing is waiting on.
 	 */
-	case RLM_MODULE_NOTFOUND:
-	case RLM_MODULE_NOOP:
-		break;
+	evict = fr_dlist_tail(&cache->lru);
+	while (evict && (fr_dlist_num_elements(&cache->lru) >= cache->conf->cache_max_entries)) {
+		ocsp_cache_entry_t *prev = fr_dlist_prev(&cache->lru, evict);
 
-	default:
-		RWDEBUG("Failed retrieving cached OCSP status");
-		break;
+		if (!evict->fetching) {
+			fr_dlist_remove(&cache->lru, evict);
+			fr_hash_table_delete(cache->ht, evict);
+		}
+		evict = prev;
+	}
+
+	MEM(entry = talloc_zero(cache->ht, ocsp_cache_entry_t));
+	MEM(entry->id = talloc_memdup(entry, id, id_len));
+	entry->id_len = id_len;
+
+	if (!fr_hash_table_insert(cache->ht, entry)) {
+		talloc_free(entry);
+		return NULL;
 	}
+	fr_dlist_insert_head(&cache->lru, entry);
+
+	return entry;
+}
+
+/** Record the result of a fetch, and wake anything waiting for it
+ *
+ * @note Must be called with the cache locked.
+ */
+static void ocsp_cache_entry_update(fr_tls_ocsp_cache_t *cache, ocsp_cache_entry_t *entry,
+				    OCSP_RESPONSE *resp, int cert_status, time_t next_update)
+{
+	int	len;
+	uint8_t	*buff, *p;
+
+	entry->fetching = false;
+	pthread_cond_broadcast(&cache->fetched);
 
 	/*
-	 *	Allow us to cache the OCSP verified state externally
+	 *	Responses without a nextUpdate can't be cached,
+	 *	as we don't know how long they're valid for.
+	 *
+	 *	If a prefetch failed, we keep the existing response
+	 *	until it expires.
 	 */
-	vp = fr_pair_find_by_da(request->control, attr_tls_ocsp_cert_valid, TAG_ANY);
-	if (vp) switch (vp->vp_uint32) {
-	case 0:	/* no */
-		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = no, forcing OCSP failure");
-		return OCSP_STATUS_FAILED;
+	if (!resp || (next_update <= time(NULL))) return;
 
-	case 1: /* yes */
-		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = yes, forcing OCSP success");
+	len = i2d_OCSP_RESPONSE(resp, NULL);
+	if (len <= 0) return;
+
+	MEM(p = buff = talloc_array(entry, uint8_t, len));
+	if (i2d_OCSP_RESPONSE(resp, &p) != len) {
+		talloc_free(buff);
+		return;
+	}
+	talloc_free(entry->resp);
+	entry->resp = buff;
+	entry->cert_status = cert_status;
+	entry->next_update = next_update;
+}
+
+static ocsp_status_t ocsp_fetch(OCSP_RESPONSE **resp_out, int *cert_status, time_t *next_update,
+				REQUEST *request, BIO *ssl_log, X509_STORE *store,
+				X509 *issuer_cert, X509 *client_cert, fr_tls_ocsp_conf_t const *conf);
+
+/** Refresh OCSP responses before they expire
+ *
+ */
+static void *ocsp_cache_prefetch_thread(void *arg)
+{
+	fr_tls_ocsp_cache_t	*cache = talloc_get_type_abort(arg, fr_tls_ocsp_cache_t);
+	ocsp_cache_entry_t	*entry;
+
+	pthread_mutex_lock(&cache->mutex);
+	for (;;) {
+		REQUEST		*request;
+		BIO		*ssl_log;
+		OCSP_RESPONSE	*resp = NULL;
+		int		cert_status = V_OCSP_CERTSTATUS_UNKNOWN;
+		time_t		next_update = 0;
+
+		if (cache->stop) break;
+
+		entry = fr_dlist_head(&cache->prefetch);
+		if (!entry) {
+			pthread_cond_wait(&cache->prefetch_cond, &cache->mutex);
+			continue;
+		}
+		fr_dlist_remove(&cache->prefetch, entry);
+		pthread_mutex_unlock(&cache->mutex);
 
 		/*
-		 *	If this fails, and an OCSP stapled response is required,
-		 *	we need to run the full OCSP check.
+		 *	Entries being fetched can't be evicted,
+		 *	so it's safe to use without the lock.
 		 */
-		if (staple_response) {
-			vp = fr_pair_find_by_da(request->control, attr_tls_ocsp_response, TAG_ANY);
-			if (!vp) {
-				RDEBUG2("No &control:TLS-OCSP-Response attribute found, performing full OCSP check");
-				break;
-			}
-			if (ocsp_staple_from_pair(request, ssl, vp) < 0) {
-				RWDEBUG("Failed setting OCSP staple response in SSL session");
-				return OCSP_STATUS_FAILED;
+		request = request_alloc(NULL);
+		ssl_log = BIO_new(BIO_s_mem());
+		if (request && ssl_log) {
+			RDEBUG2("Refreshing OCSP response before it expires");
+			if (ocsp_fetch(&resp, &cert_status, &next_update, request, ssl_log, entry->store,
+				       entry->issuer_cert, entry->client_cert, cache->conf) == OCSP_STATUS_SKIPPED) {
+				while (ERR_get_error());
 			}
 		}
+		BIO_free(ssl_log);
+		talloc_free(request);
 
-		return OCSP_STATUS_OK;
-
-	case 2: /* skipped */
-		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = skipped, skipping OCSP check");
-		return conf->softfail ? OCSP_STATUS_OK : OCSP_STATUS_FAILED;
-
-	case 3: /* unknown */
-	default:
-		break;
-	}
-
-	if (issuer_cert == NULL) {
-		RWDEBUG("Could not get issuer certificate");
-		goto skipped;
+		pthread_mutex_lock(&cache->mutex);
+		ocsp_cache_entry_certs_free(entry);
+		ocsp_cache_entry_update(cache, entry, resp, cert_status, next_update);
+		OCSP_RESPONSE_free(resp);
 	}
 
 	/*
-	 *	Setup logging for this OCSP operation
+	 *	Release anything still queued
 	 */
-	ssl_log = BIO_new(BIO_s_mem());
-	if (!ssl_log) {
-		REDEBUG("Failed creating log queue");
-		ocsp_status = OCSP_STATUS_SKIPPED;
-		goto finish;
+	while ((entry = fr_dlist_head(&cache->prefetch))) {
+		fr_dlist_remove(&cache->prefetch, entry);
+		ocsp_cache_entry_certs_free(entry);
+		entry->fetching = false;
 	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return NULL;
+}
+
+/** Queue an entry to be refreshed by the prefetch thread
+ *
+ * The thread is started on first use, as threads don't survive fork().
+ *
+ * @note Must be called with the cache locked.
+ */
+static void ocsp_cache_prefetch(fr_tls_ocsp_cache_t *cache, ocsp_cache_entry_t *entry,
+				X509_STORE *store, X509 *issuer_cert, X509 *client_cert)
+{
+	if (!cache->prefetch_running) {
+		int ret;
+
+		ret = pthread_create(&cache->prefetch_thread, NULL, ocsp_cache_prefetch_thread, cache);
+		if (ret != 0) {
+			ERROR("Failed starting OCSP prefetch thread: %s", fr_syserror(ret));
+			return;
+		}
+		cache->prefetch_running = true;
+	}
+
+	X509_STORE_up_ref(store);
+	X509_up_ref(issuer_cert);
+	X509_up_ref(client_cert);
+	entry->store = store;
+	entry->issuer_cert = issuer_cert;
+	entry->client_cert = client_cert;
+	entry->fetching = true;
+
+	fr_dlist_insert_tail(&cache->prefetch, entry);
+	pthread_cond_signal(&cache->prefetch_cond);
+}
+
+/** Fetch an OCSP response from the responder
+ *
+ * @param[out] resp_out		The response, if it was verified.  Must be freed by the caller.
+ * @param[out] cert_status	V_OCSP_CERTSTATUS_* from the response.
+ * @param[out] next_update	When the response expires, 0 if it didn't say.
+ * @param[in] request		The current request.
+ * @param[in] ssl_log		To accumulate OpenSSL errors in.
+ * @param[in] store		To verify the response with.
+ * @param[in] issuer_cert	of client_cert.
+ * @param[in] client_cert	to check.
+ * @param[in] conf		OCSP configuration.
+ * @return
+ *	- OCSP_STATUS_OK if the certificate is good.
+ *	- OCSP_STATUS_FAILED if the certificate was revoked, or the response was invalid.
+ *	- OCSP_STATUS_SKIPPED if we couldn't get a response.
+ */
+static ocsp_status_t ocsp_fetch(OCSP_RESPONSE **resp_out, int *cert_status, time_t *next_update,
+				REQUEST *request, BIO *ssl_log, X509_STORE *store,
+				X509 *issuer_cert, X509 *client_cert, fr_tls_ocsp_conf_t const *conf)
+{
+	OCSP_CERTID	*certid;
+	OCSP_REQUEST	*req = NULL;
+	OCSP_RESPONSE	*resp = NULL;
+	OCSP_BASICRESP	*bresp = NULL;
+	char		*host = NULL;
+	char		*port = NULL;
+	char		*path = NULL;
+	char		host_header[1024];
+	int		use_ssl = -1;
+	long		this_fudge = OCSP_MAX_VALIDITY_PERIOD, this_max_age = -1;
+	BIO		*conn = NULL;
+	ocsp_status_t   ocsp_status = OCSP_STATUS_FAILED;
+	ocsp_status_t	status;
+	ASN1_GENERALIZEDTIME *rev, *this_update, *next;
+	int		reason;
+	OCSP_REQ_CTX	*ctx;
+	int		rc;
+
+	fr_time_t	start;
+
+	*resp_out = NULL;
+	*next_update = 0;
 
 	/*
 	 *	Create OCSP Request
@@ -450,7 +724,8 @@ int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
 		OCSP_parse_url(url, &host, &port, &path, &use_ssl);
 		if (!host || !port || !path) {
 			RWDEBUG("Host or port or path missing from configured URL \"%s\".  Not doing OCSP", url);
-			goto skipped;
+			ocsp_status = OCSP_STATUS_SKIPPED;
+			goto finish;
 		}
 	} else {
 		int ret;
@@ -467,7 +742,8 @@ int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
 				goto use_url;
 			}
 			RWDEBUG("No OCSP URL in certificate.  Not doing OCSP");
-			goto skipped;
+			ocsp_status = OCSP_STATUS_SKIPPED;
+			goto finish;
 
 		case 1:
 			fr_assert(host && port && path);
@@ -480,7 +756,8 @@ int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
 	/* Check host and port length are sane, then create Host: HTTP header */
 	if ((strlen(host) + strlen(port) + 2) > sizeof(host_header)) {
 		RWDEBUG("Host and port too long");
-		goto skipped;
+		ocsp_status = OCSP_STATUS_SKIPPED;
+		goto finish;
 	}
 	snprintf(host_header, sizeof(host_header), "%s:%s", host, port);
 
@@ -556,7 +833,7 @@ int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
 	}
 
 	/*	Verify OCSP cert status */
-	if (!OCSP_resp_find_status(bresp, certid, (int *)&status, &reason, &rev, &this_update, &next_update)) {
+	if (!OCSP_resp_find_status(bresp, certid, (int *)&status, &reason, &rev, &this_update, &next)) {
 		REDEBUG("No Status found");
 		goto finish;
 	}
@@ -570,7 +847,7 @@ int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
 	 *
 	 *	The default for this_fudge is 300, defined by OCSP_MAX_VALIDITY_PERIOD.
 	 */
-	if (!OCSP_check_validity(this_update, next_update, this_fudge, this_max_age)) {
+	if (!OCSP_check_validity(this_update, next, this_fudge, this_max_age)) {
 		/*
 		 *	We want this to show up in the global log
 		 *	so someone will fix it...
@@ -593,9 +870,9 @@ int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
 		FR_OPENSSL_DRAIN_LOG_QUEUE(RDEBUG2, "", ssl_log);
 		REXDENT();
 
-		if (next_update) {
+		if (next) {
 			RDEBUG2("New information available at:");
-			ASN1_GENERALIZEDTIME_print(ssl_log, next_update);
+			ASN1_GENERALIZEDTIME_print(ssl_log, next);
 			RINDENT();
 			FR_OPENSSL_DRAIN_LOG_QUEUE(RDEBUG2, "", ssl_log);
 			REXDENT();
@@ -606,36 +883,13 @@ int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
 	 *	When an OCSP validation command is used with OpenSSL
 	 *	next_update is NULL.
 	 */
-	if (next_update) {
-		fr_time_t	now;
-		time_t		next;
-
-		/*
-		 *	Sometimes we already know what 'now' is depending
-		 *	on the code path, other times we don't.
-		 */
-		now = fr_time();
-
-		if (fr_tls_utils_asn1time_to_epoch(&next, next_update) < 0) {
-			RPEDEBUG("Failed parsing next_update time");
-			ocsp_status = OCSP_STATUS_SKIPPED;
-			goto finish;
-		}
-		if (fr_time_to_sec(now) < next){
-			RDEBUG2("Adding OCSP TTL attribute");
-
-			MEM(pair_update_request(&vp, attr_tls_ocsp_next_update) >= 0);
-			vp->vp_uint32 = next - fr_time_to_sec(now);
-			RINDENT();
-			RDEBUG2("&%pP", vp);
-			REXDENT();
-		} else {
-			RDEBUG2("Update time is in the past.  Not adding &TLS-OCSP-Next-Update");
-		}
-	} else {
-		RDEBUG2("Update time not provided.  Not adding &TLS-OCSP-Next-Update");
+	if (next && (fr_tls_utils_asn1time_to_epoch(next_update, next) < 0)) {
+		RPEDEBUG("Failed parsing next_update time");
+		ocsp_status = OCSP_STATUS_SKIPPED;
+		goto finish;
 	}
 
+	*cert_status = status;
 	switch (status) {
 	case V_OCSP_CERTSTATUS_GOOD:
 		RDEBUG2("Cert status: good");
@@ -661,6 +915,220 @@ int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
 		break;
 	}
 
+	*resp_out = resp;
+	resp = NULL;
+
+finish:
+	/* Free OCSP Stuff */
+	OCSP_REQUEST_free(req);
+	OCSP_BASICRESP_free(bresp);
+	OCSP_RESPONSE_free(resp);
+	OPENSSL_free(host);
+	OPENSSL_free(port);
+	OPENSSL_free(path);
+	BIO_free_all(conn);
+
+	return ocsp_status;
+}
+
+/** Sends a OCSP request to a defined OCSP responder
+ *
+ * If the OCSP cache is enabled, responses are cached by certificate ID until
+ * their nextUpdate time, and refreshed by a background thread shortly before.
+ * Only one lookup for a given certificate is sent to the responder at a time,
+ * concurrent lookups wait for its response.
+ */
+int fr_tls_ocsp_check(REQUEST *request, SSL *ssl,
+		   X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
+		   fr_tls_ocsp_conf_t *conf, bool staple_response)
+{
+	OCSP_RESPONSE	*resp = NULL;
+	BIO		*ssl_log = NULL;
+	ocsp_status_t   ocsp_status = OCSP_STATUS_FAILED;
+	int		cert_status = V_OCSP_CERTSTATUS_UNKNOWN;
+	time_t		next_update = 0;
+
+	fr_tls_ocsp_cache_t	*cache = conf->cache_store;
+	ocsp_cache_entry_t	*entry = NULL;
+	uint8_t			*id = NULL;
+	VALUE_PAIR	*vp;
+
+	if (conf->cache_server) switch (fr_tls_cache_process(request, conf->cache.load)) {
+	case RLM_MODULE_REJECT:
+		REDEBUG("Told to force OCSP validation failure from cached response");
+		return OCSP_STATUS_FAILED;
+
+	case RLM_MODULE_OK:
+	case RLM_MODULE_UPDATED:
+	/*
+	 *	These are fine for OCSP too, we don't *expect* to always
+	 *	have a cached OCSP status.
+	 */
+	case RLM_MODULE_NOTFOUND:
+	case RLM_MODULE_NOOP:
+		break;
+
+	default:
+		RWDEBUG("Failed retrieving cached OCSP status");
+		break;
+	}
+
+	/*
+	 *	Allow us to cache the OCSP verified state externally
+	 */
+	vp = fr_pair_find_by_da(request->control, attr_tls_ocsp_cert_valid, TAG_ANY);
+	if (vp) switch (vp->vp_uint32) {
+	case 0:	/* no */
+		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = no, forcing OCSP failure");
+		return OCSP_STATUS_FAILED;
+
+	case 1: /* yes */
+		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = yes, forcing OCSP success");
+
+		/*
+		 *	If this fails, and an OCSP stapled response is required,
+		 *	we need to run the full OCSP check.
+		 */
+		if (staple_response) {
+			vp = fr_pair_find_by_da(request->control, attr_tls_ocsp_response, TAG_ANY);
+			if (!vp) {
+				RDEBUG2("No &control:TLS-OCSP-Response attribute found, performing full OCSP check");
+				break;
+			}
+			if (ocsp_staple_from_pair(request, ssl, vp) < 0) {
+				RWDEBUG("Failed setting OCSP staple response in SSL session");
+				return OCSP_STATUS_FAILED;
+			}
+		}
+
+		return OCSP_STATUS_OK;
+
+	case 2: /* skipped */
+		RDEBUG2("Found &control:TLS-OCSP-Cert-Valid = skipped, skipping OCSP check");
+		return conf->softfail ? OCSP_STATUS_OK : OCSP_STATUS_FAILED;
+
+	case 3: /* unknown */
+	default:
+		break;
+	}
+
+	if (issuer_cert == NULL) {
+		RWDEBUG("Could not get issuer certificate");
+		goto skipped;
+	}
+
+	/*
+	 *	Setup logging for this OCSP operation
+	 */
+	ssl_log = BIO_new(BIO_s_mem());
+	if (!ssl_log) {
+		REDEBUG("Failed creating log queue");
+		ocsp_status = OCSP_STATUS_SKIPPED;
+		goto finish;
+	}
+
+	if (cache) {
+		OCSP_CERTID		*certid;
+		uint8_t			*p;
+		int			len;
+		ocsp_cache_result_t	result = OCSP_CACHE_MISS;
+
+		certid = OCSP_cert_to_id(NULL, client_cert, issuer_cert);
+		len = certid ? i2d_OCSP_CERTID(certid, NULL) : -1;
+		if (len > 0) {
+			MEM(p = id = talloc_array(request, uint8_t, len));
+			if (i2d_OCSP_CERTID(certid, &p) != len) TALLOC_FREE(id);
+		}
+		OCSP_CERTID_free(certid);
+
+		if (id) {
+			time_t now = time(NULL);
+
+			pthread_mutex_lock(&cache->mutex);
+			entry = ocsp_cache_entry(cache, id, talloc_array_length(id));
+
+			/*
+			 *	Someone else is asking the responder, wait for them.
+			 */
+			if (entry && entry->fetching && !entry->resp) {
+				struct timespec ts = { .tv_sec = now + (conf->timeout ? conf->timeout : 10) };
+
+				RDEBUG2("Waiting for another lookup of the same certificate");
+				while (entry->fetching) {
+					if (pthread_cond_timedwait(&cache->fetched, &cache->mutex, &ts) != 0) break;
+				}
+				now = time(NULL);
+			}
+
+			if (entry && entry->resp) {
+				if (entry->next_update > now) {
+					uint8_t const *q = entry->resp;
+
+					RDEBUG2("Found OCSP response in cache");
+					result = OCSP_CACHE_HIT;
+					resp = d2i_OCSP_RESPONSE(NULL, &q, talloc_array_length(entry->resp));
+					cert_status = entry->cert_status;
+					next_update = entry->next_update;
+
+					if (conf->cache_prefetch && !entry->fetching &&
+					    ((entry->next_update - now) <= (time_t)conf->cache_prefetch)) {
+						ocsp_cache_prefetch(cache, entry, store, issuer_cert, client_cert);
+					}
+				} else {
+					RDEBUG2("Cached OCSP response has expired");
+					result = OCSP_CACHE_STALE;
+					TALLOC_FREE(entry->resp);
+				}
+			}
+
+			if (resp) {
+				entry = NULL;
+			} else if (entry && !entry->fetching) {
+				entry->fetching = true;		/* We're fetching it */
+			} else {
+				entry = NULL;			/* Timed out waiting, fetch it ourselves */
+			}
+			pthread_mutex_unlock(&cache->mutex);
+		}
+		fr_metric_inc(fr_metric_series(cache->metric, cache->labels[result]), 1);
+	}
+
+	if (resp) {
+		ocsp_status = (cert_status == V_OCSP_CERTSTATUS_GOOD) ? OCSP_STATUS_OK : OCSP_STATUS_FAILED;
+		if (ocsp_status == OCSP_STATUS_OK) {
+			RDEBUG2("Cert status: good");
+		} else {
+			REDEBUG("Cert status: %s", OCSP_cert_status_str(cert_status));
+		}
+	} else {
+		ocsp_status = ocsp_fetch(&resp, &cert_status, &next_update, request, ssl_log,
+					 store, issuer_cert, client_cert, conf);
+		if (entry) {
+			pthread_mutex_lock(&cache->mutex);
+			ocsp_cache_entry_update(cache, entry, resp, cert_status, next_update);
+			pthread_mutex_unlock(&cache->mutex);
+		}
+	}
+	talloc_free(id);
+
+	if (next_update) {
+		time_t now = time(NULL);
+
+		if (now < next_update) {
+			RDEBUG2("Adding OCSP TTL attribute");
+
+			MEM(pair_update_request(&vp, attr_tls_ocsp_next_update) >= 0);
+			vp->vp_uint32 = next_update - now;
+			RINDENT();
+			RDEBUG2("&%pP", vp);
+			REXDENT();
+		} else {
+			RDEBUG2("Update time is in the past.  Not adding &TLS-OCSP-Next-Update");
+		}
+	} else if (ocsp_status != OCSP_STATUS_SKIPPED) {
+		RDEBUG2("Update time not provided.  Not adding &TLS-OCSP-Next-Update");
+	}
+
 finish:
 	switch (ocsp_status) {
 	case OCSP_STATUS_OK:
@@ -677,7 +1145,11 @@ finish:
 			 *	Set the stapled response for the current
 			 *	SSL session.
 			 */
-			if (ocsp_staple_from_pair(request, ssl, vp) < 0) return -1;
+			if (ocsp_staple_from_pair(request, ssl, vp) < 0) {
+				OCSP_RESPONSE_free(resp);
+				BIO_free(ssl_log);
+				return -1;
+			}
 			vp = NULL;	/* It's in the request, don't need to free it! */
 		}
 
@@ -726,14 +1198,7 @@ finish:
 		break;
 	}
 
-	/* Free OCSP Stuff */
-	OCSP_REQUEST_free(req);
-	OCSP_BASICRESP_free(bresp);
 	OCSP_RESPONSE_free(resp);
-	OPENSSL_free(host);
-	OPENSSL_free(port);
-	OPENSSL_free(path);
-	BIO_free_all(conn);
 	BIO_free(ssl_log);
 
 	return ocsp_status;
@@ -1101,11 +1101,48 @@ int fr_tls_session_pairs_from_x509_cert(fr_cursor_t *cursor, TALLOC_CTX *ctx,
 	return 0;
 }
 
+/** Feed a fragment of a TLS record received from the peer to OpenSSL
+ *
+ * Fragments are written straight into OpenSSL's input BIO, which
+ * buffers them until the record is complete, and
+ * #fr_tls_session_recv or #fr_tls_session_handshake is called
+ * to process it.  This avoids reassembling the record in a separate
+ * buffer first.
+ *
+ * @param[in] request	The current #REQUEST.
+ * @param[in] session	The current TLS session.
+ * @param[in] data	Fragment to write.
+ * @param[in] data_len	Length of the fragment.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the record would exceed the maximum record size, or the write failed.
+ */
+int fr_tls_session_recv_fragment(REQUEST *request, fr_tls_session_t *session, uint8_t const *data, size_t data_len)
+{
+	int ret;
+
+	if (!data_len) return 0;
+
+	if ((BIO_ctrl_pending(session->into_ssl) + data_len) > FR_TLS_MAX_RECORD_SIZE) {
+		REDEBUG("Exceeded maximum record size");
+		return -1;
+	}
+
+	ret = BIO_write(session->into_ssl, data, data_len);
+	if (ret != (int)data_len) {
+		REDEBUG("Failed writing %zu bytes to TLS BIO: %d", data_len, ret);
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Decrypt application data
  *
  * @note Handshake must have completed before this function may be called.
  *
- * Feed data from dirty_in to OpenSSL, and read the clean data into clean_out.
+ * Have OpenSSL decrypt the record fed to it with #fr_tls_session_recv_fragment,
+ * and read the clean data into clean_out.
  *
  * @param[in] request	The current #REQUEST.
  * @param[in] session	The current TLS session.
@@ -1127,20 +1164,6 @@ int fr_tls_session_recv(REQUEST *request, fr_tls_session_t *session)
 		goto finish;
 	}
 
-	/*
-	 *	Decrypt the complete record.
-	 */
-	if (session->dirty_in.used) {
-		ret = BIO_write(session->into_ssl, session->dirty_in.data, session->dirty_in.used);
-		if (ret != (int) session->dirty_in.used) {
-			record_init(&session->dirty_in);
-			REDEBUG("Failed writing %zd bytes to SSL BIO: %d", session->dirty_in.used, ret);
-			goto error;
-		}
-
-		record_init(&session->dirty_in);
-	}
-
 	/*
 	 *      Clear the dirty buffer now that we are done with it
 	 *      and init the clean_out buffer to store decrypted data
@@ -1308,10 +1331,40 @@ static void fr_tls_session_alert_send(REQUEST *request, fr_tls_session_t *sessio
 	session_msg_log(request, session, session->dirty_out.data, session->dirty_out.used);
 }
 
+/** Return the file descriptor to wait on for an asynchronous crypto operation
+ *
+ * @param[in] session	with session->async_pending set.
+ * @return
+ *	- The file descriptor, which becomes readable when the operation completes.
+ *	- -1 if there's no file descriptor to wait on, i.e. no ASYNC_JOB was available.
+ *	  Call #fr_tls_session_handshake again after a short delay.
+ */
+int fr_tls_session_async_fd(fr_tls_session_t *session)
+{
+#ifdef SSL_MODE_ASYNC
+	OSSL_ASYNC_FD	fds[4];
+	size_t		num = 0;
+
+	if ((SSL_get_all_async_fds(session->ssl, NULL, &num) != 1) ||
+	    (num == 0) || (num > NUM_ELEMENTS(fds))) return -1;
+
+	if (SSL_get_all_async_fds(session->ssl, fds, &num) != 1) return -1;
+
+	return fds[0];
+#else
+	return -1;
+#endif
+}
+
 /** Continue a TLS handshake
  *
- * Advance the TLS handshake by feeding OpenSSL data from dirty_in,
- * and reading data from OpenSSL into dirty_out.
+ * Advance the TLS handshake with the data fed to OpenSSL by #fr_tls_session_recv_fragment,
+ * and read data from OpenSSL into dirty_out.
+ *
+ * If async is enabled, and the engine performing a crypto operation
+ * paused the handshake, session->async_pending is set.  The caller should
+ * wait for #fr_tls_session_async_fd to become readable, and call this
+ * function again to continue the handshake.
  *
  * @param request The current request.
  * @param session The current TLS session.
@@ -1325,6 +1378,8 @@ int fr_tls_session_handshake(REQUEST *request, fr_tls_session_t *session)
 
 	fr_tls_session_request_bind(request, session->ssl);
 
+	session->async_pending = false;
+
 	/*
 	 *	This is a logic error.  fr_tls_session_handshake
 	 *	must not be called if the handshake is
@@ -1343,21 +1398,6 @@ int fr_tls_session_handshake(REQUEST *request, fr_tls_session_t *session)
 		goto error;
 	}
 
-	/*
-	 *	Feed dirty data into OpenSSL, so that is can either
-	 *	process it as Application data (decrypting it)
-	 *	or continue the TLS handshake.
-	 */
-	if (session->dirty_in.used) {
-		ret = BIO_write(session->into_ssl, session->dirty_in.data, session->dirty_in.used);
-		if (ret != (int)session->dirty_in.used) {
-			REDEBUG("Failed writing %zd bytes to TLS BIO: %d", session->dirty_in.used, ret);
-			record_init(&session->dirty_in);
-			goto error;
-		}
-		record_init(&session->dirty_in);
-	}
-
 	/*
 	 *	Magic/More magic? Although SSL_read is normally
 	 *	used to read application data, it will also
@@ -1387,6 +1427,20 @@ int fr_tls_session_handshake(REQUEST *request, fr_tls_session_t *session)
 		goto finish;
 	}
 
+#ifdef SSL_MODE_ASYNC
+	switch (SSL_get_error(session->ssl, ret)) {
+	case SSL_ERROR_WANT_ASYNC:
+	case SSL_ERROR_WANT_ASYNC_JOB:
+		RDEBUG2("Waiting for asynchronous crypto operation to complete");
+		session->async_pending = true;
+		ret = 0;
+		goto finish;
+
+	default:
+		break;
+	}
+#endif
+
 	/*
 	 *	Returns 0 if we can continue processing the handshake
 	 *	Returns -1 if we encountered a fatal error.
@@ -1490,6 +1544,15 @@ int fr_tls_session_handshake(REQUEST *request, fr_tls_session_t *session)
 			 */
 			MEM(pair_update_request(&vp, attr_eap_session_resumed) >= 0);
 			vp->vp_bool = true;
+
+			/*
+			 *	Sessions resumed from tickets don't go through
+			 *	fr_tls_cache_read, so revalidate the chain here.
+			 */
+			if (session->ticket_id && (fr_tls_validate_client_cert_chain(session->ssl) != 1)) {
+				REDEBUG("Certificate chain of resumed session failed validation");
+				goto error;
+			}
 		}
 	}
 
@@ -1503,13 +1566,11 @@ int fr_tls_session_handshake(REQUEST *request, fr_tls_session_t *session)
 		if (ret > 0) {
 			session->dirty_out.used = ret;
 		} else if (BIO_should_retry(session->from_ssl)) {
-			record_init(&session->dirty_in);
 			RDEBUG2("Asking for more data in tunnel");
 			goto success;
 
 		} else {
 			fr_tls_log_error(NULL, NULL);
-			record_init(&session->dirty_in);
 			goto error;
 		}
 	} else {
@@ -1527,9 +1588,6 @@ int fr_tls_session_handshake(REQUEST *request, fr_tls_session_t *session)
 	 */
 	if (session->pending_alert) fr_tls_session_alert_send(request, session);
 
-	/* We are done with dirty_in, reinitialize it */
-	record_init(&session->dirty_in);
-
 finish:
 	fr_tls_session_request_unbind(session->ssl);
 
@@ -1559,7 +1617,6 @@ static void session_init(fr_tls_session_t *session)
 	session->into_ssl = session->from_ssl = NULL;
 	record_init(&session->clean_in);
 	record_init(&session->clean_out);
-	record_init(&session->dirty_in);
 	record_init(&session->dirty_out);
 
 	memset(&session->info, 0, sizeof(session->info));
@@ -1839,7 +1896,9 @@ fr_tls_session_t *fr_tls_session_init_server(TALLOC_CTX *ctx, fr_tls_conf_t *con
 		session->mtu = vp->vp_uint32;
 	}
 
-	if (conf->session_cache_server) session->allow_session_resumption = true; /* otherwise it's false */
+	if (conf->session_cache_server || conf->session_cache_store) {
+		session->allow_session_resumption = true; /* otherwise it's false */
+	}
 
 	fr_tls_session_request_unbind(session->ssl);
 
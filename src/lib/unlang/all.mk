@@ -13,6 +13,7 @@ SOURCES	:=	base.c \
 		map.c \
 		module.c \
 		parallel.c \
+		profile.c \
 		return.c \
 		subrequest.c \
 		switch.c \
@@ -92,6 +92,8 @@ int unlang_init(void)
 	unlang_call_init();
 	unlang_tmpl_init();
 
+	if (unlang_profile_init() < 0) return -1;
+
 	return 0;
 }
 
@@ -43,6 +43,10 @@ int		unlang_init(void);
 
 void		unlang_free(void);
 
+int		unlang_profile_print(FILE *fp);
+
+void		unlang_profile_rate_set(uint32_t rate);
+
 #ifdef __cplusplus
 }
 #endif
@@ -197,6 +197,12 @@ static unlang_action_t unlang_call(REQUEST *request, rlm_rcode_t *presult)
 	/*
 	 *	Note that we do NOT copy the Session-State list!  That
 	 *	contains state information for the parent.
+	 *
+	 *	The lists can't be shared with the parent, even though
+	 *	the child's changes are discarded.  Nothing stops the
+	 *	child's modules from editing pairs in place.  The
+	 *	copies are allocated from the child's pool, so they're
+	 *	released with it.
 	 */
 	if ((fr_pair_list_copy(child->packet,
 			       &child->packet->vps,
@@ -208,6 +214,7 @@ static unlang_action_t unlang_call(REQUEST *request, rlm_rcode_t *presult)
 			       &child->control,
 			       request->control) < 0)) {
 		REDEBUG("failed copying lists to child");
+		talloc_free(child);
 
 		*presult = RLM_MODULE_FAIL;
 		return UNLANG_ACTION_CALCULATE_RESULT;
@@ -406,6 +406,7 @@ static bool pass2_fixup_undefined(CONF_ITEM const *ci, vp_tmpl_t *vpt, vp_tmpl_r
 
 		vpt->tmpl_da = vpt->tmpl_unknown = unknown_da;
 		vpt->type = TMPL_TYPE_ATTR;
+		tmpl_link(vpt);
 		return true;
 	}
 
@@ -419,6 +420,7 @@ static bool pass2_fixup_undefined(CONF_ITEM const *ci, vp_tmpl_t *vpt, vp_tmpl_r
 
 	vpt->tmpl_da = da;
 	vpt->type = TMPL_TYPE_ATTR;
+	tmpl_link(vpt);
 	return true;
 }
 
@@ -1110,6 +1112,7 @@ int unlang_fixup_update(vp_map_t *map, UNUSED void *ctx)
 	case TMPL_TYPE_ATTR:
 	case TMPL_TYPE_LIST:
 		if (map->lhs->tmpl_num == NUM_ANY) map->lhs->tmpl_num = NUM_ALL;
+		tmpl_link(map->lhs);
 		break;
 
 	default:
@@ -1123,6 +1126,7 @@ int unlang_fixup_update(vp_map_t *map, UNUSED void *ctx)
 	case TMPL_TYPE_ATTR:
 	case TMPL_TYPE_LIST:
 		if (map->rhs->tmpl_num == NUM_ANY) map->rhs->tmpl_num = NUM_ALL;
+		tmpl_link(map->rhs);
 		break;
 
 	default:
@@ -1275,6 +1279,7 @@ int unlang_fixup_update(vp_map_t *map, UNUSED void *ctx)
 				return -1;
 			}
 			map->lhs->tmpl_da = da;
+			tmpl_link(map->lhs);
 		}
 	} /* else we can't precompile the data */
 
@@ -1326,6 +1331,7 @@ static int unlang_fixup_filter(vp_map_t *map, UNUSED void *ctx)
 	 *	Fixup LHS attribute references to change NUM_ANY to NUM_ALL.
 	 */
 	if (map->lhs->tmpl_num == NUM_ANY) map->lhs->tmpl_num = NUM_ALL;
+	tmpl_link(map->lhs);
 
 	/*
 	 *	Fixup RHS attribute references to change NUM_ANY to NUM_ALL.
@@ -1333,6 +1339,7 @@ static int unlang_fixup_filter(vp_map_t *map, UNUSED void *ctx)
 	if ((map->rhs->type == TMPL_TYPE_ATTR) &&
 	    (map->rhs->tmpl_num == NUM_ANY)) {
 		map->rhs->tmpl_num = NUM_ALL;
+		tmpl_link(map->rhs);
 	}
 
 	/*
@@ -1405,6 +1412,7 @@ static int unlang_fixup_filter(vp_map_t *map, UNUSED void *ctx)
 				return -1;
 			}
 			map->lhs->tmpl_da = da;
+			tmpl_link(map->lhs);
 		}
 	} /* else we can't precompile the data */
 
@@ -1971,6 +1979,56 @@ static bool compile_action_subsection(unlang_t *c, CONF_SECTION *cs, CONF_SECTIO
 }
 
 
+/** Parse one of the options of a "parallel" section
+ *
+ *	parallel {
+ *		concurrency = 2		# at most 2 children running at once
+ *		first = 1		# finish once 1 child succeeds
+ *		timeout = 1.5		# fail children which run for longer
+ *		...
+ *	}
+ */
+static bool compile_parallel_option(unlang_group_t *g, CONF_PAIR *cp)
+{
+	char const	*attr = cf_pair_attr(cp);
+	char const	*value = cf_pair_value(cp);
+	unsigned long	num;
+	char		*end;
+
+	if (strcmp(attr, "timeout") == 0) {
+		if (fr_time_delta_from_str(&g->timeout, value, FR_TIME_RES_SEC) < 0) {
+			cf_log_perr(cp, "Invalid value for 'timeout'");
+			return false;
+		}
+
+		if (g->timeout <= 0) {
+			cf_log_err(cp, "Invalid value for 'timeout' - must be greater than zero");
+			return false;
+		}
+
+		return true;
+	}
+
+	if ((strcmp(attr, "concurrency") != 0) && (strcmp(attr, "first") != 0)) {
+		cf_log_err(cp, "Invalid option \"%s\" for 'parallel'", attr);
+		return false;
+	}
+
+	num = strtoul(value, &end, 10);
+	if (*end || (num == 0) || (num > INT_MAX)) {
+		cf_log_err(cp, "Invalid value for '%s' - must be a positive integer", attr);
+		return false;
+	}
+
+	if (attr[0] == 'c') {
+		g->concurrency = num;
+	} else {
+		g->first = num;
+	}
+
+	return true;
+}
+
 static unlang_t *compile_children(unlang_group_t *g, unlang_t *parent, unlang_compile_t *unlang_ctx)
 {
 	CONF_ITEM *ci = NULL;
@@ -2080,6 +2138,12 @@ static unlang_t *compile_children(unlang_group_t *g, unlang_t *parent, unlang_co
 					return NULL;
 				}
 
+			} else if (c->type == UNLANG_TYPE_PARALLEL) {
+				if (!compile_parallel_option(g, cp)) {
+					talloc_free(c);
+					return NULL;
+				}
+
 			} else if (!parent || (parent->type != UNLANG_TYPE_MODULE)) {
 				cf_log_err(cp, "Invalid location for action over-ride");
 				talloc_free(c);
@@ -2144,6 +2208,90 @@ static unlang_t *compile_group(unlang_t *parent, unlang_compile_t *unlang_ctx, C
 	return compile_section(parent, unlang_ctx, cs, UNLANG_TYPE_GROUP);
 }
 
+static uint32_t _switch_case_hash(void const *data)
+{
+	fr_value_box_t const *value = ((unlang_switch_case_t const *)data)->value;
+
+	switch (value->type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+		return fr_hash(value->vb_octets, value->datum.length);
+
+	default:
+		return fr_hash((uint8_t const *)value + fr_value_box_offsets[value->type],
+			       fr_value_box_field_sizes[value->type]);
+	}
+}
+
+static int _switch_case_cmp(void const *one, void const *two)
+{
+	unlang_switch_case_t const *a = one, *b = two;
+
+	return fr_value_box_cmp(a->value, b->value);
+}
+
+/** Index the literal case statements of a switch over an attribute
+ *
+ * Case statements are otherwise compared with the attribute one by one, in
+ * order.  The index is only built for types where fr_value_box_cmp() is an
+ * exact equality test, so a lookup finds the same case statement the linear
+ * search would have.
+ */
+static void compile_switch_cases(unlang_group_t *g)
+{
+	unlang_t		*this;
+	int			i;
+
+	if (!tmpl_is_attr(g->vpt)) return;
+
+	switch (g->vpt->tmpl_da->type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+	case FR_TYPE_UINT8:
+	case FR_TYPE_UINT16:
+	case FR_TYPE_UINT32:
+	case FR_TYPE_UINT64:
+	case FR_TYPE_INT8:
+	case FR_TYPE_INT16:
+	case FR_TYPE_INT32:
+	case FR_TYPE_INT64:
+	case FR_TYPE_SIZE:
+	case FR_TYPE_ETHERNET:
+		break;
+
+	default:
+		return;
+	}
+
+	MEM(g->cases = fr_hash_table_create(g, _switch_case_hash, _switch_case_cmp, NULL));
+
+	for (this = g->children, i = 0; this; this = this->next, i++) {
+		unlang_group_t		*h = unlang_generic_to_group(this);
+		unlang_switch_case_t	*entry;
+
+		if (!h->vpt) {
+			if (!g->default_case) g->default_case = this;
+			continue;
+		}
+
+		if (!tmpl_is_data(h->vpt) || (h->vpt->tmpl_value_type != g->vpt->tmpl_da->type)) {
+			g->dynamic_cases = true;
+			continue;
+		}
+
+		MEM(entry = talloc_zero(g->cases, unlang_switch_case_t));
+		entry->value = &h->vpt->tmpl_value;
+		entry->instruction = this;
+		entry->index = i;
+
+		/*
+		 *	Duplicate values can never match, as the
+		 *	earlier case statement always wins.
+		 */
+		if (fr_hash_table_insert(g->cases, entry) < 0) talloc_free(entry);
+	}
+}
+
 static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs)
 {
 	CONF_ITEM *ci;
@@ -2253,7 +2401,12 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		return NULL;
 	}
 
-	return compile_children(g, parent, unlang_ctx);
+	c = compile_children(g, parent, unlang_ctx);
+	if (!c) return NULL;
+
+	compile_switch_cases(g);
+
+	return c;
 }
 
 static unlang_t *compile_case(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs)
@@ -2383,6 +2536,51 @@ static unlang_t *compile_case(unlang_t *parent, unlang_compile_t *unlang_ctx, CO
 	return c;
 }
 
+/** Whether the body of a foreach loop may modify the list it's iterating over
+ *
+ * Only conditions, and updates of other lists are known to be safe.
+ * Anything else (modules, policies, subrequests...) may do whatever
+ * it wants.
+ */
+static bool foreach_body_modifies_list(unlang_t *c, vp_tmpl_t const *vpt)
+{
+	unlang_group_t const	*g;
+	vp_map_t const		*map;
+
+	for (; c; c = c->next) {
+		switch (c->type) {
+		case UNLANG_TYPE_BREAK:
+		case UNLANG_TYPE_RETURN:
+			break;
+
+		case UNLANG_TYPE_GROUP:
+		case UNLANG_TYPE_IF:
+		case UNLANG_TYPE_ELSE:
+		case UNLANG_TYPE_ELSIF:
+		case UNLANG_TYPE_SWITCH:
+		case UNLANG_TYPE_CASE:
+		case UNLANG_TYPE_FOREACH:
+			g = unlang_generic_to_group(c);
+			if (foreach_body_modifies_list(g->children, vpt)) return true;
+			break;
+
+		case UNLANG_TYPE_UPDATE:
+		case UNLANG_TYPE_FILTER:
+			g = unlang_generic_to_group(c);
+			for (map = g->map; map; map = map->next) {
+				if (!tmpl_is_attr(map->lhs) && !tmpl_is_list(map->lhs)) return true;
+				if (map->lhs->tmpl_list == vpt->tmpl_list) return true;
+			}
+			break;
+
+		default:
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static unlang_t *compile_foreach(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs)
 {
 	FR_TOKEN		type;
@@ -2460,6 +2658,7 @@ static unlang_t *compile_foreach(unlang_t *parent, unlang_compile_t *unlang_ctx,
 	 *	foreach &attr[*], but that's taking the consistency thing a bit far.
 	 */
 	vpt->tmpl_num = NUM_ALL;
+	tmpl_link(vpt);
 
 	c = compile_section(parent, unlang_ctx, cs, UNLANG_TYPE_FOREACH);
 	if (!c) {
@@ -2469,6 +2668,7 @@ static unlang_t *compile_foreach(unlang_t *parent, unlang_compile_t *unlang_ctx,
 
 	g = unlang_generic_to_group(c);
 	g->vpt = vpt;
+	g->in_place = !foreach_body_modifies_list(g->children, vpt);
 
 	return c;
 }
@@ -2628,6 +2828,7 @@ static unlang_t *compile_if_subsection(unlang_t *parent, unlang_compile_t *unlan
 	 *	them up.
 	 */
 	if (!fr_cond_walk(cond, pass2_cond_callback, unlang_ctx)) return NULL;
+	cond_eval_prepare(cond);
 
 	c = compile_section(parent, unlang_ctx, cs, mod_type);
 	if (!c) return NULL;
@@ -2837,6 +3038,15 @@ static unlang_t *compile_load_balance_subsection(unlang_t *parent, unlang_compil
 		if (strcmp(cf_section_name1(cf_item_to_section(cf_parent(cs))), "instantiate") == 0) name2 = NULL;
 	}
 
+	/*
+	 *	"least-loaded" isn't a key.  It asks the modules which
+	 *	one is least busy.
+	 */
+	if (name2 && (cf_section_name2_quote(cs) == T_BARE_WORD) && (strcmp(name2, "least-loaded") == 0)) {
+		g->least_loaded = true;
+		name2 = NULL;
+	}
+
 	if (name2) {
 		FR_TOKEN type;
 		ssize_t slen;
@@ -2939,6 +3149,22 @@ static unlang_t *compile_parallel(unlang_t *parent, unlang_compile_t *unlang_ctx
 	g->clone = clone;
 	g->detach = detach;
 
+	/*
+	 *	Detached children aren't waited for, so
+	 *	there's nothing to limit, or to time out.
+	 */
+	if (detach && (g->concurrency || g->first || g->timeout)) {
+		cf_log_err(cs, "'parallel detach' cannot have 'concurrency', 'first', or 'timeout'");
+		talloc_free(c);
+		return NULL;
+	}
+
+	if (g->first > g->num_children) {
+		cf_log_err(cs, "'first' cannot be greater than the number of children (%d)", g->num_children);
+		talloc_free(c);
+		return NULL;
+	}
+
 	return c;
 }
 
@@ -140,6 +140,24 @@ static inline void frame_state_init(unlang_stack_t *stack, unlang_stack_frame_t
 		}
 #endif
 		else {
+			void *cache = frame->state_cache;
+
+			/*
+			 *	Sibling instructions at the same depth
+			 *	usually need the same type of state, so
+			 *	recycle the previous one rather than
+			 *	carving a new chunk out of the stack pool
+			 *	for every instruction.
+			 */
+			if (cache && (talloc_get_size(cache) == op->frame_state_size) &&
+			    (strcmp(talloc_get_name(cache), name) == 0)) {
+				memset(cache, 0, op->frame_state_size);
+				frame->state = cache;
+				frame->state_cache = NULL;
+				return;
+			}
+
+			TALLOC_FREE(frame->state_cache);
 			MEM(frame->state = _talloc_zero(stack, op->frame_state_size, name));
 		}
 	}
@@ -160,6 +178,7 @@ void unlang_interpret_push(REQUEST *request, unlang_t *instruction,
 {
 	unlang_stack_t		*stack = request->stack;
 	unlang_stack_frame_t	*frame;
+	void			*state_cache;
 
 	fr_assert(instruction || top_frame);
 
@@ -179,10 +198,13 @@ void unlang_interpret_push(REQUEST *request, unlang_t *instruction,
 	stack->depth++;
 
 	/*
-	 *	Initialize the next stack frame.
+	 *	Initialize the next stack frame, keeping any
+	 *	state left for reuse by the last frame at this depth.
 	 */
 	frame = &stack->frame[stack->depth];
+	state_cache = frame->state_cache;
 	memset(frame, 0, sizeof(*frame));
+	frame->state_cache = state_cache;
 
 	frame->instruction = instruction;
 
@@ -340,7 +362,33 @@ static inline void frame_cleanup(unlang_stack_frame_t *frame)
 	break_point_clear(frame);
 	return_point_clear(frame);
 	yielded_clear(frame);
-	if (frame->state) TALLOC_FREE(frame->state);
+
+	if (!frame->state) return;
+
+	/*
+	 *	States allocated by frame_state_init() have no
+	 *	destructors, so can be kept for the next instruction
+	 *	at this depth once anything hanging off them is freed.
+	 *
+	 *	States allocated by the ops themselves may rely on
+	 *	being freed here, so only ever cache the type the
+	 *	op told us about.
+	 */
+	if (frame->instruction) {
+		unlang_op_t const *op = &unlang_ops[frame->instruction->type];
+
+		if (op->frame_state_size && op->frame_state_name && !op->frame_state_pool_size &&
+		    (talloc_get_size(frame->state) == op->frame_state_size) &&
+		    (strcmp(talloc_get_name(frame->state), op->frame_state_name) == 0)) {
+			talloc_free_children(frame->state);
+			TALLOC_FREE(frame->state_cache);
+			frame->state_cache = frame->state;
+			frame->state = NULL;
+			return;
+		}
+	}
+
+	TALLOC_FREE(frame->state);
 }
 
 /** Advance to the next sibling instruction
@@ -427,6 +475,9 @@ static inline unlang_frame_action_t frame_eval(REQUEST *request, unlang_stack_fr
 		if (is_yielded(frame)) {
 			RDEBUG("%s - Resuming execution", instruction->debug_name);
 			yielded_clear(frame);
+
+			if (stack->profile) unlang_profile_record(stack, frame, instruction,
+								  0, fr_time() - frame->yielded);
 		}
 
 		/*
@@ -460,7 +511,14 @@ static inline unlang_frame_action_t frame_eval(REQUEST *request, unlang_stack_fr
 			unlang_ops[instruction->type].name);
 
 		fr_assert(frame->interpret != NULL);
-		action = frame->interpret(request, result);
+		if (!stack->profile) {
+			action = frame->interpret(request, result);
+		} else {
+			fr_time_t start = fr_time();
+
+			action = frame->interpret(request, result);
+			unlang_profile_record(stack, frame, instruction, fr_time() - start, 0);
+		}
 
 		RDEBUG4("** [%i] %s << %s (%d)", stack->depth, __FUNCTION__,
 			fr_table_str_by_value(unlang_action_table, action, "<INVALID>"), *priority);
@@ -525,6 +583,7 @@ static inline unlang_frame_action_t frame_eval(REQUEST *request, unlang_stack_fr
 			case UNLANG_TYPE_TMPL:
 				repeatable_set(frame);
 				yielded_set(frame);
+				if (stack->profile) frame->yielded = fr_time();
 				RDEBUG4("** [%i] %s - yielding with current (%s %d)", stack->depth, __FUNCTION__,
 					fr_table_str_by_value(mod_rcode_table, frame->result, "<invalid>"),
 					frame->priority);
@@ -1011,6 +1070,7 @@ void *unlang_interpret_stack_alloc(TALLOC_CTX *ctx)
 	 */
 	stack = talloc_zero_pooled_object(ctx, unlang_stack_t, UNLANG_STACK_MAX, 128);	/* 128 bytes per state */
 	stack->result = RLM_MODULE_UNKNOWN;
+	stack->profile = unlang_profile_sample();
 
 	return stack;
 }
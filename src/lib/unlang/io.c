@@ -63,26 +63,11 @@ rlm_rcode_t unlang_io_process_interpret(UNUSED void *instance, UNUSED void *thre
 	return RLM_MODULE_HANDLED;
 }
 
-/** Allocate a child request based on the parent.
+/** Copy the per-round information from the parent to the child
  *
- * @param[in] parent		spawning the child request.
- * @param[in] namespace		the child request operates in. If NULL the parent's namespace is used.
- * @param[in] detachable	Allow/disallow the child to be detached.
- * @return
- *      - The new child request.
- *	- NULL on error.
  */
-REQUEST *unlang_io_subrequest_alloc(REQUEST *parent, fr_dict_t const *namespace, bool detachable)
+static void unlang_io_subrequest_init(REQUEST *parent, REQUEST *child)
 {
-	REQUEST			*child;
-
-	if (!detachable) {
-		child = request_alloc_fake(parent, namespace);
-	} else {
-		child = request_alloc_detachable(parent, namespace);
-	}
-	if (!child) return NULL;
-
 	/*
 	 *	Push the child, and set it's top frame to be true.
 	 */
@@ -100,14 +85,39 @@ REQUEST *unlang_io_subrequest_alloc(REQUEST *parent, fr_dict_t const *namespace,
 	child->server_cs = parent->server_cs;
 	child->backlog = parent->backlog;
 
+#define COPY_FIELD(_x) child->async->_x = parent->async->_x
+	COPY_FIELD(listen);
+	COPY_FIELD(recv_time);
+#undef COPY_FIELD
+}
+
+/** Allocate a child request based on the parent.
+ *
+ * Children come from the same per-thread free list as other requests, so
+ * freeing a child resets it and returns it to the list.  It's not released.
+ *
+ * @param[in] parent		spawning the child request.
+ * @param[in] namespace		the child request operates in. If NULL the parent's namespace is used.
+ * @param[in] detachable	Allow/disallow the child to be detached.
+ * @return
+ *      - The new child request.
+ *	- NULL on error.
+ */
+REQUEST *unlang_io_subrequest_alloc(REQUEST *parent, fr_dict_t const *namespace, bool detachable)
+{
+	REQUEST			*child;
+
+	if (!detachable) {
+		child = request_alloc_fake(parent, namespace);
+	} else {
+		child = request_alloc_detachable(parent, namespace);
+	}
+	if (!child) return NULL;
+
 	/*
 	 *	Initialize all of the async fields.
 	 */
 	child->async = talloc_zero(child, fr_async_t);
-
-#define COPY_FIELD(_x) child->async->_x = parent->async->_x
-	COPY_FIELD(listen);
-	COPY_FIELD(recv_time);
 	child->async->fake = true;
 
 	/*
@@ -117,5 +127,27 @@ REQUEST *unlang_io_subrequest_alloc(REQUEST *parent, fr_dict_t const *namespace,
 	 */
 	child->async->process = unlang_io_process_interpret;
 
+	unlang_io_subrequest_init(parent, child);
+
 	return child;
 }
+
+/** Re-attach a detached child request to a new parent
+ *
+ * The child must have been allocated as detachable, and must not
+ * currently be running.
+ *
+ * @param[in] parent		the child should run under.
+ * @param[in] child		to re-attach.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int unlang_io_subrequest_reattach(REQUEST *parent, REQUEST *child)
+{
+	if (request_reattach(parent, child) < 0) return -1;
+
+	unlang_io_subrequest_init(parent, child);
+
+	return 0;
+}
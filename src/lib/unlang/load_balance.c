@@ -29,6 +29,58 @@
 
 #define unlang_redundant_load_balance unlang_load_balance
 
+/** Find the least loaded child
+ *
+ * Only modules which provide a load callback are scored.  Everything
+ * else is treated as unavailable, and is only picked if nothing else
+ * is available.  Ties are broken randomly, so that idle modules share
+ * the load.
+ */
+static unlang_t *load_balance_least_loaded(REQUEST *request, unlang_group_t *g)
+{
+	unlang_t	*child, *found = g->children;
+	uint64_t	load, lowest = MODULE_LOAD_UNAVAILABLE;
+	uint32_t	count = 0;
+
+	for (child = g->children; child != NULL; child = child->next) {
+		unlang_module_t		*sp;
+		module_instance_t	*mi;
+
+		load = MODULE_LOAD_UNAVAILABLE;
+
+		if (child->type == UNLANG_TYPE_MODULE) {
+			sp = unlang_generic_to_module(child);
+			mi = sp->module_instance;
+
+			if (mi->module->load_score && !mi->force) {
+				load = mi->module->load_score(mi->dl_inst->data, module_thread(mi)->data);
+			}
+		}
+
+		RDEBUG4("%s has load %" PRIu64, child->debug_name, load);
+
+		if (load > lowest) continue;
+
+		if (load < lowest) {
+			lowest = load;
+			found = child;
+			count = 1;
+			continue;
+		}
+
+		/*
+		 *	Equal load, choose one of the children
+		 *	with that load at random.
+		 */
+		count++;
+		if ((count * (fr_rand() & 0xffffff)) < (uint32_t) 0x1000000) found = child;
+	}
+
+	RDEBUG3("load-balance chose least loaded child %s", found->debug_name);
+
+	return found;
+}
+
 static unlang_action_t unlang_load_balance_next(REQUEST *request, rlm_rcode_t *presult)
 {
 	unlang_stack_t			*stack = request->stack;
@@ -126,7 +178,10 @@ static unlang_action_t unlang_load_balance(REQUEST *request, rlm_rcode_t *presul
 
 	redundant = talloc_get_type_abort(frame->state, unlang_frame_state_redundant_t);
 
-	if (g->vpt) {
+	if (g->least_loaded) {
+		redundant->found = load_balance_least_loaded(request, g);
+
+	} else if (g->vpt) {
 		uint32_t hash, start;
 		ssize_t slen;
 		char const *p = NULL;
@@ -30,6 +30,8 @@ RCSID("$Id$")
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/request_data.h>
+#include <freeradius-devel/server/trace.h>
+#include <freeradius-devel/util/probe.h>
 #include <freeradius-devel/unlang/base.h>
 #include "unlang_priv.h"
 #include "module_priv.h"
@@ -52,6 +54,15 @@ typedef struct {
 	fr_event_timer_t const		*ev;		//!< Event in this worker's event heap.
 } unlang_module_event_t;
 
+static fr_metric_t	*module_calls_metric;		//!< Completed module calls by module and result.
+static fr_metric_t	*module_call_time_metric;	//!< Module call duration by module.
+static fr_metric_t	*module_cpu_time_metric;	//!< CPU time per call, by module.
+static fr_metric_t	*module_yield_time_metric;	//!< Time spent yielded per call, by module.
+static fr_metric_t	*module_request_memory_metric;	//!< Bytes allocated from requests, by module.
+static fr_metric_t	*module_thread_memory_metric;	//!< Size of thread instance data, by module.
+
+#define MODULE_THREAD_MEMORY_INTERVAL	64		//!< Measure the thread instance data every N calls.
+
 /** Call the callback registered for a read I/O event
  *
  * @param[in] el	containing the event (not passed to the callback).
@@ -401,6 +412,37 @@ REQUEST *unlang_module_subrequest_alloc(REQUEST *parent, fr_dict_t const *namesp
 	return unlang_io_subrequest_alloc(parent, namespace, UNLANG_NORMAL_CHILD);
 }
 
+/** Allocate a subrequest which can be kept across multiple rounds of a conversation
+ *
+ * Once the subrequest has finished, the module should call #request_detach
+ * with will_free=false, and bind the subrequest's lifetime to its own
+ * session data.  On the next round, #unlang_module_subrequest_reattach
+ * makes it runnable again under the new parent.
+ *
+ * @param[in] parent		to hang sub request off of.
+ * @param[in] namespace		the child will operate in.
+ * @return
+ *	- A new child request.
+ *	- NULL on failure.
+ */
+REQUEST *unlang_module_subrequest_alloc_detachable(REQUEST *parent, fr_dict_t const *namespace)
+{
+	return unlang_io_subrequest_alloc(parent, namespace, UNLANG_DETACHABLE);
+}
+
+/** Re-attach a subrequest allocated with #unlang_module_subrequest_alloc_detachable
+ *
+ * @param[in] parent		the subrequest should now run under.
+ * @param[in] child		to re-attach.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int unlang_module_subrequest_reattach(REQUEST *parent, REQUEST *child)
+{
+	return unlang_io_subrequest_reattach(parent, child);
+}
+
 /** Yield, spawning a child request, and resuming once the child request is complete
  *
  * @param[in] out		Final rcode from when evaluation of the child request finishes.
@@ -573,6 +615,126 @@ static inline void safe_unlock(module_instance_t *instance)
 	if (instance->mutex) pthread_mutex_unlock(instance->mutex);
 }
 
+/** Update the metrics for a module call which has completed
+ *
+ * The series for each module are cached in its thread instance data.
+ */
+static void unlang_module_metrics(unlang_module_t const *sp, unlang_frame_state_module_t *state, rlm_rcode_t rcode)
+{
+	module_thread_instance_t	*thread = state->thread;
+	char				name[128], labels[256];
+
+	if (!thread->call_time || !thread->calls[rcode]) {
+		fr_metric_label_escape(name, sizeof(name), sp->module_instance->name);
+
+		if (!thread->call_time) {
+			snprintf(labels, sizeof(labels), "module=\"%s\"", name);
+			thread->call_time = fr_metric_series(module_call_time_metric, labels);
+		}
+
+		if (!thread->calls[rcode]) {
+			snprintf(labels, sizeof(labels), "module=\"%s\",rcode=\"%s\"", name,
+				 fr_table_str_by_value(mod_rcode_table, rcode, "<invalid>"));
+			thread->calls[rcode] = fr_metric_series(module_calls_metric, labels);
+		}
+	}
+
+	fr_metric_inc(thread->calls[rcode], 1);
+	fr_metric_observe(thread->call_time, fr_time() - state->start);
+}
+
+/** CPU time used by the current thread
+ *
+ */
+static inline fr_time_delta_t unlang_module_thread_cpu(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0) return 0;
+
+	return fr_time_delta_from_timespec(&ts);
+}
+
+/** Note the resources in use before entering a module
+ *
+ * Only called for modules with a "resources" section.
+ */
+static void unlang_module_resources_enter(REQUEST *request, unlang_frame_state_module_t *state)
+{
+	if (state->yielded) {
+		state->yield_time += fr_time() - state->yielded;
+		state->yielded = 0;
+	}
+
+	state->memory_start = talloc_total_size(request);
+	state->cpu_start = unlang_module_thread_cpu();
+}
+
+/** Add the resources used since entering the module
+ *
+ * If the call has completed, record its totals, and check them against
+ * the module's soft limits.
+ */
+static void unlang_module_resources_exit(REQUEST *request, unlang_module_t const *sp,
+					 unlang_frame_state_module_t *state, rlm_rcode_t rcode)
+{
+	module_thread_instance_t	*thread = state->thread;
+	module_resources_t const	*limits = sp->module_instance->resources;
+	size_t				size;
+	char				name[128], labels[256];
+
+	state->cpu_used += unlang_module_thread_cpu() - state->cpu_start;
+	size = talloc_total_size(request);
+	if (size > state->memory_start) state->memory_used += size - state->memory_start;
+
+	if (rcode == RLM_MODULE_YIELD) {
+		state->yielded = fr_time();
+		return;
+	}
+
+	if (!thread->cpu_time) {
+		fr_metric_label_escape(name, sizeof(name), sp->module_instance->name);
+		snprintf(labels, sizeof(labels), "module=\"%s\"", name);
+
+		thread->cpu_time = fr_metric_series(module_cpu_time_metric, labels);
+		thread->yield_time = fr_metric_series(module_yield_time_metric, labels);
+		thread->request_memory = fr_metric_series(module_request_memory_metric, labels);
+		thread->thread_memory = fr_metric_series(module_thread_memory_metric, labels);
+	}
+
+	fr_metric_observe(thread->cpu_time, state->cpu_used);
+	fr_metric_observe(thread->yield_time, state->yield_time);
+	fr_metric_inc(thread->request_memory, state->memory_used);
+
+	if (limits->max_cpu_time && (state->cpu_used > limits->max_cpu_time)) {
+		RATE_LIMIT_LOCAL_ROPTIONAL(&thread->resources_log, RWARN, WARN,
+					   "Module %s used %pV of CPU, over its limit of %pV",
+					   sp->module_instance->name, fr_box_time_delta(state->cpu_used),
+					   fr_box_time_delta(limits->max_cpu_time));
+	}
+
+	if (limits->max_request_memory && (state->memory_used > limits->max_request_memory)) {
+		RATE_LIMIT_LOCAL_ROPTIONAL(&thread->resources_log, RWARN, WARN,
+					   "Module %s allocated %zu bytes, over its limit of %zu",
+					   sp->module_instance->name, state->memory_used, limits->max_request_memory);
+	}
+
+	/*
+	 *	Walking the thread instance data is expensive, so
+	 *	only do it occasionally.
+	 */
+	if ((thread->accounted_calls++ % MODULE_THREAD_MEMORY_INTERVAL) == 0) {
+		size = thread->data ? talloc_total_size(thread->data) : 0;
+		fr_metric_set(thread->thread_memory, size);
+
+		if (limits->max_thread_memory && (size > limits->max_thread_memory)) {
+			RATE_LIMIT_LOCAL_ROPTIONAL(&thread->resources_log, RWARN, WARN,
+						   "Module %s thread data is %zu bytes, over its limit of %zu",
+						   sp->module_instance->name, size, limits->max_thread_memory);
+		}
+	}
+}
+
 /** Send a signal (usually stop) to a request
  *
  * This is typically called via an "async" action, i.e. an action
@@ -648,10 +810,13 @@ static unlang_action_t unlang_module_resume(REQUEST *request, rlm_rcode_t *presu
 	caller = request->module;
 	request->module = sp->module_instance->name;
 
+	FR_PROBE3(module_resume, request->number, request->packet->code, sp->module_instance->name);
+	if (unlikely(sp->module_instance->resources != NULL)) unlang_module_resources_enter(request, state);
 	safe_lock(sp->module_instance);
 	rcode = request->rcode = state->resume(sp->module_instance->dl_inst->data,
 					       state->thread->data, request, state->rctx);
 	safe_unlock(sp->module_instance);
+	if (unlikely(sp->module_instance->resources != NULL)) unlang_module_resources_exit(request, sp, state, rcode);
 	request->module = caller;
 
 	/*
@@ -674,6 +839,7 @@ static unlang_action_t unlang_module_resume(REQUEST *request, rlm_rcode_t *presu
 		fr_table_str_by_value(mod_rcode_table, rcode, "<invalid>"));
 
 	if (rcode == RLM_MODULE_YIELD) {
+		FR_PROBE3(module_yield, request->number, request->packet->code, sp->module_instance->name);
 		if (stack_depth < stack->depth) return UNLANG_ACTION_PUSHED_CHILD;
 		fr_assert(stack_depth == stack->depth);
 		*presult = rcode;
@@ -681,6 +847,9 @@ static unlang_action_t unlang_module_resume(REQUEST *request, rlm_rcode_t *presu
 	}
 
 	state->thread->active_callers--;
+	unlang_module_metrics(sp, state, rcode);
+	FR_PROBE4(module_return, request->number, request->packet->code, sp->module_instance->name, rcode);
+	if (request->trace) fr_trace_span_end(request, state->span, (rcode == RLM_MODULE_FAIL));
 
 	/*
 	 *	The module is done.  But, running it pushed one or
@@ -795,9 +964,19 @@ static unlang_action_t unlang_module(REQUEST *request, rlm_rcode_t *presult)
 
 	caller = request->module;
 	request->module = sp->module_instance->name;
+	state->start = fr_time();
+	FR_PROBE3(module_call, request->number, request->packet->code, sp->module_instance->name);
+	state->span = fr_trace_span_start(request, sp->module_instance->name, FR_TRACE_SPAN_INTERNAL);
+	if (unlikely(sp->module_instance->resources != NULL)) {
+		state->cpu_used = state->yield_time = 0;
+		state->memory_used = 0;
+		state->yielded = 0;
+		unlang_module_resources_enter(request, state);
+	}
 	safe_lock(sp->module_instance);	/* Noop unless instance->mutex set */
 	rcode = sp->method(sp->module_instance->dl_inst->data, state->thread->data, request);
 	safe_unlock(sp->module_instance);
+	if (unlikely(sp->module_instance->resources != NULL)) unlang_module_resources_exit(request, sp, state, rcode);
 	request->module = caller;
 
 	/*
@@ -820,6 +999,7 @@ static unlang_action_t unlang_module(REQUEST *request, rlm_rcode_t *presult)
 
 
 	if (rcode == RLM_MODULE_YIELD) {
+		FR_PROBE3(module_yield, request->number, request->packet->code, sp->module_instance->name);
 		state->thread->active_callers++;
 		if (stack_depth < stack->depth) return UNLANG_ACTION_PUSHED_CHILD;
 		fr_assert(stack_depth == stack->depth);
@@ -828,6 +1008,10 @@ static unlang_action_t unlang_module(REQUEST *request, rlm_rcode_t *presult)
 		return UNLANG_ACTION_YIELD;
 	}
 
+	unlang_module_metrics(sp, state, rcode);
+	FR_PROBE4(module_return, request->number, request->packet->code, sp->module_instance->name, rcode);
+	if (request->trace) fr_trace_span_end(request, state->span, (rcode == RLM_MODULE_FAIL));
+
 done:
 	fr_assert(unlang_indent == request->log.unlang_indent);
 	fr_assert(rcode >= RLM_MODULE_REJECT);
@@ -854,6 +1038,25 @@ done:
 
 void unlang_module_init(void)
 {
+	module_calls_metric = fr_metric_register("freeradius_module_calls",
+						 "Completed module calls, by module and result.",
+						 FR_METRIC_COUNTER);
+	module_call_time_metric = fr_metric_register("freeradius_module_call_duration_seconds",
+						     "Time from calling a module to it completing, by module.",
+						     FR_METRIC_HISTOGRAM);
+	module_cpu_time_metric = fr_metric_register(MODULE_METRIC_CPU_TIME,
+						    "CPU time used by each module call, by module.",
+						    FR_METRIC_HISTOGRAM);
+	module_yield_time_metric = fr_metric_register(MODULE_METRIC_YIELD_TIME,
+						      "Time each module call spent yielded, by module.",
+						      FR_METRIC_HISTOGRAM);
+	module_request_memory_metric = fr_metric_register(MODULE_METRIC_REQUEST_MEMORY,
+							  "Bytes allocated from requests by module calls, by module.",
+							  FR_METRIC_COUNTER);
+	module_thread_memory_metric = fr_metric_register(MODULE_METRIC_THREAD_MEMORY,
+							 "Size of the thread instance data, by module.",
+							 FR_METRIC_GAUGE);
+
 	unlang_register(UNLANG_TYPE_MODULE,
 			   &(unlang_op_t){
 				.name = "module",
@@ -113,6 +113,10 @@ void		unlang_module_push(rlm_rcode_t *out, REQUEST *request,
 
 REQUEST		*unlang_module_subrequest_alloc(REQUEST *parent, fr_dict_t const *namespace);
 
+REQUEST		*unlang_module_subrequest_alloc_detachable(REQUEST *parent, fr_dict_t const *namespace);
+
+int		unlang_module_subrequest_reattach(REQUEST *parent, REQUEST *child);
+
 rlm_rcode_t	unlang_module_yield_to_subrequest(rlm_rcode_t *out, REQUEST *child,
 						  fr_unlang_module_resume_t resume,
 						  fr_unlang_module_signal_t signal,
@@ -49,6 +49,18 @@ typedef struct {
 	void				*rctx;			//!< for resume / signal
 	fr_unlang_module_resume_t	resume;			//!< resumption handler
 	fr_unlang_module_signal_t	signal;			//!< for signal handlers
+	fr_time_t			start;			//!< When the module was called.
+	int				span;			//!< Trace span for the call, if the request is traced.
+
+	/*
+	 *	Only used if the module has a "resources" section.
+	 */
+	fr_time_delta_t			cpu_start;		//!< Thread CPU time when the module was entered.
+	size_t				memory_start;		//!< Size of the request when the module was entered.
+	fr_time_delta_t			cpu_used;		//!< CPU time used so far, over all resumptions.
+	size_t				memory_used;		//!< Bytes allocated from the request so far.
+	fr_time_t			yielded;		//!< When the module last yielded.
+	fr_time_delta_t			yield_time;		//!< Time spent yielded so far.
 } unlang_frame_state_module_t;
 
 static inline unlang_module_t *unlang_generic_to_module(unlang_t *p)
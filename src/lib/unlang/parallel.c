@@ -61,6 +61,20 @@ static unlang_action_t unlang_parallel_child_done(REQUEST *request, UNUSED rlm_r
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
+/** A child has run for too long
+ *
+ * Mark it as timed out, and resume the parent, which cancels it.
+ */
+static void unlang_parallel_child_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	unlang_parallel_child_t *child = uctx;
+	REQUEST			*request = child->child;
+
+	RWDEBUG("Timed out - cancelling");
+
+	child->timed_out = true;
+	unlang_interpret_resumable(request->parent);
+}
 
 /** Run one or more sub-sections from the parallel section.
  *
@@ -90,7 +104,9 @@ static unlang_action_t unlang_parallel_process(REQUEST *request, rlm_rcode_t *pr
 	 *	Loop over all the children.
 	 *
 	 *	We always service the parallel section from top to
-	 *	bottom, and we always service all of it.
+	 *	bottom, and we always service all of it.  Children
+	 *	are started in order, so any children waiting for
+	 *	a free slot always come after the running ones.
 	 */
 	for (i = 0; i < state->num_children; i++) {
 		switch (state->children[i].state) {
@@ -98,6 +114,16 @@ static unlang_action_t unlang_parallel_process(REQUEST *request, rlm_rcode_t *pr
 			 *	Create the child and then run it.
 			 */
 		case CHILD_INIT:
+			/*
+			 *	Too many children are running, wait
+			 *	for one of them to finish.
+			 */
+			if (state->concurrency && (state->num_running >= state->concurrency)) {
+				RDEBUG3("parallel child %d is waiting for a running child to finish", i);
+				child_state = CHILD_YIELDED;
+				continue;
+			}
+
 			RDEBUG3("parallel child %d is INIT", i);
 			fr_assert(state->children[i].instruction != NULL);
 			child = unlang_io_subrequest_alloc(request,
@@ -167,6 +193,17 @@ static unlang_action_t unlang_parallel_process(REQUEST *request, rlm_rcode_t *pr
 
 			state->children[i].child = child;
 			state->children[i].state = CHILD_RUNNABLE;
+			state->num_running++;
+
+			/*
+			 *	The timer is parented by the child, so
+			 *	it's removed when the child is freed.
+			 */
+			if (state->timeout &&
+			    (fr_event_timer_in(child, request->el, &state->children[i].ev, state->timeout,
+					       unlang_parallel_child_timeout, &state->children[i]) < 0)) {
+				RPWDEBUG("Failed setting timeout for entry %d/%d", i + 1, state->num_children);
+			}
 
 			/* FALL-THROUGH */
 
@@ -195,6 +232,7 @@ static unlang_action_t unlang_parallel_process(REQUEST *request, rlm_rcode_t *pr
 			RDEBUG3("parallel child %s returns %s", state->children[i].child->name,
 				fr_table_str_by_value(mod_rcode_table, result, "<invalid>"));
 
+		child_done:
 			fr_assert(result < NUM_ELEMENTS(state->children[i].instruction->actions));
 
 			/*
@@ -215,6 +253,15 @@ static unlang_action_t unlang_parallel_process(REQUEST *request, rlm_rcode_t *pr
 			state->children[i].state = CHILD_DONE;
 			TALLOC_FREE(state->children[i].child);
 			state->children[i].instruction = NULL;
+			state->num_running--;
+
+			/*
+			 *	When we're waiting for the first
+			 *	children to succeed, failures are
+			 *	ignored.  If no children succeed, the
+			 *	section result is left as "fail".
+			 */
+			if (state->first && (result == RLM_MODULE_FAIL)) continue;
 
 			/*
 			 *	return is "stop processing the
@@ -254,6 +301,19 @@ static unlang_action_t unlang_parallel_process(REQUEST *request, rlm_rcode_t *pr
 					priority);
 			}
 
+			/*
+			 *	Enough children have succeeded.  Skip
+			 *	the rest, which cancels any that are
+			 *	still running.
+			 */
+			if (state->first && (++state->num_succeeded >= state->first)) {
+				RDEBUG2("parallel - %d/%d children succeeded - cancelling the remaining children",
+					state->num_succeeded, state->num_children);
+
+				i = state->num_children;
+				child_state = CHILD_DONE;
+			}
+
 			/*
 			 *	Another child has yielded, so we
 			 *	remember the yield instead of the fact
@@ -273,7 +333,19 @@ static unlang_action_t unlang_parallel_process(REQUEST *request, rlm_rcode_t *pr
 			if (state->children[i].child->runnable_id == -2) { /* see unlang_interpret_resumable() */
 				(void) fr_heap_extract(state->children[i].child->backlog,
 						       state->children[i].child);
-				goto runnable;
+				if (!state->children[i].timed_out) goto runnable;
+			}
+
+			/*
+			 *	The child ran for too long.  Stop it,
+			 *	and treat it as having failed.
+			 */
+			if (state->children[i].timed_out) {
+				RDEBUG2("parallel - entry %d/%d timed out", i + 1, state->num_children);
+
+				unlang_interpret_signal(state->children[i].child, FR_SIGNAL_CANCEL);
+				result = RLM_MODULE_FAIL;
+				goto child_done;
 			}
 
 			fr_assert(state->children[i].instruction != NULL);
@@ -286,6 +358,7 @@ static unlang_action_t unlang_parallel_process(REQUEST *request, rlm_rcode_t *pr
 			state->children[i].state = CHILD_DONE;
 			state->children[i].child = NULL;		// someone else freed this somewhere
 			state->children[i].instruction = NULL;
+			state->num_running--;
 			/* FALL-THROUGH */
 
 			/*
@@ -413,6 +486,9 @@ static unlang_action_t unlang_parallel(REQUEST *request, rlm_rcode_t *presult)
 	state->detach = g->detach;
 	state->clone = g->clone;
 	state->num_children = g->num_children;
+	state->concurrency = g->concurrency;
+	state->first = g->first;
+	state->timeout = g->timeout;
 
 	/*
 	 *	Initialize all of the children.
@@ -50,6 +50,9 @@ typedef struct {
 	unlang_parallel_child_state_t	state;		//!< State of the child.
 	REQUEST				*child; 	//!< Child request.
 	unlang_t			*instruction;	//!< broken out of g->children
+	fr_event_timer_t const		*ev;		//!< Fires if the child runs for too long.
+	bool				timed_out;	//!< The child ran for too long, and should be
+							///< cancelled.
 } unlang_parallel_child_t;
 
 typedef struct {
@@ -57,6 +60,14 @@ typedef struct {
 	int			priority;
 
 	int			num_children;		//!< How many children are executing.
+	int			num_running;		//!< How many children have been started,
+							///< and haven't yet finished.
+	int			num_succeeded;		//!< How many children have finished without
+							///< failing.
+
+	int			concurrency;		//!< Maximum number of children running at once.
+	int			first;			//!< Finish once this many children have succeeded.
+	fr_time_delta_t		timeout;		//!< How long each child may run for.
 
 	bool			detach;			//!< are we creating the child detached
 	bool			clone;			//!< are the children cloned
@@ -0,0 +1,380 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file unlang/profile.c
+ * @brief Sampling profiler for unlang instructions.
+ *
+ * One request in every "sample rate" requests is profiled.  For a profiled
+ * request, the interpreter records how long each instruction ran for, and
+ * how long it was yielded for, against the path of instructions leading to
+ * it from the top of the stack.  Requests which aren't profiled cost a
+ * single branch per instruction.
+ *
+ * Each thread aggregates into its own table, so the only lock taken in the
+ * hot path is the thread's own, which is only contended while the profile
+ * is being read, or reset.
+ *
+ * The profile is written in the "folded stacks" format used by flamegraph
+ * tools, one line per path, with the time in microseconds.  Time spent
+ * yielded is reported as a "[yield]" frame under the instruction which
+ * yielded.  Time spent in nested synchronous evaluation is counted by both
+ * the nested instructions, and by the instruction which started it.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/command.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/thread_local.h>
+
+#include "unlang_priv.h"
+
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** Time spent by one path through the instruction tree
+ *
+ */
+typedef struct {
+	uint32_t		hash;				//!< Of the path.
+	int			depth;				//!< Number of instructions in the path.
+	unlang_t const		**path;				//!< From the top of the stack to the instruction.
+	fr_time_delta_t		run;				//!< Time spent running the instruction.
+	fr_time_delta_t		yield;				//!< Time spent yielded.
+} unlang_profile_entry_t;
+
+/** The profile of a single thread
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;				//!< In the list of all threads.
+	pthread_mutex_t		mutex;				//!< Protects entries.
+	fr_hash_table_t		*entries;			//!< Of #unlang_profile_entry_t.
+	uint64_t		requests;			//!< Used to pick which requests to sample.
+	unsigned int		id;				//!< Printed as the root frame.
+} unlang_profile_thread_t;
+
+static _Atomic(uint32_t)		profile_rate;			//!< Profile one in every N requests.
+								///< 0 disables profiling.
+
+static pthread_mutex_t			profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_head_t			profile_list;			//!< Protected by profile_mutex.
+static bool				profile_list_init;
+static unsigned int			profile_thread_id;		//!< Protected by profile_mutex.
+
+static _Thread_local unlang_profile_thread_t	*profile_thread;
+
+static uint32_t profile_entry_hash(void const *data)
+{
+	unlang_profile_entry_t const *entry = data;
+
+	return entry->hash;
+}
+
+static int profile_entry_cmp(void const *one, void const *two)
+{
+	unlang_profile_entry_t const *a = one, *b = two;
+
+	if (a->depth != b->depth) return a->depth - b->depth;
+
+	return memcmp(a->path, b->path, sizeof(a->path[0]) * a->depth);
+}
+
+static int _profile_thread_free(unlang_profile_thread_t *pt)
+{
+	pthread_mutex_lock(&profile_mutex);
+	fr_dlist_remove(&profile_list, pt);
+	pthread_mutex_unlock(&profile_mutex);
+
+	pthread_mutex_destroy(&pt->mutex);
+
+	return 0;
+}
+
+static void _profile_thread_local_free(void *arg)
+{
+	talloc_free(arg);
+}
+
+/** Return the calling thread's profile, allocating it if this is the first call
+ *
+ */
+static unlang_profile_thread_t *profile_thread_get(void)
+{
+	unlang_profile_thread_t *pt = profile_thread;
+
+	if (pt) return pt;
+
+	MEM(pt = talloc_zero(NULL, unlang_profile_thread_t));
+	pthread_mutex_init(&pt->mutex, NULL);
+	MEM(pt->entries = fr_hash_table_create(pt, profile_entry_hash, profile_entry_cmp, NULL));
+
+	pthread_mutex_lock(&profile_mutex);
+	if (!profile_list_init) {
+		fr_dlist_init(&profile_list, unlang_profile_thread_t, entry);
+		profile_list_init = true;
+	}
+	pt->id = profile_thread_id++;
+	fr_dlist_insert_tail(&profile_list, pt);
+	pthread_mutex_unlock(&profile_mutex);
+
+	talloc_set_destructor(pt, _profile_thread_free);
+	fr_thread_local_set_destructor(profile_thread, _profile_thread_local_free, pt);
+
+	return pt;
+}
+
+/** Decide whether a new request should be profiled
+ *
+ * @return true if the request should be profiled.
+ */
+bool unlang_profile_sample(void)
+{
+	uint32_t		rate = atomic_load_explicit(&profile_rate, memory_order_relaxed);
+	unlang_profile_thread_t	*pt;
+
+	if (!rate) return false;
+
+	pt = profile_thread_get();
+
+	return ((pt->requests++ % rate) == 0);
+}
+
+/** Record time spent by an instruction
+ *
+ * @param[in] stack		the instruction is being evaluated in.
+ * @param[in] frame		the instruction is being evaluated in.
+ * @param[in] instruction	being evaluated.
+ * @param[in] run		time spent running the instruction, or 0 if it
+ *				wasn't run.
+ * @param[in] yield		time spent yielded, or 0 if it wasn't yielded.
+ */
+void unlang_profile_record(unlang_stack_t *stack, unlang_stack_frame_t *frame, unlang_t const *instruction,
+			   fr_time_delta_t run, fr_time_delta_t yield)
+{
+	unlang_profile_thread_t	*pt = profile_thread_get();
+	unlang_t const		*path[UNLANG_STACK_MAX];
+	unlang_profile_entry_t	find, *entry;
+	int			i, depth = frame - stack->frame;
+
+	/*
+	 *	Frame 0 is never used, so the path starts at frame 1.
+	 */
+	for (i = 1; i < depth; i++) path[i - 1] = stack->frame[i].instruction;
+	path[depth - 1] = instruction;
+
+	find.depth = depth;
+	find.path = path;
+	find.hash = fr_hash(path, sizeof(path[0]) * depth);
+
+	pthread_mutex_lock(&pt->mutex);
+	entry = fr_hash_table_finddata(pt->entries, &find);
+	if (!entry) {
+		MEM(entry = talloc_zero(pt->entries, unlang_profile_entry_t));
+		entry->hash = find.hash;
+		entry->depth = depth;
+		MEM(entry->path = talloc_memdup(entry, path, sizeof(path[0]) * depth));
+
+		if (!fr_hash_table_insert(pt->entries, entry)) {
+			talloc_free(entry);
+			pthread_mutex_unlock(&pt->mutex);
+			return;
+		}
+	}
+
+	entry->run += run;
+	entry->yield += yield;
+	pthread_mutex_unlock(&pt->mutex);
+}
+
+/** Print the name of an instruction as a frame
+ *
+ * Sections are printed with the file and line they were defined on,
+ * so that multiple sections with the same name can be distinguished.
+ * Semicolons and newlines are replaced as they're used as delimiters.
+ */
+static void profile_frame_print(FILE *fp, unlang_t const *instruction)
+{
+	char const *p;
+
+	for (p = instruction->debug_name; *p; p++) {
+		fputc(((*p == ';') || (*p == '\n')) ? '_' : *p, fp);
+	}
+
+	if (unlang_ops[instruction->type].debug_braces) {
+		unlang_group_t const *g = (unlang_group_t const *)instruction;
+
+		if (g->cs) fprintf(fp, " (%s:%d)", cf_filename(g->cs), cf_lineno(g->cs));
+	}
+}
+
+static void profile_entry_print(FILE *fp, unsigned int id, unlang_profile_entry_t const *entry,
+				char const *leaf, fr_time_delta_t value)
+{
+	int i;
+
+	fprintf(fp, "thread %u", id);
+	for (i = 0; i < entry->depth; i++) {
+		fputc(';', fp);
+		profile_frame_print(fp, entry->path[i]);
+	}
+	if (leaf) fprintf(fp, ";%s", leaf);
+
+	fprintf(fp, " %" PRIu64 "\n", (uint64_t)fr_time_delta_to_usec(value));
+}
+
+/** Print the profiles of all threads in the folded stacks format
+ *
+ * @param[in] fp	to write to.
+ * @return 0.
+ */
+int unlang_profile_print(FILE *fp)
+{
+	unlang_profile_thread_t	*pt;
+	unlang_profile_entry_t	*entry;
+	fr_hash_iter_t		iter;
+
+	pthread_mutex_lock(&profile_mutex);
+	if (!profile_list_init) goto done;
+
+	for (pt = fr_dlist_head(&profile_list);
+	     pt != NULL;
+	     pt = fr_dlist_next(&profile_list, pt)) {
+		pthread_mutex_lock(&pt->mutex);
+		for (entry = fr_hash_table_iter_init(pt->entries, &iter);
+		     entry != NULL;
+		     entry = fr_hash_table_iter_next(pt->entries, &iter)) {
+			if (entry->run) profile_entry_print(fp, pt->id, entry, NULL, entry->run);
+			if (entry->yield) profile_entry_print(fp, pt->id, entry, "[yield]", entry->yield);
+		}
+		pthread_mutex_unlock(&pt->mutex);
+	}
+
+done:
+	pthread_mutex_unlock(&profile_mutex);
+
+	return 0;
+}
+
+/** Set the sample rate, and discard the profiles collected so far
+ *
+ * @param[in] rate	Profile one in every rate requests.  0 disables profiling.
+ */
+void unlang_profile_rate_set(uint32_t rate)
+{
+	unlang_profile_thread_t	*pt;
+
+	atomic_store_explicit(&profile_rate, rate, memory_order_relaxed);
+
+	pthread_mutex_lock(&profile_mutex);
+	if (!profile_list_init) goto done;
+
+	for (pt = fr_dlist_head(&profile_list);
+	     pt != NULL;
+	     pt = fr_dlist_next(&profile_list, pt)) {
+		pthread_mutex_lock(&pt->mutex);
+		TALLOC_FREE(pt->entries);
+		MEM(pt->entries = fr_hash_table_create(pt, profile_entry_hash, profile_entry_cmp, NULL));
+		pthread_mutex_unlock(&pt->mutex);
+	}
+
+done:
+	pthread_mutex_unlock(&profile_mutex);
+}
+
+static int cmd_show_unlang_profile(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	return unlang_profile_print(fp);
+}
+
+static int cmd_set_unlang_profile(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	int rate = atoi(info->argv[0]);
+
+	if (rate < 0) {
+		fprintf(fp_err, "Sample rate must be 0 or greater\n");
+		return -1;
+	}
+
+	unlang_profile_rate_set((uint32_t)rate);
+
+	if (rate) {
+		fprintf(fp, "Profiling 1 in every %d requests\n", rate);
+	} else {
+		fprintf(fp, "Profiling disabled\n");
+	}
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_table[] = {
+	{
+		.parent = "show",
+		.name = "unlang",
+		.help = "Show information about the unlang interpreter.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "show unlang",
+		.name = "profile",
+		.func = cmd_show_unlang_profile,
+		.help = "Show time spent in each instruction, in the folded stacks format used by flamegraph tools.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "set",
+		.name = "unlang",
+		.help = "Change settings for the unlang interpreter.",
+	},
+
+	{
+		.parent = "set unlang",
+		.name = "profile",
+		.syntax = "INTEGER",
+		.func = cmd_set_unlang_profile,
+		.help = "Profile one in every INTEGER requests, or 0 to disable profiling.  Discards the current profile.",
+	},
+
+	CMD_TABLE_END
+};
+
+/** Register the commands for controlling the profiler
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int unlang_profile_init(void)
+{
+	if (fr_command_register_hook(NULL, NULL, NULL, cmd_table) < 0) {
+		PERROR("Failed registering radmin commands for unlang profiling");
+		return -1;
+	}
+
+	return 0;
+}
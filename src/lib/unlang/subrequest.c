@@ -300,7 +300,7 @@ int unlang_detached_child_init(REQUEST *request)
 		ev_p = talloc_size(request, sizeof(*ev_p));
 		memset(ev_p, 0, sizeof(*ev_p));
 
-		(void) fr_event_timer_in(request, request->el, ev_p, when, unlang_max_request_time, request);
+		(void) fr_event_timer_coarse_in(request, request->el, ev_p, when, unlang_max_request_time, request);
 	}
 
 	/*
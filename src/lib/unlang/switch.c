@@ -75,6 +75,59 @@ static unlang_action_t unlang_switch(REQUEST *request, UNUSED rlm_rcode_t *presu
 		goto do_null_case;
 	}
 
+	/*
+	 *	Look up the literal case statements in the index.
+	 *	If there are no other kinds of case statement,
+	 *	that's the answer.  Otherwise, any case statement
+	 *	before the one we found may still match.
+	 */
+	if (g->cases) {
+		VALUE_PAIR		*vp;
+		fr_cursor_t		cursor;
+		int			err;
+		unlang_switch_case_t	*entry, *best = NULL;
+		int			i;
+
+		for (vp = tmpl_cursor_init(&err, &cursor, request, g->vpt);
+		     vp;
+		     vp = fr_cursor_next(&cursor)) {
+			entry = fr_hash_table_finddata(g->cases, &(unlang_switch_case_t){ .value = &vp->data });
+			if (entry && (!best || (entry->index < best->index))) best = entry;
+		}
+
+		if (!g->dynamic_cases) {
+			found = best ? best->instruction : g->default_case;
+			goto do_null_case;
+		}
+
+		for (this = g->children, i = 0; this; this = this->next, i++) {
+			if (best && (i == best->index)) {
+				found = this;
+				break;
+			}
+
+			h = unlang_generic_to_group(this);
+			if (!h->vpt || tmpl_is_data(h->vpt)) continue;
+
+			map.rhs = g->vpt;
+			map.lhs = h->vpt;
+			cond.cast = g->vpt->tmpl_da;
+
+			if (tmpl_is_attr(h->vpt) &&
+			    (g->vpt->tmpl_da->type == h->vpt->tmpl_da->type)) {
+				cond.cast = NULL;
+			}
+
+			if (cond_eval_map(request, RLM_MODULE_UNKNOWN, 0, &cond) == 1) {
+				found = this;
+				break;
+			}
+		}
+
+		if (!found) found = g->default_case;
+		goto do_null_case;
+	}
+
 	/*
 	 *	Expand the template if necessary, so that it
 	 *	is evaluated once instead of for each 'case'
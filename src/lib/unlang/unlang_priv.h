@@ -30,6 +30,7 @@
 #include <freeradius-devel/server/map_proc.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/io/listen.h>
 
@@ -151,11 +152,27 @@ typedef struct {
 				struct {
 					CONF_SECTION		*server_cs;	//!< #UNLANG_TYPE_CALL
 				};
+				struct {
+					fr_hash_table_t		*cases;		//!< #UNLANG_TYPE_SWITCH, maps literal
+										///< case values to the case statement.
+					unlang_t		*default_case;	//!< The case statement with no value.
+					bool			dynamic_cases;	//!< Some case values must be evaluated
+										///< at runtime.
+				};
 				struct {
 					fr_dict_t const		*dict;		//!< #UNLANG_TYPE_SUBREQUEST
 					fr_dict_attr_t const	*attr_packet_type;
 					fr_dict_enum_t const	*type_enum;
 				};
+				struct {
+					bool			least_loaded;	//!< #UNLANG_TYPE_LOAD_BALANCE,
+										///< #UNLANG_TYPE_REDUNDANT_LOAD_BALANCE,
+										///< pick the least loaded child.
+				};
+				struct {
+					bool			in_place;	//!< #UNLANG_TYPE_FOREACH, the body can't modify
+										///< the list, so iterate over it without copying.
+				};
 			};
 		};
 		fr_cond_t		*cond;		//!< #UNLANG_TYPE_IF, #UNLANG_TYPE_ELSIF.
@@ -163,10 +180,26 @@ typedef struct {
 		struct {				//!< #UNLANG_TYPE_PARALLEL
 			bool			clone;
 			bool			detach;
+			int			concurrency;	//!< Maximum number of children running at once.
+								///< 0 means no limit.
+			int			first;		//!< Finish once this many children have succeeded.
+								///< 0 means wait for all of them.
+			fr_time_delta_t		timeout;	//!< Fail children which run for longer than this.
 		};
 	};
 } unlang_group_t;
 
+/** A case statement indexed by its value
+ *
+ * Used when a switch is over an attribute, so that the case statements with
+ * literal values can be found with a single lookup.
+ */
+typedef struct {
+	fr_value_box_t const	*value;		//!< Of the case statement.
+	unlang_t		*instruction;	//!< The case statement.
+	int			index;		//!< Position of the case statement in the switch.
+} unlang_switch_case_t;
+
 /** A naked xlat
  *
  * @note These are vestigial and may be removed in future.
@@ -215,6 +248,10 @@ typedef struct {
 	 */
 	void			*state;
 
+	void			*state_cache;			//!< State from the last instruction evaluated at
+								///< this depth, zeroed and reused if the next
+								///< instruction needs state of the same type.
+
 	rlm_rcode_t		result;				//!< The result from executing the instruction.
 	int			priority;			//!< Result priority.  When we pop this stack frame
 								///< this priority will be compared with the one of the
@@ -222,6 +259,9 @@ typedef struct {
 								///< result stored in the lower stack frame should
 								///< be replaced.
 	uint8_t			uflags;				//!< Unwind markers
+
+	fr_time_t		yielded;			//!< When the frame yielded.  Only set if the
+								///< request is being profiled.
 } unlang_stack_frame_t;
 
 /** An unlang stack associated with a request
@@ -232,6 +272,7 @@ typedef struct {
 	int			depth;				//!< Current depth we're executing at.
 	uint8_t			unwind;				//!< Unwind to this frame if it exists.
 								///< This is used for break and return.
+	bool			profile;			//!< Record the time spent by each instruction.
 	unlang_stack_frame_t	frame[UNLANG_STACK_MAX];	//!< The stack...
 } unlang_stack_t;
 
@@ -334,6 +375,18 @@ int		unlang_op_init(void);
 void		unlang_op_free(void);
 /** @} */
 
+/** @name Profiling
+ *
+ * @{
+ */
+bool		unlang_profile_sample(void);
+
+void		unlang_profile_record(unlang_stack_t *stack, unlang_stack_frame_t *frame, unlang_t const *instruction,
+				      fr_time_delta_t run, fr_time_delta_t yield);
+
+int		unlang_profile_init(void);
+/** @} */
+
 /** @name io shims
  *
  * Functions to simulate a 'proto' module when we're running 'fake'
@@ -345,6 +398,8 @@ rlm_rcode_t	unlang_io_process_interpret(UNUSED void *instance, UNUSED void *thre
 
 REQUEST		*unlang_io_subrequest_alloc(REQUEST *parent, fr_dict_t const *namespace, bool detachable);
 
+int		unlang_io_subrequest_reattach(REQUEST *parent, REQUEST *child);
+
 /** @} */
 
 /** @name op init functions
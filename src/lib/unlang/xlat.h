@@ -280,6 +280,8 @@ int		xlat_eval_pair(REQUEST *request, VALUE_PAIR *vp);
 
 bool		xlat_async_required(xlat_exp_t const *xlat);
 
+void		xlat_memoise_set(xlat_exp_t *head, bool memoise);
+
 ssize_t		xlat_tokenize_ephemeral(TALLOC_CTX *ctx, xlat_exp_t **head, REQUEST *request,
 					char const *fmt, vp_tmpl_rules_t const *rules);
 
@@ -316,6 +318,8 @@ void _xlat_async_thread_instantiate_set(xlat_t const *xlat,
 				        xlat_thread_detach_t thread_detach,
 					void *uctx);
 
+void		xlat_async_pure_set(xlat_t const *xlat, bool pure);
+
 void		xlat_unregister(char const *name);
 void		xlat_unregister_module(void *instance);
 int		xlat_register_redundant(CONF_SECTION *cs);
@@ -344,6 +348,8 @@ void		xlat_thread_detach(void);
 
 int		xlat_bootstrap(xlat_exp_t *root);
 
+char		*xlat_func_arg_constant(TALLOC_CTX *ctx, xlat_exp_t const *node);
+
 void		xlat_instances_free(void);
 
 /*
@@ -34,6 +34,8 @@ RCSID("$Id$")
 #include <freeradius-devel/server/cond.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/regex.h>
+#include <freeradius-devel/server/resolver.h>
+#include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/unlang/xlat_priv.h>
 
 #include <freeradius-devel/util/base64.h>
@@ -41,6 +43,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/util/sha1.h>
+#include <freeradius-devel/util/thread_local.h>
 #include <freeradius-devel/util/value.h>
 
 #ifdef HAVE_OPENSSL_EVP_H
@@ -383,6 +386,7 @@ xlat_t const *xlat_async_register(TALLOC_CTX *ctx, char const *name, xlat_func_a
 	c->func.async = func;
 	c->type = XLAT_FUNC_ASYNC;
 	c->async_safe = false;	/* this function may yield */
+	c->pure = false;
 
 	DEBUG3("%s: %s", __FUNCTION__, c->name);
 
@@ -479,6 +483,26 @@ void _xlat_async_thread_instantiate_set(xlat_t const *xlat,
 }
 
 
+/** Mark an async xlat as pure
+ *
+ * Pure functions must not yield, and their output must depend only on their
+ * arguments, not on the request or any other state.  Calls to them where
+ * all the arguments are constant are evaluated once, when the xlat is
+ * bootstrapped, and the result reused for every request.
+ *
+ * @param[in] xlat	to mark.
+ * @param[in] pure	whether the xlat is pure.
+ */
+void xlat_async_pure_set(xlat_t const *xlat, bool pure)
+{
+	xlat_t *c;
+
+	memcpy(&c, &xlat, sizeof(c));
+
+	c->pure = pure;
+}
+
+
 /** Unregister an xlat function
  *
  * We can only have one function to call per name, so the passing of "func"
@@ -1883,6 +1907,48 @@ static xlat_action_t xlat_func_hex(TALLOC_CTX *ctx, fr_cursor_t *out,
 }
 
 
+/** Called by xlat_digest_list() for each input box
+ *
+ */
+typedef void (*xlat_digest_update_t)(void *uctx, uint8_t const *data, size_t data_len);
+
+/** Feed the input boxes to a digest, one at a time
+ *
+ * This gives the same result as concatenating them to octets first,
+ * without allocating a buffer for the concatenated data.  Only
+ * boxes which aren't already strings or octets need casting.
+ *
+ * @param[in] request	The current request.
+ * @param[in] in	List of boxes to digest.  May be NULL, for the
+ *			digest of no data.
+ * @param[in] update	Digest update function.
+ * @param[in] uctx	Digest context, passed to update.
+ * @return
+ *	- 0 on success.
+ *	- -1 if a box couldn't be cast to octets.
+ */
+static int xlat_digest_list(REQUEST *request, fr_value_box_t const *in, xlat_digest_update_t update, void *uctx)
+{
+	fr_value_box_t const	*vb;
+	fr_value_box_t		vb_cast;
+
+	for (vb = in; vb; vb = vb->next) {
+		if ((vb->type == FR_TYPE_STRING) || (vb->type == FR_TYPE_OCTETS)) {
+			update(uctx, vb->vb_octets, vb->vb_length);
+			continue;
+		}
+
+		if (fr_value_box_cast(request, &vb_cast, FR_TYPE_OCTETS, NULL, vb) < 0) {
+			RPEDEBUG("Failed casting input to octets");
+			return -1;
+		}
+		update(uctx, vb_cast.vb_octets, vb_cast.vb_length);
+		fr_value_box_clear(&vb_cast);
+	}
+
+	return 0;
+}
+
 typedef enum {
 	HMAC_MD5,
 	HMAC_SHA1
@@ -2049,27 +2115,26 @@ static xlat_action_t xlat_func_md4(TALLOC_CTX *ctx, fr_cursor_t *out,
  *
  * @ingroup xlat_functions
  */
+static void xlat_md5_update(void *uctx, uint8_t const *data, size_t data_len)
+{
+	fr_md5_update(uctx, data, data_len);
+}
+
 static xlat_action_t xlat_func_md5(TALLOC_CTX *ctx, fr_cursor_t *out,
 				   REQUEST *request, UNUSED void const *xlat_inst, UNUSED void *xlat_thread_inst,
 				   fr_value_box_t **in)
 {
 	uint8_t		digest[MD5_DIGEST_LENGTH];
+	fr_md5_ctx_t	*md5_ctx;
 	fr_value_box_t	*vb;
 
-	/*
-	 *	Concatenate all input if there is some
-	 */
-	if (*in && fr_value_box_list_concat(ctx, *in, in, FR_TYPE_OCTETS, true) < 0) {
-		RPEDEBUG("Failed concatenating input");
+	md5_ctx = fr_md5_ctx_alloc(true);
+	if (xlat_digest_list(request, *in, xlat_md5_update, md5_ctx) < 0) {
+		fr_md5_ctx_free(&md5_ctx);
 		return XLAT_ACTION_FAIL;
 	}
-
-	if (*in) {
-		fr_md5_calc(digest, (*in)->vb_octets, (*in)->vb_length);
-	} else {
-		/* Digest of empty string */
-		fr_md5_calc(digest, NULL, 0);
-	}
+	fr_md5_final(digest, md5_ctx);
+	fr_md5_ctx_free(&md5_ctx);
 
 	MEM(vb = fr_value_box_alloc_null(ctx));
 	fr_value_box_memcpy(vb, vb, NULL, digest, sizeof(digest), false);
@@ -2188,6 +2253,107 @@ static xlat_action_t xlat_func_pairs(TALLOC_CTX *ctx, fr_cursor_t *out,
 }
 
 
+/** Mark the request as resumable once the lookup completes
+ *
+ */
+static void _xlat_func_resolve_done(REQUEST *request, UNUSED fr_resolver_req_t *rreq, UNUSED void *uctx)
+{
+	unlang_interpret_resumable(request);
+}
+
+/** Add the addresses to the output
+ *
+ */
+static xlat_action_t xlat_func_resolve_output(TALLOC_CTX *ctx, fr_cursor_t *out, REQUEST *request,
+					      char const *name, fr_ipaddr_t const *addrs, int num)
+{
+	int i;
+
+	if (num < 0) {
+		REDEBUG("Failed resolving \"%s\"", name);
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (num == 0) {
+		RDEBUG2("\"%s\" does not exist", name);
+		return XLAT_ACTION_DONE;
+	}
+
+	for (i = 0; i < num; i++) {
+		fr_value_box_t *vb;
+
+		MEM(vb = fr_value_box_alloc_null(ctx));
+		fr_value_box_ipaddr(vb, NULL, &addrs[i], false);
+		fr_cursor_append(out, vb);
+	}
+
+	return XLAT_ACTION_DONE;
+}
+
+static xlat_action_t xlat_func_resolve_resume(TALLOC_CTX *ctx, fr_cursor_t *out,
+					      REQUEST *request,
+					      UNUSED void const *xlat_inst, UNUSED void *xlat_thread_inst,
+					      fr_value_box_t **in, void *rctx)
+{
+	fr_resolver_req_t	*rreq = talloc_get_type_abort(rctx, fr_resolver_req_t);
+	fr_ipaddr_t const	*addrs;
+	xlat_action_t		action;
+	int			num;
+
+	num = fr_resolver_req_result(&addrs, rreq);
+	action = xlat_func_resolve_output(ctx, out, request, (*in)->vb_strvalue, addrs, num);
+	talloc_free(rreq);
+
+	return action;
+}
+
+static void xlat_func_resolve_signal(UNUSED REQUEST *request, UNUSED void *xlat_inst,
+				     UNUSED void *xlat_thread_inst, void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(rctx);
+}
+
+/** Resolve a hostname to its addresses, without blocking
+ *
+ * Answers are shared by the whole server, and cached for their TTL.
+ * If the name doesn't exist the expansion is empty.
+ *
+ * Example:
+@verbatim
+"%{resolve:radius.example.com}" == 192.0.2.1
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t xlat_func_resolve(TALLOC_CTX *ctx, fr_cursor_t *out,
+				       REQUEST *request, UNUSED void const *xlat_inst, UNUSED void *xlat_thread_inst,
+				       fr_value_box_t **in)
+{
+	fr_ipaddr_t		addrs[FR_RESOLVER_MAX_ADDRS];
+	fr_resolver_req_t	*rreq;
+	int			num;
+
+	if (!*in) {
+		REDEBUG("No hostname given");
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
+		RPEDEBUG("Failed concatenating input");
+		return XLAT_ACTION_FAIL;
+	}
+
+	num = fr_resolver_cached(addrs, NUM_ELEMENTS(addrs), (*in)->vb_strvalue, AF_UNSPEC);
+	if (num >= 0) return xlat_func_resolve_output(ctx, out, request, (*in)->vb_strvalue, addrs, num);
+
+	rreq = fr_resolver_resolve(request, (*in)->vb_strvalue, AF_UNSPEC, _xlat_func_resolve_done, NULL);
+	if (!rreq) return XLAT_ACTION_FAIL;
+
+	return unlang_xlat_yield(request, xlat_func_resolve_resume, xlat_func_resolve_signal, rreq);
+}
+
 /** Generate a random integer value
  *
  * For "N = %{rand:MAX}", 0 <= N < MAX
@@ -2538,6 +2704,12 @@ static xlat_action_t xlat_func_regex(TALLOC_CTX *ctx, fr_cursor_t *out,
 }
 #endif
 
+#ifndef HAVE_OPENSSL_EVP_H
+static void xlat_sha1_update(void *uctx, uint8_t const *data, size_t data_len)
+{
+	fr_sha1_update(uctx, data, data_len);
+}
+
 /** Calculate the SHA1 hash of a string or attribute.
  *
  * Example:
@@ -2555,21 +2727,8 @@ static xlat_action_t xlat_func_sha1(TALLOC_CTX *ctx, fr_cursor_t *out,
 	fr_sha1_ctx	sha1_ctx;
 	fr_value_box_t	*vb;
 
-	/*
-	 * Concatenate all input if there is some
-	 */
-	if (*in && fr_value_box_list_concat(ctx, *in, in, FR_TYPE_OCTETS, true) < 0) {
-		RPEDEBUG("Failed concatenating input");
-		return XLAT_ACTION_FAIL;
-	}
-
 	fr_sha1_init(&sha1_ctx);
-	if (*in) {
-		fr_sha1_update(&sha1_ctx, (*in)->vb_octets, (*in)->vb_length);
-	} else {
-		/* sha1 of empty string */
-		fr_sha1_update(&sha1_ctx, NULL, 0);
-	}
+	if (xlat_digest_list(request, *in, xlat_sha1_update, &sha1_ctx) < 0) return XLAT_ACTION_FAIL;
 	fr_sha1_final(digest, &sha1_ctx);
 
 	MEM(vb = fr_value_box_alloc_null(ctx));
@@ -2579,6 +2738,7 @@ static xlat_action_t xlat_func_sha1(TALLOC_CTX *ctx, fr_cursor_t *out,
 
 	return XLAT_ACTION_DONE;
 }
+#endif
 
 
 /** Calculate any digest supported by OpenSSL EVP_MD
@@ -2591,6 +2751,21 @@ static xlat_action_t xlat_func_sha1(TALLOC_CTX *ctx, fr_cursor_t *out,
  * @ingroup xlat_functions
  */
 #ifdef HAVE_OPENSSL_EVP_H
+/** Digest context, reused by every call on this thread
+ *
+ */
+static _Thread_local EVP_MD_CTX *xlat_md_ctx;
+
+static void _xlat_md_ctx_free_on_exit(void *arg)
+{
+	EVP_MD_CTX_destroy(arg);
+}
+
+static void xlat_evp_md_update(void *uctx, uint8_t const *data, size_t data_len)
+{
+	EVP_DigestUpdate(uctx, data, data_len);
+}
+
 static xlat_action_t xlat_evp_md(TALLOC_CTX *ctx, fr_cursor_t *out,
 			         REQUEST *request, UNUSED void const *xlat_inst, UNUSED void *xlat_thread_inst,
 			         fr_value_box_t **in, EVP_MD const *md)
@@ -2600,23 +2775,16 @@ static xlat_action_t xlat_evp_md(TALLOC_CTX *ctx, fr_cursor_t *out,
 	EVP_MD_CTX	*md_ctx;
 	fr_value_box_t	*vb;
 
-	/*
-	 * Concatenate all input if there is some
-	 */
-	if (*in && fr_value_box_list_concat(ctx, *in, in, FR_TYPE_OCTETS, true) < 0) {
-		RPEDEBUG("Failed concatenating input");
-		return XLAT_ACTION_FAIL;
+	if (unlikely(!xlat_md_ctx)) {
+		MEM(md_ctx = EVP_MD_CTX_create());
+		fr_thread_local_set_destructor(xlat_md_ctx, _xlat_md_ctx_free_on_exit, md_ctx);
+	} else {
+		md_ctx = xlat_md_ctx;
 	}
 
-	md_ctx = EVP_MD_CTX_create();
 	EVP_DigestInit_ex(md_ctx, md, NULL);
-	if (*in) {
-		EVP_DigestUpdate(md_ctx, (*in)->vb_octets, (*in)->vb_length);
-	} else {
-		EVP_DigestUpdate(md_ctx, NULL, 0);
-	}
+	if (xlat_digest_list(request, *in, xlat_evp_md_update, md_ctx) < 0) return XLAT_ACTION_FAIL;
 	EVP_DigestFinal_ex(md_ctx, digest, &digestlen);
-	EVP_MD_CTX_destroy(md_ctx);
 
 	MEM(vb = fr_value_box_alloc_null(ctx));
 	fr_value_box_memcpy(vb, vb, NULL, digest, digestlen, false);
@@ -2626,14 +2794,49 @@ static xlat_action_t xlat_evp_md(TALLOC_CTX *ctx, fr_cursor_t *out,
 	return XLAT_ACTION_DONE;
 }
 
-#  define EVP_MD_XLAT(_md, _md_func) \
+#  if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static void _xlat_md_free_on_exit(void *arg)
+{
+	EVP_MD_free(arg);
+}
+
+/*
+ *	OpenSSL 3 looks up the implementation of the digest on
+ *	every EVP_DigestInit_ex(), unless it's passed one which
+ *	was fetched explicitly.  For short inputs the lookup costs
+ *	more than the digest, so fetch each one once per thread.
+ */
+#    define EVP_MD_XLAT(_md, _md_func) \
+static _Thread_local EVP_MD *xlat_md_##_md;\
+static xlat_action_t xlat_func_##_md(TALLOC_CTX *ctx, fr_cursor_t *out,\
+				      REQUEST *request, void const *xlat_inst, void *xlat_thread_inst,\
+				      fr_value_box_t **in)\
+{\
+	if (unlikely(!xlat_md_##_md)) {\
+		EVP_MD *md;\
+		md = EVP_MD_fetch(NULL, EVP_MD_get0_name(EVP_##_md_func()), NULL);\
+		if (!md) {\
+			REDEBUG("Failed fetching digest %s", EVP_MD_get0_name(EVP_##_md_func()));\
+			return XLAT_ACTION_FAIL;\
+		}\
+		fr_thread_local_set_destructor(xlat_md_##_md, _xlat_md_free_on_exit, md);\
+	}\
+	return xlat_evp_md(ctx, out, request, xlat_inst, xlat_thread_inst, in, xlat_md_##_md);\
+}
+#  else
+#    define EVP_MD_XLAT(_md, _md_func) \
 static xlat_action_t xlat_func_##_md(TALLOC_CTX *ctx, fr_cursor_t *out,\
 				      REQUEST *request, void const *xlat_inst, void *xlat_thread_inst,\
 				      fr_value_box_t **in)\
 {\
 	return xlat_evp_md(ctx, out, request, xlat_inst, xlat_thread_inst, in, EVP_##_md_func());\
 }
+#  endif
 
+/*
+ *	OpenSSL's SHA1 uses the SHA extensions where the CPU has them.
+ */
+EVP_MD_XLAT(sha1, sha1)
 EVP_MD_XLAT(sha2_224, sha224)
 EVP_MD_XLAT(sha2_256, sha256)
 EVP_MD_XLAT(sha2_384, sha384)
@@ -2842,7 +3045,7 @@ static xlat_action_t xlat_func_sub_regex(TALLOC_CTX *ctx, fr_cursor_t *out,
 	/*
 	 *	Process the substitution
 	 */
-	if (regex_compile(NULL, &pattern, regex, regex_len, &flags, false, true) <= 0) {
+	if (regex_compile_cached(&pattern, regex, regex_len, &flags, false) <= 0) {
 		RPEDEBUG("Failed compiling regex");
 		return XLAT_ACTION_FAIL;
 	}
@@ -2852,15 +3055,12 @@ static xlat_action_t xlat_func_sub_regex(TALLOC_CTX *ctx, fr_cursor_t *out,
 			     subject, subject_len, rep, rep_len, NULL) < 0) {
 		RPEDEBUG("Failed performing substitution");
 		talloc_free(vb);
-		talloc_free(pattern);
 		return XLAT_ACTION_FAIL;
 	}
 	fr_value_box_bstrsteal(vb, vb, NULL, buff, (*in)->tainted);
 
 	fr_cursor_append(out, vb);
 
-	talloc_free(pattern);
-
 	return XLAT_ACTION_DONE;
 }
 #endif
@@ -3323,6 +3523,12 @@ int xlat_init(void)
 #define XLAT_REGISTER(_x) xlat_register(NULL, STRINGIFY(_x), xlat_func_ ## _x, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, true); \
 	xlat_internal(STRINGIFY(_x));
 
+#define XLAT_REGISTER_PURE(_name, _func) \
+do { \
+	xlat_t const *_xlat = xlat_async_register(NULL, _name, _func); \
+	if (_xlat) xlat_async_pure_set(_xlat, true); \
+} while (0)
+
 	xlat_register(NULL, "debug", xlat_func_debug, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, true);
 	xlat_internal("debug");
 	XLAT_REGISTER(debug_attr);
@@ -3336,16 +3542,16 @@ int xlat_init(void)
 	XLAT_REGISTER(xlat);
 
 
-	xlat_async_register(NULL, "base64", xlat_func_base64_encode);
-	xlat_async_register(NULL, "base64decode", xlat_func_base64_decode);
-	xlat_async_register(NULL, "bin", xlat_func_bin);
-	xlat_async_register(NULL, "concat", xlat_func_concat);
-	xlat_async_register(NULL, "hex", xlat_func_hex);
-	xlat_async_register(NULL, "hmacmd5", xlat_func_hmac_md5);
-	xlat_async_register(NULL, "hmacsha1", xlat_func_hmac_sha1);
-	xlat_async_register(NULL, "length", xlat_func_length);
-	xlat_async_register(NULL, "md4", xlat_func_md4);
-	xlat_async_register(NULL, "md5", xlat_func_md5);
+	XLAT_REGISTER_PURE("base64", xlat_func_base64_encode);
+	XLAT_REGISTER_PURE("base64decode", xlat_func_base64_decode);
+	XLAT_REGISTER_PURE("bin", xlat_func_bin);
+	XLAT_REGISTER_PURE("concat", xlat_func_concat);
+	XLAT_REGISTER_PURE("hex", xlat_func_hex);
+	XLAT_REGISTER_PURE("hmacmd5", xlat_func_hmac_md5);
+	XLAT_REGISTER_PURE("hmacsha1", xlat_func_hmac_sha1);
+	XLAT_REGISTER_PURE("length", xlat_func_length);
+	XLAT_REGISTER_PURE("md4", xlat_func_md4);
+	XLAT_REGISTER_PURE("md5", xlat_func_md5);
 	xlat_async_register(NULL, "module", xlat_func_module);
 	xlat_async_register(NULL, "pairs", xlat_func_pairs);
 	xlat_async_register(NULL, "rand", xlat_func_rand);
@@ -3353,35 +3559,36 @@ int xlat_init(void)
 #if defined(HAVE_REGEX_PCRE) || defined(HAVE_REGEX_PCRE2)
 	xlat_async_register(NULL, "regex", xlat_func_regex);
 #endif
-	xlat_async_register(NULL, "sha1", xlat_func_sha1);
+	xlat_async_register(NULL, "resolve", xlat_func_resolve);
+	XLAT_REGISTER_PURE("sha1", xlat_func_sha1);
 
 #ifdef HAVE_OPENSSL_EVP_H
-	xlat_async_register(NULL, "sha2_224", xlat_func_sha2_224);
-	xlat_async_register(NULL, "sha2_256", xlat_func_sha2_256);
-	xlat_async_register(NULL, "sha2_384", xlat_func_sha2_384);
-	xlat_async_register(NULL, "sha2_512", xlat_func_sha2_512);
+	XLAT_REGISTER_PURE("sha2_224", xlat_func_sha2_224);
+	XLAT_REGISTER_PURE("sha2_256", xlat_func_sha2_256);
+	XLAT_REGISTER_PURE("sha2_384", xlat_func_sha2_384);
+	XLAT_REGISTER_PURE("sha2_512", xlat_func_sha2_512);
 
 #  if OPENSSL_VERSION_NUMBER >= 0x10100000L
-	xlat_async_register(NULL, "blake2s_256", xlat_func_blake2s_256);
-	xlat_async_register(NULL, "blake2b_512", xlat_func_blake2b_512);
+	XLAT_REGISTER_PURE("blake2s_256", xlat_func_blake2s_256);
+	XLAT_REGISTER_PURE("blake2b_512", xlat_func_blake2b_512);
 #  endif
 
 #  if OPENSSL_VERSION_NUMBER >= 0x10101000L
-	xlat_async_register(NULL, "sha3_224", xlat_func_sha3_224);
-	xlat_async_register(NULL, "sha3_256", xlat_func_sha3_256);
-	xlat_async_register(NULL, "sha3_384", xlat_func_sha3_384);
-	xlat_async_register(NULL, "sha3_512", xlat_func_sha3_512);
+	XLAT_REGISTER_PURE("sha3_224", xlat_func_sha3_224);
+	XLAT_REGISTER_PURE("sha3_256", xlat_func_sha3_256);
+	XLAT_REGISTER_PURE("sha3_384", xlat_func_sha3_384);
+	XLAT_REGISTER_PURE("sha3_512", xlat_func_sha3_512);
 #  endif
 #endif
 
-	xlat_async_register(NULL, "string", xlat_func_string);
-	xlat_async_register(NULL, "strlen", xlat_func_strlen);
+	XLAT_REGISTER_PURE("string", xlat_func_string);
+	XLAT_REGISTER_PURE("strlen", xlat_func_strlen);
 	xlat_async_register(NULL, "sub", xlat_func_sub);
 	xlat_async_register(NULL, "tag", xlat_func_tag);
-	xlat_async_register(NULL, "tolower", xlat_func_tolower);
-	xlat_async_register(NULL, "toupper", xlat_func_toupper);
-	xlat_async_register(NULL, "urlquote", xlat_func_urlquote);
-	xlat_async_register(NULL, "urlunquote", xlat_func_urlunquote);
+	XLAT_REGISTER_PURE("tolower", xlat_func_tolower);
+	XLAT_REGISTER_PURE("toupper", xlat_func_toupper);
+	XLAT_REGISTER_PURE("urlquote", xlat_func_urlquote);
+	XLAT_REGISTER_PURE("urlunquote", xlat_func_urlunquote);
 
 	return 0;
 }
@@ -122,7 +122,7 @@ static inline bool xlat_is_literal(xlat_exp_t const *exp)
  *	- The original expansion string on success.
  *	- NULL on error.
  */
-static char *xlat_fmt_aprint(TALLOC_CTX *ctx, xlat_exp_t const *node)
+char *xlat_fmt_aprint(TALLOC_CTX *ctx, xlat_exp_t const *node)
 {
 	switch (node->type) {
 	case XLAT_LITERAL:
@@ -1045,6 +1045,24 @@ xlat_action_t xlat_frame_eval(TALLOC_CTX *ctx, fr_cursor_t *out, xlat_exp_t cons
 			XLAT_DEBUG("** [%i] %s(func) - %%{%s:...}", unlang_interpret_stack_depth(request), __FUNCTION__,
 				   node->fmt);
 
+			/*
+			 *	Pure function with constant arguments,
+			 *	we already know the result.
+			 */
+			if (node->folded) {
+				fr_cursor_t	from;
+
+				if (node->folded_value &&
+				    (fr_value_box_list_acopy(ctx, &result, node->folded_value) < 0)) goto fail;
+
+				xlat_debug_log_expansion(request, node, NULL);
+				xlat_debug_log_result(request, result);
+
+				fr_cursor_init(&from, &result);
+				fr_cursor_merge(out, &from);
+				continue;
+			}
+
 			/*
 			 *	Hand back the child node to the caller
 			 *	for evaluation.
@@ -1221,6 +1239,14 @@ static char *xlat_aprint(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const * c
 	case XLAT_FUNC:
 		XLAT_DEBUG("xlat_aprint MODULE");
 
+		if (node->folded) {
+			if (!node->folded_value) return talloc_typed_strdup(ctx, "");
+
+			str = fr_value_box_list_asprint(ctx, node->folded_value, NULL, '"');
+			if (!str) RPEDEBUG("Failed concatenating xlat result string");
+			return str;
+		}
+
 		/*
 		 *	Temporary hack to use the new API.
 		 *
@@ -1455,7 +1481,7 @@ static size_t xlat_process(TALLOC_CTX *ctx, char **out, REQUEST *request, xlat_e
 		 *	Break here to avoid nodes being evaluated multiple times
 		 *      and parts of strings being duplicated.
 		 */
-		if ((node->type == XLAT_FUNC) && (node->xlat->type == XLAT_FUNC_ASYNC)) {
+		if ((node->type == XLAT_FUNC) && (node->xlat->type == XLAT_FUNC_ASYNC) && !node->folded) {
 			i++;
 			break;
 		}
@@ -1490,6 +1516,81 @@ static size_t xlat_process(TALLOC_CTX *ctx, char **out, REQUEST *request, xlat_e
 	return total;
 }
 
+/** The result of a memoised expansion, and the inputs it was calculated from
+ *
+ */
+typedef struct {
+	xlat_escape_t		escape;		//!< Escape function the result was produced with.
+	void const		*escape_ctx;	//!< Passed to the escape function.
+	char			**inputs;	//!< Values of the attributes, virtual attributes
+						///< and regex captures the expansion read.
+	char			*result;	//!< Output of the expansion.
+	ssize_t			len;		//!< Length of the output.
+} xlat_memo_t;
+
+typedef struct {
+	REQUEST			*request;
+	char			**inputs;
+	size_t			count;
+} xlat_memo_inputs_t;
+
+static int _xlat_memo_input_walker(xlat_exp_t *node, void *uctx)
+{
+	xlat_memo_inputs_t	*mi = uctx;
+
+	if (mi->inputs) {
+		mi->inputs[mi->count] = xlat_aprint(mi->inputs, mi->request, node, NULL, NULL, 0);
+	}
+	mi->count++;
+
+	return 0;
+}
+
+/** Expand every node in an xlat tree that reads request state
+ *
+ * These are the inputs to the expansion, so if they haven't changed
+ * the result of the expansion won't have either.
+ *
+ * @return An array with one string (or NULL if the node expanded to nothing)
+ *	per input.
+ */
+static char **xlat_memo_inputs(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const *node)
+{
+	xlat_memo_inputs_t	mi = { .request = request };
+	xlat_exp_t		*head;
+	xlat_type_t		type = XLAT_ONE_LETTER | XLAT_VIRTUAL | XLAT_ATTRIBUTE;
+
+#ifdef HAVE_REGEX
+	type |= XLAT_REGEX;
+#endif
+
+	memcpy(&head, &node, sizeof(head));	/* The walker doesn't modify the tree */
+
+	(void) xlat_eval_walk(head, _xlat_memo_input_walker, type, &mi);
+	MEM(mi.inputs = talloc_zero_array(ctx, char *, mi.count));
+	mi.count = 0;
+	(void) xlat_eval_walk(head, _xlat_memo_input_walker, type, &mi);
+
+	return mi.inputs;
+}
+
+/** Check whether the inputs to an expansion have changed
+ *
+ */
+static bool xlat_memo_inputs_match(char * const *a, char * const *b)
+{
+	size_t i, count = talloc_array_length(a);
+
+	if (count != talloc_array_length(b)) return false;
+
+	for (i = 0; i < count; i++) {
+		if (!a[i] && !b[i]) continue;
+		if (!a[i] || !b[i] || (strcmp(a[i], b[i]) != 0)) return false;
+	}
+
+	return true;
+}
+
 /** Replace %whatever in a string.
  *
  * See 'doc/unlang/xlat.adoc' for more information.
@@ -1509,17 +1610,60 @@ static ssize_t _xlat_eval_compiled(TALLOC_CTX *ctx, char **out, size_t outlen, R
 	char *buff;
 	ssize_t len;
 
+	xlat_memo_t *memo = NULL;
+	char **inputs = NULL;
+
 	fr_assert(node != NULL);
 
+	/*
+	 *	If the expansion was evaluated before, and nothing
+	 *	it reads has changed, reuse the previous result.
+	 */
+	if (node->memoise) {
+		memo = request_data_reference(request, node, 0);
+		inputs = xlat_memo_inputs(request, request, node);
+
+		if (memo && (memo->escape == escape) && (memo->escape_ctx == escape_ctx) &&
+		    xlat_memo_inputs_match(memo->inputs, inputs)) {
+			RDEBUG3("Using memoised result for %s", node->fmt);
+			talloc_free(inputs);
+			MEM(buff = talloc_bstrndup(ctx, memo->result, memo->len));
+			len = memo->len;
+			goto done;
+		}
+	}
+
 	len = xlat_process(ctx, &buff, request, node, escape, escape_ctx);
 	if ((len < 0) || !buff) {
 		fr_assert(buff == NULL);
+		talloc_free(inputs);
 		if (*out) **out = '\0';
 		return len;
 	}
 
 	len = strlen(buff);
 
+	if (node->memoise) {
+		if (!memo) {
+			MEM(memo = talloc_zero(request, xlat_memo_t));
+			if (request_data_talloc_add(request, node, 0, xlat_memo_t, memo, true, true, false) < 0) {
+				talloc_free(memo);
+				talloc_free(inputs);
+				goto done;
+			}
+		}
+
+		memo->escape = escape;
+		memo->escape_ctx = escape_ctx;
+		talloc_free(memo->inputs);
+		memo->inputs = talloc_steal(memo, inputs);
+		talloc_free(memo->result);
+		MEM(memo->result = talloc_bstrndup(memo, buff, len));
+		memo->len = len;
+	}
+
+done:
+
 	/*
 	 *	If out doesn't point to an existing buffer
 	 *	copy the pointer to our buffer over.
@@ -1627,6 +1771,25 @@ ssize_t xlat_aeval_compiled(TALLOC_CTX *ctx, char **out, REQUEST *request,
 }
 
 
+/** Mark a compiled expansion as memoisable
+ *
+ * When a memoisable expansion is evaluated synchronously, the result is stored
+ * in the request, keyed on the expansion.  Later evaluations for the same request
+ * re-expand only the attributes, virtual attributes and regex captures the
+ * expansion reads, and if none of them have changed, return the stored result
+ * without calling any xlat functions.
+ *
+ * Only mark expansions whose functions are free of side effects, and whose
+ * output depends only on their arguments.
+ *
+ * @param[in] head	of the compiled expansion.
+ * @param[in] memoise	whether results should be cached.
+ */
+void xlat_memoise_set(xlat_exp_t *head, bool memoise)
+{
+	head->memoise = memoise;
+}
+
 /** Synchronous compile xlat_tokenize_argv() into argv[] array.
  *
  *  This is mostly for synchronous evaluation.
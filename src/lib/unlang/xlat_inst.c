@@ -453,6 +453,182 @@ static int _xlat_bootstrap_walker(xlat_exp_t *node, UNUSED void *uctx)
 	return 0;
 }
 
+/** Whether the value of every node in a list is known at instantiation time
+ *
+ */
+static bool xlat_is_constant(xlat_exp_t const *head)
+{
+	xlat_exp_t const *node;
+
+	for (node = head; node; node = node->next) {
+		switch (node->type) {
+		case XLAT_LITERAL:
+			continue;
+
+		case XLAT_FUNC:
+			if (node->folded) continue;
+			return false;
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/** Call a pure function with constant arguments, recording the result in the node
+ *
+ * @param[in] request	to pass to the function.  Only used for logging.
+ * @param[in] node	to fold.
+ * @return
+ *	- 0 if the node was folded.
+ *	- -1 if the function failed, or tried to yield.  The node is left alone
+ *	  and the failure will be repeated at runtime.
+ */
+static int xlat_fold_func(REQUEST *request, xlat_exp_t *node)
+{
+	TALLOC_CTX		*pool;
+	fr_value_box_t		*in = NULL, *result = NULL, *value;
+	fr_cursor_t		cursor, from;
+	xlat_exp_t const	*arg;
+	xlat_action_t		xa;
+
+	MEM(pool = talloc_new(NULL));
+
+	/*
+	 *	Build the argument list the same way
+	 *	xlat_frame_eval() would.
+	 */
+	fr_cursor_init(&cursor, &in);
+	for (arg = node->child; arg; arg = arg->next) {
+		if (arg->type == XLAT_LITERAL) {
+			MEM(value = fr_value_box_alloc_null(pool));
+			fr_value_box_strdup_buffer(value, value, NULL, arg->fmt, false);
+			fr_cursor_append(&cursor, value);
+			continue;
+		}
+
+		if (!arg->folded_value) continue;
+
+		value = NULL;
+		if (fr_value_box_list_acopy(pool, &value, arg->folded_value) < 0) goto error;
+		fr_cursor_init(&from, &value);
+		fr_cursor_merge(&cursor, &from);
+	}
+
+	fr_cursor_init(&cursor, &result);
+	xa = node->xlat->func.async(pool, &cursor, request, NULL, NULL, &in);
+	if (xa != XLAT_ACTION_DONE) goto error;
+
+	if (result && (fr_value_box_list_acopy(node, &node->folded_value, result) < 0)) goto error;
+	node->folded = true;
+
+	talloc_free(pool);
+	return 0;
+
+error:
+	talloc_free(pool);
+	return -1;
+}
+
+/** Evaluate calls to pure functions with constant arguments
+ *
+ * Works from the leaves up, so that nested calls like
+ * %{md5:%{tolower:FOO}} are folded completely.
+ *
+ * @param[in,out] request	Allocated on the first attempt to fold a node.
+ * @param[in] head		of the list of nodes to fold.
+ */
+static void xlat_fold(REQUEST **request, xlat_exp_t *head)
+{
+	xlat_exp_t *node;
+
+	for (node = head; node; node = node->next) {
+		switch (node->type) {
+		case XLAT_FUNC:
+			if (node->child) xlat_fold(request, node->child);
+
+			if (!node->xlat->pure || (node->xlat->type != XLAT_FUNC_ASYNC) ||
+			    !xlat_is_constant(node->child)) break;
+
+			if (!*request) {
+				MEM(*request = request_alloc(NULL));
+				(*request)->log.dst = talloc_zero(*request, log_dst_t);
+				(*request)->log.dst->func = vlog_request;
+				(*request)->log.dst->uctx = &default_log;
+			}
+
+			if (xlat_fold_func(*request, node) < 0) {
+				DEBUG3("Not folding %%{%s:...}, evaluation failed", node->xlat->name);
+				break;
+			}
+
+			if (DEBUG_ENABLED2) {
+				char *fmt = xlat_fmt_aprint(NULL, node);
+
+				DEBUG2("Folded constant expansion %s to %pM", fmt, node->folded_value);
+				talloc_free(fmt);
+			}
+			break;
+
+		case XLAT_ALTERNATE:
+			xlat_fold(request, node->child);
+			xlat_fold(request, node->alternate);
+			break;
+
+		case XLAT_CHILD:
+			xlat_fold(request, node->child);
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+/** Return the argument of a function call, if it's known at instantiation time
+ *
+ * Allows functions to pre-process static arguments in their
+ * #xlat_instantiate_t callback, instead of once per call.
+ *
+ * @param[in] ctx	to allocate the string in.
+ * @param[in] node	Function call, as passed to an #xlat_instantiate_t callback.
+ * @return
+ *	- The argument, if it's literal text, or calls to pure functions
+ *	  which have been folded.
+ *	- NULL if the argument must be expanded at runtime.
+ */
+char *xlat_func_arg_constant(TALLOC_CTX *ctx, xlat_exp_t const *node)
+{
+	xlat_exp_t const	*arg;
+	char			*out;
+
+	if ((node->type != XLAT_FUNC) || !xlat_is_constant(node->child)) return NULL;
+
+	MEM(out = talloc_typed_strdup(ctx, ""));
+	for (arg = node->child; arg; arg = arg->next) {
+		if (arg->type == XLAT_LITERAL) {
+			MEM(out = talloc_strdup_append_buffer(out, arg->fmt));
+			continue;
+		}
+
+		if (arg->folded_value) {
+			char *str;
+
+			str = fr_value_box_list_asprint(NULL, arg->folded_value, NULL, '\0');
+			if (!str) {
+				talloc_free(out);
+				return NULL;
+			}
+			MEM(out = talloc_strdup_append_buffer(out, str));
+			talloc_free(str);
+		}
+	}
+
+	return out;
+}
+
 /** Create instance data for "permanent" xlats
  *
  * @note This must only be used for xlats created during startup.
@@ -471,6 +647,18 @@ int xlat_bootstrap(xlat_exp_t *root)
 
 	if (!xlat_inst_tree) xlat_instantiate_init();
 
+	/*
+	 *	Calls to pure functions with constant arguments
+	 *	produce the same result for every request, so
+	 *	evaluate them now.
+	 */
+	{
+		REQUEST *request = NULL;
+
+		xlat_fold(&request, root);
+		talloc_free(request);
+	}
+
 	return xlat_eval_walk(root, _xlat_bootstrap_walker, XLAT_FUNC, NULL);
 }
 
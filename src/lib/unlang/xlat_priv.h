@@ -71,6 +71,9 @@ typedef struct xlat_s {
 	void			*thread_uctx;			//!< uctx to pass to instantiation functions.
 
 	bool			async_safe;			//!< If true, is async safe
+	bool			pure;				//!< Output depends only on the input, so calls
+								///< with constant arguments can be evaluated once
+								///< at instantiation.
 
 	size_t			buf_len;			//!< Length of output buffer to pre-allocate.
 	void			*mod_inst;			//!< Module instance passed to xlat
@@ -101,6 +104,9 @@ struct xlat_exp {
 
 	bool		async_safe;	//!< carried from all of the children
 
+	bool		memoise;	//!< Cache the result of synchronous evaluations of this
+					///< expansion for the lifetime of the request.
+
 	xlat_type_t	type;		//!< type of this expansion.
 	xlat_exp_t	*next;		//!< Next in the list.
 
@@ -126,6 +132,10 @@ struct xlat_exp {
 		xlat_inst_t		*inst;		//!< Instance data for the #xlat_t.
 		xlat_thread_inst_t	*thread_inst;	//!< Thread specific instance.
 							///< ONLY USED FOR EPHEMERAL XLATS.
+		bool			folded;		//!< Result was calculated at instantiation.
+		fr_value_box_t		*folded_value;	//!< The result of calling a pure function with
+							///< constant arguments.  May be NULL if the
+							///< function produced no output.
 	};
 };
 
@@ -169,6 +179,8 @@ xlat_action_t	xlat_frame_eval(TALLOC_CTX *ctx, fr_cursor_t *out, xlat_exp_t cons
 
 int		xlat_eval_walk(xlat_exp_t *exp, xlat_walker_t walker, xlat_type_t type, void *uctx);
 
+char		*xlat_fmt_aprint(TALLOC_CTX *ctx, xlat_exp_t const *node);
+
 int		xlat_eval_init(void);
 
 void		xlat_eval_free(void);
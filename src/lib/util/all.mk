@@ -1,5 +1,6 @@
 SUBMAKEFILES := \
 	libfreeradius-util.mk \
+	base64_tests.mk \
 	dbuff_tests.mk \
 	sbuff_tests.mk
 
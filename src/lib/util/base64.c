@@ -32,6 +32,16 @@ RCSID("$Id$")
 
 #define us(x) (uint8_t) x
 
+/*
+ *	The SSSE3 codecs are picked at runtime, as SSSE3
+ *	isn't part of the x86_64 baseline.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define HAVE_BASE64_SSSE3
+#  include <tmmintrin.h>
+#  define base64_ssse3() __builtin_cpu_supports("ssse3")
+#endif
+
 char const fr_base64_str[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
 /*
@@ -180,6 +190,93 @@ char const fr_base64_sextet[0x100] = {
   B64 (252), B64 (253), B64 (254), B64 (255)
 };
 
+#ifdef HAVE_BASE64_SSSE3
+/** Encode 12 bytes to 16 base64 chars
+ *
+ * Reads 16 bytes from in.
+ *
+ * @see http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html
+ */
+static inline CC_HINT(target("ssse3")) void base64_encode_ssse3(char *out, uint8_t const *in)
+{
+	__m128i	v, t0, t1, t2, t3, idx, res;
+
+	/*
+	 *	Move each 3 bytes into a 32bit lane, then
+	 *	split the lane into 4 6bit indexes.
+	 */
+	v = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)in),
+			     _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	t0 = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+	t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	t2 = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+	t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	idx = _mm_or_si128(t1, t3);
+
+	/*
+	 *	Map each index to the offset which turns it into
+	 *	its char.  0-25 -> 13, 26-51 -> 0, 52-61 -> 1-10,
+	 *	62 -> 11, 63 -> 12.
+	 */
+	res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+	res = _mm_or_si128(res, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+	res = _mm_shuffle_epi8(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+					     '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+					     '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+					     '/' - 63, 'A', 0, 0), res);
+
+	_mm_storeu_si128((__m128i *)out, _mm_add_epi8(res, idx));
+}
+
+/** Decode 16 base64 chars to 12 bytes
+ *
+ * Writes 16 bytes to out.
+ *
+ * @see http://0x80.pl/notesen/2016-01-17-sse-base64-decoding.html
+ *
+ * @return
+ *	- true if all the chars were in the base64 alphabet.
+ *	- false if any weren't, in which case nothing is written.
+ */
+static inline CC_HINT(target("ssse3")) bool base64_decode_ssse3(uint8_t *out, char const *in)
+{
+	__m128i	v, hi_nibbles, lo_nibbles, lo, hi, roll, merged;
+
+	v = _mm_loadu_si128((__m128i const *)in);
+	hi_nibbles = _mm_and_si128(_mm_srli_epi32(v, 4), _mm_set1_epi8(0x0f));
+	lo_nibbles = _mm_and_si128(v, _mm_set1_epi8(0x0f));
+
+	/*
+	 *	A char is invalid if the bits for its low and
+	 *	high nibbles overlap.
+	 */
+	lo = _mm_shuffle_epi8(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+					    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a), lo_nibbles);
+	hi = _mm_shuffle_epi8(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+					    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10), hi_nibbles);
+	if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0) return false;
+
+	/*
+	 *	Chars to sextets.  '/' needs its own offset, as
+	 *	it shares a high nibble with '+'.
+	 */
+	roll = _mm_shuffle_epi8(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0),
+				_mm_add_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')), hi_nibbles));
+	v = _mm_add_epi8(v, roll);
+
+	/*
+	 *	Pack each 4 sextets into 3 bytes.
+	 */
+	merged = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+	merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+	merged = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+	_mm_storeu_si128((__m128i *)out, merged);
+
+	return true;
+}
+#endif
+
 /** Base 64 encode binary data
  *
  * Base64 encode IN array of size INLEN into OUT array of size OUTLEN.
@@ -203,6 +300,32 @@ size_t fr_base64_encode(char *out, size_t outlen, uint8_t const *in, size_t inle
 		return -1;
 	}
 
+#ifdef HAVE_BASE64_SSSE3
+	if ((inlen >= 16) && base64_ssse3()) {
+		while (inlen >= 16) {
+			base64_encode_ssse3(p, in);
+			p += 16;
+			in += 12;
+			inlen -= 12;
+		}
+	}
+#endif
+
+	/*
+	 *	Complete 24bit quanta
+	 */
+	while (inlen >= 3) {
+		uint32_t v = (in[0] << 16) | (in[1] << 8) | in[2];
+
+		p[0] = fr_base64_str[(v >> 18) & 0x3f];
+		p[1] = fr_base64_str[(v >> 12) & 0x3f];
+		p[2] = fr_base64_str[(v >> 6) & 0x3f];
+		p[3] = fr_base64_str[v & 0x3f];
+		p += 4;
+		in += 3;
+		inlen -= 3;
+	}
+
 	while (inlen) {
 		*p++ = fr_base64_str[(in[0] >> 2) & 0x3f];
 		*p++ = fr_base64_str[((in[0] << 4) + (--inlen ? in[1] >> 4 : 0)) & 0x3f];
@@ -262,6 +385,15 @@ ssize_t fr_base64_decode(uint8_t *out, size_t outlen, char const *in, size_t inl
 	char const	*p = in, *q;
 	char const	*end = p + inlen;
 
+#ifdef HAVE_BASE64_SSSE3
+	if (((end - p) >= 16) && ((out_end - out_p) >= 16) && base64_ssse3()) {
+		while (((end - p) >= 16) && ((out_end - out_p) >= 16) && base64_decode_ssse3(out_p, p)) {
+			p += 16;
+			out_p += 12;
+		}
+	}
+#endif
+
 	/*
 	 *	Process complete 24bit quanta
 	 */
@@ -0,0 +1,190 @@
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/time.h>
+
+#include "base64.h"
+
+#include <ctype.h>
+
+#define TEST_MAX_LEN	256
+
+static uint8_t	test_data[TEST_MAX_LEN];
+
+/** Byte at a time base64 encoder, to check the fast paths against
+ *
+ */
+static size_t base64_encode_ref(char *out, uint8_t const *in, size_t inlen)
+{
+	char	*p = out;
+	size_t	i;
+
+	for (i = 0; (i + 3) <= inlen; i += 3) {
+		*p++ = fr_base64_str[in[i] >> 2];
+		*p++ = fr_base64_str[((in[i] & 0x03) << 4) | (in[i + 1] >> 4)];
+		*p++ = fr_base64_str[((in[i + 1] & 0x0f) << 2) | (in[i + 2] >> 6)];
+		*p++ = fr_base64_str[in[i + 2] & 0x3f];
+	}
+
+	switch (inlen - i) {
+	case 1:
+		*p++ = fr_base64_str[in[i] >> 2];
+		*p++ = fr_base64_str[(in[i] & 0x03) << 4];
+		*p++ = '=';
+		*p++ = '=';
+		break;
+
+	case 2:
+		*p++ = fr_base64_str[in[i] >> 2];
+		*p++ = fr_base64_str[((in[i] & 0x03) << 4) | (in[i + 1] >> 4)];
+		*p++ = fr_base64_str[(in[i + 1] & 0x0f) << 2];
+		*p++ = '=';
+		break;
+	}
+	*p = '\0';
+
+	return p - out;
+}
+
+static void test_init(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(test_data); i++) test_data[i] = (i * 167) + (i >> 3);
+}
+
+static void test_base64(void)
+{
+	char	out[FR_BASE64_ENC_LENGTH(TEST_MAX_LEN) + 1], ref[FR_BASE64_ENC_LENGTH(TEST_MAX_LEN) + 1];
+	uint8_t	decoded[TEST_MAX_LEN + 16];
+	size_t	len, ref_len;
+	ssize_t	slen;
+
+	test_init();
+
+	TEST_CASE("Encode and decode every length, across the block boundaries");
+	for (len = 0; len <= TEST_MAX_LEN; len++) {
+		ref_len = base64_encode_ref(ref, test_data, len);
+
+		TEST_CHECK(fr_base64_encode(out, sizeof(out), test_data, len) == ref_len);
+		TEST_CHECK(strcmp(out, ref) == 0);
+		TEST_MSG("Encoding %zu bytes, expected %s, got %s", len, ref, out);
+
+		slen = fr_base64_decode(decoded, sizeof(decoded), out, ref_len);
+		TEST_CHECK(slen == (ssize_t)len);
+		TEST_MSG("Decoding %zu bytes, got %zd", len, slen);
+		TEST_CHECK((slen >= 0) && (memcmp(decoded, test_data, len) == 0));
+	}
+
+	TEST_CASE("Invalid chars are found inside a block");
+	fr_base64_encode(out, sizeof(out), test_data, 96);
+	out[37] = '!';
+	slen = fr_base64_decode(decoded, sizeof(decoded), out, 128);
+	TEST_CHECK(slen == (36 - 128));
+	TEST_MSG("Expected %i, got %zd", 36 - 128, slen);
+
+	TEST_CASE("Short output buffer");
+	fr_base64_encode(out, sizeof(out), test_data, 96);
+	slen = fr_base64_decode(decoded, 50, out, 128);
+	TEST_CHECK(slen <= 0);
+}
+
+static void test_hex(void)
+{
+	char	out[(TEST_MAX_LEN * 2) + 1], upper[(TEST_MAX_LEN * 2) + 1];
+	uint8_t	decoded[TEST_MAX_LEN];
+	size_t	len, i;
+
+	test_init();
+
+	TEST_CASE("Encode and decode every length, across the block boundaries");
+	for (len = 0; len <= TEST_MAX_LEN; len++) {
+		TEST_CHECK(fr_bin2hex(out, test_data, len) == (len * 2));
+		for (i = 0; i < len; i++) {
+			char pair[3];
+
+			snprintf(pair, sizeof(pair), "%02x", test_data[i]);
+			if (memcmp(out + (i * 2), pair, 2) != 0) break;
+		}
+		TEST_CHECK(i == len);
+		TEST_MSG("Encoding %zu bytes, mismatch at %zu", len, i);
+		TEST_CHECK(out[len * 2] == '\0');
+
+		TEST_CHECK(fr_hex2bin(decoded, sizeof(decoded), out, len * 2) == len);
+		TEST_CHECK(memcmp(decoded, test_data, len) == 0);
+	}
+
+	TEST_CASE("Upper case hex");
+	for (i = 0; i < sizeof(out); i++) upper[i] = toupper(out[i]);
+	TEST_CHECK(fr_hex2bin(decoded, sizeof(decoded), upper, TEST_MAX_LEN * 2) == TEST_MAX_LEN);
+	TEST_CHECK(memcmp(decoded, test_data, TEST_MAX_LEN) == 0);
+
+	TEST_CASE("Invalid chars stop decoding, inside a block");
+	upper[41] = 'g';
+	TEST_CHECK(fr_hex2bin(decoded, sizeof(decoded), upper, TEST_MAX_LEN * 2) == 20);
+	upper[41] = '\0';
+	TEST_CHECK(fr_hex2bin(decoded, sizeof(decoded), upper, TEST_MAX_LEN * 2) == 20);
+	upper[41] = 0xc1;
+	TEST_CHECK(fr_hex2bin(decoded, sizeof(decoded), upper, TEST_MAX_LEN * 2) == 20);
+
+	TEST_CASE("Output is truncated");
+	TEST_CHECK(fr_hex2bin(decoded, 17, out, TEST_MAX_LEN * 2) == 17);
+	TEST_CHECK(memcmp(decoded, test_data, 17) == 0);
+}
+
+static void test_speed(void)
+{
+	static uint8_t	in[4096], decoded[sizeof(in) + 16];
+	static char	out[(sizeof(in) * 2) + 1];
+	fr_time_t	start, stop;
+	size_t		i, len, loops = 10000;
+
+	for (i = 0; i < sizeof(in); i++) in[i] = i * 31;
+
+	start = fr_time();
+	for (i = 0, len = 0; i < loops; i++) len += fr_base64_encode(out, sizeof(out), in, sizeof(in));
+	stop = fr_time();
+	TEST_CHECK(len == (loops * FR_BASE64_ENC_LENGTH(sizeof(in))));
+
+	if (test_verbose_level__ >= 1) {
+		printf("\nfr_base64_encode: %.2f ns/byte\n", (double)(stop - start) / (loops * sizeof(in)));
+	}
+
+	start = fr_time();
+	for (i = 0, len = 0; i < loops; i++) len += fr_base64_decode(decoded, sizeof(decoded), out, FR_BASE64_ENC_LENGTH(sizeof(in)));
+	stop = fr_time();
+	TEST_CHECK(len == (loops * sizeof(in)));
+
+	if (test_verbose_level__ >= 1) {
+		printf("fr_base64_decode: %.2f ns/byte\n", (double)(stop - start) / (loops * sizeof(in)));
+	}
+
+	start = fr_time();
+	for (i = 0, len = 0; i < loops; i++) len += fr_bin2hex(out, in, sizeof(in));
+	stop = fr_time();
+	TEST_CHECK(len == (loops * sizeof(in) * 2));
+
+	if (test_verbose_level__ >= 1) {
+		printf("fr_bin2hex: %.2f ns/byte\n", (double)(stop - start) / (loops * sizeof(in)));
+	}
+
+	start = fr_time();
+	for (i = 0, len = 0; i < loops; i++) len += fr_hex2bin(decoded, sizeof(decoded), out, sizeof(in) * 2);
+	stop = fr_time();
+	TEST_CHECK(len == (loops * sizeof(in)));
+
+	if (test_verbose_level__ >= 1) {
+		printf("fr_hex2bin: %.2f ns/byte\n", (double)(stop - start) / (loops * sizeof(in)));
+	}
+}
+
+TEST_LIST = {
+	{ "base64",	test_base64 },
+	{ "hex",	test_hex },
+
+	/*
+	 *	Performance
+	 */
+	{ "speed",	test_speed },
+
+	{ NULL }
+};
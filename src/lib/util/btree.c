@@ -0,0 +1,811 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** B+tree implementation
+ *
+ * All of the data is stored in the leaves, which hold up to
+ * BTREE_ORDER pointers each, and are linked together in order.
+ * Internal nodes hold separators, which are pointers to the smallest
+ * entry in the subtree to their right.  Compared to a red/black tree,
+ * a lookup touches far fewer nodes, each node is a few contiguous
+ * cache lines, and there's no per-entry node allocation.
+ *
+ * Because separators are pointers to user data, deleting an entry
+ * which is also a separator updates the separator before the data is
+ * freed.
+ *
+ * @file src/lib/util/btree.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/btree.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/strerror.h>
+
+#include <pthread.h>
+
+#define BTREE_ORDER		(32)			//!< Maximum entries in a leaf, or separators in an internal node.
+#define BTREE_MIN		((BTREE_ORDER / 2) - 1)	//!< Nodes other than the root are rebalanced below this.
+#define BTREE_MAX_DEPTH		(32)
+
+typedef struct {
+	int			num;		//!< Entries in a leaf, or separators in an internal node.
+	bool			leaf;		//!< Whether this is a leaf.
+} btree_node_t;
+
+struct fr_btree_leaf_s {
+	btree_node_t		hdr;
+	fr_btree_leaf_t		*next;		//!< Next leaf, in order.
+	void			*data[BTREE_ORDER];
+};
+
+typedef struct {
+	btree_node_t		hdr;
+	void			*key[BTREE_ORDER];	//!< key[i] is the smallest entry under child[i + 1].
+	btree_node_t		*child[BTREE_ORDER + 1];
+} btree_internal_t;
+
+struct fr_btree_s {
+#ifndef NDEBUG
+	uint32_t		magic;
+#endif
+	btree_node_t		*root;
+	fr_btree_leaf_t		*first;		//!< Leftmost leaf.  Merges always keep the left node,
+						///< so this never changes.
+	uint32_t		num_elements;
+	rb_comparator_t		compare;
+	rb_free_t		free;
+	bool			replace;
+	bool			lock;
+	pthread_mutex_t		mutex;
+	bool			being_freed;	//!< Prevent double frees in talloc_destructor.
+	char const		*type;		//!< Talloc type to check elements against.
+};
+
+#ifndef NDEBUG
+#  define BTREE_MAGIC (0x8d6e1b3a)
+#endif
+
+#define LEAF(_n)	((fr_btree_leaf_t *) (_n))
+#define INTERNAL(_n)	((btree_internal_t *) (_n))
+
+static int _btree_free(fr_btree_t *tree)
+{
+	fr_btree_leaf_t	*leaf;
+	int		i;
+
+	if (unlikely(tree->being_freed)) return -1;
+	tree->being_freed = true;
+
+	if (tree->free) for (leaf = tree->first; leaf; leaf = leaf->next) {
+		for (i = 0; i < leaf->hdr.num; i++) tree->free(leaf->data[i]);
+	}
+
+#ifndef NDEBUG
+	tree->magic = 0;
+#endif
+	tree->num_elements = 0;
+
+	/*
+	 *	Frees all of the nodes.
+	 */
+	talloc_free_children(tree);
+
+	if (tree->lock) pthread_mutex_destroy(&tree->mutex);
+
+	return 0;
+}
+
+/** Create a new B+tree
+ *
+ * @param[in] ctx		to tie tree lifetime to.
+ * @param[in] compare		Comparator used to compare entries.
+ * @param[in] type		Talloc type of entries, or NULL to not check.
+ * @param[in] node_free		Optional function used to free data if entries are
+ *				deleted or replaced.
+ * @param[in] flags		RBTREE_FLAG_*.
+ * @return
+ *	- A new B+tree on success.
+ *	- NULL on failure.
+ */
+fr_btree_t *_fr_btree_create(TALLOC_CTX *ctx, rb_comparator_t compare,
+			     char const *type, rb_free_t node_free, int flags)
+{
+	fr_btree_t *tree;
+
+	if (!compare) return NULL;
+
+	tree = talloc_zero(ctx, fr_btree_t);
+	if (!tree) return NULL;
+
+	tree->first = talloc_zero(tree, fr_btree_leaf_t);
+	if (!tree->first) {
+		talloc_free(tree);
+		return NULL;
+	}
+	tree->first->hdr.leaf = true;
+	tree->root = &tree->first->hdr;
+
+#ifndef NDEBUG
+	tree->magic = BTREE_MAGIC;
+#endif
+	tree->compare = compare;
+	tree->replace = (flags & RBTREE_FLAG_REPLACE) != 0 ? true : false;
+	tree->lock = (flags & RBTREE_FLAG_LOCK) != 0 ? true : false;
+	if (tree->lock) pthread_mutex_init(&tree->mutex, NULL);
+
+	talloc_set_destructor(tree, _btree_free);
+	tree->free = node_free;
+	tree->type = type;
+
+	return tree;
+}
+
+/** Find the first entry in a leaf which is >= data
+ *
+ */
+static inline int leaf_lower_bound(fr_btree_t *tree, fr_btree_leaf_t *leaf, void const *data, bool *found)
+{
+	int lo = 0, hi = leaf->hdr.num;
+
+	*found = false;
+	while (lo < hi) {
+		int mid = (lo + hi) >> 1;
+		int result = tree->compare(data, leaf->data[mid]);
+
+		if (result == 0) {
+			*found = true;
+			return mid;
+		}
+
+		if (result < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return lo;
+}
+
+/** Find which child of an internal node data belongs under
+ *
+ * @param[in] tree	the node is in.
+ * @param[in] node	to search.
+ * @param[in] data	to search for.
+ * @param[out] exact	set to true if data is the separator to the left of the child.
+ * @return the index of the child.
+ */
+static inline int internal_child(fr_btree_t *tree, btree_internal_t *node, void const *data, bool *exact)
+{
+	int lo = 0, hi = node->hdr.num;
+
+	*exact = false;
+	while (lo < hi) {
+		int mid = (lo + hi) >> 1;
+		int result = tree->compare(data, node->key[mid]);
+
+		if (result == 0) {
+			*exact = true;
+			return mid + 1;
+		}
+
+		if (result < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return lo;
+}
+
+/** Find the leaf an entry belongs in
+ *
+ */
+static inline fr_btree_leaf_t *btree_leaf_find(fr_btree_t *tree, void const *data)
+{
+	btree_node_t	*node = tree->root;
+	bool		exact;
+
+	while (!node->leaf) node = INTERNAL(node)->child[internal_child(tree, INTERNAL(node), data, &exact)];
+
+	return LEAF(node);
+}
+
+static inline bool btree_node_full(btree_node_t *node)
+{
+	return (node->num == BTREE_ORDER);
+}
+
+/** Split a full child of an internal node which isn't full
+ *
+ */
+static int btree_split_child(fr_btree_t *tree, btree_internal_t *parent, int i)
+{
+	btree_node_t	*child = parent->child[i];
+	btree_node_t	*right;
+	void		*sep;
+
+	if (child->leaf) {
+		fr_btree_leaf_t *l = LEAF(child), *r;
+
+		r = talloc_zero(tree, fr_btree_leaf_t);
+		if (!r) {
+			fr_strerror_printf("No memory for new btree node");
+			return -1;
+		}
+		r->hdr.leaf = true;
+		r->hdr.num = BTREE_ORDER / 2;
+		l->hdr.num = BTREE_ORDER - r->hdr.num;
+		memcpy(r->data, l->data + l->hdr.num, sizeof(r->data[0]) * r->hdr.num);
+
+		r->next = l->next;
+		l->next = r;
+
+		sep = r->data[0];
+		right = &r->hdr;
+	} else {
+		btree_internal_t *l = INTERNAL(child), *r;
+		int m = BTREE_ORDER / 2;
+
+		r = talloc_zero(tree, btree_internal_t);
+		if (!r) {
+			fr_strerror_printf("No memory for new btree node");
+			return -1;
+		}
+
+		/*
+		 *	The middle separator moves up to the parent.
+		 */
+		r->hdr.num = BTREE_ORDER - m - 1;
+		memcpy(r->key, l->key + m + 1, sizeof(r->key[0]) * r->hdr.num);
+		memcpy(r->child, l->child + m + 1, sizeof(r->child[0]) * (r->hdr.num + 1));
+
+		sep = l->key[m];
+		l->hdr.num = m;
+		right = &r->hdr;
+	}
+
+	memmove(parent->key + i + 1, parent->key + i, sizeof(parent->key[0]) * (parent->hdr.num - i));
+	memmove(parent->child + i + 2, parent->child + i + 1, sizeof(parent->child[0]) * (parent->hdr.num - i));
+	parent->key[i] = sep;
+	parent->child[i + 1] = right;
+	parent->hdr.num++;
+
+	return 0;
+}
+
+/** Insert an entry into the tree
+ *
+ * Full nodes are split on the way down, so there's always room in
+ * the parent for a new separator.
+ *
+ * @param[in] tree	to insert into.
+ * @param[in] data	to insert.
+ * @return
+ *	- true if data was inserted, or replaced an entry.
+ *	- false if an entry already exists, or on error.
+ */
+bool fr_btree_insert(fr_btree_t *tree, void const *data)
+{
+	btree_node_t	*node;
+	fr_btree_leaf_t	*leaf;
+	void		**sep = NULL;
+	void		*old;
+	bool		found;
+	int		pos;
+
+	if (unlikely(tree->being_freed)) return false;
+
+#ifndef TALLOC_GET_TYPE_ABORT_NOOP
+	if (tree->type) (void)_talloc_get_type_abort(data, tree->type, __location__);
+#endif
+
+	if (tree->lock) pthread_mutex_lock(&tree->mutex);
+
+	if (btree_node_full(tree->root)) {
+		btree_internal_t *root;
+
+		root = talloc_zero(tree, btree_internal_t);
+		if (!root) {
+		nomem:
+			fr_strerror_printf("No memory for new btree node");
+			if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+			return false;
+		}
+		root->child[0] = tree->root;
+
+		if (btree_split_child(tree, root, 0) < 0) {
+			talloc_free(root);
+			goto nomem;
+		}
+		tree->root = &root->hdr;
+	}
+
+	node = tree->root;
+	while (!node->leaf) {
+		btree_internal_t	*in = INTERNAL(node);
+		bool			exact;
+		int			i;
+
+		i = internal_child(tree, in, data, &exact);
+		if (exact) sep = &in->key[i - 1];
+
+		if (btree_node_full(in->child[i])) {
+			int result;
+
+			if (btree_split_child(tree, in, i) < 0) {
+				if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+				return false;
+			}
+
+			result = tree->compare(data, in->key[i]);
+			if (result >= 0) {
+				i++;
+				if (result == 0) sep = &in->key[i - 1];
+			}
+		}
+
+		node = in->child[i];
+	}
+
+	leaf = LEAF(node);
+	pos = leaf_lower_bound(tree, leaf, data, &found);
+	if (found) {
+		if (!tree->replace) {
+			if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+			return false;
+		}
+
+		/*
+		 *	The old entry may also be a separator,
+		 *	which has to point to the new one before
+		 *	the old one is freed.
+		 */
+		old = leaf->data[pos];
+		memcpy(&leaf->data[pos], &data, sizeof(leaf->data[pos]));
+		if (sep && (*sep == old)) *sep = leaf->data[pos];
+
+		if (tree->free) tree->free(old);
+		if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+		return true;
+	}
+
+	memmove(leaf->data + pos + 1, leaf->data + pos, sizeof(leaf->data[0]) * (leaf->hdr.num - pos));
+	memcpy(&leaf->data[pos], &data, sizeof(leaf->data[pos]));
+	leaf->hdr.num++;
+	tree->num_elements++;
+
+	if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+	return true;
+}
+
+/** Move the last entry of child[i - 1] to the start of child[i]
+ *
+ */
+static void btree_borrow_left(btree_internal_t *parent, int i)
+{
+	btree_node_t *node = parent->child[i];
+	btree_node_t *left = parent->child[i - 1];
+
+	if (node->leaf) {
+		fr_btree_leaf_t *n = LEAF(node), *l = LEAF(left);
+
+		memmove(n->data + 1, n->data, sizeof(n->data[0]) * n->hdr.num);
+		n->data[0] = l->data[l->hdr.num - 1];
+		parent->key[i - 1] = n->data[0];
+	} else {
+		btree_internal_t *n = INTERNAL(node), *l = INTERNAL(left);
+
+		memmove(n->key + 1, n->key, sizeof(n->key[0]) * n->hdr.num);
+		memmove(n->child + 1, n->child, sizeof(n->child[0]) * (n->hdr.num + 1));
+		n->key[0] = parent->key[i - 1];
+		n->child[0] = l->child[l->hdr.num];
+		parent->key[i - 1] = l->key[l->hdr.num - 1];
+	}
+
+	left->num--;
+	node->num++;
+}
+
+/** Move the first entry of child[i + 1] to the end of child[i]
+ *
+ */
+static void btree_borrow_right(btree_internal_t *parent, int i)
+{
+	btree_node_t *node = parent->child[i];
+	btree_node_t *right = parent->child[i + 1];
+
+	if (node->leaf) {
+		fr_btree_leaf_t *n = LEAF(node), *r = LEAF(right);
+
+		n->data[n->hdr.num] = r->data[0];
+		memmove(r->data, r->data + 1, sizeof(r->data[0]) * (r->hdr.num - 1));
+		parent->key[i] = r->data[0];
+	} else {
+		btree_internal_t *n = INTERNAL(node), *r = INTERNAL(right);
+
+		n->key[n->hdr.num] = parent->key[i];
+		n->child[n->hdr.num + 1] = r->child[0];
+		parent->key[i] = r->key[0];
+		memmove(r->key, r->key + 1, sizeof(r->key[0]) * (r->hdr.num - 1));
+		memmove(r->child, r->child + 1, sizeof(r->child[0]) * r->hdr.num);
+	}
+
+	right->num--;
+	node->num++;
+}
+
+/** Merge child[k + 1] into child[k], and remove the separator between them
+ *
+ */
+static void btree_merge(btree_internal_t *parent, int k)
+{
+	btree_node_t *left = parent->child[k];
+	btree_node_t *right = parent->child[k + 1];
+
+	if (left->leaf) {
+		fr_btree_leaf_t *l = LEAF(left), *r = LEAF(right);
+
+		memcpy(l->data + l->hdr.num, r->data, sizeof(r->data[0]) * r->hdr.num);
+		l->hdr.num += r->hdr.num;
+		l->next = r->next;
+	} else {
+		btree_internal_t *l = INTERNAL(left), *r = INTERNAL(right);
+
+		l->key[l->hdr.num] = parent->key[k];
+		memcpy(l->key + l->hdr.num + 1, r->key, sizeof(r->key[0]) * r->hdr.num);
+		memcpy(l->child + l->hdr.num + 1, r->child, sizeof(r->child[0]) * (r->hdr.num + 1));
+		l->hdr.num += r->hdr.num + 1;
+	}
+	talloc_free(right);
+
+	memmove(parent->key + k, parent->key + k + 1, sizeof(parent->key[0]) * (parent->hdr.num - k - 1));
+	memmove(parent->child + k + 1, parent->child + k + 2, sizeof(parent->child[0]) * (parent->hdr.num - k - 1));
+	parent->hdr.num--;
+}
+
+/** Remove an entry from the tree, without locking it
+ *
+ * @return
+ *	- true if the entry was removed, and freed if there's a free function.
+ *	- false if the entry wasn't found.
+ */
+static bool btree_delete_internal(fr_btree_t *tree, void const *data)
+{
+	btree_internal_t	*path[BTREE_MAX_DEPTH];
+	int			idx[BTREE_MAX_DEPTH];
+	int			depth = 0, pos;
+	btree_node_t		*node = tree->root;
+	fr_btree_leaf_t		*leaf;
+	bool			found, exact;
+	void			*old;
+
+	while (!node->leaf) {
+		fr_assert(depth < BTREE_MAX_DEPTH);
+
+		path[depth] = INTERNAL(node);
+		idx[depth] = internal_child(tree, path[depth], data, &exact);
+		node = path[depth]->child[idx[depth]];
+		depth++;
+	}
+
+	leaf = LEAF(node);
+	pos = leaf_lower_bound(tree, leaf, data, &found);
+	if (!found) return false;
+
+	old = leaf->data[pos];
+	memmove(leaf->data + pos, leaf->data + pos + 1, sizeof(leaf->data[0]) * (leaf->hdr.num - pos - 1));
+	leaf->hdr.num--;
+	tree->num_elements--;
+
+	/*
+	 *	Rebalance from the leaf upwards, stopping at the
+	 *	first node which didn't need to merge.
+	 */
+	while ((depth > 0) && (node->num < BTREE_MIN)) {
+		btree_internal_t	*parent = path[depth - 1];
+		int			i = idx[depth - 1];
+
+		if ((i > 0) && (parent->child[i - 1]->num > BTREE_MIN)) {
+			btree_borrow_left(parent, i);
+			break;
+		}
+
+		if ((i < parent->hdr.num) && (parent->child[i + 1]->num > BTREE_MIN)) {
+			btree_borrow_right(parent, i);
+			break;
+		}
+
+		btree_merge(parent, (i > 0) ? i - 1 : i);
+
+		node = &parent->hdr;
+		depth--;
+	}
+
+	if (!tree->root->leaf && (tree->root->num == 0)) {
+		btree_node_t *root = tree->root;
+
+		tree->root = INTERNAL(root)->child[0];
+		talloc_free(root);
+	}
+
+	/*
+	 *	If the entry was the smallest in a subtree, there's
+	 *	a separator pointing to it, which now has to point
+	 *	to the new smallest entry.
+	 */
+	node = tree->root;
+	while (!node->leaf) {
+		btree_internal_t	*in = INTERNAL(node);
+		int			i;
+
+		i = internal_child(tree, in, old, &exact);
+		if (exact) {
+			btree_node_t *min = in->child[i];
+
+			while (!min->leaf) min = INTERNAL(min)->child[0];
+			in->key[i - 1] = LEAF(min)->data[0];
+			break;
+		}
+		node = in->child[i];
+	}
+
+	if (tree->free) tree->free(old);
+
+	return true;
+}
+
+/** Delete an entry from the tree, calling the free function if there is one
+ *
+ * @param[in] tree	to delete from.
+ * @param[in] data	to find and delete.
+ * @return
+ *	- true if the entry was deleted.
+ *	- false if it wasn't found.
+ */
+bool fr_btree_deletebydata(fr_btree_t *tree, void const *data)
+{
+	bool ret;
+
+	if (unlikely(tree->being_freed)) return false;
+
+	if (tree->lock) pthread_mutex_lock(&tree->mutex);
+	ret = btree_delete_internal(tree, data);
+	if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+
+	return ret;
+}
+
+/** Find an entry in the tree
+ *
+ */
+void *fr_btree_finddata(fr_btree_t *tree, void const *data)
+{
+	fr_btree_leaf_t	*leaf;
+	bool		found;
+	int		pos;
+	void		*out;
+
+	if (unlikely(tree->being_freed)) return NULL;
+
+	if (tree->lock) pthread_mutex_lock(&tree->mutex);
+	leaf = btree_leaf_find(tree, data);
+	pos = leaf_lower_bound(tree, leaf, data, &found);
+	out = found ? leaf->data[pos] : NULL;
+	if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+
+	return out;
+}
+
+uint32_t fr_btree_num_elements(fr_btree_t *tree)
+{
+	if (!tree) return 0;
+
+	return tree->num_elements;
+}
+
+/** Position an iterator at the first entry >= data
+ *
+ */
+static void btree_seek(fr_btree_t *tree, fr_btree_iter_t *iter, void const *data)
+{
+	bool found;
+
+	iter->leaf = btree_leaf_find(tree, data);
+	iter->pos = leaf_lower_bound(tree, iter->leaf, data, &found);
+}
+
+/*
+ *	The compare should return:
+ *
+ *		< 0  - on error
+ *		0    - continue walking, don't delete the node
+ *		1    - delete the node and stop walking
+ *		2    - delete the node and continue walking
+ */
+static int walk_delete_order(fr_btree_t *tree, rb_walker_t compare, void *uctx)
+{
+	fr_btree_iter_t	iter = { .leaf = tree->first, .pos = 0 };
+	void		*data, *next;
+	int		rcode = 0;
+
+	while (iter.leaf) {
+		if (iter.pos >= iter.leaf->hdr.num) {
+			iter.leaf = iter.leaf->next;
+			iter.pos = 0;
+			continue;
+		}
+
+		data = iter.leaf->data[iter.pos];
+		rcode = compare(data, uctx);
+		if (rcode < 0) return rcode;
+
+		if (rcode == 0) {
+			iter.pos++;
+			continue;
+		}
+
+		/*
+		 *	Deleting may move entries between leaves,
+		 *	so find the next entry again afterwards.
+		 */
+		if ((iter.pos + 1) < iter.leaf->hdr.num) {
+			next = iter.leaf->data[iter.pos + 1];
+		} else if (iter.leaf->next) {
+			next = iter.leaf->next->data[0];
+		} else {
+			next = NULL;
+		}
+
+		(void) btree_delete_internal(tree, data);
+		if ((rcode != 2) || !next) return rcode;
+
+		btree_seek(tree, &iter, next);
+	}
+
+	return rcode;
+}
+
+/** Walk the entire tree
+ *
+ * Entries are only stored in the leaves, so RBTREE_PRE_ORDER,
+ * RBTREE_IN_ORDER and RBTREE_POST_ORDER all visit entries in order.
+ * RBTREE_DELETE_ORDER behaves as it does for rbtree_walk().
+ *
+ * The compare function should return 0 to continue walking.
+ * Any other value stops the walk, and is returned.
+ */
+int fr_btree_walk(fr_btree_t *tree, rb_order_t order, rb_walker_t compare, void *uctx)
+{
+	fr_btree_leaf_t	*leaf;
+	int		i, rcode = 0;
+
+	if (tree->num_elements == 0) return 0;
+
+	if (tree->lock) pthread_mutex_lock(&tree->mutex);
+
+	switch (order) {
+	case RBTREE_PRE_ORDER:
+	case RBTREE_IN_ORDER:
+	case RBTREE_POST_ORDER:
+		for (leaf = tree->first; leaf; leaf = leaf->next) {
+			for (i = 0; i < leaf->hdr.num; i++) {
+				rcode = compare(leaf->data[i], uctx);
+				if (rcode != 0) goto done;
+			}
+		}
+		break;
+
+	case RBTREE_DELETE_ORDER:
+		rcode = walk_delete_order(tree, compare, uctx);
+		break;
+
+	default:
+		rcode = -1;
+		break;
+	}
+
+done:
+	if (tree->lock) pthread_mutex_unlock(&tree->mutex);
+	return rcode;
+}
+
+typedef struct {
+	size_t			idx;
+	void			**data;
+} btree_flatten_ctx_t;
+
+static int _flatten_cb(void *data, void *uctx)
+{
+	btree_flatten_ctx_t *ctx = uctx;
+	ctx->data[ctx->idx++] = data;
+	return 0;
+}
+
+/** Return an array containing all elements in the tree, in order
+ *
+ * @param[in] ctx	Where to allocate the array.
+ * @param[out] out	Where to write a pointer to the array.
+ * @param[in] tree	to flatten.
+ * @param[in] order	to flatten the tree in.
+ * @return
+ *	- The number of elements in the tree.
+ */
+uint32_t fr_btree_flatten(TALLOC_CTX *ctx, void **out[], fr_btree_t *tree, rb_order_t order)
+{
+	uint32_t		num = fr_btree_num_elements(tree);
+	btree_flatten_ctx_t	uctx;
+
+	if (unlikely(!tree)) {
+		*out = NULL;
+		return 0;
+	}
+
+	uctx.idx = 0;
+	uctx.data = talloc_array(ctx, void *, num);
+	if (!uctx.data) return 0;
+	fr_btree_walk(tree, order, _flatten_cb, &uctx);
+	*out = uctx.data;
+
+	return uctx.idx;
+}
+
+/** Initialise an iterator, for walking over a range of entries in order
+ *
+ * @note If the tree is modified the iterator should be considered invalidated.
+ *	The tree isn't locked while iterating.
+ *
+ * @param[in] tree	to iterate over.
+ * @param[in] iter	to initialise.
+ * @param[in] start	Return entries >= this.  NULL to start at the smallest entry.
+ * @return
+ *	- The first entry in the range.
+ *	- NULL if there are no entries in the range.
+ */
+void *fr_btree_iter_init(fr_btree_t *tree, fr_btree_iter_t *iter, void const *start)
+{
+	if (start) {
+		btree_seek(tree, iter, start);
+	} else {
+		iter->leaf = tree->first;
+		iter->pos = 0;
+	}
+
+	return fr_btree_iter_next(tree, iter);
+}
+
+/** Return the next entry, in order
+ *
+ * @param[in] tree	to iterate over.
+ * @param[in] iter	initialised with fr_btree_iter_init().
+ * @return
+ *	- The next entry.
+ *	- NULL if at the end of the tree.
+ */
+void *fr_btree_iter_next(UNUSED fr_btree_t *tree, fr_btree_iter_t *iter)
+{
+	while (iter->leaf && (iter->pos >= iter->leaf->hdr.num)) {
+		iter->leaf = iter->leaf->next;
+		iter->pos = 0;
+	}
+	if (!iter->leaf) return NULL;
+
+	return iter->leaf->data[iter->pos++];
+}
@@ -0,0 +1,100 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** B+tree implementation
+ *
+ * Takes the same comparators, walkers, free functions and flags as
+ * the red/black tree, so callers can switch between the two.
+ *
+ * @file src/lib/util/btree.h
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(btree_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/util/rbtree.h>
+
+typedef struct fr_btree_s fr_btree_t;
+typedef struct fr_btree_leaf_s fr_btree_leaf_t;
+
+/** Stores the state of the current iteration operation
+ *
+ */
+typedef struct {
+	fr_btree_leaf_t		*leaf;		//!< Leaf we're currently in.
+	int			pos;		//!< Position of the next entry in the leaf.
+} fr_btree_iter_t;
+
+/** Creates a B+tree that verifies elements are of a specific talloc type
+ *
+ * @param[in] _ctx		to tie tree lifetime to.
+ *				If ctx is freed, tree will free any nodes, calling the
+ *				free function if set.
+ * @param[in] _cmp		Comparator used to compare nodes.
+ * @param[in] _talloc_type	of elements.
+ * @param[in] _node_free	Optional function used to free data if tree nodes are
+ *				deleted or replaced.
+ * @param[in] _flags		RBTREE_FLAG_* to modify tree behaviour.
+ * @return
+ *	- A new B+tree on success.
+ *	- NULL on failure.
+ */
+#define		fr_btree_talloc_create(_ctx, _cmp, _talloc_type, _node_free, _flags) \
+		_fr_btree_create(_ctx, _cmp, #_talloc_type, _node_free, _flags)
+
+/** Creates a B+tree
+ *
+ * @param[in] _ctx		to tie tree lifetime to.
+ *				If ctx is freed, tree will free any nodes, calling the
+ *				free function if set.
+ * @param[in] _cmp		Comparator used to compare nodes.
+ * @param[in] _node_free	Optional function used to free data if tree nodes are
+ *				deleted or replaced.
+ * @param[in] _flags		RBTREE_FLAG_* to modify tree behaviour.
+ * @return
+ *	- A new B+tree on success.
+ *	- NULL on failure.
+ */
+#define		fr_btree_create(_ctx, _cmp, _node_free, _flags) \
+		_fr_btree_create(_ctx, _cmp, NULL, _node_free, _flags)
+
+fr_btree_t	*_fr_btree_create(TALLOC_CTX *ctx, rb_comparator_t compare,
+				  char const *type, rb_free_t node_free, int flags);
+
+bool		fr_btree_insert(fr_btree_t *tree, void const *data);
+
+bool		fr_btree_deletebydata(fr_btree_t *tree, void const *data);
+
+void		*fr_btree_finddata(fr_btree_t *tree, void const *data);
+
+uint32_t	fr_btree_num_elements(fr_btree_t *tree);
+
+uint32_t	fr_btree_flatten(TALLOC_CTX *ctx, void **out[], fr_btree_t *tree, rb_order_t order);
+
+int		fr_btree_walk(fr_btree_t *tree, rb_order_t order, rb_walker_t compare, void *uctx);
+
+void		*fr_btree_iter_init(fr_btree_t *tree, fr_btree_iter_t *iter, void const *start);
+
+void		*fr_btree_iter_next(fr_btree_t *tree, fr_btree_iter_t *iter);
+
+#ifdef __cplusplus
+}
+#endif
@@ -64,7 +64,16 @@ struct fr_dbuff_s {
  *
  * @param[in] _dbuff	to make an ephemeral copy of.
  */
-#define FR_DBUFF_NO_ADVANCE(_dbuff) (fr_dbuff_t[]){ *(_dbuff) }
+#define FR_DBUFF_NO_ADVANCE(_dbuff) \
+(fr_dbuff_t[]){ \
+	{ \
+		.start	= (_dbuff)->start, \
+		.end	= (_dbuff)->end, \
+		.p	= (_dbuff)->p, \
+		.is_const = (_dbuff)->is_const, \
+		.parent = NULL \
+	} \
+}
 
 /** Reserve N bytes in the dbuff when passing it to another function
  *
@@ -84,12 +93,10 @@ struct fr_dbuff_s {
 #define FR_DBUFF_RESERVE(_dbuff, _reserve) \
 &(fr_dbuff_t){ \
 	.start	= (_dbuff)->start, \
-	.end	= ((size_t)(_dbuff) > (_reserve)) && ((_dbuff)->end - (_reserve)) >= ((_dbuff)->start) ? \
+	.end	= (fr_dbuff_freespace(_dbuff) > (_reserve)) ? \
 			(_dbuff)->end - (_reserve) : \
-			(_dbuff)->start, \
-	.p	= ((size_t)(_dbuff) > (_reserve)) && ((_dbuff)->end - (_reserve)) >= ((_dbuff)->p) ? \
-			(_dbuff)->p : \
-			(_dbuff)->end - (_reserve), \
+			(_dbuff)->p, \
+	.p	= (_dbuff)->p, \
 	.is_const = (_dbuff)->is_const, \
 	.parent = (_dbuff) \
 }
@@ -109,9 +116,10 @@ struct fr_dbuff_s {
  * @param[in] _dbuff	to reserve bytes in.
  * @param[in] _max	The maximum number of bytes the caller is allowed to write to.
  */
-#define FR_DBUFF_MAX(_dbuff,  _max) (fr_dbuff_freespace(_dbuff) > (_max)) ? \
-	FR_DBUFF_RESERVE(_dbuff, fr_dbuff_freespace(_dbuff) - (_max)) : \
-	_dbuff)
+#define FR_DBUFF_MAX(_dbuff,  _max) \
+	((fr_dbuff_freespace(_dbuff) > (_max)) ? \
+		FR_DBUFF_RESERVE(_dbuff, fr_dbuff_freespace(_dbuff) - (_max)) : \
+		(_dbuff))
 
 /** Does the actual work of initialising a dbuff
  *
@@ -123,6 +131,7 @@ static inline void _fr_dbuff_init(fr_dbuff_t *out, uint8_t const *start, uint8_t
 	out->p_i = out->start_i = start;
 	out->end_i = end;
 	out->is_const = is_const;
+	out->parent = NULL;
 }
 
 /** Initialise an dbuff for encoding or decoding
@@ -158,12 +167,12 @@ _fr_dbuff_init(_out, \
 #define FR_DBUFF_TMP(_start, _len_or_end) \
 &(fr_dbuff_t){ \
 	.start	= _start, \
-	.end	= _Generic((_len_or_end), \
+	.end_i	= _Generic((_len_or_end), \
 			size_t		: (uint8_t const *)(_start) + (size_t)(_len_or_end), \
 			uint8_t *	: (uint8_t const *)(_len_or_end), \
 			uint8_t const *	: (uint8_t const *)(_len_or_end) \
 		), \
-	.p	= _p \
+	.p	= _start \
 }
 /** @} */
 
@@ -235,7 +244,7 @@ static inline size_t fr_dbuff_len(fr_dbuff_t const *dbuff)
  */
 #define FR_DBUFF_RETURN(_func, _dbuff, ...) \
 do { \
-	size_t _slen; \
+	ssize_t _slen; \
 	_slen = _func(_dbuff, ## __VA_ARGS__ ); \
 	if (_slen < 0) return _slen; \
 } while (0)
@@ -334,6 +343,58 @@ static inline ssize_t fr_dbuff_memset(fr_dbuff_t *dbuff, uint8_t c, size_t inlen
 
 /** @} */
 
+/** @name Reservations
+ *
+ * Encoders often can't tell whether an item will fit until they've
+ * written most of it.  A reservation is a dbuff covering the free space
+ * of another.  Data written to the reservation isn't accounted for in
+ * the original until it's committed, so an encoder which runs out of
+ * space, or decides to skip an item, simply returns without committing.
+ *
+ @code{.c}
+ fr_dbuff_t work_dbuff;
+
+ fr_dbuff_reservation_init(&work_dbuff, dbuff, UINT8_MAX);
+ FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, attr, 2);
+ ...
+ return fr_dbuff_commit(dbuff, &work_dbuff);
+ @endcode
+ * @{
+ */
+
+/** Initialise a reservation in the free space of a dbuff
+ *
+ * @param[out] out	Reservation to initialise.
+ * @param[in] dbuff	to reserve free space in.
+ * @param[in] max	The maximum number of bytes the reservation may hold.
+ *			SIZE_MAX to reserve all of the free space.
+ */
+static inline void fr_dbuff_reservation_init(fr_dbuff_t *out, fr_dbuff_t const *dbuff, size_t max)
+{
+	size_t freespace = fr_dbuff_freespace(dbuff);
+
+	out->p = out->start = dbuff->p;
+	out->end = dbuff->p + ((max < freespace) ? max : freespace);
+	out->is_const = dbuff->is_const;
+	out->parent = NULL;
+}
+
+/** Advance a dbuff past the data written to a reservation
+ *
+ * @param[in] dbuff		the reservation was made in.
+ * @param[in] reservation	to commit.
+ * @return
+ *	- 0	nothing was written to the reservation.
+ *	- >0	the number of bytes committed.
+ */
+static inline ssize_t fr_dbuff_commit(fr_dbuff_t *dbuff, fr_dbuff_t const *reservation)
+{
+	fr_assert(reservation->start == dbuff->p);
+
+	return fr_dbuff_advance(dbuff, fr_dbuff_used(reservation));
+}
+/** @} */
+
 #ifdef __cplusplus
 }
 #endif
@@ -32,11 +32,73 @@ static void test_dbuff_init(void)
 	TEST_CHECK(dbuff.end == in + sizeof(in));
 }
 
+static void test_dbuff_max(void)
+{
+	uint8_t		buff[16] = { 0 };
+	fr_dbuff_t	dbuff;
+	fr_dbuff_t	*max;
+
+	fr_dbuff_init(&dbuff, buff, sizeof(buff));
+
+	TEST_CASE("Max smaller than the free space");
+	max = FR_DBUFF_MAX(&dbuff, 4);
+	TEST_CHECK(max != &dbuff);
+	TEST_CHECK(fr_dbuff_freespace(max) == 4);
+
+	TEST_CASE("Writing to the max advances the parent");
+	TEST_CHECK(fr_dbuff_bytes_in(max, 0x01, 0x02) == 2);
+	TEST_CHECK(dbuff.p == buff + 2);
+	TEST_CHECK(fr_dbuff_bytes_in(max, 0x03, 0x04, 0x05) < 0);
+	TEST_CHECK(dbuff.p == buff + 2);
+
+	TEST_CASE("Max larger than the free space");
+	max = FR_DBUFF_MAX(&dbuff, 64);
+	TEST_CHECK(max == &dbuff);
+
+	TEST_CASE("Reserve more than the free space");
+	TEST_CHECK(fr_dbuff_freespace(FR_DBUFF_RESERVE(&dbuff, 32)) == 0);
+}
+
+static void test_dbuff_reservation(void)
+{
+	uint8_t		buff[16] = { 0 };
+	fr_dbuff_t	dbuff, work_dbuff;
+
+	fr_dbuff_init(&dbuff, buff, sizeof(buff));
+	TEST_CHECK(fr_dbuff_bytes_in(&dbuff, 0xff) == 1);
+
+	TEST_CASE("Reservation starts at the current position");
+	fr_dbuff_reservation_init(&work_dbuff, &dbuff, 8);
+	TEST_CHECK(work_dbuff.start == buff + 1);
+	TEST_CHECK(work_dbuff.p == buff + 1);
+	TEST_CHECK(fr_dbuff_freespace(&work_dbuff) == 8);
+
+	TEST_CASE("Writes to the reservation aren't accounted for until commit");
+	TEST_CHECK(fr_dbuff_bytes_in(&work_dbuff, 0x01, 0x02, 0x03) == 3);
+	TEST_CHECK(dbuff.p == buff + 1);
+	TEST_CHECK(fr_dbuff_bytes_in(&work_dbuff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00) < 0);
+
+	TEST_CASE("Commit advances the dbuff");
+	TEST_CHECK(fr_dbuff_commit(&dbuff, &work_dbuff) == 3);
+	TEST_CHECK(dbuff.p == buff + 4);
+	TEST_CHECK(buff[3] == 0x03);
+
+	TEST_CASE("Reservation of all the free space");
+	fr_dbuff_reservation_init(&work_dbuff, &dbuff, SIZE_MAX);
+	TEST_CHECK(work_dbuff.end == dbuff.end);
+
+	TEST_CASE("Empty commit");
+	TEST_CHECK(fr_dbuff_commit(&dbuff, &work_dbuff) == 0);
+	TEST_CHECK(dbuff.p == buff + 4);
+}
+
 TEST_LIST = {
 	/*
 	 *	Basic tests
 	 */
 	{ "fr_dbuff_init",				test_dbuff_init },
+	{ "FR_DBUFF_MAX",				test_dbuff_max },
+	{ "fr_dbuff_reservation",			test_dbuff_reservation },
 
 	{ NULL }
 };
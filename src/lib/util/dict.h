@@ -272,6 +272,9 @@ int			fr_dict_unknown_vendor_afrom_num(TALLOC_CTX *ctx, fr_dict_attr_t **out,
 fr_dict_attr_t const   	*fr_dict_unknown_afrom_fields(TALLOC_CTX *ctx, fr_dict_attr_t const *parent,
 						      unsigned int vendor, unsigned int attr) CC_HINT(nonnull(2));
 
+fr_dict_attr_t const	*fr_dict_unknown_cached_by_fields(TALLOC_CTX *ctx, fr_dict_attr_t const *parent,
+							  unsigned int vendor, unsigned int attr) CC_HINT(nonnull(1,2));
+
 ssize_t			fr_dict_unknown_afrom_oid_str(TALLOC_CTX *ctx, fr_dict_attr_t **out,
 			      	      		      fr_dict_attr_t const *parent, char const *oid_str);
 
@@ -434,6 +437,14 @@ void			fr_dict_global_read_only(void);
 
 char const		*fr_dict_global_dir(void);
 
+int			fr_dict_global_cache_load(char const *file);
+
+int			fr_dict_global_cache_record(void);
+
+int			fr_dict_global_cache_write(char const *file);
+
+int			fr_dict_cache_print(FILE *fp, char const *file);
+
 fr_dict_t		*fr_dict_unconst(fr_dict_t const *dict);
 
 fr_dict_attr_t		*fr_dict_attr_unconst(fr_dict_attr_t const *da);
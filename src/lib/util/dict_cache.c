@@ -0,0 +1,709 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Compiled dictionary images
+ *
+ * An image holds the tokenised lines of every dictionary file which
+ * was read while it was being recorded, in the order they were read.
+ * Loading dictionaries from an image skips opening, reading and
+ * tokenising the files, the lines are handed straight to the
+ * dictionary parser.
+ *
+ * The image contains only offsets, so it can be mapped anywhere.
+ * It's checked against a hash of its own contents, and against the
+ * size and a hash of the contents of every source file, when it's
+ * loaded.  If anything has changed the image is refused, and the
+ * dictionaries are parsed as normal.
+ *
+ * @file src/lib/util/dict_cache.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/dict_priv.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/version.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DICT_CACHE_MAGIC	"FRDICTC"
+#define DICT_CACHE_VERSION	(1)
+#define DICT_CACHE_ALIGN(_x)	(((_x) + 7) & ~((size_t) 7))
+
+/** Header at the start of every image
+ *
+ */
+typedef struct {
+	char			magic[8];	//!< DICT_CACHE_MAGIC.
+	uint64_t		lib_magic;	//!< RADIUSD_MAGIC_NUMBER of the build which wrote the image.
+	uint32_t		version;	//!< DICT_CACHE_VERSION.
+	uint32_t		hash;		//!< Of everything after the header.
+	uint32_t		len;		//!< Of the image, including the header.
+	uint32_t		num_files;	//!< Number of FILE and MISSING records.
+} dict_cache_hdr_t;
+
+typedef enum {
+	DICT_CACHE_REC_FILE = 1,		//!< Start of a dictionary file.
+	DICT_CACHE_REC_MISSING,			//!< Optional file which didn't exist.
+	DICT_CACHE_REC_LINE,			//!< Tokenised line.
+	DICT_CACHE_REC_END			//!< End of a dictionary file.
+} dict_cache_rec_type_t;
+
+typedef struct {
+	uint8_t			type;		//!< One of dict_cache_rec_type_t.
+	uint8_t			argc;		//!< Number of strings in a LINE record.
+	uint16_t		len;		//!< Of the record, including this header.
+	uint32_t		line;		//!< Line number for LINE records, depth for FILE records.
+} dict_cache_rec_t;
+
+/** FILE and MISSING records
+ *
+ */
+typedef struct {
+	dict_cache_rec_t	rec;
+	uint32_t		next;		//!< Offset of the record after the matching END.
+	uint32_t		hash;		//!< Of the file contents.
+	uint64_t		size;		//!< Of the file.
+	char			path[];		//!< Full path of the file.
+} dict_cache_file_t;
+
+struct dict_cache_s {
+	uint8_t			*start;		//!< Of the image.
+	size_t			len;		//!< Of the image, or of the records written so far.
+	bool			recording;	//!< Whether we're writing records, or reading them.
+	bool			mapped;		//!< Whether start points to a mapping of the image file.
+};
+
+static int _dict_cache_free(dict_cache_t *cache)
+{
+	if (cache->mapped) munmap(cache->start, cache->len);
+
+	return 0;
+}
+
+/** Hash the contents of a file
+ *
+ * @param[out] hash	of the file contents.
+ * @param[out] sb	stat of the file.
+ * @param[in] path	of the file.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int dict_cache_file_hash(uint32_t *hash, struct stat *sb, char const *path)
+{
+	int		fd;
+	ssize_t		slen;
+	uint8_t		buffer[8192];
+	uint32_t	h = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", path, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, sb) < 0) {
+		fr_strerror_printf("Failed stating %s: %s", path, fr_syserror(errno));
+	error:
+		close(fd);
+		return -1;
+	}
+
+	while ((slen = read(fd, buffer, sizeof(buffer))) > 0) h = fr_hash_update(buffer, slen, h);
+	if (slen < 0) {
+		fr_strerror_printf("Failed reading %s: %s", path, fr_syserror(errno));
+		goto error;
+	}
+	close(fd);
+
+	*hash = h;
+	return 0;
+}
+
+/** Whether dictionary files should be recorded, or read from the image
+ *
+ */
+bool dict_cache_recording(dict_cache_t const *cache)
+{
+	return cache->recording;
+}
+
+/** Reserve space for a new record
+ *
+ */
+static dict_cache_rec_t *dict_cache_rec_alloc(dict_cache_t *cache, dict_cache_rec_type_t type, size_t len)
+{
+	dict_cache_rec_t	*rec;
+	size_t			size = DICT_CACHE_ALIGN(len);
+
+	if (size > UINT16_MAX) {
+		fr_strerror_printf("Dictionary cache record too large");
+		return NULL;
+	}
+
+	if ((cache->len + size) > talloc_array_length(cache->start)) {
+		uint8_t *start;
+
+		start = talloc_realloc(cache, cache->start, uint8_t, (cache->len + size) * 2);
+		if (!start) {
+			fr_strerror_printf("Out of memory");
+			return NULL;
+		}
+		cache->start = start;
+	}
+
+	rec = (dict_cache_rec_t *) (cache->start + cache->len);
+	memset(rec, 0, size);
+	rec->type = type;
+	rec->len = size;
+	cache->len += size;
+
+	return rec;
+}
+
+/** Record the start of a dictionary file
+ *
+ * @param[in] cache	being recorded.
+ * @param[out] offset	of the new record, to pass to #dict_cache_record_end.
+ * @param[in] path	of the file.
+ * @param[in] depth	of $INCLUDE nesting.
+ * @param[in] found	whether the file exists.  Missing files still get a
+ *			record, so that the image is refused if they appear.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int dict_cache_record_file(dict_cache_t *cache, size_t *offset, char const *path, int depth, bool found)
+{
+	dict_cache_file_t	*file;
+	struct stat		sb;
+	uint32_t		hash = 0;
+	size_t			len = strlen(path) + 1;
+
+	if (found && (dict_cache_file_hash(&hash, &sb, path) < 0)) return -1;
+
+	*offset = cache->len;
+	file = (dict_cache_file_t *) dict_cache_rec_alloc(cache, found ? DICT_CACHE_REC_FILE : DICT_CACHE_REC_MISSING,
+							  sizeof(*file) + len);
+	if (!file) return -1;
+
+	file->rec.line = depth;
+	file->hash = hash;
+	file->size = found ? sb.st_size : 0;
+	memcpy(file->path, path, len);
+
+	file->next = cache->len;	/* Fixed up by dict_cache_record_end() for FILE records */
+
+	return 0;
+}
+
+/** Record a tokenised line
+ *
+ * @param[in] cache	being recorded.
+ * @param[in] line	number.
+ * @param[in] argv	the line was split into.
+ * @param[in] argc	the number of strings in argv.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int dict_cache_record_line(dict_cache_t *cache, int line, char **argv, int argc)
+{
+	dict_cache_rec_t	*rec;
+	size_t			len = 0;
+	char			*p;
+	int			i;
+
+	for (i = 0; i < argc; i++) len += strlen(argv[i]) + 1;
+
+	rec = dict_cache_rec_alloc(cache, DICT_CACHE_REC_LINE, sizeof(*rec) + len);
+	if (!rec) return -1;
+
+	rec->argc = argc;
+	rec->line = line;
+
+	p = (char *) (rec + 1);
+	for (i = 0; i < argc; i++) {
+		len = strlen(argv[i]) + 1;
+		memcpy(p, argv[i], len);
+		p += len;
+	}
+
+	return 0;
+}
+
+/** Record the end of a dictionary file
+ *
+ * @param[in] cache	being recorded.
+ * @param[in] offset	of the FILE record, as returned by #dict_cache_record_file.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int dict_cache_record_end(dict_cache_t *cache, size_t offset)
+{
+	dict_cache_file_t	*file;
+
+	if (!dict_cache_rec_alloc(cache, DICT_CACHE_REC_END, sizeof(dict_cache_rec_t))) return -1;
+
+	file = (dict_cache_file_t *) (cache->start + offset);
+	file->next = cache->len;
+
+	return 0;
+}
+
+/** Return the current end of the recording
+ *
+ * Used to throw away the records for a dictionary which failed to load.
+ */
+size_t dict_cache_mark(dict_cache_t *cache)
+{
+	return cache->len;
+}
+
+/** Throw away records written since a mark
+ *
+ */
+void dict_cache_rewind(dict_cache_t *cache, size_t mark)
+{
+	cache->len = mark;
+}
+
+/** Find the start of a dictionary file in the image
+ *
+ * If the cursor is zero we're looking for a top level file, which
+ * may be anywhere in the image.  Otherwise the file must be the next
+ * record, as it's been $INCLUDEd.
+ *
+ * @param[in] cache		being replayed.
+ * @param[in,out] cursor	offset of the next record.
+ * @param[in] path		of the file.
+ * @return
+ *	- 1 if the file was found.  The cursor is updated to point to its first line.
+ *	- 0 if the file was recorded as missing.
+ *	- -1 if the file isn't in the image.
+ */
+int dict_cache_replay_file(dict_cache_t *cache, size_t *cursor, char const *path)
+{
+	dict_cache_file_t const	*file;
+	size_t			offset = *cursor;
+
+	if (!offset) {
+		for (offset = sizeof(dict_cache_hdr_t); offset < cache->len; offset = file->next) {
+			file = (dict_cache_file_t const *) (cache->start + offset);
+			if (strcmp(file->path, path) == 0) break;
+			if (file->next <= offset) return -1;
+		}
+	}
+
+	if ((offset + sizeof(dict_cache_file_t)) > cache->len) return -1;
+
+	file = (dict_cache_file_t const *) (cache->start + offset);
+	if (((file->rec.type != DICT_CACHE_REC_FILE) && (file->rec.type != DICT_CACHE_REC_MISSING)) ||
+	    (strcmp(file->path, path) != 0)) return -1;
+
+	*cursor = offset + file->rec.len;
+
+	return (file->rec.type == DICT_CACHE_REC_FILE);
+}
+
+/** Return the next tokenised line of the current file
+ *
+ * @param[in] cache		being replayed.
+ * @param[in,out] cursor	offset of the next record.
+ * @param[out] line		number of the line.
+ * @param[out] buf		to copy the line into, as the parser modifies it.
+ * @param[in] buflen		length of buf.
+ * @param[out] argv		pointers to each string in buf.
+ * @param[in] max_argc		length of argv.
+ * @return
+ *	- >0 the number of strings in argv.
+ *	- 0 at the end of the file.
+ *	- -1 if the image is corrupt.
+ */
+int dict_cache_replay_line(dict_cache_t *cache, size_t *cursor, int *line,
+			   char *buf, size_t buflen, char **argv, int max_argc)
+{
+	dict_cache_rec_t const	*rec;
+	size_t			len;
+	char			*p;
+	int			i;
+
+	if ((*cursor + sizeof(*rec)) > cache->len) {
+	corrupt:
+		fr_strerror_printf("Dictionary cache is corrupt");
+		return -1;
+	}
+
+	rec = (dict_cache_rec_t const *) (cache->start + *cursor);
+	if ((rec->len < sizeof(*rec)) || ((*cursor + rec->len) > cache->len)) goto corrupt;
+
+	/*
+	 *	$INCLUDEs are handled by the caller, so the
+	 *	next record must be the end of the file, or
+	 *	another line.
+	 */
+	switch (rec->type) {
+	case DICT_CACHE_REC_END:
+		*cursor += rec->len;
+		return 0;
+
+	case DICT_CACHE_REC_LINE:
+		break;
+
+	default:
+		goto corrupt;
+	}
+
+	len = rec->len - sizeof(*rec);
+	if ((len > buflen) || (rec->argc == 0) || (rec->argc > max_argc)) goto corrupt;
+
+	memcpy(buf, rec + 1, len);
+	for (i = 0, p = buf; i < rec->argc; i++) {
+		argv[i] = p;
+		p += strlen(p) + 1;
+	}
+
+	*line = rec->line;
+	*cursor += rec->len;
+
+	return rec->argc;
+}
+
+/** Check an image is well formed, and matches the dictionaries on disk
+ *
+ * @param[in] cache	to check.
+ * @param[in] fp	If non-NULL, print each file, and whether it's changed.
+ * @return
+ *	- 0 if the image can be used.
+ *	- -1 if it can't.
+ */
+static int dict_cache_verify(dict_cache_t *cache, FILE *fp)
+{
+	dict_cache_hdr_t const	*hdr = (dict_cache_hdr_t const *) cache->start;
+	dict_cache_rec_t const	*rec;
+	dict_cache_file_t const	*file;
+	size_t			offset;
+	uint32_t		hash;
+	struct stat		sb;
+	int			stale = 0;
+
+	if ((cache->len < sizeof(*hdr)) || (memcmp(hdr->magic, DICT_CACHE_MAGIC, sizeof(hdr->magic)) != 0)) {
+		fr_strerror_printf("Not a dictionary cache");
+		return -1;
+	}
+
+	if (hdr->version != DICT_CACHE_VERSION) {
+		fr_strerror_printf("Dictionary cache version %u is not supported", hdr->version);
+		return -1;
+	}
+
+	if (hdr->lib_magic != RADIUSD_MAGIC_NUMBER) {
+		fr_strerror_printf("Dictionary cache was written by a different build");
+		return -1;
+	}
+
+	if ((hdr->len != cache->len) ||
+	    (fr_hash(cache->start + sizeof(*hdr), cache->len - sizeof(*hdr)) != hdr->hash)) {
+		fr_strerror_printf("Dictionary cache is corrupt");
+		return -1;
+	}
+
+	for (offset = sizeof(*hdr); offset < cache->len; offset += rec->len) {
+		rec = (dict_cache_rec_t const *) (cache->start + offset);
+		if ((rec->len < sizeof(*rec)) || ((offset + rec->len) > cache->len)) {
+			fr_strerror_printf("Dictionary cache is corrupt");
+			return -1;
+		}
+
+		switch (rec->type) {
+		case DICT_CACHE_REC_FILE:
+			file = (dict_cache_file_t const *) rec;
+			if ((dict_cache_file_hash(&hash, &sb, file->path) < 0) || !S_ISREG(sb.st_mode) ||
+#ifdef S_IWOTH
+			    ((sb.st_mode & S_IWOTH) != 0) ||
+#endif
+			    ((uint64_t) sb.st_size != file->size) || (hash != file->hash)) {
+				if (fp) fprintf(fp, "changed  %s\n", file->path);
+				stale++;
+				continue;
+			}
+			if (fp) fprintf(fp, "ok       %s\n", file->path);
+			break;
+
+		case DICT_CACHE_REC_MISSING:
+			file = (dict_cache_file_t const *) rec;
+			if (stat(file->path, &sb) == 0) {
+				if (fp) fprintf(fp, "created  %s\n", file->path);
+				stale++;
+				continue;
+			}
+			if (fp) fprintf(fp, "missing  %s\n", file->path);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if (stale) {
+		fr_strerror_printf("Dictionary cache is out of date, %i source files have changed", stale);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Map an image file
+ *
+ */
+static dict_cache_t *dict_cache_open(TALLOC_CTX *ctx, char const *file)
+{
+	dict_cache_t	*cache;
+	struct stat	sb;
+	void		*map;
+	int		fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening dictionary cache %s: %s", file, fr_syserror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &sb) < 0) {
+		fr_strerror_printf("Failed stating dictionary cache %s: %s", file, fr_syserror(errno));
+	error:
+		close(fd);
+		return NULL;
+	}
+
+	if ((size_t) sb.st_size < sizeof(dict_cache_hdr_t)) {
+		fr_strerror_printf("Dictionary cache %s is truncated", file);
+		goto error;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping dictionary cache %s: %s", file, fr_syserror(errno));
+		goto error;
+	}
+	close(fd);
+
+	cache = talloc_zero(ctx, dict_cache_t);
+	if (!cache) {
+		munmap(map, sb.st_size);
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	cache->start = map;
+	cache->len = sb.st_size;
+	cache->mapped = true;
+	talloc_set_destructor(cache, _dict_cache_free);
+
+	return cache;
+}
+
+/** Load dictionaries from a compiled image where possible
+ *
+ * After this call, any dictionary file which is in the image is read
+ * from it instead of being parsed.  Files which aren't in the image
+ * are parsed as normal.
+ *
+ * @param[in] file	containing the image, as written by #fr_dict_global_cache_write.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the image can't be used.  The dictionaries will be parsed as normal.
+ */
+int fr_dict_global_cache_load(char const *file)
+{
+	dict_cache_t	*cache;
+
+	if (!dict_gctx) {
+		fr_strerror_printf("Initialise global dictionary ctx with fr_dict_global_ctx_init()");
+		return -1;
+	}
+
+	cache = dict_cache_open(dict_gctx, file);
+	if (!cache) return -1;
+
+	if (dict_cache_verify(cache, NULL) < 0) {
+		fr_strerror_printf_push("Ignoring dictionary cache %s", file);
+		talloc_free(cache);
+		return -1;
+	}
+
+	talloc_free(dict_gctx->cache);
+	dict_gctx->cache = cache;
+
+	return 0;
+}
+
+/** Record every dictionary file read from now on, so they can be written out as an image
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_dict_global_cache_record(void)
+{
+	dict_cache_t	*cache;
+
+	if (!dict_gctx) {
+		fr_strerror_printf("Initialise global dictionary ctx with fr_dict_global_ctx_init()");
+		return -1;
+	}
+
+	cache = talloc_zero(dict_gctx, dict_cache_t);
+	if (!cache) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		talloc_free(cache);
+		return -1;
+	}
+
+	cache->start = talloc_zero_array(cache, uint8_t, 65536);
+	if (!cache->start) goto oom;
+	cache->len = sizeof(dict_cache_hdr_t);
+	cache->recording = true;
+
+	talloc_free(dict_gctx->cache);
+	dict_gctx->cache = cache;
+
+	return 0;
+}
+
+/** Write the dictionary files recorded since #fr_dict_global_cache_record as an image
+ *
+ * The image is written to a temporary file, and renamed into place,
+ * so that servers starting at the same time never see a partial image.
+ *
+ * @param[in] file	to write the image to.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_dict_global_cache_write(char const *file)
+{
+	dict_cache_t		*cache;
+	dict_cache_hdr_t	*hdr;
+	dict_cache_rec_t const	*rec;
+	size_t			offset;
+	char			*tmp;
+	int			fd;
+
+	if (!dict_gctx || !dict_gctx->cache || !dict_gctx->cache->recording) {
+		fr_strerror_printf("Dictionary cache is not being recorded");
+		return -1;
+	}
+	cache = dict_gctx->cache;
+
+	if (cache->len > UINT32_MAX) {
+		fr_strerror_printf("Dictionary cache too large");
+		return -1;
+	}
+
+	hdr = (dict_cache_hdr_t *) cache->start;
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, DICT_CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->lib_magic = RADIUSD_MAGIC_NUMBER;
+	hdr->version = DICT_CACHE_VERSION;
+	hdr->len = cache->len;
+	hdr->hash = fr_hash(cache->start + sizeof(*hdr), cache->len - sizeof(*hdr));
+
+	for (offset = sizeof(*hdr); offset < cache->len; offset += rec->len) {
+		rec = (dict_cache_rec_t const *) (cache->start + offset);
+		if ((rec->type == DICT_CACHE_REC_FILE) || (rec->type == DICT_CACHE_REC_MISSING)) hdr->num_files++;
+	}
+
+	tmp = talloc_asprintf(NULL, "%s.tmp", file);
+	if (!tmp) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fr_strerror_printf("Failed creating %s: %s", tmp, fr_syserror(errno));
+		talloc_free(tmp);
+		return -1;
+	}
+
+	if ((write(fd, cache->start, cache->len) != (ssize_t) cache->len) || (fsync(fd) < 0)) {
+		fr_strerror_printf("Failed writing %s: %s", tmp, fr_syserror(errno));
+	error:
+		close(fd);
+		unlink(tmp);
+		talloc_free(tmp);
+		return -1;
+	}
+
+	if (rename(tmp, file) < 0) {
+		fr_strerror_printf("Failed renaming %s to %s: %s", tmp, file, fr_syserror(errno));
+		goto error;
+	}
+
+	close(fd);
+	talloc_free(tmp);
+
+	return 0;
+}
+
+/** Print the contents of an image, and whether each of its source files has changed
+ *
+ * @param[in] fp	to print to.
+ * @param[in] file	containing the image.
+ * @return
+ *	- 0 if the image is up to date.
+ *	- -1 if it can't be used.
+ */
+int fr_dict_cache_print(FILE *fp, char const *file)
+{
+	dict_cache_t		*cache;
+	dict_cache_hdr_t const	*hdr;
+	dict_cache_rec_t const	*rec;
+	size_t			offset;
+	uint32_t		lines = 0;
+	int			ret;
+
+	cache = dict_cache_open(NULL, file);
+	if (!cache) return -1;
+
+	hdr = (dict_cache_hdr_t const *) cache->start;
+	if (memcmp(hdr->magic, DICT_CACHE_MAGIC, sizeof(hdr->magic)) == 0) {
+		fprintf(fp, "version  %u\n", hdr->version);
+		fprintf(fp, "size     %u\n", hdr->len);
+		fprintf(fp, "hash     0x%08x\n", hdr->hash);
+		fprintf(fp, "files    %u\n", hdr->num_files);
+
+		if (hdr->len == cache->len) for (offset = sizeof(*hdr); offset < cache->len; offset += rec->len) {
+			rec = (dict_cache_rec_t const *) (cache->start + offset);
+			if (rec->len < sizeof(*rec)) break;
+			if (rec->type == DICT_CACHE_REC_LINE) lines++;
+		}
+		fprintf(fp, "lines    %u\n", lines);
+	}
+
+	ret = dict_cache_verify(cache, fp);
+	talloc_free(cache);
+
+	return ret;
+}
@@ -101,6 +101,8 @@ struct fr_dict {
 	fr_dict_protocol_t const *proto;		//!< protocol-specific validation functions
 };
 
+typedef struct dict_cache_s dict_cache_t;
+
 struct fr_dict_gctx_s {
 	bool			read_only;
 	char			*dict_dir_default;	//!< The default location for loading dictionaries if one
@@ -122,6 +124,9 @@ struct fr_dict_gctx_s {
 	 * protocol.
 	 */
 	fr_dict_t		*internal;
+
+	dict_cache_t		*cache;			//!< Compiled dictionary image being recorded or
+							///< read from.
 };
 
 extern fr_dict_gctx_t *dict_gctx;
@@ -131,8 +136,28 @@ extern size_t date_precision_table_len;
 
 fr_dict_t		*dict_alloc(TALLOC_CTX *ctx);
 
+int			dict_cache_record_file(dict_cache_t *cache, size_t *offset, char const *path,
+					       int depth, bool found);
+
+int			dict_cache_record_line(dict_cache_t *cache, int line, char **argv, int argc);
+
+int			dict_cache_record_end(dict_cache_t *cache, size_t offset);
+
+size_t			dict_cache_mark(dict_cache_t *cache);
+
+void			dict_cache_rewind(dict_cache_t *cache, size_t mark);
+
+int			dict_cache_replay_file(dict_cache_t *cache, size_t *cursor, char const *path);
+
+int			dict_cache_replay_line(dict_cache_t *cache, size_t *cursor, int *line,
+					       char *buf, size_t buflen, char **argv, int max_argc);
+
+bool			dict_cache_recording(dict_cache_t const *cache);
+
 int			dict_dlopen(fr_dict_t *dict, char const *name);
 
+void			dict_unknown_cache_invalidate(void);
+
 /** Initialise fields in a dictionary attribute structure
  *
  * @param[in] da		to initialise.
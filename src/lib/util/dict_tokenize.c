@@ -91,6 +91,10 @@ typedef struct {
 
 	dict_enum_fixup_t	*enum_fixup;
 	dict_group_fixup_t	*group_fixup;
+
+	int			depth;			//!< of $INCLUDE nesting.
+	bool			replay;			//!< Read lines from the dictionary cache.
+	size_t			cache_cursor;		//!< Offset of the next record in the dictionary cache.
 } dict_tokenize_ctx_t;
 
 /*
@@ -1624,6 +1628,10 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 	int			argc;
 	fr_dict_attr_t const	*da;
 
+	dict_cache_t		*cache = dict_gctx->cache;
+	bool			recording = cache && dict_cache_recording(cache);
+	size_t			cache_offset = 0;
+
 	/*
 	 *	Base flags are only set for the current file
 	 */
@@ -1679,7 +1687,41 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 
 	ctx->stack[ctx->stack_depth].filename = fn;
 
+	/*
+	 *	The dictionary cache was checked against the files
+	 *	when it was loaded, so there's no need to open them.
+	 *	Top level files which aren't in the cache are parsed
+	 *	as normal.
+	 */
+	if (ctx->replay) {
+		switch (dict_cache_replay_file(cache, &ctx->cache_cursor, fn)) {
+		case 1:
+			fp = NULL;
+			goto read_lines;
+
+		case 0:
+			if (!src_file) goto not_cached;
+
+			fr_strerror_printf_push("Error reading dictionary: %s[%d]: Couldn't open dictionary '%s': %s",
+						src_file, src_line, fn, fr_syserror(ENOENT));
+			return -2;
+
+		default:
+			if (src_file) {
+				fr_strerror_printf_push("Dictionary cache does not match $INCLUDE at %s[%d]",
+							src_file, src_line);
+				return -1;
+			}
+		not_cached:
+			ctx->replay = false;
+			break;
+		}
+	}
+
 	if ((fp = fopen(fn, "r")) == NULL) {
+		if (recording && src_file &&
+		    (dict_cache_record_file(cache, &cache_offset, fn, ctx->depth, false) < 0)) return -1;
+
 		if (!src_file) {
 			fr_strerror_printf_push("Couldn't open dictionary %s: %s", fr_syserror(errno), fn);
 		} else {
@@ -1722,35 +1764,60 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 	 */
 	fr_rand_seed(&statbuf, sizeof(statbuf));
 
+	if (recording && (dict_cache_record_file(cache, &cache_offset, fn, ctx->depth, true) < 0)) {
+		fclose(fp);
+		return -1;
+	}
+
+read_lines:
 	memset(&base_flags, 0, sizeof(base_flags));
 
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		ctx->stack[ctx->stack_depth].line = line++;
+	while (true) {
+		if (!fp) {
+			argc = dict_cache_replay_line(cache, &ctx->cache_cursor, &line, buf, sizeof(buf), argv, MAX_ARGV);
+			if (argc < 0) {
+				fr_strerror_printf_push("Error reading %s", fn);
+				return -1;
+			}
+			if (argc == 0) break;
 
-		switch (buf[0]) {
-		case '#':
-		case '\0':
-		case '\n':
-		case '\r':
-			continue;
-		}
+			ctx->stack[ctx->stack_depth].line = line - 1;
+		} else {
+			if (fgets(buf, sizeof(buf), fp) == NULL) break;
 
-		/*
-		 *  Comment characters should NOT be appearing anywhere but
-		 *  as start of a comment;
-		 */
-		p = strchr(buf, '#');
-		if (p) *p = '\0';
+			ctx->stack[ctx->stack_depth].line = line++;
+
+			switch (buf[0]) {
+			case '#':
+			case '\0':
+			case '\n':
+			case '\r':
+				continue;
+			}
 
-		argc = fr_dict_str_to_argv(buf, argv, MAX_ARGV);
-		if (argc == 0) continue;
+			/*
+			 *  Comment characters should NOT be appearing anywhere but
+			 *  as start of a comment;
+			 */
+			p = strchr(buf, '#');
+			if (p) *p = '\0';
+
+			argc = fr_dict_str_to_argv(buf, argv, MAX_ARGV);
+			if (argc == 0) continue;
+
+			/*
+			 *	Record the line before it's processed, as
+			 *	processing modifies the strings in place.
+			 */
+			if (recording && (dict_cache_record_line(cache, line, argv, argc) < 0)) goto error;
+		}
 
 		if (argc == 1) {
 			fr_strerror_printf("Invalid entry");
 
 		error:
 			fr_strerror_printf_push("Error reading %s[%d]", fn, line);
-			fclose(fp);
+			if (fp) fclose(fp);
 			return -1;
 		}
 
@@ -1825,7 +1892,9 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 			 *	parent.
 			 */
 
+			ctx->depth++;
 			rcode = _dict_from_file(ctx, dir, argv[1], fn, line);
+			ctx->depth--;
 			if ((rcode == -2) && (argv[0][8] == '-')) {
 				fr_strerror_printf(NULL); /* delete all errors */
 				rcode = 0;
@@ -1833,13 +1902,13 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 
 			if (rcode < 0) {
 				fr_strerror_printf_push("from $INCLUDE at %s[%d]", fn, line);
-				fclose(fp);
+				if (fp) fclose(fp);
 				return -1;
 			}
 
 			if (ctx->stack_depth < stack_depth) {
 				fr_strerror_printf_push("unexpected END-??? in $INCLUDE at %s[%d]", fn, line);
-				fclose(fp);
+				if (fp) fclose(fp);
 				return -1;
 			}
 
@@ -1850,7 +1919,7 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 				}
 
 				fr_strerror_printf_push("BEGIN-??? without END-... in file $INCLUDEd from %s[%d]", fn, line);
-				fclose(fp);
+				if (fp) fclose(fp);
 				return -1;
 			}
 
@@ -1992,7 +2061,7 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 			 *	here.
 			 */
 			if (fr_dict_finalise(ctx) < 0) {
-				fclose(fp);
+				if (fp) fclose(fp);
 				return -1;
 			}
 
@@ -2255,7 +2324,12 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 	 *	be missing things.
 	 */
 
+	if (!fp) return 0;
+
 	fclose(fp);
+
+	if (recording && (dict_cache_record_end(cache, cache_offset) < 0)) return -1;
+
 	return 0;
 }
 
@@ -2266,16 +2340,28 @@ static int dict_from_file(fr_dict_t *dict,
 	int rcode;
 	dict_tokenize_ctx_t ctx;
 
+	dict_cache_t *cache = dict_gctx->cache;
+	size_t mark = 0;
+
 	memset(&ctx, 0, sizeof(ctx));
 	ctx.dict = dict;
 	ctx.stack[0].dict = dict;
 	ctx.stack[0].da = dict->root;
 	ctx.stack[0].nest = FR_TYPE_MAX;
 
+	if (cache) {
+		if (dict_cache_recording(cache)) {
+			mark = dict_cache_mark(cache);
+		} else {
+			ctx.replay = true;
+		}
+	}
+
 	rcode = _dict_from_file(&ctx,
 				dir_name, filename, src_file, src_line);
 	if (rcode < 0) {
 		// free up the various fixups
+		if (mark) dict_cache_rewind(cache, mark);
 		return rcode;
 	}
 
@@ -2286,7 +2372,10 @@ static int dict_from_file(fr_dict_t *dict,
 	 *	Fixups should have been applied already to any protocol
 	 *	dictionaries.
 	 */
-	return fr_dict_finalise(&ctx);
+	rcode = fr_dict_finalise(&ctx);
+	if ((rcode < 0) && mark) dict_cache_rewind(cache, mark);
+
+	return rcode;
 }
 
 /** (Re-)Initialize the special internal dictionary
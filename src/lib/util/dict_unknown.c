@@ -23,6 +23,48 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/util/dict_priv.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/thread_local.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** Maximum number of unknown attributes cached per thread
+ *
+ */
+#define DICT_UNKNOWN_CACHE_SIZE	256
+
+/** An unknown attribute, interned by the fields it was created from
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*parent;		//!< Parent passed to fr_dict_unknown_cached_by_fields.
+	unsigned int		vendor;			//!< Vendor passed to fr_dict_unknown_cached_by_fields.
+	unsigned int		attr;			//!< Attribute number.
+
+	fr_dict_attr_t const	*da;			//!< Unknown attribute, allocated from this entry.
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+} dict_unknown_entry_t;
+
+typedef struct {
+	fr_hash_table_t		*ht;			//!< Entries by parent, vendor and attr.
+	fr_dlist_head_t		lru;			//!< Most recently used at the head.
+	uint64_t		generation;		//!< dict_unknown_generation when the entries
+							///< were created in.
+} dict_unknown_cache_t;
+
+static _Thread_local dict_unknown_cache_t *dict_unknown_cache;
+
+/** Incremented whenever a dictionary is freed
+ *
+ * The caches are per-thread, so the thread freeing a dictionary
+ * can't empty them.  Each thread empties its own cache the next time
+ * it's used, if the generation has changed.
+ */
+static atomic_uint_fast64_t dict_unknown_generation = ATOMIC_VAR_INIT(0);
 
 /** Copy a known or unknown attribute to produce an unknown attribute
  *
@@ -339,6 +381,145 @@ fr_dict_attr_t const *fr_dict_unknown_afrom_fields(TALLOC_CTX *ctx, fr_dict_attr
 	return n;
 }
 
+static uint32_t dict_unknown_entry_hash(void const *data)
+{
+	dict_unknown_entry_t const	*e = data;
+	uint32_t			hash;
+
+	hash = fr_hash(&e->parent, sizeof(e->parent));
+	hash = fr_hash_update(&e->vendor, sizeof(e->vendor), hash);
+	return fr_hash_update(&e->attr, sizeof(e->attr), hash);
+}
+
+static int dict_unknown_entry_cmp(void const *one, void const *two)
+{
+	dict_unknown_entry_t const	*a = one, *b = two;
+	int				ret;
+
+	ret = (a->parent > b->parent) - (a->parent < b->parent);
+	if (ret != 0) return ret;
+
+	ret = (a->vendor > b->vendor) - (a->vendor < b->vendor);
+	if (ret != 0) return ret;
+
+	return (a->attr > b->attr) - (a->attr < b->attr);
+}
+
+static void _dict_unknown_cache_free(void *cache)
+{
+	talloc_free(cache);
+}
+
+/** Mark all the per-thread unknown attribute caches as stale
+ *
+ * Called when a dictionary is freed, as cached entries are keyed on,
+ * and point to, attributes within it.
+ */
+void dict_unknown_cache_invalidate(void)
+{
+	atomic_fetch_add_explicit(&dict_unknown_generation, 1, memory_order_relaxed);
+}
+
+/** Return an unknown attribute from a per-thread cache, creating it if needed
+ *
+ * Decoders create the same unknown attributes again and again for
+ * equipment sending attributes missing from our dictionaries.  This
+ * returns one immutable copy per (parent, vendor, attr), instead of
+ * allocating a new hierarchy for every instance.
+ *
+ * The attribute is owned by the cache and must not be freed.  Pairs
+ * created from it with #fr_pair_afrom_da get their own copy as usual.
+ *
+ * When the cache is full, the least recently used entry is moved into
+ * ctx, so attributes returned by earlier calls stay valid.  ctx should
+ * therefore outlive any use of them, e.g. the per-packet decode ctx.
+ *
+ * Unknown parents aren't cached, as the result has to copy them.
+ *
+ * The cache is emptied (into ctx) after any dictionary is freed,
+ * as its entries may refer to attributes in that dictionary.
+ *
+ * @param[in] ctx		to move evicted entries into, and to allocate in
+ *				when the attribute can't be cached.
+ * @param[in] parent		of the unknown attribute (may also be unknown).
+ * @param[in] vendor		number.
+ * @param[in] attr		number.
+ * @return
+ *	- The attribute (known if the name was defined by the config).
+ *	- NULL on error.
+ */
+fr_dict_attr_t const *fr_dict_unknown_cached_by_fields(TALLOC_CTX *ctx, fr_dict_attr_t const *parent,
+						       unsigned int vendor, unsigned int attr)
+{
+	dict_unknown_cache_t	*cache = dict_unknown_cache;
+	dict_unknown_entry_t	*e, find = { .parent = parent, .vendor = vendor, .attr = attr };
+	uint64_t		generation;
+
+	if (parent->flags.is_unknown) return fr_dict_unknown_afrom_fields(ctx, parent, vendor, attr);
+
+	if (unlikely(!cache)) {
+		cache = talloc_zero(NULL, dict_unknown_cache_t);
+		if (!cache) return fr_dict_unknown_afrom_fields(ctx, parent, vendor, attr);
+
+		cache->ht = fr_hash_table_create(cache, dict_unknown_entry_hash, dict_unknown_entry_cmp, NULL);
+		if (!cache->ht) {
+			talloc_free(cache);
+			return fr_dict_unknown_afrom_fields(ctx, parent, vendor, attr);
+		}
+		fr_dlist_init(&cache->lru, dict_unknown_entry_t, entry);
+
+		cache->generation = atomic_load_explicit(&dict_unknown_generation, memory_order_relaxed);
+
+		fr_thread_local_set_destructor(dict_unknown_cache, _dict_unknown_cache_free, cache);
+	}
+
+	/*
+	 *	A dictionary has been freed since we last looked,
+	 *	so the parents we're keyed on may have been freed
+	 *	too, and their addresses reused.  Entries are moved
+	 *	into ctx, the same as when they're evicted.
+	 */
+	generation = atomic_load_explicit(&dict_unknown_generation, memory_order_relaxed);
+	if (unlikely(cache->generation != generation)) {
+		while ((e = fr_dlist_head(&cache->lru))) {
+			fr_dlist_remove(&cache->lru, e);
+			fr_hash_table_delete(cache->ht, e);
+			talloc_steal(ctx, e);
+		}
+		cache->generation = generation;
+	}
+
+	e = fr_hash_table_finddata(cache->ht, &find);
+	if (e) {
+		if (fr_dlist_head(&cache->lru) != e) {
+			fr_dlist_remove(&cache->lru, e);
+			fr_dlist_insert_head(&cache->lru, e);
+		}
+		return e->da;
+	}
+
+	if (fr_hash_table_num_elements(cache->ht) >= DICT_UNKNOWN_CACHE_SIZE) {
+		dict_unknown_entry_t *old = fr_dlist_tail(&cache->lru);
+
+		fr_dlist_remove(&cache->lru, old);
+		fr_hash_table_delete(cache->ht, old);
+		talloc_steal(ctx, old);
+	}
+
+	e = talloc(cache, dict_unknown_entry_t);
+	if (!e) return fr_dict_unknown_afrom_fields(ctx, parent, vendor, attr);
+	*e = find;
+
+	e->da = fr_dict_unknown_afrom_fields(e, parent, vendor, attr);
+	if (!e->da || !fr_hash_table_insert(cache->ht, e)) {
+		talloc_free(e);
+		return NULL;
+	}
+	fr_dlist_insert_head(&cache->lru, e);
+
+	return e->da;
+}
+
 /** Initialise a fr_dict_attr_t from an ASCII attribute and value
  *
  * Where the attribute name is in the form:
@@ -2229,6 +2229,13 @@ static int _dict_free(fr_dict_t *dict)
 		return -1;
 	}
 
+	/*
+	 *	Cached unknown attributes may point into this
+	 *	dictionary, and a dictionary loaded later may
+	 *	reuse its memory.
+	 */
+	dict_unknown_cache_invalidate();
+
 	/*
 	 *	Decrease the reference count on the validation
 	 *	library we loaded.
@@ -2704,7 +2711,9 @@ char const *fr_dict_global_dir(void)
 
 /** Mark all dictionaries and the global dictionary ctx as read only
  *
- * Any attempts to add new attributes will now fail.
+ * Any attempts to add new attributes will now fail.  The attribute
+ * and enum tables are frozen with #fr_hash_table_freeze, so name and
+ * value lookups after this point are a single probe.
  */
 void fr_dict_global_read_only(void)
 {
@@ -2719,6 +2728,17 @@ void fr_dict_global_read_only(void)
 	for (dict = fr_hash_table_iter_init(dict_gctx->protocol_by_num, &iter);
 	     dict;
 	     dict = fr_hash_table_iter_next(dict_gctx->protocol_by_num, &iter)) {
+		/*
+		 *	The names and enums won't change from now on,
+		 *	so build perfect hashes for the tables that
+		 *	are searched at runtime.  If one can't be
+		 *	built, that table just keeps its normal
+		 *	lookups.
+		 */
+		(void) fr_hash_table_freeze(dict->attributes_by_name);
+		(void) fr_hash_table_freeze(dict->values_by_name);
+		(void) fr_hash_table_freeze(dict->values_by_da);
+
 		talloc_set_memlimit(dict, talloc_get_size(dict));
 		dict->read_only = true;
 	}
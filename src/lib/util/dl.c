@@ -425,7 +425,7 @@ static int _dl_free(dl_t *dl)
 	 *	Only dlclose() handle if we're *NOT* running under valgrind
 	 *	as it unloads the symbols valgrind needs.
 	 */
-	if (dl->loader->do_dlclose) dlclose(dl->handle);        /* ignore any errors */
+	if (dl->loader->do_dlclose || dl->is_static) dlclose(dl->handle);        /* ignore any errors */
 
 	dl->handle = NULL;
 
@@ -434,6 +434,50 @@ static int _dl_free(dl_t *dl)
 	return 0;
 }
 
+/** Libraries linked into the executable
+ *
+ * Weak, so it's NULL unless the executable was built with STATIC_MODULES.
+ */
+extern dl_static_t const dl_static_modules[] CC_HINT(weak);
+
+/** Return a handle for a library which was linked into the executable
+ *
+ * The executable has to be linked with --export-dynamic, so that
+ * dlsym() can find the library's symbols.
+ *
+ * @param[in] name	of library to find.
+ * @return
+ *	- The executable's handle if the library was linked in.
+ *	- NULL if it wasn't.
+ */
+static void *dl_static_handle(char const *name)
+{
+	dl_static_t const	*p;
+	void			*handle;
+
+	if (!dl_static_modules) return NULL;
+
+	for (p = dl_static_modules; p->name; p++) {
+		if (strcmp(p->name, name) == 0) break;
+	}
+	if (!p->name) return NULL;
+
+	handle = dlopen(NULL, RTLD_NOW);
+	if (!handle) return NULL;
+
+	/*
+	 *	If the symbol isn't visible, the callbacks
+	 *	won't be either, fallback to loading the
+	 *	shared object.
+	 */
+	if (dlsym(handle, name) != p->sym) {
+		dlclose(handle);
+		return NULL;
+	}
+
+	return handle;
+}
+
 /** Search for a dl's shared object in various locations
  *
  * @note You must call dl_symbol_init when ready to call autoloader callbacks.
@@ -454,6 +498,7 @@ dl_t *dl_by_name(dl_loader_t *dl_loader, char const *name, void *uctx, bool uctx
 	void		*handle = NULL;
 	char const	*search_path;
 	dl_t		*dl;
+	bool		is_static = false;
 
 	/*
 	 *	There's already something in the tree,
@@ -486,10 +531,18 @@ dl_t *dl_by_name(dl_loader_t *dl_loader, char const *name, void *uctx, bool uctx
 
 	search_path = dl_search_path(dl_loader);
 
+	/*
+	 *	Libraries linked into the executable don't
+	 *	need to be loaded.
+	 */
+	handle = dl_static_handle(name);
+	if (handle) {
+		is_static = true;
+
 	/*
 	 *	Prefer loading our libraries by absolute path.
 	 */
-	if (search_path) {
+	} else if (search_path) {
 		char *ctx, *paths, *path;
 		char *p;
 
@@ -585,6 +638,7 @@ dl_t *dl_by_name(dl_loader_t *dl_loader, char const *name, void *uctx, bool uctx
 	dl->loader = dl_loader;
 	dl->uctx = uctx;
 	dl->uctx_free = uctx_free;
+	dl->is_static = is_static;
 	talloc_set_destructor(dl, _dl_free);
 
 	dl->in_tree = rbtree_insert(dl_loader->tree, dl);
@@ -61,8 +61,20 @@ typedef struct dl_s {
 	void			*uctx;		//!< API client's opaque data.
 	bool			uctx_free;	//!< Free opaque data on dl_t free (usually false).
 	bool			in_tree;	//!< Whether this dl is registered in the dl_tree.
+	bool			is_static;	//!< Linked into the executable, handle is the executable's.
 } dl_t;
 
+/** Entry in the table of libraries linked into the executable
+ *
+ * Executables built with STATIC_MODULES provide a NULL terminated
+ * dl_static_modules[] table.  dl_by_name() checks it before
+ * searching the filesystem.
+ */
+typedef struct {
+	char const		*name;		//!< Name of the library e.g. rlm_exec.
+	void const		*sym;		//!< The library's public symbol.
+} dl_static_t;
+
 /** Callback to call when a module is first loaded
  *
  * @param[in] module	being loaded.
@@ -46,6 +46,18 @@ RCSID("$Id$")
 
 #define FR_EV_BATCH_FDS (256)
 
+/*
+ *	Coarse timers live in a hashed hierarchical timer wheel, with
+ *	O(1) insert and delete.  A tick is 2^20ns (~1ms), and the four
+ *	levels of 64 slots cover ~4.9 hours.  Coarse timers further in
+ *	the future than that go in the heap with the precise timers.
+ */
+#define FR_EV_WHEEL_TICK_SHIFT	(20)
+#define FR_EV_WHEEL_SLOT_BITS	(6)
+#define FR_EV_WHEEL_SLOTS	(1 << FR_EV_WHEEL_SLOT_BITS)
+#define FR_EV_WHEEL_SLOT_MASK	(FR_EV_WHEEL_SLOTS - 1)
+#define FR_EV_WHEEL_LEVELS	(4)
+
 DIAG_OFF(unused-macros)
 #define fr_time() static_assert(0, "Use el->time for event loop timing")
 DIAG_ON(unused-macros)
@@ -91,7 +103,10 @@ struct fr_event_timer {
 
 	fr_event_timer_t const	**parent;		//!< Previous timer.
 	int32_t			heap_id;	       	//!< Where to store opaque heap data.
-	fr_dlist_t		entry;			//!< in linked list of event timers
+	fr_dlist_t		entry;			//!< in linked list of event timers, or a wheel slot.
+
+	bool			coarse;			//!< Timer may go in the timer wheel.
+	fr_dlist_head_t		*wheel_slot;		//!< Wheel slot (or due list) this timer is in.
 };
 
 typedef enum {
@@ -331,6 +346,14 @@ struct fr_event_list {
 
 	fr_event_fd_t		*fd_to_free;		//!< File descriptor events pending deletion.
 	fr_dlist_head_t		ev_to_add;		//!< dlist of events to add
+
+	struct {
+		uint64_t		tick;		//!< Last tick processed.
+		uint64_t		used[FR_EV_WHEEL_LEVELS];	//!< Bitmap of non-empty slots per level.
+		fr_dlist_head_t		slot[FR_EV_WHEEL_LEVELS][FR_EV_WHEEL_SLOTS];
+		fr_dlist_head_t		due;		//!< Expired coarse timers waiting to run.
+		uint32_t		num;		//!< Timers in the wheel, including due ones.
+	} wheel;					//!< Timer wheel for coarse timers.
 };
 
 /** Compare two timer events to see which one should occur first
@@ -388,7 +411,7 @@ int fr_event_list_num_timers(fr_event_list_t *el)
 {
 	if (unlikely(!el)) return -1;
 
-	return fr_heap_num_elements(el->times);
+	return fr_heap_num_elements(el->times) + el->wheel.num;
 }
 
 /** Return the kq associated with an event list.
@@ -1100,6 +1123,229 @@ int fr_event_timer_delete(fr_event_timer_t const **ev_p)
 	return talloc_free(ev);
 }
 
+/** Insert a coarse timer into the timer wheel
+ *
+ * Timers are placed in the lowest level where their expiry tick shares
+ * all the higher digits with the current tick.  Each slot therefore only
+ * holds timers for the current rotation of the level above, and is
+ * cascaded down a level when that rotation reaches it.
+ *
+ * @param[in] el	to insert the timer into.
+ * @param[in] ev	to insert.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the timer is too far in the future for the wheel.
+ */
+static int event_wheel_insert(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	fr_dlist_head_t	*head;
+	uint64_t	expires, tick;
+	unsigned int	level, shift = 0;
+	unsigned int	idx;
+
+	/*
+	 *	Resync an empty wheel with the clock, so it
+	 *	doesn't have to catch up later.
+	 */
+	if (!el->wheel.num) {
+		fr_time_t now = el->time();
+
+		if (now > 0) el->wheel.tick = (uint64_t)now >> FR_EV_WHEEL_TICK_SHIFT;
+	}
+	tick = el->wheel.tick;
+
+	/*
+	 *	Round up, so coarse timers are never early.
+	 */
+	expires = (ev->when > 0) ? ((uint64_t)ev->when + ((1 << FR_EV_WHEEL_TICK_SHIFT) - 1)) >> FR_EV_WHEEL_TICK_SHIFT : 0;
+	if (expires <= tick) {
+		head = &el->wheel.due;
+		goto insert;
+	}
+
+	for (level = 0; level < FR_EV_WHEEL_LEVELS; level++) {
+		shift = level * FR_EV_WHEEL_SLOT_BITS;
+
+		if ((expires >> (shift + FR_EV_WHEEL_SLOT_BITS)) == (tick >> (shift + FR_EV_WHEEL_SLOT_BITS))) break;
+	}
+	if (level == FR_EV_WHEEL_LEVELS) return -1;
+
+	idx = (expires >> shift) & FR_EV_WHEEL_SLOT_MASK;
+	head = &el->wheel.slot[level][idx];
+	el->wheel.used[level] |= ((uint64_t)1 << idx);
+
+insert:
+	fr_dlist_insert_tail(head, ev);
+	ev->wheel_slot = head;
+	el->wheel.num++;
+
+	return 0;
+}
+
+/** Remove a coarse timer from the timer wheel
+ *
+ * @param[in] el	the timer is in.
+ * @param[in] ev	to remove.
+ */
+static void event_wheel_remove(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	fr_dlist_head_t	*head = ev->wheel_slot;
+
+	(void) fr_dlist_remove(head, ev);
+	ev->wheel_slot = NULL;
+	el->wheel.num--;
+
+	if ((head != &el->wheel.due) && fr_dlist_empty(head)) {
+		size_t offset = head - &el->wheel.slot[0][0];
+
+		el->wheel.used[offset / FR_EV_WHEEL_SLOTS] &= ~((uint64_t)1 << (offset & FR_EV_WHEEL_SLOT_MASK));
+	}
+}
+
+/** Find the next tick at which a wheel slot fires or cascades
+ *
+ * @param[in] el	to check.
+ * @param[out] out	The next tick.
+ * @return
+ *	- true if there's a non-empty slot.
+ *	- false if the wheel slots are empty.
+ */
+static bool event_wheel_next(fr_event_list_t *el, uint64_t *out)
+{
+	uint64_t	tick = el->wheel.tick;
+	unsigned int	level;
+
+	for (level = 0; level < FR_EV_WHEEL_LEVELS; level++) {
+		unsigned int	shift = level * FR_EV_WHEEL_SLOT_BITS;
+		unsigned int	digit = (tick >> shift) & FR_EV_WHEEL_SLOT_MASK;
+		uint64_t	above;
+
+		if (digit == FR_EV_WHEEL_SLOT_MASK) continue;
+
+		above = el->wheel.used[level] & (~(uint64_t)0 << (digit + 1));
+		if (!above) continue;
+
+		*out = ((tick >> (shift + FR_EV_WHEEL_SLOT_BITS)) << (shift + FR_EV_WHEEL_SLOT_BITS)) |
+		       ((uint64_t)__builtin_ctzll(above) << shift);
+		return true;
+	}
+
+	return false;
+}
+
+/** Advance the timer wheel, moving expired timers to the due list
+ *
+ * Only ticks where a slot fires or cascades are visited, so an idle
+ * wheel costs nothing to advance.
+ *
+ * @param[in] el	to advance.
+ * @param[in] now	The current time.
+ */
+static void event_wheel_advance(fr_event_list_t *el, fr_time_t now)
+{
+	uint64_t	now_tick, tick;
+
+	if (now <= 0) return;
+	now_tick = (uint64_t)now >> FR_EV_WHEEL_TICK_SHIFT;
+
+	while (el->wheel.num && event_wheel_next(el, &tick) && (tick <= now_tick)) {
+		int level;
+
+		el->wheel.tick = tick;
+
+		/*
+		 *	Cascade from the top down, so timers from higher
+		 *	levels land in lower slots before those are
+		 *	processed.  Level 0 timers all go to the due list.
+		 */
+		for (level = FR_EV_WHEEL_LEVELS - 1; level >= 0; level--) {
+			unsigned int		shift = level * FR_EV_WHEEL_SLOT_BITS;
+			unsigned int		idx = (tick >> shift) & FR_EV_WHEEL_SLOT_MASK;
+			fr_dlist_head_t		*head = &el->wheel.slot[level][idx];
+			fr_event_timer_t	*ev;
+
+			if (tick & (((uint64_t)1 << shift) - 1)) continue;
+			if (!(el->wheel.used[level] & ((uint64_t)1 << idx))) continue;
+
+			el->wheel.used[level] &= ~((uint64_t)1 << idx);
+			while ((ev = fr_dlist_head(head)) != NULL) {
+				(void) fr_dlist_remove(head, ev);
+				el->wheel.num--;
+				(void) event_wheel_insert(el, ev);
+			}
+		}
+	}
+
+	if (now_tick > el->wheel.tick) el->wheel.tick = now_tick;
+}
+
+/** Return when the next timer event (precise or coarse) is due
+ *
+ * @param[in] el	to check.
+ * @param[out] when	the next timer is due, or the next tick the wheel needs servicing.
+ * @return
+ *	- true if there's a timer.
+ *	- false if there are no timers.
+ */
+static bool event_timer_next(fr_event_list_t *el, fr_time_t *when)
+{
+	fr_event_timer_t	*ev;
+	uint64_t		tick;
+	bool			found = false;
+
+	ev = fr_dlist_head(&el->wheel.due);
+	if (ev) {
+		*when = ev->when;
+		return true;
+	}
+
+	ev = fr_heap_peek(el->times);
+	if (ev) {
+		*when = ev->when;
+		found = true;
+	}
+
+	if (el->wheel.num && event_wheel_next(el, &tick)) {
+		fr_time_t next = (fr_time_t)(tick << FR_EV_WHEEL_TICK_SHIFT);
+
+		if (!found || (next < *when)) *when = next;
+		found = true;
+	}
+
+	return found;
+}
+
+/** Add a timer to the wheel if it's coarse, or the heap
+ *
+ */
+static int event_timer_add(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	if (ev->coarse && (event_wheel_insert(el, ev) == 0)) return 0;
+
+	return fr_heap_insert(el->times, ev);
+}
+
+/** Remove a timer from the heap, the wheel, or the list of timers to add
+ *
+ * @return
+ *	- 0 if the timer was removed.
+ *	- -1 if the timer wasn't found.
+ */
+static int event_timer_unlink(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	if (ev->wheel_slot) {
+		event_wheel_remove(el, ev);
+		return 0;
+	}
+
+	if (fr_dlist_entry_in_list(&ev->entry)) {
+		(void) fr_dlist_remove(&el->ev_to_add, ev);
+		return 0;
+	}
+
+	return fr_heap_extract(el->times, ev);
+}
+
 /** Remove an event from the event loop
  *
  * @param[in] ev	to free.
@@ -1113,12 +1359,7 @@ static int _event_timer_free(fr_event_timer_t *ev)
 	fr_event_timer_t const **ev_p;
 	int		ret;
 
-	if (fr_dlist_entry_in_list(&ev->entry)) {
-		(void) fr_dlist_remove(&el->ev_to_add, ev);
-		ret = 0;
-	} else {
-		ret = fr_heap_extract(el->times, ev);
-	}
+	ret = event_timer_unlink(el, ev);
 
 	ev_p = ev->parent;
 	fr_assert(*(ev->parent) == ev);
@@ -1135,26 +1376,11 @@ static int _event_timer_free(fr_event_timer_t *ev)
 	return 0;
 }
 
-/** Insert a timer event into an event list
- *
- * @note The talloc parent of the memory returned in ev_p must not be changed.
- *	 If the lifetime of the event needs to be bound to another context
- *	 this function should be called with the existing event pointed to by
- *	 ev_p.
+/** Insert a precise or coarse timer event into an event list
  *
- * @param[in] ctx		to bind lifetime of the event to.
- * @param[in] el		to insert event into.
- * @param[in,out] ev_p		If not NULL modify this event instead of creating a new one.  This is a parent
- *				in a temporal sense, not in a memory structure or dependency sense.
- * @param[in] when		we should run the event.
- * @param[in] callback		function to execute if the event fires.
- * @param[in] uctx		user data to pass to the event.
- * @return
- *	- 0 on success.
- *	- -1 on failure.
  */
-int fr_event_timer_at(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t const **ev_p,
-		      fr_time_t when, fr_event_timer_cb_t callback, void const *uctx)
+static int event_timer_insert(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t const **ev_p,
+			      fr_time_t when, fr_event_timer_cb_t callback, void const *uctx, bool coarse)
 {
 	fr_event_timer_t *ev;
 
@@ -1218,7 +1444,7 @@ int fr_event_timer_at(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t con
 		 *	Event may have fired, in which case the
 		 *	event will no longer be in the event loop.
 		 */
-		(void) fr_heap_extract(el->times, ev);
+		(void) event_timer_unlink(el, ev);
 	}
 
 	ev->el = el;
@@ -1227,11 +1453,12 @@ int fr_event_timer_at(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t con
 	ev->uctx = uctx;
 	ev->linked_ctx = ctx;
 	ev->parent = ev_p;
+	ev->coarse = coarse;
 
 	if (el->in_handler) {
 		fr_dlist_insert_head(&el->ev_to_add, ev);
 
-	} else if (unlikely(fr_heap_insert(el->times, ev) < 0)) {
+	} else if (unlikely(event_timer_add(el, ev) < 0)) {
 		talloc_free(ev);
 		return -1;
 	}
@@ -1241,6 +1468,59 @@ int fr_event_timer_at(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t con
 	return 0;
 }
 
+/** Insert a timer event into an event list
+ *
+ * @note The talloc parent of the memory returned in ev_p must not be changed.
+ *	 If the lifetime of the event needs to be bound to another context
+ *	 this function should be called with the existing event pointed to by
+ *	 ev_p.
+ *
+ * @param[in] ctx		to bind lifetime of the event to.
+ * @param[in] el		to insert event into.
+ * @param[in,out] ev_p		If not NULL modify this event instead of creating a new one.  This is a parent
+ *				in a temporal sense, not in a memory structure or dependency sense.
+ * @param[in] when		we should run the event.
+ * @param[in] callback		function to execute if the event fires.
+ * @param[in] uctx		user data to pass to the event.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_event_timer_at(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t const **ev_p,
+		      fr_time_t when, fr_event_timer_cb_t callback, void const *uctx)
+{
+	return event_timer_insert(ctx, el, ev_p, when, callback, uctx, false);
+}
+
+/** Insert a coarse timer event into an event list
+ *
+ * Coarse timers go in a timer wheel, and so are O(1) to insert and delete,
+ * but may fire up to ~1ms after when.  They're intended for timeouts which
+ * are usually cancelled before they fire, such as max_request_time or
+ * cleanup_delay.
+ *
+ * @note The talloc parent of the memory returned in ev_p must not be changed.
+ *	 If the lifetime of the event needs to be bound to another context
+ *	 this function should be called with the existing event pointed to by
+ *	 ev_p.
+ *
+ * @param[in] ctx		to bind lifetime of the event to.
+ * @param[in] el		to insert event into.
+ * @param[in,out] ev_p		If not NULL modify this event instead of creating a new one.  This is a parent
+ *				in a temporal sense, not in a memory structure or dependency sense.
+ * @param[in] when		we should run the event.
+ * @param[in] callback		function to execute if the event fires.
+ * @param[in] uctx		user data to pass to the event.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_event_timer_coarse_at(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t const **ev_p,
+			     fr_time_t when, fr_event_timer_cb_t callback, void const *uctx)
+{
+	return event_timer_insert(ctx, el, ev_p, when, callback, uctx, true);
+}
+
 /** Insert a timer event into an event list
  *
  * @note The talloc parent of the memory returned in ev_p must not be changed.
@@ -1270,6 +1550,31 @@ int fr_event_timer_in(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t con
 	return fr_event_timer_at(ctx, el, ev_p, now, callback, uctx);
 }
 
+/** Insert a coarse timer event into an event list
+ *
+ * @see fr_event_timer_coarse_at
+ *
+ * @param[in] ctx		to bind lifetime of the event to.
+ * @param[in] el		to insert event into.
+ * @param[in,out] ev_p		If not NULL modify this event instead of creating a new one.
+ * @param[in] delta		In how many nanoseconds to wait before should we execute the event.
+ * @param[in] callback		function to execute if the event fires.
+ * @param[in] uctx		user data to pass to the event.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_event_timer_coarse_in(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t const **ev_p,
+			     fr_time_delta_t delta, fr_event_timer_cb_t callback, void const *uctx)
+{
+	fr_time_t now;
+
+	now = el->time();
+	now += delta;
+
+	return fr_event_timer_coarse_at(ctx, el, ev_p, now, callback, uctx);
+}
+
 /** Remove PID wait event from kevent if the fr_event_pid_t is freed
  *
  * @param[in] ev	to free.
@@ -1313,6 +1618,7 @@ int fr_event_pid_wait(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_pid_t const
 	struct kevent evset;
 
 	ev = talloc(ctx, fr_event_pid_t);
+	ev->el = el;
 	ev->pid = pid;
 	ev->callback = wait_fn;
 	ev->uctx = uctx;
@@ -1522,18 +1828,27 @@ int fr_event_timer_run(fr_event_list_t *el, fr_time_t *when)
 {
 	fr_event_timer_cb_t	callback;
 	void			*uctx;
-	fr_event_timer_t	*ev;
+	fr_event_timer_t	*ev, *heap_ev;
 
 	if (unlikely(!el)) return 0;
 
-	if (fr_heap_num_elements(el->times) == 0) {
+	if ((fr_heap_num_elements(el->times) == 0) && !el->wheel.num) {
 		*when = 0;
 		return 0;
 	}
 
-	ev = fr_heap_peek(el->times);
+	if (el->wheel.num) event_wheel_advance(el, *when);
+
+	/*
+	 *	Expired coarse timers and precise timers
+	 *	run in the order they were due.
+	 */
+	ev = fr_dlist_head(&el->wheel.due);
+	heap_ev = fr_heap_peek(el->times);
+	if (!ev || (heap_ev && (heap_ev->when < ev->when))) ev = heap_ev;
+
 	if (!ev) {
-		*when = 0;
+		if (!event_timer_next(el, when)) *when = 0;
 		return 0;
 	}
 
@@ -1541,7 +1856,7 @@ int fr_event_timer_run(fr_event_list_t *el, fr_time_t *when)
 	 *	See if it's time to do this one.
 	 */
 	if (ev->when > *when) {
-		*when = ev->when;
+		(void) event_timer_next(el, when);
 		return 0;
 	}
 
@@ -1576,7 +1891,7 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	fr_event_pre_t		*pre;
 	int			num_fd_events;
 	bool			timer_event_ready = false;
-	fr_event_timer_t	*ev;
+	fr_time_t		next;
 
 	el->num_fd_events = 0;
 
@@ -1600,13 +1915,12 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	 *	events are in the past.  Or, we wait for a future
 	 *	timer event.
 	 */
-	ev = fr_heap_peek(el->times);
-	if (ev) {
-		if (ev->when <= el->now) {
+	if (event_timer_next(el, &next)) {
+		if (next <= el->now) {
 			timer_event_ready = true;
 
 		} else if (wait) {
-			when = ev->when - el->now;
+			when = next - el->now;
 
 		} /* else we're not waiting, leave "when == 0" */
 
@@ -1906,7 +2220,7 @@ service:
 	 *	Run all of the timer events.  Note that these can add
 	 *	new timers!
 	 */
-	if (fr_heap_num_elements(el->times) > 0) {
+	if ((fr_heap_num_elements(el->times) > 0) || el->wheel.num) {
 		do {
 			when = el->now;
 		} while (fr_event_timer_run(el, &when) == 1);
@@ -1928,7 +2242,7 @@ service:
 	 */
 	while ((ev = fr_dlist_head(&el->ev_to_add)) != NULL) {
 		(void)fr_dlist_remove(&el->ev_to_add, ev);
-		if (unlikely(fr_heap_insert(el->times, ev) < 0)) {
+		if (unlikely(event_timer_add(el, ev) < 0)) {
 			talloc_free(ev);
 			fr_assert_msg(0, "failed inserting heap event: %s", fr_strerror());	/* Die in debug builds */
 		}
@@ -1999,12 +2313,20 @@ int fr_event_loop(fr_event_list_t *el)
 static int _event_list_free(fr_event_list_t *el)
 {
 	fr_event_timer_t const *ev;
+	int i, j;
 
 	while ((ev = fr_heap_peek(el->times)) != NULL) fr_event_timer_delete(&ev);
 
+	for (i = 0; i < FR_EV_WHEEL_LEVELS; i++) {
+		for (j = 0; j < FR_EV_WHEEL_SLOTS; j++) {
+			while ((ev = fr_dlist_head(&el->wheel.slot[i][j])) != NULL) fr_event_timer_delete(&ev);
+		}
+	}
+	while ((ev = fr_dlist_head(&el->wheel.due)) != NULL) fr_event_timer_delete(&ev);
+
 	talloc_free_children(el);
 
-	if (el->kq >= 0) close(el->kq);
+	if (el->kq >= 0) fr_kqueue_close(el->kq);
 
 	return 0;
 }
@@ -2022,6 +2344,7 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 {
 	fr_event_list_t		*el;
 	struct kevent		kev;
+	int			i, j;
 
 	el = talloc_zero(ctx, fr_event_list_t);
 	if (!fr_cond_assert(el)) {
@@ -2056,6 +2379,10 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 	fr_dlist_talloc_init(&el->post_callbacks, fr_event_post_t, entry);
 	fr_dlist_talloc_init(&el->user_callbacks, fr_event_user_t, entry);
 	fr_dlist_talloc_init(&el->ev_to_add, fr_event_timer_t, entry);
+	for (i = 0; i < FR_EV_WHEEL_LEVELS; i++) {
+		for (j = 0; j < FR_EV_WHEEL_SLOTS; j++) fr_dlist_talloc_init(&el->wheel.slot[i][j], fr_event_timer_t, entry);
+	}
+	fr_dlist_talloc_init(&el->wheel.due, fr_event_timer_t, entry);
 	if (status) (void) fr_event_pre_insert(el, status, status_uctx);
 
 	/*
@@ -2085,7 +2412,7 @@ void fr_event_list_set_time_func(fr_event_list_t *el, fr_event_time_source_t fun
  */
 bool fr_event_list_empty(fr_event_list_t *el)
 {
-	return !fr_heap_num_elements(el->times) && !rbtree_num_elements(el->fds);
+	return !fr_heap_num_elements(el->times) && !el->wheel.num && !rbtree_num_elements(el->fds);
 }
 
 #ifdef TESTING
@@ -2103,17 +2430,19 @@ bool fr_event_list_empty(fr_event_list_t *el)
  *  OR
  *
  *   valgrind --tool=memcheck --leak-check=full --show-reachable=yes ./event
+ *
+ *  OR, to compare arming and cancelling timers in the heap
+ *  against the timer wheel
+ *
+ *   ./event -b
  */
 
-static void print_time(void *ctx)
+static void print_time(UNUSED fr_event_list_t *el, fr_time_t now, void *ctx)
 {
-	fr_time_t when;
-	int64_t usec;
-
-	when = *(fr_time_t *) ctx;
-	usec = fr_time_to_usec(when);
+	fr_time_t when = *(fr_time_t *) ctx;
 
-	printf("%d.%06d\n", usec / USEC, usec % USEC);
+	printf("%" PRId64 ".%06" PRId64 " (late %" PRId64 "us)\n",
+	       fr_time_to_usec(when) / USEC, fr_time_to_usec(when) % USEC, fr_time_to_usec(now - when));
 	fflush(stdout);
 }
 
@@ -2132,16 +2461,58 @@ static uint32_t event_rand(void)
 	return num;
 }
 
+static void bench_noop(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, UNUSED void *ctx)
+{
+}
+
+#define BENCH_TIMERS 100000
+
+/** Compare arming and cancelling timers in the heap and the timer wheel
+ *
+ *  Each timer is armed 0-30s in the future, as with max_request_time
+ *  and cleanup_delay, then all of them are cancelled, which is what
+ *  usually happens to those timers.
+ */
+static void timer_benchmark(fr_event_list_t *el)
+{
+	static fr_event_timer_t const	*events[BENCH_TIMERS];
+	static fr_time_delta_t		delays[BENCH_TIMERS];
+	fr_time_t			start, armed, end, now;
+	int				i, pass;
+
+	for (i = 0; i < BENCH_TIMERS; i++) delays[i] = (event_rand() % 30000) * NSEC / 1000;
+
+	for (pass = 0; pass < 2; pass++) {
+		now = el->time();
+
+		start = el->time();
+		for (i = 0; i < BENCH_TIMERS; i++) {
+			if (pass == 0) {
+				fr_event_timer_at(el, el, &events[i], now + delays[i], bench_noop, NULL);
+			} else {
+				fr_event_timer_coarse_at(el, el, &events[i], now + delays[i], bench_noop, NULL);
+			}
+		}
+		armed = el->time();
+		for (i = 0; i < BENCH_TIMERS; i++) fr_event_timer_delete(&events[i]);
+		end = el->time();
+
+		printf("%s: %d timers, arm %" PRId64 "ns/timer, cancel %" PRId64 "ns/timer\n",
+		       (pass == 0) ? "heap" : "wheel", BENCH_TIMERS,
+		       (armed - start) / BENCH_TIMERS, (end - armed) / BENCH_TIMERS);
+	}
+}
 
 #define MAX 100
 int main(int argc, char **argv)
 {
-	int i, rcode;
-	fr_time_t array[MAX];
+	int i;
+	static fr_time_t array[MAX];
+	static fr_event_timer_t const *events[MAX];
 	fr_time_t now, when;
 	fr_event_list_t *el;
 
-	el = fr_event_list_alloc(NULL, NULL);
+	el = fr_event_list_alloc(NULL, NULL, NULL);
 	if (!el) fr_exit_now(1);
 
 	memset(&rand_pool, 0, sizeof(rand_pool));
@@ -2150,12 +2521,26 @@ int main(int argc, char **argv)
 	fr_rand_init(&rand_pool, 1);
 	rand_pool.randcnt = 0;
 
+	if ((argc > 1) && (strcmp(argv[1], "-b") == 0)) {
+		timer_benchmark(el);
+		talloc_free(el);
+		return 0;
+	}
+
 	array[0] = el->time();
 	for (i = 1; i < MAX; i++) {
 		array[i] = array[i - 1];
 		array[i] += event_rand() & 0xffff;
 
-		fr_event_timer_at(NULL, el, array[i], print_time, array[i]);
+		/*
+		 *	Mix precise and coarse timers, they should
+		 *	still be run in order.
+		 */
+		if (i & 0x01) {
+			fr_event_timer_at(NULL, el, &events[i], array[i], print_time, &array[i]);
+		} else {
+			fr_event_timer_coarse_at(NULL, el, &events[i], array[i], print_time, &array[i]);
+		}
 	}
 
 	while (fr_event_list_num_timers(el)) {
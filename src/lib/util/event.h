@@ -30,10 +30,10 @@ extern "C" {
 
 #include <freeradius-devel/build.h>
 #include <freeradius-devel/missing.h>
+#include <freeradius-devel/util/kqueue.h>
 #include <freeradius-devel/util/time.h>
 
 #include <stdbool.h>
-#include <sys/event.h>
 #include <talloc.h>
 
 /** An opaque file descriptor handle
@@ -231,6 +231,10 @@ int		fr_event_timer_at(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t co
 				  fr_time_t when, fr_event_timer_cb_t callback, void const *uctx);
 int		fr_event_timer_in(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t const **ev,
 				  fr_time_delta_t delta, fr_event_timer_cb_t callback, void const *uctx);
+int		fr_event_timer_coarse_at(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t const **ev,
+					 fr_time_t when, fr_event_timer_cb_t callback, void const *uctx);
+int		fr_event_timer_coarse_in(TALLOC_CTX *ctx, fr_event_list_t *el, fr_event_timer_t const **ev,
+					 fr_time_delta_t delta, fr_event_timer_cb_t callback, void const *uctx);
 int		fr_event_timer_delete(fr_event_timer_t const **ev);
 int		fr_event_timer_run(fr_event_list_t *el, fr_time_t *when);
 
@@ -61,6 +61,16 @@ struct fr_hash_table_s {
 	fr_hash_entry_t		null;
 
 	fr_hash_entry_t		**buckets;
+
+	bool			flat;		//!< Use open addressing, see flat_insert().
+	int			walking;	//!< Don't move slots, someone's walking the table.
+	int			num_deleted;	//!< Flat tables: slots marked deleted.
+	uint8_t			*ctrl;		//!< Flat tables: one control byte per slot.
+	struct fr_hash_slot_s	*slots;		//!< Flat tables: key and data for each slot.
+
+	uint32_t		perfect_buckets; //!< Frozen tables: number of displacement buckets.
+	uint32_t		*perfect_disp;	//!< Frozen tables: displacement for each bucket.
+	struct fr_hash_slot_s	*perfect;	//!< Frozen tables: one slot per entry, or NULL.
 };
 
 #ifdef TESTING
@@ -248,11 +258,338 @@ static int list_delete(fr_hash_table_t *ht,
 }
 
 
+/*
+ *	This should be a power of two.  Changing it to 4 doesn't seem
+ *	to make any difference.
+ */
+#define GROW_FACTOR (2)
+
+/*
+ *	Flat tables.
+ *
+ *	These use open addressing, in the style of a "Swiss table".
+ *	There is one control byte per slot, which is either EMPTY,
+ *	DELETED, or the low 7 bits of the key for the entry in that
+ *	slot.  A probe checks a whole group of control bytes at once,
+ *	and only calls the comparison function for slots where those
+ *	bits match.  Entries are stored in one array, so lookups don't
+ *	chase pointers, and inserts don't allocate.
+ *
+ *	The first FLAT_GROUP control bytes are copied to the end of
+ *	the control array, so a group can be loaded starting at any
+ *	slot without wrapping.
+ */
+#define FLAT_GROUP		(16)
+#define FLAT_MIN_SIZE		(64)
+
+#define FLAT_EMPTY		((uint8_t) 0x80)
+#define FLAT_DELETED		((uint8_t) 0xfe)
+
+#define FLAT_H1(_key)		((_key) >> 7)
+#define FLAT_H2(_key)		((uint8_t) ((_key) & 0x7f))
+
+typedef struct fr_hash_slot_s {
+	uint32_t		key;
+	void			*data;
+} fr_hash_slot_t;
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+
+/** Return a bitmask of the slots in the group whose control byte is c
+ *
+ */
+static inline uint32_t flat_match(uint8_t const *ctrl, uint8_t c)
+{
+	__m128i group = _mm_loadu_si128((__m128i const *) ctrl);
+
+	return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) c)));
+}
+
+/** Return a bitmask of the slots in the group which are EMPTY or DELETED
+ *
+ */
+static inline uint32_t flat_match_free(uint8_t const *ctrl)
+{
+	return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((__m128i const *) ctrl));
+}
+#else
+static inline uint32_t flat_match(uint8_t const *ctrl, uint8_t c)
+{
+	uint32_t	mask = 0;
+	int		i;
+
+	for (i = 0; i < FLAT_GROUP; i++) if (ctrl[i] == c) mask |= (1 << i);
+
+	return mask;
+}
+
+static inline uint32_t flat_match_free(uint8_t const *ctrl)
+{
+	uint32_t	mask = 0;
+	int		i;
+
+	for (i = 0; i < FLAT_GROUP; i++) if (ctrl[i] & 0x80) mask |= (1 << i);
+
+	return mask;
+}
+#endif
+
+static inline void flat_ctrl_set(fr_hash_table_t *ht, uint32_t i, uint8_t c)
+{
+	ht->ctrl[i] = c;
+	if (i < FLAT_GROUP) ht->ctrl[ht->num_buckets + i] = c;
+}
+
+/** Allocate the control bytes and slots for a flat table
+ *
+ */
+static int flat_alloc(fr_hash_table_t *ht, int size)
+{
+	uint8_t		*ctrl;
+	fr_hash_slot_t	*slots;
+
+	ctrl = talloc_array(NULL, uint8_t, size + FLAT_GROUP);
+	if (!ctrl) return -1;
+
+	slots = talloc_array(NULL, fr_hash_slot_t, size);
+	if (!slots) {
+		talloc_free(ctrl);
+		return -1;
+	}
+	memset(ctrl, FLAT_EMPTY, size + FLAT_GROUP);
+
+	ht->ctrl = ctrl;
+	ht->slots = slots;
+	ht->num_buckets = size;
+	ht->mask = size - 1;
+	ht->num_deleted = 0;
+
+	/*
+	 *	Grow when 7/8 of the slots are used, including
+	 *	deleted ones.
+	 */
+	ht->next_grow = size - (size >> 3);
+
+	return 0;
+}
+
+/** Find the slot an entry is in
+ *
+ * @return
+ *	- The slot number.
+ *	- -1 if the entry isn't in the table.  If first_free
+ *	  is not NULL, it's set to the first free slot we
+ *	  probed, or -1 if there were none.
+ */
+static int flat_find(fr_hash_table_t *ht, uint32_t key, void const *data, int *first_free)
+{
+	uint32_t	pos, stride, mask, probes;
+	uint8_t		h2 = FLAT_H2(key);
+
+	if (first_free) *first_free = -1;
+
+	pos = FLAT_H1(key) & ht->mask;
+	stride = 0;
+
+	for (probes = 0; probes <= ((uint32_t) ht->num_buckets / FLAT_GROUP); probes++) {
+		uint8_t const *group = ht->ctrl + pos;
+
+		for (mask = flat_match(group, h2); mask; mask &= mask - 1) {
+			uint32_t i = (pos + __builtin_ctz(mask)) & ht->mask;
+
+			if (ht->slots[i].key != key) continue;
+			if (ht->cmp && (ht->cmp(data, ht->slots[i].data) != 0)) continue;
+
+			return i;
+		}
+
+		mask = flat_match_free(group);
+		if (first_free && (*first_free < 0) && mask) *first_free = (pos + __builtin_ctz(mask)) & ht->mask;
+
+		/*
+		 *	Entries are never placed past a group which
+		 *	had an empty slot when they were inserted.
+		 */
+		if (flat_match(group, FLAT_EMPTY)) break;
+
+		stride += FLAT_GROUP;
+		pos = (pos + stride) & ht->mask;
+	}
+
+	return -1;
+}
+
+/** Rebuild a flat table with a new number of slots, discarding deleted slots
+ *
+ */
+static int flat_resize(fr_hash_table_t *ht, int size)
+{
+	uint8_t		*old_ctrl = ht->ctrl;
+	fr_hash_slot_t	*old_slots = ht->slots;
+	int		old_size = ht->num_buckets;
+	int		i;
+
+	if (flat_alloc(ht, size) < 0) {
+		ht->ctrl = old_ctrl;
+		ht->slots = old_slots;
+		return -1;
+	}
+
+	for (i = 0; i < old_size; i++) {
+		uint32_t	pos, stride, mask;
+
+		if (old_ctrl[i] & 0x80) continue;
+
+		pos = FLAT_H1(old_slots[i].key) & ht->mask;
+		stride = 0;
+
+		while (!(mask = flat_match_free(ht->ctrl + pos))) {
+			stride += FLAT_GROUP;
+			pos = (pos + stride) & ht->mask;
+		}
+		pos = (pos + __builtin_ctz(mask)) & ht->mask;
+
+		flat_ctrl_set(ht, pos, FLAT_H2(old_slots[i].key));
+		ht->slots[pos] = old_slots[i];
+	}
+
+	talloc_free(old_ctrl);
+	talloc_free(old_slots);
+
+#ifdef TESTING
+	grow = 1;
+#endif
+
+	return 0;
+}
+
+static int flat_insert(fr_hash_table_t *ht, void const *data)
+{
+	uint32_t	key;
+	int		i;
+
+	/*
+	 *	Resizing moves the slots, so don't do it while
+	 *	walking over the table.  We can still fill the
+	 *	rest of the free slots.
+	 */
+	if (((ht->num_elements + ht->num_deleted) >= ht->next_grow) && !ht->walking) {
+		int size = ht->num_buckets;
+
+		/*
+		 *	If it's mostly deleted slots, rebuild it at
+		 *	the same size.
+		 */
+		if (ht->num_elements >= (ht->next_grow >> 1)) size *= GROW_FACTOR;
+
+		if (flat_resize(ht, size) < 0) return 0;
+	}
+
+	key = ht->hash(data);
+
+	if (flat_find(ht, key, data, &i) >= 0) return 0;	/* already in the table */
+	if (i < 0) return 0;					/* full, and walking */
+
+	if (ht->ctrl[i] == FLAT_DELETED) ht->num_deleted--;
+
+	flat_ctrl_set(ht, i, FLAT_H2(key));
+	ht->slots[i].key = key;
+	memcpy(&ht->slots[i].data, &data, sizeof(ht->slots[i].data));
+
+	ht->num_elements++;
+
+	return 1;
+}
+
+static void *flat_yank(fr_hash_table_t *ht, void const *data)
+{
+	int		i;
+	uint32_t	before, after;
+	int		lead, trail;
+
+	i = flat_find(ht, ht->hash(data), data, NULL);
+	if (i < 0) return NULL;
+
+	ht->num_elements--;
+
+	/*
+	 *	If probes for other entries could never have gone
+	 *	past this slot, because there's always an empty
+	 *	slot within one group of it, it can be marked empty.
+	 *	Otherwise it has to be marked deleted, so those
+	 *	probes keep going.
+	 */
+	before = flat_match(ht->ctrl + (((uint32_t) i - FLAT_GROUP) & ht->mask), FLAT_EMPTY);
+	after = flat_match(ht->ctrl + i, FLAT_EMPTY);
+
+	lead = before ? (__builtin_clz(before) - (32 - FLAT_GROUP)) : FLAT_GROUP;
+	trail = after ? __builtin_ctz(after) : FLAT_GROUP;
+
+	if ((lead + trail) < FLAT_GROUP) {
+		flat_ctrl_set(ht, i, FLAT_EMPTY);
+	} else {
+		flat_ctrl_set(ht, i, FLAT_DELETED);
+		ht->num_deleted++;
+	}
+
+	return ht->slots[i].data;
+}
+
+/*
+ *	Frozen tables have a minimal perfect hash built over the
+ *	entries, using "hash and displace".  Entries are split into
+ *	buckets, and each bucket is given a displacement which moves
+ *	all of its entries into free slots.  A lookup is then one hash
+ *	of the key, and one comparison.
+ *
+ *	The normal table is kept, so walks and iterators work as
+ *	before.  Any change to the table throws the perfect hash away.
+ */
+#define PERFECT_BUCKET_SIZE	(4)		//!< Average entries per displacement bucket.
+#define PERFECT_MAX_TRIES	(64)		//!< Displacements to try, per slot in the table.
+
+static inline uint32_t perfect_mix(uint32_t key, uint32_t disp)
+{
+	key ^= disp;
+	key *= 0x85ebca6b;
+	key ^= key >> 13;
+	key *= 0xc2b2ae35;
+	key ^= key >> 16;
+
+	return key;
+}
+
+static inline uint32_t perfect_bucket(fr_hash_table_t const *ht, uint32_t key)
+{
+	return perfect_mix(key, 0) % ht->perfect_buckets;
+}
+
+static inline uint32_t perfect_slot(fr_hash_table_t const *ht, uint32_t key, uint32_t disp)
+{
+	return perfect_mix(key, disp) % (uint32_t) ht->num_elements;
+}
+
+static void perfect_free(fr_hash_table_t *ht)
+{
+	TALLOC_FREE(ht->perfect);
+	TALLOC_FREE(ht->perfect_disp);
+	ht->perfect_buckets = 0;
+}
+
 static int _fr_hash_table_free(fr_hash_table_t *ht)
 {
 	int i;
 	fr_hash_entry_t *node, *next;
 
+	perfect_free(ht);
+
+	if (ht->flat) {
+		talloc_free(ht->ctrl);
+		talloc_free(ht->slots);
+		return 0;
+	}
+
 	/*
 	 *	Walk over the buckets, freeing them all.
 	 */
@@ -280,6 +617,32 @@ fr_hash_table_t *fr_hash_table_create(TALLOC_CTX *ctx,
 				      fr_hash_table_hash_t hashNode,
 				      fr_hash_table_cmp_t cmpNode,
 				      fr_hash_table_free_t freeNode)
+{
+	return fr_hash_table_create_flags(ctx, hashNode, cmpNode, freeNode, FR_HASH_TABLE_FLAG_NONE);
+}
+
+/** Create a hash table, choosing the implementation
+ *
+ * With #FR_HASH_TABLE_FLAG_FLAT, the table uses open addressing.
+ * Lookups probe a group of slots at once, without following
+ * pointers, and inserts don't allocate memory.  Memory usage in
+ * bytes is about 20 * number of entries, on 64-bit systems.
+ *
+ * @param[in] ctx	to bind the table's lifetime to.
+ * @param[in] hashNode	hashes an entry.
+ * @param[in] cmpNode	compares two entries.  May be NULL, in which case
+ *			entries with the same hash are considered equal.
+ * @param[in] freeNode	called to free entries which are deleted or replaced.
+ * @param[in] flags	FR_HASH_TABLE_FLAG_*.
+ * @return
+ *	- A new hash table.
+ *	- NULL on error.
+ */
+fr_hash_table_t *fr_hash_table_create_flags(TALLOC_CTX *ctx,
+					    fr_hash_table_hash_t hashNode,
+					    fr_hash_table_cmp_t cmpNode,
+					    fr_hash_table_free_t freeNode,
+					    int flags)
 {
 	fr_hash_table_t *ht;
 
@@ -293,6 +656,16 @@ fr_hash_table_t *fr_hash_table_create(TALLOC_CTX *ctx,
 	ht->free = freeNode;
 	ht->hash = hashNode;
 	ht->cmp = cmpNode;
+
+	if (flags & FR_HASH_TABLE_FLAG_FLAT) {
+		ht->flat = true;
+		if (flat_alloc(ht, FLAT_MIN_SIZE) < 0) {
+			talloc_free(ht);
+			return NULL;
+		}
+		return ht;
+	}
+
 	ht->num_buckets = FR_HASH_NUM_BUCKETS;
 	ht->mask = ht->num_buckets - 1;
 
@@ -369,12 +742,6 @@ static void fr_hash_table_fixup(fr_hash_table_t *ht, uint32_t entry)
 	if (!ht->buckets[entry]) ht->buckets[entry] = &ht->null;
 }
 
-/*
- *	This should be a power of two.  Changing it to 4 doesn't seem
- *	to make any difference.
- */
-#define GROW_FACTOR (2)
-
 /*
  *	Grow the hash table.
  */
@@ -411,6 +778,10 @@ int fr_hash_table_insert(fr_hash_table_t *ht, void const *data)
 
 	if (!ht || !data) return 0;
 
+	if (unlikely(ht->perfect != NULL)) perfect_free(ht);
+
+	if (ht->flat) return flat_insert(ht, data);
+
 	key = ht->hash(data);
 	entry = key & ht->mask;
 	reversed = reverse(key);
@@ -476,6 +847,21 @@ int fr_hash_table_replace(fr_hash_table_t *ht, void const *data)
 
 	if (!ht || !data) return 0;
 
+	if (unlikely(ht->perfect != NULL)) perfect_free(ht);
+
+	if (ht->flat) {
+		int i;
+
+		i = flat_find(ht, ht->hash(data), data, NULL);
+		if (i < 0) return flat_insert(ht, data);
+
+		if (ht->free) ht->free(ht->slots[i].data);
+
+		memcpy(&ht->slots[i].data, &data, sizeof(ht->slots[i].data));
+
+		return 1;
+	}
+
 	node = fr_hash_table_find(ht, data);
 	if (!node) return fr_hash_table_insert(ht, data);
 
@@ -495,6 +881,29 @@ void *fr_hash_table_finddata(fr_hash_table_t *ht, void const *data)
 	fr_hash_entry_t *node;
 	void *out;
 
+	if (ht && ht->perfect) {
+		uint32_t key = ht->hash(data);
+		fr_hash_slot_t const *slot;
+
+		slot = &ht->perfect[perfect_slot(ht, key, ht->perfect_disp[perfect_bucket(ht, key)])];
+		if ((slot->key != key) || (ht->cmp && (ht->cmp(data, slot->data) != 0))) return NULL;
+
+		memcpy(&out, &slot->data, sizeof(out));
+
+		return out;
+	}
+
+	if (ht && ht->flat) {
+		int i;
+
+		i = flat_find(ht, ht->hash(data), data, NULL);
+		if (i < 0) return NULL;
+
+		memcpy(&out, &ht->slots[i].data, sizeof(out));
+
+		return out;
+	}
+
 	node = fr_hash_table_find(ht, data);
 	if (!node) return NULL;
 
@@ -518,6 +927,10 @@ void *fr_hash_table_yank(fr_hash_table_t *ht, void const *data)
 
 	if (!ht) return NULL;
 
+	if (unlikely(ht->perfect != NULL)) perfect_free(ht);
+
+	if (ht->flat) return flat_yank(ht, data);
+
 	key = ht->hash(data);
 	entry = key & ht->mask;
 	reversed = reverse(key);
@@ -562,6 +975,14 @@ void fr_hash_table_free(fr_hash_table_t *ht)
 
 	if (!ht) return;
 
+	if (ht->flat) {
+		if (ht->free) for (i = 0; i < ht->num_buckets; i++) {
+			if (!(ht->ctrl[i] & 0x80)) ht->free(ht->slots[i].data);
+		}
+		talloc_free(ht);
+		return;
+	}
+
 	/*
 	 *	Walk over the buckets, freeing them all.
 	 */
@@ -607,6 +1028,21 @@ int fr_hash_table_walk(fr_hash_table_t *ht,
 
 	if (!ht || !callback) return 0;
 
+	if (ht->flat) {
+		rcode = 0;
+
+		ht->walking++;
+		for (i = ht->num_buckets - 1; i >= 0; i--) {
+			if (ht->ctrl[i] & 0x80) continue;
+
+			rcode = callback(context, ht->slots[i].data);
+			if (rcode != 0) break;
+		}
+		ht->walking--;
+
+		return rcode;
+	}
+
 	for (i = ht->num_buckets - 1; i >= 0; i--) {
 		fr_hash_entry_t *node, *next;
 
@@ -644,6 +1080,13 @@ void *fr_hash_table_iter_next(fr_hash_table_t *ht, fr_hash_iter_t *iter)
 
 	if (unlikely(!ht)) return NULL;
 
+	if (ht->flat) {
+		while ((--iter->bucket) >= 0) {
+			if (!(ht->ctrl[iter->bucket] & 0x80)) return ht->slots[iter->bucket].data;
+		}
+		return NULL;
+	}
+
 	/*
 	 *	Return the next element in the bucket
 	 */
@@ -683,9 +1126,138 @@ void fr_hash_table_fill(fr_hash_table_t *ht)
 {
 	int i;
 
+	if (ht->flat) return;	/* Lookups never modify flat tables */
+
 	for (i = ht->num_buckets - 1; i >= 0; i--) if (!ht->buckets[i]) fr_hash_table_fixup(ht, i);
 }
 
+/** Build a minimal perfect hash over the entries in a table
+ *
+ * Should be called once a table has been populated, and won't change
+ * again.  Lookups are then a single hash of the key, and a single
+ * comparison, whatever the table's size.
+ *
+ * Inserting, replacing or deleting entries afterwards is allowed,
+ * but throws the perfect hash away, and lookups go back to using the
+ * normal table.
+ *
+ * @param[in] ht	to freeze.
+ * @return
+ *	- 0 on success.
+ *	- -1 if no perfect hash could be found, e.g. because two entries
+ *	  have the same hash.  The table still works as before.
+ */
+int fr_hash_table_freeze(fr_hash_table_t *ht)
+{
+	uint32_t		i, j, k, b, num, num_order, disp, max_tries;
+	uint32_t		*keys, *count, *start, *order, *members, *pos;
+	uint8_t			*used;
+	void			**entries;
+	void			*data;
+	fr_hash_iter_t		iter;
+	int			ret = -1;
+
+	if (!ht) return -1;
+
+	perfect_free(ht);
+
+	num = ht->num_elements;
+	if (num == 0) return -1;
+
+	ht->perfect_buckets = (num / PERFECT_BUCKET_SIZE) + 1;
+
+	keys = talloc_array(NULL, uint32_t, num);
+	entries = talloc_array(keys, void *, num);
+	count = talloc_zero_array(keys, uint32_t, ht->perfect_buckets);
+	start = talloc_zero_array(keys, uint32_t, ht->perfect_buckets + 1);
+	order = talloc_array(keys, uint32_t, ht->perfect_buckets);
+	members = talloc_array(keys, uint32_t, num);
+	pos = talloc_array(keys, uint32_t, PERFECT_BUCKET_SIZE * 16);
+	used = talloc_zero_array(keys, uint8_t, num);
+	ht->perfect = talloc_zero_array(ht, fr_hash_slot_t, num);
+	ht->perfect_disp = talloc_zero_array(ht, uint32_t, ht->perfect_buckets);
+	if (!keys || !entries || !count || !start || !order || !members || !pos || !used ||
+	    !ht->perfect || !ht->perfect_disp) goto done;
+
+	/*
+	 *	Group the entries by bucket.
+	 */
+	for (i = 0, data = fr_hash_table_iter_init(ht, &iter);
+	     data && (i < num);
+	     i++, data = fr_hash_table_iter_next(ht, &iter)) {
+		keys[i] = ht->hash(data);
+		entries[i] = data;
+		count[perfect_bucket(ht, keys[i])]++;
+	}
+	if (i != num) goto done;
+
+	for (b = 0; b < ht->perfect_buckets; b++) {
+		start[b + 1] = start[b] + count[b];
+	}
+
+	memset(count, 0, sizeof(*count) * ht->perfect_buckets);
+	for (i = 0; i < num; i++) {
+		b = perfect_bucket(ht, keys[i]);
+		members[start[b] + count[b]++] = i;
+	}
+
+	/*
+	 *	Place the largest buckets first, while there's
+	 *	still plenty of room.  Bucket sizes are small, so
+	 *	sort them by size with one pass per size.
+	 */
+	for (b = 0, num_order = 0; b < ht->perfect_buckets; b++) if (count[b]) num_order++;
+
+	for (i = 0, k = PERFECT_BUCKET_SIZE * 16; k > 0; k--) {
+		for (b = 0; b < ht->perfect_buckets; b++) {
+			if (count[b] == k) order[i++] = b;
+		}
+	}
+	if (i != num_order) goto done;	/* Some buckets were too large, the hash is too poor to bother */
+
+	max_tries = num * PERFECT_MAX_TRIES;
+	for (i = 0; i < num_order; i++) {
+		b = order[i];
+
+		/*
+		 *	Entries with the same key always land in the
+		 *	same slot, so no displacement can separate them.
+		 */
+		for (j = 1; j < count[b]; j++) {
+			for (k = 0; k < j; k++) {
+				if (keys[members[start[b] + j]] == keys[members[start[b] + k]]) goto done;
+			}
+		}
+
+		for (disp = 1; disp <= max_tries; disp++) {
+			for (j = 0; j < count[b]; j++) {
+				pos[j] = perfect_slot(ht, keys[members[start[b] + j]], disp);
+				if (used[pos[j]]) break;
+
+				for (k = 0; k < j; k++) if (pos[k] == pos[j]) break;
+				if (k < j) break;
+			}
+			if (j == count[b]) break;
+		}
+		if (disp > max_tries) goto done;
+
+		ht->perfect_disp[b] = disp;
+		for (j = 0; j < count[b]; j++) {
+			used[pos[j]] = 1;
+			ht->perfect[pos[j]].key = keys[members[start[b] + j]];
+			memcpy(&ht->perfect[pos[j]].data, &entries[members[start[b] + j]], sizeof(ht->perfect[pos[j]].data));
+		}
+	}
+
+	ret = 0;
+
+done:
+	talloc_free(keys);
+	if (ret < 0) perfect_free(ht);
+
+	return ret;
+}
+
 /** Initialise an iterator
  *
  * @note If the hash table is modified the iterator should be considered invalidated.
@@ -717,6 +1289,13 @@ int fr_hash_table_info(fr_hash_table_t *ht)
 
 	if (!ht) return 0;
 
+	if (ht->flat) {
+		printf("FLAT HASH TABLE %p\tslots: %d\t(%d deleted)\n", ht,
+		       ht->num_buckets, ht->num_deleted);
+		printf("\tnum entries %d\n\n", ht->num_elements);
+		return 0;
+	}
+
 	uninitialized = collisions = 0;
 	memset(array, 0, sizeof(array));
 
@@ -59,11 +59,20 @@ typedef uint32_t (*fr_hash_table_hash_t)(void const *);
 typedef int (*fr_hash_table_cmp_t)(void const *, void const *);
 typedef int (*fr_hash_table_walk_t)(void * /* ctx */, void * /* data */);
 
+#define FR_HASH_TABLE_FLAG_NONE	(0)
+#define FR_HASH_TABLE_FLAG_FLAT	(1 << 0)	//!< Open addressing, with flat storage.
+
 fr_hash_table_t *fr_hash_table_create(TALLOC_CTX *ctx,
 				      fr_hash_table_hash_t hashNode,
 				      fr_hash_table_cmp_t cmpNode,
 				      fr_hash_table_free_t freeNode);
 
+fr_hash_table_t *fr_hash_table_create_flags(TALLOC_CTX *ctx,
+					    fr_hash_table_hash_t hashNode,
+					    fr_hash_table_cmp_t cmpNode,
+					    fr_hash_table_free_t freeNode,
+					    int flags);
+
 void		fr_hash_table_free(fr_hash_table_t *ht);
 
 int		fr_hash_table_insert(fr_hash_table_t *ht, void const *data);
@@ -88,6 +97,8 @@ void		*fr_hash_table_iter_init(fr_hash_table_t *ht, fr_hash_iter_t *iter);
 
 void		fr_hash_table_fill(fr_hash_table_t *ht);
 
+int		fr_hash_table_freeze(fr_hash_table_t *ht);
+
 #ifdef __cplusplus
 }
 #endif
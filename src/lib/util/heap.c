@@ -14,7 +14,7 @@
  *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
  */
 
-/** Functions for a basic binary heaps
+/** Functions for d-ary heaps
  *
  * @file src/lib/util/heap.c
  *
@@ -34,6 +34,11 @@ RCSID("$Id$")
  *	of the minimum element.  The heap entry can contain an "int"
  *	field that holds the entries position in the heap.  The offset
  *	of the field is held inside of the heap structure.
+ *
+ *	Each node has 2^shift children.  With 4 or 8 children the
+ *	heap is shallower, and all the children of a node are in
+ *	one or two cache lines, which more than makes up for the
+ *	extra comparisons when extracting.
  */
 
 struct fr_heap_s {
@@ -41,6 +46,7 @@ struct fr_heap_s {
 	size_t		offset;			//!< Offset of heap index in element structure.
 
 	int32_t		num_elements;		//!< Number of nodes used.
+	uint8_t		shift;			//!< log2 of the number of children of each node.
 
 	char const	*type;			//!< Type of elements.
 	fr_heap_cmp_t	cmp;			//!< Comparator function.
@@ -49,15 +55,16 @@ struct fr_heap_s {
 };
 
 /*
- *	First node in a heap is element 0. Children of i are 2i+1 and
- *	2i+2.  These macros wrap the logic, so the code is more
+ *	First node in a heap is element 0. Children of i are di+1
+ *	to di+d.  These macros wrap the logic, so the code is more
  *	descriptive.
  */
-#define HEAP_PARENT(_x)	(((_x) - 1 ) / 2)
-#define HEAP_LEFT(_x)	(2 * (_x) + 1)
-/* #define HEAP_RIGHT(_x) (2 * (_x) + 2 ) */
+#define HEAP_PARENT(_hp, _x)	(((_x) - 1) >> (_hp)->shift)
+#define HEAP_LEFT(_hp, _x)	(((_x) << (_hp)->shift) + 1)
 #define	HEAP_SWAP(_a, _b) { void *_tmp = _a; _a = _b; _b = _tmp; }
 
+#define HEAP_DEFAULT_SHIFT	(2)		//!< 4 children per node.
+
 static void fr_heap_bubble(fr_heap_t *hp, int32_t child);
 
 fr_heap_t *_fr_heap_create(TALLOC_CTX *ctx, fr_heap_cmp_t cmp, char const *type, size_t offset)
@@ -79,10 +86,47 @@ fr_heap_t *_fr_heap_create(TALLOC_CTX *ctx, fr_heap_cmp_t cmp, char const *type,
 	fh->type = type;
 	fh->cmp = cmp;
 	fh->offset = offset;
+	fh->shift = HEAP_DEFAULT_SHIFT;
 
 	return fh;
 }
 
+/** Set how many children each node in the heap has
+ *
+ * @param[in] hp	to change.  Must be empty.
+ * @param[in] arity	Number of children.  One of 2, 4 or 8.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the heap has elements, or the arity isn't supported.
+ */
+int fr_heap_arity_set(fr_heap_t *hp, unsigned int arity)
+{
+	if (hp->num_elements > 0) {
+		fr_strerror_printf("Can't change the arity of a heap which has elements");
+		return -1;
+	}
+
+	switch (arity) {
+	case 2:
+		hp->shift = 1;
+		break;
+
+	case 4:
+		hp->shift = 2;
+		break;
+
+	case 8:
+		hp->shift = 3;
+		break;
+
+	default:
+		fr_strerror_printf("Heap arity must be 2, 4 or 8, not %u", arity);
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  *	Insert element in heap. Normally, p != NULL, we insert p in a
  *	new position and bubble up. If p == NULL, then the element is
@@ -165,7 +209,7 @@ static void fr_heap_bubble(fr_heap_t *hp, int32_t child)
 	 *	Bubble up the element.
 	 */
 	while (child > 0) {
-		int32_t parent = HEAP_PARENT(child);
+		int32_t parent = HEAP_PARENT(hp, child);
 
 		/*
 		 *	Parent is smaller than the child.  We're done.
@@ -193,7 +237,7 @@ static void fr_heap_bubble(fr_heap_t *hp, int32_t child)
  */
 int fr_heap_extract(fr_heap_t *hp, void *data)
 {
-	int32_t parent, child, max;
+	int32_t parent, child, last, max;
 
 	if (unlikely(hp->num_elements == 0)) {
 		fr_strerror_printf("Tried to extract element from empty heap");
@@ -222,19 +266,24 @@ int fr_heap_extract(fr_heap_t *hp, void *data)
 	}
 
 	RESET_OFFSET(hp, parent);
-	child = HEAP_LEFT(parent);
+	child = HEAP_LEFT(hp, parent);
 	while (child <= max) {
+		int32_t i;
+
 		/*
-		 *	Maybe take the right child.
+		 *	Take the smallest of the children.
 		 */
-		if ((child != max) &&
-		    (hp->cmp(hp->p[child + 1], hp->p[child]) < 0)) {
-			child = child + 1;
+		last = child + (1 << hp->shift) - 1;
+		if (last > max) last = max;
+
+		for (i = child + 1; i <= last; i++) {
+			if (hp->cmp(hp->p[i], hp->p[child]) < 0) child = i;
 		}
+
 		hp->p[parent] = hp->p[child];
 		SET_OFFSET(hp, parent);
 		parent = child;
-		child = HEAP_LEFT(child);
+		child = HEAP_LEFT(hp, child);
 	}
 	hp->num_elements--;
 
@@ -282,6 +331,32 @@ void *fr_heap_pop(fr_heap_t *hp)
 }
 
 
+/** Pop all the elements which sort before, or the same as, a limit
+ *
+ * Elements are returned in heap order.  This is useful for draining
+ * everything which has expired, without a peek and a pop for each
+ * element.
+ *
+ * @param[in] hp	to pop elements from.
+ * @param[out] out	Where to write the elements.
+ * @param[in] max	Maximum number of elements to pop.
+ * @param[in] cmp	Called as cmp(element, limit).  Popping stops when
+ *			this returns > 0.
+ * @param[in] limit	to compare elements against.
+ * @return the number of elements written to out.
+ */
+uint32_t fr_heap_pop_until(fr_heap_t *hp, void **out, uint32_t max, fr_heap_cmp_t cmp, void const *limit)
+{
+	uint32_t num = 0;
+
+	while ((num < max) && (hp->num_elements > 0) && (cmp(hp->p[0], limit) <= 0)) {
+		out[num++] = hp->p[0];
+		(void) fr_heap_extract(hp, NULL);
+	}
+
+	return num;
+}
+
 void *fr_heap_peek_tail(fr_heap_t *hp)
 {
 	if (!hp || (hp->num_elements == 0)) return NULL;
@@ -341,6 +416,13 @@ void *fr_heap_iter_next(fr_heap_t *hp, fr_heap_iter_t *iter)
 }
 
 #ifdef TESTING
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/time.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
 static bool fr_heap_check(fr_heap_t *hp, void *data)
 {
 	int i;
@@ -367,54 +449,41 @@ typedef struct {
  *
  *  ./heap
  */
-static int heap_cmp(void const *one, void const *two)
+static int8_t heap_cmp(void const *one, void const *two)
 {
 	heap_thing const *a = one, *b = two;
 
-	return a->data - b->data;
+	return (a->data > b->data) - (a->data < b->data);
 }
 
 #define ARRAY_SIZE (1024)
 
-int main(int argc, char **argv)
+static void heap_test(unsigned int arity, int skip)
 {
-	fr_heap_t *hp;
-	int i;
-	heap_thing array[ARRAY_SIZE];
-	int skip = 0;
-	int left;
-
-	if (argc > 1) {
-		skip = atoi(argv[1]);
-	}
+	fr_heap_t	*hp;
+	int		i, left, prev;
+	heap_thing	array[ARRAY_SIZE], limit;
+	void		*out[ARRAY_SIZE];
+	uint32_t	num;
 
-	hp = fr_heap_create(NULL, heap_cmp, offsetof(heap_thing, heap_id));
+	hp = fr_heap_create(NULL, heap_cmp, heap_thing, heap);
 	fr_fatal_assert_msg(hp, "Failed creating heap!");
+	fr_fatal_assert_msg(fr_heap_arity_set(hp, arity) == 0, "Failed setting arity %u", arity);
 
 	for (i = 0; i < ARRAY_SIZE; i++) {
 		array[i].data = rand() % 65537;
 
-		fr_fatal_assert_msg(fr_heap_insert(hp, &array[i]) >= 0, "Failed inserting %d");
+		fr_fatal_assert_msg(fr_heap_insert(hp, &array[i]) >= 0, "Failed inserting %d", i);
 
 		fr_fatal_assert_msg(fr_heap_check(hp, &array[i]), "Inserted but not in heap %d", i);
 	}
 
-#if 0
-	for (i = 0; i < ARRAY_SIZE; i++) {
-		printf("Array %d has value %d at offset %d\n",
-		       i, array[i].data, array[i].heap);
-	}
-#endif
-
 	if (skip) {
 		int32_t entry;
 
-		printf("%d elements to remove\n", ARRAY_SIZE / skip);
-
 		for (i = 0; i < ARRAY_SIZE / skip; i++) {
 			entry = i * skip;
 
-
 			fr_fatal_assert_msg(fr_heap_extract(hp, &array[entry]) >= 0, "Failed removing %d", entry);
 
 			fr_fatal_assert_msg(!fr_heap_check(hp, &array[entry]), "Deleted but still in heap %d", entry);
@@ -423,15 +492,31 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 *	Everything up to the limit comes out in order, and
+	 *	nothing after it does.
+	 */
+	limit.data = 65537 / 2;
+	num = fr_heap_pop_until(hp, out, ARRAY_SIZE, heap_cmp, &limit);
+
+	prev = -1;
+	for (i = 0; i < (int) num; i++) {
+		heap_thing *t = out[i];
+
+		fr_fatal_assert_msg(t->data <= limit.data, "Popped %d, which is past the limit", t->data);
+		fr_fatal_assert_msg(t->data >= prev, "Popped %d after %d", t->data, prev);
+		prev = t->data;
+	}
+
 	left = fr_heap_num_elements(hp);
-	printf("%d elements left in the heap\n", left);
 
 	for (i = 0; i < left; i++) {
 		heap_thing *t = fr_heap_peek(hp);
 
 		fr_fatal_assert_msg(t, "Failed peeking %d", i);
-
-		printf("%d\t%d\n", i, t->data);
+		fr_fatal_assert_msg(t->data > limit.data, "%d should have been popped", t->data);
+		fr_fatal_assert_msg(t->data >= prev, "Extracted %d after %d", t->data, prev);
+		prev = t->data;
 
 		fr_fatal_assert_msg(fr_heap_extract(hp, NULL) >= 0, "Failed extracting %d", i);
 	}
@@ -439,6 +524,77 @@ int main(int argc, char **argv)
 	fr_fatal_assert_msg(fr_heap_num_elements(hp) <= 0, "%d elements left at the end", fr_heap_num_elements(hp));
 
 	talloc_free(hp);
+}
+
+/** Time inserting, and then popping, a heap's worth of elements, for each arity
+ *
+ */
+static void heap_bench(uint32_t max)
+{
+	uint32_t	num, i;
+	unsigned int	arity;
+	heap_thing	*array;
+	fr_heap_t	*hp;
+	fr_time_t	start, mid, end;
+
+	for (num = 1000; num <= max; num *= 10) {
+		array = talloc_array(NULL, heap_thing, num);
+
+		for (arity = 2; arity <= 8; arity *= 2) {
+			hp = fr_heap_create(NULL, heap_cmp, heap_thing, heap);
+			(void) fr_heap_arity_set(hp, arity);
+
+			for (i = 0; i < num; i++) array[i].data = fr_rand();
+
+			start = fr_time();
+			for (i = 0; i < num; i++) (void) fr_heap_insert(hp, &array[i]);
+			mid = fr_time();
+			while (fr_heap_pop(hp));
+			end = fr_time();
+
+			printf("%8u elements  %u-ary  %.2f ns/insert  %.2f ns/pop\n", num, arity,
+			       ((double) (mid - start)) / num, ((double) (end - mid)) / num);
+
+			talloc_free(hp);
+		}
+
+		talloc_free(array);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int		c;
+	int		skip = 0;
+	bool		do_bench = false;
+	uint32_t	max = 1000000;
+	unsigned int	arity;
+
+	while ((c = getopt(argc, argv, "bm:s:")) != -1) switch (c) {
+		case 'b':
+			do_bench = true;
+			break;
+
+		case 'm':
+			max = atoi(optarg);
+			break;
+
+		case 's':
+			skip = atoi(optarg);
+			break;
+
+		default:
+			fprintf(stderr, "usage: heap [-b] [-m max] [-s skip]\n");
+			fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (do_bench) {
+		fr_time_start();
+		heap_bench(max);
+		return 0;
+	}
+
+	for (arity = 2; arity <= 8; arity *= 2) heap_test(arity, skip);
 
 	return 0;
 }
@@ -69,11 +69,15 @@ typedef struct fr_heap_s fr_heap_t;
 
 fr_heap_t	*_fr_heap_create(TALLOC_CTX *ctx, fr_heap_cmp_t cmp, char const *talloc_type, size_t offset);
 
+int		fr_heap_arity_set(fr_heap_t *hp, unsigned int arity) CC_HINT(nonnull);
+
 int		fr_heap_insert(fr_heap_t *hp, void *data);
 int		fr_heap_extract(fr_heap_t *hp, void *data);
 void		*fr_heap_pop(fr_heap_t *hp) CC_HINT(nonnull);
 void		*fr_heap_peek(fr_heap_t *hp);
 void		*fr_heap_peek_tail(fr_heap_t *hp);
+uint32_t	fr_heap_pop_until(fr_heap_t *hp, void **out, uint32_t max,
+				  fr_heap_cmp_t cmp, void const *limit) CC_HINT(nonnull);
 
 uint32_t	fr_heap_num_elements(fr_heap_t *hp);
 
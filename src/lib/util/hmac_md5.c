@@ -44,6 +44,15 @@ static void _hmac_md5_ctx_free_on_exit(void *arg)
 	HMAC_CTX_free(arg);
 }
 
+#  if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static _Thread_local EVP_MD *md5_hmac_md;
+
+static void _hmac_md5_md_free_on_exit(void *arg)
+{
+	EVP_MD_free(arg);
+}
+#  endif
+
 /** Calculate HMAC using OpenSSL's MD5 implementation
  *
  * @param digest Caller digest to be filled in.
@@ -56,7 +65,8 @@ static void _hmac_md5_ctx_free_on_exit(void *arg)
 void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
 		 uint8_t const *key, size_t key_len)
 {
-	HMAC_CTX *ctx;
+	HMAC_CTX	*ctx;
+	EVP_MD const	*md = EVP_md5();
 
 	if (unlikely(!md5_hmac_ctx)) {
 		ctx = HMAC_CTX_new();
@@ -66,12 +76,26 @@ void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *in, size_t in
 		ctx = md5_hmac_ctx;
 	}
 
+#  if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	/*
+	 *	OpenSSL 3 looks up the implementation of EVP_md5() on
+	 *	every call, unless we fetch it ourselves.
+	 */
+	if (unlikely(!md5_hmac_md)) {
+		EVP_MD *fetched;
+
+		fetched = EVP_MD_fetch(NULL, "MD5", NULL);
+		if (fetched) fr_thread_local_set_destructor(md5_hmac_md, _hmac_md5_md_free_on_exit, fetched);
+	}
+	if (md5_hmac_md) md = md5_hmac_md;
+#  endif
+
 #ifdef EVP_MD_CTX_FLAG_NON_FIPS_ALLOW
 	/* Since MD5 is not allowed by FIPS, explicitly allow it. */
 	HMAC_CTX_set_flags(ctx, EVP_MD_CTX_FLAG_NON_FIPS_ALLOW);
 #endif /* EVP_MD_CTX_FLAG_NON_FIPS_ALLOW */
 
-	HMAC_Init_ex(ctx, key, key_len, EVP_md5(), NULL);
+	HMAC_Init_ex(ctx, key, key_len, md, NULL);
 	HMAC_Update(ctx, in, inlen);
 	HMAC_Final(ctx, digest, NULL);
 	HMAC_CTX_reset(ctx);
@@ -150,6 +174,74 @@ void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *in, size_t in
 }
 #endif /* HAVE_OPENSSL_EVP_H */
 
+/** Calculate the HMAC-MD5 of several buffers at once
+ *
+ * This gives the same digests as calling fr_hmac_md5() for each
+ * buffer, but uses fr_md5_calc_multi() to do the inner and outer
+ * hashes for FR_MD5_MULTI_LANES buffers at a time.  Each buffer can
+ * have its own key.
+ *
+ * @param[in] hmac	The buffers and keys, and where to write each digest.
+ * @param[in] num	The number of buffers.
+ */
+void fr_hmac_md5_multi(fr_hmac_md5_multi_t const *hmac, int num)
+{
+	int		i, j, k, lanes;
+	uint8_t		k_ipad[FR_MD5_MULTI_LANES][64];
+	uint8_t		k_opad[FR_MD5_MULTI_LANES][64];
+	uint8_t		tk[FR_MD5_MULTI_LANES][MD5_DIGEST_LENGTH];
+	uint8_t		inner[FR_MD5_MULTI_LANES][MD5_DIGEST_LENGTH];
+	fr_md5_multi_t	md5[FR_MD5_MULTI_LANES];
+
+	for (i = 0; i < num; i += lanes) {
+		lanes = num - i;
+		if (lanes > FR_MD5_MULTI_LANES) lanes = FR_MD5_MULTI_LANES;
+
+		for (j = 0; j < lanes; j++) {
+			uint8_t const	*key = hmac[i + j].key;
+			size_t		key_len = hmac[i + j].key_len;
+
+			/* if key is longer than 64 bytes reset it to key=MD5(key) */
+			if (key_len > 64) {
+				fr_md5_calc(tk[j], key, key_len);
+				key = tk[j];
+				key_len = MD5_DIGEST_LENGTH;
+			}
+
+			memset(k_ipad[j], 0, sizeof(k_ipad[j]));
+			memcpy(k_ipad[j], key, key_len);
+			memcpy(k_opad[j], k_ipad[j], sizeof(k_opad[j]));
+
+			for (k = 0; k < 64; k++) {
+				k_ipad[j][k] ^= 0x36;
+				k_opad[j][k] ^= 0x5c;
+			}
+
+			/*
+			 *	MD5(K XOR ipad, in)
+			 */
+			md5[j] = (fr_md5_multi_t) {
+				.out = inner[j],
+				.in = { k_ipad[j], hmac[i + j].in },
+				.inlen = { 64, hmac[i + j].inlen }
+			};
+		}
+		fr_md5_calc_multi(md5, lanes);
+
+		/*
+		 *	MD5(K XOR opad, MD5(K XOR ipad, in))
+		 */
+		for (j = 0; j < lanes; j++) {
+			md5[j] = (fr_md5_multi_t) {
+				.out = hmac[i + j].out,
+				.in = { k_opad[j], inner[j] },
+				.inlen = { 64, MD5_DIGEST_LENGTH }
+			};
+		}
+		fr_md5_calc_multi(md5, lanes);
+	}
+}
+
 /*
 Test Vectors (Trailing '\0' of a character string not included in test):
 
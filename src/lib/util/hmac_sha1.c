@@ -49,6 +49,15 @@ static void _hmac_sha1_ctx_free_on_exit(void *arg)
 	HMAC_CTX_free(arg);
 }
 
+#  if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static _Thread_local EVP_MD *sha1_hmac_md;
+
+static void _hmac_sha1_md_free_on_exit(void *arg)
+{
+	EVP_MD_free(arg);
+}
+#  endif
+
 /** Calculate HMAC using OpenSSL's SHA1 implementation
  *
  * @param digest Caller digest to be filled in.
@@ -61,7 +70,8 @@ static void _hmac_sha1_ctx_free_on_exit(void *arg)
 void fr_hmac_sha1(uint8_t digest[SHA1_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
 		  uint8_t const *key, size_t key_len)
 {
-	HMAC_CTX *ctx;
+	HMAC_CTX	*ctx;
+	EVP_MD const	*md = EVP_sha1();
 
 	if (unlikely(!sha1_hmac_ctx)) {
 		ctx = HMAC_CTX_new();
@@ -71,7 +81,21 @@ void fr_hmac_sha1(uint8_t digest[SHA1_DIGEST_LENGTH], uint8_t const *in, size_t
 		ctx = sha1_hmac_ctx;
 	}
 
-	HMAC_Init_ex(ctx, key, key_len, EVP_sha1(), NULL);
+#  if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	/*
+	 *	OpenSSL 3 looks up the implementation of EVP_sha1() on
+	 *	every call, unless we fetch it ourselves.
+	 */
+	if (unlikely(!sha1_hmac_md)) {
+		EVP_MD *fetched;
+
+		fetched = EVP_MD_fetch(NULL, "SHA1", NULL);
+		if (fetched) fr_thread_local_set_destructor(sha1_hmac_md, _hmac_sha1_md_free_on_exit, fetched);
+	}
+	if (sha1_hmac_md) md = sha1_hmac_md;
+#  endif
+
+	HMAC_Init_ex(ctx, key, key_len, md, NULL);
 	HMAC_Update(ctx, in, inlen);
 	HMAC_Final(ctx, digest, NULL);
 	HMAC_CTX_reset(ctx);
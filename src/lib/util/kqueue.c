@@ -0,0 +1,1242 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** kqueue emulation over epoll
+ *
+ * Implements the subset of the kqueue API used by the event loop, channels
+ * and control planes directly on top of epoll, without the extra thread,
+ * per-filter bookkeeping and FIONREAD ioctls that libkqueue adds to every
+ * event.
+ *
+ * - EVFILT_READ / EVFILT_WRITE map to a single epoll registration per fd.
+ *   EV_CLEAR maps to EPOLLET.  Regular files, which epoll refuses, are
+ *   checked on every call, the same way kqueue reports them.
+ * - EVFILT_USER is an eventfd per ident, so NOTE_TRIGGER from another
+ *   thread wakes up epoll_wait().
+ * - EVFILT_PROC is a pidfd, with the exit status retrieved via waitid()
+ *   without reaping the child.
+ * - EVFILT_VNODE is a per-kqueue inotify descriptor.
+ *
+ * Each kqueue is an epoll fd, with its state in a lookup table indexed by
+ * that fd.  All state is protected by a per-kqueue mutex, which is released
+ * while waiting, so events can be triggered from other threads.
+ *
+ * @file src/lib/util/kqueue.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#ifdef HAVE_KQUEUE_EPOLL
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/kqueue.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <talloc.h>
+#include <unistd.h>
+
+#ifndef P_PIDFD
+#  define P_PIDFD	3
+#endif
+
+/*
+ *	Maximum number of epoll events we retrieve per call.
+ */
+#define KQ_MAX_EPOLL_EVENTS	64
+
+/*
+ *	kqueue lookup table.  Two levels so the first level can be
+ *	read without locking, chunks are never freed or moved.
+ */
+#define KQ_CHUNK_BITS		10
+#define KQ_CHUNK_SIZE		(1 << KQ_CHUNK_BITS)
+#define KQ_MAX_CHUNKS		1024
+
+/*
+ *	Flags we remember from the change, and return with the event.
+ */
+#define KQ_FILTER_FLAGS		(EV_ONESHOT | EV_CLEAR)
+
+#define KQ_INOTIFY_MASK		(IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF | IN_UNMOUNT | \
+				 IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MASK_ADD)
+
+typedef enum {
+	KQ_NOTE_FD = 0,				//!< EVFILT_READ, EVFILT_WRITE and EVFILT_VNODE on a fd.
+	KQ_NOTE_USER,				//!< EVFILT_USER, fd is an eventfd.
+	KQ_NOTE_PROC,				//!< EVFILT_PROC, fd is a pidfd.
+	KQ_NOTE_INOTIFY				//!< The kqueue's inotify descriptor.
+} kq_note_type_t;
+
+/** State of a single kqueue filter
+ *
+ */
+typedef struct {
+	bool			active;		//!< Filter has been added.
+	bool			enabled;	//!< Filter is not disabled.
+	uint16_t		flags;		//!< KQ_FILTER_FLAGS as added.
+	uint32_t		fflags;		//!< Filter flags as added.
+	intptr_t		data;		//!< Filter data.
+	void			*udata;		//!< Returned with the event.
+} kq_filter_t;
+
+/** Something registered with the kqueue
+ *
+ * Everything is indexed by a file descriptor.  For KQ_NOTE_FD that's the
+ * ident, for the others it's the eventfd, pidfd, or inotify fd.
+ */
+typedef struct {
+	kq_note_type_t		type;
+	int			fd;		//!< Descriptor, and index into the fds table.
+	uintptr_t		ident;		//!< ident for EVFILT_USER and EVFILT_PROC.
+
+	uint32_t		events;		//!< epoll events we're registered for.
+	bool			in_epoll;	//!< Whether fd has been added to epoll.
+	bool			is_file;	//!< Regular file, epoll can't watch it.
+
+	kq_filter_t		read;		//!< EVFILT_READ, or the EVFILT_USER/EVFILT_PROC filter.
+	kq_filter_t		write;		//!< EVFILT_WRITE.
+	kq_filter_t		vnode;		//!< EVFILT_VNODE.
+
+	int			wd;		//!< inotify watch descriptor.
+	off_t			size;		//!< Last size, to tell NOTE_EXTEND from NOTE_WRITE.
+	nlink_t			nlink;		//!< Last link count, to tell NOTE_LINK from NOTE_ATTRIB.
+	uint32_t		vnode_fired;	//!< Vnode fflags accumulated from inotify.
+
+	fr_dlist_t		entry;		//!< Entry in the notes or files list.
+	fr_dlist_t		vnode_entry;	//!< Entry in the vnodes list.
+} kq_note_t;
+
+typedef struct {
+	int			epfd;		//!< epoll descriptor, which is the kqueue descriptor.
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+
+	kq_note_t		**fds;		//!< Notes indexed by fd.
+	int			num_fds;	//!< Size of the fds array.
+
+	fr_dlist_head_t		notes;		//!< EVFILT_USER and EVFILT_PROC notes.
+	fr_dlist_head_t		files;		//!< Regular files.
+	fr_dlist_head_t		vnodes;		//!< Notes with an EVFILT_VNODE filter.
+
+	kq_note_t		*inotify;	//!< Lazily created inotify descriptor.
+
+	struct kevent		*pending;	//!< Events which didn't fit in the caller's eventlist.
+	int			num_pending;
+	int			max_pending;
+} fr_kqueue_t;
+
+static fr_kqueue_t **kq_table[KQ_MAX_CHUNKS];
+static pthread_mutex_t kq_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static fr_kqueue_t *kq_find(int kqfd)
+{
+	fr_kqueue_t **chunk;
+
+	if ((kqfd < 0) || ((kqfd >> KQ_CHUNK_BITS) >= KQ_MAX_CHUNKS)) return NULL;
+
+	chunk = kq_table[kqfd >> KQ_CHUNK_BITS];
+	if (!chunk) return NULL;
+
+	return chunk[kqfd & (KQ_CHUNK_SIZE - 1)];
+}
+
+static int kq_table_set(int kqfd, fr_kqueue_t *kq)
+{
+	fr_kqueue_t **chunk;
+
+	if ((kqfd >> KQ_CHUNK_BITS) >= KQ_MAX_CHUNKS) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	pthread_mutex_lock(&kq_table_mutex);
+	chunk = kq_table[kqfd >> KQ_CHUNK_BITS];
+	if (!chunk) {
+		chunk = talloc_zero_array(NULL, fr_kqueue_t *, KQ_CHUNK_SIZE);
+		if (!chunk) {
+			pthread_mutex_unlock(&kq_table_mutex);
+			errno = ENOMEM;
+			return -1;
+		}
+		kq_table[kqfd >> KQ_CHUNK_BITS] = chunk;
+	}
+	chunk[kqfd & (KQ_CHUNK_SIZE - 1)] = kq;
+	pthread_mutex_unlock(&kq_table_mutex);
+
+	return 0;
+}
+
+static inline kq_note_t *kq_note_by_fd(fr_kqueue_t *kq, int fd)
+{
+	if ((fd < 0) || (fd >= kq->num_fds)) return NULL;
+
+	return kq->fds[fd];
+}
+
+static kq_note_t *kq_note_by_ident(fr_kqueue_t *kq, kq_note_type_t type, uintptr_t ident)
+{
+	kq_note_t *note = NULL;
+
+	while ((note = fr_dlist_next(&kq->notes, note))) {
+		if ((note->type == type) && (note->ident == ident)) return note;
+	}
+
+	return NULL;
+}
+
+/** Remove a note from all the lists and free it
+ *
+ * For notes which own their descriptor, it's closed.
+ */
+static void kq_note_free(fr_kqueue_t *kq, kq_note_t *note)
+{
+	if (note->is_file) {
+		fr_dlist_remove(&kq->files, note);
+	} else if (note->type != KQ_NOTE_FD) {
+		fr_dlist_remove(&kq->notes, note);
+	}
+	fr_dlist_remove(&kq->vnodes, note);
+
+	if (kq->fds[note->fd] == note) kq->fds[note->fd] = NULL;
+
+	if (note->type != KQ_NOTE_FD) {
+		if (note->in_epoll) (void) epoll_ctl(kq->epfd, EPOLL_CTL_DEL, note->fd, NULL);
+		close(note->fd);
+	}
+
+	talloc_free(note);
+}
+
+/** Allocate a new note, and insert it into the fds table
+ *
+ */
+static kq_note_t *kq_note_alloc(fr_kqueue_t *kq, kq_note_type_t type, int fd)
+{
+	kq_note_t *note;
+
+	if (fd < 0) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	if (fd >= kq->num_fds) {
+		kq_note_t	**fds;
+		int		num = kq->num_fds ? kq->num_fds : 64;
+
+		while (num <= fd) num <<= 1;
+
+		fds = talloc_realloc(kq, kq->fds, kq_note_t *, num);
+		if (!fds) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		memset(fds + kq->num_fds, 0, sizeof(*fds) * (num - kq->num_fds));
+		kq->fds = fds;
+		kq->num_fds = num;
+	}
+
+	/*
+	 *	A fd which was closed without being removed,
+	 *	and the number's been reused.
+	 */
+	if (kq->fds[fd]) kq_note_free(kq, kq->fds[fd]);
+
+	note = talloc_zero(kq, kq_note_t);
+	if (!note) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	note->type = type;
+	note->fd = fd;
+	note->wd = -1;
+	fr_dlist_entry_init(&note->entry);
+	fr_dlist_entry_init(&note->vnode_entry);
+
+	kq->fds[fd] = note;
+
+	return note;
+}
+
+/** Update the epoll registration for a fd note to match its filters
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure with errno set.
+ */
+static int kq_note_fd_sync(fr_kqueue_t *kq, kq_note_t *note)
+{
+	struct epoll_event	ev = { .data.fd = note->fd };
+	bool			clear = true;
+
+	if (note->read.active && note->read.enabled) {
+		ev.events |= EPOLLIN | EPOLLRDHUP;
+		if (!(note->read.flags & EV_CLEAR)) clear = false;
+	}
+	if (note->write.active && note->write.enabled) {
+		ev.events |= EPOLLOUT;
+		if (!(note->write.flags & EV_CLEAR)) clear = false;
+	}
+
+	/*
+	 *	epoll edge triggering applies to the whole fd,
+	 *	so only use it if every filter asked for it.
+	 */
+	if (ev.events && clear) ev.events |= EPOLLET;
+
+	if (note->is_file) goto done;
+
+	if (!ev.events) {
+		if (!note->in_epoll) goto done;
+
+		if (epoll_ctl(kq->epfd, EPOLL_CTL_DEL, note->fd, NULL) < 0) {
+			/*
+			 *	The fd has gone away, so it's no
+			 *	longer registered, and the caller
+			 *	needs to know.
+			 */
+			note->in_epoll = false;
+			return -1;
+		}
+		note->in_epoll = false;
+		goto done;
+	}
+
+	if (ev.events == note->events && note->in_epoll) return 0;
+
+	if (!note->in_epoll) {
+		if (epoll_ctl(kq->epfd, EPOLL_CTL_ADD, note->fd, &ev) < 0) {
+			switch (errno) {
+			/*
+			 *	Left over from an fd with the same
+			 *	number which was closed and reused.
+			 */
+			case EEXIST:
+				if (epoll_ctl(kq->epfd, EPOLL_CTL_MOD, note->fd, &ev) < 0) return -1;
+				break;
+
+			/*
+			 *	Regular files and directories are always
+			 *	readable and writable, and epoll refuses
+			 *	them.  Check them on every call instead.
+			 */
+			case EPERM:
+				note->is_file = true;
+				fr_dlist_insert_tail(&kq->files, note);
+				goto done;
+
+			default:
+				return -1;
+			}
+		}
+		note->in_epoll = true;
+	} else if (epoll_ctl(kq->epfd, EPOLL_CTL_MOD, note->fd, &ev) < 0) {
+		/*
+		 *	The fd was closed and reused without being
+		 *	removed, so epoll dropped it.
+		 */
+		if (errno != ENOENT) return -1;
+		if (epoll_ctl(kq->epfd, EPOLL_CTL_ADD, note->fd, &ev) < 0) return -1;
+	}
+
+done:
+	note->events = ev.events;
+	return 0;
+}
+
+/** Create the inotify descriptor for the kqueue
+ *
+ */
+static int kq_inotify_init(fr_kqueue_t *kq)
+{
+	struct epoll_event	ev = { .events = EPOLLIN };
+	kq_note_t		*note;
+	int			fd;
+
+	if (kq->inotify) return 0;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) return -1;
+
+	note = kq_note_alloc(kq, KQ_NOTE_INOTIFY, fd);
+	if (!note) {
+		close(fd);
+		return -1;
+	}
+
+	ev.data.fd = fd;
+	if (epoll_ctl(kq->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		kq_note_free(kq, note);
+		return -1;
+	}
+	note->in_epoll = true;
+	kq->inotify = note;
+
+	return 0;
+}
+
+/** Stop watching a vnode
+ *
+ * The watch descriptor is shared between all fds which refer to the same
+ * inode, so it's only removed when the last one goes.
+ */
+static void kq_vnode_unwatch(fr_kqueue_t *kq, kq_note_t *note)
+{
+	kq_note_t *other = NULL;
+
+	fr_dlist_remove(&kq->vnodes, note);
+	note->vnode.active = false;
+
+	if (note->wd < 0) return;
+
+	while ((other = fr_dlist_next(&kq->vnodes, other))) {
+		if (other->wd == note->wd) goto done;
+	}
+	(void) inotify_rm_watch(kq->inotify->fd, note->wd);
+
+done:
+	note->wd = -1;
+}
+
+static int kq_change_vnode(fr_kqueue_t *kq, kq_note_t *note, struct kevent const *kev)
+{
+	if (kev->flags & EV_ADD) {
+		if (!note->vnode.active) {
+			char		path[64];
+			struct stat	buf;
+
+			if (fstat(note->fd, &buf) < 0) return -1;
+
+			if (kq_inotify_init(kq) < 0) return -1;
+
+			/*
+			 *	The magic link resolves to the inode, even
+			 *	if the file's been renamed or unlinked.
+			 */
+			snprintf(path, sizeof(path), "/proc/self/fd/%i", note->fd);
+			note->wd = inotify_add_watch(kq->inotify->fd, path, KQ_INOTIFY_MASK);
+			if (note->wd < 0) return -1;
+
+			note->size = buf.st_size;
+			note->nlink = buf.st_nlink;
+			note->vnode_fired = 0;
+			note->vnode.active = true;
+			note->vnode.enabled = true;
+			fr_dlist_insert_tail(&kq->vnodes, note);
+		}
+
+		note->vnode.flags = kev->flags & KQ_FILTER_FLAGS;
+		note->vnode.fflags = kev->fflags;
+		note->vnode.udata = kev->udata;
+	} else if (!note->vnode.active) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (kev->flags & EV_DISABLE) note->vnode.enabled = false;
+	if (kev->flags & EV_ENABLE) note->vnode.enabled = true;
+	if (kev->flags & EV_DELETE) kq_vnode_unwatch(kq, note);
+
+	return 0;
+}
+
+/** Apply a change for EVFILT_READ, EVFILT_WRITE or EVFILT_VNODE
+ *
+ */
+static int kq_change_fd(fr_kqueue_t *kq, struct kevent const *kev)
+{
+	kq_note_t	*note;
+	kq_filter_t	*filter;
+	bool		created = false;
+	int		ret;
+
+	if (kev->ident > INT_MAX) {
+		errno = EBADF;
+		return -1;
+	}
+
+	note = kq_note_by_fd(kq, (int)kev->ident);
+	if (note && (note->type != KQ_NOTE_FD)) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (!note) {
+		if (!(kev->flags & EV_ADD)) {
+			errno = ENOENT;
+			return -1;
+		}
+
+		/*
+		 *	Catch closed fds here, the same
+		 *	as kqueue would.
+		 */
+		if (fcntl((int)kev->ident, F_GETFD) < 0) return -1;
+
+		note = kq_note_alloc(kq, KQ_NOTE_FD, (int)kev->ident);
+		if (!note) return -1;
+		created = true;
+	}
+
+	if (kev->filter == EVFILT_VNODE) {
+		ret = kq_change_vnode(kq, note, kev);
+		goto done;
+	}
+
+	filter = (kev->filter == EVFILT_READ) ? &note->read : &note->write;
+
+	if (kev->flags & EV_ADD) {
+		filter->active = true;
+		filter->enabled = true;
+		filter->flags = kev->flags & KQ_FILTER_FLAGS;
+		filter->fflags = kev->fflags;
+		filter->data = kev->data;
+		filter->udata = kev->udata;
+	} else if (!filter->active) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (kev->flags & EV_DISABLE) filter->enabled = false;
+	if (kev->flags & EV_ENABLE) filter->enabled = true;
+	if (kev->flags & EV_DELETE) filter->active = false;
+
+	ret = kq_note_fd_sync(kq, note);
+	if ((ret < 0) && (kev->flags & EV_ADD)) filter->active = false;
+
+done:
+	if (!note->read.active && !note->write.active && !note->vnode.active) {
+		int err = errno;
+
+		kq_note_free(kq, note);
+		errno = err;
+	} else if (created && (ret < 0)) {
+		int err = errno;
+
+		kq_note_free(kq, note);
+		errno = err;
+	}
+
+	return ret;
+}
+
+static int kq_change_user(fr_kqueue_t *kq, struct kevent const *kev)
+{
+	kq_note_t	*note;
+	uint64_t	one = 1;
+
+	note = kq_note_by_ident(kq, KQ_NOTE_USER, kev->ident);
+	if (!note) {
+		struct epoll_event	ev = { .events = EPOLLIN };
+		int			fd;
+
+		if (!(kev->flags & EV_ADD)) {
+			errno = ENOENT;
+			return -1;
+		}
+
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd < 0) return -1;
+
+		note = kq_note_alloc(kq, KQ_NOTE_USER, fd);
+		if (!note) {
+			close(fd);
+			return -1;
+		}
+		note->ident = kev->ident;
+		fr_dlist_insert_tail(&kq->notes, note);
+
+		ev.data.fd = fd;
+		if (epoll_ctl(kq->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			int err = errno;
+
+			kq_note_free(kq, note);
+			errno = err;
+			return -1;
+		}
+		note->in_epoll = true;
+		note->events = ev.events;
+		note->read.active = true;
+		note->read.enabled = true;
+	}
+
+	if (kev->flags & EV_DELETE) {
+		kq_note_free(kq, note);
+		return 0;
+	}
+
+	if (kev->flags & EV_ADD) {
+		note->read.flags = kev->flags & KQ_FILTER_FLAGS;
+		note->read.udata = kev->udata;
+	}
+
+	switch (kev->fflags & NOTE_FFCTRLMASK) {
+	case NOTE_FFAND:
+		note->read.fflags &= kev->fflags & NOTE_FFLAGSMASK;
+		break;
+
+	case NOTE_FFOR:
+		note->read.fflags |= kev->fflags & NOTE_FFLAGSMASK;
+		break;
+
+	case NOTE_FFCOPY:
+		note->read.fflags = kev->fflags & NOTE_FFLAGSMASK;
+		break;
+
+	default:
+		break;
+	}
+
+	if ((kev->flags & (EV_ENABLE | EV_DISABLE)) != 0) {
+		struct epoll_event ev = { .data.fd = note->fd };
+
+		note->read.enabled = !(kev->flags & EV_DISABLE);
+		if (note->read.enabled) ev.events = EPOLLIN;
+		if ((ev.events != note->events) && (epoll_ctl(kq->epfd, EPOLL_CTL_MOD, note->fd, &ev) < 0)) return -1;
+		note->events = ev.events;
+	}
+
+	if ((kev->fflags & NOTE_TRIGGER) && (write(note->fd, &one, sizeof(one)) < 0) && (errno != EAGAIN)) return -1;
+
+	return 0;
+}
+
+static int kq_change_proc(fr_kqueue_t *kq, struct kevent const *kev)
+{
+	kq_note_t	*note;
+
+	note = kq_note_by_ident(kq, KQ_NOTE_PROC, kev->ident);
+	if (!note) {
+		struct epoll_event	ev = { .events = EPOLLIN };
+		int			fd;
+
+		if (!(kev->flags & EV_ADD)) {
+			errno = ENOENT;
+			return -1;
+		}
+
+#ifdef SYS_pidfd_open
+		fd = syscall(SYS_pidfd_open, (pid_t)kev->ident, 0);
+#else
+		errno = ENOSYS;
+		fd = -1;
+#endif
+		if (fd < 0) return -1;
+
+		note = kq_note_alloc(kq, KQ_NOTE_PROC, fd);
+		if (!note) {
+			close(fd);
+			return -1;
+		}
+		note->ident = kev->ident;
+		fr_dlist_insert_tail(&kq->notes, note);
+
+		ev.data.fd = fd;
+		if (epoll_ctl(kq->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			int err = errno;
+
+			kq_note_free(kq, note);
+			errno = err;
+			return -1;
+		}
+		note->in_epoll = true;
+		note->events = ev.events;
+		note->read.active = true;
+		note->read.enabled = true;
+	}
+
+	if (kev->flags & EV_DELETE) {
+		kq_note_free(kq, note);
+		return 0;
+	}
+
+	if (kev->flags & EV_ADD) {
+		note->read.flags = kev->flags & KQ_FILTER_FLAGS;
+		note->read.fflags = kev->fflags;
+		note->read.udata = kev->udata;
+	}
+
+	return 0;
+}
+
+static int kq_change(fr_kqueue_t *kq, struct kevent const *kev)
+{
+	/*
+	 *	Drop any events for the filter which
+	 *	haven't been retrieved yet.
+	 */
+	if (kev->flags & EV_DELETE) {
+		int i;
+
+		for (i = 0; i < kq->num_pending; i++) {
+			if ((kq->pending[i].ident == kev->ident) && (kq->pending[i].filter == kev->filter)) {
+				kq->pending[i].filter = 0;
+			}
+		}
+	}
+
+	switch (kev->filter) {
+	case EVFILT_READ:
+	case EVFILT_WRITE:
+	case EVFILT_VNODE:
+		return kq_change_fd(kq, kev);
+
+	case EVFILT_USER:
+		return kq_change_user(kq, kev);
+
+	case EVFILT_PROC:
+		return kq_change_proc(kq, kev);
+
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+/** Add an event to the caller's eventlist, or the pending list if it's full
+ *
+ */
+static void kq_emit(fr_kqueue_t *kq, struct kevent *eventlist, int nevents, int *n, struct kevent const *kev)
+{
+	if (*n < nevents) {
+		eventlist[(*n)++] = *kev;
+		return;
+	}
+
+	if (kq->num_pending == kq->max_pending) {
+		struct kevent	*pending;
+		int		num = kq->max_pending ? (kq->max_pending * 2) : 16;
+
+		pending = talloc_realloc(kq, kq->pending, struct kevent, num);
+		if (!pending) return;	/* Level triggered events will be reported again */
+
+		kq->pending = pending;
+		kq->max_pending = num;
+	}
+
+	kq->pending[kq->num_pending++] = *kev;
+}
+
+/** Check a pending event still refers to a registered filter
+ *
+ * kqueue drops events for filters which are deleted before they're
+ * retrieved, and callers rely on that.
+ */
+static bool kq_pending_valid(fr_kqueue_t *kq, struct kevent const *kev)
+{
+	kq_note_t	*note;
+	kq_filter_t	*filter;
+
+	switch (kev->filter) {
+	case EVFILT_READ:
+	case EVFILT_WRITE:
+	case EVFILT_VNODE:
+		if (kev->ident > INT_MAX) return false;
+
+		note = kq_note_by_fd(kq, (int)kev->ident);
+		if (!note || (note->type != KQ_NOTE_FD)) return false;
+
+		if (kev->filter == EVFILT_READ) {
+			filter = &note->read;
+		} else if (kev->filter == EVFILT_WRITE) {
+			filter = &note->write;
+		} else {
+			filter = &note->vnode;
+		}
+		break;
+
+	case EVFILT_USER:
+		note = kq_note_by_ident(kq, KQ_NOTE_USER, kev->ident);
+		if (!note) return false;
+		filter = &note->read;
+		break;
+
+	/*
+	 *	Proc notes are removed when they fire.
+	 */
+	case EVFILT_PROC:
+		return true;
+
+	default:
+		return false;
+	}
+
+	return filter->active && filter->enabled && (filter->udata == kev->udata);
+}
+
+/** Return events which didn't fit into the last eventlist
+ *
+ */
+static int kq_pending_drain(fr_kqueue_t *kq, struct kevent *eventlist, int nevents)
+{
+	int i, n = 0;
+
+	for (i = 0; (i < kq->num_pending) && (n < nevents); i++) {
+		if (!kq_pending_valid(kq, &kq->pending[i])) continue;
+		eventlist[n++] = kq->pending[i];
+	}
+
+	if (i < kq->num_pending) memmove(kq->pending, kq->pending + i, sizeof(*kq->pending) * (kq->num_pending - i));
+	kq->num_pending -= i;
+
+	return n;
+}
+
+/** Report readiness for regular files, which are always readable and writable
+ *
+ * Reads are only reported when the file offset isn't at EOF, the same as kqueue.
+ */
+static void kq_files_ready(fr_kqueue_t *kq, struct kevent *eventlist, int nevents, int *n)
+{
+	kq_note_t	*note = NULL;
+	struct kevent	kev;
+
+	while ((note = fr_dlist_next(&kq->files, note))) {
+		if (note->read.active && note->read.enabled) {
+			struct stat	buf;
+			off_t		offset;
+
+			offset = lseek(note->fd, 0, SEEK_CUR);
+			if ((offset >= 0) && (fstat(note->fd, &buf) == 0) && (buf.st_size > offset)) {
+				EV_SET(&kev, note->fd, EVFILT_READ, note->read.flags, 0,
+				       buf.st_size - offset, note->read.udata);
+				kq_emit(kq, eventlist, nevents, n, &kev);
+			}
+		}
+
+		if (note->write.active && note->write.enabled) {
+			EV_SET(&kev, note->fd, EVFILT_WRITE, note->write.flags, 0, 0, note->write.udata);
+			kq_emit(kq, eventlist, nevents, n, &kev);
+		}
+	}
+}
+
+/** Convert epoll readiness on a fd into EVFILT_READ / EVFILT_WRITE events
+ *
+ */
+static void kq_event_fd(fr_kqueue_t *kq, kq_note_t *note, uint32_t events,
+			struct kevent *eventlist, int nevents, int *n)
+{
+	struct kevent	kev;
+	bool		sync = false;
+
+	if (note->read.active && note->read.enabled && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+		EV_SET(&kev, note->fd, EVFILT_READ, note->read.flags, 0, 0, note->read.udata);
+
+		/*
+		 *	Like kqueue, socket errors just make the
+		 *	socket readable, the read returns the error.
+		 */
+		if (events & (EPOLLRDHUP | EPOLLHUP)) {
+			int		err = 0;
+			socklen_t	len = sizeof(err);
+
+			(void) getsockopt(note->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			kev.flags |= EV_EOF;
+			kev.fflags = err;
+		}
+		kq_emit(kq, eventlist, nevents, n, &kev);
+
+		if (note->read.flags & EV_ONESHOT) {
+			note->read.active = false;
+			sync = true;
+		}
+	}
+
+	if (note->write.active && note->write.enabled && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+		EV_SET(&kev, note->fd, EVFILT_WRITE, note->write.flags, 0, 0, note->write.udata);
+		if (events & EPOLLHUP) {
+			int		err = 0;
+			socklen_t	len = sizeof(err);
+
+			(void) getsockopt(note->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			kev.flags |= EV_EOF;
+			kev.fflags = err;
+		}
+		kq_emit(kq, eventlist, nevents, n, &kev);
+
+		if (note->write.flags & EV_ONESHOT) {
+			note->write.active = false;
+			sync = true;
+		}
+	}
+
+	if (!sync) return;
+
+	(void) kq_note_fd_sync(kq, note);
+	if (!note->read.active && !note->write.active && !note->vnode.active) kq_note_free(kq, note);
+}
+
+static void kq_event_user(fr_kqueue_t *kq, kq_note_t *note, struct kevent *eventlist, int nevents, int *n)
+{
+	struct kevent	kev;
+
+	if (!note->read.enabled) return;
+
+	EV_SET(&kev, note->ident, EVFILT_USER, note->read.flags,
+	       note->read.fflags & NOTE_FFLAGSMASK, note->read.data, note->read.udata);
+	kq_emit(kq, eventlist, nevents, n, &kev);
+
+	if (note->read.flags & EV_ONESHOT) {
+		kq_note_free(kq, note);
+		return;
+	}
+
+	/*
+	 *	Without EV_CLEAR user events stay
+	 *	triggered until they're deleted.
+	 */
+	if (note->read.flags & EV_CLEAR) {
+		uint64_t count;
+
+		(void) read(note->fd, &count, sizeof(count));
+		note->read.fflags = 0;
+	}
+}
+
+static void kq_event_proc(fr_kqueue_t *kq, kq_note_t *note, struct kevent *eventlist, int nevents, int *n)
+{
+	struct kevent	kev;
+	siginfo_t	info;
+	int		status = 0;
+
+	memset(&info, 0, sizeof(info));
+
+	/*
+	 *	Leave the child for the caller to reap,
+	 *	kqueue doesn't reap it either.
+	 */
+	if (waitid(P_PIDFD, note->fd, &info, WEXITED | WNOHANG | WNOWAIT) < 0) {
+		if (errno != ECHILD) return;
+	} else if (info.si_pid == 0) {
+		return;		/* Spurious wakeup */
+	} else {
+		switch (info.si_code) {
+		case CLD_EXITED:
+			status = (info.si_status & 0xff) << 8;
+			break;
+
+		case CLD_KILLED:
+			status = info.si_status & 0x7f;
+			break;
+
+		case CLD_DUMPED:
+			status = (info.si_status & 0x7f) | 0x80;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	EV_SET(&kev, note->ident, EVFILT_PROC, note->read.flags | EV_EOF | EV_ONESHOT,
+	       NOTE_EXIT, status, note->read.udata);
+	kq_emit(kq, eventlist, nevents, n, &kev);
+
+	/*
+	 *	The process is gone, so is the note.
+	 */
+	kq_note_free(kq, note);
+}
+
+/** Map an inotify event onto the vnode notes watching the inode
+ *
+ */
+static void kq_inotify_map(fr_kqueue_t *kq, struct inotify_event const *iev)
+{
+	kq_note_t	*note = NULL;
+
+	while ((note = fr_dlist_next(&kq->vnodes, note))) {
+		uint32_t	fflags = 0;
+		struct stat	buf;
+		bool		have_stat;
+
+		if (note->wd != iev->wd) continue;
+
+		have_stat = (fstat(note->fd, &buf) == 0);
+
+		if (iev->mask & IN_MODIFY) {
+			fflags |= NOTE_WRITE;
+			if (have_stat && (buf.st_size > note->size)) fflags |= NOTE_EXTEND;
+		}
+
+		/*
+		 *	An open inode doesn't get IN_DELETE_SELF until
+		 *	it's closed, unlinking shows up as a link count
+		 *	change.
+		 */
+		if (iev->mask & IN_ATTRIB) {
+			if (have_stat && (buf.st_nlink == 0)) {
+				fflags |= NOTE_DELETE;
+			} else if (have_stat && (buf.st_nlink != note->nlink)) {
+				fflags |= NOTE_LINK;
+			} else {
+				fflags |= NOTE_ATTRIB;
+			}
+		}
+
+		if (iev->mask & (IN_CREATE | IN_MOVED_TO)) {
+			fflags |= NOTE_WRITE | NOTE_EXTEND;
+			if (iev->mask & IN_ISDIR) fflags |= NOTE_LINK;
+		}
+		if (iev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			fflags |= NOTE_WRITE;
+			if (iev->mask & IN_ISDIR) fflags |= NOTE_LINK;
+		}
+
+		if (iev->mask & IN_DELETE_SELF) fflags |= NOTE_DELETE;
+		if (iev->mask & IN_MOVE_SELF) fflags |= NOTE_RENAME;
+		if (iev->mask & IN_UNMOUNT) fflags |= NOTE_REVOKE;
+
+		/*
+		 *	The kernel removed the watch.
+		 */
+		if (iev->mask & IN_IGNORED) note->wd = -1;
+
+		if (have_stat) {
+			note->size = buf.st_size;
+			note->nlink = buf.st_nlink;
+		}
+
+		note->vnode_fired |= fflags & note->vnode.fflags;
+	}
+}
+
+static void kq_event_inotify(fr_kqueue_t *kq, struct kevent *eventlist, int nevents, int *n)
+{
+	char		buffer[4096] CC_HINT(aligned(__alignof__(struct inotify_event)));
+	kq_note_t	*note = NULL;
+	struct kevent	kev;
+	ssize_t		len;
+
+	while ((len = read(kq->inotify->fd, buffer, sizeof(buffer))) > 0) {
+		char *p = buffer;
+
+		while (p < (buffer + len)) {
+			struct inotify_event const *iev = (struct inotify_event const *)p;
+
+			kq_inotify_map(kq, iev);
+			p += sizeof(*iev) + iev->len;
+		}
+	}
+
+	/*
+	 *	One event per vnode, with all the fflags
+	 *	from this batch.
+	 */
+	while ((note = fr_dlist_next(&kq->vnodes, note))) {
+		if (!note->vnode_fired) continue;
+
+		if (note->vnode.enabled) {
+			EV_SET(&kev, note->fd, EVFILT_VNODE, note->vnode.flags, note->vnode_fired, 0, note->vnode.udata);
+			kq_emit(kq, eventlist, nevents, n, &kev);
+		}
+		note->vnode_fired = 0;
+	}
+}
+
+/** Create a new kqueue
+ *
+ * @return
+ *	- A kqueue descriptor on success.
+ *	- -1 on failure with errno set.
+ */
+int fr_kqueue(void)
+{
+	fr_kqueue_t	*kq;
+	int		epfd;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) return -1;
+
+	kq = talloc_zero(NULL, fr_kqueue_t);
+	if (!kq) {
+		close(epfd);
+		errno = ENOMEM;
+		return -1;
+	}
+	kq->epfd = epfd;
+	pthread_mutex_init(&kq->mutex, NULL);
+	fr_dlist_init(&kq->notes, kq_note_t, entry);
+	fr_dlist_init(&kq->files, kq_note_t, entry);
+	fr_dlist_init(&kq->vnodes, kq_note_t, vnode_entry);
+
+	if (kq_table_set(epfd, kq) < 0) {
+		int err = errno;
+
+		pthread_mutex_destroy(&kq->mutex);
+		talloc_free(kq);
+		close(epfd);
+		errno = err;
+		return -1;
+	}
+
+	return epfd;
+}
+
+/** Close a kqueue, and free everything registered with it
+ *
+ * @param[in] kqfd	to close.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure with errno set.
+ */
+int fr_kqueue_close(int kqfd)
+{
+	fr_kqueue_t	*kq;
+	int		i;
+
+	kq = kq_find(kqfd);
+	if (!kq) return close(kqfd);
+
+	(void) kq_table_set(kqfd, NULL);
+
+	for (i = 0; i < kq->num_fds; i++) {
+		if (kq->fds[i] && (kq->fds[i]->type != KQ_NOTE_FD)) close(kq->fds[i]->fd);
+	}
+
+	pthread_mutex_destroy(&kq->mutex);
+	talloc_free(kq);
+
+	return close(kqfd);
+}
+
+/** Register changes with, and retrieve events from a kqueue
+ *
+ * Has the same semantics as kevent(2), for the filters we support.
+ *
+ * @param[in] kqfd		to operate on.
+ * @param[in] changelist	of filters to add, modify or delete.
+ * @param[in] nchanges		in the changelist.
+ * @param[out] eventlist	where to write events.
+ * @param[in] nevents		the maximum number of events to return.
+ * @param[in] timeout		to wait for, NULL for forever.
+ * @return
+ *	- The number of events placed in the eventlist.
+ *	- -1 on failure with errno set.
+ */
+int fr_kevent(int kqfd, struct kevent const *changelist, int nchanges,
+	      struct kevent *eventlist, int nevents, struct timespec const *timeout)
+{
+	fr_kqueue_t		*kq;
+	struct epoll_event	events[KQ_MAX_EPOLL_EVENTS];
+	int			i, n = 0, num, ms;
+
+	kq = kq_find(kqfd);
+	if (!kq) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if ((nchanges < 0) || (nevents < 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&kq->mutex);
+	for (i = 0; i < nchanges; i++) {
+		if (kq_change(kq, &changelist[i]) == 0) continue;
+
+		/*
+		 *	Errors go in the eventlist if there's
+		 *	room, otherwise we stop and return them.
+		 */
+		if (n >= nevents) {
+			pthread_mutex_unlock(&kq->mutex);
+			return -1;
+		}
+		eventlist[n] = changelist[i];
+		eventlist[n].flags = EV_ERROR;
+		eventlist[n].data = errno;
+		n++;
+	}
+
+	if ((n > 0) || (nevents == 0)) {
+		pthread_mutex_unlock(&kq->mutex);
+		return n;
+	}
+
+	n = kq_pending_drain(kq, eventlist, nevents);
+	kq_files_ready(kq, eventlist, nevents, &n);
+	pthread_mutex_unlock(&kq->mutex);
+
+	if (n > 0) {
+		ms = 0;
+	} else if (!timeout) {
+		ms = -1;
+	} else if (timeout->tv_sec >= (INT_MAX / 1000)) {
+		ms = INT_MAX;
+	} else {
+		/*
+		 *	Round up, so we don't wake up
+		 *	before the timer is due.
+		 */
+		ms = (timeout->tv_sec * 1000) + ((timeout->tv_nsec + 999999) / 1000000);
+	}
+
+	if (n >= nevents) return n;
+
+	num = nevents - n;
+	if (num > KQ_MAX_EPOLL_EVENTS) num = KQ_MAX_EPOLL_EVENTS;
+
+	num = epoll_wait(kq->epfd, events, num, ms);
+	if (num < 0) return (n > 0) ? n : -1;
+
+	pthread_mutex_lock(&kq->mutex);
+	for (i = 0; i < num; i++) {
+		kq_note_t *note;
+
+		/*
+		 *	Deleted while we were waiting.
+		 */
+		note = kq_note_by_fd(kq, events[i].data.fd);
+		if (!note) continue;
+
+		switch (note->type) {
+		case KQ_NOTE_FD:
+			kq_event_fd(kq, note, events[i].events, eventlist, nevents, &n);
+			break;
+
+		case KQ_NOTE_USER:
+			kq_event_user(kq, note, eventlist, nevents, &n);
+			break;
+
+		case KQ_NOTE_PROC:
+			kq_event_proc(kq, note, eventlist, nevents, &n);
+			break;
+
+		case KQ_NOTE_INOTIFY:
+			kq_event_inotify(kq, eventlist, nevents, &n);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&kq->mutex);
+
+	return n;
+}
+#endif
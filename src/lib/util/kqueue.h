@@ -0,0 +1,149 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** kqueue API, either the system one, or an emulation over epoll on Linux
+ *
+ * The event loop, channels and control planes are all written against the
+ * kqueue API.  On OSX and the BSDs that's provided by the kernel.  On Linux
+ * we provide the subset of the API we use natively over epoll, eventfd,
+ * pidfd and inotify, instead of pulling in libkqueue.
+ *
+ * @file src/lib/util/kqueue.h
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(kqueue_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/missing.h>
+
+#ifndef HAVE_KQUEUE_EPOLL
+#include <sys/event.h>
+#include <unistd.h>
+
+/** Close a kqueue
+ *
+ * @param[in] kq	to close.
+ * @return the result of close().
+ */
+static inline int fr_kqueue_close(int kq)
+{
+	return close(kq);
+}
+#else
+#include <stdint.h>
+#include <time.h>
+
+struct kevent {
+	uintptr_t	ident;		//!< Identifier for this event.
+	int16_t		filter;		//!< Filter for event.
+	uint16_t	flags;		//!< Action flags for kqueue.
+	uint32_t	fflags;		//!< Filter flag value.
+	intptr_t	data;		//!< Filter data value.
+	void		*udata;		//!< Opaque user data identifier.
+};
+
+#define EV_SET(_kevp, _ident, _filter, _flags, _fflags, _data, _udata) do { \
+	struct kevent *__kevp = (_kevp); \
+	__kevp->ident = (_ident); \
+	__kevp->filter = (_filter); \
+	__kevp->flags = (_flags); \
+	__kevp->fflags = (_fflags); \
+	__kevp->data = (_data); \
+	__kevp->udata = (_udata); \
+} while (0)
+
+/*
+ *	Filters.  Values match FreeBSD and libkqueue, only
+ *	READ, WRITE, VNODE, PROC and USER are implemented.
+ */
+#define EVFILT_READ		(-1)
+#define EVFILT_WRITE		(-2)
+#define EVFILT_VNODE		(-4)
+#define EVFILT_PROC		(-5)
+#define EVFILT_SIGNAL		(-6)
+#define EVFILT_TIMER		(-7)
+#define EVFILT_USER		(-11)
+
+/*
+ *	Actions
+ */
+#define EV_ADD			0x0001		//!< Add event to kq (implies enable).
+#define EV_DELETE		0x0002		//!< Delete event from kq.
+#define EV_ENABLE		0x0004		//!< Enable event.
+#define EV_DISABLE		0x0008		//!< Disable event (not reported).
+
+/*
+ *	Flags
+ */
+#define EV_ONESHOT		0x0010		//!< Only report one occurrence.
+#define EV_CLEAR		0x0020		//!< Clear event state after reporting.
+
+/*
+ *	Returned values
+ */
+#define EV_ERROR		0x4000		//!< Error, data contains errno.
+#define EV_EOF			0x8000		//!< EOF detected.
+
+/*
+ *	EVFILT_USER fflags
+ */
+#define NOTE_FFNOP		0x00000000	//!< Ignore input fflags.
+#define NOTE_FFAND		0x40000000	//!< AND fflags.
+#define NOTE_FFOR		0x80000000	//!< OR fflags.
+#define NOTE_FFCOPY		0xc0000000	//!< Copy fflags.
+#define NOTE_FFCTRLMASK		0xc0000000	//!< Mask for operations.
+#define NOTE_FFLAGSMASK		0x00ffffff
+#define NOTE_TRIGGER		0x01000000	//!< Cause the event to be triggered.
+
+/*
+ *	EVFILT_VNODE fflags
+ */
+#define NOTE_DELETE		0x0001		//!< Vnode was removed.
+#define NOTE_WRITE		0x0002		//!< Data contents changed.
+#define NOTE_EXTEND		0x0004		//!< Size increased.
+#define NOTE_ATTRIB		0x0008		//!< Attributes changed.
+#define NOTE_LINK		0x0010		//!< Link count changed.
+#define NOTE_RENAME		0x0020		//!< Vnode was renamed.
+#define NOTE_REVOKE		0x0040		//!< Filesystem containing the vnode was unmounted.
+
+/*
+ *	EVFILT_PROC fflags
+ */
+#define NOTE_EXIT		0x80000000	//!< Process exited, data contains the wait status.
+
+int	fr_kqueue(void);
+
+int	fr_kqueue_close(int kq);
+
+int	fr_kevent(int kq, struct kevent const *changelist, int nchanges,
+		  struct kevent *eventlist, int nevents, struct timespec const *timeout);
+
+/*
+ *	Function-like macros, so "struct kevent" is left alone.
+ */
+#define kqueue()		fr_kqueue()
+#define kevent(...)		fr_kevent(__VA_ARGS__)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
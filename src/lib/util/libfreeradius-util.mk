@@ -8,8 +8,10 @@ TARGET		:= libfreeradius-util.a
 SOURCES		:= \
 		   ascend.c \
 		   base64.c \
+		   btree.c \
 		   cursor.c \
 		   debug.c \
+		   dict_cache.c \
 		   dict_print.c \
 		   dict_tokenize.c \
 		   dict_unknown.c \
@@ -29,7 +31,10 @@ SOURCES		:= \
 		   hmac_sha1.c \
 		   inet.c \
 		   isaac.c \
+		   kqueue.c \
 		   log.c \
+		   log_async.c \
+		   lru.c \
 		   md4.c \
 		   md5.c \
 		   misc.c \
@@ -64,6 +69,7 @@ SOURCES		:= \
 		   token.c \
 		   trie.c \
 		   udp.c \
+		   udp_ring.c \
 		   udpfromto.c \
 		   value.c \
 		   version.c
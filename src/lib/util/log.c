@@ -24,6 +24,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/log.h>
+#include <freeradius-devel/util/log_async.h>
 #include <freeradius-devel/util/print.h>
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/syserror.h>
@@ -430,13 +431,21 @@ int fr_vlog(fr_log_t const *log, fr_log_type_t type, char const *file, int line,
 			syslog_priority = LOG_AUTH | LOG_INFO;
 			break;
 		}
-		syslog(syslog_priority,
-		       "%s"	/* time */
-		       "%s"	/* time sep */
-		       "%s",	/* message */
-		       fmt_time,
-		       fmt_time[0] ? ": " : "",
-		       fmt_msg);
+
+		/*
+		 *	Hand the message to the log thread if
+		 *	there is one.
+		 */
+		buffer = talloc_asprintf(pool,
+					 "%s"	/* time */
+					 "%s"	/* time sep */
+					 "%s",	/* message */
+					 fmt_time,
+					 fmt_time[0] ? ": " : "",
+					 fmt_msg);
+		if (fr_log_async_enqueue(-1, syslog_priority, buffer, talloc_array_length(buffer) - 1)) break;
+
+		syslog(syslog_priority, "%s", buffer);
 	}
 		break;
 #endif
@@ -467,6 +476,8 @@ int fr_vlog(fr_log_t const *log, fr_log_type_t type, char const *file, int line,
 				 	 colourise ? VTC_RESET : "");
 
 		len = talloc_array_length(buffer) - 1;
+		if (fr_log_async_enqueue(log->fd, 0, buffer, len)) break;
+
 		wrote = write(log->fd, buffer, len);
 		if (wrote < len) ret = -1;
 	}
@@ -0,0 +1,501 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Asynchronous log pipeline
+ *
+ * Each thread which logs gets its own single producer, single consumer
+ * ring of formatted log messages.  A dedicated log thread drains the
+ * rings, and batches the writes to each file descriptor with writev().
+ *
+ * Producers never block.  If a thread's ring is full, the message
+ * is dropped, and counted.  The log thread periodically reports how
+ * many messages were dropped.
+ *
+ * The only lock is taken when a thread logs its first message, or
+ * exits, to add or remove its ring from the list the log thread drains.
+ *
+ * @file src/lib/util/log_async.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/log_async.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/thread_local.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#ifdef HAVE_SYSLOG_H
+#  include <syslog.h>
+#endif
+
+#define LOG_ASYNC_ALIGN		16
+#define LOG_ASYNC_WRAP		(-2)		//!< fd of a record which marks the end of the ring.
+#define LOG_ASYNC_IOV_MAX	64		//!< Maximum number of messages to write with one call.
+#define LOG_ASYNC_MIN_RING	4096
+
+/** A message in a ring
+ *
+ * Followed by the text of the message, padded to #LOG_ASYNC_ALIGN.
+ */
+typedef struct {
+	uint32_t		len;		//!< Length of the message text.
+	int32_t			fd;		//!< To write the message to, -1 for syslog.
+	int32_t			priority;	//!< syslog priority.
+	uint32_t		pad;
+} log_async_rec_t;
+
+typedef struct log_async_ring_s log_async_ring_t;
+
+/** Per-thread ring of formatted messages
+ *
+ */
+struct log_async_ring_s {
+	alignas(128) _Atomic(uint64_t)	head;		//!< Written by the producer.
+	alignas(128) _Atomic(uint64_t)	tail;		//!< Written by the log thread.
+
+	uint64_t		size;		//!< A power of 2.
+	uint8_t			*data;
+
+	atomic_bool		linked;		//!< In the list drained by the log thread.
+	bool			exited;		//!< Producer thread has exited.
+
+	log_async_ring_t	*next;
+};
+
+static _Thread_local log_async_ring_t	*log_async_ring;
+static _Thread_local bool		log_async_is_log_thread;
+
+static pthread_mutex_t			log_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static log_async_ring_t			*log_async_rings;	//!< Protected by log_async_mutex.
+
+static atomic_bool			log_async_running;
+static atomic_bool			log_async_sleeping;
+static _Atomic(uint64_t)		log_async_dropped_count;
+
+static pthread_t			log_async_thread;
+static int				log_async_wake[2] = { -1, -1 };
+static fr_log_t const			*log_async_log;
+static uint64_t				log_async_ring_size;
+
+/** Free a ring when its producer thread exits
+ *
+ * If the log thread is still draining the ring, it's freed once empty.
+ */
+static void _log_async_ring_free(void *arg)
+{
+	log_async_ring_t *ring = arg;
+
+	pthread_mutex_lock(&log_async_mutex);
+	if (atomic_load(&ring->linked)) {
+		ring->exited = true;
+		ring = NULL;
+	}
+	pthread_mutex_unlock(&log_async_mutex);
+
+	talloc_free(ring);
+}
+
+/** Return the calling thread's ring, allocating it if needed
+ *
+ */
+static log_async_ring_t *log_async_ring_get(void)
+{
+	log_async_ring_t *ring = log_async_ring;
+
+	if (!ring) {
+		ring = talloc_zero(NULL, log_async_ring_t);
+		if (!ring) return NULL;
+
+		ring->size = log_async_ring_size;
+		ring->data = talloc_array(ring, uint8_t, ring->size);
+		if (!ring->data) {
+			talloc_free(ring);
+			return NULL;
+		}
+
+		fr_thread_local_set_destructor(log_async_ring, _log_async_ring_free, ring);
+	}
+
+	/*
+	 *	New ring, or the pipeline was restarted.
+	 */
+	if (!atomic_load_explicit(&ring->linked, memory_order_acquire)) {
+		pthread_mutex_lock(&log_async_mutex);
+		atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+		atomic_store_explicit(&ring->tail, 0, memory_order_relaxed);
+		atomic_store(&ring->linked, true);
+		ring->next = log_async_rings;
+		log_async_rings = ring;
+		pthread_mutex_unlock(&log_async_mutex);
+	}
+
+	return ring;
+}
+
+/** Queue a formatted message for the log thread
+ *
+ * @param[in] fd	to write the message to, or -1 to send it to syslog.
+ * @param[in] priority	syslog priority, if fd is -1.
+ * @param[in] msg	to write, including any trailing newline.
+ * @param[in] len	of msg.
+ * @return
+ *	- true if the message was queued, or dropped because the ring was full.
+ *	- false if the pipeline isn't running, and the caller should write the message itself.
+ */
+bool fr_log_async_enqueue(int fd, int priority, char const *msg, size_t len)
+{
+	log_async_ring_t	*ring;
+	log_async_rec_t		*rec;
+	uint64_t		head, tail, offset, need, contiguous;
+
+	if (!atomic_load_explicit(&log_async_running, memory_order_acquire) || log_async_is_log_thread) return false;
+
+	ring = log_async_ring_get();
+	if (!ring) return false;
+
+	need = sizeof(*rec) + ROUND_UP_POW2(len, LOG_ASYNC_ALIGN);
+	if (need > (ring->size / 2)) goto drop;		/* Would never fit alongside anything else */
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	offset = head & (ring->size - 1);
+	contiguous = ring->size - offset;
+
+	/*
+	 *	Messages are never split, so if this one doesn't fit
+	 *	before the end of the ring, we skip to the start.
+	 */
+	if ((ring->size - (head - tail)) < ((contiguous < need) ? contiguous + need : need)) goto drop;
+
+	if (contiguous < need) {
+		rec = (log_async_rec_t *)(ring->data + offset);
+		rec->fd = LOG_ASYNC_WRAP;
+		head += contiguous;
+		offset = 0;
+	}
+
+	rec = (log_async_rec_t *)(ring->data + offset);
+	rec->len = len;
+	rec->fd = fd;
+	rec->priority = priority;
+	memcpy(rec + 1, msg, len);
+
+	atomic_store_explicit(&ring->head, head + need, memory_order_release);
+
+	/*
+	 *	Only pay for a system call if the log thread is
+	 *	asleep.  The fence pairs with the one the log thread
+	 *	issues before it re-checks the rings, so either it
+	 *	sees our message, or we see that it's sleeping.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&log_async_sleeping, memory_order_relaxed) &&
+	    atomic_exchange_explicit(&log_async_sleeping, false, memory_order_relaxed)) {
+		uint8_t c = 0;
+
+		if (write(log_async_wake[1], &c, 1) < 0) { /* ignore */ }
+	}
+
+	return true;
+
+drop:
+	atomic_fetch_add_explicit(&log_async_dropped_count, 1, memory_order_relaxed);
+	return true;
+}
+
+/** Write out a batch of messages for the same file descriptor
+ *
+ */
+static void log_async_flush(int fd, struct iovec *iov, int *num)
+{
+	if (*num == 0) return;
+
+	if (writev(fd, iov, *num) < 0) { /* nowhere to report it */ }
+	*num = 0;
+}
+
+/** Write out everything in one ring
+ *
+ * @return the number of messages written.
+ */
+static unsigned int log_async_ring_drain(log_async_ring_t *ring)
+{
+	uint64_t		head, tail;
+	struct iovec		iov[LOG_ASYNC_IOV_MAX];
+	int			num = 0, batch_fd = -1;
+	unsigned int		count = 0;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	while (tail != head) {
+		uint64_t	offset = tail & (ring->size - 1);
+		log_async_rec_t	*rec = (log_async_rec_t *)(ring->data + offset);
+
+		if (rec->fd == LOG_ASYNC_WRAP) {
+			tail += ring->size - offset;
+			continue;
+		}
+
+		if (rec->fd < 0) {
+#ifdef HAVE_SYSLOG_H
+			syslog(rec->priority, "%.*s", (int) rec->len, (char const *)(rec + 1));
+#endif
+		} else {
+			/*
+			 *	The iovecs point into the ring, so they
+			 *	must be written before the tail is advanced.
+			 */
+			if ((num == LOG_ASYNC_IOV_MAX) || ((num > 0) && (rec->fd != batch_fd))) {
+				log_async_flush(batch_fd, iov, &num);
+			}
+
+			batch_fd = rec->fd;
+			iov[num].iov_base = rec + 1;
+			iov[num].iov_len = rec->len;
+			num++;
+		}
+
+		tail += sizeof(*rec) + ROUND_UP_POW2(rec->len, LOG_ASYNC_ALIGN);
+		count++;
+	}
+
+	log_async_flush(batch_fd, iov, &num);
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+	return count;
+}
+
+/** Drain all the rings, and free the ones whose threads have exited
+ *
+ */
+static unsigned int log_async_drain(void)
+{
+	log_async_ring_t	**last, *ring;
+	unsigned int		count = 0;
+
+	pthread_mutex_lock(&log_async_mutex);
+	last = &log_async_rings;
+	while ((ring = *last)) {
+		count += log_async_ring_drain(ring);
+
+		if (ring->exited) {
+			*last = ring->next;
+			talloc_free(ring);
+			continue;
+		}
+		last = &ring->next;
+	}
+	pthread_mutex_unlock(&log_async_mutex);
+
+	return count;
+}
+
+/** Tell the administrator about messages we've dropped
+ *
+ */
+static void log_async_report_dropped(uint64_t *reported)
+{
+	uint64_t	dropped = atomic_load_explicit(&log_async_dropped_count, memory_order_relaxed);
+	char		buffer[128];
+	int		len;
+
+	if (dropped == *reported) return;
+
+	len = snprintf(buffer, sizeof(buffer), "Dropped %" PRIu64 " log messages, as the log buffer was full",
+		       dropped - *reported);
+	*reported = dropped;
+
+	switch (log_async_log->dst) {
+#ifdef HAVE_SYSLOG_H
+	case L_DST_SYSLOG:
+		syslog(LOG_WARNING, "%s", buffer);
+		break;
+#endif
+
+	case L_DST_FILES:
+	case L_DST_STDOUT:
+	case L_DST_STDERR:
+		buffer[len++] = '\n';
+		if (write(log_async_log->fd, buffer, len) < 0) { /* nowhere to report it */ }
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void *log_async_thread_main(UNUSED void *arg)
+{
+	uint64_t	reported = 0;
+	time_t		last_report = 0;
+
+	log_async_is_log_thread = true;
+
+	while (atomic_load_explicit(&log_async_running, memory_order_acquire)) {
+		struct pollfd	pfd = { .fd = log_async_wake[0], .events = POLLIN };
+		time_t		now;
+		uint8_t		buffer[64];
+
+		if (log_async_drain() > 0) continue;
+
+		/*
+		 *	Report drops at most once a second.
+		 */
+		now = time(NULL);
+		if (now != last_report) {
+			log_async_report_dropped(&reported);
+			last_report = now;
+		}
+
+		/*
+		 *	Nothing to do.  Announce that we're going to
+		 *	sleep, then check again, so we don't miss a
+		 *	message queued just before we set the flag.
+		 */
+		atomic_store_explicit(&log_async_sleeping, true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if (log_async_drain() > 0) {
+			atomic_store_explicit(&log_async_sleeping, false, memory_order_relaxed);
+			continue;
+		}
+
+		(void) poll(&pfd, 1, 1000);
+		atomic_store_explicit(&log_async_sleeping, false, memory_order_relaxed);
+
+		while (read(log_async_wake[0], buffer, sizeof(buffer)) > 0);
+	}
+
+	/*
+	 *	Write out anything queued before we were stopped.
+	 */
+	log_async_drain();
+	log_async_report_dropped(&reported);
+
+	return NULL;
+}
+
+/** Start the log thread
+ *
+ * Once started, messages fr_vlog() would write to a file descriptor, or syslog,
+ * are queued for the log thread instead.
+ *
+ * @note The log thread doesn't survive fork(), so this must be called after
+ *	the server daemonizes.
+ *
+ * @param[in] log	destination for reports of dropped messages.
+ * @param[in] ring_size	Size of each thread's ring.  Rounded up to a power of 2.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_log_async_start(fr_log_t const *log, size_t ring_size)
+{
+	int	ret;
+
+	if (atomic_load(&log_async_running)) return 0;
+
+	if (ring_size < LOG_ASYNC_MIN_RING) ring_size = LOG_ASYNC_MIN_RING;
+	log_async_ring_size = 1;
+	while (log_async_ring_size < ring_size) log_async_ring_size <<= 1;
+
+	log_async_log = log;
+
+	if (pipe(log_async_wake) < 0) {
+		fr_strerror_printf("Failed creating log wakeup pipe: %s", fr_syserror(errno));
+		return -1;
+	}
+	(void) fcntl(log_async_wake[0], F_SETFL, O_NONBLOCK);
+	(void) fcntl(log_async_wake[1], F_SETFL, O_NONBLOCK);
+
+	atomic_store(&log_async_dropped_count, 0);
+	atomic_store(&log_async_running, true);
+
+	ret = pthread_create(&log_async_thread, NULL, log_async_thread_main, NULL);
+	if (ret != 0) {
+		atomic_store(&log_async_running, false);
+		close(log_async_wake[0]);
+		close(log_async_wake[1]);
+		log_async_wake[0] = log_async_wake[1] = -1;
+
+		fr_strerror_printf("Failed creating log thread: %s", fr_syserror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Stop the log thread, after it's written out all queued messages
+ *
+ * Messages are written synchronously again after this returns.
+ */
+void fr_log_async_stop(void)
+{
+	log_async_ring_t	*ring, *next;
+	uint8_t			c = 0;
+
+	if (!atomic_load(&log_async_running)) return;
+
+	atomic_store(&log_async_running, false);
+	if (write(log_async_wake[1], &c, 1) < 0) { /* thread polls anyway */ }
+
+	pthread_join(log_async_thread, NULL);
+
+	close(log_async_wake[0]);
+	close(log_async_wake[1]);
+	log_async_wake[0] = log_async_wake[1] = -1;
+
+	/*
+	 *	Rings of threads which are still running are
+	 *	freed when those threads exit.
+	 */
+	pthread_mutex_lock(&log_async_mutex);
+	for (ring = log_async_rings; ring; ring = next) {
+		next = ring->next;
+
+		atomic_store(&ring->linked, false);
+		ring->next = NULL;
+		if (ring->exited) talloc_free(ring);
+	}
+	log_async_rings = NULL;
+	pthread_mutex_unlock(&log_async_mutex);
+}
+
+/** Return how many messages have been dropped because a ring was full
+ *
+ */
+uint64_t fr_log_async_dropped(void)
+{
+	return atomic_load_explicit(&log_async_dropped_count, memory_order_relaxed);
+}
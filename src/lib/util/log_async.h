@@ -0,0 +1,45 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Asynchronous log pipeline
+ *
+ * @file src/lib/util/log_async.h
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(log_async_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/util/log.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+int		fr_log_async_start(fr_log_t const *log, size_t ring_size);
+
+void		fr_log_async_stop(void);
+
+bool		fr_log_async_enqueue(int fd, int priority, char const *msg, size_t len);
+
+uint64_t	fr_log_async_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,153 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Non-thread-safe least recently used cache of per-key state
+ *
+ * @file src/lib/util/lru.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <string.h>
+
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/lru.h>
+#include <freeradius-devel/util/rbtree.h>
+#include <freeradius-devel/util/talloc.h>
+
+struct fr_lru_s {
+	rbtree_t			*tree;		//!< Entries, keyed by key.
+	fr_dlist_head_t			list;		//!< Entries, most recently used at the head.
+	uint32_t			max_entries;	//!< Evict the least recently used entry beyond this.
+};
+
+/** An entry in a #fr_lru_t
+ *
+ */
+typedef struct {
+	char const			*key;		//!< Identifies the entry.
+	void				*data;		//!< Caller's state for the key.
+	fr_dlist_t			entry;		//!< Entry in the LRU list.
+} fr_lru_entry_t;
+
+static int _lru_cmp(void const *one, void const *two)
+{
+	fr_lru_entry_t const	*a = one, *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+/** Allocate a cache of per-key state
+ *
+ * Used by modules to remember what a remote server told them about
+ * a key, so they don't need to ask again.
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_entries	Maximum number of keys to remember.  0 disables
+ *				the cache.
+ * @return
+ *	- A new #fr_lru_t.
+ *	- NULL on failure.
+ */
+fr_lru_t *fr_lru_alloc(TALLOC_CTX *ctx, uint32_t max_entries)
+{
+	fr_lru_t *lru;
+
+	lru = talloc_zero(ctx, fr_lru_t);
+	if (!lru) return NULL;
+
+	lru->tree = rbtree_talloc_create(lru, _lru_cmp, fr_lru_entry_t, NULL, 0);
+	if (!lru->tree) {
+		talloc_free(lru);
+		return NULL;
+	}
+	fr_dlist_talloc_init(&lru->list, fr_lru_entry_t, entry);
+	lru->max_entries = max_entries;
+
+	return lru;
+}
+
+/** Find the state for a key, marking it as most recently used
+ *
+ * @param[in] lru	to search.
+ * @param[in] key	to search for.
+ * @return
+ *	- The state for the key.
+ *	- NULL if we don't have any.
+ */
+void *fr_lru_find(fr_lru_t *lru, char const *key)
+{
+	fr_lru_entry_t	find, *found;
+
+	find.key = key;
+	found = rbtree_finddata(lru->tree, &find);
+	if (!found) return NULL;
+
+	fr_dlist_remove(&lru->list, found);
+	fr_dlist_insert_head(&lru->list, found);
+
+	return found->data;
+}
+
+/** Find or create the state for a key, marking it as most recently used
+ *
+ * If the cache is full, the least recently used entry is freed.
+ *
+ * @param[in] lru	to insert into.
+ * @param[in] key	identifying the state.  Copied if a new entry is created.
+ * @param[in] size	of the state.
+ * @param[in] type	talloc type of the state.
+ * @return
+ *	- The existing state for the key.
+ *	- New zeroed state.
+ *	- NULL if the cache is disabled, or on failure.
+ */
+void *_fr_lru_insert(fr_lru_t *lru, char const *key, size_t size, char const *type)
+{
+	fr_lru_entry_t	*found;
+	void		*data;
+
+	if (!lru->max_entries) return NULL;
+
+	data = fr_lru_find(lru, key);
+	if (data) return data;
+
+	while (fr_dlist_num_elements(&lru->list) >= lru->max_entries) {
+		fr_lru_entry_t *evict = fr_dlist_tail(&lru->list);
+
+		fr_dlist_remove(&lru->list, evict);
+		rbtree_deletebydata(lru->tree, evict);
+		talloc_free(evict);
+	}
+
+	found = talloc_zero(lru->tree, fr_lru_entry_t);
+	if (!found) return NULL;
+
+	found->key = talloc_typed_strdup(found, key);
+	found->data = talloc_zero_size(found, size);
+	if (!found->key || !found->data) {
+	error:
+		talloc_free(found);
+		return NULL;
+	}
+	talloc_set_name_const(found->data, type);
+
+	if (!rbtree_insert(lru->tree, found)) goto error;
+	fr_dlist_insert_head(&lru->list, found);
+
+	return found->data;
+}
@@ -0,0 +1,55 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Non-thread-safe least recently used cache of per-key state
+ *
+ * @file src/lib/util/lru.h
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(lru_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/missing.h>
+
+#include <stdint.h>
+#include <talloc.h>
+
+typedef struct fr_lru_s fr_lru_t;
+
+fr_lru_t	*fr_lru_alloc(TALLOC_CTX *ctx, uint32_t max_entries);
+
+void		*fr_lru_find(fr_lru_t *lru, char const *key);
+
+/** Find or create the entry for a key
+ *
+ * @param[in] _lru	to insert into.
+ * @param[in] _key	identifying the entry.
+ * @param[in] _type	of the entry's data.
+ */
+#define fr_lru_insert(_lru, _key, _type) \
+	((_type *)_fr_lru_insert(_lru, _key, sizeof(_type), #_type))
+
+void		*_fr_lru_insert(fr_lru_t *lru, char const *key, size_t size, char const *type);
+
+#ifdef __cplusplus
+}
+#endif
@@ -238,6 +238,82 @@ static const uint8_t PADDING[MD5_BLOCK_LENGTH] = {
 /* This is the central step in the MD5 algorithm. */
 #define MD5STEP(f, w, x, y, z, data, s) (w += f(x, y, z) + data, w = w << s | w >> (32 - s),  w += x)
 
+/** All 64 steps of the MD5 transform
+ *
+ * Works with anything that has the usual arithmetic operators.  So the
+ * same steps are used for one block at a time, and for several
+ * buffers at once, stored in vectors.
+ */
+#define MD5_TRANSFORM(a, b, c, d, in) do { \
+	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12); \
+	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17); \
+	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22); \
+	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12); \
+	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17); \
+	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22); \
+	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7); \
+	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12); \
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17); \
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22); \
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7); \
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12); \
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17); \
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22); \
+	\
+	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5); \
+	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9); \
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20); \
+	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5); \
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9); \
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20); \
+	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5); \
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9); \
+	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14); \
+	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20); \
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5); \
+	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9); \
+	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14); \
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20); \
+	\
+	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11); \
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16); \
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23); \
+	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11); \
+	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16); \
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23); \
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4); \
+	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11); \
+	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16); \
+	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23); \
+	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4); \
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11); \
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16); \
+	MD5STEP(F3, b, c, d, a, in[2 ] + 0xc4ac5665, 23); \
+	\
+	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6); \
+	MD5STEP(F4, d, a, b, c, in[7 ] + 0x432aff97, 10); \
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15); \
+	MD5STEP(F4, b, c, d, a, in[5 ] + 0xfc93a039, 21); \
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6); \
+	MD5STEP(F4, d, a, b, c, in[3 ] + 0x8f0ccc92, 10); \
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15); \
+	MD5STEP(F4, b, c, d, a, in[1 ] + 0x85845dd1, 21); \
+	MD5STEP(F4, a, b, c, d, in[8 ] + 0x6fa87e4f,  6); \
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10); \
+	MD5STEP(F4, c, d, a, b, in[6 ] + 0xa3014314, 15); \
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21); \
+	MD5STEP(F4, a, b, c, d, in[4 ] + 0xf7537e82,  6); \
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10); \
+	MD5STEP(F4, c, d, a, b, in[2 ] + 0x2ad7d2bb, 15); \
+	MD5STEP(F4, b, c, d, a, in[9 ] + 0xeb86d391, 21); \
+} while (0)
+
 /** The core of the MD5 algorithm
  *
  * This alters an existing MD5 hash to reflect the addition of 16
@@ -264,73 +340,7 @@ static void fr_md5_local_transform(uint32_t state[static 4], uint8_t const block
 	c = state[2];
 	d = state[3];
 
-	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7);
-	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12);
-	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17);
-	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22);
-	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7);
-	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12);
-	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17);
-	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22);
-	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7);
-	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12);
-	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
-	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
-	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7);
-	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
-	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
-	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
-
-	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5);
-	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9);
-	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
-	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20);
-	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5);
-	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9);
-	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
-	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20);
-	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5);
-	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9);
-	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14);
-	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20);
-	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5);
-	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9);
-	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14);
-	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
-
-	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4);
-	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11);
-	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
-	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
-	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4);
-	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11);
-	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16);
-	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
-	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4);
-	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11);
-	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16);
-	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23);
-	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4);
-	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
-	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
-	MD5STEP(F3, b, c, d, a, in[2 ] + 0xc4ac5665, 23);
-
-	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6);
-	MD5STEP(F4, d, a, b, c, in[7 ] + 0x432aff97, 10);
-	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
-	MD5STEP(F4, b, c, d, a, in[5 ] + 0xfc93a039, 21);
-	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6);
-	MD5STEP(F4, d, a, b, c, in[3 ] + 0x8f0ccc92, 10);
-	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
-	MD5STEP(F4, b, c, d, a, in[1 ] + 0x85845dd1, 21);
-	MD5STEP(F4, a, b, c, d, in[8 ] + 0x6fa87e4f,  6);
-	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
-	MD5STEP(F4, c, d, a, b, in[6 ] + 0xa3014314, 15);
-	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
-	MD5STEP(F4, a, b, c, d, in[4 ] + 0xf7537e82,  6);
-	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
-	MD5STEP(F4, c, d, a, b, in[2 ] + 0x2ad7d2bb, 15);
-	MD5STEP(F4, b, c, d, a, in[9 ] + 0xeb86d391, 21);
+	MD5_TRANSFORM(a, b, c, d, in);
 
 	state[0] += a;
 	state[1] += b;
@@ -540,3 +550,199 @@ void fr_md5_calc(uint8_t out[static MD5_DIGEST_LENGTH], uint8_t const *in, size_
 	fr_md5_final(out, ctx);
 	fr_md5_ctx_free(&ctx);
 }
+
+/*
+ *	Multi-buffer MD5.
+ *
+ *	Each 32 bit word of the state is kept in a vector, with one
+ *	lane per buffer.  The MD5 steps are then run on all lanes at
+ *	once.  The compiler turns the vector operations into AVX2 on
+ *	x86_64 (when the CPU has it), or into pairs of SSE2 / NEON
+ *	instructions everywhere else.
+ */
+typedef uint32_t md5_vec_t __attribute__ ((vector_size (FR_MD5_MULTI_LANES * sizeof(uint32_t))));
+
+/** Run the MD5 steps over one block from each lane
+ *
+ * @param[in,out] state	of each lane.
+ * @param[in] in	the 16 words of the block for each lane.
+ */
+static inline CC_HINT(always_inline) void md5_multi_transform_body(md5_vec_t state[static 4], md5_vec_t const in[static 16])
+{
+	md5_vec_t a, b, c, d;
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+
+	MD5_TRANSFORM(a, b, c, d, in);
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+typedef void (*md5_multi_transform_t)(md5_vec_t state[static 4], md5_vec_t const in[static 16]);
+
+static void md5_multi_transform_generic(md5_vec_t state[static 4], md5_vec_t const in[static 16])
+{
+	md5_multi_transform_body(state, in);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#  define MD5_MULTI_AVX2
+static CC_HINT(target("avx2")) void md5_multi_transform_avx2(md5_vec_t state[static 4], md5_vec_t const in[static 16])
+{
+	md5_multi_transform_body(state, in);
+}
+#endif
+
+static md5_multi_transform_t md5_multi_transform;
+
+/** Get the next block of a buffer, with padding and length added at the end
+ *
+ * @param[out] block	Where to build the block, if it can't be used in place.
+ * @param[in] md5	The buffer being hashed.
+ * @param[in] total	length of md5->in[0] and md5->in[1].
+ * @param[in] offset	of the block in the data.
+ * @return the 64 bytes of the block.
+ */
+static uint8_t const *md5_multi_block(uint8_t block[static MD5_BLOCK_LENGTH], fr_md5_multi_t const *md5,
+				      size_t total, size_t offset)
+{
+	size_t		used = 0, len, skip;
+	int		i;
+	uint64_t	bits;
+
+	/*
+	 *	Most blocks come from the middle of one of the
+	 *	buffers, and can be used where they are.
+	 */
+	if ((offset + MD5_BLOCK_LENGTH) <= md5->inlen[0]) return md5->in[0] + offset;
+
+	if ((offset >= md5->inlen[0]) && ((offset + MD5_BLOCK_LENGTH) <= total)) {
+		return md5->in[1] + (offset - md5->inlen[0]);
+	}
+
+	/*
+	 *	Otherwise copy whatever data is left, and pad it.
+	 */
+	memset(block, 0, MD5_BLOCK_LENGTH);
+
+	skip = offset;
+	for (i = 0; (i < 2) && (used < MD5_BLOCK_LENGTH); i++) {
+		if (skip >= md5->inlen[i]) {
+			skip -= md5->inlen[i];
+			continue;
+		}
+
+		len = md5->inlen[i] - skip;
+		if (len > (MD5_BLOCK_LENGTH - used)) len = MD5_BLOCK_LENGTH - used;
+
+		memcpy(block + used, md5->in[i] + skip, len);
+		used += len;
+		skip = 0;
+	}
+
+	if ((total >= offset) && ((total - offset) < MD5_BLOCK_LENGTH)) block[total - offset] = 0x80;
+
+	/*
+	 *	The last block ends with the length in bits.
+	 */
+	if ((offset + MD5_BLOCK_LENGTH) >= (total + 1 + 8)) {
+		bits = (uint64_t) total << 3;
+		for (i = 0; i < 8; i++) block[56 + i] = bits >> (i * 8);
+	}
+
+	return block;
+}
+
+/** Calculate the MD5 hashes of several buffers at once
+ *
+ * This gives the same digests as calling fr_md5_calc() for each buffer.
+ * The buffers are hashed FR_MD5_MULTI_LANES at a time, which is
+ * much faster than hashing them one by one when there are several
+ * of them.  The digest for each buffer is over md5->in[0] followed
+ * by md5->in[1], so "data + secret" style digests don't need a copy.
+ *
+ * Buffers of different lengths can be mixed; lanes which run out of
+ * blocks just stop changing.
+ *
+ * @param[in] md5	The buffers to hash, and where to write each digest.
+ * @param[in] num	The number of buffers.
+ */
+void fr_md5_calc_multi(fr_md5_multi_t const *md5, int num)
+{
+	int		i, j, k, lanes;
+	size_t		total[FR_MD5_MULTI_LANES];
+	size_t		blocks, num_blocks[FR_MD5_MULTI_LANES], b;
+	md5_vec_t	state[4], old[4], in[MD5_BLOCK_LENGTH / 4], more;
+	uint8_t		buffer[MD5_BLOCK_LENGTH];
+	uint8_t const	*block;
+
+	if (unlikely(!md5_multi_transform)) {
+		md5_multi_transform = md5_multi_transform_generic;
+#ifdef MD5_MULTI_AVX2
+		if (__builtin_cpu_supports("avx2")) md5_multi_transform = md5_multi_transform_avx2;
+#endif
+	}
+
+	for (i = 0; i < num; i += lanes) {
+		lanes = num - i;
+		if (lanes > FR_MD5_MULTI_LANES) lanes = FR_MD5_MULTI_LANES;
+
+		/*
+		 *	The data, then 0x80, then the 8 byte length.
+		 */
+		blocks = 0;
+		for (j = 0; j < FR_MD5_MULTI_LANES; j++) {
+			if (j >= lanes) {
+				num_blocks[j] = 0;
+				continue;
+			}
+
+			total[j] = md5[i + j].inlen[0] + md5[i + j].inlen[1];
+			num_blocks[j] = (total[j] + 1 + 8 + MD5_BLOCK_LENGTH - 1) / MD5_BLOCK_LENGTH;
+			if (num_blocks[j] > blocks) blocks = num_blocks[j];
+		}
+
+		for (k = 0; k < 4; k++) state[k] = (md5_vec_t) { 0 };
+		state[0] += 0x67452301;
+		state[1] += 0xefcdab89;
+		state[2] += 0x98badcfe;
+		state[3] += 0x10325476;
+
+		for (b = 0; b < blocks; b++) {
+			memset(in, 0, sizeof(in));
+
+			for (j = 0; j < lanes; j++) {
+				if (b >= num_blocks[j]) continue;
+
+				block = md5_multi_block(buffer, &md5[i + j], total[j], b * MD5_BLOCK_LENGTH);
+				for (k = 0; k < MD5_BLOCK_LENGTH / 4; k++) {
+					in[k][j] = (uint32_t)(
+					    (uint32_t)(block[k * 4 + 0]) |
+					    (uint32_t)(block[k * 4 + 1]) <<  8 |
+					    (uint32_t)(block[k * 4 + 2]) << 16 |
+					    (uint32_t)(block[k * 4 + 3]) << 24);
+				}
+			}
+
+			memcpy(old, state, sizeof(old));
+			md5_multi_transform(state, in);
+
+			/*
+			 *	Lanes which have already finished keep
+			 *	their old state.
+			 */
+			for (j = 0; j < FR_MD5_MULTI_LANES; j++) more[j] = (b < num_blocks[j]) ? UINT32_MAX : 0;
+			for (k = 0; k < 4; k++) state[k] = (state[k] & more) | (old[k] & ~more);
+		}
+
+		for (j = 0; j < lanes; j++) {
+			for (k = 0; k < 4; k++) PUT_32BIT_LE(md5[i + j].out + k * 4, state[k][j]);
+		}
+	}
+}
@@ -84,9 +84,39 @@ extern		fr_md5_final_t		fr_md5_final;
  */
 void		fr_md5_calc(uint8_t out[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen);
 
+/** How many buffers fr_md5_calc_multi() hashes at the same time
+ *
+ */
+#define FR_MD5_MULTI_LANES	(8)
+
+/** One buffer for fr_md5_calc_multi()
+ *
+ * The digest is calculated over in[0] followed by in[1].  Either may be empty.
+ */
+typedef struct {
+	uint8_t			*out;		//!< Where to write the MD5 digest.
+	uint8_t const		*in[2];		//!< Data to hash.
+	size_t			inlen[2];	//!< Length of each piece of data.
+} fr_md5_multi_t;
+
+void		fr_md5_calc_multi(fr_md5_multi_t const *md5, int num);
+
 /* hmac.c */
 void		fr_hmac_md5(uint8_t digest[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
 			    uint8_t const *key, size_t key_len);
+
+/** One buffer for fr_hmac_md5_multi()
+ *
+ */
+typedef struct {
+	uint8_t			*out;		//!< Where to write the HMAC-MD5 digest.
+	uint8_t const		*in;		//!< Data to sign.
+	size_t			inlen;		//!< Length of the data.
+	uint8_t const		*key;		//!< Authentication key.
+	size_t			key_len;	//!< Length of the key.
+} fr_hmac_md5_multi_t;
+
+void		fr_hmac_md5_multi(fr_hmac_md5_multi_t const *hmac, int num);
 #ifdef __cplusplus
 }
 #endif
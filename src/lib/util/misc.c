@@ -41,6 +41,10 @@ RCSID("$Id$")
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 #define FR_PUT_LE16(a, val)\
 	do {\
 		a[1] = ((uint16_t) (val)) >> 8;\
@@ -160,6 +164,83 @@ int rad_unlockfd(int fd, int lock_len)
 
 static char const hextab[] = "0123456789abcdef";
 
+/** Value of each hex char plus one, so that 0 means invalid
+ *
+ */
+static uint8_t const hexval[UINT8_MAX + 1] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+#ifdef __SSE2__
+/** Convert 32 hex chars to 16 bytes
+ *
+ * @return
+ *	- true if all the chars were valid.
+ *	- false if any weren't, in which case nothing is written.
+ */
+static inline bool hex2bin_sse2(uint8_t *bin, char const *hex)
+{
+	__m128i	a = _mm_loadu_si128((__m128i const *)hex);
+	__m128i	b = _mm_loadu_si128((__m128i const *)(hex + 16));
+	__m128i	out[2];
+	int	i;
+
+	for (i = 0; i < 2; i++) {
+		__m128i in = (i == 0) ? a : b;
+		__m128i lower = _mm_or_si128(in, _mm_set1_epi8(0x20));	/* 'A' -> 'a', digits are unchanged */
+		__m128i digit, alpha, val;
+
+		/*
+		 *	The comparisons are signed, so chars >= 0x80
+		 *	are never valid.
+		 */
+		digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+				      _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+		alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+				      _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+		if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff) return false;
+
+		val = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(in, _mm_set1_epi8('0'))),
+				   _mm_andnot_si128(digit, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+
+		/*
+		 *	Each 16bit lane is (low nibble << 8) | high nibble.
+		 */
+		out[i] = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(val, 4), _mm_set1_epi16(0x00f0)),
+				      _mm_srli_epi16(val, 8));
+	}
+
+	_mm_storeu_si128((__m128i *)bin, _mm_packus_epi16(out[0], out[1]));
+
+	return true;
+}
+
+/** Convert 16 bytes to 32 hex chars
+ *
+ */
+static inline void bin2hex_sse2(char *hex, uint8_t const *bin)
+{
+	__m128i	in = _mm_loadu_si128((__m128i const *)bin);
+	__m128i	mask = _mm_set1_epi8(0x0f);
+	__m128i	hi = _mm_and_si128(_mm_srli_epi16(in, 4), mask);
+	__m128i	lo = _mm_and_si128(in, mask);
+
+	/*
+	 *	'0' + n, plus the gap between '9' and 'a' if n > 9.
+	 */
+	hi = _mm_add_epi8(_mm_add_epi8(hi, _mm_set1_epi8('0')),
+			  _mm_and_si128(_mm_cmpgt_epi8(hi, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10)));
+	lo = _mm_add_epi8(_mm_add_epi8(lo, _mm_set1_epi8('0')),
+			  _mm_and_si128(_mm_cmpgt_epi8(lo, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10)));
+
+	_mm_storeu_si128((__m128i *)hex, _mm_unpacklo_epi8(hi, lo));
+	_mm_storeu_si128((__m128i *)(hex + 16), _mm_unpackhi_epi8(hi, lo));
+}
+#endif
+
 /** Convert hex strings to binary data
  *
  * @param bin Buffer to write output to.
@@ -170,9 +251,9 @@ static char const hextab[] = "0123456789abcdef";
  */
 size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
 {
-	size_t i;
+	size_t i = 0;
 	size_t len;
-	char *c1, *c2;
+	uint8_t c1, c2;
 
 	/*
 	 *	Smartly truncate output, caller should check number of bytes
@@ -181,11 +262,16 @@ size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
 	len = inlen >> 1;
 	if (len > outlen) len = outlen;
 
-	for (i = 0; i < len; i++) {
-		if(!(c1 = memchr(hextab, tolower((int) hex[i << 1]), sizeof(hextab))) ||
-		   !(c2 = memchr(hextab, tolower((int) hex[(i << 1) + 1]), sizeof(hextab))))
-			break;
-		bin[i] = ((c1-hextab)<<4) + (c2-hextab);
+#ifdef __SSE2__
+	while (((len - i) >= 16) && hex2bin_sse2(bin + i, hex + (i << 1))) i += 16;
+#endif
+
+	for (; i < len; i++) {
+		c1 = hexval[(uint8_t) hex[i << 1]];
+		c2 = hexval[(uint8_t) hex[(i << 1) + 1]];
+		if (!c1 || !c2) break;
+
+		bin[i] = ((c1 - 1) << 4) | (c2 - 1);
 	}
 
 	return i;
@@ -204,9 +290,17 @@ size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
  */
 size_t fr_bin2hex(char *hex, uint8_t const *bin, size_t inlen)
 {
-	size_t i;
+	size_t i = 0;
 
-	for (i = 0; i < inlen; i++) {
+#ifdef __SSE2__
+	for (; (inlen - i) >= 16; i += 16) {
+		bin2hex_sse2(hex, bin);
+		hex += 32;
+		bin += 16;
+	}
+#endif
+
+	for (; i < inlen; i++) {
 		hex[0] = hextab[((*bin) >> 4) & 0x0f];
 		hex[1] = hextab[*bin & 0x0f];
 		hex += 2;
@@ -37,6 +37,17 @@ RCSID("$Id$")
 #  define FREE_MAGIC (0xF4EEF4EE)
 #endif
 
+/*
+ *	The destructor only helps with debugging.  In production
+ *	builds, not having one lets talloc free pairs without calling
+ *	back into us, which matters when a request with many pairs is
+ *	freed.
+ */
+#if !defined(NDEBUG) || defined(TALLOC_DEBUG)
+#  define PAIR_DESTRUCTOR
+#endif
+
+#ifdef PAIR_DESTRUCTOR
 /** Free a VALUE_PAIR
  *
  * @note Do not call directly, use talloc_free instead.
@@ -55,19 +66,20 @@ static int _fr_pair_free(NDEBUG_UNUSED VALUE_PAIR *vp)
 #endif
 	return 0;
 }
+#endif
 
-/** Dynamically allocate a new attribute
+/** Allocate a pair, optionally with room for a short value
  *
- * @param[in] ctx	Talloc ctx to allocate the pair in.
- * @return
- *	- A new #VALUE_PAIR.
- *	- NULL if an error occurred.
  */
-VALUE_PAIR *fr_pair_alloc(TALLOC_CTX *ctx)
+static inline VALUE_PAIR *pair_alloc(TALLOC_CTX *ctx, bool pooled)
 {
 	VALUE_PAIR *vp;
 
-	vp = talloc_zero(ctx, VALUE_PAIR);
+	if (pooled) {
+		vp = talloc_zero_pooled_object(ctx, VALUE_PAIR, 1, FR_VALUE_BOX_INLINE_SIZE + 1);
+	} else {
+		vp = talloc_zero(ctx, VALUE_PAIR);
+	}
 	if (!vp) {
 		fr_strerror_printf("Out of memory");
 		return NULL;
@@ -77,11 +89,25 @@ VALUE_PAIR *fr_pair_alloc(TALLOC_CTX *ctx)
 	vp->tag = TAG_ANY;
 	vp->type = VT_NONE;
 
+#ifdef PAIR_DESTRUCTOR
 	talloc_set_destructor(vp, _fr_pair_free);
+#endif
 
 	return vp;
 }
 
+/** Dynamically allocate a new attribute
+ *
+ * @param[in] ctx	Talloc ctx to allocate the pair in.
+ * @return
+ *	- A new #VALUE_PAIR.
+ *	- NULL if an error occurred.
+ */
+VALUE_PAIR *fr_pair_alloc(TALLOC_CTX *ctx)
+{
+	return pair_alloc(ctx, false);
+}
+
 /** Dynamically allocate a new attribute and fill in the da field
  *
  * Allocates a new attribute and a new dictionary attr if no DA is provided.
@@ -106,7 +132,12 @@ VALUE_PAIR *fr_pair_afrom_da(TALLOC_CTX *ctx, fr_dict_attr_t const *da)
 		return NULL;
 	}
 
-	vp = fr_pair_alloc(ctx);
+	/*
+	 *	String and octets values are allocated in the
+	 *	context of the pair, so short ones can come from
+	 *	the same chunk.
+	 */
+	vp = pair_alloc(ctx, (da->type == FR_TYPE_STRING) || (da->type == FR_TYPE_OCTETS));
 	if (!vp) {
 		fr_strerror_printf("Out of memory");
 		return NULL;
@@ -120,6 +151,10 @@ VALUE_PAIR *fr_pair_afrom_da(TALLOC_CTX *ctx, fr_dict_attr_t const *da)
 		fr_dict_attr_t const *unknown;
 
 		unknown = fr_dict_unknown_acopy(vp, da);
+		if (!unknown) {
+			talloc_free(vp);
+			return NULL;
+		}
 		da = unknown;
 	}
 
@@ -203,19 +238,7 @@ VALUE_PAIR *fr_pair_copy(TALLOC_CTX *ctx, VALUE_PAIR const *vp)
 	n->op = vp->op;
 	n->tag = vp->tag;
 	n->next = NULL;
-	n->type = vp->type;
-
-	/*
-	 *	Copy the unknown attribute hierarchy
-	 */
-	if (n->da->flags.is_unknown) {
-		n->da = fr_dict_unknown_acopy(n, n->da);
-		if (!n->da) {
-			talloc_free(n);
-			return NULL;
-		}
-	}
-
+	n->type = vp->type;	/* fr_pair_afrom_da() copied any unknown da */
 
 	/*
 	 *	If it's an xlat, copy the raw string and return
@@ -379,6 +402,9 @@ void *fr_pair_iter_next_by_ancestor(void **prev, void *to_eval, void *uctx)
 
 /** Find the pair with the matching DAs
  *
+ * This is a linear search.  There's no index by attribute, as callers
+ * throughout the server edit vp->next directly, and an index couldn't
+ * be kept in step with the list.
  */
 VALUE_PAIR *fr_pair_find_by_da(VALUE_PAIR *head, fr_dict_attr_t const *da, int8_t tag)
 {
@@ -413,6 +439,13 @@ VALUE_PAIR *fr_pair_find_by_num(VALUE_PAIR *head, unsigned int vendor, unsigned
 	LIST_VERIFY(head);
 
 	for (vp = head; vp != NULL; vp = vp->next) {
+		/*
+		 *	Check the cheap things first.  Finding the
+		 *	vendor means walking up the dictionary tree,
+		 *	so only do it for pairs which could match.
+		 */
+		if ((attr != vp->da->attr) || !TAG_EQ(tag, vp->tag)) continue;
+
 		if (!fr_dict_attr_is_top_level(vp->da)) continue;
 
 	     	if (vendor > 0) {
@@ -424,7 +457,7 @@ VALUE_PAIR *fr_pair_find_by_num(VALUE_PAIR *head, unsigned int vendor, unsigned
 	     		if (dv->pen != vendor) continue;
 	     	}
 
-		if ((attr == vp->da->attr) && TAG_EQ(tag, vp->tag)) return vp;
+		return vp;
 	}
 
 	return NULL;
@@ -358,6 +358,113 @@ VALUE_PAIR *fr_pair_make(TALLOC_CTX *ctx, fr_dict_t const *dict, VALUE_PAIR **vp
 	return vp;
 }
 
+#define PAIR_NAME_CACHE_SIZE	32
+
+/** Attributes recently resolved by fr_pair_list_afrom_substr()
+ *
+ * Input files tend to use the same few attributes on every line,
+ * so we remember them instead of going back to the dictionary.
+ * Lives for one fr_pair_list_afrom_file() or fr_pair_list_afrom_str()
+ * call, so it never outlives the dictionaries.
+ */
+typedef struct {
+	fr_dict_attr_t const	*da[PAIR_NAME_CACHE_SIZE];
+} fr_pair_name_cache_t;
+
+/** Resolve an attribute name, using the cache for unqualified names
+ *
+ * @param[in] cache	of recently used attributes.
+ * @param[out] out	Where to write the attribute.
+ * @param[in] dict	to resolve attributes in.
+ * @param[in] name	to resolve.
+ * @return the same as #fr_dict_attr_by_qualified_name_substr.
+ */
+static ssize_t pair_name_resolve(fr_pair_name_cache_t *cache, fr_dict_attr_t const **out,
+				 fr_dict_t const *dict, char const *name)
+{
+	char const		*p;
+	size_t			len;
+	unsigned int		slot;
+	fr_dict_attr_t const	*da;
+	ssize_t			slen;
+
+	for (p = name; fr_dict_attr_allowed_chars[(uint8_t)*p] && (*p != '.'); p++);
+	len = p - name;
+
+	/*
+	 *	Qualified names, and OIDs go the long way around.
+	 */
+	if ((len == 0) || (*p == '.')) return fr_dict_attr_by_qualified_name_substr(NULL, out, dict, name, true);
+
+	slot = (tolower((uint8_t)name[0]) ^ tolower((uint8_t)name[len - 1]) ^ len) & (PAIR_NAME_CACHE_SIZE - 1);
+	da = cache->da[slot];
+	if (da && (strncasecmp(da->name, name, len) == 0) && !da->name[len]) {
+		*out = da;
+		return len;
+	}
+
+	slen = fr_dict_attr_by_qualified_name_substr(NULL, out, dict, name, true);
+	if ((slen == (ssize_t)len) && *out) cache->da[slot] = *out;
+
+	return slen;
+}
+
+/** Find the length of a bare word value
+ *
+ * Stops at the same places as gettoken() does.
+ *
+ * @return the length of the bare word, or 0 if it's quoted or starts with a token.
+ */
+static size_t pair_bare_word_len(char const *value)
+{
+	char const *p = value;
+
+	switch (*p) {
+	case '\'':
+	case '"':
+	case '`':
+		return 0;
+
+	default:
+		break;
+	}
+
+	while (true) {
+		switch (*p) {
+		case '\0':
+		case ',':
+		case '{':
+		case '}':
+		case '(':
+		case ')':
+		case '=':
+		case '<':
+		case '>':
+		case '#':
+		case ';':
+			return p - value;
+
+		case '!':
+			if ((p[1] == '~') || (p[1] == '*') || (p[1] == '=')) return p - value;
+			break;
+
+		case '+':
+			if ((p[1] == '+') || (p[1] == '=')) return p - value;
+			break;
+
+		case '-':
+		case ':':
+			if (p[1] == '=') return p - value;
+			break;
+
+		default:
+			if (isspace((uint8_t)*p)) return p - value;
+			break;
+		}
+		p++;
+	}
+}
+
 /** Read one line of attribute/value pairs into a list.
  *
  * The line may specify multiple attributes separated by commas.
@@ -369,13 +476,15 @@ VALUE_PAIR *fr_pair_make(TALLOC_CTX *ctx, fr_dict_t const *dict, VALUE_PAIR **vp
  * @param[in] dict	to resolve attributes in.
  * @param[in] buffer	to read valuepairs from.
  * @param[in] list	where the parsed VALUE_PAIRs will be appended.
+ * @param[in] cache	of recently used attributes.
  * @param[in,out] token	The last token we parsed
  * @param[in] depth	the nesting depth for FR_TYPE_GROUP
  * @return
  *	- <= 0 on failure.
  *	- The number of bytes of name consumed on success.
  */
-static ssize_t fr_pair_list_afrom_substr(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *buffer, VALUE_PAIR **list, FR_TOKEN *token, int depth)
+static ssize_t fr_pair_list_afrom_substr(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *buffer, VALUE_PAIR **list,
+					 fr_pair_name_cache_t *cache, FR_TOKEN *token, int depth)
 {
 	VALUE_PAIR	*vp, *head, **tail;
 	char const	*p, *next;
@@ -399,6 +508,7 @@ static ssize_t fr_pair_list_afrom_substr(TALLOC_CTX *ctx, fr_dict_t const *dict,
 		ssize_t slen;
 		fr_dict_attr_t const *da;
 		fr_dict_attr_t *da_unknown = NULL;
+		int8_t tag = TAG_NONE;
 
 		fr_skip_whitespace(p);
 
@@ -416,7 +526,7 @@ static ssize_t fr_pair_list_afrom_substr(TALLOC_CTX *ctx, fr_dict_t const *dict,
 		/*
 		 *	Parse the name.
 		 */
-		slen = fr_dict_attr_by_qualified_name_substr(NULL, &da, dict, p, true);
+		slen = pair_name_resolve(cache, &da, dict, p);
 		if (slen <= 0) {
 
 			slen = fr_dict_unknown_afrom_oid_substr(ctx, &da_unknown, root, p);
@@ -439,8 +549,16 @@ static ssize_t fr_pair_list_afrom_substr(TALLOC_CTX *ctx, fr_dict_t const *dict,
 		 *	Allow tags if the attribute supports them.
 		 */
 		if (da->flags.has_tag && (*next == ':') && isdigit((int) next[1])) {
-			next += 2;
-			while (isdigit((int) *next)) next++;
+			long	value;
+			char	*end;
+
+			value = strtol(next + 1, &end, 10);
+			if (!TAG_VALID_ZERO(value)) {
+				fr_strerror_printf("Invalid tag for attribute %s", da->name);
+				goto error;
+			}
+			tag = value;
+			next = end;
 		}
 
 		if ((size_t) (next - p) >= sizeof(raw.l_opand)) {
@@ -483,7 +601,7 @@ static ssize_t fr_pair_list_afrom_substr(TALLOC_CTX *ctx, fr_dict_t const *dict,
 			vp = fr_pair_afrom_da(ctx, da);
 			if (!vp) goto error;
 
-			slen = fr_pair_list_afrom_substr(vp, dict, p, &child, &last_token, depth + 1);
+			slen = fr_pair_list_afrom_substr(vp, dict, p, &child, cache, &last_token, depth + 1);
 			if (slen <= 0) {
 				talloc_free(vp);
 				goto error;
@@ -505,6 +623,16 @@ static ssize_t fr_pair_list_afrom_substr(TALLOC_CTX *ctx, fr_dict_t const *dict,
 		} else {
 			FR_TOKEN quote;
 			char const *q;
+			char const *value = raw.r_opand;
+			ssize_t value_len = -1;
+			size_t len;
+			bool fast;
+
+			/*
+			 *	Known attributes don't need to be looked
+			 *	up again by name.
+			 */
+			fast = !da_unknown && (raw.op != T_OP_REG_EQ) && (raw.op != T_OP_REG_NE);
 
 			/*
 			 *	Free the unknown attribute, we don't need it any more.
@@ -513,12 +641,23 @@ static ssize_t fr_pair_list_afrom_substr(TALLOC_CTX *ctx, fr_dict_t const *dict,
 			da_unknown = NULL;
 
 			/*
-			 *	Get the RHS thing.
+			 *	Bare words can be parsed in place.
 			 */
-			quote = gettoken(&p, raw.r_opand, sizeof(raw.r_opand), false);
-			if (quote == T_EOL) {
-				fr_strerror_printf("Failed to get value");
-				goto error;
+			len = fast ? pair_bare_word_len(p) : 0;
+			if ((len > 0) && (len < (sizeof(raw.r_opand) - 1))) {
+				value = p;
+				value_len = len;
+				p += len;
+				quote = T_BARE_WORD;
+			} else {
+				/*
+				 *	Get the RHS thing.
+				 */
+				quote = gettoken(&p, raw.r_opand, sizeof(raw.r_opand), false);
+				if (quote == T_EOL) {
+					fr_strerror_printf("Failed to get value");
+					goto error;
+				}
 			}
 
 			switch (quote) {
@@ -551,13 +690,31 @@ static ssize_t fr_pair_list_afrom_substr(TALLOC_CTX *ctx, fr_dict_t const *dict,
 
 			fr_skip_whitespace(p);
 
+			if (fast) {
+				vp = fr_pair_afrom_da(ctx, da);
+				if (!vp) goto error;
+				vp->op = raw.op;
+				vp->tag = tag;
+
+				if ((raw.op == T_OP_CMP_TRUE) || (raw.op == T_OP_CMP_FALSE)) goto next;
+
+				if (raw.quote == T_DOUBLE_QUOTED_STRING) {
+					if (fr_pair_mark_xlat(vp, raw.r_opand) < 0) {
+						talloc_free(vp);
+						goto error;
+					}
+				} else if (fr_pair_value_from_str(vp, value, value_len, '"', true) < 0) {
+					talloc_free(vp);
+					goto error;
+				}
+
 			/*
 			 *	Regular expressions get sanity checked by pair_make().
 			 *
 			 *	@todo - note that they will also be escaped,
 			 *	so we may need to fix that later.
 			 */
-			if ((raw.op == T_OP_REG_EQ) || (raw.op == T_OP_REG_NE)) {
+			} else if ((raw.op == T_OP_REG_EQ) || (raw.op == T_OP_REG_NE)) {
 				vp = fr_pair_make(ctx, dict, NULL, raw.l_opand, raw.r_opand, raw.op);
 				if (!vp) goto error;
 			} else {
@@ -655,9 +812,10 @@ static ssize_t fr_pair_list_afrom_substr(TALLOC_CTX *ctx, fr_dict_t const *dict,
  */
 FR_TOKEN fr_pair_list_afrom_str(TALLOC_CTX *ctx, fr_dict_t const *dict, char const *buffer, VALUE_PAIR **list)
 {
-	FR_TOKEN token;
+	FR_TOKEN		token;
+	fr_pair_name_cache_t	cache = { .da = { NULL } };
 
-	(void) fr_pair_list_afrom_substr(ctx, dict, buffer, list, &token, 0);
+	(void) fr_pair_list_afrom_substr(ctx, dict, buffer, list, &cache, &token, 0);
 	return token;
 }
 
@@ -668,6 +826,7 @@ int fr_pair_list_afrom_file(TALLOC_CTX *ctx, fr_dict_t const *dict, VALUE_PAIR *
 {
 	char buf[8192];
 	FR_TOKEN last_token = T_EOL;
+	fr_pair_name_cache_t cache = { .da = { NULL } };
 
 	fr_cursor_t cursor;
 
@@ -698,7 +857,7 @@ int fr_pair_list_afrom_file(TALLOC_CTX *ctx, fr_dict_t const *dict, VALUE_PAIR *
 		 *	Read all of the attributes on the current line.
 		 */
 		vp = NULL;
-		last_token = fr_pair_list_afrom_str(ctx, dict, buf, &vp);
+		(void) fr_pair_list_afrom_substr(ctx, dict, buf, &vp, &cache, &last_token, 0);
 		if (!vp) {
 			if (last_token != T_EOL) goto error;
 			break;
@@ -33,6 +33,71 @@ RCSID("$Id$")
 #include <string.h>
 #include <talloc.h>
 
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#  include <arm_neon.h>
+#endif
+
+/** Find the length of the run of printable ASCII chars at the start of a string
+ *
+ * Printable means 0x20 - 0x7e.  These are always valid UTF-8, and
+ * don't need escaping unless they're the quotation character or a
+ * backslash, so we can skip or copy them in bulk.
+ *
+ * @param[in] str	input string.
+ * @param[in] inlen	length of input string.
+ * @param[in] a		additional char to stop at.
+ * @param[in] b		additional char to stop at.
+ * @return The number of printable chars at the start of str.
+ */
+static inline size_t utf8_printable_run(uint8_t const *str, size_t inlen, uint8_t a, uint8_t b)
+{
+	uint8_t const *p = str, *end = str + inlen;
+
+#if defined(__SSE2__)
+	{
+		__m128i	lo = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7f);
+		__m128i	va = _mm_set1_epi8((char)a), vb = _mm_set1_epi8((char)b);
+
+		/*
+		 *	The comparison is signed, so bytes >= 0x80
+		 *	are also less than 0x20.
+		 */
+		while ((end - p) >= 16) {
+			__m128i	v = _mm_loadu_si128((__m128i const *)p);
+			int	mask;
+
+			mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmplt_epi8(v, lo),
+									  _mm_cmpeq_epi8(v, del)),
+							      _mm_or_si128(_mm_cmpeq_epi8(v, va),
+									  _mm_cmpeq_epi8(v, vb))));
+			if (mask) return (p - str) + __builtin_ctz(mask);
+			p += 16;
+		}
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	{
+		uint8x16_t lo = vdupq_n_u8(0x20), hi = vdupq_n_u8(0x7e);
+		uint8x16_t va = vdupq_n_u8(a), vb = vdupq_n_u8(b);
+
+		while ((end - p) >= 16) {
+			uint8x16_t v = vld1q_u8(p);
+			uint8x16_t m;
+
+			m = vorrq_u8(vorrq_u8(vcltq_u8(v, lo), vcgtq_u8(v, hi)),
+				     vorrq_u8(vceqq_u8(v, va), vceqq_u8(v, vb)));
+			if (vmaxvq_u8(m)) break;	/* the scalar loop finds which one */
+			p += 16;
+		}
+	}
+#endif
+
+	while ((p < end) && (*p >= 0x20) && (*p <= 0x7e) && (*p != a) && (*p != b)) p++;
+
+	return p - str;
+}
+
 /** Checks for utf-8, taken from http://www.w3.org/International/questions/qa-forms-utf-8
  *
  * @param[in] str	input string.
@@ -161,6 +226,12 @@ ssize_t fr_utf8_str(uint8_t const *str, ssize_t inlen)
 	do {
 		size_t clen;
 
+		/*
+		 *	Most strings are mostly ASCII.
+		 */
+		p += utf8_printable_run(p, end - p, 0x7f, 0x7f);
+		if (p == end) break;
+
 		clen = fr_utf8_char(p, end - p);
 		if (clen == 0) return end - p;
 		p += clen;
@@ -278,6 +349,32 @@ size_t fr_snprint(char *out, size_t outlen, char const *in, ssize_t inlen, char
 
 	while (inlen > 0) {
 		int sp = 0;
+		size_t run;
+
+		/*
+		 *	Copy runs of chars which don't need escaping
+		 *	in one go.
+		 */
+		run = utf8_printable_run(p, inlen, quote, '\\');
+		if (run > 0) {
+			if ((freespace > 0) && (freespace <= run)) {
+				if (out) {
+					memcpy(out + used, p, freespace - 1);
+					out[used + freespace - 1] = '\0';
+				}
+				out = NULL;
+				freespace = 0;
+
+			} else if (freespace > run) { /* room for chars AND trailing zero */
+				if (out) memcpy(out + used, p, run);
+				freespace -= run;
+			}
+
+			used += run;
+			p += run;
+			inlen -= run;
+			continue;
+		}
 
 		/*
 		 *	Always escape the quotation character.
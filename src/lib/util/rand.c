@@ -32,8 +32,56 @@ RCSID("$Id$")
 #include <time.h>
 #include <unistd.h>
 
+/*
+ *	Mix fresh entropy into a thread's pool after this many rounds
+ *	of ISAAC, i.e. after every 16M numbers.
+ */
+#define FR_RAND_RESEED_ROUNDS	(65536)
+
 static _Thread_local fr_randctx fr_rand_pool;		//!< A pool of pre-generated random integers
 static _Thread_local bool fr_rand_initialized = false;
+static _Thread_local uint32_t fr_rand_rounds;		//!< ISAAC rounds since the pool was last reseeded
+
+/** Read entropy from the system
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the system pool couldn't be read.
+ */
+static int rand_entropy(void *out, size_t outlen)
+{
+	int fd;
+	size_t total;
+	ssize_t this;
+	uint8_t *p = out;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0) return -1;
+
+	total = 0;
+	while (total < outlen) {
+		this = read(fd, p + total, outlen - total);
+		if ((this < 0) && (errno != EINTR)) break;
+		if (this > 0) total += this;
+	}
+	close(fd);
+
+	return (total == outlen) ? 0 : -1;
+}
+
+/** Mix fresh entropy from the system into this thread's pool
+ *
+ *  Each thread has its own pool, so no locks are needed.
+ */
+static void rand_reseed(void)
+{
+	uint32_t	entropy[32];
+	size_t		i;
+
+	if (rand_entropy(entropy, sizeof(entropy)) < 0) return;
+
+	for (i = 0; i < NUM_ELEMENTS(entropy); i++) fr_rand_pool.randmem[i] ^= entropy[i];
+}
 
 /** Seed the random number generator
  *
@@ -47,25 +95,10 @@ void fr_rand_seed(void const *data, size_t size)
 	 *	Ensure that the pool is initialized.
 	 */
 	if (!fr_rand_initialized) {
-		int fd;
-
 		memset(&fr_rand_pool, 0, sizeof(fr_rand_pool));
 
-		fd = open("/dev/urandom", O_RDONLY);
-		if (fd >= 0) {
-			size_t total;
-			ssize_t this;
-
-			total = 0;
-			while (total < sizeof(fr_rand_pool.randrsl)) {
-				this = read(fd, fr_rand_pool.randrsl,
-					    sizeof(fr_rand_pool.randrsl) - total);
-				if ((this < 0) && (errno != EINTR)) break;
-				if (this > 0) total += this;
-			}
-			close(fd);
-		} else {
-			fr_rand_pool.randrsl[0] = fd;
+		if (rand_entropy(fr_rand_pool.randrsl, sizeof(fr_rand_pool.randrsl)) < 0) {
+			fr_rand_pool.randrsl[0] = getpid();
 			fr_rand_pool.randrsl[1] = time(NULL);
 			fr_rand_pool.randrsl[2] = errno;
 		}
@@ -105,6 +138,12 @@ uint32_t fr_rand(void)
 	num = fr_rand_pool.randrsl[fr_rand_pool.randcnt++];
 	if (fr_rand_pool.randcnt >= 256) {
 		fr_rand_pool.randcnt = 0;
+
+		if (++fr_rand_rounds >= FR_RAND_RESEED_ROUNDS) {
+			fr_rand_rounds = 0;
+			rand_reseed();
+		}
+
 		fr_isaac(&fr_rand_pool);
 	}
 
@@ -25,6 +25,8 @@ RCSID("$Id$")
 
 #ifdef HAVE_REGEX
 
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/regex.h>
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/talloc.h>
@@ -1307,4 +1309,210 @@ size_t regex_flags_snprint(char *out, size_t outlen, fr_regex_flags_t const *fla
 
 	return p - out;
 }
+
+/*
+ *	Patterns built from xlat expansions are compiled each time
+ *	the condition is evaluated, but typically only take a small
+ *	number of distinct values.  Keep the most recently used
+ *	ones, JIT compiled, in a per-thread LRU cache.
+ */
+#ifndef FR_REGEX_CACHE_MAX
+#  define FR_REGEX_CACHE_MAX	256
+#endif
+
+#define REGEX_CACHE_SUBCAPTURES	(1 << 7)
+
+/** A runtime compiled expression, and the pattern it was compiled from
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+	uint32_t		hash;		//!< Of the pattern and compile flags.
+	uint8_t			cflags;		//!< Flags which affect compilation.
+	size_t			len;		//!< Length of the pattern.
+	char const		*pattern;	//!< Pattern, not \0 terminated.
+	regex_t			*preg;		//!< Compiled expression.
+} regex_cache_entry_t;
+
+/** Thread local cache of runtime compiled expressions
+ *
+ */
+typedef struct {
+	fr_hash_table_t		*ht;		//!< Entries indexed by pattern and flags.
+	fr_dlist_head_t		lru;		//!< Most recently used at the head.
+	fr_regex_cache_stats_t	stats;		//!< How effective the cache is.
+} regex_cache_t;
+
+static _Thread_local regex_cache_t *regex_cache;
+
+static uint32_t regex_cache_entry_hash(void const *data)
+{
+	regex_cache_entry_t const *a = data;
+
+	return a->hash;
+}
+
+static int regex_cache_entry_cmp(void const *one, void const *two)
+{
+	regex_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->cflags > b->cflags) - (a->cflags < b->cflags);
+	if (ret != 0) return ret;
+
+	ret = (a->len > b->len) - (a->len < b->len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->pattern, b->pattern, a->len);
+}
+
+static void _regex_cache_free_on_exit(void *arg)
+{
+	talloc_free(arg);
+}
+
+/** Thread local init for the regex cache
+ *
+ */
+static regex_cache_t *regex_cache_init(void)
+{
+	regex_cache_t *cache;
+
+	cache = talloc_zero(NULL, regex_cache_t);
+	if (!cache) {
+	nomem:
+		fr_strerror_printf("Out of memory");
+		talloc_free(cache);
+		return NULL;
+	}
+
+	cache->ht = fr_hash_table_create(cache, regex_cache_entry_hash, regex_cache_entry_cmp, NULL);
+	if (!cache->ht) goto nomem;
+	fr_dlist_talloc_init(&cache->lru, regex_cache_entry_t, entry);
+
+	/*
+	 *	Free on thread exit
+	 */
+	fr_thread_local_set_destructor(regex_cache, _regex_cache_free_on_exit, cache);
+	regex_cache = cache;
+
+	return cache;
+}
+
+/** Compile a pattern at runtime, reusing a previous compilation if possible
+ *
+ * Expressions are JIT compiled (if available), as they're likely to
+ * be evaluated again.
+ *
+ * @note The compiled expression is owned by the thread local cache,
+ *	and must not be freed by the caller.  It remains valid until the
+ *	next call to this function from the same thread.  If its
+ *	subcaptures are added to a request with #regex_sub_to_request
+ *	it remains valid for at least the lifetime of the subcaptures.
+ *
+ * @param[out] out		Where to write out a pointer to the structure containing
+ *				the compiled expression.
+ * @param[in] pattern		to compile.
+ * @param[in] len		of pattern.
+ * @param[in] flags		controlling matching. May be NULL.
+ * @param[in] subcaptures	Whether to compile the regular expression to store subcapture
+ *				data.
+ * @return
+ *	- >= 1 on success.
+ *	- <= 0 on error. Negative value is offset of parse error.
+ */
+ssize_t regex_compile_cached(regex_t **out, char const *pattern, size_t len,
+			     fr_regex_flags_t const *flags, bool subcaptures)
+{
+	regex_cache_t		*cache = regex_cache;
+	regex_cache_entry_t	find, *found;
+	ssize_t			slen;
+
+	*out = NULL;
+
+	if (unlikely(!cache) && !(cache = regex_cache_init())) return -1;
+
+	/*
+	 *	The global flag is implemented by the substitution
+	 *	function, so doesn't change the compiled expression.
+	 */
+	find.cflags = subcaptures ? REGEX_CACHE_SUBCAPTURES : 0;
+	if (flags) {
+		find.cflags |= (flags->ignore_case << 0) | (flags->multiline << 1) | (flags->dot_all << 2) |
+			       (flags->unicode << 3) | (flags->extended << 4);
+	}
+	find.len = len;
+	find.pattern = pattern;
+	find.hash = fr_hash_update(&find.cflags, sizeof(find.cflags), fr_hash(pattern, len));
+
+	found = fr_hash_table_finddata(cache->ht, &find);
+	if (found) {
+		cache->stats.hits++;
+
+		fr_dlist_remove(&cache->lru, found);
+		fr_dlist_insert_head(&cache->lru, found);
+
+		*out = found->preg;
+		return len;
+	}
+	cache->stats.misses++;
+
+	found = talloc_zero(cache, regex_cache_entry_t);
+	if (!found) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	slen = regex_compile(found, &found->preg, pattern, len, flags, subcaptures, false);
+	if (slen <= 0) {
+		talloc_free(found);
+		return slen;
+	}
+
+	found->hash = find.hash;
+	found->cflags = find.cflags;
+	found->len = len;
+	found->pattern = talloc_memdup(found, pattern, len);
+	if (!found->pattern || !fr_hash_table_insert(cache->ht, found)) {
+		fr_strerror_printf("Failed inserting expression into cache");
+		talloc_free(found);
+		return -1;
+	}
+#if defined(HAVE_REGEX_PCRE) || defined(HAVE_REGEX_PCRE2)
+	found->preg->cached = true;
+#endif
+	fr_dlist_insert_head(&cache->lru, found);
+
+	/*
+	 *	Evict the least recently used expression.
+	 *	Any subcaptures still referencing it keep
+	 *	it alive until they're freed.
+	 */
+	if (fr_hash_table_num_elements(cache->ht) > FR_REGEX_CACHE_MAX) {
+		regex_cache_entry_t *lru = fr_dlist_tail(&cache->lru);
+
+		fr_hash_table_delete(cache->ht, lru);
+		fr_dlist_remove(&cache->lru, lru);
+		talloc_free(lru);
+		cache->stats.evictions++;
+	}
+
+	*out = found->preg;
+
+	return slen;
+}
+
+/** Return the statistics for this thread's regex cache
+ *
+ * @return the cache statistics.  These are updated as the thread
+ *	compiles expressions, and are freed when it exits.
+ */
+fr_regex_cache_stats_t const *regex_cache_stats(void)
+{
+	static fr_regex_cache_stats_t const empty = { 0 };
+
+	if (unlikely(!regex_cache) && !regex_cache_init()) return &empty;
+
+	return &regex_cache->stats;
+}
 #endif
@@ -67,6 +67,7 @@ typedef struct {
 	bool			precompiled;	//!< Whether this regex was precompiled,
 						///< or compiled for one off evaluation.
 	bool			jitd;		//!< Whether JIT data is available.
+	bool			cached;		//!< Owned by the thread local regex cache.
 } regex_t;
 /*
  *######################################
@@ -112,6 +113,7 @@ typedef struct {
 
 	bool			precompiled;	//!< Whether this regex was precompiled, or compiled for one off evaluation.
 	bool			jitd;		//!< Whether JIT data is available.
+	bool			cached;		//!< Owned by the thread local regex cache.
 } regex_t;
 /*
  *######################################
@@ -165,10 +167,22 @@ typedef struct {
 	uint8_t extended:1;			//!< x - Permit whitespace and comments.
 } fr_regex_flags_t;
 
+/** Statistics for a thread's cache of runtime compiled expressions
+ *
+ */
+typedef struct {
+	uint64_t		hits;		//!< Patterns found in the cache.
+	uint64_t		misses;		//!< Patterns which had to be compiled.
+	uint64_t		evictions;	//!< Expressions removed to make room for new ones.
+} fr_regex_cache_stats_t;
+
 ssize_t		regex_flags_parse(int *err, fr_regex_flags_t *out, char const *in, size_t len, bool err_on_dup);
 size_t		regex_flags_snprint(char *out, size_t outlen, fr_regex_flags_t const *flags);
 ssize_t		regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_t len,
 			      fr_regex_flags_t const *flags, bool subcaptures, bool runtime);
+ssize_t		regex_compile_cached(regex_t **out, char const *pattern, size_t len,
+				     fr_regex_flags_t const *flags, bool subcaptures);
+fr_regex_cache_stats_t const *regex_cache_stats(void);
 int		regex_exec(regex_t *preg, char const *subject, size_t len, fr_regmatch_t *regmatch);
 #ifdef HAVE_REGEX_PCRE2
 int		regex_substitute(TALLOC_CTX *ctx, char **out, size_t max_out, regex_t *preg, fr_regex_flags_t *flags,
@@ -155,6 +155,32 @@ do { \
 	if ((_in->p + _len) > _in->end) _len = (_in->end - _in->p); \
 } while(0)
 
+/** Find the first char in a range which is (or isn't) in a set
+ *
+ * Looks at four chars per iteration, as the table lookups for each
+ * are independent.  The caller then copies the whole span with memcpy.
+ *
+ * @param[in] p		start of the range.
+ * @param[in] end	of the range.
+ * @param[in] table	of chars.
+ * @param[in] stop	Value of the table entry to stop at.
+ * @return Pointer to the first matching char, or end.
+ */
+static inline char const *sbuff_scan(char const *p, char const *end, char const table[static UINT8_MAX + 1], bool stop)
+{
+	while ((end - p) >= 4) {
+		if ((bool)table[(uint8_t)p[0]] == stop) return p;
+		if ((bool)table[(uint8_t)p[1]] == stop) return p + 1;
+		if ((bool)table[(uint8_t)p[2]] == stop) return p + 2;
+		if ((bool)table[(uint8_t)p[3]] == stop) return p + 3;
+		p += 4;
+	}
+
+	while ((p < end) && ((bool)table[(uint8_t)*p] != stop)) p++;
+
+	return p;
+}
+
 /** Copy as many bytes as possible from the sbuff to another buffer
  *
  * Copy size is limited by available data in sbuff and output buffer length.
@@ -203,7 +229,6 @@ size_t fr_sbuff_strncpy_allowed(char *out, size_t outlen, fr_sbuff_t *in, size_t
 {
 	char const	*p = in->p;
 	char const	*end;
-	char		*out_p = out;
 	size_t		copied;
 
 	if (unlikely(outlen == 0)) return 0;
@@ -212,12 +237,12 @@ size_t fr_sbuff_strncpy_allowed(char *out, size_t outlen, fr_sbuff_t *in, size_t
 
 	STRNCPY_TRIM_LEN(len, in, outlen);
 
-	end = p + len;
+	end = sbuff_scan(p, p + len, allowed_chars, false);
 
-	while ((p < end) && allowed_chars[(uint8_t)*p]) *out_p++ = *p++;
-	*out_p = '\0';
+	copied = (end - p);
+	memcpy(out, p, copied);
+	out[copied] = '\0';
 
-	copied = (p - in->p);
 	in->p += copied;
 
 	return copied;
@@ -243,7 +268,6 @@ size_t fr_sbuff_strncpy_until(char *out, size_t outlen, fr_sbuff_t *in, size_t l
 {
 	char const	*p = in->p;
 	char const	*end;
-	char		*out_p = out;
 	size_t		copied;
 
 	if (unlikely(outlen == 0)) return 0;
@@ -252,12 +276,12 @@ size_t fr_sbuff_strncpy_until(char *out, size_t outlen, fr_sbuff_t *in, size_t l
 
 	STRNCPY_TRIM_LEN(len, in, outlen);
 
-	end = p + len;
+	end = sbuff_scan(p, p + len, until, true);
 
-	while ((p < end) && !until[(uint8_t)*p]) *out_p++ = *p++;
-	*out_p = '\0';
+	copied = (end - p);
+	memcpy(out, p, copied);
+	out[copied] = '\0';
 
-	copied = (p - in->p);
 	in->p += copied;
 
 	return copied;
@@ -180,7 +180,7 @@ _Generic((_len_or_end), \
  * @param[out] _out	Pointer to sbuff to initialise.
  * @param[in] _buff	Char buffer to wrap.
  */
-#define fr_sbuff_print_init(_out, _buff)	_fr_sbuff_init(_out, _buff, sizeof(_buff), false);
+#define fr_sbuff_print_init(_out, _buff)	_fr_sbuff_print_init(_out, _buff, (_buff) + sizeof(_buff), false)
 
 /** Initialise an sbuff for a talloced buffer
  *
@@ -191,7 +191,7 @@ _Generic((_len_or_end), \
  */
 #define fr_sbuff_print_talloc_init(_out, _buff) \
 do { \
-	_fr_sbuff_print_init(_out, _buff, talloc_array_length(_buff) - 1, true); \
+	_fr_sbuff_print_init(_out, _buff, (_buff) + talloc_array_length(_buff), true); \
 	(_out)->is_extendable = true; \
 } while (0)
 
@@ -207,7 +207,7 @@ do { \
 do { \
 	char *_buff; \
 	MEM(_buff = talloc_array(_ctx, char, (_len) + 1)); \
-	_fr_sbuff_print_init(_out, _buff, (_len) + 1, true); \
+	_fr_sbuff_print_init(_out, _buff, _buff + (_len) + 1, true); \
 	(_out)->is_extendable = true; \
 } while (0)
 
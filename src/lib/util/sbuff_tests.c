@@ -1,4 +1,5 @@
 #include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/time.h>
 
 #include "sbuff.c"
 
@@ -119,6 +120,123 @@ static void test_strncpy(void)
 	TEST_CHECK(sbuff.p == sbuff.start);
 }
 
+static void test_strncpy_until(void)
+{
+	char const	*in = "i am a test string, with a comma";
+	char		out[18 + 1];
+	char		until[UINT8_MAX + 1] = { [','] = true, ['"'] = true };
+	char		allowed[UINT8_MAX + 1] = { ['a'] = true, ['i'] = true, ['m'] = true, [' '] = true };
+	fr_sbuff_t	sbuff;
+	size_t		len;
+
+	fr_sbuff_parse_init(&sbuff, in, strlen(in));
+
+	TEST_CASE("Copy until terminal would overrun output");
+	len = fr_sbuff_strncpy_until(out, sizeof(out), &sbuff, SIZE_MAX, until);
+	TEST_CHECK(len == 18);
+	TEST_CHECK(strcmp(out, "i am a test string") == 0);
+	TEST_CHECK(*sbuff.p == ',');
+
+	TEST_CASE("Copy until terminal at the start");
+	len = fr_sbuff_strncpy_until(out, sizeof(out), &sbuff, SIZE_MAX, until);
+	TEST_CHECK(len == 0);
+	TEST_CHECK(strcmp(out, "") == 0);
+	TEST_CHECK(*sbuff.p == ',');
+
+	TEST_CASE("Copy until end of input");
+	sbuff.p++;
+	len = fr_sbuff_strncpy_until(out, sizeof(out), &sbuff, SIZE_MAX, until);
+	TEST_CHECK(len == 13);
+	TEST_CHECK(strcmp(out, " with a comma") == 0);
+	TEST_CHECK(sbuff.p == sbuff.end);
+
+	TEST_CASE("Copy allowed chars");
+	fr_sbuff_start(&sbuff);
+	len = fr_sbuff_strncpy_allowed(out, sizeof(out), &sbuff, SIZE_MAX, allowed);
+	TEST_CHECK(len == 7);
+	TEST_CHECK(strcmp(out, "i am a ") == 0);
+	TEST_CHECK(*sbuff.p == 't');
+}
+
+static void test_snprint(void)
+{
+	char		out[64];
+	size_t		len;
+
+	TEST_CASE("Long printable runs are copied as is");
+	len = fr_snprint(out, sizeof(out), "this is a long string with no escapes at all", -1, '"');
+	TEST_CHECK(len == 44);
+	TEST_CHECK(strcmp(out, "this is a long string with no escapes at all") == 0);
+
+	TEST_CASE("Escapes in the middle of, and after, long printable runs");
+	len = fr_snprint(out, sizeof(out), "a string which is \\long\\ enough \"for\"\n", -1, '"');
+	TEST_CHECK(strcmp(out, "a string which is \\\\long\\\\ enough \\\"for\\\"\\n") == 0);
+	TEST_MSG("Got %s", out);
+	TEST_CHECK(len == strlen(out));
+
+	TEST_CASE("UTF-8 and invalid chars after a printable run");
+	len = fr_snprint(out, sizeof(out), "sixteen plus one \xc3\xa9\xff", -1, '"');
+	TEST_CHECK(strcmp(out, "sixteen plus one \xc3\xa9\\377") == 0);
+	TEST_MSG("Got %s", out);
+	TEST_CHECK(len == strlen(out));
+
+	TEST_CASE("Truncation in a printable run");
+	len = fr_snprint(out, 11, "this is a long string with no escapes at all", -1, '\'');
+	TEST_CHECK(len == 44);
+	TEST_CHECK(strcmp(out, "this is a ") == 0);
+
+	TEST_CASE("UTF-8 validation skips printable runs");
+	TEST_CHECK(fr_utf8_str((uint8_t const *)"an ascii string, of more than sixteen chars", 43) == 43);
+	TEST_CHECK(fr_utf8_str((uint8_t const *)"an ascii string, then \xc3\xa9", 24) == 24);
+	TEST_CHECK(fr_utf8_str((uint8_t const *)"an ascii string, then \xff", 23) != 23);
+}
+
+static void test_speed(void)
+{
+	static char	in[4096];
+	static char	out[(sizeof(in) * 4) + 1];
+	char		until[UINT8_MAX + 1] = { ['\n'] = true };
+	fr_sbuff_t	sbuff;
+	fr_time_t	start, stop;
+	size_t		i, len, loops = 100000;
+
+	/*
+	 *	Something like a config file, or a log line.
+	 */
+	for (i = 0; i < (sizeof(in) - 1); i++) in[i] = ((i % 64) == 63) ? '"' : "abcdefghijklmnopqrstuvwxyz012345"[i % 32];
+	in[sizeof(in) - 1] = '\n';
+
+	start = fr_time();
+	for (i = 0, len = 0; i < loops; i++) {
+		fr_sbuff_parse_init(&sbuff, in, sizeof(in));
+		len += fr_sbuff_strncpy_until(out, sizeof(out), &sbuff, SIZE_MAX, until);
+	}
+	stop = fr_time();
+	TEST_CHECK(len == (loops * (sizeof(in) - 1)));
+
+	if (test_verbose_level__ >= 1) {
+		printf("\nfr_sbuff_strncpy_until: %.2f ns/byte\n", (double)(stop - start) / (loops * sizeof(in)));
+	}
+
+	start = fr_time();
+	for (i = 0, len = 0; i < loops; i++) len += fr_snprint(out, sizeof(out), in, sizeof(in), '"');
+	stop = fr_time();
+	TEST_CHECK(len == (loops * (sizeof(in) + (sizeof(in) / 64))));	/* 63 '"' and the '\n' are escaped */
+
+	if (test_verbose_level__ >= 1) {
+		printf("fr_snprint: %.2f ns/byte\n", (double)(stop - start) / (loops * sizeof(in)));
+	}
+
+	start = fr_time();
+	for (i = 0, len = 0; i < loops; i++) len += fr_utf8_str((uint8_t const *)in, sizeof(in) - 1);
+	stop = fr_time();
+	TEST_CHECK(len == (loops * (sizeof(in) - 1)));
+
+	if (test_verbose_level__ >= 1) {
+		printf("fr_utf8_str: %.2f ns/byte\n", (double)(stop - start) / (loops * sizeof(in)));
+	}
+}
+
 /*
 static void test_sbuff_parse_num(void)
 {
@@ -152,7 +270,14 @@ TEST_LIST = {
 	{ "fr_sbuff_parse_init",			test_parse_init },
 	{ "fr_sbuff_strncpy_exact",			test_strncpy_exact },
 	{ "fr_sbuff_strncpy",				test_strncpy },
+	{ "fr_sbuff_strncpy_until",			test_strncpy_until },
+	{ "fr_snprint",					test_snprint },
 	{ "no-advance",					test_no_advance },
 
+	/*
+	 *	Performance
+	 */
+	{ "speed",					test_speed },
+
 	{ NULL }
 };
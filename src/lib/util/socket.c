@@ -34,9 +34,14 @@
 
 #include <fcntl.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+#include <linux/filter.h>
+#endif
+
 /*
  *	This is used during binding ports less than 1024
  *	which is a privilege that processes don't
@@ -493,36 +498,8 @@ int fr_socket_client_udp(fr_ipaddr_t *src_ipaddr, uint16_t *src_port, fr_ipaddr_
 	return sockfd;
 }
 
-/** Establish a connected TCP socket
- *
- * The following code demonstrates using this function with a connection timeout:
- @code {.c}
-   sockfd = fr_socket_client_tcp(NULL, ipaddr, port, true);
-   if (sockfd < 0) {
-   	fr_perror();
-   	fr_exit_now(1);
-   }
-   if ((errno == EINPROGRESS) && (fr_socket_wait_for_connect(sockfd, timeout) < 0)) {
-   error:
-   	fr_perror();
-   	close(sockfd);
-   	goto error;
-   }
-   //Optionally, if blocking operation is required
-   if (fr_blocking(sockfd) < 0) goto error;
- @endcode
- *
- * @param src_ipaddr	to bind socket to, may be NULL if socket is not bound to any specific
- *			address.
- * @param dst_ipaddr	Where to connect to.
- * @param dst_port	Where to connect to.
- * @param async		Whether to set the socket to nonblocking, allowing use of
- *			#fr_socket_wait_for_connect.
- * @return
- *	- FD on success
- *	- -1 on failure.
- */
-int fr_socket_client_tcp(fr_ipaddr_t const *src_ipaddr, fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port, bool async)
+static int socket_client_tcp(fr_ipaddr_t const *src_ipaddr, fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port,
+			     bool async, bool fastopen)
 {
 	int			sockfd;
 	struct sockaddr_storage	salocal;
@@ -541,6 +518,18 @@ int fr_socket_client_tcp(fr_ipaddr_t const *src_ipaddr, fr_ipaddr_t const *dst_i
 		return -1;
 	}
 
+	/*
+	 *	Older kernels reject the option, in which
+	 *	case we just do a normal three way handshake.
+	 */
+#ifdef TCP_FASTOPEN_CONNECT
+	if (fastopen) {
+		int set = 1;
+
+		(void) setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (void *)&set, sizeof(int));
+	}
+#endif
+
 	/*
 	 *	Allow the caller to bind us to a specific source IP.
 	 */
@@ -596,6 +585,67 @@ int fr_socket_client_tcp(fr_ipaddr_t const *src_ipaddr, fr_ipaddr_t const *dst_i
 	return sockfd;
 }
 
+/** Establish a connected TCP socket
+ *
+ * The following code demonstrates using this function with a connection timeout:
+ @code {.c}
+   sockfd = fr_socket_client_tcp(NULL, ipaddr, port, true);
+   if (sockfd < 0) {
+   	fr_perror();
+   	fr_exit_now(1);
+   }
+   if ((errno == EINPROGRESS) && (fr_socket_wait_for_connect(sockfd, timeout) < 0)) {
+   error:
+   	fr_perror();
+   	close(sockfd);
+   	goto error;
+   }
+   //Optionally, if blocking operation is required
+   if (fr_blocking(sockfd) < 0) goto error;
+ @endcode
+ *
+ * @param src_ipaddr	to bind socket to, may be NULL if socket is not bound to any specific
+ *			address.
+ * @param dst_ipaddr	Where to connect to.
+ * @param dst_port	Where to connect to.
+ * @param async		Whether to set the socket to nonblocking, allowing use of
+ *			#fr_socket_wait_for_connect.
+ * @return
+ *	- FD on success
+ *	- -1 on failure.
+ */
+int fr_socket_client_tcp(fr_ipaddr_t const *src_ipaddr, fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port, bool async)
+{
+	return socket_client_tcp(src_ipaddr, dst_ipaddr, dst_port, async, false);
+}
+
+/** Establish a connected TCP socket, using TCP Fast Open where the platform supports it
+ *
+ * With Fast Open, connect() completes immediately and the SYN is deferred
+ * until the first write, which carries the first request.  If the server
+ * has previously issued us a Fast Open cookie, the request is delivered
+ * with the SYN, saving a round trip on reconnect.
+ *
+ * Only suitable for protocols where the client speaks first, and where
+ * replaying the first write is harmless (the SYN may be retransmitted).
+ *
+ * If Fast Open is unavailable this behaves identically to #fr_socket_client_tcp.
+ *
+ * @param src_ipaddr	to bind socket to, may be NULL if socket is not bound to any specific
+ *			address.
+ * @param dst_ipaddr	Where to connect to.
+ * @param dst_port	Where to connect to.
+ * @param async		Whether to set the socket to nonblocking.
+ * @return
+ *	- FD on success
+ *	- -1 on failure.
+ */
+int fr_socket_client_tcp_fastopen(fr_ipaddr_t const *src_ipaddr, fr_ipaddr_t const *dst_ipaddr,
+				  uint16_t dst_port, bool async)
+{
+	return socket_client_tcp(src_ipaddr, dst_ipaddr, dst_port, async, true);
+}
+
 /** Wait for a socket to be connected, with an optional timeout
  *
  * @note On error the caller is expected to ``close(sockfd)``.
@@ -1023,3 +1073,65 @@ skip_cap:
 #endif
 	return 0;
 }
+
+/** Steer packets in a SO_REUSEPORT group by source IP address
+ *
+ * Attaches a classic BPF program to the reuseport group the socket is
+ * a member of.  The program hashes the low 32 bits of the source IP
+ * address, and returns it modulo the number of sockets in the group.
+ * Packets from a given source are therefore always delivered to the
+ * same socket.
+ *
+ * The index returned by the program is the order in which the sockets
+ * joined the group, so all sockets should be bound before packets arrive.
+ *
+ * @param[in] sockfd	any socket in the reuseport group.
+ * @param[in] af	address family of the socket.
+ * @param[in] num	number of sockets in the reuseport group.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, or if the platform does not support steering.
+ */
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+int fr_socket_reuseport_steer(int sockfd, int af, unsigned int num)
+{
+	struct sock_filter	code[] = {
+		/* A = last 32 bits of the source address */
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + ((af == AF_INET6) ? 20 : 12) },
+		/* A ^= (A >> 16) */
+		{ BPF_MISC | BPF_TAX, 0, 0, 0 },
+		{ BPF_ALU | BPF_RSH | BPF_K, 0, 0, 16 },
+		{ BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },
+		/* return A % num */
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, num },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog	prog = {
+		.len = NUM_ELEMENTS(code),
+		.filter = code,
+	};
+
+	if ((af != AF_INET) && (af != AF_INET6)) {
+		fr_strerror_printf("Unsupported address family %i", af);
+		return -1;
+	}
+
+	if (num < 1) {
+		fr_strerror_printf("Invalid number of sockets %u", num);
+		return -1;
+	}
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+		fr_strerror_printf("Failed attaching reuseport filter: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+#else
+int fr_socket_reuseport_steer(UNUSED int sockfd, UNUSED int af, UNUSED unsigned int num)
+{
+	fr_strerror_printf("SO_ATTACH_REUSEPORT_CBPF is not supported on this platform");
+	return -1;
+}
+#endif
@@ -47,12 +47,16 @@ int		fr_socket_client_udp(fr_ipaddr_t *src_ipaddr, uint16_t *src_port, fr_ipaddr
 				     uint16_t dst_port, bool async);
 int		fr_socket_client_tcp(fr_ipaddr_t const *src_ipaddr, fr_ipaddr_t const *dst_ipaddr,
 				     uint16_t dst_port, bool async);
+int		fr_socket_client_tcp_fastopen(fr_ipaddr_t const *src_ipaddr, fr_ipaddr_t const *dst_ipaddr,
+					      uint16_t dst_port, bool async);
 int		fr_socket_wait_for_connect(int sockfd, fr_time_delta_t timeout);
 
 int		fr_socket_server_udp(fr_ipaddr_t const *ipaddr, uint16_t *port, char const *port_name, bool async);
 int		fr_socket_server_tcp(fr_ipaddr_t const *ipaddr, uint16_t *port, char const *port_name, bool async);
 int		fr_socket_bind(int sockfd, fr_ipaddr_t const *ipaddr, uint16_t *port, char const *interface);
 
+int		fr_socket_reuseport_steer(int sockfd, int af, unsigned int num);
+
 #ifdef __cplusplus
 }
 #endif
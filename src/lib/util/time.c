@@ -52,6 +52,16 @@ USES_APPLE_DEPRECATED_API
 
 #include <stdatomic.h>
 
+/*
+ *	The TSC can only be used on x86 with clock_gettime()
+ *	to calibrate it against.
+ */
+#if defined(HAVE_CLOCK_GETTIME) && (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#  define HAVE_TSC
+#  include <cpuid.h>
+#  include <x86intrin.h>
+#endif
+
 static _Atomic int64_t			our_realtime;	//!< realtime at the start of the epoch in nanoseconds.
 static char const			*tz_names[2] = { NULL, NULL };	//!< normal, DST, from localtime_r(), tm_zone
 static long				gmtoff[2] = {0, 0};	       	//!< from localtime_r(), tm_gmtoff
@@ -64,6 +74,106 @@ static mach_timebase_info_data_t	timebase;
 static uint64_t				our_mach_epoch;
 #endif
 
+/** Read the system monotonic clock
+ *
+ */
+static inline fr_time_t fr_time_monotonic(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return fr_time_delta_from_timespec(&ts) - our_epoch;
+#else  /* __MACH__ is defined */
+	uint64_t when;
+
+	when = mach_absolute_time();
+	when -= our_mach_epoch;
+
+	return when * (timebase.numer / timebase.denom);
+#endif
+}
+
+#ifdef HAVE_TSC
+/** Parameters for converting TSC ticks to fr_time_t
+ *
+ * There are two copies.  fr_time_sync() writes the one which
+ * isn't in use, and then switches tsc_gen over to it, so readers
+ * never see a partial update.
+ */
+typedef struct {
+	uint64_t		tsc;		//!< TSC value at the last sync.
+	fr_time_t		when;		//!< fr_time_t at the last sync.
+	uint64_t		mult;		//!< Nanoseconds per tick, as a 32.32 fixed point value.
+} fr_time_tsc_t;
+
+static fr_time_tsc_t			tsc_params[2];
+static _Atomic uint32_t			tsc_gen;
+static _Atomic bool			tsc_enabled;
+
+static struct {
+	uint64_t		tsc;		//!< TSC value at the last calibration.
+	fr_time_t		when;		//!< CLOCK_MONOTONIC at the last calibration.
+} tsc_cal;
+
+#define TSC_CALIBRATE_MIN	(NSEC / 10)	//!< Don't recalibrate over shorter periods than this.
+
+
+/** Convert ticks since the last sync to nanoseconds
+ *
+ * Split so that we don't overflow if fr_time_sync() isn't
+ * called for a long time.
+ */
+static inline int64_t tsc_to_nsec(uint64_t ticks, uint64_t mult)
+{
+	return ((ticks >> 32) * mult) + (((ticks & 0xffffffff) * mult) >> 32);
+}
+
+static inline fr_time_t fr_time_tsc(void)
+{
+	fr_time_tsc_t const *params;
+
+	params = &tsc_params[atomic_load_explicit(&tsc_gen, memory_order_acquire) & 0x01];
+
+	return params->when + tsc_to_nsec(__rdtsc() - params->tsc, params->mult);
+}
+
+/** Sync the TSC against CLOCK_MONOTONIC, and recalibrate its rate
+ *
+ * Must only be called from one thread.
+ */
+static void fr_time_tsc_sync(void)
+{
+	fr_time_tsc_t	*old, *new;
+	uint32_t	gen;
+	uint64_t	tsc;
+	fr_time_t	now, tsc_now;
+
+	gen = atomic_load_explicit(&tsc_gen, memory_order_relaxed);
+	old = &tsc_params[gen & 0x01];
+	new = &tsc_params[(gen + 1) & 0x01];
+
+	now = fr_time_monotonic();
+	tsc = __rdtsc();
+
+	*new = *old;
+	if (((now - tsc_cal.when) >= TSC_CALIBRATE_MIN) && (tsc > tsc_cal.tsc)) {
+		new->mult = ((uint64_t)(now - tsc_cal.when) << 32) / (tsc - tsc_cal.tsc);
+		tsc_cal.tsc = tsc;
+		tsc_cal.when = now;
+	}
+
+	/*
+	 *	Never go backwards.  If the TSC has been running
+	 *	fast, the new rate slows it down again.
+	 */
+	tsc_now = old->when + tsc_to_nsec(tsc - old->tsc, old->mult);
+	new->tsc = tsc;
+	new->when = (tsc_now > now) ? tsc_now : now;
+
+	atomic_store_explicit(&tsc_gen, gen + 1, memory_order_release);
+}
+#endif
+
 /** Get a new our_realtime value
  *
  * Should be done regularly to adjust for changes in system time.
@@ -134,6 +244,10 @@ int fr_time_sync(void)
 	tz_names[isdst] = tm.tm_zone;
 	gmtoff[isdst] = tm.tm_gmtoff * NSEC; /* they store seconds, we store nanoseconds */
 
+#ifdef HAVE_TSC
+	if (atomic_load_explicit(&tsc_enabled, memory_order_relaxed)) fr_time_tsc_sync();
+#endif
+
 	return 0;
 }
 
@@ -165,27 +279,86 @@ int fr_time_start(void)
 	return fr_time_sync();
 }
 
+/** Use the TSC to get the time
+ *
+ *  Reading the TSC is much cheaper than calling clock_gettime(), even
+ *  through the vDSO.  It's only used if the CPU says the TSC is
+ *  invariant, i.e. it runs at a constant rate across P-states and
+ *  isn't stopped in deep C-states.
+ *
+ *  The TSC is calibrated against CLOCK_MONOTONIC here, and then again
+ *  every time fr_time_sync() is called, so fr_time_sync() should be
+ *  called regularly (radiusd calls it once a second).
+ *
+ *  Must be called after fr_time_start(), and before any other threads
+ *  are started.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the TSC can't be used.
+ */
+int fr_time_tsc_enable(void)
+{
+#ifdef HAVE_TSC
+	unsigned int		eax, ebx, ecx, edx;
+	struct timespec		ts = { .tv_sec = 0, .tv_nsec = 10 * 1000 * 1000 };
+	fr_time_t		start, end;
+	uint64_t		tsc_start, tsc_end;
+
+	if (atomic_load_explicit(&tsc_enabled, memory_order_relaxed)) return 0;
+
+	/*
+	 *	Advanced power management, EDX bit 8 is invariant TSC.
+	 */
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) {
+		fr_strerror_printf("CPU does not have an invariant TSC");
+		return -1;
+	}
+
+	start = fr_time_monotonic();
+	tsc_start = __rdtsc();
+	(void) nanosleep(&ts, NULL);
+	end = fr_time_monotonic();
+	tsc_end = __rdtsc();
+
+	if ((tsc_end <= tsc_start) || (end <= start)) {
+		fr_strerror_printf("Failed calibrating TSC");
+		return -1;
+	}
+
+	tsc_params[0].mult = ((uint64_t)(end - start) << 32) / (tsc_end - tsc_start);
+	tsc_params[0].tsc = tsc_end;
+	tsc_params[0].when = end;
+	tsc_cal.tsc = tsc_start;
+	tsc_cal.when = start;
+	atomic_store_explicit(&tsc_gen, 0, memory_order_release);
+	atomic_store_explicit(&tsc_enabled, true, memory_order_release);
+
+	return 0;
+#else
+	fr_strerror_printf("TSC is not supported on this platform");
+	return -1;
+#endif
+}
+
 /** Return a relative time since the server our_epoch
  *
  *  This time is useful for doing time comparisons, deltas, etc.
  *  Human (i.e. printable) time is something else.
  *
+ *  Callers which run from an event loop, and don't need
+ *  microsecond precision should use fr_event_list_time()
+ *  instead, which only reads the clock once per iteration.
+ *
  * @returns fr_time_t time in nanoseconds since the server our_epoch.
  */
 fr_time_t fr_time(void)
 {
-#ifdef HAVE_CLOCK_GETTIME
-	struct timespec ts;
-	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
-	return fr_time_delta_from_timespec(&ts) - our_epoch;
-#else  /* __MACH__ is defined */
-	uint64_t when;
-
-	when = mach_absolute_time();
-	when -= our_mach_epoch;
-
-	return when * (timebase.numer / timebase.denom);
+#ifdef HAVE_TSC
+	if (atomic_load_explicit(&tsc_enabled, memory_order_relaxed)) return fr_time_tsc();
 #endif
+
+	return fr_time_monotonic();
 }
 
 /** Nanoseconds since the Unix Epoch the last time we synced internal time with wallclock time
@@ -578,3 +751,47 @@ void fr_time_elapsed_fprint(FILE *fp, fr_time_elapsed_t const *elapsed, char con
 		}
 	}
 }
+
+#ifdef TESTING
+/*
+ *  cc -DTESTING -I ../.. -include freeradius-devel/build.h time.c strerror.c -o time_bench -ltalloc
+ *
+ *  ./time_bench
+ *
+ *  Prints the cost of each way of reading the clock.
+ */
+#define BENCH_CALLS 10000000
+
+static void clock_benchmark(char const *name, fr_time_t (*func)(void))
+{
+	fr_time_t	start, end;
+	int64_t		sum = 0;
+	int		i;
+
+	start = fr_time_monotonic();
+	for (i = 0; i < BENCH_CALLS; i++) sum += func();
+	end = fr_time_monotonic();
+
+	printf("%-10s %" PRId64 "ns/call (%" PRId64 ")\n", name, (end - start) / BENCH_CALLS, sum & 0x01);
+}
+
+int main(UNUSED int argc, UNUSED char **argv)
+{
+	if (fr_time_start() < 0) {
+		fprintf(stderr, "Failed starting time\n");
+		return 1;
+	}
+
+	clock_benchmark("monotonic", fr_time_monotonic);
+	clock_benchmark("fr_time", fr_time);
+
+	if (fr_time_tsc_enable() < 0) {
+		fprintf(stderr, "TSC unavailable: %s\n", fr_strerror());
+		return 0;
+	}
+
+	clock_benchmark("tsc", fr_time);
+
+	return 0;
+}
+#endif
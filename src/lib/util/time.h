@@ -87,6 +87,7 @@ typedef struct {
 
 int fr_time_start(void);
 int fr_time_sync(void);
+int fr_time_tsc_enable(void);
 fr_time_t fr_time(void);
 
 /*
@@ -42,7 +42,9 @@ fr_trie_t	*fr_trie_alloc(TALLOC_CTX *ctx);
 int		fr_trie_insert(fr_trie_t *ft, void const *key, size_t keylen, void const *data) CC_HINT(nonnull);
 void		*fr_trie_lookup(fr_trie_t const *ft, void const *key, size_t keylen) CC_HINT(nonnull);
 void		*fr_trie_match(fr_trie_t const *ft, void const *key, size_t keylen) CC_HINT(nonnull);
+int		fr_trie_lookup_batch(fr_trie_t const *ft, void *out[], void const *keys[], size_t const keylen[], int num) CC_HINT(nonnull);
 void		*fr_trie_remove(fr_trie_t *ft, void const *key, size_t keylen) CC_HINT(nonnull);
+int		fr_trie_freeze(fr_trie_t *ft) CC_HINT(nonnull);
 int		fr_trie_walk(fr_trie_t *ft, void *ctx, fr_trie_walk_t callback) CC_HINT(nonnull(1,3));
 
 #ifdef __cplusplus
@@ -256,3 +256,474 @@ done:
 
 	return received;
 }
+
+/*
+ *	Enough room for IP_PKTINFO / IPV6_PKTINFO and SO_TIMESTAMP.
+ */
+#define UDP_BATCH_CBUF_SIZE	(256)
+
+#ifdef HAVE_RECVMMSG
+#define UDP_BATCH_UNUSED
+#else
+#define UDP_BATCH_UNUSED UNUSED
+#endif
+
+#ifdef HAVE_SENDMMSG
+#define UDP_SEND_BATCH_UNUSED
+#else
+#define UDP_SEND_BATCH_UNUSED UNUSED
+#endif
+
+struct udp_batch_s {
+	size_t			num;			//!< Maximum number of datagrams read per system call.
+	size_t			max_packet_size;	//!< Size of each datagram buffer.
+
+	size_t			received;		//!< Number of datagrams returned by the last read.
+	size_t			next;			//!< Next datagram to return to the caller.
+
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr		*msgvec;		//!< One header per datagram.
+	struct iovec		*iov;			//!< One iovec per datagram.
+	struct sockaddr_storage	*src;			//!< Source address of each datagram.
+	uint8_t			*cbuf;			//!< Auxiliary data (PKTINFO, timestamp) for each datagram.
+	uint8_t			*data;			//!< Packet data for each datagram.
+
+	struct sockaddr_storage	dst;			//!< Local address of the socket.
+	socklen_t		sizeof_dst;		//!< Length of the local address.
+	int			dst_sockfd;		//!< Socket the local address was retrieved for.
+#endif
+};
+
+/** Allocate the state needed to read multiple datagrams with one system call
+ *
+ * If the platform doesn't support recvmmsg(), or num is 1, then
+ * udp_batch_recv() falls back to calling udp_recv() for each datagram.
+ *
+ * @param[in] ctx		to allocate the batch in.
+ * @param[in] num		maximum number of datagrams to read per system call.
+ * @param[in] max_packet_size	maximum size of a datagram.
+ * @return
+ *	- A new batch on success.
+ *	- NULL on failure.
+ */
+udp_batch_t *udp_batch_alloc(TALLOC_CTX *ctx, size_t num, size_t max_packet_size)
+{
+	udp_batch_t	*batch;
+#ifdef HAVE_RECVMMSG
+	size_t		i;
+#endif
+
+	batch = talloc_zero(ctx, udp_batch_t);
+	if (!batch) return NULL;
+
+	if (num < 1) num = 1;
+
+	batch->num = num;
+	batch->max_packet_size = max_packet_size;
+
+#ifdef HAVE_RECVMMSG
+	batch->dst_sockfd = -1;
+
+	if (num == 1) return batch;
+
+	batch->msgvec = talloc_zero_array(batch, struct mmsghdr, num);
+	batch->iov = talloc_zero_array(batch, struct iovec, num);
+	batch->src = talloc_zero_array(batch, struct sockaddr_storage, num);
+	batch->cbuf = talloc_zero_array(batch, uint8_t, num * UDP_BATCH_CBUF_SIZE);
+	batch->data = talloc_array(batch, uint8_t, num * max_packet_size);
+	if (!batch->msgvec || !batch->iov || !batch->src || !batch->cbuf || !batch->data) {
+		talloc_free(batch);
+		return NULL;
+	}
+
+	/*
+	 *	The headers always point to the same buffers, so we
+	 *	only need to reset the lengths before each read.
+	 */
+	for (i = 0; i < num; i++) {
+		batch->iov[i].iov_base = batch->data + (i * max_packet_size);
+		batch->iov[i].iov_len = max_packet_size;
+
+		batch->msgvec[i].msg_hdr.msg_name = &batch->src[i];
+		batch->msgvec[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->msgvec[i].msg_hdr.msg_iovlen = 1;
+		batch->msgvec[i].msg_hdr.msg_control = batch->cbuf + (i * UDP_BATCH_CBUF_SIZE);
+	}
+#endif
+
+	return batch;
+}
+
+/** Return the number of datagrams which have been read from the socket, but not yet returned
+ *
+ * @param[in] batch	to check.
+ * @return the number of datagrams which can be returned without a system call.
+ */
+size_t udp_batch_pending(udp_batch_t const *batch)
+{
+	if (batch->next >= batch->received) return 0;
+
+	return batch->received - batch->next;
+}
+
+/** Read a UDP packet, reading multiple packets from the socket at a time
+ *
+ * The arguments and return values are the same as for udp_recv().
+ * When there are no more buffered datagrams, up to batch->num
+ * datagrams are read with one call to recvmmsg().  Subsequent calls
+ * return the buffered datagrams without calling into the kernel.
+ *
+ * Connected sockets, and requests to peek at the data, are passed
+ * through to udp_recv().
+ *
+ * @param[in] batch	state for buffered datagrams.
+ * @param[in] sockfd	we're reading from.
+ * @param[out] data	pointer where data will be written
+ * @param[in] data_len	length of data to read
+ * @param[in] flags	for things
+ * @param[out] src_ipaddr of the packet.
+ * @param[out] src_port of the packet.
+ * @param[out] dst_ipaddr of the packet.
+ * @param[out] dst_port of the packet.
+ * @param[out] if_index of the interface that received the packet.
+ * @param[out] when the packet was received.
+ * @return
+ *	- > 0 on success (number of bytes read).
+ *	- 0 if there is no data.
+ *	- < 0 on failure.
+ */
+ssize_t udp_batch_recv(UDP_BATCH_UNUSED udp_batch_t *batch, int sockfd, void *data, size_t data_len, int flags,
+		       fr_ipaddr_t *src_ipaddr, uint16_t *src_port,
+		       fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
+		       fr_time_t *when)
+{
+#ifdef HAVE_RECVMMSG
+	size_t			i;
+	size_t			received;
+	struct msghdr		*msgh;
+	struct sockaddr_storage	dst;
+	socklen_t		sizeof_dst;
+	uint16_t		port;
+
+	if ((batch->num == 1) || ((flags & (UDP_FLAGS_CONNECTED | UDP_FLAGS_PEEK)) != 0)) {
+		return udp_recv(sockfd, data, data_len, flags,
+				src_ipaddr, src_port, dst_ipaddr, dst_port, if_index, when);
+	}
+
+	if (when) *when = 0;
+
+	/*
+	 *	No buffered datagrams, go get some more.
+	 */
+	if (batch->next >= batch->received) {
+		int rcode;
+
+		batch->next = batch->received = 0;
+
+		/*
+		 *	recvmmsg() doesn't provide the destination
+		 *	port.  The local address of a bound socket
+		 *	doesn't change, so we only retrieve it once.
+		 *	Doing it before the read means a failure
+		 *	doesn't lose any datagrams.
+		 */
+		if (batch->dst_sockfd != sockfd) {
+			batch->sizeof_dst = sizeof(batch->dst);
+			if (getsockname(sockfd, (struct sockaddr *)&batch->dst, &batch->sizeof_dst) < 0) {
+				fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+				return -1;
+			}
+			batch->dst_sockfd = sockfd;
+		}
+
+		for (i = 0; i < batch->num; i++) {
+			batch->msgvec[i].msg_hdr.msg_namelen = sizeof(batch->src[i]);
+			batch->msgvec[i].msg_hdr.msg_controllen = UDP_BATCH_CBUF_SIZE;
+			batch->msgvec[i].msg_hdr.msg_flags = 0;
+			batch->msgvec[i].msg_len = 0;
+		}
+
+		rcode = recvmmsg(sockfd, batch->msgvec, batch->num, 0, NULL);
+		if (rcode < 0) {
+			if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) return 0;
+
+			fr_strerror_printf("Failed reading socket: %s", fr_syserror(errno));
+			return -1;
+		}
+		if (rcode == 0) return 0;
+
+		batch->received = rcode;
+	}
+
+	i = batch->next++;
+	msgh = &batch->msgvec[i].msg_hdr;
+
+	/*
+	 *	Same as recvfrom(), we discard any data in the packet
+	 *	after "data_len" bytes.
+	 */
+	received = batch->msgvec[i].msg_len;
+	if (received > data_len) received = data_len;
+	memcpy(data, batch->iov[i].iov_base, received);
+
+	dst = batch->dst;
+	sizeof_dst = batch->sizeof_dst;
+
+#ifdef WITH_UDPFROMTO
+	udpfromto_cmsg(msgh, (struct sockaddr *)&dst, &sizeof_dst, if_index, when);
+#else
+	if (if_index) *if_index = 0;
+#endif
+
+	if (fr_ipaddr_from_sockaddr(&batch->src[i], msgh->msg_namelen, src_ipaddr, &port) < 0) {
+		fr_strerror_printf_push("Failed converting sockaddr to ipaddr");
+		return -1;
+	}
+
+	*src_port = port;
+
+	if (dst_ipaddr) {
+		fr_ipaddr_from_sockaddr(&dst, sizeof_dst, dst_ipaddr, &port);
+		*dst_port = port;
+	}
+
+	/*
+	 *	We didn't get it from the kernel
+	 *	so use our own time source.
+	 */
+	if (when && !*when) *when = fr_time();
+
+	return received;
+#else
+	return udp_recv(sockfd, data, data_len, flags,
+			src_ipaddr, src_port, dst_ipaddr, dst_port, if_index, when);
+#endif
+}
+
+struct udp_send_batch_s {
+	size_t			num;			//!< Maximum number of datagrams written per system call.
+	size_t			max_packet_size;	//!< Size of each datagram buffer.
+
+	size_t			queued;			//!< Number of datagrams in the batch.
+	size_t			sent;			//!< Number of datagrams already written.
+	fr_time_t		oldest;			//!< When the first datagram was added to the batch.
+
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr		*msgvec;		//!< One header per datagram.
+	struct iovec		*iov;			//!< One iovec per datagram.
+	struct sockaddr_storage	*dst;			//!< Destination address of each datagram.
+	uint8_t			*cbuf;			//!< Auxiliary data (source address) for each datagram.
+	uint8_t			*data;			//!< Packet data for each datagram.
+#endif
+};
+
+/** Allocate the state needed to write multiple datagrams with one system call
+ *
+ * If the platform doesn't support sendmmsg(), or num is 1, then
+ * udp_send_batch_add() writes each datagram immediately with udp_send().
+ *
+ * @param[in] ctx		to allocate the batch in.
+ * @param[in] num		maximum number of datagrams to write per system call.
+ * @param[in] max_packet_size	maximum size of a datagram.
+ * @return
+ *	- A new batch on success.
+ *	- NULL on failure.
+ */
+udp_send_batch_t *udp_send_batch_alloc(TALLOC_CTX *ctx, size_t num, size_t max_packet_size)
+{
+	udp_send_batch_t	*batch;
+#ifdef HAVE_SENDMMSG
+	size_t			i;
+#endif
+
+	batch = talloc_zero(ctx, udp_send_batch_t);
+	if (!batch) return NULL;
+
+	if (num < 1) num = 1;
+
+#ifndef HAVE_SENDMMSG
+	num = 1;
+#endif
+
+	batch->num = num;
+	batch->max_packet_size = max_packet_size;
+
+#ifdef HAVE_SENDMMSG
+	if (num == 1) return batch;
+
+	batch->msgvec = talloc_zero_array(batch, struct mmsghdr, num);
+	batch->iov = talloc_zero_array(batch, struct iovec, num);
+	batch->dst = talloc_zero_array(batch, struct sockaddr_storage, num);
+	batch->cbuf = talloc_zero_array(batch, uint8_t, num * UDP_BATCH_CBUF_SIZE);
+	batch->data = talloc_array(batch, uint8_t, num * max_packet_size);
+	if (!batch->msgvec || !batch->iov || !batch->dst || !batch->cbuf || !batch->data) {
+		talloc_free(batch);
+		return NULL;
+	}
+
+	for (i = 0; i < num; i++) {
+		batch->iov[i].iov_base = batch->data + (i * max_packet_size);
+
+		batch->msgvec[i].msg_hdr.msg_name = &batch->dst[i];
+		batch->msgvec[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->msgvec[i].msg_hdr.msg_iovlen = 1;
+	}
+#endif
+
+	return batch;
+}
+
+/** Return the number of datagrams which are waiting to be written
+ *
+ * @param[in] batch	to check.
+ * @return the number of datagrams in the batch.
+ */
+size_t udp_send_batch_pending(udp_send_batch_t const *batch)
+{
+	return batch->queued - batch->sent;
+}
+
+/** Return whether there's room for more datagrams in the batch
+ *
+ * @param[in] batch	to check.
+ * @return true if udp_send_batch_flush() has to be called before adding more datagrams.
+ */
+bool udp_send_batch_full(udp_send_batch_t const *batch)
+{
+	return (batch->num > 1) && (batch->queued == batch->num);
+}
+
+/** Return when the oldest datagram in the batch was added
+ *
+ * @param[in] batch	to check.
+ * @return when the oldest datagram was added, or 0 if the batch is empty.
+ */
+fr_time_t udp_send_batch_oldest(udp_send_batch_t const *batch)
+{
+	if (batch->queued == batch->sent) return 0;
+
+	return batch->oldest;
+}
+
+/** Add a datagram to a batch
+ *
+ * The data is copied, so the caller can free or re-use the buffer as
+ * soon as this function returns.
+ *
+ * @param[in] batch	to add the datagram to.
+ * @param[in] sockfd	we're writing to.  Only used if batching is disabled.
+ * @param[in] data	pointer to data to send
+ * @param[in] data_len	length of data to send
+ * @param[in] flags	to pass to udp_send().
+ * @param[in] src_ipaddr of the packet.
+ * @param[in] src_port of the packet.
+ * @param[in] if_index of the packet.
+ * @param[in] dst_ipaddr of the packet.
+ * @param[in] dst_port of the packet.
+ * @return
+ *	- >= 0 on success.
+ *	- < 0 on failure, including when the batch is full.
+ */
+ssize_t udp_send_batch_add(udp_send_batch_t *batch, int sockfd, void *data, size_t data_len, int flags,
+			   fr_ipaddr_t const *src_ipaddr, uint16_t src_port, int if_index,
+			   fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port)
+{
+#ifdef HAVE_SENDMMSG
+	size_t			i;
+	struct msghdr		*msgh;
+	socklen_t		sizeof_dst;
+#endif
+
+	if ((batch->num == 1) || ((flags & UDP_FLAGS_CONNECTED) != 0)) {
+		return udp_send(sockfd, data, data_len, flags,
+				src_ipaddr, src_port, if_index, dst_ipaddr, dst_port);
+	}
+
+#ifdef HAVE_SENDMMSG
+	if (batch->queued == batch->num) {
+		fr_strerror_printf("Send batch is full");
+		errno = EWOULDBLOCK;
+		return -1;
+	}
+
+	if (data_len > batch->max_packet_size) {
+		fr_strerror_printf("Packet is larger than the maximum size of %zu", batch->max_packet_size);
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	i = batch->queued;
+	msgh = &batch->msgvec[i].msg_hdr;
+
+	if (fr_ipaddr_to_sockaddr(dst_ipaddr, dst_port, &batch->dst[i], &sizeof_dst) < 0) return -1;
+	msgh->msg_namelen = sizeof_dst;
+
+	memcpy(batch->iov[i].iov_base, data, data_len);
+	batch->iov[i].iov_len = data_len;
+
+	msgh->msg_control = NULL;
+	msgh->msg_controllen = 0;
+
+#ifdef WITH_UDPFROMTO
+	/*
+	 *	Same rules as udp_send().  If they don't specify a
+	 *	source IP address, don't set one.
+	 */
+	if ((src_ipaddr->af != AF_UNSPEC) && (dst_ipaddr->af != AF_UNSPEC) &&
+	    !fr_ipaddr_is_inaddr_any(src_ipaddr)) {
+		struct sockaddr_storage	src;
+		socklen_t		sizeof_src;
+
+		fr_ipaddr_to_sockaddr(src_ipaddr, src_port, &src, &sizeof_src);
+		udpfromto_cmsg_src(msgh, batch->cbuf + (i * UDP_BATCH_CBUF_SIZE), (struct sockaddr *)&src, if_index);
+	}
+#endif
+
+	if (batch->queued == batch->sent) batch->oldest = fr_time();
+	batch->queued++;
+
+	return data_len;
+#else
+	return -1;
+#endif
+}
+
+/** Write all of the datagrams in a batch
+ *
+ * If the socket isn't writable, the unsent datagrams are kept in the
+ * batch, and the caller should try again later.
+ *
+ * @param[in] batch	to write.
+ * @param[in] sockfd	we're writing to.
+ * @return
+ *	- >= 0 the number of datagrams written.
+ *	- < 0 on failure.  All datagrams in the batch are discarded.
+ */
+int udp_send_batch_flush(UDP_SEND_BATCH_UNUSED udp_send_batch_t *batch, UDP_SEND_BATCH_UNUSED int sockfd)
+{
+#ifdef HAVE_SENDMMSG
+	int			total = 0;
+
+	while (batch->sent < batch->queued) {
+		int rcode;
+
+		rcode = sendmmsg(sockfd, &batch->msgvec[batch->sent], batch->queued - batch->sent, 0);
+		if (rcode < 0) {
+			if ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR)) return total;
+
+			fr_strerror_printf("udp_sendmmsg failed: %s", fr_syserror(errno));
+			batch->queued = batch->sent = 0;
+			return -1;
+		}
+
+		batch->sent += rcode;
+		total += rcode;
+	}
+
+	batch->queued = batch->sent = 0;
+
+	return total;
+#else
+	return 0;
+#endif
+}
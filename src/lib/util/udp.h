@@ -34,11 +34,22 @@ extern "C" {
 #endif
 #include <freeradius-devel/util/inet.h>
 #include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/talloc.h>
 
 #define UDP_FLAGS_NONE		(0)
 #define UDP_FLAGS_CONNECTED	(1 << 0)
 #define UDP_FLAGS_PEEK		(1 << 1)
 
+/** State for reading multiple datagrams with one system call
+ *
+ */
+typedef struct udp_batch_s udp_batch_t;
+
+/** State for writing multiple datagrams with one system call
+ *
+ */
+typedef struct udp_send_batch_s udp_send_batch_t;
+
 ssize_t udp_send(int sockfd, void *data, size_t data_len, int flags,
 		 fr_ipaddr_t const *src_ipaddr, uint16_t src_port, int if_index,
 		 fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port);
@@ -52,6 +63,29 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 		 fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
 		 fr_time_t *when);
 
+udp_batch_t *udp_batch_alloc(TALLOC_CTX *ctx, size_t num, size_t max_packet_size);
+
+ssize_t udp_batch_recv(udp_batch_t *batch, int sockfd, void *data, size_t data_len, int flags,
+		       fr_ipaddr_t *src_ipaddr, uint16_t *src_port,
+		       fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
+		       fr_time_t *when);
+
+size_t udp_batch_pending(udp_batch_t const *batch);
+
+udp_send_batch_t *udp_send_batch_alloc(TALLOC_CTX *ctx, size_t num, size_t max_packet_size);
+
+ssize_t udp_send_batch_add(udp_send_batch_t *batch, int sockfd, void *data, size_t data_len, int flags,
+			   fr_ipaddr_t const *src_ipaddr, uint16_t src_port, int if_index,
+			   fr_ipaddr_t const *dst_ipaddr, uint16_t dst_port);
+
+int udp_send_batch_flush(udp_send_batch_t *batch, int sockfd);
+
+size_t udp_send_batch_pending(udp_send_batch_t const *batch);
+
+bool udp_send_batch_full(udp_send_batch_t const *batch);
+
+fr_time_t udp_send_batch_oldest(udp_send_batch_t const *batch);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,441 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Receive UDP datagrams through a memory mapped packet ring
+ *
+ * On Linux, a TPACKET_V3 ring lets the kernel write datagrams into
+ * memory which we share with it.  We can then read many datagrams
+ * without making any system calls, and without the per-socket
+ * locking of recvmsg().
+ *
+ * The kernel still delivers the datagrams to the normal UDP socket,
+ * which we need for sending replies.  udp_recv_disable() attaches a
+ * filter to that socket which drops everything, so that the
+ * datagrams aren't queued twice.
+ *
+ * Only IPv4 is supported.  Fragmented datagrams are ignored, and
+ * must be read from the normal UDP socket instead.
+ *
+ * @file src/lib/util/udp_ring.c
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/udp_ring.h>
+#include <freeradius-devel/util/net.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+#  include <linux/if_packet.h>
+#  include <linux/if_ether.h>
+#  include <linux/filter.h>
+#  include <net/if.h>
+#  include <sys/mman.h>
+#endif
+
+#ifdef TPACKET3_HDRLEN
+#define UDP_RING_BLOCK_SIZE	(1 << 20)	//!< Must be a multiple of the page size.
+#define UDP_RING_FRAME_SIZE	(1 << 11)
+#define UDP_RING_TIMEOUT	(1)		//!< Milliseconds before the kernel hands us a partly full block.
+
+struct udp_ring_s {
+	int			fd;			//!< Packet socket.
+
+	uint8_t			*map;			//!< The ring, shared with the kernel.
+	size_t			map_size;		//!< Size of the mapping.
+	unsigned int		num_blocks;		//!< Number of blocks in the ring.
+
+	unsigned int		block;			//!< The block we're reading, or will read next.
+	struct tpacket_block_desc *desc;		//!< The block we're reading, if the kernel has given it to us.
+	struct tpacket3_hdr	*next;			//!< The next datagram in the block.
+	uint32_t		remaining;		//!< Number of datagrams left in the block.
+};
+
+static int _udp_ring_free(udp_ring_t *ring)
+{
+	if (ring->map) (void) munmap(ring->map, ring->map_size);
+	if (ring->fd >= 0) close(ring->fd);
+
+	return 0;
+}
+
+/** Allocate a receive ring for datagrams sent to an address and port
+ *
+ * All of the rings for the same port share the datagrams between
+ * them, so each network thread can have its own.
+ *
+ * @param[in] ctx		to allocate the ring in.
+ * @param[in] interface		to read datagrams from, or NULL for all interfaces.
+ * @param[in] ipaddr		destination address of the datagrams.  May be INADDR_ANY.
+ * @param[in] port		destination port of the datagrams.
+ * @param[in] ring_size		how much memory to share with the kernel.
+ * @return
+ *	- A new ring on success.
+ *	- NULL on failure.
+ */
+udp_ring_t *udp_ring_alloc(TALLOC_CTX *ctx, char const *interface,
+			   fr_ipaddr_t const *ipaddr, uint16_t port, size_t ring_size)
+{
+	udp_ring_t		*ring;
+	int			version = TPACKET_V3;
+	struct tpacket_req3	req;
+	struct sockaddr_ll	sll;
+	void			*map;
+	struct sock_fprog	prog;
+
+	/*
+	 *	Accept IPv4 UDP datagrams to our address and port,
+	 *	which aren't fragments, and which we didn't send.
+	 *	Offsets are from the start of the IP header.
+	 */
+	struct sock_filter	filter[] = {
+		/* 0 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+		/* 1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 11, 0),
+		/* 2 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+		/* 3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 9),
+		/* 4 */ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+		/* 5 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 7, 0),
+		/* 6 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 16),
+		/* 7 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(ipaddr->addr.v4.s_addr), 1, 0),
+		/* 8 */ BPF_STMT(BPF_RET | BPF_K, 0),
+		/* 9 */ BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+		/* 10 */ BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),
+		/* 11 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+		/* 12 */ BPF_STMT(BPF_RET | BPF_K, UINT16_MAX),
+		/* 13 */ BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+
+	if (ipaddr->af != AF_INET) {
+		fr_strerror_printf("Packet rings only support IPv4");
+		return NULL;
+	}
+
+	/*
+	 *	Any destination address matches.
+	 */
+	if (ipaddr->addr.v4.s_addr == htonl(INADDR_ANY)) {
+		filter[7] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JA, 1, 0, 0);
+	}
+
+	ring = talloc_zero(ctx, udp_ring_t);
+	if (!ring) {
+		fr_strerror_printf("Failed allocating memory");
+		return NULL;
+	}
+	ring->fd = -1;
+	talloc_set_destructor(ring, _udp_ring_free);
+
+	/*
+	 *	We don't get any datagrams until we bind, so set
+	 *	everything up first.
+	 */
+	ring->fd = socket(AF_PACKET, SOCK_DGRAM, 0);
+	if (ring->fd < 0) {
+		fr_strerror_printf("Failed opening packet socket: %s", fr_syserror(errno));
+	error:
+		talloc_free(ring);
+		return NULL;
+	}
+
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		fr_strerror_printf("Failed setting TPACKET_V3: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	ring->num_blocks = ring_size / UDP_RING_BLOCK_SIZE;
+	if (ring->num_blocks < 2) ring->num_blocks = 2;
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = UDP_RING_BLOCK_SIZE;
+	req.tp_block_nr = ring->num_blocks;
+	req.tp_frame_size = UDP_RING_FRAME_SIZE;
+	req.tp_frame_nr = (UDP_RING_BLOCK_SIZE / UDP_RING_FRAME_SIZE) * ring->num_blocks;
+	req.tp_retire_blk_tov = UDP_RING_TIMEOUT;
+
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		fr_strerror_printf("Failed creating packet ring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	ring->map_size = (size_t) UDP_RING_BLOCK_SIZE * ring->num_blocks;
+	map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if (map == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping packet ring: %s", fr_syserror(errno));
+		goto error;
+	}
+	ring->map = map;
+
+	prog.len = NUM_ELEMENTS(filter);
+	prog.filter = filter;
+	if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		fr_strerror_printf("Failed attaching packet filter: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_IP);
+	if (interface) {
+		sll.sll_ifindex = if_nametoindex(interface);
+		if (!sll.sll_ifindex) {
+			fr_strerror_printf("Unknown interface %s", interface);
+			goto error;
+		}
+	}
+
+	if (bind(ring->fd, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
+		fr_strerror_printf("Failed binding packet socket: %s", fr_syserror(errno));
+		goto error;
+	}
+
+#ifdef PACKET_FANOUT
+	/*
+	 *	Share the datagrams with the other rings for this
+	 *	port, keeping each flow on the same ring.
+	 */
+	{
+		int fanout = port | (PACKET_FANOUT_HASH << 16);
+
+		if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0) {
+			fr_strerror_printf("Failed joining packet fanout group: %s", fr_syserror(errno));
+			goto error;
+		}
+	}
+#endif
+
+	return ring;
+}
+
+/** Return the file descriptor to watch for datagrams
+ *
+ */
+int udp_ring_fd(udp_ring_t const *ring)
+{
+	return ring->fd;
+}
+
+/** Give a block back to the kernel, once we've read all of it
+ *
+ */
+static inline CC_HINT(always_inline) void udp_ring_release(udp_ring_t *ring)
+{
+	if (!ring->desc || ring->remaining) return;
+
+	__atomic_store_n(&ring->desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+
+	ring->desc = NULL;
+	ring->block = (ring->block + 1) % ring->num_blocks;
+}
+
+/** Read one datagram from the ring
+ *
+ * The arguments are the same as for udp_recv().
+ *
+ * @return
+ *	- > 0 the length of the datagram.
+ *	- 0 if there are no datagrams waiting.
+ */
+ssize_t udp_ring_recv(udp_ring_t *ring, void *data, size_t data_len,
+		      fr_ipaddr_t *src_ipaddr, uint16_t *src_port,
+		      fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
+		      fr_time_t *when)
+{
+	struct tpacket3_hdr	*hdr;
+	struct sockaddr_ll const *sll;
+	ip_header_t const	*ip;
+	udp_header_t const	*udp;
+	uint8_t const		*p;
+	size_t			ihl, ip_len, payload_len;
+
+next:
+	if (!ring->desc) {
+		struct tpacket_block_desc *desc;
+
+		desc = (struct tpacket_block_desc *) (ring->map + ((size_t) ring->block * UDP_RING_BLOCK_SIZE));
+		if (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) return 0;
+
+		ring->desc = desc;
+		ring->remaining = desc->hdr.bh1.num_pkts;
+		ring->next = (struct tpacket3_hdr *) (((uint8_t *) desc) + desc->hdr.bh1.offset_to_first_pkt);
+
+		if (!ring->remaining) {
+			udp_ring_release(ring);
+			goto next;
+		}
+	}
+
+	hdr = ring->next;
+	ring->next = (struct tpacket3_hdr *) (((uint8_t *) hdr) + hdr->tp_next_offset);
+	ring->remaining--;
+
+	/*
+	 *	The filter should have dropped these, but it's cheap
+	 *	to check.
+	 */
+	sll = (struct sockaddr_ll const *) (((uint8_t *) hdr) + TPACKET_ALIGN(sizeof(*hdr)));
+	if (sll->sll_pkttype == PACKET_OUTGOING) goto skip;
+
+	p = ((uint8_t const *) hdr) + hdr->tp_net;
+	ip = (ip_header_t const *) p;
+
+	if ((hdr->tp_snaplen < (sizeof(*ip) + sizeof(*udp))) || ((ip->ip_vhl >> 4) != 4)) goto skip;
+
+	ihl = (ip->ip_vhl & 0x0f) * 4;
+	ip_len = ntohs(ip->ip_len);
+	if ((ihl < sizeof(*ip)) || (ip_len > hdr->tp_snaplen) || (ip_len < (ihl + sizeof(*udp)))) goto skip;
+
+	udp = (udp_header_t const *) (p + ihl);
+
+	/*
+	 *	Only check the UDP checksum if there is one, and the
+	 *	hardware hasn't already checked it.
+	 */
+#ifdef TP_STATUS_CSUM_VALID
+	if (udp->checksum && !(hdr->tp_status & TP_STATUS_CSUM_VALID)) {
+#else
+	if (udp->checksum) {
+#endif
+		if (fr_udp_header_check((uint8_t const *) udp, ip_len - ihl, ip) != 0) goto skip;
+
+	} else if (ntohs(udp->len) != (ip_len - ihl)) {
+		goto skip;
+	}
+
+	payload_len = ip_len - ihl - sizeof(*udp);
+	if (payload_len > data_len) goto skip;
+
+	memcpy(data, ((uint8_t const *) udp) + sizeof(*udp), payload_len);
+
+	if (src_ipaddr) {
+		memset(src_ipaddr, 0, sizeof(*src_ipaddr));
+		src_ipaddr->af = AF_INET;
+		src_ipaddr->prefix = 32;
+		src_ipaddr->addr.v4 = ip->ip_src;
+	}
+	if (src_port) *src_port = ntohs(udp->src);
+
+	if (dst_ipaddr) {
+		memset(dst_ipaddr, 0, sizeof(*dst_ipaddr));
+		dst_ipaddr->af = AF_INET;
+		dst_ipaddr->prefix = 32;
+		dst_ipaddr->addr.v4 = ip->ip_dst;
+	}
+	if (dst_port) *dst_port = ntohs(udp->dst);
+
+	if (if_index) *if_index = sll->sll_ifindex;
+	if (when) *when = fr_time();
+
+	udp_ring_release(ring);
+
+	return payload_len;
+
+skip:
+	udp_ring_release(ring);
+	goto next;
+}
+
+/** Return the number of datagrams which can be read without waiting
+ *
+ */
+size_t udp_ring_pending(udp_ring_t const *ring)
+{
+	return ring->remaining;
+}
+
+/** Stop a UDP socket from queueing any datagrams
+ *
+ * Used when the datagrams are read from a ring, and the socket is
+ * only for writing replies.
+ *
+ * @param[in] sockfd	to stop reading from.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int udp_recv_disable(int sockfd)
+{
+	struct sock_filter	filter[] = {
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog	prog;
+
+	prog.len = NUM_ELEMENTS(filter);
+	prog.filter = filter;
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		fr_strerror_printf("Failed attaching filter: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Undo udp_recv_disable()
+ *
+ * @param[in] sockfd	to read from again.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int udp_recv_enable(int sockfd)
+{
+	if ((setsockopt(sockfd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0) < 0) && (errno != ENOENT)) {
+		fr_strerror_printf("Failed detaching filter: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+#else
+udp_ring_t *udp_ring_alloc(UNUSED TALLOC_CTX *ctx, UNUSED char const *interface,
+			   UNUSED fr_ipaddr_t const *ipaddr, UNUSED uint16_t port, UNUSED size_t ring_size)
+{
+	fr_strerror_printf("Packet rings are not supported on this system");
+	return NULL;
+}
+
+int udp_ring_fd(UNUSED udp_ring_t const *ring)
+{
+	return -1;
+}
+
+ssize_t udp_ring_recv(UNUSED udp_ring_t *ring, UNUSED void *data, UNUSED size_t data_len,
+		      UNUSED fr_ipaddr_t *src_ipaddr, UNUSED uint16_t *src_port,
+		      UNUSED fr_ipaddr_t *dst_ipaddr, UNUSED uint16_t *dst_port, UNUSED int *if_index,
+		      UNUSED fr_time_t *when)
+{
+	return 0;
+}
+
+size_t udp_ring_pending(UNUSED udp_ring_t const *ring)
+{
+	return 0;
+}
+
+int udp_recv_disable(UNUSED int sockfd)
+{
+	fr_strerror_printf("Packet rings are not supported on this system");
+	return -1;
+}
+
+int udp_recv_enable(UNUSED int sockfd)
+{
+	return 0;
+}
+#endif
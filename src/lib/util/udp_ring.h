@@ -0,0 +1,59 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Receive UDP datagrams through a memory mapped packet ring
+ *
+ * @file src/lib/util/udp_ring.h
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSIDH(udp_ring_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/missing.h>
+#include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/talloc.h>
+
+/** State for a memory mapped receive ring
+ *
+ */
+typedef struct udp_ring_s udp_ring_t;
+
+udp_ring_t	*udp_ring_alloc(TALLOC_CTX *ctx, char const *interface,
+				fr_ipaddr_t const *ipaddr, uint16_t port, size_t ring_size);
+
+int		udp_ring_fd(udp_ring_t const *ring) CC_HINT(nonnull);
+
+ssize_t		udp_ring_recv(udp_ring_t *ring, void *data, size_t data_len,
+			      fr_ipaddr_t *src_ipaddr, uint16_t *src_port,
+			      fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
+			      fr_time_t *when) CC_HINT(nonnull(1,2));
+
+size_t		udp_ring_pending(udp_ring_t const *ring) CC_HINT(nonnull);
+
+int		udp_recv_disable(int sockfd);
+
+int		udp_recv_enable(int sockfd);
+
+#ifdef __cplusplus
+}
+#endif
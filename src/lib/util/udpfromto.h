@@ -37,6 +37,12 @@ extern "C" {
 #include <netinet/in.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+
+/*
+ *	Enough room for the auxiliary data we send and receive.
+ */
+#define UDPFROMTO_CMSG_SIZE	(256)
 
 int	udpfromto_init(int s);
 
@@ -45,6 +51,11 @@ int	recvfromto(int s, void *buf, size_t len, int flags,
 		   struct sockaddr *to, socklen_t *tolen,
 		   int *if_index, fr_time_t *when);
 
+void	udpfromto_cmsg(struct msghdr *msgh, struct sockaddr *to, socklen_t *to_len,
+		       int *if_index, fr_time_t *when);
+
+void	udpfromto_cmsg_src(struct msghdr *msgh, void *cbuf, struct sockaddr *from, int if_index);
+
 int	sendfromto(int s, void *buf, size_t len, int flags,
 		   struct sockaddr *from, socklen_t fromlen,
 		   struct sockaddr *to, socklen_t tolen,
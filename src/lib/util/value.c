@@ -3049,6 +3049,424 @@ int fr_value_box_cast_in_place(TALLOC_CTX *ctx, fr_value_box_t *vb,
 	return 0;
 }
 
+/*
+ *	Specialised cast kernels
+ *
+ *	These handle the common forms of the type pairs that show
+ *	up most often at runtime (mainly strings from xlat expansions
+ *	being cast to integers and IP addresses, and back again),
+ *	without going through the generic dispatch, or printing to
+ *	and parsing from intermediary talloced buffers.
+ *
+ *	Each kernel has the same signature as #fr_value_box_cast
+ *	and produces identical output.  Anything outside the fast
+ *	path is passed to #fr_value_box_cast, so a kernel can be
+ *	called with any input box.
+ */
+
+/** Parse a string of plain decimal digits as an integer
+ *
+ * Strings with whitespace, hex prefixes, enumeration names, or which
+ * overflow the destination type, go through #fr_value_box_from_str.
+ */
+static int cast_string_to_integer(TALLOC_CTX *ctx, fr_value_box_t *dst,
+				  fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
+				  fr_value_box_t const *src)
+{
+	char const	*p, *end;
+	uint64_t	num = 0;
+	bool		negative = false;
+
+	if ((src->type != FR_TYPE_STRING) || (src == dst) ||
+	    (dst_enumv && dst_enumv->flags.has_value)) {
+	generic:
+		return fr_value_box_cast(ctx, dst, dst_type, dst_enumv, src);
+	}
+
+	p = src->vb_strvalue;
+	end = p + src->vb_length;
+
+	if ((p < end) && (*p == '-')) {
+		negative = true;
+		p++;
+	}
+
+	/*
+	 *	19 digits can't overflow a uint64_t, anything
+	 *	longer is rare enough to take the slow path.
+	 */
+	if ((p == end) || ((end - p) > 19)) goto generic;
+
+	while (p < end) {
+		if ((*p < '0') || (*p > '9')) goto generic;
+		num = (num * 10) + (*p++ - '0');
+	}
+
+	memset(dst, 0, sizeof(*dst));
+
+	switch (dst_type) {
+	case FR_TYPE_UINT8:
+		if (negative || (num > UINT8_MAX)) goto generic;
+		dst->vb_uint8 = num;
+		break;
+
+	case FR_TYPE_UINT16:
+		if (negative || (num > UINT16_MAX)) goto generic;
+		dst->vb_uint16 = num;
+		break;
+
+	case FR_TYPE_UINT32:
+		if (negative || (num > UINT32_MAX)) goto generic;
+		dst->vb_uint32 = num;
+		break;
+
+	case FR_TYPE_UINT64:
+		if (negative) goto generic;
+		dst->vb_uint64 = num;
+		break;
+
+	case FR_TYPE_INT8:
+		if (num > (negative ? (uint64_t) INT8_MAX + 1 : INT8_MAX)) goto generic;
+		dst->vb_int8 = negative ? -(int64_t) num : (int64_t) num;
+		break;
+
+	case FR_TYPE_INT16:
+		if (num > (negative ? (uint64_t) INT16_MAX + 1 : INT16_MAX)) goto generic;
+		dst->vb_int16 = negative ? -(int64_t) num : (int64_t) num;
+		break;
+
+	case FR_TYPE_INT32:
+		if (num > (negative ? (uint64_t) INT32_MAX + 1 : INT32_MAX)) goto generic;
+		dst->vb_int32 = negative ? -(int64_t) num : (int64_t) num;
+		break;
+
+	case FR_TYPE_INT64:
+		if (num > (uint64_t) INT64_MAX) goto generic;	/* 19 digits, so INT64_MIN takes the slow path */
+		dst->vb_int64 = negative ? -(int64_t) num : (int64_t) num;
+		break;
+
+	default:
+		goto generic;
+	}
+
+	dst->type = dst_type;
+	dst->datum.length = dict_attr_sizes[dst_type][1];
+	dst->tainted = src->tainted;
+	dst->enumv = dst_enumv;
+
+	return 0;
+}
+
+/** Write the presentation format of an integer into a string box
+ *
+ * Integers with enumeration names go through #fr_value_box_asprint.
+ */
+static int cast_integer_to_string(TALLOC_CTX *ctx, fr_value_box_t *dst,
+				  fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
+				  fr_value_box_t const *src)
+{
+	char		buffer[24];		/* Enough for any int64_t and a sign */
+	char		*p = buffer + sizeof(buffer);
+	uint64_t	num;
+	bool		negative = false;
+	char		*out;
+
+	if ((dst_type != FR_TYPE_STRING) || (src == dst) ||
+	    (src->enumv && src->enumv->flags.has_value)) {
+	generic:
+		return fr_value_box_cast(ctx, dst, dst_type, dst_enumv, src);
+	}
+
+	switch (src->type) {
+	case FR_TYPE_UINT8:
+		num = src->vb_uint8;
+		break;
+
+	case FR_TYPE_UINT16:
+		num = src->vb_uint16;
+		break;
+
+	case FR_TYPE_UINT32:
+		num = src->vb_uint32;
+		break;
+
+	case FR_TYPE_UINT64:
+		num = src->vb_uint64;
+		break;
+
+#define SIGNED_TO_NUM(_field) \
+		do { \
+			negative = (src->_field < 0); \
+			num = negative ? -(uint64_t) src->_field : (uint64_t) src->_field; \
+		} while (0)
+
+	case FR_TYPE_INT8:
+		SIGNED_TO_NUM(vb_int8);
+		break;
+
+	case FR_TYPE_INT16:
+		SIGNED_TO_NUM(vb_int16);
+		break;
+
+	case FR_TYPE_INT32:
+		SIGNED_TO_NUM(vb_int32);
+		break;
+
+	case FR_TYPE_INT64:
+		SIGNED_TO_NUM(vb_int64);
+		break;
+#undef SIGNED_TO_NUM
+
+	default:
+		goto generic;
+	}
+
+	do {
+		*--p = '0' + (num % 10);
+		num /= 10;
+	} while (num);
+	if (negative) *--p = '-';
+
+	out = talloc_bstrndup(ctx, p, (buffer + sizeof(buffer)) - p);
+	if (!out) return -1;
+
+	memset(dst, 0, sizeof(*dst));
+	dst->type = FR_TYPE_STRING;
+	dst->vb_strvalue = out;
+	dst->datum.length = (buffer + sizeof(buffer)) - p;
+	dst->enumv = dst_enumv;
+
+	return 0;
+}
+
+/** Parse a dotted quad as an IPv4 address
+ *
+ * Anything else (integers, hostnames, prefixes, '*') goes through
+ * #fr_inet_pton4 via #fr_value_box_from_str.
+ */
+static int cast_string_to_ipv4addr(TALLOC_CTX *ctx, fr_value_box_t *dst,
+				   fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
+				   fr_value_box_t const *src)
+{
+	char const	*p, *end;
+	uint32_t	addr = 0;
+	unsigned int	octet, digits, dots = 0;
+
+	if ((src->type != FR_TYPE_STRING) || (dst_type != FR_TYPE_IPV4_ADDR) || (src == dst) ||
+	    (dst_enumv && dst_enumv->flags.has_value)) {
+	generic:
+		return fr_value_box_cast(ctx, dst, dst_type, dst_enumv, src);
+	}
+
+	p = src->vb_strvalue;
+	end = p + src->vb_length;
+
+	for (;;) {
+		octet = 0;
+		for (digits = 0; (p < end) && (*p >= '0') && (*p <= '9'); digits++, p++) {
+			if (digits == 3) goto generic;
+			octet = (octet * 10) + (*p - '0');
+		}
+		if (!digits || (octet > 255)) goto generic;
+		addr = (addr << 8) | octet;
+
+		if (p == end) break;
+		if ((*p != '.') || (++dots > 3)) goto generic;
+		p++;
+	}
+	if (dots != 3) goto generic;
+
+	memset(dst, 0, sizeof(*dst));
+	dst->type = FR_TYPE_IPV4_ADDR;
+	dst->vb_ip.af = AF_INET;
+	dst->vb_ip.prefix = 32;
+	dst->vb_ip.addr.v4.s_addr = htonl(addr);
+	dst->datum.length = dict_attr_sizes[FR_TYPE_IPV4_ADDR][1];
+	dst->tainted = src->tainted;
+	dst->enumv = dst_enumv;
+
+	return 0;
+}
+
+/** Write an IPv4 address as a dotted quad into a string box
+ *
+ */
+static int cast_ipv4addr_to_string(TALLOC_CTX *ctx, fr_value_box_t *dst,
+				   fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
+				   fr_value_box_t const *src)
+{
+	char		buffer[INET_ADDRSTRLEN];
+	char		*p = buffer;
+	uint8_t const	*addr;
+	unsigned int	i, octet;
+	char		*out;
+
+	if ((src->type != FR_TYPE_IPV4_ADDR) || (dst_type != FR_TYPE_STRING) || (src == dst) ||
+	    (src->enumv && src->enumv->flags.has_value)) {
+		return fr_value_box_cast(ctx, dst, dst_type, dst_enumv, src);
+	}
+
+	addr = (uint8_t const *) &src->vb_ip.addr.v4.s_addr;
+	for (i = 0; i < 4; i++) {
+		octet = addr[i];
+		if (octet >= 100) *p++ = '0' + (octet / 100);
+		if (octet >= 10) *p++ = '0' + ((octet / 10) % 10);
+		*p++ = '0' + (octet % 10);
+		if (i < 3) *p++ = '.';
+	}
+
+	out = talloc_bstrndup(ctx, buffer, p - buffer);
+	if (!out) return -1;
+
+	memset(dst, 0, sizeof(*dst));
+	dst->type = FR_TYPE_STRING;
+	dst->vb_strvalue = out;
+	dst->datum.length = p - buffer;
+	dst->enumv = dst_enumv;
+
+	return 0;
+}
+
+/** Copy raw octets into a string box
+ *
+ */
+static int cast_octets_to_string(TALLOC_CTX *ctx, fr_value_box_t *dst,
+				 fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
+				 fr_value_box_t const *src)
+{
+	char *out;
+
+	if ((src->type != FR_TYPE_OCTETS) || (dst_type != FR_TYPE_STRING) || (src == dst)) {
+		return fr_value_box_cast(ctx, dst, dst_type, dst_enumv, src);
+	}
+
+	out = talloc_bstrndup(ctx, (char const *) src->vb_octets, src->vb_length);
+	if (!out) return -1;
+
+	memset(dst, 0, sizeof(*dst));
+	dst->type = FR_TYPE_STRING;
+	dst->vb_strvalue = out;
+	dst->datum.length = src->vb_length;
+	dst->enumv = dst_enumv;
+
+	return 0;
+}
+
+/** Widen an unsigned integer into a larger unsigned integer
+ *
+ */
+static int cast_unsigned_widen(TALLOC_CTX *ctx, fr_value_box_t *dst,
+			       fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
+			       fr_value_box_t const *src)
+{
+	uint64_t num;
+
+	if (src == dst) {
+	generic:
+		return fr_value_box_cast(ctx, dst, dst_type, dst_enumv, src);
+	}
+
+	switch (src->type) {
+	case FR_TYPE_UINT8:
+		num = src->vb_uint8;
+		break;
+
+	case FR_TYPE_UINT16:
+		num = src->vb_uint16;
+		break;
+
+	case FR_TYPE_UINT32:
+		num = src->vb_uint32;
+		break;
+
+	default:
+		goto generic;
+	}
+
+	memset(dst, 0, sizeof(*dst));
+
+	switch (dst_type) {
+	case FR_TYPE_UINT32:
+		if (src->type == FR_TYPE_UINT32) goto generic;
+		dst->vb_uint32 = num;
+		break;
+
+	case FR_TYPE_UINT64:
+		dst->vb_uint64 = num;
+		break;
+
+	default:
+		goto generic;
+	}
+
+	dst->type = dst_type;
+	dst->enumv = dst_enumv;
+
+	return 0;
+}
+
+#define CAST_INTEGER_TO_STRING \
+	[FR_TYPE_UINT8] = cast_integer_to_string, \
+	[FR_TYPE_UINT16] = cast_integer_to_string, \
+	[FR_TYPE_UINT32] = cast_integer_to_string, \
+	[FR_TYPE_UINT64] = cast_integer_to_string, \
+	[FR_TYPE_INT8] = cast_integer_to_string, \
+	[FR_TYPE_INT16] = cast_integer_to_string, \
+	[FR_TYPE_INT32] = cast_integer_to_string, \
+	[FR_TYPE_INT64] = cast_integer_to_string
+
+/** Kernels indexed by [dst_type][src_type]
+ *
+ * NULL entries use #fr_value_box_cast.
+ */
+static fr_value_box_cast_func_t const cast_funcs[FR_TYPE_MAX + 1][FR_TYPE_MAX + 1] = {
+	[FR_TYPE_STRING] = {
+		CAST_INTEGER_TO_STRING,
+		[FR_TYPE_IPV4_ADDR] = cast_ipv4addr_to_string,
+		[FR_TYPE_OCTETS] = cast_octets_to_string
+	},
+	[FR_TYPE_IPV4_ADDR] = { [FR_TYPE_STRING] = cast_string_to_ipv4addr },
+
+	[FR_TYPE_UINT8] = { [FR_TYPE_STRING] = cast_string_to_integer },
+	[FR_TYPE_UINT16] = { [FR_TYPE_STRING] = cast_string_to_integer },
+	[FR_TYPE_UINT32] = {
+		[FR_TYPE_STRING] = cast_string_to_integer,
+		[FR_TYPE_UINT8] = cast_unsigned_widen,
+		[FR_TYPE_UINT16] = cast_unsigned_widen
+	},
+	[FR_TYPE_UINT64] = {
+		[FR_TYPE_STRING] = cast_string_to_integer,
+		[FR_TYPE_UINT8] = cast_unsigned_widen,
+		[FR_TYPE_UINT16] = cast_unsigned_widen,
+		[FR_TYPE_UINT32] = cast_unsigned_widen
+	},
+
+	[FR_TYPE_INT8] = { [FR_TYPE_STRING] = cast_string_to_integer },
+	[FR_TYPE_INT16] = { [FR_TYPE_STRING] = cast_string_to_integer },
+	[FR_TYPE_INT32] = { [FR_TYPE_STRING] = cast_string_to_integer },
+	[FR_TYPE_INT64] = { [FR_TYPE_STRING] = cast_string_to_integer }
+};
+
+/** Return the function to use for casting between two types
+ *
+ * Where the source and destination types are known in advance, e.g.
+ * when a map or template is compiled, this should be called once, and
+ * the result called in place of #fr_value_box_cast.
+ *
+ * @param[in] dst_type	to cast to.
+ * @param[in] src_type	to cast from.
+ * @return
+ *	- A specialised kernel for the type pair.
+ *	- #fr_value_box_cast if there's no kernel for the type pair.
+ */
+fr_value_box_cast_func_t fr_value_box_cast_func(fr_type_t dst_type, fr_type_t src_type)
+{
+	if ((dst_type > FR_TYPE_MAX) || (src_type > FR_TYPE_MAX) ||
+	    !cast_funcs[dst_type][src_type]) return fr_value_box_cast;
+
+	return cast_funcs[dst_type][src_type];
+}
+
 /** Assign a #fr_value_box_t value from an #fr_ipaddr_t
  *
  * Automatically determines the type of the value box from the ipaddr address family
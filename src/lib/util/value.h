@@ -43,6 +43,7 @@ typedef struct value_box fr_value_box_t;
 #include <freeradius-devel/util/log.h>
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/table.h>
+#include <freeradius-devel/util/talloc.h>
 #include <freeradius-devel/util/token.h>
 #include <freeradius-devel/util/types.h>
 #include <freeradius-devel/util/time.h>
@@ -75,6 +76,16 @@ typedef struct {
 	fr_value_box_list_type_t type;				//!< What type of list this is.
 } fr_value_box_list_t;
 
+/** Bytes of string or octets data to allocate in the same chunk as a box or pair
+ *
+ * Boxes and pairs which are likely to hold strings or octets are
+ * allocated as talloc pools of this size, so that short values are
+ * allocated from memory next to the box, and not with a separate
+ * malloc.  The value is still a normal talloc chunk, parented by the
+ * box, so code which frees, steals or reallocs it doesn't change.
+ */
+#define FR_VALUE_BOX_INLINE_SIZE	(32)
+
 /** Union containing all data types supported by the server
  *
  * This union contains all data types that can be represented by VALUE_PAIRs. It may also be used in other parts
@@ -326,7 +337,16 @@ static inline fr_value_box_t *fr_value_box_alloc(TALLOC_CTX *ctx, fr_type_t type
 {
 	fr_value_box_t *value;
 
-	value = talloc_zero(ctx, fr_value_box_t);
+	switch (type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+		value = talloc_zero_pooled_object(ctx, fr_value_box_t, 1, FR_VALUE_BOX_INLINE_SIZE + 1);
+		break;
+
+	default:
+		value = talloc_zero(ctx, fr_value_box_t);
+		break;
+	}
 	if (unlikely(!value)) return NULL;
 
 	fr_value_box_init(value, type, enumv, tainted);
@@ -335,6 +355,9 @@ static inline fr_value_box_t *fr_value_box_alloc(TALLOC_CTX *ctx, fr_type_t type
 }
 
 /** Allocate a value box for later use with a value assignment function
+ *
+ * These are nearly always used for string or octets results, so they
+ * get room for a short value, as with #fr_value_box_alloc.
  *
  * @param[in] ctx	to allocate the value_box in.
  * @return
@@ -345,7 +368,7 @@ static inline fr_value_box_t *fr_value_box_alloc_null(TALLOC_CTX *ctx)
 {
 	fr_value_box_t *value;
 
-	value = talloc_zero(ctx, fr_value_box_t);
+	value = talloc_zero_pooled_object(ctx, fr_value_box_t, 1, FR_VALUE_BOX_INLINE_SIZE + 1);
 	if (unlikely(!value)) return NULL;
 
 	value->type = FR_TYPE_INVALID;
@@ -543,6 +566,15 @@ int		fr_value_box_cast(TALLOC_CTX *ctx, fr_value_box_t *dst,
 int		fr_value_box_cast_in_place(TALLOC_CTX *ctx, fr_value_box_t *vb,
 					   fr_type_t dst_type, fr_dict_attr_t const *dst_enumv);
 
+/** Signature shared by #fr_value_box_cast and the specialised cast kernels
+ *
+ */
+typedef int (*fr_value_box_cast_func_t)(TALLOC_CTX *ctx, fr_value_box_t *dst,
+					fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
+					fr_value_box_t const *src);
+
+fr_value_box_cast_func_t fr_value_box_cast_func(fr_type_t dst_type, fr_type_t src_type);
+
 int		fr_value_box_ipaddr(fr_value_box_t *dst, fr_dict_attr_t const *enumv,
 					 fr_ipaddr_t const *ipaddr, bool tainted);
 
@@ -78,6 +78,7 @@ typedef struct {
 	bool		blocked;
 	int		pipefd[2];
 	pthread_t	pthread_id;
+	uint32_t	thread_priority;	//!< SCHED_FIFO priority of the session thread.
 
 	bfd_auth_type_t auth_type;
 	uint8_t		secret[BFD_MAX_SECRET_LENGTH];
@@ -225,6 +226,7 @@ typedef struct {
 	uint32_t	min_rx_interval;
 	uint32_t	max_timeouts;
 	bool		demand;
+	uint32_t	thread_priority;
 
 	bfd_auth_type_t	auth_type;
 	uint8_t		secret[BFD_MAX_SECRET_LENGTH];
@@ -233,6 +235,14 @@ typedef struct {
 	rbtree_t	*session_tree;
 } bfd_socket_t;
 
+/*
+ *	What the socket reader passes to a session thread.
+ */
+typedef struct {
+	fr_time_t	when;			//!< The kernel received the packet.
+	bfd_packet_t	bfd;
+} bfd_pipe_msg_t;
+
 static fr_dict_t const *dict_bfd;
 
 extern fr_dict_autoload_t proto_bfd_dict[];
@@ -245,7 +255,7 @@ static int bfd_start_packets(bfd_state_t *session);
 static int bfd_start_control(bfd_state_t *session);
 static int bfd_stop_control(bfd_state_t *session);
 static void bfd_detection_timeout(UNUSED fr_event_list_t *eel, fr_time_t now, void *ctx);
-static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd);
+static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd, fr_time_t when);
 
 static fr_event_list_t *event_list = NULL; /* don't ask */
 
@@ -278,15 +288,16 @@ static void bfd_pipe_recv(UNUSED fr_event_list_t *xel, int fd, UNUSED int flags,
 {
 	ssize_t num;
 	bfd_state_t *session = ctx;
-	bfd_packet_t bfd;
+	bfd_pipe_msg_t msg;
+	size_t hdr_len = offsetof(bfd_pipe_msg_t, bfd) + 4;
 
 	if (session->blocked) return;
 
 	/*
-	 *	Read the header
+	 *	Read the receive time, and the header
 	 */
-	num = read(fd, &bfd, 4);
-	if ((num < 4) || (bfd.length < 4)) {
+	num = read(fd, &msg, hdr_len);
+	if ((num < (ssize_t) hdr_len) || (msg.bfd.length < 4)) {
 	fail:
 		ERROR("BFD Failed reading from pipe!");
 		session->blocked = true;
@@ -296,15 +307,15 @@ static void bfd_pipe_recv(UNUSED fr_event_list_t *xel, int fd, UNUSED int flags,
 	/*
 	 *	This is already checked in the caller, but what the heck...
 	 */
-	if (bfd.length > sizeof(bfd)) goto fail;
+	if (msg.bfd.length > sizeof(msg.bfd)) goto fail;
 
 	/*
 	 *	Read the rest of the packet.
 	 */
-	num = read(fd, ((uint8_t *) &bfd) + 4, bfd.length - 4);
-	if ((num < 0) || ((num + 4) != bfd.length)) goto fail;
+	num = read(fd, ((uint8_t *) &msg.bfd) + 4, msg.bfd.length - 4);
+	if ((num < 0) || ((num + 4) != msg.bfd.length)) goto fail;
 
-	bfd_process(session, &bfd);
+	bfd_process(session, &msg.bfd, msg.when);
 }
 
 /*
@@ -316,6 +327,22 @@ static void *bfd_child_thread(void *ctx)
 	bfd_state_t *session = ctx;
 
 	DEBUG("BFD %d starting child thread", session->number);
+
+	/*
+	 *	Keep the timers running on time, no matter how busy
+	 *	the workers are.
+	 */
+	if (session->thread_priority) {
+		struct sched_param	param = { .sched_priority = session->thread_priority };
+		int			ret;
+
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (ret != 0) {
+			WARN("BFD %d failed setting thread priority %u: %s",
+			     session->number, session->thread_priority, fr_syserror(ret));
+		}
+	}
+
 	bfd_start_control(session);
 
 	fr_event_loop(session->el);
@@ -505,6 +532,7 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 	session->recv_auth_seq = 0;
 	session->xmit_auth_seq = fr_rand();
 	session->auth_seq_known = 0;
+	session->thread_priority = sock->thread_priority;
 
 	/*
 	 *	Allow over-riding of variables per session.
@@ -1154,7 +1182,7 @@ static void bfd_poll_response(bfd_state_t *session)
 }
 
 
-static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd)
+static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd, fr_time_t when)
 {
 	if (bfd->auth_present &&
 	    (session->auth_type == BFD_AUTH_RESERVED)) {
@@ -1322,9 +1350,11 @@ static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd)
 
 	/*
 	 *	We've received the packet for the purpose of Section
-	 *	6.8.4.
+	 *	6.8.4.  Use the time the kernel received it, so that
+	 *	delays in reading the socket don't count against the
+	 *	peer.
 	 */
-	session->last_recv = fr_time();
+	session->last_recv = when;
 
 	/*
 	 *	We've received a packet, but missed the previous one.
@@ -1404,6 +1434,66 @@ static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd)
  *	mean we start polling.
  */
 
+/*
+ *	Read a packet, along with the time the kernel received it.
+ */
+static ssize_t bfd_recv(int sockfd, bfd_packet_t *bfd, struct sockaddr_storage *src, socklen_t *sizeof_src,
+			fr_time_t *when)
+{
+	ssize_t		rcode;
+	struct msghdr	msgh;
+	struct iovec	iov;
+	struct cmsghdr	*cmsg;
+	uint8_t		cbuf[CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(struct timeval))];
+
+	memset(&msgh, 0, sizeof(msgh));
+	iov.iov_base = bfd;
+	iov.iov_len = sizeof(*bfd);
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_name = src;
+	msgh.msg_namelen = *sizeof_src;
+	msgh.msg_control = cbuf;
+	msgh.msg_controllen = sizeof(cbuf);
+
+	*when = 0;
+
+	rcode = recvmsg(sockfd, &msgh, 0);
+	if (rcode < 0) return rcode;
+
+	*sizeof_src = msgh.msg_namelen;
+
+	for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET) continue;
+
+#ifdef SCM_TIMESTAMPNS
+		if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec ts;
+
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			*when = fr_time_from_timespec(&ts);
+			break;
+		}
+#endif
+#ifdef SCM_TIMESTAMP
+		if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+			struct timeval tv;
+
+			memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+			*when = fr_time_from_timeval(&tv);
+		}
+#endif
+	}
+
+	/*
+	 *	The kernel didn't give us a timestamp, or it's in
+	 *	the future because the wall clock was stepped.
+	 */
+	if (!*when || (*when > fr_time())) *when = fr_time();
+
+	return rcode;
+}
+
 /*
  *	Check if an incoming request is "ok"
  *
@@ -1419,9 +1509,9 @@ static int bfd_socket_recv(rad_listen_t *listener)
 	struct sockaddr_storage src;
 	socklen_t	sizeof_src = sizeof(src);
 	bfd_packet_t	bfd;
+	fr_time_t	when;
 
-	rcode = recvfrom(listener->fd, &bfd, sizeof(bfd), 0,
-			 (struct sockaddr *)&src, &sizeof_src);
+	rcode = bfd_recv(listener->fd, &bfd, &src, &sizeof_src, &when);
 	if (rcode < 0) {
 		ERROR("Failed receiving packet: %s", fr_syserror(errno));
 		return 0;
@@ -1503,8 +1593,12 @@ static int bfd_socket_recv(rad_listen_t *listener)
 	}
 
 	if (!event_list) {
-		uint8_t *p = (uint8_t *) &bfd;
-		size_t total = bfd.length;
+		bfd_pipe_msg_t msg;
+		uint8_t *p = (uint8_t *) &msg;
+		size_t total = offsetof(bfd_pipe_msg_t, bfd) + bfd.length;
+
+		msg.when = when;
+		memcpy(&msg.bfd, &bfd, bfd.length);
 
 		/*
 		 *	A child has had a problem.  Do some cleanups.
@@ -1535,7 +1629,7 @@ static int bfd_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	return bfd_process(session, &bfd);
+	return bfd_process(session, &bfd, when);
 }
 
 static int bfd_parse_ip_port(CONF_SECTION *cs, fr_ipaddr_t *ipaddr, uint16_t *port)
@@ -1675,6 +1769,8 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 			  &sock->max_timeouts), "3", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(sock, cs, "demand", FR_ITEM_POINTER(FR_TYPE_BOOL, &sock->demand),
 			  "no", T_DOUBLE_QUOTED_STRING) < 0) return -1;
+	if (cf_pair_parse(sock, cs, "thread_priority", FR_ITEM_POINTER(FR_TYPE_UINT32,
+			  &sock->thread_priority), "0", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(NULL, cs, "auth_type", FR_ITEM_POINTER(FR_TYPE_STRING, &auth_type_str),
 			  NULL, T_INVALID) < 0) return -1;
 
@@ -1696,6 +1792,8 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 	if (sock->max_timeouts == 0) sock->max_timeouts = 1;
 	if (sock->max_timeouts > 10) sock->max_timeouts = 10;
 
+	if (sock->thread_priority > 99) sock->thread_priority = 99;
+
 	sock->auth_type = fr_table_value_by_str(auth_types, auth_type_str, BFD_AUTH_INVALID);
 	if (sock->auth_type == BFD_AUTH_INVALID) {
 		ERROR("Unknown auth_type '%s'", auth_type_str);
@@ -1769,6 +1867,19 @@ static int bfd_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 		return -1;
 	}
 
+#ifdef SO_TIMESTAMPNS
+	/*
+	 *	Nanosecond receive timestamps, for detection times.
+	 */
+	{
+		int on = 1;
+
+		if (setsockopt(this->fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+			WARN("Failed enabling socket timestamps: %s", fr_syserror(errno));
+		}
+	}
+#endif
+
 	/*
 	 *	Bootstrap the initial set of connections.
 	 */
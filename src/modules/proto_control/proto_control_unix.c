@@ -49,6 +49,7 @@
 
 #include <fcntl.h>
 #include <libgen.h>
+#include <poll.h>
 #include <pwd.h>
 #include <grp.h>
 
@@ -70,9 +71,44 @@ typedef struct {
 	FILE				*misc;
 	fr_cmd_info_t			*info;			//!< for running commands
 
+	fr_event_list_t			*el;			//!< for retrying writes
+	fr_event_timer_t const		*ev;			//!< retry timer, while output is queued
+	uint8_t				*out;			//!< framed output which hasn't been written
+	size_t				out_start;		//!< first byte of out to write
+	size_t				out_end;		//!< end of the queued output
+	bool				out_error;		//!< the output can't be written, close the socket
+
 	RADCLIENT			radclient;		//!< for faking out clients
 } proto_control_unix_thread_t;
 
+/*
+ *	Command output is written in chunks of this size, so that
+ *	large listings don't need one write per line.
+ */
+#define OUTPUT_CHUNK_SIZE	(16384)
+
+/*
+ *	When a command has queued more than this much output, it
+ *	waits for the other end to read some of it.
+ */
+#define OUTPUT_QUEUE_MAX	(1024 * 1024)
+
+/*
+ *	How long a command will wait for the other end to read its
+ *	output, before we give up and close the socket.
+ */
+#define OUTPUT_TIMEOUT_MS	(5000)
+
+static fr_event_update_t pause_read[] = {
+	FR_EVENT_SUSPEND(fr_event_io_func_t, read),
+	{ 0 }
+};
+
+static fr_event_update_t resume_read[] = {
+	FR_EVENT_RESUME(fr_event_io_func_t, read),
+	{ 0 }
+};
+
 typedef struct {
 	CONF_SECTION			*cs;			//!< our configuration
 
@@ -120,6 +156,131 @@ static fr_table_num_sorted_t mode_names[] = {
 };
 static size_t mode_names_len = NUM_ELEMENTS(mode_names);
 
+/** Write as much of the queued output as the socket will take
+ *
+ * @return
+ *	- <0 on error.
+ *	- 0 if all of the output has been written.
+ *	- 1 if there is still output queued.
+ */
+static int output_flush(proto_control_unix_thread_t *thread)
+{
+	ssize_t r;
+
+	if (thread->out_error) return -1;
+
+	while (thread->out_start < thread->out_end) {
+		r = write(thread->sockfd, thread->out + thread->out_start, thread->out_end - thread->out_start);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) return 1;
+
+			DEBUG2("proto_control_unix - Failed writing to %s: %s", thread->name, fr_syserror(errno));
+			thread->out_error = true;
+			return -1;
+		}
+
+		thread->out_start += r;
+	}
+
+	thread->out_start = thread->out_end = 0;
+	return 0;
+}
+
+/** Add a conduit message to the output queue, and write what we can
+ *
+ *  Commands run to completion in this thread, so they can't be
+ *  suspended when the other end is slow to read.  Instead, once
+ *  there is too much queued, we wait (for a bounded time) until
+ *  the other end has read some of it.
+ */
+static ssize_t output_queue(proto_control_unix_thread_t *thread, fr_conduit_type_t conduit,
+			    void const *buffer, size_t buffer_size)
+{
+	fr_conduit_hdr_t	hdr;
+	size_t			needed;
+
+	if (thread->out_error) return -1;
+	if (!buffer_size) return 0;
+
+	if (buffer_size > UINT32_MAX) {
+		fr_strerror_printf("Data to write to conduit (%zu bytes) exceeds maximum length", buffer_size);
+		return -1;
+	}
+
+	needed = thread->out_end + sizeof(hdr) + buffer_size;
+	if (needed > talloc_array_length(thread->out)) {
+		/*
+		 *	Move the unwritten data to the start of the
+		 *	buffer, and then grow it if necessary.
+		 */
+		if (thread->out_start > 0) {
+			memmove(thread->out, thread->out + thread->out_start, thread->out_end - thread->out_start);
+			thread->out_end -= thread->out_start;
+			thread->out_start = 0;
+			needed = thread->out_end + sizeof(hdr) + buffer_size;
+		}
+
+		if (needed > talloc_array_length(thread->out)) {
+			MEM(thread->out = talloc_realloc(thread, thread->out, uint8_t, needed + OUTPUT_CHUNK_SIZE));
+		}
+	}
+
+	hdr.conduit = htons(conduit);
+	hdr.length = htonl(buffer_size);
+	memcpy(thread->out + thread->out_end, &hdr, sizeof(hdr));
+	memcpy(thread->out + thread->out_end + sizeof(hdr), buffer, buffer_size);
+	thread->out_end += sizeof(hdr) + buffer_size;
+
+	if (output_flush(thread) < 0) return -1;
+
+	while ((thread->out_end - thread->out_start) > OUTPUT_QUEUE_MAX) {
+		struct pollfd	pfd;
+		int		rcode;
+
+		pfd.fd = thread->sockfd;
+		pfd.events = POLLOUT;
+
+		rcode = poll(&pfd, 1, OUTPUT_TIMEOUT_MS);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			thread->out_error = true;
+			return -1;
+		}
+
+		if (rcode == 0) {
+			ERROR("proto_control_unix - Timed out writing command output to %s", thread->name);
+			thread->out_error = true;
+			return -1;
+		}
+
+		if (output_flush(thread) < 0) return -1;
+	}
+
+	return buffer_size;
+}
+
+static void output_retry(fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	proto_control_unix_thread_t *thread = talloc_get_type_abort(uctx, proto_control_unix_thread_t);
+
+	/*
+	 *	Still blocked, try again later.
+	 */
+	if ((output_flush(thread) == 1) &&
+	    (fr_event_timer_in(thread, el, &thread->ev, fr_time_delta_from_msec(10), output_retry, thread) == 0)) {
+		return;
+	}
+
+	/*
+	 *	Everything has been written, OR the socket is broken.
+	 *	Either way, resume reading.  mod_read() will close
+	 *	broken sockets.
+	 */
+	(void) fr_event_filter_update(el, thread->sockfd, FR_EVENT_FILTER_IO, resume_read);
+}
+
 #undef INT
 #define INT size_t
 #define SINT ssize_t
@@ -128,21 +289,26 @@ static SINT write_stdout(void *instance, char const *buffer, INT buffer_size)
 {
 	proto_control_unix_thread_t *thread = talloc_get_type_abort(instance, proto_control_unix_thread_t);
 
-	return fr_conduit_write(thread->sockfd, FR_CONDUIT_STDOUT, buffer, buffer_size);
+	return output_queue(thread, FR_CONDUIT_STDOUT, buffer, buffer_size);
 }
 
 static SINT write_stderr(void *instance, char const *buffer, INT buffer_size)
 {
-	proto_control_unix_thread_t *thread = talloc_get_type_abort(instance, proto_control_unix_thread_t)
-;
-	return fr_conduit_write(thread->sockfd, FR_CONDUIT_STDERR, buffer, buffer_size);
+	proto_control_unix_thread_t *thread = talloc_get_type_abort(instance, proto_control_unix_thread_t);
+
+	/*
+	 *	Keep the messages in the order they were printed.
+	 */
+	(void) fflush(thread->stdout);
+
+	return output_queue(thread, FR_CONDUIT_STDERR, buffer, buffer_size);
 }
 
 static SINT write_misc(void *instance, char const *buffer, INT buffer_size)
 {
 	proto_control_unix_thread_t *thread = talloc_get_type_abort(instance, proto_control_unix_thread_t);
 
-	return fr_conduit_write(thread->sockfd, thread->misc_conduit, buffer, buffer_size);
+	return output_queue(thread, thread->misc_conduit, buffer, buffer_size);
 }
 
 
@@ -203,6 +369,7 @@ static ssize_t mod_read_command(fr_listen_t *li, UNUSED void **packet_ctx, UNUSE
 		thread->misc_conduit = FR_CONDUIT_COMPLETE;
 
 		fr_radmin_complete(thread->misc, string + 2, start);
+		(void) fflush(thread->misc);
 		thread->misc_conduit = FR_CONDUIT_STDOUT;
 		status = FR_CONDUIT_SUCCESS;
 		goto done;
@@ -232,8 +399,26 @@ fail:
 	}
 
 done:
+	(void) fflush(thread->stdout);
+	(void) fflush(thread->stderr);
+
 	status = htonl(status);
-	(void) fr_conduit_write(thread->sockfd, FR_CONDUIT_CMD_STATUS, &status, sizeof(status));
+	if (output_queue(thread, FR_CONDUIT_CMD_STATUS, &status, sizeof(status)) < 0) return -1;
+
+	/*
+	 *	The other end hasn't read all of the output.  Don't
+	 *	read any more commands until it has.
+	 */
+	if (output_flush(thread) == 1) {
+		if (!thread->el ||
+		    (fr_event_timer_in(thread, thread->el, &thread->ev, fr_time_delta_from_msec(10),
+				       output_retry, thread) < 0)) {
+			ERROR("proto_control_unix - Failed adding retry timer for %s", thread->name);
+			return -1;
+		}
+
+		(void) fr_event_filter_update(thread->el, thread->sockfd, FR_EVENT_FILTER_IO, pause_read);
+	}
 
 	return 0;
 }
@@ -291,6 +476,11 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	fr_conduit_type_t		conduit;
 	bool				want_more;
 
+	/*
+	 *	We couldn't write the output of a previous command.
+	 */
+	if (thread->out_error) return -1;
+
 	/*
 	 *      Read data into the buffer.
 	 */
@@ -1009,6 +1199,11 @@ static int getpeereid(int s, uid_t *euid, gid_t *egid)
 
 static int _close_cookies(proto_control_unix_thread_t *thread)
 {
+	/*
+	 *	Discard anything which is still buffered.
+	 */
+	thread->out_error = true;
+
 	if (thread->stdout) fclose(thread->stdout);
 	if (thread->stderr) fclose(thread->stderr);
 	if (thread->misc) fclose(thread->misc);
@@ -1098,14 +1293,22 @@ static int mod_fd_set(fr_listen_t *li, int fd)
 	talloc_set_destructor(thread, _close_cookies);
 
 	/*
-	 *	@todo - if we move to a binary protocol, then we
-	 *	should change this to a small (i.e. 1K) buffer.  The
-	 *	data should be sent over to the remote side as quickly
-	 *	as possible.
+	 *	Output is sent in chunks, and flushed at the end of
+	 *	each command.  Line buffering would mean a conduit
+	 *	message, and a write, for every line of a listing.
+	 */
+	(void) setvbuf(thread->stdout, NULL, _IOFBF, OUTPUT_CHUNK_SIZE);
+	(void) setvbuf(thread->stderr, NULL, _IOFBF, OUTPUT_CHUNK_SIZE);
+	(void) setvbuf(thread->misc, NULL, _IOFBF, OUTPUT_CHUNK_SIZE);
+
+	/*
+	 *	Command output is queued, and written without
+	 *	blocking the network thread.
 	 */
-	(void) setvbuf(thread->stdout, NULL, _IOLBF, 0);
-	(void) setvbuf(thread->stderr, NULL, _IOLBF, 0);
-	(void) setvbuf(thread->misc, NULL, _IOLBF, 0);
+	if (fr_nonblock(fd) < 0) {
+		ERROR("Failed setting nonblocking socket flag for %s: %s", thread->name, fr_syserror(errno));
+		return -1;
+	}
 
 	thread->info = talloc_zero(thread, fr_cmd_info_t);
 	fr_command_info_init(thread, thread->info);
@@ -1113,6 +1316,13 @@ static int mod_fd_set(fr_listen_t *li, int fd)
 	return 0;
 }
 
+static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, UNUSED void *nr)
+{
+	proto_control_unix_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_control_unix_thread_t);
+
+	thread->el = el;
+}
+
 static char const *mod_name(fr_listen_t *li)
 {
 	proto_control_unix_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_control_unix_thread_t);
@@ -1208,6 +1418,7 @@ fr_app_io_t proto_control_unix = {
 	.read			= mod_read,
 	.write			= mod_write,
 	.fd_set			= mod_fd_set,
+	.event_list_set		= mod_event_list_set,
 	.connection_set		= mod_connection_set,
 	.network_get		= mod_network_get,
 	.client_find		= mod_client_find,
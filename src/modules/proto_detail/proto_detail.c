@@ -23,7 +23,9 @@
  * @copyright 2016 Alan DeKok (aland@freeradius.org)
  */
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail.h>
 #include <freeradius-devel/radius/radius.h>
+#include <freeradius-devel/internal/internal.h>
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/schedule.h>
 #include <freeradius-devel/io/application.h>
@@ -233,6 +235,83 @@ static int transport_parse(TALLOC_CTX *ctx, void *out, UNUSED void *parent,
 /** Decode the packet, and set the request->process function
  *
  */
+/** Decode a binary detail record
+ *
+ * The header has already been checked by the reader.
+ */
+static int detail_decode_binary(REQUEST *request, uint8_t const *data, size_t data_len)
+{
+	fr_detail_binary_hdr_t	hdr;
+	uint8_t const		*p, *end;
+	VALUE_PAIR		*vp;
+	fr_cursor_t		cursor;
+	fr_dict_t const		*dict;
+
+	if (fr_detail_binary_hdr_decode(&hdr, data, data_len) < 0) {
+		RPEDEBUG("Malformed binary record");
+		return -1;
+	}
+
+	if (hdr.length > data_len) {
+		REDEBUG("Truncated binary record");
+		return -1;
+	}
+
+	dict = fr_dict_by_protocol_num(hdr.protocol);
+	if (!dict) {
+		REDEBUG("Invalid protocol: %u", hdr.protocol);
+		return -1;
+	}
+	request->dict = dict;
+
+	request->packet->src_ipaddr = hdr.src_ipaddr;
+	request->packet->dst_ipaddr = hdr.dst_ipaddr;
+	request->packet->src_port = hdr.src_port;
+	request->packet->dst_port = hdr.dst_port;
+
+	fr_cursor_init(&cursor, &request->packet->vps);
+	fr_cursor_tail(&cursor);	/* Ensure we only free what we add on error */
+
+	vp = fr_pair_afrom_da(request->packet, attr_packet_original_timestamp);
+	if (vp) {
+		vp->vp_date = hdr.timestamp;
+		vp->type = VT_DATA;
+		fr_cursor_append(&cursor, vp);
+	}
+
+	p = data + FR_DETAIL_BINARY_HDR_LEN;
+	end = data + hdr.length;
+
+	while (p < end) {
+		ssize_t slen;
+
+		switch (*p++) {
+		case FR_DETAIL_BINARY_DICT_PROTOCOL:
+			dict = request->dict;
+			break;
+
+		case FR_DETAIL_BINARY_DICT_INTERNAL:
+			dict = dict_freeradius;
+			break;
+
+		default:
+			REDEBUG("Unknown dictionary at offset %zu", (size_t) (p - data) - 1);
+			goto error;
+		}
+
+		slen = fr_internal_decode_pair(request->packet, &cursor, dict, p, end - p, NULL);
+		if (slen <= 0) {
+			RPEDEBUG("Failed decoding attribute at offset %zu", (size_t) (p - data));
+		error:
+			fr_cursor_free_list(&cursor);
+			return -1;
+		}
+		p += slen;
+	}
+
+	return 0;
+}
+
 static int mod_decode(void const *instance, REQUEST *request, uint8_t *const data, size_t data_len)
 {
 	proto_detail_t const	*inst = talloc_get_type_abort_const(instance, proto_detail_t);
@@ -257,6 +336,11 @@ static int mod_decode(void const *instance, REQUEST *request, uint8_t *const dat
 	request->reply->src_ipaddr = request->packet->src_ipaddr;
 	request->reply->dst_ipaddr = request->packet->src_ipaddr;
 
+	if ((data_len > 0) && (data[0] == (uint8_t) FR_DETAIL_BINARY_MAGIC[0])) {
+		if (detail_decode_binary(request, data, data_len) < 0) return -1;
+		goto done;
+	}
+
 	end = data + data_len;
 
 	MPRINT("HEADER %s", data);
@@ -376,6 +460,7 @@ static int mod_decode(void const *instance, REQUEST *request, uint8_t *const dat
 		while ((p < end) && (*p)) p++;
 	}
 
+done:
 	/*
 	 *	Let the app_io take care of populating additional fields in the request
 	 */
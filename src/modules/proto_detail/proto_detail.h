@@ -28,6 +28,7 @@ RCSIDH(detail_h, "$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/retry.h>
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -95,6 +96,8 @@ struct proto_detail_work_s {
 	bool				track_progress;		//!< do we track progress by writing?
 	bool				retransmit;		//!< are we retransmitting on error?
 	bool				immediate;		//!< start reading the detail files immediately
+	bool				order_by_session;	//!< run records with the same Acct-Session-Id
+								//!< one at a time, in file order.
 
 	int				mode;			//!< O_RDWR or O_RDONLY
 
@@ -137,6 +140,11 @@ struct proto_detail_work_thread_s {
 	off_t				header_offset;		//!< offset of the current header we're reading
 	off_t				read_offset;		//!< where we're reading from in filename_work
 
+	uint8_t				*map;			//!< filename_work, mapped into memory.
+	size_t				map_size;		//!< size of the mapping.
+
+	fr_hash_table_t			*sessions;		//!< records being processed, by Acct-Session-Id.
+
 	fr_event_timer_t const		*ev;			//!< for detail file timers.
 
 	pthread_mutex_t			worker_mutex;		//!< for the workers
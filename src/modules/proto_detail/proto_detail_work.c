@@ -24,6 +24,7 @@
  */
 #include <netdb.h>
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail.h>
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/io/base.h>
@@ -36,6 +37,7 @@
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #ifndef NDEBUG
 #if 0
@@ -52,10 +54,13 @@
 #define MPRINT(_x, ...)
 #endif
 
-typedef struct {
+typedef struct fr_detail_entry_s fr_detail_entry_t;
+
+struct fr_detail_entry_s {
 	proto_detail_work_thread_t	*parent;		//!< talloc_parent is SLOW!
 	fr_time_t			timestamp;		//!< when we read the entry.
 	off_t				done_offset;		//!< where we're tracking the status
+	bool				binary;			//!< done_offset is the flags of a binary record.
 
 	int				id;			//!< for retransmission counters
 
@@ -65,7 +70,11 @@ typedef struct {
 	fr_retry_t			retry;			//!< our retry timers
 	fr_event_timer_t const		*ev;			//!< retransmission timer
 	fr_dlist_t			entry;			//!< for the retransmission list
-} fr_detail_entry_t;
+
+	char const			*session_id;		//!< Acct-Session-Id, if we're ordering by session.
+	fr_detail_entry_t		*session_next;		//!< next record for this session.
+	fr_detail_entry_t		*session_tail;		//!< last record waiting for this session.
+};
 
 static CONF_PARSER limit_config[] = {
 	{ FR_CONF_OFFSET("initial_rtx_time", FR_TYPE_TIME_DELTA, proto_detail_work_t, retry_config.irt), .dflt = STRINGIFY(2) },
@@ -91,6 +100,8 @@ static const CONF_PARSER file_listen_config[] = {
 
 	{ FR_CONF_OFFSET("retransmit", FR_TYPE_BOOL, proto_detail_work_t, retransmit ), .dflt = "yes" },
 
+	{ FR_CONF_OFFSET("order_by_session", FR_TYPE_BOOL, proto_detail_work_t, order_by_session ), .dflt = "no" },
+
 	{ FR_CONF_POINTER("limit", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) limit_config },
 	CONF_PARSER_TERMINATOR
 };
@@ -135,6 +146,21 @@ static int mod_decode(void const *instance, REQUEST *request, UNUSED uint8_t *co
 	return 0;
 }
 
+static uint32_t session_hash(void const *data)
+{
+	fr_detail_entry_t const *track = data;
+
+	return fr_hash_string(track->session_id);
+}
+
+static int session_cmp(void const *one, void const *two)
+{
+	fr_detail_entry_t const *a = one;
+	fr_detail_entry_t const *b = two;
+
+	return strcmp(a->session_id, b->session_id);
+}
+
 static fr_event_update_t pause_read[] = {
 	FR_EVENT_SUSPEND(fr_event_io_func_t, read),
 	{ 0 }
@@ -156,10 +182,15 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	uint8_t				*partial, *end, *next, *p, *record_end;
 	uint8_t				*stopped_search;
 	off_t				done_offset;
+	char const			*session_id;
+	fr_detail_binary_hdr_t		hdr;
+	bool				binary;
 
 	fr_assert(*leftover < buffer_len);
 	fr_assert(thread->fd >= 0);
 
+	li->read_pending = false;
+
 	MPRINT("AT COUNT %d offset %ld", thread->count, (long) thread->read_offset);
 
 	/*
@@ -185,7 +216,11 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 		fr_assert(buffer_len >= track->packet_len);
 		memcpy(buffer, track->packet, track->packet_len);
 
-		DEBUG("Retrying packet %d (retransmission %u)", track->id, track->retry.count);
+		if (track->retry.count) {
+			DEBUG("Retrying packet %d (retransmission %u)", track->id, track->retry.count);
+		} else {
+			MPRINT("Running packet %d, which was waiting for session %s", track->id, track->session_id);
+		}
 		*packet_ctx = track;
 		*recv_time_p = track->timestamp;
 		*priority = inst->parent->priority;
@@ -247,24 +282,40 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 
 		room = buffer_len - *leftover;
 
-		data_size = read(thread->fd, partial, room);
-		if (data_size < 0) {
-			ERROR("proto_detail (%s): Failed reading file %s: %s",
-			      thread->name, thread->filename_work, fr_syserror(errno));
-			return -1;
+		/*
+		 *	Copy directly from the mapped file.  We still
+		 *	move the file offset, so that the event loop
+		 *	knows whether or not there's more to read.
+		 */
+		if (thread->map) {
+			data_size = thread->map_size - thread->read_offset;
+			if ((size_t) data_size > room) data_size = room;
+
+			memcpy(partial, thread->map + thread->read_offset, data_size);
+			thread->read_offset += data_size;
+			(void) lseek(thread->fd, thread->read_offset, SEEK_SET);
+
+		} else {
+			data_size = read(thread->fd, partial, room);
+			if (data_size < 0) {
+				ERROR("proto_detail (%s): Failed reading file %s: %s",
+				      thread->name, thread->filename_work, fr_syserror(errno));
+				return -1;
+			}
+
+			/*
+			 *	Remember the read offset.
+			 */
+			thread->read_offset = lseek(thread->fd, 0, SEEK_CUR);
 		}
 
 		MPRINT("GOT %zd bytes", data_size);
 
-		/*
-		 *	Remember the read offset, and whether we got EOF.
-		 */
-		thread->read_offset = lseek(thread->fd, 0, SEEK_CUR);
-
 		/*
 		 *	Only set EOF if there's no more data in the buffer to manage.
 		 */
-		thread->eof = (data_size == 0) || (thread->read_offset == thread->file_size) || ((size_t) data_size < room);
+		thread->eof = (data_size == 0) || (thread->read_offset == thread->file_size) || ((size_t) data_size < room) ||
+			      (thread->map && ((size_t) thread->read_offset == thread->map_size));
 		if (thread->eof) {
 			MPRINT("Set EOF data_size %ld vs room %ld", data_size, room);
 			MPRINT("Set EOF read %ld vs file %ld", (long) thread->read_offset, (long) thread->file_size);
@@ -284,6 +335,59 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 redo:
 	next = NULL;
 	stopped_search = end;
+	binary = false;
+
+	/*
+	 *	Binary records can't start with a printable
+	 *	character, so we can tell the formats apart record by
+	 *	record.  The length is in the header, so there's no
+	 *	need to search for the end of the record.
+	 */
+	if ((thread->last_search == 0) && (end > buffer) && (buffer[0] == (uint8_t) FR_DETAIL_BINARY_MAGIC[0])) {
+		if ((size_t) (end - buffer) >= FR_DETAIL_BINARY_HDR_LEN) {
+			if (fr_detail_binary_hdr_decode(&hdr, buffer, end - buffer) < 0) {
+				PERROR("proto_detail (%s): Malformed record found at offset %zu in file %s",
+				       thread->name, (size_t) thread->header_offset, thread->filename_work);
+				return -1;
+			}
+
+			if (hdr.length > buffer_len) {
+				ERROR("proto_detail (%s): Too large entry (%u > %d bytes) found at offset %zu of file %s",
+				      thread->name, hdr.length, (int) buffer_len,
+				      (size_t) thread->header_offset, thread->filename_work);
+				return -1;
+			}
+		}
+
+		if (((size_t) (end - buffer) < FR_DETAIL_BINARY_HDR_LEN) || ((size_t) (end - buffer) < hdr.length)) {
+			if (thread->eof) {
+				ERROR("proto_detail (%s): Truncated entry found at offset %zu of file %s",
+				      thread->name, (size_t) thread->header_offset, thread->filename_work);
+				return -1;
+			}
+
+			*leftover = end - buffer;
+			MPRINT("Not at EOF, and no complete binary record.  Leftover is %zd", *leftover);
+			return 0;
+		}
+
+		binary = true;
+		packet_len = hdr.length;
+		next = buffer + packet_len;
+		*leftover = end - next;
+
+		if (packet_len > inst->parent->max_packet_size) {
+			DEBUG("Ignoring 'too large' entry at offset %zu of %s",
+			      (size_t) thread->header_offset, thread->filename_work);
+			goto skip_record;
+		}
+
+		if ((hdr.flags & FR_DETAIL_BINARY_FLAG_DONE) != 0) goto skip_record;
+
+		done_offset = thread->header_offset + FR_DETAIL_BINARY_OFFSET_FLAGS;
+		session_id = NULL;
+		goto track;
+	}
 
 	/*
 	 *	Look for "end of record" marker, starting from the
@@ -437,6 +541,11 @@ redo:
 	skip_record:
 		MPRINT("Skipping record");
 		if (next) {
+			/*
+			 *	The buffer now starts at the next record.
+			 */
+			thread->header_offset += next - buffer;
+
 			memmove(buffer, next, (end - next));
 			data_size = (end - next);
 			*leftover = 0;
@@ -461,6 +570,7 @@ redo:
 	record_end = buffer + packet_len;
 	p = buffer;
 	done_offset = 0;
+	session_id = NULL;
 
 	while (p < record_end) {
 		if (*p != '\0') {
@@ -481,17 +591,29 @@ redo:
 			p++;
 			done_offset = thread->header_offset + (p - buffer);
 		}
+
+		/*
+		 *	Each line is a C string, as we replaced the LF
+		 *	with a zero above.
+		 */
+		if (thread->sessions &&
+		    ((size_t) (record_end - p) > (sizeof("\tAcct-Session-Id = ") - 1)) &&
+		    (memcmp(p, "\tAcct-Session-Id = ", sizeof("\tAcct-Session-Id = ") - 1) == 0)) {
+			session_id = (char const *) p + sizeof("\tAcct-Session-Id = ") - 1;
+		}
 	}
 
 	/*
 	 *	Allocate the tracking entry.
 	 */
+track:
 	track = talloc_zero(thread, fr_detail_entry_t);
 	track->parent = thread;
 	track->timestamp = fr_time();
 	track->id = thread->count++;
 
 	track->done_offset = done_offset;
+	track->binary = binary;
 	if (inst->retransmit) {
 		track->packet = talloc_memdup(track, buffer, packet_len);
 		track->packet_len = packet_len;
@@ -502,6 +624,53 @@ redo:
 	 */
 	thread->header_offset += packet_len;
 
+	/*
+	 *	If there's already a record running for this session,
+	 *	then this one waits until that one is done.  It still
+	 *	counts as outstanding, so that the number of waiting
+	 *	records is limited.
+	 */
+	if (session_id) {
+		fr_detail_entry_t *active;
+
+		MEM(track->session_id = talloc_strdup(track, session_id));
+
+		active = fr_hash_table_finddata(thread->sessions, track);
+		if (!active) {
+			if (fr_hash_table_insert(thread->sessions, track) < 0) {
+				ERROR("proto_detail (%s): Failed tracking session %s", thread->name, track->session_id);
+				talloc_const_free(track->session_id);
+				track->session_id = NULL;
+			}
+			goto run;
+		}
+
+		if (!track->packet) {
+			MEM(track->packet = talloc_memdup(track, buffer, packet_len));
+			track->packet_len = packet_len;
+		}
+
+		if (active->session_tail) {
+			active->session_tail->session_next = track;
+		} else {
+			active->session_next = track;
+		}
+		active->session_tail = track;
+
+		MPRINT("Packet %d waits for packet %d with session %s", track->id, active->id, track->session_id);
+
+		/*
+		 *	Remove the record from the buffer, and tell
+		 *	the network to call us again for the next one.
+		 */
+		if (*leftover) memmove(buffer, buffer + packet_len, *leftover);
+		li->read_pending = (*leftover > 0) || !thread->eof;
+		*packet_ctx = NULL;
+		packet_len = 0;
+		goto done;
+	}
+
+run:
 	*packet_ctx = track;
 	*recv_time_p = track->timestamp;
 	*priority = inst->parent->priority;
@@ -537,19 +706,21 @@ done:
 	 */
 	thread->last_search = 0;
 
+	/*
+	 *	Don't ask to be called again if we've paused reading.
+	 */
+	if (thread->paused) li->read_pending = false;
+
 	MPRINT("Returning NUM %u - %.*s", thread->outstanding, (int) packet_len, buffer);
 	return packet_len;
 }
 
 
-static void work_retransmit(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+/** Queue a record which mod_read() will return before reading anything else
+ *
+ */
+static void work_queue(proto_detail_work_thread_t *thread, fr_detail_entry_t *track)
 {
-	fr_detail_entry_t		*track = talloc_get_type_abort(uctx, fr_detail_entry_t);
-	proto_detail_work_thread_t     	*thread = track->parent;
-
-	DEBUG("%s - retransmitting packet %d", thread->name, track->id);
-	track->retry.count++;
-
 	fr_dlist_insert_tail(&thread->list, track);
 
 	if (thread->paused && (thread->outstanding < thread->inst->max_outstanding)) {
@@ -573,6 +744,49 @@ static void work_retransmit(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, vo
 #endif
 }
 
+static void work_retransmit(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_detail_entry_t		*track = talloc_get_type_abort(uctx, fr_detail_entry_t);
+	proto_detail_work_thread_t     	*thread = track->parent;
+
+	DEBUG("%s - retransmitting packet %d", thread->name, track->id);
+	track->retry.count++;
+
+	work_queue(thread, track);
+}
+
+static void work_session_run(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_detail_entry_t		*track = talloc_get_type_abort(uctx, fr_detail_entry_t);
+
+	work_queue(track->parent, track);
+}
+
+/** A record is done, so let the next one for the same session run
+ *
+ */
+static void work_session_done(proto_detail_work_thread_t *thread, fr_detail_entry_t *track)
+{
+	fr_detail_entry_t *next = track->session_next;
+
+	if (!next) {
+		(void) fr_hash_table_delete(thread->sessions, track);
+		return;
+	}
+
+	next->session_tail = (track->session_tail == next) ? NULL : track->session_tail;
+	(void) fr_hash_table_replace(thread->sessions, next);
+
+	/*
+	 *	We're called from mod_write(), so we can't call the
+	 *	reader directly.  Run it from the event loop instead.
+	 */
+	if (fr_event_timer_at(thread, thread->el, &next->ev, fr_time(), work_session_run, next) < 0) {
+		ERROR("%s - Failed inserting timer for packet %d", thread->name, next->id);
+		fr_dlist_insert_tail(&thread->list, next);
+	}
+}
+
 static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t request_time,
 			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
 {
@@ -631,14 +845,33 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 		 *	Seek to the entry, mark it as done, and then seek to
 		 *	the point in the file where we were reading from.
 		 */
-		(void) lseek(thread->fd, track->done_offset, SEEK_SET);
-		if (write(thread->fd, "Done", 4) < 0) {
-			ERROR("%s - Failed marking entry as done: %s", thread->name, fr_syserror(errno));
+		if (track->binary) {
+			uint8_t flags = FR_DETAIL_BINARY_FLAG_DONE;
+
+			if (thread->map && ((size_t) track->done_offset + 1 <= thread->map_size)) {
+				thread->map[track->done_offset] |= flags;
+			} else {
+				(void) lseek(thread->fd, track->done_offset, SEEK_SET);
+				if (write(thread->fd, &flags, 1) < 0) {
+					ERROR("%s - Failed marking entry as done: %s", thread->name, fr_syserror(errno));
+				}
+				(void) lseek(thread->fd, thread->read_offset, SEEK_SET);
+			}
+
+		} else if (thread->map && ((size_t) track->done_offset + 4 <= thread->map_size)) {
+			memcpy(thread->map + track->done_offset, "Done", 4);
+		} else {
+			(void) lseek(thread->fd, track->done_offset, SEEK_SET);
+			if (write(thread->fd, "Done", 4) < 0) {
+				ERROR("%s - Failed marking entry as done: %s", thread->name, fr_syserror(errno));
+			}
+			(void) lseek(thread->fd, thread->read_offset, SEEK_SET);
 		}
-		(void) lseek(thread->fd, thread->read_offset, SEEK_SET);
 	}
 
 free_track:
+	if (track->session_id) work_session_done(thread, track);
+
 	thread->outstanding--;
 
 	/*
@@ -681,6 +914,7 @@ static int mod_open(fr_listen_t *li)
 {
 	proto_detail_work_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_work_t);
 	proto_detail_work_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_detail_work_thread_t);
+	struct stat			buf;
 
 	fr_dlist_init(&thread->list, fr_detail_entry_t, entry);
 
@@ -697,17 +931,15 @@ static int mod_open(fr_listen_t *li)
 		}
 	}
 
+	if (fstat(thread->fd, &buf) < 0) {
+		cf_log_err(inst->cs, "Failed examining %s: %s", thread->filename_work, fr_syserror(errno));
+		return -1;
+	}
+
 	/*
 	 *	If we're tracking progress, learn where the EOF is.
 	 */
 	if (inst->track_progress) {
-		struct stat buf;
-
-		if (fstat(thread->fd, &buf) < 0) {
-			cf_log_err(inst->cs, "Failed examining %s: %s", thread->filename_work, fr_syserror(errno));
-			return -1;
-		}
-
 		thread->file_size = buf.st_size;
 	} else {
 		/*
@@ -716,6 +948,37 @@ static int mod_open(fr_listen_t *li)
 		thread->file_size = 1;
 	}
 
+	/*
+	 *	Map the file, so that reading it doesn't need a
+	 *	system call per buffer, and marking entries as "Done"
+	 *	doesn't need three.  The work file has already been
+	 *	renamed, so nothing should be appending to it.  If
+	 *	mmap() fails, we just read() the file instead.
+	 */
+	if (S_ISREG(buf.st_mode) && (buf.st_size > 0)) {
+		void *map;
+
+		map = mmap(NULL, buf.st_size, PROT_READ | (inst->track_progress ? PROT_WRITE : 0),
+			   MAP_SHARED, thread->fd, 0);
+		if (map != MAP_FAILED) {
+			thread->map = map;
+			thread->map_size = buf.st_size;
+#ifdef MADV_SEQUENTIAL
+			(void) madvise(map, buf.st_size, MADV_SEQUENTIAL);
+#endif
+		} else {
+			DEBUG2("Failed mapping %s, reading it instead: %s", thread->filename_work, fr_syserror(errno));
+		}
+	}
+
+	if (inst->order_by_session) {
+		thread->sessions = fr_hash_table_create(thread, session_hash, session_cmp, NULL);
+		if (!thread->sessions) {
+			cf_log_err(inst->cs, "Failed creating session table");
+			return -1;
+		}
+	}
+
 	fr_assert(thread->name == NULL);
 	fr_assert(thread->filename_work != NULL);
 	thread->name = talloc_typed_asprintf(thread, "proto_detail working file %s", thread->filename_work);
@@ -749,6 +1012,11 @@ static int mod_close_internal(proto_detail_work_thread_t *thread)
 
 	unlink(thread->filename_work);
 
+	if (thread->map) {
+		(void) munmap(thread->map, thread->map_size);
+		thread->map = NULL;
+	}
+
 	close(thread->fd);
 	thread->fd = -1;
 
@@ -27,6 +27,7 @@
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/util/udp.h>
 #include <freeradius-devel/util/trie.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/io/base.h>
 #include <freeradius-devel/io/application.h>
@@ -38,12 +39,42 @@
 
 extern fr_app_io_t proto_dhcpv4_udp;
 
+/** A lease we've ACKed, which can be renewed without running the virtual server
+ *
+ */
+typedef struct {
+	uint8_t				htype;			//!< Hardware type of the client.
+	uint8_t				hlen;			//!< Length of the hardware address.
+	uint8_t				chaddr[DHCP_CHADDR_LEN];	//!< Hardware address of the client.
+
+	uint32_t			yiaddr;			//!< Address which was leased, in network order.
+	uint32_t			giaddr;			//!< Relay the lease was granted through.
+
+	fr_time_t			expires;		//!< When the lease granted by the virtual
+								///< server ends.
+
+	uint8_t				*reply;			//!< The ACK we sent.
+	size_t				reply_len;		//!< Length of the ACK.
+
+	fr_dlist_t			entry;			//!< Entry in the LRU list.
+} proto_dhcpv4_udp_lease_t;
+
 typedef struct {
 	char const			*name;			//!< socket name
 	int				sockfd;
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
+	udp_batch_t			*batch;			//!< for reading multiple packets at a time.
+	udp_send_batch_t		*send_batch;		//!< for writing multiple replies at a time.
+
+	fr_event_list_t			*el;			//!< for the send delay timer.
+	fr_event_timer_t const		*ev;			//!< send delay timer.
+
+	fr_hash_table_t			*leases;		//!< Leases by client hardware address.
+	fr_dlist_head_t			lease_lru;		//!< Most recently used at the head.
+	uint8_t				*lease_reply;		//!< Where replies from the lease cache are built.
+
 	fr_stats_t			stats;			//!< statistics for this socket
 }  proto_dhcpv4_udp_thread_t;
 
@@ -62,6 +93,17 @@ typedef struct {
 	uint32_t			max_packet_size;	//!< for message ring buffer.
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
 
+	uint16_t			max_recv_coalesce;	//!< Maximum number of packets to read with one
+								//!< recvmmsg() call.
+	uint16_t			max_send_coalesce;	//!< Maximum number of replies to write with one
+								//!< sendmmsg() call.
+	fr_time_delta_t			max_send_delay;		//!< Maximum time a reply can wait to be coalesced.
+
+	uint32_t			lease_max_entries;	//!< Maximum number of leases to cache.  0 disables
+								//!< the lease cache.
+	fr_time_delta_t			lease_min_remaining;	//!< Renewals for leases with less time than this
+								//!< left go through the virtual server.
+
 	uint16_t			port;			//!< Port to listen on.
 
 	bool				broadcast;		//!< whether we listen for broadcast packets
@@ -86,6 +128,13 @@ static const CONF_PARSER networks_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER lease_cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, proto_dhcpv4_udp_t, lease_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("min_remaining", FR_TYPE_TIME_DELTA, proto_dhcpv4_udp_t, lease_min_remaining), .dflt = "600" },
+
+	CONF_PARSER_TERMINATOR
+};
+
 
 static const CONF_PARSER udp_listen_config[] = {
 	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, proto_dhcpv4_udp_t, ipaddr) },
@@ -104,8 +153,12 @@ static const CONF_PARSER udp_listen_config[] = {
 
 	{ FR_CONF_OFFSET("dynamic_clients", FR_TYPE_BOOL, proto_dhcpv4_udp_t, dynamic_clients) } ,
 	{ FR_CONF_POINTER("networks", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) networks_config },
+	{ FR_CONF_POINTER("lease_cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) lease_cache_config },
 
 	{ FR_CONF_OFFSET("max_packet_size", FR_TYPE_UINT32, proto_dhcpv4_udp_t, max_packet_size), .dflt = "4096" } ,
+	{ FR_CONF_OFFSET("max_recv_coalesce", FR_TYPE_UINT16, proto_dhcpv4_udp_t, max_recv_coalesce), .dflt = "1" } ,
+	{ FR_CONF_OFFSET("max_send_coalesce", FR_TYPE_UINT16, proto_dhcpv4_udp_t, max_send_coalesce), .dflt = "1" } ,
+	{ FR_CONF_OFFSET("max_send_delay", FR_TYPE_TIME_DELTA, proto_dhcpv4_udp_t, max_send_delay), .dflt = "0" } ,
        	{ FR_CONF_OFFSET("max_attributes", FR_TYPE_UINT32, proto_dhcpv4_udp_t, max_attributes), .dflt = STRINGIFY(DHCPV4_MAX_ATTRIBUTES) } ,
 
 	CONF_PARSER_TERMINATOR
@@ -121,16 +174,512 @@ fr_dict_autoload_t proto_dhcpv4_udp_dict[] = {
 
 static fr_dict_attr_t const *attr_message_type;
 static fr_dict_attr_t const *attr_dhcp_server_identifier;
+static fr_dict_attr_t const *attr_requested_ip_address;
+static fr_dict_attr_t const *attr_lease_time;
+static fr_dict_attr_t const *attr_renewal_time;
+static fr_dict_attr_t const *attr_rebinding_time;
 
 extern fr_dict_attr_autoload_t proto_dhcpv4_udp_dict_attr[];
 fr_dict_attr_autoload_t proto_dhcpv4_udp_dict_attr[] = {
 	{ .out = &attr_message_type, .name = "DHCP-Message-Type", .type = FR_TYPE_UINT8, .dict = &dict_dhcpv4},
 	{ .out = &attr_dhcp_server_identifier, .name = "DHCP-DHCP-Server-Identifier", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_dhcpv4},
+	{ .out = &attr_requested_ip_address, .name = "DHCP-Requested-IP-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_dhcpv4},
+	{ .out = &attr_lease_time, .name = "DHCP-IP-Address-Lease-Time", .type = FR_TYPE_UINT32, .dict = &dict_dhcpv4},
+	{ .out = &attr_renewal_time, .name = "DHCP-Renewal-Time", .type = FR_TYPE_UINT32, .dict = &dict_dhcpv4},
+	{ .out = &attr_rebinding_time, .name = "DHCP-Rebinding-Time", .type = FR_TYPE_UINT32, .dict = &dict_dhcpv4},
 	{ NULL }
 };
 
+static uint32_t lease_hash(void const *data)
+{
+	proto_dhcpv4_udp_lease_t const *lease = data;
+	uint32_t hash;
+
+	hash = fr_hash(&lease->htype, sizeof(lease->htype));
+	hash = fr_hash_update(&lease->hlen, sizeof(lease->hlen), hash);
+	return fr_hash_update(lease->chaddr, lease->hlen, hash);
+}
+
+static int lease_cmp(void const *one, void const *two)
+{
+	proto_dhcpv4_udp_lease_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->htype > b->htype) - (a->htype < b->htype);
+	if (ret != 0) return ret;
+
+	ret = (a->hlen > b->hlen) - (a->hlen < b->hlen);
+	if (ret != 0) return ret;
+
+	return memcmp(a->chaddr, b->chaddr, a->hlen);
+}
+
+/** Find the cached lease for the client which sent a packet
+ *
+ */
+static proto_dhcpv4_udp_lease_t *lease_find(proto_dhcpv4_udp_thread_t *thread, dhcp_packet_t const *packet)
+{
+	proto_dhcpv4_udp_lease_t find;
+
+	if ((packet->hlen == 0) || (packet->hlen > sizeof(find.chaddr))) return NULL;
+
+	find.htype = packet->htype;
+	find.hlen = packet->hlen;
+	memcpy(find.chaddr, packet->chaddr, packet->hlen);
+
+	return fr_hash_table_finddata(thread->leases, &find);
+}
+
+static void lease_remove(proto_dhcpv4_udp_thread_t *thread, proto_dhcpv4_udp_lease_t *lease)
+{
+	fr_dlist_remove(&thread->lease_lru, lease);
+	fr_hash_table_delete(thread->leases, lease);
+	talloc_free(lease);
+}
+
+/** Remember, or forget, the lease given to a client
+ *
+ * Only ACKs which grant a finite lease are cached.  Any other reply
+ * to the client means that the virtual server has to see its next
+ * request.
+ */
+static void lease_update(proto_dhcpv4_udp_t const *inst, proto_dhcpv4_udp_thread_t *thread,
+			 uint8_t const *buffer, size_t buffer_len)
+{
+	dhcp_packet_t const		*packet = (dhcp_packet_t const *) buffer;
+	proto_dhcpv4_udp_lease_t	*lease;
+	uint8_t const			*code, *option;
+	uint32_t			lease_time;
+
+	if ((packet->hlen == 0) || (packet->hlen > sizeof(packet->chaddr))) return;
+
+	code = fr_dhcpv4_packet_get_option(packet, buffer_len, attr_message_type);
+	if (!code || (code[1] < 1)) return;
+
+	lease = lease_find(thread, packet);
+	if (lease) lease_remove(thread, lease);
+
+	if ((code[2] != FR_DHCP_ACK) || (packet->yiaddr == htonl(INADDR_ANY))) return;
+
+	option = fr_dhcpv4_packet_get_option(packet, buffer_len, attr_lease_time);
+	if (!option || (option[1] != 4)) return;
+
+	memcpy(&lease_time, option + 2, 4);
+	lease_time = ntohl(lease_time);
+	if ((lease_time == 0) || (lease_time == UINT32_MAX)) return;
+
+	/*
+	 *	Evict the least recently used leases.
+	 */
+	while (fr_hash_table_num_elements(thread->leases) >= inst->lease_max_entries) {
+		lease = fr_dlist_tail(&thread->lease_lru);
+		if (!lease) break;
+
+		lease_remove(thread, lease);
+	}
+
+	MEM(lease = talloc_zero(thread->leases, proto_dhcpv4_udp_lease_t));
+	lease->htype = packet->htype;
+	lease->hlen = packet->hlen;
+	memcpy(lease->chaddr, packet->chaddr, packet->hlen);
+	lease->yiaddr = packet->yiaddr;
+	lease->giaddr = packet->giaddr;
+	lease->expires = fr_time() + fr_time_delta_from_sec(lease_time);
+	MEM(lease->reply = talloc_memdup(lease, buffer, buffer_len));
+	lease->reply_len = buffer_len;
+
+	if (!fr_hash_table_insert(thread->leases, lease)) {
+		talloc_free(lease);
+		return;
+	}
+	fr_dlist_insert_head(&thread->lease_lru, lease);
+}
+
+/** Overwrite a 32-bit option in a reply we're building
+ *
+ */
+static void lease_option_set(uint8_t *buffer, size_t buffer_len, fr_dict_attr_t const *da, uint32_t value)
+{
+	uint8_t const *option;
+
+	option = fr_dhcpv4_packet_get_option((dhcp_packet_t const *) buffer, buffer_len, da);
+	if (!option || (option[1] != 4)) return;
+
+	value = htonl(value);
+	memcpy(buffer + (option - buffer) + 2, &value, 4);
+}
+
+/** Figure out where a reply should be sent
+ *
+ * @param[in] inst		of the listener.
+ * @param[in] thread		of the listener.
+ * @param[in,out] address	the request came from, with src/dst swapped.  Updated
+ *				with the addresses the reply should be sent from and to.
+ * @param[in] buffer		containing the reply.  The opcode and hops are updated.
+ * @param[in] buffer_len	length of the reply.
+ * @param[in] request		the reply is for.  Only the first 20 bytes are available.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the reply should be discarded.
+ */
+static int mod_reply_address(proto_dhcpv4_udp_t const *inst, proto_dhcpv4_udp_thread_t *thread,
+			     fr_io_address_t *address, uint8_t *buffer, size_t buffer_len,
+			     dhcp_packet_t const *request)
+{
+	uint8_t const *code, *sid;
+	uint32_t ipaddr;
+	dhcp_packet_t *packet = (dhcp_packet_t *) buffer;
+#ifdef WITH_IFINDEX_IPADDR_RESOLUTION
+	fr_ipaddr_t primary;
+#endif
+
+	/*
+	 *	This isn't available in the packet header.
+	 */
+	code = fr_dhcpv4_packet_get_option(packet, buffer_len, attr_message_type);
+	if (!code || (code[1] < 1) || (code[2] == 0) || (code[2] > FR_DHCP_LEASE_ACTIVE)) {
+		DEBUG("WARNING - silently discarding reply due to invalid or missing message type");
+		return -1;
+	}
+
+	/*
+	 *	Set the source IP of the packet.
+	 *
+	 *	- if src_ipaddr is unicast, use that
+	 *	- else if socket wasn't bound to *, then use that
+	 *	- else if we have if_index, get main IP from that interface and use that.
+	 *	- else for offer/ack, look at option 54, for Server Identification and use that
+	 *	- else leave source IP as whatever is already in "address->src_ipaddr".
+	 */
+	if (inst->src_ipaddr.addr.v4.s_addr != INADDR_ANY) {
+		address->src_ipaddr = inst->src_ipaddr;
+
+	} else if (inst->ipaddr.addr.v4.s_addr != INADDR_ANY) {
+		address->src_ipaddr = inst->ipaddr;
+
+#ifdef WITH_IFINDEX_IPADDR_RESOLUTION
+	} else if ((address->if_index > 0) &&
+		   (fr_ipaddr_from_ifindex(&primary, thread->sockfd, &address->dst_ipaddr.af,
+					   &address->if_index) == 0)) {
+		address->src_ipaddr = primary;
+#endif
+	} else if (((code[2] == FR_DHCP_OFFER) || (code[2] == FR_DHCP_ACK)) &&
+		   ((sid = fr_dhcpv4_packet_get_option(packet, buffer_len, attr_dhcp_server_identifier)) != NULL) &&
+		   (sid[1] == 4)) {
+		memcpy(&address->src_ipaddr.addr.v4.s_addr, sid + 2, 4);
+	}
+
+	/*
+	 *	We have GIADDR in the packet, so send it
+	 *	there.  The packet is FROM our IP address and
+	 *	port, TO the destination IP address, at the
+	 *	same (i.e. server) port.
+	 */
+	memcpy(&ipaddr, &packet->giaddr, 4);
+	if (ipaddr != INADDR_ANY) {
+		DEBUG("Reply will be sent to giaddr.");
+		address->dst_ipaddr.addr.v4.s_addr = ipaddr;
+		address->dst_port = inst->port;
+		address->src_port = inst->port;
+
+		/*
+		 *	Increase the hop count for client
+		 *	packets sent to the next gateway.
+		 */
+		if ((code[2] == FR_DHCP_DISCOVER) ||
+		    (code[2] == FR_DHCP_REQUEST)) {
+			packet->opcode = 1; /* client message */
+			packet->hops = request->hops + 1;
+		} else {
+			packet->opcode = 2; /* server message */
+		}
+
+		return 0;
+	}
+
+	/*
+	 *	If there's no GIADDR, we don't know where to
+	 *	send client packets.
+	 */
+	if ((code[2] == FR_DHCP_DISCOVER) || (code[2] == FR_DHCP_REQUEST)) {
+		DEBUG("WARNING - silently discarding client reply, as there is no GIADDR to send it to.");
+		return -1;
+	}
+
+	packet->opcode = 2; /* server message */
+
+	/*
+	 *	The original packet requested a broadcast
+	 *	reply, and CIADDR is empty, go broadcast the
+	 *	reply.  RFC 2131 page 23.
+	 */
+	if (((request->flags & FR_DHCP_FLAGS_VALUE_BROADCAST) != 0) &&
+	    (request->ciaddr == INADDR_ANY)) {
+		DEBUG("Reply will be broadcast due to client request.");
+		address->dst_ipaddr.addr.v4.s_addr = INADDR_BROADCAST;
+		return 0;
+	}
+
+	/*
+	 *	The original packet has CIADDR, so we unicast
+	 *	the reply there.  RFC 2131 page 23.
+	 */
+	if (request->ciaddr != INADDR_ANY) {
+		DEBUG("Reply will be unicast to CIADDR from original packet.");
+		memcpy(&address->dst_ipaddr.addr.v4.s_addr, &request->ciaddr, 4);
+		return 0;
+	}
+
+	/*
+	 *	The original packet was unicast to us, such as
+	 *	via a relay.  We have a unicast destination
+	 *	address, so we just use that.
+	 */
+	if ((packet->yiaddr == htonl(INADDR_ANY)) &&
+	    (address->dst_ipaddr.addr.v4.s_addr != htonl(INADDR_BROADCAST))) {
+		DEBUG("Reply will be unicast to source IP from original packet.");
+		return 0;
+	}
+
+	switch (code[2]) {
+		/*
+		 *	Offers are sent to YIADDR if we
+		 *	received a unicast packet from YIADDR.
+		 *	Otherwise, they are unicast to YIADDR
+		 *	(if we can update ARP), otherwise they
+		 *	are broadcast.
+		 */
+	case FR_DHCP_OFFER:
+		/*
+		 *	If the packet was unicast from the
+		 *	client, unicast it back.
+		 */
+		if (memcmp(&address->dst_ipaddr.addr.v4.s_addr, &packet->yiaddr, 4) == 0) {
+			DEBUG("Reply will be unicast to YIADDR.");
+
+#ifdef SIOCSARP
+		} else if (inst->broadcast && inst->interface) {
+			if (fr_dhcpv4_udp_add_arp_entry(thread->sockfd, inst->interface,
+							&packet->yiaddr, &packet->chaddr) < 0) {
+				DEBUG("Failed adding ARP entry.  Reply will be broadcast.");
+				address->dst_ipaddr.addr.v4.s_addr = INADDR_BROADCAST;
+			} else {
+				DEBUG("Reply will be unicast to YIADDR after ARP table updates.");
+			}
+
+#endif
+		} else {
+			DEBUG("Reply will be broadcast due to OFFER.");
+			address->dst_ipaddr.addr.v4.s_addr = INADDR_BROADCAST;
+		}
+		break;
+
+		/*
+		 *	ACKs are unicast to YIADDR
+		 */
+	case FR_DHCP_ACK:
+		DEBUG("Reply will be unicast to YIADDR.");
+		memcpy(&address->dst_ipaddr.addr.v4.s_addr, &packet->yiaddr, 4);
+		break;
+
+		/*
+		 *	NAKs are broadcast.
+		 */
+	case FR_DHCP_NAK:
+		DEBUG("Reply will be broadcast due to NAK.");
+		address->dst_ipaddr.addr.v4.s_addr = INADDR_BROADCAST;
+		break;
+
+	default:
+		DEBUG("WARNING - silently discarding reply due to invalid message type %d", code[2]);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Send a reply, or queue it to be sent with other replies
+ *
+ */
+static ssize_t mod_send(proto_dhcpv4_udp_thread_t *thread, uint8_t *buffer, size_t buffer_len, int flags,
+			fr_io_address_t const *address)
+{
+	if (!thread->send_batch) {
+		return udp_send(thread->sockfd, buffer, buffer_len, flags,
+				&address->src_ipaddr, address->src_port,
+				address->if_index,
+				&address->dst_ipaddr, address->dst_port);
+	}
+
+	/*
+	 *	No more room, write out the queued replies before
+	 *	adding this one.
+	 */
+	if (udp_send_batch_full(thread->send_batch) &&
+	    (udp_send_batch_flush(thread->send_batch, thread->sockfd) < 0)) return -1;
+
+	return udp_send_batch_add(thread->send_batch, thread->sockfd, buffer, buffer_len, flags,
+				  &address->src_ipaddr, address->src_port,
+				  address->if_index,
+				  &address->dst_ipaddr, address->dst_port);
+}
+
+static void mod_flush_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx);
+
+/** Write the queued replies
+ *
+ * Replies are held back for up to max_send_delay, so that more
+ * replies can be written with the same system call.
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	proto_dhcpv4_udp_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_dhcpv4_udp_t);
+	proto_dhcpv4_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dhcpv4_udp_thread_t);
+	fr_time_t			oldest;
+
+	if (!thread->send_batch) return 0;
+
+	oldest = udp_send_batch_oldest(thread->send_batch);
+	if (!oldest) return 0;
+
+	/*
+	 *	Wait for more replies, unless the batch is full, or
+	 *	the oldest reply has already waited long enough.
+	 */
+	if (inst->max_send_delay && thread->el && !udp_send_batch_full(thread->send_batch) &&
+	    ((oldest + inst->max_send_delay) > fr_time())) {
+		if (thread->ev) return 0;
+
+		if (fr_event_timer_at(thread, thread->el, &thread->ev, oldest + inst->max_send_delay,
+				      mod_flush_timer, li) == 0) return 0;
+	}
+
+	if (thread->ev) fr_event_timer_delete(&thread->ev);
+
+	if (udp_send_batch_flush(thread->send_batch, thread->sockfd) < 0) {
+		PERROR("proto_dhcpv4_udp failed writing replies");
+		return -1;
+	}
+
+	/*
+	 *	The socket wasn't writable.  Try again soon.
+	 */
+	if (udp_send_batch_pending(thread->send_batch) && thread->el) {
+		(void) fr_event_timer_in(thread, thread->el, &thread->ev, fr_time_delta_from_msec(1),
+					 mod_flush_timer, li);
+	}
+
+	return 0;
+}
+
+static void mod_flush_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_listen_t			*li = talloc_get_type_abort(uctx, fr_listen_t);
+	proto_dhcpv4_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dhcpv4_udp_thread_t);
+
+	if (udp_send_batch_flush(thread->send_batch, thread->sockfd) < 0) {
+		PERROR("proto_dhcpv4_udp failed writing replies");
+		return;
+	}
+
+	if (udp_send_batch_pending(thread->send_batch)) {
+		(void) fr_event_timer_in(thread, thread->el, &thread->ev, fr_time_delta_from_msec(1),
+					 mod_flush_timer, li);
+	}
+}
+
+static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, UNUSED void *nr)
+{
+	proto_dhcpv4_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dhcpv4_udp_thread_t);
+
+	thread->el = el;
+}
+
+/** Answer a renewal from the lease cache
+ *
+ * RENEWING, REBINDING and INIT-REBOOT clients ask for the address
+ * they already have.  If we ACKed that address recently, through
+ * the same relay, then we re-send the ACK without running the
+ * virtual server.  The ACK only grants what's left of the lease the
+ * virtual server gave out, so the lease is never extended without
+ * the virtual server (and whatever backs it) seeing the request.
+ *
+ * @return
+ *	- true if the request was answered.
+ *	- false if it needs full processing.
+ */
+static bool mod_lease_reply(fr_listen_t *li, proto_dhcpv4_udp_t const *inst, proto_dhcpv4_udp_thread_t *thread,
+			    fr_io_address_t const *from, dhcp_packet_t const *request, size_t request_len)
+{
+	proto_dhcpv4_udp_lease_t	*lease;
+	dhcp_packet_t			*packet;
+	fr_io_address_t			address;
+	uint8_t const			*option;
+	uint32_t			ipaddr, remaining;
+	fr_time_t			now;
+
+	lease = lease_find(thread, request);
+	if (!lease) return false;
+
+	/*
+	 *	SELECTING clients are answering an OFFER, which
+	 *	the virtual server has to see.
+	 */
+	if (fr_dhcpv4_packet_get_option(request, request_len, attr_dhcp_server_identifier)) return false;
+
+	memcpy(&ipaddr, &request->ciaddr, 4);
+	if (ipaddr == INADDR_ANY) {
+		option = fr_dhcpv4_packet_get_option(request, request_len, attr_requested_ip_address);
+		if (!option || (option[1] != 4)) return false;
+
+		memcpy(&ipaddr, option + 2, 4);
+	}
+
+	if ((ipaddr != lease->yiaddr) || (request->giaddr != lease->giaddr)) return false;
+
+	now = fr_time();
+	if ((lease->expires - now) < inst->lease_min_remaining) return false;
+
+	remaining = (uint32_t) fr_time_delta_to_sec(lease->expires - now);
+
+	memcpy(thread->lease_reply, lease->reply, lease->reply_len);
+	packet = (dhcp_packet_t *) thread->lease_reply;
+	packet->xid = request->xid;
+	packet->flags = request->flags;
+	packet->ciaddr = request->ciaddr;
+
+	lease_option_set(thread->lease_reply, lease->reply_len, attr_lease_time, remaining);
+	lease_option_set(thread->lease_reply, lease->reply_len, attr_renewal_time, remaining / 2);
+	lease_option_set(thread->lease_reply, lease->reply_len, attr_rebinding_time, (remaining / 8) * 7);
+
+	address.src_ipaddr = from->dst_ipaddr;
+	address.src_port = from->dst_port;
+	address.dst_ipaddr = from->src_ipaddr;
+	address.dst_port = from->src_port;
+	address.if_index = from->if_index;
+
+	if (mod_reply_address(inst, thread, &address, thread->lease_reply, lease->reply_len, request) < 0) return false;
+
+	if (mod_send(thread, thread->lease_reply, lease->reply_len, 0, &address) < 0) {
+		PERROR("proto_dhcpv4_udp failed writing reply from lease cache");
+		return false;
+	}
+	(void) mod_flush(li);
+
+	fr_dlist_remove(&thread->lease_lru, lease);
+	fr_dlist_insert_head(&thread->lease_lru, lease);
+
+	thread->stats.total_responses++;
+
+	DEBUG2("proto_dhcpv4_udp - Answered XID %08x from lease cache, %u seconds remaining %s",
+	       ntohl(request->xid), remaining, thread->name);
+
+	return true;
+}
+
 static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len, size_t *leftover, UNUSED uint32_t *priority, UNUSED bool *is_dup)
 {
+	proto_dhcpv4_udp_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_dhcpv4_udp_t);
 	proto_dhcpv4_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dhcpv4_udp_thread_t);
 	fr_io_address_t			*address, **address_p;
 
@@ -155,10 +704,18 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 */
 	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
 
-	data_size = udp_recv(thread->sockfd, buffer, buffer_len, flags,
-			     &address->src_ipaddr, &address->src_port,
-			     &address->dst_ipaddr, &address->dst_port,
-			     &address->if_index, recv_time_p);
+	if (thread->batch) {
+		data_size = udp_batch_recv(thread->batch, thread->sockfd, buffer, buffer_len, flags,
+					   &address->src_ipaddr, &address->src_port,
+					   &address->dst_ipaddr, &address->dst_port,
+					   &address->if_index, recv_time_p);
+		li->read_pending = (udp_batch_pending(thread->batch) > 0);
+	} else {
+		data_size = udp_recv(thread->sockfd, buffer, buffer_len, flags,
+				     &address->src_ipaddr, &address->src_port,
+				     &address->dst_ipaddr, &address->dst_port,
+				     &address->if_index, recv_time_p);
+	}
 	if (data_size < 0) {
 		DEBUG2("proto_dhvpv4_udp got read error %zd: %s", data_size, fr_strerror());
 		return data_size;
@@ -193,6 +750,30 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 		return 0;
 	}
 
+	/*
+	 *	Renewals may be answered from the lease cache.
+	 *	Clients which give up their lease have to go
+	 *	through the virtual server the next time.
+	 */
+	if (thread->leases && !thread->connection && (packet->opcode == 1)) {
+		proto_dhcpv4_udp_lease_t *lease;
+
+		switch (message_type) {
+		case FR_DHCP_REQUEST:
+			if (mod_lease_reply(li, inst, thread, address, packet, packet_len)) return 0;
+			break;
+
+		case FR_DHCP_DECLINE:
+		case FR_DHCP_RELEASE:
+			lease = lease_find(thread, packet);
+			if (lease) lease_remove(thread, lease);
+			break;
+
+		default:
+			break;
+		}
+	}
+
 	/*
 	 *	proto_dhcpv4 sets the priority
 	 */
@@ -244,185 +825,16 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	 *	Figure out which kind of packet we're sending.
 	 */
 	if (!thread->connection) {
-		uint8_t const *code, *sid;
-		uint32_t ipaddr;
-		dhcp_packet_t *packet = (dhcp_packet_t *) buffer;
-		dhcp_packet_t *request = (dhcp_packet_t *) track->packet; /* only 20 bytes tho! */
-#ifdef WITH_IFINDEX_IPADDR_RESOLUTION
-		fr_ipaddr_t primary;
-#endif
-
-		/*
-		 *	This isn't available in the packet header.
-		 */
-		code = fr_dhcpv4_packet_get_option(packet, buffer_len, attr_message_type);
-		if (!code || (code[1] < 1) || (code[2] == 0) || (code[2] > FR_DHCP_LEASE_ACTIVE)) {
-			DEBUG("WARNING - silently discarding reply due to invalid or missing message type");
-			return 0;
-		}
-
-		/*
-		 *	Set the source IP of the packet.
-		 *
-		 *	- if src_ipaddr is unicast, use that
-		 *	- else if socket wasn't bound to *, then use that
-		 *	- else if we have if_index, get main IP from that interface and use that.
-		 *	- else for offer/ack, look at option 54, for Server Identification and use that
-		 *	- else leave source IP as whatever is already in "address.src_ipaddr".
-		 */
-		if (inst->src_ipaddr.addr.v4.s_addr != INADDR_ANY) {
-			address.src_ipaddr = inst->src_ipaddr;
-
-		} else if (inst->ipaddr.addr.v4.s_addr != INADDR_ANY) {
-			address.src_ipaddr = inst->ipaddr;
-
-#ifdef WITH_IFINDEX_IPADDR_RESOLUTION
-		} else if ((address->if_index > 0) &&
-			   (fr_ipaddr_from_ifindex(&primary, thread->sockfd, &address.dst_ipaddr.af,
-						   &address.if_index) == 0)) {
-			address.src_ipaddr = primary;
-#endif
-		} else if (((code[2] == FR_DHCP_OFFER) || (code[2] == FR_DHCP_ACK)) &&
-			   ((sid = fr_dhcpv4_packet_get_option(packet, buffer_len, attr_dhcp_server_identifier)) != NULL) &&
-			   (sid[1] == 4)) {
-			memcpy(&address.src_ipaddr.addr.v4.s_addr, sid + 2, 4);
-		}
-
-		/*
-		 *	We have GIADDR in the packet, so send it
-		 *	there.  The packet is FROM our IP address and
-		 *	port, TO the destination IP address, at the
-		 *	same (i.e. server) port.
-		 */
-		memcpy(&ipaddr, &packet->giaddr, 4);
-		if (ipaddr != INADDR_ANY) {
-			DEBUG("Reply will be sent to giaddr.");
-			address.dst_ipaddr.addr.v4.s_addr = ipaddr;
-			address.dst_port = inst->port;
-			address.src_port = inst->port;
-
-			/*
-			 *	Increase the hop count for client
-			 *	packets sent to the next gateway.
-			 */
-			if ((code[2] == FR_DHCP_DISCOVER) ||
-			    (code[2] == FR_DHCP_REQUEST)) {
-				packet->opcode = 1; /* client message */
-				packet->hops = request->hops + 1;
-			} else {
-				packet->opcode = 2; /* server message */
-			}
-
-			goto send_reply;
-		}
-
-		/*
-		 *	If there's no GIADDR, we don't know where to
-		 *	send client packets.
-		 */
-		if ((code[2] == FR_DHCP_DISCOVER) || (code[2] == FR_DHCP_REQUEST)) {
-			DEBUG("WARNING - silently discarding client reply, as there is no GIADDR to send it to.");
-			return 0;
-		}
-
-		packet->opcode = 2; /* server message */
-
-		/*
-		 *	The original packet requested a broadcast
-		 *	reply, and CIADDR is empty, go broadcast the
-		 *	reply.  RFC 2131 page 23.
-		 */
-		if (((request->flags & FR_DHCP_FLAGS_VALUE_BROADCAST) != 0) &&
-		    (request->ciaddr == INADDR_ANY)) {
-			DEBUG("Reply will be broadcast due to client request.");
-			address.dst_ipaddr.addr.v4.s_addr = INADDR_BROADCAST;
-			goto send_reply;
-		}
-
-		/*
-		 *	The original packet has CIADDR, so we unicast
-		 *	the reply there.  RFC 2131 page 23.
-		 */
-		if (request->ciaddr != INADDR_ANY) {
-			DEBUG("Reply will be unicast to CIADDR from original packet.");
-			memcpy(&address.dst_ipaddr.addr.v4.s_addr, &request->ciaddr, 4);
-			goto send_reply;
-		}
-
-		/*
-		 *	The original packet was unicast to us, such as
-		 *	via a relay.  We have a unicast destination
-		 *	address, so we just use that.
-		 */
-		if ((packet->yiaddr == htonl(INADDR_ANY)) &&
-		    (address.dst_ipaddr.addr.v4.s_addr != htonl(INADDR_BROADCAST))) {
-			DEBUG("Reply will be unicast to source IP from original packet.");
-			goto send_reply;
-		}
-
-		switch (code[2]) {
-			/*
-			 *	Offers are sent to YIADDR if we
-			 *	received a unicast packet from YIADDR.
-			 *	Otherwise, they are unicast to YIADDR
-			 *	(if we can update ARP), otherwise they
-			 *	are broadcast.
-			 */
-		case FR_DHCP_OFFER:
-			/*
-			 *	If the packet was unicast from the
-			 *	client, unicast it back.
-			 */
-			if (memcmp(&address.dst_ipaddr.addr.v4.s_addr, &packet->yiaddr, 4) == 0) {
-				DEBUG("Reply will be unicast to YIADDR.");
-
-#ifdef SIOCSARP
-			} else if (inst->broadcast && inst->interface) {
-				if (fr_dhcpv4_udp_add_arp_entry(thread->sockfd, inst->interface,
-								&packet->yiaddr, &packet->chaddr) < 0) {
-					DEBUG("Failed adding ARP entry.  Reply will be broadcast.");
-					address.dst_ipaddr.addr.v4.s_addr = INADDR_BROADCAST;
-				} else {
-					DEBUG("Reply will be unicast to YIADDR after ARP table updates.");
-				}
-
-#endif
-			} else {
-				DEBUG("Reply will be broadcast due to OFFER.");
-				address.dst_ipaddr.addr.v4.s_addr = INADDR_BROADCAST;
-			}
-			break;
+		if (mod_reply_address(inst, thread, &address, buffer, buffer_len,
+				      (dhcp_packet_t const *) track->packet) < 0) return 0;
 
-			/*
-			 *	ACKs are unicast to YIADDR
-			 */
-		case FR_DHCP_ACK:
-			DEBUG("Reply will be unicast to YIADDR.");
-			memcpy(&address.dst_ipaddr.addr.v4.s_addr, &packet->yiaddr, 4);
-			break;
-
-			/*
-			 *	NAKs are broadcast.
-			 */
-		case FR_DHCP_NAK:
-			DEBUG("Reply will be broadcast due to NAK.");
-			address.dst_ipaddr.addr.v4.s_addr = INADDR_BROADCAST;
-			break;
-
-		default:
-			DEBUG("WARNING - silently discarding reply due to invalid message type %d", code[2]);
-			return 0;
-		}
+		if (thread->leases) lease_update(inst, thread, buffer, buffer_len);
 	}
 
-send_reply:
 	/*
 	 *	proto_dhcpv4 takes care of suppressing do-not-respond, etc.
 	 */
-	data_size = udp_send(thread->sockfd, buffer, buffer_len, flags,
-			     &address.src_ipaddr, address.src_port,
-			     address.if_index,
-			     &address.dst_ipaddr, address.dst_port);
+	data_size = mod_send(thread, buffer, buffer_len, flags, &address);
 
 	/*
 	 *	This socket is dead.  That's an error...
@@ -512,6 +924,45 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+	/*
+	 *	Read multiple packets at a time, if we're allowed to.
+	 */
+	if (inst->max_recv_coalesce > 1) {
+		thread->batch = udp_batch_alloc(thread, inst->max_recv_coalesce, inst->max_packet_size);
+		if (!thread->batch) {
+			close(sockfd);
+			ERROR("Failed allocating receive buffers");
+			goto error;
+		}
+	}
+
+	/*
+	 *	Write multiple replies at a time, if we're allowed to.
+	 */
+	if (inst->max_send_coalesce > 1) {
+		thread->send_batch = udp_send_batch_alloc(thread, inst->max_send_coalesce, inst->max_packet_size);
+		if (!thread->send_batch) {
+			close(sockfd);
+			ERROR("Failed allocating send buffers");
+			goto error;
+		}
+	}
+
+	/*
+	 *	Each thread reads and writes its own socket, so it
+	 *	sees both the ACKs and the renewals for its clients.
+	 */
+	if (inst->lease_max_entries > 0) {
+		thread->leases = fr_hash_table_create(thread, lease_hash, lease_cmp, NULL);
+		if (!thread->leases) {
+			close(sockfd);
+			ERROR("Failed creating lease cache");
+			goto error;
+		}
+		fr_dlist_init(&thread->lease_lru, proto_dhcpv4_udp_lease_t, entry);
+		MEM(thread->lease_reply = talloc_array(thread, uint8_t, inst->max_packet_size));
+	}
+
 	ci = cf_parent(inst->cs); /* listen { ... } */
 	fr_assert(ci != NULL);
 	ci = cf_parent(ci);
@@ -606,6 +1057,16 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, MIN_PACKET_SIZE);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("max_recv_coalesce", inst->max_recv_coalesce, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_recv_coalesce", inst->max_recv_coalesce, <=, 1024);
+
+	FR_INTEGER_BOUND_CHECK("max_send_coalesce", inst->max_send_coalesce, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_send_coalesce", inst->max_send_coalesce, <=, 1024);
+
+	FR_TIME_DELTA_BOUND_CHECK("max_send_delay", inst->max_send_delay, <=, fr_time_delta_from_msec(100));
+
+	FR_INTEGER_BOUND_CHECK("lease_cache.max_entries", inst->lease_max_entries, <=, 1 << 24);
+
 	if (!inst->port) {
 		struct servent *s;
 
@@ -718,8 +1179,10 @@ fr_app_io_t proto_dhcpv4_udp = {
 	.open			= mod_open,
 	.read			= mod_read,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.fd_set			= mod_fd_set,
 	.connection_set		= mod_connection_set,
+	.event_list_set		= mod_event_list_set,
 	.network_get		= mod_network_get,
 	.client_find		= mod_client_find,
 	.get_name      		= mod_name,
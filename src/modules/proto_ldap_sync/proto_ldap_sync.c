@@ -123,6 +123,8 @@ static CONF_PARSER ldap_sync_search_config[] = {
 
 	{ FR_CONF_OFFSET("allow_refresh", FR_TYPE_BOOL, sync_config_t, allow_refresh), .dflt = "no" },
 
+	{ FR_CONF_OFFSET("replica", FR_TYPE_STRING, sync_config_t, replica_name) },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -573,6 +575,7 @@ static void proto_ldap_sync_reinit(fr_event_list_t *el, fr_time_t now, void *use
 	/*
 	 *	Reinitialise the sync
 	 */
+	if (config->replica) fr_ldap_replica_refresh_start(config->replica);
 	if (sync_state_init(inst->conn, config, NULL, true) == 0) return;
 
 	PERROR("Failed reinitialising sync, will retry in %pV seconds", fr_box_time_delta(inst->sync_retry_interval));
@@ -660,6 +663,28 @@ static int _proto_ldap_present(fr_ldap_connection_t *conn, sync_config_t const *
 	return 0;
 }
 
+/** Receive notification that the refresh phase is complete
+ *
+ * Any entries in the replica the server didn't tell us about during the
+ * refresh no longer exist.
+ *
+ * @note This is a callback for the sync_demux function.
+ *
+ * @param[in] conn	the sync belongs to.
+ * @param[in] config	of the sync that completed its refresh.
+ * @param[in] sync_id	of the sync that completed its refresh.
+ * @param[in] phase	Refresh phase the sync was in.
+ * @param[in] user_ctx	The listener.
+ * @return 0.
+ */
+static int _proto_ldap_refresh_done(UNUSED fr_ldap_connection_t *conn, sync_config_t const *config,
+				    UNUSED int sync_id, UNUSED sync_phases_t phase, UNUSED void *user_ctx)
+{
+	if (config->replica) fr_ldap_replica_refresh_done(config->replica);
+
+	return 0;
+}
+
 /** Enque a new cookie store request
  *
  * Create a new request containing the cookie we received from the LDAP server. This allows
@@ -727,6 +752,34 @@ static int _proto_ldap_entry(fr_ldap_connection_t *conn, sync_config_t const *co
 	fr_ldap_map_exp_t	expanded;
 	REQUEST			*request;
 
+	/*
+	 *	Keep the in-memory copy of the directory up to date.
+	 *	Entries in the present phase are sent without
+	 *	attributes, so we only need to note they still exist.
+	 */
+	if (config->replica) {
+		switch (state) {
+		case SYNC_STATE_ADD:
+		case SYNC_STATE_MODIFY:
+			if (msg && (fr_ldap_replica_entry_update(config->replica, conn, uuid, msg) < 0)) {
+				PERROR("Failed updating replica \"%s\"", config->replica_name);
+				return -1;
+			}
+			break;
+
+		case SYNC_STATE_PRESENT:
+			fr_ldap_replica_entry_update(config->replica, conn, uuid, NULL);
+			break;
+
+		case SYNC_STATE_DELETE:
+			fr_ldap_replica_entry_delete(config->replica, uuid);
+			break;
+
+		default:
+			break;
+		}
+	}
+
 	request = proto_ldap_request_setup(listen, inst, sync_id);
 	if (!request) return -1;
 
@@ -1063,10 +1116,19 @@ static int proto_ldap_socket_open(UNUSED CONF_SECTION *cs, rad_listen_t *listen)
 		uint8_t *cookie;
 		int	ret;
 
+		/*
+		 *	The replica only lives in memory, so it needs
+		 *	the complete contents of the DIT, not just the
+		 *	changes since the last cookie.
+		 */
+		if (inst->sync_config[i]->replica) {
+			cookie = NULL;
+			fr_ldap_replica_refresh_start(inst->sync_config[i]->replica);
+
 		/*
 		 *	Synchronously load the cookie... ewww
 		 */
-		if (proto_ldap_cookie_load(inst, &cookie, listen, inst->sync_config[i]) < 0) goto error;
+		} else if (proto_ldap_cookie_load(inst, &cookie, listen, inst->sync_config[i]) < 0) goto error;
 		ret = sync_state_init(inst->conn, inst->sync_config[i], cookie, false);
 		talloc_free(cookie);
 		if (ret < 0) goto error;
@@ -1083,6 +1145,16 @@ static int proto_ldap_socket_open(UNUSED CONF_SECTION *cs, rad_listen_t *listen)
  *	- 0 on success.
  *	- -1 on error.
  */
+/** Stop writing to the replica when the sync config is freed
+ *
+ */
+static int _sync_config_free(sync_config_t *config)
+{
+	if (config->replica) fr_ldap_replica_detach(config->replica);
+
+	return 0;
+}
+
 static int proto_ldap_socket_parse(CONF_SECTION *cs, rad_listen_t *listen)
 {
 	proto_ldap_inst_t 	*inst = listen->data;
@@ -1150,6 +1222,33 @@ static int proto_ldap_socket_parse(CONF_SECTION *cs, rad_listen_t *listen)
 		inst->sync_config[i]->entry = _proto_ldap_entry;
 		inst->sync_config[i]->refresh_required = _proto_ldap_refresh_required;
 		inst->sync_config[i]->present = _proto_ldap_present;
+		inst->sync_config[i]->done = _proto_ldap_refresh_done;
+
+		if (inst->sync_config[i]->replica_name) {
+			size_t j;
+
+			/*
+			 *	Stale entries are removed at the end of
+			 *	each refresh, which would remove the
+			 *	entries another sync had written.
+			 */
+			for (j = 0; j < i; j++) {
+				if (!inst->sync_config[j]->replica_name ||
+				    (strcmp(inst->sync_config[j]->replica_name,
+					    inst->sync_config[i]->replica_name) != 0)) continue;
+
+				cf_log_err(sync_cs, "Replica \"%s\" is already written by another sync",
+					   inst->sync_config[i]->replica_name);
+				return -1;
+			}
+
+			inst->sync_config[i]->replica = fr_ldap_replica_acquire(inst->sync_config[i]->replica_name);
+			if (!inst->sync_config[i]->replica) {
+				cf_log_perr(sync_cs, "Failed creating replica");
+				return -1;
+			}
+			talloc_set_destructor(inst->sync_config[i], _sync_config_free);
+		}
 
 		/*
 		 *	Parse and validate any maps
@@ -1203,10 +1302,11 @@ static int ldap_compile_section(CONF_SECTION *server_cs, char const *name1, char
  * @param[in] server_cs		The virtual server containing the sections to compile.
  * @param[in] listen_cs		The listen config section.
  */
-static int proto_ldap_listen_compile(CONF_SECTION *server_cs, UNUSED CONF_SECTION *listen_cs)
+static int proto_ldap_listen_compile(CONF_SECTION *server_cs, CONF_SECTION *listen_cs)
 {
-	int rcode;
-	int found = 0;
+	int		rcode;
+	int		found = 0;
+	CONF_SECTION	*sync_cs;
 
 	rcode = ldap_compile_section(server_cs, "load", "Cookie", MOD_AUTHORIZE);
 	if (rcode < 0) return rcode;
@@ -1232,9 +1332,19 @@ static int proto_ldap_listen_compile(CONF_SECTION *server_cs, UNUSED CONF_SECTIO
 	if (rcode < 0) return rcode;
 	if (rcode > 0) found++;
 
+	/*
+	 *	Maintaining a replica is reason enough
+	 *	to have a listener.
+	 */
+	for (sync_cs = cf_section_find(listen_cs, "sync", NULL);
+	     sync_cs;
+	     sync_cs = cf_section_find_next(listen_cs, sync_cs, "sync", NULL)) {
+		if (cf_pair_find(sync_cs, "replica")) found++;
+	}
+
 	if (found == 0) {
 		cf_log_err(server_cs, "At least one of 'recv [Present|Add|Delete|Modify] { ... }' "
-			      "sections must be present in virtual server %s", cf_section_name2(server_cs));
+			      "sections, or a sync with a 'replica', must be present in virtual server %s", cf_section_name2(server_cs));
 
 		return -1;
 	}
@@ -546,9 +546,10 @@ static int sync_intermediate(sync_state_t *sync, LDAPMessage *msg, UNUSED LDAPCo
 			}
 
 			ret = sync->config->entry(sync->conn, sync->config, sync->msgid, sync->phase,
-						  (uint8_t const *)sync_uuids[i].bv_val, NULL, SYNC_STATE_DELETE,
+						  (uint8_t const *)sync_uuids[i].bv_val, NULL,
+						  refresh_deletes ? SYNC_STATE_DELETE : SYNC_STATE_PRESENT,
 						  sync->config->user_ctx);
-			if (!ret) goto error;
+			if (ret < 0) goto error;
 		}
 
 		ber_bvarray_free(sync_uuids);
@@ -561,6 +562,16 @@ static int sync_intermediate(sync_state_t *sync, LDAPMessage *msg, UNUSED LDAPCo
 
 	}
 
+	/*
+	 *	In refreshAndPersist mode there's no syncDone
+	 *	to tell us the initial content has all been
+	 *	sent, so tell the caller here instead.
+	 */
+	if (refresh_done && sync->config->done) {
+		ret = sync->config->done(sync->conn, sync->config, sync->msgid, sync->phase, sync->config->user_ctx);
+		if (ret != 0) goto error;
+	}
+
 	if (new_cookie && sync->config->cookie) {
 		ret = sync->config->cookie(sync->conn, sync->config, sync->msgid, sync->cookie, sync->config->user_ctx);
 	}
@@ -146,6 +146,9 @@ struct sync_config_s {
 	bool				allow_refresh;		//!< If false, we synthesize the cookie value
 								//!< when no cookie is available.
 
+	char const			*replica_name;		//!< In-memory replica to maintain.
+	fr_ldap_replica_t		*replica;		//!< Replica entries are written to.
+
 	/*
 	 *	LDAP attribute to RADIUS map
 	 */
@@ -42,7 +42,14 @@ static CONF_PARSER const limit_config[] = {
 
 	{ FR_CONF_OFFSET("max_connections", FR_TYPE_UINT32, proto_radius_t, io.max_connections), .dflt = "1024" } ,
 	{ FR_CONF_OFFSET("max_clients", FR_TYPE_UINT32, proto_radius_t, io.max_clients), .dflt = "256" } ,
+	{ FR_CONF_OFFSET("max_pending_clients", FR_TYPE_UINT32, proto_radius_t, io.max_pending_clients), .dflt = "64" } ,
 	{ FR_CONF_OFFSET("max_pending_packets", FR_TYPE_UINT32, proto_radius_t, io.max_pending_packets), .dflt = "256" } ,
+	{ FR_CONF_OFFSET("max_client_outstanding", FR_TYPE_UINT32, proto_radius_t, io.max_client_outstanding), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("max_client_rate", FR_TYPE_UINT32, proto_radius_t, io.max_client_rate), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("max_client_burst", FR_TYPE_UINT32, proto_radius_t, io.max_client_burst), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("max_rate", FR_TYPE_UINT32, proto_radius_t, io.max_rate), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("max_burst", FR_TYPE_UINT32, proto_radius_t, io.max_burst), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("rate_limit_dry_run", FR_TYPE_BOOL, proto_radius_t, io.rate_limit_dry_run), .dflt = "no" } ,
 
 	/*
 	 *	For performance tweaking.  NOT for normal humans.
@@ -83,8 +90,23 @@ static CONF_PARSER const proto_radius_config[] = {
 	 */
 	{ FR_CONF_OFFSET("tunnel_password_zeros", FR_TYPE_BOOL, proto_radius_t, tunnel_password_zeros) } ,
 
+	/*
+	 *	Open one socket per network thread, and optionally
+	 *	steer each client to one of them.
+	 */
+	{ FR_CONF_OFFSET("reuse_port", FR_TYPE_BOOL, proto_radius_t, io.reuse_port), .dflt = "no" } ,
+	{ FR_CONF_OFFSET("steer_by_source", FR_TYPE_BOOL, proto_radius_t, io.steer_by_source), .dflt = "no" } ,
+
+	/*
+	 *	Run packets from this listener in a named worker
+	 *	pool, instead of the virtual server's.
+	 */
+	{ FR_CONF_OFFSET("worker_pool", FR_TYPE_STRING, proto_radius_t, io.worker_pool) } ,
+
 	{ FR_CONF_POINTER("limit", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) limit_config },
 	{ FR_CONF_POINTER("priority", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) priority_config },
+	{ FR_CONF_OFFSET("replicate", FR_TYPE_SUBSECTION | FR_TYPE_OK_MISSING, proto_radius_t, io.replicate_conf),
+	  .subcs = (void const *) fr_io_replicate_config },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -97,11 +119,13 @@ fr_dict_autoload_t proto_radius_dict[] = {
 	{ NULL }
 };
 
+static fr_dict_attr_t const *attr_original_request_authenticator;
 static fr_dict_attr_t const *attr_packet_type;
 static fr_dict_attr_t const *attr_user_name;
 
 extern fr_dict_attr_autoload_t proto_radius_dict_attr[];
 fr_dict_attr_autoload_t proto_radius_dict_attr[] = {
+	{ .out = &attr_original_request_authenticator, .name = "FreeRADIUS-Original-Request-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
 	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius},
 	{ .out = &attr_user_name, .name = "User-Name", .type = FR_TYPE_STRING, .dict = &dict_radius},
 	{ NULL }
@@ -483,9 +507,25 @@ static ssize_t mod_encode(void const *instance, REQUEST *request, uint8_t *buffe
 	}
 #endif
 
-	data_len = fr_radius_encode(buffer, buffer_len, request->packet->data,
-				    client->secret, talloc_array_length(client->secret) - 1,
-				    request->reply->code, request->reply->id, request->reply->vps);
+	/*
+	 *	The client is using extended IDs, so tell it which
+	 *	request this is a reply to.  This overwrites any
+	 *	value copied from a proxied reply.
+	 */
+	if (fr_pair_find_by_da(request->packet->vps, attr_original_request_authenticator, TAG_ANY)) {
+		VALUE_PAIR *vp;
+
+		MEM(pair_update_reply(&vp, attr_original_request_authenticator) >= 0);
+		fr_pair_value_memcpy(vp, request->packet->vector, sizeof(request->packet->vector), true);
+	}
+
+	/*
+	 *	Encode straight into the message buffer the worker
+	 *	reserved for us.
+	 */
+	data_len = fr_radius_encode_dbuff(FR_DBUFF_TMP(buffer, buffer_len), request->packet->data,
+					  client->secret, talloc_array_length(client->secret) - 1,
+					  request->reply->code, request->reply->id, request->reply->vps);
 	if (data_len < 0) {
 		RPEDEBUG("Failed encoding RADIUS reply");
 		return -1;
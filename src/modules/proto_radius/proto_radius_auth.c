@@ -59,6 +59,9 @@ typedef struct {
 							//!< authenticating server to be identified in packet
 							//!< captures.
 
+	char const	*state_backend;			//!< Module to store session-state in, so other
+							//!< servers can continue the conversation.
+
 	fr_state_tree_t	*state_tree;			//!< State tree to link multiple requests/responses.
 
 	CONF_SECTION	*recv_access_request;
@@ -79,6 +82,7 @@ static const CONF_PARSER session_config[] = {
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_UINT32, proto_radius_auth_t, session_timeout), .dflt = "15" },
 	{ FR_CONF_OFFSET("max", FR_TYPE_UINT32, proto_radius_auth_t, max_session), .dflt = "4096" },
 	{ FR_CONF_OFFSET("state_server_id", FR_TYPE_UINT8, proto_radius_auth_t, state_server_id) },
+	{ FR_CONF_OFFSET("backend", FR_TYPE_STRING | FR_TYPE_NOT_EMPTY, proto_radius_auth_t, state_backend) },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -727,12 +731,37 @@ static virtual_server_compile_t compile_list[] = {
 	COMPILE_TERMINATOR
 };
 
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *process_app_cs)
+static int mod_instantiate(void *instance, CONF_SECTION *process_app_cs)
 {
 	proto_radius_auth_t	*inst = instance;
 
 	inst->state_tree = fr_state_tree_init(inst, attr_state, main_config->spawn_workers, inst->max_session,
 					      inst->session_timeout, inst->state_server_id);
+	if (!inst->state_tree) return -1;
+
+	/*
+	 *	Modules which can store session-state
+	 *	publish a backend in their config section.
+	 */
+	if (inst->state_backend) {
+		module_instance_t		*mi;
+		fr_state_backend_t const	*backend;
+
+		mi = module_by_name(NULL, inst->state_backend);
+		if (!mi) {
+			cf_log_err(process_app_cs, "Unknown module instance \"%s\" for session.backend",
+				   inst->state_backend);
+			return -1;
+		}
+
+		backend = cf_data_value(cf_data_find(mi->dl_inst->conf, fr_state_backend_t, NULL));
+		if (!backend) {
+			cf_log_err(process_app_cs, "Module \"%s\" cannot store session-state", inst->state_backend);
+			return -1;
+		}
+
+		fr_state_tree_backend_set(inst->state_tree, backend);
+	}
 
 	return 0;
 }
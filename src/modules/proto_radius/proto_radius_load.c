@@ -92,12 +92,14 @@ struct proto_radius_load_s {
 	fr_load_config_t		load;			//!< load configuration
 
 	char const     			*csv;			//!< where to write CSV stats
+	char const			*report;		//!< where to write the JSON summary
 };
 
 
 static const CONF_PARSER load_listen_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT, proto_radius_load_t, filename) },
 	{ FR_CONF_OFFSET("csv", FR_TYPE_STRING, proto_radius_load_t, csv) },
+	{ FR_CONF_OFFSET("report", FR_TYPE_STRING, proto_radius_load_t, report) },
 
 	{ FR_CONF_OFFSET("max_packet_size", FR_TYPE_UINT32, proto_radius_load_t, max_packet_size), .dflt = "4096" } ,
 	{ FR_CONF_OFFSET("max_attributes", FR_TYPE_UINT32, proto_radius_load_t, max_attributes), .dflt = STRINGIFY(RADIUS_MAX_ATTRIBUTES) } ,
@@ -108,6 +110,7 @@ static const CONF_PARSER load_listen_config[] = {
 	{ FR_CONF_OFFSET("step", FR_TYPE_UINT32, proto_radius_load_t, load.step) },
 	{ FR_CONF_OFFSET("max_backlog", FR_TYPE_UINT32, proto_radius_load_t, load.milliseconds) },
 	{ FR_CONF_OFFSET("parallel", FR_TYPE_UINT32, proto_radius_load_t, load.parallel) },
+	{ FR_CONF_OFFSET("open_loop", FR_TYPE_BOOL, proto_radius_load_t, load.open_loop) },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -168,6 +171,29 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 }
 
 
+/** Write the summary of the test
+ *
+ */
+static void write_report(proto_radius_load_thread_t *thread)
+{
+	int	fd;
+	size_t	len;
+	char	buffer[2048];
+
+	fd = open(thread->inst->report, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		ERROR("Failed opening %s - %s", thread->inst->report, fr_syserror(errno));
+		return;
+	}
+
+	len = fr_load_generator_report_sprint(thread->l, buffer, sizeof(buffer));
+	if (write(fd, buffer, len) < 0) {
+		ERROR("Failed writing to %s - %s", thread->inst->report, fr_syserror(errno));
+	}
+
+	close(fd);
+}
+
 static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, fr_time_t request_time,
 			 UNUSED uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
 {
@@ -186,9 +212,11 @@ static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, fr_time_t req
 	 *	reply.  Then if the load test is done, exit the
 	 *	server.
 	 */
-	state = fr_load_generator_have_reply(thread->l, request_time);
+	state = fr_load_generator_have_reply(thread->l, request_time, li->reply_queue_time, li->reply_done);
 	if (state == FR_LOAD_DONE) {
 		thread->done = true;
+
+		if (thread->inst->report) write_report(thread);
 	}
 
 	return buffer_len;
@@ -23,7 +23,9 @@
  * @copyright 2016 Alan DeKok (aland@deployingradius.com)
  */
 #include <netdb.h>
+#include <sys/uio.h>
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/handover.h>
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/server/tcp.h>
 #include <freeradius-devel/util/trie.h>
@@ -37,6 +39,11 @@
 
 extern fr_app_io_t proto_radius_tcp;
 
+/*
+ *	Maximum number of replies we queue before writing them.
+ */
+#define TCP_MAX_IOV	(64)
+
 typedef struct {
 	char const			*name;			//!< socket name
 	int				sockfd;
@@ -44,6 +51,9 @@ typedef struct {
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
 	fr_stats_t			stats;			//!< statistics for this socket
+
+	struct iovec			iov[TCP_MAX_IOV];	//!< replies waiting to be written.
+	int				num_iov;		//!< number of entries used in iov.
 } proto_radius_tcp_thread_t;
 
 typedef struct {
@@ -200,20 +210,77 @@ static ssize_t mod_read(fr_listen_t *li, UNUSED void **packet_ctx, fr_time_t *re
 }
 
 
+/** Write all of the queued replies with as few system calls as possible
+ *
+ * @param[in] thread	the socket to write to.
+ * @return
+ *	- <0 on error.
+ *	- 0 if the queue has been written.
+ *	- 1 if the socket isn't writable, and data is still queued.
+ */
+static int tcp_flush(proto_radius_tcp_thread_t *thread)
+{
+	ssize_t	data_size;
+	int	i;
+
+	while (thread->num_iov > 0) {
+		data_size = writev(thread->sockfd, thread->iov, thread->num_iov);
+		if (data_size < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 1;
+
+			if (errno == EINTR) continue;
+
+			fr_strerror_printf("Failed writing to socket: %s", fr_syserror(errno));
+			thread->num_iov = 0;
+			return -1;
+		}
+
+		/*
+		 *	Skip the replies which were fully written, and
+		 *	trim the one which was partially written.
+		 */
+		for (i = 0; i < thread->num_iov; i++) {
+			if ((size_t) data_size < thread->iov[i].iov_len) break;
+
+			data_size -= thread->iov[i].iov_len;
+		}
+
+		if (i < thread->num_iov) {
+			thread->iov[i].iov_base = ((uint8_t *) thread->iov[i].iov_base) + data_size;
+			thread->iov[i].iov_len -= data_size;
+		}
+
+		thread->num_iov -= i;
+		if (i && thread->num_iov) memmove(&thread->iov[0], &thread->iov[i],
+						  thread->num_iov * sizeof(thread->iov[0]));
+	}
+
+	return 0;
+}
+
+static int mod_flush(fr_listen_t *li)
+{
+	proto_radius_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_tcp_thread_t);
+
+	return tcp_flush(thread);
+}
+
+/** Queue a reply, which is written when the network calls mod_flush()
+ *
+ *  The network keeps the buffer until the socket has been flushed, so
+ *  we don't need to copy it.
+ */
 static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t request_time,
 			 uint8_t *buffer, size_t buffer_len, size_t written)
 {
 	proto_radius_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_tcp_thread_t);
 	fr_io_track_t			*track = talloc_get_type_abort(packet_ctx, fr_io_track_t);
-	ssize_t				data_size;
 
 	/*
 	 *	@todo - share a stats interface with the parent?  or
 	 *	put the stats in the listener, so that proto_radius
 	 *	can update them, too.. <sigh>
 	 */
-	thread->stats.total_responses++;
-
 	/*
 	 *	This handles the race condition where we get a DUP,
 	 *	but the original packet replies before we're run.
@@ -235,15 +302,23 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	fr_assert(written < buffer_len);
 
 	/*
-	 *	Only write replies if they're RADIUS packets.
-	 *	sometimes we want to NOT send a reply...
+	 *	If the queue is full, try to make room.  If we can't,
+	 *	the network holds on to the reply until the socket is
+	 *	writable.
 	 */
-	data_size = write(thread->sockfd, buffer + written, buffer_len - written);
+	if (thread->num_iov == TCP_MAX_IOV) {
+		int rcode;
 
-	/*
-	 *	This socket is dead.  That's an error...
-	 */
-	if (data_size <= 0) return data_size;
+		rcode = tcp_flush(thread);
+		if (rcode < 0) return -1;
+
+		if (rcode > 0) {
+			errno = EWOULDBLOCK;
+			return -1;
+		}
+	}
+
+	thread->stats.total_responses++;
 
 	/*
 	 *	Root through the reply to determine any
@@ -254,10 +329,11 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 //		status_check_reply(inst, buffer, buffer_len);
 	}
 
-	/*
-	 *	Add in previously written data to the response.
-	 */
-	return data_size + written;
+	thread->iov[thread->num_iov].iov_base = buffer + written;
+	thread->iov[thread->num_iov].iov_len = buffer_len - written;
+	thread->num_iov++;
+
+	return buffer_len;
 }
 
 
@@ -295,6 +371,16 @@ static int mod_open(fr_listen_t *li)
 
 	fr_assert(!thread->connection);
 
+	/*
+	 *	The previous server may have given us its socket,
+	 *	which is already listening.
+	 */
+	sockfd = fr_handover_fd_find(IPPROTO_TCP, &inst->ipaddr, port, inst->interface);
+	if (sockfd >= 0) {
+		li->fd = sockfd;
+		goto listening;
+	}
+
 	li->fd = sockfd = fr_socket_server_tcp(&inst->ipaddr, &port, inst->port_name, true);
 	if (sockfd < 0) {
 		PERROR("Failed opening TCP socket");
@@ -314,8 +400,13 @@ static int mod_open(fr_listen_t *li)
 		goto error;
 	}
 
+listening:
 	thread->sockfd = sockfd;
 
+	if (fr_handover_fd_add(IPPROTO_TCP, &inst->ipaddr, port, inst->interface, sockfd) < 0) {
+		PWARN("Socket can't be handed over to a new server");
+	}
+
 	ci = cf_parent(inst->cs); /* listen { ... } */
 	fr_assert(ci != NULL);
 	ci = cf_parent(ci);
@@ -384,6 +475,23 @@ static int mod_compare(void const *instance, UNUSED void *thread_instance, UNUSE
 }
 
 
+static uint32_t mod_hash(void const *instance, void const *packet)
+{
+	uint32_t hash;
+	proto_radius_tcp_t const *inst = talloc_get_type_abort_const(instance, proto_radius_tcp_t);
+	uint8_t const *p = packet;
+
+	/*
+	 *	Code and ID, and the authenticator if we're using
+	 *	it to dedup.
+	 */
+	hash = fr_hash(p, 2);
+	if (inst->dedup_authenticator) hash = fr_hash_update(p + 4, RADIUS_AUTH_VECTOR_LENGTH, hash);
+
+	return hash;
+}
+
+
 static char const *mod_name(fr_listen_t *li)
 {
 	proto_radius_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_tcp_thread_t);
@@ -598,12 +706,15 @@ fr_app_io_t proto_radius_tcp = {
 
 	.default_message_size	= 4096,
 	.track_duplicates	= true,
+	.deferred_write		= true,
 
 	.open			= mod_open,
 	.read			= mod_read,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.fd_set			= mod_fd_set,
 	.compare		= mod_compare,
+	.hash			= mod_hash,
 	.connection_set		= mod_connection_set,
 	.network_get		= mod_network_get,
 	.client_find		= mod_client_find,
@@ -24,8 +24,10 @@
  */
 #include <netdb.h>
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/handover.h>
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/util/udp.h>
+#include <freeradius-devel/util/udp_ring.h>
 #include <freeradius-devel/util/trie.h>
 #include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/io/base.h>
@@ -44,6 +46,13 @@ typedef struct {
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
+	udp_batch_t			*batch;			//!< for reading multiple packets at a time.
+	udp_send_batch_t		*send_batch;		//!< for writing multiple replies at a time.
+	udp_ring_t			*ring;			//!< for reading packets from a shared memory ring.
+
+	fr_event_list_t			*el;			//!< for the send delay timer.
+	fr_event_timer_t const		*ev;			//!< send delay timer.
+
 	fr_stats_t			stats;			//!< statistics for this socket
 } proto_radius_udp_thread_t;
 
@@ -61,12 +70,21 @@ typedef struct {
 	uint32_t			max_packet_size;	//!< for message ring buffer.
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
 
+	uint16_t			max_recv_coalesce;	//!< Maximum number of packets to read with one
+								//!< recvmmsg() call.
+	uint16_t			max_send_coalesce;	//!< Maximum number of replies to write with one
+								//!< sendmmsg() call.
+	fr_time_delta_t			max_send_delay;		//!< Maximum time a reply can wait to be coalesced.
+
+	uint32_t			recv_ring_size;		//!< How much memory to share with the kernel.
+
 	uint16_t			port;			//!< Port to listen on.
 
 	bool				recv_buff_is_set;	//!< Whether we were provided with a recv_buff
 	bool				send_buff_is_set;	//!< Whether we were provided with a send_buff
 	bool				dynamic_clients;	//!< whether we have dynamic clients
 	bool				dedup_authenticator;	//!< dedup using the request authenticator
+	bool				recv_ring;		//!< read packets from a memory mapped ring.
 
 	RADCLIENT_LIST			*clients;		//!< local clients
 
@@ -102,6 +120,11 @@ static const CONF_PARSER udp_listen_config[] = {
 	{ FR_CONF_POINTER("networks", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) networks_config },
 
 	{ FR_CONF_OFFSET("max_packet_size", FR_TYPE_UINT32, proto_radius_udp_t, max_packet_size), .dflt = "4096" } ,
+	{ FR_CONF_OFFSET("max_recv_coalesce", FR_TYPE_UINT16, proto_radius_udp_t, max_recv_coalesce), .dflt = "1" } ,
+	{ FR_CONF_OFFSET("max_send_coalesce", FR_TYPE_UINT16, proto_radius_udp_t, max_send_coalesce), .dflt = "1" } ,
+	{ FR_CONF_OFFSET("max_send_delay", FR_TYPE_TIME_DELTA, proto_radius_udp_t, max_send_delay), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("recv_ring", FR_TYPE_BOOL, proto_radius_udp_t, recv_ring), .dflt = "no" } ,
+	{ FR_CONF_OFFSET("recv_ring_size", FR_TYPE_UINT32, proto_radius_udp_t, recv_ring_size), .dflt = "4194304" } ,
        	{ FR_CONF_OFFSET("max_attributes", FR_TYPE_UINT32, proto_radius_udp_t, max_attributes), .dflt = STRINGIFY(RADIUS_MAX_ATTRIBUTES) } ,
 
 	CONF_PARSER_TERMINATOR
@@ -133,10 +156,24 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 */
 	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
 
-	data_size = udp_recv(thread->sockfd, buffer, buffer_len, flags,
-			     &address->src_ipaddr, &address->src_port,
-			     &address->dst_ipaddr, &address->dst_port,
-			     &address->if_index, recv_time_p);
+	if (thread->ring && !thread->connection) {
+		data_size = udp_ring_recv(thread->ring, buffer, buffer_len,
+					  &address->src_ipaddr, &address->src_port,
+					  &address->dst_ipaddr, &address->dst_port,
+					  &address->if_index, recv_time_p);
+		li->read_pending = (udp_ring_pending(thread->ring) > 0);
+	} else if (thread->batch) {
+		data_size = udp_batch_recv(thread->batch, thread->sockfd, buffer, buffer_len, flags,
+					   &address->src_ipaddr, &address->src_port,
+					   &address->dst_ipaddr, &address->dst_port,
+					   &address->if_index, recv_time_p);
+		li->read_pending = (udp_batch_pending(thread->batch) > 0);
+	} else {
+		data_size = udp_recv(thread->sockfd, buffer, buffer_len, flags,
+				     &address->src_ipaddr, &address->src_port,
+				     &address->dst_ipaddr, &address->dst_port,
+				     &address->if_index, recv_time_p);
+	}
 	if (data_size < 0) {
 		DEBUG2("proto_radius_udp got read error: %s", fr_strerror());
 		return data_size;
@@ -194,6 +231,105 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 }
 
 
+/** Send a reply, or queue it to be sent with other replies
+ *
+ */
+static ssize_t mod_send(proto_radius_udp_thread_t *thread, uint8_t *buffer, size_t buffer_len, int flags,
+			fr_io_address_t const *address)
+{
+	if (!thread->send_batch) {
+		return udp_send(thread->sockfd, buffer, buffer_len, flags,
+				&address->dst_ipaddr, address->dst_port,
+				address->if_index,
+				&address->src_ipaddr, address->src_port);
+	}
+
+	/*
+	 *	No more room, write out the queued replies before
+	 *	adding this one.  If the socket isn't writable, then
+	 *	adding the reply fails with EWOULDBLOCK, and the
+	 *	network side will try again later.
+	 */
+	if (udp_send_batch_full(thread->send_batch) &&
+	    (udp_send_batch_flush(thread->send_batch, thread->sockfd) < 0)) return -1;
+
+	return udp_send_batch_add(thread->send_batch, thread->sockfd, buffer, buffer_len, flags,
+				  &address->dst_ipaddr, address->dst_port,
+				  address->if_index,
+				  &address->src_ipaddr, address->src_port);
+}
+
+static void mod_flush_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx);
+
+/** Write the queued replies
+ *
+ * Replies are held back for up to max_send_delay, so that more
+ * replies can be written with the same system call.
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	proto_radius_udp_t const       	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_radius_udp_t);
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+	fr_time_t			oldest;
+
+	if (!thread->send_batch) return 0;
+
+	oldest = udp_send_batch_oldest(thread->send_batch);
+	if (!oldest) return 0;
+
+	/*
+	 *	Wait for more replies, unless the batch is full, or
+	 *	the oldest reply has already waited long enough.
+	 */
+	if (inst->max_send_delay && thread->el && !udp_send_batch_full(thread->send_batch) &&
+	    ((oldest + inst->max_send_delay) > fr_time())) {
+		if (thread->ev) return 0;
+
+		if (fr_event_timer_at(thread, thread->el, &thread->ev, oldest + inst->max_send_delay,
+				      mod_flush_timer, li) == 0) return 0;
+	}
+
+	if (thread->ev) fr_event_timer_delete(&thread->ev);
+
+	if (udp_send_batch_flush(thread->send_batch, thread->sockfd) < 0) {
+		PERROR("proto_radius_udp failed writing replies");
+		return -1;
+	}
+
+	/*
+	 *	The socket wasn't writable.  Try again soon.
+	 */
+	if (udp_send_batch_pending(thread->send_batch) && thread->el) {
+		(void) fr_event_timer_in(thread, thread->el, &thread->ev, fr_time_delta_from_msec(1),
+					 mod_flush_timer, li);
+	}
+
+	return 0;
+}
+
+static void mod_flush_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_listen_t			*li = talloc_get_type_abort(uctx, fr_listen_t);
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	if (udp_send_batch_flush(thread->send_batch, thread->sockfd) < 0) {
+		PERROR("proto_radius_udp failed writing replies");
+		return;
+	}
+
+	if (udp_send_batch_pending(thread->send_batch)) {
+		(void) fr_event_timer_in(thread, thread->el, &thread->ev, fr_time_delta_from_msec(1),
+					 mod_flush_timer, li);
+	}
+}
+
+static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, UNUSED void *nr)
+{
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	thread->el = el;
+}
+
 static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t request_time,
 			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
 {
@@ -230,10 +366,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 
 			memcpy(&packet, &track->reply, sizeof(packet)); /* const issues */
 
-			(void) udp_send(thread->sockfd, packet, track->reply_len, flags,
-					&address->dst_ipaddr, address->dst_port,
-					address->if_index,
-					&address->src_ipaddr, address->src_port);
+			(void) mod_send(thread, (uint8_t *) packet, track->reply_len, flags, address);
 		}
 
 		return buffer_len;
@@ -248,10 +381,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	 *	Only write replies if they're RADIUS packets.
 	 *	sometimes we want to NOT send a reply...
 	 */
-	data_size = udp_send(thread->sockfd, buffer, buffer_len, flags,
-			     &address->dst_ipaddr, address->dst_port,
-			     address->if_index,
-			     &address->src_ipaddr, address->src_port);
+	data_size = mod_send(thread, buffer, buffer_len, flags, address);
 
 	/*
 	 *	This socket is dead.  That's an error...
@@ -302,6 +432,24 @@ static int mod_open(fr_listen_t *li)
 	CONF_SECTION			*server_cs;
 	CONF_ITEM			*ci;
 
+	/*
+	 *	The previous server may have given us its socket,
+	 *	which is already bound.
+	 */
+	if (!thread->connection) {
+		sockfd = fr_handover_fd_find(IPPROTO_UDP, &inst->ipaddr, port, inst->interface);
+		if (sockfd >= 0) {
+			li->fd = sockfd;
+			li->app_io_addr = fr_app_io_socket_addr(li, IPPROTO_UDP, &inst->ipaddr, port);
+
+			/*
+			 *	It may have been reading from a ring.
+			 */
+			if (!inst->recv_ring) (void) udp_recv_enable(sockfd);
+			goto bound;
+		}
+	}
+
 	li->fd = sockfd = fr_socket_server_udp(&inst->ipaddr, &port, inst->port_name, true);
 	if (sockfd < 0) {
 		PERROR("Failed opening UDP socket");
@@ -352,8 +500,58 @@ static int mod_open(fr_listen_t *li)
 		goto error;
 	}
 
+bound:
 	thread->sockfd = sockfd;
 
+	if (!thread->connection && (fr_handover_fd_add(IPPROTO_UDP, &inst->ipaddr, port, inst->interface, sockfd) < 0)) {
+		PWARN("Socket can't be handed over to a new server");
+	}
+
+	/*
+	 *	Read packets from a ring which we share with the
+	 *	kernel.  The socket is then only used for replies, so
+	 *	stop the kernel from queueing packets on it, too.
+	 */
+	if (inst->recv_ring && !thread->connection) {
+		thread->ring = udp_ring_alloc(thread, inst->interface, &inst->ipaddr, port, inst->recv_ring_size);
+		if (!thread->ring) {
+			close(sockfd);
+			PERROR("Failed opening receive ring");
+			goto error;
+		}
+
+		if (udp_recv_disable(sockfd) < 0) {
+			close(sockfd);
+			PERROR("Failed disabling reads on UDP socket");
+			goto error;
+		}
+
+		li->fd = udp_ring_fd(thread->ring);
+
+	/*
+	 *	Read multiple packets at a time, if we're allowed to.
+	 */
+	} else if (inst->max_recv_coalesce > 1) {
+		thread->batch = udp_batch_alloc(thread, inst->max_recv_coalesce, inst->max_packet_size);
+		if (!thread->batch) {
+			close(sockfd);
+			ERROR("Failed allocating receive buffers");
+			goto error;
+		}
+	}
+
+	/*
+	 *	Write multiple replies at a time, if we're allowed to.
+	 */
+	if (inst->max_send_coalesce > 1) {
+		thread->send_batch = udp_send_batch_alloc(thread, inst->max_send_coalesce, inst->max_packet_size);
+		if (!thread->send_batch) {
+			close(sockfd);
+			ERROR("Failed allocating send buffers");
+			goto error;
+		}
+	}
+
 	ci = cf_parent(inst->cs); /* listen { ... } */
 	fr_assert(ci != NULL);
 	ci = cf_parent(ci);
@@ -422,6 +620,23 @@ static int mod_compare(void const *instance, UNUSED void *thread_instance, UNUSE
 }
 
 
+static uint32_t mod_hash(void const *instance, void const *packet)
+{
+	uint32_t hash;
+	proto_radius_udp_t const *inst = talloc_get_type_abort_const(instance, proto_radius_udp_t);
+	uint8_t const *p = packet;
+
+	/*
+	 *	Code and ID, and the authenticator if we're using
+	 *	it to dedup.
+	 */
+	hash = fr_hash(p, 2);
+	if (inst->dedup_authenticator) hash = fr_hash_update(p + 4, RADIUS_AUTH_VECTOR_LENGTH, hash);
+
+	return hash;
+}
+
+
 static char const *mod_name(fr_listen_t *li)
 {
 	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
@@ -460,6 +675,24 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 20);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("max_recv_coalesce", inst->max_recv_coalesce, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_recv_coalesce", inst->max_recv_coalesce, <=, 1024);
+
+	FR_INTEGER_BOUND_CHECK("max_send_coalesce", inst->max_send_coalesce, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_send_coalesce", inst->max_send_coalesce, <=, 1024);
+
+	FR_TIME_DELTA_BOUND_CHECK("max_send_delay", inst->max_send_delay, <=, fr_time_delta_from_msec(100));
+
+	if (inst->recv_ring) {
+		if (inst->ipaddr.af != AF_INET) {
+			cf_log_err(cs, "'recv_ring' can only be used with IPv4 addresses");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("recv_ring_size", inst->recv_ring_size, >=, (1 << 21));
+		FR_INTEGER_BOUND_CHECK("recv_ring_size", inst->recv_ring_size, <=, (1 << 30));
+	}
+
 	if (!inst->port) {
 		struct servent *s;
 
@@ -549,8 +782,11 @@ fr_app_io_t proto_radius_udp = {
 	.open			= mod_open,
 	.read			= mod_read,
 	.write			= mod_write,
+	.flush			= mod_flush,
+	.event_list_set		= mod_event_list_set,
 	.fd_set			= mod_fd_set,
 	.compare		= mod_compare,
+	.hash			= mod_hash,
 	.connection_set		= mod_connection_set,
 	.network_get		= mod_network_get,
 	.client_find		= mod_client_find,
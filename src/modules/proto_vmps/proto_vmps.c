@@ -54,7 +54,14 @@ static CONF_PARSER const limit_config[] = {
 
 	{ FR_CONF_OFFSET("max_connections", FR_TYPE_UINT32, proto_vmps_t, io.max_connections), .dflt = "1024" } ,
 	{ FR_CONF_OFFSET("max_clients", FR_TYPE_UINT32, proto_vmps_t, io.max_clients), .dflt = "256" } ,
+	{ FR_CONF_OFFSET("max_pending_clients", FR_TYPE_UINT32, proto_vmps_t, io.max_pending_clients), .dflt = "64" } ,
 	{ FR_CONF_OFFSET("max_pending_packets", FR_TYPE_UINT32, proto_vmps_t, io.max_pending_packets), .dflt = "256" } ,
+	{ FR_CONF_OFFSET("max_client_outstanding", FR_TYPE_UINT32, proto_vmps_t, io.max_client_outstanding), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("max_client_rate", FR_TYPE_UINT32, proto_vmps_t, io.max_client_rate), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("max_client_burst", FR_TYPE_UINT32, proto_vmps_t, io.max_client_burst), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("max_rate", FR_TYPE_UINT32, proto_vmps_t, io.max_rate), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("max_burst", FR_TYPE_UINT32, proto_vmps_t, io.max_burst), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("rate_limit_dry_run", FR_TYPE_BOOL, proto_vmps_t, io.rate_limit_dry_run), .dflt = "no" } ,
 
 	/*
 	 *	For performance tweaking.  NOT for normal humans.
@@ -31,21 +31,66 @@ RCSID("$Id$")
 #include	<freeradius-devel/server/module.h>
 #include	<freeradius-devel/util/debug.h>
 #include	<freeradius-devel/server/users_file.h>
+#include	<freeradius-devel/util/hash.h>
 
 #include	<sys/stat.h>
 
 #include	<ctype.h>
 #include	<fcntl.h>
 
+/** A filter rule, with anything which can be prepared at load time
+ *
+ */
+typedef struct {
+	VALUE_PAIR		*check;		//!< Rule from the filter file.
+#ifdef HAVE_REGEX
+	regex_t			*preg;		//!< Compiled form of =~ and !~ rules.
+#endif
+} attr_filter_check_t;
+
+/** All of an entry's rules for one attribute
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;		//!< Attribute the rules apply to.
+	attr_filter_check_t	*checks;	//!< Rules, in file order.
+} attr_filter_rule_t;
+
+/** Compiled form of an entry in the filter file
+ *
+ */
+typedef struct {
+	PAIR_LIST const		*pl;		//!< Entry in the filter file.
+
+	bool			fall_through;	//!< Continue to the next matching entry.
+	int			relax_filter;	//!< Value of Relax-Filter, or -1 if not set.
+
+	VALUE_PAIR		**set;		//!< ':=' rules, which are added to the output.
+	uint32_t		vsa_any;	//!< 'Vendor-Specific =* ANY' rules, which allow
+						///< all VSAs.
+	fr_hash_table_t		*rules;		//!< attr_filter_rule_t by attribute.
+} attr_filter_entry_t;
+
+/** Entries which apply to a key, in file order
+ *
+ */
+typedef struct {
+	char const		*name;		//!< Key, or "DEFAULT".
+	attr_filter_entry_t	**entries;	//!< Entries for the key, and DEFAULT entries.
+} attr_filter_key_t;
+
 /*
  *	Define a structure with the module configuration, so it can
  *	be used as the instance handle.
  */
 typedef struct {
-	char const	*filename;
-	vp_tmpl_t	*key;
-	bool		relaxed;
-	PAIR_LIST	*attrs;
+	char const		*filename;
+	vp_tmpl_t		*key;
+	bool			relaxed;
+	PAIR_LIST		*attrs;
+
+	fr_hash_table_t		*keys;		//!< attr_filter_key_t by name.
+	attr_filter_key_t	*defaults;	//!< For keys with no entries of their own.
 } rlm_attr_filter_t;
 
 static const CONF_PARSER module_config[] = {
@@ -81,12 +126,25 @@ fr_dict_attr_autoload_t rlm_attr_filter_dict_attr[] = {
 	{ NULL }
 };
 
-static void check_pair(REQUEST *request, VALUE_PAIR *check_item, VALUE_PAIR *reply_item, int *pass, int *fail)
+static void check_pair(REQUEST *request, attr_filter_check_t const *check, VALUE_PAIR *reply_item, int *pass, int *fail)
 {
-	int compare;
-
-	if (check_item->op == T_OP_SET) return;
-
+	VALUE_PAIR	*check_item = check->check;
+	int		compare;
+
+#ifdef HAVE_REGEX
+	if (check->preg) {
+		char	*value;
+
+		value = fr_pair_asprint(NULL, reply_item, '\0');
+		if (!value) {
+			compare = -1;
+		} else {
+			compare = regex_exec(check->preg, value, talloc_array_length(value) - 1, NULL);
+			talloc_free(value);
+			if (check_item->op == T_OP_REG_NE) compare = !compare;
+		}
+	} else
+#endif
 	compare = fr_pair_cmp(check_item, reply_item);
 	if (compare < 0) RPEDEBUG("Comparison failed");
 
@@ -146,6 +204,185 @@ static int attr_filter_getfile(TALLOC_CTX *ctx, rlm_attr_filter_t *inst, char co
 }
 
 
+static uint32_t attr_filter_rule_hash(void const *data)
+{
+	attr_filter_rule_t const *rule = data;
+
+	return fr_hash(&rule->da, sizeof(rule->da));
+}
+
+static int attr_filter_rule_cmp(void const *one, void const *two)
+{
+	attr_filter_rule_t const *a = one, *b = two;
+
+	return (a->da > b->da) - (a->da < b->da);
+}
+
+static uint32_t attr_filter_key_hash(void const *data)
+{
+	attr_filter_key_t const *key = data;
+
+	return fr_hash_string(key->name);
+}
+
+static int attr_filter_key_cmp(void const *one, void const *two)
+{
+	attr_filter_key_t const *a = one, *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
+/** Add an entry to the list for a key
+ *
+ */
+static void attr_filter_key_add(attr_filter_key_t *key, attr_filter_entry_t *entry)
+{
+	size_t len = talloc_array_length(key->entries);
+
+	MEM(key->entries = talloc_realloc(key, key->entries, attr_filter_entry_t *, len + 1));
+	key->entries[len] = entry;
+}
+
+/** Compile an entry in the filter file
+ *
+ * Rules are grouped by attribute, so that each attribute being filtered
+ * is only compared with the rules which apply to it.  Regular expressions
+ * are compiled once, here, rather than for every comparison.
+ */
+static attr_filter_entry_t *attr_filter_entry_compile(rlm_attr_filter_t *inst, char const *filename, PAIR_LIST const *pl)
+{
+	attr_filter_entry_t	*entry;
+	VALUE_PAIR		*vp;
+
+	MEM(entry = talloc_zero(inst, attr_filter_entry_t));
+	entry->pl = pl;
+	entry->relax_filter = -1;
+	MEM(entry->set = talloc_array(entry, VALUE_PAIR *, 0));
+	MEM(entry->rules = fr_hash_table_create(entry, attr_filter_rule_hash, attr_filter_rule_cmp, NULL));
+
+	for (vp = pl->check; vp; vp = vp->next) {
+		attr_filter_rule_t	*rule, find = { .da = vp->da };
+		attr_filter_check_t	*check;
+		size_t			len;
+
+		if (vp->da == attr_fall_through) {
+			if (vp->vp_bool) {
+				entry->fall_through = true;
+				continue;
+			}
+		} else if (vp->da == attr_relax_filter) {
+			entry->relax_filter = vp->vp_bool;
+		}
+
+		/*
+		 *	SET rules are added to the output, and
+		 *	aren't compared.
+		 */
+		if (vp->op == T_OP_SET) {
+			len = talloc_array_length(entry->set);
+			MEM(entry->set = talloc_realloc(entry, entry->set, VALUE_PAIR *, len + 1));
+			entry->set[len] = vp;
+			continue;
+		}
+
+		if ((vp->da == attr_vendor_specific) && (vp->op == T_OP_CMP_TRUE)) entry->vsa_any++;
+
+		rule = fr_hash_table_finddata(entry->rules, &find);
+		if (!rule) {
+			MEM(rule = talloc_zero(entry->rules, attr_filter_rule_t));
+			rule->da = vp->da;
+			MEM(rule->checks = talloc_array(rule, attr_filter_check_t, 0));
+			if (!fr_hash_table_insert(entry->rules, rule)) {
+				talloc_free(entry);
+				return NULL;
+			}
+		}
+
+		len = talloc_array_length(rule->checks);
+		MEM(rule->checks = talloc_realloc(rule, rule->checks, attr_filter_check_t, len + 1));
+		check = &rule->checks[len];
+		memset(check, 0, sizeof(*check));
+		check->check = vp;
+
+#ifdef HAVE_REGEX
+		if (((vp->op == T_OP_REG_EQ) || (vp->op == T_OP_REG_NE)) && (vp->vp_type == FR_TYPE_STRING)) {
+			ssize_t slen;
+
+			slen = regex_compile(rule, &check->preg, vp->xlat, talloc_array_length(vp->xlat) - 1,
+					     NULL, false, true);
+			if (slen <= 0) {
+				ERROR("[%s]:%d Error at offset %zu compiling regex for %s",
+				       filename, pl->lineno, -slen, vp->da->name);
+				talloc_free(entry);
+				return NULL;
+			}
+		}
+#endif
+	}
+
+	return entry;
+}
+
+/** Compile the filter file, so that filtering costs one lookup per attribute
+ *
+ * Each key gets the list of entries which apply to it, i.e. its own
+ * entries and the DEFAULT entries, in file order.  Keys with no entries
+ * of their own use the list of DEFAULT entries.
+ */
+static int attr_filter_compile(rlm_attr_filter_t *inst, char const *filename)
+{
+	PAIR_LIST		*pl;
+	attr_filter_entry_t	*entry;
+	attr_filter_key_t	*key, find;
+	fr_hash_iter_t		iter;
+
+	MEM(inst->keys = fr_hash_table_create(inst, attr_filter_key_hash, attr_filter_key_cmp, NULL));
+	MEM(inst->defaults = talloc_zero(inst, attr_filter_key_t));
+	inst->defaults->name = "DEFAULT";
+	MEM(inst->defaults->entries = talloc_array(inst->defaults, attr_filter_entry_t *, 0));
+
+	/*
+	 *	Create the lists for each key first, so that
+	 *	DEFAULT entries before the first entry for a key
+	 *	are added to its list.
+	 */
+	for (pl = inst->attrs; pl; pl = pl->next) {
+		if (strcmp(pl->name, "DEFAULT") == 0) continue;
+
+		find.name = pl->name;
+		if (fr_hash_table_finddata(inst->keys, &find)) continue;
+
+		MEM(key = talloc_zero(inst->keys, attr_filter_key_t));
+		key->name = pl->name;
+		MEM(key->entries = talloc_array(key, attr_filter_entry_t *, 0));
+		if (!fr_hash_table_insert(inst->keys, key)) return -1;
+	}
+
+	for (pl = inst->attrs; pl; pl = pl->next) {
+		entry = attr_filter_entry_compile(inst, filename, pl);
+		if (!entry) return -1;
+
+		if (strcmp(pl->name, "DEFAULT") != 0) {
+			find.name = pl->name;
+			key = fr_hash_table_finddata(inst->keys, &find);
+			fr_assert(key != NULL);
+
+			attr_filter_key_add(key, entry);
+			continue;
+		}
+
+		attr_filter_key_add(inst->defaults, entry);
+
+		for (key = fr_hash_table_iter_init(inst->keys, &iter);
+		     key;
+		     key = fr_hash_table_iter_next(inst->keys, &iter)) {
+			attr_filter_key_add(key, entry);
+		}
+	}
+
+	return 0;
+}
+
 /*
  *	(Re-)read the "attrs" file into memory.
  */
@@ -161,6 +398,12 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (attr_filter_compile(inst, inst->filename) < 0) {
+		ERROR("Errors compiling %s", inst->filename);
+
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -173,9 +416,11 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void const *instance
 {
 	rlm_attr_filter_t const *inst = instance;
 	VALUE_PAIR	*vp;
-	fr_cursor_t	input, check, out;
-	VALUE_PAIR	*input_item, *check_item, *output;
-	PAIR_LIST	*pl;
+	fr_cursor_t	input, out;
+	VALUE_PAIR	*input_item, *output;
+	PAIR_LIST const	*pl;
+	attr_filter_key_t	*key, find;
+	size_t		i, num;
 	int		found = 0;
 	int		pass, fail = 0;
 	char const	*keyname = NULL;
@@ -198,82 +443,61 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void const *instance
 	fr_cursor_init(&out, &output);
 
 	/*
-	 *      Find the attr_filter profile entry for the entry.
+	 *	Find the entries which apply to the key.
 	 */
-	for (pl = inst->attrs; pl; pl = pl->next) {
-		int fall_through = 0;
-		int relax_filter = inst->relaxed;
+	find.name = keyname;
+	key = fr_hash_table_finddata(inst->keys, &find);
+	if (!key) key = inst->defaults;
 
-		/*
-		 *  If the current entry is NOT a default,
-		 *  AND the realm does NOT match the current entry,
-		 *  then skip to the next entry.
-		 */
-		if ((strcmp(pl->name, "DEFAULT") != 0) &&
-		    (strcmp(keyname, pl->name) != 0))  {
-		    continue;
-		}
+	num = talloc_array_length(key->entries);
+	for (i = 0; i < num; i++) {
+		attr_filter_entry_t const	*entry = key->entries[i];
+		int				relax_filter = inst->relaxed;
+		size_t				j;
 
+		pl = entry->pl;
 		RDEBUG2("Matched entry %s at line %d", pl->name, pl->lineno);
 		found = 1;
 
-		for (check_item = fr_cursor_init(&check, &pl->check);
-		     check_item;
-		     check_item = fr_cursor_next(&check)) {
-		     	if (check_item->da == attr_fall_through) {
-				if (check_item->vp_uint32 == 1) {
-					fall_through = 1;
-					continue;
-				}
-		     	} else if (check_item->da == attr_relax_filter) {
-				relax_filter = check_item->vp_uint32;
-		     	}
+		if (entry->relax_filter >= 0) relax_filter = entry->relax_filter;
 
-			/*
-			 *    If it is a SET operator, add the attribute to
-			 *    the output list without checking it.
-			 */
-			if (check_item->op == T_OP_SET ) {
-				vp = fr_pair_copy(packet, check_item);
-				if (!vp) goto error;
+		/*
+		 *    SET rules add the attribute to the output list
+		 *    without checking it.
+		 */
+		for (j = 0; j < talloc_array_length(entry->set); j++) {
+			vp = fr_pair_copy(packet, entry->set[j]);
+			if (!vp) goto error;
 
-				xlat_eval_pair(request, vp);
-				fr_cursor_append(&out, vp);
-			}
+			xlat_eval_pair(request, vp);
+			fr_cursor_append(&out, vp);
 		}
 
 		/*
 		 *	Iterate through the input items, comparing
-		 *	each item to every rule, then moving it to the
-		 *	output list only if it matches all rules
-		 *	for that attribute.  IE, Idle-Timeout is moved
+		 *	each item to the rules for that attribute,
+		 *	then moving it to the output list only if it
+		 *	matches all of them.  IE, Idle-Timeout is moved
 		 *	only if it matches all rules that describe an
 		 *	Idle-Timeout.
 		 */
 		for (input_item = fr_cursor_init(&input, &packet->vps);
 		     input_item;
 		     input_item = fr_cursor_next(&input)) {
+			attr_filter_rule_t const	*rule, find_rule = { .da = input_item->da };
+
 			pass = fail = 0; /* reset the pass,fail vars for each reply item */
 
 			/*
-			 *  Reset the check_item pointer to beginning of the list
+			 *  Vendor-Specific is special, and matches any VSA if the
+			 *  comparison is always true.
 			 */
-			for (check_item = fr_cursor_head(&check);
-			     check_item;
-			     check_item = fr_cursor_next(&check)) {
-				/*
-				 *  Vendor-Specific is special, and matches any VSA if the
-				 *  comparison is always true.
-				 */
-				if ((check_item->da == attr_vendor_specific) &&
-				    (fr_dict_vendor_num_by_da(input_item->da) != 0) &&
-				    (check_item->op == T_OP_CMP_TRUE)) {
-					pass++;
-					continue;
-				}
+			if (entry->vsa_any && (fr_dict_vendor_num_by_da(input_item->da) != 0)) pass += entry->vsa_any;
 
-				if (input_item->da == check_item->da) {
-					check_pair(request, check_item, input_item, &pass, &fail);
+			rule = fr_hash_table_finddata(entry->rules, &find_rule);
+			if (rule) {
+				for (j = 0; j < talloc_array_length(rule->checks); j++) {
+					check_pair(request, &rule->checks[j], input_item, &pass, &fail);
 				}
 			}
 
@@ -296,7 +520,7 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void const *instance
 		}
 
 		/* If we shouldn't fall through, break */
-		if (!fall_through) {
+		if (!entry->fall_through) {
 			break;
 		}
 	}
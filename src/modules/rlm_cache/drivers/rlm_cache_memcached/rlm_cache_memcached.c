@@ -182,7 +182,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		return CACHE_ERROR;
 	}
 	RDEBUG2("Retrieved %zu bytes from memcached", len);
-	RDEBUG2("%s", from_store);
+	if (!cache_serialized_is_binary((uint8_t const *)from_store, len)) RDEBUG2("%s", from_store);
 
 	c = talloc_zero(NULL, rlm_cache_entry_t);
 	ret = cache_deserialize(c, request->dict, from_store, len);
@@ -204,7 +204,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
  *
  * @copydetails cache_entry_insert_t
  */
-static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, UNUSED void *instance,
 					 REQUEST *request, void *handle, const rlm_cache_entry_t *c)
 {
 	rlm_cache_memcached_handle_t *mandle = handle;
@@ -212,20 +212,21 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	memcached_return_t ret;
 
 	TALLOC_CTX *pool;
-	char *to_store;
+	uint8_t *to_store = NULL;
+	size_t len = 0;
 
 	pool = talloc_pool(NULL, 1024);
 	if (!pool) return CACHE_ERROR;
 
-	if (cache_serialize(pool, &to_store, c) < 0) {
+	if (cache_serialize_by_format(pool, &to_store, &len, c, config->serialize) < 0) {
+		RPERROR("Failed serializing entry");
 		talloc_free(pool);
 
 		return CACHE_ERROR;
 	}
 
 	ret = memcached_set(mandle->handle, (char const *)c->key, c->key_len,
-		            to_store ? to_store : "",
-		            to_store ? talloc_array_length(to_store) - 1 : 0, c->expires, 0);
+		            to_store ? (char const *)to_store : "", len, c->expires, 0);
 	talloc_free(pool);
 	if (ret != MEMCACHED_SUCCESS) {
 		RERROR("Failed storing entry: %s: %s", memcached_strerror(mandle->handle, ret),
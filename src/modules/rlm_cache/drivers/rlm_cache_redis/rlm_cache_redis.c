@@ -24,26 +24,50 @@
 #define LOG_PREFIX "rlm_cache_redis - "
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 
 #include "../../rlm_cache.h"
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
-static CONF_PARSER driver_config[] = {
-	REDIS_COMMON_CONFIG,
-	CONF_PARSER_TERMINATOR
-};
+#include <freeradius-devel/redis/pipeline.h>
 
 typedef struct {
 	fr_redis_conf_t		conf;		//!< Connection parameters for the Redis server.
 						//!< Must be first field in this struct.
 
+	bool			pipeline;	//!< Send commands asynchronously, on a trunk.
+	fr_trunk_conf_t		trunk_conf;	//!< For the pipelined connections.
+	fr_redis_io_conf_t	io_conf;	//!< Server the pipelined connections go to.
+
 	vp_tmpl_t		*created_attr;	//!< LHS of the Cache-Created map.
 	vp_tmpl_t		*expires_attr;	//!< LHS of the Cache-Expires map.
 
 	fr_redis_cluster_t	*cluster;
 } rlm_cache_redis_t;
 
+typedef struct {
+	fr_redis_cluster_thread_t *cluster;	//!< Thread specific state for the pipelined connections.
+	fr_redis_trunk_t	*trunk;		//!< Pipelined connections.
+} rlm_cache_redis_thread_t;
+
+/** An asynchronous operation
+ *
+ */
+typedef struct {
+	rlm_cache_async_t	*out;		//!< Where to write the result.
+	fr_redis_command_set_t	*cmds;		//!< Being executed.
+	uint8_t const		*key;		//!< Of the entry.
+	size_t			key_len;	//!< Length of the key.
+} rlm_cache_redis_async_t;
+
+static CONF_PARSER driver_config[] = {
+	REDIS_COMMON_CONFIG,
+	{ FR_CONF_OFFSET("pipeline", FR_TYPE_BOOL, rlm_cache_redis_t, pipeline), .dflt = "no" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_cache_redis_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+	CONF_PARSER_TERMINATOR
+};
+
 static fr_dict_t const *dict_freeradius;
 
 extern fr_dict_autoload_t rlm_cache_redis_dict[];
@@ -107,6 +131,41 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	/*
+	 *	Pipelined connections don't follow cluster
+	 *	redirects, so they go to the first server.
+	 */
+	if (driver->pipeline) {
+		if (driver->conf.password || driver->conf.database) {
+			cf_log_err(conf, "'pipeline' does not support 'password' or 'database'");
+			return -1;
+		}
+
+		driver->io_conf.hostname = talloc_typed_strdup(driver, driver->conf.hostname[0]);
+		driver->io_conf.port = driver->conf.port;
+		driver->io_conf.log_prefix = talloc_typed_strdup(driver, buffer);
+	}
+
+	return 0;
+}
+
+/** Create the pipelined connections for this thread
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_cache_redis_t		*driver = talloc_get_type_abort(instance, rlm_cache_redis_t);
+	rlm_cache_redis_thread_t	*t = talloc_get_type_abort(thread, rlm_cache_redis_thread_t);
+
+	if (!driver->pipeline) return 0;
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, el, &driver->trunk_conf);
+	t->trunk = fr_redis_trunk_alloc(t->cluster, &driver->io_conf);
+	if (!t->trunk) {
+		ERROR("Failed creating pipelined connections");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -121,68 +180,43 @@ static void cache_entry_free(rlm_cache_entry_t *c)
 	talloc_free(c);
 }
 
-/** Locate a cache entry in redis
+/** Convert the reply to LRANGE into a cache entry
  *
- * @copydetails cache_entry_find_t
+ * @param[out] out	The entry.
+ * @param[in] request	The current request.
+ * @param[in] reply	to LRANGE.  Not freed.
+ * @param[in] key	of the entry.
+ * @param[in] key_len	Length of the key.
+ * @return
+ *	- CACHE_OK if the entry was found.
+ *	- CACHE_MISS if it wasn't.
+ *	- CACHE_ERROR if the reply was invalid.
  */
-static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
-				       UNUSED rlm_cache_config_t const *config, void *instance,
-				       REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+static cache_status_t cache_entry_from_reply(rlm_cache_entry_t **out, REQUEST *request, redisReply *reply,
+					     uint8_t const *key, size_t key_len)
 {
-	rlm_cache_redis_t		*driver = instance;
 	size_t				i;
-
-	fr_redis_cluster_state_t	state;
-	fr_redis_conn_t			*conn;
-	fr_redis_rcode_t		status;
-	redisReply			*reply = NULL;
-	int				s_ret;
-
 	vp_map_t			*head = NULL, **last = &head;
 #ifdef HAVE_TALLOC_ZERO_POOLED_OBJECT
 	size_t				pool_size = 0;
 #endif
 	rlm_cache_entry_t		*c;
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
-		/*
-		 *	Grab all the data for this hash, should return an array
-		 *	of alternating keys/values which we then convert into maps.
-		 */
-		RDEBUG3("LRANGE %pV 0 -1", fr_box_strvalue_len((char const *)key, key_len));
-		reply = redisCommand(conn->handle, "LRANGE %b 0 -1", key, key_len);
-		status = fr_redis_command_status(conn, reply);
-	}
-	if (s_ret != REDIS_RCODE_SUCCESS) {
-		RERROR("Failed retrieving entry for key \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
-
-	error:
-		fr_redis_reply_free(&reply);
-		return CACHE_ERROR;
-	}
-
-	if (!fr_cond_assert(reply)) goto error;
-
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Bad result type, expected array, got %s",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		goto error;
+		return CACHE_ERROR;
 	}
 
 	RDEBUG3("Entry contains %zu elements", reply->elements);
 
-	if (reply->elements == 0) {
-		fr_redis_reply_free(&reply);
-		return CACHE_MISS;
-	}
+	if (reply->elements == 0) return CACHE_MISS;
 
 	if (reply->elements % 3) {
 		REDEBUG("Invalid number of reply elements (%zu).  "
 			"Reply must contain triplets of keys operators and values",
 			reply->elements);
-		goto error;
+		return CACHE_ERROR;
 	}
 
 #ifdef HAVE_TALLOC_ZERO_POOLED_OBJECT
@@ -210,12 +244,10 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		if (fr_redis_reply_to_map(c, last, request,
 					  reply->element[i], reply->element[i + 1], reply->element[i + 2]) < 0) {
 			talloc_free(c);
-			fr_redis_reply_free(&reply);
 			return CACHE_ERROR;
 		}
 		last = &(*last)->next;
 	}
-	fr_redis_reply_free(&reply);
 
 	/*
 	 *	Pull out the cache created date
@@ -251,24 +283,67 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 	return CACHE_OK;
 }
 
-
-/** Insert a new entry into the data store
+/** Locate a cache entry in redis
  *
- * @copydetails cache_entry_insert_t
+ * @copydetails cache_entry_find_t
  */
-static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
-					 REQUEST *request, UNUSED void *handle, const rlm_cache_entry_t *c)
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *instance,
+				       REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
 {
-	rlm_cache_redis_t	*driver = instance;
-	TALLOC_CTX		*pool;
-
-	vp_map_t		*map;
+	rlm_cache_redis_t		*driver = instance;
 
-	fr_redis_conn_t		*conn;
 	fr_redis_cluster_state_t	state;
-	fr_redis_rcode_t	status;
-	redisReply		*reply = NULL;
-	int			s_ret;
+	fr_redis_conn_t			*conn;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL;
+	int				s_ret;
+	cache_status_t			cache_status;
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, key, key_len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, driver->cluster, request, status, &reply)) {
+		/*
+		 *	Grab all the data for this hash, should return an array
+		 *	of alternating keys/values which we then convert into maps.
+		 */
+		RDEBUG3("LRANGE %pV 0 -1", fr_box_strvalue_len((char const *)key, key_len));
+		reply = redisCommand(conn->handle, "LRANGE %b 0 -1", key, key_len);
+		status = fr_redis_command_status(conn, reply);
+	}
+	if (s_ret != REDIS_RCODE_SUCCESS) {
+		RERROR("Failed retrieving entry for key \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
+
+	error:
+		fr_redis_reply_free(&reply);
+		return CACHE_ERROR;
+	}
+
+	if (!fr_cond_assert(reply)) goto error;
+
+	cache_status = cache_entry_from_reply(out, request, reply, key, key_len);
+	fr_redis_reply_free(&reply);
+
+	return cache_status;
+}
+
+
+/** Build the RPUSH command which serializes an entry
+ *
+ * @param[out] argv_out		The arguments of the command, allocated in pool.
+ * @param[out] argv_len_out	The length of each argument, allocated in pool.
+ * @param[in] pool		To allocate the arguments in.
+ * @param[in] driver		Instance of the driver.
+ * @param[in] request		The current request.
+ * @param[in] c			Entry to serialize.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int cache_entry_to_argv(char const ***argv_out, size_t **argv_len_out, TALLOC_CTX *pool,
+			       rlm_cache_redis_t const *driver, REQUEST *request, rlm_cache_entry_t const *c)
+{
+	vp_map_t		*map;
 
 	static char const	command[] = "RPUSH";
 	char const		**argv;
@@ -276,10 +351,6 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	char const		**argv_p;
 	size_t			*argv_len_p;
 
-	unsigned int		pipelined = 0;	/* How many commands pending in the pipeline */
-	redisReply		*replies[5];	/* Should have the same number of elements as pipelined commands */
-	size_t			reply_cnt = 0, i;
-
 	int			cnt;
 
 	vp_tmpl_t		expires_value;
@@ -317,14 +388,6 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 
 	for (cnt = 0, map = &created; map; cnt++, map = map->next);
 
-	/*
-	 *	The majority of serialized entries should be under 1k.
-	 *
-	 * @todo We should really calculate this using some sort of moving average.
-	 */
-	pool = talloc_pool(request, 1024);
-	if (!pool) return CACHE_ERROR;
-
 	argv_p = argv = talloc_array(pool, char const *, (cnt * 3) + 2);	/* pair = 3 + cmd + key */
 	argv_len_p = argv_len = talloc_array(pool, size_t, (cnt * 3) + 2);	/* pair = 3 + cmd + key */
 
@@ -340,13 +403,54 @@ static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config
 	for (map = &created; map; map = map->next) {
 		if (fr_redis_tuple_from_map(pool, argv_p, argv_len_p, map) < 0) {
 			REDEBUG("Failed encoding map as Redis K/V pair");
-			talloc_free(pool);
-			return CACHE_ERROR;
+			return -1;
 		}
 		argv_p += 3;
 		argv_len_p += 3;
 	}
 
+	*argv_out = argv;
+	*argv_len_out = argv_len;
+
+	return 0;
+}
+
+/** Insert a new entry into the data store
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, UNUSED void *handle, const rlm_cache_entry_t *c)
+{
+	rlm_cache_redis_t	*driver = instance;
+	TALLOC_CTX		*pool;
+
+	fr_redis_conn_t		*conn;
+	fr_redis_cluster_state_t	state;
+	fr_redis_rcode_t	status;
+	redisReply		*reply = NULL;
+	int			s_ret;
+
+	char const		**argv;
+	size_t			*argv_len;
+
+	unsigned int		pipelined = 0;	/* How many commands pending in the pipeline */
+	redisReply		*replies[5];	/* Should have the same number of elements as pipelined commands */
+	size_t			reply_cnt = 0, i;
+
+	/*
+	 *	The majority of serialized entries should be under 1k.
+	 *
+	 * @todo We should really calculate this using some sort of moving average.
+	 */
+	pool = talloc_pool(request, 1024);
+	if (!pool) return CACHE_ERROR;
+
+	if (cache_entry_to_argv(&argv, &argv_len, pool, driver, request, c) < 0) {
+		talloc_free(pool);
+		return CACHE_ERROR;
+	}
+
 	RDEBUG3("Pipelining commands");
 
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, driver->cluster, request, c->key, c->key_len, false);
@@ -464,17 +568,299 @@ static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config
 	return CACHE_ERROR;
 }
 
+/** Check whether any of the replies in a command set indicate an error
+ *
+ * @param[in] request	The current request.
+ * @param[in] completed	Commands with replies.
+ * @return the last reply, or NULL if there was an error.
+ */
+static redisReply *cache_async_last_reply(REQUEST *request, fr_dlist_head_t *completed)
+{
+	fr_redis_command_t	*cmd;
+	redisReply		*reply = NULL;
+
+	for (cmd = fr_dlist_head(completed);
+	     cmd;
+	     cmd = fr_dlist_next(completed, cmd)) {
+		reply = fr_redis_command_get_result(cmd);
+		if (!reply) {
+			REDEBUG("No reply received from server");
+			return NULL;
+		}
+
+		if (reply->type == REDIS_REPLY_ERROR) {
+			REDEBUG("Server returned error: %pV", fr_box_strvalue_len(reply->str, reply->len));
+			return NULL;
+		}
+	}
+
+	return reply;
+}
+
+/** Process the reply to a pipelined LRANGE
+ *
+ */
+static void cache_async_find_complete(REQUEST *request, fr_dlist_head_t *completed, void *rctx)
+{
+	rlm_cache_redis_async_t	*op = talloc_get_type_abort(rctx, rlm_cache_redis_async_t);
+	redisReply		*reply;
+
+	reply = cache_async_last_reply(request, completed);
+	op->out->status = reply ? cache_entry_from_reply(&op->out->c, request, reply, op->key, op->key_len) :
+				  CACHE_ERROR;
+	op->out->uctx = NULL;
+	talloc_free(op);
+
+	unlang_interpret_resumable(request);
+}
+
+/** Process the replies to a pipelined insert
+ *
+ */
+static void cache_async_insert_complete(REQUEST *request, fr_dlist_head_t *completed, void *rctx)
+{
+	rlm_cache_redis_async_t	*op = talloc_get_type_abort(rctx, rlm_cache_redis_async_t);
+
+	op->out->status = cache_async_last_reply(request, completed) ? CACHE_OK : CACHE_ERROR;
+	op->out->uctx = NULL;
+	talloc_free(op);
+
+	unlang_interpret_resumable(request);
+}
+
+/** Process the reply to a pipelined DEL
+ *
+ */
+static void cache_async_expire_complete(REQUEST *request, fr_dlist_head_t *completed, void *rctx)
+{
+	rlm_cache_redis_async_t	*op = talloc_get_type_abort(rctx, rlm_cache_redis_async_t);
+	redisReply		*reply;
+
+	reply = cache_async_last_reply(request, completed);
+	if (!reply) {
+		op->out->status = CACHE_ERROR;
+	} else if (reply->type != REDIS_REPLY_INTEGER) {
+		REDEBUG("Bad result type, expected integer, got %s",
+			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
+		op->out->status = CACHE_ERROR;
+	} else {
+		op->out->status = reply->integer ? CACHE_OK : CACHE_MISS;
+	}
+	op->out->uctx = NULL;
+	talloc_free(op);
+
+	unlang_interpret_resumable(request);
+}
+
+/** Record that a pipelined operation failed
+ *
+ */
+static void cache_async_fail(REQUEST *request, UNUSED fr_dlist_head_t *completed, void *rctx)
+{
+	rlm_cache_redis_async_t	*op = talloc_get_type_abort(rctx, rlm_cache_redis_async_t);
+
+	RERROR("Failed sending commands to server");
+
+	op->out->status = CACHE_ERROR;
+	op->out->uctx = NULL;
+	talloc_free(op);
+
+	unlang_interpret_resumable(request);
+}
+
+/** Allocate the state for a pipelined operation
+ *
+ */
+static rlm_cache_redis_async_t *cache_async_alloc(rlm_cache_async_t *out, REQUEST *request,
+						  fr_redis_command_set_complete_t complete,
+						  uint8_t const *key, size_t key_len)
+{
+	rlm_cache_redis_async_t	*op;
+
+	MEM(op = talloc_zero(request, rlm_cache_redis_async_t));
+	op->out = out;
+	op->key = key;
+	op->key_len = key_len;
+
+	/*
+	 *	Once enqueued, the command set belongs to the trunk
+	 *	which frees it after calling complete or fail.
+	 */
+	op->cmds = fr_redis_command_set_alloc(NULL, request, complete, cache_async_fail, op);
+
+	out->status = CACHE_ERROR;
+	out->c = NULL;
+	out->uctx = op;
+
+	return op;
+}
+
+/** Enqueue the commands for a pipelined operation
+ *
+ */
+static int cache_async_enqueue(rlm_cache_async_t *out, rlm_cache_redis_thread_t *t, rlm_cache_redis_async_t *op)
+{
+	if (redis_command_set_enqueue(t->trunk, op->cmds) != FR_REDIS_PIPELINE_OK) {
+		fr_strerror_printf("Failed enqueuing commands");
+		out->uctx = NULL;
+		talloc_free(op->cmds);
+		talloc_free(op);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Locate a cache entry in redis, without blocking
+ *
+ * @copydetails cache_entry_find_async_t
+ */
+static int cache_entry_find_async(rlm_cache_async_t *out, UNUSED rlm_cache_config_t const *config,
+				  void *instance, void *thread, REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_redis_t		*driver = instance;
+	rlm_cache_redis_thread_t	*t = talloc_get_type_abort(thread, rlm_cache_redis_thread_t);
+	rlm_cache_redis_async_t		*op;
+	char const			*argv[] = { "LRANGE", (char const *)key, "0", "-1" };
+	size_t				argv_len[] = { 6, key_len, 1, 2 };
+
+	if (!driver->pipeline) return 1;
+
+	op = cache_async_alloc(out, request, cache_async_find_complete, key, key_len);
+
+	RDEBUG3("LRANGE %pV 0 -1", fr_box_strvalue_len((char const *)key, key_len));
+	if (fr_redis_command_argv_add(op->cmds, NUM_ELEMENTS(argv), argv, argv_len) != FR_REDIS_PIPELINE_OK) {
+		out->uctx = NULL;
+		talloc_free(op->cmds);
+		talloc_free(op);
+		return -1;
+	}
+
+	return cache_async_enqueue(out, t, op);
+}
+
+/** Insert a new entry into the data store, without blocking
+ *
+ * @copydetails cache_entry_insert_async_t
+ */
+static int cache_entry_insert_async(rlm_cache_async_t *out, UNUSED rlm_cache_config_t const *config,
+				    void *instance, void *thread, REQUEST *request, rlm_cache_entry_t const *c)
+{
+	rlm_cache_redis_t		*driver = instance;
+	rlm_cache_redis_thread_t	*t = talloc_get_type_abort(thread, rlm_cache_redis_thread_t);
+	rlm_cache_redis_async_t		*op;
+	TALLOC_CTX			*pool;
+	char const			**argv;
+	size_t				*argv_len;
+	char				expires[21];
+	char const			*del_argv[] = { "DEL", (char const *)c->key };
+	size_t				del_argv_len[] = { 3, c->key_len };
+	char const			*expire_argv[] = { "EXPIREAT", (char const *)c->key, expires };
+	size_t				expire_argv_len[] = { 8, c->key_len, 0 };
+
+	if (!driver->pipeline) return 1;
+
+	op = cache_async_alloc(out, request, cache_async_insert_complete, c->key, c->key_len);
+
+	/*
+	 *	The arguments are copied when the command
+	 *	is formatted, so the pool can be freed as
+	 *	soon as they've been added.
+	 */
+	MEM(pool = talloc_pool(op, 1024));
+	if (cache_entry_to_argv(&argv, &argv_len, pool, driver, request, c) < 0) goto error;
+
+	if ((c->expires > 0) &&
+	    (fr_redis_command_preformatted_add(op->cmds, "MULTI", 5) != FR_REDIS_PIPELINE_OK)) goto error;
+
+	if (fr_redis_command_argv_add(op->cmds, NUM_ELEMENTS(del_argv), del_argv, del_argv_len) !=
+	    FR_REDIS_PIPELINE_OK) goto error;
+
+	if (fr_redis_command_argv_add(op->cmds, talloc_array_length(argv), argv, argv_len) !=
+	    FR_REDIS_PIPELINE_OK) goto error;
+
+	if (c->expires > 0) {
+		expire_argv_len[2] = snprintf(expires, sizeof(expires), "%" PRIu64, fr_unix_time_to_sec(c->expires));
+
+		if (fr_redis_command_argv_add(op->cmds, NUM_ELEMENTS(expire_argv), expire_argv, expire_argv_len) !=
+		    FR_REDIS_PIPELINE_OK) goto error;
+
+		if (fr_redis_command_preformatted_add(op->cmds, "EXEC", 4) != FR_REDIS_PIPELINE_OK) goto error;
+	}
+	talloc_free(pool);
+
+	return cache_async_enqueue(out, t, op);
+
+error:
+	out->uctx = NULL;
+	talloc_free(op->cmds);
+	talloc_free(op);
+	return -1;
+}
+
+/** Delete a cache entry from redis, without blocking
+ *
+ * @copydetails cache_entry_expire_async_t
+ */
+static int cache_entry_expire_async(rlm_cache_async_t *out, UNUSED rlm_cache_config_t const *config,
+				    void *instance, void *thread, REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_redis_t		*driver = instance;
+	rlm_cache_redis_thread_t	*t = talloc_get_type_abort(thread, rlm_cache_redis_thread_t);
+	rlm_cache_redis_async_t		*op;
+	char const			*argv[] = { "DEL", (char const *)key };
+	size_t				argv_len[] = { 3, key_len };
+
+	if (!driver->pipeline) return 1;
+
+	op = cache_async_alloc(out, request, cache_async_expire_complete, key, key_len);
+
+	if (fr_redis_command_argv_add(op->cmds, NUM_ELEMENTS(argv), argv, argv_len) != FR_REDIS_PIPELINE_OK) {
+		out->uctx = NULL;
+		talloc_free(op->cmds);
+		talloc_free(op);
+		return -1;
+	}
+
+	return cache_async_enqueue(out, t, op);
+}
+
+/** Stop a pipelined operation
+ *
+ * @copydetails cache_async_cancel_t
+ */
+static void cache_async_cancel(UNUSED void *instance, UNUSED void *thread, UNUSED REQUEST *request,
+			       rlm_cache_async_t *async)
+{
+	rlm_cache_redis_async_t	*op;
+
+	if (!async->uctx) return;
+
+	op = talloc_get_type_abort(async->uctx, rlm_cache_redis_async_t);
+	fr_redis_command_set_cancel(op->cmds);	/* Trunk frees the command set */
+	async->uctx = NULL;
+	talloc_free(op);
+}
+
 extern rlm_cache_driver_t rlm_cache_redis;
 rlm_cache_driver_t rlm_cache_redis = {
-	.name		= "rlm_cache_redis",
-	.magic		= RLM_MODULE_INIT,
-	.onload		= mod_load,
-	.instantiate	= mod_instantiate,
-	.inst_size	= sizeof(rlm_cache_redis_t),
-	.config		= driver_config,
-	.free		= cache_entry_free,
-
-	.find		= cache_entry_find,
-	.insert		= cache_entry_insert,
-	.expire		= cache_entry_expire,
+	.name			= "rlm_cache_redis",
+	.magic			= RLM_MODULE_INIT,
+	.onload			= mod_load,
+	.instantiate		= mod_instantiate,
+	.inst_size		= sizeof(rlm_cache_redis_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_inst_size	= sizeof(rlm_cache_redis_thread_t),
+	.thread_inst_type	= "rlm_cache_redis_thread_t",
+	.config			= driver_config,
+	.free			= cache_entry_free,
+
+	.find			= cache_entry_find,
+	.insert			= cache_entry_insert,
+	.expire			= cache_entry_expire,
+
+	.find_async		= cache_entry_find_async,
+	.insert_async		= cache_entry_insert_async,
+	.expire_async		= cache_entry_expire_async,
+	.cancel_async		= cache_async_cancel,
 };
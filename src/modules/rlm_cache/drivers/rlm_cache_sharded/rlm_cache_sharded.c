@@ -0,0 +1,463 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_sharded.c
+ * @brief In memory cache, split into independently locked shards.
+ *
+ * rlm_cache_rbtree has one mutex for the whole cache, so with many
+ * workers, every cache lookup waits on every other one.  This driver
+ * splits the cache into shards, each with its own mutex, tree and LRU
+ * list.  A key always maps to the same shard, so requests for
+ * different keys rarely contend.
+ *
+ * When a shard goes over its share of max_entries or max_memory,
+ * the least recently used entries are evicted.  Expired entries at
+ * the end of the LRU list are removed first.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include "../../rlm_cache.h"
+
+#define MAX_SHARDS	(1024)
+
+typedef struct {
+	pthread_mutex_t		mutex;		//!< Protects everything in the shard.
+	rbtree_t		*cache;		//!< Tree for looking up cache keys.
+	fr_dlist_head_t		lru;		//!< Entries, most recently used first.
+
+	size_t			memory;		//!< Used by entries in this shard.
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		evictions;	//!< Entries removed to make space.
+} rlm_cache_shard_t;
+
+typedef struct {
+	uint32_t		num_shards;	//!< Must be a power of 2.
+	size_t			max_memory;	//!< Over all shards.  0 means no limit.
+
+	uint32_t		shard_max_entries;	//!< Share of max_entries for each shard.
+	size_t			shard_max_memory;	//!< Share of max_memory for each shard.
+
+	rlm_cache_shard_t	*shards;
+} rlm_cache_sharded_t;
+
+typedef struct {
+	rlm_cache_entry_t	fields;		//!< Entry data.
+	fr_dlist_t		entry;		//!< In the LRU list.
+	rlm_cache_shard_t	*shard;		//!< We're in.  NULL if not in the cache.
+	size_t			size;		//!< Memory counted against the shard.
+} rlm_cache_sharded_entry_t;
+
+/** The shard the handle has locked
+ *
+ */
+typedef struct {
+	rlm_cache_sharded_t	*driver;
+	rlm_cache_shard_t	*shard;		//!< Currently locked, or NULL.
+} rlm_cache_sharded_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("shards", FR_TYPE_UINT32, rlm_cache_sharded_t, num_shards), .dflt = "16" },
+	{ FR_CONF_OFFSET("max_memory", FR_TYPE_SIZE, rlm_cache_sharded_t, max_memory), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Compare two entries by key
+ *
+ * There may only be one entry with the same key.
+ */
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Remove an entry from its shard
+ *
+ */
+static int _cache_entry_free(rlm_cache_sharded_entry_t *c)
+{
+	rlm_cache_shard_t *shard = c->shard;
+
+	if (!shard) return 0;
+
+	rbtree_deletebydata(shard->cache, c);
+	fr_dlist_remove(&shard->lru, c);
+	shard->memory -= c->size;
+	c->shard = NULL;
+
+	return 0;
+}
+
+/** Lock the shard a key belongs to
+ *
+ * A handle only ever locks one shard.  All of the operations for one
+ * call to rlm_cache use the same key, so in practice the shard never
+ * changes.
+ */
+static rlm_cache_shard_t *shard_lock(rlm_cache_sharded_handle_t *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_sharded_t	*driver = handle->driver;
+	rlm_cache_shard_t	*shard;
+
+	shard = &driver->shards[fr_hash(key, key_len) & (driver->num_shards - 1)];
+	if (handle->shard == shard) return shard;
+
+	if (handle->shard) pthread_mutex_unlock(&handle->shard->mutex);
+
+	pthread_mutex_lock(&shard->mutex);
+	handle->shard = shard;
+
+	return shard;
+}
+
+/** Remove expired entries, and least recently used ones until the shard is within its limits
+ *
+ * @param[in] driver	instance.
+ * @param[in] shard	to remove entries from.
+ * @param[in] keep	entry which was just inserted, and must not be removed.
+ * @param[in] now	the current time.
+ */
+static void shard_evict(rlm_cache_sharded_t const *driver, rlm_cache_shard_t *shard,
+			rlm_cache_sharded_entry_t *keep, fr_unix_time_t now)
+{
+	rlm_cache_sharded_entry_t *c;
+
+	while ((c = fr_dlist_tail(&shard->lru)) && (c != keep)) {
+		if (c->fields.expires >= now) {
+			if ((!driver->shard_max_entries ||
+			     (rbtree_num_elements(shard->cache) <= driver->shard_max_entries)) &&
+			    (!driver->shard_max_memory || (shard->memory <= driver->shard_max_memory))) break;
+
+			shard->evictions++;
+		}
+
+		talloc_free(c);
+	}
+}
+
+/** Free all shards
+ *
+ */
+static int mod_detach(void *instance)
+{
+	rlm_cache_sharded_t	*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	uint32_t		i;
+
+	if (!driver->shards) return 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_shard_t		*shard = &driver->shards[i];
+		rlm_cache_sharded_entry_t	*c;
+
+		if (!shard->cache) continue;
+
+		while ((c = fr_dlist_head(&shard->lru))) talloc_free(c);
+		talloc_free(shard->cache);
+
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	return 0;
+}
+
+/** Create a new cache_sharded instance
+ *
+ * @param instance	A uint8_t array of inst_size if inst_size > 0, else NULL,
+ *			this should contain the result of parsing the driver's
+ *			CONF_PARSER array that it specified in the interface struct.
+ * @param conf		section holding driver specific #CONF_PAIR (s).
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_cache_sharded_t		*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	rlm_cache_config_t const	*config = dl_module_parent_data_by_child_data(instance);
+	uint32_t			i;
+
+	fr_assert(config);
+
+	if (!driver->num_shards || (driver->num_shards > MAX_SHARDS) ||
+	    (driver->num_shards & (driver->num_shards - 1))) {
+		cf_log_err(conf, "'shards' must be a power of 2, between 1 and %u", MAX_SHARDS);
+		return -1;
+	}
+
+	/*
+	 *	Each shard gets an equal share of the limits.
+	 */
+	if (config->max_entries) {
+		driver->shard_max_entries = config->max_entries / driver->num_shards;
+		if (!driver->shard_max_entries) driver->shard_max_entries = 1;
+	}
+
+	if (driver->max_memory) {
+		driver->shard_max_memory = driver->max_memory / driver->num_shards;
+		if (!driver->shard_max_memory) driver->shard_max_memory = 1;
+	}
+
+	MEM(driver->shards = talloc_zero_array(driver, rlm_cache_shard_t, driver->num_shards));
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_shard_t *shard = &driver->shards[i];
+
+		shard->cache = rbtree_talloc_create(NULL, cache_entry_cmp, rlm_cache_sharded_entry_t, NULL, 0);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+			return -1;
+		}
+		fr_dlist_talloc_init(&shard->lru, rlm_cache_sharded_entry_t, entry);
+
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					    REQUEST *request)
+{
+	rlm_cache_sharded_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_sharded_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+	talloc_set_destructor(c, _cache_entry_free);
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry, and mark it as recently used
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+				       UNUSED REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_shard_t		*shard = shard_lock(handle, key, key_len);
+	rlm_cache_sharded_entry_t	*c;
+
+	c = rbtree_finddata(shard->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
+	if (!c) {
+		shard->misses++;
+		*out = NULL;
+		return CACHE_MISS;
+	}
+
+	shard->hits++;
+
+	fr_dlist_remove(&shard->lru, c);
+	fr_dlist_insert_head(&shard->lru, c);
+
+	*out = &c->fields;
+
+	return CACHE_OK;
+}
+
+/** Free an entry and remove it from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					 REQUEST *request, void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_shard_t	*shard;
+	rlm_cache_entry_t	*c;
+
+	if (!request) return CACHE_ERROR;
+
+	shard = shard_lock(handle, key, key_len);
+
+	c = rbtree_finddata(shard->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
+	if (!c) return CACHE_MISS;
+
+	talloc_free(c);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * Entries which make the shard go over its limits cause the least
+ * recently used entries to be evicted.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle,
+					 rlm_cache_entry_t const *c)
+{
+	rlm_cache_sharded_t		*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	rlm_cache_shard_t		*shard;
+	rlm_cache_sharded_entry_t	*my_c;
+
+	if (!request) return CACHE_ERROR;
+
+	memcpy(&my_c, &c, sizeof(my_c));
+
+	shard = shard_lock(handle, c->key, c->key_len);
+
+	/*
+	 *	Allow overwriting
+	 */
+	if (!rbtree_insert(shard->cache, my_c)) {
+		(void) cache_entry_expire(config, instance, request, handle, c->key, c->key_len);
+
+		if (!rbtree_insert(shard->cache, my_c)) {
+			RERROR("Failed adding entry");
+			return CACHE_ERROR;
+		}
+	}
+
+	my_c->shard = shard;
+	my_c->size = talloc_total_size(my_c);
+	shard->memory += my_c->size;
+	fr_dlist_insert_head(&shard->lru, my_c);
+
+	shard_evict(driver, shard, my_c, fr_time_to_unix_time(request->packet->timestamp));
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * Expiry is checked when entries are found, or evicted, so there's
+ * nothing to do.
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					  UNUSED REQUEST *request, UNUSED void *handle,
+					  UNUSED rlm_cache_entry_t *c)
+{
+	return CACHE_OK;
+}
+
+/** Get the statistics for one shard, or for all of them
+ *
+ * @copydetails cache_stats_t
+ */
+static int cache_stats(rlm_cache_stats_t *out, UNUSED rlm_cache_config_t const *config, void *instance, int shard)
+{
+	rlm_cache_sharded_t	*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	uint32_t		i, start = 0, end = driver->num_shards;
+
+	if (shard >= (int) driver->num_shards) return -1;
+
+	if (shard >= 0) {
+		start = shard;
+		end = shard + 1;
+	}
+
+	memset(out, 0, sizeof(*out));
+
+	for (i = start; i < end; i++) {
+		rlm_cache_shard_t *s = &driver->shards[i];
+
+		pthread_mutex_lock(&s->mutex);
+		out->hits += s->hits;
+		out->misses += s->misses;
+		out->evictions += s->evictions;
+		out->entries += rbtree_num_elements(s->cache);
+		out->memory += s->memory;
+		pthread_mutex_unlock(&s->mutex);
+	}
+
+	return driver->num_shards;
+}
+
+/** Allocate a handle
+ *
+ * Shards are locked when the key is known, by the find, insert and
+ * expire callbacks.
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, void *instance,
+			 REQUEST *request)
+{
+	rlm_cache_sharded_handle_t *h;
+
+	MEM(h = talloc_zero(request, rlm_cache_sharded_handle_t));
+	h->driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+
+	*handle = h;
+
+	return 0;
+}
+
+/** Unlock the shard, and free the handle
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, REQUEST *request,
+			  rlm_cache_handle_t *handle)
+{
+	rlm_cache_sharded_handle_t *h = talloc_get_type_abort(handle, rlm_cache_sharded_handle_t);
+
+	if (h->shard) {
+		pthread_mutex_unlock(&h->shard->mutex);
+		RDEBUG3("Shard %u mutex released", (unsigned int) (h->shard - h->driver->shards));
+	}
+
+	talloc_free(h);
+}
+
+extern rlm_cache_driver_t rlm_cache_sharded;
+rlm_cache_driver_t rlm_cache_sharded = {
+	.name		= "rlm_cache_sharded",
+	.magic		= RLM_MODULE_INIT,
+	.config		= driver_config,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.inst_size	= sizeof(rlm_cache_sharded_t),
+	.inst_type	= "rlm_cache_sharded_t",
+	.alloc		= cache_entry_alloc,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+	.stats		= cache_stats,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+};
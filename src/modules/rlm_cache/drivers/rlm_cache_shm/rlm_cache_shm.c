@@ -0,0 +1,525 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_shm.c
+ * @brief Cache shared between processes, in a memory mapped file.
+ *
+ * The file holds a header, followed by a hash table of fixed size
+ * slots.  Each slot holds one serialized entry.  Keys are found by
+ * probing a few slots after the one the key hashes to.
+ *
+ * There are no locks.  Each slot has a sequence number, which is odd
+ * while the slot is being written.  Writers claim a slot by changing
+ * the sequence number from even to odd with a CAS, and make it even
+ * again when they're done.  Readers copy the slot, and retry if the
+ * sequence number changed while they were copying.
+ *
+ * The file outlives the processes using it, so a restarted server
+ * starts with a warm cache.  If the file doesn't match the configured
+ * table size, it's emptied and resized.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include "../../rlm_cache.h"
+#include "../../serialize.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#define SHM_MAGIC		(0x46524353)	/* "FRCS" */
+#define SHM_VERSION		(1)
+#define SHM_PROBES		(8)		//!< Slots to search for a key.
+#define SHM_READ_RETRIES	(4)		//!< Times to retry reading a slot which is being written.
+
+/** Start of the file
+ *
+ */
+typedef struct {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		num_slots;
+	uint32_t		slot_size;
+
+	_Atomic(uint64_t)	hits;		//!< By all processes.
+	_Atomic(uint64_t)	misses;
+	_Atomic(uint64_t)	evictions;
+} CC_HINT(aligned(64)) rlm_cache_shm_header_t;
+
+/** One entry
+ *
+ */
+typedef struct {
+	_Atomic(uint32_t)	seq;		//!< Odd while the slot is being written.
+	uint32_t		hash;		//!< Of the key.
+	uint32_t		key_len;	//!< 0 if the slot is empty.
+	uint32_t		data_len;	//!< Length of the serialized entry.
+	fr_unix_time_t		expires;	//!< When the entry expires.
+	uint8_t			data[];		//!< The key, followed by the serialized entry.
+} rlm_cache_shm_slot_t;
+
+typedef struct {
+	char const		*filename;	//!< Of the memory mapped file.
+	uint32_t		num_slots;	//!< Must be a power of 2.
+	uint32_t		slot_size;	//!< Including the slot header.
+
+	rlm_cache_shm_header_t	*header;	//!< Start of the mapping.
+	size_t			size;		//!< Of the mapping.
+} rlm_cache_shm_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("filename", FR_TYPE_STRING, rlm_cache_shm_t, filename) },
+	{ FR_CONF_OFFSET("slots", FR_TYPE_UINT32, rlm_cache_shm_t, num_slots), .dflt = "65536" },
+	{ FR_CONF_OFFSET("slot_size", FR_TYPE_UINT32, rlm_cache_shm_t, slot_size), .dflt = "1024" },
+	CONF_PARSER_TERMINATOR
+};
+
+static inline rlm_cache_shm_slot_t *shm_slot(rlm_cache_shm_t const *driver, uint32_t hash, uint32_t probe)
+{
+	uint32_t i = (hash + probe) & (driver->num_slots - 1);
+
+	return (rlm_cache_shm_slot_t *)(((uint8_t *)driver->header) + sizeof(*driver->header) +
+					((size_t) i * driver->slot_size));
+}
+
+/** Claim a slot for writing
+ *
+ * @return
+ *	- The sequence number to release the slot with.
+ *	- 0 if another process is writing the slot.
+ */
+static inline uint32_t shm_slot_lock(rlm_cache_shm_slot_t *slot)
+{
+	uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+	if (seq & 0x01) return 0;
+
+	if (!atomic_compare_exchange_strong_explicit(&slot->seq, &seq, seq + 1,
+						     memory_order_acquire, memory_order_relaxed)) return 0;
+
+	return seq + 2;
+}
+
+static inline void shm_slot_unlock(rlm_cache_shm_slot_t *slot, uint32_t seq)
+{
+	atomic_store_explicit(&slot->seq, seq, memory_order_release);
+}
+
+/** Copy a slot, if it holds the key
+ *
+ * @param[out] buffer	to copy the slot to.  Must be slot_size bytes.
+ * @param[in] slot	to copy.
+ * @param[in] hash	of the key.
+ * @param[in] key	to look for.
+ * @param[in] key_len	of the key.
+ * @return
+ *	- true if the slot held the key, and was copied.
+ *	- false if it didn't, or was being written.
+ */
+static bool shm_slot_read(uint8_t *buffer, rlm_cache_shm_slot_t *slot, size_t slot_size,
+			  uint32_t hash, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_shm_slot_t	*copy = (rlm_cache_shm_slot_t *) buffer;
+	uint32_t		seq;
+	int			i;
+
+	for (i = 0; i < SHM_READ_RETRIES; i++) {
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq & 0x01) continue;
+
+		if ((slot->hash != hash) || (slot->key_len != key_len)) {
+			if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq) return false;
+			continue;
+		}
+
+		memcpy(buffer, slot, slot_size);
+
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) continue;
+
+		if ((copy->key_len != key_len) ||
+		    (copy->data_len > (slot_size - sizeof(*copy) - key_len)) ||
+		    (memcmp(copy->data, key, key_len) != 0)) return false;
+
+		return true;
+	}
+
+	return false;
+}
+
+/** Map the cache file, creating or resizing it if needed
+ *
+ */
+static int shm_map(rlm_cache_shm_t *driver, CONF_SECTION *conf)
+{
+	int			fd;
+	struct stat		st;
+	void			*mem;
+	rlm_cache_shm_header_t	*header;
+
+	driver->size = sizeof(rlm_cache_shm_header_t) + ((size_t) driver->num_slots * driver->slot_size);
+
+	fd = open(driver->filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		cf_log_err(conf, "Failed opening %s: %s", driver->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	Only one process checks and initialises the file at a time.
+	 */
+	if (flock(fd, LOCK_EX) < 0) {
+		cf_log_err(conf, "Failed locking %s: %s", driver->filename, fr_syserror(errno));
+	error:
+		close(fd);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		cf_log_err(conf, "Failed reading %s: %s", driver->filename, fr_syserror(errno));
+		goto error;
+	}
+
+	/*
+	 *	Empty the file, and size it correctly.
+	 */
+	if ((size_t) st.st_size != driver->size) {
+		if ((ftruncate(fd, 0) < 0) || (ftruncate(fd, driver->size) < 0)) {
+			cf_log_err(conf, "Failed resizing %s: %s", driver->filename, fr_syserror(errno));
+			goto error;
+		}
+	}
+
+	mem = mmap(NULL, driver->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED) {
+		cf_log_err(conf, "Failed mapping %s: %s", driver->filename, fr_syserror(errno));
+		goto error;
+	}
+	header = mem;
+
+	if ((header->magic != SHM_MAGIC) || (header->version != SHM_VERSION) ||
+	    (header->num_slots != driver->num_slots) || (header->slot_size != driver->slot_size)) {
+		if (header->magic) cf_log_warn(conf, "Format of %s has changed, emptying it", driver->filename);
+
+		memset(mem, 0, driver->size);
+		header->version = SHM_VERSION;
+		header->num_slots = driver->num_slots;
+		header->slot_size = driver->slot_size;
+		atomic_thread_fence(memory_order_release);
+		header->magic = SHM_MAGIC;
+	} else {
+		DEBUG("Using %s, with existing entries", driver->filename);
+	}
+
+	(void) flock(fd, LOCK_UN);
+	close(fd);
+
+	driver->header = header;
+
+	return 0;
+}
+
+/** Unmap the cache file
+ *
+ * The file, and the entries in it, are left for the next process.
+ */
+static int mod_detach(void *instance)
+{
+	rlm_cache_shm_t *driver = talloc_get_type_abort(instance, rlm_cache_shm_t);
+
+	if (driver->header) munmap(driver->header, driver->size);
+
+	return 0;
+}
+
+/** Create a new cache_shm instance
+ *
+ * @param instance	A uint8_t array of inst_size if inst_size > 0, else NULL,
+ *			this should contain the result of parsing the driver's
+ *			CONF_PARSER array that it specified in the interface struct.
+ * @param conf		section holding driver specific #CONF_PAIR (s).
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_cache_shm_t			*driver = talloc_get_type_abort(instance, rlm_cache_shm_t);
+	rlm_cache_config_t const	*config = dl_module_parent_data_by_child_data(instance);
+
+	fr_assert(config);
+
+	if (!driver->num_slots || (driver->num_slots & (driver->num_slots - 1))) {
+		cf_log_err(conf, "'slots' must be a power of 2");
+		return -1;
+	}
+	FR_INTEGER_BOUND_CHECK("slots", driver->num_slots, <=, (1 << 24));
+
+	FR_INTEGER_BOUND_CHECK("slot_size", driver->slot_size, >=, 256);
+	FR_INTEGER_BOUND_CHECK("slot_size", driver->slot_size, <=, 65536);
+	driver->slot_size = (driver->slot_size + 63) & ~63;	/* Keep slots cache line aligned */
+
+	if (!driver->filename) {
+		driver->filename = talloc_typed_asprintf(driver, "/dev/shm/radiusd_cache_%s", config->name);
+	}
+
+	return shm_map(driver, conf);
+}
+
+/** Free an entry we deserialized
+ *
+ * @copydetails cache_entry_free_t
+ */
+static void cache_entry_free(rlm_cache_entry_t *c)
+{
+	talloc_free(c);
+}
+
+/** Locate a cache entry
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *instance,
+				       REQUEST *request, UNUSED void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_shm_t		*driver = talloc_get_type_abort(instance, rlm_cache_shm_t);
+	rlm_cache_shm_slot_t	*copy;
+	rlm_cache_entry_t	*c;
+	uint8_t			*buffer;
+	uint32_t		hash = fr_hash(key, key_len);
+	int			i;
+
+	*out = NULL;
+
+	/*
+	 *	One extra byte, so we can terminate the serialized entry.
+	 */
+	MEM(buffer = talloc_array(NULL, uint8_t, driver->slot_size + 1));
+	copy = (rlm_cache_shm_slot_t *) buffer;
+
+	for (i = 0; i < SHM_PROBES; i++) {
+		if (shm_slot_read(buffer, shm_slot(driver, hash, i), driver->slot_size, hash, key, key_len)) break;
+	}
+
+	if (i == SHM_PROBES) {
+		atomic_fetch_add_explicit(&driver->header->misses, 1, memory_order_relaxed);
+		talloc_free(buffer);
+		return CACHE_MISS;
+	}
+	atomic_fetch_add_explicit(&driver->header->hits, 1, memory_order_relaxed);
+
+	copy->data[key_len + copy->data_len] = '\0';
+
+	MEM(c = talloc_zero(NULL, rlm_cache_entry_t));
+	if (cache_deserialize(c, request->dict, (char *) copy->data + key_len, copy->data_len) < 0) {
+		RPERROR("Invalid entry");
+		talloc_free(buffer);
+		talloc_free(c);
+		return CACHE_ERROR;
+	}
+	talloc_free(buffer);
+
+	c->key = talloc_memdup(c, key, key_len);
+	c->key_len = key_len;
+
+	*out = c;
+
+	return CACHE_OK;
+}
+
+/** Remove an entry from the cache
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
+					 UNUSED REQUEST *request, UNUSED void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_shm_t	*driver = talloc_get_type_abort(instance, rlm_cache_shm_t);
+	uint32_t	hash = fr_hash(key, key_len);
+	cache_status_t	status = CACHE_MISS;
+	int		i;
+
+	for (i = 0; i < SHM_PROBES; i++) {
+		rlm_cache_shm_slot_t	*slot = shm_slot(driver, hash, i);
+		uint32_t		seq;
+
+		if ((slot->hash != hash) || (slot->key_len != key_len)) continue;
+
+		seq = shm_slot_lock(slot);
+		if (!seq) continue;
+
+		if ((slot->hash == hash) && (slot->key_len == key_len) &&
+		    (memcmp(slot->data, key, key_len) == 0)) {
+			slot->key_len = 0;
+			status = CACHE_OK;
+		}
+
+		shm_slot_unlock(slot, seq);
+	}
+
+	return status;
+}
+
+/** Insert a new entry into the cache
+ *
+ * Uses the slot which already holds the key, or an empty or expired
+ * slot, or failing that evicts the entry which will expire soonest.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, UNUSED void *handle,
+					 rlm_cache_entry_t const *c)
+{
+	rlm_cache_shm_t		*driver = talloc_get_type_abort(instance, rlm_cache_shm_t);
+	rlm_cache_shm_slot_t	*slot, *found = NULL;
+	fr_unix_time_t		now = fr_time_to_unix_time(request->packet->timestamp);
+	uint32_t		hash = fr_hash(c->key, c->key_len);
+	uint32_t		seq = 0;
+	size_t			len;
+	uint8_t			*to_store = NULL;
+	TALLOC_CTX		*pool;
+	int			i;
+	bool			evicted = false;
+
+	pool = talloc_pool(NULL, 1024);
+	if (!pool) return CACHE_ERROR;
+
+	if (cache_serialize_by_format(pool, &to_store, &len, c, config->serialize) < 0) {
+		RPERROR("Failed serializing entry");
+		talloc_free(pool);
+		return CACHE_ERROR;
+	}
+
+	if ((c->key_len + len) > (driver->slot_size - sizeof(*slot))) {
+		RWDEBUG("Entry is %zu bytes, which is larger than slot_size allows", c->key_len + len);
+		talloc_free(pool);
+		return CACHE_ERROR;
+	}
+
+	/*
+	 *	Prefer the slot with the same key, then an empty or
+	 *	expired slot, then the slot which expires soonest.
+	 */
+	for (i = 0; i < SHM_PROBES; i++) {
+		slot = shm_slot(driver, hash, i);
+
+		if ((slot->hash == hash) && (slot->key_len == c->key_len) &&
+		    (memcmp(slot->data, c->key, c->key_len) == 0)) {
+			found = slot;
+			evicted = false;
+			break;
+		}
+
+		if (!slot->key_len || (slot->expires < now)) {
+			if (!found || found->key_len) {
+				found = slot;
+				evicted = false;
+			}
+			continue;
+		}
+
+		if (!found || (found->key_len && (slot->expires < found->expires))) {
+			found = slot;
+			evicted = true;
+		}
+	}
+
+	seq = shm_slot_lock(found);
+	if (!seq) {
+		RWDEBUG("Slot is being written by another process, not caching entry");
+		talloc_free(pool);
+		return CACHE_ERROR;
+	}
+
+	found->hash = hash;
+	found->key_len = c->key_len;
+	found->data_len = len;
+	found->expires = c->expires;
+	memcpy(found->data, c->key, c->key_len);
+	if (len) memcpy(found->data + c->key_len, to_store, len);
+
+	shm_slot_unlock(found, seq);
+	talloc_free(pool);
+
+	if (evicted) atomic_fetch_add_explicit(&driver->header->evictions, 1, memory_order_relaxed);
+
+	return CACHE_OK;
+}
+
+/** Get the statistics for the cache
+ *
+ * The cache is shared, so the statistics are for all processes using it.
+ *
+ * @copydetails cache_stats_t
+ */
+static int cache_stats(rlm_cache_stats_t *out, UNUSED rlm_cache_config_t const *config, void *instance, int shard)
+{
+	rlm_cache_shm_t	*driver = talloc_get_type_abort(instance, rlm_cache_shm_t);
+	fr_unix_time_t	now = fr_time_to_unix_time(fr_time());
+	uint32_t	i;
+
+	if (shard > 0) return -1;
+
+	memset(out, 0, sizeof(*out));
+	out->hits = atomic_load_explicit(&driver->header->hits, memory_order_relaxed);
+	out->misses = atomic_load_explicit(&driver->header->misses, memory_order_relaxed);
+	out->evictions = atomic_load_explicit(&driver->header->evictions, memory_order_relaxed);
+
+	for (i = 0; i < driver->num_slots; i++) {
+		rlm_cache_shm_slot_t *slot = shm_slot(driver, i, 0);
+
+		if (!slot->key_len || (slot->expires < now)) continue;
+
+		out->entries++;
+		out->memory += slot->key_len + slot->data_len;
+	}
+
+	return 1;
+}
+
+extern rlm_cache_driver_t rlm_cache_shm;
+rlm_cache_driver_t rlm_cache_shm = {
+	.name		= "rlm_cache_shm",
+	.magic		= RLM_MODULE_INIT,
+	.config		= driver_config,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.inst_size	= sizeof(rlm_cache_shm_t),
+	.inst_type	= "rlm_cache_shm_t",
+	.free		= cache_entry_free,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.stats		= cache_stats,
+};
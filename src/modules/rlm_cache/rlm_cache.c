@@ -30,24 +30,98 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/dl_module.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/rbtree.h>
 
 #include "rlm_cache.h"
 
+#define LEASE_POLL_INTERVAL	fr_time_delta_from_msec(5)	//!< How often waiting requests check the lease.
+
+/** Keys which requests are populating
+ *
+ * Shared by all worker threads, so protected by the mutex.
+ */
+struct rlm_cache_lease_table_s {
+	pthread_mutex_t		mutex;
+	rbtree_t		*tree;			//!< Of rlm_cache_lease_t.
+};
+
+/** A request is populating an entry
+ *
+ */
+typedef struct {
+	uint8_t const		*key;			//!< Being populated.
+	size_t			key_len;		//!< Length of the key.
+	fr_time_t		expires;		//!< When other requests stop waiting for it.
+	void const		*owner;			//!< The #rlm_cache_lease_ref_t of the request holding the lease.
+} rlm_cache_lease_t;
+
+/** Held by the request which holds the lease, and releases it when freed
+ *
+ */
+typedef struct {
+	rlm_cache_t const	*inst;
+	uint8_t const		*key;
+	size_t			key_len;
+} rlm_cache_lease_ref_t;
+
+/** A request is waiting for another request to populate an entry
+ *
+ */
+typedef struct {
+	rlm_cache_t const	*inst;
+	uint8_t const		*key;
+	size_t			key_len;
+	fr_time_t		started;		//!< When the request started waiting.
+} rlm_cache_lease_wait_t;
+
+typedef enum {
+	CACHE_ASYNC_FIND = 0,				//!< Retrieving the entry.
+	CACHE_ASYNC_INSERT,				//!< Inserting a new entry.
+	CACHE_ASYNC_SET_TTL,				//!< Inserting an existing entry with a new TTL.
+	CACHE_ASYNC_EXPIRE				//!< Removing the entry.
+} rlm_cache_async_op_t;
+
+/** A request is waiting for the driver to complete an operation
+ *
+ */
+typedef struct {
+	rlm_cache_async_op_t	op;			//!< Being performed.
+	rlm_cache_async_t	result;			//!< Written by the driver.
+
+	uint8_t const		*key;			//!< Of the entry.
+	size_t			key_len;		//!< Length of the key.
+	rlm_cache_entry_t	*c;			//!< Being inserted.
+
+	rlm_rcode_t		rcode;			//!< Before the operation.
+	bool			merge;			//!< The entry being inserted was merged into the request.
+	bool			waited;			//!< The request has already waited for a lease.
+} rlm_cache_async_state_t;
+
 extern module_t rlm_cache;
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", FR_TYPE_STRING, rlm_cache_config_t, driver_name), .dflt = "rlm_cache_rbtree" },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_cache_config_t, key) },
 	{ FR_CONF_OFFSET("ttl", FR_TYPE_UINT32, rlm_cache_config_t, ttl), .dflt = "500" },
+	{ FR_CONF_OFFSET("negative_ttl", FR_TYPE_UINT32, rlm_cache_config_t, negative_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("lease_timeout", FR_TYPE_TIME_DELTA, rlm_cache_config_t, lease_timeout), .dflt = "0" },
 	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_cache_config_t, max_entries), .dflt = "0" },
 
 	/* Should be a type which matches time_t, @fixme before 2038 */
 	{ FR_CONF_OFFSET("epoch", FR_TYPE_INT32, rlm_cache_config_t, epoch), .dflt = "0" },
 	{ FR_CONF_OFFSET("add_stats", FR_TYPE_BOOL, rlm_cache_config_t, stats), .dflt = "no" },
+	{ FR_CONF_OFFSET("serialize", FR_TYPE_STRING, rlm_cache_config_t, serialize_name), .dflt = "binary" },
 	CONF_PARSER_TERMINATOR
 };
 
+static fr_table_num_sorted_t const cache_serialize_table[] = {
+	{ "binary",	CACHE_SERIALIZE_BINARY	},
+	{ "text",	CACHE_SERIALIZE_TEXT	}
+};
+static size_t cache_serialize_table_len = NUM_ELEMENTS(cache_serialize_table);
+
 static fr_dict_t const *dict_freeradius;
 
 extern fr_dict_autoload_t rlm_cache_dict[];
@@ -62,6 +136,7 @@ static fr_dict_attr_t const *attr_cache_allow_merge;
 static fr_dict_attr_t const *attr_cache_allow_insert;
 static fr_dict_attr_t const *attr_cache_ttl;
 static fr_dict_attr_t const *attr_cache_entry_hits;
+static fr_dict_attr_t const *attr_cache_negative;
 
 extern fr_dict_attr_autoload_t rlm_cache_dict_attr[];
 fr_dict_attr_autoload_t rlm_cache_dict_attr[] = {
@@ -71,6 +146,7 @@ fr_dict_attr_autoload_t rlm_cache_dict_attr[] = {
 	{ .out = &attr_cache_allow_insert, .name = "Cache-Allow-Insert", .type = FR_TYPE_BOOL, .dict = &dict_freeradius },
 	{ .out = &attr_cache_ttl, .name = "Cache-TTL", .type = FR_TYPE_INT32, .dict = &dict_freeradius },
 	{ .out = &attr_cache_entry_hits, .name = "Cache-Entry-Hits", .type = FR_TYPE_UINT32, .dict = &dict_freeradius },
+	{ .out = &attr_cache_negative, .name = "Cache-Negative", .type = FR_TYPE_BOOL, .dict = &dict_freeradius },
 	{ NULL }
 };
 
@@ -187,20 +263,100 @@ static rlm_rcode_t cache_merge(rlm_cache_t const *inst, REQUEST *request, rlm_ca
 		vp->vp_uint32 = c->hits;
 	}
 
+	/*
+	 *	The entry records that there was nothing to cache,
+	 *	so tell the policy it doesn't need to look again.
+	 */
+	if (!c->maps) {
+		RDEBUG2("Entry is negative");
+		MEM(pair_update_request(&vp, attr_cache_negative) >= 0);
+		vp->vp_bool = true;
+	}
+
 	return merged > 0 ?
 		RLM_MODULE_UPDATED :
 		RLM_MODULE_OK;
 }
 
+/** Start an asynchronous driver operation
+ *
+ * @param[out] out	State to yield with, if the operation was started.
+ * @param[in] inst	Module instance.
+ * @param[in] request	The current request.
+ * @param[in] op	to start.
+ * @param[in] key	of the entry.
+ * @param[in] key_len	Length of the key.
+ * @param[in] c		to insert, for #CACHE_ASYNC_INSERT and #CACHE_ASYNC_SET_TTL.
+ * @return
+ *	- 1 if the driver can't perform the operation asynchronously.
+ *	- 0 if the operation was started.
+ *	- -1 on failure.
+ */
+static int cache_async_start(rlm_cache_async_state_t **out, rlm_cache_t const *inst, REQUEST *request,
+			     rlm_cache_async_op_t op, uint8_t const *key, size_t key_len, rlm_cache_entry_t const *c)
+{
+	rlm_cache_async_state_t		*state;
+	module_thread_instance_t	*thread = module_thread(inst->driver_inst);
+	void				*driver_inst = inst->driver_inst->dl_inst->data;
+	int				ret;
+
+	MEM(state = talloc_zero(request, rlm_cache_async_state_t));
+	state->op = op;
+	state->key = talloc_memdup(state, key, key_len);
+	state->key_len = key_len;
+
+	switch (op) {
+	case CACHE_ASYNC_FIND:
+		ret = inst->driver->find_async(&state->result, &inst->config, driver_inst, thread->data,
+					       request, key, key_len);
+		break;
+
+	case CACHE_ASYNC_INSERT:
+	case CACHE_ASYNC_SET_TTL:
+		ret = inst->driver->insert_async(&state->result, &inst->config, driver_inst, thread->data,
+						 request, c);
+		break;
+
+	case CACHE_ASYNC_EXPIRE:
+		ret = inst->driver->expire_async(&state->result, &inst->config, driver_inst, thread->data,
+						 request, key, key_len);
+		break;
+
+	default:
+		fr_assert(0);
+		ret = -1;
+		break;
+	}
+
+	if (ret != 0) {
+		if (ret < 0) RPEDEBUG("Failed starting cache operation");
+		talloc_free(state);
+		return ret;
+	}
+
+	*out = state;
+
+	return 0;
+}
+
 /** Find a cached entry.
  *
+ * @param[out] out	The entry, if one was found.
+ * @param[in] inst	Module instance.
+ * @param[in] request	The current request.
+ * @param[in] handle	from #cache_acquire.
+ * @param[in] key	of the entry.
+ * @param[in] key_len	Length of the key.
+ * @param[in] found	Result of an asynchronous find, or NULL to call
+ *			the driver's find callback.
  * @return
  *	- #RLM_MODULE_OK on cache hit.
  *	- #RLM_MODULE_FAIL on failure.
  *	- #RLM_MODULE_NOTFOUND on cache miss.
  */
 static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst, REQUEST *request,
-			      rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len)
+			      rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len,
+			      rlm_cache_async_t *found)
 {
 	cache_status_t ret;
 
@@ -209,7 +365,19 @@ static rlm_rcode_t cache_find(rlm_cache_entry_t **out, rlm_cache_t const *inst,
 	*out = NULL;
 
 	for (;;) {
-		ret = inst->driver->find(&c, &inst->config, inst->driver_inst->dl_inst->data, request, *handle, key, key_len);
+		/*
+		 *	The driver already retrieved the entry
+		 *	asynchronously.
+		 */
+		if (found) {
+			ret = found->status;
+			c = found->c;
+			found->c = NULL;
+			found = NULL;
+		} else {
+			ret = inst->driver->find(&c, &inst->config, inst->driver_inst->dl_inst->data,
+						 request, *handle, key, key_len);
+		}
 		switch (ret) {
 		case CACHE_RECONNECT:
 			RDEBUG2("Reconnecting...");
@@ -285,14 +453,20 @@ static rlm_rcode_t cache_expire(rlm_cache_t const *inst, REQUEST *request,
 }
 
 /** Create and insert a cache entry
+ *
+ * Entries with no attributes record that there was nothing to cache,
+ * and are inserted with negative_ttl.
  *
  * @return
  *	- #RLM_MODULE_OK on success.
  *	- #RLM_MODULE_UPDATED if we merged the cache entry.
+ *	- #RLM_MODULE_YIELD if the driver is inserting the entry asynchronously.
+ *	  async is set to the state to yield with.
  *	- #RLM_MODULE_FAIL on failure.
  */
-static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_cache_handle_t **handle,
-				uint8_t const *key, size_t key_len, int ttl)
+static rlm_rcode_t cache_insert(rlm_cache_async_state_t **async,
+				rlm_cache_t const *inst, REQUEST *request, rlm_cache_handle_t **handle,
+				uint8_t const *key, size_t key_len, int ttl, int negative_ttl)
 {
 	vp_map_t		const *map;
 	vp_map_t		**last, *c_map;
@@ -316,12 +490,6 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 	c->key = talloc_memdup(c, key, key_len);
 	c->key_len = key_len;
 
-	/*
-	 *	All in NSEC resolution
-	 */
-	c->created = c->expires = fr_time_to_unix_time(request->packet->timestamp);
-	c->expires += fr_time_delta_from_sec(ttl);
-
 	last = &c->maps;
 
 	RDEBUG2("Creating new cache entry");
@@ -447,6 +615,17 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 	}
 	talloc_free(pool);
 
+	if (!c->maps) {
+		RDEBUG2("Nothing to cache, creating negative entry");
+		ttl = negative_ttl;
+	}
+
+	/*
+	 *	All in NSEC resolution
+	 */
+	c->created = c->expires = fr_time_to_unix_time(request->packet->timestamp);
+	c->expires += fr_time_delta_from_sec(ttl);
+
 	/*
 	 *	Check to see if we need to merge the entry into the request
 	 */
@@ -455,6 +634,21 @@ static rlm_rcode_t cache_insert(rlm_cache_t const *inst, REQUEST *request, rlm_c
 
 	if (merge) cache_merge(inst, request, c);
 
+	if (inst->driver->insert_async) switch (cache_async_start(async, inst, request, CACHE_ASYNC_INSERT,
+								   key, key_len, c)) {
+	case 0:
+		(*async)->c = c;
+		(*async)->merge = merge;
+		return RLM_MODULE_YIELD;
+
+	case 1:
+		break;
+
+	default:
+		talloc_free(c);
+		return RLM_MODULE_FAIL;
+	}
+
 	for (;;) {
 		cache_status_t ret;
 
@@ -530,6 +724,332 @@ static rlm_rcode_t cache_set_ttl(rlm_cache_t const *inst, REQUEST *request,
 	}
 }
 
+static int lease_cmp(void const *one, void const *two)
+{
+	rlm_cache_lease_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+	if (ret) return ret;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Remove a lease, if it's still held by the owner
+ *
+ * @param[in] leases	to remove the lease from.
+ * @param[in] key	of the lease.
+ * @param[in] key_len	of the lease.
+ * @param[in] owner	of the lease, or NULL to remove it whoever holds it.
+ * @return
+ *	- true if a lease was removed.
+ *	- false if there was no lease, or it was held by someone else.
+ */
+static bool lease_remove(rlm_cache_lease_table_t *leases, uint8_t const *key, size_t key_len, void const *owner)
+{
+	rlm_cache_lease_t	find = { .key = key, .key_len = key_len }, *lease;
+	bool			removed = false;
+
+	pthread_mutex_lock(&leases->mutex);
+	lease = rbtree_finddata(leases->tree, &find);
+	if (lease && (!owner || (lease->owner == owner))) {
+		rbtree_deletebydata(leases->tree, lease);
+		talloc_free(lease);
+		removed = true;
+	}
+	pthread_mutex_unlock(&leases->mutex);
+
+	return removed;
+}
+
+static int _lease_ref_free(rlm_cache_lease_ref_t *ref)
+{
+	(void) lease_remove(ref->inst->leases, ref->key, ref->key_len, ref);
+
+	return 0;
+}
+
+/** Take a lease on a key which we didn't find
+ *
+ * If no other request holds a lease on the key (or the lease has
+ * expired), this request takes it, and is expected to populate the
+ * entry.  The lease is released when the entry is inserted, or the
+ * request is freed.
+ *
+ * @param[in] inst	Module instance.
+ * @param[in] request	which didn't find an entry.
+ * @param[in] key	which wasn't found.
+ * @param[in] key_len	of the key.
+ * @param[in] waited	whether the request has already waited for a lease.
+ * @return
+ *	- true if the request should continue, as if the entry wasn't found.
+ *	- false if the request should wait for another request to populate the entry.
+ */
+static bool cache_lease_acquire(rlm_cache_t const *inst, REQUEST *request,
+				uint8_t const *key, size_t key_len, bool waited)
+{
+	rlm_cache_lease_table_t	*leases = inst->leases;
+	rlm_cache_lease_t	find = { .key = key, .key_len = key_len }, *lease;
+	rlm_cache_lease_ref_t	*ref;
+	fr_time_t		now = fr_time();
+
+	if (!leases) return true;
+
+	/*
+	 *	We already hold a lease on this key.
+	 */
+	ref = request_data_reference(request, inst, 0);
+	if (ref && (ref->key_len == key_len) && (memcmp(ref->key, key, key_len) == 0)) return true;
+
+	pthread_mutex_lock(&leases->mutex);
+	lease = rbtree_finddata(leases->tree, &find);
+	if (lease && (lease->expires > now)) {
+		pthread_mutex_unlock(&leases->mutex);
+
+		/*
+		 *	We waited, and the entry still isn't there,
+		 *	so don't wait again.
+		 */
+		if (waited) {
+			RDEBUG2("Entry is still being populated by another request, continuing");
+			return true;
+		}
+
+		RDEBUG2("Entry is being populated by another request, waiting for it");
+		return false;
+	}
+
+	MEM(ref = talloc_zero(request, rlm_cache_lease_ref_t));
+	ref->inst = inst;
+	ref->key = talloc_memdup(ref, key, key_len);
+	ref->key_len = key_len;
+
+	/*
+	 *	Take over leases whose owner didn't populate the
+	 *	entry in time.
+	 */
+	if (!lease) {
+		MEM(lease = talloc_zero(leases->tree, rlm_cache_lease_t));
+		lease->key = talloc_memdup(lease, key, key_len);
+		lease->key_len = key_len;
+		if (!rbtree_insert(leases->tree, lease)) {
+			pthread_mutex_unlock(&leases->mutex);
+			talloc_free(lease);
+			talloc_free(ref);
+			return true;
+		}
+	}
+	lease->expires = now + inst->config.lease_timeout;
+	lease->owner = ref;
+	pthread_mutex_unlock(&leases->mutex);
+
+	talloc_set_destructor(ref, _lease_ref_free);
+	(void) request_data_add(request, inst, 0, ref, true, true, false);
+
+	RDEBUG2("Took lease on entry");
+
+	return true;
+}
+
+/** Release any lease on the key, now the entry has been populated
+ *
+ */
+static void cache_lease_release(rlm_cache_t const *inst, REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_lease_ref_t *ref;
+
+	if (!inst->leases) return;
+
+	ref = request_data_get(request, inst, 0);
+	talloc_free(ref);
+
+	if (lease_remove(inst->leases, key, key_len, NULL)) RDEBUG2("Released lease on entry");
+}
+
+static void cache_lease_poll(UNUSED void *instance, UNUSED void *thread, REQUEST *request,
+			     UNUSED void *rctx, UNUSED fr_time_t fired)
+{
+	unlang_interpret_resumable(request);
+}
+
+static void cache_lease_signal(UNUSED void *instance, UNUSED void *thread, REQUEST *request, void *rctx,
+			       fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	(void) unlang_module_timeout_delete(request, rctx);
+}
+
+static rlm_rcode_t cache_it(rlm_cache_t const *inst, REQUEST *request, bool waited, rlm_cache_async_t *found);
+
+/** Check whether the request we're waiting for has populated the entry
+ *
+ * If it has, or it's taking too long, look for the entry again.
+ * Otherwise keep waiting.
+ */
+static rlm_rcode_t cache_lease_resume(void *instance, UNUSED void *thread, REQUEST *request, void *rctx)
+{
+	rlm_cache_t const	*inst = instance;
+	rlm_cache_lease_wait_t	*wait = talloc_get_type_abort(rctx, rlm_cache_lease_wait_t);
+	rlm_cache_lease_t	find = { .key = wait->key, .key_len = wait->key_len }, *lease;
+	fr_time_t		now = fr_time();
+	bool			done;
+
+	pthread_mutex_lock(&inst->leases->mutex);
+	lease = rbtree_finddata(inst->leases->tree, &find);
+	done = !lease || (lease->expires <= now);
+	pthread_mutex_unlock(&inst->leases->mutex);
+
+	if (!done) {
+		if ((now - wait->started) < inst->config.lease_timeout) {
+			if (unlang_module_timeout_add(request, cache_lease_poll, wait, now + LEASE_POLL_INTERVAL) == 0) {
+				return unlang_module_yield(request, cache_lease_resume, cache_lease_signal, wait);
+			}
+			RPEDEBUG("Failed adding poll timer");
+		}
+		RDEBUG2("Timed out waiting for entry");
+	}
+	talloc_free(wait);
+
+	return cache_it(inst, request, true, NULL);
+}
+
+/** Wait for another request to populate the entry
+ *
+ * Waiting requests may be in other threads, so they poll the lease
+ * rather than being woken when it's released.
+ */
+static rlm_rcode_t cache_lease_wait(rlm_cache_t const *inst, REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_lease_wait_t *wait;
+
+	MEM(wait = talloc_zero(request, rlm_cache_lease_wait_t));
+	wait->inst = inst;
+	wait->key = talloc_memdup(wait, key, key_len);
+	wait->key_len = key_len;
+	wait->started = fr_time();
+
+	if (unlang_module_timeout_add(request, cache_lease_poll, wait, wait->started + LEASE_POLL_INTERVAL) < 0) {
+		RPEDEBUG("Failed adding poll timer");
+		talloc_free(wait);
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, cache_lease_resume, cache_lease_signal, wait);
+}
+
+/** Remove the control attributes which apply to one call of the module
+ *
+ */
+static void cache_control_clear(REQUEST *request)
+{
+	fr_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+
+	for (vp = fr_cursor_init(&cursor, &request->control);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+	     again:
+		if (!fr_dict_attr_is_top_level(vp->da)) continue;
+
+		switch (vp->da->attr) {
+		case FR_CACHE_TTL:
+		case FR_CACHE_STATUS_ONLY:
+		case FR_CACHE_ALLOW_MERGE:
+		case FR_CACHE_ALLOW_INSERT:
+		case FR_CACHE_MERGE_NEW:
+			RDEBUG2("Removing &control:%s", vp->da->name);
+			vp = fr_cursor_remove(&cursor);
+			talloc_free(vp);
+			vp = fr_cursor_current(&cursor);
+			if (!vp) break;
+			goto again;
+		}
+	}
+}
+
+/** Continue after the driver completes an asynchronous operation
+ *
+ */
+static rlm_rcode_t cache_async_resume(void *instance, UNUSED void *thread, REQUEST *request, void *rctx)
+{
+	rlm_cache_t const		*inst = instance;
+	rlm_cache_async_state_t		*state = talloc_get_type_abort(rctx, rlm_cache_async_state_t);
+	rlm_rcode_t			rcode = state->rcode;
+
+	switch (state->op) {
+	/*
+	 *	Carry on from where we left off
+	 */
+	case CACHE_ASYNC_FIND:
+		rcode = cache_it(inst, request, state->waited, &state->result);
+		cache_free(inst, &state->result.c);
+		talloc_free(state);
+		return rcode;
+
+	case CACHE_ASYNC_INSERT:
+		if (state->result.status != CACHE_OK) {
+			talloc_free(state->c);	/* Failed insertion - use talloc_free not the driver free */
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+		RDEBUG2("Committed entry");
+		cache_free(inst, &state->c);
+		cache_lease_release(inst, request, state->key, state->key_len);
+
+		if (state->merge) {
+			rcode = RLM_MODULE_UPDATED;
+		} else if (rcode != RLM_MODULE_UPDATED) {
+			rcode = RLM_MODULE_OK;
+		}
+		break;
+
+	case CACHE_ASYNC_SET_TTL:
+		cache_free(inst, &state->c);
+		if (state->result.status != CACHE_OK) {
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+		RDEBUG2("Updated entry TTL");
+		if (rcode != RLM_MODULE_UPDATED) rcode = RLM_MODULE_OK;
+		break;
+
+	case CACHE_ASYNC_EXPIRE:
+		switch (state->result.status) {
+		case CACHE_OK:
+			if (rcode == RLM_MODULE_NOOP) rcode = RLM_MODULE_OK;
+			break;
+
+		case CACHE_MISS:
+			if (rcode == RLM_MODULE_NOOP) rcode = RLM_MODULE_NOTFOUND;
+			break;
+
+		default:
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+		break;
+	}
+
+	talloc_free(state);
+	cache_control_clear(request);
+
+	return rcode;
+}
+
+static void cache_async_signal(void *instance, UNUSED void *thread, REQUEST *request, void *rctx,
+			       fr_state_signal_t action)
+{
+	rlm_cache_t const		*inst = instance;
+	rlm_cache_async_state_t		*state = talloc_get_type_abort(rctx, rlm_cache_async_state_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (inst->driver->cancel_async) inst->driver->cancel_async(inst->driver_inst->dl_inst->data,
+								   module_thread(inst->driver_inst)->data,
+								   request, &state->result);
+}
+
 /** Verify that a map in the cache section makes sense
  *
  */
@@ -548,21 +1068,22 @@ static int cache_verify(vp_map_t *map, void *ctx)
 
 /** Do caching checks
  *
- * Since we can update ANY VP list, we do exactly the same thing for all sections
- * (autz / auth / etc.)
+ * If the driver can retrieve entries asynchronously, we yield while it
+ * does, and are called again with the result.
  *
- * If you want to cache something different in different sections, configure
- * another cache module.
+ * @param[in] inst	Module instance.
+ * @param[in] request	The current request.
+ * @param[in] waited	Whether the request has already waited for another
+ *			request to populate the entry.
+ * @param[in] found	Result of an asynchronous find, or NULL.
  */
-static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t cache_it(rlm_cache_t const *inst, REQUEST *request, bool waited, rlm_cache_async_t *found)
 {
 	rlm_cache_entry_t	*c = NULL;
-	rlm_cache_t const	*inst = instance;
 
-	rlm_cache_handle_t	*handle;
+	rlm_cache_handle_t	*handle = NULL;
+	rlm_cache_async_state_t	*async = NULL;
 
-	fr_cursor_t		cursor;
 	VALUE_PAIR		*vp;
 
 	bool			merge = true, insert = true, expire = false, set_ttl = false;
@@ -574,6 +1095,7 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
 
 	int			ttl = inst->config.ttl;
+	int			negative_ttl = inst->config.negative_ttl ? inst->config.negative_ttl : inst->config.ttl;
 
 	key_len = tmpl_expand((char const **)&key, (char *)buffer, sizeof(buffer),
 			      request, inst->config.key, NULL, NULL);
@@ -594,12 +1116,26 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 		RDEBUG3("status-only: yes");
 		REXDENT();
 
+		if (!found && inst->driver->find_async) switch (cache_async_start(&async, inst, request,
+										  CACHE_ASYNC_FIND, key, key_len, NULL)) {
+		case 0:
+			goto yield;
+
+		case 1:
+			break;
+
+		default:
+			return RLM_MODULE_FAIL;
+		}
+
 		if (cache_acquire(&handle, inst, request) < 0) return RLM_MODULE_FAIL;
 
-		rcode = cache_find(&c, inst, request, &handle, key, key_len);
+		rcode = cache_find(&c, inst, request, &handle, key, key_len, found);
 		if (rcode == RLM_MODULE_FAIL) goto finish;
 		fr_assert(!inst->driver->acquire || handle);
 
+		if (!c && !cache_lease_acquire(inst, request, key, key_len, waited)) goto wait;
+
 		rcode = c ? RLM_MODULE_OK:
 			    RLM_MODULE_NOTFOUND;
 		goto finish;
@@ -626,6 +1162,7 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 			set_ttl = true;
 			ttl = vp->vp_int32;
 		}
+		negative_ttl = ttl;	/* An explicit TTL applies to all entries */
 	}
 
 	RINDENT();
@@ -634,6 +1171,24 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 	RDEBUG3("expire : %s", expire ? "yes" : "no");
 	RDEBUG3("ttl    : %i", ttl);
 	REXDENT();
+
+	/*
+	 *	Retrieve the entry asynchronously if we're going to
+	 *	need it, and carry on when we have it.
+	 */
+	if (!found && inst->driver->find_async && (merge || (!expire && (insert || set_ttl)))) {
+		switch (cache_async_start(&async, inst, request, CACHE_ASYNC_FIND, key, key_len, NULL)) {
+		case 0:
+			goto yield;
+
+		case 1:
+			break;
+
+		default:
+			return RLM_MODULE_FAIL;
+		}
+	}
+
 	if (cache_acquire(&handle, inst, request) < 0) return RLM_MODULE_FAIL;
 
 	/*
@@ -641,7 +1196,7 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 	 *	recording whether the entry existed.
 	 */
 	if (merge) {
-		rcode = cache_find(&c, inst, request, &handle, key, key_len);
+		rcode = cache_find(&c, inst, request, &handle, key, key_len, found);
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 			goto finish;
@@ -652,6 +1207,13 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 			break;
 
 		case RLM_MODULE_NOTFOUND:
+			/*
+			 *	If we're not going to insert the entry
+			 *	now, the policy will populate it and call
+			 *	us again.  Make sure only one request does
+			 *	that at a time.
+			 */
+			if (!insert && !cache_lease_acquire(inst, request, key, key_len, waited)) goto wait;
 			rcode = RLM_MODULE_NOTFOUND;
 			exists = 0;
 			break;
@@ -672,6 +1234,21 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 	if (expire && ((exists == -1) || (exists == 1))) {
 		if (!insert) {
 			fr_assert(!set_ttl);
+
+			if (inst->driver->expire_async) switch (cache_async_start(&async, inst, request,
+										  CACHE_ASYNC_EXPIRE,
+										  key, key_len, NULL)) {
+			case 0:
+				goto yield;
+
+			case 1:
+				break;
+
+			default:
+				rcode = RLM_MODULE_FAIL;
+				goto finish;
+			}
+
 			switch (cache_expire(inst, request, &handle, key, key_len)) {
 			case RLM_MODULE_FAIL:
 				rcode = RLM_MODULE_FAIL;
@@ -701,7 +1278,7 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 	 *	determine that now.
 	 */
 	if ((exists < 0) && (insert || set_ttl)) {
-		switch (cache_find(&c, inst, request, &handle, key, key_len)) {
+		switch (cache_find(&c, inst, request, &handle, key, key_len, found)) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
@@ -729,6 +1306,21 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 
 		c->expires = fr_time_to_unix_time(request->packet->timestamp) + fr_unix_time_from_sec(ttl);
 
+		if (inst->driver->insert_async) switch (cache_async_start(&async, inst, request, CACHE_ASYNC_SET_TTL,
+									   key, key_len, c)) {
+		case 0:
+			async->c = c;
+			c = NULL;
+			goto yield;
+
+		case 1:
+			break;
+
+		default:
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+
 		switch (cache_set_ttl(inst, request, &handle, c)) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
@@ -751,11 +1343,14 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 	 *	insert.
 	 */
 	if (insert && (exists == 0)) {
-		switch (cache_insert(inst, request, &handle, key, key_len, ttl)) {
+		switch (cache_insert(&async, inst, request, &handle, key, key_len, ttl, negative_ttl)) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
 
+		case RLM_MODULE_YIELD:
+			goto yield;
+
 		case RLM_MODULE_OK:
 			if (rcode != RLM_MODULE_UPDATED) rcode = RLM_MODULE_OK;
 			break;
@@ -768,10 +1363,10 @@ static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *re
 			fr_assert(0);
 		}
 		fr_assert(!inst->driver->acquire || handle);
+		cache_lease_release(inst, request, key, key_len);
 		goto finish;
 	}
 
-
 finish:
 	cache_free(inst, &c);
 	cache_release(inst, request, &handle);
@@ -779,31 +1374,105 @@ finish:
 	/*
 	 *	Clear control attributes
 	 */
-	for (vp = fr_cursor_init(&cursor, &request->control);
-	     vp;
-	     vp = fr_cursor_next(&cursor)) {
-	     again:
-		if (!fr_dict_attr_is_top_level(vp->da)) continue;
+	cache_control_clear(request);
 
-		switch (vp->da->attr) {
-		case FR_CACHE_TTL:
-		case FR_CACHE_STATUS_ONLY:
-		case FR_CACHE_ALLOW_MERGE:
-		case FR_CACHE_ALLOW_INSERT:
-		case FR_CACHE_MERGE_NEW:
-			RDEBUG2("Removing &control:%s", vp->da->name);
-			vp = fr_cursor_remove(&cursor);
-			talloc_free(vp);
-			vp = fr_cursor_current(&cursor);
-			if (!vp) break;
-			goto again;
+	return rcode;
+
+	/*
+	 *	The driver is completing the operation asynchronously.
+	 *	We finish up when it's done.
+	 */
+yield:
+	cache_free(inst, &c);
+	cache_release(inst, request, &handle);
+
+	async->rcode = rcode;
+	async->waited = waited;
+
+	return unlang_module_yield(request, cache_async_resume, cache_async_signal, async);
+
+	/*
+	 *	Leave the control attributes alone, we'll
+	 *	need them when we look again.
+	 */
+wait:
+	cache_free(inst, &c);
+	cache_release(inst, request, &handle);
+
+	return cache_lease_wait(inst, request, key, key_len);
+}
+
+/** Do caching checks
+ *
+ * Since we can update ANY VP list, we do exactly the same thing for all sections
+ * (autz / auth / etc.)
+ *
+ * If you want to cache something different in different sections, configure
+ * another cache module.
+ */
+static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_cache_it(void *instance, UNUSED void *thread, REQUEST *request)
+{
+	return cache_it(instance, request, false, NULL);
+}
+
+/** Print one of the driver's statistics
+ *
+ * The format is "<name>" for the whole cache, or "<shard>.<name>"
+ * for one shard, where name is one of hits, misses, evictions,
+ * entries or memory.
+ */
+static ssize_t cache_stats_xlat(TALLOC_CTX *ctx, char **out, rlm_cache_t const *inst,
+				REQUEST *request, char const *fmt)
+{
+	rlm_cache_stats_t	stats;
+	int			shard = -1;
+	char const		*p = fmt;
+	char			*q;
+	uint64_t		value;
+
+	if (!inst->driver->stats) {
+		REDEBUG("Driver %s does not provide statistics", inst->driver->name);
+		return -1;
+	}
+
+	if (isdigit((uint8_t) *p)) {
+		shard = strtol(p, &q, 10);
+		if (*q != '.') {
+			REDEBUG("Invalid shard in \"%s\"", fmt);
+			return -1;
 		}
+		p = q + 1;
 	}
 
-	return rcode;
+	if (inst->driver->stats(&stats, &inst->config, inst->driver_inst->dl_inst->data, shard) < 0) {
+		REDEBUG("No such shard %i", shard);
+		return -1;
+	}
+
+	if (strcmp(p, "hits") == 0) {
+		value = stats.hits;
+	} else if (strcmp(p, "misses") == 0) {
+		value = stats.misses;
+	} else if (strcmp(p, "evictions") == 0) {
+		value = stats.evictions;
+	} else if (strcmp(p, "entries") == 0) {
+		value = stats.entries;
+	} else if (strcmp(p, "memory") == 0) {
+		value = stats.memory;
+	} else {
+		REDEBUG("Unknown statistic \"%s\"", p);
+		return -1;
+	}
+
+	*out = talloc_typed_asprintf(ctx, "%" PRIu64, value);
+	return talloc_array_length(*out) - 1;
 }
 
 /** Allow single attribute values to be retrieved from the cache
+ *
+ * "stats.<name>" retrieves the cache statistics instead, if the
+ * driver provides them.
  *
  * @ingroup xlat_functions
  */
@@ -828,6 +1497,8 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 	vp_tmpl_t		*target = NULL;
 	vp_map_t		*map = NULL;
 
+	if (strncmp(fmt, "stats.", 6) == 0) return cache_stats_xlat(ctx, out, inst, request, fmt + 6);
+
 	key_len = tmpl_expand((char const **)&key, (char *)buffer, sizeof(buffer),
 			      request, inst->config.key, NULL, NULL);
 	if (key_len < 0) return -1;
@@ -847,15 +1518,18 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 		return -1;
 	}
 
-	switch (cache_find(&c, mod_inst, request, &handle, key, key_len)) {
+	switch (cache_find(&c, mod_inst, request, &handle, key, key_len, NULL)) {
 	case RLM_MODULE_OK:		/* found */
 		break;
 
 	case RLM_MODULE_NOTFOUND:	/* not found */
+		talloc_free(target);
+		cache_release(mod_inst, request, &handle);
 		return 0;
 
 	default:
 		talloc_free(target);
+		cache_release(mod_inst, request, &handle);
 		return -1;
 	}
 
@@ -871,17 +1545,49 @@ static ssize_t cache_xlat(TALLOC_CTX *ctx, char **out, UNUSED size_t freespace,
 
 	talloc_free(target);
 
-	/*
-	 *	Check if we found a matching map
-	 */
-	if (!map) return 0;
-
 	cache_free(mod_inst, &c);
 	cache_release(mod_inst, request, &handle);
 
 	return ret;
 }
 
+static int cmd_show_module_cache(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	rlm_cache_t const	*inst = ctx;
+	void			*data = inst->driver_inst->dl_inst->data;
+	rlm_cache_stats_t	stats;
+	int			i, num;
+
+	num = inst->driver->stats(&stats, &inst->config, data, -1);
+
+	fprintf(fp, "shard\thits\tmisses\tevictions\tentries\tmemory\n");
+	for (i = 0; i < num; i++) {
+		if (inst->driver->stats(&stats, &inst->config, data, i) < 0) break;
+
+		fprintf(fp, "%i\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t\t%" PRIu64 "\t%" PRIu64 "\n",
+			i, stats.hits, stats.misses, stats.evictions, stats.entries, stats.memory);
+	}
+
+	(void) inst->driver->stats(&stats, &inst->config, data, -1);
+	fprintf(fp, "total\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t\t%" PRIu64 "\t%" PRIu64 "\n",
+		stats.hits, stats.misses, stats.evictions, stats.entries, stats.memory);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_table[] = {
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "cache",
+		.func = cmd_show_module_cache,
+		.help = "Show hit, miss and eviction statistics for the cache.",
+		.read_only = true,
+	},
+
+	CMD_TABLE_END
+};
+
 /** Free any memory allocated under the instance
  *
  */
@@ -889,6 +1595,8 @@ static int mod_detach(void *instance)
 {
 	rlm_cache_t *inst = instance;
 
+	if (inst->leases) pthread_mutex_destroy(&inst->leases->mutex);
+
 	/*
 	 *	We need to explicitly free all children, so if the driver
 	 *	parented any memory off the instance, their destructors
@@ -954,6 +1662,7 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	fr_assert(inst->driver->find);
 	fr_assert(inst->driver->insert);
 	fr_assert(inst->driver->expire);
+	fr_assert(!inst->driver->find_async || (inst->driver->insert_async && inst->driver->expire_async));
 
 	/*
 	 *	Register the cache xlat function
@@ -970,6 +1679,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_cache_t	*inst = instance;
 	CONF_SECTION	*update;
+	int		serialize;
 
 	inst->cs = conf;
 
@@ -985,6 +1695,23 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	serialize = fr_table_value_by_str(cache_serialize_table, inst->config.serialize_name, -1);
+	if (serialize < 0) {
+		cf_log_err(conf, "Invalid 'serialize' value \"%s\", expected 'binary' or 'text'",
+			   inst->config.serialize_name);
+		return -1;
+	}
+	inst->config.serialize = serialize;
+
+	if (inst->config.lease_timeout) {
+		FR_TIME_DELTA_BOUND_CHECK("lease_timeout", inst->config.lease_timeout, <=, fr_time_delta_from_sec(30));
+
+		MEM(inst->leases = talloc_zero(inst, rlm_cache_lease_table_t));
+		MEM(inst->leases->tree = rbtree_talloc_create(inst->leases, lease_cmp, rlm_cache_lease_t,
+							      NULL, RBTREE_FLAG_NONE));
+		pthread_mutex_init(&inst->leases->mutex, NULL);
+	}
+
 	update = cf_section_find(inst->cs, "update", CF_IDENT_ANY);
 	if (!update) {
 		cf_log_err(conf, "Must have an 'update' section in order to cache anything");
@@ -1011,6 +1738,11 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->driver->stats && (fr_command_register_hook(NULL, inst->config.name, inst, cmd_table) < 0)) {
+		PERROR("Failed registering radmin commands for cache %s", inst->config.name);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -42,6 +42,14 @@ typedef enum {
 	CACHE_MISS	= 1				//!< Cache entry notfound
 } cache_status_t;
 
+/** How drivers which store entries externally serialize them
+ *
+ */
+typedef enum {
+	CACHE_SERIALIZE_BINARY = 0,			//!< Attribute numbers, types and raw values.
+	CACHE_SERIALIZE_TEXT				//!< Humanly readable pairs.
+} cache_serialize_t;
+
 /** Configuration for the rlm_cache module
  *
  * This is separate from the #rlm_cache_t struct, to limit driver's visibility of
@@ -52,11 +60,18 @@ typedef struct {
 	char const		*driver_name;		//!< Driver name.
 	vp_tmpl_t		*key;			//!< What to expand to get the value of the key.
 	uint32_t		ttl;			//!< How long an entry is valid for.
+	uint32_t		negative_ttl;		//!< How long an entry with no attributes is valid for.
 	uint32_t		max_entries;		//!< Maximum entries allowed.
 	int32_t			epoch;			//!< Time after which entries are considered valid.
 	bool			stats;			//!< Generate statistics.
+	char const		*serialize_name;	//!< How entries are serialized.
+	cache_serialize_t	serialize;		//!< Parsed version of serialize_name.
+	fr_time_delta_t		lease_timeout;		//!< How long requests wait for another request
+							//!< to populate an entry.  0 disables leases.
 } rlm_cache_config_t;
 
+typedef struct rlm_cache_lease_table_s rlm_cache_lease_table_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -73,6 +88,8 @@ typedef struct {
 	vp_map_t		*maps;			//!< Attribute map applied to users.
 							//!< and profiles.
 	CONF_SECTION		*cs;
+
+	rlm_cache_lease_table_t	*leases;		//!< Keys which requests are populating.
 } rlm_cache_t;
 
 typedef struct {
@@ -85,6 +102,28 @@ typedef struct {
 	vp_map_t		*maps;			//!< Head of the maps list.
 } rlm_cache_entry_t;
 
+/** Statistics for a cache, or one shard of it
+ *
+ */
+typedef struct {
+	uint64_t		hits;			//!< Lookups which found an entry.
+	uint64_t		misses;			//!< Lookups which didn't.
+	uint64_t		evictions;		//!< Entries removed to make space for new ones.
+	uint64_t		entries;		//!< Currently in the cache.
+	uint64_t		memory;			//!< Used by the entries.
+} rlm_cache_stats_t;
+
+/** Result of an asynchronous driver operation
+ *
+ * The driver fills this in when the operation completes, then marks
+ * the request as resumable.
+ */
+typedef struct {
+	cache_status_t		status;			//!< Of the operation.
+	rlm_cache_entry_t	*c;			//!< Found by #cache_entry_find_async_t.
+	void			*uctx;			//!< For the driver to track the operation with.
+} rlm_cache_async_t;
+
 /** Allocate a new cache entry
  *
  */
@@ -263,6 +302,82 @@ typedef void		(*cache_release_t)(rlm_cache_config_t const *config, void *instanc
 typedef int		(*cache_reconnect_t)(rlm_cache_handle_t **handle, rlm_cache_config_t const *config,
 					     void *instance, REQUEST *request);
 
+/** Get statistics for the cache
+ *
+ * @note This callback is optional.  If it's provided, the statistics are available
+ *	via %{<inst>:stats.<name>} and "show module <inst> cache".
+ *
+ * @param[out] out Where to write the statistics.
+ * @param[in] config for this instance of the rlm_cache module.
+ * @param[in] instance Driver specific instance data.
+ * @param[in] shard to get the statistics for, or -1 for all shards.
+ * @return
+ *	- The number of shards in the cache.
+ *	- -1 if the shard doesn't exist.
+ */
+typedef int		(*cache_stats_t)(rlm_cache_stats_t *out, rlm_cache_config_t const *config,
+					 void *instance, int shard);
+
+/** Start retrieving an entry from the cache, without blocking
+ *
+ * When the entry has been retrieved, the driver sets out->status and
+ * out->c, as for #cache_entry_find_t, and marks the request as resumable.
+ *
+ * @note This callback is optional.  If it's provided, #cache_entry_insert_async_t
+ *	and #cache_entry_expire_async_t must be provided too.
+ *
+ * @param[out] out Where to write the result.
+ * @param[in] config for this instance of the rlm_cache module.
+ * @param[in] instance Driver specific instance data.
+ * @param[in] thread Driver specific thread data.
+ * @param[in] request The current request.
+ * @param[in] key to use to identify the cache entry.
+ * @param[in] key_len Length of key data.
+ * @return
+ *	- 1 if this instance of the driver can't perform the operation asynchronously.
+ *	  The synchronous callback is used instead.
+ *	- 0 if the operation was started.
+ *	- -1 on failure.
+ */
+typedef int		(*cache_entry_find_async_t)(rlm_cache_async_t *out,
+						    rlm_cache_config_t const *config, void *instance, void *thread,
+						    REQUEST *request, uint8_t const *key, size_t key_len);
+
+/** Start inserting an entry into the cache, without blocking
+ *
+ * When the entry has been inserted, the driver sets out->status, as for
+ * #cache_entry_insert_t, and marks the request as resumable.  c remains
+ * valid until then.
+ *
+ * @return as for #cache_entry_find_async_t.
+ */
+typedef int		(*cache_entry_insert_async_t)(rlm_cache_async_t *out,
+						      rlm_cache_config_t const *config, void *instance, void *thread,
+						      REQUEST *request, rlm_cache_entry_t const *c);
+
+/** Start removing an entry from the cache, without blocking
+ *
+ * When the entry has been removed, the driver sets out->status, as for
+ * #cache_entry_expire_t, and marks the request as resumable.
+ *
+ * @return as for #cache_entry_find_async_t.
+ */
+typedef int		(*cache_entry_expire_async_t)(rlm_cache_async_t *out,
+						      rlm_cache_config_t const *config, void *instance, void *thread,
+						      REQUEST *request, uint8_t const *key, size_t key_len);
+
+/** Stop an asynchronous operation, because the request is being cancelled
+ *
+ * The driver must not mark the request as resumable after this is called.
+ *
+ * @param[in] instance Driver specific instance data.
+ * @param[in] thread Driver specific thread data.
+ * @param[in] request The current request.
+ * @param[in] async The operation to cancel.
+ */
+typedef void		(*cache_async_cancel_t)(void *instance, void *thread, REQUEST *request,
+						rlm_cache_async_t *async);
+
 struct rlm_cache_driver_s {
 	DL_MODULE_COMMON;					//!< Common fields for all loadable modules.
 	FR_MODULE_COMMON;					//!< Common fields for all instantiated modules.
@@ -283,4 +398,12 @@ struct rlm_cache_driver_s {
 	cache_release_t			release;		//!< (optional) Release access to resource acquired
 								//!< with acquire callback.
 	cache_reconnect_t		reconnect;		//!< (optional) Re-initialise resource.
+
+	cache_stats_t			stats;			//!< (optional) Get hit, miss and eviction statistics.
+
+	cache_entry_find_async_t	find_async;		//!< (optional) Retrieve an entry without blocking.
+	cache_entry_insert_async_t	insert_async;		//!< (optional) Add an entry without blocking.
+	cache_entry_expire_async_t	expire_async;		//!< (optional) Remove an entry without blocking.
+	cache_async_cancel_t		cancel_async;		//!< (optional) Stop an operation started by the
+								//!< callbacks above.
 };
@@ -19,6 +19,25 @@
  * @file serialize.c
  * @brief Serialize and deserialise cache entries.
  *
+ * Entries can be serialized in two formats.  The text format is humanly readable,
+ * but must be parsed on every hit.  The binary format records attribute numbers,
+ * types and raw values, so it can be converted back into maps without parsing.
+ *
+ * The binary format (all integers are big endian) is:
+ *
+ @verbatim
+   0x00 'F' 'C' <version>
+   <created (uint64 ns)> <expires (uint64 ns)>
+   Followed by zero or more maps:
+     <request ref (uint8)> <list (uint8)> <tag (uint8)> <op (uint8)>
+     <dict name len (uint8)> <dict name> (len 0 means the same as the last map)
+     <depth (uint8)> <attribute number (uint32)>{depth}
+     <type (uint8)> <value len (uint32)> <value>
+ @endverbatim
+ *
+ * Text entries always start with a printable character, so the leading 0x00
+ * distinguishes the two formats.
+ *
  * @author Arran Cudbard-Bell
  * @copyright 2014 Arran Cudbard-Bell (a.cudbardb@freeradius.org)
  * @copyright 2014 The FreeRADIUS server project
@@ -28,6 +47,13 @@ RCSID("$Id$")
 #include "rlm_cache.h"
 #include "serialize.h"
 
+#include <freeradius-devel/util/net.h>
+
+#define CACHE_BINARY_VERSION	1
+#define CACHE_BINARY_HDR_LEN	(4 + 8 + 8)
+
+static uint8_t const cache_binary_magic[] = { 0x00, 'F', 'C', CACHE_BINARY_VERSION };
+
 /** Serialize a cache entry as a humanly readable string
  *
  * @param ctx to alloc new string in. Should be a talloc pool a little bigger
@@ -89,7 +115,373 @@ finish:
 	return 0;
 }
 
+/** Make room for more data in a binary serialized entry
+ *
+ * @param[in,out] buff	talloc array to extend.
+ * @param[in] used	How much of the buffer has been written to.
+ * @param[in] need	How many more bytes are required.
+ * @return a pointer to the first free byte, or NULL on error.
+ */
+static uint8_t *cache_binary_reserve(uint8_t **buff, size_t used, size_t need)
+{
+	size_t	len = talloc_array_length(*buff);
+	uint8_t	*new;
+
+	if ((used + need) <= len) return *buff + used;
+
+	while (len < (used + need)) len *= 2;
+
+	new = talloc_realloc(NULL, *buff, uint8_t, len);
+	if (!new) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+	*buff = new;
+
+	return new + used;
+}
+
+/** Serialize a cache entry in a compact binary format
+ *
+ * @param[in] ctx	to alloc new buffer in.
+ * @param[out] out	Where to write pointer to serialized cache entry.
+ * @param[out] outlen	Length of the serialized entry.
+ * @param[in] c		Cache entry to serialize.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, size_t *outlen, rlm_cache_entry_t const *c)
+{
+	uint8_t		*buff, *p;
+	size_t		used;
+	vp_map_t	*map;
+	fr_dict_t const	*last_dict = NULL;
+
+	MEM(buff = talloc_array(ctx, uint8_t, 256));
+
+	memcpy(buff, cache_binary_magic, sizeof(cache_binary_magic));
+	fr_net_from_uint64(buff + 4, (uint64_t)c->created);
+	fr_net_from_uint64(buff + 12, (uint64_t)c->expires);
+	used = CACHE_BINARY_HDR_LEN;
+
+	for (map = c->maps; map; map = map->next) {
+		fr_dict_attr_t const	*da = map->lhs->tmpl_da;
+		fr_dict_attr_t const	*parent;
+		fr_dict_t const		*dict;
+		fr_value_box_t const	*value = &map->rhs->tmpl_value;
+		fr_type_t		type = value->type;
+		char			*str = NULL;
+		uint8_t			fixed[32];
+		uint8_t const		*data;
+		size_t			data_len, name_len = 0;
+		unsigned int		i;
+
+		if (da->flags.is_unknown || da->flags.is_raw || (da->depth > UINT8_MAX)) {
+			fr_strerror_printf("Can't serialize attribute %s", da->name);
+		error:
+			talloc_free(buff);
+			return -1;
+		}
+
+		dict = fr_dict_by_da(da);
+		if (dict != last_dict) {
+			name_len = strlen(fr_dict_root(dict)->name);
+			if ((name_len == 0) || (name_len > UINT8_MAX)) {
+				fr_strerror_printf("Can't serialize attribute %s", da->name);
+				goto error;
+			}
+			last_dict = dict;
+		}
+
+		/*
+		 *	Dates and deltas are written with their full
+		 *	resolution, strings and octets as they are, and
+		 *	everything else in its network format.  Types
+		 *	with no network format are written as strings.
+		 */
+		switch (type) {
+		case FR_TYPE_DATE:
+			fr_net_from_uint64(fixed, (uint64_t)value->vb_date);
+			data = fixed;
+			data_len = 8;
+			break;
+
+		case FR_TYPE_TIME_DELTA:
+			fr_net_from_uint64(fixed, (uint64_t)value->vb_time_delta);
+			data = fixed;
+			data_len = 8;
+			break;
+
+		case FR_TYPE_STRING:
+			data = (uint8_t const *)value->vb_strvalue;
+			data_len = value->datum.length;
+			break;
+
+		case FR_TYPE_OCTETS:
+			data = value->vb_octets;
+			data_len = value->datum.length;
+			break;
+
+		default:
+		{
+			ssize_t slen;
+
+			slen = fr_value_box_to_network(NULL, fixed, sizeof(fixed), value);
+			if (slen > 0) {
+				data = fixed;
+				data_len = slen;
+				break;
+			}
+
+			str = fr_value_box_asprint(buff, value, '\0');
+			if (!str) goto error;
+			type = FR_TYPE_STRING;
+			data = (uint8_t const *)str;
+			data_len = talloc_array_length(str) - 1;
+		}
+			break;
+		}
+
+		p = cache_binary_reserve(&buff, used, 5 + 1 + name_len + 1 + (da->depth * 4) + 1 + 4 + data_len);
+		if (!p) goto error;
+
+		*p++ = map->lhs->tmpl_request;
+		*p++ = map->lhs->tmpl_list;
+		*p++ = (uint8_t)map->lhs->tmpl_tag;
+		*p++ = map->op;
+
+		*p++ = name_len;
+		if (name_len) {
+			memcpy(p, fr_dict_root(dict)->name, name_len);
+			p += name_len;
+		}
+
+		*p++ = da->depth;
+		for (parent = da, i = da->depth; i > 0; parent = parent->parent, i--) {
+			fr_net_from_uint32(p + ((i - 1) * 4), parent->attr);
+		}
+		p += da->depth * 4;
+
+		*p++ = type;
+		fr_net_from_uint32(p, data_len);
+		p += 4;
+		if (data_len) memcpy(p, data, data_len);
+		p += data_len;
+
+		used = p - buff;
+		talloc_free(str);
+	}
+
+	*out = buff;
+	*outlen = used;
+
+	return 0;
+}
+
+/** Serialize a cache entry in the format selected by the user
+ *
+ * @param[in] ctx	to alloc new buffer in.
+ * @param[out] out	Where to write pointer to serialized cache entry.
+ * @param[out] outlen	Length of the serialized entry.
+ * @param[in] c		Cache entry to serialize.
+ * @param[in] format	to serialize the entry in.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_serialize_by_format(TALLOC_CTX *ctx, uint8_t **out, size_t *outlen,
+			      rlm_cache_entry_t const *c, cache_serialize_t format)
+{
+	char	*str = NULL;
+
+	if (format == CACHE_SERIALIZE_BINARY) return cache_serialize_binary(ctx, out, outlen, c);
+
+	if (cache_serialize(ctx, &str, c) < 0) return -1;
+
+	*out = (uint8_t *)str;
+	*outlen = str ? talloc_array_length(str) - 1 : 0;
+
+	return 0;
+}
+
+/** Check whether a serialized entry is in the binary format
+ *
+ * @param[in] in	Serialized entry.
+ * @param[in] inlen	Length of the serialized entry.
+ * @return true if the entry was serialized with #cache_serialize_binary.
+ */
+bool cache_serialized_is_binary(uint8_t const *in, size_t inlen)
+{
+	return (inlen >= CACHE_BINARY_HDR_LEN) && (in[0] == cache_binary_magic[0]) &&
+	       (in[1] == cache_binary_magic[1]) && (in[2] == cache_binary_magic[2]);
+}
+
+/** Converts a binary serialized cache entry back into a structure
+ *
+ * @param[in] c		Cache entry to populate (should already be allocated)
+ * @param[in] in	Entry serialized with #cache_serialize_binary.
+ * @param[in] inlen	Length of the serialized entry.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen)
+{
+	uint8_t const	*p = in, *end = in + inlen;
+	vp_map_t	**last = &c->maps;
+	fr_dict_t const	*dict = NULL;
+
+	if (!cache_serialized_is_binary(in, inlen)) {
+		fr_strerror_printf("Entry is not in binary format");
+		return -1;
+	}
+
+	if (in[3] != CACHE_BINARY_VERSION) {
+		fr_strerror_printf("Unsupported binary entry version %u", in[3]);
+		return -1;
+	}
+
+	c->created = (fr_unix_time_t)fr_net_to_uint64(in + 4);
+	c->expires = (fr_unix_time_t)fr_net_to_uint64(in + 12);
+	p += CACHE_BINARY_HDR_LEN;
+
+#define CHECK_SPACE(_len) if ((size_t)(end - p) < (size_t)(_len)) goto truncated
+
+	while (p < end) {
+		vp_map_t		*map;
+		fr_dict_attr_t const	*da;
+		fr_type_t		type;
+		request_ref_t		request_ref;
+		pair_list_t		list;
+		int8_t			tag;
+		FR_TOKEN		op;
+		size_t			name_len, data_len;
+		unsigned int		depth, i;
+
+		CHECK_SPACE(5);
+		request_ref = p[0];
+		list = p[1];
+		tag = (int8_t)p[2];
+		op = p[3];
+		name_len = p[4];
+		p += 5;
+
+		if (name_len) {
+			char name[UINT8_MAX + 1];
+
+			CHECK_SPACE(name_len);
+			memcpy(name, p, name_len);
+			name[name_len] = '\0';
+			p += name_len;
+
+			dict = fr_dict_by_protocol_name(name);
+			if (!dict) {
+				fr_strerror_printf("Unknown dictionary \"%s\"", name);
+				return -1;
+			}
+		}
+
+		if (!dict) {
+			fr_strerror_printf("Missing dictionary");
+			return -1;
+		}
+
+		CHECK_SPACE(1);
+		depth = *p++;
+		CHECK_SPACE(depth * 4);
+
+		da = fr_dict_root(dict);
+		for (i = 0; i < depth; i++, p += 4) {
+			unsigned int attr = fr_net_to_uint32(p);
+
+			da = fr_dict_attr_child_by_num(da, attr);
+			if (!da) {
+				fr_strerror_printf("Unknown attribute %u.  Check local dictionaries", attr);
+				return -1;
+			}
+		}
+
+		CHECK_SPACE(5);
+		type = p[0];
+		data_len = fr_net_to_uint32(p + 1);
+		p += 5;
+		CHECK_SPACE(data_len);
+
+		MEM(map = talloc_zero(c, vp_map_t));
+		map->op = op;
+		MEM(map->lhs = talloc_zero(map, vp_tmpl_t));
+		tmpl_from_da(map->lhs, da, tag, NUM_ANY, request_ref, list);
+
+		MEM(map->rhs = talloc_zero(map, vp_tmpl_t));
+		tmpl_init(map->rhs, TMPL_TYPE_DATA, "<binary>", 8, T_BARE_WORD);
+
+		if (type != da->type) {
+			fr_type_t cast = da->type;
+
+			/*
+			 *	Values with no network format were
+			 *	written as strings.
+			 */
+			if (type != FR_TYPE_STRING) {
+				fr_strerror_printf("Value of %s has type %s, expected %s.  Check local dictionaries",
+						   da->name, fr_table_str_by_value(fr_value_box_type_table, type, "<INVALID>"),
+						   fr_table_str_by_value(fr_value_box_type_table, da->type, "<INVALID>"));
+			error:
+				talloc_free(map);
+				return -1;
+			}
+
+			if (fr_value_box_from_str(map->rhs, &map->rhs->tmpl_value, &cast, da,
+						  (char const *)p, data_len, '\0', false) < 0) goto error;
+
+		} else switch (type) {
+		case FR_TYPE_DATE:
+			if (data_len != 8) goto bad_length;
+			fr_value_box_init(&map->rhs->tmpl_value, type, da, false);
+			map->rhs->tmpl_value.vb_date = (fr_unix_time_t)fr_net_to_uint64(p);
+			break;
+
+		case FR_TYPE_TIME_DELTA:
+			if (data_len != 8) {
+			bad_length:
+				fr_strerror_printf("Invalid value length %zu for %s", data_len, da->name);
+				goto error;
+			}
+			fr_value_box_init(&map->rhs->tmpl_value, type, da, false);
+			map->rhs->tmpl_value.vb_time_delta = (fr_time_delta_t)fr_net_to_uint64(p);
+			break;
+
+		case FR_TYPE_STRING:
+			if (fr_value_box_bstrndup(map->rhs, &map->rhs->tmpl_value, da,
+						  (char const *)p, data_len, false) < 0) goto error;
+			break;
+
+		case FR_TYPE_OCTETS:
+			if (fr_value_box_memcpy(map->rhs, &map->rhs->tmpl_value, da, p, data_len, false) < 0) goto error;
+			break;
+
+		default:
+			if (fr_value_box_from_network(map->rhs, &map->rhs->tmpl_value, type, da,
+						      p, data_len, false) != (ssize_t)data_len) goto bad_length;
+			break;
+		}
+		p += data_len;
+
+		*last = map;
+		last = &(*last)->next;
+	}
+
+	return 0;
+
+truncated:
+	fr_strerror_printf("Binary entry truncated");
+	return -1;
+}
+
 /** Converts a serialized cache entry back into a structure
+ *
+ * Entries in either format are accepted.
  *
  * @param[in] c		Cache entry to populate (should already be allocated)
  * @param[in] dict	to use for unqualified attributes.
@@ -107,6 +499,10 @@ int cache_deserialize(rlm_cache_entry_t *c, fr_dict_t const *dict, char *in, ssi
 
 	if (inlen < 0) inlen = strlen(in);
 
+	if (cache_serialized_is_binary((uint8_t const *)in, inlen)) {
+		return cache_deserialize_binary(c, (uint8_t const *)in, inlen);
+	}
+
 	p = in;
 
 	while (((size_t)(p - in)) < (size_t)inlen) {
@@ -27,4 +27,9 @@
 RCSIDH(serialize_h, "$Id$")
 
 int cache_serialize(TALLOC_CTX *ctx, char **out, rlm_cache_entry_t const *c);
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, size_t *outlen, rlm_cache_entry_t const *c);
+int cache_serialize_by_format(TALLOC_CTX *ctx, uint8_t **out, size_t *outlen,
+			      rlm_cache_entry_t const *c, cache_serialize_t format);
+bool cache_serialized_is_binary(uint8_t const *in, size_t inlen);
 int cache_deserialize(rlm_cache_entry_t *c, fr_dict_t const *dict, char *in, ssize_t inlen);
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen);
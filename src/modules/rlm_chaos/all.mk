@@ -0,0 +1,3 @@
+SOURCES		:= rlm_chaos.c
+TARGET		:= rlm_chaos.a
+TGT_LDLIBS	:= -lm
@@ -0,0 +1,521 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_chaos.c
+ * @brief Emulate a slow, unreliable backend for benchmarking and failure testing.
+ *
+ * Each call yields the request for a latency drawn from a configurable
+ * distribution, as a request to a real backend would.  Calls can also be
+ * made to time out, fail with a connection error, or queue behind a
+ * throughput cap.
+ *
+ * The latency and failure settings can be changed at runtime with
+ * "set module <name> chaos <setting> <value>".
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/time.h>
+
+#include <math.h>
+
+typedef enum {
+	CHAOS_LATENCY_INVALID = 0,
+	CHAOS_LATENCY_FIXED,				//!< Always mean.
+	CHAOS_LATENCY_NORMAL,				//!< Normally distributed around mean.
+	CHAOS_LATENCY_LONG_TAIL,			//!< Pareto distribution with the given mean.
+	CHAOS_LATENCY_BIMODAL				//!< Normally distributed around mean, or slow_mean.
+} chaos_latency_t;
+
+static fr_table_num_sorted_t const chaos_latency_table[] = {
+	{ "bimodal",	CHAOS_LATENCY_BIMODAL	},
+	{ "fixed",	CHAOS_LATENCY_FIXED	},
+	{ "long_tail",	CHAOS_LATENCY_LONG_TAIL	},
+	{ "normal",	CHAOS_LATENCY_NORMAL	}
+};
+static size_t chaos_latency_table_len = NUM_ELEMENTS(chaos_latency_table);
+
+/** Settings which can be changed at runtime
+ *
+ */
+typedef struct {
+	chaos_latency_t		distribution;		//!< How latency is distributed.
+	fr_time_delta_t		mean;			//!< Mean latency.
+	fr_time_delta_t		stddev;			//!< Standard deviation for normal and bimodal latency.
+	double			shape;			//!< Shape of the long tail.  Lower is longer.
+	fr_time_delta_t		slow_mean;		//!< Mean of the slow mode, for bimodal latency.
+	double			slow_percent;		//!< Percentage of calls taking the slow mode.
+
+	double			timeout_percent;	//!< Percentage of calls which time out.
+	double			error_percent;		//!< Percentage of calls which fail immediately.
+	uint32_t		max_rate;		//!< Calls per second, per thread.  0 is unlimited.
+} rlm_chaos_settings_t;
+
+typedef struct {
+	char const		*name;			//!< Instance name, used for radmin commands.
+
+	char const		*distribution_str;	//!< Latency distribution name, from the config.
+	rlm_chaos_settings_t	config;			//!< Settings as parsed from the config.
+
+	fr_time_delta_t		timeout;		//!< How long a timed out call takes.
+	char const		*rcode_str;		//!< What to return from calls which succeed.
+	rlm_rcode_t		rcode;
+
+	pthread_mutex_t		mutex;			//!< Protects settings.
+	rlm_chaos_settings_t	settings;		//!< Live settings.  Changed by radmin.
+} rlm_chaos_t;
+
+typedef struct {
+	fr_time_t		next_slot;		//!< When the throughput cap next admits a call.
+} rlm_chaos_thread_t;
+
+/** Tracks a call whilst the request is yielded
+ *
+ */
+typedef struct {
+	fr_time_t		yielded;		//!< When the call started.
+	bool			timed_out;		//!< Whether the call should fail as a timeout.
+} rlm_chaos_rctx_t;
+
+static const CONF_PARSER latency_config[] = {
+	{ FR_CONF_OFFSET("distribution", FR_TYPE_STRING, rlm_chaos_t, distribution_str), .dflt = "fixed" },
+	{ FR_CONF_OFFSET("mean", FR_TYPE_TIME_DELTA, rlm_chaos_t, config.mean), .dflt = "0" },
+	{ FR_CONF_OFFSET("stddev", FR_TYPE_TIME_DELTA, rlm_chaos_t, config.stddev), .dflt = "0" },
+	{ FR_CONF_OFFSET("shape", FR_TYPE_FLOAT64, rlm_chaos_t, config.shape), .dflt = "1.5" },
+	{ FR_CONF_OFFSET("slow_mean", FR_TYPE_TIME_DELTA, rlm_chaos_t, config.slow_mean), .dflt = "0" },
+	{ FR_CONF_OFFSET("slow_percent", FR_TYPE_FLOAT64, rlm_chaos_t, config.slow_percent), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_POINTER("latency", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) latency_config },
+
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, rlm_chaos_t, timeout), .dflt = "30" },
+	{ FR_CONF_OFFSET("timeout_percent", FR_TYPE_FLOAT64, rlm_chaos_t, config.timeout_percent), .dflt = "0" },
+	{ FR_CONF_OFFSET("error_percent", FR_TYPE_FLOAT64, rlm_chaos_t, config.error_percent), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_rate", FR_TYPE_UINT32, rlm_chaos_t, config.max_rate), .dflt = "0" },
+	{ FR_CONF_OFFSET("rcode", FR_TYPE_STRING, rlm_chaos_t, rcode_str), .dflt = "ok" },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Check settings are consistent
+ *
+ * @return
+ *	- 0 if the settings are valid.
+ *	- -1 if they're not, with the error available via fr_strerror().
+ */
+static int chaos_settings_verify(rlm_chaos_settings_t const *settings)
+{
+	if (settings->distribution == CHAOS_LATENCY_INVALID) {
+		fr_strerror_printf("Invalid latency distribution");
+		return -1;
+	}
+
+	if ((settings->mean < 0) || (settings->stddev < 0) || (settings->slow_mean < 0)) {
+		fr_strerror_printf("Latencies must not be negative");
+		return -1;
+	}
+
+	if (settings->shape <= 1) {
+		fr_strerror_printf("Invalid value for 'shape'.  It must be greater than 1");
+		return -1;
+	}
+
+	if ((settings->slow_percent < 0) || (settings->slow_percent > 100) ||
+	    (settings->timeout_percent < 0) || (settings->timeout_percent > 100) ||
+	    (settings->error_percent < 0) || (settings->error_percent > 100)) {
+		fr_strerror_printf("Invalid percentage.  It must be 0..100 inclusive");
+		return -1;
+	}
+
+	if ((settings->timeout_percent + settings->error_percent) > 100) {
+		fr_strerror_printf("'timeout_percent' and 'error_percent' must not add up to more than 100");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Return a random number in the range (0, 1)
+ *
+ */
+static inline double chaos_rand(void)
+{
+	return ((double) fr_rand() + 0.5) / 4294967296.0;
+}
+
+/** Return a normally distributed value, using the Box-Muller transform
+ *
+ */
+static double chaos_rand_normal(double mean, double stddev)
+{
+	if (stddev == 0) return mean;
+
+	return mean + (stddev * sqrt(-2.0 * log(chaos_rand())) * cos(2.0 * M_PI * chaos_rand()));
+}
+
+/** Pick a latency for a call
+ *
+ */
+static fr_time_delta_t chaos_latency(rlm_chaos_settings_t const *settings)
+{
+	double	latency;
+
+	switch (settings->distribution) {
+	case CHAOS_LATENCY_FIXED:
+	default:
+		return settings->mean;
+
+	case CHAOS_LATENCY_NORMAL:
+		latency = chaos_rand_normal(settings->mean, settings->stddev);
+		break;
+
+	/*
+	 *	Pareto, with the minimum chosen so that the
+	 *	mean of the distribution is settings->mean.
+	 */
+	case CHAOS_LATENCY_LONG_TAIL:
+		latency = ((settings->mean * (settings->shape - 1)) / settings->shape) /
+			  pow(chaos_rand(), 1.0 / settings->shape);
+		break;
+
+	case CHAOS_LATENCY_BIMODAL:
+		if ((chaos_rand() * 100) < settings->slow_percent) {
+			latency = chaos_rand_normal(settings->slow_mean, settings->stddev);
+		} else {
+			latency = chaos_rand_normal(settings->mean, settings->stddev);
+		}
+		break;
+	}
+
+	if (latency <= 0) return 0;
+
+	/*
+	 *	Long tails can produce very large values,
+	 *	callers clamp them to the timeout.
+	 */
+	if (latency >= (double) INT64_MAX) return INT64_MAX;
+
+	return (fr_time_delta_t) latency;
+}
+
+static void _chaos_done(UNUSED void *instance, UNUSED void *thread, REQUEST *request,
+			UNUSED void *rctx, UNUSED fr_time_t fired)
+{
+	unlang_interpret_resumable(request);
+}
+
+static rlm_rcode_t mod_chaos_resume(void *instance, UNUSED void *thread, REQUEST *request, void *rctx)
+{
+	rlm_chaos_t const	*inst = talloc_get_type_abort_const(instance, rlm_chaos_t);
+	rlm_chaos_rctx_t	*cctx = talloc_get_type_abort(rctx, rlm_chaos_rctx_t);
+	bool			timed_out = cctx->timed_out;
+
+	RDEBUG3("Call took %pVs", fr_box_time_delta(fr_time() - cctx->yielded));
+	talloc_free(cctx);
+
+	if (timed_out) {
+		REDEBUG("Injected timeout");
+		return RLM_MODULE_FAIL;
+	}
+
+	return inst->rcode;
+}
+
+static void mod_chaos_signal(UNUSED void *instance, UNUSED void *thread, REQUEST *request, void *rctx,
+			     fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	RDEBUG2("Cancelling call");
+
+	(void) unlang_module_timeout_delete(request, rctx);
+	talloc_free(rctx);
+}
+
+static rlm_rcode_t CC_HINT(nonnull) mod_chaos(void *instance, void *thread, REQUEST *request)
+{
+	rlm_chaos_t		*inst = talloc_get_type_abort(instance, rlm_chaos_t);
+	rlm_chaos_thread_t	*t = thread;
+	rlm_chaos_settings_t	settings;
+	rlm_chaos_rctx_t	*cctx;
+	fr_time_t		now;
+	fr_time_delta_t		delay;
+	double			roll;
+	bool			timed_out = false;
+
+	pthread_mutex_lock(&inst->mutex);
+	settings = inst->settings;
+	pthread_mutex_unlock(&inst->mutex);
+
+	roll = chaos_rand() * 100;
+	if (roll < settings.error_percent) {
+		REDEBUG("Injected connection error");
+		return RLM_MODULE_FAIL;
+	}
+
+	if (roll < (settings.error_percent + settings.timeout_percent)) {
+		delay = inst->timeout;
+		timed_out = true;
+	} else {
+		delay = chaos_latency(&settings);
+	}
+
+	now = fr_time();
+
+	/*
+	 *	Calls over the throughput cap queue behind
+	 *	the ones admitted before them, as they would
+	 *	for a saturated backend.
+	 */
+	if (settings.max_rate) {
+		fr_time_t slot;
+
+		slot = (t->next_slot > now) ? t->next_slot : now;
+		t->next_slot = slot + (NSEC / settings.max_rate);
+
+		if ((INT64_MAX - delay) < (slot - now)) {
+			delay = INT64_MAX;
+		} else {
+			delay += slot - now;
+		}
+	}
+
+	/*
+	 *	Calls which take too long time out, the
+	 *	same as if the backend hadn't responded.
+	 */
+	if (delay >= inst->timeout) {
+		delay = inst->timeout;
+		timed_out = true;
+	}
+
+	if (delay == 0) return inst->rcode;
+
+	RDEBUG2("Delaying call by %pVs%s", fr_box_time_delta(delay), timed_out ? " then timing out" : "");
+
+	MEM(cctx = talloc(request, rlm_chaos_rctx_t));
+	cctx->yielded = now;
+	cctx->timed_out = timed_out;
+
+	if (unlang_module_timeout_add(request, _chaos_done, cctx, now + delay) < 0) {
+		RPEDEBUG("Adding event failed");
+		talloc_free(cctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_chaos_resume, mod_chaos_signal, cctx);
+}
+
+static int cmd_show_module_chaos(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	rlm_chaos_t		*inst = talloc_get_type_abort(ctx, rlm_chaos_t);
+	rlm_chaos_settings_t	settings;
+
+	pthread_mutex_lock(&inst->mutex);
+	settings = inst->settings;
+	pthread_mutex_unlock(&inst->mutex);
+
+	fprintf(fp, "distribution\t%s\n",
+		fr_table_str_by_value(chaos_latency_table, settings.distribution, "<invalid>"));
+	fprintf(fp, "mean\t\t%.6f s\n", (double) settings.mean / NSEC);
+	fprintf(fp, "stddev\t\t%.6f s\n", (double) settings.stddev / NSEC);
+	fprintf(fp, "shape\t\t%g\n", settings.shape);
+	fprintf(fp, "slow_mean\t%.6f s\n", (double) settings.slow_mean / NSEC);
+	fprintf(fp, "slow_percent\t%g\n", settings.slow_percent);
+	fprintf(fp, "timeout_percent\t%g\n", settings.timeout_percent);
+	fprintf(fp, "error_percent\t%g\n", settings.error_percent);
+	fprintf(fp, "max_rate\t%u\n", settings.max_rate);
+
+	return 0;
+}
+
+static int cmd_set_module_chaos(UNUSED FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
+{
+	rlm_chaos_t		*inst = talloc_get_type_abort(ctx, rlm_chaos_t);
+	rlm_chaos_settings_t	settings;
+	char const		*name = info->argv[0];
+	char const		*value = info->argv[1];
+	char			*end;
+
+	pthread_mutex_lock(&inst->mutex);
+	settings = inst->settings;
+	pthread_mutex_unlock(&inst->mutex);
+
+	if (strcmp(name, "distribution") == 0) {
+		settings.distribution = fr_table_value_by_str(chaos_latency_table, value, CHAOS_LATENCY_INVALID);
+
+	} else if ((strcmp(name, "mean") == 0) || (strcmp(name, "stddev") == 0) || (strcmp(name, "slow_mean") == 0)) {
+		fr_time_delta_t delta;
+
+		if (fr_time_delta_from_str(&delta, value, FR_TIME_RES_SEC) < 0) {
+			fprintf(fp_err, "Invalid time '%s' - %s\n", value, fr_strerror());
+			return -1;
+		}
+
+		if (strcmp(name, "mean") == 0) {
+			settings.mean = delta;
+		} else if (strcmp(name, "stddev") == 0) {
+			settings.stddev = delta;
+		} else {
+			settings.slow_mean = delta;
+		}
+
+	} else if (strcmp(name, "max_rate") == 0) {
+		unsigned long rate;
+
+		rate = strtoul(value, &end, 10);
+		if (*end || (rate > UINT32_MAX)) {
+			fprintf(fp_err, "Invalid rate '%s'\n", value);
+			return -1;
+		}
+		settings.max_rate = rate;
+
+	} else {
+		double number;
+
+		number = strtod(value, &end);
+		if (*end) {
+			fprintf(fp_err, "Invalid number '%s'\n", value);
+			return -1;
+		}
+
+		if (strcmp(name, "shape") == 0) {
+			settings.shape = number;
+		} else if (strcmp(name, "slow_percent") == 0) {
+			settings.slow_percent = number;
+		} else if (strcmp(name, "timeout_percent") == 0) {
+			settings.timeout_percent = number;
+		} else if (strcmp(name, "error_percent") == 0) {
+			settings.error_percent = number;
+		} else {
+			fprintf(fp_err, "Unknown setting '%s'\n", name);
+			return -1;
+		}
+	}
+
+	if (chaos_settings_verify(&settings) < 0) {
+		fprintf(fp_err, "%s\n", fr_strerror());
+		return -1;
+	}
+
+	pthread_mutex_lock(&inst->mutex);
+	inst->settings = settings;
+	pthread_mutex_unlock(&inst->mutex);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_table[] = {
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "chaos",
+		.func = cmd_show_module_chaos,
+		.help = "Show the current latency and failure settings.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "set module",
+		.add_name = true,
+		.name = "chaos",
+		.syntax = "(distribution|mean|stddev|shape|slow_mean|slow_percent|timeout_percent|error_percent|max_rate) STRING",
+		.func = cmd_set_module_chaos,
+		.help = "Change a latency or failure setting.  Takes effect for the next call.",
+		.read_only = false,
+	},
+
+	CMD_TABLE_END
+};
+
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_chaos_t	*inst = talloc_get_type_abort(instance, rlm_chaos_t);
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	inst->rcode = fr_table_value_by_str(rcode_table, inst->rcode_str, RLM_MODULE_UNKNOWN);
+	if (inst->rcode == RLM_MODULE_UNKNOWN) {
+		cf_log_err(conf, "Unknown module return code '%s'", inst->rcode_str);
+		return -1;
+	}
+
+	inst->config.distribution = fr_table_value_by_str(chaos_latency_table, inst->distribution_str,
+							  CHAOS_LATENCY_INVALID);
+	if (inst->config.distribution == CHAOS_LATENCY_INVALID) {
+		cf_log_err(conf, "Invalid value for 'distribution'.  Must be one of 'fixed', 'normal', "
+			   "'long_tail' or 'bimodal'");
+		return -1;
+	}
+
+	if (inst->timeout <= 0) {
+		cf_log_err(conf, "Invalid value for 'timeout'.  It must be greater than 0");
+		return -1;
+	}
+
+	if (chaos_settings_verify(&inst->config) < 0) {
+		cf_log_perr(conf, "Invalid configuration");
+		return -1;
+	}
+
+	inst->settings = inst->config;
+	pthread_mutex_init(&inst->mutex, NULL);
+
+	if (fr_command_register_hook(NULL, inst->name, inst, cmd_table) < 0) {
+		PERROR("Failed registering radmin commands for chaos %s", inst->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_chaos_t	*inst = talloc_get_type_abort(instance, rlm_chaos_t);
+
+	pthread_mutex_destroy(&inst->mutex);
+
+	return 0;
+}
+
+extern module_t rlm_chaos;
+module_t rlm_chaos = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "chaos",
+	.type			= RLM_TYPE_THREAD_SAFE,
+	.inst_size		= sizeof(rlm_chaos_t),
+	.thread_inst_size	= sizeof(rlm_chaos_thread_t),
+	.config			= module_config,
+	.instantiate		= mod_instantiate,
+	.detach			= mod_detach,
+	.methods = {
+		[MOD_AUTHENTICATE]	= mod_chaos,
+		[MOD_AUTHORIZE]		= mod_chaos,
+		[MOD_PREACCT]		= mod_chaos,
+		[MOD_ACCOUNTING]	= mod_chaos,
+		[MOD_POST_AUTH]		= mod_chaos,
+	},
+};
@@ -531,65 +531,47 @@ static xlat_action_t cipher_rsa_encrypt_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
 	return XLAT_ACTION_DONE;
 }
 
-/** Sign input data
- *
- * Arguments are @verbatim(<plaintext>...)@endverbatim
- *
-@verbatim
-%{<inst>_sign:<plaintext>...}
-@endverbatim
+/** Produce a signature for a single message
  *
- * If multiple arguments are provided they will be concatenated.
+ * Reuses the digest and sign contexts allocated for the thread, so
+ * no OpenSSL state is created per call.
  *
- * @ingroup xlat_functions
+ * @param[in] ctx	to allocate the signature in.
+ * @param[out] out	Where to write the signature.
+ * @param[in] request	The current request.
+ * @param[in] inst	Module instance.
+ * @param[in] xt	Thread instance holding the pre-allocated contexts.
+ * @param[in] msg	to sign.
+ * @param[in] msg_len	Length of msg.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static xlat_action_t cipher_rsa_sign_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
-					  REQUEST *request, void const *xlat_inst, void *xlat_thread_inst,
-					  fr_value_box_t **in)
+static int cipher_rsa_sign_msg(TALLOC_CTX *ctx, uint8_t **out, REQUEST *request,
+			       rlm_cipher_t const *inst, rlm_cipher_rsa_thread_inst_t *xt,
+			       uint8_t const *msg, size_t msg_len)
 {
-	rlm_cipher_t const		*inst = talloc_get_type_abort_const(*((void const * const *)xlat_inst),
-									    rlm_cipher_t);
-	rlm_cipher_rsa_thread_inst_t	*xt = talloc_get_type_abort(*((void **)xlat_thread_inst),
-								    rlm_cipher_rsa_thread_inst_t);
-
-	char const			*msg;
-	size_t				msg_len;
-
 	uint8_t				*sig;
 	size_t				sig_len;
 
 	unsigned int			digest_len = 0;
 
-	fr_value_box_t			*vb;
-
-	if (!*in) {
-		REDEBUG("sign requires one or arguments (<plaintext>...)");
-		return XLAT_ACTION_FAIL;
-	}
-
-	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
-		REDEBUG("Failed concatenating arguments to form plaintext");
-		return XLAT_ACTION_FAIL;
-	}
-	msg = (*in)->vb_strvalue;
-	msg_len = (*in)->vb_length;
-
 	/*
 	 *	First produce a digest of the message
 	 */
 	if (unlikely(EVP_DigestInit_ex(xt->evp_md_ctx, inst->rsa->sig_digest, NULL) <= 0)) {
 		fr_tls_log_error(request, "Failed initialising message digest");
-		return XLAT_ACTION_FAIL;
+		return -1;
 	}
 
 	if (EVP_DigestUpdate(xt->evp_md_ctx, msg, msg_len) <= 0) {
 		fr_tls_log_error(request, "Failed ingesting message");
-		return XLAT_ACTION_FAIL;
+		return -1;
 	}
 
 	if (EVP_DigestFinal_ex(xt->evp_md_ctx, xt->digest_buff, &digest_len) <= 0) {
 		fr_tls_log_error(request, "Failed finalising message digest");
-		return XLAT_ACTION_FAIL;
+		return -1;
 	}
 	fr_assert((size_t)digest_len == talloc_array_length(xt->digest_buff));
 
@@ -598,13 +580,14 @@ static xlat_action_t cipher_rsa_sign_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
 	 */
 	if (EVP_PKEY_sign(xt->evp_sign_ctx, NULL, &sig_len, xt->digest_buff, (size_t)digest_len) <= 0) {
 		fr_tls_log_error(request, "Failed getting length of digest");
-		return XLAT_ACTION_FAIL;
+		return -1;
 	}
 
 	MEM(sig = talloc_array(ctx, uint8_t, sig_len));
 	if (EVP_PKEY_sign(xt->evp_sign_ctx, sig, &sig_len, xt->digest_buff, (size_t)digest_len) <= 0) {
 		fr_tls_log_error(request, "Failed signing message digest");
-		return XLAT_ACTION_FAIL;
+		talloc_free(sig);
+		return -1;
 	}
 
 	/*
@@ -617,13 +600,56 @@ static xlat_action_t cipher_rsa_sign_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
 		if (unlikely(!n)) {
 			REDEBUG("Failed shrinking signature buffer");
 			talloc_free(sig);
-			return XLAT_ACTION_FAIL;
+			return -1;
 		}
 		talloc_set_type(n, uint8_t);
 
 		sig = n;
 	}
 
+	*out = sig;
+
+	return 0;
+}
+
+/** Sign input data
+ *
+ * Arguments are @verbatim(<plaintext>...)@endverbatim
+ *
+@verbatim
+%{<inst>_sign:<plaintext>...}
+@endverbatim
+ *
+ * If multiple arguments are provided they will be concatenated.
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t cipher_rsa_sign_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
+					  REQUEST *request, void const *xlat_inst, void *xlat_thread_inst,
+					  fr_value_box_t **in)
+{
+	rlm_cipher_t const		*inst = talloc_get_type_abort_const(*((void const * const *)xlat_inst),
+									    rlm_cipher_t);
+	rlm_cipher_rsa_thread_inst_t	*xt = talloc_get_type_abort(*((void **)xlat_thread_inst),
+								    rlm_cipher_rsa_thread_inst_t);
+
+	uint8_t				*sig;
+
+	fr_value_box_t			*vb;
+
+	if (!*in) {
+		REDEBUG("sign requires one or arguments (<plaintext>...)");
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
+		REDEBUG("Failed concatenating arguments to form plaintext");
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (cipher_rsa_sign_msg(ctx, &sig, request, inst, xt,
+				(uint8_t const *)(*in)->vb_strvalue, (*in)->vb_length) < 0) return XLAT_ACTION_FAIL;
+
 	MEM(vb = fr_value_box_alloc_null(ctx));
 	fr_value_box_memsteal(vb, vb, NULL, sig, false);
 	fr_cursor_append(out, vb);
@@ -631,6 +657,68 @@ static xlat_action_t cipher_rsa_sign_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
 	return XLAT_ACTION_DONE;
 }
 
+/** Sign multiple values in a single call
+ *
+ * Arguments are @verbatim(<plaintext>...)@endverbatim
+ *
+@verbatim
+%{<inst>_sign_each:%{Tmp-String-0[*]}}
+@endverbatim
+ *
+ * Unlike @verbatim %{<inst>_sign:...} @endverbatim each argument is signed
+ * separately, producing one signature per argument, in the same order as the
+ * arguments.  String and octets values are signed as-is, other types are
+ * signed in their string form.
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t cipher_rsa_sign_each_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
+					       REQUEST *request, void const *xlat_inst, void *xlat_thread_inst,
+					       fr_value_box_t **in)
+{
+	rlm_cipher_t const		*inst = talloc_get_type_abort_const(*((void const * const *)xlat_inst),
+									    rlm_cipher_t);
+	rlm_cipher_rsa_thread_inst_t	*xt = talloc_get_type_abort(*((void **)xlat_thread_inst),
+								    rlm_cipher_rsa_thread_inst_t);
+
+	fr_cursor_t			cursor;
+	fr_value_box_t			*in_vb;
+
+	if (!*in) {
+		REDEBUG("sign_each requires one or arguments (<plaintext>...)");
+		return XLAT_ACTION_FAIL;
+	}
+
+	for (in_vb = fr_cursor_talloc_init(&cursor, in, fr_value_box_t);
+	     in_vb;
+	     in_vb = fr_cursor_next(&cursor)) {
+		uint8_t		*sig;
+		fr_value_box_t	*vb;
+
+		switch (in_vb->type) {
+		case FR_TYPE_STRING:
+		case FR_TYPE_OCTETS:
+			break;
+
+		default:
+			if (fr_value_box_cast_in_place(ctx, in_vb, FR_TYPE_STRING, NULL) < 0) {
+				RPEDEBUG("Failed converting argument to plaintext");
+				return XLAT_ACTION_FAIL;
+			}
+			break;
+		}
+
+		if (cipher_rsa_sign_msg(ctx, &sig, request, inst, xt,
+					in_vb->vb_octets, in_vb->vb_length) < 0) return XLAT_ACTION_FAIL;
+
+		MEM(vb = fr_value_box_alloc_null(ctx));
+		fr_value_box_memsteal(vb, vb, NULL, sig, false);
+		fr_cursor_append(out, vb);
+	}
+
+	return XLAT_ACTION_DONE;
+}
+
 /** Decrypt input data
  *
  * Arguments are @verbatim(<ciphertext\>...)@endverbatim
@@ -1161,7 +1249,8 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 
 		if (inst->rsa->private_key_file) {
 			char *decrypt_name;
-			char *verify_name;
+			char *sign_name;
+			char *sign_each_name;
 			xlat_t const *xlat;
 
 			/*
@@ -1181,25 +1270,39 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 			talloc_free(decrypt_name);
 
 			/*
-			 *	Verify sign xlat
+			 *	Register sign xlat
 			 */
-			verify_name = talloc_asprintf(inst, "%s_verify", inst->xlat_name);
-			xlat = xlat_async_register(inst, verify_name, cipher_rsa_verify_xlat);
+			sign_name = talloc_asprintf(inst, "%s_sign", inst->xlat_name);
+			xlat = xlat_async_register(inst, sign_name, cipher_rsa_sign_xlat);
 			xlat_async_instantiate_set(xlat, cipher_xlat_instantiate,
 						   rlm_cipher_t *,
 						   NULL,
 						   inst);
-			xlat_async_thread_instantiate_set(xlat,
-							  cipher_xlat_thread_instantiate,
+			xlat_async_thread_instantiate_set(xlat, cipher_xlat_thread_instantiate,
 							  rlm_cipher_rsa_thread_inst_t *,
 							  NULL,
 							  inst);
-			talloc_free(verify_name);
+			talloc_free(sign_name);
+
+			/*
+			 *	Register batch sign xlat
+			 */
+			sign_each_name = talloc_asprintf(inst, "%s_sign_each", inst->xlat_name);
+			xlat = xlat_async_register(inst, sign_each_name, cipher_rsa_sign_each_xlat);
+			xlat_async_instantiate_set(xlat, cipher_xlat_instantiate,
+						   rlm_cipher_t *,
+						   NULL,
+						   inst);
+			xlat_async_thread_instantiate_set(xlat, cipher_xlat_thread_instantiate,
+							  rlm_cipher_rsa_thread_inst_t *,
+							  NULL,
+							  inst);
+			talloc_free(sign_each_name);
 		}
 
 		if (inst->rsa->certificate_file) {
 			char *encrypt_name;
-			char *sign_name;
+			char *verify_name;
 			xlat_t const *xlat;
 
 			/*
@@ -1218,10 +1321,10 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 			talloc_free(encrypt_name);
 
 			/*
-			 *	Register sign xlat
+			 *	Register verify xlat
 			 */
-			sign_name = talloc_asprintf(inst, "%s_sign", inst->xlat_name);
-			xlat = xlat_async_register(inst, sign_name, cipher_rsa_sign_xlat);
+			verify_name = talloc_asprintf(inst, "%s_verify", inst->xlat_name);
+			xlat = xlat_async_register(inst, verify_name, cipher_rsa_verify_xlat);
 			xlat_async_instantiate_set(xlat, cipher_xlat_instantiate,
 						   rlm_cipher_t *,
 						   NULL,
@@ -1230,7 +1333,7 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 							  rlm_cipher_rsa_thread_inst_t *,
 							  NULL,
 							  inst);
-			talloc_free(sign_name);
+			talloc_free(verify_name);
 		}
 		break;
 
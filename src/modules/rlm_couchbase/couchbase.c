@@ -179,10 +179,7 @@ void couchbase_http_data_callback(lcb_http_request_t request, lcb_t instance, co
 	(void)request;
 }
 
-/** Initialize a Couchbase connection instance
- *
- * Initialize all information relating to a Couchbase instance and configure available method callbacks.
- * This function forces synchronous operation and will wait for a connection or timeout.
+/** Create and configure a Couchbase instance, without connecting it
  *
  * @param instance Empty (un-allocated) Couchbase instance object.
  * @param host       The Couchbase server or list of servers.
@@ -191,10 +188,13 @@ void couchbase_http_data_callback(lcb_http_request_t request, lcb_t instance, co
  * @param pass       The Couchbase bucket password (NULL if none).
  * @param timeout    Maximum time to wait for obtaining the initial configuration.
  * @param opts       Extra options to configure the libcouchbase.
+ * @param io         I/O options, from #couchbase_io_opts_alloc.  NULL to use the
+ *		     default (blocking) I/O plugin.
  * @return           Couchbase error object.
  */
-lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const char *bucket, const char *user, const char *pass,
-				      lcb_uint32_t timeout, const couchbase_opts_t *opts)
+lcb_error_t couchbase_instance_create(lcb_t *instance, const char *host, const char *bucket, const char *user,
+				      const char *pass, lcb_uint32_t timeout, const couchbase_opts_t *opts,
+				      lcb_io_opt_t io)
 {
 	lcb_error_t error;                      /* couchbase command return */
 	struct lcb_create_st options;           /* init create struct */
@@ -207,6 +207,7 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 	options.v.v0.bucket = bucket;
 	options.v.v0.user = user;
 	options.v.v0.passwd = pass;
+	options.v.v0.io = io;
 
 	/* create couchbase connection instance */
 	error = lcb_create(instance, &options);
@@ -228,6 +229,31 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 		}
 	}
 
+	return LCB_SUCCESS;
+}
+
+/** Initialize a Couchbase connection instance
+ *
+ * Initialize all information relating to a Couchbase instance and configure available method callbacks.
+ * This function forces synchronous operation and will wait for a connection or timeout.
+ *
+ * @param instance Empty (un-allocated) Couchbase instance object.
+ * @param host       The Couchbase server or list of servers.
+ * @param bucket     The Couchbase bucket to associate with the instance.
+ * @param user       The Couchbase bucket user (NULL if none).
+ * @param pass       The Couchbase bucket password (NULL if none).
+ * @param timeout    Maximum time to wait for obtaining the initial configuration.
+ * @param opts       Extra options to configure the libcouchbase.
+ * @return           Couchbase error object.
+ */
+lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const char *bucket, const char *user, const char *pass,
+				      lcb_uint32_t timeout, const couchbase_opts_t *opts)
+{
+	lcb_error_t error;                      /* couchbase command return */
+
+	error = couchbase_instance_create(instance, host, bucket, user, pass, timeout, opts, NULL);
+	if (error != LCB_SUCCESS) return error;
+
 	/* initiate connection */
 	error = lcb_connect(*instance);
 	if (error != LCB_SUCCESS) return error;
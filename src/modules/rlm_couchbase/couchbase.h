@@ -35,6 +35,7 @@ DIAG_ON(documentation)
 #endif
 
 #include <freeradius-devel/json/base.h>
+#include <freeradius-devel/util/event.h>
 
 /** Information relating to the parsing of Couchbase document payloads
  *
@@ -90,6 +91,14 @@ void couchbase_get_callback(lcb_t instance, const void *cookie, lcb_error_t erro
 void couchbase_http_data_callback(lcb_http_request_t request, lcb_t instance,
 	const void *cookie, lcb_error_t error, const lcb_http_resp_t *resp);
 
+/* create and configure a couchbase instance without connecting */
+lcb_error_t couchbase_instance_create(lcb_t *instance, const char *host, const char *bucket, const char *user,
+				      const char *pass, lcb_uint32_t timeout, const couchbase_opts_t *opts,
+				      lcb_io_opt_t io);
+
+/* allocate I/O options which run libcouchbase on an event list */
+lcb_io_opt_t couchbase_io_opts_alloc(TALLOC_CTX *ctx, fr_event_list_t *el);
+
 /* create a couchbase instance and connect to the cluster */
 lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const char *bucket, const char *user,
 					const char *pass, lcb_uint32_t timeout, const couchbase_opts_t *opts);
@@ -0,0 +1,262 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief libcouchbase I/O plugin which runs on a FreeRADIUS event list.
+ * @file io.c
+ *
+ * libcouchbase uses an "event" I/O model, it asks to be told when sockets
+ * are readable or writable, and to be called back when timers expire.
+ * Sockets are still created, read and written using the BSD socket
+ * functions libcouchbase provides.
+ *
+ * Nothing here calls lcb_wait, so the event loop start and stop functions
+ * are never used.  All I/O happens as the worker's event list runs.
+ *
+ * @copyright 2020 The FreeRADIUS Server Project.
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_couchbase - "
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+
+#include "couchbase.h"
+
+/** Interest in a socket
+ *
+ */
+typedef struct {
+	fr_event_list_t		*el;		//!< Event list the socket is inserted into.
+	lcb_socket_t		fd;		//!< Socket we're watching, -1 if none.
+	short			flags;		//!< LCB_READ_EVENT and/or LCB_WRITE_EVENT.
+	void			*uarg;		//!< Passed to callback.
+	lcb_ioE_callback	callback;	//!< To call when the socket is ready.
+} couchbase_io_event_t;
+
+/** A timer
+ *
+ */
+typedef struct {
+	fr_event_list_t		*el;		//!< Event list the timer is inserted into.
+	fr_event_timer_t const	*ev;		//!< The timer event, NULL if not scheduled.
+	void			*uarg;		//!< Passed to callback.
+	lcb_ioE_callback	callback;	//!< To call when the timer fires.
+} couchbase_io_timer_t;
+
+#define IO_EL(_iops) ((fr_event_list_t *)(_iops)->v.v2.cookie)
+
+static void _couchbase_io_readable(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	couchbase_io_event_t	*ev = uctx;
+
+	ev->callback(fd, LCB_READ_EVENT, ev->uarg);
+}
+
+static void _couchbase_io_writable(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	couchbase_io_event_t	*ev = uctx;
+
+	ev->callback(fd, LCB_WRITE_EVENT, ev->uarg);
+}
+
+/** Tell libcouchbase about the error, it'll close the socket and retry or fail the operations
+ *
+ */
+static void _couchbase_io_error(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	couchbase_io_event_t	*ev = uctx;
+
+	DEBUG4("FD %i errored: %s", fd, fr_syserror(fd_errno));
+
+	ev->callback(fd, LCB_ERROR_EVENT, ev->uarg);
+}
+
+static void *_couchbase_io_event_create(lcb_io_opt_t iops)
+{
+	couchbase_io_event_t	*ev;
+
+	MEM(ev = talloc_zero(iops, couchbase_io_event_t));
+	ev->el = IO_EL(iops);
+	ev->fd = -1;
+
+	return ev;
+}
+
+static void _couchbase_io_event_cancel(UNUSED lcb_io_opt_t iops, UNUSED lcb_socket_t sock, void *event)
+{
+	couchbase_io_event_t	*ev = event;
+
+	if (ev->fd < 0) return;
+
+	if (fr_event_fd_delete(ev->el, ev->fd, FR_EVENT_FILTER_IO) < 0) {
+		PERROR("De-registration failed for FD %i", ev->fd);
+	}
+	ev->fd = -1;
+	ev->flags = 0;
+}
+
+static int _couchbase_io_event_watch(lcb_io_opt_t iops, lcb_socket_t sock, void *event, short flags,
+				     void *uarg, lcb_ioE_callback callback)
+{
+	couchbase_io_event_t	*ev = event;
+
+	ev->uarg = uarg;
+	ev->callback = callback;
+
+	flags &= (LCB_READ_EVENT | LCB_WRITE_EVENT);
+	if (!flags) {
+		_couchbase_io_event_cancel(iops, sock, event);
+		return 0;
+	}
+
+	/*
+	 *	libcouchbase re-arms events after each
+	 *	callback, don't churn the event list
+	 *	if nothing has changed.
+	 */
+	if ((ev->fd == sock) && (ev->flags == flags)) return 0;
+
+	if ((ev->fd >= 0) && (ev->fd != sock)) _couchbase_io_event_cancel(iops, ev->fd, event);
+
+	if (fr_event_fd_insert(ev, ev->el, sock,
+			       (flags & LCB_READ_EVENT) ? _couchbase_io_readable : NULL,
+			       (flags & LCB_WRITE_EVENT) ? _couchbase_io_writable : NULL,
+			       _couchbase_io_error,
+			       ev) < 0) {
+		PERROR("Registration failed for FD %i", sock);
+		return -1;
+	}
+	ev->fd = sock;
+	ev->flags = flags;
+
+	return 0;
+}
+
+static void _couchbase_io_event_destroy(lcb_io_opt_t iops, void *event)
+{
+	couchbase_io_event_t	*ev = event;
+
+	_couchbase_io_event_cancel(iops, ev->fd, event);
+	talloc_free(ev);
+}
+
+static void _couchbase_io_timer_fired(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	couchbase_io_timer_t	*timer = uctx;
+
+	timer->callback(-1, 0, timer->uarg);
+}
+
+static void *_couchbase_io_timer_create(lcb_io_opt_t iops)
+{
+	couchbase_io_timer_t	*timer;
+
+	MEM(timer = talloc_zero(iops, couchbase_io_timer_t));
+	timer->el = IO_EL(iops);
+
+	return timer;
+}
+
+static void _couchbase_io_timer_cancel(UNUSED lcb_io_opt_t iops, void *t)
+{
+	couchbase_io_timer_t	*timer = t;
+
+	fr_event_timer_delete(&timer->ev);
+}
+
+static int _couchbase_io_timer_schedule(UNUSED lcb_io_opt_t iops, void *t, lcb_U32 usec,
+					void *uarg, lcb_ioE_callback callback)
+{
+	couchbase_io_timer_t	*timer = t;
+
+	timer->uarg = uarg;
+	timer->callback = callback;
+
+	if (fr_event_timer_in(timer, timer->el, &timer->ev, fr_time_delta_from_usec(usec),
+			      _couchbase_io_timer_fired, timer) < 0) {
+		PERROR("Failed scheduling timer");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void _couchbase_io_timer_destroy(lcb_io_opt_t iops, void *t)
+{
+	_couchbase_io_timer_cancel(iops, t);
+	talloc_free(t);
+}
+
+/** The worker's event list is always running, and is never stopped on behalf of libcouchbase
+ *
+ */
+static void _couchbase_io_loop_noop(UNUSED lcb_io_opt_t iops)
+{
+}
+
+static void _couchbase_io_procs(int version, lcb_loop_procs *loop, lcb_timer_procs *timer, lcb_bsd_procs *bsd,
+				lcb_ev_procs *ev, UNUSED lcb_completion_procs *iocp, lcb_iomodel_t *model)
+{
+	*model = LCB_IOMODEL_EVENT;
+
+	loop->start = _couchbase_io_loop_noop;
+	loop->stop = _couchbase_io_loop_noop;
+
+	timer->create = _couchbase_io_timer_create;
+	timer->destroy = _couchbase_io_timer_destroy;
+	timer->cancel = _couchbase_io_timer_cancel;
+	timer->schedule = _couchbase_io_timer_schedule;
+
+	ev->create = _couchbase_io_event_create;
+	ev->destroy = _couchbase_io_event_destroy;
+	ev->cancel = _couchbase_io_event_cancel;
+	ev->watch = _couchbase_io_event_watch;
+
+	lcb_iops_wire_bsd_impl2(bsd, version);
+}
+
+/** Freed by us, after the libcouchbase instance using it
+ *
+ */
+static void _couchbase_io_destructor(UNUSED lcb_io_opt_t iops)
+{
+}
+
+/** Allocate I/O options which run libcouchbase's I/O on an event list
+ *
+ * Pass the result to #couchbase_instance_create.  Free it with talloc_free,
+ * once the libcouchbase instance using it has been destroyed.
+ *
+ * @param[in] ctx	to allocate the I/O options in.
+ * @param[in] el	to insert I/O and timer events into.
+ * @return I/O options.
+ */
+lcb_io_opt_t couchbase_io_opts_alloc(TALLOC_CTX *ctx, fr_event_list_t *el)
+{
+	lcb_io_opt_t	iops;
+
+	MEM(iops = talloc_zero(ctx, struct lcb_io_opt_st));
+	iops->version = 2;
+	iops->destructor = _couchbase_io_destructor;
+	iops->v.v2.cookie = el;
+	iops->v.v2.get_procs = _couchbase_io_procs;
+
+	return iops;
+}
@@ -698,6 +698,9 @@ static int _get_client_value(char **out, CONF_PAIR const *cp, void *data)
  * rebuild on this design document in Couchbase.  However, since this function is only
  * run once at server startup this should not be a concern.
  *
+ * Clients which already exist, and haven't changed, are left alone, so calling
+ * this function again only replaces the clients which have changed.
+ *
  * @param  inst The module instance.
  * @param  tmpl Default values for new clients.
  * @param  map  The client attribute configuration list.
@@ -715,7 +718,6 @@ int mod_load_client_documents(rlm_couchbase_t *inst, CONF_SECTION *tmpl, CONF_SE
 	lcb_error_t cb_error = LCB_SUCCESS;                      /* couchbase error holder */
 	json_object *json, *j_value;                                /* json object holders */
 	json_object *jrows = NULL;                               /* json object to hold view rows */
-	CONF_SECTION *client;                                    /* freeradius config list */
 	RADCLIENT *c;                                            /* freeradius client */
 
 	/* get handle */
@@ -851,52 +853,37 @@ int mod_load_client_documents(rlm_couchbase_t *inst, CONF_SECTION *tmpl, CONF_SE
 		/* debugging */
 		DEBUG3("cookie->jobj == %s", json_object_to_json_string(cookie->jobj));
 
-		/* allocate conf list */
-		client = tmpl ? cf_section_dup(NULL, NULL, tmpl, "client", vkey, true) :
-				cf_section_alloc(NULL, NULL, "client", vkey);
-
-		if (client_map_section(client, map, _get_client_value, cookie->jobj) < 0) {
-			/* free config setion */
-			talloc_free(client);
-			/* set return */
-			retval = -1;
-			/* return */
-			goto free_and_return;
-		}
-
 		/*
 		 * @todo These should be parented from something.
 		 */
-		c = client_afrom_cs(NULL, client, false);
+		c = client_afrom_map(NULL, vkey, tmpl, map, _get_client_value, cookie->jobj);
 		if (!c) {
 			ERROR("failed to allocate client");
-			/* free config setion */
-			talloc_free(client);
 			/* set return */
 			retval = -1;
 			/* return */
 			goto free_and_return;
 		}
 
-		/*
-		 * Client parents the CONF_SECTION which defined it.
-		 */
-		talloc_steal(c, client);
+		/* attempt to add or replace client, unchanged clients are skipped */
+		switch (client_update(NULL, c)) {
+		case 1:
+			/* debugging */
+			DEBUG("client '%s' added", vkey);
+			break;
+
+		case 0:
+			DEBUG3("client '%s' unchanged", vkey);
+			break;
 
-		/* attempt to add client */
-		if (!client_add(NULL, c)) {
-			ERROR("failed to add client '%s' from '%s', possible duplicate?", vkey, vid);
-			/* free client */
-			client_free(c);
+		default:
+			ERROR("failed to add client '%s' from '%s'", vkey, vid);
 			/* set return */
 			retval = -1;
 			/* return */
 			goto free_and_return;
 		}
 
-		/* debugging */
-		DEBUG("client '%s' added", c->longname);
-
 		/* free json object */
 		if (cookie->jobj) {
 			json_object_put(cookie->jobj);
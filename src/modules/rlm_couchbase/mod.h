@@ -28,9 +28,12 @@ RCSIDH(mod_h, "$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/pool.h>
+#include <freeradius-devel/server/trunk.h>
 
 #include <freeradius-devel/json/base.h>
 
+#include "couchbase.h"
+
 /* maximum size of a stored value */
 #define MAX_VALUE_SIZE 20480
 
@@ -58,7 +61,8 @@ typedef struct {
 	const char		*client_view;    	//!< Couchbase view that returns client documents.
 
 	json_object		*map;           	//!< Json object to hold user defined attribute map.
-	fr_pool_t		*pool;			//!< Connection pool.
+	fr_pool_t		*pool;			//!< Connection pool, used when loading clients.
+	fr_trunk_conf_t		trunk_conf;		//!< Connections used by the worker threads.
 	char const		*name;			//!< Module instance name.
 	void			*api_opts;		//!< Couchbase API internal options.
 } rlm_couchbase_t;
@@ -73,6 +77,56 @@ typedef struct {
 	void *cookie;    //!< Couchbase cookie (@p cookie_u @p cookie_t).
 } rlm_couchbase_handle_t;
 
+typedef struct couchbase_trunk_s couchbase_trunk_t;
+
+/** Per-thread instance data
+ *
+ */
+typedef struct {
+	couchbase_trunk_t	*trunk;			//!< Connections for this thread.
+} rlm_couchbase_thread_t;
+
+/** Types of operation we can send via a trunk
+ *
+ */
+typedef enum {
+	COUCHBASE_OP_GET = 0,				//!< Retrieve a document.
+	COUCHBASE_OP_SET				//!< Create or replace a document.
+} couchbase_op_type_t;
+
+typedef struct couchbase_op_s couchbase_op_t;
+
+/** Called when an operation completes, or fails
+ *
+ * op->error should be checked before using op->jobj.  The trunk frees
+ * the operation once the callback returns, steal op->jobj to keep it.
+ *
+ * @param[in] request	the operation was made for.
+ * @param[in] op	that completed.
+ * @param[in] rctx	passed to #couchbase_trunk_get or #couchbase_trunk_set.
+ */
+typedef void (*couchbase_op_callback_t)(REQUEST *request, couchbase_op_t *op, void *rctx);
+
+/** A single get or set, sent via a trunk
+ *
+ */
+struct couchbase_op_s {
+	couchbase_op_type_t	type;			//!< What we're doing.
+	char const		*key;			//!< Document key.
+	char const		*document;		//!< Document to store.  Only used for sets.
+	uint32_t		expire;			//!< Document expiry.  Only used for sets.
+
+	lcb_error_t		error;			//!< Result of the operation.
+	json_object		*jobj;			//!< Parsed document.  Only set for successful gets.
+
+	fr_trunk_request_t	*treq;			//!< Trunk request this operation is associated with.
+	void			*tracker;		//!< Passed to libcouchbase as the operation cookie,
+							///< NULL if the operation hasn't been sent.
+
+	couchbase_op_callback_t	callback;		//!< To call on completion.
+	void			*rctx;			//!< Passed to the callback.
+};
+
 /* define functions */
 void *mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
 
@@ -96,3 +150,15 @@ int mod_build_api_opts(CONF_SECTION *conf, void *instance);
 
 int mod_free_api_opts(void *instance);
 
+couchbase_trunk_t *couchbase_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, rlm_couchbase_t const *inst,
+					 fr_trunk_conf_t const *tconf, char const *log_prefix);
+
+couchbase_op_t *couchbase_trunk_get(TALLOC_CTX *ctx, couchbase_trunk_t *ctrunk, REQUEST *request, char const *key,
+				    couchbase_op_callback_t callback, void *rctx);
+
+couchbase_op_t *couchbase_trunk_set(TALLOC_CTX *ctx, couchbase_trunk_t *ctrunk, REQUEST *request, char const *key,
+				    char const *document, uint32_t expire,
+				    couchbase_op_callback_t callback, void *rctx);
+
+void couchbase_op_cancel(couchbase_op_t *op);
+
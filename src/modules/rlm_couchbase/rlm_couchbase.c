@@ -33,6 +33,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/base.h>
+#include <freeradius-devel/unlang/base.h>
 
 #include <freeradius-devel/json/base.h>
 
@@ -63,6 +64,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("user_key", FR_TYPE_TMPL, rlm_couchbase_t, user_key), .dflt = "raduser_%{md5:%{tolower:%{%{Stripped-User-Name}:-%{User-Name}}}}", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("read_clients", FR_TYPE_BOOL, rlm_couchbase_t, read_clients) }, /* NULL defaults to "no" */
 	{ FR_CONF_POINTER("client", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) client_config },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_couchbase_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -86,250 +88,229 @@ fr_dict_attr_autoload_t rlm_couchbase_dict_attr[] = {
 	{ NULL }
 };
 
-/** Handle authorization requests using Couchbase document data
+/** Asynchronous operation state
  *
- * Attempt to fetch the document assocaited with the requested user by
- * using the deterministic key defined in the configuration.  When a valid
- * document is found it will be parsed and the containing value pairs will be
- * injected into the request.
+ */
+typedef struct {
+	couchbase_op_t		*op;			//!< In flight, NULL once the trunk has called us back.
+	char const		*key;			//!< Document key.
+	uint32_t		status;			//!< Acct-Status-Type, only used for accounting.
+
+	lcb_error_t		error;			//!< Result of the last operation.
+	json_object		*jobj;			//!< Document returned by the last get.
+} couchbase_rctx_t;
+
+/** Release any document we're still holding on to
  *
- * @param instance	The module instance.
- * @param thread	specific data.
- * @param request	The authorization request.
- * @return Operation status (#rlm_rcode_t).
  */
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+static int _couchbase_rctx_free(couchbase_rctx_t *rctx)
 {
-	rlm_couchbase_t const	*inst = instance;		/* our module instance */
-	rlm_couchbase_handle_t	*handle = NULL;			/* connection pool handle */
+	if (rctx->jobj) json_object_put(rctx->jobj);
+
+	return 0;
+}
+
+/** Record the result of an operation, and mark the request as runnable
+ *
+ */
+static void couchbase_op_done(REQUEST *request, couchbase_op_t *op, void *uctx)
+{
+	couchbase_rctx_t	*rctx = talloc_get_type_abort(uctx, couchbase_rctx_t);
+
+	rctx->op = NULL;	/* Freed by the trunk */
+	rctx->error = op->error;
+
+	if (rctx->jobj) json_object_put(rctx->jobj);
+	rctx->jobj = op->jobj;
+	op->jobj = NULL;
+
+	unlang_interpret_resumable(request);
+}
+
+/** Stop the operation in flight if the request is cancelled
+ *
+ */
+static void mod_couchbase_signal(UNUSED void *instance, UNUSED void *thread, UNUSED REQUEST *request, void *uctx,
+				 fr_state_signal_t action)
+{
+	couchbase_rctx_t	*rctx = talloc_get_type_abort(uctx, couchbase_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (rctx->op) {
+		couchbase_op_cancel(rctx->op);	/* Trunk frees the operation */
+		rctx->op = NULL;
+	}
+	talloc_free(rctx);
+}
+
+/** Expand a document key, and allocate the state for an asynchronous operation
+ *
+ */
+static couchbase_rctx_t *couchbase_rctx_alloc(REQUEST *request, vp_tmpl_t const *vpt)
+{
+	couchbase_rctx_t	*rctx;
 	char			buffer[MAX_KEY_SIZE];
-	char const		*dockey;			/* our document key */
-	lcb_error_t		cb_error = LCB_SUCCESS;		/* couchbase error holder */
-	rlm_rcode_t		rcode = RLM_MODULE_OK;		/* return code */
+	char const		*dockey;
 	ssize_t			slen;
 
-	/* assert packet as not null */
-	fr_assert(request->packet != NULL);
-
-	/* attempt to build document key */
-	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->user_key, NULL, NULL);
-	if (slen < 0) return RLM_MODULE_FAIL;
+	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, vpt, NULL, NULL);
+	if (slen < 0) return NULL;
 	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
 		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
-		return RLM_MODULE_FAIL;
+		return NULL;
 	}
 
-	/* get handle */
-	handle = fr_pool_connection_get(inst->pool, request);
-
-	/* check handle */
-	if (!handle) return RLM_MODULE_FAIL;
+	MEM(rctx = talloc_zero(request, couchbase_rctx_t));
+	talloc_set_destructor(rctx, _couchbase_rctx_free);
+	rctx->key = talloc_typed_strdup(rctx, dockey);
 
-	/* set couchbase instance */
-	lcb_t cb_inst = handle->handle;
+	return rctx;
+}
 
-	/* set cookie */
-	cookie_t *cookie = handle->cookie;
+/** Apply the attributes in a user document to the request
+ *
+ */
+static rlm_rcode_t couchbase_apply_user_document(REQUEST *request, json_object *jobj)
+{
+	TALLOC_CTX	*pool = talloc_pool(request, 1024);	/* We need to do lots of allocs */
+	fr_cursor_t	maps, vlms;
+	vp_map_t	*map_head = NULL, *map;
+	vp_list_mod_t	*vlm_head = NULL, *vlm;
+	rlm_rcode_t	rcode = RLM_MODULE_OK;
+
+	fr_cursor_init(&maps, &map_head);
+
+	/*
+	 *	Convert JSON data into maps
+	 */
+	if ((mod_json_object_to_map(pool, &maps, request, jobj, PAIR_LIST_CONTROL) < 0) ||
+	    (mod_json_object_to_map(pool, &maps, request, jobj, PAIR_LIST_REPLY) < 0) ||
+	    (mod_json_object_to_map(pool, &maps, request, jobj, PAIR_LIST_REQUEST) < 0) ||
+	    (mod_json_object_to_map(pool, &maps, request, jobj, PAIR_LIST_STATE) < 0)) {
+	invalid:
+		rcode = RLM_MODULE_INVALID;
+		goto finish;
+	}
 
-	/* fetch document */
-	cb_error = couchbase_get_key(cb_inst, cookie, dockey);
+	fr_cursor_init(&vlms, &vlm_head);
+
+	/*
+	 *	Convert all the maps into list modifications,
+	 *	which are guaranteed to succeed.
+	 */
+	for (map = fr_cursor_head(&maps);
+	     map;
+	     map = fr_cursor_next(&maps)) {
+		if (map_to_list_mod(pool, &vlm, request, map, NULL, NULL) < 0) goto invalid;
+		fr_cursor_insert(&vlms, vlm);
+	}
 
-	/* check error */
-	if (cb_error != LCB_SUCCESS || !cookie->jobj) {
-		/* log error */
-		RERROR("failed to fetch document or parse return");
-		/* set return */
-		rcode = RLM_MODULE_FAIL;
-		/* return */
+	if (!vlm_head) {
+		RDEBUG2("Nothing to update");
+		rcode = RLM_MODULE_NOOP;
 		goto finish;
 	}
 
-	/* debugging */
-	RDEBUG3("parsed user document == %s", json_object_to_json_string(cookie->jobj));
-
-	{
-		TALLOC_CTX	*pool = talloc_pool(request, 1024);	/* We need to do lots of allocs */
-		fr_cursor_t	maps, vlms;
-		vp_map_t	*map_head = NULL, *map;
-		vp_list_mod_t	*vlm_head = NULL, *vlm;
-
-		fr_cursor_init(&maps, &map_head);
-
-		/*
-		 *	Convert JSON data into maps
-		 */
-		if ((mod_json_object_to_map(pool, &maps, request, cookie->jobj, PAIR_LIST_CONTROL) < 0) ||
-		    (mod_json_object_to_map(pool, &maps, request, cookie->jobj, PAIR_LIST_REPLY) < 0) ||
-		    (mod_json_object_to_map(pool, &maps, request, cookie->jobj, PAIR_LIST_REQUEST) < 0) ||
-		    (mod_json_object_to_map(pool, &maps, request, cookie->jobj, PAIR_LIST_STATE) < 0)) {
-		invalid:
-			talloc_free(pool);
-			rcode = RLM_MODULE_INVALID;
+	/*
+	 *	Apply the list of modifications
+	 */
+	for (vlm = fr_cursor_head(&vlms);
+	     vlm;
+	     vlm = fr_cursor_next(&vlms)) {
+		int ret;
+
+		ret = map_list_mod_apply(request, vlm);	/* SHOULD NOT FAIL */
+		if (!fr_cond_assert(ret == 0)) {
+			rcode = RLM_MODULE_FAIL;
 			goto finish;
 		}
+	}
 
-		fr_cursor_init(&vlms, &vlm_head);
-
-		/*
-		 *	Convert all the maps into list modifications,
-		 *	which are guaranteed to succeed.
-		 */
-		for (map = fr_cursor_head(&maps);
-		     map;
-		     map = fr_cursor_next(&maps)) {
-			if (map_to_list_mod(pool, &vlm, request, map, NULL, NULL) < 0) goto invalid;
-			fr_cursor_insert(&vlms, vlm);
-		}
+finish:
+	talloc_free(pool);
 
-		if (!vlm_head) {
-			RDEBUG2("Nothing to update");
-			talloc_free(pool);
-			rcode = RLM_MODULE_NOOP;
-			goto finish;
-		}
+	return rcode;
+}
 
-		/*
-		 *	Apply the list of modifications
-		 */
-		for (vlm = fr_cursor_head(&vlms);
-		     vlm;
-		     vlm = fr_cursor_next(&vlms)) {
-			int ret;
-
-			ret = map_list_mod_apply(request, vlm);	/* SHOULD NOT FAIL */
-			if (!fr_cond_assert(ret == 0)) {
-				talloc_free(pool);
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			}
-		}
+/** Continue authorization once the user document has been retrieved
+ *
+ */
+static rlm_rcode_t mod_authorize_resume(UNUSED void *instance, UNUSED void *thread, REQUEST *request, void *uctx)
+{
+	couchbase_rctx_t	*rctx = talloc_get_type_abort(uctx, couchbase_rctx_t);
+	rlm_rcode_t		rcode;
 
-		talloc_free(pool);
+	if ((rctx->error != LCB_SUCCESS) || !rctx->jobj) {
+		RERROR("Failed to fetch document \"%s\": %s (0x%x)", rctx->key,
+		       lcb_strerror(NULL, rctx->error), rctx->error);
+		talloc_free(rctx);
+		return RLM_MODULE_FAIL;
 	}
 
-finish:
-	/* free json object */
-	if (cookie->jobj) {
-		json_object_put(cookie->jobj);
-		cookie->jobj = NULL;
-	}
+	/* debugging */
+	RDEBUG3("parsed user document == %s", json_object_to_json_string(rctx->jobj));
 
-	/* release handle */
-	if (handle) fr_pool_connection_release(inst->pool, request, handle);
+	rcode = couchbase_apply_user_document(request, rctx->jobj);
+	talloc_free(rctx);
 
-	/* return */
 	return rcode;
 }
 
-#ifdef WITH_ACCOUNTING
-/** Write accounting data to Couchbase documents
- *
- * Handle accounting requests and store the associated data into JSON documents
- * in couchbase mapping attribute names to JSON element names per the module configuration.
+/** Handle authorization requests using Couchbase document data
  *
- * When an existing document already exists for the same accounting section the new attributes
- * will be merged with the currently existing data.  When conflicts arrise the new attribute
- * value will replace or be added to the existing value.
+ * Attempt to fetch the document assocaited with the requested user by
+ * using the deterministic key defined in the configuration.  When a valid
+ * document is found it will be parsed and the containing value pairs will be
+ * injected into the request.
  *
  * @param instance	The module instance.
  * @param thread	specific data.
- * @param request	The accounting request object.
+ * @param request	The authorization request.
  * @return Operation status (#rlm_rcode_t).
  */
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request)
 {
-	rlm_couchbase_t const *inst = instance;       /* our module instance */
-	rlm_couchbase_handle_t *handle = NULL;  /* connection pool handle */
-	rlm_rcode_t rcode = RLM_MODULE_OK;      /* return code */
-	VALUE_PAIR *vp;                         /* radius value pair linked list */
-	char buffer[MAX_KEY_SIZE];
-	char const *dockey;			/* our document key */
-	char document[MAX_VALUE_SIZE];          /* our document body */
-	char element[MAX_KEY_SIZE];             /* mapped radius attribute to element name */
-	int status = 0;                         /* account status type */
-	int docfound = 0;                       /* document found toggle */
-	lcb_error_t cb_error = LCB_SUCCESS;     /* couchbase error holder */
-	ssize_t slen;
+	rlm_couchbase_t const	*inst = instance;		/* our module instance */
+	rlm_couchbase_thread_t	*t = talloc_get_type_abort(thread, rlm_couchbase_thread_t);
+	couchbase_rctx_t	*rctx;
 
 	/* assert packet as not null */
 	fr_assert(request->packet != NULL);
 
-	/* sanity check */
-	if ((vp = fr_pair_find_by_da(request->packet->vps, attr_acct_status_type, TAG_ANY)) == NULL) {
-		/* log debug */
-		RDEBUG2("could not find status type in packet");
-		/* return */
-		return RLM_MODULE_NOOP;
-	}
-
-	/* set status */
-	status = vp->vp_uint32;
-
-	/* acknowledge the request but take no action */
-	if (status == FR_STATUS_ACCOUNTING_ON || status == FR_STATUS_ACCOUNTING_OFF) {
-		/* log debug */
-		RDEBUG2("handling accounting on/off request without action");
-		/* return */
-		return RLM_MODULE_OK;
-	}
-
-	/* get handle */
-	handle = fr_pool_connection_get(inst->pool, request);
-
-	/* check handle */
-	if (!handle) return RLM_MODULE_FAIL;
-
-	/* set couchbase instance */
-	lcb_t cb_inst = handle->handle;
-
-	/* set cookie */
-	cookie_t *cookie = handle->cookie;
-
 	/* attempt to build document key */
-	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->acct_key, NULL, NULL);
-	if (slen < 0) {
-		rcode = RLM_MODULE_FAIL;
-		goto finish;
-	}
-	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
-		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
-		rcode = RLM_MODULE_FAIL;
-		/* return */
-		goto finish;
-	}
+	rctx = couchbase_rctx_alloc(request, inst->user_key);
+	if (!rctx) return RLM_MODULE_FAIL;
 
-	/* attempt to fetch document */
-	cb_error = couchbase_get_key(cb_inst, cookie, dockey);
-
-	/* check error and object */
-	if (cb_error != LCB_SUCCESS || cookie->jerr != json_tokener_success || !cookie->jobj) {
-		/* log error */
-		RERROR("failed to execute get request or parse returned json object");
-		/* free and reset json object */
-		if (cookie->jobj) {
-			json_object_put(cookie->jobj);
-			cookie->jobj = NULL;
-		}
-	/* check cookie json object */
-	} else if (cookie->jobj) {
-		/* set doc found */
-		docfound = 1;
-		/* debugging */
-		RDEBUG3("parsed json body from couchbase: %s", json_object_to_json_string(cookie->jobj));
+	/* fetch document */
+	rctx->op = couchbase_trunk_get(request, t->trunk, request, rctx->key, couchbase_op_done, rctx);
+	if (!rctx->op) {
+		talloc_free(rctx);
+		return RLM_MODULE_FAIL;
 	}
 
-	/* start json document if needed */
-	if (docfound != 1) {
-		/* debugging */
-		RDEBUG2("no existing document found - creating new json document");
-		/* create new json object */
-		cookie->jobj = json_object_new_object();
-		/* set 'docType' element for new document */
-		json_object_object_add(cookie->jobj, "docType", json_object_new_string(inst->doctype));
-		/* default startTimestamp and stopTimestamp to null values */
-		json_object_object_add(cookie->jobj, "startTimestamp", NULL);
-		json_object_object_add(cookie->jobj, "stopTimestamp", NULL);
-	}
+	return unlang_module_yield(request, mod_authorize_resume, mod_couchbase_signal, rctx);
+}
+
+#ifdef WITH_ACCOUNTING
+/** Merge the accounting data from a request into an accounting document
+ *
+ * @param[out] out	Serialised document.
+ * @param[in] inst	The module instance.
+ * @param[in] request	The accounting request.
+ * @param[in] jobj	Existing document, or a new document, updated in place.
+ * @param[in] status	Acct-Status-Type of the request.
+ * @return
+ *	- RLM_MODULE_OK if the document should be stored.
+ *	- RLM_MODULE_NOOP if the status type isn't one we record.
+ *	- RLM_MODULE_FAIL if the document is too large.
+ */
+static rlm_rcode_t couchbase_accounting_document(char const **out, rlm_couchbase_t const *inst, REQUEST *request,
+						 json_object *jobj, uint32_t status)
+{
+	VALUE_PAIR	*vp;
+	char		element[MAX_KEY_SIZE];			/* mapped radius attribute to element name */
+	char const	*document;
 
 	/* status specific replacements for start/stop time */
 	switch (status) {
@@ -337,7 +318,7 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 		/* add start time */
 		if ((vp = fr_pair_find_by_da(request->packet->vps, attr_acct_status_type, TAG_ANY)) != NULL) {
 			/* add to json object */
-			json_object_object_add(cookie->jobj, "startTimestamp",
+			json_object_object_add(jobj, "startTimestamp",
 					       mod_value_pair_to_json_object(request, vp));
 		}
 		break;
@@ -346,23 +327,21 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 		/* add stop time */
 		if ((vp = fr_pair_find_by_da(request->packet->vps, attr_event_timestamp, TAG_ANY)) != NULL) {
 			/* add to json object */
-			json_object_object_add(cookie->jobj, "stopTimestamp",
+			json_object_object_add(jobj, "stopTimestamp",
 					       mod_value_pair_to_json_object(request, vp));
 		}
 		/* check start timestamp and adjust if needed */
-		mod_ensure_start_timestamp(cookie->jobj, request->packet->vps);
+		mod_ensure_start_timestamp(jobj, request->packet->vps);
 		break;
 
 	case FR_STATUS_ALIVE:
 		/* check start timestamp and adjust if needed */
-		mod_ensure_start_timestamp(cookie->jobj, request->packet->vps);
+		mod_ensure_start_timestamp(jobj, request->packet->vps);
 		break;
 
 	default:
 		/* don't doing anything */
-		rcode = RLM_MODULE_NOOP;
-		/* return */
-		goto finish;
+		return RLM_MODULE_NOOP;
 	}
 
 	/* loop through pairs and add to json document */
@@ -372,45 +351,164 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 			/* debug */
 			RDEBUG3("mapped attribute %s => %s", vp->da->name, element);
 			/* add to json object with mapped name */
-			json_object_object_add(cookie->jobj, element, mod_value_pair_to_json_object(request, vp));
+			json_object_object_add(jobj, element, mod_value_pair_to_json_object(request, vp));
 		}
 	}
 
-	/* copy json string to document and check size */
-	if (strlcpy(document, json_object_to_json_string(cookie->jobj), sizeof(document)) >= sizeof(document)) {
+	/* check document size */
+	document = json_object_to_json_string(jobj);
+	if (strlen(document) >= MAX_VALUE_SIZE) {
 		/* this isn't good */
 		RERROR("could not write json document - insufficient buffer space");
-		/* set return */
+		return RLM_MODULE_FAIL;
+	}
+
+	*out = document;
+
+	return RLM_MODULE_OK;
+}
+
+/** Finish accounting once the document has been stored
+ *
+ */
+static rlm_rcode_t mod_accounting_set_resume(UNUSED void *instance, UNUSED void *thread, REQUEST *request, void *uctx)
+{
+	couchbase_rctx_t	*rctx = talloc_get_type_abort(uctx, couchbase_rctx_t);
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+
+	/* check return */
+	if (rctx->error != LCB_SUCCESS) {
+		RERROR("failed to store document (%s): %s (0x%x)", rctx->key,
+		       lcb_strerror(NULL, rctx->error), rctx->error);
 		rcode = RLM_MODULE_FAIL;
-		/* return */
-		goto finish;
+	}
+	talloc_free(rctx);
+
+	return rcode;
+}
+
+/** Merge the request into the existing accounting document, and store the result
+ *
+ */
+static rlm_rcode_t mod_accounting_get_resume(void *instance, void *thread, REQUEST *request, void *uctx)
+{
+	rlm_couchbase_t const	*inst = instance;
+	rlm_couchbase_thread_t	*t = talloc_get_type_abort(thread, rlm_couchbase_thread_t);
+	couchbase_rctx_t	*rctx = talloc_get_type_abort(uctx, couchbase_rctx_t);
+	char const		*document;
+	rlm_rcode_t		rcode;
+
+	switch (rctx->error) {
+	case LCB_SUCCESS:
+		/* debugging */
+		RDEBUG3("parsed json body from couchbase: %s", json_object_to_json_string(rctx->jobj));
+		break;
+
+	case LCB_KEY_ENOENT:
+		break;
+
+	default:
+		/* log error */
+		RERROR("failed to execute get request or parse returned json object: %s (0x%x)",
+		       lcb_strerror(NULL, rctx->error), rctx->error);
+		/* free and reset json object */
+		if (rctx->jobj) {
+			json_object_put(rctx->jobj);
+			rctx->jobj = NULL;
+		}
+		break;
+	}
+
+	/* start json document if needed */
+	if (!rctx->jobj) {
+		/* debugging */
+		RDEBUG2("no existing document found - creating new json document");
+		/* create new json object */
+		rctx->jobj = json_object_new_object();
+		/* set 'docType' element for new document */
+		json_object_object_add(rctx->jobj, "docType", json_object_new_string(inst->doctype));
+		/* default startTimestamp and stopTimestamp to null values */
+		json_object_object_add(rctx->jobj, "startTimestamp", NULL);
+		json_object_object_add(rctx->jobj, "stopTimestamp", NULL);
+	}
+
+	rcode = couchbase_accounting_document(&document, inst, request, rctx->jobj, rctx->status);
+	if (rcode != RLM_MODULE_OK) {
+		talloc_free(rctx);
+		return rcode;
 	}
 
 	/* debugging */
-	RDEBUG3("setting '%s' => '%s'", dockey, document);
+	RDEBUG3("setting '%s' => '%s'", rctx->key, document);
 
 	/* store document/key in couchbase */
-	cb_error = couchbase_set_key(cb_inst, dockey, document, inst->expire);
+	rctx->error = LCB_SUCCESS;
+	rctx->op = couchbase_trunk_set(request, t->trunk, request, rctx->key, document, inst->expire,
+				       couchbase_op_done, rctx);
+	if (!rctx->op) {
+		talloc_free(rctx);
+		return RLM_MODULE_FAIL;
+	}
 
-	/* check return */
-	if (cb_error != LCB_SUCCESS) {
-		RERROR("failed to store document (%s): %s (0x%x)", dockey, lcb_strerror(NULL, cb_error), cb_error);
+	return unlang_module_yield(request, mod_accounting_set_resume, mod_couchbase_signal, rctx);
+}
+
+/** Write accounting data to Couchbase documents
+ *
+ * Handle accounting requests and store the associated data into JSON documents
+ * in couchbase mapping attribute names to JSON element names per the module configuration.
+ *
+ * When an existing document already exists for the same accounting section the new attributes
+ * will be merged with the currently existing data.  When conflicts arrise the new attribute
+ * value will replace or be added to the existing value.
+ *
+ * The existing document is retrieved, and the merged document stored, without blocking
+ * the worker.
+ *
+ * @param instance	The module instance.
+ * @param thread	specific data.
+ * @param request	The accounting request object.
+ * @return Operation status (#rlm_rcode_t).
+ */
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request)
+{
+	rlm_couchbase_t const	*inst = instance;	/* our module instance */
+	rlm_couchbase_thread_t	*t = talloc_get_type_abort(thread, rlm_couchbase_thread_t);
+	couchbase_rctx_t	*rctx;
+	VALUE_PAIR		*vp;			/* radius value pair linked list */
+
+	/* assert packet as not null */
+	fr_assert(request->packet != NULL);
+
+	/* sanity check */
+	if ((vp = fr_pair_find_by_da(request->packet->vps, attr_acct_status_type, TAG_ANY)) == NULL) {
+		/* log debug */
+		RDEBUG2("could not find status type in packet");
+		/* return */
+		return RLM_MODULE_NOOP;
 	}
 
-finish:
-	/* free and reset json object */
-	if (cookie->jobj) {
-		json_object_put(cookie->jobj);
-		cookie->jobj = NULL;
+	/* acknowledge the request but take no action */
+	if (vp->vp_uint32 == FR_STATUS_ACCOUNTING_ON || vp->vp_uint32 == FR_STATUS_ACCOUNTING_OFF) {
+		/* log debug */
+		RDEBUG2("handling accounting on/off request without action");
+		/* return */
+		return RLM_MODULE_OK;
 	}
 
-	/* release our connection handle */
-	if (handle) {
-		fr_pool_connection_release(inst->pool, request, handle);
+	/* attempt to build document key */
+	rctx = couchbase_rctx_alloc(request, inst->acct_key);
+	if (!rctx) return RLM_MODULE_FAIL;
+	rctx->status = vp->vp_uint32;
+
+	/* attempt to fetch document */
+	rctx->op = couchbase_trunk_get(request, t->trunk, request, rctx->key, couchbase_op_done, rctx);
+	if (!rctx->op) {
+		talloc_free(rctx);
+		return RLM_MODULE_FAIL;
 	}
 
-	/* return */
-	return rcode;
+	return unlang_module_yield(request, mod_accounting_get_resume, mod_couchbase_signal, rctx);
 }
 #endif
 
@@ -555,6 +653,20 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+/** Create a trunk of connections for this thread
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_couchbase_t		*inst = talloc_get_type_abort(instance, rlm_couchbase_t);
+	rlm_couchbase_thread_t	*t = talloc_get_type_abort(thread, rlm_couchbase_thread_t);
+
+	t->trunk = couchbase_trunk_alloc(t, el, inst, &inst->trunk_conf, inst->name);
+	if (!t->trunk) return -1;
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	INFO("libcouchbase version: %s", lcb_get_version(NULL));
@@ -576,6 +688,9 @@ module_t rlm_couchbase = {
 	.onload		= mod_load,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_inst_size	= sizeof(rlm_couchbase_thread_t),
+	.thread_inst_type	= "rlm_couchbase_thread_t",
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 #ifdef WITH_ACCOUNTING
@@ -0,0 +1,489 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Multiplex gets and sets over a trunk of Couchbase connections.
+ * @file trunk.c
+ *
+ * Each connection is a libcouchbase instance using the I/O plugin in io.c,
+ * so operations complete as the worker's event list runs.  Every operation
+ * waiting for a connection is scheduled in the same libcouchbase scheduling
+ * context, so they're flushed to the cluster together.
+ *
+ * @copyright 2020 The FreeRADIUS Server Project.
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_couchbase - "
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+
+#include "mod.h"
+#include "couchbase.h"
+
+struct couchbase_trunk_s {
+	rlm_couchbase_t const	*inst;			//!< Used to create new libcouchbase instances.
+	fr_time_delta_t		timeout;		//!< How long to wait for the cluster configuration.
+	fr_trunk_t		*trunk;			//!< Connections to the cluster.
+};
+
+/** A libcouchbase instance running on a worker's event list
+ *
+ */
+typedef struct {
+	lcb_t			instance;		//!< libcouchbase instance.
+	lcb_io_opt_t		iops;			//!< I/O plugin the instance uses.
+	fr_connection_t		*conn;			//!< Connection this instance belongs to.
+	fr_event_timer_t const	*ev;			//!< Used to signal failures outside of libcouchbase callbacks.
+	bool			closing;		//!< The instance is being destroyed, ignore any callbacks.
+} couchbase_conn_t;
+
+/** Passed to libcouchbase as the cookie for an operation
+ *
+ * libcouchbase can't abandon operations once they've been scheduled, so
+ * when an operation is cancelled or moved, it's disassociated from its
+ * tracker, and the response is discarded.
+ */
+typedef struct {
+	couchbase_op_t		*op;			//!< Operation, or NULL if the response should be discarded.
+} couchbase_tracker_t;
+
+/** Release the parsed document, and disassociate the operation from its tracker
+ *
+ */
+static int _couchbase_op_free(couchbase_op_t *op)
+{
+	if (op->jobj) json_object_put(op->jobj);
+	if (op->tracker) ((couchbase_tracker_t *)op->tracker)->op = NULL;
+
+	return 0;
+}
+
+/** Retrieve our connection from a libcouchbase instance
+ *
+ */
+static inline couchbase_conn_t *couchbase_conn_from_instance(lcb_t instance)
+{
+	cookie_u cu;
+
+	cu.cdata = lcb_get_cookie(instance);
+
+	return talloc_get_type_abort(cu.data, couchbase_conn_t);
+}
+
+/** Signal the connection failed, from outside libcouchbase's callbacks
+ *
+ * libcouchbase instances can't be destroyed from within a callback.
+ */
+static void _couchbase_conn_failed(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	couchbase_conn_t *c = talloc_get_type_abort(uctx, couchbase_conn_t);
+
+	fr_connection_signal_reconnect(c->conn, FR_CONNECTION_FAILED);
+}
+
+/** Called once the instance has retrieved the cluster configuration, or failed to
+ *
+ */
+static void _couchbase_conn_bootstrap(lcb_t instance, lcb_error_t error)
+{
+	couchbase_conn_t *c = couchbase_conn_from_instance(instance);
+
+	if (c->closing) return;
+
+	if (error == LCB_SUCCESS) {
+		if (c->conn->state == FR_CONNECTION_STATE_CONNECTING) fr_connection_signal_connected(c->conn);
+		return;
+	}
+
+	ERROR("%s - Failed bootstrapping: %s (0x%x)", c->conn->log_prefix, lcb_strerror(instance, error), error);
+
+	if (fr_event_timer_in(c, c->conn->el, &c->ev, 0, _couchbase_conn_failed, c) < 0) {
+		PERROR("%s - Failed inserting reconnect timer", c->conn->log_prefix);
+	}
+}
+
+/** Match a response to its operation, and signal the trunk
+ *
+ */
+static void _couchbase_conn_response(lcb_t instance, int cbtype, lcb_RESPBASE const *rb)
+{
+	couchbase_conn_t	*c = couchbase_conn_from_instance(instance);
+	couchbase_tracker_t	*tracker;
+	couchbase_op_t		*op;
+	cookie_u		cu;
+
+	if (c->closing) return;
+
+	cu.cdata = rb->cookie;
+	tracker = talloc_get_type_abort(cu.data, couchbase_tracker_t);
+	op = tracker->op;
+	talloc_free(tracker);
+
+	if (!op) {
+		DEBUG3("%s - Discarding response for cancelled operation", c->conn->log_prefix);
+		return;
+	}
+	op->tracker = NULL;
+	op->error = rb->rc;
+
+	if ((cbtype == LCB_CALLBACK_GET) && (rb->rc == LCB_SUCCESS)) {
+		lcb_RESPGET const	*resp = (lcb_RESPGET const *)rb;
+		json_tokener		*jtok;
+
+		MEM(jtok = json_tokener_new());
+		op->jobj = json_tokener_parse_ex(jtok, resp->value, resp->nvalue);
+		if (!op->jobj) {
+			ERROR("%s - Failed parsing document \"%s\": %s", c->conn->log_prefix, op->key,
+			      json_tokener_error_desc(json_tokener_get_error(jtok)));
+			op->error = LCB_EINVAL;
+		}
+		json_tokener_free(jtok);
+	}
+
+	fr_trunk_request_signal_complete(op->treq);
+}
+
+/** Create a libcouchbase instance and start retrieving the cluster configuration
+ *
+ */
+static fr_connection_state_t _couchbase_conn_init(void **h_out, fr_connection_t *conn, void *uctx)
+{
+	couchbase_trunk_t	*ctrunk = talloc_get_type_abort(uctx, couchbase_trunk_t);
+	rlm_couchbase_t const	*inst = ctrunk->inst;
+	couchbase_conn_t	*c;
+	lcb_error_t		error;
+
+	MEM(c = talloc_zero(conn, couchbase_conn_t));
+	c->conn = conn;
+	c->iops = couchbase_io_opts_alloc(c, conn->el);
+
+	error = couchbase_instance_create(&c->instance, inst->server, inst->bucket, inst->username, inst->password,
+					  fr_time_delta_to_usec(ctrunk->timeout), inst->api_opts, c->iops);
+	if (error != LCB_SUCCESS) {
+		ERROR("%s - Failed creating instance: %s (0x%x)", conn->log_prefix, lcb_strerror(NULL, error), error);
+	error:
+		if (c->instance) lcb_destroy(c->instance);
+		talloc_free(c);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	lcb_set_cookie(c->instance, c);
+	lcb_set_bootstrap_callback(c->instance, _couchbase_conn_bootstrap);
+	lcb_install_callback3(c->instance, LCB_CALLBACK_GET, _couchbase_conn_response);
+	lcb_install_callback3(c->instance, LCB_CALLBACK_STORE, _couchbase_conn_response);
+
+	error = lcb_connect(c->instance);
+	if (error != LCB_SUCCESS) {
+		ERROR("%s - Failed connecting: %s (0x%x)", conn->log_prefix, lcb_strerror(c->instance, error), error);
+		goto error;
+	}
+
+	*h_out = c;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+/** Destroy the libcouchbase instance
+ *
+ * Responses for any operations still in flight are discarded.
+ */
+static void _couchbase_conn_close(UNUSED fr_event_list_t *el, void *h, UNUSED void *uctx)
+{
+	couchbase_conn_t *c = talloc_get_type_abort(h, couchbase_conn_t);
+
+	c->closing = true;
+	lcb_destroy(c->instance);
+	talloc_free(c);
+}
+
+/** Allocate a new connection for the trunk
+ *
+ */
+static fr_connection_t *_couchbase_trunk_connection_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+							  fr_connection_conf_t const *conf,
+							  char const *log_prefix, void *uctx)
+{
+	couchbase_trunk_t *ctrunk = talloc_get_type_abort(uctx, couchbase_trunk_t);
+
+	ctrunk->timeout = conf->connection_timeout;
+
+	return fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+					.init = _couchbase_conn_init,
+					.close = _couchbase_conn_close
+				   },
+				   conf, log_prefix, ctrunk);
+}
+
+/** Schedule every pending operation
+ *
+ * Because the trunk is in always writable mode, this is called as soon
+ * as an operation is enqueued.  All the operations are scheduled in a
+ * single context, which libcouchbase flushes when we leave it.
+ */
+static void _couchbase_trunk_request_mux(UNUSED fr_event_list_t *el,
+					 fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	couchbase_conn_t	*c = talloc_get_type_abort(conn->h, couchbase_conn_t);
+	fr_trunk_request_t	*treq;
+	couchbase_op_t		*op;
+	couchbase_tracker_t	*tracker;
+	REQUEST			*request;
+	bool			sched = false;
+
+	for (;;) {
+		lcb_error_t error;
+
+		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) break;
+		if (!treq) break;
+
+		op = talloc_get_type_abort(treq->preq, couchbase_op_t);
+		request = treq->request;
+
+		if (!sched) {
+			lcb_sched_enter(c->instance);
+			sched = true;
+		}
+
+		MEM(tracker = talloc_zero(c, couchbase_tracker_t));
+		tracker->op = op;
+
+		switch (op->type) {
+		case COUCHBASE_OP_GET:
+		{
+			lcb_CMDGET cmd = { 0 };
+
+			LCB_CMD_SET_KEY(&cmd, op->key, strlen(op->key));
+			error = lcb_get3(c->instance, tracker, &cmd);
+		}
+			break;
+
+		case COUCHBASE_OP_SET:
+		{
+			lcb_CMDSTORE cmd = { 0 };
+
+			cmd.operation = LCB_SET;
+			cmd.exptime = op->expire;
+			LCB_CMD_SET_KEY(&cmd, op->key, strlen(op->key));
+			LCB_CMD_SET_VALUE(&cmd, op->document, strlen(op->document));
+			error = lcb_store3(c->instance, tracker, &cmd);
+		}
+			break;
+
+		default:
+			fr_assert(0);
+			error = LCB_EINVAL;
+			break;
+		}
+
+		if (error != LCB_SUCCESS) {
+			ROPTIONAL(RERROR, ERROR, "Failed scheduling operation for \"%s\": %s (0x%x)",
+				  op->key, lcb_strerror(c->instance, error), error);
+			talloc_free(tracker);
+			op->error = error;
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		op->tracker = tracker;
+		fr_trunk_request_signal_sent(treq);
+	}
+
+	if (sched) lcb_sched_leave(c->instance);
+}
+
+/** Disassociate the operation from its tracker
+ *
+ * If the operation is being moved to another connection it's scheduled
+ * again with a new tracker.
+ */
+static void _couchbase_trunk_request_cancel(UNUSED fr_connection_t *conn, void *preq,
+					    UNUSED fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
+{
+	couchbase_op_t *op = talloc_get_type_abort(preq, couchbase_op_t);
+
+	if (!op->tracker) return;
+
+	((couchbase_tracker_t *)op->tracker)->op = NULL;
+	op->tracker = NULL;
+}
+
+/** Signal the API client that the operation completed
+ *
+ */
+static void _couchbase_trunk_request_complete(REQUEST *request, void *preq, UNUSED void *rctx, UNUSED void *uctx)
+{
+	couchbase_op_t *op = talloc_get_type_abort(preq, couchbase_op_t);
+
+	if (op->callback) op->callback(request, op, op->rctx);
+}
+
+/** Signal the API client that the operation couldn't be sent, or the connection failed
+ *
+ */
+static void _couchbase_trunk_request_fail(REQUEST *request, void *preq, UNUSED void *rctx,
+					  UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	couchbase_op_t *op = talloc_get_type_abort(preq, couchbase_op_t);
+
+	if (op->error == LCB_SUCCESS) op->error = LCB_NETWORK_ERROR;
+	if (op->callback) op->callback(request, op, op->rctx);
+}
+
+/** Free the operation, and any document that wasn't stolen
+ *
+ */
+static void _couchbase_trunk_request_free(UNUSED REQUEST *request, void *preq, UNUSED void *uctx)
+{
+	couchbase_op_t *op = talloc_get_type_abort(preq, couchbase_op_t);
+
+	talloc_free(op);
+}
+
+/** Allocate a trunk of connections to a Couchbase cluster
+ *
+ * @param[in] ctx		to allocate the trunk in.
+ * @param[in] el		to insert I/O and timer events into.
+ * @param[in] inst		module instance, holding the server, bucket and credentials.
+ * @param[in] tconf		controlling how many connections are opened.
+ * @param[in] log_prefix	to prepend to connection log messages.
+ * @return
+ *	- A new trunk on success.
+ *	- NULL on failure.
+ */
+couchbase_trunk_t *couchbase_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, rlm_couchbase_t const *inst,
+					 fr_trunk_conf_t const *tconf, char const *log_prefix)
+{
+	couchbase_trunk_t	*ctrunk;
+	fr_trunk_conf_t		*our_tconf;
+	fr_trunk_io_funcs_t	io_funcs = {
+					.connection_alloc	= _couchbase_trunk_connection_alloc,
+					.request_mux		= _couchbase_trunk_request_mux,
+					.request_cancel		= _couchbase_trunk_request_cancel,
+					.request_complete	= _couchbase_trunk_request_complete,
+					.request_fail		= _couchbase_trunk_request_fail,
+					.request_free		= _couchbase_trunk_request_free
+				};
+
+	MEM(ctrunk = talloc_zero(ctx, couchbase_trunk_t));
+	ctrunk->inst = inst;
+
+	MEM(our_tconf = talloc_memdup(ctrunk, tconf, sizeof(*tconf)));
+	our_tconf->always_writable = true;
+
+	ctrunk->trunk = fr_trunk_alloc(ctrunk, el, &io_funcs, our_tconf, log_prefix, ctrunk, false);
+	if (!ctrunk->trunk) {
+		talloc_free(ctrunk);
+		return NULL;
+	}
+
+	return ctrunk;
+}
+
+/** Enqueue an operation on a trunk
+ *
+ */
+static couchbase_op_t *couchbase_op_enqueue(couchbase_op_t *op, couchbase_trunk_t *ctrunk, REQUEST *request)
+{
+	switch (fr_trunk_request_enqueue(&op->treq, ctrunk->trunk, request, op, op->rctx)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		return op;
+
+	default:
+		ROPTIONAL(REDEBUG, ERROR, "Failed enqueuing operation for \"%s\"", op->key);
+		talloc_free(op);
+		return NULL;
+	}
+}
+
+/** Retrieve a document
+ *
+ * @param[in] ctx		to allocate the operation in.
+ * @param[in] ctrunk		to enqueue the operation on.
+ * @param[in] request		the document is being retrieved for.
+ * @param[in] key		of the document.  Copied.
+ * @param[in] callback		to call on completion.
+ * @param[in] rctx		to pass to the callback.
+ * @return
+ *	- A new operation on success.  This is freed by the trunk once the callback returns.
+ *	- NULL if the operation couldn't be enqueued.
+ */
+couchbase_op_t *couchbase_trunk_get(TALLOC_CTX *ctx, couchbase_trunk_t *ctrunk, REQUEST *request, char const *key,
+				    couchbase_op_callback_t callback, void *rctx)
+{
+	couchbase_op_t *op;
+
+	MEM(op = talloc_zero(ctx, couchbase_op_t));
+	talloc_set_destructor(op, _couchbase_op_free);
+
+	op->type = COUCHBASE_OP_GET;
+	op->key = talloc_typed_strdup(op, key);
+	op->error = LCB_SUCCESS;
+	op->callback = callback;
+	op->rctx = rctx;
+
+	return couchbase_op_enqueue(op, ctrunk, request);
+}
+
+/** Create or replace a document
+ *
+ * @param[in] ctx		to allocate the operation in.
+ * @param[in] ctrunk		to enqueue the operation on.
+ * @param[in] request		the document is being stored for.
+ * @param[in] key		of the document.  Copied.
+ * @param[in] document		to store.  Copied.
+ * @param[in] expire		Document expiry in seconds, 0 for never.
+ * @param[in] callback		to call on completion.
+ * @param[in] rctx		to pass to the callback.
+ * @return
+ *	- A new operation on success.  This is freed by the trunk once the callback returns.
+ *	- NULL if the operation couldn't be enqueued.
+ */
+couchbase_op_t *couchbase_trunk_set(TALLOC_CTX *ctx, couchbase_trunk_t *ctrunk, REQUEST *request, char const *key,
+				    char const *document, uint32_t expire,
+				    couchbase_op_callback_t callback, void *rctx)
+{
+	couchbase_op_t *op;
+
+	MEM(op = talloc_zero(ctx, couchbase_op_t));
+	talloc_set_destructor(op, _couchbase_op_free);
+
+	op->type = COUCHBASE_OP_SET;
+	op->key = talloc_typed_strdup(op, key);
+	op->document = talloc_typed_strdup(op, document);
+	op->expire = expire;
+	op->error = LCB_SUCCESS;
+	op->callback = callback;
+	op->rctx = rctx;
+
+	return couchbase_op_enqueue(op, ctrunk, request);
+}
+
+/** Cancel an operation which has not yet completed
+ *
+ * The callback will not be called, and the trunk frees the operation.
+ */
+void couchbase_op_cancel(couchbase_op_t *op)
+{
+	if (!op->treq) return;
+
+	fr_trunk_request_signal_cancel(op->treq);
+}
@@ -26,10 +26,16 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
 
 #include <freeradius-devel/server/map_proc.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST *request,
 				fr_value_box_t **key, vp_map_t const *maps);
 
@@ -58,13 +64,33 @@ typedef struct {
 
 	char const     	**field_names;
 	int		*field_offsets; /* field X from the file maps to array entry Y here */
-	rbtree_t	*tree;
-	fr_trie_t	*trie;
+
+	bool		watch;		//!< Reload the file when it changes.
+	bool		mmap;		//!< Map the file, and only index line offsets.
+	CONF_SECTION	*cs;		//!< For logging parse errors.
+	fr_reload_t	*reload;	//!< Publishes the current #rlm_csv_data_t.
 
 	vp_tmpl_t	*key;
 	vp_map_t	*map;		//!< if there is an "update" section in the configuration.
 } rlm_csv_t;
 
+/** The indexed contents of the file
+ *
+ */
+typedef struct {
+	rbtree_t	*tree;
+	fr_trie_t	*trie;		//!< Entries, or with "mmap", line offsets + 1.
+
+	/*
+	 *	With "mmap", rows are only parsed when they match.
+	 */
+	char const	*map;		//!< The file, mapped read only.
+	size_t		map_len;
+	uint64_t	*slots;		//!< Hash table of line offsets + 1.  0 marks an empty slot.
+	uint32_t	*hashes;	//!< Key hash of the line in each slot.
+	size_t		num_slots;	//!< Always a power of 2.
+} rlm_csv_data_t;
+
 typedef struct rlm_csv_entry_s rlm_csv_entry_t;
 struct rlm_csv_entry_s {
 	rlm_csv_entry_t *next;
@@ -83,6 +109,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("index_field", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, rlm_csv_t, index_field_name) },
 	{ FR_CONF_OFFSET("data_type", FR_TYPE_STRING, rlm_csv_t, data_type_name) },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL, rlm_csv_t, key) },
+	{ FR_CONF_OFFSET("watch", FR_TYPE_BOOL, rlm_csv_t, watch), .dflt = "no" },
+	{ FR_CONF_OFFSET("mmap", FR_TYPE_BOOL, rlm_csv_t, mmap), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -97,7 +125,7 @@ static int csv_entry_cmp(void const *one, void const *two)
 /*
  *	Allow for quotation marks.
  */
-static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
+static bool buf2entry(rlm_csv_t const *inst, char *buf, char **out)
 {
 	char *p, *q;
 
@@ -166,21 +194,24 @@ static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
 }
 
 /*
- *	Convert a buffer to a CSV entry
+ *	Split a buffer into a CSV entry
  */
-static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buffer)
+static rlm_csv_entry_t *csv_entry_alloc(TALLOC_CTX *ctx, CONF_SECTION *conf, rlm_csv_t const *inst,
+					int lineno, char *buffer)
 {
 	rlm_csv_entry_t *e;
 	int i;
 	char *p, *q;
 
-	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(inst, uint8_t,
+	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(ctx, uint8_t,
 						     sizeof(*e) + (inst->used_fields * sizeof(e->data[0]))));
 	talloc_set_type(e, rlm_csv_entry_t);
 
 	for (p = buffer, i = 0; p != NULL; p = q, i++) {
 		if (!buf2entry(inst, p, &q)) {
 			cf_log_err(conf, "Malformed entry in file %s line %d", inst->filename, lineno);
+		error:
+			talloc_free(e);
 			return NULL;
 		}
 
@@ -188,7 +219,7 @@ static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno
 
 		if (i >= inst->num_fields) {
 			cf_log_err(conf, "Too many fields at file %s line %d", inst->filename, lineno);
-			return NULL;
+			goto error;
 		}
 
 		/*
@@ -215,24 +246,38 @@ static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno
 
 	if (i < inst->num_fields) {
 		cf_log_err(conf, "Too few fields in file %s at line %d (%d < %d)", inst->filename, lineno, i, inst->num_fields);
-		return NULL;
+		goto error;
 	}
 
+	return e;
+}
+
+/*
+ *	Convert a buffer to a CSV entry, and index it
+ */
+static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t const *inst, rlm_csv_data_t *data,
+				 int lineno, char *buffer)
+{
+	rlm_csv_entry_t *e;
+
+	e = csv_entry_alloc(data, conf, inst, lineno, buffer);
+	if (!e) return NULL;
+
 	if ((inst->data_type == FR_TYPE_IPV4_ADDR) || (inst->data_type == FR_TYPE_IPV4_PREFIX)) {
-		if (fr_trie_insert(inst->trie, &e->key->vb_ip.addr.v4.s_addr, e->key->vb_ip.prefix, e) < 0) {
+		if (fr_trie_insert(data->trie, &e->key->vb_ip.addr.v4.s_addr, e->key->vb_ip.prefix, e) < 0) {
 			cf_log_err(conf, "Failed inserting entry for file %s line %d: %s",
 				   inst->filename, lineno, fr_strerror());
 			return NULL;
 		}
 
 	} else if ((inst->data_type == FR_TYPE_IPV6_ADDR) || (inst->data_type == FR_TYPE_IPV6_PREFIX)) {
-		if (fr_trie_insert(inst->trie, &e->key->vb_ip.addr.v6.s6_addr, e->key->vb_ip.prefix, e) < 0) {
+		if (fr_trie_insert(data->trie, &e->key->vb_ip.addr.v6.s6_addr, e->key->vb_ip.prefix, e) < 0) {
 			cf_log_err(conf, "Failed inserting entry for file %s line %d: %s",
 				   inst->filename, lineno, fr_strerror());
 			return NULL;
 		}
 
-	} else if (!rbtree_insert(inst->tree, e)) {
+	} else if (!rbtree_insert(data->tree, e)) {
 		/*
 		 *	@todo - allow duplicate keys later
 		 */
@@ -244,6 +289,265 @@ static rlm_csv_entry_t *file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno
 	return e;
 }
 
+static int _csv_data_free(rlm_csv_data_t *data)
+{
+	void *map;
+
+	if (!data->map) return 0;
+
+	memcpy(&map, &data->map, sizeof(map)); /* const issues */
+	munmap(map, data->map_len);
+
+	return 0;
+}
+
+/*
+ *	Copy the line at "offset" into a buffer, as fgets() would.
+ */
+static void csv_line(char *buffer, size_t buflen, rlm_csv_data_t const *data, uint64_t offset)
+{
+	char const	*p = data->map + offset;
+	char const	*end = data->map + data->map_len;
+	char const	*nl;
+	size_t		len;
+
+	nl = memchr(p, '\n', end - p);
+	len = nl ? (size_t)(nl - p) + 1 : (size_t)(end - p);
+	if (len >= buflen) len = buflen - 1;
+
+	memcpy(buffer, p, len);
+	buffer[len] = '\0';
+}
+
+/*
+ *	Parse only the key field of a line.  The other fields
+ *	are left alone until the entry is actually used.
+ */
+static int csv_key_parse(TALLOC_CTX *ctx, fr_value_box_t *out, rlm_csv_t const *inst, char *buffer)
+{
+	int	i;
+	char	*p, *q;
+
+	for (p = buffer, i = 0; p != NULL; p = q, i++) {
+		if (!buf2entry(inst, p, &q)) return -1;
+
+		if (q) *(q++) = '\0';
+
+		if (i == inst->index_field) {
+			fr_type_t type = inst->data_type;
+
+			return fr_value_box_from_str(ctx, out, &type, NULL, p, -1, 0, false);
+		}
+	}
+
+	fr_strerror_printf("Too few fields");
+	return -1;
+}
+
+/*
+ *	Hash a key.  Equal keys must hash the same, no matter
+ *	whether they came from the file or from a request.
+ */
+static uint32_t csv_key_hash(fr_value_box_t const *key)
+{
+	char	buffer[256];
+	size_t	len;
+
+	switch (key->type) {
+	case FR_TYPE_STRING:
+		return fr_hash(key->vb_strvalue, key->vb_length);
+
+	case FR_TYPE_OCTETS:
+		return fr_hash(key->vb_octets, key->vb_length);
+
+	default:
+		break;
+	}
+
+	len = fr_value_box_snprint(buffer, sizeof(buffer), key, '\0');
+	if (len >= sizeof(buffer)) len = sizeof(buffer) - 1;
+
+	return fr_hash(buffer, len);
+}
+
+/*
+ *	Find the slot holding a key, or the empty slot where it
+ *	would go.
+ */
+static size_t csv_slot_find(rlm_csv_t const *inst, rlm_csv_data_t const *data,
+			    fr_value_box_t const *key, uint32_t hash)
+{
+	size_t	i, mask = data->num_slots - 1;
+	char	buffer[8192];
+
+	for (i = hash & mask; data->slots[i] != 0; i = (i + 1) & mask) {
+		fr_value_box_t	line_key;
+		int		cmp;
+
+		if (data->hashes[i] != hash) continue;
+
+		memset(&line_key, 0, sizeof(line_key));
+		csv_line(buffer, sizeof(buffer), data, data->slots[i] - 1);
+		if (csv_key_parse(NULL, &line_key, inst, buffer) < 0) continue;
+
+		cmp = fr_value_box_cmp(&line_key, key);
+		fr_value_box_clear(&line_key);
+		if (cmp == 0) break;
+	}
+
+	return i;
+}
+
+/*
+ *	Map the file, and index the offset of each line by its key.
+ *
+ *	Only the index lives in memory, the rest of the line is
+ *	parsed when a request looks it up.
+ */
+static int csv_mmap_index(rlm_csv_t const *inst, rlm_csv_data_t *data, off_t start, int lineno)
+{
+	int		fd;
+	struct stat	st;
+	void		*map;
+	char const	*p, *end;
+	size_t		rows = 0;
+	char		buffer[8192];
+
+	fd = open(inst->filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Error opening filename %s: %s", inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fr_strerror_printf("Error reading filename %s: %s", inst->filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size > start) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			fr_strerror_printf("Error mapping filename %s: %s", inst->filename, fr_syserror(errno));
+			close(fd);
+			return -1;
+		}
+		data->map = map;
+		data->map_len = st.st_size;
+		talloc_set_destructor(data, _csv_data_free);
+	}
+	close(fd);
+
+	end = data->map + data->map_len;
+	for (p = data->map + start; p < end; rows++) {
+		p = memchr(p, '\n', end - p);
+		if (!p) break;
+		p++;
+	}
+
+	if (!data->trie) {
+		data->num_slots = 2;
+		while (data->num_slots < (rows * 2)) data->num_slots <<= 1;
+
+		MEM(data->slots = talloc_zero_array(data, uint64_t, data->num_slots));
+		MEM(data->hashes = talloc_array(data, uint32_t, data->num_slots));
+	}
+
+	for (p = data->map + start; p < end; lineno++) {
+		uint64_t	offset = p - data->map;
+		char const	*nl;
+		fr_value_box_t	key;
+		int		ret;
+
+		nl = memchr(p, '\n', end - p);
+		p = nl ? nl + 1 : end;
+
+		csv_line(buffer, sizeof(buffer), data, offset);
+		if ((buffer[0] == '\n') || ((buffer[0] == '\r') && (buffer[1] == '\n'))) continue;
+
+		memset(&key, 0, sizeof(key));
+		if (csv_key_parse(NULL, &key, inst, buffer) < 0) {
+			cf_log_err(inst->cs, "Failed parsing key field in file %s line %d - %s",
+				   inst->filename, lineno, fr_strerror());
+			continue;
+		}
+
+		switch (inst->data_type) {
+		case FR_TYPE_IPV4_ADDR:
+		case FR_TYPE_IPV4_PREFIX:
+			ret = fr_trie_insert(data->trie, &key.vb_ip.addr.v4.s_addr, key.vb_ip.prefix,
+					     (void *)(uintptr_t)(offset + 1));
+			break;
+
+		case FR_TYPE_IPV6_ADDR:
+		case FR_TYPE_IPV6_PREFIX:
+			ret = fr_trie_insert(data->trie, &key.vb_ip.addr.v6.s6_addr, key.vb_ip.prefix,
+					     (void *)(uintptr_t)(offset + 1));
+			break;
+
+		default:
+		{
+			uint32_t	hash = csv_key_hash(&key);
+			size_t		i;
+
+			i = csv_slot_find(inst, data, &key, hash);
+			if (data->slots[i] != 0) {
+				fr_strerror_printf("duplicate entry");
+				ret = -1;
+				break;
+			}
+			data->slots[i] = offset + 1;
+			data->hashes[i] = hash;
+			ret = 0;
+		}
+			break;
+		}
+		fr_value_box_clear(&key);
+
+		if (ret < 0) {
+			fr_strerror_printf("Failed inserting entry for file %s line %d: %s",
+					   inst->filename, lineno, fr_strerror());
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *	Find the line for a key in the mapped file, and parse it.
+ *
+ *	The caller frees the entry.
+ */
+static rlm_csv_entry_t *csv_mmap_find(TALLOC_CTX *ctx, rlm_csv_t const *inst, rlm_csv_data_t const *data,
+				      fr_value_box_t const *key)
+{
+	uint64_t	offset;
+	char		buffer[8192];
+
+	if (data->trie) {
+		void *found;
+
+		if ((key->type == FR_TYPE_IPV4_ADDR) || (key->type == FR_TYPE_IPV4_PREFIX)) {
+			found = fr_trie_lookup(data->trie, &key->vb_ip.addr.v4.s_addr, key->vb_ip.prefix);
+		} else {
+			found = fr_trie_lookup(data->trie, &key->vb_ip.addr.v6.s6_addr, key->vb_ip.prefix);
+		}
+		if (!found) return NULL;
+
+		offset = (uintptr_t)found - 1;
+	} else {
+		size_t i;
+
+		i = csv_slot_find(inst, data, key, csv_key_hash(key));
+		if (data->slots[i] == 0) return NULL;
+
+		offset = data->slots[i] - 1;
+	}
+
+	csv_line(buffer, sizeof(buffer), data, offset);
+	return csv_entry_alloc(ctx, inst->cs, inst, 0, buffer);
+}
 
 static int fieldname2offset(rlm_csv_t *inst, char const *field_name)
 {
@@ -367,6 +671,101 @@ static int csv_maps_verify(CONF_SECTION *cs, void *mod_inst, UNUSED void *proc_i
 	return 0;
 }
 
+/*
+ *	(Re-)read the entries from the file into memory.
+ *
+ *	Called at startup, and from the reload thread
+ *	when the file changes.
+ */
+static int csv_parse(void **out, void *uctx)
+{
+	rlm_csv_t const	*inst = talloc_get_type_abort_const(uctx, rlm_csv_t);
+	rlm_csv_data_t	*data;
+	FILE		*fp;
+	int		lineno = 1;
+	char		buffer[8192];
+
+	fp = fopen(inst->filename, "r");
+	if (!fp) {
+		fr_strerror_printf("Error opening filename %s: %s", inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	The maps were checked against the field names when
+	 *	the server started, so they can't change.
+	 */
+	if (inst->header) {
+		char *q;
+
+		if (!fgets(buffer, sizeof(buffer), fp) || !(q = strchr(buffer, '\n'))) {
+			fr_strerror_printf("Error reading filename %s: Unexpected EOF", inst->filename);
+			fclose(fp);
+			return -1;
+		}
+		*q = '\0';
+
+		if (strcmp(buffer, inst->fields) != 0) {
+			fr_strerror_printf("Header of %s has changed, the server must be restarted", inst->filename);
+			fclose(fp);
+			return -1;
+		}
+		lineno++;
+	}
+
+	MEM(data = talloc_zero(NULL, rlm_csv_data_t));
+
+	/*
+	 *	@todo - also define data types for each field.  And do
+	 *	type-specific comparisons.
+	 */
+	if ((inst->data_type == FR_TYPE_IPV4_ADDR) || (inst->data_type == FR_TYPE_IPV4_PREFIX) ||
+	    (inst->data_type == FR_TYPE_IPV6_ADDR) || (inst->data_type == FR_TYPE_IPV6_PREFIX)) {
+		MEM(data->trie = fr_trie_alloc(data));
+	} else if (!inst->mmap) {
+		MEM(data->tree = rbtree_talloc_create(data, csv_entry_cmp, rlm_csv_entry_t, NULL, 0));
+	}
+
+	/*
+	 *	Index the rest of the file, and leave it on disk.
+	 */
+	if (inst->mmap) {
+		off_t start = ftello(fp);
+
+		fclose(fp);
+
+		if ((start < 0) || (csv_mmap_index(inst, data, start, lineno) < 0)) {
+			talloc_free(data);
+			return -1;
+		}
+
+		*out = data;
+		return 0;
+	}
+
+	/*
+	 *	Read the rest of the file.
+	 */
+	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+		rlm_csv_entry_t *e;
+
+		e = file2csv(inst->cs, inst, data, lineno, buffer);
+		if (!e) {
+			fr_strerror_printf("Failed parsing %s", inst->filename);
+			talloc_free(data);
+			fclose(fp);
+			return -1;
+		}
+
+		lineno++;
+	}
+
+	fclose(fp);
+
+	*out = data;
+	return 0;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -385,7 +784,6 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	char *q;
 	char *fields;
 	FILE *fp;
-	int lineno;
 	char buffer[8192];
 
 	inst->name = cf_section_name2(conf);
@@ -407,25 +805,14 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	}
 
 	/*
-	 *	@todo - also define data types for each field.  And do
-	 *	type-specific comparisons.
-	 */
-	if ((inst->data_type == FR_TYPE_IPV4_ADDR) || (inst->data_type == FR_TYPE_IPV4_PREFIX) ||
-	    (inst->data_type == FR_TYPE_IPV6_ADDR) || (inst->data_type == FR_TYPE_IPV6_PREFIX)) {
-		MEM(inst->trie = fr_trie_alloc(inst));
-	} else {
-		MEM(inst->tree = rbtree_talloc_create(inst, csv_entry_cmp, rlm_csv_entry_t, NULL, 0));
-	}
-
-	/*
-	 *	Read the file line by line.
+	 *	Open the file to read the header.  The entries
+	 *	are read by csv_parse().
 	 */
 	fp = fopen(inst->filename, "r");
 	if (!fp) {
 		cf_log_err(conf, "Error opening filename %s: %s", inst->filename, fr_syserror(errno));
 		return -1;
 	}
-	lineno = 1;
 
 	/*
 	 *	If there is a header in the file, then read that first.
@@ -449,7 +836,6 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		 *	header from the file.
 		 */
 		inst->fields = talloc_strdup(inst, buffer);
-		lineno++;
 	}
 
 	/*
@@ -561,23 +947,18 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	fclose(fp);
+
 	/*
 	 *	Read the rest of the file.
 	 */
-	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-		rlm_csv_entry_t *e;
-
-		e = file2csv(conf, inst, lineno, buffer);
-		if (!e) {
-			fclose(fp);
-			return -1;
-		}
-
-		lineno++;
+	inst->cs = conf;
+	inst->reload = fr_reload_alloc(inst, inst->name, &inst->filename, 1, inst->watch, csv_parse, inst);
+	if (!inst->reload) {
+		cf_log_perr(conf, "Failed reading %s", inst->filename);
+		return -1;
 	}
 
-	fclose(fp);
-
 	/*
 	 *	And register the map function.
 	 */
@@ -629,6 +1010,19 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 }
 
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  UNUSED fr_event_list_t *el, UNUSED void *thread)
+{
+	rlm_csv_t *inst = instance;
+
+	if (fr_reload_start(inst->reload) < 0) {
+		PERROR("Failed watching %s", inst->filename);
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  *	Convert field X to a VP.
  */
@@ -700,21 +1094,33 @@ static rlm_rcode_t mod_map_apply(rlm_csv_t *inst, REQUEST *request,
 				fr_value_box_t const *key, vp_map_t const *maps)
 {
 	rlm_rcode_t		rcode = RLM_MODULE_UPDATED;
+	rlm_csv_data_t		*data;
 	rlm_csv_entry_t		*e;
 	vp_map_t const		*map;
+	map_batch_t		batch;
 
-	if ((inst->data_type == FR_TYPE_IPV4_ADDR) || (inst->data_type == FR_TYPE_IPV4_PREFIX)) {
-		e = fr_trie_lookup(inst->trie, &key->vb_ip.addr.v4.s_addr, key->vb_ip.prefix);
+	map_batch_init(&batch, request);
+
+	/*
+	 *	The entry is used until the batch is committed.
+	 */
+	data = fr_reload_read_lock(inst->reload);
+
+	if (inst->mmap) {
+		e = csv_mmap_find(request, inst, data, key);
+
+	} else if ((inst->data_type == FR_TYPE_IPV4_ADDR) || (inst->data_type == FR_TYPE_IPV4_PREFIX)) {
+		e = fr_trie_lookup(data->trie, &key->vb_ip.addr.v4.s_addr, key->vb_ip.prefix);
 
 	} else if ((inst->data_type == FR_TYPE_IPV6_ADDR) || (inst->data_type == FR_TYPE_IPV6_PREFIX)) {
-		e = fr_trie_lookup(inst->trie, &key->vb_ip.addr.v6.s6_addr, key->vb_ip.prefix);
+		e = fr_trie_lookup(data->trie, &key->vb_ip.addr.v6.s6_addr, key->vb_ip.prefix);
 
 	} else {
 		rlm_csv_entry_t my_e;
 
 		memcpy(&my_e.key, &key, sizeof(key)); /* const issues */
 
-		e = rbtree_finddata(inst->tree, &my_e);
+		e = rbtree_finddata(data->tree, &my_e);
 	}
 	if (!e) {
 		rcode = RLM_MODULE_NOOP;
@@ -757,7 +1163,7 @@ static rlm_rcode_t mod_map_apply(rlm_csv_t *inst, REQUEST *request,
 		 *	Pass the raw data to the callback, which will
 		 *	create the VP and add it to the map.
 		 */
-		if (map_to_request(request, map, csv_map_getvalue, e->data[field]) < 0) {
+		if (map_batch_add(&batch, map, csv_map_getvalue, e->data[field]) < 0) {
 			REXDENT();
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
@@ -767,6 +1173,10 @@ static rlm_rcode_t mod_map_apply(rlm_csv_t *inst, REQUEST *request,
 	REXDENT();
 
 finish:
+	map_batch_commit(&batch);
+	if (inst->mmap) talloc_free(e);
+	fr_reload_read_unlock(inst->reload);
+
 	return rcode;
 }
 
@@ -860,6 +1270,7 @@ module_t rlm_csv = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 
 	.method_names = (module_method_names_t[]){
 		{ CF_IDENT_ANY, CF_IDENT_ANY,	mod_process },
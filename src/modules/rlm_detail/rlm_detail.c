@@ -27,9 +27,14 @@ RCSID("$Id$")
 #define LOG_PREFIX_ARGS inst->name
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/exfile.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/unlang/module.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/internal/internal.h>
 
 #include <ctype.h>
 #include <fcntl.h>
@@ -45,6 +50,17 @@ RCSID("$Id$")
 
 #define DIRLEN	8192		//!< Maximum path length.
 
+typedef enum {
+	DETAIL_FORMAT_TEXT = 0,		//!< One "Attribute = value" line per attribute.
+	DETAIL_FORMAT_BINARY		//!< Length prefixed records, see lib/server/detail.h.
+} detail_format_t;
+
+static fr_table_num_sorted_t const detail_format_table[] = {
+	{ "binary",	DETAIL_FORMAT_BINARY	},
+	{ "text",	DETAIL_FORMAT_TEXT	}
+};
+static size_t detail_format_table_len = NUM_ELEMENTS(detail_format_table);
+
 /** Instance configuration for rlm_detail
  *
  * Holds the configuration and preparsed data for a instance of rlm_detail.
@@ -66,9 +82,37 @@ typedef struct {
 
 	exfile_t    	*ef;		//!< Log file handler
 
+	size_t		buffer_size;	//!< Per-thread write buffer size, 0 to write every entry immediately.
+	fr_time_delta_t	flush_delay;	//!< Maximum time an entry sits in the buffer.
+	bool		durable;	//!< Only return once entries are on stable storage.
+
+	char const	*format_str;	//!< "text" or "binary".
+	detail_format_t	format;		//!< Parsed from format_str.
+
 	fr_hash_table_t *ht;		//!< Holds suppressed attributes.
 } rlm_detail_t;
 
+typedef struct {
+	exfile_thread_t	*eft;		//!< Buffered file handle, if buffer_size is set.
+	FILE		*fp;		//!< Formats entries into buff.
+	char		*buff;		//!< The entry being formatted.
+	size_t		used;		//!< How much of buff is in use.
+
+	fr_event_list_t	*el;		//!< To run the commit timer in.
+	fr_event_timer_t const *commit_ev;	//!< Armed when requests are waiting for a commit.
+	fr_dlist_head_t	waiting;	//!< Requests waiting for their entries to be durable.
+	bool		failed;		//!< A write failed since the last commit.
+} rlm_detail_thread_t;
+
+/** A request waiting for its entry to reach stable storage
+ *
+ */
+typedef struct {
+	fr_dlist_t	entry;		//!< In the thread's list of waiting requests.
+	REQUEST		*request;	//!< To resume.
+	rlm_rcode_t	rcode;		//!< Result of the commit.
+} detail_waiter_t;
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_detail_t, filename), .dflt = "%A/%{Packet-Src-IP-Address}/detail" },
 	{ FR_CONF_OFFSET("header", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_detail_t, header), .dflt = "%t" },
@@ -77,6 +121,10 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("locking", FR_TYPE_BOOL, rlm_detail_t, locking), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", FR_TYPE_BOOL, rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", FR_TYPE_BOOL, rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_OFFSET("buffer_size", FR_TYPE_SIZE, rlm_detail_t, buffer_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("flush_delay", FR_TYPE_TIME_DELTA, rlm_detail_t, flush_delay), .dflt = "1.0" },
+	{ FR_CONF_OFFSET("durable", FR_TYPE_BOOL, rlm_detail_t, durable), .dflt = "no" },
+	{ FR_CONF_OFFSET("format", FR_TYPE_STRING, rlm_detail_t, format_str), .dflt = "text" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -160,6 +208,17 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		inst->escape_func = rad_filename_make_safe;
 	}
 
+	inst->format = fr_table_value_by_str(detail_format_table, inst->format_str, -1);
+	if ((int) inst->format < 0) {
+		cf_log_err(conf, "Invalid 'format = %s', expected 'text' or 'binary'", inst->format_str);
+		return -1;
+	}
+
+	if (inst->durable && !inst->buffer_size) {
+		cf_log_err(conf, "'durable = yes' requires 'buffer_size' to be set");
+		return -1;
+	}
+
 	inst->ef = module_exfile_init(inst, conf, 256, 30, inst->locking, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err(conf, "Failed creating log file context");
@@ -237,6 +296,76 @@ static void detail_fr_pair_fprint(TALLOC_CTX *ctx, FILE *out, VALUE_PAIR const *
 }
 
 
+/** Write a single binary detail entry to file pointer
+ *
+ * The packet metadata goes in the record header, so the header format and
+ * log_packet_header are not used.
+ */
+static int detail_write_binary(FILE *out, rlm_detail_t const *inst, REQUEST *request, RADIUS_PACKET *packet,
+			       bool compat)
+{
+	fr_detail_binary_hdr_t	hdr;
+	fr_cursor_t		cursor;
+	VALUE_PAIR		*vp;
+	uint8_t			*buff, *p, *end;
+	int			ret = -1;
+
+	if (!packet->vps) {
+		RWDEBUG("Skipping empty packet");
+		return 0;
+	}
+
+	MEM(buff = talloc_array(request, uint8_t, FR_DETAIL_BINARY_MAX_LEN));
+	p = buff + FR_DETAIL_BINARY_HDR_LEN;
+	end = buff + FR_DETAIL_BINARY_MAX_LEN;
+
+	for (vp = fr_cursor_init(&cursor, &packet->vps);
+	     vp;
+	     vp = fr_cursor_current(&cursor)) {
+		ssize_t slen;
+
+		if ((inst->ht && fr_hash_table_finddata(inst->ht, vp->da)) ||
+		    (compat && (vp->da == attr_user_password))) {
+			fr_cursor_next(&cursor);
+			continue;
+		}
+
+		if (p >= end) {
+		too_big:
+			RPERROR("Failed encoding detail entry");
+			goto finish;
+		}
+
+		*p++ = (fr_dict_by_da(vp->da) == request->dict) ? FR_DETAIL_BINARY_DICT_PROTOCOL :
+								  FR_DETAIL_BINARY_DICT_INTERNAL;
+
+		slen = fr_internal_encode_pair(p, end - p, &cursor, NULL);
+		if (slen <= 0) goto too_big;
+		p += slen;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.length = p - buff;
+	hdr.code = packet->code;
+	hdr.timestamp = fr_time_to_unix_time(request->packet->timestamp);
+	hdr.src_ipaddr = packet->src_ipaddr;
+	hdr.dst_ipaddr = packet->dst_ipaddr;
+	hdr.src_port = packet->src_port;
+	hdr.dst_port = packet->dst_port;
+	hdr.protocol = fr_dict_root(request->dict)->attr;
+	fr_detail_binary_hdr_encode(buff, &hdr);
+
+	if (fwrite(buff, p - buff, 1, out) != 1) {
+		RERROR("Failed writing to detail file: %s", fr_syserror(errno));
+		goto finish;
+	}
+	ret = 0;
+
+finish:
+	talloc_free(buff);
+	return ret;
+}
+
 /** Write a single detail entry to file pointer
  *
  * @param[in] out Where to write entry.
@@ -250,6 +379,8 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 	VALUE_PAIR *vp;
 	char timestamp[256];
 
+	if (inst->format == DETAIL_FORMAT_BINARY) return detail_write_binary(out, inst, request, packet, compat);
+
 	if (xlat_eval(timestamp, sizeof(timestamp), request, inst->header, NULL, NULL) < 0) {
 		return -1;
 	}
@@ -377,10 +508,124 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 	return 0;
 }
 
+/*
+ *	Collect entries formatted by detail_write() into the thread's buffer.
+ */
+static ssize_t _detail_buff_write(void *cookie, char const *in, size_t len)
+{
+	rlm_detail_thread_t	*t = talloc_get_type_abort(cookie, rlm_detail_thread_t);
+	size_t			size = talloc_array_length(t->buff);
+
+	if ((t->used + len) > size) {
+		while ((t->used + len) > size) size *= 2;
+		MEM(t->buff = talloc_realloc(t, t->buff, char, size));
+	}
+
+	memcpy(t->buff + t->used, in, len);
+	t->used += len;
+
+	return len;
+}
+
+static rlm_rcode_t detail_durable_resume(UNUSED void *instance, UNUSED void *thread, REQUEST *request, void *rctx)
+{
+	detail_waiter_t	*w = talloc_get_type_abort(rctx, detail_waiter_t);
+	rlm_rcode_t	rcode = w->rcode;
+
+	talloc_free(w);
+
+	if (rcode != RLM_MODULE_OK) REDEBUG("Failed writing entry to stable storage");
+
+	return rcode;
+}
+
+static void detail_durable_signal(UNUSED void *instance, void *thread, UNUSED REQUEST *request,
+				  void *rctx, fr_state_signal_t action)
+{
+	rlm_detail_thread_t	*t = talloc_get_type_abort(thread, rlm_detail_thread_t);
+	detail_waiter_t		*w = talloc_get_type_abort(rctx, detail_waiter_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	fr_dlist_remove(&t->waiting, w);
+	talloc_free(w);
+}
+
+/** Write out and sync everything buffered, then resume the requests waiting for it
+ *
+ * One fdatasync() per file covers every request which arrived since
+ * the last commit.
+ */
+static void _detail_commit_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_detail_thread_t	*t = talloc_get_type_abort(uctx, rlm_detail_thread_t);
+	detail_waiter_t		*w;
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+
+	t->commit_ev = NULL;
+
+	if ((exfile_thread_flush(t->eft, NULL) < 0) || t->failed) rcode = RLM_MODULE_FAIL;
+	t->failed = false;
+
+	while ((w = fr_dlist_head(&t->waiting)) != NULL) {
+		fr_dlist_remove(&t->waiting, w);
+		w->rcode = rcode;
+		unlang_interpret_resumable(w->request);
+	}
+}
+
+/*
+ *	Format the entry in memory, and hand it to the exfile code to be
+ *	written out with other entries.
+ */
+static rlm_rcode_t detail_do_buffered(rlm_detail_t const *inst, rlm_detail_thread_t *t, REQUEST *request,
+				      char const *filename, RADIUS_PACKET *packet, bool compat)
+{
+	struct iovec	vector;
+	int		ret;
+
+	t->used = 0;
+	ret = detail_write(t->fp, inst, request, packet, compat);
+	fflush(t->fp);
+	if (ret < 0) return RLM_MODULE_FAIL;
+
+	vector.iov_base = t->buff;
+	vector.iov_len = t->used;
+
+	if (exfile_thread_writev(t->eft, request, filename, inst->perm, &vector, 1) < 0) {
+		RPERROR("Couldn't write to file %s", filename);
+
+		/*
+		 *	The failure may have been writing out entries
+		 *	for requests which are still waiting.
+		 */
+		t->failed = true;
+		return RLM_MODULE_FAIL;
+	}
+
+	if (inst->durable) {
+		detail_waiter_t *w;
+
+		if (!t->commit_ev &&
+		    (fr_event_timer_in(t, t->el, &t->commit_ev, inst->flush_delay, _detail_commit_timer, t) < 0)) {
+			RPERROR("Failed inserting commit timer");
+			return RLM_MODULE_FAIL;
+		}
+
+		MEM(w = talloc_zero(request, detail_waiter_t));
+		w->request = request;
+		fr_dlist_insert_tail(&t->waiting, w);
+
+		return unlang_module_yield(request, detail_durable_resume, detail_durable_signal, w);
+	}
+
+	return RLM_MODULE_OK;
+}
+
 /*
  *	Do detail, compatible with old accounting
  */
-static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *request,
+static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, void *thread, REQUEST *request,
 					      RADIUS_PACKET *packet, bool compat)
 {
 	int		outfd, dupfd;
@@ -393,7 +638,8 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *req
 	char		*endptr;
 #endif
 
-	rlm_detail_t const *inst = instance;
+	rlm_detail_t const	*inst = instance;
+	rlm_detail_thread_t	*t = talloc_get_type_abort(thread, rlm_detail_thread_t);
 
 	/*
 	 *	Generate the path for the detail file.  Use the same
@@ -406,6 +652,8 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *req
 
 	RDEBUG2("%s expands to %s", inst->filename, buffer);
 
+	if (t->eft) return detail_do_buffered(inst, t, request, buffer, packet, compat);
+
 	outfd = exfile_open(inst->ef, request, buffer, inst->perm);
 	if (outfd < 0) {
 		RPERROR("Couldn't open file %s", buffer);
@@ -460,45 +708,93 @@ skip_group:
 	return RLM_MODULE_OK;
 }
 
+static int _detail_thread_free(rlm_detail_thread_t *t)
+{
+	if (t->fp) fclose(t->fp);
+
+	return 0;
+}
+
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_detail_t		*inst = instance;
+	rlm_detail_thread_t	*t = talloc_get_type_abort(thread, rlm_detail_thread_t);
+	gid_t			gid = -1;
+
+	if (!inst->buffer_size) return 0;
+
+#ifdef HAVE_GRP_H
+	if (inst->group) {
+		char *endptr;
+
+		gid = strtol(inst->group, &endptr, 10);
+		if ((*endptr != '\0') && (rad_getgid(t, &gid, inst->group) < 0)) {
+			cf_log_err(conf, "Unable to find system group '%s'", inst->group);
+			return -1;
+		}
+	}
+#endif
+
+	t->eft = exfile_thread_alloc(t, inst->ef, el, inst->buffer_size, inst->flush_delay, gid);
+	if (!t->eft) {
+		cf_log_err(conf, "Failed creating buffered log file context");
+		return -1;
+	}
+	exfile_thread_durable(t->eft, inst->durable);
+
+	t->el = el;
+	fr_dlist_init(&t->waiting, detail_waiter_t, entry);
+
+	MEM(t->buff = talloc_array(t, char, 1024));
+	t->fp = fopencookie(t, "w", (cookie_io_functions_t){ .write = _detail_buff_write });
+	if (!t->fp) {
+		cf_log_err(conf, "Failed creating detail buffer: %s", fr_syserror(errno));
+		return -1;
+	}
+	talloc_set_destructor(t, _detail_thread_free);
+
+	return 0;
+}
+
 /*
  *	Accounting - write the detail files.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->packet, true);
+	return detail_do(instance, thread, request, request->packet, true);
 }
 
 /*
  *	Incoming Access Request - write the detail files.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->packet, false);
+	return detail_do(instance, thread, request, request->packet, false);
 }
 
 /*
  *	Outgoing Access-Request Reply - write the detail files.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->reply, false);
+	return detail_do(instance, thread, request, request->reply, false);
 }
 
 #ifdef WITH_COA
 /*
  *	Incoming CoA - write the detail files.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_recv_coa(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_recv_coa(void *instance, void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->packet, false);
+	return detail_do(instance, thread, request, request->packet, false);
 }
 
 /*
  *	Outgoing CoA - write the detail files.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_send_coa(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_send_coa(void *instance, void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->reply, false);
+	return detail_do(instance, thread, request, request->reply, false);
 }
 #endif
 
@@ -506,9 +802,9 @@ static rlm_rcode_t CC_HINT(nonnull) mod_send_coa(void *instance, UNUSED void *th
  *	Outgoing Access-Request to home server - write the detail files.
  */
 #ifdef WITH_PROXY
-static rlm_rcode_t CC_HINT(nonnull) mod_pre_proxy(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_pre_proxy(void *instance, void *thread, REQUEST *request)
 {
-	return detail_do(instance, request, request->proxy->packet, false);
+	return detail_do(instance, thread, request, request->proxy->packet, false);
 }
 
 
@@ -528,13 +824,13 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_proxy(void *instance, void *thread,
 		rlm_rcode_t rcode;
 
 		rcode = mod_accounting(instance, thread, request);
-		if (rcode == RLM_MODULE_OK) {
+		if ((rcode == RLM_MODULE_OK) || (rcode == RLM_MODULE_YIELD)) {
 			request->reply->code = FR_CODE_ACCOUNTING_RESPONSE;
 		}
 		return rcode;
 	}
 
-	return detail_do(instance, request, request->proxy->reply, false);
+	return detail_do(instance, thread, request, request->proxy->reply, false);
 }
 #endif
 
@@ -544,8 +840,10 @@ module_t rlm_detail = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "detail",
 	.inst_size	= sizeof(rlm_detail_t),
+	.thread_inst_size	= sizeof(rlm_detail_thread_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
@@ -351,6 +351,11 @@ static void mod_authenticate_cancel(UNUSED void *instance, UNUSED void *thread,
 
 	eap_session = talloc_get_type_abort(rctx, eap_session_t);
 
+	/*
+	 *	Even if the submodule keeps its subrequest,
+	 *	we've no idea what state the subrequest
+	 *	is in, so it has to go.
+	 */
 	(void)fr_cond_assert(request_detach(eap_session->subrequest, true) == 0);
 	TALLOC_FREE(eap_session->subrequest);
 
@@ -375,16 +380,27 @@ static void mod_authenticate_cancel(UNUSED void *instance, UNUSED void *thread,
  *	- RLM_MODULE_HANDLED	if we're done with this round.
  *	- RLM_MODULE_REJECT	if the user should be rejected.
  */
-static rlm_rcode_t mod_authenticate_result(REQUEST *request, UNUSED void *instance, UNUSED void *thread,
+static rlm_rcode_t mod_authenticate_result(REQUEST *request, void *instance, UNUSED void *thread,
 					   eap_session_t *eap_session, rlm_rcode_t result)
 {
+	rlm_eap_t const	*inst = talloc_get_type_abort_const(instance, rlm_eap_t);
 	rlm_rcode_t	rcode;
 
+	/*
+	 *	Park the subrequest until the next round if
+	 *	the submodule wants to keep it.  Its lifetime
+	 *	is already bound to the eap_session, so it's
+	 *	freed if the eap_session is destroyed below.
+	 */
+	if (inst->methods[eap_session->type].submodule->keep_subrequest) {
+		(void)fr_cond_assert(request_detach(eap_session->subrequest, false) == 0);
 	/*
 	 *	Cleanup the subrequest
 	 */
-	(void)fr_cond_assert(request_detach(eap_session->subrequest, true) == 0);
-	TALLOC_FREE(eap_session->subrequest);
+	} else {
+		(void)fr_cond_assert(request_detach(eap_session->subrequest, true) == 0);
+		TALLOC_FREE(eap_session->subrequest);
+	}
 
 	/*
 	 *	The submodule failed.  Die.
@@ -566,6 +582,12 @@ static rlm_rcode_t eap_method_select(rlm_eap_t *inst, UNUSED void *thread, eap_s
 		fr_assert(next < FR_EAP_METHOD_MAX);
 		fr_assert(inst->methods[next].submodule);
 
+		/*
+		 *	A subrequest kept by the previous
+		 *	method is no use to the new one.
+		 */
+		TALLOC_FREE(eap_session->subrequest);
+
 		eap_session->process = inst->methods[next].submodule->session_init;
 		eap_session->type = next;
 		break;
@@ -600,6 +622,7 @@ static rlm_rcode_t eap_method_select(rlm_eap_t *inst, UNUSED void *thread, eap_s
 			REDEBUG2("Client asked for unsupported EAP type %s (%d)", eap_type2name(type->num), type->num);
 			goto is_invalid;
 		}
+		if (eap_session->type != type->num) TALLOC_FREE(eap_session->subrequest);
 		eap_session->type = type->num;
 		break;
 	}
@@ -608,13 +631,47 @@ static rlm_rcode_t eap_method_select(rlm_eap_t *inst, UNUSED void *thread, eap_s
 
 	RDEBUG2("Calling submodule %s", method->submodule->name);
 
+	/*
+	 *	Re-use the subrequest kept from the last round.
+	 *
+	 *	Its session-state and request data stay where
+	 *	they are, instead of being moved into the parent
+	 *	and back again every round.
+	 */
+	if (eap_session->subrequest) {
+		fr_assert(method->submodule->keep_subrequest);
+
+		if (unlang_module_subrequest_reattach(request, eap_session->subrequest) < 0) {
+			RERROR("Failed re-attaching subrequest");
+			TALLOC_FREE(eap_session->subrequest);
+			return RLM_MODULE_FAIL;
+		}
+
+	/*
+	 *	Allocate a subrequest which lives as long as
+	 *	the eap_session.
+	 */
+	} else if (method->submodule->keep_subrequest) {
+		MEM(eap_session->subrequest = unlang_module_subrequest_alloc_detachable(request,
+										      method->submodule->namespace ?
+										      *(method->submodule->namespace) :
+										      request->dict));
+		if (talloc_link_ctx(eap_session, eap_session->subrequest) < 0) {
+			RERROR("Failed binding subrequest to EAP session");
+			(void)request_detach(eap_session->subrequest, true);
+			TALLOC_FREE(eap_session->subrequest);
+			return RLM_MODULE_FAIL;
+		}
+
 	/*
 	 *	Allocate a new subrequest
 	 */
-	MEM(eap_session->subrequest = unlang_module_subrequest_alloc(request,
-								     method->submodule->namespace ?
-								     *(method->submodule->namespace) :
-								     request->dict));
+	} else {
+		MEM(eap_session->subrequest = unlang_module_subrequest_alloc(request,
+									     method->submodule->namespace ?
+									     *(method->submodule->namespace) :
+									     request->dict));
+	}
 
 	if (method->submodule->clone_parent_lists) {
 		if (fr_pair_list_copy(eap_session->subrequest,
@@ -662,7 +719,10 @@ static rlm_rcode_t eap_method_select(rlm_eap_t *inst, UNUSED void *thread, eap_s
 	 */
 	return unlang_module_yield_to_subrequest(&eap_session->submodule_rcode, eap_session->subrequest,
 						 mod_authenticate_result_async, mod_authenticate_cancel,
-						 &(unlang_subrequest_session_t){ .enable = true, .unique_ptr = eap_session },
+						 &(unlang_subrequest_session_t){
+							.enable = !method->submodule->keep_subrequest,
+							.unique_ptr = eap_session
+						 },
 						 eap_session);
 }
 
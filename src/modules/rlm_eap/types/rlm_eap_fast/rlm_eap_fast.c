@@ -448,6 +448,16 @@ error:
 }
 
 
+static rlm_rcode_t CC_HINT(nonnull) mod_process(void *instance, UNUSED void *thread, REQUEST *request);
+
+/** Continue the handshake once an asynchronous crypto operation has completed
+ *
+ */
+static rlm_rcode_t mod_process_resume(void *instance, void *thread, REQUEST *request, UNUSED void *rctx)
+{
+	return mod_process(instance, thread, request);
+}
+
 /*
  *	Do authentication, by letting EAP-TLS do most of the work.
  */
@@ -497,6 +507,13 @@ static rlm_rcode_t mod_process(void *instance, UNUSED void *thread, REQUEST *req
 	case EAP_TLS_HANDLED:
 		return RLM_MODULE_HANDLED;
 
+	/*
+	 *	The handshake is waiting on an asynchronous
+	 *	crypto operation.
+	 */
+	case EAP_TLS_YIELD:
+		return eap_tls_yield(request, eap_session, mod_process_resume);
+
 	/*
 	 *	Handshake is done, proceed with decoding tunneled
 	 *	data.
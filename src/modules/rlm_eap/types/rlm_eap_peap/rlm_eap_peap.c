@@ -121,10 +121,19 @@ static peap_tunnel_t *peap_alloc(TALLOC_CTX *ctx, rlm_eap_peap_t *inst)
 	return t;
 }
 
+static rlm_rcode_t CC_HINT(nonnull) mod_process(void *instance, UNUSED void *thread, REQUEST *request);
+
+/** Continue the handshake once an asynchronous crypto operation has completed
+ *
+ */
+static rlm_rcode_t mod_process_resume(void *instance, void *thread, REQUEST *request, UNUSED void *rctx)
+{
+	return mod_process(instance, thread, request);
+}
+
 /*
  *	Do authentication, by letting EAP-TLS do most of the work.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_process(void *instance, UNUSED void *thread, REQUEST *request);
 static rlm_rcode_t mod_process(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_rcode_t		rcode;
@@ -178,6 +187,13 @@ static rlm_rcode_t mod_process(void *instance, UNUSED void *thread, REQUEST *req
 		 */
 		return RLM_MODULE_HANDLED;
 
+	/*
+	 *	The handshake is waiting on an asynchronous
+	 *	crypto operation.
+	 */
+	case EAP_TLS_YIELD:
+		return eap_tls_yield(request, eap_session, mod_process_resume);
+
 	/*
 	 *	Handshake is done, proceed with decoding tunneled
 	 *	data.
@@ -368,5 +384,7 @@ rlm_eap_submodule_t rlm_eap_peap = {
 	.instantiate	= mod_instantiate,
 
 	.session_init	= mod_session_init,	/* Initialise a new EAP session */
-	.entry_point	= mod_process		/* Process next round of EAP method */
+	.entry_point	= mod_process,		/* Process next round of EAP method */
+
+	.keep_subrequest = true			/* Keep the inner-tunnel request between rounds */
 };
@@ -41,6 +41,41 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
 #include "eap_pwd.h"
 
+#include <openssl/crypto.h>
+#include <pthread.h>
+
+/*
+ *	The largest password element, which is an uncompressed
+ *	point of group 21 (P-521).
+ */
+#define PWE_MAX_LEN	(1 + (2 * 66))
+
+/** A password element derived by an earlier session
+ *
+ */
+typedef struct {
+	char const	*peer_id;			//!< the element was derived for.
+	uint8_t		verifier[SHA256_DIGEST_LENGTH];	//!< HMAC of the password, so we notice if it changes.
+	uint8_t		pwe[PWE_MAX_LEN];		//!< from EC_POINT_point2oct().
+	size_t		pwe_len;
+	fr_dlist_t	entry;				//!< in the LRU list.
+} pwd_cache_entry_t;
+
+/** Password elements shared by all threads
+ *
+ * The token is part of the password element, so the cache only works
+ * if every session sends the same token.  It's changed when the cache
+ * lifetime runs out, and all of the entries are discarded then.
+ */
+typedef struct {
+	pthread_mutex_t	mutex;
+	rbtree_t	*tree;				//!< entries, ordered by peer_id.
+	fr_dlist_head_t	lru;				//!< entries, most recently used first.
+	uint32_t	token;				//!< sent to every peer until expires.
+	fr_time_t	expires;
+	uint8_t		key[SHA256_DIGEST_LENGTH];	//!< for the password verifiers.  Changed with the token.
+} pwd_cache_t;
+
 typedef struct {
     BN_CTX *bnctx;
 
@@ -48,6 +83,10 @@ typedef struct {
     uint32_t	fragment_size;
     char const	*server_id;
     char const	*virtual_server;
+
+    fr_time_delta_t	cache_lifetime;
+    uint32_t		cache_size;
+    pwd_cache_t		*cache;
 } rlm_eap_pwd_t;
 
 #define MPPE_KEY_LEN    32
@@ -57,6 +96,8 @@ static CONF_PARSER submodule_config[] = {
 	{ FR_CONF_OFFSET("group", FR_TYPE_UINT32, rlm_eap_pwd_t, group), .dflt = "19" },
 	{ FR_CONF_OFFSET("fragment_size", FR_TYPE_UINT32, rlm_eap_pwd_t, fragment_size), .dflt = "1020" },
 	{ FR_CONF_OFFSET("server_id", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_eap_pwd_t, server_id) },
+	{ FR_CONF_OFFSET("cache_lifetime", FR_TYPE_TIME_DELTA, rlm_eap_pwd_t, cache_lifetime), .dflt = "0" },
+	{ FR_CONF_OFFSET("cache_size", FR_TYPE_UINT32, rlm_eap_pwd_t, cache_size), .dflt = "1024" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -84,6 +125,141 @@ fr_dict_attr_autoload_t rlm_eap_pwd_dict_attr[] = {
 	{ NULL }
 };
 
+static int pwd_cache_cmp(void const *one, void const *two)
+{
+	pwd_cache_entry_t const *a = one, *b = two;
+
+	return strcmp(a->peer_id, b->peer_id);
+}
+
+/** Scrub the password element, so it doesn't linger in freed memory
+ *
+ */
+static int _pwd_cache_entry_free(pwd_cache_entry_t *entry)
+{
+	OPENSSL_cleanse(entry->verifier, sizeof(entry->verifier));
+	OPENSSL_cleanse(entry->pwe, sizeof(entry->pwe));
+
+	return 0;
+}
+
+static void pwd_cache_entry_delete(pwd_cache_t *cache, pwd_cache_entry_t *entry)
+{
+	fr_dlist_remove(&cache->lru, entry);
+	rbtree_deletebydata(cache->tree, entry);
+	talloc_free(entry);
+}
+
+/** Return the token to send to a new peer, changing it if the cache has expired
+ *
+ */
+static uint32_t pwd_cache_token(rlm_eap_pwd_t const *inst)
+{
+	pwd_cache_t		*cache = inst->cache;
+	pwd_cache_entry_t	*entry;
+	fr_time_t		now = fr_time();
+	uint32_t		token;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (now >= cache->expires) {
+		while ((entry = fr_dlist_head(&cache->lru))) pwd_cache_entry_delete(cache, entry);
+
+		cache->token = fr_rand();
+		fr_rand_buffer(cache->key, sizeof(cache->key));
+		cache->expires = now + inst->cache_lifetime;
+	}
+	token = cache->token;
+	pthread_mutex_unlock(&cache->mutex);
+
+	return token;
+}
+
+/** Find the password element for a peer
+ *
+ * If the peer's password has changed since the element was derived,
+ * the entry is deleted.
+ *
+ * @return
+ *	- the length of the password element.
+ *	- 0 if there's no usable entry.
+ */
+static size_t pwd_cache_find(uint8_t pwe[static PWE_MAX_LEN], rlm_eap_pwd_t const *inst, uint32_t token,
+			     char const *peer_id, char const *password, size_t password_len)
+{
+	pwd_cache_t		*cache = inst->cache;
+	pwd_cache_entry_t	*entry, find = { .peer_id = peer_id };
+	uint8_t			verifier[SHA256_DIGEST_LENGTH];
+	size_t			len = 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (token != cache->token) goto done;
+
+	entry = rbtree_finddata(cache->tree, &find);
+	if (!entry) goto done;
+
+	HMAC(EVP_sha256(), cache->key, sizeof(cache->key), (uint8_t const *)password, password_len, verifier, NULL);
+	if (CRYPTO_memcmp(verifier, entry->verifier, sizeof(verifier)) != 0) {
+		pwd_cache_entry_delete(cache, entry);
+		goto done;
+	}
+
+	fr_dlist_remove(&cache->lru, entry);
+	fr_dlist_insert_head(&cache->lru, entry);
+
+	memcpy(pwe, entry->pwe, entry->pwe_len);
+	len = entry->pwe_len;
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+	OPENSSL_cleanse(verifier, sizeof(verifier));
+
+	return len;
+}
+
+/** Save the password element derived for a peer, evicting the least recently used entry if we're full
+ *
+ */
+static void pwd_cache_insert(rlm_eap_pwd_t const *inst, pwd_session_t *session,
+			     char const *password, size_t password_len)
+{
+	pwd_cache_t		*cache = inst->cache;
+	pwd_cache_entry_t	*entry, find = { .peer_id = session->peer_id };
+	uint8_t			pwe[PWE_MAX_LEN];
+	size_t			pwe_len;
+
+	pwe_len = EC_POINT_point2oct(session->group, session->pwe, POINT_CONVERSION_UNCOMPRESSED,
+				     pwe, sizeof(pwe), inst->bnctx);
+	if (!pwe_len) return;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (session->token != cache->token) goto done;
+
+	entry = rbtree_finddata(cache->tree, &find);
+	if (entry) pwd_cache_entry_delete(cache, entry);
+
+	while (fr_dlist_num_elements(&cache->lru) >= inst->cache_size) {
+		pwd_cache_entry_delete(cache, fr_dlist_tail(&cache->lru));
+	}
+
+	MEM(entry = talloc_zero(cache->tree, pwd_cache_entry_t));
+	talloc_set_destructor(entry, _pwd_cache_entry_free);
+	entry->peer_id = talloc_typed_strdup(entry, session->peer_id);
+	HMAC(EVP_sha256(), cache->key, sizeof(cache->key), (uint8_t const *)password, password_len,
+	     entry->verifier, NULL);
+	memcpy(entry->pwe, pwe, pwe_len);
+	entry->pwe_len = pwe_len;
+
+	if (!rbtree_insert(cache->tree, entry)) {
+		talloc_free(entry);
+		goto done;
+	}
+	fr_dlist_insert_head(&cache->lru, entry);
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+	OPENSSL_cleanse(pwe, sizeof(pwe));
+}
+
 static int send_pwd_request(REQUEST *request, pwd_session_t *session, eap_round_t *eap_round)
 {
 	size_t		len;
@@ -329,11 +505,34 @@ static rlm_rcode_t mod_process(void *instance, UNUSED void *thread, REQUEST *req
 			return RLM_MODULE_FAIL;
 		}
 
+		/*
+		 *	Hunting and pecking is expensive, so use the
+		 *	password element from an earlier session if
+		 *	we have one.
+		 */
+		if (inst->cache) {
+			uint8_t	pwe[PWE_MAX_LEN];
+			size_t	pwe_len;
+
+			pwe_len = pwd_cache_find(pwe, inst, session->token, session->peer_id,
+						 known_good->vp_strvalue, known_good->vp_length);
+			if (pwe_len) {
+				RDEBUG2("Using cached password element");
+				ret = load_password_element(request, session, session->group_num,
+							    pwe, pwe_len, inst->bnctx);
+				OPENSSL_cleanse(pwe, sizeof(pwe));
+				goto have_pwe;
+			}
+		}
+
 		ret = compute_password_element(request, session, session->group_num,
 					       known_good->vp_strvalue, known_good->vp_length,
 					       inst->server_id, strlen(inst->server_id),
 					       session->peer_id, strlen(session->peer_id),
 					       &session->token, inst->bnctx);
+		if ((ret == 0) && inst->cache) pwd_cache_insert(inst, session, known_good->vp_strvalue,
+								known_good->vp_length);
+	have_pwe:
 		if (ephemeral) talloc_list_free(&known_good);
 		if (ret < 0) {
 			REDEBUG("Failed to obtain password element");
@@ -532,7 +731,7 @@ static rlm_rcode_t mod_session_init(void *instance, UNUSED void *thread, REQUEST
 	packet->group_num = htons(session->group_num);
 	packet->random_function = EAP_PWD_DEF_RAND_FUN;
 	packet->prf = EAP_PWD_DEF_PRF;
-	session->token = fr_rand();
+	session->token = inst->cache ? pwd_cache_token(inst) : fr_rand();
 	memcpy(packet->token, (char *)&session->token, 4);
 	packet->prep = EAP_PWD_PREP_NONE;
 	memcpy(packet->identity, inst->server_id, session->out_len - sizeof(pwd_id_packet_t) );
@@ -552,6 +751,14 @@ static int mod_detach(void *arg)
 
 	if (inst->bnctx) BN_CTX_free(inst->bnctx);
 
+	if (inst->cache) {
+		pwd_cache_entry_t *entry;
+
+		while ((entry = fr_dlist_head(&inst->cache->lru))) pwd_cache_entry_delete(inst->cache, entry);
+		pthread_mutex_destroy(&inst->cache->mutex);
+		OPENSSL_cleanse(inst->cache->key, sizeof(inst->cache->key));
+	}
+
 	return 0;
 }
 
@@ -583,6 +790,18 @@ static int mod_instantiate(void *instance, CONF_SECTION *cs)
 		return -1;
 	}
 
+	if (inst->cache_lifetime) {
+		if (!inst->cache_size) {
+			cf_log_err_by_child(cs, "cache_size", "Must be greater than zero when cache_lifetime is set");
+			return -1;
+		}
+
+		MEM(inst->cache = talloc_zero(inst, pwd_cache_t));
+		pthread_mutex_init(&inst->cache->mutex, NULL);
+		MEM(inst->cache->tree = rbtree_talloc_create(inst->cache, pwd_cache_cmp, pwd_cache_entry_t, NULL, 0));
+		fr_dlist_init(&inst->cache->lru, pwd_cache_entry_t, entry);
+	}
+
 	return 0;
 }
 
@@ -32,6 +32,12 @@ RCSID("$Id$")
 #include <freeradius-devel/unlang/compile.h>
 #include <freeradius-devel/unlang/module.h>
 
+static CONF_PARSER vector_cache_config[] = {
+	{ FR_CONF_OFFSET("max_subscribers", FR_TYPE_UINT32, eap_aka_sim_common_conf_t, vector_cache_max_subscribers ), .dflt = "0" },
+	{ FR_CONF_OFFSET("vectors", FR_TYPE_UINT32, eap_aka_sim_common_conf_t, vector_cache_vectors ), .dflt = "9" },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER submodule_config[] = {
 	{ FR_CONF_OFFSET("request_identity", FR_TYPE_UINT32, eap_aka_sim_common_conf_t, request_identity ),
 	  .func = cf_table_parse_uint32, .uctx = &(cf_table_parse_ctx_t){ .table = fr_aka_sim_id_request_table, .len = &fr_aka_sim_id_request_table_len }},
@@ -40,6 +46,7 @@ static CONF_PARSER submodule_config[] = {
 	{ FR_CONF_OFFSET("ephemeral_id_length", FR_TYPE_SIZE, eap_aka_sim_common_conf_t, ephemeral_id_length ), .dflt = "14" },	/* 14 for compatibility */
 	{ FR_CONF_OFFSET("protected_success", FR_TYPE_BOOL, eap_aka_sim_common_conf_t, protected_success ), .dflt = "no" },
 	{ FR_CONF_OFFSET("virtual_server", FR_TYPE_VOID | FR_TYPE_REQUIRED, eap_aka_sim_common_conf_t, virtual_server), .func = virtual_server_cf_parse },
+	{ FR_CONF_POINTER("vector_cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) vector_cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -153,12 +160,24 @@ static int mod_section_compile(eap_aka_sim_actions_t *actions, CONF_SECTION *ser
 	return 0;
 }
 
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	eap_aka_sim_common_conf_t	*inst = talloc_get_type_abort(instance, eap_aka_sim_common_conf_t);
 
 	if (mod_section_compile(&inst->actions, inst->virtual_server) < 0) return -1;
 
+	if (inst->vector_cache_max_subscribers > 0) {
+		FR_INTEGER_BOUND_CHECK("vector_cache.vectors", inst->vector_cache_vectors, >=, 3);
+		FR_INTEGER_BOUND_CHECK("vector_cache.vectors", inst->vector_cache_vectors, <=, 255);
+
+		inst->vector_cache = fr_aka_sim_vector_cache_alloc(inst, inst->vector_cache_max_subscribers,
+								   inst->vector_cache_vectors);
+		if (!inst->vector_cache) {
+			cf_log_err(conf, "Failed allocating triplet cache");
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
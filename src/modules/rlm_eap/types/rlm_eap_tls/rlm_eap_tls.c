@@ -189,6 +189,14 @@ static rlm_rcode_t eap_tls_virtual_server(rlm_eap_tls_t *inst, REQUEST *request,
 	return RLM_MODULE_YIELD;
 }
 
+/** Continue the handshake once an asynchronous crypto operation has completed
+ *
+ */
+static rlm_rcode_t mod_process_resume(void *instance, void *thread, REQUEST *request, UNUSED void *rctx)
+{
+	return mod_process(instance, thread, request);
+}
+
 static rlm_rcode_t mod_process(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	eap_tls_status_t	status;
@@ -226,6 +234,13 @@ static rlm_rcode_t mod_process(void *instance, UNUSED void *thread, REQUEST *req
 	case EAP_TLS_HANDLED:
 		return RLM_MODULE_HANDLED;
 
+	/*
+	 *	The handshake is waiting on an asynchronous
+	 *	crypto operation.
+	 */
+	case EAP_TLS_YIELD:
+		return eap_tls_yield(request, eap_session, mod_process_resume);
+
 	/*
 	 *	Handshake is done, proceed with decoding tunneled
 	 *	data.
@@ -28,7 +28,9 @@ RCSID("$Id$")
 #define LOG_PREFIX_ARGS inst->name
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/exec_pool.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 
 /*
@@ -47,8 +49,18 @@ typedef struct {
 	bool		timeout_is_set;
 
 	vp_tmpl_t	*tmpl;
+
+	fr_exec_pool_conf_t	helper;		//!< Persistent helper processes.
 } rlm_exec_t;
 
+typedef struct {
+	fr_exec_pool_t	*pool;			//!< This thread's helpers.
+} rlm_exec_thread_t;
+
+typedef struct {
+	fr_exec_pool_req_t	*preq;		//!< Request submitted to the helper pool.
+} rlm_exec_helper_rctx_t;
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("wait", FR_TYPE_BOOL, rlm_exec_t, wait), .dflt = "yes" },
 	{ FR_CONF_OFFSET("program", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_exec_t, program) },
@@ -56,6 +68,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("output_pairs", FR_TYPE_STRING, rlm_exec_t, output) },
 	{ FR_CONF_OFFSET("shell_escape", FR_TYPE_BOOL, rlm_exec_t, shell_escape), .dflt = "yes" },
 	{ FR_CONF_OFFSET_IS_SET("timeout", FR_TYPE_TIME_DELTA, rlm_exec_t, timeout) },
+	{ FR_CONF_OFFSET("helper", FR_TYPE_SUBSECTION, rlm_exec_t, helper), .subcs = (void const *) fr_exec_pool_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -281,6 +294,15 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	rlm_exec_t		*inst = instance;
 	ssize_t			slen;
 
+	if (inst->helper.program) {
+		if (fr_exec_pool_conf_check(cf_section_find(conf, "helper", NULL), &inst->helper) < 0) return -1;
+
+		if (!inst->wait) {
+			cf_log_err(conf, "Helpers require 'wait = yes'");
+			return -1;
+		}
+	}
+
 	if (!inst->program) return 0;
 
 	/*
@@ -340,10 +362,161 @@ static rlm_rcode_t mod_resume(void *instance, UNUSED void *thread, REQUEST *requ
 	return RLM_MODULE_OK;
 }
 
+/** Start this thread's helper processes
+ *
+ */
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_exec_t		*inst = instance;
+	rlm_exec_thread_t	*t = talloc_get_type_abort(thread, rlm_exec_thread_t);
+
+	if (!inst->helper.program) return 0;
+
+	t->pool = fr_exec_pool_alloc(t, el, &inst->helper, inst->name);
+	if (!t->pool) {
+		cf_log_perr(conf, "Failed creating helper pool");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void exec_helper_complete(REQUEST *request, UNUSED fr_exec_pool_req_t *preq, UNUSED void *uctx)
+{
+	unlang_interpret_resumable(request);
+}
+
+static void exec_helper_signal(UNUSED void *instance, UNUSED void *thread, UNUSED REQUEST *request,
+			       void *rctx, fr_state_signal_t action)
+{
+	rlm_exec_helper_rctx_t	*hctx = talloc_get_type_abort(rctx, rlm_exec_helper_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	TALLOC_FREE(hctx->preq);
+}
+
+/** Process a helper's reply
+ *
+ * The reply is an rcode name, optionally followed by a list of
+ * attributes to add to the output list, i.e.
+ *
+ *	updated Reply-Message = "Hello", Session-Timeout = 3600
+ */
+static rlm_rcode_t exec_helper_resume(void *instance, UNUSED void *thread, REQUEST *request, void *rctx)
+{
+	rlm_exec_t const	*inst = instance;
+	rlm_exec_helper_rctx_t	*hctx = talloc_get_type_abort(rctx, rlm_exec_helper_rctx_t);
+	uint8_t const		*reply;
+	char const		*p, *q;
+	rlm_rcode_t		rcode;
+
+	switch (fr_exec_pool_req_result(&reply, NULL, hctx->preq)) {
+	case FR_EXEC_POOL_REQ_DONE:
+		break;
+
+	case FR_EXEC_POOL_REQ_TIMEOUT:
+		REDEBUG("Timeout waiting for helper");
+		talloc_free(hctx);
+		return RLM_MODULE_FAIL;
+
+	default:
+		REDEBUG("Helper failed");
+		talloc_free(hctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	RDEBUG2("Helper replied: %s", (char const *)reply);
+
+	p = (char const *)reply;
+	fr_skip_whitespace(p);
+	for (q = p; *q && !isspace((int) *q); q++);
+
+	rcode = fr_table_value_by_substr(rcode_table, p, q - p, RLM_MODULE_UNKNOWN);
+	if (rcode == RLM_MODULE_UNKNOWN) {
+		REDEBUG("Helper reply does not start with a valid rcode");
+		talloc_free(hctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	fr_skip_whitespace(q);
+	if (*q) {
+		VALUE_PAIR **output_pairs, *vps = NULL;
+
+		if (!inst->output) {
+			RWDEBUG("Ignoring attributes from helper as 'output_pairs' is not set");
+			goto done;
+		}
+
+		output_pairs = radius_list(request, inst->output_list);
+		if (!output_pairs) {
+			talloc_free(hctx);
+			return RLM_MODULE_INVALID;
+		}
+
+		if (fr_pair_list_afrom_str(radius_list_ctx(request, inst->output_list),
+					   request->dict, q, &vps) == T_INVALID) {
+			RPEDEBUG("Failed parsing helper reply");
+			talloc_free(hctx);
+			return RLM_MODULE_FAIL;
+		}
+
+		fr_pair_list_tainted(vps);
+		fr_pair_add(output_pairs, vps);
+	}
+
+done:
+	talloc_free(hctx);
+
+	return rcode;
+}
+
+/** Send the input pairs to a helper, and yield until it replies
+ *
+ * The request is a single line of comma separated attributes.
+ */
+static rlm_rcode_t mod_exec_helper(rlm_exec_t const *inst, rlm_exec_thread_t *t, REQUEST *request)
+{
+	rlm_exec_helper_rctx_t	*hctx;
+	char			*line;
+
+	MEM(line = talloc_strdup(request, ""));
+	if (inst->input) {
+		VALUE_PAIR	**input_pairs, *vp;
+		fr_cursor_t	cursor;
+
+		input_pairs = radius_list(request, inst->input_list);
+		if (!input_pairs) {
+			talloc_free(line);
+			return RLM_MODULE_INVALID;
+		}
+
+		for (vp = fr_cursor_init(&cursor, input_pairs);
+		     vp;
+		     vp = fr_cursor_next(&cursor)) {
+			char buffer[1024];
+
+			fr_pair_snprint(buffer, sizeof(buffer), vp);
+			MEM(line = talloc_asprintf_append_buffer(line, "%s%s", *line ? ", " : "", buffer));
+		}
+	}
+
+	MEM(hctx = talloc_zero(request, rlm_exec_helper_rctx_t));
+	hctx->preq = fr_exec_pool_enqueue(hctx, t->pool, request, (uint8_t const *)line, talloc_array_length(line) - 1,
+					  exec_helper_complete, NULL);
+	talloc_free(line);
+	if (!hctx->preq) {
+		talloc_free(hctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, exec_helper_resume, exec_helper_signal, hctx);
+}
+
 /*
  *  Dispatch an exec method
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, void *thread, REQUEST *request)
 {
 	rlm_exec_t const	*inst = instance;
 	rlm_rcode_t		rcode;
@@ -354,6 +527,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, UNUSED voi
 	TALLOC_CTX		*ctx = NULL;
 	char			out[1024];
 
+	if (inst->helper.program) return mod_exec_helper(inst, talloc_get_type_abort(thread, rlm_exec_thread_t), request);
+
 	/*
 	 *	This needs to be a runtime check for now as rlm_exec
 	 *	may be defined with the intent of calling it via xlat
@@ -469,9 +644,11 @@ module_t rlm_exec = {
 	.name		= "exec",
 	.type		= RLM_TYPE_THREAD_SAFE,
 	.inst_size	= sizeof(rlm_exec_t),
+	.thread_inst_size	= sizeof(rlm_exec_thread_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_exec_dispatch,
 		[MOD_AUTHORIZE]		= mod_exec_dispatch,
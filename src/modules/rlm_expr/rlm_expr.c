@@ -154,15 +154,216 @@ static expr_map_t map[] =
 	{0,	TOKEN_LAST}
 };
 
-static bool get_expression(REQUEST *request, char const **string, int64_t *answer, expr_token_t prev);
+/*
+ *	Expressions are parsed into a tree, which can be evaluated
+ *	many times.  Operations on constants are performed as the
+ *	tree is built, so only operations involving attributes
+ *	remain.
+ */
+typedef enum {
+	EXPR_NODE_INTEGER = 0,		//!< A constant.
+	EXPR_NODE_ATTR,			//!< Sum of the values of an attribute.
+	EXPR_NODE_UNARY,		//!< ~ and/or - applied to a child.
+	EXPR_NODE_BINARY		//!< An operator applied to two children.
+} expr_node_type_t;
+
+typedef struct expr_node_s expr_node_t;
+struct expr_node_s {
+	expr_node_type_t	type;
+
+	union {
+		int64_t		value;		//!< For EXPR_NODE_INTEGER.
+
+		vp_tmpl_t	*vpt;		//!< For EXPR_NODE_ATTR.
+
+		struct {
+			bool		invert;		//!< Bitwise inversion, applied first.
+			bool		negative;	//!< Negation.
+			expr_node_t	*child;
+		} unary;			//!< For EXPR_NODE_UNARY.
+
+		struct {
+			expr_token_t	op;
+			expr_node_t	*lhs;
+			expr_node_t	*rhs;
+		} binary;			//!< For EXPR_NODE_BINARY.
+	};
+};
+
+/** Instance data for a call to the expr xlat
+ *
+ */
+typedef struct {
+	expr_node_t const	*tree;		//!< Parsed expression, or NULL if the expression
+						///< contains expansions and must be parsed
+						///< at runtime.
+} rlm_expr_xlat_inst_t;
+
+static bool calc_result(int64_t lhs, expr_token_t op, int64_t rhs, int64_t *answer)
+{
+	switch (op) {
+	default:
+	case TOKEN_SUBTRACT:
+		rhs = -rhs;
+		/* FALL-THROUGH */
+
+	case TOKEN_ADD:
+		if ((rhs > 0) && (lhs > (int64_t) INT64_MAX - rhs)) {
+		overflow:
+			fr_strerror_printf("Numerical overflow in expression!");
+			return false;
+		}
+
+		if ((rhs < 0) && (lhs < (int64_t) INT64_MIN - rhs)) goto overflow;
+
+		*answer = lhs + rhs;
+		break;
+
+	case TOKEN_DIVIDE:
+		if (rhs == 0) {
+			fr_strerror_printf("Division by zero in expression!");
+			return false;
+		}
+
+		*answer = lhs / rhs;
+		break;
+
+	case TOKEN_REMAINDER:
+		if (rhs == 0) {
+			fr_strerror_printf("Division by zero!");
+			return false;
+		}
+
+		*answer = lhs % rhs;
+		break;
+
+	case TOKEN_MULTIPLY:
+		*answer = lhs * rhs;
+		break;
+
+	case TOKEN_LSHIFT:
+		if (rhs > 62) {
+			fr_strerror_printf("Shift must be less than 62 (was %lld)", (long long int) rhs);
+			return false;
+		}
+
+		*answer = lhs << rhs;
+		break;
+
+	case TOKEN_RSHIFT:
+		if (rhs > 62) {
+			fr_strerror_printf("Shift must be less than 62 (was %lld)", (long long int) rhs);
+			return false;
+		}
+
+		*answer = lhs >> rhs;
+		break;
+
+	case TOKEN_AND:
+		*answer = lhs & rhs;
+		break;
+
+	case TOKEN_OR:
+		*answer = lhs | rhs;
+		break;
+
+	case TOKEN_POWER:
+		if (rhs > 63) {
+			fr_strerror_printf("Exponent must be between 0-63 (was %lld)", (long long int) rhs);
+			return false;
+		}
+
+		if (lhs > 65535) {
+			fr_strerror_printf("Base must be between 0-65535 (was %lld)", (long long int) lhs);
+			return false;
+		}
+
+		*answer = fr_pow(lhs, rhs);
+		break;
+	}
+
+	return true;
+}
+
+static inline int64_t calc_unary(int64_t x, bool invert, bool negative)
+{
+	if (invert) x = ~x;
+
+	if (negative) x = -x;
+
+	return x;
+}
+
+static expr_node_t *expr_node_integer(TALLOC_CTX *ctx, int64_t value)
+{
+	expr_node_t *node;
+
+	MEM(node = talloc_zero(ctx, expr_node_t));
+	node->type = EXPR_NODE_INTEGER;
+	node->value = value;
+
+	return node;
+}
+
+/** Apply unary operators to a node, folding them into constants
+ *
+ */
+static expr_node_t *expr_node_unary(TALLOC_CTX *ctx, expr_node_t *child, bool invert, bool negative)
+{
+	expr_node_t *node;
+
+	if (!invert && !negative) return child;
+
+	if (child->type == EXPR_NODE_INTEGER) {
+		child->value = calc_unary(child->value, invert, negative);
+		return child;
+	}
+
+	MEM(node = talloc_zero(ctx, expr_node_t));
+	node->type = EXPR_NODE_UNARY;
+	node->unary.invert = invert;
+	node->unary.negative = negative;
+	node->unary.child = child;
+
+	return node;
+}
 
-static bool get_number(REQUEST *request, char const **string, int64_t *answer)
+/** Apply an operator to two nodes, folding them into a constant if possible
+ *
+ * If the operation fails, i.e. division by zero, the node is left for
+ * the evaluator, so the error is reported against the request.
+ */
+static expr_node_t *expr_node_binary(TALLOC_CTX *ctx, expr_node_t *lhs, expr_token_t op, expr_node_t *rhs)
+{
+	expr_node_t	*node;
+	int64_t		answer;
+
+	if ((lhs->type == EXPR_NODE_INTEGER) && (rhs->type == EXPR_NODE_INTEGER) &&
+	    calc_result(lhs->value, op, rhs->value, &answer)) {
+		talloc_free(rhs);
+		lhs->value = answer;
+		return lhs;
+	}
+
+	MEM(node = talloc_zero(ctx, expr_node_t));
+	node->type = EXPR_NODE_BINARY;
+	node->binary.op = op;
+	node->binary.lhs = lhs;
+	node->binary.rhs = rhs;
+
+	return node;
+}
+
+static bool get_expression(TALLOC_CTX *ctx, expr_node_t **out, fr_dict_t const *dict,
+			   char const **string, expr_token_t prev);
+
+static bool get_number(TALLOC_CTX *ctx, expr_node_t **out, fr_dict_t const *dict, char const **string)
 {
-	int64_t x;
-	bool invert = false;
-	bool negative = false;
-	char const *p = *string;
-	vp_tmpl_t *vpt = NULL;
+	int64_t		x;
+	bool		invert = false;
+	bool		negative = false;
+	char const	*p = *string;
+	expr_node_t	*node;
 
 	/*
 	 *	Look for a number.
@@ -188,6 +389,7 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 
 		x = strtoul(p, &end, 16);
 		p = end;
+		node = expr_node_integer(ctx, x);
 		goto done;
 	}
 
@@ -200,82 +402,26 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 	 *	Look for an attribute.
 	 */
 	if (*p == '&') {
-		int		i, max, err;
 		ssize_t		slen;
-		VALUE_PAIR	*vp;
-		fr_cursor_t	cursor;
+		vp_tmpl_t	*vpt;
 
-		slen = tmpl_afrom_attr_substr(request, NULL, &vpt, p, -1, &(vp_tmpl_rules_t){ .dict_def = request->dict });
+		slen = tmpl_afrom_attr_substr(ctx, NULL, &vpt, p, -1, &(vp_tmpl_rules_t){ .dict_def = dict });
 		if (slen <= 0) {
-			RPEDEBUG("Failed parsing attribute name '%s'", p);
+			fr_strerror_printf_push("Failed parsing attribute name '%s'", p);
 			return false;
 		}
 
-		p += slen;
-
 		if (vpt->tmpl_num == NUM_COUNT) {
-			REDEBUG("Attribute count is not supported");
+			fr_strerror_printf("Attribute count is not supported");
+			talloc_free(vpt);
 			return false;
 		}
 
-		if (vpt->tmpl_num == NUM_ALL) {
-			max = 65535;
-		} else {
-			max = 1;
-		}
-
-		x = 0;
-		for (i = 0, vp = tmpl_cursor_init(&err, &cursor, request, vpt);
-		     (i < max) && (vp != NULL);
-		     i++, vp = fr_cursor_next(&cursor)) {
-			int64_t		y;
-			fr_value_box_t	value;
-
-			if (vp->vp_type != FR_TYPE_UINT64) {
-				if (fr_value_box_cast(vp, &value, FR_TYPE_UINT64, NULL, &vp->data) < 0) {
-					RPEDEBUG("Failed converting &%.*s to an integer value", (int) vpt->len,
-						 vpt->name);
-					return false;
-				}
-				if (value.vb_uint64 > INT64_MAX) {
-				overflow:
-					talloc_free(vpt);
-					REDEBUG("Value of &%.*s (%pV) would overflow a signed 64bit integer "
-						"(our internal arithmetic type)", (int)vpt->len, vpt->name, &value);
-					return false;
-				}
-				y = (int64_t)value.vb_uint64;
-
-				RINDENT();
-				RDEBUG3("&%.*s --> %" PRIu64, (int)vpt->len, vpt->name, y);
-				REXDENT();
-			} else {
-				if (vp->vp_uint64 > INT64_MAX) {
-					/*
-					 *	So we can print out the correct value
-					 *	in the overflow error message.
-					 */
-					fr_value_box_copy(NULL, &value, &vp->data);
-					goto overflow;
-				}
-				y = (int64_t)vp->vp_uint64;
-			}
-
-			/*
-			 *	Check for overflow without actually overflowing.
-			 */
-			if ((y > 0) && (x > (int64_t) INT64_MAX - y)) goto overflow;
-
-			if ((y < 0) && (x < (int64_t) INT64_MIN - y)) goto overflow;
-
-			x += y;
-		} /* loop over all found VPs */
-
-		if (err != 0) {
-			RWDEBUG("Can't find &%.*s.  Using 0 as operand value", (int)vpt->len, vpt->name);
-			goto done;
-		}
+		p += slen;
 
+		MEM(node = talloc_zero(ctx, expr_node_t));
+		node->type = EXPR_NODE_ATTR;
+		node->vpt = talloc_steal(node, vpt);
 		goto done;
 	}
 
@@ -284,10 +430,10 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 	 */
 	if (*p == '(') {
 		p++;
-		if (!get_expression(request, &p, &x, TOKEN_NONE)) return false;
+		if (!get_expression(ctx, &node, dict, &p, TOKEN_NONE)) return false;
 
 		if (*p != ')') {
-			REDEBUG("No trailing ')'");
+			fr_strerror_printf("No trailing ')'");
 			return false;
 		}
 		p++;
@@ -295,7 +441,7 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 	}
 
 	if ((*p < '0') || (*p > '9')) {
-		REDEBUG("Not a number at \"%s\"", p);
+		fr_strerror_printf("Not a number at \"%s\"", p);
 		return false;
 	}
 
@@ -309,106 +455,15 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 		x += (*p - '0');
 		p++;
 	}
+	node = expr_node_integer(ctx, x);
 
 done:
-	if (vpt) talloc_free(vpt);
-
-	if (invert) x = ~x;
-
-	if (negative) x = -x;
-
 	*string = p;
-	*answer = x;
-	return true;
-}
-
-static bool calc_result(REQUEST *request, int64_t lhs, expr_token_t op, int64_t rhs, int64_t *answer)
-{
-	switch (op) {
-	default:
-	case TOKEN_SUBTRACT:
-		rhs = -rhs;
-		/* FALL-THROUGH */
-
-	case TOKEN_ADD:
-		if ((rhs > 0) && (lhs > (int64_t) INT64_MAX - rhs)) {
-		overflow:
-			REDEBUG("Numerical overflow in expression!");
-			return false;
-		}
-
-		if ((rhs < 0) && (lhs < (int64_t) INT64_MIN - rhs)) goto overflow;
-
-		*answer = lhs + rhs;
-		break;
-
-	case TOKEN_DIVIDE:
-		if (rhs == 0) {
-			REDEBUG("Division by zero in expression!");
-			return false;
-		}
-
-		*answer = lhs / rhs;
-		break;
-
-	case TOKEN_REMAINDER:
-		if (rhs == 0) {
-			REDEBUG("Division by zero!");
-			return false;
-		}
-
-		*answer = lhs % rhs;
-		break;
-
-	case TOKEN_MULTIPLY:
-		*answer = lhs * rhs;
-		break;
-
-	case TOKEN_LSHIFT:
-		if (rhs > 62) {
-			REDEBUG("Shift must be less than 62 (was %lld)", (long long int) rhs);
-			return false;
-		}
-
-		*answer = lhs << rhs;
-		break;
-
-	case TOKEN_RSHIFT:
-		if (rhs > 62) {
-			REDEBUG("Shift must be less than 62 (was %lld)", (long long int) rhs);
-			return false;
-		}
-
-		*answer = lhs >> rhs;
-		break;
-
-	case TOKEN_AND:
-		*answer = lhs & rhs;
-		break;
-
-	case TOKEN_OR:
-		*answer = lhs | rhs;
-		break;
-
-	case TOKEN_POWER:
-		if (rhs > 63) {
-			REDEBUG("Exponent must be between 0-63 (was %lld)", (long long int) rhs);
-			return false;
-		}
-
-		if (lhs > 65535) {
-			REDEBUG("Base must be between 0-65535 (was %lld)", (long long int) lhs);
-			return false;
-		}
-
-		*answer = fr_pow(lhs, rhs);
-		break;
-	}
-
+	*out = expr_node_unary(ctx, node, invert, negative);
 	return true;
 }
 
-static bool get_operator(REQUEST *request, char const **string, expr_token_t *op)
+static bool get_operator(char const **string, expr_token_t *op)
 {
 	int		i;
 	char const	*p = *string;
@@ -436,21 +491,21 @@ static bool get_operator(REQUEST *request, char const **string, expr_token_t *op
 		return true;
 	}
 
-	REDEBUG("Expected operator at \"%s\"", p);
+	fr_strerror_printf("Expected operator at \"%s\"", p);
 
 	return false;
 }
 
-
-static bool get_expression(REQUEST *request, char const **string, int64_t *answer, expr_token_t prev)
+static bool get_expression(TALLOC_CTX *ctx, expr_node_t **out, fr_dict_t const *dict,
+			   char const **string, expr_token_t prev)
 {
-	int64_t		lhs, rhs;
+	expr_node_t	*lhs, *rhs;
 	char const 	*p, *op_p;
 	expr_token_t	this;
 
 	p = *string;
 
-	if (!get_number(request, &p, &lhs)) return false;
+	if (!get_number(ctx, &lhs, dict, &p)) return false;
 
 redo:
 	fr_skip_whitespace(p);
@@ -459,7 +514,7 @@ redo:
 	 *	A number by itself is OK.
 	 */
 	if (!*p || (*p == ')')) {
-		*answer = lhs;
+		*out = lhs;
 		*string = p;
 		return true;
 	}
@@ -468,7 +523,7 @@ redo:
 	 *	Peek at the operator.
 	 */
 	op_p = p;
-	if (!get_operator(request, &p, &this)) return false;
+	if (!get_operator(&p, &this)) return false;
 
 	/*
 	 *	a + b + c ... = (a + b) + c ...
@@ -478,7 +533,7 @@ redo:
 	 *	care of continuing.
 	 */
 	if (precedence[this] <= precedence[prev]) {
-		*answer = lhs;
+		*out = lhs;
 		*string = op_p;
 		return true;
 	}
@@ -486,22 +541,176 @@ redo:
 	/*
 	 *	a + b * c ... = a + (b * c) ...
 	 */
-	if (!get_expression(request, &p, &rhs, this)) return false;
-
-	if (!calc_result(request, lhs, this, rhs, answer)) return false;
+	if (!get_expression(ctx, &rhs, dict, &p, this)) return false;
 
 	/*
-	 *	There may be more to calculate.  The answer we
-	 *	calculated here is now the LHS of the lower priority
+	 *	There may be more to calculate.  The node we
+	 *	built here is now the LHS of the lower priority
 	 *	operation which follows the current expression.  e.g.
 	 *
 	 *	a * b + c ... = (a * b) + c ...
 	 *	              =       d + c ...
 	 */
-	lhs = *answer;
+	lhs = expr_node_binary(ctx, lhs, this, rhs);
 	goto redo;
 }
 
+/** Parse an expression into a tree
+ *
+ * @param[in] ctx	to allocate the tree in.  Partially built trees
+ *			are left in ctx on error.
+ * @param[out] out	Root of the tree.
+ * @param[in] dict	to resolve unqualified attribute references in.
+ *			NULL searches all dictionaries.
+ * @param[in] fmt	Expression to parse.
+ * @return
+ *	- true on success.
+ *	- false on error, with the error available via fr_strerror().
+ */
+static bool expr_parse(TALLOC_CTX *ctx, expr_node_t **out, fr_dict_t const *dict, char const *fmt)
+{
+	char const *p = fmt;
+
+	if (!get_expression(ctx, out, dict, &p, TOKEN_NONE)) return false;
+
+	if (*p) {
+		fr_strerror_printf("Invalid text after expression: %s", p);
+		return false;
+	}
+
+	return true;
+}
+
+/** Sum the values of an attribute
+ *
+ */
+static bool expr_eval_attr(REQUEST *request, vp_tmpl_t const *vpt, int64_t *answer)
+{
+	int		i, max, err;
+	int64_t		x = 0;
+	VALUE_PAIR	*vp;
+	fr_cursor_t	cursor;
+
+	if (vpt->tmpl_num == NUM_ALL) {
+		max = 65535;
+	} else {
+		max = 1;
+	}
+
+	for (i = 0, vp = tmpl_cursor_init(&err, &cursor, request, vpt);
+	     (i < max) && (vp != NULL);
+	     i++, vp = fr_cursor_next(&cursor)) {
+		int64_t		y;
+		fr_value_box_t	value;
+
+		if (vp->vp_type != FR_TYPE_UINT64) {
+			if (fr_value_box_cast(vp, &value, FR_TYPE_UINT64, NULL, &vp->data) < 0) {
+				RPEDEBUG("Failed converting &%.*s to an integer value", (int) vpt->len,
+					 vpt->name);
+				return false;
+			}
+			if (value.vb_uint64 > INT64_MAX) {
+			overflow:
+				REDEBUG("Value of &%.*s (%pV) would overflow a signed 64bit integer "
+					"(our internal arithmetic type)", (int)vpt->len, vpt->name, &value);
+				return false;
+			}
+			y = (int64_t)value.vb_uint64;
+
+			RINDENT();
+			RDEBUG3("&%.*s --> %" PRIu64, (int)vpt->len, vpt->name, y);
+			REXDENT();
+		} else {
+			if (vp->vp_uint64 > INT64_MAX) {
+				/*
+				 *	So we can print out the correct value
+				 *	in the overflow error message.
+				 */
+				fr_value_box_copy(NULL, &value, &vp->data);
+				goto overflow;
+			}
+			y = (int64_t)vp->vp_uint64;
+		}
+
+		/*
+		 *	Check for overflow without actually overflowing.
+		 */
+		if ((y > 0) && (x > (int64_t) INT64_MAX - y)) goto overflow;
+
+		if ((y < 0) && (x < (int64_t) INT64_MIN - y)) goto overflow;
+
+		x += y;
+	} /* loop over all found VPs */
+
+	if (err != 0) RWDEBUG("Can't find &%.*s.  Using 0 as operand value", (int)vpt->len, vpt->name);
+
+	*answer = x;
+	return true;
+}
+
+/** Evaluate a parsed expression
+ *
+ */
+static bool expr_eval(REQUEST *request, expr_node_t const *node, int64_t *answer)
+{
+	int64_t lhs, rhs;
+
+	switch (node->type) {
+	case EXPR_NODE_INTEGER:
+		*answer = node->value;
+		return true;
+
+	case EXPR_NODE_ATTR:
+		return expr_eval_attr(request, node->vpt, answer);
+
+	case EXPR_NODE_UNARY:
+		if (!expr_eval(request, node->unary.child, &lhs)) return false;
+
+		*answer = calc_unary(lhs, node->unary.invert, node->unary.negative);
+		return true;
+
+	case EXPR_NODE_BINARY:
+		if (!expr_eval(request, node->binary.lhs, &lhs) ||
+		    !expr_eval(request, node->binary.rhs, &rhs)) return false;
+
+		if (!calc_result(lhs, node->binary.op, rhs, answer)) {
+			RPEDEBUG("Failed evaluating expression");
+			return false;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+/** Parse expressions which don't need expanding once, when the server starts
+ *
+ * Attribute references are resolved against all dictionaries.
+ */
+static int expr_xlat_instantiate(void *xlat_inst, xlat_exp_t const *exp, UNUSED void *uctx)
+{
+	rlm_expr_xlat_inst_t	*inst = xlat_inst;
+	TALLOC_CTX		*pool;
+	char			*fmt;
+	expr_node_t		*tree;
+
+	fmt = xlat_func_arg_constant(NULL, exp);
+	if (!fmt) return 0;
+
+	MEM(pool = talloc_new(inst));
+	if (!expr_parse(pool, &tree, NULL, fmt)) {
+		PERROR("Invalid expression \"%s\"", fmt);
+		talloc_free(pool);
+		talloc_free(fmt);
+		return -1;
+	}
+	talloc_free(fmt);
+
+	inst->tree = tree;
+
+	return 0;
+}
+
 /** Xlat expressions
  *
  * Example (NAS-Port = 1):
@@ -511,26 +720,52 @@ redo:
  *
  * @ingroup xlat_functions
  */
-static ssize_t expr_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
-			 UNUSED void const *mod_inst, UNUSED void const *xlat_inst,
-			 REQUEST *request, char const *fmt)
+static xlat_action_t expr_xlat(TALLOC_CTX *ctx, fr_cursor_t *out, REQUEST *request,
+			       void const *xlat_inst, UNUSED void *xlat_thread_inst,
+			       fr_value_box_t **in)
 {
-	int64_t		result;
-	char const 	*p;
+	rlm_expr_xlat_inst_t const	*inst = xlat_inst;
+	expr_node_t			*tree;
+	TALLOC_CTX			*pool = NULL;
+	int64_t				result;
+	fr_value_box_t			*vb;
+
+	if (inst->tree) {
+		if (!expr_eval(request, inst->tree, &result)) return XLAT_ACTION_FAIL;
+		goto done;
+	}
 
-	p = fmt;
+	/*
+	 *	The expression contained expansions,
+	 *	so it has to be parsed every time.
+	 */
+	if (!*in) {
+		REDEBUG("Missing expression");
+		return XLAT_ACTION_FAIL;
+	}
 
-	if (!get_expression(request, &p, &result, TOKEN_NONE)) {
-		return -1;
+	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
+		RPEDEBUG("Failed concatenating input");
+		return XLAT_ACTION_FAIL;
 	}
 
-	if (*p) {
-		REDEBUG("Invalid text after expression: %s", p);
-		return -1;
+	MEM(pool = talloc_new(request));
+	if (!expr_parse(pool, &tree, request->dict, (*in)->vb_strvalue)) {
+		RPEDEBUG("Invalid expression");
+	error:
+		talloc_free(pool);
+		return XLAT_ACTION_FAIL;
 	}
 
-	snprintf(*out, outlen, "%lld", (long long int) result);
-	return strlen(*out);
+	if (!expr_eval(request, tree, &result)) goto error;
+	talloc_free(pool);
+
+done:
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_INT64, NULL, false));
+	vb->vb_int64 = result;
+	fr_cursor_append(out, vb);
+
+	return XLAT_ACTION_DONE;
 }
 
 /*
@@ -545,14 +780,16 @@ static ssize_t expr_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
  */
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
-	rlm_expr_t *inst = instance;
+	rlm_expr_t	*inst = instance;
+	xlat_t const	*xlat;
 
 	inst->xlat_name = cf_section_name2(conf);
 	if (!inst->xlat_name) {
 		inst->xlat_name = cf_section_name1(conf);
 	}
 
-	xlat_register(inst, inst->xlat_name, expr_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, true);
+	xlat = xlat_async_register(inst, inst->xlat_name, expr_xlat);
+	xlat_async_instantiate_set(xlat, expr_xlat_instantiate, rlm_expr_xlat_inst_t, NULL, NULL);
 
 	return 0;
 }
@@ -27,43 +27,44 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/pairmove.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/server/users_file.h>
 
 #include <ctype.h>
 #include <fcntl.h>
 
+/** The indexed contents of every configured file
+ *
+ * Replaced as a whole when any of the files change.
+ */
+typedef struct {
+	pairlist_db_t *common;
+	pairlist_db_t *users;		/* autz */
+	pairlist_db_t *auth_users;	/* authenticate */
+	pairlist_db_t *acct_users;	/* preacct */
+#ifdef WITH_PROXY
+	pairlist_db_t *preproxy_users;	/* pre-proxy */
+	pairlist_db_t *postproxy_users;	/* post-proxy */
+#endif
+	pairlist_db_t *postauth_users;	/* post-authenticate */
+} rlm_files_data_t;
+
 typedef struct {
+	char const *name;
 	vp_tmpl_t *key;
+	bool watch;			//!< Reload the files when they change.
 
 	char const *filename;
-	rbtree_t *common;
-
-	/* autz */
 	char const *usersfile;
-	rbtree_t *users;
-
-
-	/* authenticate */
 	char const *auth_usersfile;
-	rbtree_t *auth_users;
-
-	/* preacct */
 	char const *acct_usersfile;
-	rbtree_t *acct_users;
-
 #ifdef WITH_PROXY
-	/* pre-proxy */
 	char const *preproxy_usersfile;
-	rbtree_t *preproxy_users;
-
-	/* post-proxy */
 	char const *postproxy_usersfile;
-	rbtree_t *postproxy_users;
 #endif
-
-	/* post-authenticate */
 	char const *postauth_usersfile;
-	rbtree_t *postauth_users;
+
+	fr_reload_t *reload;		//!< Publishes the current #rlm_files_data_t.
 } rlm_files_t;
 
 static fr_dict_t const *dict_freeradius;
@@ -107,26 +108,20 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("auth_usersfile", FR_TYPE_FILE_INPUT, rlm_files_t, auth_usersfile) },
 	{ FR_CONF_OFFSET("postauth_usersfile", FR_TYPE_FILE_INPUT, rlm_files_t, postauth_usersfile) },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL | FR_TYPE_NOT_EMPTY, rlm_files_t, key), .dflt = "%{%{Stripped-User-Name}:-%{User-Name}}", .quote = T_DOUBLE_QUOTED_STRING },
+	{ FR_CONF_OFFSET("watch", FR_TYPE_BOOL, rlm_files_t, watch), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
 
-static int pairlist_cmp(void const *a, void const *b)
-{
-	return strcmp(((PAIR_LIST const *)a)->name, ((PAIR_LIST const *)b)->name);
-}
-
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
+static int getusersfile(TALLOC_CTX *ctx, char const *filename, pairlist_db_t **pdb)
 {
 	int rcode;
 	VALUE_PAIR *vp;
 	PAIR_LIST *users = NULL;
-	PAIR_LIST *entry, *next;
-	PAIR_LIST *user_list, *default_list, **default_tail;
-	rbtree_t *tree;
+	PAIR_LIST *entry;
 
 	if (!filename) {
-		*ptree = NULL;
+		*pdb = NULL;
 		return 0;
 	}
 
@@ -205,93 +200,36 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree)
 		entry = entry->next;
 	}
 
-	tree = rbtree_create(ctx, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
-	if (!tree) {
-		pairlist_free(&users);
-		return -1;
-	}
-
-	default_list = NULL;
-	default_tail = &default_list;
-
 	/*
 	 *	We've read the entries in linearly, but putting them
 	 *	into an indexed data structure would be much faster.
 	 *	Let's go fix that now.
 	 */
-	for (entry = users; entry != NULL; entry = next) {
-		/*
-		 *	Remove this entry from the input list.
-		 */
-		next = entry->next;
-		entry->next = NULL;
-
-		/*
-		 *	DEFAULT entries get their own list.
-		 */
-		if (strcmp(entry->name, "DEFAULT") == 0) {
-			if (!default_list) {
-				default_list = entry;
-
-				/*
-				 *	Insert the first DEFAULT into the tree.
-				 */
-				if (!rbtree_insert(tree, entry)) {
-				error:
-					pairlist_free(&entry);
-					pairlist_free(&next);
-					talloc_free(tree);
-					return -1;
-				}
-
-			} else {
-				/*
-				 *	Tack this entry onto the tail
-				 *	of the DEFAULT list.
-				 */
-				*default_tail = entry;
-			}
-
-			default_tail = &entry->next;
-			continue;
-		}
-
-		/*
-		 *	Not DEFAULT, must be a normal user.
-		 */
-		user_list = rbtree_finddata(tree, entry);
-		if (!user_list) {
-			/*
-			 *	Insert the first one.
-			 */
-			if (!rbtree_insert(tree, entry)) goto error;
-		} else {
-			/*
-			 *	Find the tail of this list, and add it
-			 *	there.
-			 */
-			while (user_list->next) user_list = user_list->next;
-
-			user_list->next = entry;
-		}
+	if (pairlist_db_alloc(ctx, pdb, &users) < 0) {
+		pairlist_free(&users);
+		return -1;
 	}
 
-	*ptree = tree;
-
 	return 0;
 }
 
 
 
 /*
- *	(Re-)read the "users" file into memory.
+ *	(Re-)read the "users" files into memory.
+ *
+ *	Called at startup, and from the reload thread
+ *	when any of the files change.
  */
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+static int files_parse(void **out, void *uctx)
 {
-	rlm_files_t *inst = instance;
+	rlm_files_t const *inst = talloc_get_type_abort_const(uctx, rlm_files_t);
+	rlm_files_data_t *data;
+
+	MEM(data = talloc_zero(NULL, rlm_files_data_t));
 
 #undef READFILE
-#define READFILE(_x, _y) do { if (getusersfile(inst, inst->_x, &inst->_y) != 0) { ERROR("Failed reading %s", inst->_x); return -1;} } while (0)
+#define READFILE(_x, _y) do { if (getusersfile(data, inst->_x, &data->_y) != 0) { fr_strerror_printf("Failed reading %s", inst->_x); talloc_free(data); return -1;} } while (0)
 
 	READFILE(filename, common);
 	READFILE(usersfile, users);
@@ -305,63 +243,88 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
 	READFILE(auth_usersfile, auth_users);
 	READFILE(postauth_usersfile, postauth_users);
 
+	*out = data;
+	return 0;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_files_t *inst = instance;
+	char const *filenames[7];
+	size_t num_files = 0;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+#undef WATCHFILE
+#define WATCHFILE(_x) do { if (inst->_x) filenames[num_files++] = inst->_x; } while (0)
+
+	WATCHFILE(filename);
+	WATCHFILE(usersfile);
+	WATCHFILE(acct_usersfile);
+
+#ifdef WITH_PROXY
+	WATCHFILE(preproxy_usersfile);
+	WATCHFILE(postproxy_usersfile);
+#endif
+
+	WATCHFILE(auth_usersfile);
+	WATCHFILE(postauth_usersfile);
+
+	inst->reload = fr_reload_alloc(inst, inst->name, filenames, num_files, inst->watch, files_parse, inst);
+	if (!inst->reload) {
+		PERROR("Failed reading users files");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  UNUSED fr_event_list_t *el, UNUSED void *thread)
+{
+	rlm_files_t *inst = instance;
+
+	if (fr_reload_start(inst->reload) < 0) {
+		PERROR("Failed watching users files");
+		return -1;
+	}
+
 	return 0;
 }
 
 /*
  *	Common code called by everything below.
  */
-static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char const *filename, rbtree_t *tree,
+static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char const *filename, pairlist_db_t *db,
 			       RADIUS_PACKET *packet, RADIUS_PACKET *reply)
 {
-	char const	*name;
-	VALUE_PAIR	*check_tmp = NULL;
-	VALUE_PAIR	*reply_tmp = NULL;
-	PAIR_LIST const *user_pl, *default_pl;
-	bool		found = false;
-	PAIR_LIST	my_pl;
-	char		buffer[256];
+	char const		*name;
+	VALUE_PAIR		*check_tmp = NULL;
+	VALUE_PAIR		*reply_tmp = NULL;
+	PAIR_LIST const		*pl;
+	pairlist_db_cursor_t	pl_cursor;
+	bool			found = false;
+	char			buffer[256];
 
 	if (tmpl_expand(&name, buffer, sizeof(buffer), request, inst->key, NULL, NULL) < 0) {
 		REDEBUG("Failed expanding key %s", inst->key->name);
 		return RLM_MODULE_FAIL;
 	}
 
-	if (!tree) return RLM_MODULE_NOOP;
-
-	my_pl.name = name;
-	user_pl = rbtree_finddata(tree, &my_pl);
-	my_pl.name = "DEFAULT";
-	default_pl = rbtree_finddata(tree, &my_pl);
+	if (!db) return RLM_MODULE_NOOP;
 
 	/*
-	 *	Find the entry for the user.
+	 *	Find the entry for the user.  The entries for the
+	 *	user, and the DEFAULT entries, are returned in file
+	 *	order.  DEFAULT entries which the index says can't
+	 *	match aren't returned.
 	 */
-	while (user_pl || default_pl) {
+	for (pl = pairlist_db_cursor_init(request, &pl_cursor, db, name, packet->vps);
+	     pl;
+	     pl = pairlist_db_cursor_next(&pl_cursor)) {
 		fr_cursor_t cursor;
 		VALUE_PAIR *vp;
-		PAIR_LIST const *pl;
-
-		/*
-		 *	Figure out which entry to match on.
-		 */
-
-		if (!default_pl && user_pl) {
-			pl = user_pl;
-			user_pl = user_pl->next;
-
-		} else if (!user_pl && default_pl) {
-			pl = default_pl;
-			default_pl = default_pl->next;
-
-		} else if (user_pl->order < default_pl->order) {
-			pl = user_pl;
-			user_pl = user_pl->next;
-
-		} else {
-			pl = default_pl;
-			default_pl = default_pl->next;
-		}
 
 		MEM(fr_pair_list_copy(request, &check_tmp, pl->check) >= 0);
 		for (vp = fr_cursor_init(&cursor, &check_tmp);
@@ -391,8 +354,16 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 			 *	Fallthrough?
 			 */
 			if (!fall_through(pl->reply)) break;
+			continue;
 		}
+
+		/*
+		 *	Don't let the check items of an entry
+		 *	which didn't match leak into the next.
+		 */
+		fr_pair_list_free(&check_tmp);
 	}
+	pairlist_db_cursor_free(&pl_cursor);
 
 	/*
 	 *	Remove server internal parameters.
@@ -419,10 +390,15 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_data_t const *data = fr_reload_read_lock(inst->reload);
+	rlm_rcode_t rcode;
+
+	rcode = file_common(inst, request, inst->filename,
+			    data->users ? data->users : data->common,
+			    request->packet, request->reply);
+	fr_reload_read_unlock(inst->reload);
 
-	return file_common(inst, request, inst->filename,
-			   inst->users ? inst->users : inst->common,
-			   request->packet, request->reply);
+	return rcode;
 }
 
 
@@ -434,48 +410,73 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 static rlm_rcode_t CC_HINT(nonnull) mod_preacct(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_data_t const *data = fr_reload_read_lock(inst->reload);
+	rlm_rcode_t rcode;
 
-	return file_common(inst, request, inst->acct_usersfile,
-			   inst->acct_users ? inst->acct_users : inst->common,
-			   request->packet, request->reply);
+	rcode = file_common(inst, request, inst->acct_usersfile,
+			    data->acct_users ? data->acct_users : data->common,
+			    request->packet, request->reply);
+	fr_reload_read_unlock(inst->reload);
+
+	return rcode;
 }
 
 #ifdef WITH_PROXY
 static rlm_rcode_t CC_HINT(nonnull) mod_pre_proxy(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_data_t const *data = fr_reload_read_lock(inst->reload);
+	rlm_rcode_t rcode;
+
+	rcode = file_common(inst, request, inst->preproxy_usersfile,
+			    data->preproxy_users ? data->preproxy_users : data->common,
+			    request->packet, request->proxy->packet);
+	fr_reload_read_unlock(inst->reload);
 
-	return file_common(inst, request, inst->preproxy_usersfile,
-			   inst->preproxy_users ? inst->preproxy_users : inst->common,
-			   request->packet, request->proxy->packet);
+	return rcode;
 }
 
 static rlm_rcode_t CC_HINT(nonnull) mod_post_proxy(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_data_t const *data = fr_reload_read_lock(inst->reload);
+	rlm_rcode_t rcode;
+
+	rcode = file_common(inst, request, inst->postproxy_usersfile,
+			    data->postproxy_users ? data->postproxy_users : data->common,
+			    request->proxy->reply, request->reply);
+	fr_reload_read_unlock(inst->reload);
 
-	return file_common(inst, request, inst->postproxy_usersfile,
-			   inst->postproxy_users ? inst->postproxy_users : inst->common,
-			   request->proxy->reply, request->reply);
+	return rcode;
 }
 #endif
 
 static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_data_t const *data = fr_reload_read_lock(inst->reload);
+	rlm_rcode_t rcode;
 
-	return file_common(inst, request, inst->auth_usersfile,
-			   inst->auth_users ? inst->auth_users : inst->common,
-			   request->packet, request->reply);
+	rcode = file_common(inst, request, inst->auth_usersfile,
+			    data->auth_users ? data->auth_users : data->common,
+			    request->packet, request->reply);
+	fr_reload_read_unlock(inst->reload);
+
+	return rcode;
 }
 
 static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
 {
 	rlm_files_t const *inst = instance;
+	rlm_files_data_t const *data = fr_reload_read_lock(inst->reload);
+	rlm_rcode_t rcode;
+
+	rcode = file_common(inst, request, inst->postauth_usersfile,
+			    data->postauth_users ? data->postauth_users : data->common,
+			    request->packet, request->reply);
+	fr_reload_read_unlock(inst->reload);
 
-	return file_common(inst, request, inst->postauth_usersfile,
-			   inst->postauth_users ? inst->postauth_users : inst->common,
-			   request->packet, request->reply);
+	return rcode;
 }
 
 
@@ -484,9 +485,11 @@ extern module_t rlm_files;
 module_t rlm_files = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "files",
+	.type		= RLM_TYPE_PARALLEL,
 	.inst_size	= sizeof(rlm_files_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
@@ -196,6 +196,7 @@ struct rlm_isc_dhcp_info_s {
 	fr_hash_table_t		*hosts_by_uid;	//!< by client identifier
 	VALUE_PAIR		*options;	//!< DHCP options
 	fr_trie_t		*subnets;
+	bool			frozen;		//!< indexes have been frozen.
 	rlm_isc_dhcp_info_t	*child;
 	rlm_isc_dhcp_info_t	**last;		//!< pointer to last child
 };
@@ -205,6 +206,27 @@ static int parse_section(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *i
 
 static char const *spaces = "                                                                                ";
 
+/** Freeze the host and subnet indexes of a section
+ *
+ *	Once a section has been parsed, nothing else is added to its
+ *	indexes, so lookups can use the frozen versions.  Frozen hash
+ *	tables are a single probe, and frozen tries are laid out in
+ *	one block of memory.  If freezing fails, the index still works
+ *	as before.
+ *
+ *	Freezing a hash table rebuilds it from scratch, so each section
+ *	is only frozen once.
+ */
+static void indexes_freeze(rlm_isc_dhcp_info_t *info)
+{
+	if (info->frozen) return;
+	info->frozen = true;
+
+	if (info->hosts_by_ether) (void) fr_hash_table_freeze(info->hosts_by_ether);
+	if (info->hosts_by_uid) (void) fr_hash_table_freeze(info->hosts_by_uid);
+	if (info->subnets) (void) fr_trie_freeze(info->subnets);
+}
+
 /** Refills the read buffer with one line from the file.
  *
  *	This function also takes care of suppressing blank lines, and
@@ -2116,6 +2138,8 @@ static int parse_section(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *i
 
 	IDEBUG("%.*s }", state->braces, spaces);
 
+	indexes_freeze(info);
+
 	return entries;
 }
 
@@ -2206,6 +2230,16 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->head = info = talloc_zero(inst, rlm_isc_dhcp_info_t);
 	info->last = &(info->child);
 
+	/*
+	 *	The global host indexes are filled in by parse_host(),
+	 *	so they have to exist before the file is read.
+	 */
+	inst->hosts_by_ether = fr_hash_table_create(inst, host_ether_hash, host_ether_cmp, NULL);
+	if (!inst->hosts_by_ether) return -1;
+
+	inst->hosts_by_uid = fr_hash_table_create(inst, host_uid_hash, host_uid_cmp, NULL);
+	if (!inst->hosts_by_uid) return -1;
+
 	rcode = read_file(inst, info, inst->filename);
 	if (rcode < 0) {
 		cf_log_err(conf, "%s", fr_strerror());
@@ -2217,12 +2251,14 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return 0;
 	}
 
-	inst->hosts_by_ether = fr_hash_table_create(inst, host_ether_hash, host_ether_cmp, NULL);
-	if (!inst->hosts_by_ether) return -1;
-
-	inst->hosts_by_uid = fr_hash_table_create(inst, host_uid_hash, host_uid_cmp, NULL);
-	if (!inst->hosts_by_uid) return -1;
-
+	/*
+	 *	Nothing is added to the indexes after this.  The top
+	 *	level is read by read_file(), not parse_section(), so
+	 *	this is the only place its indexes are frozen.
+	 */
+	indexes_freeze(info);
+	(void) fr_hash_table_freeze(inst->hosts_by_ether);
+	(void) fr_hash_table_freeze(inst->hosts_by_uid);
 
 	return 0;
 }
@@ -93,22 +93,22 @@ char const *rlm_krb5_error(rlm_krb5_t const *inst, krb5_context context, krb5_er
  * @return 0 (always indicates success).
  */
 static int _mod_conn_free(rlm_krb5_handle_t *conn) {
-	krb5_free_context(conn->context);
-
 	if (conn->keytab) krb5_kt_close(conn->context, conn->keytab);
 
 #ifdef HEIMDAL_KRB5
 	if (conn->ccache) krb5_cc_destroy(conn->context, conn->ccache);
 #endif
 
+	krb5_free_context(conn->context);
+
 	return 0;
 }
 
-/** Create and return a new connection
+/** Create and return a new libkrb5 context, keytab handle and replay cache
  *
  * libkrb5(s) can talk to the KDC over TCP. Were assuming something sane is implemented
- * by libkrb5 and that it does connection caching associated with contexts, so it's
- * worth using a connection pool to preserve connections when workers die.
+ * by libkrb5 and that it does connection caching associated with contexts, so each
+ * worker or executor thread creates one of these, and keeps it for its lifetime.
  */
 void *krb5_mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_delta_t timeout)
 {
@@ -149,8 +149,6 @@ void *krb5_mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_delta
 	krb5_verify_opt_set_secure(&conn->options, true);
 
 	if (inst->service) krb5_verify_opt_set_service(&conn->options, inst->service);
-#else
-	krb5_verify_init_creds_opt_set_ap_req_nofail(inst->vic_options, true);
 #endif
 	return conn;
 
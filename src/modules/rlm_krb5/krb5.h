@@ -29,9 +29,7 @@ RCSIDH(krb5_h, "$Id$")
 USES_APPLE_DEPRECATED_API
 #include <krb5.h>
 
-#ifdef KRB5_IS_THREAD_SAFE
-#  include <freeradius-devel/server/pool.h>
-#endif
+#include <freeradius-devel/server/offload.h>
 
 typedef struct {
 	krb5_context	context;
@@ -48,9 +46,7 @@ typedef struct {
  * Holds the configuration and preparsed data for a instance of rlm_krb5.
  */
 typedef struct {
-#ifdef KRB5_IS_THREAD_SAFE
-	fr_pool_t	*pool;		//!< Connection pool instance.
-#else
+#ifndef KRB5_IS_THREAD_SAFE
 	rlm_krb5_handle_t	*conn;
 #endif
 
@@ -65,6 +61,9 @@ typedef struct {
 
 	krb5_context		context;	//!< The kerberos context (cloned once per request).
 
+	fr_offload_conf_t	async;		//!< KDC executor configuration.
+	fr_offload_t		*offload;	//!< KDC executors.  NULL if calls are synchronous.
+
 #ifndef HEIMDAL_KRB5
 	krb5_get_init_creds_opt		*gic_options;	//!< Options to pass to the get_initial_credentials
 							//!< function.
@@ -76,6 +75,15 @@ typedef struct {
 #endif
 } rlm_krb5_t;
 
+/** Per-thread instance data for rlm_krb5
+ *
+ */
+typedef struct {
+	rlm_krb5_handle_t	*conn;		//!< This thread's libkrb5 context, keytab and replay cache.
+							///< NULL if calls are made by executors.
+	fr_offload_thread_t	*offload;	//!< This thread's handle for the KDC executors.
+} rlm_krb5_thread_t;
+
 /*
  *	MIT Kerberos uses comm_err, so the macro just expands to a call
  *	to error_message.
@@ -31,12 +31,14 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 #include "krb5.h"
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("keytab", FR_TYPE_STRING, rlm_krb5_t, keytabname) },
 	{ FR_CONF_OFFSET("service_principal", FR_TYPE_STRING, rlm_krb5_t, service_princ) },
+	{ FR_CONF_OFFSET("async", FR_TYPE_SUBSECTION, rlm_krb5_t, async), .subcs = (void const *) fr_offload_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -73,13 +75,26 @@ static int mod_detach(void *instance)
 	talloc_free(inst->service);
 
 	if (inst->context) krb5_free_context(inst->context);
-#ifdef KRB5_IS_THREAD_SAFE
-	fr_pool_free(inst->pool);
-#endif
 
 	return 0;
 }
 
+/** Create an executor's libkrb5 context, keytab handle and replay cache
+ *
+ */
+static void *mod_offload_resource_alloc(void *uctx)
+{
+	return krb5_mod_conn_create(NULL, uctx, 0);
+}
+
+/** Free an executor's libkrb5 context
+ *
+ */
+static void mod_offload_resource_free(void *resource, UNUSED void *uctx)
+{
+	talloc_free(resource);
+}
+
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_krb5_t *inst = instance;
@@ -220,116 +235,107 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 	MEM(inst->vic_options = talloc_zero(inst, krb5_verify_init_creds_opt));
 	krb5_verify_init_creds_opt_init(inst->vic_options);
+	krb5_verify_init_creds_opt_set_ap_req_nofail(inst->vic_options, true);
 #endif
 
-#ifdef KRB5_IS_THREAD_SAFE
 	/*
-	 *	Initialize the socket pool.
+	 *	Hand exchanges with the KDC to dedicated threads,
+	 *	so workers don't block waiting for it.
 	 */
-	inst->pool = module_connection_pool_init(conf, inst, krb5_mod_conn_create, NULL, NULL, NULL, NULL);
-	if (!inst->pool) return -1;
-#else
+	if (inst->async.num_threads) {
+		CONF_SECTION *async_cs = cf_section_find(conf, "async", NULL);
+
+#ifndef KRB5_IS_THREAD_SAFE
+		cf_log_err(conf, "'async' requires a thread safe libkrb5");
+		return -1;
+#endif
+		if (fr_offload_conf_check(async_cs ? async_cs : conf, &inst->async) < 0) return -1;
+
+		inst->offload = fr_offload_alloc(inst, &inst->async, inst->name,
+						 mod_offload_resource_alloc, mod_offload_resource_free, inst);
+		if (!inst->offload) {
+			cf_log_perr(conf, "Unable to initialise krb5 executors");
+			return -1;
+		}
+	}
+
+#ifndef KRB5_IS_THREAD_SAFE
 	inst->conn = krb5_mod_conn_create(inst, inst, 0);
 	if (!inst->conn) return -1;
 #endif
 	return 0;
 }
 
-/** Common function for transforming a User-Name string into a principal.
+/** Create this thread's libkrb5 context, or connect it to the executors
  *
- * @param[out] client Where to write the client principal.
- * @param[in] inst of rlm_krb5.
- * @param[in] request Current request.
- * @param[in] context Kerberos context.
+ * Resolving the keytab and setting up the replay cache are done once
+ * here, rather than for every request.
  */
-static rlm_rcode_t krb5_parse_user(krb5_principal *client, KRB5_UNUSED rlm_krb5_t const *inst, REQUEST *request,
-				   krb5_context context)
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
 {
-	krb5_error_code ret;
-	char *princ_name;
-	VALUE_PAIR *username;
-
-	username = fr_pair_find_by_da(request->packet->vps, attr_user_name, TAG_ANY);
-
-	/*
-	 *	We can only authenticate user requests which HAVE
-	 *	a User-Name attribute.
-	 */
-	if (!username) {
-		REDEBUG("Attribute \"User-Name\" is required for authentication");
-		return RLM_MODULE_INVALID;
-	}
-
-	ret = krb5_parse_name(context, username->vp_strvalue, client);
-	if (ret) {
-		REDEBUG("Failed parsing username as principal: %s", rlm_krb5_error(inst, context, ret));
-
-		return RLM_MODULE_FAIL;
+	rlm_krb5_t		*inst = instance;
+	rlm_krb5_thread_t	*t = talloc_get_type_abort(thread, rlm_krb5_thread_t);
+
+	if (inst->offload) {
+		t->offload = fr_offload_thread_alloc(t, inst->offload, el);
+		if (!t->offload) {
+			cf_log_perr(conf, "Failed connecting to krb5 executors");
+			return -1;
+		}
+		return 0;
 	}
 
-	krb5_unparse_name(context, *client, &princ_name);
-	RDEBUG2("Using client principal \"%s\"", princ_name);
-#ifdef HEIMDAL_KRB5
-	free(princ_name);
-#else
-	krb5_free_unparsed_name(context, princ_name);
+#ifdef KRB5_IS_THREAD_SAFE
+	t->conn = krb5_mod_conn_create(t, inst, 0);
+	if (!t->conn) return -1;
 #endif
-	return RLM_MODULE_OK;
+
+	return 0;
 }
 
-/** Log error message and return appropriate rcode
+/** Authentication state, copied out of the request so it can be used by an executor
  *
- * Translate kerberos error codes into return codes.
- * @param inst of rlm_krb5.
- * @param request Current request.
- * @param ret code from kerberos.
- * @param conn used in the last operation.
  */
-static rlm_rcode_t krb5_process_error(rlm_krb5_t const *inst, REQUEST *request, rlm_krb5_handle_t *conn, int ret)
+typedef struct {
+	rlm_krb5_t const	*inst;			//!< Module instance.
+	char			*username;		//!< Copied from User-Name.
+	char			*password;		//!< Copied from User-Password.
+
+	bool			parsed;			//!< Whether the username could be converted
+							///< into a principal.
+	krb5_error_code		ret;			//!< Result of the last libkrb5 call.
+	char			principal[256];		//!< Unparsed client principal, for logging.
+	char			error[256];		//!< Error message for ret.
+} rlm_krb5_auth_t;
+
+/** Check the request has everything we need, and copy it
+ *
+ * @param[out] out	Authentication state.
+ * @param[in] ctx	to allocate the state in.
+ * @param[in] inst	of rlm_krb5.
+ * @param[in] request	Current request.
+ * @return
+ *	- RLM_MODULE_OK if the user can be authenticated.
+ *	- RLM_MODULE_INVALID if User-Name or User-Password are missing or invalid.
+ */
+static rlm_rcode_t krb5_auth_prepare(rlm_krb5_auth_t **out, TALLOC_CTX *ctx, rlm_krb5_t const *inst,
+				     REQUEST *request)
 {
-	fr_assert(ret != 0);
-
-	if (!fr_cond_assert(inst)) return RLM_MODULE_FAIL;
-	if (!fr_cond_assert(conn)) return RLM_MODULE_FAIL;	/* Silences warnings */
+	rlm_krb5_auth_t	*auth;
+	VALUE_PAIR	*username, *password;
 
-	switch (ret) {
-	case KRB5_LIBOS_BADPWDMATCH:
-	case KRB5KRB_AP_ERR_BAD_INTEGRITY:
-		REDEBUG("Provided password was incorrect (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
-		return RLM_MODULE_REJECT;
-
-	case KRB5KDC_ERR_KEY_EXP:
-	case KRB5KDC_ERR_CLIENT_REVOKED:
-	case KRB5KDC_ERR_SERVICE_REVOKED:
-		REDEBUG("Account has been locked out (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
-		return RLM_MODULE_DISALLOW;
-
-	case KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN:
-		RDEBUG2("User not found (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
-		return RLM_MODULE_NOTFOUND;
+	username = fr_pair_find_by_da(request->packet->vps, attr_user_name, TAG_ANY);
 
-	default:
-		REDEBUG("Error verifying credentials (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
-		return RLM_MODULE_FAIL;
+	/*
+	 *	We can only authenticate user requests which HAVE
+	 *	a User-Name attribute.
+	 */
+	if (!username) {
+		REDEBUG("Attribute \"User-Name\" is required for authentication");
+		return RLM_MODULE_INVALID;
 	}
-}
-
-#ifdef HEIMDAL_KRB5
-
-/*
- *	Validate user/pass (Heimdal)
- */
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
-{
-	rlm_krb5_t const	*inst = instance;
-	rlm_rcode_t		rcode;
-	krb5_error_code		ret;
-	rlm_krb5_handle_t	*conn;
-	krb5_principal		client = NULL;
-	VALUE_PAIR		*password;
 
 	password = fr_pair_find_by_da(request->packet->vps, attr_user_password, TAG_ANY);
-
 	if (!password) {
 		REDEBUG("Attribute \"User-Password\" is required for authentication");
 		return RLM_MODULE_INVALID;
@@ -352,24 +358,49 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 		RDEBUG2("Login attempt with password");
 	}
 
-#  ifdef KRB5_IS_THREAD_SAFE
-	conn = fr_pool_connection_get(inst->pool, request);
-	if (!conn) return RLM_MODULE_FAIL;
-#  else
-	conn = inst->conn;
-#  endif
+	MEM(auth = talloc_zero(ctx, rlm_krb5_auth_t));
+	auth->inst = inst;
+	auth->username = talloc_bstrndup(auth, username->vp_strvalue, username->vp_length);
+	auth->password = talloc_bstrndup(auth, password->vp_strvalue, password->vp_length);
+
+	*out = auth;
+
+	return RLM_MODULE_OK;
+}
 
-	rcode = krb5_parse_user(&client, inst, request, conn->context);
-	if (rcode != RLM_MODULE_OK) goto cleanup;
+/** Convert the username into a principal, and verify the password with the KDC
+ *
+ * Doesn't touch the request, so may be called from an executor thread.
+ *
+ * @param[in] conn	libkrb5 context and keytab to use.
+ * @param[in] auth	Authentication state.  The result is written back to it.
+ * @return The libkrb5 error code, or 0 on success.
+ */
+static int krb5_auth_run(rlm_krb5_handle_t *conn, rlm_krb5_auth_t *auth)
+{
+	krb5_principal	client = NULL;
+	krb5_error_code	ret;
+	char		*princ_name;
 
+	ret = krb5_parse_name(conn->context, auth->username, &client);
+	if (ret) goto finish;
+	auth->parsed = true;
+
+	if (krb5_unparse_name(conn->context, client, &princ_name) == 0) {
+		strlcpy(auth->principal, princ_name, sizeof(auth->principal));
+#ifdef HEIMDAL_KRB5
+		free(princ_name);
+#else
+		krb5_free_unparsed_name(conn->context, princ_name);
+#endif
+	}
+
+#ifdef HEIMDAL_KRB5
 	/*
 	 *	Verify the user, using the options we set in instantiate
 	 */
-	ret = krb5_verify_user_opt(conn->context, client, password->vp_strvalue, &conn->options);
-	if (ret) {
-		rcode = krb5_process_error(inst, request, conn, ret);
-		goto cleanup;
-	}
+	ret = krb5_verify_user_opt(conn->context, client, auth->password, &conn->options);
+	if (ret) goto finish;
 
 	/*
 	 *	krb5_verify_user_opt adds the credentials to the ccache
@@ -393,107 +424,180 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 		}
 		krb5_cc_end_seq_get(conn->context, conn->ccache, &cursor);
 	}
-
-cleanup:
-	if (client) {
-		krb5_free_principal(conn->context, client);
+	ret = 0;
+#else
+	{
+		krb5_creds init_creds;
+
+		memset(&init_creds, 0, sizeof(init_creds));
+
+		/*
+		 * 	Retrieve the TGT from the TGS/KDC and check we can decrypt it,
+		 *	then check it against the service principal.
+		 */
+		ret = krb5_get_init_creds_password(conn->context, &init_creds, client, auth->password,
+						   NULL, NULL, 0, NULL, auth->inst->gic_options);
+		if (ret == 0) ret = krb5_verify_init_creds(conn->context, &init_creds, auth->inst->server,
+							   conn->keytab, NULL, auth->inst->vic_options);
+		krb5_free_cred_contents(conn->context, &init_creds);
 	}
+#endif
 
-#  ifdef KRB5_IS_THREAD_SAFE
-	fr_pool_connection_release(inst->pool, request, conn);
-#  endif
-	return rcode;
-}
+finish:
+	if (ret) strlcpy(auth->error, rlm_krb5_error(auth->inst, conn->context, ret), sizeof(auth->error));
+	if (client) krb5_free_principal(conn->context, client);
+	auth->ret = ret;
 
-#else  /* HEIMDAL_KRB5 */
+	return ret;
+}
 
-/*
- *  Validate userid/passwd (MIT)
+/** Log error message and return appropriate rcode
+ *
+ * Translate kerberos error codes into return codes.
+ * @param request Current request.
+ * @param ret code from kerberos.
+ * @param msg describing ret.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t krb5_process_error(REQUEST *request, krb5_error_code ret, char const *msg)
 {
-	rlm_krb5_t const	*inst = instance;
-	rlm_rcode_t		rcode;
-	krb5_error_code		ret;
+	fr_assert(ret != 0);
 
-	rlm_krb5_handle_t	*conn;
+	switch (ret) {
+	case KRB5_LIBOS_BADPWDMATCH:
+	case KRB5KRB_AP_ERR_BAD_INTEGRITY:
+		REDEBUG("Provided password was incorrect (%i): %s", ret, msg);
+		return RLM_MODULE_REJECT;
 
-	krb5_principal		client = NULL;	/* actually a pointer value */
-	krb5_creds		init_creds;
-	char			*nonconst_password;		/* compiler warnings */
-	VALUE_PAIR		*password;
+	case KRB5KDC_ERR_KEY_EXP:
+	case KRB5KDC_ERR_CLIENT_REVOKED:
+	case KRB5KDC_ERR_SERVICE_REVOKED:
+		REDEBUG("Account has been locked out (%i): %s", ret, msg);
+		return RLM_MODULE_DISALLOW;
 
-	password = fr_pair_find_by_da(request->packet->vps, attr_user_password, TAG_ANY);
+	case KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN:
+		RDEBUG2("User not found (%i): %s", ret, msg);
+		return RLM_MODULE_NOTFOUND;
 
-	if (!password) {
-		REDEBUG("Attribute \"User-Password\" is required for authentication");
-		return RLM_MODULE_INVALID;
+	default:
+		REDEBUG("Error verifying credentials (%i): %s", ret, msg);
+		return RLM_MODULE_FAIL;
 	}
+}
 
-	/*
-	 *	Make sure the supplied password isn't empty
-	 */
-	if (password->vp_length == 0) {
-		REDEBUG("User-Password must not be empty");
-		return RLM_MODULE_INVALID;
+/** Log the result of an authentication, and translate it into a return code
+ *
+ */
+static rlm_rcode_t krb5_auth_result(REQUEST *request, rlm_krb5_auth_t const *auth)
+{
+	if (!auth->parsed) {
+		REDEBUG("Failed parsing username as principal: %s", auth->error);
+		return RLM_MODULE_FAIL;
 	}
 
-	/*
-	 *	Log the password
-	 */
-	if (RDEBUG_ENABLED3) {
-		RDEBUG("Login attempt with password \"%pV\"", &password->data);
-	} else {
-		RDEBUG2("Login attempt with password");
+	RDEBUG2("Using client principal \"%s\"", auth->principal);
+
+	if (auth->ret) return krb5_process_error(request, auth->ret, auth->error);
+
+	return RLM_MODULE_OK;
+}
+
+static void mod_authenticate_complete(REQUEST *request, UNUSED fr_offload_req_t *oreq, UNUSED void *uctx)
+{
+	unlang_interpret_resumable(request);
+}
+
+static int _mod_authenticate_run(void *resource, void *data)
+{
+	return krb5_auth_run(talloc_get_type_abort(resource, rlm_krb5_handle_t),
+			     talloc_get_type_abort(data, rlm_krb5_auth_t));
+}
+
+/** Process the result of an authentication run by an executor
+ *
+ */
+static rlm_rcode_t mod_authenticate_resume(UNUSED void *instance, UNUSED void *thread, REQUEST *request, void *rctx)
+{
+	fr_offload_req_t	*oreq = talloc_get_type_abort(rctx, fr_offload_req_t);
+	rlm_rcode_t		rcode;
+	void			*data;
+
+	switch (fr_offload_req_result(NULL, &data, oreq)) {
+	case FR_OFFLOAD_REQ_DONE:
+		rcode = krb5_auth_result(request, talloc_get_type_abort(data, rlm_krb5_auth_t));
+		break;
+
+	case FR_OFFLOAD_REQ_TIMEOUT:
+		REDEBUG("Timeout waiting for KDC");
+		rcode = RLM_MODULE_FAIL;
+		break;
+
+	default:
+		REDEBUG("Kerberos call failed");
+		rcode = RLM_MODULE_FAIL;
+		break;
 	}
 
-#  ifdef KRB5_IS_THREAD_SAFE
-	conn = fr_pool_connection_get(inst->pool, request);
-	if (!conn) return RLM_MODULE_FAIL;
-#  else
-	conn = inst->conn;
-#  endif
+	talloc_free(oreq);
 
-	/*
-	 *	Zero out local storage
-	 */
-	memset(&init_creds, 0, sizeof(init_creds));
+	return rcode;
+}
 
-	/*
-	 *	Check we have all the required VPs, and convert the username
-	 *	into a principal.
-	 */
-	rcode = krb5_parse_user(&client, inst, request, conn->context);
-	if (rcode != RLM_MODULE_OK) goto cleanup;
+static void mod_authenticate_signal(UNUSED void *instance, UNUSED void *thread, UNUSED REQUEST *request,
+				    void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
 
-	/*
-	 * 	Retrieve the TGT from the TGS/KDC and check we can decrypt it.
-	 */
-	memcpy(&nonconst_password, &password->vp_strvalue, sizeof(nonconst_password));
-	RDEBUG2("Retrieving and decrypting TGT");
-	ret = krb5_get_init_creds_password(conn->context, &init_creds, client, nonconst_password,
-					   NULL, NULL, 0, NULL, inst->gic_options);
-	if (ret) {
-		rcode = krb5_process_error(inst, request, conn, ret);
-		goto cleanup;
+	talloc_free(rctx);
+}
+
+/** Validate the user's password with the KDC
+ *
+ * If executor threads are configured, the exchange with the KDC is
+ * queued for them and the request yields.  Otherwise the worker
+ * blocks, using its own libkrb5 context.
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, void *thread, REQUEST *request)
+{
+	rlm_krb5_t const	*inst = instance;
+	rlm_krb5_thread_t	*t = talloc_get_type_abort(thread, rlm_krb5_thread_t);
+	rlm_krb5_handle_t	*conn;
+	rlm_krb5_auth_t		*auth;
+	rlm_rcode_t		rcode;
+
+	rcode = krb5_auth_prepare(&auth, NULL, inst, request);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	if (t->offload) {
+		fr_offload_req_t	*oreq;
+		char const		*realm;
+
+		/*
+		 *	Concurrency is limited per realm, so one
+		 *	unresponsive KDC can't starve the others.
+		 */
+		realm = strrchr(auth->username, '@');
+		if (realm) realm++;
+
+		oreq = fr_offload_enqueue(t->offload, request, realm,
+					  _mod_authenticate_run, auth, mod_authenticate_complete, NULL);
+		if (!oreq) return RLM_MODULE_FAIL;
+
+		return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, oreq);
 	}
 
-	RDEBUG2("Attempting to authenticate against service principal");
-	ret = krb5_verify_init_creds(conn->context, &init_creds, inst->server, conn->keytab, NULL, inst->vic_options);
-	if (ret) rcode = krb5_process_error(inst, request, conn, ret);
+#ifdef KRB5_IS_THREAD_SAFE
+	conn = t->conn;
+#else
+	conn = inst->conn;
+#endif
 
-cleanup:
-	if (client) krb5_free_principal(conn->context, client);
-	krb5_free_cred_contents(conn->context, &init_creds);
+	krb5_auth_run(conn, auth);
+	rcode = krb5_auth_result(request, auth);
+	talloc_free(auth);
 
-#  ifdef KRB5_IS_THREAD_SAFE
-	fr_pool_connection_release(inst->pool, request, conn);
-#  endif
 	return rcode;
 }
 
-#endif /* MIT_KRB5 */
-
 extern module_t rlm_krb5;
 module_t rlm_krb5 = {
 	.magic		= RLM_MODULE_INIT,
@@ -502,8 +606,11 @@ module_t rlm_krb5 = {
 	.type		= RLM_TYPE_THREAD_SAFE,
 #endif
 	.inst_size	= sizeof(rlm_krb5_t),
+	.thread_inst_size	= sizeof(rlm_krb5_thread_t),
+	.thread_inst_type	= "rlm_krb5_thread_t",
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate
@@ -98,6 +98,9 @@ static int _get_client_value(char **out, CONF_PAIR const *cp, void *data)
 }
 
 /** Load clients from LDAP on server start
+ *
+ * Clients which already exist, and haven't changed, are left alone, so calling
+ * this function again only replaces the clients which have changed.
  *
  * @param[in] inst rlm_ldap configuration.
  * @param[in] tmpl to use as the base for the new client.
@@ -195,7 +198,6 @@ int rlm_ldap_client_load(rlm_ldap_t const *inst, CONF_SECTION *tmpl, CONF_SECTIO
 	do {
 		ldap_client_data_t	data;
 
-		CONF_SECTION		*client;
 		char			*id;
 
 		struct berval		**values;
@@ -218,45 +220,34 @@ int rlm_ldap_client_load(rlm_ldap_t const *inst, CONF_SECTION *tmpl, CONF_SECTIO
 			ldap_value_free_len(values);
 		}
 
-		/*
-		 *	Iterate over mapping sections
-		 */
-		client = tmpl ? cf_section_dup(NULL, NULL, tmpl, "client", id, true) :
-				cf_section_alloc(NULL, NULL, "client", id);
-
 		data.conn = conn;
 		data.entry = entry;
 
-		if (client_map_section(client, map, _get_client_value, &data) < 0) {
-			talloc_free(client);
-			ret = -1;
-			goto finish;
-		}
-
 		/*
 		 *@todo these should be parented from something
 		 */
-		c = client_afrom_cs(NULL, client, NULL);
+		c = client_afrom_map(NULL, id, tmpl, map, _get_client_value, &data);
+		if (id != dn) talloc_free(id);
 		if (!c) {
-			talloc_free(client);
 			ret = -1;
 			goto finish;
 		}
 
-		/*
-		 *	Client parents the CONF_SECTION which defined it
-		 */
-		talloc_steal(c, client);
+		switch (client_update(NULL, c)) {
+		case 1:
+			DEBUG("Client \"%s\" added", dn);
+			break;
+
+		case 0:
+			DEBUG3("Client \"%s\" unchanged", dn);
+			break;
 
-		if (!client_add(NULL, c)) {
-			ERROR("Failed to add client \"%s\", possible duplicate?", dn);
+		default:
+			ERROR("Failed to add client \"%s\"", dn);
 			ret = -1;
-			client_free(c);
 			goto finish;
 		}
 
-		DEBUG("Client \"%s\" added", dn);
-
 		ldap_memfree(dn);
 		dn = NULL;
 	} while ((entry = ldap_next_entry(conn->handle, entry)));
@@ -36,17 +36,268 @@ USES_APPLE_DEPRECATED_API
 
 #include "rlm_ldap.h"
 
+/** What a group cache entry maps
+ *
+ */
+typedef enum {
+	LDAP_GROUP_CACHE_MEMBERSHIP = 0,		//!< User DN and group name or DN, to whether the
+							///< user is a member.
+	LDAP_GROUP_CACHE_DN2NAME,			//!< Group DN to group name.
+	LDAP_GROUP_CACHE_NAME2DN			//!< Group name to group DN.
+} ldap_group_cache_type_t;
+
+typedef struct {
+	ldap_group_cache_type_t	type;			//!< Of entry.
+	uint8_t			*key;			//!< Type specific.
+	size_t			key_len;		//!< Length of the key.
+
+	char			*value;			//!< Resolved group name or DN.  NULL if the name or DN
+							///< didn't resolve, or if this is a membership entry.
+	bool			member;			//!< Whether the user is a member of the group.
+
+	fr_time_t		expires;		//!< When the entry should no longer be used.
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+} ldap_group_cache_entry_t;
+
+/** Membership and group resolution cache
+ *
+ * Shared by all worker threads, so protected by the mutex.
+ */
+struct ldap_group_cache_s {
+	pthread_mutex_t		mutex;
+	rbtree_t		*tree;			//!< Entries by type and key.
+	fr_dlist_head_t		lru;			//!< Most recently used entries at the head.
+};
+
+static int ldap_group_cache_cmp(void const *one, void const *two)
+{
+	ldap_group_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->type > b->type) - (a->type < b->type);
+	if (ret != 0) return ret;
+
+	ret = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+	if (ret != 0) return ret;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+static int _ldap_group_cache_entry_free(ldap_group_cache_entry_t *c)
+{
+	ldap_group_cache_t *cache = talloc_get_type_abort(talloc_parent(c), ldap_group_cache_t);
+
+	rbtree_deletebydata(cache->tree, c);
+	fr_dlist_remove(&cache->lru, c);
+
+	return 0;
+}
+
+/** Build a key from one or two strings
+ *
+ * Membership keys are the user DN and the group, separated by a '\0',
+ * which can't appear in either.
+ */
+static uint8_t *ldap_group_cache_key(TALLOC_CTX *ctx, size_t *len, char const *a, char const *b)
+{
+	size_t	a_len = strlen(a), b_len = b ? strlen(b) + 1 : 0;
+	uint8_t	*key;
+
+	*len = a_len + b_len;
+	MEM(key = talloc_array(ctx, uint8_t, *len));
+	memcpy(key, a, a_len);
+	if (b) {
+		key[a_len] = '\0';
+		memcpy(key + a_len + 1, b, b_len - 1);
+	}
+
+	return key;
+}
+
+/** Look for a group cache entry
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] ctx	to allocate the copy of the value in.
+ * @param[out] value	The resolved name or DN.  NULL if the cache recorded
+ *			that it didn't resolve.  May be NULL.
+ * @param[out] member	Whether the user is a member of the group.  May be NULL.
+ * @param[in] type	of entry.
+ * @param[in] a		First part of the key.
+ * @param[in] b		Second part of the key.  May be NULL.
+ * @return
+ *	- true if a live entry was found.
+ *	- false if there was no entry, or it had expired.
+ */
+static bool ldap_group_cache_find(rlm_ldap_t const *inst, TALLOC_CTX *ctx, char **value, bool *member,
+				  ldap_group_cache_type_t type, char const *a, char const *b)
+{
+	ldap_group_cache_t		*cache = inst->group_cache;
+	ldap_group_cache_entry_t	find = { .type = type }, *c;
+	bool				found = false;
+
+	if (!cache) return false;
+
+	find.key = ldap_group_cache_key(NULL, &find.key_len, a, b);
+
+	pthread_mutex_lock(&cache->mutex);
+	c = rbtree_finddata(cache->tree, &find);
+	if (c) {
+		if (c->expires <= fr_time()) {
+			talloc_free(c);
+		} else {
+			fr_dlist_remove(&cache->lru, c);
+			fr_dlist_insert_head(&cache->lru, c);
+
+			if (value) *value = c->value ? talloc_typed_strdup(ctx, c->value) : NULL;
+			if (member) *member = c->member;
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	talloc_free(find.key);
+
+	return found;
+}
+
+/** Add or replace a group cache entry
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] value	The resolved name or DN.  NULL if it didn't resolve.
+ * @param[in] member	Whether the user is a member of the group.
+ * @param[in] type	of entry.
+ * @param[in] a		First part of the key.
+ * @param[in] b		Second part of the key.  May be NULL.
+ */
+static void ldap_group_cache_add(rlm_ldap_t const *inst, char const *value, bool member,
+				 ldap_group_cache_type_t type, char const *a, char const *b)
+{
+	ldap_group_cache_t		*cache = inst->group_cache;
+	ldap_group_cache_entry_t	*c, *old;
+	fr_time_delta_t			ttl;
+
+	if (!cache) return;
+
+	/*
+	 *	Membership is an answer, whichever way it
+	 *	goes.  Names and DNs that didn't resolve may
+	 *	be about to be created, so they get their own
+	 *	(usually shorter) TTL.
+	 */
+	ttl = ((type != LDAP_GROUP_CACHE_MEMBERSHIP) && !value) ? inst->group_cache_negative_ttl :
+								   inst->group_cache_ttl;
+	if (!ttl) return;
+
+	pthread_mutex_lock(&cache->mutex);
+	MEM(c = talloc_zero(cache, ldap_group_cache_entry_t));
+	c->type = type;
+	c->key = ldap_group_cache_key(c, &c->key_len, a, b);
+	if (value) c->value = talloc_typed_strdup(c, value);
+	c->member = member;
+	c->expires = fr_time() + ttl;
+
+	old = rbtree_finddata(cache->tree, c);
+	if (old) talloc_free(old);
+
+	while (inst->group_cache_max_entries &&
+	       (fr_dlist_num_elements(&cache->lru) >= inst->group_cache_max_entries)) {
+		talloc_free(fr_dlist_tail(&cache->lru));
+	}
+
+	rbtree_insert(cache->tree, c);
+	fr_dlist_insert_head(&cache->lru, c);
+	talloc_set_destructor(c, _ldap_group_cache_entry_free);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Look for the result of a previous membership check
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @param[in] user_dn	of the user object.
+ * @param[in] check	vp containing the group value (name or dn).
+ * @param[out] member	Whether the user was a member of the group.
+ * @return true if a previous result was found.
+ */
+bool rlm_ldap_group_cache_membership_find(rlm_ldap_t const *inst, REQUEST *request,
+					  char const *user_dn, VALUE_PAIR const *check, bool *member)
+{
+	if (!ldap_group_cache_find(inst, NULL, NULL, member, LDAP_GROUP_CACHE_MEMBERSHIP,
+				   user_dn, check->vp_strvalue)) return false;
+
+	RDEBUG2("User is%s a member of \"%pV\" (cached)", *member ? "" : " not", &check->data);
+
+	return true;
+}
+
+/** Record the result of a membership check
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] user_dn	of the user object.
+ * @param[in] check	vp containing the group value (name or dn).
+ * @param[in] member	Whether the user is a member of the group.
+ */
+void rlm_ldap_group_cache_membership_add(rlm_ldap_t const *inst, char const *user_dn,
+					 VALUE_PAIR const *check, bool member)
+{
+	ldap_group_cache_add(inst, NULL, member, LDAP_GROUP_CACHE_MEMBERSHIP, user_dn, check->vp_strvalue);
+}
+
+/** Allocate the group cache, if it's enabled
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int rlm_ldap_group_cache_init(rlm_ldap_t *inst)
+{
+	ldap_group_cache_t *cache;
+
+	if (!inst->group_cache_ttl && !inst->group_cache_negative_ttl) return 0;
+
+	MEM(cache = talloc_zero(inst, ldap_group_cache_t));
+	cache->tree = rbtree_create(cache, ldap_group_cache_cmp, NULL, 0);
+	if (!cache->tree) {
+		talloc_free(cache);
+		return -1;
+	}
+	fr_dlist_talloc_init(&cache->lru, ldap_group_cache_entry_t, entry);
+	pthread_mutex_init(&cache->mutex, NULL);
+
+	inst->group_cache = cache;
+
+	return 0;
+}
+
+/** Free the group cache
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ */
+void rlm_ldap_group_cache_free(rlm_ldap_t *inst)
+{
+	ldap_group_cache_entry_t *c;
+
+	if (!inst->group_cache) return;
+
+	while ((c = fr_dlist_head(&inst->group_cache->lru))) talloc_free(c);
+	pthread_mutex_destroy(&inst->group_cache->mutex);
+	TALLOC_FREE(inst->group_cache);
+}
+
 /** Convert multiple group names into a DNs
  *
  * Given an array of group names, builds a filter matching all names, then retrieves all group objects
  * and stores the DN associated with each group object.
  *
+ * Names the group cache already knows about (whether or not they resolved) are not searched for.
+ *
  * @param[in] inst rlm_ldap configuration.
  * @param[in] request Current request.
  * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
  * @param[in] names to convert to DNs (NULL terminated).
- * @param[out] out Where to write the DNs. DNs must be freed with ldap_memfree(). Will be NULL terminated.
- * @param[in] outlen Size of out.
+ * @param[out] out Where to write the DNs. DNs must be freed with talloc_free(). Will be NULL terminated.
+ * @param[in] outlen Number of elements in out.
  * @return One of the RLM_MODULE_* values.
  */
 static rlm_rcode_t rlm_ldap_group_name2dn(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_connection_t **pconn,
@@ -58,17 +309,21 @@ static rlm_rcode_t rlm_ldap_group_name2dn(rlm_ldap_t const *inst, REQUEST *reque
 
 	unsigned int name_cnt = 0;
 	unsigned int entry_cnt;
-	char const *attrs[] = { NULL };
+	char const *attrs[] = { inst->groupobj_name_attr, NULL };
 
 	LDAPMessage *result = NULL, *entry;
 
 	char **name = names;
 	char **dn = out;
+	char *cached;
+	char *pending[LDAP_MAX_CACHEABLE + 1];
+	char **pending_p = pending;
+	bool resolved[LDAP_MAX_CACHEABLE + 1] = { false };
 	char const *base_dn = NULL;
 	char base_dn_buff[LDAP_MAX_DN_STR_LEN];
 	char buffer[LDAP_MAX_GROUP_NAME_LEN + 1];
 
-	char *filter;
+	char *filter = NULL;
 
 	*dn = NULL;
 
@@ -82,6 +337,41 @@ static rlm_rcode_t rlm_ldap_group_name2dn(rlm_ldap_t const *inst, REQUEST *reque
 
 	RDEBUG2("Converting group name(s) to group DN(s)");
 
+	/*
+	 *	Pull out anything we've resolved before
+	 */
+	while (*name) {
+		if (!ldap_group_cache_find(inst, request, &cached, NULL, LDAP_GROUP_CACHE_NAME2DN, *name, NULL)) {
+			if ((size_t)(pending_p - pending) >= NUM_ELEMENTS(pending) - 1) {
+				REDEBUG("Number of group names exceeds limit (%i)", LDAP_MAX_CACHEABLE);
+				rcode = RLM_MODULE_INVALID;
+				goto finish;
+			}
+			*pending_p++ = *name++;
+			continue;
+		}
+
+		if (!cached) {
+			RDEBUG2("Group name \"%s\" does not resolve to a DN (cached)", *name++);
+			continue;
+		}
+
+		if ((size_t)(dn - out) >= (outlen - 1)) {
+			REDEBUG("Number of DNs exceeds limit (%zu)", outlen - 1);
+			talloc_free(cached);
+			rcode = RLM_MODULE_INVALID;
+			goto finish;
+		}
+
+		RDEBUG2("Got group DN \"%s\" (cached)", cached);
+		*dn++ = cached;
+		*dn = NULL;
+		name++;
+	}
+	*pending_p = NULL;
+
+	if (!pending[0]) goto finish;
+
 	/*
 	 *	It'll probably only save a few ms in network latency, but it means we can send a query
 	 *	for the entire group list at once.
@@ -89,22 +379,23 @@ static rlm_rcode_t rlm_ldap_group_name2dn(rlm_ldap_t const *inst, REQUEST *reque
 	filter = talloc_typed_asprintf(request, "%s%s%s",
 				 inst->groupobj_filter ? "(&" : "",
 				 inst->groupobj_filter ? inst->groupobj_filter : "",
-				 names[0] && names[1] ? "(|" : "");
-	while (*name) {
-		fr_ldap_escape_func(request, buffer, sizeof(buffer), *name++, NULL);
+				 pending[0] && pending[1] ? "(|" : "");
+	for (pending_p = pending; *pending_p; pending_p++) {
+		fr_ldap_escape_func(request, buffer, sizeof(buffer), *pending_p, NULL);
 		filter = talloc_asprintf_append_buffer(filter, "(%s=%s)", inst->groupobj_name_attr, buffer);
 
 		name_cnt++;
 	}
 	filter = talloc_asprintf_append_buffer(filter, "%s%s",
 					       inst->groupobj_filter ? ")" : "",
-					       names[0] && names[1] ? ")" : "");
+					       pending[0] && pending[1] ? ")" : "");
 
 	if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
 			inst->groupobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
 		REDEBUG("Failed creating base_dn");
 
-		return RLM_MODULE_INVALID;
+		rcode = RLM_MODULE_INVALID;
+		goto finish;
 	}
 
 	status = fr_ldap_search(&result, request, pconn, base_dn, inst->groupobj_scope,
@@ -115,7 +406,7 @@ static rlm_rcode_t rlm_ldap_group_name2dn(rlm_ldap_t const *inst, REQUEST *reque
 
 	case LDAP_PROC_NO_RESULT:
 		RDEBUG2("Tried to resolve group name(s) to DNs but got no results");
-		goto finish;
+		goto negative;
 
 	default:
 		rcode = RLM_MODULE_FAIL;
@@ -130,7 +421,7 @@ static rlm_rcode_t rlm_ldap_group_name2dn(rlm_ldap_t const *inst, REQUEST *reque
 		goto finish;
 	}
 
-	if (entry_cnt > (outlen - 1)) {
+	if (entry_cnt > (outlen - 1 - (dn - out))) {
 		REDEBUG("Number of DNs exceeds limit (%zu)", outlen - 1);
 		rcode = RLM_MODULE_INVALID;
 
@@ -152,21 +443,53 @@ static rlm_rcode_t rlm_ldap_group_name2dn(rlm_ldap_t const *inst, REQUEST *reque
 	}
 
 	do {
-		*dn = ldap_get_dn((*pconn)->handle, entry);
-		if (!*dn) {
+		struct berval	**values;
+		char		*entry_dn;
+		int		i, count;
+
+		entry_dn = ldap_get_dn((*pconn)->handle, entry);
+		if (!entry_dn) {
 			ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 			REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
 
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
 		}
-		fr_ldap_util_normalise_dn(*dn, *dn);
+		fr_ldap_util_normalise_dn(entry_dn, entry_dn);
+
+		RDEBUG2("Got group DN \"%s\"", entry_dn);
+		*dn++ = talloc_typed_strdup(request, entry_dn);
+		*dn = NULL;
 
-		RDEBUG2("Got group DN \"%s\"", *dn);
-		dn++;
+		/*
+		 *	Map the object back to the name(s) we
+		 *	searched for, so the next lookup can
+		 *	skip the directory.
+		 */
+		values = ldap_get_values_len((*pconn)->handle, entry, inst->groupobj_name_attr);
+		count = values ? ldap_count_values_len(values) : 0;
+		for (i = 0; i < count; i++) {
+			for (pending_p = pending; *pending_p; pending_p++) {
+				if ((strlen(*pending_p) != values[i]->bv_len) ||
+				    (strncasecmp(*pending_p, values[i]->bv_val, values[i]->bv_len) != 0)) continue;
+
+				resolved[pending_p - pending] = true;
+				ldap_group_cache_add(inst, entry_dn, false, LDAP_GROUP_CACHE_NAME2DN, *pending_p, NULL);
+			}
+		}
+		if (values) ldap_value_free_len(values);
+		ldap_memfree(entry_dn);
 	} while((entry = ldap_next_entry((*pconn)->handle, entry)));
 
-	*dn = NULL;
+negative:
+	/*
+	 *	Anything we didn't add above didn't resolve
+	 */
+	for (pending_p = pending; *pending_p; pending_p++) {
+		if (resolved[pending_p - pending]) continue;
+
+		ldap_group_cache_add(inst, NULL, false, LDAP_GROUP_CACHE_NAME2DN, *pending_p, NULL);
+	}
 
 finish:
 	talloc_free(filter);
@@ -177,8 +500,8 @@ finish:
 	 */
 	if (rcode != RLM_MODULE_OK) {
 		dn = out;
-		while(*dn) ldap_memfree(*dn++);
-		*dn = NULL;
+		while(*dn) talloc_free(*dn++);
+		*out = NULL;
 	}
 
 	return rcode;
@@ -215,6 +538,16 @@ static rlm_rcode_t rlm_ldap_group_dn2name(rlm_ldap_t const *inst, REQUEST *reque
 		return RLM_MODULE_INVALID;
 	}
 
+	if (ldap_group_cache_find(inst, request, out, NULL, LDAP_GROUP_CACHE_DN2NAME, dn, NULL)) {
+		if (!*out) {
+			REDEBUG("Group DN \"%s\" did not resolve to an object (cached)", dn);
+			return inst->allow_dangling_group_refs ? RLM_MODULE_NOOP : RLM_MODULE_INVALID;
+		}
+
+		RDEBUG2("Group DN \"%s\" resolves to name \"%s\" (cached)", dn, *out);
+		return RLM_MODULE_OK;
+	}
+
 	RDEBUG2("Resolving group DN \"%s\" to group name", dn);
 
 	status = fr_ldap_search(&result, request, pconn, dn, LDAP_SCOPE_BASE, NULL, attrs, NULL, NULL);
@@ -224,6 +557,7 @@ static rlm_rcode_t rlm_ldap_group_dn2name(rlm_ldap_t const *inst, REQUEST *reque
 
 	case LDAP_PROC_NO_RESULT:
 		REDEBUG("Group DN \"%s\" did not resolve to an object", dn);
+		ldap_group_cache_add(inst, NULL, false, LDAP_GROUP_CACHE_DN2NAME, dn, NULL);
 		return inst->allow_dangling_group_refs ? RLM_MODULE_NOOP : RLM_MODULE_INVALID;
 
 	default:
@@ -250,6 +584,7 @@ static rlm_rcode_t rlm_ldap_group_dn2name(rlm_ldap_t const *inst, REQUEST *reque
 
 	*out = fr_ldap_berval_to_string(request, values[0]);
 	RDEBUG2("Group DN \"%s\" resolves to name \"%s\"", dn, *out);
+	ldap_group_cache_add(inst, *out, false, LDAP_GROUP_CACHE_DN2NAME, dn, NULL);
 
 finish:
 	if (result) ldap_msgfree(result);
@@ -379,7 +714,7 @@ rlm_rcode_t rlm_ldap_cacheable_userobj(rlm_ldap_t const *inst, REQUEST *request,
 	}
 	*name_p = NULL;
 
-	rcode = rlm_ldap_group_name2dn(inst, request, pconn, group_name, group_dn, sizeof(group_dn));
+	rcode = rlm_ldap_group_name2dn(inst, request, pconn, group_name, group_dn, NUM_ELEMENTS(group_dn));
 
 	ldap_value_free_len(values);
 	talloc_free(value_ctx);
@@ -407,7 +742,7 @@ rlm_rcode_t rlm_ldap_cacheable_userobj(rlm_ldap_t const *inst, REQUEST *request,
 		fr_cursor_append(&list_cursor, vp);
 
 		RDEBUG2("&control:%s += \"%pV\"", inst->cache_da->name, &vp->data);
-		ldap_memfree(*dn_p);
+		talloc_free(*dn_p);
 	}
 	REXDENT();
 
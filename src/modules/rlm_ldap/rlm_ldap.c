@@ -36,6 +36,7 @@ USES_APPLE_DEPRECATED_API
 #include "rlm_ldap.h"
 
 #include <freeradius-devel/server/map_proc.h>
+#include <freeradius-devel/unlang/base.h>
 
 static CONF_PARSER sasl_mech_dynamic[] = {
 	{ FR_CONF_OFFSET("mech", FR_TYPE_TMPL | FR_TYPE_NOT_EMPTY, fr_ldap_sasl_t_dynamic_t, mech) },
@@ -104,6 +105,20 @@ static CONF_PARSER user_config[] = {
 /*
  *	Group configuration
  */
+static CONF_PARSER replica_config[] = {
+	{ FR_CONF_OFFSET("name", FR_TYPE_STRING, rlm_ldap_t, replica_name) },
+	{ FR_CONF_OFFSET("attribute", FR_TYPE_STRING, rlm_ldap_t, replica_attr) },
+	{ FR_CONF_OFFSET("value", FR_TYPE_TMPL, rlm_ldap_t, replica_value) },
+	CONF_PARSER_TERMINATOR
+};
+
+static CONF_PARSER group_cache_config[] = {
+	{ FR_CONF_OFFSET("ttl", FR_TYPE_TIME_DELTA, rlm_ldap_t, group_cache_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("negative_ttl", FR_TYPE_TIME_DELTA, rlm_ldap_t, group_cache_negative_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_ldap_t, group_cache_max_entries), .dflt = "4096" },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER group_config[] = {
 	{ FR_CONF_OFFSET("filter", FR_TYPE_STRING, rlm_ldap_t, groupobj_filter) },
 	{ FR_CONF_OFFSET("scope", FR_TYPE_STRING, rlm_ldap_t, groupobj_scope_str), .dflt = "sub" },
@@ -117,6 +132,7 @@ static CONF_PARSER group_config[] = {
 	{ FR_CONF_OFFSET("cache_attribute", FR_TYPE_STRING, rlm_ldap_t, cache_attribute) },
 	{ FR_CONF_OFFSET("group_attribute", FR_TYPE_STRING, rlm_ldap_t, group_attribute) },
 	{ FR_CONF_OFFSET("allow_dangling_group_ref", FR_TYPE_BOOL, rlm_ldap_t, allow_dangling_group_refs), .dflt = "no" },
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) group_cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -223,6 +239,11 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_POINTER("global", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) global_config },
 
 	{ FR_CONF_OFFSET("tls", FR_TYPE_SUBSECTION, rlm_ldap_t, handle_config), .subcs = (void const *) tls_config },
+
+	{ FR_CONF_OFFSET("pipeline", FR_TYPE_BOOL, rlm_ldap_t, pipeline), .dflt = "no" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_ldap_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+
+	{ FR_CONF_POINTER("replica", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) replica_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -597,10 +618,12 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 	rlm_rcode_t		rcode;
 
 	bool			found = false;
+	bool			definitive = false;
 	bool			check_is_dn;
 
 	fr_ldap_connection_t		*conn = NULL;
-	char const		*user_dn;
+	char const		*user_dn = NULL;
+	VALUE_PAIR		*vp;
 
 	fr_assert(inst->groupobj_base_dn);
 
@@ -641,6 +664,13 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 		}
 	}
 
+	/*
+	 *	If we already know who the user is, we may
+	 *	not need a connection at all.
+	 */
+	vp = fr_pair_find_by_da(request->control, attr_ldap_userdn, TAG_ANY);
+	if (vp && rlm_ldap_group_cache_membership_find(inst, request, vp->vp_strvalue, check, &found)) goto finish;
+
 	conn = mod_conn_get(inst, request);
 	if (!conn) return 1;
 
@@ -655,6 +685,8 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	fr_assert(conn);
 
+	if (!vp && rlm_ldap_group_cache_membership_find(inst, request, user_dn, check, &found)) goto finish;
+
 	/*
 	 *	Check groupobj user membership
 	 */
@@ -665,6 +697,7 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 		case RLM_MODULE_OK:
 			found = true;
+			goto record;
 
 		default:
 			goto finish;
@@ -683,6 +716,7 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 		case RLM_MODULE_OK:
 			found = true;
+			break;
 
 		default:
 			goto finish;
@@ -691,7 +725,12 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	fr_assert(conn);
 
+record:
+	definitive = true;
+
 finish:
+	if (definitive) rlm_ldap_group_cache_membership_add(inst, user_dn, check, found);
+
 	if (conn) ldap_mod_conn_release(inst, request, conn);
 
 	if (!found) {
@@ -919,62 +958,68 @@ free_result:
 	return rcode;
 }
 
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+/** Expand the user map, and add the attributes we need for access, group and profile checks
+ *
+ * @param[out] expanded	Attributes to retrieve.  expanded->ctx must be freed by the caller.
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int ldap_authorize_attrs(fr_ldap_map_exp_t *expanded, rlm_ldap_t const *inst, REQUEST *request)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_OK;
-	int			ldap_errno;
-	int			i;
-	rlm_ldap_t const	*inst = instance;
-	struct berval		**values;
-	fr_ldap_connection_t	*conn;
-	LDAPMessage		*result, *entry;
-	char const 		*dn = NULL;
-	fr_ldap_map_exp_t	expanded; /* faster than allocing every time */
-#ifdef WITH_EDIR
-	fr_ldap_rcode_t		status;
-#endif
-
-	/*
-	 *	Don't be tempted to add a check for User-Name or
-	 *	User-Password here.  LDAP authorization can be used
-	 *	for many things besides searching for users.
-	 */
-
-	if (fr_ldap_map_expand(&expanded, request, inst->user_map) < 0) return RLM_MODULE_FAIL;
-
-	conn = mod_conn_get(inst, request);
-	if (!conn) return RLM_MODULE_FAIL;
+	if (fr_ldap_map_expand(expanded, request, inst->user_map) < 0) return -1;
 
 	/*
 	 *	Add any additional attributes we need for checking access, memberships, and profiles
 	 */
 	if (inst->userobj_access_attr) {
-		expanded.attrs[expanded.count++] = inst->userobj_access_attr;
+		expanded->attrs[expanded->count++] = inst->userobj_access_attr;
 	}
 
 	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
-		expanded.attrs[expanded.count++] = inst->userobj_membership_attr;
+		expanded->attrs[expanded->count++] = inst->userobj_membership_attr;
 	}
 
 	if (inst->profile_attr) {
-		expanded.attrs[expanded.count++] = inst->profile_attr;
+		expanded->attrs[expanded->count++] = inst->profile_attr;
 	}
 
 	if (inst->valuepair_attr) {
-		expanded.attrs[expanded.count++] = inst->valuepair_attr;
+		expanded->attrs[expanded->count++] = inst->valuepair_attr;
 	}
 
-	expanded.attrs[expanded.count] = NULL;
+	expanded->attrs[expanded->count] = NULL;
 
-	dn = rlm_ldap_find_user(inst, request, &conn, expanded.attrs, true, &result, &rcode);
-	if (!dn) {
-		goto finish;
-	}
+	return 0;
+}
 
-	entry = ldap_first_entry(conn->handle, result);
+/** Apply access checks, group caching, profiles and the user map to a user object
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @param[in,out] pconn	to use for any further searches, and to parse the result.
+ * @param[in] dn	of the user object.
+ * @param[in] result	of searching for the user object.
+ * @param[in] expanded	attributes the user object was searched for with.
+ * @return One of the RLM_MODULE_* codes.
+ */
+static rlm_rcode_t ldap_authorize_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_connection_t **pconn,
+				       char const *dn, LDAPMessage *result, fr_ldap_map_exp_t *expanded)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	int			ldap_errno;
+	int			i;
+	struct berval		**values;
+	LDAPMessage		*entry;
+#ifdef WITH_EDIR
+	fr_ldap_rcode_t		status;
+#endif
+
+	entry = ldap_first_entry((*pconn)->handle, result);
 	if (!entry) {
-		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
 
 		goto finish;
@@ -984,7 +1029,7 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 	 *	Check for access.
 	 */
 	if (inst->userobj_access_attr) {
-		rcode = rlm_ldap_check_access(inst, request, conn, entry);
+		rcode = rlm_ldap_check_access(inst, request, *pconn, entry);
 		if (rcode != RLM_MODULE_OK) {
 			goto finish;
 		}
@@ -995,13 +1040,13 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 	 */
 	if (inst->cacheable_group_dn || inst->cacheable_group_name) {
 		if (inst->userobj_membership_attr) {
-			rcode = rlm_ldap_cacheable_userobj(inst, request, &conn, entry, inst->userobj_membership_attr);
+			rcode = rlm_ldap_cacheable_userobj(inst, request, pconn, entry, inst->userobj_membership_attr);
 			if (rcode != RLM_MODULE_OK) {
 				goto finish;
 			}
 		}
 
-		rcode = rlm_ldap_cacheable_groupobj(inst, request, &conn);
+		rcode = rlm_ldap_cacheable_groupobj(inst, request, pconn);
 		if (rcode != RLM_MODULE_OK) {
 			goto finish;
 		}
@@ -1025,7 +1070,7 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 		/*
 		 *	Retrive universal password
 		 */
-		res = fr_ldap_edir_get_password(conn->handle, dn, password, &pass_size);
+		res = fr_ldap_edir_get_password((*pconn)->handle, dn, password, &pass_size);
 		if (res != 0) {
 			REDEBUG("Failed to retrieve eDirectory password: (%i) %s", res, fr_ldap_edir_errstr(res));
 			rcode = RLM_MODULE_FAIL;
@@ -1050,8 +1095,8 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 			/*
 			 *	Bind as the user
 			 */
-			conn->rebound = true;
-			status = fr_ldap_bind(request, &conn, dn, vp->vp_strvalue, NULL, 0, NULL, NULL);
+			(*pconn)->rebound = true;
+			status = fr_ldap_bind(request, pconn, dn, vp->vp_strvalue, NULL, 0, NULL, NULL);
 			switch (status) {
 			case LDAP_PROC_SUCCESS:
 				rcode = RLM_MODULE_OK;
@@ -1099,7 +1144,7 @@ skip_edir:
 			goto finish;
 		}
 
-		switch (rlm_ldap_map_profile(inst, request, &conn, profile, &expanded)) {
+		switch (rlm_ldap_map_profile(inst, request, pconn, profile, expanded)) {
 		case RLM_MODULE_INVALID:
 			rcode = RLM_MODULE_INVALID;
 			goto finish;
@@ -1120,14 +1165,14 @@ skip_edir:
 	 *	Apply a SET of user profiles.
 	 */
 	if (inst->profile_attr) {
-		values = ldap_get_values_len(conn->handle, entry, inst->profile_attr);
+		values = ldap_get_values_len((*pconn)->handle, entry, inst->profile_attr);
 		if (values != NULL) {
 			for (i = 0; values[i] != NULL; i++) {
 				rlm_rcode_t ret;
 				char *value;
 
 				value = fr_ldap_berval_to_string(request, values[i]);
-				ret = rlm_ldap_map_profile(inst, request, &conn, value, &expanded);
+				ret = rlm_ldap_map_profile(inst, request, pconn, value, expanded);
 				talloc_free(value);
 				if (ret == RLM_MODULE_FAIL) {
 					ldap_value_free_len(values);
@@ -1143,13 +1188,251 @@ skip_edir:
 	if (inst->user_map || inst->valuepair_attr) {
 		RDEBUG2("Processing user attributes");
 		RINDENT();
-		if (fr_ldap_map_do(request, conn, inst->valuepair_attr,
-				   &expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
+		if (fr_ldap_map_do(request, *pconn, inst->valuepair_attr,
+				   expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
+		REXDENT();
+		rlm_ldap_check_reply(inst, request, *pconn);
+	}
+
+finish:
+	return rcode;
+}
+
+/** Authorize the user using the in-memory replica of the directory
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @param[in] expanded	attributes to map.
+ * @param[out] rcode	The result of authorization.
+ * @return
+ *	- true if the user object was found in the replica.
+ *	- false if the directory should be searched instead.
+ */
+static bool ldap_authorize_replica(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_map_exp_t *expanded,
+				   rlm_rcode_t *rcode)
+{
+	fr_ldap_replica_entry_t const	*entry;
+	fr_ldap_result_t		access;
+	char const			*value;
+	char				value_buff[LDAP_MAX_FILTER_STR_LEN];
+	VALUE_PAIR			*vp;
+
+	if (tmpl_expand(&value, value_buff, sizeof(value_buff), request, inst->replica_value, NULL, NULL) < 0) {
+		RPWDEBUG("Failed expanding replica value, searching directory");
+		return false;
+	}
+
+	entry = fr_ldap_replica_find(inst->replica, inst->replica_attr, value);
+	if (!entry) {
+		RDEBUG2("No user object with %s \"%s\" in replica, searching directory", inst->replica_attr, value);
+		return false;
+	}
+
+	RDEBUG2("User object found in replica at DN \"%s\"", fr_ldap_replica_entry_dn(entry));
+
+	MEM(pair_update_control(&vp, attr_ldap_userdn) >= 0);
+	fr_pair_value_strcpy(vp, fr_ldap_replica_entry_dn(entry));
+
+	*rcode = RLM_MODULE_OK;
+
+	if (inst->userobj_access_attr) {
+		fr_ldap_replica_entry_values(&access, entry, inst->userobj_access_attr);
+		*rcode = rlm_ldap_check_access_values(inst, request, access.values);
+		if (*rcode != RLM_MODULE_OK) goto finish;
+	}
+
+	if (inst->user_map || inst->valuepair_attr) {
+		RDEBUG2("Processing user attributes");
+		RINDENT();
+		if (fr_ldap_replica_map_do(request, inst->valuepair_attr, expanded, entry) > 0) *rcode = RLM_MODULE_UPDATED;
 		REXDENT();
-		rlm_ldap_check_reply(inst, request, conn);
 	}
 
 finish:
+	fr_ldap_replica_unlock(inst->replica);
+
+	return true;
+}
+
+/** Asynchronous authorize state
+ *
+ */
+typedef struct {
+	fr_ldap_query_t		*query;			//!< Search in flight, NULL once the trunk has
+							//!< called us back.
+	fr_ldap_map_exp_t	expanded;		//!< Attributes being retrieved.
+	fr_ldap_rcode_t		status;			//!< Of the search.
+	LDAPMessage		*result;		//!< Stolen from the query.
+} ldap_autz_ctx_t;
+
+/** Free any result we didn't process
+ *
+ */
+static int _ldap_autz_ctx_free(ldap_autz_ctx_t *autz_ctx)
+{
+	if (autz_ctx->result) ldap_msgfree(autz_ctx->result);
+	talloc_free(autz_ctx->expanded.ctx);
+
+	return 0;
+}
+
+/** Record the result of the user object search, and mark the request as runnable
+ *
+ */
+static void ldap_autz_search_done(REQUEST *request, fr_ldap_query_t *query, void *uctx)
+{
+	ldap_autz_ctx_t	*autz_ctx = talloc_get_type_abort(uctx, ldap_autz_ctx_t);
+
+	autz_ctx->query = NULL;		/* Freed by the trunk */
+	autz_ctx->status = query->status;
+	autz_ctx->result = query->result;
+	query->result = NULL;
+
+	unlang_interpret_resumable(request);
+}
+
+/** Continue authorization once the user object has been retrieved
+ *
+ * The rest of authorization (group caching, profiles, eDirectory) still
+ * uses pooled connections, which may block.
+ */
+static rlm_rcode_t mod_authorize_resume(void *instance, UNUSED void *thread, REQUEST *request, void *uctx)
+{
+	rlm_ldap_t const	*inst = instance;
+	ldap_autz_ctx_t		*autz_ctx = talloc_get_type_abort(uctx, ldap_autz_ctx_t);
+	fr_ldap_connection_t	*conn;
+	char const		*dn = NULL;
+	rlm_rcode_t		rcode;
+
+	switch (autz_ctx->status) {
+	case LDAP_PROC_SUCCESS:
+	case LDAP_PROC_BAD_CONN:
+		break;
+
+	case LDAP_PROC_BAD_DN:
+	case LDAP_PROC_NO_RESULT:
+		rcode = RLM_MODULE_NOTFOUND;
+		goto finish;
+
+	default:
+		RPEDEBUG("Failed searching for user object");
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	conn = mod_conn_get(inst, request);
+	if (!conn) {
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	/*
+	 *	We couldn't get the search onto a trunked
+	 *	connection, so try again the old fashioned way.
+	 */
+	if (autz_ctx->status == LDAP_PROC_BAD_CONN) {
+		RDEBUG2("Trunked search failed, retrying");
+		dn = rlm_ldap_find_user(inst, request, &conn, autz_ctx->expanded.attrs, true, &autz_ctx->result, &rcode);
+	} else {
+		dn = rlm_ldap_user_result(inst, request, conn, autz_ctx->result, &rcode);
+	}
+	if (dn) rcode = ldap_authorize_user(inst, request, &conn, dn, autz_ctx->result, &autz_ctx->expanded);
+
+	ldap_mod_conn_release(inst, request, conn);
+
+finish:
+	talloc_free(autz_ctx);
+
+	return rcode;
+}
+
+/** Stop waiting for the user object if the request is cancelled
+ *
+ */
+static void mod_authorize_signal(UNUSED void *instance, UNUSED void *thread, UNUSED REQUEST *request, void *uctx,
+				 fr_state_signal_t action)
+{
+	ldap_autz_ctx_t	*autz_ctx = talloc_get_type_abort(uctx, ldap_autz_ctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (autz_ctx->query) {
+		fr_ldap_query_cancel(autz_ctx->query);		/* Trunk frees the query */
+		autz_ctx->query = NULL;
+	}
+	talloc_free(autz_ctx);
+}
+
+/** Search for the user object over the trunk, yielding until the result arrives
+ *
+ */
+static rlm_rcode_t mod_authorize_async(rlm_ldap_t const *inst, fr_ldap_trunk_t *trunk, REQUEST *request,
+				       fr_ldap_map_exp_t *expanded)
+{
+	ldap_autz_ctx_t	*autz_ctx;
+	rlm_rcode_t	rcode;
+	char const	*filter;
+	char		filter_buff[LDAP_MAX_FILTER_STR_LEN];
+	char const	*base_dn;
+	char		base_dn_buff[LDAP_MAX_DN_STR_LEN];
+	LDAPControl	*serverctrls[] = { inst->userobj_sort_ctrl, NULL };
+
+	MEM(autz_ctx = talloc_zero(request, ldap_autz_ctx_t));
+	autz_ctx->expanded = *expanded;
+	talloc_set_destructor(autz_ctx, _ldap_autz_ctx_free);
+
+	rcode = rlm_ldap_user_search_expand(inst, request, &base_dn, base_dn_buff, sizeof(base_dn_buff),
+					    &filter, filter_buff, sizeof(filter_buff));
+	if (rcode != RLM_MODULE_OK) {
+		talloc_free(autz_ctx);
+		return rcode;
+	}
+
+	autz_ctx->query = fr_ldap_trunk_search(autz_ctx, trunk, request, base_dn, inst->userobj_scope, filter,
+					       autz_ctx->expanded.attrs, serverctrls, ldap_autz_search_done, autz_ctx);
+	if (!autz_ctx->query) {
+		talloc_free(autz_ctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_authorize_resume, mod_authorize_signal, autz_ctx);
+}
+
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	rlm_ldap_t const	*inst = instance;
+	rlm_ldap_thread_t	*t = thread;
+	fr_ldap_connection_t	*conn;
+	LDAPMessage		*result = NULL;
+	char const 		*dn = NULL;
+	fr_ldap_map_exp_t	expanded; /* faster than allocing every time */
+
+	/*
+	 *	Don't be tempted to add a check for User-Name or
+	 *	User-Password here.  LDAP authorization can be used
+	 *	for many things besides searching for users.
+	 */
+
+	if (ldap_authorize_attrs(&expanded, inst, request) < 0) return RLM_MODULE_FAIL;
+
+	if (inst->replica && ldap_authorize_replica(inst, request, &expanded, &rcode)) {
+		talloc_free(expanded.ctx);
+		return rcode;
+	}
+
+	if (t->trunk) return mod_authorize_async(inst, t->trunk, request, &expanded);
+
+	conn = mod_conn_get(inst, request);
+	if (!conn) {
+		talloc_free(expanded.ctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	dn = rlm_ldap_find_user(inst, request, &conn, expanded.attrs, true, &result, &rcode);
+	if (dn) rcode = ldap_authorize_user(inst, request, &conn, dn, result, &expanded);
+
 	talloc_free(expanded.ctx);
 	if (result) ldap_msgfree(result);
 	ldap_mod_conn_release(inst, request, conn);
@@ -1422,6 +1705,8 @@ static int mod_detach(void *instance)
 #endif
 
 	fr_pool_free(inst->pool);
+	rlm_ldap_group_cache_free(inst);
+	if (inst->replica) fr_ldap_replica_detach(inst->replica);
 
 	return 0;
 }
@@ -1577,6 +1862,41 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		}
 	}
 
+	if (rlm_ldap_group_cache_init(inst) < 0) {
+		cf_log_err(conf, "Failed initialising group cache");
+		goto error;
+	}
+
+	/*
+	 *	The replica only has what's in the user object,
+	 *	so anything that needs further searches, or a
+	 *	bind, has to go to the directory.
+	 */
+	if (inst->replica_name) {
+		if (!inst->replica_attr || !inst->replica_value) {
+			cf_log_err(conf, "Configuration items 'replica.attribute' and 'replica.value' must be set "
+				   "if 'replica.name' is");
+			goto error;
+		}
+
+		if (inst->cacheable_group_dn || inst->cacheable_group_name || inst->default_profile ||
+		    inst->profile_attr
+#ifdef WITH_EDIR
+		    || inst->edir
+#endif
+		    ) {
+			cf_log_err(conf, "'replica' cannot be used with cacheable groups, profiles, or eDirectory");
+			goto error;
+		}
+
+		inst->replica = fr_ldap_replica_acquire(inst->replica_name);
+		if (!inst->replica) {
+			cf_log_perr(conf, "Failed finding replica");
+			goto error;
+		}
+		fr_ldap_replica_index_add(inst->replica, inst->replica_attr);
+	}
+
 	/*
 	 *	If we have a *pair* as opposed to a *section*
 	 *	then the module is referencing another ldap module's
@@ -1997,6 +2317,27 @@ error:
 	return -1;
 }
 
+/** Open the trunked connections used for asynchronous user object searches
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_ldap_t		*inst = instance;
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(thread, rlm_ldap_thread_t);
+	char			*log_prefix;
+
+	if (!inst->pipeline) return 0;
+
+	log_prefix = talloc_asprintf(t, "rlm_ldap (%s)", inst->name);
+	t->trunk = fr_ldap_trunk_alloc(t, el, &inst->handle_config, &inst->trunk_conf, log_prefix);
+	if (!t->trunk) {
+		ERROR("Failed creating trunked connections");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_ldap_init();
@@ -2022,6 +2363,9 @@ module_t rlm_ldap = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_inst_size	= sizeof(rlm_ldap_thread_t),
+	.thread_inst_type	= "rlm_ldap_thread_t",
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
@@ -18,6 +18,7 @@
 #include <freeradius-devel/ldap/base.h>
 
 typedef struct ldap_inst_s rlm_ldap_t;
+typedef struct ldap_group_cache_s ldap_group_cache_t;
 
 typedef struct {
 	vp_tmpl_t	*mech;				//!< SASL mech(s) to try.
@@ -112,6 +113,13 @@ struct ldap_inst_s {
 	bool		allow_dangling_group_refs;	//!< Don't error if we fail to resolve a group DN referenced
 														///< from a user object.
 
+	fr_time_delta_t	group_cache_ttl;		//!< How long to remember membership checks and group
+							///< name/DN resolutions for.  Zero disables the cache.
+	fr_time_delta_t	group_cache_negative_ttl;	//!< How long to remember group names and DNs which
+							///< didn't resolve.
+	uint32_t	group_cache_max_entries;	//!< Evict the least recently used entries above this.
+	ldap_group_cache_t *group_cache;		//!< Shared between all threads.  NULL if disabled.
+
 	/*
 	 *	Profiles
 	 */
@@ -142,6 +150,15 @@ struct ldap_inst_s {
 	fr_pool_t	*pool;				//!< Connection pool instance.
 	fr_ldap_config_t handle_config;			//!< Connection configuration instance.
 
+	bool		pipeline;			//!< Search for user objects over trunked connections,
+							///< yielding the request instead of blocking.
+	fr_trunk_conf_t	trunk_conf;			//!< For the trunked connections.
+
+	char const	*replica_name;			//!< In-memory replica maintained by proto_ldap_sync.
+	char const	*replica_attr;			//!< Attribute to find user objects in the replica by.
+	vp_tmpl_t	*replica_value;			//!< Value of replica_attr the user object should have.
+	fr_ldap_replica_t *replica;			//!< Looked at before searching for user objects.
+
 	/*
 	 *	Global config
 	 */
@@ -151,6 +168,13 @@ struct ldap_inst_s {
 	uint32_t	ldap_debug;			//!< Debug flag for the SDK.
 };
 
+/** Thread specific instance data
+ *
+ */
+typedef struct {
+	fr_ldap_trunk_t	*trunk;				//!< Admin connections for user object searches.
+} rlm_ldap_thread_t;
+
 extern fr_dict_attr_t const *attr_cleartext_password;
 extern fr_dict_attr_t const *attr_crypt_password;
 extern fr_dict_attr_t const *attr_ldap_userdn;
@@ -163,12 +187,21 @@ extern fr_dict_attr_t const *attr_user_name;
 /*
  *	user.c - User lookup functions
  */
+rlm_rcode_t rlm_ldap_user_search_expand(rlm_ldap_t const *inst, REQUEST *request,
+					char const **base_dn, char *base_dn_buff, size_t base_dn_len,
+					char const **filter, char *filter_buff, size_t filter_len);
+
+char const *rlm_ldap_user_result(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_connection_t const *conn,
+				 LDAPMessage *result, rlm_rcode_t *rcode);
+
 char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_connection_t **pconn,
 			       char const *attrs[], bool force, LDAPMessage **result, rlm_rcode_t *rcode);
 
 rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, REQUEST *request,
 				  fr_ldap_connection_t const *conn, LDAPMessage *entry);
 
+rlm_rcode_t rlm_ldap_check_access_values(rlm_ldap_t const *inst, REQUEST *request, struct berval **values);
+
 void rlm_ldap_check_reply(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_connection_t const *conn);
 
 /*
@@ -187,6 +220,16 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(rlm_ldap_t const *inst, REQUEST *requ
 
 rlm_rcode_t rlm_ldap_check_cached(rlm_ldap_t const *inst, REQUEST *request, VALUE_PAIR *check);
 
+int rlm_ldap_group_cache_init(rlm_ldap_t *inst);
+
+void rlm_ldap_group_cache_free(rlm_ldap_t *inst);
+
+bool rlm_ldap_group_cache_membership_find(rlm_ldap_t const *inst, REQUEST *request,
+					  char const *user_dn, VALUE_PAIR const *check, bool *member);
+
+void rlm_ldap_group_cache_membership_add(rlm_ldap_t const *inst, char const *user_dn,
+					 VALUE_PAIR const *check, bool member);
+
 /*
  *	conn.c - Connection wrappers.
  */
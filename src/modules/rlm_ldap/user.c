@@ -36,6 +36,120 @@ USES_APPLE_DEPRECATED_API
 
 #include "rlm_ldap.h"
 
+/** Expand the base DN and filter used to search for a user object
+ *
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @param[out] base_dn		Where to write the expanded base DN.
+ * @param[in] base_dn_buff	Buffer to expand the base DN into.
+ * @param[in] base_dn_len	Length of base_dn_buff.
+ * @param[out] filter		Where to write the expanded filter.  Will be NULL if no filter was configured.
+ * @param[in] filter_buff	Buffer to expand the filter into.
+ * @param[in] filter_len	Length of filter_buff.
+ * @return
+ *	- #RLM_MODULE_OK on success.
+ *	- #RLM_MODULE_INVALID if either expansion failed.
+ */
+rlm_rcode_t rlm_ldap_user_search_expand(rlm_ldap_t const *inst, REQUEST *request,
+					char const **base_dn, char *base_dn_buff, size_t base_dn_len,
+					char const **filter, char *filter_buff, size_t filter_len)
+{
+	*filter = NULL;
+
+	if (inst->userobj_filter) {
+		if (tmpl_expand(filter, filter_buff, filter_len, request, inst->userobj_filter,
+				fr_ldap_escape_func, NULL) < 0) {
+			REDEBUG("Unable to create filter");
+			return RLM_MODULE_INVALID;
+		}
+	}
+
+	if (tmpl_expand(base_dn, base_dn_buff, base_dn_len, request,
+			inst->userobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Unable to create base_dn");
+		return RLM_MODULE_INVALID;
+	}
+
+	return RLM_MODULE_OK;
+}
+
+/** Extract the DN of a user object from a search result
+ *
+ * Adds the DN to the control list as LDAP-UserDN.
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] request	Current request.
+ * @param[in] conn	Used to parse the result.  Does not need to be the
+ *			connection the search was performed on.
+ * @param[in] result	of searching for the user object.  Not freed.
+ * @param[out] rcode	The status of the operation, one of the RLM_MODULE_* codes.
+ * @return The user's DN or NULL on error.
+ */
+char const *rlm_ldap_user_result(rlm_ldap_t const *inst, REQUEST *request, fr_ldap_connection_t const *conn,
+				 LDAPMessage *result, rlm_rcode_t *rcode)
+{
+	VALUE_PAIR	*vp = NULL;
+	LDAPMessage	*entry;
+	int		ldap_errno;
+	int		cnt;
+	char		*dn;
+
+	*rcode = RLM_MODULE_FAIL;
+
+	/*
+	 *	Forbid the use of unsorted search results that
+	 *	contain multiple entries, as it's a potential
+	 *	security issue, and likely non deterministic.
+	 */
+	if (!inst->userobj_sort_ctrl) {
+		cnt = ldap_count_entries(conn->handle, result);
+		if (cnt > 1) {
+			REDEBUG("Ambiguous search result, returned %i unsorted entries (should return 1 or 0).  "
+				"Enable sorting, or specify a more restrictive base_dn, filter or scope", cnt);
+			REDEBUG("The following entries were returned:");
+			RINDENT();
+			for (entry = ldap_first_entry(conn->handle, result);
+			     entry;
+			     entry = ldap_next_entry(conn->handle, entry)) {
+				dn = ldap_get_dn(conn->handle, entry);
+				REDEBUG("%s", dn);
+				ldap_memfree(dn);
+			}
+			REXDENT();
+			*rcode = RLM_MODULE_INVALID;
+			return NULL;
+		}
+	}
+
+	entry = ldap_first_entry(conn->handle, result);
+	if (!entry) {
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		REDEBUG("Failed retrieving entry: %s",
+			ldap_err2string(ldap_errno));
+
+		return NULL;
+	}
+
+	dn = ldap_get_dn(conn->handle, entry);
+	if (!dn) {
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
+
+		return NULL;
+	}
+	fr_ldap_util_normalise_dn(dn, dn);
+
+	RDEBUG2("User object found at DN \"%s\"", dn);
+
+	MEM(pair_update_control(&vp, attr_ldap_userdn) >= 0);
+	fr_pair_value_strcpy(vp, dn);
+	*rcode = RLM_MODULE_OK;
+
+	ldap_memfree(dn);
+
+	return vp->vp_strvalue;
+}
+
 /** Retrieve the DN of a user object
  *
  * Retrieves the DN of a user and adds it to the control list as LDAP-UserDN. Will also retrieve any
@@ -61,10 +175,8 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 
 	fr_ldap_rcode_t	status;
 	VALUE_PAIR	*vp = NULL;
-	LDAPMessage	*tmp_msg = NULL, *entry = NULL;
-	int		ldap_errno;
-	int		cnt;
-	char		*dn = NULL;
+	LDAPMessage	*tmp_msg = NULL;
+	char const	*dn;
 	char const	*filter = NULL;
 	char	    	filter_buff[LDAP_MAX_FILTER_STR_LEN];
 	char const	*base_dn;
@@ -115,23 +227,9 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 		(*pconn)->rebound = false;
 	}
 
-	if (inst->userobj_filter) {
-		if (tmpl_expand(&filter, filter_buff, sizeof(filter_buff), request, inst->userobj_filter,
-				fr_ldap_escape_func, NULL) < 0) {
-			REDEBUG("Unable to create filter");
-			*rcode = RLM_MODULE_INVALID;
-
-			return NULL;
-		}
-	}
-
-	if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
-			inst->userobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
-		REDEBUG("Unable to create base_dn");
-		*rcode = RLM_MODULE_INVALID;
-
-		return NULL;
-	}
+	*rcode = rlm_ldap_user_search_expand(inst, request, &base_dn, base_dn_buff, sizeof(base_dn_buff),
+					     &filter, filter_buff, sizeof(filter_buff));
+	if (*rcode != RLM_MODULE_OK) return NULL;
 
 	status = fr_ldap_search(result, request, pconn, base_dn,
 				inst->userobj_scope, filter, attrs, serverctrls, NULL);
@@ -151,64 +249,14 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, fr_ldap
 
 	fr_assert(*pconn);
 
-	/*
-	 *	Forbid the use of unsorted search results that
-	 *	contain multiple entries, as it's a potential
-	 *	security issue, and likely non deterministic.
-	 */
-	if (!inst->userobj_sort_ctrl) {
-		cnt = ldap_count_entries((*pconn)->handle, *result);
-		if (cnt > 1) {
-			REDEBUG("Ambiguous search result, returned %i unsorted entries (should return 1 or 0).  "
-				"Enable sorting, or specify a more restrictive base_dn, filter or scope", cnt);
-			REDEBUG("The following entries were returned:");
-			RINDENT();
-			for (entry = ldap_first_entry((*pconn)->handle, *result);
-			     entry;
-			     entry = ldap_next_entry((*pconn)->handle, entry)) {
-				dn = ldap_get_dn((*pconn)->handle, entry);
-				REDEBUG("%s", dn);
-				ldap_memfree(dn);
-			}
-			REXDENT();
-			*rcode = RLM_MODULE_INVALID;
-			goto finish;
-		}
-	}
+	dn = rlm_ldap_user_result(inst, request, *pconn, *result, rcode);
 
-	entry = ldap_first_entry((*pconn)->handle, *result);
-	if (!entry) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-		REDEBUG("Failed retrieving entry: %s",
-			ldap_err2string(ldap_errno));
-
-		goto finish;
-	}
-
-	dn = ldap_get_dn((*pconn)->handle, entry);
-	if (!dn) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-		REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
-
-		goto finish;
-	}
-	fr_ldap_util_normalise_dn(dn, dn);
-
-	RDEBUG2("User object found at DN \"%s\"", dn);
-
-	MEM(pair_update_control(&vp, attr_ldap_userdn) >= 0);
-	fr_pair_value_strcpy(vp, dn);
-	*rcode = RLM_MODULE_OK;
-
-	ldap_memfree(dn);
-
-finish:
 	if ((freeit || (*rcode != RLM_MODULE_OK)) && *result) {
 		ldap_msgfree(*result);
 		*result = NULL;
 	}
 
-	return vp ? vp->vp_strvalue : NULL;
+	return dn;
 }
 
 /** Check for presence of access attribute in result
@@ -224,11 +272,30 @@ finish:
 rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, REQUEST *request,
 				  fr_ldap_connection_t const *conn, LDAPMessage *entry)
 {
-	rlm_rcode_t rcode = RLM_MODULE_OK;
+	rlm_rcode_t rcode;
 	struct berval **values = NULL;
 
 	values = ldap_get_values_len(conn->handle, entry, inst->userobj_access_attr);
-	if (values) {
+	rcode = rlm_ldap_check_access_values(inst, request, values);
+	if (values) ldap_value_free_len(values);
+
+	return rcode;
+}
+
+/** Check the values of the access attribute
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] values of the access attribute.  NULL if the user object didn't have one.
+ * @return
+ *	- #RLM_MODULE_DISALLOW if the user was denied access.
+ *	- #RLM_MODULE_OK otherwise.
+ */
+rlm_rcode_t rlm_ldap_check_access_values(rlm_ldap_t const *inst, REQUEST *request, struct berval **values)
+{
+	rlm_rcode_t rcode = RLM_MODULE_OK;
+
+	if (values && values[0]) {
 		if (inst->access_positive) {
 			if ((values[0]->bv_len >= 5) && (strncasecmp(values[0]->bv_val, "false", 5) == 0)) {
 				REDEBUG("\"%s\" attribute exists but is set to 'false' - user locked out",
@@ -240,7 +307,6 @@ rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, REQUEST *request,
 			REDEBUG("\"%s\" attribute exists - user locked out", inst->userobj_access_attr);
 			rcode = RLM_MODULE_DISALLOW;
 		}
-		ldap_value_free_len(values);
 	} else if (inst->access_positive) {
 		REDEBUG("No \"%s\" attribute - user locked out", inst->userobj_access_attr);
 		rcode = RLM_MODULE_DISALLOW;
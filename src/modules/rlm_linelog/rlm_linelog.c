@@ -67,6 +67,17 @@ static fr_table_num_sorted_t const linefr_log_dst_table[] = {
 };
 static size_t linefr_log_dst_table_len = NUM_ELEMENTS(linefr_log_dst_table);
 
+typedef enum {
+	LINELOG_DROP_OLDEST = 0,			//!< Make room by discarding the oldest queued entry.
+	LINELOG_DROP_NEWEST,				//!< Discard the entry being logged.
+} linelog_drop_t;
+
+static fr_table_num_sorted_t const linelog_drop_table[] = {
+	{ "newest",	LINELOG_DROP_NEWEST	},
+	{ "oldest",	LINELOG_DROP_OLDEST	}
+};
+static size_t linelog_drop_table_len = NUM_ELEMENTS(linelog_drop_table);
+
 typedef struct {
 	fr_ipaddr_t		dst_ipaddr;		//!< Network server.
 	fr_ipaddr_t		src_ipaddr;		//!< Send requests from a given src_ipaddr.
@@ -105,6 +116,9 @@ typedef struct {
 		exfile_t		*ef;			//!< Exclusive file access handle.
 		bool			escape;			//!< Do filename escaping, yes / no.
 		xlat_escape_t		escape_func;		//!< Escape function.
+		size_t			buffer_size;		//!< Per-thread write buffer size, 0 to write
+								///< every entry immediately.
+		fr_time_delta_t		flush_delay;		//!< Maximum time an entry sits in the buffer.
 	} file;
 
 	struct {
@@ -115,6 +129,16 @@ typedef struct {
 	linelog_net_t		tcp;			//!< TCP server.
 	linelog_net_t		udp;			//!< UDP server.
 
+	struct {
+		size_t			queue_size;		//!< Per-thread queue size, 0 to write through
+								///< the connection pool instead.
+		size_t			flush_size;		//!< Write the queue when this much is waiting.
+		fr_time_delta_t		flush_delay;		//!< Maximum time an entry sits in the queue.
+		fr_time_delta_t		reconnect_delay;	//!< How long to wait before reconnecting.
+		char const		*drop_str;		//!< What to drop when the queue is full.
+		linelog_drop_t		drop;			//!< Resolved drop policy.
+	} async;
+
 	CONF_SECTION		*cs;			//!< #CONF_SECTION to use as the root for #log_ref lookups.
 } linelog_instance_t;
 
@@ -122,12 +146,42 @@ typedef struct {
 	int			sockfd;			//!< File descriptor associated with socket
 } linelog_conn_t;
 
+/** A log entry waiting to be sent
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< In the thread's queue.
+	size_t			len;			//!< Length of data.
+	uint8_t			data[];			//!< The entry, including delimiters.
+} linelog_msg_t;
+
+typedef struct {
+	linelog_instance_t const *inst;			//!< Instance of rlm_linelog.
+	exfile_thread_t		*eft;			//!< Buffered file handle, if file.buffer_size is set.
+
+	struct {
+		fr_event_list_t		*el;			//!< Event list servicing the socket and timers.
+		int			fd;			//!< Socket, or -1 if not connected.
+		bool			connected;		//!< Whether the connect() has completed.
+		fr_event_timer_t const	*flush_ev;		//!< Flush timer, armed when entries are queued.
+		fr_event_timer_t const	*reconnect_ev;		//!< Reconnect timer.
+		fr_dlist_head_t		queue;			//!< Entries waiting to be sent.
+		size_t			queued;			//!< Bytes in the queue.
+		size_t			sent;			//!< How much of the first entry has been sent.
+		uint64_t		written;		//!< Entries sent.
+		uint64_t		dropped;		//!< Entries discarded because the queue was full.
+		fr_rate_limit_t		drop_rate_limit;	//!< For complaining about dropped entries.
+	} async;
+} rlm_linelog_thread_t;
+
 
 static const CONF_PARSER file_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_XLAT, linelog_instance_t, file.name) },
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, linelog_instance_t, file.permissions), .dflt = "0600" },
 	{ FR_CONF_OFFSET("group", FR_TYPE_STRING, linelog_instance_t, file.group_str) },
 	{ FR_CONF_OFFSET("escape_filenames", FR_TYPE_BOOL, linelog_instance_t, file.escape), .dflt = "no" },
+	{ FR_CONF_OFFSET("buffer_size", FR_TYPE_SIZE, linelog_instance_t, file.buffer_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("flush_delay", FR_TYPE_TIME_DELTA, linelog_instance_t, file.flush_delay), .dflt = "1.0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -156,6 +210,15 @@ static const CONF_PARSER tcp_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER async_config[] = {
+	{ FR_CONF_OFFSET("queue_size", FR_TYPE_SIZE, linelog_instance_t, async.queue_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("flush_size", FR_TYPE_SIZE, linelog_instance_t, async.flush_size), .dflt = "16384" },
+	{ FR_CONF_OFFSET("flush_delay", FR_TYPE_TIME_DELTA, linelog_instance_t, async.flush_delay), .dflt = "0.1" },
+	{ FR_CONF_OFFSET("reconnect_delay", FR_TYPE_TIME_DELTA, linelog_instance_t, async.reconnect_delay), .dflt = "1.0" },
+	{ FR_CONF_OFFSET("drop", FR_TYPE_STRING, linelog_instance_t, async.drop_str), .dflt = "oldest" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("destination", FR_TYPE_STRING | FR_TYPE_REQUIRED, linelog_instance_t, log_dst_str) },
 
@@ -172,6 +235,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("tcp", FR_TYPE_SUBSECTION, linelog_instance_t, tcp), .subcs= (void const *) tcp_config },
 	{ FR_CONF_OFFSET("udp", FR_TYPE_SUBSECTION, linelog_instance_t, udp), .subcs = (void const *) udp_config },
 
+	{ FR_CONF_POINTER("async", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) async_config },
+
 	/*
 	 *	Deprecated config items
 	 */
@@ -312,6 +377,18 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 	snprintf(prefix, sizeof(prefix), "rlm_linelog (%s)", inst->name);
 
+	inst->async.drop = fr_table_value_by_str(linelog_drop_table, inst->async.drop_str, -1);
+	if ((int) inst->async.drop < 0) {
+		cf_log_err(conf, "Invalid value \"%s\" for 'async.drop', must be \"oldest\" or \"newest\"",
+			   inst->async.drop_str);
+		return -1;
+	}
+
+	if (inst->async.queue_size) {
+		FR_SIZE_BOUND_CHECK("async.flush_size", inst->async.flush_size, <=, inst->async.queue_size);
+		FR_TIME_DELTA_BOUND_CHECK("async.reconnect_delay", inst->async.reconnect_delay, >=, fr_time_delta_from_msec(100));
+	}
+
 	/*
 	 *	Setup the logging destination
 	 */
@@ -376,6 +453,8 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		cf_log_err(conf, "Unix sockets are not supported on this sytem");
 		return -1;
 #else
+		if (inst->async.queue_size) break;	/* Each thread has its own socket */
+
 		inst->pool = module_connection_pool_init(cf_section_find(conf, "unix", NULL),
 							 inst, mod_conn_create, NULL, prefix, NULL, NULL);
 		if (!inst->pool) return -1;
@@ -383,12 +462,16 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		break;
 
 	case LINELOG_DST_UDP:
+		if (inst->async.queue_size) break;	/* Each thread has its own socket */
+
 		inst->pool = module_connection_pool_init(cf_section_find(conf, "udp", NULL),
 							 inst, mod_conn_create, NULL, prefix, NULL, NULL);
 		if (!inst->pool) return -1;
 		break;
 
 	case LINELOG_DST_TCP:
+		if (inst->async.queue_size) break;	/* Each thread has its own socket */
+
 		inst->pool = module_connection_pool_init(cf_section_find(conf, "tcp", NULL),
 							 inst, mod_conn_create, NULL, prefix, NULL, NULL);
 		if (!inst->pool) return -1;
@@ -435,6 +518,366 @@ static size_t linelog_escape_func(UNUSED REQUEST *request,
 	return fr_snprint(out, outlen, in, -1, 0);
 }
 
+/*
+ *	Asynchronous output to sockets.
+ *
+ *	Each thread owns a non-blocking socket and a bounded queue of
+ *	log entries.  Logging an entry copies it to the queue, and the
+ *	queue is written out from the event loop, so a slow or dead
+ *	log collector never blocks a worker.
+ */
+static void linelog_async_flush(rlm_linelog_thread_t *t);
+static void linelog_async_connect(rlm_linelog_thread_t *t);
+
+static void _linelog_async_reconnect_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_linelog_thread_t *t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+
+	linelog_async_connect(t);
+}
+
+/** Close the socket, and try again after reconnect_delay
+ *
+ * Queued entries are kept.  If part of the first entry has already been sent,
+ * it's sent again in full on the new connection.
+ */
+static void linelog_async_close(rlm_linelog_thread_t *t, bool reconnect)
+{
+	if (t->async.fd >= 0) {
+		(void) fr_event_fd_delete(t->async.el, t->async.fd, FR_EVENT_FILTER_IO);
+		close(t->async.fd);
+		t->async.fd = -1;
+	}
+	t->async.connected = false;
+	t->async.sent = 0;
+
+	if (!reconnect || t->async.reconnect_ev) return;
+
+	if (fr_event_timer_in(t, t->async.el, &t->async.reconnect_ev, t->inst->async.reconnect_delay,
+			      _linelog_async_reconnect_timer, t) < 0) {
+		PERROR("Failed inserting reconnect timer");
+	}
+}
+
+static void _linelog_async_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				 int fd_errno, void *uctx)
+{
+	rlm_linelog_thread_t *t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+
+	WARN("Connection to log destination failed: %s.  Will reconnect", fr_syserror(fd_errno));
+	linelog_async_close(t, true);
+}
+
+/*
+ *	We never expect anything back.  Discard it, and notice
+ *	when the other end closes the connection.
+ */
+static void _linelog_async_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+	char			discard[64];
+	ssize_t			slen;
+
+	while ((slen = read(fd, discard, sizeof(discard))) > 0);
+
+	if ((slen == 0) && (t->inst->log_dst != LINELOG_DST_UDP)) {
+		WARN("Log destination closed the connection.  Will reconnect");
+		linelog_async_close(t, true);
+		return;
+	}
+
+	if ((slen < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+		WARN("Failed reading from log destination: %s.  Will reconnect", fr_syserror(errno));
+		linelog_async_close(t, true);
+	}
+}
+
+static void _linelog_async_write(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	rlm_linelog_thread_t *t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+
+	if (!t->async.connected) {
+		DEBUG2("Connection to log destination successful");
+		t->async.connected = true;
+	}
+
+	linelog_async_flush(t);
+}
+
+/** Only ask to be told about writability when there's data waiting, or we're connecting
+ *
+ */
+static int linelog_async_events(rlm_linelog_thread_t *t, bool want_write)
+{
+	if (fr_event_fd_insert(t, t->async.el, t->async.fd,
+			       _linelog_async_read,
+			       want_write ? _linelog_async_write : NULL,
+			       _linelog_async_error, t) < 0) {
+		PERROR("Failed inserting socket into event loop");
+		linelog_async_close(t, true);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void linelog_async_connect(rlm_linelog_thread_t *t)
+{
+	linelog_instance_t const	*inst = t->inst;
+	int				fd = -1;
+
+	t->async.reconnect_ev = NULL;
+
+	switch (inst->log_dst) {
+	case LINELOG_DST_UNIX:
+		fd = fr_socket_client_unix(inst->unix_sock.path, true);
+		break;
+
+	case LINELOG_DST_TCP:
+		fd = fr_socket_client_tcp(NULL, &inst->tcp.dst_ipaddr, inst->tcp.port, true);
+		break;
+
+	case LINELOG_DST_UDP:
+		fd = fr_socket_client_udp(NULL, NULL, &inst->udp.dst_ipaddr, inst->udp.port, true);
+		break;
+
+	default:
+		fr_assert(0);
+		return;
+	}
+
+	if (fd < 0) {
+		PWARN("Failed opening connection to log destination.  Will retry");
+		linelog_async_close(t, true);
+		return;
+	}
+
+	/*
+	 *	The socket becomes writable when the connect
+	 *	completes.  Until then, entries wait in the queue.
+	 */
+	t->async.fd = fd;
+	t->async.connected = false;
+	(void) linelog_async_events(t, true);
+}
+
+static void linelog_async_msg_free(rlm_linelog_thread_t *t, linelog_msg_t *msg)
+{
+	fr_dlist_remove(&t->async.queue, msg);
+	t->async.queued -= msg->len;
+	talloc_free(msg);
+}
+
+/** Write as much of the queue as the socket will take
+ *
+ * Stream sockets get as many entries as possible in a single writev().
+ * Datagram sockets get one entry per datagram.
+ */
+static void linelog_async_flush(rlm_linelog_thread_t *t)
+{
+	bool stream = (t->inst->log_dst != LINELOG_DST_UDP);
+
+	if (t->async.flush_ev) fr_event_timer_delete(&t->async.flush_ev);
+
+	if ((t->async.fd < 0) || !t->async.connected) return;
+
+	while (!fr_dlist_empty(&t->async.queue)) {
+		struct iovec	vector[64];
+		linelog_msg_t	*msg;
+		int		i = 0;
+		ssize_t		slen;
+
+		for (msg = fr_dlist_head(&t->async.queue);
+		     msg && (i < (int) NUM_ELEMENTS(vector));
+		     msg = fr_dlist_next(&t->async.queue, msg)) {
+			vector[i].iov_base = msg->data;
+			vector[i].iov_len = msg->len;
+			i++;
+
+			if (!stream) break;
+		}
+
+		vector[0].iov_base = (uint8_t *) vector[0].iov_base + t->async.sent;
+		vector[0].iov_len -= t->async.sent;
+
+		slen = writev(t->async.fd, vector, i);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				(void) linelog_async_events(t, true);
+				return;
+			}
+
+			WARN("Failed writing to log destination: %s.  Will reconnect", fr_syserror(errno));
+			linelog_async_close(t, true);
+			return;
+		}
+
+		/*
+		 *	Free everything which has been completely
+		 *	written, and remember how far we got into
+		 *	the next entry.
+		 */
+		slen += t->async.sent;
+		t->async.sent = 0;
+		while ((msg = fr_dlist_head(&t->async.queue)) != NULL) {
+			if ((size_t) slen < msg->len) {
+				t->async.sent = slen;
+				break;
+			}
+			slen -= msg->len;
+			t->async.written++;
+			linelog_async_msg_free(t, msg);
+
+			if (!stream) break;
+		}
+	}
+
+	(void) linelog_async_events(t, false);
+}
+
+static void _linelog_async_flush_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_linelog_thread_t *t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+
+	t->async.flush_ev = NULL;
+	linelog_async_flush(t);
+}
+
+/** Add an entry to the queue
+ *
+ * @return
+ *	- 0 if the entry was queued.
+ *	- -1 if the entry was dropped.
+ */
+static int linelog_async_writev(rlm_linelog_thread_t *t, REQUEST *request, struct iovec const *vector, size_t iovcnt)
+{
+	linelog_instance_t const	*inst = t->inst;
+	linelog_msg_t			*msg;
+	size_t				len = 0, i;
+	uint8_t				*p;
+
+	for (i = 0; i < iovcnt; i++) len += vector[i].iov_len;
+	if (!len) return 0;
+
+	/*
+	 *	Make room, or refuse the new entry.  The first entry
+	 *	can't be dropped if part of it has already been sent.
+	 */
+	while ((t->async.queued + len) > inst->async.queue_size) {
+		msg = fr_dlist_head(&t->async.queue);
+		if (msg && t->async.sent) msg = fr_dlist_next(&t->async.queue, msg);
+
+		if (!msg || (inst->async.drop == LINELOG_DROP_NEWEST)) {
+			t->async.dropped++;
+			RATE_LIMIT_LOCAL(&t->async.drop_rate_limit, RWARN,
+					 "Log queue is full, dropping new entry (%" PRIu64 " dropped so far)",
+					 t->async.dropped);
+			return -1;
+		}
+
+		t->async.dropped++;
+		RATE_LIMIT_LOCAL(&t->async.drop_rate_limit, RWARN,
+				 "Log queue is full, dropping oldest entry (%" PRIu64 " dropped so far)",
+				 t->async.dropped);
+		linelog_async_msg_free(t, msg);
+	}
+
+	MEM(msg = talloc_size(t, sizeof(*msg) + len));
+	talloc_set_name_const(msg, "linelog_msg_t");
+	msg->len = len;
+	for (i = 0, p = msg->data; i < iovcnt; i++) {
+		memcpy(p, vector[i].iov_base, vector[i].iov_len);
+		p += vector[i].iov_len;
+	}
+	fr_dlist_insert_tail(&t->async.queue, msg);
+	t->async.queued += len;
+
+	if (t->async.queued >= inst->async.flush_size) {
+		linelog_async_flush(t);
+		return 0;
+	}
+
+	if (!t->async.flush_ev &&
+	    (fr_event_timer_in(t, t->async.el, &t->async.flush_ev, inst->async.flush_delay,
+			       _linelog_async_flush_timer, t) < 0)) {
+		RPERROR("Failed inserting flush timer, writing immediately");
+		linelog_async_flush(t);
+	}
+
+	return 0;
+}
+
+/** Allocate a per-thread buffered file handle, or socket, if buffering is enabled
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_linelog.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	linelog_instance_t	*inst = instance;
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(thread, rlm_linelog_thread_t);
+
+	t->inst = inst;
+	t->async.fd = -1;
+
+	switch (inst->log_dst) {
+	case LINELOG_DST_UNIX:
+	case LINELOG_DST_UDP:
+	case LINELOG_DST_TCP:
+		if (!inst->async.queue_size) return 0;
+
+		t->async.el = el;
+		fr_dlist_init(&t->async.queue, linelog_msg_t, entry);
+		linelog_async_connect(t);
+		return 0;
+
+	default:
+		break;
+	}
+
+	if ((inst->log_dst != LINELOG_DST_FILE) || !inst->file.buffer_size) return 0;
+
+	t->eft = exfile_thread_alloc(t, inst->file.ef, el, inst->file.buffer_size, inst->file.flush_delay,
+				     inst->file.group_str ? inst->file.group : (gid_t) -1);
+	if (!t->eft) {
+		cf_log_err(conf, "Failed creating buffered log file context");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Make a last attempt to send anything queued, and close the socket
+ *
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(thread, rlm_linelog_thread_t);
+
+	if (!t->async.el) return 0;
+
+	linelog_async_flush(t);
+	if (!fr_dlist_empty(&t->async.queue)) {
+		WARN("Discarding %zu queued log entries", fr_dlist_num_elements(&t->async.queue));
+		t->async.dropped += fr_dlist_num_elements(&t->async.queue);
+	}
+
+	DEBUG2("Wrote %" PRIu64 " entries to log destination, dropped %" PRIu64,
+	       t->async.written, t->async.dropped);
+
+	if (t->async.reconnect_ev) fr_event_timer_delete(&t->async.reconnect_ev);
+	linelog_async_close(t, false);
+
+	return 0;
+}
+
 /** Write a linelog message
  *
  * Write a log message to syslog or a flat file.
@@ -447,8 +890,8 @@ static size_t linelog_escape_func(UNUSED REQUEST *request,
  *	- #RLM_MODULE_FAIL if we failed writing the message.
  *	- #RLM_MODULE_OK on success.
  */
-static rlm_rcode_t mod_do_linelog(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_do_linelog(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_do_linelog(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_do_linelog(void *instance, void *thread, REQUEST *request)
 {
 	linelog_conn_t		*conn;
 	fr_time_delta_t		timeout = 0;
@@ -456,6 +899,7 @@ static rlm_rcode_t mod_do_linelog(void *instance, UNUSED void *thread, REQUEST *
 
 	char			*p = buff;
 	linelog_instance_t	*inst = instance;
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(thread, rlm_linelog_thread_t);
 	char const		*value;
 	vp_tmpl_t		empty, *vpt = NULL, *vpt_p = NULL;
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
@@ -642,6 +1086,20 @@ build_vector:
 			return RLM_MODULE_FAIL;
 		}
 
+		/*
+		 *	Buffered writes.  The exfile code creates
+		 *	directories, and sets the group, when it
+		 *	opens the file.
+		 */
+		if (t->eft) {
+			if (exfile_thread_writev(t->eft, request, path, inst->file.permissions,
+						 vector_p, vector_len) < 0) {
+				RPERROR("Failed writing to \"%s\"", path);
+				rcode = RLM_MODULE_FAIL;
+			}
+			goto finish;
+		}
+
 		/* check path and eventually create subdirs */
 		p = strrchr(path, '/');
 		if (p) {
@@ -680,12 +1138,16 @@ build_vector:
 		break;
 
 	case LINELOG_DST_UNIX:
+		if (t->async.el) goto do_queue;
+
 		if (inst->unix_sock.timeout) {
 			timeout = inst->unix_sock.timeout;
 		}
 		goto do_write;
 
 	case LINELOG_DST_UDP:
+		if (t->async.el) goto do_queue;
+
 		if (inst->udp.timeout) {
 			timeout = inst->udp.timeout;
 		}
@@ -694,6 +1156,13 @@ build_vector:
 	case LINELOG_DST_TCP:
 	{
 		int i, num;
+
+		if (t->async.el) {
+		do_queue:
+			if (linelog_async_writev(t, request, vector_p, vector_len) < 0) rcode = RLM_MODULE_FAIL;
+			break;
+		}
+
 		if (inst->tcp.timeout) {
 			timeout = inst->tcp.timeout;
 		}
@@ -786,8 +1255,11 @@ module_t rlm_linelog = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "linelog",
 	.inst_size	= sizeof(linelog_instance_t),
+	.thread_inst_size	= sizeof(rlm_linelog_thread_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_do_linelog,
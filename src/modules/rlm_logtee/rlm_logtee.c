@@ -51,6 +51,9 @@ RCSID("$Id$")
 
 #include <sys/uio.h>
 
+#define LOGTEE_IOV_MAX		64		//!< Maximum number of lines to write with one call.
+#define LOGTEE_REC_NONE		SIZE_MAX	//!< No record to merge lines into.
+
 typedef enum {
 	LOGTEE_DST_INVALID = 0,
 	LOGTEE_DST_FILE,				//!< Log to a file.
@@ -86,7 +89,9 @@ typedef struct {
 	logtee_dst_t		log_dst;		//!< Logging destination.
 	char const		*log_dst_str;		//!< Logging destination string.
 
-	size_t			buffer_depth;		//!< How big our circular buffer should be.
+	size_t			buffer_size;		//!< How many bytes of log data each thread buffers.
+	size_t			flush_size;		//!< Write as soon as this many bytes are buffered.
+	fr_time_delta_t		flush_delay;		//!< Write buffered data after this long.
 
 	struct {
 		char const		*name;			//!< File to write to.
@@ -116,10 +121,28 @@ typedef struct {
 	rlm_logtee_t const	*inst;			//!< Instance of logtee.
 	fr_event_list_t		*el;			//!< This thread's event list.
 	fr_connection_t		*conn;			//!< Connection to our log destination.
+	bool			connected;		//!< conn has an open socket.
+	bool			active;			//!< We're waiting for the socket to become writable.
+
+	/*
+	 *	Each line is a record, a uint32_t length, followed by
+	 *	the data.  For UDP, lines are merged into records of up
+	 *	to flush_size bytes, and each record is sent as one
+	 *	datagram.  Lines are never split across datagrams, and
+	 *	never written partially to a new connection.
+	 */
+	uint8_t			*buff;			//!< Buffered records.
+	size_t			start;			//!< Offset of the first unwritten record.
+	size_t			end;			//!< Offset of the end of the last record.
+	size_t			partial;		//!< How much of the first record has been written.
+	size_t			last;			//!< Offset of the record we merge datagrams into.
+	bool			merge;			//!< Merge lines into datagrams.
 
-	fr_fring_t		*fring;			//!< Circular buffer used to batch up messages.
+	fr_event_timer_t const	*flush_ev;		//!< Writes buffered data after flush_delay.
 
-	bool			pending;		//!< We have pending messages to write.
+	uint64_t		dropped;		//!< Lines dropped because the buffer was full,
+							///< or couldn't be sent.
+	uint64_t		dropped_reported;	//!< How many drops we've already complained about.
 
 	TALLOC_CTX		*msg_pool;		//!< A 1k talloc pool to hold the log message whilst
 							//!< it's being expanded.
@@ -157,7 +180,9 @@ static const CONF_PARSER tcp_config[] = {
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("destination", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_logtee_t, log_dst_str) },
-	{ FR_CONF_OFFSET("buffer_depth", FR_TYPE_SIZE, rlm_logtee_t, buffer_depth), .dflt = "10000" },
+	{ FR_CONF_OFFSET("buffer_size", FR_TYPE_SIZE, rlm_logtee_t, buffer_size), .dflt = "1M" },
+	{ FR_CONF_OFFSET("flush_size", FR_TYPE_SIZE, rlm_logtee_t, flush_size), .dflt = "8k" },
+	{ FR_CONF_OFFSET("flush_delay", FR_TYPE_TIME_DELTA, rlm_logtee_t, flush_delay), .dflt = "0.1" },
 
 	{ FR_CONF_OFFSET("delimiter", FR_TYPE_STRING, rlm_logtee_t, delimiter), .dflt = "\n" },
 	{ FR_CONF_OFFSET("format", FR_TYPE_TMPL, rlm_logtee_t, log_fmt), .dflt = "%n - %s", .quote = T_DOUBLE_QUOTED_STRING },
@@ -257,22 +282,71 @@ static void _logtee_conn_read(UNUSED fr_event_list_t *el, int sock, UNUSED int f
 	}
 }
 
+static inline uint32_t logtee_rec_len(rlm_logtee_thread_t const *t, size_t offset)
+{
+	uint32_t len;
+
+	memcpy(&len, t->buff + offset, sizeof(len));
+
+	return len;
+}
+
+/** Discard the first record
+ *
+ */
+static void logtee_rec_consume(rlm_logtee_thread_t *t)
+{
+	t->start += sizeof(uint32_t) + logtee_rec_len(t, t->start);
+	t->partial = 0;
+
+	if ((t->last != LOGTEE_REC_NONE) && (t->last < t->start)) t->last = LOGTEE_REC_NONE;
+
+	if (t->start == t->end) t->start = t->end = 0;
+}
+
+/** Complain about lines we dropped since we last complained
+ *
+ */
+static void logtee_dropped_report(rlm_logtee_thread_t *t)
+{
+	if (t->dropped == t->dropped_reported) return;
+
+	WARN("%s - Dropped %" PRIu64 " log line(s), %" PRIu64 " in total",
+	     t->inst->name, t->dropped - t->dropped_reported, t->dropped);
+	t->dropped_reported = t->dropped;
+}
+
 /** There's space available to write data, so do that...
  *
+ * Writes as many records as the socket will take, with one call
+ * per datagram, or per #LOGTEE_IOV_MAX lines for stream sockets.
  */
 static void _logtee_conn_writable(UNUSED fr_event_list_t *el, int sock, UNUSED int flags, void *uctx)
 {
 	rlm_logtee_thread_t	*t = talloc_get_type_abort(uctx, rlm_logtee_thread_t);
-	char			*msg;
 
-	/*
-	 *	Fixme in general...
-	 */
-	while ((msg = fr_fring_next(t->fring))) {
-		ssize_t slen;
+	while (t->start < t->end) {
+		struct iovec	iov[LOGTEE_IOV_MAX];
+		int		num = 0;
+		size_t		offset = t->start;
+		ssize_t		slen;
+
+		while ((offset < t->end) && (num < LOGTEE_IOV_MAX)) {
+			uint32_t len = logtee_rec_len(t, offset);
+
+			iov[num].iov_base = t->buff + offset + sizeof(uint32_t);
+			iov[num].iov_len = len;
+			if (num == 0) {
+				iov[num].iov_base = (uint8_t *)iov[num].iov_base + t->partial;
+				iov[num].iov_len -= t->partial;
+			}
+			num++;
+			offset += sizeof(uint32_t) + len;
 
-		slen = write(sock, msg, talloc_array_length(msg) - 1) ;
-	write_error:
+			if (t->merge) break;	/* One datagram at a time */
+		}
+
+		slen = writev(sock, iov, num);
 		if (slen < 0) {
 			switch (errno) {
 			case EAGAIN:
@@ -283,6 +357,16 @@ static void _logtee_conn_writable(UNUSED fr_event_list_t *el, int sock, UNUSED i
 			case ENOBUFS:
 				return;
 
+			/*
+			 *	Datagram is too big, there's no point
+			 *	in trying it again.
+			 */
+			case EMSGSIZE:
+				t->dropped++;
+				logtee_rec_consume(t);
+				continue;
+
+			case ECONNREFUSED:	/* UDP, nothing listening yet */
 			case ECONNRESET:
 			case EDESTADDRREQ:
 			case EIO:
@@ -298,14 +382,34 @@ static void _logtee_conn_writable(UNUSED fr_event_list_t *el, int sock, UNUSED i
 			 */
 			default:
 				fr_assert(0);
+				return;
 			}
 		}
 
-		slen = write(sock, t->inst->delimiter, t->inst->delimiter_len);
-		if (slen < 0) goto write_error;
+		if (t->merge) {
+			logtee_rec_consume(t);
+			continue;
+		}
+
+		/*
+		 *	Consume everything that was written, and
+		 *	remember how much of the last line made it.
+		 */
+		while (num-- > 0) {
+			size_t left = logtee_rec_len(t, t->start) - t->partial;
+
+			if ((size_t)slen < left) {
+				t->partial += slen;
+				return;		/* Socket is full */
+			}
+
+			slen -= left;
+			logtee_rec_consume(t);
+		}
 	}
 
 	logtee_fd_idle(t);
+	logtee_dropped_report(t);
 }
 
 /** Set the socket to idle
@@ -318,6 +422,8 @@ static void logtee_fd_idle(rlm_logtee_thread_t *t)
 {
 	int fd = *((int *)t->conn->h);
 
+	t->active = false;
+
 	DEBUG3("Marking socket (%i) as idle", fd);
 	if (fr_event_fd_insert(t->conn, t->el, fd,
 			       _logtee_conn_read,
@@ -338,6 +444,8 @@ static void logtee_fd_active(rlm_logtee_thread_t *t)
 {
 	int fd = *((int *)t->conn->h);
 
+	t->active = true;
+
 	DEBUG3("Marking socket (%i) as active - Draining requests", fd);
 	if (fr_event_fd_insert(t->conn, t->el, fd,
 			       _logtee_conn_read,
@@ -351,9 +459,22 @@ static void logtee_fd_active(rlm_logtee_thread_t *t)
 /** Shutdown/close a file descriptor
  *
  */
-static void _logtee_conn_close(UNUSED fr_event_list_t *el, void *h, UNUSED void *uctx)
+static void _logtee_conn_close(UNUSED fr_event_list_t *el, void *h, void *uctx)
 {
-	int	fd = *((int *)h);
+	rlm_logtee_thread_t	*t = talloc_get_type_abort(uctx, rlm_logtee_thread_t);
+	int			fd = *((int *)h);
+
+	t->connected = false;
+	t->active = false;
+
+	/*
+	 *	The rest of a partially written line would be
+	 *	garbage to whoever reads the next connection.
+	 */
+	if (t->partial) {
+		t->dropped++;
+		logtee_rec_consume(t);
+	}
 
 	DEBUG3("Closing socket (%i)", fd);
 	if (shutdown(fd, SHUT_RDWR) < 0) DEBUG3("Shutdown on socket (%i) failed: %s", fd, fr_syserror(errno));
@@ -369,10 +490,12 @@ static fr_connection_state_t _logtee_conn_open(UNUSED fr_event_list_t *el, UNUSE
 
 	DEBUG2("Socket connected");
 
+	t->connected = true;
+
 	/*
 	 *	If we have data pending, add the writable event immediately
 	 */
-	if (t->pending) {
+	if (t->start < t->end) {
 		logtee_fd_active(t);
 	} else {
 		logtee_fd_idle(t);
@@ -436,11 +559,86 @@ static fr_connection_state_t _logtee_conn_init(void **h_out, fr_connection_t *co
 	return FR_CONNECTION_STATE_CONNECTING;
 }
 
+/** Start writing buffered data, once the socket is writable
+ *
+ */
+static void logtee_flush(rlm_logtee_thread_t *t)
+{
+	fr_event_timer_delete(&t->flush_ev);
+
+	if (t->connected && !t->active) logtee_fd_active(t);
+}
+
+static void _logtee_flush_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_logtee_thread_t	*t = talloc_get_type_abort(uctx, rlm_logtee_thread_t);
+
+	logtee_flush(t);
+}
+
+/** Add a line, and the delimiter, to the buffer
+ *
+ * @param[in] t		Thread instance containing the buffer.
+ * @param[in] line	to add.
+ * @param[in] len	of line.
+ * @return
+ *	- 0 on success.
+ *	- -1 if there wasn't enough room.
+ */
+static int logtee_buffer_add(rlm_logtee_thread_t *t, char const *line, size_t len)
+{
+	rlm_logtee_t const	*inst = t->inst;
+	size_t			size = talloc_array_length(t->buff);
+	size_t			need = len + inst->delimiter_len;
+	size_t			rec;
+	uint32_t		rec_len;
+	bool			merge;
+
+	merge = t->merge && (t->last != LOGTEE_REC_NONE) &&
+		((logtee_rec_len(t, t->last) + need) <= inst->flush_size);
+	if (!merge) need += sizeof(uint32_t);
+
+	if ((t->end + need) > size) {
+		if (t->start > 0) {
+			memmove(t->buff, t->buff + t->start, t->end - t->start);
+			if (t->last != LOGTEE_REC_NONE) t->last -= t->start;
+			t->end -= t->start;
+			t->start = 0;
+		}
+
+		if ((t->end + need) > size) {
+			t->dropped++;
+			return -1;
+		}
+	}
+
+	if (merge) {
+		rec = t->last;
+		rec_len = logtee_rec_len(t, rec);
+	} else {
+		rec = t->end;
+		rec_len = 0;
+		t->end += sizeof(uint32_t);
+	}
+
+	memcpy(t->buff + t->end, line, len);
+	memcpy(t->buff + t->end + len, inst->delimiter, inst->delimiter_len);
+	t->end += len + inst->delimiter_len;
+
+	rec_len += len + inst->delimiter_len;
+	memcpy(t->buff + rec, &rec_len, sizeof(rec_len));
+
+	if (t->merge) t->last = rec;
+
+	return 0;
+}
+
 /** Logging callback to write log messages to a destination
  *
  * This allows the logging destination to be customised on a per request basis.
  *
- * @note Function does not write log output immediately
+ * @note Function does not write log output immediately.  Lines are buffered, and written
+ *	once flush_size bytes are buffered, or after flush_delay.
  *
  * @param[in] type	What type of message this is (error, warn, info, debug).
  * @param[in] lvl	At what logging level this message should be output.
@@ -491,12 +689,16 @@ static void logtee_it(fr_log_type_t type, fr_log_lvl_t lvl, REQUEST *request,
 	if (tmpl_aexpand(t, &exp, request, inst->log_fmt, NULL, NULL) < 0) goto finish;
 	request->log.dst = dst;
 
-	fr_fring_overwrite(t->fring, exp);	/* Insert it into the buffer */
-
-	if (!t->pending) {
-		t->pending = true;
-		logtee_fd_active(t);		/* Listen for when the fd is writable */
+	if (logtee_buffer_add(t, exp, talloc_array_length(exp) - 1) == 0) {
+		if ((t->end - t->start) >= inst->flush_size) {
+			logtee_flush(t);
+		} else if (!t->flush_ev && !t->active &&
+			   (fr_event_timer_in(t, t->el, &t->flush_ev, inst->flush_delay,
+					      _logtee_flush_timer, t) < 0)) {
+			logtee_flush(t);
+		}
 	}
+	talloc_free(exp);
 
 finish:
 	/*
@@ -559,7 +761,9 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instanc
 	rlm_logtee_t		*inst = talloc_get_type_abort(instance, rlm_logtee_t);
 	rlm_logtee_thread_t	*t = talloc_get_type_abort(thread, rlm_logtee_thread_t);
 
-	MEM(t->fring = fr_fring_alloc(t, inst->buffer_depth, false));
+	MEM(t->buff = talloc_array(t, uint8_t, inst->buffer_size));
+	t->last = LOGTEE_REC_NONE;
+	t->merge = (inst->log_dst == LOGTEE_DST_UDP);
 
 	t->inst = inst;
 	t->el = el;
@@ -621,8 +825,14 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 	snprintf(prefix, sizeof(prefix), "rlm_logtee (%s)", inst->name);
 
-	FR_SIZE_BOUND_CHECK("buffer_depth", inst->buffer_depth, >=, (size_t)1);
-	FR_SIZE_BOUND_CHECK("buffer_depth", inst->buffer_depth, <=, (size_t)1000000);	/* 1 Million messages */
+	FR_SIZE_BOUND_CHECK("buffer_size", inst->buffer_size, >=, (size_t)4096);
+	FR_SIZE_BOUND_CHECK("buffer_size", inst->buffer_size, <=, (size_t)(1024 * 1024 * 1024));
+	FR_SIZE_BOUND_CHECK("flush_size", inst->flush_size, >=, (size_t)1);
+	FR_SIZE_BOUND_CHECK("flush_size", inst->flush_size, <=, inst->buffer_size);
+	if (inst->log_dst == LOGTEE_DST_UDP) {
+		FR_SIZE_BOUND_CHECK("flush_size", inst->flush_size, <=, (size_t)65507);	/* Max UDP payload */
+	}
+	FR_TIME_DELTA_BOUND_CHECK("flush_delay", inst->flush_delay, <=, fr_time_delta_from_sec(10));
 
 	/*
 	 *	Setup the logging destination
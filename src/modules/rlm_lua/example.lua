@@ -61,6 +61,14 @@ function authorize()
   --tprint(request['user-name'])
   --tprint(request['user-name'])
 
+  -- LuaJIT only, operates on pairs in place via the FFI
+  --for vp in fr.pair.each("Reply-Message") do
+  --  print(fr.pair.str(vp))
+  --end
+  --local vp = fr.pair.first("User-Name")
+  --if vp then fr.pair.set(vp, fr.pair.str(vp):lower()) end
+  --fr.pair.add("Session-Timeout", 3600)
+
   print("example.lua/authorize()")
   print("Request list contents:")
   tprint(fr.request, 2)
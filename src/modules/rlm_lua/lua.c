@@ -922,6 +922,11 @@ int fr_lua_init(lua_State **out, rlm_lua_t const *instance)
 	if (inst->jit) {
 		DEBUG4("Initialised new LuaJIT interpreter %p", L);
 		if (fr_lua_util_jit_log_register(inst, L) < 0) goto error;
+
+		/*
+		 *	Setup "fr.pair.{}", in-place access to pairs via the FFI
+		 */
+		if (fr_lua_util_jit_pair_register(inst, L) < 0) goto error;
 	} else {
 		DEBUG4("Initialised new Lua interpreter %p", L);
 		if (fr_lua_util_log_register(inst, L) < 0) goto error;
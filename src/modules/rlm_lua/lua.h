@@ -78,7 +78,20 @@ void		fr_lua_util_jit_log_info(char const *msg);
 void		fr_lua_util_jit_log_warn(char const *msg);
 void		fr_lua_util_jit_log_error(char const *msg);
 
+fr_dict_attr_t const *fr_lua_util_jit_attr(char const *name);
+VALUE_PAIR	*fr_lua_util_jit_pair_first(fr_dict_attr_t const *da);
+VALUE_PAIR	*fr_lua_util_jit_pair_next(VALUE_PAIR const *vp);
+VALUE_PAIR	*fr_lua_util_jit_pair_add(fr_dict_attr_t const *da);
+VALUE_PAIR	*fr_lua_util_jit_pair_remove(VALUE_PAIR *vp);
+char const	*fr_lua_util_jit_pair_value_str(size_t *len, VALUE_PAIR const *vp);
+int		fr_lua_util_jit_pair_value_int64(int64_t *out, VALUE_PAIR const *vp);
+int		fr_lua_util_jit_pair_value_double(double *out, VALUE_PAIR const *vp);
+int		fr_lua_util_jit_pair_set_str(VALUE_PAIR *vp, char const *value, size_t len);
+int		fr_lua_util_jit_pair_set_int64(VALUE_PAIR *vp, int64_t value);
+int		fr_lua_util_jit_pair_set_double(VALUE_PAIR *vp, double value);
+
 int		fr_lua_util_jit_log_register(rlm_lua_t const *inst, lua_State *L);
+int		fr_lua_util_jit_pair_register(rlm_lua_t const *inst, lua_State *L);
 int		fr_lua_util_log_register(rlm_lua_t const *inst, lua_State *L);
 void		fr_lua_util_set_inst(rlm_lua_t const *inst);
 rlm_lua_t const	*fr_lua_util_get_inst(void);
@@ -37,6 +37,7 @@ RCSID("$Id$")
 
 static _Thread_local REQUEST *fr_lua_request;
 static _Thread_local rlm_lua_t const *fr_lua_inst;
+static _Thread_local char fr_lua_pair_buff[256];	//!< Scratch space for printing non-string values.
 
 void fr_lua_util_fr_register(lua_State *L)
 {
@@ -261,6 +262,438 @@ int fr_lua_util_jit_log_register(rlm_lua_t const *inst, lua_State *L)
 	return 0;
 }
 
+/** Resolve an attribute name for use with the other fr_lua_util_jit_pair_* functions
+ *
+ * The result is stable for the lifetime of the server, so Lua code should
+ * resolve each name once and cache the pointer.
+ *
+ * @param[in] name	of the attribute.
+ * @return
+ *	- The attribute.
+ *	- NULL if there's no current request, or the attribute is unknown.
+ */
+fr_dict_attr_t const *fr_lua_util_jit_attr(char const *name)
+{
+	REQUEST			*request = fr_lua_request;
+	fr_dict_attr_t const	*da;
+
+	if (!request || !name) return NULL;
+
+	da = fr_dict_attr_by_name(request->dict, name);
+	if (!da) {
+		RWDEBUG("Unknown or invalid attribute name \"%s\"", name);
+		return NULL;
+	}
+
+	return da;
+}
+
+/** Return the first instance of an attribute in the request list
+ *
+ * @param[in] da	to search for.
+ * @return
+ *	- The first matching pair.
+ *	- NULL if no pairs match.
+ */
+VALUE_PAIR *fr_lua_util_jit_pair_first(fr_dict_attr_t const *da)
+{
+	REQUEST		*request = fr_lua_request;
+	VALUE_PAIR	*vp;
+
+	if (!request || !da) return NULL;
+
+	for (vp = request->packet->vps; vp; vp = vp->next) if (vp->da == da) return vp;
+
+	return NULL;
+}
+
+/** Return the next instance of the same attribute as vp
+ *
+ * @param[in] vp	to start searching after.
+ * @return
+ *	- The next matching pair.
+ *	- NULL if there are no more matching pairs.
+ */
+VALUE_PAIR *fr_lua_util_jit_pair_next(VALUE_PAIR const *vp)
+{
+	VALUE_PAIR *next;
+
+	if (!vp) return NULL;
+
+	for (next = vp->next; next; next = next->next) if (next->da == vp->da) return next;
+
+	return NULL;
+}
+
+/** Create a new pair and append it to the request list
+ *
+ * The pair has no value until one of the fr_lua_util_jit_pair_set_* functions
+ * is called on it.
+ *
+ * @param[in] da	of the pair to create.
+ * @return
+ *	- The new pair.
+ *	- NULL on error.
+ */
+VALUE_PAIR *fr_lua_util_jit_pair_add(fr_dict_attr_t const *da)
+{
+	REQUEST		*request = fr_lua_request;
+	VALUE_PAIR	*vp;
+
+	if (!request || !da) return NULL;
+
+	MEM(vp = fr_pair_afrom_da(request->packet, da));
+	fr_pair_add(&request->packet->vps, vp);
+
+	return vp;
+}
+
+/** Remove a pair from the request list and free it
+ *
+ * @param[in] vp	to remove.
+ * @return
+ *	- The next instance of the same attribute, so loops can continue.
+ *	- NULL if there are no more matching pairs, or vp wasn't in the list.
+ */
+VALUE_PAIR *fr_lua_util_jit_pair_remove(VALUE_PAIR *vp)
+{
+	REQUEST		*request = fr_lua_request;
+	VALUE_PAIR	**last, *next;
+
+	if (!request || !vp) return NULL;
+
+	for (last = &request->packet->vps; *last; last = &(*last)->next) {
+		if (*last != vp) continue;
+
+		next = fr_lua_util_jit_pair_next(vp);
+		*last = vp->next;
+		talloc_free(vp);
+
+		return next;
+	}
+
+	RWDEBUG("Pair %p is not in the request list", vp);
+
+	return NULL;
+}
+
+/** Get the value of a pair as a buffer
+ *
+ * For string and octets attributes this returns a pointer to the pair's own
+ * buffer, so no copy is made until the caller converts it to a Lua string.
+ * Other types are printed to a per-thread buffer which is overwritten by the
+ * next call.
+ *
+ * @param[out] len	of the returned buffer.
+ * @param[in] vp	to retrieve the value of.
+ * @return
+ *	- The value.
+ *	- NULL on error.
+ */
+char const *fr_lua_util_jit_pair_value_str(size_t *len, VALUE_PAIR const *vp)
+{
+	rlm_lua_t const	*inst = fr_lua_inst;
+	REQUEST		*request = fr_lua_request;
+	size_t		slen;
+
+	if (!vp) return NULL;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		*len = vp->vp_length;
+		return vp->vp_strvalue;
+
+	case FR_TYPE_OCTETS:
+		*len = vp->vp_length;
+		return (char const *)vp->vp_octets;
+
+	case FR_TYPE_NON_VALUES:
+		ROPTIONAL(REDEBUG, DEBUG, "Cannot convert %s to Lua type",
+			  fr_table_str_by_value(fr_value_box_type_table, vp->vp_type, "<INVALID>"));
+		return NULL;
+
+	default:
+		break;
+	}
+
+	slen = fr_pair_value_snprint(fr_lua_pair_buff, sizeof(fr_lua_pair_buff), vp, '\0');
+	if (is_truncated(slen, sizeof(fr_lua_pair_buff))) {
+		ROPTIONAL(REDEBUG, DEBUG, "Cannot convert %s to Lua type, insufficient buffer space",
+			  fr_table_str_by_value(fr_value_box_type_table, vp->vp_type, "<INVALID>"));
+		return NULL;
+	}
+	*len = slen;
+
+	return fr_lua_pair_buff;
+}
+
+/** Get the value of a pair as a signed 64bit integer
+ *
+ * @param[out] out	Where to write the value.
+ * @param[in] vp	to retrieve the value of.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the value can't be represented as an integer.
+ */
+int fr_lua_util_jit_pair_value_int64(int64_t *out, VALUE_PAIR const *vp)
+{
+	rlm_lua_t const	*inst = fr_lua_inst;
+	REQUEST		*request = fr_lua_request;
+	fr_value_box_t	vb;
+
+	if (!vp) return -1;
+
+	if (fr_value_box_cast(NULL, &vb, FR_TYPE_INT64, NULL, &vp->data) < 0) {
+		ROPTIONAL(RPEDEBUG, PERROR, "Failed converting \"%s\" to integer", vp->da->name);
+		return -1;
+	}
+	*out = vb.vb_int64;
+
+	return 0;
+}
+
+/** Get the value of a pair as a double
+ *
+ * @param[out] out	Where to write the value.
+ * @param[in] vp	to retrieve the value of.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the value can't be represented as a number.
+ */
+int fr_lua_util_jit_pair_value_double(double *out, VALUE_PAIR const *vp)
+{
+	rlm_lua_t const	*inst = fr_lua_inst;
+	REQUEST		*request = fr_lua_request;
+	fr_value_box_t	vb;
+
+	if (!vp) return -1;
+
+	if (fr_value_box_cast(NULL, &vb, FR_TYPE_FLOAT64, NULL, &vp->data) < 0) {
+		ROPTIONAL(RPEDEBUG, PERROR, "Failed converting \"%s\" to number", vp->da->name);
+		return -1;
+	}
+	*out = vb.vb_float64;
+
+	return 0;
+}
+
+/** Replace the value of a pair with a cast of the value in src
+ *
+ * The existing value is only freed if the cast succeeds.
+ */
+static int fr_lua_util_jit_pair_set(VALUE_PAIR *vp, fr_value_box_t const *src)
+{
+	rlm_lua_t const	*inst = fr_lua_inst;
+	REQUEST		*request = fr_lua_request;
+	fr_value_box_t	vb;
+
+	if (fr_value_box_cast(vp, &vb, vp->da->type, vp->da, src) < 0) {
+		ROPTIONAL(RPEDEBUG, PERROR, "Failed setting value of \"%s\"", vp->da->name);
+		return -1;
+	}
+	fr_value_box_clear(&vp->data);
+	vp->data = vb;
+
+	return 0;
+}
+
+/** Set the value of a pair from a buffer
+ *
+ * The value is parsed according to the type of the pair.
+ *
+ * @param[in] vp	to modify.
+ * @param[in] value	to set.  Does not need to be \0 terminated.
+ * @param[in] len	of value.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_lua_util_jit_pair_set_str(VALUE_PAIR *vp, char const *value, size_t len)
+{
+	fr_value_box_t	vb;
+
+	if (!vp || !value) return -1;
+
+	fr_value_box_bstrndup_shallow(&vb, NULL, value, len, true);
+
+	return fr_lua_util_jit_pair_set(vp, &vb);
+}
+
+/** Set the value of a pair from a signed 64bit integer
+ *
+ * @param[in] vp	to modify.
+ * @param[in] value	to set.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_lua_util_jit_pair_set_int64(VALUE_PAIR *vp, int64_t value)
+{
+	fr_value_box_t	vb;
+
+	if (!vp) return -1;
+
+	fr_value_box_init(&vb, FR_TYPE_INT64, NULL, true);
+	vb.vb_int64 = value;
+
+	return fr_lua_util_jit_pair_set(vp, &vb);
+}
+
+/** Set the value of a pair from a double
+ *
+ * @param[in] vp	to modify.
+ * @param[in] value	to set.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_lua_util_jit_pair_set_double(VALUE_PAIR *vp, double value)
+{
+	fr_value_box_t	vb;
+
+	if (!vp) return -1;
+
+	fr_value_box_init(&vb, FR_TYPE_FLOAT64, NULL, true);
+	vb.vb_float64 = value;
+
+	return fr_lua_util_jit_pair_set(vp, &vb);
+}
+
+/** Insert the "fr.pair.{}" accessors into the lua environment
+ *
+ * Unlike "fr.request.{}", which converts every value it returns into a Lua
+ * value, these operate on VALUE_PAIRs in place through the FFI.  Values are
+ * only converted when the script asks for them, and attribute lookups are
+ * cached per-interpreter.
+ *
+ * Pair pointers are only valid for the duration of the call they were
+ * retrieved in.
+ *
+ * @note Must be called after #fr_lua_util_jit_log_register, which loads the FFI library.
+ *
+ * @param inst Current instance of the fr_lua module.
+ * @param L Lua interpreter.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_lua_util_jit_pair_register(rlm_lua_t const *inst, lua_State *L)
+{
+	int ret;
+
+	ret = luaL_dostring(L, "\
+		ffi.cdef [[\
+			typedef struct dict_attr fr_dict_attr_t;\
+			typedef struct value_pair_s VALUE_PAIR;\
+			fr_dict_attr_t const *fr_lua_util_jit_attr(char const *name);\
+			VALUE_PAIR *fr_lua_util_jit_pair_first(fr_dict_attr_t const *da);\
+			VALUE_PAIR *fr_lua_util_jit_pair_next(VALUE_PAIR const *vp);\
+			VALUE_PAIR *fr_lua_util_jit_pair_add(fr_dict_attr_t const *da);\
+			VALUE_PAIR *fr_lua_util_jit_pair_remove(VALUE_PAIR *vp);\
+			char const *fr_lua_util_jit_pair_value_str(size_t *len, VALUE_PAIR const *vp);\
+			int fr_lua_util_jit_pair_value_int64(int64_t *out, VALUE_PAIR const *vp);\
+			int fr_lua_util_jit_pair_value_double(double *out, VALUE_PAIR const *vp);\
+			int fr_lua_util_jit_pair_set_str(VALUE_PAIR *vp, char const *value, size_t len);\
+			int fr_lua_util_jit_pair_set_int64(VALUE_PAIR *vp, int64_t value);\
+			int fr_lua_util_jit_pair_set_double(VALUE_PAIR *vp, double value);\
+		]]\
+		local _da = {}\
+		local _len = ffi.new(\"size_t[1]\")\
+		local _int = ffi.new(\"int64_t[1]\")\
+		local _num = ffi.new(\"double[1]\")\
+		local function _vp(vp)\
+			if vp == nil then return nil end\
+			return vp\
+		end\
+		local function _attr(name)\
+			local da = _da[name]\
+			if da then return da end\
+			da = fr_lua.fr_lua_util_jit_attr(name)\
+			if da == nil then return nil end\
+			_da[name] = da\
+			return da\
+		end\
+		local _fr_pair = {}\
+		_fr_pair.first = function(name)\
+			local da = _attr(name)\
+			if not da then return nil end\
+			return _vp(fr_lua.fr_lua_util_jit_pair_first(da))\
+		end\
+		_fr_pair.next = function(vp)\
+			return _vp(fr_lua.fr_lua_util_jit_pair_next(vp))\
+		end\
+		_fr_pair.each = function(name)\
+			local vp = nil\
+			local da = _attr(name)\
+			return function()\
+				if not da then return nil end\
+				if vp == nil then\
+					vp = _vp(fr_lua.fr_lua_util_jit_pair_first(da))\
+				else\
+					vp = _vp(fr_lua.fr_lua_util_jit_pair_next(vp))\
+				end\
+				if vp == nil then da = nil end\
+				return vp\
+			end\
+		end\
+		_fr_pair.str = function(vp)\
+			local p = fr_lua.fr_lua_util_jit_pair_value_str(_len, vp)\
+			if p == nil then return nil end\
+			return ffi.string(p, _len[0])\
+		end\
+		_fr_pair.int = function(vp)\
+			if fr_lua.fr_lua_util_jit_pair_value_int64(_int, vp) < 0 then return nil end\
+			return tonumber(_int[0])\
+		end\
+		_fr_pair.num = function(vp)\
+			if fr_lua.fr_lua_util_jit_pair_value_double(_num, vp) < 0 then return nil end\
+			return _num[0]\
+		end\
+		_fr_pair.set = function(vp, value)\
+			local ret\
+			if type(value) == \"number\" then\
+				if value == math.floor(value) then\
+					ret = fr_lua.fr_lua_util_jit_pair_set_int64(vp, value)\
+				else\
+					ret = fr_lua.fr_lua_util_jit_pair_set_double(vp, value)\
+				end\
+			else\
+				value = tostring(value)\
+				ret = fr_lua.fr_lua_util_jit_pair_set_str(vp, value, #value)\
+			end\
+			return ret == 0\
+		end\
+		_fr_pair.add = function(name, value)\
+			local da = _attr(name)\
+			if not da then return nil end\
+			local vp = _vp(fr_lua.fr_lua_util_jit_pair_add(da))\
+			if vp and value ~= nil and not _fr_pair.set(vp, value) then\
+				fr_lua.fr_lua_util_jit_pair_remove(vp)\
+				return nil\
+			end\
+			return vp\
+		end\
+		_fr_pair.remove = function(vp)\
+			return _vp(fr_lua.fr_lua_util_jit_pair_remove(vp))\
+		end\
+		fr.pair = setmetatable({}, {\
+			__index = _fr_pair,\
+			__newindex = function(table, key, value)\
+				_fr_log.warn(\"fr.pair.$func() is read-only\")\
+			end,\
+			__metatable = false\
+		})\
+		");
+	if (ret != 0) {
+		ERROR("Failed setting up FFI pair accessors: %s",
+		      lua_gettop(L) ? lua_tostring(L, -1) : "Unknown error");
+
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Register utililiary functions in the lua environment
  *
  * @param inst Current instance of the fr_lua module.
@@ -12,6 +12,7 @@ module Radiusd
         radlog(L_ERR, "[mruby]Running ruby authorize")
         radlog(L_WARN, "Authorize: #{request.inspect}(#{request.class})")
         radlog(L_WARN, "Authorize: #{request.request.inspect}(#{request.request.class})")
+        radlog(L_WARN, "Authorize: User-Name is #{request.request["User-Name"]}")
     
         reply = [["Framed-MTU", 1500]]
         control = [["Cleartext-Password", "hello"], ["Tmp-String-0", "!*", "ANY"]]
@@ -23,6 +23,8 @@
  * @copyright 2016 The FreeRADIUS server project
  */
 
+#include <freeradius-devel/server/base.h>
+
 #include "rlm_mruby.h"
 
 static mrb_value mruby_request_frconfig(mrb_state *mrb, mrb_value self)
@@ -87,3 +89,244 @@ struct RClass *mruby_request_class(mrb_state *mrb, struct RClass *parent)
 
 	return request;
 }
+
+/*
+ *	The pairs belong to the request, so there's nothing to free.
+ */
+static void mruby_pairs_free(UNUSED mrb_state *mrb, UNUSED void *ptr)
+{
+}
+
+static mrb_data_type const mruby_pairs_type = {
+	.struct_name = "Pairs",
+	.dfree = mruby_pairs_free
+};
+
+static mruby_pairs_t *mruby_pairs_get(mrb_state *mrb, mrb_value self)
+{
+	mruby_pairs_t *pairs;
+
+	pairs = mrb_data_get_ptr(mrb, self, &mruby_pairs_type);
+	if (!pairs) mrb_raise(mrb, E_RUNTIME_ERROR, "Attribute list used after the request has finished");
+
+	return pairs;
+}
+
+static mrb_value mruby_vp_name(mrb_state *mrb, REQUEST *request, VALUE_PAIR const *vp)
+{
+	char		*str;
+	mrb_value	name;
+
+	if (!vp->da->flags.has_tag) return mrb_str_new(mrb, vp->da->name, strlen(vp->da->name));
+
+	str = talloc_typed_asprintf(request, "%s:%d", vp->da->name, vp->tag);
+	name = mrb_str_new(mrb, str, talloc_array_length(str) - 1);
+	talloc_free(str);
+
+	return name;
+}
+
+/*
+ *	The only way to create floats, doubles, bools etc, is to
+ *	feed mruby the string representation and have it convert to
+ *	its internal types.
+ */
+static mrb_value mruby_vp_value(mrb_state *mrb, REQUEST *request, VALUE_PAIR const *vp)
+{
+	mrb_value	to_cast;
+	char		*in;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+		return mrb_str_new(mrb, vp->vp_ptr, vp->vp_length);
+
+	case FR_TYPE_BOOL:
+		return vp->vp_bool ? mrb_true_value() : mrb_false_value();
+
+	case FR_TYPE_NON_VALUES:
+		fr_assert(0);
+		return mrb_nil_value();
+
+	default:
+		break;
+	}
+
+	in = fr_value_box_asprint(request, &vp->data, '\0');
+	to_cast = mrb_str_new(mrb, in, talloc_array_length(in) - 1);
+	talloc_free(in);
+
+	switch (vp->vp_type) {
+	case FR_TYPE_UINT8:
+	case FR_TYPE_UINT16:
+	case FR_TYPE_UINT32:
+	case FR_TYPE_UINT64:
+	case FR_TYPE_INT8:
+	case FR_TYPE_INT16:
+	case FR_TYPE_INT32:
+	case FR_TYPE_INT64:
+	case FR_TYPE_DATE:
+	case FR_TYPE_TIME_DELTA:
+	case FR_TYPE_SIZE:
+		return mrb_convert_type(mrb, to_cast, MRB_TT_FIXNUM, "Fixnum", "to_int");
+
+	case FR_TYPE_FLOAT32:
+	case FR_TYPE_FLOAT64:
+		return mrb_convert_type(mrb, to_cast, MRB_TT_FLOAT, "Float", "to_f");
+
+	default:
+		return to_cast;		/* No conversions required */
+	}
+}
+
+static mrb_value mruby_vp_tuple(mrb_state *mrb, REQUEST *request, VALUE_PAIR const *vp)
+{
+	mrb_value tuple;
+
+	tuple = mrb_ary_new_capa(mrb, 2);
+	mrb_ary_push(mrb, tuple, mruby_vp_name(mrb, request, vp));
+	mrb_ary_push(mrb, tuple, mruby_vp_value(mrb, request, vp));
+
+	return tuple;
+}
+
+/*
+ *	pairs["User-Name"] returns the value of the first User-Name,
+ *	or nil.  pairs[0] returns the first [name, value] tuple, as
+ *	when the lists were arrays.
+ */
+static mrb_value mruby_pairs_aref(mrb_state *mrb, mrb_value self)
+{
+	mruby_pairs_t		*pairs = mruby_pairs_get(mrb, self);
+	mrb_value		key;
+	VALUE_PAIR		*vp;
+	fr_cursor_t		cursor;
+
+	mrb_get_args(mrb, "o", &key);
+
+	if (mrb_fixnum_p(key)) {
+		mrb_int i = mrb_fixnum(key);
+
+		if (i < 0) return mrb_nil_value();
+
+		for (vp = fr_cursor_init(&cursor, pairs->vps); vp; vp = fr_cursor_next(&cursor)) {
+			if (i-- == 0) return mruby_vp_tuple(mrb, pairs->request, vp);
+		}
+		return mrb_nil_value();
+	}
+
+	if (mrb_string_p(key)) {
+		fr_dict_attr_t const *da;
+
+		da = fr_dict_attr_by_name(pairs->request->dict, mrb_str_to_cstr(mrb, key));
+		if (!da) return mrb_nil_value();
+
+		vp = fr_pair_find_by_da(*pairs->vps, da, TAG_ANY);
+		if (!vp) return mrb_nil_value();
+
+		return mruby_vp_value(mrb, pairs->request, vp);
+	}
+
+	mrb_raise(mrb, E_TYPE_ERROR, "Expected an attribute name, or an index");
+	return mrb_nil_value();
+}
+
+/*
+ *	Yields [name, value] for each attribute.  Everything else in
+ *	Enumerable is built on this.
+ */
+static mrb_value mruby_pairs_each(mrb_state *mrb, mrb_value self)
+{
+	mruby_pairs_t	*pairs = mruby_pairs_get(mrb, self);
+	mrb_value	block;
+	VALUE_PAIR	*vp;
+	fr_cursor_t	cursor;
+	int		ai;
+
+	mrb_get_args(mrb, "&", &block);
+	if (mrb_nil_p(block)) mrb_raise(mrb, E_ARGUMENT_ERROR, "Pairs#each requires a block");
+
+	ai = mrb_gc_arena_save(mrb);
+	for (vp = fr_cursor_init(&cursor, pairs->vps); vp; vp = fr_cursor_next(&cursor)) {
+		mrb_yield(mrb, block, mruby_vp_tuple(mrb, pairs->request, vp));
+		mrb_gc_arena_restore(mrb, ai);
+
+		/*
+		 *	The block may have finished the request.
+		 */
+		if (!DATA_PTR(self)) break;
+	}
+
+	return self;
+}
+
+static mrb_value mruby_pairs_to_a(mrb_state *mrb, mrb_value self)
+{
+	mruby_pairs_t	*pairs = mruby_pairs_get(mrb, self);
+	mrb_value	out;
+	VALUE_PAIR	*vp;
+	fr_cursor_t	cursor;
+
+	out = mrb_ary_new(mrb);
+	for (vp = fr_cursor_init(&cursor, pairs->vps); vp; vp = fr_cursor_next(&cursor)) {
+		mrb_ary_push(mrb, out, mruby_vp_tuple(mrb, pairs->request, vp));
+	}
+
+	return out;
+}
+
+static mrb_value mruby_pairs_inspect(mrb_state *mrb, mrb_value self)
+{
+	return mrb_inspect(mrb, mruby_pairs_to_a(mrb, self));
+}
+
+static mrb_value mruby_pairs_size(mrb_state *mrb, mrb_value self)
+{
+	mruby_pairs_t	*pairs = mruby_pairs_get(mrb, self);
+	VALUE_PAIR	*vp;
+	fr_cursor_t	cursor;
+	mrb_int		count = 0;
+
+	for (vp = fr_cursor_init(&cursor, pairs->vps); vp; vp = fr_cursor_next(&cursor)) count++;
+
+	return mrb_fixnum_value(count);
+}
+
+/** Define the class which gives scripts lazy access to attribute lists
+ *
+ * Values are only converted to Ruby types when the script asks for
+ * them, so a method which looks at one or two attributes doesn't pay
+ * for converting the whole request.
+ */
+struct RClass *mruby_pairs_class(mrb_state *mrb, struct RClass *parent)
+{
+	struct RClass *pairs;
+
+	pairs = mrb_define_class_under(mrb, parent, "Pairs", mrb->object_class);
+	MRB_SET_INSTANCE_TT(pairs, MRB_TT_DATA);
+	mrb_include_module(mrb, pairs, mrb_module_get(mrb, "Enumerable"));
+
+	mrb_define_method(mrb, pairs, "[]", mruby_pairs_aref, MRB_ARGS_REQ(1));
+	mrb_define_method(mrb, pairs, "each", mruby_pairs_each, MRB_ARGS_BLOCK());
+	mrb_define_method(mrb, pairs, "to_a", mruby_pairs_to_a, MRB_ARGS_NONE());
+	mrb_define_method(mrb, pairs, "inspect", mruby_pairs_inspect, MRB_ARGS_NONE());
+	mrb_define_method(mrb, pairs, "to_s", mruby_pairs_inspect, MRB_ARGS_NONE());
+	mrb_define_method(mrb, pairs, "size", mruby_pairs_size, MRB_ARGS_NONE());
+	mrb_define_method(mrb, pairs, "length", mruby_pairs_size, MRB_ARGS_NONE());
+
+	return pairs;
+}
+
+mrb_value mruby_pairs_new(mrb_state *mrb, struct RClass *pairs_class, mruby_pairs_t *pairs)
+{
+	return mrb_obj_value(mrb_data_object_alloc(mrb, pairs_class, pairs, &mruby_pairs_type));
+}
+
+/** Stop a Pairs object from pointing at the list, once the method call is done
+ *
+ * The script may have kept a reference to the object.
+ */
+void mruby_pairs_release(mrb_value pairs)
+{
+	DATA_PTR(pairs) = NULL;
+}
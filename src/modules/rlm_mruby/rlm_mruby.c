@@ -42,12 +42,23 @@ typedef struct {
 	char const *filename;
 	char const *module_name;
 
+	uint8_t *bytecode;		//!< RiteVM bytecode for the script, loaded by every thread.
+} rlm_mruby_t;
+
+/*
+ *	Each thread has its own VM, so calls don't need to be
+ *	serialised.
+ */
+typedef struct {
+	rlm_mruby_t const *inst;
+
 	mrb_state *mrb;
 
 	struct RClass *mruby_module;
 	struct RClass *mruby_request;
+	struct RClass *mruby_pairs;
 	mrb_value mrubyconf_hash;
-} rlm_mruby_t;
+} rlm_mruby_thread_t;
 
 /*
  *	A mapping of configuration file names to internal variables.
@@ -69,6 +80,24 @@ static mrb_value mruby_log(mrb_state *mrb, UNUSED mrb_value self)
 	return mrb_nil_value();
 }
 
+/*
+ *	Log the exception raised by the last call, and clear it.  The
+ *	VM is re-used, so it mustn't be left set.
+ */
+static void mruby_exception_log(REQUEST *request, mrb_state *mrb, char const *what)
+{
+	mrb_value msg;
+
+	msg = mrb_inspect(mrb, mrb_obj_value(mrb->exc));
+	mrb->exc = NULL;
+
+	if (request) {
+		REDEBUG("%s failed: %.*s", what, (int)RSTRING_LEN(msg), RSTRING_PTR(msg));
+	} else {
+		ERROR("%s failed: %.*s", what, (int)RSTRING_LEN(msg), RSTRING_PTR(msg));
+	}
+}
+
 static void mruby_parse_config(mrb_state *mrb, CONF_SECTION *cs, int lvl, mrb_value hash)
 {
 	int indent_section = (lvl + 1) * 4;
@@ -128,64 +157,22 @@ static void mruby_parse_config(mrb_state *mrb, CONF_SECTION *cs, int lvl, mrb_va
  *	configured instance of the module.  e.g. set up connections
  *	to external databases, read configuration files, set up
  *	dictionary entries, etc.
+ *
+ *	The script is compiled here, once.  Each thread then loads
+ *	the bytecode into its own VM, without parsing it again.
  */
-static int mod_instantiate(void *instance, CONF_SECTION *conf)
+static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
 {
 	rlm_mruby_t *inst = instance;
 	mrb_state *mrb;
-	CONF_SECTION *cs;
+	mrbc_context *cxt;
+	struct mrb_parser_state *parser;
+	struct RProc *proc;
+	uint8_t *bin = NULL;
+	size_t bin_len;
+	char *script;
 	FILE *f;
-	mrb_value status;
-
-	mrb = inst->mrb = mrb_open();
-	if (!mrb) {
-		ERROR("mruby initialization failed");
-		return -1;
-	}
-
-	/* Define the freeradius module */
-	DEBUG("Creating module %s", inst->module_name);
-	inst->mruby_module = mrb_define_module(mrb, inst->module_name);
-	if (!inst->mruby_module) {
-		ERROR("Creating module %s failed", inst->module_name);
-		return -1;
-	}
-
-	/* Define the log method */
-	mrb_define_class_method(mrb, inst->mruby_module, "log", mruby_log, MRB_ARGS_REQ(2));
-
-#define A(x) mrb_define_const(mrb, inst->mruby_module, #x, mrb_fixnum_value(x));
-	/* Define the logging constants */
-	A(L_DBG);
-	A(L_WARN);
-	A(L_INFO);
-	A(L_ERR);
-	A(L_WARN);
-	A(L_DBG_WARN);
-	A(L_DBG_ERR);
-	A(L_DBG_WARN_REQ);
-	A(L_DBG_ERR_REQ);
-
-	/* Define the return value constants */
-	A(RLM_MODULE_REJECT)
-	A(RLM_MODULE_FAIL)
-	A(RLM_MODULE_OK)
-	A(RLM_MODULE_HANDLED)
-	A(RLM_MODULE_INVALID)
-	A(RLM_MODULE_DISALLOW)
-	A(RLM_MODULE_NOTFOUND)
-	A(RLM_MODULE_NOOP)
-	A(RLM_MODULE_UPDATED)
-	A(RLM_MODULE_NUMCODES)
-#undef A
-
-	/* Convert a FreeRADIUS config structure into a mruby hash */
-	inst->mrubyconf_hash = mrb_hash_new(mrb);
-	cs = cf_section_find(conf, "config", NULL);
-	if (cs) mruby_parse_config(mrb, cs, 0, inst->mrubyconf_hash);
-
-	/* Define the Request class */
-	inst->mruby_request = mruby_request_class(mrb, inst->mruby_module);
+	int ret;
 
 	DEBUG("Loading file %s...", inst->filename);
 	f = fopen(inst->filename, "r");
@@ -194,117 +181,79 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
-	status = mrb_load_file(mrb, f);
-	if (mrb_undef_p(status)) {
-		ERROR("Parsing file failed");
-		return -1;
+	script = talloc_array(inst, char, 0);
+	for (;;) {
+		char	buffer[4096];
+		size_t	len, used = talloc_array_length(script);
+
+		len = fread(buffer, 1, sizeof(buffer), f);
+		if (!len) break;
+
+		MEM(script = talloc_realloc(inst, script, char, used + len));
+		memcpy(script + used, buffer, len);
 	}
+	ret = ferror(f);
 	fclose(f);
+	if (ret) {
+		ERROR("Reading file failed");
+		return -1;
+	}
 
-	status = mrb_funcall(mrb, mrb_obj_value(inst->mruby_module), "instantiate", 0);
-	if (mrb_undef_p(status)) {
-		ERROR("Running instantiate failed");
+	/*
+	 *	Scripts compiled by mrbc are used as-is.
+	 */
+	if ((talloc_array_length(script) >= 4) && (memcmp(script, "RITE", 4) == 0)) {
+		inst->bytecode = (uint8_t *)script;
+		return 0;
+	}
+
+	mrb = mrb_open();
+	if (!mrb) {
+		ERROR("mruby initialization failed");
 		return -1;
 	}
 
-	return 0;
-}
+	cxt = mrbc_context_new(mrb);
+	mrbc_filename(mrb, cxt, inst->filename);
 
-static int mruby_vps_to_array(REQUEST *request, mrb_value *out, mrb_state *mrb, VALUE_PAIR **vps)
-{
-	mrb_value	res;
-	VALUE_PAIR	*vp;
-	fr_cursor_t	cursor;
-
-	res = mrb_ary_new(mrb);
-	for (vp = fr_cursor_init(&cursor, vps); vp; vp = fr_cursor_next(&cursor)) {
-		mrb_value	tmp, key, val, to_cast;
-		char		*str;
-
-		tmp = mrb_ary_new_capa(mrb, 2);
-		if (vp->da->flags.has_tag) {
-			str = talloc_typed_asprintf(request, "%s:%d", vp->da->name, vp->tag);
-			key = mrb_str_new(mrb, str, talloc_array_length(str) - 1);
-			talloc_free(str);
+	parser = mrb_parse_nstring(mrb, script, talloc_array_length(script), cxt);
+	if (!parser || parser->nerr) {
+		if (parser) {
+			ERROR("Parsing file failed: %s[%d]: %s", inst->filename,
+			      parser->error_buffer[0].lineno, parser->error_buffer[0].message);
+			mrb_parser_free(parser);
 		} else {
-			key = mrb_str_new(mrb, vp->da->name, strlen(vp->da->name));
+			ERROR("Parsing file failed");
 		}
+	error:
+		mrbc_context_free(mrb, cxt);
+		mrb_close(mrb);
+		return -1;
+	}
 
-		/*
-		 *	The only way to create floats, doubles, bools etc,
-		 *	is to feed mruby the string representation and have
-		 *	it convert to its internal types.
-		 */
-		switch (vp->vp_type) {
-		case FR_TYPE_STRING:
-		case FR_TYPE_OCTETS:
-			to_cast = mrb_str_new(mrb, vp->vp_ptr, vp->vp_length);
-			break;
-
-		case FR_TYPE_BOOL:
-#ifndef NDEBUG
-			to_cast = mrb_nil_value();	/* Not needed but clang flags it */
-#endif
-			break;
-
-		default:
-		{
-			char *in;
-
-			in = fr_value_box_asprint(request, &vp->data, '\0');
-			to_cast = mrb_str_new(mrb, in, talloc_array_length(in) - 1);
-			talloc_free(in);
-		}
-			break;
-		}
+	proc = mrb_generate_code(mrb, parser);
+	mrb_parser_free(parser);
+	if (!proc) {
+		ERROR("Compiling file failed");
+		goto error;
+	}
 
-		switch (vp->vp_type) {
-		case FR_TYPE_STRING:
-		case FR_TYPE_OCTETS:
-		case FR_TYPE_IPV4_ADDR:
-		case FR_TYPE_IPV4_PREFIX:
-		case FR_TYPE_IPV6_ADDR:
-		case FR_TYPE_IPV6_PREFIX:
-		case FR_TYPE_IFID:
-		case FR_TYPE_ETHERNET:
-		case FR_TYPE_ABINARY:
-			val = to_cast;		/* No conversions required */
-			break;
-
-		case FR_TYPE_BOOL:
-			val = vp->vp_bool ? mrb_obj_value(mrb->true_class) : mrb_obj_value(mrb->false_class);
-			break;
-
-		case FR_TYPE_UINT8:
-		case FR_TYPE_UINT16:
-		case FR_TYPE_UINT32:
-		case FR_TYPE_UINT64:
-		case FR_TYPE_INT8:
-		case FR_TYPE_INT16:
-		case FR_TYPE_INT32:
-		case FR_TYPE_INT64:
-		case FR_TYPE_DATE:
-		case FR_TYPE_TIME_DELTA:
-		case FR_TYPE_SIZE:
-			val = mrb_convert_type(mrb, to_cast, MRB_TT_FIXNUM, "Fixnum", "to_int");
-			break;
-
-		case FR_TYPE_FLOAT32:
-		case FR_TYPE_FLOAT64:
-			val = mrb_convert_type(mrb, to_cast, MRB_TT_FLOAT, "Float", "to_f");
-			break;
-
-		case FR_TYPE_NON_VALUES:
-			fr_assert(0);
-			return -1;
-		}
+#ifdef MRB_DUMP_DEBUG_INFO
+#  define DUMP_FLAGS MRB_DUMP_DEBUG_INFO
+#else
+#  define DUMP_FLAGS DUMP_DEBUG_INFO
+#endif
+	if (mrb_dump_irep(mrb, proc->body.irep, DUMP_FLAGS, &bin, &bin_len) != MRB_DUMP_OK) {
+		ERROR("Generating bytecode failed");
+		goto error;
+	}
 
-		mrb_ary_push(mrb, tmp, key);
-		mrb_ary_push(mrb, tmp, val);
-		mrb_ary_push(mrb, res, tmp);
+	MEM(inst->bytecode = talloc_memdup(inst, bin, bin_len));
+	mrb_free(mrb, bin);
+	talloc_free(script);
 
-		*out = res;
-	}
+	mrbc_context_free(mrb, cxt);
+	mrb_close(mrb);
 
 	return 0;
 }
@@ -390,42 +339,9 @@ static void add_vp_tuple(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, mr
 	}
 }
 
-static inline int mruby_set_vps(REQUEST *request, mrb_state *mrb, mrb_value mruby_request,
-				char const *list_name, VALUE_PAIR **vps)
+static rlm_rcode_t mruby_result_process(REQUEST *request, mrb_state *mrb, mrb_value mruby_result,
+					char const *function_name)
 {
-	mrb_value res;
-
-	memset(&res, 0, sizeof(res));	/* clang scan */
-
-	if (mruby_vps_to_array(request, &res, mrb, vps) < 0) return -1;
-
-	mrb_iv_set(mrb, mruby_request, mrb_intern_cstr(mrb, list_name), res);
-
-	return 0;
-}
-
-static rlm_rcode_t CC_HINT(nonnull) do_mruby(REQUEST *request, rlm_mruby_t const *inst, char const *function_name)
-{
-	mrb_state *mrb = inst->mrb;
-	mrb_value mruby_request, mruby_result;
-
-	mruby_request = mrb_obj_new(mrb, inst->mruby_request, 0, NULL);
-	mrb_iv_set(mrb, mruby_request, mrb_intern_cstr(mrb, "@frconfig"), inst->mrubyconf_hash);
-	mruby_set_vps(request, mrb, mruby_request, "@request", &request->packet->vps);
-	mruby_set_vps(request, mrb, mruby_request, "@reply", &request->reply->vps);
-	mruby_set_vps(request, mrb, mruby_request, "@control", &request->control);
-	mruby_set_vps(request, mrb, mruby_request, "@session_state", &request->state);
-#ifdef WITH_PROXY
-	if (request->proxy) {
-		mruby_set_vps(request, mrb, mruby_request, "@proxy_request", &request->proxy->packet->vps);
-		mruby_set_vps(request, mrb, mruby_request, "@proxy_reply", &request->proxy->reply->vps);
-	}
-#endif
-
-DIAG_OFF(class-varargs)
-	mruby_result = mrb_funcall(mrb, mrb_obj_value(inst->mruby_module), function_name, 1, mruby_request);
-DIAG_ON(class-varargs)
-
 	/* Two options for the return value:
 	 * - a fixnum: convert to rlm_rcode_t, and return that
 	 * - an array: this should have exactly three items in it. The first one
@@ -473,10 +389,66 @@ DIAG_ON(class-varargs)
 }
 
 
-#define RLM_MRUBY_FUNC(foo) static rlm_rcode_t CC_HINT(nonnull) mod_##foo(void *instance, UNUSED void *thread, REQUEST *request) \
+static rlm_rcode_t CC_HINT(nonnull) do_mruby(REQUEST *request, rlm_mruby_thread_t *t, char const *function_name)
+{
+	mrb_state *mrb = t->mrb;
+	mrb_value mruby_request, mruby_result;
+	rlm_rcode_t rcode;
+	int ai;
+	size_t i, num_lists = 0;
+	mrb_value lists[6];
+	mruby_pairs_t pairs[6];
+
+	ai = mrb_gc_arena_save(mrb);
+
+	mruby_request = mrb_obj_new(mrb, t->mruby_request, 0, NULL);
+	mrb_iv_set(mrb, mruby_request, mrb_intern_cstr(mrb, "@frconfig"), t->mrubyconf_hash);
+
+	/*
+	 *	The lists aren't converted here.  The script reads
+	 *	the attributes it needs through the Pairs objects.
+	 */
+#define LIST(_name, _vps) do { \
+		pairs[num_lists] = (mruby_pairs_t) { .request = request, .vps = _vps }; \
+		lists[num_lists] = mruby_pairs_new(mrb, t->mruby_pairs, &pairs[num_lists]); \
+		mrb_iv_set(mrb, mruby_request, mrb_intern_lit(mrb, _name), lists[num_lists]); \
+		num_lists++; \
+	} while (0)
+
+	LIST("@request", &request->packet->vps);
+	LIST("@reply", &request->reply->vps);
+	LIST("@control", &request->control);
+	LIST("@session_state", &request->state);
+#ifdef WITH_PROXY
+	if (request->proxy) {
+		LIST("@proxy_request", &request->proxy->packet->vps);
+		LIST("@proxy_reply", &request->proxy->reply->vps);
+	}
+#endif
+#undef LIST
+
+DIAG_OFF(class-varargs)
+	mruby_result = mrb_funcall(mrb, mrb_obj_value(t->mruby_module), function_name, 1, mruby_request);
+DIAG_ON(class-varargs)
+
+	for (i = 0; i < num_lists; i++) mruby_pairs_release(lists[i]);
+
+	if (mrb->exc) {
+		mruby_exception_log(request, mrb, function_name);
+		rcode = RLM_MODULE_FAIL;
+	} else {
+		rcode = mruby_result_process(request, mrb, mruby_result, function_name);
+	}
+
+	mrb_gc_arena_restore(mrb, ai);
+
+	return rcode;
+}
+
+#define RLM_MRUBY_FUNC(foo) static rlm_rcode_t CC_HINT(nonnull) mod_##foo(UNUSED void *instance, void *thread, REQUEST *request) \
 	{ \
 		return do_mruby(request,	\
-			       (rlm_mruby_t const *)instance, \
+			       talloc_get_type_abort(thread, rlm_mruby_thread_t), \
 			       #foo); \
 	}
 
@@ -498,14 +470,93 @@ RLM_MRUBY_FUNC(send_coa)
 
 
 /*
- *	Only free memory we allocated.  The strings allocated via
- *	cf_section_parse() do not need to be freed.
+ *	Create this thread's VM, and load the script into it.
  */
-static int mod_detach(void *instance)
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
 {
-	rlm_mruby_t *inst = instance;
+	rlm_mruby_t const *inst = instance;
+	rlm_mruby_thread_t *t = talloc_get_type_abort(thread, rlm_mruby_thread_t);
+	mrb_state *mrb;
+	CONF_SECTION *cs;
+	mrb_sym instantiate;
+
+	t->inst = inst;
+
+	mrb = t->mrb = mrb_open();
+	if (!mrb) {
+		ERROR("mruby initialization failed");
+		return -1;
+	}
+
+	/* Define the freeradius module */
+	DEBUG("Creating module %s", inst->module_name);
+	t->mruby_module = mrb_define_module(mrb, inst->module_name);
+	if (!t->mruby_module) {
+		ERROR("Creating module %s failed", inst->module_name);
+		return -1;
+	}
+
+	/* Define the log method */
+	mrb_define_class_method(mrb, t->mruby_module, "log", mruby_log, MRB_ARGS_REQ(2));
+
+#define A(x) mrb_define_const(mrb, t->mruby_module, #x, mrb_fixnum_value(x));
+	/* Define the logging constants */
+	A(L_DBG);
+	A(L_WARN);
+	A(L_INFO);
+	A(L_ERR);
+	A(L_WARN);
+	A(L_DBG_WARN);
+	A(L_DBG_ERR);
+	A(L_DBG_WARN_REQ);
+	A(L_DBG_ERR_REQ);
+
+	/* Define the return value constants */
+	A(RLM_MODULE_REJECT)
+	A(RLM_MODULE_FAIL)
+	A(RLM_MODULE_OK)
+	A(RLM_MODULE_HANDLED)
+	A(RLM_MODULE_INVALID)
+	A(RLM_MODULE_DISALLOW)
+	A(RLM_MODULE_NOTFOUND)
+	A(RLM_MODULE_NOOP)
+	A(RLM_MODULE_UPDATED)
+	A(RLM_MODULE_NUMCODES)
+#undef A
+
+	/* Convert a FreeRADIUS config structure into a mruby hash */
+	t->mrubyconf_hash = mrb_hash_new(mrb);
+	cs = cf_section_find(conf, "config", NULL);
+	if (cs) mruby_parse_config(mrb, cs, 0, t->mrubyconf_hash);
+
+	/* Define the Request and Pairs classes */
+	t->mruby_request = mruby_request_class(mrb, t->mruby_module);
+	t->mruby_pairs = mruby_pairs_class(mrb, t->mruby_module);
+
+	mrb_load_irep(mrb, inst->bytecode);
+	if (mrb->exc) {
+		mruby_exception_log(NULL, mrb, "Loading script");
+		return -1;
+	}
+
+	instantiate = mrb_intern_lit(mrb, "instantiate");
+	if (!mrb_respond_to(mrb, mrb_obj_value(t->mruby_module), instantiate)) return 0;
+
+	mrb_funcall_argv(mrb, mrb_obj_value(t->mruby_module), instantiate, 0, NULL);
+	if (mrb->exc) {
+		mruby_exception_log(NULL, mrb, "Running instantiate");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_mruby_thread_t *t = talloc_get_type_abort(thread, rlm_mruby_thread_t);
 
-	mrb_close(inst->mrb);
+	if (t->mrb) mrb_close(t->mrb);
 
 	return 0;
 }
@@ -523,11 +574,14 @@ extern module_t rlm_mruby;
 module_t rlm_mruby = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "mruby",
-	.type		= RLM_TYPE_THREAD_UNSAFE, /* Not sure */
+	.type		= RLM_TYPE_THREAD_SAFE,
 	.inst_size	= sizeof(rlm_mruby_t),
+	.thread_inst_size	= sizeof(rlm_mruby_thread_t),
+	.thread_inst_type	= "rlm_mruby_thread_t",
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
-	.detach		= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
@@ -23,18 +23,37 @@
  * @copyright 2016 The FreeRADIUS server project
  */
 
+#include <freeradius-devel/server/base.h>
+
 #ifdef HAVE_WDOCUMENTATION
 DIAG_OFF(documentation)
 #endif
 #include <mruby.h>
 #include <mruby/compile.h>
 #include <mruby/array.h>
+#include <mruby/data.h>
+#include <mruby/dump.h>
 #include <mruby/hash.h>
+#include <mruby/irep.h>
 #include <mruby/numeric.h>
+#include <mruby/proc.h>
 #include <mruby/string.h>
 #include <mruby/variable.h>
 #ifdef HAVE_WDOCUMENTATION
 DIAG_ON(documentation)
 #endif
 
+/** A list of attributes, which the script reads through a Pairs object
+ *
+ * The Pairs object points to this, and only for as long as the method
+ * call lasts.
+ */
+typedef struct {
+	REQUEST		*request;
+	VALUE_PAIR	**vps;
+} mruby_pairs_t;
+
 struct RClass *mruby_request_class(mrb_state *mrb, struct RClass *parent);
+struct RClass *mruby_pairs_class(mrb_state *mrb, struct RClass *parent);
+mrb_value mruby_pairs_new(mrb_state *mrb, struct RClass *pairs_class, mruby_pairs_t *pairs);
+void mruby_pairs_release(mrb_value pairs);
@@ -39,7 +39,7 @@ RCSID("$Id$")
 #define WBC_MSV1_0_ALLOW_MSVCHAPV2 0x00010000
 #endif
 
-#define NT_LENGTH 24
+#define NT_LENGTH MSCHAP_WBCLIENT_NT_LENGTH
 
 /** Use Winbind to normalise a username
  *
@@ -77,40 +77,37 @@ static char *wbclient_normalise_username(TALLOC_CTX *ctx, struct wbcContext *wb_
 	return res;
 }
 
-/** Check NTLM authentication direct to winbind via Samba's libwbclient library
+/** Copy everything a winbind authentication needs out of the request
  *
+ * @param[in] ctx		to allocate the authentication context in.
+ * @param[in] inst		Module instance.
+ * @param[in] request		The current request.
+ * @param[in] challenge		MS-CHAP challenge.
+ * @param[in] response		NT-Response.
  * @return
- *	- 0 success.
- *	- -1 auth failure.
- *	- -648 password expired.
+ *	- The authentication context.
+ *	- NULL if the username or domain couldn't be expanded.
  */
-int do_auth_wbclient(rlm_mschap_t const *inst, REQUEST *request,
-		     uint8_t const *challenge, uint8_t const *response,
-		     uint8_t nthashhash[NT_DIGEST_LENGTH])
+mschap_wbclient_ctx_t *mschap_wbclient_prepare(TALLOC_CTX *ctx, rlm_mschap_t const *inst, REQUEST *request,
+					       uint8_t const *challenge, uint8_t const *response)
 {
-	int				ret = -1;
-	struct wbcContext		*wb_ctx = NULL;
+	mschap_wbclient_ctx_t		*wctx;
 	struct wbcAuthUserParams	*authparams;
-	wbcErr				err;
 	ssize_t				slen;
-	struct wbcAuthUserInfo		*info = NULL;
-	struct wbcAuthErrorInfo		*error = NULL;
-	uint8_t				resp[NT_LENGTH];
 
 	/*
 	 *	wb_username must be set for this function to be called
 	 */
 	fr_assert(inst->wb_username);
 
-	MEM(authparams = talloc_zero_pooled_object(NULL, struct wbcAuthUserParams, 2, 1024));
-	/*
-	 *	Domain first so we don't leave holes in the pool
-	 */
+	MEM(wctx = talloc_zero(ctx, mschap_wbclient_ctx_t));
+	authparams = &wctx->authparams;
+
 	if (inst->wb_domain) {
-		slen = tmpl_aexpand(authparams, &authparams->domain_name, request, inst->wb_domain, NULL, NULL);
+		slen = tmpl_aexpand(wctx, &authparams->domain_name, request, inst->wb_domain, NULL, NULL);
 		if (slen < 0) {
 			REDEBUG2("Unable to expand winbind_domain");
-			goto finish;
+			goto error;
 		}
 	} else {
 		RWDEBUG2("No domain specified; authentication may fail because of this");
@@ -119,10 +116,12 @@ int do_auth_wbclient(rlm_mschap_t const *inst, REQUEST *request,
 	/*
 	 *	Get the username and domain from the configuration
 	 */
-	slen = tmpl_aexpand(authparams, &authparams->account_name, request, inst->wb_username, NULL, NULL);
+	slen = tmpl_aexpand(wctx, &authparams->account_name, request, inst->wb_username, NULL, NULL);
 	if (slen < 0) {
 		REDEBUG2("Unable to expand winbind_username");
-		goto finish;
+	error:
+		talloc_free(wctx);
+		return NULL;
 	}
 
 	/*
@@ -131,8 +130,8 @@ int do_auth_wbclient(rlm_mschap_t const *inst, REQUEST *request,
 	authparams->level = WBC_AUTH_USER_LEVEL_RESPONSE;
 	authparams->password.response.nt_length = NT_LENGTH;
 
-	memcpy(resp, response, NT_LENGTH);
-	authparams->password.response.nt_data = resp;
+	memcpy(wctx->resp, response, NT_LENGTH);
+	authparams->password.response.nt_data = wctx->resp;
 
 	memcpy(authparams->password.response.challenge, challenge, sizeof(authparams->password.response.challenge));
 
@@ -141,82 +140,137 @@ int do_auth_wbclient(rlm_mschap_t const *inst, REQUEST *request,
 					WBC_MSV1_0_ALLOW_SERVER_TRUST_ACCOUNT;
 
 	/*
-	 * Send auth request across to winbind
+	 *	The retry needs the original challenges
+	 *	to recalculate the hash.
 	 */
-	wb_ctx = fr_pool_connection_get(inst->wb_pool, request);
-	if (wb_ctx == NULL) {
-		RERROR("Unable to get winbind connection from pool");
-		goto finish;
+	if (inst->wb_retry_with_normalised_username) {
+		VALUE_PAIR	*vp_response;
+		VALUE_PAIR	*vp_challenge;
+
+		vp_challenge = fr_pair_find_by_da(request->packet->vps, attr_ms_chap_challenge, TAG_ANY);
+		vp_response = fr_pair_find_by_da(request->packet->vps, attr_ms_chap2_response, TAG_ANY);
+		if (!vp_challenge || (vp_challenge->vp_length < sizeof(wctx->auth_challenge))) {
+			RWDEBUG2("Unable to get MS-CHAP-Challenge, won't retry with a normalised username");
+		} else if (!vp_response || (vp_response->vp_length < (2 + sizeof(wctx->peer_challenge)))) {
+			RWDEBUG2("Unable to get MS-CHAP2-Response, won't retry with a normalised username");
+		} else {
+			memcpy(wctx->auth_challenge, vp_challenge->vp_octets, sizeof(wctx->auth_challenge));
+			memcpy(wctx->peer_challenge, vp_response->vp_octets + 2, sizeof(wctx->peer_challenge));
+			wctx->retry = true;
+		}
 	}
 
 	RDEBUG2("Sending authentication request user \"%pV\" domain \"%pV\"",
 		fr_box_strvalue_buffer(authparams->account_name),
 		fr_box_strvalue_buffer(authparams->domain_name));
 
+	return wctx;
+}
+
+/** Send a prepared authentication to winbind
+ *
+ * Doesn't access the request, so may be run by a winbind executor thread.
+ *
+ * @param[in] wb_ctx	libwbclient context to use.
+ * @param[in] wctx	Prepared authentication.  Updated with the result.
+ * @return The wbcErr.
+ */
+int mschap_wbclient_run(struct wbcContext *wb_ctx, mschap_wbclient_ctx_t *wctx)
+{
+	struct wbcAuthUserParams	*authparams = &wctx->authparams;
+	struct wbcAuthUserInfo		*info = NULL;
+	struct wbcAuthErrorInfo		*error = NULL;
+	wbcErr				err;
+
 	err = wbcCtxAuthenticateUserEx(wb_ctx, authparams, &info, &error);
-	if (err == WBC_ERR_AUTH_ERROR && inst->wb_retry_with_normalised_username) {
-		VALUE_PAIR 	*vp_response;
-		VALUE_PAIR	*vp_challenge;
-		VALUE_PAIR	*vp_chap_user_name;
-		char		*normalised_username = NULL;
+	if (err == WBC_ERR_AUTH_ERROR && wctx->retry) {
+		char *normalised_username;
 
-		normalised_username = wbclient_normalise_username(authparams, wb_ctx, authparams->domain_name,
+		normalised_username = wbclient_normalise_username(wctx, wb_ctx, authparams->domain_name,
 								  authparams->account_name);
-		if (!normalised_username) goto release;
+		if (!normalised_username) goto done;
 
-		RDEBUG2("Starting retry, normalised username \"%pV\" -> \"%pV\"",
-			fr_box_strvalue_buffer(authparams->account_name),
-			fr_box_strvalue_buffer(normalised_username));
-
-		if (talloc_memcmp_bstr(authparams->account_name, normalised_username) == 0) goto release;
+		if (talloc_memcmp_bstr(authparams->account_name, normalised_username) == 0) {
+			talloc_free(normalised_username);
+			goto done;
+		}
 
-		talloc_const_free(authparams->account_name);
+		/*
+		 *	The original name is kept for logging,
+		 *	the retry uses the normalised one.
+		 */
+		wctx->normalised_username = normalised_username;
 		authparams->account_name = normalised_username;
 
-		/* Set MS-CHAP-USER-NAME */
-		MEM(pair_update_request(&vp_chap_user_name, attr_ms_chap_user_name) >= 0);
-		fr_pair_value_bstrncpy(vp_chap_user_name,
-				       normalised_username, talloc_array_length(normalised_username) - 1);
+		/* Recalculate hash */
+		mschap_challenge_hash(authparams->password.response.challenge,
+				      wctx->peer_challenge, wctx->auth_challenge,
+				      normalised_username, talloc_array_length(normalised_username) - 1);
 
-		RDEBUG2("Retrying authentication request user \"%pV\" domain \"%pV\"",
-			fr_box_strvalue_buffer(authparams->account_name),
-			fr_box_strvalue_buffer(normalised_username));
+		if (info) wbcFreeMemory(info);
+		if (error) wbcFreeMemory(error);
+		info = NULL;
+		error = NULL;
 
-		/* Recalculate hash */
-		vp_challenge = fr_pair_find_by_da(request->packet->vps, attr_ms_chap_challenge, TAG_ANY);
-		if (!vp_challenge) {
-			RERROR("Unable to get MS-CHAP-Challenge");
-			goto release;
-		}
+		err = wbcCtxAuthenticateUserEx(wb_ctx, authparams, &info, &error);
+	}
 
-		vp_response = fr_pair_find_by_da(request->packet->vps, attr_ms_chap2_response, TAG_ANY);
-		if (!vp_response) {
-			RERROR("Unable to get MS-CHAP2-Response");
-			goto release;
+done:
+	wctx->err = err;
+	if ((err == WBC_ERR_SUCCESS) && info) {
+		memcpy(wctx->nthashhash, info->user_session_key, NT_DIGEST_LENGTH);
+	}
+	if (error) {
+		wctx->have_error = true;
+		wctx->nt_status = error->nt_status;
+		if (error->display_string) {
+			strlcpy(wctx->display_string, error->display_string, sizeof(wctx->display_string));
+			wctx->have_display_string = true;
 		}
+	}
 
-		mschap_challenge_hash(authparams->password.response.challenge,
-				      vp_response->vp_octets + 2,
-				      vp_challenge->vp_octets,
-				      vp_chap_user_name->vp_strvalue, vp_chap_user_name->vp_length);
+	if (info) wbcFreeMemory(info);
+	if (error) wbcFreeMemory(error);
 
-		err = wbcCtxAuthenticateUserEx(wb_ctx, authparams, &info, &error);
-release:
-		talloc_free(normalised_username);
-	}
+	return err;
+}
 
-	fr_pool_connection_release(inst->wb_pool, request, wb_ctx);
+/** Process the result of a winbind authentication
+ *
+ * @param[in] request		The current request.
+ * @param[in] wctx		Authentication run by #mschap_wbclient_run.
+ * @param[out] nthashhash	Where to write the user session key.
+ * @return
+ *	- 0 success.
+ *	- -1 auth failure.
+ *	- -648 password expired.
+ */
+int mschap_wbclient_result(REQUEST *request, mschap_wbclient_ctx_t *wctx, uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	int ret = -1;
+
+	if (wctx->normalised_username) {
+		VALUE_PAIR *vp_chap_user_name;
+
+		RDEBUG2("Retried authentication request with normalised username \"%pV\"",
+			fr_box_strvalue_buffer(wctx->normalised_username));
+
+		/* Set MS-CHAP-USER-NAME */
+		MEM(pair_update_request(&vp_chap_user_name, attr_ms_chap_user_name) >= 0);
+		fr_pair_value_bstrncpy(vp_chap_user_name,
+				       wctx->normalised_username, talloc_array_length(wctx->normalised_username) - 1);
+	}
 
 	/*
 	 * Try and give some useful feedback on what happened. There are only
 	 * a few errors that can actually be returned from wbcCtxAuthenticateUserEx.
 	 */
-	switch (err) {
+	switch (wctx->err) {
 	case WBC_ERR_SUCCESS:
 		ret = 0;
 		RDEBUG2("Authenticated successfully");
 		/* Grab the nthashhash from the result */
-		memcpy(nthashhash, info->user_session_key, NT_DIGEST_LENGTH);
+		memcpy(nthashhash, wctx->nthashhash, NT_DIGEST_LENGTH);
 		break;
 
 	case WBC_ERR_WINBIND_NOT_AVAILABLE:
@@ -230,7 +284,7 @@ release:
 		break;
 
 	case WBC_ERR_AUTH_ERROR:
-		if (!error) {
+		if (!wctx->have_error) {
 			REDEBUG2("Authentication failed");
 			break;
 		}
@@ -238,18 +292,18 @@ release:
 		/*
 		 * The password needs to be changed, so set ret appropriately.
 		 */
-		if (error->nt_status == NT_STATUS_PASSWORD_EXPIRED ||
-		    error->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE) {
+		if (wctx->nt_status == NT_STATUS_PASSWORD_EXPIRED ||
+		    wctx->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE) {
 			ret = -648;
 		}
 
 		/*
 		 * Return the NT_STATUS human readable error string, if there is one.
 		 */
-		if (error->display_string) {
-			REDEBUG2("%s [0x%X]", error->display_string, error->nt_status);
+		if (wctx->have_display_string) {
+			REDEBUG2("%s [0x%X]", wctx->display_string, wctx->nt_status);
 		} else {
-			REDEBUG2("Authentication failed [0x%X]", error->nt_status);
+			REDEBUG2("Authentication failed [0x%X]", wctx->nt_status);
 		}
 		break;
 
@@ -260,19 +314,54 @@ release:
 		 *   WBC_ERR_NO_MEMORY
 		 * neither of which are particularly likely.
 		 */
-		if (error && error->display_string) {
-			REDEBUG2("libwbclient error: wbcErr %d (%s)", err, error->display_string);
+		if (wctx->have_display_string) {
+			REDEBUG2("libwbclient error: wbcErr %d (%s)", wctx->err, wctx->display_string);
 		} else {
-			REDEBUG2("libwbclient error: wbcErr %d", err);
+			REDEBUG2("libwbclient error: wbcErr %d", wctx->err);
 		}
 		break;
 	}
 
-finish:
-	talloc_free(authparams);
-	if (info) wbcFreeMemory(info);
-	if (error) wbcFreeMemory(error);
-
 	return ret;
 }
 
+/** Check NTLM authentication direct to winbind via Samba's libwbclient library
+ *
+ * Blocks the worker until winbind responds.  Used when no winbind
+ * executor threads are configured.
+ *
+ * @return
+ *	- 0 success.
+ *	- -1 auth failure.
+ *	- -648 password expired.
+ */
+int do_auth_wbclient(rlm_mschap_t const *inst, REQUEST *request,
+		     uint8_t const *challenge, uint8_t const *response,
+		     uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	int			ret;
+	struct wbcContext	*wb_ctx;
+	mschap_wbclient_ctx_t	*wctx;
+
+	wctx = mschap_wbclient_prepare(NULL, inst, request, challenge, response);
+	if (!wctx) return -1;
+
+	/*
+	 * Send auth request across to winbind
+	 */
+	wb_ctx = fr_pool_connection_get(inst->wb_pool, request);
+	if (wb_ctx == NULL) {
+		RERROR("Unable to get winbind connection from pool");
+		talloc_free(wctx);
+		return -1;
+	}
+
+	mschap_wbclient_run(wb_ctx, wctx);
+
+	fr_pool_connection_release(inst->wb_pool, request, wb_ctx);
+
+	ret = mschap_wbclient_result(request, wctx, nthashhash);
+	talloc_free(wctx);
+
+	return ret;
+}
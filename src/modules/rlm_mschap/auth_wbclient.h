@@ -2,6 +2,36 @@
 /* @copyright 2015 The FreeRADIUS server project */
 RCSIDH(auth_wbclient_h, "$Id$")
 
+#define MSCHAP_WBCLIENT_NT_LENGTH	24
+
+/** A winbind authentication, prepared in the worker, and run by a winbind executor
+ *
+ * Holds copies of everything the call needs, so it never touches the request.
+ */
+typedef struct {
+	struct wbcAuthUserParams	authparams;			//!< Strings are children of this struct.
+	uint8_t				resp[MSCHAP_WBCLIENT_NT_LENGTH];	//!< Copy of the NT-Response.
+
+	bool				retry;				//!< Retry with a normalised username.
+	uint8_t				peer_challenge[MSCHAP_PEER_CHALLENGE_LENGTH];	//!< From MS-CHAP2-Response, for the retry.
+	uint8_t				auth_challenge[MSCHAP_PEER_AUTHENTICATOR_CHALLENGE_LENGTH];	//!< From MS-CHAP-Challenge, for the retry.
+	char				*normalised_username;		//!< Username the retry was made with.
+
+	wbcErr				err;				//!< Result of the call.
+	bool				have_error;			//!< Whether winbind returned error info.
+	uint32_t			nt_status;			//!< From the error info.
+	char				display_string[256];		//!< From the error info.
+	bool				have_display_string;		//!< Whether display_string is valid.
+	uint8_t				nthashhash[NT_DIGEST_LENGTH];	//!< User session key on success.
+} mschap_wbclient_ctx_t;
+
+mschap_wbclient_ctx_t *mschap_wbclient_prepare(TALLOC_CTX *ctx, rlm_mschap_t const *inst, REQUEST *request,
+					       uint8_t const *challenge, uint8_t const *response);
+
+int mschap_wbclient_run(struct wbcContext *wb_ctx, mschap_wbclient_ctx_t *wctx);
+
+int mschap_wbclient_result(REQUEST *request, mschap_wbclient_ctx_t *wctx, uint8_t nthashhash[NT_DIGEST_LENGTH]);
+
 int do_auth_wbclient(rlm_mschap_t const *inst, REQUEST *request,
 		     uint8_t const *challenge, uint8_t const *response,
 		     uint8_t nthashhash[NT_DIGEST_LENGTH]);
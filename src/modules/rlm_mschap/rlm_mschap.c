@@ -31,8 +31,10 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/password.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 
+#include <freeradius-devel/util/base64.h>
 #include <freeradius-devel/util/md4.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/misc.h>
@@ -71,6 +73,37 @@ int od_mschap_auth(REQUEST *request, VALUE_PAIR *challenge, VALUE_PAIR * usernam
 #define ACB_AUTOLOCK	0x04000000	//!< Account auto locked.
 #define ACB_FR_EXPIRED	0x00020000	//!< Password Expired.
 
+#define MSCHAP_YIELD	(-1000)		//!< do_mschap() result when waiting for an ntlm_auth helper,
+					///< or a winbind executor.
+
+/** An exchange with an ntlm_auth helper, or a winbind executor
+ *
+ * mod_authenticate() yields when the request is sent, and runs again
+ * with this as the rctx when the helper replies.  On the second pass
+ * do_mschap() returns the helper's result instead of sending another
+ * request.
+ */
+typedef struct {
+	fr_exec_pool_t		*pool;		//!< Thread's helper pool.
+	fr_exec_pool_req_t	*preq;		//!< Request sent to the helper.  NULL on the first pass.
+#ifdef WITH_AUTH_WINBIND
+	fr_offload_thread_t	*offload;	//!< Thread's handle for the winbind executors.
+	fr_offload_req_t	*oreq;		//!< Call made by a winbind executor.  NULL on the first pass.
+#endif
+} mschap_helper_rctx_t;
+
+/** Whether this is the second pass, and do_mschap() should return a result
+ *
+ */
+static inline bool mschap_helper_sent(mschap_helper_rctx_t const *hctx)
+{
+	if (!hctx) return false;
+#ifdef WITH_AUTH_WINBIND
+	if (hctx->oreq) return true;
+#endif
+	return (hctx->preq != NULL);
+}
+
 static const CONF_PARSER passchange_config[] = {
 	{ FR_CONF_OFFSET("ntlm_auth", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_cpw) },
 	{ FR_CONF_OFFSET("ntlm_auth_username", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_cpw_username) },
@@ -79,11 +112,24 @@ static const CONF_PARSER passchange_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER ntlm_auth_helper_config[] = {
+	{ FR_CONF_OFFSET("program", FR_TYPE_STRING, rlm_mschap_t, ntlm_auth_helper.program) },
+	{ FR_CONF_OFFSET("username", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_auth_helper_username),
+	  .dflt = "%{mschap:User-Name}" },
+	{ FR_CONF_OFFSET("domain", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_auth_helper_domain) },
+	{ FR_CONF_OFFSET("num_helpers", FR_TYPE_UINT32, rlm_mschap_t, ntlm_auth_helper.num_helpers), .dflt = "2" },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, rlm_mschap_t, ntlm_auth_helper.timeout), .dflt = "5" },
+	{ FR_CONF_OFFSET("restart_delay", FR_TYPE_TIME_DELTA, rlm_mschap_t, ntlm_auth_helper.restart_delay), .dflt = "1" },
+	{ FR_CONF_OFFSET("max_queued", FR_TYPE_UINT32, rlm_mschap_t, ntlm_auth_helper.max_queued), .dflt = "1024" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER winbind_config[] = {
 	{ FR_CONF_OFFSET("username", FR_TYPE_TMPL, rlm_mschap_t, wb_username) },
 	{ FR_CONF_OFFSET("domain", FR_TYPE_TMPL, rlm_mschap_t, wb_domain) },
 #ifdef WITH_AUTH_WINBIND
 	{ FR_CONF_OFFSET("retry_with_normalised_username", FR_TYPE_BOOL, rlm_mschap_t, wb_retry_with_normalised_username), .dflt = "no" },
+	{ FR_CONF_OFFSET("async", FR_TYPE_SUBSECTION, rlm_mschap_t, wb_async), .subcs = (void const *) fr_offload_config },
 #endif
 	CONF_PARSER_TERMINATOR
 };
@@ -100,6 +146,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("with_ntdomain_hack", FR_TYPE_BOOL, rlm_mschap_t, with_ntdomain_hack), .dflt = "yes" },
 	{ FR_CONF_OFFSET("ntlm_auth", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_auth) },
 	{ FR_CONF_OFFSET("ntlm_auth_timeout", FR_TYPE_TIME_DELTA, rlm_mschap_t, ntlm_auth_timeout) },
+	{ FR_CONF_POINTER("ntlm_auth_helper", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) ntlm_auth_helper_config },
 
 	{ FR_CONF_POINTER("passchange", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) passchange_config },
 	{ FR_CONF_OFFSET("allow_retry", FR_TYPE_BOOL, rlm_mschap_t, allow_retry), .dflt = "yes" },
@@ -668,6 +715,27 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_del
 
 	return *wb_ctx;
 }
+
+/*
+ *	Create a winbind executor's context
+ */
+static void *mod_offload_resource_alloc(UNUSED void *uctx)
+{
+	struct wbcContext *wb_ctx;
+
+	wb_ctx = wbcCtxCreate();
+	if (!wb_ctx) fr_strerror_printf("Failed to create winbind context");
+
+	return wb_ctx;
+}
+
+/*
+ *	Free a winbind executor's context
+ */
+static void mod_offload_resource_free(void *resource, UNUSED void *uctx)
+{
+	wbcCtxFree(resource);
+}
 #endif
 
 /*
@@ -1060,6 +1128,296 @@ ntlm_auth_err:
 	return -1;
 }
 
+/** Convert an error message from ntlm_auth into a do_mschap() result
+ *
+ * @param[in] request	The current request.
+ * @param[in] buffer	Output from ntlm_auth.  May be modified.
+ * @return
+ *	- -648 password expired.
+ *	- -647 account locked out.
+ *	- -691 account disabled.
+ *	- -2 no logon servers.
+ *	- -1 any other error.
+ */
+static int ntlm_auth_error(REQUEST *request, char *buffer)
+{
+	char *p;
+
+	/*
+	 *	Do checks for numbers, which are
+	 *	language neutral.  They're also
+	 *	faster.
+	 */
+	p = strcasestr(buffer, "0xC0000");
+	if (p) {
+		int rcode = 0;
+
+		p += 7;
+		if (strcmp(p, "224") == 0) {
+			rcode = -648;
+
+		} else if (strcmp(p, "234") == 0) {
+			rcode = -647;
+
+		} else if (strcmp(p, "072") == 0) {
+			rcode = -691;
+
+		} else if (strcasecmp(p, "05E") == 0) {
+			rcode = -2;
+		}
+
+		if (rcode != 0) {
+			REDEBUG2("%s", buffer);
+			return rcode;
+		}
+
+		/*
+		 *	Else fall through to more ridiculous checks.
+		 */
+	}
+
+	/*
+	 *	Look for variants of expire password.
+	 */
+	if (strcasestr(buffer, "0xC0000224") ||
+	    strcasestr(buffer, "Password expired") ||
+	    strcasestr(buffer, "Password has expired") ||
+	    strcasestr(buffer, "Password must be changed") ||
+	    strcasestr(buffer, "Must change password") ||
+	    strcasestr(buffer, "NT_STATUS_PASSWORD_EXPIRED") ||
+	    strcasestr(buffer, "NT_STATUS_PASSWORD_MUST_CHANGE")) {
+		return -648;
+	}
+
+	if (strcasestr(buffer, "0xC0000234") ||
+	    strcasestr(buffer, "Account locked out") ||
+	    strcasestr(buffer, "NT_STATUS_ACCOUNT_LOCKED_OUT")) {
+		REDEBUG2("%s", buffer);
+		return -647;
+	}
+
+	if (strcasestr(buffer, "0xC0000072") ||
+	    strcasestr(buffer, "Account disabled") ||
+	    strcasestr(buffer, "NT_STATUS_ACCOUNT_DISABLED")) {
+		REDEBUG2("%s", buffer);
+		return -691;
+	}
+
+	if (strcasestr(buffer, "0xC000005E") ||
+	    strcasestr(buffer, "No logon servers") ||
+	    strcasestr(buffer, "NT_STATUS_NO_LOGON_SERVERS")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	if (strcasestr(buffer, "could not obtain winbind separator") ||
+	    strcasestr(buffer, "Reading winbind reply failed")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	RDEBUG2("External script failed");
+	p = strchr(buffer, '\n');
+	if (p) *p = '\0';
+
+	REDEBUG("External script says: %s", buffer);
+	return -1;
+}
+
+static void mschap_helper_complete(REQUEST *request, UNUSED fr_exec_pool_req_t *preq, UNUSED void *uctx)
+{
+	unlang_interpret_resumable(request);
+}
+
+/** Send an authentication request to an ntlm_auth helper
+ *
+ * Uses the ntlm-server-1 helper protocol, where the request is a
+ * list of `name: value` lines, terminated by a line containing a
+ * single `.`.  Names followed by `::` have base64 encoded values.
+ *
+ * @return
+ *	- MSCHAP_YIELD if the request was sent.
+ *	- -1 on failure.
+ */
+static int mschap_helper_send(rlm_mschap_t const *inst, REQUEST *request, mschap_helper_rctx_t *hctx,
+			      uint8_t const *challenge, uint8_t const *response)
+{
+	char		buffer[256];
+	char		b64[FR_BASE64_ENC_LENGTH(sizeof(buffer)) + 1];
+	char		*msg;
+	ssize_t		slen;
+	size_t		len;
+
+	slen = xlat_eval(buffer, sizeof(buffer), request, inst->ntlm_auth_helper_username, NULL, NULL);
+	if (slen < 0) {
+		RPEDEBUG("Failed expanding ntlm_auth helper username");
+		return -1;
+	}
+	len = fr_base64_encode(b64, sizeof(b64), (uint8_t const *)buffer, slen);
+	MEM(msg = talloc_asprintf(hctx, "Username:: %.*s\n", (int)len, b64));
+
+	if (inst->ntlm_auth_helper_domain) {
+		slen = xlat_eval(buffer, sizeof(buffer), request, inst->ntlm_auth_helper_domain, NULL, NULL);
+		if (slen < 0) {
+			RPEDEBUG("Failed expanding ntlm_auth helper domain");
+			talloc_free(msg);
+			return -1;
+		}
+		len = fr_base64_encode(b64, sizeof(b64), (uint8_t const *)buffer, slen);
+		MEM(msg = talloc_asprintf_append_buffer(msg, "NT-Domain:: %.*s\n", (int)len, b64));
+	}
+
+	fr_bin2hex(buffer, challenge, 8);
+	MEM(msg = talloc_asprintf_append_buffer(msg, "LANMAN-Challenge: %s\n", buffer));
+	fr_bin2hex(buffer, response, 24);
+	MEM(msg = talloc_asprintf_append_buffer(msg, "NT-Response: %s\n", buffer));
+	MEM(msg = talloc_strdup_append_buffer(msg, "Request-User-Session-Key: Yes\n.\n"));
+
+	RDEBUG2("Sending request to ntlm_auth helper");
+
+	hctx->preq = fr_exec_pool_enqueue(hctx, hctx->pool, request, (uint8_t const *)msg,
+					  talloc_array_length(msg) - 1, mschap_helper_complete, NULL);
+	talloc_free(msg);
+	if (!hctx->preq) return -1;
+
+	return MSCHAP_YIELD;
+}
+
+/** Process the reply from an ntlm_auth helper
+ *
+ * The reply is a list of `name: value` lines, i.e.
+ *
+ *	Authenticated: Yes
+ *	User-Session-Key: 000102030405060708090a0b0c0d0e0f
+ *
+ * or
+ *
+ *	Authenticated: No
+ *	Authentication-Error: NT_STATUS_WRONG_PASSWORD
+ *
+ * @return a do_mschap() result.
+ */
+static int mschap_helper_result(REQUEST *request, mschap_helper_rctx_t *hctx,
+				uint8_t nthashhash[static NT_DIGEST_LENGTH])
+{
+	uint8_t const	*reply;
+	char		*p, *next, *error = NULL;
+	bool		authenticated = false, have_key = false;
+
+	switch (fr_exec_pool_req_result(&reply, NULL, hctx->preq)) {
+	case FR_EXEC_POOL_REQ_DONE:
+		break;
+
+	case FR_EXEC_POOL_REQ_TIMEOUT:
+		REDEBUG("Timeout waiting for ntlm_auth helper");
+		return -2;
+
+	default:
+		REDEBUG("ntlm_auth helper failed");
+		return -2;
+	}
+
+	/*
+	 *	The reply is ours to modify, it's owned by the
+	 *	exchange, and only parsed once.
+	 */
+	memcpy(&p, &reply, sizeof(p));
+	for (; p && *p; p = next) {
+		next = strchr(p, '\n');
+		if (next) *next++ = '\0';
+
+		if (strcasecmp(p, "Authenticated: Yes") == 0) {
+			authenticated = true;
+
+		} else if (strncasecmp(p, "User-Session-Key: ", 18) == 0) {
+			if (fr_hex2bin(nthashhash, NT_DIGEST_LENGTH, p + 18, strlen(p + 18)) != NT_DIGEST_LENGTH) {
+				REDEBUG("Invalid output from ntlm_auth helper: User-Session-Key has non-hex values");
+				return -1;
+			}
+			have_key = true;
+
+		} else if (strncasecmp(p, "Authentication-Error: ", 22) == 0) {
+			error = p + 22;
+
+		} else if (strncasecmp(p, "Error: ", 7) == 0) {
+			error = p + 7;
+		}
+	}
+
+	if (!authenticated) {
+		if (error) return ntlm_auth_error(request, error);
+
+		REDEBUG("ntlm_auth helper rejected the user");
+		return -1;
+	}
+
+	if (!have_key) RWDEBUG("ntlm_auth helper did not return a User-Session-Key, MPPE keys will be invalid");
+
+	return 0;
+}
+
+#ifdef WITH_AUTH_WINBIND
+static void mschap_wbclient_complete(REQUEST *request, UNUSED fr_offload_req_t *oreq, UNUSED void *uctx)
+{
+	unlang_interpret_resumable(request);
+}
+
+static int _mschap_wbclient_run(void *resource, void *data)
+{
+	return mschap_wbclient_run(resource, talloc_get_type_abort(data, mschap_wbclient_ctx_t));
+}
+
+/** Queue a winbind authentication for the executors
+ *
+ * @return
+ *	- MSCHAP_YIELD if the call was queued.
+ *	- -1 on failure.
+ */
+static int mschap_wbclient_send(rlm_mschap_t const *inst, REQUEST *request, mschap_helper_rctx_t *hctx,
+				uint8_t const *challenge, uint8_t const *response)
+{
+	mschap_wbclient_ctx_t *wctx;
+
+	wctx = mschap_wbclient_prepare(hctx, inst, request, challenge, response);
+	if (!wctx) return -1;
+
+	/*
+	 *	Concurrency is limited per domain, so one
+	 *	unresponsive DC can't starve the others.
+	 */
+	hctx->oreq = fr_offload_enqueue(hctx->offload, request, wctx->authparams.domain_name,
+					_mschap_wbclient_run, wctx, mschap_wbclient_complete, NULL);
+	if (!hctx->oreq) return -1;
+
+	return MSCHAP_YIELD;
+}
+
+/** Process the result of a winbind authentication run by an executor
+ *
+ * @return a do_mschap() result.
+ */
+static int mschap_wbclient_recv(REQUEST *request, mschap_helper_rctx_t *hctx,
+				uint8_t nthashhash[static NT_DIGEST_LENGTH])
+{
+	void *data;
+
+	switch (fr_offload_req_result(NULL, &data, hctx->oreq)) {
+	case FR_OFFLOAD_REQ_DONE:
+		break;
+
+	case FR_OFFLOAD_REQ_TIMEOUT:
+		REDEBUG("Timeout waiting for winbind");
+		return -2;
+
+	default:
+		REDEBUG("Winbind call failed");
+		return -2;
+	}
+
+	return mschap_wbclient_result(request, talloc_get_type_abort(data, mschap_wbclient_ctx_t), nthashhash);
+}
+#endif
+
 /*
  *	Do the MS-CHAP stuff.
  *
@@ -1071,7 +1429,7 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 						      VALUE_PAIR *password,
 						      uint8_t const *challenge, uint8_t const *response,
 						      uint8_t nthashhash[static NT_DIGEST_LENGTH],
-						      MSCHAP_AUTH_METHOD method)
+						      MSCHAP_AUTH_METHOD method, mschap_helper_rctx_t *hctx)
 {
 	uint8_t	calculated[24];
 
@@ -1118,84 +1476,7 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 		 */
 		result = radius_exec_program(request, buffer, sizeof(buffer), NULL, request, inst->ntlm_auth, NULL,
 					     true, true, inst->ntlm_auth_timeout);
-		if (result != 0) {
-			char *p;
-
-			/*
-			 *	Do checks for numbers, which are
-			 *	language neutral.  They're also
-			 *	faster.
-			 */
-			p = strcasestr(buffer, "0xC0000");
-			if (p) {
-				int rcode = 0;
-
-				p += 7;
-				if (strcmp(p, "224") == 0) {
-					rcode = -648;
-
-				} else if (strcmp(p, "234") == 0) {
-					rcode = -647;
-
-				} else if (strcmp(p, "072") == 0) {
-					rcode = -691;
-
-				} else if (strcasecmp(p, "05E") == 0) {
-					rcode = -2;
-				}
-
-				if (rcode != 0) {
-					REDEBUG2("%s", buffer);
-					return rcode;
-				}
-
-				/*
-				 *	Else fall through to more ridiculous checks.
-				 */
-			}
-
-			/*
-			 *	Look for variants of expire password.
-			 */
-			if (strcasestr(buffer, "0xC0000224") ||
-			    strcasestr(buffer, "Password expired") ||
-			    strcasestr(buffer, "Password has expired") ||
-			    strcasestr(buffer, "Password must be changed") ||
-			    strcasestr(buffer, "Must change password")) {
-				return -648;
-			}
-
-			if (strcasestr(buffer, "0xC0000234") ||
-			    strcasestr(buffer, "Account locked out")) {
-				REDEBUG2("%s", buffer);
-				return -647;
-			}
-
-			if (strcasestr(buffer, "0xC0000072") ||
-			    strcasestr(buffer, "Account disabled")) {
-				REDEBUG2("%s", buffer);
-				return -691;
-			}
-
-			if (strcasestr(buffer, "0xC000005E") ||
-			    strcasestr(buffer, "No logon servers")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			if (strcasestr(buffer, "could not obtain winbind separator") ||
-			    strcasestr(buffer, "Reading winbind reply failed")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			RDEBUG2("External script failed");
-			p = strchr(buffer, '\n');
-			if (p) *p = '\0';
-
-			REDEBUG("External script says: %s", buffer);
-			return -1;
-		}
+		if (result != 0) return ntlm_auth_error(request, buffer);
 
 		/*
 		 *	Parse the answer as an nthashhash.
@@ -1229,12 +1510,26 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 
 		break;
 		}
+	case AUTH_NTLMAUTH_HELPER:
+	/*
+	 *	Ask a persistent ntlm_auth helper.  The first pass
+	 *	sends the request, the second gets the result.
+	 */
+		if (!fr_cond_assert(hctx)) return -1;
+		if (!hctx->preq) return mschap_helper_send(inst, request, hctx, challenge, response);
+
+		return mschap_helper_result(request, hctx, nthashhash);
+
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
 	/*
-	 *	Process auth via the wbclient library
+	 *	Process auth via the wbclient library, either
+	 *	directly, or by handing it to an executor.
 	 */
-		return do_auth_wbclient(inst, request, challenge, response, nthashhash);
+		if (!hctx) return do_auth_wbclient(inst, request, challenge, response, nthashhash);
+		if (!hctx->oreq) return mschap_wbclient_send(inst, request, hctx, challenge, response);
+
+		return mschap_wbclient_recv(request, hctx, nthashhash);
 #endif
 	default:
 		/* We should never reach this line */
@@ -1707,7 +2002,8 @@ static rlm_rcode_t CC_HINT(nonnull(1,2,3,4,7,8)) mschap_process_response(int *ms
 									   VALUE_PAIR *nt_password,
 									   VALUE_PAIR *challenge,
 									   VALUE_PAIR *response,
-									   MSCHAP_AUTH_METHOD method)
+									   MSCHAP_AUTH_METHOD method,
+									   mschap_helper_rctx_t *hctx)
 {
 	int			offset;
 	int			mschap_result;
@@ -1747,7 +2043,9 @@ static rlm_rcode_t CC_HINT(nonnull(1,2,3,4,7,8)) mschap_process_response(int *ms
 	 *	Do the MS-CHAP authentication.
 	 */
 	mschap_result = do_mschap(inst, request, nt_password, challenge->vp_octets,
-				  response->vp_octets + offset, nthashhash, method);
+				  response->vp_octets + offset, nthashhash, method, hctx);
+	if (mschap_result == MSCHAP_YIELD) return RLM_MODULE_YIELD;
+
 	/*
 	 *	Check for errors, and add MSCHAP-Error if necessary.
 	 */
@@ -1762,7 +2060,8 @@ static rlm_rcode_t CC_HINT(nonnull(1,2,3,4,7,8)) mschap_process_v2_response(int
 									    VALUE_PAIR *nt_password,
 									    VALUE_PAIR *challenge,
 									    VALUE_PAIR *response,
-									    MSCHAP_AUTH_METHOD method)
+									    MSCHAP_AUTH_METHOD method,
+									    mschap_helper_rctx_t *hctx)
 {
 		uint8_t		mschap_challenge[16];
 		VALUE_PAIR	*user_name, *name_vp, *response_name, *peer_challenge_attr;
@@ -1840,7 +2139,7 @@ static rlm_rcode_t CC_HINT(nonnull(1,2,3,4,7,8)) mschap_process_v2_response(int
 		 *  indicates the auth process should continue directly to AD.
 		 *  Otherwise OD will determine auth success/fail.
 		 */
-		if (!nt_password && inst->open_directory) {
+		if (!nt_password && inst->open_directory && !mschap_helper_sent(hctx)) {
 			RDEBUG2("No NT-Password available. Trying OpenDirectory Authentication");
 			rcode = od_mschap_auth(request, challenge, user_name);
 			if (rcode != RLM_MODULE_NOOP) return rcode;
@@ -1869,7 +2168,8 @@ static rlm_rcode_t CC_HINT(nonnull(1,2,3,4,7,8)) mschap_process_v2_response(int
 				      username_str, username_len);	/* user name */
 
 		mschap_result = do_mschap(inst, request, nt_password, mschap_challenge,
-					  response->vp_octets + 26, nthashhash, method);
+					  response->vp_octets + 26, nthashhash, method, hctx);
+		if (mschap_result == MSCHAP_YIELD) return RLM_MODULE_YIELD;
 
 		/*
 		 *	Check for errors, and add MSCHAP-Error if necessary.
@@ -1904,6 +2204,10 @@ static rlm_rcode_t CC_HINT(nonnull(1,2,3,4,7,8)) mschap_process_v2_response(int
 		return RLM_MODULE_OK;
 }
 
+static rlm_rcode_t mod_authenticate_resume(void *instance, void *thread, REQUEST *request, void *rctx);
+static void mod_authenticate_signal(void *instance, void *thread, REQUEST *request,
+				    void *rctx, fr_state_signal_t action);
+
 /*
  *	mod_authenticate() - authenticate user based on given
  *	attributes and configuration.
@@ -1919,10 +2223,15 @@ static rlm_rcode_t CC_HINT(nonnull(1,2,3,4,7,8)) mschap_process_v2_response(int
  *	In case of password mismatch or locked account we MAY return
  *	MS-CHAP-Error for MS-CHAP or MS-CHAP v2
  *	If MS-CHAP2 succeeds we MUST return MS-CHAP2-Success
+ *
+ *	When using ntlm_auth helpers this runs twice, once to send the
+ *	request to the helper, and again with hctx set when the helper
+ *	has replied.  Everything before do_mschap() is repeated, except
+ *	for password changes.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull(1,3)) mschap_authenticate(rlm_mschap_t const *inst, rlm_mschap_thread_t *t,
+							     REQUEST *request, mschap_helper_rctx_t *hctx)
 {
-	rlm_mschap_t const	*inst = instance;
 	VALUE_PAIR		*challenge = NULL;
 	VALUE_PAIR		*response = NULL;
 	VALUE_PAIR		*cpw = NULL;
@@ -1985,7 +2294,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 	 *	input attribute, and we're calling out to an
 	 *	external password store.
 	 */
-	if (nt_password_find(&ephemeral, &nt_password, instance, request) < 0) return RLM_MODULE_FAIL;
+	if (nt_password_find(&ephemeral, &nt_password, inst, request) < 0) return RLM_MODULE_FAIL;
 
 	/*
 	 *	Check to see if this is a change password request, and process
@@ -1995,8 +2304,10 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 	if (cpw) {
 		uint8_t		*p;
 
-		rcode = mschap_process_cpw_request(instance, request, cpw, nt_password);
-		if (rcode != RLM_MODULE_OK) goto finish;
+		if (!mschap_helper_sent(hctx)) {
+			rcode = mschap_process_cpw_request(inst, request, cpw, nt_password);
+			if (rcode != RLM_MODULE_OK) goto finish;
+		}
 
 		/*
 		 *	Clear any expiry bit so the user can now login;
@@ -2025,6 +2336,17 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 		fr_pair_value_memsteal(response, p, false);
 	}
 
+	if ((method == AUTH_NTLMAUTH_HELPER) && !hctx) {
+		MEM(hctx = talloc_zero(request, mschap_helper_rctx_t));
+		hctx->pool = t->helper_pool;
+	}
+#ifdef WITH_AUTH_WINBIND
+	if ((method == AUTH_WBCLIENT) && t->wb_offload && !hctx) {
+		MEM(hctx = talloc_zero(request, mschap_helper_rctx_t));
+		hctx->offload = t->wb_offload;
+	}
+#endif
+
 	challenge = fr_pair_find_by_da(request->packet->vps, attr_ms_chap_challenge, TAG_ANY);
 	if (!challenge) {
 		REDEBUG("&control:Auth-Type = %s set for a request that does not contain &%s",
@@ -2041,14 +2363,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 						inst, request,
 						smb_ctrl, nt_password,
 						challenge, response,
-						method);
+						method, hctx);
 		if (rcode != RLM_MODULE_OK) goto finish;
 	} else if ((response = fr_pair_find_by_da(request->packet->vps, attr_ms_chap2_response, TAG_ANY))) {
 		rcode = mschap_process_v2_response(&mschap_version, nthashhash,
 						   inst, request,
 						   smb_ctrl, nt_password,
 						   challenge, response,
-						   method);
+						   method, hctx);
 		if (rcode != RLM_MODULE_OK) goto finish;
 	} else {		/* Neither CHAPv1 or CHAPv2 response: die */
 		REDEBUG("&control:Auth-Type = %s set for a request that does not contain &%s or &%s attributes",
@@ -2107,9 +2429,51 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 finish:
 	if (ephemeral) talloc_list_free(&nt_password);
 
+	if (rcode == RLM_MODULE_YIELD) {
+		return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, hctx);
+	}
+
+	/*
+	 *	Either the first pass didn't need the helper, or
+	 *	mod_authenticate_resume() frees it.
+	 */
+	if (hctx && !mschap_helper_sent(hctx)) talloc_free(hctx);
+
+	return rcode;
+}
+
+static rlm_rcode_t mod_authenticate_resume(void *instance, void *thread, REQUEST *request, void *rctx)
+{
+	mschap_helper_rctx_t	*hctx = talloc_get_type_abort(rctx, mschap_helper_rctx_t);
+	rlm_rcode_t		rcode;
+
+	rcode = mschap_authenticate(instance, talloc_get_type_abort(thread, rlm_mschap_thread_t), request, hctx);
+#ifdef WITH_AUTH_WINBIND
+	talloc_free(hctx->oreq);	/* Parented by the thread's offload handle */
+#endif
+	talloc_free(hctx);
+
 	return rcode;
 }
 
+static void mod_authenticate_signal(UNUSED void *instance, UNUSED void *thread, UNUSED REQUEST *request,
+				    void *rctx, fr_state_signal_t action)
+{
+	mschap_helper_rctx_t	*hctx = talloc_get_type_abort(rctx, mschap_helper_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	TALLOC_FREE(hctx->preq);
+#ifdef WITH_AUTH_WINBIND
+	TALLOC_FREE(hctx->oreq);
+#endif
+}
+
+static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, void *thread, REQUEST *request)
+{
+	return mschap_authenticate(instance, talloc_get_type_abort(thread, rlm_mschap_thread_t), request, NULL);
+}
+
 /*
  *	Create instance for our module. Allocate space for
  *	instance structure and read configuration parameters
@@ -2132,6 +2496,20 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 			cf_log_err(conf, "Unable to initialise winbind connection pool");
 			return -1;
 		}
+
+		if (inst->wb_async.num_threads) {
+			CONF_SECTION *wb_cs = cf_section_find(conf, "winbind", NULL);
+
+			if (fr_offload_conf_check(wb_cs ? cf_section_find(wb_cs, "async", NULL) : conf,
+						  &inst->wb_async) < 0) return -1;
+
+			inst->wb_offload = fr_offload_alloc(inst, &inst->wb_async, inst->name,
+							    mod_offload_resource_alloc, mod_offload_resource_free, NULL);
+			if (!inst->wb_offload) {
+				cf_log_perr(conf, "Unable to initialise winbind executors");
+				return -1;
+			}
+		}
 #else
 		cf_log_err(conf, "'winbind' auth not enabled at compiled time");
 		return -1;
@@ -2143,6 +2521,20 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		inst->method = AUTH_NTLMAUTH_EXEC;
 	}
 
+	/*
+	 *	...except for persistent helpers, which have to be
+	 *	configured explicitly.
+	 */
+	if (inst->ntlm_auth_helper.program) {
+		inst->ntlm_auth_helper.protocol = FR_EXEC_POOL_PROTO_LINE;
+		inst->ntlm_auth_helper.terminator = ".";
+
+		if (fr_exec_pool_conf_check(cf_section_find(conf, "ntlm_auth_helper", NULL),
+					    &inst->ntlm_auth_helper) < 0) return -1;
+
+		inst->method = AUTH_NTLMAUTH_HELPER;
+	}
+
 	switch (inst->method) {
 	case AUTH_INTERNAL:
 		DEBUG("Using internal authentication");
@@ -2150,9 +2542,17 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	case AUTH_NTLMAUTH_EXEC:
 		DEBUG("Authenticating by calling 'ntlm_auth'");
 		break;
+	case AUTH_NTLMAUTH_HELPER:
+		DEBUG("Authenticating via persistent 'ntlm_auth' helpers");
+		break;
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
-		DEBUG("Authenticating directly to winbind");
+		if (inst->wb_offload) {
+			DEBUG("Authenticating directly to winbind, via %u executor threads",
+			      inst->wb_async.num_threads);
+		} else {
+			DEBUG("Authenticating directly to winbind");
+		}
 		break;
 #endif
 	}
@@ -2177,6 +2577,37 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+/*
+ *	Start this thread's ntlm_auth helpers, or connect it to
+ *	the winbind executors.
+ */
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_mschap_t		*inst = instance;
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(thread, rlm_mschap_thread_t);
+
+#ifdef WITH_AUTH_WINBIND
+	if ((inst->method == AUTH_WBCLIENT) && inst->wb_offload) {
+		t->wb_offload = fr_offload_thread_alloc(t, inst->wb_offload, el);
+		if (!t->wb_offload) {
+			cf_log_perr(conf, "Failed connecting to winbind executors");
+			return -1;
+		}
+		return 0;
+	}
+#endif
+
+	if (inst->method != AUTH_NTLMAUTH_HELPER) return 0;
+
+	t->helper_pool = fr_exec_pool_alloc(t, el, &inst->ntlm_auth_helper, inst->name);
+	if (!t->helper_pool) {
+		cf_log_perr(conf, "Failed creating ntlm_auth helper pool");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
 	char const		*name;
@@ -2226,9 +2657,11 @@ module_t rlm_mschap = {
 	.name		= "mschap",
 	.type		= 0,
 	.inst_size	= sizeof(rlm_mschap_t),
+	.thread_inst_size	= sizeof(rlm_mschap_thread_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
@@ -4,6 +4,9 @@ RCSIDH(rlm_mschap_h, "$Id$")
 
 #include "config.h"
 
+#include <freeradius-devel/server/exec_pool.h>
+#include <freeradius-devel/server/offload.h>
+
 #ifdef WITH_AUTH_WINBIND
 #  include <wbclient.h>
 
@@ -13,9 +16,10 @@ RCSIDH(rlm_mschap_h, "$Id$")
 /* Method of authentication we are going to use */
 typedef enum {
 	AUTH_INTERNAL		= 0,
-	AUTH_NTLMAUTH_EXEC	= 1
+	AUTH_NTLMAUTH_EXEC	= 1,
+	AUTH_NTLMAUTH_HELPER	= 2
 #ifdef WITH_AUTH_WINBIND
-	,AUTH_WBCLIENT       	= 2
+	,AUTH_WBCLIENT       	= 3
 #endif
 } MSCHAP_AUTH_METHOD;
 
@@ -62,6 +66,9 @@ typedef struct {
 
 	char const		*ntlm_auth;
 	fr_time_delta_t		ntlm_auth_timeout;
+	fr_exec_pool_conf_t	ntlm_auth_helper;	//!< Persistent ntlm_auth helpers.
+	char const		*ntlm_auth_helper_username;
+	char const		*ntlm_auth_helper_domain;
 	char const		*ntlm_cpw;
 	char const		*ntlm_cpw_username;
 	char const		*ntlm_cpw_domain;
@@ -75,8 +82,17 @@ typedef struct {
 #ifdef WITH_AUTH_WINBIND
 	fr_pool_t		*wb_pool;
 	bool			wb_retry_with_normalised_username;
+	fr_offload_conf_t	wb_async;		//!< Winbind executor configuration.
+	fr_offload_t		*wb_offload;		//!< Winbind executors.  NULL if calls are synchronous.
 #endif
 #ifdef __APPLE__
 	bool			open_directory;
 #endif
 } rlm_mschap_t;
+
+typedef struct {
+	fr_exec_pool_t		*helper_pool;		//!< This thread's ntlm_auth helpers.
+#ifdef WITH_AUTH_WINBIND
+	fr_offload_thread_t	*wb_offload;		//!< This thread's handle for the winbind executors.
+#endif
+} rlm_mschap_thread_t;
@@ -29,21 +29,30 @@ USES_APPLE_DEPRECATED_API
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/crypt.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/offload.h>
 #include <freeradius-devel/server/password.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/tls/base.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/unlang/module.h>
 #include <freeradius-devel/util/base64.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/md5.h>
+#include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/util/sha1.h>
 
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.password.h>
 
 #include <ctype.h>
+#include <pthread.h>
 
 #ifdef HAVE_OPENSSL_EVP_H
 #  include <openssl/evp.h>
 #endif
 
+typedef struct pap_cache_s pap_cache_t;
+
 /*
  *      Define a structure for our module configuration.
  *
@@ -55,12 +64,32 @@ typedef struct {
 	char const		*name;
 	fr_dict_enum_t		*auth_type;
 	bool			normify;
+
+	fr_offload_conf_t	async;		//!< Hashing thread configuration.
+	fr_offload_t		*offload;	//!< Threads running slow hashes.  NULL if hashing is synchronous.
+
+	uint32_t		cache_max_entries;	//!< Maximum verified credentials to remember.
+						///< 0 disables the cache.
+	fr_time_delta_t		cache_lifetime;	//!< How long a verified credential is remembered for.
+	pap_cache_t		*cache;		//!< Verified credentials.  NULL if disabled.
 } rlm_pap_t;
 
+typedef struct {
+	fr_offload_thread_t	*offload;	//!< This thread's handle for the hashing threads.
+} rlm_pap_thread_t;
+
 typedef rlm_rcode_t (*pap_auth_func_t)(rlm_pap_t const *, REQUEST *, VALUE_PAIR const *, VALUE_PAIR const *);
 
+static const CONF_PARSER cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_pap_t, cache_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_TIME_DELTA, rlm_pap_t, cache_lifetime), .dflt = "300" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", FR_TYPE_BOOL, rlm_pap_t, normify), .dflt = "yes" },
+	{ FR_CONF_OFFSET("async", FR_TYPE_SUBSECTION, rlm_pap_t, async), .subcs = (void const *) fr_offload_config },
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -76,12 +105,14 @@ static fr_dict_autoload_t rlm_pap_dict[] = {
 static fr_dict_attr_t const *attr_auth_type;
 static fr_dict_attr_t const *attr_password_root;
 
+static fr_dict_attr_t const *attr_user_name;
 static fr_dict_attr_t const *attr_user_password;
 
 static fr_dict_attr_autoload_t rlm_pap_dict_attr[] = {
 	{ .out = &attr_auth_type, .name = "Auth-Type", .type = FR_TYPE_UINT32, .dict = &dict_freeradius },
 	{ .out = &attr_password_root, .name = "Password-Root", .type = FR_TYPE_TLV, .dict = &dict_freeradius },
 
+	{ .out = &attr_user_name, .name = "User-Name", .type = FR_TYPE_STRING, .dict = &dict_radius },
 	{ .out = &attr_user_password, .name = "User-Password", .type = FR_TYPE_STRING, .dict = &dict_radius },
 
 	{ NULL }
@@ -372,22 +403,37 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_384, "SSHA3-384", EVP_sha
 PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha3_512())
 #  endif
 
+/** Parsed PBKDF2-Password
+ *
+ */
+typedef struct {
+	EVP_MD const		*evp_md;		//!< HMAC digest.
+	int			digest_type;		//!< FR_SSHA*_PASSWORD, used for logging.
+	size_t			digest_len;		//!< Length of hash and digest.
+
+	uint32_t		iterations;		//!< Rounds of HMAC.
+
+	uint8_t			*salt;
+	size_t			salt_len;
+	uint8_t			hash[EVP_MAX_MD_SIZE];	//!< "known good" hash.
+	uint8_t			digest[EVP_MAX_MD_SIZE];	//!< Calculated from the user's password.
+} pap_pbkdf2_t;
+
 /** Validates Crypt::PBKDF2 LDAP format strings
  *
+ * @param[out] out	Where to write the parsed components.
  * @param[in] request	The current request.
  * @param[in] str	Raw PBKDF2 string.
  * @param[in] len	Length of string.
  * @return
- *	- RLM_MODULE_REJECT
- *	- RLM_MODULE_OK
+ *	- 0 on success.
+ *	- -1 if the string is invalid.
  */
-static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2_parse(REQUEST *request, const uint8_t *str, size_t len,
-								 fr_table_num_sorted_t const hash_names[], size_t hash_names_len,
-								 char scheme_sep, char iter_sep, char salt_sep,
-								 bool iter_is_base64, VALUE_PAIR const *password)
+static inline int CC_HINT(nonnull) pap_pbkdf2_parse(pap_pbkdf2_t *out, REQUEST *request, const uint8_t *str, size_t len,
+						    fr_table_num_sorted_t const hash_names[], size_t hash_names_len,
+						    char scheme_sep, char iter_sep, char salt_sep,
+						    bool iter_is_base64)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_INVALID;
-
 	uint8_t const		*p, *q, *end;
 	ssize_t			slen;
 
@@ -397,16 +443,11 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2_parse(REQUEST *reques
 
 	uint32_t		iterations;
 
-	uint8_t			*salt = NULL;
-	size_t			salt_len;
-	uint8_t			hash[EVP_MAX_MD_SIZE];
-	uint8_t			digest[EVP_MAX_MD_SIZE];
-
 	RDEBUG2("Comparing with \"known-good\" PBKDF2-Password");
 
 	if (len <= 1) {
 		REDEBUG("PBKDF2-Password is too short");
-		goto finish;
+		return -1;
 	}
 
 	/*
@@ -418,7 +459,7 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2_parse(REQUEST *reques
 	q = memchr(p, scheme_sep, end - p);
 	if (!q) {
 		REDEBUG("PBKDF2-Password has no component separators");
-		goto finish;
+		return -1;
 	}
 
 	digest_type = fr_table_value_by_substr(hash_names, (char const *)p, q - p, -1);
@@ -472,19 +513,19 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2_parse(REQUEST *reques
 
 	default:
 		REDEBUG("Unknown PBKDF2 hash method \"%.*s\"", (int)(q - p), p);
-		goto finish;
+		return -1;
 	}
 
 	p = q + 1;
 
 	if (((end - p) < 1) || !(q = memchr(p, iter_sep, end - p))) {
 		REDEBUG("PBKDF2-Password missing iterations component");
-		goto finish;
+		return -1;
 	}
 
 	if ((q - p) == 0) {
 		REDEBUG("PBKDF2-Password iterations component too short");
-		goto finish;
+		return -1;
 	}
 
 	/*
@@ -501,7 +542,7 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2_parse(REQUEST *reques
 			REMARKER(iterations_buff, qq - iterations_buff,
 				 "PBKDF2-Password iterations field contains an invalid character");
 
-			goto finish;
+			return -1;
 		}
 		p = q + 1;
 	/*
@@ -512,7 +553,7 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2_parse(REQUEST *reques
 		slen = fr_base64_decode((uint8_t *)&iterations, sizeof(iterations), (char const *)p, q - p);
 		if (slen < 0) {
 			RPEDEBUG("Failed decoding PBKDF2-Password iterations component (%.*s)", (int)(q - p), p);
-			goto finish;
+			return -1;
 		}
 		if (slen != sizeof(iterations)) {
 			REDEBUG("Decoded PBKDF2-Password iterations component is wrong size");
@@ -525,87 +566,116 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2_parse(REQUEST *reques
 
 	if (((end - p) < 1) || !(q = memchr(p, salt_sep, end - p))) {
 		REDEBUG("PBKDF2-Password missing salt component");
-		goto finish;
+		return -1;
 	}
 
 	if ((q - p) == 0) {
 		REDEBUG("PBKDF2-Password salt component too short");
-		goto finish;
+		return -1;
 	}
 
-	MEM(salt = talloc_array(request, uint8_t, FR_BASE64_DEC_LENGTH(q - p)));
-	slen = fr_base64_decode(salt, talloc_array_length(salt), (char const *) p, q - p);
+	MEM(out->salt = talloc_array(out, uint8_t, FR_BASE64_DEC_LENGTH(q - p)));
+	slen = fr_base64_decode(out->salt, talloc_array_length(out->salt), (char const *) p, q - p);
 	if (slen < 0) {
 		RPEDEBUG("Failed decoding PBKDF2-Password salt component");
-		goto finish;
+		return -1;
 	}
-	salt_len = (size_t)slen;
+	out->salt_len = (size_t)slen;
 
 	p = q + 1;
 
 	if ((q - p) == 0) {
 		REDEBUG("PBKDF2-Password hash component too short");
-		goto finish;
+		return -1;
 	}
 
-	slen = fr_base64_decode(hash, sizeof(hash), (char const *)p, end - p);
+	slen = fr_base64_decode(out->hash, sizeof(out->hash), (char const *)p, end - p);
 	if (slen < 0) {
 		RPEDEBUG("Failed decoding PBKDF2-Password hash component");
-		goto finish;
+		return -1;
 	}
 
 	if ((size_t)slen != digest_len) {
 		REDEBUG("PBKDF2-Password hash component length is incorrect for hash type, expected %zu, got %zd",
 			digest_len, slen);
 
-		RHEXDUMP2(hash, slen, "hash component");
+		RHEXDUMP2(out->hash, slen, "hash component");
 
-		goto finish;
+		return -1;
 	}
 
 	RDEBUG2("PBKDF2 %s: Iterations %u, salt length %zu, hash length %zd",
 		fr_table_str_by_value(pbkdf2_crypt_names, digest_type, "<UNKNOWN>"),
-		iterations, salt_len, slen);
+		iterations, out->salt_len, slen);
 
-	/*
-	 *	Hash and compare
-	 */
-	if (PKCS5_PBKDF2_HMAC((char const *)password->vp_octets, (int)password->vp_length,
-			      (unsigned char const *)salt, (int)salt_len,
-			      (int)iterations,
-			      evp_md,
-			      (int)digest_len, (unsigned char *)digest) == 0) {
-		REDEBUG("PBKDF2 digest failure");
-		goto finish;
-	}
+	out->evp_md = evp_md;
+	out->digest_type = digest_type;
+	out->digest_len = digest_len;
+	out->iterations = iterations;
 
-	if (fr_digest_cmp(digest, hash, (size_t)digest_len) != 0) {
+	return 0;
+}
+
+/** Calculate the PBKDF2 digest of the user's password
+ *
+ * Doesn't access the request, so may be called from an offload thread.
+ *
+ * @param[in] pbkdf2	Parsed PBKDF2-Password.  The digest is written here.
+ * @param[in] password	The user's password.
+ * @param[in] len	Length of the password.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int pap_pbkdf2_hash(pap_pbkdf2_t *pbkdf2, uint8_t const *password, size_t len)
+{
+	if (PKCS5_PBKDF2_HMAC((char const *)password, (int)len,
+			      (unsigned char const *)pbkdf2->salt, (int)pbkdf2->salt_len,
+			      (int)pbkdf2->iterations,
+			      pbkdf2->evp_md,
+			      (int)pbkdf2->digest_len, (unsigned char *)pbkdf2->digest) == 0) return -1;
+
+	return 0;
+}
+
+/** Compare the calculated digest with the "known good" hash
+ *
+ */
+static rlm_rcode_t pap_pbkdf2_cmp(REQUEST *request, pap_pbkdf2_t const *pbkdf2)
+{
+	if (fr_digest_cmp(pbkdf2->digest, pbkdf2->hash, pbkdf2->digest_len) != 0) {
 		REDEBUG("PBKDF2 digest does not match \"known good\" digest");
-		REDEBUG3("Salt       : %pH", fr_box_octets(salt, salt_len));
-		REDEBUG3("Calculated : %pH", fr_box_octets(digest, digest_len));
-		REDEBUG3("Expected   : %pH", fr_box_octets(hash, slen));
-		rcode = RLM_MODULE_REJECT;
-	} else {
-		rcode = RLM_MODULE_OK;
+		REDEBUG3("Salt       : %pH", fr_box_octets(pbkdf2->salt, pbkdf2->salt_len));
+		REDEBUG3("Calculated : %pH", fr_box_octets(pbkdf2->digest, pbkdf2->digest_len));
+		REDEBUG3("Expected   : %pH", fr_box_octets(pbkdf2->hash, pbkdf2->digest_len));
+		return RLM_MODULE_REJECT;
 	}
 
-finish:
-	talloc_free(salt);
-
-	return rcode;
+	return RLM_MODULE_OK;
 }
 
-static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2(UNUSED rlm_pap_t const *inst,
-							   REQUEST *request,
-							   VALUE_PAIR const *known_good, VALUE_PAIR const *password)
+/** Determine the format of a PBKDF2-Password, and parse it
+ *
+ * @param[in] ctx		to allocate the result in.
+ * @param[in] request		The current request.
+ * @param[in] known_good	PBKDF2-Password.
+ * @return
+ *	- The parsed PBKDF2-Password.
+ *	- NULL if it's invalid.
+ */
+static pap_pbkdf2_t *pap_pbkdf2_alloc(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR const *known_good)
 {
-	uint8_t const *p = known_good->vp_octets, *q, *end = p + known_good->vp_length;
+	uint8_t const	*p = known_good->vp_octets, *q, *end = p + known_good->vp_length;
+	pap_pbkdf2_t	*pbkdf2;
+	int		ret;
 
 	if (end - p < 2) {
 		REDEBUG("PBKDF2-Password too short");
-		return RLM_MODULE_INVALID;
+		return NULL;
 	}
 
+	MEM(pbkdf2 = talloc_zero(ctx, pap_pbkdf2_t));
+
 	/*
 	 *	If it doesn't begin with a $ assume
 	 *	It's Crypt::PBKDF2 LDAP format
@@ -620,9 +690,10 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2(UNUSED rlm_pap_t cons
 			q = memchr(p, '}', end - p);
 			p = q + 1;
 		}
-		return pap_auth_pbkdf2_parse(request, p, end - p,
-					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
-					     ':', ':', ':', true, password);
+		ret = pap_pbkdf2_parse(pbkdf2, request, p, end - p,
+				       pbkdf2_crypt_names, pbkdf2_crypt_names_len,
+				       ':', ':', ':', true);
+		goto done;
 	}
 
 	/*
@@ -632,9 +703,10 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2(UNUSED rlm_pap_t cons
 	 */
 	if ((size_t)(end - p) >= sizeof("$PBKDF2$") && (memcmp(p, "$PBKDF2$", sizeof("$PBKDF2$") - 1) == 0)) {
 		p += sizeof("$PBKDF2$") - 1;
-		return pap_auth_pbkdf2_parse(request, p, end - p,
-					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
-					     ':', ':', '$', false, password);
+		ret = pap_pbkdf2_parse(pbkdf2, request, p, end - p,
+				       pbkdf2_crypt_names, pbkdf2_crypt_names_len,
+				       ':', ':', '$', false);
+		goto done;
 	}
 
 	/*
@@ -646,14 +718,44 @@ static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2(UNUSED rlm_pap_t cons
 	 */
 	if ((size_t)(end - p) >= sizeof("$pbkdf2-") && (memcmp(p, "$pbkdf2-", sizeof("$pbkdf2-") - 1) == 0)) {
 		p += sizeof("$pbkdf2-") - 1;
-		return pap_auth_pbkdf2_parse(request, p, end - p,
-					     pbkdf2_passlib_names, pbkdf2_passlib_names_len,
-					     '$', '$', '$', false, password);
+		ret = pap_pbkdf2_parse(pbkdf2, request, p, end - p,
+				       pbkdf2_passlib_names, pbkdf2_passlib_names_len,
+				       '$', '$', '$', false);
+		goto done;
 	}
 
 	REDEBUG("Can't determine format of PBKDF2-Password");
+	ret = -1;
+
+done:
+	if (ret < 0) {
+		talloc_free(pbkdf2);
+		return NULL;
+	}
 
-	return RLM_MODULE_INVALID;
+	return pbkdf2;
+}
+
+static inline rlm_rcode_t CC_HINT(nonnull) pap_auth_pbkdf2(UNUSED rlm_pap_t const *inst,
+							   REQUEST *request,
+							   VALUE_PAIR const *known_good, VALUE_PAIR const *password)
+{
+	pap_pbkdf2_t	*pbkdf2;
+	rlm_rcode_t	rcode;
+
+	pbkdf2 = pap_pbkdf2_alloc(request, request, known_good);
+	if (!pbkdf2) return RLM_MODULE_INVALID;
+
+	if (pap_pbkdf2_hash(pbkdf2, password->vp_octets, password->vp_length) < 0) {
+		REDEBUG("PBKDF2 digest failure");
+		talloc_free(pbkdf2);
+		return RLM_MODULE_INVALID;
+	}
+
+	rcode = pap_pbkdf2_cmp(request, pbkdf2);
+	talloc_free(pbkdf2);
+
+	return rcode;
 }
 #endif
 
@@ -832,17 +934,410 @@ static const pap_auth_func_t auth_func_table[] = {
 #endif	/* HAVE_OPENSSL_EVP_H */
 };
 
+/** A slow hash being calculated by a hashing thread
+ *
+ */
+typedef struct {
+	unsigned int		type;		//!< FR_CRYPT_PASSWORD or FR_PBKDF2_PASSWORD.
+	char			*password;	//!< The user's password.
+	size_t			password_len;
+	char			*known_good;	//!< Crypt-Password.
+#ifdef HAVE_OPENSSL_EVP_H
+	pap_pbkdf2_t		*pbkdf2;	//!< Parsed PBKDF2-Password.
+#endif
+	bool			cache;		//!< Whether to cache the credential if it's verified.
+	uint8_t			cache_key[SHA1_DIGEST_LENGTH];
+} pap_offload_ctx_t;
+
+static int _pap_offload_ctx_free(pap_offload_ctx_t *octx)
+{
+	memset(octx->password, 0, octx->password_len);
+
+	return 0;
+}
+
+/** Whether a "known good" password uses a hash slow enough to be worth offloading or caching
+ *
+ */
+static bool pap_hash_is_slow(VALUE_PAIR const *known_good)
+{
+	switch (known_good->da->attr) {
+#ifdef HAVE_CRYPT
+	case FR_CRYPT_PASSWORD:
+#endif
+#ifdef HAVE_OPENSSL_EVP_H
+	case FR_PBKDF2_PASSWORD:
+#endif
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/** A credential which recently passed a slow hash check
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;				//!< Entry in the LRU list.
+	uint8_t			key[SHA1_DIGEST_LENGTH];	//!< HMAC of the user, "known good" and password.
+	fr_time_t		expires;			//!< When the entry can no longer be used.
+} pap_cache_entry_t;
+
+/** Verified credentials, shared by all workers
+ *
+ * Entries are keyed by an HMAC over the user, the "known good" hash and
+ * the presented password, with a secret generated at startup.  Neither
+ * the password nor anything that could be used to brute force it offline
+ * is held in memory.  If the stored hash changes, the key changes, and the
+ * old entry is never matched again.
+ */
+struct pap_cache_s {
+	uint32_t		max_entries;			//!< Maximum entries, the LRU entry is evicted.
+	fr_time_delta_t		lifetime;			//!< How long entries live for.
+	uint8_t			secret[32];			//!< HMAC key.
+
+	pthread_mutex_t		mutex;				//!< Protects everything below.
+	fr_hash_table_t		*ht;				//!< Entries by key.  Entries are allocated in its ctx.
+	fr_dlist_head_t		lru;				//!< Most recently used at the head.
+};
+
+static uint32_t pap_cache_entry_hash(void const *data)
+{
+	pap_cache_entry_t const *entry = data;
+
+	return fr_hash(entry->key, sizeof(entry->key));
+}
+
+static int pap_cache_entry_cmp(void const *one, void const *two)
+{
+	pap_cache_entry_t const *a = one, *b = two;
+
+	return memcmp(a->key, b->key, sizeof(a->key));
+}
+
+static int _pap_cache_free(pap_cache_t *cache)
+{
+	TALLOC_FREE(cache->ht);
+	memset(cache->secret, 0, sizeof(cache->secret));
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+static pap_cache_t *pap_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, fr_time_delta_t lifetime)
+{
+	pap_cache_t	*cache;
+
+	MEM(cache = talloc_zero(ctx, pap_cache_t));
+	cache->max_entries = max_entries;
+	cache->lifetime = lifetime;
+	fr_rand_buffer(cache->secret, sizeof(cache->secret));
+
+	cache->ht = fr_hash_table_create(cache, pap_cache_entry_hash, pap_cache_entry_cmp, NULL);
+	if (!cache->ht) {
+		talloc_free(cache);
+		return NULL;
+	}
+	fr_dlist_init(&cache->lru, pap_cache_entry_t, entry);
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _pap_cache_free);
+
+	return cache;
+}
+
+/** Calculate the cache key for a credential
+ *
+ * Each field is length prefixed, so different splits of the same
+ * bytes produce different keys.
+ */
+static void pap_cache_key(uint8_t key[static SHA1_DIGEST_LENGTH], pap_cache_t const *cache, REQUEST *request,
+			  VALUE_PAIR const *known_good, VALUE_PAIR const *password)
+{
+	VALUE_PAIR	*user;
+	uint8_t		*buff, *p;
+	size_t		user_len, len;
+	char const	*type = known_good->da->name;
+	size_t		type_len = strlen(type);
+
+	user = fr_pair_find_by_da(request->packet->vps, attr_user_name, TAG_ANY);
+	user_len = user ? user->vp_length : 0;
+
+	len = (4 * 4) + user_len + type_len + known_good->vp_length + password->vp_length;
+	MEM(p = buff = talloc_array(NULL, uint8_t, len));
+
+#define FIELD(_ptr, _len) \
+do { \
+	uint32_t _nlen = htonl((uint32_t)(_len)); \
+	memcpy(p, &_nlen, sizeof(_nlen)); \
+	p += sizeof(_nlen); \
+	memcpy(p, _ptr, _len); \
+	p += _len; \
+} while (0)
+
+	FIELD(user ? user->vp_strvalue : "", user_len);
+	FIELD(type, type_len);
+	FIELD(known_good->vp_ptr, known_good->vp_length);
+	FIELD(password->vp_strvalue, password->vp_length);
+#undef FIELD
+
+	fr_hmac_sha1(key, buff, len, cache->secret, sizeof(cache->secret));
+
+	memset(buff, 0, len);
+	talloc_free(buff);
+}
+
+/** Check whether a credential has been verified recently
+ *
+ */
+static bool pap_cache_find(pap_cache_t *cache, uint8_t const key[static SHA1_DIGEST_LENGTH])
+{
+	pap_cache_entry_t	find, *entry;
+	bool			found = false;
+
+	memcpy(find.key, key, sizeof(find.key));
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = fr_hash_table_finddata(cache->ht, &find);
+	if (entry) {
+		fr_dlist_remove(&cache->lru, entry);
+		if (entry->expires > fr_time()) {
+			fr_dlist_insert_head(&cache->lru, entry);
+			found = true;
+		} else {
+			fr_hash_table_delete(cache->ht, entry);
+			talloc_free(entry);
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return found;
+}
+
+/** Record a credential which has just been verified
+ *
+ */
+static void pap_cache_insert(pap_cache_t *cache, uint8_t const key[static SHA1_DIGEST_LENGTH])
+{
+	pap_cache_entry_t	find, *entry;
+
+	memcpy(find.key, key, sizeof(find.key));
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = fr_hash_table_finddata(cache->ht, &find);
+	if (entry) {
+		fr_dlist_remove(&cache->lru, entry);
+	} else {
+		if ((uint32_t)fr_hash_table_num_elements(cache->ht) >= cache->max_entries) {
+			pap_cache_entry_t *evict = fr_dlist_tail(&cache->lru);
+
+			fr_dlist_remove(&cache->lru, evict);
+			fr_hash_table_delete(cache->ht, evict);
+			talloc_free(evict);
+		}
+
+		MEM(entry = talloc_zero(cache->ht, pap_cache_entry_t));
+		memcpy(entry->key, key, sizeof(entry->key));
+		if (!fr_hash_table_insert(cache->ht, entry)) {
+			talloc_free(entry);
+			pthread_mutex_unlock(&cache->mutex);
+			return;
+		}
+	}
+	entry->expires = fr_time() + cache->lifetime;
+	fr_dlist_insert_head(&cache->lru, entry);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Calculate the hash on a hashing thread
+ *
+ */
+static int _pap_offload_run(UNUSED void *resource, void *data)
+{
+	pap_offload_ctx_t	*octx = talloc_get_type_abort(data, pap_offload_ctx_t);
+
+	switch (octx->type) {
+#ifdef HAVE_CRYPT
+	case FR_CRYPT_PASSWORD:
+		return fr_crypt_check(octx->password, octx->known_good);
+#endif
+
+#ifdef HAVE_OPENSSL_EVP_H
+	case FR_PBKDF2_PASSWORD:
+		return pap_pbkdf2_hash(octx->pbkdf2, (uint8_t const *)octx->password, octx->password_len);
+#endif
+
+	default:
+		return -1;
+	}
+}
+
+static void *mod_offload_resource_alloc(void *uctx)
+{
+	return uctx;	/* Hashing doesn't need any per-thread resources */
+}
+
+static void mod_offload_complete(REQUEST *request, UNUSED fr_offload_req_t *oreq, UNUSED void *uctx)
+{
+	unlang_interpret_resumable(request);
+}
+
+static rlm_rcode_t pap_auth_result(REQUEST *request, rlm_rcode_t rcode)
+{
+	switch (rcode) {
+	case RLM_MODULE_REJECT:
+		REDEBUG("Password incorrect");
+		break;
+
+	case RLM_MODULE_OK:
+		RDEBUG2("User authenticated successfully");
+		break;
+
+	default:
+		break;
+	}
+
+	return rcode;
+}
+
+/** Process the result of a hash calculated by a hashing thread
+ *
+ */
+static rlm_rcode_t mod_authenticate_resume(void *instance, UNUSED void *thread, REQUEST *request, void *rctx)
+{
+	rlm_pap_t const		*inst = instance;
+	fr_offload_req_t	*oreq = talloc_get_type_abort(rctx, fr_offload_req_t);
+	pap_offload_ctx_t	*octx;
+	rlm_rcode_t		rcode = RLM_MODULE_FAIL;
+	void			*data;
+	int			ret;
+
+	switch (fr_offload_req_result(&ret, &data, oreq)) {
+	case FR_OFFLOAD_REQ_DONE:
+		octx = talloc_get_type_abort(data, pap_offload_ctx_t);
+
+		switch (octx->type) {
+#ifdef HAVE_CRYPT
+		case FR_CRYPT_PASSWORD:
+			if (ret != 0) {
+				REDEBUG("Crypt digest does not match \"known good\" digest");
+				rcode = RLM_MODULE_REJECT;
+				break;
+			}
+			rcode = RLM_MODULE_OK;
+			break;
+#endif
+
+#ifdef HAVE_OPENSSL_EVP_H
+		case FR_PBKDF2_PASSWORD:
+			if (ret < 0) {
+				REDEBUG("PBKDF2 digest failure");
+				rcode = RLM_MODULE_INVALID;
+				break;
+			}
+			rcode = pap_pbkdf2_cmp(request, octx->pbkdf2);
+			break;
+#endif
+
+		default:
+			fr_assert(0);
+			break;
+		}
+
+		if ((rcode == RLM_MODULE_OK) && octx->cache) pap_cache_insert(inst->cache, octx->cache_key);
+		break;
+
+	case FR_OFFLOAD_REQ_TIMEOUT:
+		REDEBUG("Timeout waiting for password hash");
+		break;
+
+	default:
+		REDEBUG("Password hashing failed");
+		break;
+	}
+
+	talloc_free(oreq);
+
+	return pap_auth_result(request, rcode);
+}
+
+static void mod_authenticate_signal(UNUSED void *instance, UNUSED void *thread, UNUSED REQUEST *request,
+				    void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(rctx);
+}
+
+/** Queue a slow hash for the hashing threads, and yield
+ *
+ */
+static rlm_rcode_t pap_auth_offload(rlm_pap_thread_t *t, REQUEST *request,
+				    VALUE_PAIR const *known_good, VALUE_PAIR const *password,
+				    uint8_t const *cache_key)
+{
+	pap_offload_ctx_t	*octx;
+	fr_offload_req_t	*oreq;
+
+	MEM(octx = talloc_zero(NULL, pap_offload_ctx_t));
+	octx->type = known_good->da->attr;
+	MEM(octx->password = talloc_memdup(octx, password->vp_strvalue, password->vp_length + 1));
+	octx->password_len = password->vp_length;
+	talloc_set_destructor(octx, _pap_offload_ctx_free);
+	if (cache_key) {
+		octx->cache = true;
+		memcpy(octx->cache_key, cache_key, sizeof(octx->cache_key));
+	}
+
+	switch (octx->type) {
+#ifdef HAVE_CRYPT
+	case FR_CRYPT_PASSWORD:
+		MEM(octx->known_good = talloc_bstrndup(octx, known_good->vp_strvalue, known_good->vp_length));
+		break;
+#endif
+
+#ifdef HAVE_OPENSSL_EVP_H
+	case FR_PBKDF2_PASSWORD:
+		octx->pbkdf2 = pap_pbkdf2_alloc(octx, request, known_good);
+		if (!octx->pbkdf2) {
+			talloc_free(octx);
+			return RLM_MODULE_INVALID;
+		}
+		break;
+#endif
+
+	default:
+		fr_assert(0);
+		talloc_free(octx);
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	Concurrency can be limited per hash type, so a
+	 *	flood of expensive hashes can't starve the others.
+	 */
+	oreq = fr_offload_enqueue(t->offload, request, known_good->da->name,
+				  _pap_offload_run, octx, mod_offload_complete, NULL);
+	if (!oreq) return RLM_MODULE_FAIL;
+
+	return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, oreq);
+}
+
 /*
  *	Authenticate the user via one of any well-known password.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, void *thread, REQUEST *request)
 {
 	rlm_pap_t const 	*inst = instance;
+	rlm_pap_thread_t	*t = talloc_get_type_abort(thread, rlm_pap_thread_t);
 	VALUE_PAIR		*known_good;
 	VALUE_PAIR		*password;
 	rlm_rcode_t		rcode = RLM_MODULE_INVALID;
 	pap_auth_func_t		auth_func;
 	bool			ephemeral;
+	bool			cache = false;
+	uint8_t			cache_key[SHA1_DIGEST_LENGTH];
 
 	password = fr_pair_find_by_da(request->packet->vps, attr_user_password, TAG_ANY);
 	if (!password) {
@@ -889,25 +1384,88 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 		RDEBUG2("Comparing with \"known-good\" %s (%zu)", known_good->da->name, known_good->vp_length);
 	}
 
+	/*
+	 *	Skip slow hashes if the same user presented the
+	 *	same password, against the same "known good"
+	 *	hash, recently.
+	 */
+	if (inst->cache && pap_hash_is_slow(known_good)) {
+		pap_cache_key(cache_key, inst->cache, request, known_good, password);
+		if (pap_cache_find(inst->cache, cache_key)) {
+			RDEBUG2("Credentials were verified recently, skipping %s check", known_good->da->name);
+			if (ephemeral) talloc_list_free(&known_good);
+
+			return pap_auth_result(request, RLM_MODULE_OK);
+		}
+		cache = true;
+	}
+
+	/*
+	 *	Slow hashes are calculated by the hashing
+	 *	threads, so they don't hold up other requests.
+	 */
+	if (t->offload && pap_hash_is_slow(known_good)) {
+		rcode = pap_auth_offload(t, request, known_good, password, cache ? cache_key : NULL);
+		if (ephemeral) talloc_list_free(&known_good);
+		if (rcode == RLM_MODULE_YIELD) return rcode;
+
+		return pap_auth_result(request, rcode);
+	}
+
 	/*
 	 *	Authenticate, and return.
 	 */
 	rcode = auth_func(inst, request, known_good, password);
 	if (ephemeral) talloc_list_free(&known_good);
-	switch (rcode) {
-	case RLM_MODULE_REJECT:
-		REDEBUG("Password incorrect");
-		break;
+	if ((rcode == RLM_MODULE_OK) && cache) pap_cache_insert(inst->cache, cache_key);
 
-	case RLM_MODULE_OK:
-		RDEBUG2("User authenticated successfully");
-		break;
+	return pap_auth_result(request, rcode);
+}
 
-	default:
-		break;
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_pap_t		*inst = instance;
+	CONF_SECTION		*async_cs;
+
+	if (inst->cache_max_entries) {
+		FR_TIME_DELTA_BOUND_CHECK("cache.lifetime", inst->cache_lifetime, >=, fr_time_delta_from_sec(1));
+		FR_TIME_DELTA_BOUND_CHECK("cache.lifetime", inst->cache_lifetime, <=, fr_time_delta_from_sec(86400));
+
+		inst->cache = pap_cache_alloc(inst, inst->cache_max_entries, inst->cache_lifetime);
+		if (!inst->cache) {
+			cf_log_err(conf, "Failed allocating credential cache");
+			return -1;
+		}
 	}
 
-	return rcode;
+	if (!inst->async.num_threads) return 0;
+
+	async_cs = cf_section_find(conf, "async", NULL);
+	if (fr_offload_conf_check(async_cs ? async_cs : conf, &inst->async) < 0) return -1;
+
+	inst->offload = fr_offload_alloc(inst, &inst->async, inst->name, mod_offload_resource_alloc, NULL, inst);
+	if (!inst->offload) {
+		cf_log_perr(conf, "Unable to initialise hashing threads");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_pap_t		*inst = instance;
+	rlm_pap_thread_t	*t = talloc_get_type_abort(thread, rlm_pap_thread_t);
+
+	if (!inst->offload) return 0;
+
+	t->offload = fr_offload_thread_alloc(t, inst->offload, el);
+	if (!t->offload) {
+		cf_log_perr(conf, "Failed connecting to hashing threads");
+		return -1;
+	}
+
+	return 0;
 }
 
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
@@ -1002,10 +1560,13 @@ module_t rlm_pap = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "pap",
 	.inst_size	= sizeof(rlm_pap_t),
+	.thread_inst_size	= sizeof(rlm_pap_thread_t),
 	.onload		= mod_load,
 	.unload		= mod_unload,
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
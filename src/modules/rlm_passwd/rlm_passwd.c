@@ -27,7 +27,13 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 struct mypasswd {
 	struct mypasswd *next;
@@ -35,18 +41,34 @@ struct mypasswd {
 	char *field[1];
 };
 
-struct hashtable {
-	int tablesize;
-	int key_field;
-	int num_fields;
-	int islist;
-	int ignorenis;
-	char * filename;
-	struct mypasswd **table;
-	char buffer[1024];
-	FILE *fp;
-	char delimiter;
-};
+/** One key in the index
+ *
+ */
+typedef struct {
+	uint64_t	offset;			//!< Of the key in the file, + 1.  0 marks an empty slot.
+	uint32_t	len;			//!< Of the key.
+	uint32_t	hash;			//!< Of the key.
+} passwd_slot_t;
+
+/** A passwd file mapped into memory, with an index of the key field
+ *
+ * Only the index is built when the file is read.  The fields of a
+ * line are split when a lookup finds it, so the whole thing is the
+ * size of the file, plus 16 bytes for every two keys.
+ */
+typedef struct {
+	char const	*map;			//!< The file.
+	size_t		map_len;
+	passwd_slot_t	*slots;			//!< Open addressed, and a power of 2 in size.
+	size_t		num_slots;
+	int		num_fields;
+	char		delimiter;
+} passwd_index_t;
+
+/*
+ *	Lines longer than this are ignored.
+ */
+#define PASSWD_LINE_MAX	(1024)
 
 static fr_dict_t const *dict_freeradius;
 
@@ -118,208 +140,205 @@ static int string_to_entry(char const* string, int num_fields, char delimiter,
 }
 
 
-static void destroy_password (struct mypasswd * pass)
+static int _passwd_index_free(passwd_index_t *idx)
 {
-	struct mypasswd *p;
+	void *map;
 
-	while ((p = pass) != NULL) {
-		pass = pass->next;
-		talloc_free(p);
-	}
-}
+	if (!idx->map) return 0;
 
+	memcpy(&map, &idx->map, sizeof(map)); /* const issues */
+	munmap(map, idx->map_len);
 
-static unsigned int hash(char const * username, unsigned int tablesize)
-{
-	int h=1;
-	while (*username) {
-		h = h * 7907 + *username++;
-	}
-	return h%tablesize;
+	return 0;
 }
 
-static void release_hash_table(struct hashtable * ht){
-	int i;
+static void passwd_index_insert(passwd_index_t *idx, char const *key, size_t len)
+{
+	size_t		i, mask = idx->num_slots - 1;
+	uint32_t	h = fr_hash(key, len);
 
-	if (!ht) return;
-	for (i = 0; i < ht->tablesize; i++)
-		if (ht->table[i])
-			destroy_password(ht->table[i]);
-	if (ht->fp) {
-		fclose(ht->fp);
-		ht->fp = NULL;
-	}
-	ht->tablesize = 0;
-}
+	/*
+	 *	Duplicate keys go into the next free slot, so that
+	 *	lookups find them in the same probe sequence.
+	 */
+	for (i = h & mask; idx->slots[i].offset != 0; i = (i + 1) & mask);
 
-static void release_ht(struct hashtable * ht){
-	if (!ht) return;
-	release_hash_table(ht);
-	talloc_free(ht);
+	idx->slots[i].offset = (key - idx->map) + 1;
+	idx->slots[i].len = len;
+	idx->slots[i].hash = h;
 }
 
-static struct hashtable * build_hash_table (char const * file, int num_fields,
-					    int key_field, int islist, int tablesize, int ignorenis, char delimiter)
+/*
+ *	Walk over the keys in the file, inserting them into the
+ *	index if it exists.  Returns the number of keys.
+ */
+static size_t passwd_index_walk(passwd_index_t *idx, char const *file, int key_field, bool islist, bool ignorenis)
 {
-	struct hashtable* ht;
-	size_t len;
-	unsigned int h;
-	struct mypasswd *hashentry, *hashentry1;
-	char *list;
-	char *nextlist=0;
-	int i;
-	char buffer[1024];
+	char const	*p, *end = idx->map + idx->map_len;
+	size_t		keys = 0;
+	int		lineno = 0;
+
+	for (p = idx->map; p < end; ) {
+		char const	*line = p, *eol, *key, *key_end;
+		int		i;
+
+		lineno++;
+		eol = memchr(p, '\n', end - p);
+		if (eol) {
+			p = eol + 1;
+		} else {
+			eol = p = end;
+		}
+		if ((eol > line) && (eol[-1] == '\r')) eol--;
 
-	MEM(ht = talloc_zero(NULL, struct hashtable));
-	MEM(ht->filename = talloc_typed_strdup(ht, file));
+		if (eol == line) continue;
+		if (ignorenis && ((*line == '+') || (*line == '-'))) continue;
 
-	ht->tablesize = tablesize;
-	ht->num_fields = num_fields;
-	ht->key_field = key_field;
-	ht->islist = islist;
-	ht->ignorenis = ignorenis;
+		if ((eol - line) >= PASSWD_LINE_MAX) {
+			if (!idx->slots) WARN("%s[%d]: Line is too long, ignoring it", file, lineno);
+			continue;
+		}
 
-	if (delimiter) ht->delimiter = delimiter;
-	else ht->delimiter = ':';
-	if(!tablesize) return ht;
-	if(!(ht->fp = fopen(file,"r"))) {
-		talloc_free(ht);
-		return NULL;
-	}
+		/*
+		 *	Find the key field.
+		 */
+		key = line;
+		for (i = 0; i < key_field; i++) {
+			key = memchr(key, idx->delimiter, eol - key);
+			if (!key) break;
+			key++;
+		}
+		if (!key) continue;
 
-	/*
-	 *	@todo: This code is SHIT.  It's badly formatted.  It's
-	 *	hard to understand.  It re-implements tons of things
-	 *	which are already in the server core.
-	 */
-	memset(ht->buffer, 0, 1024);
-	MEM(ht->table = talloc_zero_array(ht, struct mypasswd *, tablesize));
-	while (fgets(buffer, 1024, ht->fp)) {
-		if(*buffer && *buffer!='\n' && (!ignorenis || (*buffer != '+' && *buffer != '-')) ){
-			hashentry = mypasswd_alloc(buffer, num_fields, &len);
-			if (!hashentry){
-				release_hash_table(ht);
-				return ht;
-			}
+		key_end = memchr(key, idx->delimiter, eol - key);
+		if (!key_end || (key_field == (idx->num_fields - 1))) key_end = eol;
 
-			len = string_to_entry(buffer, num_fields, ht->delimiter, hashentry, len);
-			if (!hashentry->field[key_field] || *hashentry->field[key_field] == '\0') {
-				talloc_free(hashentry);
-				continue;
-			}
+		/*
+		 *	A list of keys, separated by commas.
+		 */
+		while (key < key_end) {
+			char const *next = key_end;
 
 			if (islist) {
-				list = hashentry->field[key_field];
-				for (nextlist = list; *nextlist && *nextlist!=','; nextlist++);
-				if (*nextlist) *nextlist++ = 0;
-				else nextlist = 0;
+				next = memchr(key, ',', key_end - key);
+				if (!next) next = key_end;
 			}
-			h = hash(hashentry->field[key_field], tablesize);
-			hashentry->next = ht->table[h];
-			ht->table[h] = hashentry;
-			if (islist) {
-				for (list=nextlist; nextlist; list = nextlist){
-					for (nextlist = list; *nextlist && *nextlist!=','; nextlist++);
-					if (*nextlist) *nextlist++ = 0;
-					else nextlist = 0;
-					if(!(hashentry1 = mypasswd_alloc("", num_fields, &len))){
-						release_hash_table(ht);
-						return ht;
-					}
-					for (i=0; i<num_fields; i++) hashentry1->field[i] = hashentry->field[i];
-					hashentry1->field[key_field] = list;
-					h = hash(list, tablesize);
-					hashentry1->next = ht->table[h];
-					ht->table[h] = hashentry1;
-				}
+
+			if (next > key) {
+				if (idx->slots) passwd_index_insert(idx, key, next - key);
+				keys++;
 			}
+
+			key = next + 1;
 		}
 	}
-	fclose(ht->fp);
-	ht->fp = NULL;
-	return ht;
-#undef passwd
+
+	return keys;
 }
 
-static struct mypasswd * get_next(char *name, struct hashtable *ht,
-				  struct mypasswd **last_found)
+static passwd_index_t *passwd_index_alloc(char const *file, int num_fields, int key_field,
+					  bool islist, bool ignorenis, char delimiter)
 {
-	struct mypasswd * passwd;
-	struct mypasswd * hashentry;
-	char buffer[1024];
-	char *list, *nextlist;
-
-	if (ht->tablesize > 0) {
-		/* get saved address of next item to check from buffer */
-		hashentry = *last_found;
-		for (; hashentry; hashentry = hashentry->next) {
-			if (!strcmp(hashentry->field[ht->key_field], name)) {
-				/* save new address */
-				*last_found = hashentry->next;
-				return hashentry;
-			}
-		}
+	passwd_index_t	*idx;
+	int		fd;
+	struct stat	st;
+	size_t		keys;
+
+	MEM(idx = talloc_zero(NULL, passwd_index_t));
+	idx->num_fields = num_fields;
+	idx->delimiter = delimiter ? delimiter : ':';
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", file, fr_syserror(errno));
+	error:
+		talloc_free(idx);
 		return NULL;
 	}
-	/*	printf("try to find in file\n"); */
-	if (!ht->fp) return NULL;
 
-	passwd = (struct mypasswd *) ht->buffer;
+	if (fstat(fd, &st) < 0) {
+		fr_strerror_printf("Failed reading %s: %s", file, fr_syserror(errno));
+		close(fd);
+		goto error;
+	}
 
-	while (fgets(buffer, 1024,ht->fp)) {
-		if(*buffer && *buffer!='\n' && string_to_entry(buffer, ht->num_fields, ht->delimiter, passwd, sizeof(ht->buffer)-1) &&
-		   (!ht->ignorenis || (*buffer !='-' && *buffer != '+') ) ){
-			if(!ht->islist) {
-				if(!strcmp(passwd->field[ht->key_field], name))
-					return passwd;
-			}
-			else {
-				for (list = passwd->field[ht->key_field], nextlist = list; nextlist; list = nextlist) {
-					for(nextlist = list; *nextlist && *nextlist!=','; nextlist++);
-					if(!*nextlist) {
-						nextlist = 0;
-					} else {
-						*nextlist++ = 0;
-					}
-					if (!strcmp(list, name)) {
-						return passwd;
-					}
-				}
-			}
+	if (st.st_size > 0) {
+		void *map;
 
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			fr_strerror_printf("Failed mapping %s: %s", file, fr_syserror(errno));
+			close(fd);
+			goto error;
 		}
+		idx->map = map;
+		idx->map_len = st.st_size;
+		talloc_set_destructor(idx, _passwd_index_free);
 	}
-	fclose(ht->fp);
-	ht->fp = NULL;
-	return NULL;
+	close(fd);
+
+	/*
+	 *	Count the keys, and size the index so that it's
+	 *	never more than half full.
+	 */
+	keys = passwd_index_walk(idx, file, key_field, islist, ignorenis);
+
+	idx->num_slots = 2;
+	while (idx->num_slots < (keys * 2)) idx->num_slots <<= 1;
+	MEM(idx->slots = talloc_zero_array(idx, passwd_slot_t, idx->num_slots));
+
+	(void) passwd_index_walk(idx, file, key_field, islist, ignorenis);
+
+	return idx;
 }
 
-static struct mypasswd * get_pw_nam(char * name, struct hashtable* ht,
-				    struct mypasswd **last_found)
+/*
+ *	Find the next line with a matching key, starting at slot *cursor.
+ *
+ *	The fields of the line are split into "out".
+ */
+static struct mypasswd *get_next(char const *name, passwd_index_t const *idx, size_t *cursor,
+				 struct mypasswd *out, size_t outlen)
 {
-	int h;
-	struct mypasswd * hashentry;
-
-	if (!ht || !name || *name == '\0') return NULL;
-	*last_found = NULL;
-	if (ht->tablesize > 0) {
-		h = hash (name, ht->tablesize);
-		for (hashentry = ht->table[h]; hashentry; hashentry = hashentry->next) {
-			if (!strcmp(hashentry->field[ht->key_field], name)){
-				/* save address of next item to check into buffer */
-				*last_found=hashentry->next;
-				return hashentry;
-			}
-		}
+	size_t		len = strlen(name);
+	size_t		mask = idx->num_slots - 1;
+	uint32_t	h = fr_hash(name, len);
 
-		return NULL;
-	}
-	if (ht->fp) {
-		fclose(ht->fp);
-		ht->fp = NULL;
+	while (idx->slots[*cursor].offset != 0) {
+		passwd_slot_t const	*slot = &idx->slots[*cursor];
+		char const		*key, *line, *eol;
+		char			buffer[PASSWD_LINE_MAX + 1];
+
+		*cursor = (*cursor + 1) & mask;
+
+		if ((slot->hash != h) || (slot->len != len)) continue;
+
+		key = idx->map + slot->offset - 1;
+		if (memcmp(key, name, len) != 0) continue;
+
+		for (line = key; (line > idx->map) && (line[-1] != '\n'); line--);
+		eol = memchr(key, '\n', (idx->map + idx->map_len) - key);
+		if (!eol) eol = idx->map + idx->map_len;
+		if ((eol - line) > PASSWD_LINE_MAX) continue;
+
+		memcpy(buffer, line, eol - line);
+		buffer[eol - line] = '\0';
+
+		if (!string_to_entry(buffer, idx->num_fields, idx->delimiter, out, outlen)) continue;
+
+		return out;
 	}
-	if (!(ht->fp=fopen(ht->filename, "r"))) return NULL;
-	return get_next(name, ht, last_found);
+
+	return NULL;
+}
+
+static struct mypasswd *get_pw_nam(char const *name, passwd_index_t const *idx, size_t *cursor,
+				   struct mypasswd *out, size_t outlen)
+{
+	if (!idx || !name || *name == '\0') return NULL;
+
+	*cursor = fr_hash(name, strlen(name)) & (idx->num_slots - 1);
+	return get_next(name, idx, cursor, out, outlen);
 }
 
 #ifdef TEST
@@ -327,37 +346,36 @@ static struct mypasswd * get_pw_nam(char * name, struct hashtable* ht,
 #define MALLOC_CHECK_ 1
 
 int main(void){
-	struct hashtable *ht;
-	char *buffer;
-	struct mypasswd* pw, *last_found;
-	int i;
+	passwd_index_t *idx;
+	char buffer[1024];
+	uint64_t pwbuf[(sizeof(struct mypasswd) + (2 * PASSWD_LINE_MAX)) / sizeof(uint64_t)];
+	struct mypasswd *pw = (struct mypasswd *) pwbuf;
+	size_t cursor;
 
-	ht = build_hash_table("/etc/group", 4, 3, 1, 100, 0, ":");
-	if(!ht) {
-		printf("Hash table not built\n");
+	idx = passwd_index_alloc("/etc/group", 4, 3, true, false, ':');
+	if(!idx) {
+		printf("Index not built\n");
 		return -1;
 	}
-	for (i = 0; i < ht->tablesize; i++) {
-		if (ht->table[i]) {
-			printf("%d:\n", i);
-			for (pw = ht->table[i]; pw; pw = pw->next) {
-				printpw(pw, 4);
-			}
-		}
-	}
 
-	while(fgets(buffer, 1024, stdin)){
+	while(fgets(buffer, sizeof(buffer), stdin)){
 		buffer[strlen(buffer)-1] = 0;
-		pw = get_pw_nam(buffer, ht, &last_found);
-		printpw(pw,4);
-		while ((pw = get_next(buffer, ht, &last_found))) printpw(pw,4);
+		if (!get_pw_nam(buffer, idx, &cursor, pw, sizeof(pwbuf))) {
+			printpw(NULL, 4);
+			continue;
+		}
+		do {
+			printpw(pw, 4);
+		} while (get_next(buffer, idx, &cursor, pw, sizeof(pwbuf)));
 	}
-	release_ht(ht);
+	talloc_free(idx);
 }
 
 #else  /* TEST */
 typedef struct {
-	struct hashtable	*ht;
+	char const		*name;
+	fr_reload_t		*reload;	//!< Publishes the current passwd_index_t.
+	bool			watch;		//!< Reload the file when it changes.
 	struct mypasswd		*pwd_fmt;
 	char const		*filename;
 	char const		*format;
@@ -383,10 +401,31 @@ static const CONF_PARSER module_config[] = {
 
 	{ FR_CONF_OFFSET("allow_multiple_keys", FR_TYPE_BOOL, rlm_passwd_t, allow_multiple), .dflt = "no" },
 
-	{ FR_CONF_OFFSET("hash_size", FR_TYPE_UINT32, rlm_passwd_t, hash_size), .dflt = "100" },
+	{ FR_CONF_OFFSET("hash_size", FR_TYPE_UINT32 | FR_TYPE_DEPRECATED, rlm_passwd_t, hash_size) },
+
+	{ FR_CONF_OFFSET("watch", FR_TYPE_BOOL, rlm_passwd_t, watch), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	(Re-)read the passwd file into memory.
+ *
+ *	Called at startup, and from the reload thread
+ *	when the file changes.
+ */
+static int passwd_parse(void **out, void *uctx)
+{
+	rlm_passwd_t const	*inst = talloc_get_type_abort_const(uctx, rlm_passwd_t);
+	passwd_index_t		*idx;
+
+	idx = passwd_index_alloc(inst->filename, inst->num_fields, inst->key_field, inst->listable,
+				 inst->ignore_nislike, *inst->delimiter);
+	if (!idx) return -1;
+
+	*out = idx;
+	return 0;
+}
+
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	int			num_fields = 0, key_field = -1, listable = 0;
@@ -400,11 +439,6 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	fr_assert(inst->filename && *inst->filename);
 	fr_assert(inst->format && *inst->format);
 
-	if (inst->hash_size == 0) {
-		cf_log_err(conf, "Invalid value '0' for hash_size");
-		return -1;
-	}
-
 	lf = talloc_typed_strdup(inst, inst->format);
 	if (!lf) {
 		ERROR("Memory allocation failed for lf");
@@ -442,24 +476,13 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
-	inst->ht = build_hash_table(inst->filename, num_fields, key_field, listable,
-				    inst->hash_size, inst->ignore_nislike, *inst->delimiter);
-	if (!inst->ht){
-		ERROR("Can't build hashtable from passwd file");
-		return -1;
-	}
-
 	inst->pwd_fmt = mypasswd_alloc(inst->format, num_fields, &len);
 	if (!inst->pwd_fmt){
 		ERROR("Memory allocation failed");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 	if (!string_to_entry(inst->format, num_fields, ':', inst->pwd_fmt , len)) {
 		ERROR("Unable to convert format entry");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -474,16 +497,12 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	}
 	if (!*inst->pwd_fmt->field[key_field]) {
 		cf_log_err(conf, "key field is empty");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
 	if (fr_dict_attr_by_qualified_name(&da, dict_freeradius,
 					   inst->pwd_fmt->field[key_field], true) != FR_DICT_ATTR_OK) {
 		PERROR("Unable to resolve attribute");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -492,6 +511,15 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->key_field = key_field;
 	inst->listable = listable;
 
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	inst->reload = fr_reload_alloc(inst, inst->name, &inst->filename, 1, inst->watch, passwd_parse, inst);
+	if (!inst->reload) {
+		PERROR("Failed reading passwd file");
+		return -1;
+	}
+
 	DEBUG3("num_fields: %d key_field %d(%s) listable: %s", num_fields, key_field,
 	       inst->pwd_fmt->field[key_field], listable ? "yes" : "no");
 
@@ -500,12 +528,22 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 #undef inst
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  UNUSED fr_event_list_t *el, UNUSED void *thread)
+{
+	rlm_passwd_t *inst = instance;
+
+	if (fr_reload_start(inst->reload) < 0) {
+		PERROR("Failed watching passwd file");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int mod_detach (void *instance) {
 #define inst ((rlm_passwd_t *)instance)
-	if(inst->ht) {
-		release_ht(inst->ht);
-		inst->ht = NULL;
-	}
+	TALLOC_FREE(inst->reload);
 	talloc_free(inst->pwd_fmt);
 	return 0;
 #undef inst
@@ -538,13 +576,18 @@ static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, UNUSED void *
 
 	char			buffer[1024];
 	VALUE_PAIR		*key, *i;
-	struct mypasswd		*pw, *last_found;
+	uint64_t		pwbuf[(sizeof(struct mypasswd) + (2 * PASSWD_LINE_MAX)) / sizeof(uint64_t)];
+	struct mypasswd		*pw;
+	size_t			slot;
+	passwd_index_t		*idx;
 	fr_cursor_t		cursor;
 	int			found = 0;
 
 	key = fr_pair_find_by_da(request->packet->vps, inst->keyattr, TAG_ANY);
 	if (!key) return RLM_MODULE_NOTFOUND;
 
+	idx = fr_reload_read_lock(inst->reload);
+
 	for (i = fr_cursor_iter_by_da_init(&cursor, &key, inst->keyattr);
 	     i;
 	     i = fr_cursor_next(&cursor)) {
@@ -552,20 +595,22 @@ static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, UNUSED void *
 		 *	Ensure we have the string form of the attribute
 		 */
 		fr_pair_value_snprint(buffer, sizeof(buffer), i, 0);
-		pw = get_pw_nam(buffer, inst->ht, &last_found);
+		pw = get_pw_nam(buffer, idx, &slot, (struct mypasswd *) pwbuf, sizeof(pwbuf));
 		if (!pw) continue;
 
 		do {
 			result_add(request, inst, request, &request->control, pw, 0, "config");
 			result_add(request->reply, inst, request, &request->reply->vps, pw, 1, "reply_items");
 			result_add(request->packet, inst, request, &request->packet->vps, pw, 2, "request_items");
-		} while ((pw = get_next(buffer, inst->ht, &last_found)));
+		} while ((pw = get_next(buffer, idx, &slot, pw, sizeof(pwbuf))));
 
 		found++;
 
 		if (!inst->allow_multiple) break;
 	}
 
+	fr_reload_read_unlock(inst->reload);
+
 	if (!found) return RLM_MODULE_NOTFOUND;
 
 	return RLM_MODULE_OK;
@@ -578,6 +623,7 @@ module_t rlm_passwd = {
 	.inst_size	= sizeof(rlm_passwd_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_passwd_map,
@@ -76,6 +76,7 @@ typedef struct {
 	char const	*perl_flags;
 	PerlInterpreter	*perl;
 	bool		perl_parsed;
+	bool		tie_lists;		//!< Expose pair lists as tied hashes instead of copying them.
 	pthread_key_t	*thread_key;
 
 #ifdef USE_ITHREADS
@@ -115,6 +116,8 @@ static const CONF_PARSER module_config[] = {
 #endif
 	{ FR_CONF_OFFSET("perl_flags", FR_TYPE_STRING, rlm_perl_t, perl_flags) },
 
+	{ FR_CONF_OFFSET("tie_lists", FR_TYPE_BOOL, rlm_perl_t, tie_lists), .dflt = "no" },
+
 	{ FR_CONF_OFFSET("func_start_accounting", FR_TYPE_STRING, rlm_perl_t, func_start_accounting) },
 
 	{ FR_CONF_OFFSET("func_stop_accounting", FR_TYPE_STRING, rlm_perl_t, func_stop_accounting) },
@@ -151,6 +154,26 @@ EXTERN_C void boot_DynaLoader(pTHX_ CV* cv);
 static int perl_sys_init3_called = 0;
 static _Thread_local REQUEST *rlm_perl_request;
 
+/** Maps a global perl hash to the pair list it represents
+ *
+ */
+typedef struct {
+	char const	*hash_name;		//!< Name of the global hash.
+	char const	*list_name;		//!< Name of the list, for debug messages.
+	pair_list_t	list;			//!< List the hash is tied to, when tie_lists is enabled.
+} perl_tied_list_t;
+
+static perl_tied_list_t const perl_tied_lists[] = {
+	{ .hash_name = "RAD_REQUEST", .list_name = "request", .list = PAIR_LIST_REQUEST },
+	{ .hash_name = "RAD_REPLY", .list_name = "reply", .list = PAIR_LIST_REPLY },
+	{ .hash_name = "RAD_CONFIG", .list_name = "control", .list = PAIR_LIST_CONTROL },
+	{ .hash_name = "RAD_STATE", .list_name = "session-state", .list = PAIR_LIST_STATE },
+#ifdef WITH_PROXY
+	{ .hash_name = "RAD_REQUEST_PROXY", .list_name = "proxy-request", .list = PAIR_LIST_PROXY_REQUEST },
+	{ .hash_name = "RAD_REQUEST_PROXY_REPLY", .list_name = "proxy-reply", .list = PAIR_LIST_PROXY_REPLY },
+#endif
+};
+
 #ifdef USE_ITHREADS
 #  define dl_librefs "DynaLoader::dl_librefs"
 #  define dl_modules "DynaLoader::dl_modules"
@@ -353,6 +376,371 @@ static XS(XS_radiusd_xlat)
 	XSRETURN(1);
 }
 
+static SV *perl_vp_to_sv(REQUEST *request, VALUE_PAIR const *vp, const char *hash_name, const char *list_name);
+static void perl_vp_to_svpvn_element(REQUEST *request, AV *av, VALUE_PAIR const *vp,
+				     int *i, const char *hash_name, const char *list_name);
+static int pairadd_sv(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, char *key, SV *sv, FR_TOKEN op,
+		      const char *hash_name, const char *list_name);
+
+/** Resolve the list a tied hash operates on
+ *
+ * @param[out] ctx	to allocate new pairs in.  May be NULL.
+ * @param[out] tl	the tied list the object refers to.
+ * @param[in] request	the current request.
+ * @param[in] self	the object the hash is tied to.
+ * @return
+ *	- The head of the list.
+ *	- NULL if the list doesn't exist for this request.
+ */
+static VALUE_PAIR **perl_tied_list(TALLOC_CTX **ctx, perl_tied_list_t const **tl, REQUEST *request, SV *self)
+{
+	IV idx;
+
+	if (!SvROK(self)) croak("radiusd::pairlist methods must be called on a tied object");
+
+	idx = SvIV(SvRV(self));
+	if ((idx < 0) || ((size_t)idx >= NUM_ELEMENTS(perl_tied_lists))) croak("Invalid radiusd::pairlist object");
+
+	*tl = &perl_tied_lists[idx];
+	if (!request) return NULL;
+
+	if (ctx) *ctx = radius_list_ctx(request, (*tl)->list);
+
+	return radius_list(request, (*tl)->list);
+}
+
+/** Convert a hash key into an attribute and tag
+ *
+ * Keys are in the same format as the ones created by #perl_store_vps.
+ * That is, <attribute> or <attribute>:<tag>.
+ */
+static fr_dict_attr_t const *perl_tied_key_to_da(int8_t *tag, REQUEST *request, char const *key)
+{
+	fr_dict_attr_t const	*da;
+	char const		*p;
+	char			*q;
+	char			buffer[256];
+	long			num;
+
+	*tag = TAG_ANY;
+
+	da = fr_dict_attr_by_name(request->dict, key);
+	if (da) return da;
+
+	p = strrchr(key, ':');
+	if (!p || ((size_t)(p - key) >= sizeof(buffer))) return NULL;
+
+	num = strtol(p + 1, &q, 10);
+	if ((q == (p + 1)) || *q || (num < 0) || (num > 0x1f)) return NULL;
+
+	strlcpy(buffer, key, (p - key) + 1);
+	da = fr_dict_attr_by_name(request->dict, buffer);
+	if (!da || !da->flags.has_tag) return NULL;
+
+	*tag = num;
+
+	return da;
+}
+
+static inline CC_HINT(always_inline) bool perl_tied_vp_match(VALUE_PAIR const *vp, int8_t tag)
+{
+	return !vp->da->flags.has_tag || (vp->tag == tag);
+}
+
+static char const *perl_tied_vp_key(char *buffer, size_t buflen, VALUE_PAIR const *vp)
+{
+	if (vp->da->flags.has_tag && (vp->tag != TAG_ANY)) {
+		snprintf(buffer, buflen, "%s:%d", vp->da->name, vp->tag);
+		return buffer;
+	}
+
+	return vp->da->name;
+}
+
+/** Convert the pairs matching a key to a perl value
+ *
+ * @return
+ *	- A scalar if one pair matched.
+ *	- An array ref if multiple pairs matched.
+ *	- NULL if no pairs matched.
+ */
+static SV *perl_tied_fetch(REQUEST *request, perl_tied_list_t const *tl, VALUE_PAIR **vps,
+			   fr_dict_attr_t const *da, int8_t tag)
+{
+	fr_cursor_t	cursor;
+	VALUE_PAIR	*vp, *next;
+	AV		*av;
+	int		i = 0;
+
+	for (vp = fr_cursor_iter_by_da_init(&cursor, vps, da);
+	     vp && !perl_tied_vp_match(vp, tag);
+	     vp = fr_cursor_next(&cursor));
+	if (!vp) return NULL;
+
+	for (next = fr_cursor_next(&cursor);
+	     next && !perl_tied_vp_match(next, tag);
+	     next = fr_cursor_next(&cursor));
+	if (!next) return perl_vp_to_sv(request, vp, tl->hash_name, tl->list_name);
+
+	av = newAV();
+	perl_vp_to_svpvn_element(request, av, vp, &i, tl->hash_name, tl->list_name);
+	for (; next; next = fr_cursor_next(&cursor)) {
+		if (!perl_tied_vp_match(next, tag)) continue;
+		perl_vp_to_svpvn_element(request, av, next, &i, tl->hash_name, tl->list_name);
+	}
+
+	return newRV_noinc((SV *)av);
+}
+
+/** Remove and free all pairs matching a key
+ *
+ */
+static void perl_tied_remove(VALUE_PAIR **vps, fr_dict_attr_t const *da, int8_t tag)
+{
+	fr_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+
+	vp = fr_cursor_iter_by_da_init(&cursor, vps, da);
+	while (vp) {
+		if (!perl_tied_vp_match(vp, tag)) {
+			vp = fr_cursor_next(&cursor);
+			continue;
+		}
+		talloc_free(fr_cursor_remove(&cursor));
+		vp = fr_cursor_current(&cursor);
+	}
+}
+
+/*
+ *	Tied hash interface for %RAD_REQUEST etc. when tie_lists is enabled.
+ *
+ *	Values are converted from and to pairs as they are accessed,
+ *	instead of copying every list in and out on every call.
+ */
+static XS(XS_radiusd_pairlist_FETCH)
+{
+	dXSARGS;
+	REQUEST			*request = rlm_perl_request;
+	perl_tied_list_t const	*tl;
+	VALUE_PAIR		**vps;
+	fr_dict_attr_t const	*da;
+	int8_t			tag;
+	SV			*sv;
+
+	if (items != 2) croak("Usage: radiusd::pairlist::FETCH(self, key)");
+
+	vps = perl_tied_list(NULL, &tl, request, ST(0));
+	if (!vps) XSRETURN_UNDEF;
+
+	da = perl_tied_key_to_da(&tag, request, SvPV_nolen(ST(1)));
+	if (!da) XSRETURN_UNDEF;
+
+	sv = perl_tied_fetch(request, tl, vps, da, tag);
+	if (!sv) XSRETURN_UNDEF;
+
+	ST(0) = sv_2mortal(sv);
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_pairlist_STORE)
+{
+	dXSARGS;
+	REQUEST			*request = rlm_perl_request;
+	perl_tied_list_t const	*tl;
+	VALUE_PAIR		**vps;
+	TALLOC_CTX		*ctx;
+	fr_dict_attr_t const	*da;
+	int8_t			tag;
+	char			*key;
+	SV			*value;
+
+	if (items != 3) croak("Usage: radiusd::pairlist::STORE(self, key, value)");
+
+	vps = perl_tied_list(&ctx, &tl, request, ST(0));
+	if (!vps) {
+		if (request) RWDEBUG("Can't assign to %%%s, list is not available", tl->hash_name);
+		XSRETURN_EMPTY;
+	}
+
+	key = SvPV_nolen(ST(1));
+	value = ST(2);
+
+	/*
+	 *	Assignment replaces all existing instances,
+	 *	in the same way as rebuilding the list from
+	 *	the hash does.
+	 */
+	da = perl_tied_key_to_da(&tag, request, key);
+	if (da) perl_tied_remove(vps, da, tag);
+
+	if (SvROK(value) && (SvTYPE(SvRV(value)) == SVt_PVAV)) {
+		AV	*av = (AV *)SvRV(value);
+		I32	i, len = av_len(av);
+
+		for (i = 0; i <= len; i++) {
+			SV **av_sv = av_fetch(av, i, 0);
+
+			if (av_sv) (void)pairadd_sv(ctx, request, vps, key, *av_sv, T_OP_ADD, tl->hash_name, tl->list_name);
+		}
+	} else {
+		(void)pairadd_sv(ctx, request, vps, key, value, T_OP_EQ, tl->hash_name, tl->list_name);
+	}
+
+	XSRETURN_EMPTY;
+}
+
+static XS(XS_radiusd_pairlist_DELETE)
+{
+	dXSARGS;
+	REQUEST			*request = rlm_perl_request;
+	perl_tied_list_t const	*tl;
+	VALUE_PAIR		**vps;
+	fr_dict_attr_t const	*da;
+	int8_t			tag;
+	SV			*sv;
+
+	if (items != 2) croak("Usage: radiusd::pairlist::DELETE(self, key)");
+
+	vps = perl_tied_list(NULL, &tl, request, ST(0));
+	if (!vps) XSRETURN_UNDEF;
+
+	da = perl_tied_key_to_da(&tag, request, SvPV_nolen(ST(1)));
+	if (!da) XSRETURN_UNDEF;
+
+	sv = perl_tied_fetch(request, tl, vps, da, tag);
+	if (!sv) XSRETURN_UNDEF;
+
+	RDEBUG2("delete $%s{'%s'}", tl->hash_name, SvPV_nolen(ST(1)));
+	perl_tied_remove(vps, da, tag);
+
+	ST(0) = sv_2mortal(sv);
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_pairlist_CLEAR)
+{
+	dXSARGS;
+	REQUEST			*request = rlm_perl_request;
+	perl_tied_list_t const	*tl;
+	VALUE_PAIR		**vps;
+
+	if (items != 1) croak("Usage: radiusd::pairlist::CLEAR(self)");
+
+	vps = perl_tied_list(NULL, &tl, request, ST(0));
+	if (!vps) XSRETURN_EMPTY;
+
+	RDEBUG2("%%%s = ()", tl->hash_name);
+	fr_pair_list_free(vps);
+
+	XSRETURN_EMPTY;
+}
+
+static XS(XS_radiusd_pairlist_EXISTS)
+{
+	dXSARGS;
+	REQUEST			*request = rlm_perl_request;
+	perl_tied_list_t const	*tl;
+	VALUE_PAIR		**vps;
+	fr_dict_attr_t const	*da;
+	fr_cursor_t		cursor;
+	VALUE_PAIR		*vp;
+	int8_t			tag;
+
+	if (items != 2) croak("Usage: radiusd::pairlist::EXISTS(self, key)");
+
+	vps = perl_tied_list(NULL, &tl, request, ST(0));
+	if (!vps) XSRETURN_NO;
+
+	da = perl_tied_key_to_da(&tag, request, SvPV_nolen(ST(1)));
+	if (!da) XSRETURN_NO;
+
+	for (vp = fr_cursor_iter_by_da_init(&cursor, vps, da); vp; vp = fr_cursor_next(&cursor)) {
+		if (perl_tied_vp_match(vp, tag)) XSRETURN_YES;
+	}
+
+	XSRETURN_NO;
+}
+
+/*
+ *	Keys are returned in the same order as perl_store_vps
+ *	would have inserted them, with one key per attribute/tag.
+ */
+static XS(XS_radiusd_pairlist_FIRSTKEY)
+{
+	dXSARGS;
+	REQUEST			*request = rlm_perl_request;
+	perl_tied_list_t const	*tl;
+	VALUE_PAIR		**vps;
+	char			buffer[256];
+
+	if (items != 1) croak("Usage: radiusd::pairlist::FIRSTKEY(self)");
+
+	vps = perl_tied_list(NULL, &tl, request, ST(0));
+	if (!vps || !*vps) XSRETURN_UNDEF;
+
+	fr_pair_list_sort(vps, fr_pair_cmp_by_da_tag);
+
+	ST(0) = sv_2mortal(newSVpv(perl_tied_vp_key(buffer, sizeof(buffer), *vps), 0));
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_pairlist_NEXTKEY)
+{
+	dXSARGS;
+	REQUEST			*request = rlm_perl_request;
+	perl_tied_list_t const	*tl;
+	VALUE_PAIR		**vps;
+	fr_dict_attr_t const	*da;
+	fr_cursor_t		cursor;
+	VALUE_PAIR		*vp;
+	int8_t			tag;
+	char			buffer[256];
+
+	if (items != 2) croak("Usage: radiusd::pairlist::NEXTKEY(self, lastkey)");
+
+	vps = perl_tied_list(NULL, &tl, request, ST(0));
+	if (!vps) XSRETURN_UNDEF;
+
+	da = perl_tied_key_to_da(&tag, request, SvPV_nolen(ST(1)));
+	if (!da) XSRETURN_UNDEF;
+
+	/*
+	 *	The list was sorted by FIRSTKEY, so skip past
+	 *	the last key's group of pairs.
+	 */
+	for (vp = fr_cursor_init(&cursor, vps);
+	     vp && ((vp->da != da) || !perl_tied_vp_match(vp, tag));
+	     vp = fr_cursor_next(&cursor));
+	while (vp && (vp->da == da) && perl_tied_vp_match(vp, tag)) vp = fr_cursor_next(&cursor);
+	if (!vp) XSRETURN_UNDEF;
+
+	ST(0) = sv_2mortal(newSVpv(perl_tied_vp_key(buffer, sizeof(buffer), vp), 0));
+	XSRETURN(1);
+}
+
+/** Tie the global list hashes to the pair lists
+ *
+ * Only ties hashes that aren't already tied, so this is cheap to call
+ * on every request, and works for cloned interpreters.
+ */
+static void perl_tie_lists(void)
+{
+	size_t	i;
+	HV	*stash = gv_stashpv("radiusd::pairlist", GV_ADD);
+
+	for (i = 0; i < NUM_ELEMENTS(perl_tied_lists); i++) {
+		HV	*hv = get_hv(perl_tied_lists[i].hash_name, 1);
+		SV	*obj;
+
+		if (SvRMAGICAL((SV *)hv) && mg_find((SV *)hv, PERL_MAGIC_tied)) continue;
+
+		hv_clear(hv);
+		obj = sv_bless(newRV_noinc(newSViv(i)), stash);
+		sv_magic((SV *)hv, obj, PERL_MAGIC_tied, NULL, 0);
+		SvREFCNT_dec(obj);
+	}
+}
+
 static void xs_init(pTHX)
 {
 	char const *file = __FILE__;
@@ -362,6 +750,14 @@ static void xs_init(pTHX)
 
 	newXS("radiusd::log",XS_radiusd_log, "rlm_perl");
 	newXS("radiusd::xlat",XS_radiusd_xlat, "rlm_perl");
+
+	newXS("radiusd::pairlist::FETCH", XS_radiusd_pairlist_FETCH, "rlm_perl");
+	newXS("radiusd::pairlist::STORE", XS_radiusd_pairlist_STORE, "rlm_perl");
+	newXS("radiusd::pairlist::DELETE", XS_radiusd_pairlist_DELETE, "rlm_perl");
+	newXS("radiusd::pairlist::CLEAR", XS_radiusd_pairlist_CLEAR, "rlm_perl");
+	newXS("radiusd::pairlist::EXISTS", XS_radiusd_pairlist_EXISTS, "rlm_perl");
+	newXS("radiusd::pairlist::FIRSTKEY", XS_radiusd_pairlist_FIRSTKEY, "rlm_perl");
+	newXS("radiusd::pairlist::NEXTKEY", XS_radiusd_pairlist_NEXTKEY, "rlm_perl");
 }
 
 /** Call perl code using an xlat
@@ -679,6 +1075,35 @@ static void perl_vp_to_svpvn_element(REQUEST *request, AV *av, VALUE_PAIR const
 	(*i)++;
 }
 
+/*
+ *	Convert a single VP to a perl scalar
+ */
+static SV *perl_vp_to_sv(REQUEST *request, VALUE_PAIR const *vp, const char *hash_name, const char *list_name)
+{
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		RDEBUG2("$%s{'%s'} = &%s:%s -> '%pV'", hash_name, vp->da->name, list_name,
+		       vp->da->name, &vp->data);
+		return newSVpvn(vp->vp_strvalue, vp->vp_length);
+
+	case FR_TYPE_OCTETS:
+		RDEBUG2("$%s{'%s'} = &%s:%s -> %pV", hash_name, vp->da->name, list_name,
+		       vp->da->name, &vp->data);
+		return newSVpvn((char const *)vp->vp_octets, vp->vp_length);
+
+	default:
+	{
+		char buffer[1024];
+		size_t len;
+
+		len = fr_pair_value_snprint(buffer, sizeof(buffer), vp, '\0');
+		RDEBUG2("$%s{'%s'} = &%s:%s -> '%s'", hash_name, vp->da->name,
+		       list_name, vp->da->name, buffer);
+		return newSVpvn(buffer, truncate_len(len, sizeof(buffer)));
+	}
+	}
+}
+
 /*
  *  	get the vps and put them in perl hash
  *  	If one VP have multiple values it is added as array_ref
@@ -738,33 +1163,7 @@ static void perl_store_vps(UNUSED TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR
 		/*
 		 *	It's a normal single valued attribute
 		 */
-		switch (vp->vp_type) {
-		case FR_TYPE_STRING:
-			RDEBUG2("$%s{'%s'} = &%s:%s -> '%pV'", hash_name, vp->da->name, list_name,
-			       vp->da->name, &vp->data);
-			(void)hv_store(rad_hv, name, strlen(name), newSVpvn(vp->vp_strvalue, vp->vp_length), 0);
-			break;
-
-		case FR_TYPE_OCTETS:
-			RDEBUG2("$%s{'%s'} = &%s:%s -> %pV", hash_name, vp->da->name, list_name,
-			       vp->da->name, &vp->data);
-			(void)hv_store(rad_hv, name, strlen(name),
-				       newSVpvn((char const *)vp->vp_octets, vp->vp_length), 0);
-			break;
-
-		default:
-		{
-			char buffer[1024];
-			size_t len;
-
-			len = fr_pair_value_snprint(buffer, sizeof(buffer), vp, '\0');
-			RDEBUG2("$%s{'%s'} = &%s:%s -> '%s'", hash_name, vp->da->name,
-			       list_name, vp->da->name, buffer);
-			(void)hv_store(rad_hv, name, strlen(name),
-				       newSVpvn(buffer, truncate_len(len, sizeof(buffer))), 0);
-		}
-			break;
-		}
+		(void)hv_store(rad_hv, name, strlen(name), perl_vp_to_sv(request, vp, hash_name, list_name), 0);
 	}
 	REXDENT();
 }
@@ -893,6 +1292,15 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		ENTER;
 		SAVETMPS;
 
+		/*
+		 *	Lists are accessed through the tied hashes as
+		 *	the script uses them, nothing to copy.
+		 */
+		if (inst->tie_lists) {
+			perl_tie_lists();
+			goto call;
+		}
+
 		rad_reply_hv = get_hv("RAD_REPLY", 1);
 		rad_config_hv = get_hv("RAD_CONFIG", 1);
 		rad_request_hv = get_hv("RAD_REQUEST", 1);
@@ -922,6 +1330,7 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		}
 #endif
 
+	call:
 		/*
 		 * Store pointer to request structure globally so radiusd::xlat works
 		 */
@@ -957,6 +1366,9 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		FREETMPS;
 		LEAVE;
 
+		rlm_perl_request = NULL;
+		if (inst->tie_lists) return exitstatus;
+
 		vp = NULL;
 		if ((get_hv_content(request->packet, request, rad_request_hv, &vp, "RAD_REQUEST", "request")) == 0) {
 			fr_pair_list_free(&request->packet->vps);
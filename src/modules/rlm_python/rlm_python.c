@@ -68,6 +68,9 @@ typedef struct {
 #if PY_MAJOR_VERSION == 2
 	bool		single_interpreter_mode;//!< Whether or not to create interpreters per module
 						//!< instance.
+#else
+	bool		per_thread_interpreter;	//!< Create an interpreter per worker thread, each
+						///< with its own copy of the user's module.
 #endif
 
 	python_func_def_t
@@ -93,19 +96,50 @@ typedef struct {
  *
  * Multiple instances of python create multiple interpreters and each
  * thread must have a PyThreadState per interpreter, to track execution.
+ *
+ * If per_thread_interpreter is set, each thread instead gets its own
+ * interpreter, with its own copy of the user's module and functions.
  */
 typedef struct {
+	rlm_python_t const *inst;		//!< Module instance this thread belongs to.
 	PyThreadState	*state;			//!< Module instance/thread specific state.
+
+	PyThreadState	*interpreter;		//!< Thread specific interpreter, or NULL if we're
+						///< using the module instance's interpreter.
+	PyObject	*module;		//!< radiusd module in the thread specific interpreter.
+
+	python_func_def_t
+	instantiate,
+	authorize,
+	authenticate,
+	preacct,
+	accounting,
+	pre_proxy,
+	post_proxy,
+	post_auth,
+#ifdef WITH_COA
+	recv_coa,
+	send_coa,
+#endif
+	detach;				//!< Functions loaded into the thread specific interpreter.
+
+	rbtree_t	*attr_names;		//!< Attribute names converted to Python strings.
 } rlm_python_thread_t;
 
+/** An attribute name converted to a Python string
+ *
+ * Python strings are immutable, so the same object can be passed
+ * to the Python function on every call.
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;		//!< Attribute the name belongs to.
+	int8_t			tag;		//!< Tag of the attribute, if it has one.
+	PyObject		*name;		//!< "<name>" or "<name>:<tag>".
+} python_attr_name_t;
+
 static void		*python_dlhandle;
 static PyThreadState	*global_interpreter;	//!< Our first interpreter.
 
-#if PY_MAJOR_VERSION == 3
-static rlm_python_t	*current_inst;		//!< Used for communication with inittab functions.
-static CONF_SECTION	*current_conf;		//!< Used for communication with inittab functions.
-#endif
-
 static char		*default_path;		//!< The default python path.
 
 /*
@@ -173,6 +207,8 @@ static CONF_PARSER module_config[] = {
 
 #if PY_MAJOR_VERSION == 2
 	{ FR_CONF_OFFSET("cext_compat", FR_TYPE_BOOL, rlm_python_t, single_interpreter_mode), .dflt = "no" },
+#else
+	{ FR_CONF_OFFSET("per_thread_interpreter", FR_TYPE_BOOL, rlm_python_t, per_thread_interpreter), .dflt = "no" },
 #endif
 
 	CONF_PARSER_TERMINATOR
@@ -262,13 +298,21 @@ static void python_error_log(const rlm_python_t *inst, REQUEST *request)
 
 		for(; ptb != NULL; ptb = ptb->tb_next, fnum++) {
 			PyFrameObject *cur_frame = ptb->tb_frame;
+#if PY_VERSION_HEX >= 0x03090000
+			PyCodeObject *code = PyFrame_GetCode(cur_frame);	/* Frames are opaque as of 3.11 */
+#else
+			PyCodeObject *code = cur_frame->f_code;
+#endif
 
 			ROPTIONAL(RERROR, ERROR, "[%ld] %s:%d at %s()",
 				fnum,
-				PyUnicode_AsUTF8(cur_frame->f_code->co_filename),
+				PyUnicode_AsUTF8(code->co_filename),
 				PyFrame_GetLineNumber(cur_frame),
-				PyUnicode_AsUTF8(cur_frame->f_code->co_name)
+				PyUnicode_AsUTF8(code->co_name)
 			);
+#if PY_VERSION_HEX >= 0x03090000
+			Py_DECREF(code);
+#endif
 		}
 	}
 
@@ -393,22 +437,82 @@ static void mod_vptuple(TALLOC_CTX *ctx, rlm_python_t const *inst, REQUEST *requ
 }
 
 
-/*
- *	This is the core Python function that the others wrap around.
- *	Pass the value-pair print strings in a tuple.
+static int python_attr_name_cmp(void const *one, void const *two)
+{
+	python_attr_name_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->da > b->da) - (a->da < b->da);
+	if (ret != 0) return ret;
+
+	return (a->tag > b->tag) - (a->tag < b->tag);
+}
+
+static int _python_attr_name_decref(void *data, UNUSED void *uctx)
+{
+	python_attr_name_t *attr_name = data;
+
+	Py_CLEAR(attr_name->name);
+
+	return 0;
+}
+
+/** Return a new reference to a Python string containing the name of an attribute
+ *
+ * Names are cached per thread, so we don't create a new
+ * Python string for every attribute on every call.
+ *
+ * Must be called with the GIL held.
  */
-static int mod_populate_vptuple(rlm_python_t const *inst, REQUEST *request, PyObject *pp, VALUE_PAIR *vp)
+static PyObject *python_attr_name(rlm_python_thread_t *t, VALUE_PAIR const *vp)
 {
-	PyObject *attribute = NULL;
-	PyObject *value = NULL;
+	python_attr_name_t	find, *found;
+
+	find = (python_attr_name_t){
+		.da = vp->da,
+		.tag = vp->da->flags.has_tag ? vp->tag : 0
+	};
+
+	found = rbtree_finddata(t->attr_names, &find);
+	if (found) goto done;
+
+	MEM(found = talloc(t->attr_names, python_attr_name_t));
+	*found = find;
 
 	/* Look at the fr_pair_fprint_name? */
 	if (vp->da->flags.has_tag) {
-		attribute = PyUnicode_FromFormat("%s:%d", vp->da->name, vp->tag);
+		found->name = PyUnicode_FromFormat("%s:%d", vp->da->name, vp->tag);
 	} else {
-		attribute = PyUnicode_FromString(vp->da->name);
+		found->name = PyUnicode_FromString(vp->da->name);
+	}
+
+	if (!found->name) {
+		talloc_free(found);
+		return NULL;
+	}
+
+	if (!rbtree_insert(t->attr_names, found)) {
+		Py_DECREF(found->name);
+		talloc_free(found);
+		return NULL;
 	}
 
+done:
+	Py_INCREF(found->name);
+	return found->name;
+}
+
+/*
+ *	This is the core Python function that the others wrap around.
+ *	Pass the value-pair print strings in a tuple.
+ */
+static int mod_populate_vptuple(rlm_python_t const *inst, rlm_python_thread_t *t,
+				REQUEST *request, PyObject *pp, VALUE_PAIR *vp)
+{
+	PyObject *attribute = NULL;
+	PyObject *value = NULL;
+
+	attribute = python_attr_name(t, vp);
 	if (!attribute) return -1;
 
 	switch (vp->vp_type) {
@@ -504,7 +608,8 @@ static int mod_populate_vptuple(rlm_python_t const *inst, REQUEST *request, PyOb
 	return 0;
 }
 
-static rlm_rcode_t do_python_single(rlm_python_t const *inst, REQUEST *request, PyObject *p_func, char const *funcname)
+static rlm_rcode_t do_python_single(rlm_python_t const *inst, rlm_python_thread_t *t,
+				    REQUEST *request, PyObject *p_func, char const *funcname)
 {
 	fr_cursor_t	cursor;
 	VALUE_PAIR	*vp;
@@ -523,6 +628,8 @@ static rlm_rcode_t do_python_single(rlm_python_t const *inst, REQUEST *request,
 	 */
 	tuple_len = 0;
 	if (request != NULL) {
+		fr_assert(t);
+
 		for (vp = fr_cursor_init(&cursor, &request->packet->vps);
 		     vp;
 		     vp = fr_cursor_next(&cursor)) tuple_len++;
@@ -549,7 +656,7 @@ static rlm_rcode_t do_python_single(rlm_python_t const *inst, REQUEST *request,
 				goto finish;
 			}
 
-			if (mod_populate_vptuple(inst, request, pp, vp) == 0) {
+			if (mod_populate_vptuple(inst, t, request, pp, vp) == 0) {
 				/* Put the tuple inside the container */
 				PyTuple_SET_ITEM(p_arg, i, pp);
 			} else {
@@ -650,16 +757,21 @@ static rlm_rcode_t do_python(rlm_python_t const *inst, rlm_python_thread_t *this
 	RDEBUG3("Using thread state %p/%p", inst, this_thread->state);
 
 	PyEval_RestoreThread(this_thread->state);	/* Swap in our local thread state */
-	rcode = do_python_single(inst, request, p_func, funcname);
+	rcode = do_python_single(inst, this_thread, request, p_func, funcname);
 	(void)fr_cond_assert(PyEval_SaveThread() == this_thread->state);
 
 	return rcode;
 }
 
+/*
+ *	Threads with their own interpreter call the
+ *	functions loaded into that interpreter.
+ */
 #define MOD_FUNC(x) \
 static rlm_rcode_t CC_HINT(nonnull) mod_##x(void *instance, void *thread, REQUEST *request) { \
-	return do_python((rlm_python_t const *) instance, (rlm_python_thread_t *)thread, \
-			 request, ((rlm_python_t const *)instance)->x.function, #x);\
+	rlm_python_thread_t *t = thread; \
+	return do_python((rlm_python_t const *) instance, t, request, \
+			 t->interpreter ? t->x.function : ((rlm_python_t const *)instance)->x.function, #x);\
 }
 
 MOD_FUNC(authenticate)
@@ -690,7 +802,7 @@ static void python_function_destroy(python_func_def_t *def)
 /** Import a user module and load a function from it
  *
  */
-static int python_function_load(rlm_python_t *inst, python_func_def_t *def)
+static int python_function_load(rlm_python_t const *inst, python_func_def_t *def)
 {
 	char const *funcname = "python_function_load";
 
@@ -727,7 +839,7 @@ static int python_function_load(rlm_python_t *inst, python_func_def_t *def)
  *	Parse a configuration section, and populate a dict.
  *	This function is recursively called (allows to have nested dicts.)
  */
-static int python_parse_config(rlm_python_t *inst, CONF_SECTION *cs, int lvl, PyObject *dict)
+static int python_parse_config(rlm_python_t const *inst, CONF_SECTION const *cs, int lvl, PyObject *dict)
 {
 	int		indent_section = (lvl * 4);
 	int		indent_item = (lvl + 1) * 4;
@@ -810,20 +922,21 @@ static int python_parse_config(rlm_python_t *inst, CONF_SECTION *cs, int lvl, Py
 /** Make the current instance's config available within the module we're initialising
  *
  */
-static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, PyObject *module)
+static int python_module_import_config(rlm_python_t const *inst, CONF_SECTION const *conf, PyObject *module,
+				       PyObject **out)
 {
-	CONF_SECTION *cs;
+	CONF_SECTION	*cs;
+	PyObject	*dict;
 
 	/*
 	 *	Convert a FreeRADIUS config structure into a python
 	 *	dictionary.
 	 */
-	inst->pythonconf_dict = PyDict_New();
-	if (!inst->pythonconf_dict) {
+	dict = PyDict_New();
+	if (!dict) {
 		ERROR("Unable to create python dict for config");
 	error:
-		Py_XDECREF(inst->pythonconf_dict);
-		inst->pythonconf_dict = NULL;
+		Py_XDECREF(dict);
 		python_error_log(inst, NULL);
 		return -1;
 	}
@@ -831,13 +944,15 @@ static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, P
 	cs = cf_section_find(conf, "config", NULL);
 	if (cs) {
 		DEBUG("Inserting \"config\" section into python environment as radiusd.config");
-		if (python_parse_config(inst, cs, 0, inst->pythonconf_dict) < 0) goto error;
+		if (python_parse_config(inst, cs, 0, dict) < 0) goto error;
 	}
 
 	/*
 	 *	Add module configuration as a dict
 	 */
-	if (PyModule_AddObject(module, "config", inst->pythonconf_dict) < 0) goto error;
+	if (PyModule_AddObject(module, "config", dict) < 0) goto error;
+
+	*out = dict;
 
 	return 0;
 }
@@ -845,7 +960,7 @@ static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, P
 /** Import integer constants into the module we're initialising
  *
  */
-static int python_module_import_constants(rlm_python_t *inst, PyObject *module)
+static int python_module_import_constants(rlm_python_t const *inst, PyObject *module)
 {
 	size_t i;
 
@@ -860,7 +975,7 @@ static int python_module_import_constants(rlm_python_t *inst, PyObject *module)
 	return 0;
 }
 
-static char *python_path_build(TALLOC_CTX *ctx, rlm_python_t *inst, CONF_SECTION *conf)
+static char *python_path_build(TALLOC_CTX *ctx, rlm_python_t const *inst, CONF_SECTION const *conf)
 {
 	char *path;
 
@@ -869,13 +984,15 @@ static char *python_path_build(TALLOC_CTX *ctx, rlm_python_t *inst, CONF_SECTION
 		MEM(path = talloc_asprintf_append_buffer(path, "%s:", inst->python_path));
 	}
 	if (inst->python_path_include_conf_dir) {
-		char const *imutable;
-		char *mutable;
+		char *filename;
 
-		imutable = cf_filename(conf);
-		memcpy(&mutable, &imutable, sizeof(mutable));
-
-		MEM(path = talloc_asprintf_append_buffer(path, "%s:", dirname(mutable)));
+		/*
+		 *	dirname() may modify its argument, and this
+		 *	is called once per thread interpreter.
+		 */
+		MEM(filename = talloc_typed_strdup(path, cf_filename(conf)));
+		MEM(path = talloc_asprintf_append_buffer(path, "%s:", dirname(filename)));
+		talloc_free(filename);
 	}
 	if (inst->python_path_include_default) {
 		MEM(path = talloc_asprintf_append_buffer(path, "%s:", default_path));
@@ -893,60 +1010,46 @@ static char *python_path_build(TALLOC_CTX *ctx, rlm_python_t *inst, CONF_SECTION
 #if PY_MAJOR_VERSION == 3
 static PyObject *python_module_init(void)
 {
-	rlm_python_t	*inst = current_inst;
-	CONF_SECTION	*conf = current_conf;
-	PyObject	*module;
+	/*
+	 *	Multi-phase initialisation, so that each
+	 *	interpreter gets its own copy of the module,
+	 *	and so the module can be imported into
+	 *	interpreters with their own GIL.
+	 */
+	static PyModuleDef_Slot py_module_slots[] = {
+#if PY_VERSION_HEX >= 0x030C0000
+		{ Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+		{ 0, NULL }
+	};
 
 	static struct PyModuleDef py_module_def = {
 		PyModuleDef_HEAD_INIT,
 		"radiusd",			/* m_name */
 		"FreeRADIUS python module",	/* m_doc */
-		-1,				/* m_size */
+		0,				/* m_size */
 		module_methods,			/* m_methods */
-		NULL,				/* m_reload */
+		py_module_slots,		/* m_slots */
 		NULL,				/* m_traverse */
 		NULL,				/* m_clear */
 		NULL,				/* m_free */
 	};
 
-	fr_assert(inst && conf);
-
-	module = PyModule_Create(&py_module_def);
-	if (!module) {
-		python_error_log(inst, NULL);
-		Py_RETURN_NONE;
-	}
-
-	return module;
+	return PyModuleDef_Init(&py_module_def);
 }
 
-static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
+/** Set the python path, and import the radiusd module into the current interpreter
+ *
+ * Must be called with the interpreter's thread state swapped in.
+ */
+static int python_interpreter_setup(rlm_python_t const *inst, CONF_SECTION const *conf,
+				    PyObject **module_out, PyObject **config_out)
 {
 	char		*path;
 	PyObject	*module;
 	wchar_t	        *wide_path;
 
-	/*
-	 *	python_module_init takes no args, so we need
-	 *	to set these globals so that when it's
-	 *	called during interpreter initialisation
-	 *	it can get at the current instance config.
-	 */
-	current_inst = inst;
-	current_conf = conf;
-
-	PyEval_RestoreThread(global_interpreter);
-	LSAN_DISABLE(inst->interpreter = Py_NewInterpreter());
-	if (!inst->interpreter) {
-		ERROR("Failed creating new interpreter");
-		return -1;
-	}
-	DEBUG3("Created new interpreter %p", inst->interpreter);
-	PyEval_SaveThread();		/* Unlock GIL */
-
-	PyEval_RestoreThread(inst->interpreter);
-
-	path = python_path_build(inst, inst, conf);
+	path = python_path_build(NULL, inst, conf);
 	DEBUG3("Setting python path to \"%s\"", path);
 	wide_path = Py_DecodeLocale(path, NULL);
 	talloc_free(path);
@@ -959,17 +1062,39 @@ static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
 	 *	own copy which it can mutate as much as
 	 *      it wants.
 	 */
- 	module = PyImport_ImportModule("radiusd");
- 	if (!module) {
- 		ERROR("Failed importing \"radiusd\" module into interpreter %p", inst->interpreter);
- 		return -1;
- 	}
-	if ((python_module_import_config(inst, conf, module) < 0) ||
+	module = PyImport_ImportModule("radiusd");
+	if (!module) {
+		ERROR("Failed importing \"radiusd\" module into interpreter");
+		python_error_log(inst, NULL);
+		return -1;
+	}
+	if ((python_module_import_config(inst, conf, module, config_out) < 0) ||
 	    (python_module_import_constants(inst, module) < 0)) {
 		Py_DECREF(module);
 		return -1;
 	}
-	inst->module = module;
+	*module_out = module;
+
+	return 0;
+}
+
+static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
+{
+	PyEval_RestoreThread(global_interpreter);
+	LSAN_DISABLE(inst->interpreter = Py_NewInterpreter());
+	if (!inst->interpreter) {
+		ERROR("Failed creating new interpreter");
+		PyEval_SaveThread();
+		return -1;
+	}
+	DEBUG3("Created new interpreter %p", inst->interpreter);
+	PyEval_SaveThread();		/* Unlock GIL */
+
+	PyEval_RestoreThread(inst->interpreter);
+	if (python_interpreter_setup(inst, conf, &inst->module, &inst->pythonconf_dict) < 0) {
+		PyEval_SaveThread();
+		return -1;
+	}
 	PyEval_SaveThread();
 
 	return 0;
@@ -988,6 +1113,174 @@ static void python_interpreter_free(UNUSED rlm_python_t *inst, PyThreadState *in
 	PyThreadState_Swap(global_interpreter);	/* Get a none-null thread state */
 	PyEval_SaveThread();		/* Unlock GIL */
 }
+
+/** Free a temporary thread state, used to get access to the main interpreter
+ *
+ * Must be called with no current thread state.
+ */
+static void python_thread_state_free(PyThreadState *state)
+{
+	PyEval_RestoreThread(state);
+	PyThreadState_Clear(state);
+	PyThreadState_DeleteCurrent();	/* Also unlocks the GIL */
+}
+
+/** Destroy a thread specific interpreter
+ *
+ * Must be called with the interpreter's thread state swapped in.
+ * On return there's no current thread state, and no GIL is held.
+ */
+static void python_thread_interpreter_end(PyThreadState *interp)
+{
+	Py_EndInterpreter(interp);	/* Sets thread state to NULL */
+
+#if PY_VERSION_HEX < 0x030C0000
+	/*
+	 *	The GIL is shared with the main interpreter, and
+	 *	is still locked.  It can only be unlocked via a
+	 *	thread state belonging to a live interpreter.
+	 */
+	{
+		PyThreadState *state;
+
+		state = PyThreadState_New(global_interpreter->interp);
+		PyThreadState_Swap(state);
+		PyThreadState_Clear(state);
+		PyThreadState_DeleteCurrent();
+	}
+#endif
+}
+
+/** Create an interpreter for the current thread, and load the user's module into it
+ *
+ * With Python >= 3.12 the interpreter gets its own GIL, so threads
+ * don't contend with each other when calling Python functions.
+ * Earlier versions share a single GIL between all interpreters.
+ */
+static int python_thread_interpreter_init(rlm_python_t const *inst, rlm_python_thread_t *t,
+					  CONF_SECTION const *conf)
+{
+	PyThreadState	*state;
+
+	/*
+	 *	Creating an interpreter requires a current thread
+	 *	state, and this thread doesn't have one yet.
+	 */
+	state = PyThreadState_New(global_interpreter->interp);
+	if (!state) {
+		ERROR("Failed initialising local PyThreadState");
+		return -1;
+	}
+	PyEval_RestoreThread(state);
+
+#if PY_VERSION_HEX >= 0x030C0000
+	{
+		PyInterpreterConfig	config = {
+						.use_main_obmalloc = 0,
+						.allow_fork = 0,
+						.allow_exec = 0,
+						.allow_threads = 1,
+						.allow_daemon_threads = 0,
+						.check_multi_interp_extensions = 1,
+						.gil = PyInterpreterConfig_OWN_GIL
+					};
+		PyStatus		status;
+
+		/*
+		 *	Swaps in the new interpreter's thread state and
+		 *	locks its GIL, unlocking the main interpreter's.
+		 */
+		LSAN_DISABLE(status = Py_NewInterpreterFromConfig(&t->interpreter, &config));
+		if (PyStatus_Exception(status)) {
+			ERROR("Failed creating thread interpreter: %s", status.err_msg ? status.err_msg : "unknown error");
+			t->interpreter = NULL;
+			PyThreadState_Clear(state);
+			PyThreadState_DeleteCurrent();
+			return -1;
+		}
+	}
+#else
+	LSAN_DISABLE(t->interpreter = Py_NewInterpreter());
+	if (!t->interpreter) {
+		ERROR("Failed creating thread interpreter");
+		PyThreadState_Clear(state);
+		PyThreadState_DeleteCurrent();
+		return -1;
+	}
+#endif
+	DEBUG3("Created new thread interpreter %p", t->interpreter);
+
+	if (python_interpreter_setup(inst, conf, &t->module, &(PyObject *){ NULL }) < 0) {
+	error:
+		python_function_destroy(&t->instantiate);
+		python_function_destroy(&t->authorize);
+		python_function_destroy(&t->authenticate);
+		python_function_destroy(&t->preacct);
+		python_function_destroy(&t->accounting);
+		python_function_destroy(&t->pre_proxy);
+		python_function_destroy(&t->post_proxy);
+		python_function_destroy(&t->post_auth);
+#ifdef WITH_COA
+		python_function_destroy(&t->recv_coa);
+		python_function_destroy(&t->send_coa);
+#endif
+		python_function_destroy(&t->detach);
+		Py_CLEAR(t->module);
+
+		python_thread_interpreter_end(t->interpreter);
+		t->interpreter = NULL;
+		python_thread_state_free(state);
+		return -1;
+	}
+
+	/*
+	 *	Load the functions into this interpreter
+	 */
+#define PYTHON_FUNC_LOAD_THREAD(_x) \
+	do { \
+		t->_x.module_name = inst->_x.module_name; \
+		t->_x.function_name = inst->_x.function_name; \
+		if (python_function_load(inst, &t->_x) < 0) goto error; \
+	} while (0)
+	PYTHON_FUNC_LOAD_THREAD(instantiate);
+	PYTHON_FUNC_LOAD_THREAD(authenticate);
+	PYTHON_FUNC_LOAD_THREAD(authorize);
+	PYTHON_FUNC_LOAD_THREAD(preacct);
+	PYTHON_FUNC_LOAD_THREAD(accounting);
+	PYTHON_FUNC_LOAD_THREAD(pre_proxy);
+	PYTHON_FUNC_LOAD_THREAD(post_proxy);
+	PYTHON_FUNC_LOAD_THREAD(post_auth);
+#ifdef WITH_COA
+	PYTHON_FUNC_LOAD_THREAD(recv_coa);
+	PYTHON_FUNC_LOAD_THREAD(send_coa);
+#endif
+	PYTHON_FUNC_LOAD_THREAD(detach);
+
+	/*
+	 *	Each interpreter has its own copy of the user's
+	 *	module, so any state set up by instantiate needs
+	 *	to be set up again here.
+	 */
+	if (t->instantiate.function) {
+		switch (do_python_single(inst, t, NULL, t->instantiate.function, "instantiate")) {
+		case RLM_MODULE_FAIL:
+		case RLM_MODULE_REJECT:
+		case RLM_MODULE_YIELD:	/* Yield not valid in instantiate */
+			goto error;
+
+		default:
+			break;
+		}
+	}
+
+	t->state = t->interpreter;
+	PyEval_SaveThread();		/* Unlock the thread interpreter's GIL */
+
+	python_thread_state_free(state);
+
+	return 0;
+}
+
 /*
  *	Python 2 interpreter initialisation and destruction
  */
@@ -1043,7 +1336,7 @@ static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
 		 */
 		Py_INCREF(module);
 
-		if ((python_module_import_config(inst, conf, module) < 0) ||
+		if ((python_module_import_config(inst, conf, module, &inst->pythonconf_dict) < 0) ||
 		    (python_module_import_constants(inst, module) < 0)) goto error;
 
 		if (inst->single_interpreter_mode) global_module = module;
@@ -1104,6 +1397,13 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
 
+#if PY_MAJOR_VERSION == 3 && PY_VERSION_HEX < 0x030C0000
+	if (inst->per_thread_interpreter) {
+		WARN("Python %s does not support a GIL per interpreter.  Thread interpreters will share a GIL",
+		     Py_GetVersion());
+	}
+#endif
+
 	if (python_interpreter_init(inst, conf) < 0) return -1;
 
 	/*
@@ -1135,7 +1435,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	if (inst->instantiate.function) {
 		rlm_rcode_t rcode;
 
-		rcode = do_python_single(inst, NULL, inst->instantiate.function, "instantiate");
+		rcode = do_python_single(inst, NULL, NULL, inst->instantiate.function, "instantiate");
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 		case RLM_MODULE_REJECT:
@@ -1177,7 +1477,7 @@ static int mod_detach(void *instance)
 	/*
 	 *	We don't care if this fails.
 	 */
-	if (inst->detach.function) (void)do_python_single(inst, NULL, inst->detach.function, "detach");
+	if (inst->detach.function) (void)do_python_single(inst, NULL, NULL, inst->detach.function, "detach");
 
 #define PYTHON_FUNC_DESTROY(_x) python_function_destroy(&inst->_x)
 	PYTHON_FUNC_DESTROY(instantiate);
@@ -1205,13 +1505,22 @@ static int mod_detach(void *instance)
 	return 0;
 }
 
-static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance,
 				  UNUSED fr_event_list_t *el, void *thread)
 {
 	PyThreadState		*state;
 	rlm_python_t		*inst = instance;
 	rlm_python_thread_t	*this_thread = thread;
 
+	this_thread->inst = inst;
+	MEM(this_thread->attr_names = rbtree_create(this_thread, python_attr_name_cmp, NULL, 0));
+
+#if PY_MAJOR_VERSION == 3
+	if (inst->per_thread_interpreter) return python_thread_interpreter_init(inst, this_thread, conf);
+#else
+	(void)conf;
+#endif
+
 	state = PyThreadState_New(inst->interpreter->interp);
 	if (!state) {
 		ERROR("Failed initialising local PyThreadState");
@@ -1228,7 +1537,46 @@ static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
 {
 	rlm_python_thread_t	*this_thread = thread;
 
+	/*
+	 *	Failed during thread instantiation
+	 */
+	if (!this_thread->state) return 0;
+
 	PyEval_RestoreThread(this_thread->state);	/* Swap in our local thread state */
+
+	rbtree_walk(this_thread->attr_names, RBTREE_IN_ORDER, _python_attr_name_decref, NULL);
+
+#if PY_MAJOR_VERSION == 3
+	if (this_thread->interpreter) {
+		/*
+		 *	We don't care if this fails.
+		 */
+		if (this_thread->detach.function) {
+			(void)do_python_single(this_thread->inst, this_thread, NULL,
+					       this_thread->detach.function, "detach");
+		}
+
+		python_function_destroy(&this_thread->instantiate);
+		python_function_destroy(&this_thread->authorize);
+		python_function_destroy(&this_thread->authenticate);
+		python_function_destroy(&this_thread->preacct);
+		python_function_destroy(&this_thread->accounting);
+		python_function_destroy(&this_thread->pre_proxy);
+		python_function_destroy(&this_thread->post_proxy);
+		python_function_destroy(&this_thread->post_auth);
+#ifdef WITH_COA
+		python_function_destroy(&this_thread->recv_coa);
+		python_function_destroy(&this_thread->send_coa);
+#endif
+		python_function_destroy(&this_thread->detach);
+		Py_CLEAR(this_thread->module);
+
+		python_thread_interpreter_end(this_thread->interpreter);
+
+		return 0;
+	}
+#endif
+
 	PyThreadState_Clear(this_thread->state);
 	PyEval_SaveThread();
 
@@ -0,0 +1,236 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_radius/cache.c
+ * @brief Cache of replies from home servers, for retransmitted requests.
+ *
+ * The server core deals with retransmissions it sees on the same
+ * socket, while the original request is still around.  Anything else
+ * (a retransmission to a different listener, or one after cleanup_delay)
+ * is a new request, and would be proxied again.  This cache remembers
+ * the home server's reply for a short time, so that those requests
+ * can be answered without bothering the home server.
+ *
+ * Entries are keyed by the client's address and port, and the packet
+ * code, ID and Request Authenticator.  Every entry has the same TTL,
+ * so entries expire in the order they were inserted.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/rbtree.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/debug.h>
+
+#include "cache.h"
+
+struct radius_cache_s {
+	rbtree_t		*tree;			//!< Entries, by key.
+	fr_dlist_head_t		expire;			//!< Entries, oldest first.
+	fr_time_delta_t		ttl;			//!< How long entries live for.
+	uint32_t		max_entries;		//!< Oldest entries are removed past this.
+};
+
+struct radius_cache_entry_s {
+	radius_cache_t		*cache;			//!< NULL until the entry is inserted.
+	fr_dlist_t		entry;			//!< In the expiry list.
+
+	fr_ipaddr_t		src_ipaddr;		//!< Of the client.
+	uint16_t		src_port;		//!< Of the client.
+	uint8_t			code;			//!< Of the request.
+	uint8_t			id;			//!< Of the request.
+	uint8_t			vector[RADIUS_AUTH_VECTOR_LENGTH];	//!< Of the request.
+
+	size_t			skip;			//!< Reply attributes which were there before proxying.
+
+	fr_time_t		expires;		//!< When the entry should be removed.
+	rlm_rcode_t		rcode;			//!< Returned by the module.
+	unsigned int		reply_code;		//!< Of the reply.
+	VALUE_PAIR		*vps;			//!< Attributes added by the home server.
+};
+
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	radius_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = (a->code > b->code) - (a->code < b->code);
+	if (ret) return ret;
+
+	ret = (a->id > b->id) - (a->id < b->id);
+	if (ret) return ret;
+
+	ret = (a->src_port > b->src_port) - (a->src_port < b->src_port);
+	if (ret) return ret;
+
+	ret = memcmp(a->vector, b->vector, sizeof(a->vector));
+	if (ret) return ret;
+
+	return fr_ipaddr_cmp(&a->src_ipaddr, &b->src_ipaddr);
+}
+
+static int _cache_entry_free(radius_cache_entry_t *entry)
+{
+	if (!entry->cache) return 0;
+
+	fr_dlist_remove(&entry->cache->expire, entry);
+	rbtree_deletebydata(entry->cache->tree, entry);
+
+	return 0;
+}
+
+static void cache_entry_key(radius_cache_entry_t *entry, RADIUS_PACKET const *packet)
+{
+	entry->src_ipaddr = packet->src_ipaddr;
+	entry->src_port = packet->src_port;
+	entry->code = packet->code;
+	entry->id = packet->id;
+	memcpy(entry->vector, packet->vector, sizeof(entry->vector));
+}
+
+/** Remove expired entries
+ *
+ */
+static void cache_expire(radius_cache_t *cache, fr_time_t now)
+{
+	radius_cache_entry_t *entry;
+
+	while ((entry = fr_dlist_head(&cache->expire)) && (entry->expires <= now)) talloc_free(entry);
+}
+
+/** Create a reply cache
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] ttl		How long replies are cached for.
+ * @param[in] max_entries	Maximum number of replies to cache.
+ * @return the new cache.
+ */
+radius_cache_t *radius_cache_alloc(TALLOC_CTX *ctx, fr_time_delta_t ttl, uint32_t max_entries)
+{
+	radius_cache_t *cache;
+
+	MEM(cache = talloc_zero(ctx, radius_cache_t));
+	MEM(cache->tree = rbtree_talloc_create(cache, cache_entry_cmp, radius_cache_entry_t, NULL, RBTREE_FLAG_NONE));
+	fr_dlist_talloc_init(&cache->expire, radius_cache_entry_t, entry);
+	cache->ttl = ttl;
+	cache->max_entries = max_entries;
+
+	return cache;
+}
+
+/** Allocate an entry for a request which is about to be proxied
+ *
+ * The entry is parented by the request, and records which reply
+ * attributes already exist, so that only the ones from the home
+ * server are cached.
+ *
+ * @param[in] request	about to be proxied.
+ * @return the new entry.
+ */
+radius_cache_entry_t *radius_cache_entry_alloc(REQUEST *request)
+{
+	radius_cache_entry_t	*entry;
+	VALUE_PAIR		*vp;
+
+	MEM(entry = talloc_zero(request, radius_cache_entry_t));
+	cache_entry_key(entry, request->packet);
+
+	for (vp = request->reply->vps; vp; vp = vp->next) entry->skip++;
+
+	talloc_set_destructor(entry, _cache_entry_free);
+
+	return entry;
+}
+
+/** Cache the reply to a request
+ *
+ * @param[in] cache	to insert the entry into.
+ * @param[in] entry	from #radius_cache_entry_alloc.  Will be freed
+ *			if the reply can't be cached.
+ * @param[in] request	which was proxied.
+ * @param[in] rcode	the module returned.
+ * @param[in] now	the current time.
+ */
+void radius_cache_insert(radius_cache_t *cache, radius_cache_entry_t *entry,
+			 REQUEST *request, rlm_rcode_t rcode, fr_time_t now)
+{
+	VALUE_PAIR	*vp;
+	size_t		i;
+
+	cache_expire(cache, now);
+
+	/*
+	 *	A duplicate got there first.
+	 */
+	if (rbtree_finddata(cache->tree, entry)) {
+		talloc_free(entry);
+		return;
+	}
+
+	if (fr_dlist_num_elements(&cache->expire) >= cache->max_entries) talloc_free(fr_dlist_head(&cache->expire));
+
+	for (vp = request->reply->vps, i = 0; vp && (i < entry->skip); vp = vp->next, i++);
+
+	if (vp && (fr_pair_list_copy(entry, &entry->vps, vp) < 0)) {
+		talloc_free(entry);
+		return;
+	}
+
+	entry->rcode = rcode;
+	entry->reply_code = request->reply->code;
+	entry->expires = now + cache->ttl;
+
+	(void) talloc_steal(cache, entry);
+	if (!rbtree_insert(cache->tree, entry)) {
+		talloc_free(entry);
+		return;
+	}
+	fr_dlist_insert_tail(&cache->expire, entry);
+	entry->cache = cache;
+}
+
+/** Answer a request from the cache
+ *
+ * @param[out] rcode	the module returned for the original request.
+ * @param[in] cache	to search.
+ * @param[in] request	to answer.
+ * @param[in] now	the current time.
+ * @return
+ *	- true if the request was answered.
+ *	- false if there's no cached reply.
+ */
+bool radius_cache_reply(rlm_rcode_t *rcode, radius_cache_t *cache, REQUEST *request, fr_time_t now)
+{
+	radius_cache_entry_t	find, *entry;
+
+	cache_expire(cache, now);
+
+	cache_entry_key(&find, request->packet);
+
+	entry = rbtree_finddata(cache->tree, &find);
+	if (!entry) return false;
+
+	if (entry->vps && (fr_pair_list_copy(request->reply, &request->reply->vps, entry->vps) < 0)) return false;
+
+	request->reply->code = entry->reply_code;
+	*rcode = entry->rcode;
+
+	return true;
+}
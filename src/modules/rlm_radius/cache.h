@@ -0,0 +1,39 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file cache.h
+ * @brief Cache of replies from home servers, for retransmitted requests.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+#include "rlm_radius.h"
+
+typedef struct radius_cache_s radius_cache_t;
+typedef struct radius_cache_entry_s radius_cache_entry_t;
+
+radius_cache_t		*radius_cache_alloc(TALLOC_CTX *ctx, fr_time_delta_t ttl, uint32_t max_entries);
+
+radius_cache_entry_t	*radius_cache_entry_alloc(REQUEST *request);
+
+void			radius_cache_insert(radius_cache_t *cache, radius_cache_entry_t *entry,
+					    REQUEST *request, rlm_rcode_t rcode, fr_time_t now);
+
+bool			radius_cache_reply(rlm_rcode_t *rcode, radius_cache_t *cache, REQUEST *request, fr_time_t now);
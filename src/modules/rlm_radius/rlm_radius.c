@@ -31,6 +31,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/dlist.h>
 
 #include "rlm_radius.h"
+#include "cache.h"
 
 static int transport_parse(TALLOC_CTX *ctx, void *out, UNUSED void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 static int type_parse(TALLOC_CTX *ctx, void *out, UNUSED void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
@@ -53,6 +54,13 @@ static CONF_PARSER const status_check_update_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static CONF_PARSER const response_cache_config[] = {
+	{ FR_CONF_OFFSET("ttl", FR_TYPE_TIME_DELTA, rlm_radius_t, cache_ttl) },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_radius_t, cache_max_entries), .dflt = STRINGIFY(4096) },
+
+	CONF_PARSER_TERMINATOR
+};
+
 /*
  *	Retransmission intervals for the packets we support.
  */
@@ -113,6 +121,8 @@ static CONF_PARSER const module_config[] = {
 
 	{ FR_CONF_OFFSET("originate", FR_TYPE_BOOL, rlm_radius_t, originate) },
 
+	{ FR_CONF_OFFSET("extended_id", FR_TYPE_BOOL, rlm_radius_t, extended_id) },
+
 	{ FR_CONF_POINTER("status_check", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) status_check_config },
 
 	{ FR_CONF_OFFSET("max_attributes", FR_TYPE_UINT32, rlm_radius_t, max_attributes), .dflt = STRINGIFY(RADIUS_MAX_ATTRIBUTES) },
@@ -121,6 +131,8 @@ static CONF_PARSER const module_config[] = {
 
 	{ FR_CONF_OFFSET("revive_interval", FR_TYPE_TIME_DELTA, rlm_radius_t, revive_interval) },
 
+	{ FR_CONF_POINTER("response_cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) response_cache_config },
+
 	{ FR_CONF_OFFSET("pool", FR_TYPE_SUBSECTION, rlm_radius_t, trunk_conf), .subcs = (void const *) fr_trunk_config, },
 
 	CONF_PARSER_TERMINATOR
@@ -385,11 +397,43 @@ static void mod_radius_signal(void *instance, void *thread, REQUEST *request, vo
  *
  */
 static rlm_rcode_t mod_radius_resume(void *instance, void *thread, REQUEST *request, void *ctx)
+{
+	rlm_radius_t const *inst = talloc_get_type_abort_const(instance, rlm_radius_t);
+	rlm_radius_thread_t *t = talloc_get_type_abort(thread, rlm_radius_thread_t);
+	radius_cache_entry_t *entry;
+	rlm_rcode_t rcode;
+
+	rcode = inst->io->resume(request, inst->io_instance, t->io_thread, ctx);
+
+	if (!t->cache) return rcode;
+
+	entry = request_data_get(request, inst, 0);
+	if (!entry) return rcode;
+
+	/*
+	 *	Only cache real replies from the home server.
+	 */
+	if ((rcode == RLM_MODULE_FAIL) || !request->reply->code) {
+		talloc_free(entry);
+		return rcode;
+	}
+
+	radius_cache_insert(t->cache, entry, request, rcode, fr_time());
+
+	return rcode;
+}
+
+/** Report how busy the home server is
+ *
+ */
+static uint64_t mod_radius_load(void const *instance, void *thread)
 {
 	rlm_radius_t const *inst = talloc_get_type_abort_const(instance, rlm_radius_t);
 	rlm_radius_thread_t *t = talloc_get_type_abort(thread, rlm_radius_thread_t);
 
-	return inst->io->resume(request, inst->io_instance, t->io_thread, ctx);
+	if (!inst->io->load_score) return MODULE_LOAD_UNAVAILABLE;
+
+	return inst->io->load_score(inst->io_instance, t->io_thread);
 }
 
 /** Do any RADIUS-layer fixups for proxying.
@@ -475,6 +519,22 @@ static rlm_rcode_t CC_HINT(nonnull) mod_process(void *instance, void *thread, RE
 	 */
 	radius_fixups(inst, request);
 
+	/*
+	 *	The client retransmitted a request which we've
+	 *	already proxied, and which the server core didn't
+	 *	catch.  Answer it without bothering the home server.
+	 */
+	if (t->cache) {
+		if (radius_cache_reply(&rcode, t->cache, request, fr_time())) {
+			fr_metric_inc(t->cache_hits, 1);
+			RDEBUG2("Found cached reply to duplicate request, not proxying");
+			return rcode;
+		}
+		fr_metric_inc(t->cache_misses, 1);
+
+		(void) request_data_add(request, inst, 0, radius_cache_entry_alloc(request), true, true, false);
+	}
+
 	/*
 	 *	Push the request and it's data to the IO submodule.
 	 *
@@ -521,6 +581,12 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
 
 	t->inst = instance;
 
+	if (inst->cache_ttl) {
+		t->cache = radius_cache_alloc(t, inst->cache_ttl, inst->cache_max_entries);
+		t->cache_hits = fr_metric_series(inst->cache_metric, inst->cache_labels[0]);
+		t->cache_misses = fr_metric_series(inst->cache_metric, inst->cache_labels[1]);
+	}
+
 	/*
 	 *	Allocate thread-specific data.  The connections should
 	 *	live here.
@@ -555,10 +621,26 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
  *	- 0 on success.
  *	- -1 on failure.
  */
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_radius_t *inst = talloc_get_type_abort(instance, rlm_radius_t);
 
+	if (inst->cache_ttl) {
+		char buffer[128];
+
+		inst->cache_metric = fr_metric_register("freeradius_radius_response_cache",
+							"Requests answered from the response cache, or proxied.",
+							FR_METRIC_COUNTER);
+		if (!inst->cache_metric) {
+			cf_log_perr(conf, "Failed registering metrics");
+			return -1;
+		}
+
+		fr_metric_label_escape(buffer, sizeof(buffer), inst->name);
+		inst->cache_labels[0] = talloc_typed_asprintf(inst, "instance=\"%s\",result=\"hit\"", buffer);
+		inst->cache_labels[1] = talloc_typed_asprintf(inst, "instance=\"%s\",result=\"miss\"", buffer);
+	}
+
 	if (inst->io->instantiate && inst->io->instantiate(inst->io_instance, inst->io_conf) < 0) return -1;
 
 	return 0;
@@ -582,13 +664,50 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
 
+	/*
+	 *	Extended IDs are negotiated via Status-Server, and
+	 *	only make sense if we're reading the replies.
+	 */
+	if (inst->extended_id) {
+		if (inst->replicate) {
+			cf_log_err(conf, "Cannot use 'extended_id = true' with 'replicate = true'");
+			return -1;
+		}
+
+		if (inst->status_check != FR_CODE_STATUS_SERVER) {
+			cf_log_err(conf, "Using 'extended_id = true' requires 'status_check { type = Status-Server }'");
+			return -1;
+		}
+	}
+
 	/*
 	 *	These limits are specific to RADIUS, and cannot be over-ridden
+	 *
+	 *	Without extended IDs, each connection only has 256 IDs.
 	 */
 	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, >=, 2);
-	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, <=, 255);
+	if (inst->extended_id) {
+		FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, <=, 65535);
+	} else {
+		FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, <=, 255);
+	}
 	FR_INTEGER_BOUND_CHECK("trunk.per_connection_target", inst->trunk_conf.target_req_per_conn, <=, inst->trunk_conf.max_req_per_conn / 2);
 
+	/*
+	 *	Cached replies must expire before the client gives
+	 *	up, and stops retransmitting.
+	 */
+	if (inst->cache_ttl) {
+		if (inst->replicate) {
+			cf_log_err(conf, "Cannot use 'response_cache' with 'replicate = true'");
+			return -1;
+		}
+
+		FR_TIME_DELTA_BOUND_CHECK("response_cache.ttl", inst->cache_ttl, <=, fr_time_delta_from_sec(30));
+		FR_INTEGER_BOUND_CHECK("response_cache.max_entries", inst->cache_max_entries, >=, 1);
+		FR_INTEGER_BOUND_CHECK("response_cache.max_entries", inst->cache_max_entries, <=, 1 << 20);
+	}
+
 	FR_TIME_DELTA_BOUND_CHECK("zombie_period", inst->zombie_period, >=, fr_time_delta_from_sec(1));
 	FR_TIME_DELTA_BOUND_CHECK("zombie_period", inst->zombie_period, <=, fr_time_delta_from_sec(120));
 
@@ -809,4 +928,5 @@ module_t rlm_radius = {
                 { CF_IDENT_ANY,       CF_IDENT_ANY,   mod_process },
                 MODULE_NAME_TERMINATOR
         },
+	.load_score	= mod_radius_load,
 };
@@ -42,6 +42,10 @@ typedef struct rlm_radius_io_s rlm_radius_io_t;
 typedef struct {
 	rlm_radius_t const	*inst;			//!< Instance of the module.
 	void			*io_thread;		//!< thread context for the IO submodule
+
+	struct radius_cache_s	*cache;			//!< Replies to retransmitted requests.
+	fr_metric_series_t	*cache_hits;		//!< Requests answered from the cache.
+	fr_metric_series_t	*cache_misses;		//!< Requests which were proxied.
 } rlm_radius_thread_t;
 
 /*
@@ -63,9 +67,16 @@ struct rlm_radius_s {
 	bool			originate;  		//!< Originating packets, instead of proxying existing ones.
 							///< Controls whether Proxy-State is added to the outbound
 							///< request.
+	bool			extended_id;		//!< Negotiate extended IDs with Status-Server, so
+							///< that a connection can carry more than 256 packets.
 
 	uint32_t		max_attributes;   	//!< Maximum number of attributes to decode in response.
 
+	fr_time_delta_t		cache_ttl;		//!< How long to cache replies for.  0 disables the cache.
+	uint32_t		cache_max_entries;	//!< Per thread.
+	char const		*cache_labels[2];	//!< For the hit and miss metric series.
+	fr_metric_t		*cache_metric;		//!< Requests answered from the cache, or proxied.
+
 	uint32_t		proxy_state;  		//!< Unique ID (mostly) of this module.
 	uint32_t		*types;			//!< array of allowed packet types
 	uint32_t		status_check;  		//!< code of status-check type
@@ -84,6 +95,11 @@ struct rlm_radius_s {
  */
 typedef rlm_rcode_t (*rlm_radius_io_enqueue_t)(void **rctx, void *instance, void *thread, REQUEST *request);
 
+/** Report how busy the home server is, see #module_load_t
+ *
+ */
+typedef uint64_t (*rlm_radius_io_load_t)(void const *instance, void *thread);
+
 /** Public structure describing an I/O path for an outgoing socket.
  *
  * This structure is exported by client I/O modules e.g. rlm_radius_udp.
@@ -96,4 +112,5 @@ struct rlm_radius_io_s {
 	rlm_radius_io_enqueue_t		enqueue;	//!< Enqueue a REQUEST with an IO submodule.
 	fr_unlang_module_signal_t	signal;		//!< Send a signal to an IO module.
 	fr_unlang_module_resume_t	resume;		//!< Resume a request, and get rcode.
+	rlm_radius_io_load_t		load_score;	//!< Report how busy the home server is.
 };
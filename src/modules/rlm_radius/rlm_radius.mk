@@ -1,5 +1,5 @@
 TARGET		:= rlm_radius.a
 
-SOURCES		:= rlm_radius.c
+SOURCES		:= rlm_radius.c cache.c
 
 TGT_PREREQS	:= libfreeradius-radius.a libfreeradius-util.a
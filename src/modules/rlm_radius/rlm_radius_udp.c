@@ -39,6 +39,12 @@ RCSID("$Id$")
 #include "rlm_radius.h"
 #include "track.h"
 
+/*
+ *	Smoothed reply times, as an EWMA with alpha = 1/8
+ */
+#define IALPHA (8)
+#define RTT(_old, _new) ((_new + ((IALPHA - 1) * _old)) / IALPHA)
+
 /** Static configuration for the module.
  *
  */
@@ -72,6 +78,8 @@ typedef struct {
 	rlm_radius_udp_t const	*inst;			//!< our instance
 
 	fr_trunk_t		*trunk;			//!< trunk handler
+
+	fr_time_delta_t		rtt;			//!< Smoothed time the home server takes to reply.
 } udp_thread_t;
 
 typedef struct {
@@ -149,6 +157,7 @@ struct udp_request_s {
 	bool			require_ma;		//!< saved from the original packet.
 	bool			can_retransmit;		//!< can we retransmit this packet?
 	bool			status_check;		//!< is this packet a status check?
+	bool			extended_id;		//!< ask for the Request Authenticator to be echoed.
 
 	VALUE_PAIR		*extra;			//!< VPs for debugging, like Proxy-State.
 
@@ -201,6 +210,7 @@ static fr_dict_attr_t const *attr_extended_attribute_1;
 static fr_dict_attr_t const *attr_message_authenticator;
 static fr_dict_attr_t const *attr_nas_identifier;
 static fr_dict_attr_t const *attr_original_packet_code;
+static fr_dict_attr_t const *attr_original_request_authenticator;
 static fr_dict_attr_t const *attr_proxy_state;
 static fr_dict_attr_t const *attr_response_length;
 static fr_dict_attr_t const *attr_user_password;
@@ -215,6 +225,7 @@ fr_dict_attr_autoload_t rlm_radius_udp_dict_attr[] = {
 	{ .out = &attr_message_authenticator, .name = "Message-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
 	{ .out = &attr_nas_identifier, .name = "NAS-Identifier", .type = FR_TYPE_STRING, .dict = &dict_radius},
 	{ .out = &attr_original_packet_code, .name = "Original-Packet-Code", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_original_request_authenticator, .name = "FreeRADIUS-Original-Request-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
 	{ .out = &attr_proxy_state, .name = "Proxy-State", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
 	{ .out = &attr_response_length, .name = "Response-Length", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ .out = &attr_user_password, .name = "User-Password", .type = FR_TYPE_STRING, .dict = &dict_radius},
@@ -348,6 +359,12 @@ static void CC_HINT(nonnull) status_check_alloc(fr_event_list_t *el, udp_handle_
 	u->priority = ~(uint32_t) 0;
 	u->status_check = true;
 
+	/*
+	 *	Negotiate extended IDs.  If the home server echoes the
+	 *	attribute back, it supports them.
+	 */
+	u->extended_id = inst->parent->extended_id;
+
 	/*
 	 *	Allocate outside of the free list.
 	 *	There appears to be an issue where
@@ -522,6 +539,48 @@ static void conn_status_check_again(fr_event_list_t *el, UNUSED fr_time_t now, v
 /** Read the incoming status-check response.  If it's correct mark the connection as connected
  *
  */
+/** Find FreeRADIUS-Original-Request-Authenticator in a reply
+ *
+ * This is called before the reply is validated, so it checks the
+ * lengths itself.  The caller still has to verify the reply.
+ *
+ * @param[in] packet		the reply.
+ * @param[in] packet_len	the amount of data read.
+ * @return
+ *	- The Request Authenticator of the original request.
+ *	- NULL if the reply doesn't contain one.
+ */
+static uint8_t const *original_request_authenticator(uint8_t const *packet, size_t packet_len)
+{
+	uint8_t const	*attr, *end;
+	uint32_t	vendor = htonl(fr_dict_vendor_num_by_da(attr_original_request_authenticator));
+	size_t		len;
+
+	if (packet_len < RADIUS_HEADER_LENGTH) return NULL;
+
+	len = (packet[2] << 8) | packet[3];
+	if (len > packet_len) return NULL;
+	end = packet + len;
+
+	for (attr = packet + RADIUS_HEADER_LENGTH;
+	     (attr + 2) <= end;
+	     attr += attr[1]) {
+		if (attr[1] < 2) return NULL;
+
+		if ((attr[0] != FR_VENDOR_SPECIFIC) || (attr[1] != (RADIUS_AUTH_VECTOR_LENGTH + 8))) continue;
+
+		if ((attr + attr[1]) > end) return NULL;
+
+		if ((memcmp(attr + 2, &vendor, 4) != 0) ||
+		    (attr[6] != (uint8_t) attr_original_request_authenticator->attr) ||
+		    (attr[7] != (RADIUS_AUTH_VECTOR_LENGTH + 2))) continue;
+
+		return attr + 8;
+	}
+
+	return NULL;
+}
+
 static void conn_readable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
 {
 	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
@@ -578,6 +637,23 @@ static void conn_readable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSE
 
 	fr_pair_list_free(&reply);	/* FIXME - Do something with these... */
 
+	/*
+	 *	If we asked for extended IDs, the home server has to
+	 *	support them.  Otherwise we could have more packets
+	 *	outstanding on this connection than there are IDs.
+	 */
+	if (u->extended_id) {
+		if (!original_request_authenticator(h->buffer, (size_t) slen)) {
+			ERROR("%s - Home server does not support extended IDs.  Set 'extended_id = false' - %s",
+			      h->module_name, h->name);
+			fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		DEBUG2("%s - Using extended IDs on connection %s", h->module_name, h->name);
+		radius_track_use_authenticator(h->tt, true);
+	}
+
 	/*
 	 *	Process the error, and count this as a success.
 	 *	This is usually used for dynamic configuration
@@ -1270,6 +1346,7 @@ static int encode(rlm_radius_udp_t const *inst, REQUEST *request, udp_request_t
 	uint8_t			*msg = NULL;
 	int			message_authenticator = u->require_ma * (RADIUS_MESSAGE_AUTHENTICATOR_LENGTH + 2);
 	int			proxy_state = 6;
+	int			extended_id = u->extended_id * (RADIUS_AUTH_VECTOR_LENGTH + 8);
 
 	fr_assert(inst->parent->allowed[u->code]);
 	fr_assert(!u->packet);
@@ -1342,13 +1419,14 @@ static int encode(rlm_radius_udp_t const *inst, REQUEST *request, udp_request_t
 	 *	We should have at mininum 64-byte packets, so don't
 	 *	bother doing run-time checks here.
 	 */
-	fr_assert(u->packet_len >= (size_t) (RADIUS_HEADER_LENGTH + proxy_state + message_authenticator));
+	fr_assert(u->packet_len >= (size_t) (RADIUS_HEADER_LENGTH + proxy_state + extended_id + message_authenticator));
 
 	/*
-	 *	Encode it, leaving room for Proxy-State and
+	 *	Encode it, leaving room for Proxy-State,
+	 *	FreeRADIUS-Original-Request-Authenticator, and
 	 *	Message-Authenticator if necessary.
 	 */
-	packet_len = fr_radius_encode(u->packet, u->packet_len - (proxy_state + message_authenticator), NULL,
+	packet_len = fr_radius_encode(u->packet, u->packet_len - (proxy_state + extended_id + message_authenticator), NULL,
 				      inst->secret, talloc_array_length(inst->secret) - 1,
 				      u->code, id, request->packet->vps);
 	if (fr_pair_encode_is_error(packet_len)) {
@@ -1363,7 +1441,7 @@ static int encode(rlm_radius_udp_t const *inst, REQUEST *request, udp_request_t
 		size_t have;
 		size_t need;
 
-		have = u->packet_len - (proxy_state + message_authenticator);
+		have = u->packet_len - (proxy_state + extended_id + message_authenticator);
 		need = have - packet_len;
 
 		if (need > RADIUS_MAX_PACKET_SIZE) {
@@ -1379,7 +1457,7 @@ static int encode(rlm_radius_udp_t const *inst, REQUEST *request, udp_request_t
 	/*
 	 *	The encoded packet should NOT over-run the input buffer.
 	 */
-	fr_assert((size_t) (packet_len + proxy_state + message_authenticator) <= u->packet_len);
+	fr_assert((size_t) (packet_len + proxy_state + extended_id + message_authenticator) <= u->packet_len);
 
 	/*
 	 *	Add Proxy-State to the tail end of the packet.
@@ -1429,6 +1507,24 @@ static int encode(rlm_radius_udp_t const *inst, REQUEST *request, udp_request_t
 		fr_pair_add(&u->extra, vp);
 	}
 
+	/*
+	 *	Ask the home server to echo the Request Authenticator
+	 *	back to us, so that we can find the request when many
+	 *	share the same ID.  The value we send doesn't matter.
+	 */
+	if (extended_id) {
+		uint8_t		*attr = u->packet + packet_len;
+		uint32_t	vendor = htonl(fr_dict_vendor_num_by_da(attr_original_request_authenticator));
+
+		attr[0] = FR_VENDOR_SPECIFIC;
+		attr[1] = extended_id;
+		memcpy(attr + 2, &vendor, 4);
+		attr[6] = (uint8_t) attr_original_request_authenticator->attr;
+		attr[7] = RADIUS_AUTH_VECTOR_LENGTH + 2;
+		memset(attr + 8, 0, RADIUS_AUTH_VECTOR_LENGTH);
+		packet_len += extended_id;
+	}
+
 	/*
 	 *	Add Message-Authenticator manually.
 	 *
@@ -1809,6 +1905,7 @@ static void request_mux(fr_event_list_t *el,
 				continue;
 			}
 			u->id = u->rr->id;
+			u->extended_id = h->tt->use_authenticator;
 
 			RDEBUG("Sending %s ID %d length %ld over connection %s",
 			       fr_packet_codes[u->code], u->id, u->packet_len, h->name);
@@ -1828,8 +1925,18 @@ static void request_mux(fr_event_list_t *el,
 			/*
 			 *	Remember the authentication vector, which now has the
 			 *	packet signature.
+			 *
+			 *	With extended IDs, the ID and vector have to be
+			 *	unique, which is only an issue for identical
+			 *	Accounting-Request packets.
 			 */
-			(void) radius_track_entry_update(u->rr, u->packet + RADIUS_AUTH_VECTOR_OFFSET);
+			if (radius_track_entry_update(u->rr, u->packet + RADIUS_AUTH_VECTOR_OFFSET) < 0) {
+				RPERROR("Failed tracking packet");
+				udp_request_reset(u);
+				if (u->ev) (void) fr_event_timer_delete(&u->ev);
+				fr_trunk_request_signal_fail(treq);
+				continue;
+			}
 		} else {
 			RDEBUG("Retransmitting %s ID %d length %ld over connection %s",
 			       fr_packet_codes[u->code], u->id, u->packet_len, h->name);
@@ -1962,7 +2069,7 @@ static void request_mux(fr_event_list_t *el,
 			RDEBUG("%s request.  Expecting response within %u.%03us",
 			       action, msec / 1000, msec % 1000);
 
-			if (fr_event_timer_at(u, el, &u->ev, u->retry.next, request_timeout, treq) < 0) {
+			if (fr_event_timer_coarse_at(u, el, &u->ev, u->retry.next, request_timeout, treq) < 0) {
 				RERROR("Failed inserting retransmit timeout for connection");
 				fr_trunk_request_signal_fail(treq);
 				continue;
@@ -2356,8 +2463,13 @@ static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, U
 		/*
 		 *	Note that we don't care about packet codes.  All
 		 *	packet codes share the same ID space.
+		 *
+		 *	With extended IDs, the reply also tells us the
+		 *	Request Authenticator of the request.
 		 */
-		rr = radius_track_entry_find(h->tt, h->buffer[1], NULL);
+		rr = radius_track_entry_find(h->tt, h->buffer[1],
+					     h->tt->use_authenticator ?
+					     original_request_authenticator(h->buffer, (size_t) slen) : NULL);
 		if (!rr) {
 			WARN("%s - Ignoring reply with ID %i that arrived too late",
 			     h->module_name, h->buffer[1]);
@@ -2379,6 +2491,11 @@ static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, U
 			continue;
 		}
 
+		/*
+		 *	The extended ID is for us, not for the request.
+		 */
+		if (u->extended_id) (void) fr_pair_delete_by_da(&reply, attr_original_request_authenticator);
+
 		/*
 		 *	Only valid packets are processed
 		 *	Otherwise an attacker could perform
@@ -2388,6 +2505,17 @@ static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, U
 		 */
 		h->last_reply = now = fr_time();
 
+		/*
+		 *	Only sample replies to packets which weren't
+		 *	retransmitted, as we can't tell which of the
+		 *	copies the home server is replying to.
+		 */
+		if (u->retry.count == 1) {
+			udp_thread_t *t = h->thread;
+
+			t->rtt = t->rtt ? RTT(t->rtt, now - u->retry.start) : (now - u->retry.start);
+		}
+
 		/*
 		 *	Status-Server can have any reply code, we don't care
 		 *	what it is.  So long as it's signed properly, we
@@ -2588,6 +2716,32 @@ static void request_free(UNUSED REQUEST *request, void *preq_to_free, UNUSED voi
 	talloc_free(u);
 }
 
+/** Report how busy the home server is
+ *
+ * Scores are the smoothed reply time multiplied by the number of
+ * requests waiting on, or sent to, the home server.  So a request
+ * sent here should expect to wait roughly that long for a reply.
+ */
+static uint64_t mod_load(UNUSED void const *instance, void *thread)
+{
+	udp_thread_t	*t = talloc_get_type_abort(thread, udp_thread_t);
+	fr_time_delta_t	rtt;
+
+	if (!t->trunk ||
+	    !fr_trunk_connection_count_by_state(t->trunk, FR_TRUNK_CONN_ACTIVE | FR_TRUNK_CONN_FULL)) {
+		return MODULE_LOAD_UNAVAILABLE;
+	}
+
+	/*
+	 *	Nothing has been sampled yet, so assume all home
+	 *	servers are equally fast.
+	 */
+	rtt = t->rtt ? t->rtt : fr_time_delta_from_msec(1);
+
+	return (uint64_t) rtt * (fr_trunk_request_count_by_state(t->trunk, FR_TRUNK_CONN_ALL,
+								  FR_TRUNK_REQUEST_STATE_ALL) + 1);
+}
+
 /** Resume execution of the request, returning the rcode set during trunk execution
  *
  */
@@ -2912,4 +3066,5 @@ rlm_radius_io_t rlm_radius_udp = {
 	.enqueue		= mod_enqueue,
 	.signal			= mod_signal,
 	.resume			= mod_resume,
+	.load_score		= mod_load,
 };
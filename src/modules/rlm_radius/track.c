@@ -319,12 +319,25 @@ int radius_track_entry_update(radius_track_entry_t *te, uint8_t const *vector)
 	 *	array.  That way if the server responds with
 	 *	Original-Request-Authenticator, we can easily find it.
 	 */
-	if (!rbtree_insert(tt->subtree[te->id], te)) return -1;
+	if (!tt->subtree[te->id]) {
+		MEM(tt->subtree[te->id] = rbtree_talloc_create(tt, te_cmp, radius_track_entry_t,
+							       NULL, RBTREE_FLAG_NONE));
+	}
+
+	if (!rbtree_insert(tt->subtree[te->id], te)) {
+		fr_strerror_printf("Duplicate Request Authenticator for ID %u", te->id);
+		return -1;
+	}
 
 	return 0;
 }
 
 /** Find a tracking entry from a request authenticator
+ *
+ * When extended IDs are in use, many outstanding packets share each
+ * ID, and the reply carries the Request Authenticator of the request
+ * in FreeRADIUS-Original-Request-Authenticator.  The ID and Request
+ * Authenticator together identify the request.
  *
  * @param tt		The radius_track_t tracking table
  * @param packet_id    	The ID from the RADIUS header
@@ -362,7 +375,7 @@ radius_track_entry_t *radius_track_entry_find(radius_track_t *tt, uint8_t packet
 	 */
 	memcpy(&my_te.vector, vector, sizeof(my_te.vector));
 
-	te = rbtree_finddata(tt->subtree[packet_id], &my_te);
+	te = tt->subtree[packet_id] ? rbtree_finddata(tt->subtree[packet_id], &my_te) : NULL;
 
 	/*
 	 *	Not found, the packet MAY have been allocated in the
@@ -391,7 +404,10 @@ radius_track_entry_t *radius_track_entry_find(radius_track_t *tt, uint8_t packet
 		return te;
 	}
 
-	(void) talloc_get_type_abort(te, radius_track_entry_t);
+	/*
+	 *	Entries in the static array are in the subtree, too.
+	 */
+	if (te != &tt->id[te->id]) (void) talloc_get_type_abort(te, radius_track_entry_t);
 	fr_assert(te->request != NULL);
 
 	return te;
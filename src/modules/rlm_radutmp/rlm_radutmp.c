@@ -25,6 +25,7 @@ RCSID("$Id$")
 
 #include	<freeradius-devel/server/base.h>
 #include	<freeradius-devel/server/radutmp.h>
+#include	<freeradius-devel/server/radutmp_db.h>
 #include	<freeradius-devel/server/module.h>
 #include	<freeradius-devel/util/debug.h>
 
@@ -54,6 +55,10 @@ typedef struct {
 	bool		check_nas;
 	uint32_t	permission;
 	bool		caller_id_ok;
+	bool		indexed;
+	uint32_t	max_sessions;
+
+	radutmp_db_t	*db;		//!< The indexed session database, if we're using one.
 } rlm_radutmp_t;
 
 static const CONF_PARSER module_config[] = {
@@ -62,6 +67,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("check_with_nas", FR_TYPE_BOOL, rlm_radutmp_t, check_nas), .dflt = "yes" },
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, rlm_radutmp_t, permission), .dflt = "0644" },
 	{ FR_CONF_OFFSET("caller_id", FR_TYPE_BOOL, rlm_radutmp_t, caller_id_ok), .dflt = "no" },
+	{ FR_CONF_OFFSET("indexed", FR_TYPE_BOOL, rlm_radutmp_t, indexed), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_sessions", FR_TYPE_UINT32, rlm_radutmp_t, max_sessions), .dflt = "65536" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -173,6 +180,145 @@ static NAS_PORT *nas_port_find(NAS_PORT *nas_port_list, uint32_t nasaddr, uint16
 }
 
 
+/*
+ *	Compare the existing entry for a NAS / portno combination
+ *	with the one from the packet.
+ *
+ *	Returns 1 if the entry should be overwritten, 0 if it should
+ *	be ignored, and -1 if the packet conflicts with it.
+ */
+static int radutmp_match(REQUEST *request, char const *nas, int status, struct radutmp *ut, struct radutmp const *u)
+{
+	/*
+	 *	Don't compare stop records to unused entries.
+	 */
+	if (status == FR_STATUS_STOP && u->type == P_IDLE) return 0;
+
+	if ((status == FR_STATUS_STOP) && strncmp(ut->session_id, u->session_id, sizeof(u->session_id)) != 0) {
+		/*
+		 *	Don't complain if this is not a
+		 *	login record (some clients can
+		 *	send _only_ logout records).
+		 */
+		if (u->type == P_LOGIN) {
+			RWDEBUG("Logout entry for NAS %s port %u has wrong ID", nas, u->nas_port);
+		}
+
+		return -1;
+	}
+
+	if ((status == FR_STATUS_START) && strncmp(ut->session_id, u->session_id, sizeof(u->session_id)) == 0  &&
+	    u->time >= ut->time) {
+		if (u->type == P_LOGIN) {
+			RIDEBUG("Login entry for NAS %s port %u duplicate", nas, u->nas_port);
+			return -1;
+		}
+
+		RWDEBUG("Login entry for NAS %s port %u wrong order", nas, u->nas_port);
+		return -1;
+	}
+
+	/*
+	 *	FIXME: the ALIVE record could need some more checking, but anyway I'd
+	 *	rather rewrite this mess -- miquels.
+	 */
+	if ((status == FR_STATUS_ALIVE) && strncmp(ut->session_id, u->session_id, sizeof(u->session_id)) == 0  &&
+	    u->type == P_LOGIN) {
+		/*
+		 *	Keep the original login time.
+		 */
+		ut->time = u->time;
+	}
+
+	return 1;
+}
+
+/*
+ *	Get a handle for the indexed session database.
+ *
+ *	The filename may be dynamically expanded, so reopen the
+ *	database if it's changed since the last packet.
+ */
+static radutmp_db_t *radutmp_db_get(REQUEST *request, rlm_radutmp_t *inst, char const *filename)
+{
+	if (inst->db && (strcmp(radutmp_db_filename(inst->db), filename) == 0)) return inst->db;
+
+	TALLOC_FREE(inst->db);
+
+	inst->db = radutmp_db_open(inst, filename, true, inst->max_sessions, inst->permission);
+	if (!inst->db) RPERROR("Failed opening session database");
+
+	return inst->db;
+}
+
+/*
+ *	Store logins in the indexed session database.
+ */
+static rlm_rcode_t radutmp_db_accounting(REQUEST *request, rlm_radutmp_t *inst, char const *filename,
+					 char const *nas, int status, struct radutmp *ut)
+{
+	radutmp_db_t	*db;
+	struct radutmp	u;
+	rlm_rcode_t	rcode = RLM_MODULE_OK;
+	int		r;
+
+	db = radutmp_db_get(request, inst, filename);
+	if (!db) return RLM_MODULE_FAIL;
+
+	if (radutmp_db_lock(db) < 0) {
+		RPERROR("Error acquiring lock");
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	Zap all users on the NAS.
+	 */
+	if ((status == FR_STATUS_ACCOUNTING_ON) || (status == FR_STATUS_ACCOUNTING_OFF)) {
+		RDEBUG2("Zapped %i session(s)", radutmp_db_zap(db, ut->nas_address, ut->time));
+		goto finish;
+	}
+
+	/*
+	 *	Find the entry for this NAS / portno combination.
+	 */
+	r = radutmp_db_port_find(&u, db, ut->nas_address, ut->nas_port);
+	if (r < 0) {
+	fail:
+		RPERROR("Failed updating session database");
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+	if (r > 0) r = radutmp_match(request, nas, status, ut, &u);
+
+	/*
+	 *	Found the entry, do start/update it with
+	 *	the information from the packet.
+	 */
+	if ((r >= 0) && (status == FR_STATUS_START || status == FR_STATUS_ALIVE)) {
+		ut->type = P_LOGIN;
+		if (radutmp_db_port_update(db, ut) < 0) goto fail;
+	}
+
+	/*
+	 *	The user has logged off, mark the entry as idle.
+	 */
+	if (status == FR_STATUS_STOP) {
+		if (r > 0) {
+			u.type = P_IDLE;
+			u.time = ut->time;
+			u.delay = ut->delay;
+			if (radutmp_db_port_update(db, &u) < 0) goto fail;
+		} else if (r == 0) {
+			RWDEBUG("Logout for NAS %s port %u, but no Login record", nas, ut->nas_port);
+		}
+	}
+
+finish:
+	radutmp_db_unlock(db);
+
+	return rcode;
+}
+
 /*
  *	Store logins in the RADIUS utmp file.
  */
@@ -337,14 +483,22 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 	 */
 	if (status == FR_STATUS_ACCOUNTING_ON && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s restarted (Accounting-On packet seen)", nas);
-		rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		if (inst->indexed) {
+			rcode = radutmp_db_accounting(request, inst, filename, nas, status, &ut);
+		} else {
+			rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		}
 
 		goto finish;
 	}
 
 	if (status == FR_STATUS_ACCOUNTING_OFF && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s rebooted (Accounting-Off packet seen)", nas);
-		rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		if (inst->indexed) {
+			rcode = radutmp_db_accounting(request, inst, filename, nas, status, &ut);
+		} else {
+			rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		}
 
 		goto finish;
 	}
@@ -391,6 +545,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 		goto finish;
 	}
 
+	if (inst->indexed) {
+		rcode = radutmp_db_accounting(request, inst, filename, nas, status, &ut);
+		goto finish;
+	}
+
 	/*
 	 *	Enter into the radutmp file.
 	 */
@@ -430,51 +589,9 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 			continue;
 		}
 
-		/*
-		 *	Don't compare stop records to unused entries.
-		 */
-		if (status == FR_STATUS_STOP && u.type == P_IDLE) {
-			continue;
-		}
-
-		if ((status == FR_STATUS_STOP) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) != 0) {
-			/*
-			 *	Don't complain if this is not a
-			 *	login record (some clients can
-			 *	send _only_ logout records).
-			 */
-			if (u.type == P_LOGIN) {
-				RWDEBUG("Logout entry for NAS %s port %u has wrong ID", nas, u.nas_port);
-			}
-
-			r = -1;
-			break;
-		}
-
-		if ((status == FR_STATUS_START) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) == 0  &&
-		    u.time >= ut.time) {
-			if (u.type == P_LOGIN) {
-				RIDEBUG("Login entry for NAS %s port %u duplicate", nas, u.nas_port);
-				r = -1;
-				break;
-			}
-
-			RWDEBUG("Login entry for NAS %s port %u wrong order", nas, u.nas_port);
-			r = -1;
-			break;
-		}
-
-		/*
-		 *	FIXME: the ALIVE record could need some more checking, but anyway I'd
-		 *	rather rewrite this mess -- miquels.
-		 */
-		if ((status == FR_STATUS_ALIVE) && strncmp(ut.session_id, u.session_id, sizeof(u.session_id)) == 0  &&
-		    u.type == P_LOGIN) {
-			/*
-			 *	Keep the original login time.
-			 */
-			ut.time = u.time;
-		}
+		r = radutmp_match(request, nas, status, &ut, &u);
+		if (r == 0) continue;
+		if (r < 0) break;
 
 		if (lseek(fd, -(off_t)sizeof(u), SEEK_CUR) < 0) {
 			RWDEBUG("negative lseek!");
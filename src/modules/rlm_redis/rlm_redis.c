@@ -35,11 +35,8 @@ RCSID("$Id$")
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
-
-static CONF_PARSER module_config[] = {
-	REDIS_COMMON_CONFIG,
-	CONF_PARSER_TERMINATOR
-};
+#include <freeradius-devel/redis/pipeline.h>
+#include <freeradius-devel/unlang/base.h>
 
 /** rlm_redis module instance
  *
@@ -50,9 +47,35 @@ typedef struct {
 
 	char const		*name;		//!< Instance name.
 
+	bool			pipeline;	//!< Send xlat commands over pipelined connections
+						//!< instead of blocking on the connection pool.
+	fr_trunk_conf_t		trunk_conf;	//!< For the pipelined connections.
+
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
 } rlm_redis_t;
 
+/** Thread specific data for rlm_redis
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster;	//!< Pipelined connections to the cluster's nodes.
+} rlm_redis_thread_t;
+
+/** Module and thread instance used by the pipelined xlat
+ *
+ */
+typedef struct {
+	rlm_redis_t const	*inst;		//!< Module instance.
+	rlm_redis_thread_t	*t;		//!< Module thread instance.
+} redis_xlat_thread_inst_t;
+
+static CONF_PARSER module_config[] = {
+	REDIS_COMMON_CONFIG,
+	{ FR_CONF_OFFSET("pipeline", FR_TYPE_BOOL, rlm_redis_t, pipeline), .dflt = "no" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_redis_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+	CONF_PARSER_TERMINATOR
+};
+
 /** Change the state of a connection to READONLY execute a command and switch to READWRITE
  *
  * @param[out] status_out Where to write the status from the command.
@@ -280,6 +303,377 @@ static xlat_action_t redis_node_xlat(TALLOC_CTX *ctx, fr_cursor_t *out,
 }
 
 
+/** Key used to select the node for a command
+ *
+ * If we've got multiple arguments, the second one is usually the key.
+ * The Redis docs say commands should be analysed first to get key
+ * positions, but this involves sending them to the server, which is
+ * just as expensive as sending them to the wrong server and receiving
+ * a redirect.
+ */
+static inline void redis_command_key(uint8_t const **key, size_t *key_len, int argc, char const **argv)
+{
+	if (argc > 1) {
+		*key = (uint8_t const *)argv[1];
+		*key_len = strlen(argv[1]);
+		return;
+	}
+
+	*key = NULL;
+	*key_len = 0;
+}
+
+static inline void redis_command_print(REQUEST *request, int argc, char const **argv)
+{
+	RDEBUG2("Executing command: %s", argv[0]);
+	if (argc > 1) {
+		RDEBUG2("With arguments");
+		RINDENT();
+		for (int i = 1; i < argc; i++) RDEBUG2("[%i] %s", i, argv[i]);
+		REXDENT();
+	}
+}
+
+/** Execute a command on the node serving its key, following redirects
+ *
+ * @param[out] out		Where to write the reply.
+ * @param[in] inst		of rlm_redis.
+ * @param[in] request		The current request.
+ * @param[in] read_only		Prefer slaves, and set the connection to READONLY.
+ * @param[in] argc		Redis command argument count.
+ * @param[in] argv		Redis command arguments.
+ * @return status of the command.
+ */
+static fr_redis_rcode_t redis_command(redisReply **out, rlm_redis_t const *inst, REQUEST *request,
+				      bool read_only, int argc, char const **argv)
+{
+	fr_redis_conn_t			*conn;
+	fr_redis_cluster_state_t	state;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL;
+	fr_redis_rcode_t		s_ret;
+	uint8_t const			*key;
+	size_t				key_len;
+
+	redis_command_key(&key, &key_len, argc, argv);
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, read_only);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
+		redis_command_print(request, argc, argv);
+		if (!read_only) {
+			reply = redisCommandArgv(conn->handle, argc, argv, NULL);
+			status = fr_redis_command_status(conn, reply);
+		} else if (redis_command_read_only(&status, &reply, request, conn, argc, argv) == -2) {
+			state.close_conn = true;
+		}
+	}
+
+	*out = reply;
+
+	return s_ret;
+}
+
+/** Convert a reply into an xlat output value
+ *
+ * @return
+ *	- The value.
+ *	- NULL if the reply wasn't a value.
+ */
+static fr_value_box_t *redis_reply_to_box(TALLOC_CTX *ctx, REQUEST *request, redisReply *reply)
+{
+	fr_value_box_t	*vb;
+
+	switch (reply->type) {
+	case REDIS_REPLY_INTEGER:
+		MEM(vb = fr_value_box_alloc_null(ctx));
+		fr_value_box_asprintf(vb, vb, NULL, false, "%lld", reply->integer);
+		break;
+
+	case REDIS_REPLY_STATUS:
+	case REDIS_REPLY_STRING:
+		MEM(vb = fr_value_box_alloc_null(ctx));
+		fr_value_box_bstrndup(vb, vb, NULL, reply->str, reply->len, true);
+		break;
+
+	default:
+		REDEBUG("Server returned non-value type \"%s\"",
+			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
+		return NULL;
+	}
+
+	return vb;
+}
+
+/** Asynchronous xlat state
+ *
+ */
+typedef struct {
+	fr_redis_command_set_t	*cmds;		//!< Command in flight, NULL once the trunk has
+						//!< called us back.
+	bool			node_override;	//!< The command was sent to a specific node.
+	bool			read_only;	//!< Prefer slaves if the command has to be retried.
+
+	int			argc;		//!< Number of arguments.
+	char const		*argv[MAX_REDIS_ARGS];	//!< Arguments, pointing into argv_buf.
+	char			argv_buf[MAX_REDIS_COMMAND_LEN];
+
+	fr_redis_rcode_t	status;		//!< Of the command.
+	fr_value_box_t		*result;	//!< Value returned by the command.
+} redis_xlat_rctx_t;
+
+/** Record the reply to a pipelined xlat command
+ *
+ * The reply is freed with the command set, so it's converted here.
+ */
+static void redis_xlat_complete(REQUEST *request, fr_dlist_head_t *completed, void *uctx)
+{
+	redis_xlat_rctx_t	*rctx = talloc_get_type_abort(uctx, redis_xlat_rctx_t);
+	redisReply		*reply;
+
+	rctx->cmds = NULL;	/* Freed by the trunk */
+
+	rctx->status = fr_redis_command_reply(&reply, request, fr_dlist_head(completed));
+	if (reply && RDEBUG_ENABLED3) fr_redis_reply_print(L_DBG_LVL_3, reply, request, 0);
+
+	if (rctx->status == REDIS_RCODE_SUCCESS) {
+		rctx->result = redis_reply_to_box(rctx, request, reply);
+		if (!rctx->result) rctx->status = REDIS_RCODE_ERROR;
+	}
+
+	unlang_interpret_resumable(request);
+}
+
+/** Record that a pipelined xlat command couldn't be sent
+ *
+ */
+static void redis_xlat_fail(REQUEST *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	redis_xlat_rctx_t	*rctx = talloc_get_type_abort(uctx, redis_xlat_rctx_t);
+
+	rctx->cmds = NULL;	/* Freed by the trunk */
+	rctx->status = REDIS_RCODE_RECONNECT;
+
+	unlang_interpret_resumable(request);
+}
+
+/** Return the result of a pipelined xlat command
+ *
+ */
+static xlat_action_t redis_pipeline_xlat_resume(TALLOC_CTX *ctx, fr_cursor_t *out,
+						REQUEST *request, UNUSED void const *xlat_inst, void *xlat_thread_inst,
+						UNUSED fr_value_box_t **in, void *rctx)
+{
+	redis_xlat_thread_inst_t	*xt = talloc_get_type_abort(xlat_thread_inst, redis_xlat_thread_inst_t);
+	redis_xlat_rctx_t		*our_rctx = talloc_get_type_abort(rctx, redis_xlat_rctx_t);
+	xlat_action_t			xa = XLAT_ACTION_DONE;
+	redisReply			*reply = NULL;
+	fr_value_box_t			*vb;
+
+	switch (our_rctx->status) {
+	case REDIS_RCODE_SUCCESS:
+		fr_cursor_append(out, talloc_steal(ctx, our_rctx->result));
+		break;
+
+	default:
+		if (!fr_redis_trunk_retry(our_rctx->status)) {
+			xa = XLAT_ACTION_FAIL;
+			break;
+		}
+
+		if (our_rctx->node_override) {
+			REDEBUG("Command failed on the specified node");
+			xa = XLAT_ACTION_FAIL;
+			break;
+		}
+
+		RDEBUG2("Pipelined command failed, retrying");
+		if (redis_command(&reply, xt->inst, request, our_rctx->read_only,
+				  our_rctx->argc, our_rctx->argv) != REDIS_RCODE_SUCCESS) {
+			xa = XLAT_ACTION_FAIL;
+			break;
+		}
+		if (!fr_cond_assert(reply)) {
+			xa = XLAT_ACTION_FAIL;
+			break;
+		}
+
+		vb = redis_reply_to_box(ctx, request, reply);
+		if (!vb) {
+			xa = XLAT_ACTION_FAIL;
+			break;
+		}
+		fr_cursor_append(out, vb);
+		break;
+	}
+
+	fr_redis_reply_free(&reply);
+	talloc_free(our_rctx);
+
+	return xa;
+}
+
+/** Stop a pipelined xlat command if the request is cancelled
+ *
+ */
+static void redis_pipeline_xlat_signal(UNUSED REQUEST *request, UNUSED void *xlat_inst,
+				       UNUSED void *xlat_thread_inst, void *rctx, fr_state_signal_t action)
+{
+	redis_xlat_rctx_t	*our_rctx = talloc_get_type_abort(rctx, redis_xlat_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (our_rctx->cmds) {
+		fr_redis_command_set_cancel(our_rctx->cmds);	/* Trunk frees the command set */
+		our_rctx->cmds = NULL;
+	}
+	talloc_free(our_rctx);
+}
+
+/** Xlat to make calls to redis, without blocking the worker
+ *
+ * Used instead of #redis_xlat when `pipeline = yes`.  The command is sent
+ * over this thread's pipelined connections to the node serving its key,
+ * along with the commands of other requests.
+ *
+ * The input has already been expanded, so it's split into arguments
+ * without any further expansion.  Arguments which may contain spaces
+ * must be quoted.
+ *
+@verbatim
+%{redis:[-][@<host>[:port]] <redis command>}
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t redis_pipeline_xlat(TALLOC_CTX *ctx, UNUSED fr_cursor_t *out,
+					 REQUEST *request, UNUSED void const *xlat_inst, void *xlat_thread_inst,
+					 fr_value_box_t **in)
+{
+	redis_xlat_thread_inst_t	*xt = talloc_get_type_abort(xlat_thread_inst, redis_xlat_thread_inst_t);
+	rlm_redis_t const		*inst = xt->inst;
+	redis_xlat_rctx_t		*rctx;
+	fr_redis_command_set_t		*cmds;
+	fr_redis_trunk_t		*trunk;
+	fr_ipaddr_t			ipaddr;
+	uint16_t			port;
+	char const			*p, *q;
+
+	if (!in) {
+		REDEBUG("Missing command");
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (fr_value_box_list_concat(ctx, *in, in, FR_TYPE_STRING, true) < 0) {
+		RPEDEBUG("Failed concatenating input");
+		return XLAT_ACTION_FAIL;
+	}
+
+	MEM(rctx = talloc_zero(request, redis_xlat_rctx_t));
+
+	p = (*in)->vb_strvalue;
+	if (p[0] == '-') {
+		p++;
+		rctx->read_only = true;
+	}
+
+	/*
+	 *	Hack to allow querying against a specific node for testing
+	 */
+	if (p[0] == '@') {
+		fr_socket_addr_t	node_addr;
+
+		RDEBUG3("Overriding node selection");
+
+		p++;
+		q = strchr(p, ' ');
+		if (!q) {
+			REDEBUG("Found node specifier but no command, format is [-][@<host>[:port]] <redis command>");
+		error:
+			talloc_free(rctx);
+			return XLAT_ACTION_FAIL;
+		}
+
+		if (fr_inet_pton_port(&node_addr.ipaddr, &node_addr.port, p, q - p, AF_UNSPEC, true, true) < 0) {
+			RPEDEBUG("Failed parsing node address");
+			goto error;
+		}
+		if (!node_addr.port) node_addr.port = inst->conf.port;
+
+		ipaddr = node_addr.ipaddr;
+		port = node_addr.port;
+		rctx->node_override = true;
+
+		p = q + 1;
+	}
+
+	/*
+	 *	Split the command without expanding it again
+	 */
+	rctx->argc = rad_expand_xlat(NULL, p, MAX_REDIS_ARGS, rctx->argv, false,
+				     sizeof(rctx->argv_buf), rctx->argv_buf);
+	if (rctx->argc <= 0) {
+		RPEDEBUG("Invalid command: %s", p);
+		goto error;
+	}
+
+	if (rctx->argc >= (MAX_REDIS_ARGS - 1)) {
+		RPEDEBUG("Too many parameters; increase MAX_REDIS_ARGS and recompile: %s", p);
+		goto error;
+	}
+
+	/*
+	 *	Pipelined connections go to masters, so read only
+	 *	commands are sent to the master for the key slot.
+	 */
+	if (!rctx->node_override) {
+		uint8_t const	*key;
+		size_t		key_len;
+
+		redis_command_key(&key, &key_len, rctx->argc, rctx->argv);
+		trunk = fr_redis_cluster_trunk_by_key(xt->t->cluster, inst->cluster, request, key, key_len);
+	} else {
+		trunk = fr_redis_cluster_trunk_by_addr(xt->t->cluster, request, &ipaddr, port);
+	}
+	if (!trunk) {
+		RPEDEBUG("Failed finding pipelined connections to the node");
+		goto error;
+	}
+
+	redis_command_print(request, rctx->argc, rctx->argv);
+
+	cmds = fr_redis_command_set_alloc(NULL, request, redis_xlat_complete, redis_xlat_fail, rctx);
+	if (fr_redis_command_argv_add(cmds, rctx->argc, rctx->argv, NULL) != FR_REDIS_PIPELINE_OK) {
+		RPEDEBUG("Invalid command");
+		talloc_free(cmds);
+		goto error;
+	}
+
+	if (redis_command_set_enqueue(trunk, cmds) != FR_REDIS_PIPELINE_OK) {
+		REDEBUG("Failed enqueuing command");
+		talloc_free(cmds);
+		goto error;
+	}
+	rctx->cmds = cmds;
+
+	return unlang_xlat_yield(request, redis_pipeline_xlat_resume, redis_pipeline_xlat_signal, rctx);
+}
+
+/** Resolves and caches the module's thread instance for use by a specific xlat instance
+ *
+ */
+static int redis_xlat_thread_instantiate(UNUSED void *xlat_inst, void *xlat_thread_inst,
+					 UNUSED xlat_exp_t const *exp, void *uctx)
+{
+	rlm_redis_t		*inst = talloc_get_type_abort(uctx, rlm_redis_t);
+	redis_xlat_thread_inst_t	*xt = xlat_thread_inst;
+
+	xt->inst = inst;
+	xt->t = talloc_get_type_abort(module_thread_by_data(inst)->data, rlm_redis_thread_t);
+
+	return 0;
+}
+
 /** Xlat to make calls to redis
  *
 @verbatim
@@ -296,13 +690,9 @@ static ssize_t redis_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
 	fr_redis_conn_t		*conn;
 
 	bool			read_only = false;
-	uint8_t	const		*key = NULL;
-	size_t			key_len = 0;
 
-	fr_redis_cluster_state_t	state;
 	fr_redis_rcode_t		status;
 	redisReply		*reply = NULL;
-	int			s_ret;
 
 	size_t			len;
 	int			ret;
@@ -364,13 +754,7 @@ static ssize_t redis_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
 			goto arg_error;
 		}
 
-		RDEBUG2("Executing command: %s", argv[0]);
-		if (argc > 1) {
-			RDEBUG2("With argments");
-			RINDENT();
-			for (int i = 1; i < argc; i++) RDEBUG2("[%i] %s", i, argv[i]);
-			REXDENT();
-		}
+		redis_command_print(request, argc, argv);
 
 		if (!read_only) {
 			reply = redisCommandArgv(conn->handle, argc, argv, NULL);
@@ -426,35 +810,7 @@ static ssize_t redis_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
 		goto finish;
 	}
 
-	/*
-	 *	If we've got multiple arguments, the second one is usually the key.
-	 *	The Redis docs say commands should be analysed first to get key
-	 *	positions, but this involves sending them to the server, which is
-	 *	just as expensive as sending them to the wrong server and receiving
-	 *	a redirect.
-	 */
-	if (argc > 1) {
-		key = (uint8_t const *)argv[1];
-	 	key_len = strlen((char const *)key);
-	}
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, read_only);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
-		RDEBUG2("Executing command: %s", argv[0]);
-		if (argc > 1) {
-			RDEBUG2("With arguments");
-			RINDENT();
-			for (int i = 1; i < argc; i++) RDEBUG2("[%i] %s", i, argv[i]);
-			REXDENT();
-		}
-		if (!read_only) {
-			reply = redisCommandArgv(conn->handle, argc, argv, NULL);
-			status = fr_redis_command_status(conn, reply);
-		} else if (redis_command_read_only(&status, &reply, request, conn, argc, argv) == -2) {
-			state.close_conn = true;
-		}
-	}
-	if (s_ret != REDIS_RCODE_SUCCESS) {
+	if (redis_command(&reply, inst, request, read_only, argc, argv) != REDIS_RCODE_SUCCESS) {
 		ret = -1;
 		goto finish;
 	}
@@ -499,7 +855,13 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
 
-	xlat_register(inst, inst->name, redis_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, false);
+	if (inst->pipeline) {
+		xlat = xlat_async_register(inst, inst->name, redis_pipeline_xlat);
+		xlat_async_thread_instantiate_set(xlat, redis_xlat_thread_instantiate,
+						  redis_xlat_thread_inst_t, NULL, inst);
+	} else {
+		xlat_register(inst, inst->name, redis_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, false);
+	}
 
 	/*
 	 *	%{redis_node:<key>[ idx]}
@@ -524,6 +886,27 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->cluster = fr_redis_cluster_alloc(inst, conf, &inst->conf, true, NULL, NULL, NULL);
 	if (!inst->cluster) return -1;
 
+	/*
+	 *	Pipelined connections don't authenticate
+	 *	or select a database.
+	 */
+	if (inst->pipeline && (inst->conf.password || inst->conf.database)) {
+		cf_log_err(conf, "'pipeline' does not support 'password' or 'database'");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_redis_t		*inst = talloc_get_type_abort(instance, rlm_redis_t);
+	rlm_redis_thread_t	*t = talloc_get_type_abort(thread, rlm_redis_thread_t);
+
+	if (!inst->pipeline) return 0;
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, el, &inst->trunk_conf);
+
 	return 0;
 }
 
@@ -544,4 +927,7 @@ module_t rlm_redis = {
 	.onload		= mod_load,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_inst_size	= sizeof(rlm_redis_thread_t),
+	.thread_inst_type	= "rlm_redis_thread_t",
 };
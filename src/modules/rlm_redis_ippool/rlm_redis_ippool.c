@@ -48,6 +48,8 @@ RCSID("$Id$")
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
+#include <freeradius-devel/unlang/base.h>
 #include "redis_ippool.h"
 
 #ifdef WITH_DHCP
@@ -97,11 +99,25 @@ typedef struct {
 	bool			copy_on_update; //!< Copy the address provided by ip_address to the
 						//!< allocated_address_attr if updates are successful.
 
+	bool			pipeline;	//!< Send scripts over pipelined connections
+						//!< instead of blocking on the connection pool.
+	fr_trunk_conf_t		trunk_conf;	//!< For the pipelined connections.
+
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
 } rlm_redis_ippool_t;
 
+/** Thread specific data for rlm_redis_ippool
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster;	//!< Pipelined connections to the cluster's nodes,
+							//!< created as pools on each node are used.
+} rlm_redis_ippool_thread_t;
+
 static CONF_PARSER redis_config[] = {
 	REDIS_COMMON_CONFIG,
+	{ FR_CONF_OFFSET("pipeline", FR_TYPE_BOOL, rlm_redis_ippool_t, pipeline), .dflt = "no" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_redis_ippool_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -445,6 +461,115 @@ static void ippool_action_print(REQUEST *request, ippool_action_t action,
 	talloc_free(gateway_str);
 }
 
+/** Arguments for one of the Lua scripts
+ *
+ * The argument strings either point into the numeric buffers here, or
+ * to buffers owned by the caller.
+ */
+typedef struct {
+	char const		*script;	//!< Lua script, uploaded if the server doesn't have it.
+	char const		*argv[8];	//!< EVALSHA command and arguments.
+	size_t			argv_len[8];	//!< Length of each argument.
+	int			argc;		//!< Number of arguments.
+
+	char			num[3][21];	//!< Buffers for numeric arguments.
+	int			num_used;	//!< How many of the numeric buffers are in use.
+	char			ip[FR_IPADDR_PREFIX_STRLEN];	//!< Buffer for the IP address argument.
+} ippool_args_t;
+
+static inline void ippool_args_add(ippool_args_t *args, char const *value, size_t len)
+{
+	fr_assert(args->argc < (int)NUM_ELEMENTS(args->argv));
+
+	args->argv[args->argc] = value;
+	args->argv_len[args->argc++] = len;
+}
+
+static inline void ippool_args_add_uint(ippool_args_t *args, uint32_t num)
+{
+	char	*p;
+	size_t	len;
+
+	fr_assert(args->num_used < (int)NUM_ELEMENTS(args->num));
+
+	p = args->num[args->num_used++];
+	len = snprintf(p, sizeof(args->num[0]), "%u", num);
+	ippool_args_add(args, p, len);
+}
+
+/** Build the EVALSHA command for an action
+ *
+ * @param[out] args		to populate.
+ * @param[in] inst		of rlm_redis_ippool.
+ * @param[in] action		to build the command for.
+ * @param[in] key_prefix	Pool name.
+ * @param[in] key_prefix_len	Length of the pool name.
+ * @param[in] ip		to update or release.  NULL when allocating.
+ * @param[in] device_id		Device identifier.
+ * @param[in] device_id_len	Length of the device identifier.
+ * @param[in] gateway_id	Gateway identifier.
+ * @param[in] gateway_id_len	Length of the gateway identifier.
+ * @param[in] expires		Lease time (not used for releases).
+ */
+static void ippool_args_build(ippool_args_t *args, rlm_redis_ippool_t const *inst, ippool_action_t action,
+			      uint8_t const *key_prefix, size_t key_prefix_len,
+			      fr_ipaddr_t *ip,
+			      uint8_t const *device_id, size_t device_id_len,
+			      uint8_t const *gateway_id, size_t gateway_id_len,
+			      uint32_t expires)
+{
+	char const	*digest;
+
+	memset(args, 0, sizeof(*args));
+
+	/*
+	 *	hiredis doesn't deal well with NULL string pointers
+	 */
+	if (!device_id) device_id = (uint8_t const *)"";
+	if (!gateway_id) gateway_id = (uint8_t const *)"";
+
+	switch (action) {
+	case POOL_ACTION_ALLOCATE:
+		digest = lua_alloc_digest;
+		args->script = lua_alloc_cmd;
+		break;
+
+	case POOL_ACTION_UPDATE:
+		digest = lua_update_digest;
+		args->script = lua_update_cmd;
+		break;
+
+	case POOL_ACTION_RELEASE:
+		digest = lua_release_digest;
+		args->script = lua_release_cmd;
+		break;
+
+	default:
+		fr_assert(0);
+		return;
+	}
+
+	ippool_args_add(args, "EVALSHA", sizeof("EVALSHA") - 1);
+	ippool_args_add(args, digest, SHA1_DIGEST_LENGTH * 2);
+	ippool_args_add(args, "1", 1);
+	ippool_args_add(args, (char const *)key_prefix, key_prefix_len);
+	ippool_args_add_uint(args, (uint32_t)fr_time_to_timeval(fr_time()).tv_sec);
+
+	if (action != POOL_ACTION_RELEASE) ippool_args_add_uint(args, expires);
+
+	if (ip) {
+		if ((ip->af == AF_INET) && inst->ipv4_integer) {
+			ippool_args_add_uint(args, htonl(ip->addr.v4.s_addr));
+		} else {
+			IPPOOL_SPRINT_IP(args->ip, ip, ip->prefix);
+			ippool_args_add(args, args->ip, strlen(args->ip));
+		}
+	}
+
+	ippool_args_add(args, (char const *)device_id, device_id_len);
+	if (action != POOL_ACTION_RELEASE) ippool_args_add(args, (char const *)gateway_id, gateway_id_len);
+}
+
 /** Execute a script against Redis cluster
  *
  * Handles uploading the script to the server if required.
@@ -454,22 +579,15 @@ static void ippool_action_print(REQUEST *request, ippool_action_t action,
  * @param[out] out		Where to write Redis reply object resulting from the command.
  * @param[in] request		The current request.
  * @param[in] cluster		configuration.
- * @param[in] key		to use to determine the cluster node.
- * @param[in] key_len		length of the key.
  * @param[in] wait_num		If > 0 wait until this many slaves have replicated the data
  *				from the last command.
  * @param[in] wait_timeout	How long to wait for slaves.
- * @param[in] digest		of script.
- * @param[in] script		to upload.
- * @param[in] cmd		EVALSHA command to execute.
- * @param[in] ...		Arguments for the eval command.
+ * @param[in] args		EVALSHA command to execute.  The key used to determine
+ *				the cluster node is argument 3.
  * @return status of the command.
  */
 static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_redis_cluster_t *cluster,
-				      uint8_t const *key, size_t key_len,
-				      uint32_t wait_num, fr_time_delta_t wait_timeout,
-				      char const digest[], char const *script,
-				      char const *cmd, ...)
+				      uint32_t wait_num, fr_time_delta_t wait_timeout, ippool_args_t const *args)
 {
 	fr_redis_conn_t			*conn;
 	redisReply			*replies[5];	/* Must be equal to the maximum number of pipelined commands */
@@ -479,7 +597,9 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 	fr_redis_rcode_t		s_ret, status;
 	unsigned int			pipelined = 0;
 
-	va_list				ap;
+	char const			*digest = args->argv[1];
+	uint8_t const			*key = (uint8_t const *)args->argv[3];
+	size_t				key_len = args->argv_len[3];
 
 	*out = NULL;
 
@@ -487,20 +607,14 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 	memset(replies, 0, sizeof(replies));
 #endif
 
-	va_start(ap, cmd);
-
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, cluster, request, key, key_len, false);
 	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
 	     s_ret = fr_redis_cluster_state_next(&state, &conn, cluster, request, status, &replies[0])) {
-	     	va_list	copy;
-
 	     	RDEBUG3("Calling script 0x%s", digest);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
+		redisAppendCommandArgv(conn->handle, args->argc, (char const **)args->argv, args->argv_len);
 		pipelined = 1;
 		if (wait_num) {
-			redisAppendCommand(conn->handle, "WAIT %i %i", wait_num, fr_time_delta_to_msec(wait_timeout));
+			redisAppendCommand(conn->handle, "WAIT %u %" PRId64, wait_num, fr_time_delta_to_msec(wait_timeout));
 			pipelined++;
 		}
 		reply_cnt = fr_redis_pipeline_result(&pipelined, &status,
@@ -520,14 +634,12 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 		 */
 	     	RDEBUG3("Loading script 0x%s", digest);
 		redisAppendCommand(conn->handle, "MULTI");
-		redisAppendCommand(conn->handle, "SCRIPT LOAD %s", script);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
+		redisAppendCommand(conn->handle, "SCRIPT LOAD %s", args->script);
+		redisAppendCommandArgv(conn->handle, args->argc, (char const **)args->argv, args->argv_len);
 		redisAppendCommand(conn->handle, "EXEC");
 		pipelined = 4;
 		if (wait_num) {
-			redisAppendCommand(conn->handle, "WAIT %i %i", wait_num, wait_timeout);
+			redisAppendCommand(conn->handle, "WAIT %u %" PRId64, wait_num, fr_time_delta_to_msec(wait_timeout));
 			pipelined++;
 		}
 
@@ -544,7 +656,7 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 					fr_table_str_by_value(redis_reply_types, replies[3]->type, "<UNKNOWN>"));
 			error:
 				fr_redis_pipeline_free(replies, reply_cnt);
-				status = REDIS_RCODE_ERROR;
+				s_ret = REDIS_RCODE_ERROR;
 				goto finish;
 			}
 			if (replies[3]->elements != 2) {
@@ -570,7 +682,7 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 	case 2:	/* EVALSHA with wait */
 		if (ippool_wait_check(request, wait_num, replies[1]) < 0) goto error;
 		fr_redis_reply_free(&replies[1]);	/* Free the wait response */
-		break;
+		/* FALL-THROUGH */
 
 	case 1:	/* EVALSHA */
 		*out = replies[0];
@@ -595,62 +707,26 @@ static fr_redis_rcode_t ippool_script(redisReply **out, REQUEST *request, fr_red
 	}
 
 finish:
-	va_end(ap);
 	return s_ret;
 }
 
-/** Allocate a new IP address from a pool
+/** Check the common part of the reply to one of the Lua scripts
  *
+ * @param[in] request	The current request.
+ * @param[in] reply	to check.
+ * @return the rcode returned by the script.
  */
-static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, REQUEST *request,
-					    uint8_t const *key_prefix, size_t key_prefix_len,
-					    uint8_t const *device_id, size_t device_id_len,
-					    uint8_t const *gateway_id, size_t gateway_id_len,
-					    uint32_t expires)
+static ippool_rcode_t ippool_reply_rcode(REQUEST *request, redisReply *reply)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
-	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
-
-	fr_assert(key_prefix);
-	fr_assert(device_id);
-
-	now = fr_time_to_timeval(fr_time());
-
-	/*
-	 *	hiredis doesn't deal well with NULL string pointers
-	 */
-	if (!gateway_id) gateway_id = (uint8_t const *)"";
-
-	status = ippool_script(&reply, request, inst->cluster,
-			       key_prefix, key_prefix_len,
-			       inst->wait_num, inst->wait_timeout,
-			       lua_alloc_digest, lua_alloc_cmd,
-	 		       "EVALSHA %s 1 %b %u %u %b %b",
-	 		       lua_alloc_digest,
-			       key_prefix, key_prefix_len,
-			       (unsigned int)now.tv_sec, expires,
-			       device_id, device_id_len,
-			       gateway_id, gateway_id_len);
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	fr_assert(reply);
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	if (reply->elements == 0) {
 		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	/*
@@ -659,11 +735,21 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, REQU
 	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
 		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
-	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
+
+	return reply->element[0]->integer;
+}
+
+/** Process the reply to the allocation script
+ *
+ */
+static ippool_rcode_t ippool_allocate_reply(rlm_redis_ippool_t const *inst, REQUEST *request, redisReply *reply)
+{
+	ippool_rcode_t		ret;
+
+	ret = ippool_reply_rcode(request, reply);
+	if (ret < 0) return ret;
 
 	/*
 	 *	Process IP address
@@ -699,8 +785,7 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, REQU
 				if (fr_value_box_cast(NULL, &ip_map.rhs->tmpl_value, FR_TYPE_IPV4_ADDR,
 						      NULL, &tmp)) {
 					RPEDEBUG("Failed converting integer to IPv4 address");
-					ret = IPPOOL_RCODE_FAIL;
-					goto finish;
+					return IPPOOL_RCODE_FAIL;
 				}
 			} else {
 				ip_map.rhs->tmpl_value.vb_uint32 = ntohl((uint32_t)reply->element[1]->integer);
@@ -715,17 +800,13 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, REQU
 			ip_map.rhs->tmpl_value_type = FR_TYPE_STRING;
 
 		do_ip_map:
-			if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
-			}
+			if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
 			break;
 
 		default:
 			REDEBUG("Server returned unexpected type \"%s\" for IP element (result[1])",
 				fr_table_str_by_value(redis_reply_types, reply->element[1]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
@@ -754,10 +835,7 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, REQU
 			range_map.rhs->tmpl_value.vb_strvalue = reply->element[2]->str;
 			range_map.rhs->tmpl_value_length = reply->element[2]->len;
 			range_map.rhs->tmpl_value_type = FR_TYPE_STRING;
-			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
-			}
+			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
 		}
 			break;
 
@@ -767,8 +845,7 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, REQU
 		default:
 			REDEBUG("Server returned unexpected type \"%s\" for range element (result[2])",
 				fr_table_str_by_value(redis_reply_types, reply->element[2]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
@@ -791,106 +868,30 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, REQU
 		if (reply->element[3]->type != REDIS_REPLY_INTEGER) {
 			REDEBUG("Server returned unexpected type \"%s\" for expiry element (result[3])",
 				fr_table_str_by_value(redis_reply_types, reply->element[3]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 
 		expiry_map.rhs->tmpl_value.vb_uint32 = reply->element[3]->integer;
 		expiry_map.rhs->tmpl_value_type = FR_TYPE_UINT32;
-		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) {
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
-		}
+		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
 	}
-finish:
-	fr_redis_reply_free(&reply);
+
 	return ret;
 }
 
-/** Update an existing IP address in a pool
+/** Process the reply to the update script
  *
  */
-static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUEST *request,
-					  uint8_t const *key_prefix, size_t key_prefix_len,
-					  fr_ipaddr_t *ip,
-					  uint8_t const *device_id, size_t device_id_len,
-					  uint8_t const *gateway_id, size_t gateway_id_len,
+static ippool_rcode_t ippool_update_reply(rlm_redis_ippool_t const *inst, REQUEST *request, redisReply *reply,
 					  uint32_t expires)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
-	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
+	ippool_rcode_t		ret;
 
 	vp_tmpl_t		range_rhs = { .name = "", .type = TMPL_TYPE_DATA, .tmpl_value_type = FR_TYPE_STRING, .quote = T_DOUBLE_QUOTED_STRING };
 	vp_map_t		range_map = { .lhs = inst->range_attr, .op = T_OP_SET, .rhs = &range_rhs };
 
-	now = fr_time_to_timeval(fr_time());
-
-	/*
-	 *	hiredis doesn't deal well with NULL string pointers
-	 */
-	if (!device_id) device_id = (uint8_t const *)"";
-	if (!gateway_id) gateway_id = (uint8_t const *)"";
-
-	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %u %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       htonl(ip->addr.v4.s_addr),
-				       device_id, device_id_len,
-				       gateway_id, gateway_id_len);
-	} else {
-		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %s %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       ip_buff,
-				       device_id, device_id_len,
-				       gateway_id, gateway_id_len);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	if (reply->type != REDIS_REPLY_ARRAY) {
-		REDEBUG("Expected result to be array got \"%s\"",
-			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	if (reply->elements == 0) {
-		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	/*
-	 *	Process return code
-	 */
-	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
-		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
-			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
+	ret = ippool_reply_rcode(request, reply);
+	if (ret < 0) return ret;
 
 	/*
 	 *	Process Range identifier
@@ -904,10 +905,7 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUES
 			range_map.rhs->tmpl_value.vb_strvalue = reply->element[1]->str;
 			range_map.rhs->tmpl_value_length = reply->element[1]->len;
 			range_map.rhs->tmpl_value_type = FR_TYPE_STRING;
-			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
-			}
+			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
 			break;
 
 		case REDIS_REPLY_NIL:
@@ -916,8 +914,7 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUES
 		default:
 			REDEBUG("Server returned unexpected type \"%s\" for range element (result[1])",
 				fr_table_str_by_value(redis_reply_types, reply->element[0]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
@@ -939,96 +936,54 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, REQUES
 
 		expiry_map.rhs->tmpl_value.vb_uint32 = expires;
 		expiry_map.rhs->tmpl_value_type = FR_TYPE_UINT32;
-		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) {
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
-		}
+		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
 	}
 
-finish:
-	fr_redis_reply_free(&reply);
-
 	return ret;
 }
 
-/** Release an existing IP address in a pool
+/** Process the reply to one of the Lua scripts
  *
+ * @param[in] inst	of rlm_redis_ippool.
+ * @param[in] request	The current request.
+ * @param[in] action	the script performed.
+ * @param[in] reply	to process.  Not freed.
+ * @param[in] expires	Lease time passed to the script.
+ * @return the result of the action.
  */
-static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, REQUEST *request,
-					   uint8_t const *key_prefix, size_t key_prefix_len,
-					   fr_ipaddr_t *ip,
-					   uint8_t const *device_id, size_t device_id_len)
+static ippool_rcode_t ippool_reply(rlm_redis_ippool_t const *inst, REQUEST *request, ippool_action_t action,
+				   redisReply *reply, uint32_t expires)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
-	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
-
-	now = fr_time_to_timeval(fr_time());
+	switch (action) {
+	case POOL_ACTION_ALLOCATE:
+		return ippool_allocate_reply(inst, request, reply);
 
-	/*
-	 *	hiredis doesn't deal well with NULL string pointers
-	 */
-	if (!device_id) device_id = (uint8_t const *)"";
+	case POOL_ACTION_UPDATE:
+		return ippool_update_reply(inst, request, reply, expires);
 
-	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_release_digest, lua_release_cmd,
-				       "EVALSHA %s 1 %b %u %u %b",
-				       lua_release_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec,
-				       htonl(ip->addr.v4.s_addr),
-				       device_id, device_id_len);
-	} else {
-		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_release_digest, lua_release_cmd,
-				       "EVALSHA %s 1 %b %u %s %b",
-				       lua_release_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec,
-				       ip_buff,
-				       device_id, device_id_len);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
+	case POOL_ACTION_RELEASE:
+		return ippool_reply_rcode(request, reply);
 
-	if (reply->type != REDIS_REPLY_ARRAY) {
-		REDEBUG("Expected result to be array got \"%s\"",
-			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+	default:
+		fr_assert(0);
+		return IPPOOL_RCODE_FAIL;
 	}
+}
 
-	if (reply->elements == 0) {
-		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
+/** Perform an action, blocking until the cluster responds
+ *
+ */
+static ippool_rcode_t ippool_run(rlm_redis_ippool_t const *inst, REQUEST *request, ippool_action_t action,
+				 ippool_args_t const *args, uint32_t expires)
+{
+	redisReply		*reply = NULL;
+	ippool_rcode_t		ret;
 
-	/*
-	 *	Process return code
-	 */
-	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
-		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
-			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
+	if (ippool_script(&reply, request, inst->cluster, inst->wait_num, inst->wait_timeout,
+			  args) != REDIS_RCODE_SUCCESS) return IPPOOL_RCODE_FAIL;
 
-finish:
+	fr_assert(reply);
+	ret = ippool_reply(inst, request, action, reply, expires);
 	fr_redis_reply_free(&reply);
 
 	return ret;
@@ -1073,65 +1028,21 @@ static inline ssize_t ippool_pool_name(uint8_t const **out, uint8_t buff[], size
 	return slen;
 }
 
-static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request, ippool_action_t action)
+/** Convert the result of an action into a module rcode
+ *
+ * @param[in] inst	of rlm_redis_ippool.
+ * @param[in] request	The current request.
+ * @param[in] action	that was performed.
+ * @param[in] ret	Result of the action.
+ * @param[in] ip_str	Address that was updated or released.
+ * @return the module rcode.
+ */
+static rlm_rcode_t ippool_action_rcode(rlm_redis_ippool_t const *inst, REQUEST *request, ippool_action_t action,
+				       ippool_rcode_t ret, char const *ip_str)
 {
-	uint8_t		key_prefix_buff[IPPOOL_MAX_KEY_PREFIX_SIZE], device_id_buff[256], gateway_id_buff[256];
-	uint8_t const	*key_prefix, *device_id = NULL, *gateway_id = NULL;
-	size_t		key_prefix_len, device_id_len = 0, gateway_id_len = 0;
-	ssize_t		slen;
-	fr_ipaddr_t	ip;
-	char		expires_buff[20];
-	char const	*expires_str;
-	unsigned long	expires = 0;
-	char		*q;
-
-	slen = ippool_pool_name(&key_prefix, (uint8_t *)&key_prefix_buff, sizeof(key_prefix_len), inst, request);
-	if (slen < 0) return RLM_MODULE_FAIL;
-	if (slen == 0) return RLM_MODULE_NOOP;
-
-	key_prefix_len = (size_t)slen;
-
-	if (inst->device_id) {
-		slen = tmpl_expand((char const **)&device_id,
-				   (char *)&device_id_buff, sizeof(device_id_buff),
-				   request, inst->device_id, NULL, NULL);
-		if (slen < 0) {
-			REDEBUG("Failed expanding device (%s)", inst->device_id->name);
-			return RLM_MODULE_FAIL;
-		}
-		device_id_len = (size_t)slen;
-	}
-
-	if (inst->gateway_id) {
-		slen = tmpl_expand((char const **)&gateway_id,
-				   (char *)&gateway_id_buff, sizeof(gateway_id_buff),
-				   request, inst->gateway_id, NULL, NULL);
-		if (slen < 0) {
-			REDEBUG("Failed expanding gateway (%s)", inst->gateway_id->name);
-			return RLM_MODULE_FAIL;
-		}
-		gateway_id_len = (size_t)slen;
-	}
-
 	switch (action) {
 	case POOL_ACTION_ALLOCATE:
-		if (tmpl_expand(&expires_str, expires_buff, sizeof(expires_buff),
-				request, inst->offer_time, NULL, NULL) < 0) {
-			REDEBUG("Failed expanding offer_time (%s)", inst->offer_time->name);
-			return RLM_MODULE_FAIL;
-		}
-
-		expires = strtoul(expires_str, &q, 10);
-		if (q != (expires_str + strlen(expires_str))) {
-			REDEBUG("Invalid offer_time.  Must be an integer value");
-			return RLM_MODULE_FAIL;
-		}
-
-		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len, NULL,
-				    device_id, device_id_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
-					      device_id, device_id_len,
-					      gateway_id, gateway_id_len, (uint32_t)expires)) {
+		switch (ret) {
 		case IPPOOL_RCODE_SUCCESS:
 			RDEBUG2("IP address lease allocated");
 			return RLM_MODULE_UPDATED;
@@ -1145,37 +1056,7 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 		}
 
 	case POOL_ACTION_UPDATE:
-	{
-		char		ip_buff[INET6_ADDRSTRLEN + 4];
-		char const	*ip_str;
-
-		if (tmpl_expand(&expires_str, expires_buff, sizeof(expires_buff),
-				request, inst->lease_time, NULL, NULL) < 0) {
-			REDEBUG("Failed expanding lease_time (%s)", inst->lease_time->name);
-			return RLM_MODULE_FAIL;
-		}
-
-		expires = strtoul(expires_str, &q, 10);
-		if (q != (expires_str + strlen(expires_str))) {
-			REDEBUG("Invalid expires.  Must be an integer value");
-			return RLM_MODULE_FAIL;
-		}
-
-		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->requested_address, NULL, NULL) < 0) {
-			REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
-			return RLM_MODULE_FAIL;
-		}
-
-		if (fr_inet_pton(&ip, ip_str, -1, AF_UNSPEC, false, true) < 0) {
-			RPEDEBUG("Failed parsing address");
-			return RLM_MODULE_FAIL;
-		}
-
-		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
-				    ip_str, device_id, device_id_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_update(inst, request, key_prefix, key_prefix_len,
-					    &ip, device_id, device_id_len,
-					    gateway_id, gateway_id_len, (uint32_t)expires)) {
+		switch (ret) {
 		case IPPOOL_RCODE_SUCCESS:
 			RDEBUG2("Requested IP address' \"%s\" lease updated", ip_str);
 
@@ -1222,27 +1103,9 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 		default:
 			return RLM_MODULE_FAIL;
 		}
-	}
 
 	case POOL_ACTION_RELEASE:
-	{
-		char		ip_buff[INET6_ADDRSTRLEN + 4];
-		char const	*ip_str;
-
-		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->requested_address, NULL, NULL) < 0) {
-			REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
-			return RLM_MODULE_FAIL;
-		}
-
-		if (fr_inet_pton(&ip, ip_str, -1, AF_UNSPEC, false, true) < 0) {
-			RPEDEBUG("Failed parsing address");
-			return RLM_MODULE_FAIL;
-		}
-
-		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
-				    ip_str, device_id, device_id_len, gateway_id, gateway_id_len, 0);
-		switch (redis_ippool_release(inst, request, key_prefix, key_prefix_len,
-					     &ip, device_id, device_id_len)) {
+		switch (ret) {
 		case IPPOOL_RCODE_SUCCESS:
 			RDEBUG2("IP address \"%s\" released", ip_str);
 			return RLM_MODULE_UPDATED;
@@ -1263,7 +1126,333 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 		default:
 			return RLM_MODULE_FAIL;
 		}
+
+	default:
+		fr_assert(0);
+		return RLM_MODULE_FAIL;
 	}
+}
+
+/** Asynchronous action state
+ *
+ */
+typedef struct {
+	rlm_redis_ippool_t const	*inst;		//!< Module instance.
+	fr_redis_trunk_t		*trunk;		//!< Connections to the node serving the pool.
+	fr_redis_command_set_t		*cmds;		//!< Commands in flight, NULL once the trunk has
+							//!< called us back.
+
+	ippool_action_t			action;		//!< Being performed.
+	ippool_args_t			args;		//!< EVALSHA command.
+	uint8_t				*key_prefix;	//!< Copy of the pool name.
+	uint8_t				*device_id;	//!< Copy of the device identifier.
+	uint8_t				*gateway_id;	//!< Copy of the gateway identifier.
+	char				*ip_str;	//!< Copy of the requested address.
+	uint32_t			expires;	//!< Lease time.
+
+	bool				loading;	//!< Script is being loaded ahead of the EVALSHA.
+	fr_redis_rcode_t		status;		//!< Of the EVALSHA.
+	ippool_rcode_t			ret;		//!< Result of the script.
+} ippool_async_t;
+
+static void ippool_async_complete(REQUEST *request, fr_dlist_head_t *completed, void *uctx);
+static void ippool_async_fail(REQUEST *request, fr_dlist_head_t *completed, void *uctx);
+static rlm_rcode_t mod_action_resume(void *instance, void *thread, REQUEST *request, void *uctx);
+static void mod_action_signal(void *instance, void *thread, REQUEST *request, void *uctx,
+			      fr_state_signal_t action);
+
+/** Send the command set for an asynchronous action
+ *
+ * If the last attempt failed with NOSCRIPT, the script is loaded
+ * in the same command set, ahead of the EVALSHA.
+ */
+static int ippool_async_send(ippool_async_t *rctx, REQUEST *request)
+{
+	rlm_redis_ippool_t const	*inst = rctx->inst;
+	fr_redis_command_set_t		*cmds;
+
+	cmds = fr_redis_command_set_alloc(NULL, request, ippool_async_complete, ippool_async_fail, rctx);
+
+	if (rctx->loading) {
+		char const	*argv[] = { "SCRIPT", "LOAD", rctx->args.script };
+		size_t		argv_len[] = { 6, 4, strlen(rctx->args.script) };
+
+		RDEBUG3("Loading script 0x%s", rctx->args.argv[1]);
+		if (fr_redis_command_argv_add(cmds, NUM_ELEMENTS(argv), argv, argv_len) != FR_REDIS_PIPELINE_OK) {
+		error:
+			talloc_free(cmds);
+			return -1;
+		}
+	}
+
+	RDEBUG3("Calling script 0x%s", rctx->args.argv[1]);
+	if (fr_redis_command_argv_add(cmds, rctx->args.argc, rctx->args.argv,
+				      rctx->args.argv_len) != FR_REDIS_PIPELINE_OK) goto error;
+
+	if (inst->wait_num) {
+		char		wait_num[21], wait_timeout[21];
+		char const	*argv[] = { "WAIT", wait_num, wait_timeout };
+		size_t		argv_len[] = { 4, 0, 0 };
+
+		argv_len[1] = snprintf(wait_num, sizeof(wait_num), "%u", inst->wait_num);
+		argv_len[2] = snprintf(wait_timeout, sizeof(wait_timeout), "%" PRIu64,
+				       fr_time_delta_to_msec(inst->wait_timeout));
+
+		if (fr_redis_command_argv_add(cmds, NUM_ELEMENTS(argv), argv, argv_len) != FR_REDIS_PIPELINE_OK) {
+			goto error;
+		}
+	}
+
+	if (redis_command_set_enqueue(rctx->trunk, cmds) != FR_REDIS_PIPELINE_OK) {
+		REDEBUG("Failed enqueuing commands");
+		goto error;
+	}
+	rctx->cmds = cmds;
+
+	return 0;
+}
+
+/** Process the replies to an asynchronous action
+ *
+ */
+static void ippool_async_complete(REQUEST *request, fr_dlist_head_t *completed, void *uctx)
+{
+	ippool_async_t			*rctx = talloc_get_type_abort(uctx, ippool_async_t);
+	rlm_redis_ippool_t const	*inst = rctx->inst;
+	fr_redis_command_t		*cmd;
+	redisReply			*reply;
+
+	rctx->cmds = NULL;	/* Freed by the trunk */
+
+	cmd = fr_dlist_head(completed);
+	if (rctx->loading) {
+		if ((fr_redis_command_reply(&reply, request, cmd) != REDIS_RCODE_SUCCESS) ||
+		    (reply->type != REDIS_REPLY_STRING)) {
+			REDEBUG("Bad response to SCRIPT LOAD");
+			rctx->status = REDIS_RCODE_ERROR;
+			goto finish;
+		}
+		cmd = fr_dlist_next(completed, cmd);
+	}
+
+	rctx->status = fr_redis_command_reply(&reply, request, cmd);
+	if (reply && RDEBUG_ENABLED3) fr_redis_reply_print(L_DBG_LVL_3, reply, request, 0);
+	if (rctx->status != REDIS_RCODE_SUCCESS) goto finish;
+
+	if (inst->wait_num) {
+		redisReply *wait_reply;
+
+		cmd = fr_dlist_next(completed, cmd);
+		wait_reply = cmd ? fr_redis_command_get_result(cmd) : NULL;
+		if (!wait_reply || (ippool_wait_check(request, inst->wait_num, wait_reply) < 0)) {
+			rctx->status = REDIS_RCODE_ERROR;
+			goto finish;
+		}
+	}
+
+	rctx->ret = ippool_reply(inst, request, rctx->action, reply, rctx->expires);
+
+finish:
+	unlang_interpret_resumable(request);
+}
+
+/** Record that the commands for an asynchronous action couldn't be sent
+ *
+ */
+static void ippool_async_fail(REQUEST *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	ippool_async_t		*rctx = talloc_get_type_abort(uctx, ippool_async_t);
+
+	rctx->cmds = NULL;	/* Freed by the trunk */
+	rctx->status = REDIS_RCODE_RECONNECT;
+
+	unlang_interpret_resumable(request);
+}
+
+/** Continue processing an action once the replies have been received
+ *
+ */
+static rlm_rcode_t mod_action_resume(void *instance, UNUSED void *thread, REQUEST *request, void *uctx)
+{
+	rlm_redis_ippool_t const	*inst = instance;
+	ippool_async_t			*rctx = talloc_get_type_abort(uctx, ippool_async_t);
+	rlm_rcode_t			rcode;
+
+	switch (rctx->status) {
+	case REDIS_RCODE_SUCCESS:
+		rcode = ippool_action_rcode(inst, request, rctx->action, rctx->ret, rctx->ip_str);
+		break;
+
+	/*
+	 *	The node has restarted, or had its script
+	 *	cache flushed.  Load the script, and try
+	 *	again.
+	 */
+	case REDIS_RCODE_NO_SCRIPT:
+		if (rctx->loading) goto fail;
+
+		rctx->loading = true;
+		if (ippool_async_send(rctx, request) < 0) goto fail;
+
+		return unlang_module_yield(request, mod_action_resume, mod_action_signal, rctx);
+
+	default:
+		if (!fr_redis_trunk_retry(rctx->status)) goto fail;
+
+		RDEBUG2("Pipelined command failed, retrying");
+		rcode = ippool_action_rcode(inst, request, rctx->action,
+					    ippool_run(inst, request, rctx->action, &rctx->args, rctx->expires),
+					    rctx->ip_str);
+		break;
+
+	fail:
+		RPEDEBUG("Failed calling script");
+		rcode = RLM_MODULE_FAIL;
+		break;
+	}
+
+	talloc_free(rctx);
+
+	return rcode;
+}
+
+/** Stop an asynchronous action if the request is cancelled
+ *
+ */
+static void mod_action_signal(UNUSED void *instance, UNUSED void *thread, UNUSED REQUEST *request, void *uctx,
+			      fr_state_signal_t action)
+{
+	ippool_async_t		*rctx = talloc_get_type_abort(uctx, ippool_async_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (rctx->cmds) {
+		fr_redis_command_set_cancel(rctx->cmds);	/* Trunk frees the command set */
+		rctx->cmds = NULL;
+	}
+	talloc_free(rctx);
+}
+
+/** Start an action without blocking
+ *
+ * The inputs are copied, as they live on the caller's stack.
+ */
+static rlm_rcode_t mod_action_async(rlm_redis_ippool_t const *inst, fr_redis_trunk_t *trunk,
+				    REQUEST *request, ippool_action_t action,
+				    uint8_t const *key_prefix, size_t key_prefix_len,
+				    fr_ipaddr_t *ip, char const *ip_str,
+				    uint8_t const *device_id, size_t device_id_len,
+				    uint8_t const *gateway_id, size_t gateway_id_len,
+				    uint32_t expires)
+{
+	ippool_async_t	*rctx;
+
+	MEM(rctx = talloc_zero(request, ippool_async_t));
+	rctx->inst = inst;
+	rctx->trunk = trunk;
+	rctx->action = action;
+	rctx->expires = expires;
+	rctx->key_prefix = talloc_memdup(rctx, key_prefix, key_prefix_len);
+	if (device_id) rctx->device_id = talloc_memdup(rctx, device_id, device_id_len);
+	if (gateway_id) rctx->gateway_id = talloc_memdup(rctx, gateway_id, gateway_id_len);
+	if (ip_str) rctx->ip_str = talloc_typed_strdup(rctx, ip_str);
+
+	ippool_args_build(&rctx->args, inst, action, rctx->key_prefix, key_prefix_len, ip,
+			  rctx->device_id, device_id_len, rctx->gateway_id, gateway_id_len, expires);
+
+	if (ippool_async_send(rctx, request) < 0) {
+		talloc_free(rctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_action_resume, mod_action_signal, rctx);
+}
+
+static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, rlm_redis_ippool_thread_t *t,
+			      REQUEST *request, ippool_action_t action)
+{
+	uint8_t		key_prefix_buff[IPPOOL_MAX_KEY_PREFIX_SIZE], device_id_buff[256], gateway_id_buff[256];
+	uint8_t const	*key_prefix, *device_id = NULL, *gateway_id = NULL;
+	size_t		key_prefix_len, device_id_len = 0, gateway_id_len = 0;
+	ssize_t		slen;
+	fr_ipaddr_t	ip, *ip_p = NULL;
+	char		ip_buff[INET6_ADDRSTRLEN + 4];
+	char const	*ip_str = NULL;
+	char		expires_buff[20];
+	char const	*expires_str;
+	unsigned long	expires = 0;
+	char		*q;
+	ippool_args_t	args;
+
+	slen = ippool_pool_name(&key_prefix, (uint8_t *)&key_prefix_buff, sizeof(key_prefix_buff), inst, request);
+	if (slen < 0) return RLM_MODULE_FAIL;
+	if (slen == 0) return RLM_MODULE_NOOP;
+
+	key_prefix_len = (size_t)slen;
+
+	if (inst->device_id) {
+		slen = tmpl_expand((char const **)&device_id,
+				   (char *)&device_id_buff, sizeof(device_id_buff),
+				   request, inst->device_id, NULL, NULL);
+		if (slen < 0) {
+			REDEBUG("Failed expanding device (%s)", inst->device_id->name);
+			return RLM_MODULE_FAIL;
+		}
+		device_id_len = (size_t)slen;
+	}
+
+	if (inst->gateway_id) {
+		slen = tmpl_expand((char const **)&gateway_id,
+				   (char *)&gateway_id_buff, sizeof(gateway_id_buff),
+				   request, inst->gateway_id, NULL, NULL);
+		if (slen < 0) {
+			REDEBUG("Failed expanding gateway (%s)", inst->gateway_id->name);
+			return RLM_MODULE_FAIL;
+		}
+		gateway_id_len = (size_t)slen;
+	}
+
+	switch (action) {
+	case POOL_ACTION_ALLOCATE:
+		if (tmpl_expand(&expires_str, expires_buff, sizeof(expires_buff),
+				request, inst->offer_time, NULL, NULL) < 0) {
+			REDEBUG("Failed expanding offer_time (%s)", inst->offer_time->name);
+			return RLM_MODULE_FAIL;
+		}
+
+		expires = strtoul(expires_str, &q, 10);
+		if (q != (expires_str + strlen(expires_str))) {
+			REDEBUG("Invalid offer_time.  Must be an integer value");
+			return RLM_MODULE_FAIL;
+		}
+		break;
+
+	case POOL_ACTION_UPDATE:
+		if (tmpl_expand(&expires_str, expires_buff, sizeof(expires_buff),
+				request, inst->lease_time, NULL, NULL) < 0) {
+			REDEBUG("Failed expanding lease_time (%s)", inst->lease_time->name);
+			return RLM_MODULE_FAIL;
+		}
+
+		expires = strtoul(expires_str, &q, 10);
+		if (q != (expires_str + strlen(expires_str))) {
+			REDEBUG("Invalid expires.  Must be an integer value");
+			return RLM_MODULE_FAIL;
+		}
+		/* FALL-THROUGH */
+
+	case POOL_ACTION_RELEASE:
+		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->requested_address, NULL, NULL) < 0) {
+			REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
+			return RLM_MODULE_FAIL;
+		}
+
+		if (fr_inet_pton(&ip, ip_str, -1, AF_UNSPEC, false, true) < 0) {
+			RPEDEBUG("Failed parsing address");
+			return RLM_MODULE_FAIL;
+		}
+		ip_p = &ip;
+		break;
 
 	case POOL_ACTION_BULK_RELEASE:
 		RDEBUG2("Bulk release not yet implemented");
@@ -1273,10 +1462,32 @@ static rlm_rcode_t mod_action(rlm_redis_ippool_t const *inst, REQUEST *request,
 		fr_assert(0);
 		return RLM_MODULE_FAIL;
 	}
+
+	ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len, ip_str,
+			    device_id, device_id_len, gateway_id, gateway_id_len, expires);
+
+	/*
+	 *	Pipeline the command on the connections to
+	 *	the node which serves the pool.
+	 */
+	if (inst->pipeline) {
+		fr_redis_trunk_t *trunk;
+
+		trunk = fr_redis_cluster_trunk_by_key(t->cluster, inst->cluster, request, key_prefix, key_prefix_len);
+		if (trunk) return mod_action_async(inst, trunk, request, action, key_prefix, key_prefix_len,
+						   ip_p, ip_str, device_id, device_id_len,
+						   gateway_id, gateway_id_len, (uint32_t)expires);
+	}
+
+	ippool_args_build(&args, inst, action, key_prefix, key_prefix_len, ip_p,
+			  device_id, device_id_len, gateway_id, gateway_id_len, (uint32_t)expires);
+
+	return ippool_action_rcode(inst, request, action, ippool_run(inst, request, action, &args, (uint32_t)expires),
+				   ip_str);
 }
 
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request)
 {
 	rlm_redis_ippool_t const	*inst = instance;
 	VALUE_PAIR			*vp;
@@ -1285,7 +1496,7 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 	 *	Pool-Action override
 	 */
 	vp = fr_pair_find_by_da(request->control, attr_pool_action, TAG_ANY);
-	if (vp) return mod_action(inst, request, vp->vp_uint32);
+	if (vp) return mod_action(inst, thread, request, vp->vp_uint32);
 
 	/*
 	 *	Otherwise, guess the action by Acct-Status-Type
@@ -1299,22 +1510,22 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 	switch (vp->vp_uint32) {
 	case FR_STATUS_START:
 	case FR_STATUS_ALIVE:
-		return mod_action(inst, request, POOL_ACTION_UPDATE);
+		return mod_action(inst, thread, request, POOL_ACTION_UPDATE);
 
 	case FR_STATUS_STOP:
-		return mod_action(inst, request, POOL_ACTION_RELEASE);
+		return mod_action(inst, thread, request, POOL_ACTION_RELEASE);
 
 	case FR_STATUS_ACCOUNTING_OFF:
 	case FR_STATUS_ACCOUNTING_ON:
-		return mod_action(inst, request, POOL_ACTION_BULK_RELEASE);
+		return mod_action(inst, thread, request, POOL_ACTION_BULK_RELEASE);
 
 	default:
 		return RLM_MODULE_NOOP;
 	}
 }
 
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_authorize(void *instance, void *thread, REQUEST *request)
 {
 	rlm_redis_ippool_t const	*inst = instance;
 	VALUE_PAIR			*vp;
@@ -1324,11 +1535,11 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 	 *	when called in Post-Auth.
 	 */
 	vp = fr_pair_find_by_da(request->control, attr_pool_action, TAG_ANY);
-	return mod_action(inst, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
+	return mod_action(inst, thread, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
 }
 
-static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_post_auth(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_post_auth(void *instance, void *thread, REQUEST *request)
 {
 	rlm_redis_ippool_t const	*inst = instance;
 	VALUE_PAIR			*vp;
@@ -1357,7 +1568,7 @@ static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *r
 	}
 
 run:
-	return mod_action(inst, request, action);
+	return mod_action(inst, thread, request, action);
 }
 
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
@@ -1378,6 +1589,15 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	/*
+	 *	The pipelined connections are set up without
+	 *	authentication or database selection.
+	 */
+	if (inst->pipeline && (inst->conf.password || inst->conf.database)) {
+		cf_log_err(subcs, "'pipeline' does not support 'password' or 'database'");
+		return -1;
+	}
+
 	/*
 	 *	Pre-Compute the SHA1 hashes of the Lua scripts
 	 */
@@ -1410,6 +1630,18 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_redis_ippool_t		*inst = talloc_get_type_abort(instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(thread, rlm_redis_ippool_thread_t);
+
+	if (!inst->pipeline) return 0;
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, el, &inst->trunk_conf);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_redis_version_print();
@@ -1426,6 +1658,9 @@ module_t rlm_redis_ippool = {
 	.config		= module_config,
 	.onload		= mod_load,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_inst_size	= sizeof(rlm_redis_ippool_thread_t),
+	.thread_inst_type	= "rlm_redis_ippool_thread_t",
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_AUTHORIZE]		= mod_authorize,
@@ -28,6 +28,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/base.h>
 #include <freeradius-devel/server/cf_parse.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/sha1.h>
 
 #include "base.h"
 #include "cluster.h"
@@ -162,6 +163,7 @@ static char lua_release_cmd[] =
 	 */
 	"redis.call('DEL', '{' .. KEYS[1] .. '}:"IPPOOL_DEVICE_KEY":' .. found)" EOL	/* 11 */
 	"return 1";									/* 12 */
+static char lua_release_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
 
 /** Lua script for removing a lease
  *
@@ -196,6 +198,7 @@ static char lua_remove_cmd[] =
 	 */
 	"redis.call('DEL', '{' .. KEYS[1] .. '}:"IPPOOL_DEVICE_KEY":' .. found)" EOL	/* 11 */
 	"return 1" EOL;									/* 12 */
+static char lua_remove_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
 
 static void NEVER_RETURNS usage(int ret) {
 	INFO("Usage: %s -adrsm range... [-p prefix_len]... [-x]... [-oShf] server[:port] [pool] [range id]", name);
@@ -302,11 +305,15 @@ static bool ipaddr_next(fr_ipaddr_t *ipaddr, fr_ipaddr_t const *end, uint8_t pre
 }
 
 /** Add a net to the pool
+ *
+ * If the enqueue function calls a Lua script, the script is loaded once at
+ * the start of each pipelined batch, so the per-address commands can use
+ * EVALSHA instead of sending the whole script for every address.
  *
  * @return the number of new addresses added.
  */
 static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t const *op,
-			   redis_ippool_queue_t enqueue, redis_ippool_process_t process)
+			   char const *script, redis_ippool_queue_t enqueue, redis_ippool_process_t process)
 {
 	redis_driver_conf_t		*inst = talloc_get_type_abort(instance, redis_driver_conf_t);
 
@@ -341,6 +348,16 @@ static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t co
 			 */
 			ipaddr = acked;
 
+			/*
+			 *	Ensure the node we're talking to has the
+			 *	script cached.  This is cheap if it's
+			 *	already loaded.
+			 */
+			if (script) {
+				redisAppendCommand(conn->handle, "SCRIPT LOAD %s", script);
+				pipelined++;
+			}
+
 			for (i = 0; (i < MAX_PIPELINED) && more; i++, more = ipaddr_next(&ipaddr, &op->end,
 											 op->prefix)) {
 				int enqueued;
@@ -369,7 +386,7 @@ static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t co
 		if (process) {
 			fr_ipaddr_t to_process = acked;
 
-			for (i = 0; (size_t)i < reply_cnt; i++) {
+			for (i = script ? 1 : 0; (size_t)i < reply_cnt; i++) {
 				int ret;
 
 				ret = process(out, &to_process, replies[i]);
@@ -465,7 +482,7 @@ static int _driver_show_lease_enqueue(UNUSED redis_driver_conf_t *inst, fr_redis
  */
 static inline int driver_show_lease(void *out, void *instance, ippool_tool_operation_t const *op)
 {
-	return driver_do_lease(out, instance, op, _driver_show_lease_enqueue, _driver_show_lease_process);
+	return driver_do_lease(out, instance, op, NULL, _driver_show_lease_enqueue, _driver_show_lease_process);
 }
 
 /** Count the number of leases we released
@@ -499,7 +516,7 @@ static int _driver_release_lease_enqueue(UNUSED redis_driver_conf_t *inst, fr_re
 	IPPOOL_SPRINT_IP(ip_buff, ipaddr, prefix);
 
 	DEBUG("Releasing %s to pool \"%s\"", ip_buff, key_prefix);
-	redisAppendCommand(conn->handle, "EVAL %s 1 %b %s", lua_release_cmd, key_prefix, key_prefix_len, ip_buff);
+	redisAppendCommand(conn->handle, "EVALSHA %s 1 %b %s", lua_release_digest, key_prefix, key_prefix_len, ip_buff);
 	return 1;
 }
 
@@ -508,7 +525,7 @@ static int _driver_release_lease_enqueue(UNUSED redis_driver_conf_t *inst, fr_re
  */
 static inline int driver_release_lease(void *out, void *instance, ippool_tool_operation_t const *op)
 {
-	return driver_do_lease(out, instance, op,
+	return driver_do_lease(out, instance, op, lua_release_cmd,
 			       _driver_release_lease_enqueue, _driver_release_lease_process);
 }
 
@@ -547,7 +564,7 @@ static int _driver_remove_lease_enqueue(UNUSED redis_driver_conf_t *inst, fr_red
 	IPPOOL_SPRINT_IP(ip_buff, ipaddr, prefix);
 
 	DEBUG("Removing %s from pool \"%s\"", ip_buff, key_prefix);
-	redisAppendCommand(conn->handle, "EVAL %s 1 %b %s", lua_remove_cmd, key_prefix, key_prefix_len, ip_buff);
+	redisAppendCommand(conn->handle, "EVALSHA %s 1 %b %s", lua_remove_digest, key_prefix, key_prefix_len, ip_buff);
 	return 1;
 }
 
@@ -556,7 +573,7 @@ static int _driver_remove_lease_enqueue(UNUSED redis_driver_conf_t *inst, fr_red
  */
 static int driver_remove_lease(void *out, void *instance, ippool_tool_operation_t const *op)
 {
-	return driver_do_lease(out, instance, op,
+	return driver_do_lease(out, instance, op, lua_remove_cmd,
 			       _driver_remove_lease_enqueue, _driver_remove_lease_process);
 }
 
@@ -628,7 +645,7 @@ static int _driver_add_lease_enqueue(UNUSED redis_driver_conf_t *inst, fr_redis_
  */
 static int driver_add_lease(void *out, void *instance, ippool_tool_operation_t const *op)
 {
-	return driver_do_lease(out, instance, op, _driver_add_lease_enqueue, _driver_add_lease_process);
+	return driver_do_lease(out, instance, op, NULL, _driver_add_lease_enqueue, _driver_add_lease_process);
 }
 
 /** Count the number of leases we modified
@@ -684,7 +701,7 @@ static int _driver_modify_lease_enqueue(UNUSED redis_driver_conf_t *inst, fr_red
  */
 static int driver_modify_lease(void *out, void *instance, ippool_tool_operation_t const *op)
 {
-	return driver_do_lease(out, instance, op,
+	return driver_do_lease(out, instance, op, NULL,
 			       _driver_modify_lease_enqueue, _driver_modify_lease_process);
 }
 
@@ -1025,6 +1042,24 @@ static int driver_init(TALLOC_CTX *ctx, CONF_SECTION *conf, void **instance)
 		talloc_free(this);
 		return -1;
 	}
+
+	/*
+	 *	Pre-Compute the SHA1 hashes of the Lua scripts
+	 */
+	{
+		fr_sha1_ctx	sha1_ctx;
+		uint8_t		digest[SHA1_DIGEST_LENGTH];
+
+		fr_sha1_init(&sha1_ctx);
+		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_release_cmd, sizeof(lua_release_cmd) - 1);
+		fr_sha1_final(digest, &sha1_ctx);
+		fr_bin2hex(lua_release_digest, digest, sizeof(digest));
+
+		fr_sha1_init(&sha1_ctx);
+		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_remove_cmd, sizeof(lua_remove_cmd) - 1);
+		fr_sha1_final(digest, &sha1_ctx);
+		fr_bin2hex(lua_remove_digest, digest, sizeof(digest));
+	}
 	*instance = this;
 
 	return 0;
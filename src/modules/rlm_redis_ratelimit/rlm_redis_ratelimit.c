@@ -0,0 +1,471 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_redis_ratelimit.c
+ * @brief Rate limiting shared between servers, using token buckets held in Redis.
+ *
+ * Each bucket is a Redis hash holding the number of tokens, and when
+ * they were last refilled.  A script refills the bucket from the Redis
+ * server's clock, and takes tokens from it atomically, so every server
+ * using the same Redis cluster shares the one limit.
+ *
+ * Asking Redis for every request would make the limit as slow as the
+ * round trip.  Instead, each thread leases several tokens at once, and
+ * uses them locally until they run out or the lease expires.  Tokens are
+ * always taken from the bucket before they're used, so the limit is never
+ * exceeded.  Leased tokens which are never used are lost, so a larger
+ * lease means fewer round trips, but more requests rejected before the
+ * limit is reached.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/lru.h>
+
+#include <freeradius-devel/redis/base.h>
+#include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
+#include <freeradius-devel/unlang/base.h>
+
+/** Refill a bucket, and take up to the requested number of tokens from it
+ *
+ * - KEYS[1] the bucket.
+ * - ARGV[1] tokens added to the bucket per second.
+ * - ARGV[2] maximum tokens in the bucket.
+ * - ARGV[3] tokens wanted.
+ *
+ * Returns the number of tokens taken, which may be 0.
+ */
+static char const ratelimit_script[] =
+	"redis.replicate_commands()\n"
+	"local time = redis.call('TIME')\n"
+	"local now = (tonumber(time[1]) * 1000000) + tonumber(time[2])\n"
+	"local rate = tonumber(ARGV[1])\n"
+	"local burst = tonumber(ARGV[2])\n"
+	"local bucket = redis.call('HMGET', KEYS[1], 'tokens', 'last')\n"
+	"local tokens = tonumber(bucket[1])\n"
+	"local last = tonumber(bucket[2])\n"
+	"if not tokens or not last then\n"
+	"  tokens = burst\n"
+	"elseif now > last then\n"
+	"  tokens = math.min(burst, tokens + (((now - last) * rate) / 1000000))\n"
+	"end\n"
+	"local take = math.min(math.floor(tokens), tonumber(ARGV[3]))\n"
+	"redis.call('HMSET', KEYS[1], 'tokens', tostring(tokens - take), 'last', now)\n"
+	"redis.call('PEXPIRE', KEYS[1], math.ceil((burst * 1000) / rate) + 1000)\n"
+	"return take\n";
+
+typedef struct {
+	fr_redis_conf_t		conf;		//!< Connection parameters for the Redis server.
+						//!< Must be first field in this struct.
+
+	char const		*name;		//!< Instance name.
+	fr_redis_cluster_t	*cluster;	//!< Pool O pools
+
+	char const		*key;		//!< Expanded to select the bucket.
+	char const		*key_prefix;	//!< Prepended to the expanded key.
+
+	uint32_t		rate;		//!< Tokens added to each bucket per second.
+	uint32_t		burst;		//!< Maximum number of tokens in a bucket.
+	uint32_t		lease;		//!< Tokens taken from Redis at once.
+	fr_time_delta_t		lease_lifetime;	//!< How long leased tokens can be used for.
+	uint32_t		local_entries;	//!< Maximum number of buckets each thread has
+						//!< leases for.
+
+	fr_trunk_conf_t		trunk_conf;	//!< For the pipelined connections.
+} rlm_redis_ratelimit_t;
+
+/** Tokens a thread has leased from a bucket
+ *
+ */
+typedef struct {
+	uint32_t		tokens;		//!< Leased, and not yet used.
+	bool			denied;		//!< The bucket was empty when we last asked.
+	fr_time_t		expires;	//!< When the tokens can no longer be used.
+} ratelimit_lease_t;
+
+/** Thread specific data for rlm_redis_ratelimit
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster;	//!< Pipelined connections to the cluster's nodes.
+	fr_lru_t			*leases;	//!< Leased tokens, keyed by bucket.
+} rlm_redis_ratelimit_thread_t;
+
+/** A request for tokens from a bucket
+ *
+ */
+typedef struct {
+	rlm_redis_ratelimit_t const	*inst;		//!< Module instance.
+	rlm_redis_ratelimit_thread_t	*t;		//!< Thread which sent the request.
+	fr_redis_command_set_t		*cmds;		//!< Commands in flight, NULL once the trunk has
+							//!< called us back.
+
+	char				key[256];	//!< Identifies the bucket.
+	char				rate_str[16];
+	char				burst_str[16];
+	char				lease_str[16];
+	char const			*argv[7];	//!< EVAL command.
+
+	bool				synced;		//!< Whether we've used the connection pool.
+	fr_redis_rcode_t		status;		//!< Of the command.
+	int64_t				granted;	//!< Tokens Redis gave us.
+} ratelimit_rctx_t;
+
+static CONF_PARSER module_config[] = {
+	REDIS_COMMON_CONFIG,
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_redis_ratelimit_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+
+	{ FR_CONF_OFFSET("key", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_redis_ratelimit_t, key) },
+	{ FR_CONF_OFFSET("key_prefix", FR_TYPE_STRING, rlm_redis_ratelimit_t, key_prefix), .dflt = "ratelimit:" },
+
+	{ FR_CONF_OFFSET("rate", FR_TYPE_UINT32 | FR_TYPE_REQUIRED, rlm_redis_ratelimit_t, rate) },
+	{ FR_CONF_OFFSET("burst", FR_TYPE_UINT32, rlm_redis_ratelimit_t, burst), .dflt = "0" },
+	{ FR_CONF_OFFSET("lease", FR_TYPE_UINT32, rlm_redis_ratelimit_t, lease), .dflt = "10" },
+	{ FR_CONF_OFFSET("lease_lifetime", FR_TYPE_TIME_DELTA, rlm_redis_ratelimit_t, lease_lifetime), .dflt = "1.0" },
+	{ FR_CONF_OFFSET("local_entries", FR_TYPE_UINT32, rlm_redis_ratelimit_t, local_entries), .dflt = "10000" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** Record what Redis gave us for a bucket
+ *
+ */
+static void ratelimit_lease_update(rlm_redis_ratelimit_thread_t *t, char const *key,
+				   uint32_t tokens, bool denied, fr_time_t expires)
+{
+	ratelimit_lease_t	*found;
+
+	found = fr_lru_insert(t->leases, key, ratelimit_lease_t);
+	if (!found) return;
+
+	found->tokens = tokens;
+	found->denied = denied;
+	found->expires = expires;
+}
+
+/** Interpret the reply to the script
+ *
+ */
+static fr_redis_rcode_t ratelimit_reply(REQUEST *request, redisReply *reply, void *uctx)
+{
+	ratelimit_rctx_t	*rctx = talloc_get_type_abort(uctx, ratelimit_rctx_t);
+
+	fr_redis_reply_print(L_DBG_LVL_3, reply, request, 0);
+
+	if (reply->type != REDIS_REPLY_INTEGER) {
+		REDEBUG("Expected type \"integer\" got type \"%s\"",
+			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
+		return REDIS_RCODE_ERROR;
+	}
+
+	rctx->granted = reply->integer;
+
+	return REDIS_RCODE_SUCCESS;
+}
+
+/** Run the script over the connection pool
+ *
+ */
+static fr_redis_rcode_t ratelimit_sync(ratelimit_rctx_t *rctx, REQUEST *request)
+{
+	rctx->synced = true;
+
+	return fr_redis_trunk_sync(rctx->inst->cluster, request,
+				   (uint8_t const *)rctx->key, strlen(rctx->key),
+				   NUM_ELEMENTS(rctx->argv), rctx->argv, ratelimit_reply, rctx);
+}
+
+/** Process the result of a request for tokens
+ *
+ */
+static rlm_rcode_t ratelimit_result(REQUEST *request, ratelimit_rctx_t *rctx)
+{
+	rlm_redis_ratelimit_t const	*inst = rctx->inst;
+	fr_time_t			now = fr_time();
+	fr_time_delta_t			denied_for;
+
+	if ((rctx->status != REDIS_RCODE_SUCCESS) && !rctx->synced && fr_redis_trunk_retry(rctx->status)) {
+		RDEBUG2("Pipelined command failed, retrying");
+		rctx->status = ratelimit_sync(rctx, request);
+	}
+
+	if (rctx->status != REDIS_RCODE_SUCCESS) {
+		REDEBUG("Failed taking tokens from bucket \"%s\"", rctx->key);
+		return RLM_MODULE_FAIL;
+	}
+
+	if (rctx->granted > 0) {
+		RDEBUG2("Leased %" PRId64 " token(s) from bucket \"%s\"", rctx->granted, rctx->key);
+		ratelimit_lease_update(rctx->t, rctx->key, (uint32_t)(rctx->granted - 1), false,
+				       now + inst->lease_lifetime);
+		return RLM_MODULE_OK;
+	}
+
+	/*
+	 *	Don't ask again until the bucket has had time to
+	 *	refill by at least one token.
+	 */
+	denied_for = NSEC / inst->rate;
+	if (denied_for > inst->lease_lifetime) denied_for = inst->lease_lifetime;
+	ratelimit_lease_update(rctx->t, rctx->key, 0, true, now + denied_for);
+
+	RDEBUG2("Bucket \"%s\" is empty", rctx->key);
+	return RLM_MODULE_DISALLOW;
+}
+
+static void ratelimit_async_complete(REQUEST *request, fr_dlist_head_t *completed, void *uctx)
+{
+	ratelimit_rctx_t	*rctx = talloc_get_type_abort(uctx, ratelimit_rctx_t);
+	redisReply		*reply;
+
+	rctx->cmds = NULL;	/* Freed by the trunk */
+
+	rctx->status = fr_redis_command_reply(&reply, request, fr_dlist_head(completed));
+	if (rctx->status == REDIS_RCODE_SUCCESS) rctx->status = ratelimit_reply(request, reply, rctx);
+
+	unlang_interpret_resumable(request);
+}
+
+static void ratelimit_async_fail(REQUEST *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	ratelimit_rctx_t	*rctx = talloc_get_type_abort(uctx, ratelimit_rctx_t);
+
+	rctx->cmds = NULL;	/* Freed by the trunk */
+	rctx->status = REDIS_RCODE_RECONNECT;
+
+	unlang_interpret_resumable(request);
+}
+
+/** Continue once Redis has replied
+ *
+ */
+static rlm_rcode_t mod_ratelimit_resume(UNUSED void *instance, UNUSED void *thread, REQUEST *request, void *uctx)
+{
+	ratelimit_rctx_t	*rctx = talloc_get_type_abort(uctx, ratelimit_rctx_t);
+	rlm_rcode_t		rcode;
+
+	rcode = ratelimit_result(request, rctx);
+	talloc_free(rctx);
+
+	return rcode;
+}
+
+/** Stop waiting for Redis if the request is cancelled
+ *
+ */
+static void mod_ratelimit_signal(UNUSED void *instance, UNUSED void *thread, UNUSED REQUEST *request, void *uctx,
+				 fr_state_signal_t action)
+{
+	ratelimit_rctx_t	*rctx = talloc_get_type_abort(uctx, ratelimit_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (rctx->cmds) {
+		fr_redis_command_set_cancel(rctx->cmds);	/* Trunk frees the command set */
+		rctx->cmds = NULL;
+	}
+	talloc_free(rctx);
+}
+
+/** Take a token from the bucket selected by the key
+ *
+ * @return
+ *	- RLM_MODULE_OK if there was a token.
+ *	- RLM_MODULE_DISALLOW if the bucket is empty.
+ *	- RLM_MODULE_NOOP if the key expanded to nothing.
+ *	- RLM_MODULE_FAIL if Redis couldn't be queried.
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_ratelimit(void *instance, void *thread, REQUEST *request)
+{
+	rlm_redis_ratelimit_t const	*inst = instance;
+	rlm_redis_ratelimit_thread_t	*t = talloc_get_type_abort(thread, rlm_redis_ratelimit_thread_t);
+	ratelimit_rctx_t		*rctx;
+	ratelimit_lease_t		*found;
+	fr_redis_command_set_t		*cmds;
+	fr_redis_trunk_t		*trunk;
+	char				buffer[256];
+	ssize_t				slen;
+	rlm_rcode_t			rcode;
+
+	slen = xlat_eval(buffer, sizeof(buffer), request, inst->key, NULL, NULL);
+	if (slen < 0) {
+		RPEDEBUG("Failed expanding key");
+		return RLM_MODULE_FAIL;
+	}
+	if (slen == 0) {
+		RDEBUG2("Key expanded to nothing, not limiting");
+		return RLM_MODULE_NOOP;
+	}
+
+	MEM(rctx = talloc_zero(request, ratelimit_rctx_t));
+	rctx->inst = inst;
+	rctx->t = t;
+
+	if ((size_t)snprintf(rctx->key, sizeof(rctx->key), "%s%s",
+			     inst->key_prefix, buffer) >= sizeof(rctx->key)) {
+		REDEBUG("Bucket key too long");
+		talloc_free(rctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	Use our own tokens if we have any.
+	 */
+	found = fr_lru_find(t->leases, rctx->key);
+	if (found && (found->expires > fr_time())) {
+		if (found->denied) {
+			RDEBUG2("Bucket \"%s\" was empty recently", rctx->key);
+			talloc_free(rctx);
+			return RLM_MODULE_DISALLOW;
+		}
+
+		if (found->tokens > 0) {
+			found->tokens--;
+			RDEBUG2("Using leased token from bucket \"%s\", %u left", rctx->key, found->tokens);
+			talloc_free(rctx);
+			return RLM_MODULE_OK;
+		}
+	}
+
+	snprintf(rctx->rate_str, sizeof(rctx->rate_str), "%u", inst->rate);
+	snprintf(rctx->burst_str, sizeof(rctx->burst_str), "%u", inst->burst);
+	snprintf(rctx->lease_str, sizeof(rctx->lease_str), "%u", inst->lease);
+	rctx->argv[0] = "EVAL";
+	rctx->argv[1] = ratelimit_script;
+	rctx->argv[2] = "1";
+	rctx->argv[3] = rctx->key;
+	rctx->argv[4] = rctx->rate_str;
+	rctx->argv[5] = rctx->burst_str;
+	rctx->argv[6] = rctx->lease_str;
+
+	RDEBUG2("Leasing up to %u token(s) from bucket \"%s\"", inst->lease, rctx->key);
+
+	trunk = fr_redis_cluster_trunk_by_key(t->cluster, inst->cluster, request,
+					      (uint8_t const *)rctx->key, strlen(rctx->key));
+	if (!trunk) {
+		RDEBUG2("No pipelined connections available");
+	sync:
+		rctx->status = ratelimit_sync(rctx, request);
+		rcode = ratelimit_result(request, rctx);
+		talloc_free(rctx);
+		return rcode;
+	}
+
+	cmds = fr_redis_command_set_alloc(NULL, request, ratelimit_async_complete, ratelimit_async_fail, rctx);
+	if (fr_redis_command_argv_add(cmds, NUM_ELEMENTS(rctx->argv), rctx->argv, NULL) != FR_REDIS_PIPELINE_OK) {
+		RPEDEBUG("Invalid command");
+		talloc_free(cmds);
+		talloc_free(rctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	if (redis_command_set_enqueue(trunk, cmds) != FR_REDIS_PIPELINE_OK) {
+		RDEBUG2("Failed enqueuing pipelined commands");
+		talloc_free(cmds);
+		goto sync;
+	}
+	rctx->cmds = cmds;
+
+	return unlang_module_yield(request, mod_ratelimit_resume, mod_ratelimit_signal, rctx);
+}
+
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
+{
+	rlm_redis_ratelimit_t *inst = instance;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	return 0;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_redis_ratelimit_t *inst = instance;
+
+	if (!inst->rate) {
+		cf_log_err(conf, "'rate' must be greater than zero");
+		return -1;
+	}
+
+	if (!inst->burst) inst->burst = inst->rate;
+
+	FR_INTEGER_BOUND_CHECK("lease", inst->lease, >=, 1);
+	FR_INTEGER_BOUND_CHECK("lease", inst->lease, <=, inst->burst);
+	FR_TIME_DELTA_BOUND_CHECK("lease_lifetime", inst->lease_lifetime, >=, fr_time_delta_from_msec(10));
+
+	/*
+	 *	Pipelined connections don't authenticate
+	 *	or select a database.
+	 */
+	if (inst->conf.password || inst->conf.database) {
+		cf_log_err(conf, "'password' and 'database' are not supported");
+		return -1;
+	}
+
+	inst->cluster = fr_redis_cluster_alloc(inst, conf, &inst->conf, true, NULL, NULL, NULL);
+	if (!inst->cluster) return -1;
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_redis_ratelimit_t		*inst = talloc_get_type_abort(instance, rlm_redis_ratelimit_t);
+	rlm_redis_ratelimit_thread_t	*t = talloc_get_type_abort(thread, rlm_redis_ratelimit_thread_t);
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, el, &inst->trunk_conf);
+	t->leases = fr_lru_alloc(t, inst->local_entries);
+	if (!t->leases) return -1;
+
+	return 0;
+}
+
+static int mod_load(void)
+{
+	fr_redis_version_print();
+
+	return 0;
+}
+
+extern module_t rlm_redis_ratelimit;
+module_t rlm_redis_ratelimit = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "redis_ratelimit",
+	.type		= RLM_TYPE_THREAD_SAFE,
+	.inst_size	= sizeof(rlm_redis_ratelimit_t),
+	.config		= module_config,
+	.onload		= mod_load,
+	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_inst_size	= sizeof(rlm_redis_ratelimit_thread_t),
+	.thread_inst_type	= "rlm_redis_ratelimit_thread_t",
+	.methods = {
+		[MOD_AUTHORIZE]		= mod_ratelimit,
+		[MOD_PREACCT]		= mod_ratelimit,
+		[MOD_ACCOUNTING]	= mod_ratelimit,
+		[MOD_POST_AUTH]		= mod_ratelimit
+	},
+};
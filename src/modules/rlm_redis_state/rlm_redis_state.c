@@ -0,0 +1,391 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_redis_state.c
+ * @brief Store session-state in Redis so that any server can continue a conversation.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/state.h>
+#include <freeradius-devel/util/debug.h>
+
+#include <freeradius-devel/internal/internal.h>
+
+#include <freeradius-devel/redis/base.h>
+#include <freeradius-devel/redis/cluster.h>
+
+/*
+ *	Largest encoded session-state we'll store.
+ */
+#define REDIS_STATE_MAX_LEN	65535
+
+typedef struct {
+	fr_redis_conf_t		conf;		//!< Connection parameters for the Redis server.
+						//!< Must be first field in this struct.
+
+	char const		*name;		//!< Instance name.
+	CONF_SECTION		*cs;
+	fr_redis_cluster_t	*cluster;	//!< Pool O pools
+
+	char const		*key_prefix;	//!< Prepended to the State value to form the key.
+
+	fr_state_backend_t	*backend;	//!< Published in our config section.
+} rlm_redis_state_t;
+
+static CONF_PARSER module_config[] = {
+	REDIS_COMMON_CONFIG,
+
+	{ FR_CONF_OFFSET("key_prefix", FR_TYPE_STRING, rlm_redis_state_t, key_prefix), .dflt = "session-state:" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static fr_dict_t const *dict_freeradius;
+static fr_dict_t const *dict_radius;
+
+extern fr_dict_autoload_t rlm_redis_state_dict[];
+fr_dict_autoload_t rlm_redis_state_dict[] = {
+	{ .out = &dict_freeradius, .proto = "freeradius" },
+	{ .out = &dict_radius, .proto = "radius" },
+	{ NULL }
+};
+
+/*
+ *	The internal encoding doesn't record which dictionary
+ *	an attribute came from, so each encoded attribute is
+ *	preceded by one of these.
+ */
+typedef enum {
+	REDIS_STATE_DICT_INTERNAL = 0,
+	REDIS_STATE_DICT_RADIUS
+} redis_state_dict_t;
+
+/** Build the Redis key for a State value
+ *
+ * @return the key, which must be freed by the caller.
+ */
+static uint8_t *redis_state_key(TALLOC_CTX *ctx, size_t *out_len, rlm_redis_state_t const *inst,
+				uint8_t const *key, size_t key_len)
+{
+	size_t	prefix_len = talloc_array_length(inst->key_prefix) - 1;
+	uint8_t	*out;
+
+	MEM(out = talloc_array(ctx, uint8_t, prefix_len + key_len));
+	memcpy(out, inst->key_prefix, prefix_len);
+	memcpy(out + prefix_len, key, key_len);
+	*out_len = prefix_len + key_len;
+
+	return out;
+}
+
+/** Serialise the session-state attributes, and store them in Redis
+ *
+ */
+static int redis_state_insert(void *uctx, REQUEST *request, uint8_t const *key, size_t key_len,
+			      VALUE_PAIR *vps, fr_time_delta_t lifetime)
+{
+	rlm_redis_state_t const		*inst = talloc_get_type_abort_const(uctx, rlm_redis_state_t);
+	fr_redis_cluster_state_t	state;
+	fr_redis_conn_t			*conn;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL;
+	int				s_ret;
+
+	fr_cursor_t			cursor;
+	VALUE_PAIR			*vp;
+	uint8_t				*buff, *p, *end;
+	uint8_t				*rkey;
+	size_t				rkey_len;
+	int				ret = -1;
+
+	MEM(buff = talloc_array(request, uint8_t, REDIS_STATE_MAX_LEN));
+	p = buff;
+	end = buff + REDIS_STATE_MAX_LEN;
+
+	for (vp = fr_cursor_init(&cursor, &vps);
+	     vp;
+	     vp = fr_cursor_current(&cursor)) {
+		ssize_t slen;
+
+		if (p >= end) {
+		too_big:
+			RPERROR("Failed encoding session-state");
+			talloc_free(buff);
+			return -1;
+		}
+
+		*p++ = (fr_dict_by_da(vp->da) == dict_radius) ? REDIS_STATE_DICT_RADIUS : REDIS_STATE_DICT_INTERNAL;
+
+		slen = fr_internal_encode_pair(p, end - p, &cursor, NULL);
+		if (slen <= 0) goto too_big;
+		p += slen;
+	}
+
+	rkey = redis_state_key(request, &rkey_len, inst, key, key_len);
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, rkey, rkey_len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
+		reply = redisCommand(conn->handle, "SET %b %b EX %u", rkey, rkey_len, buff, (size_t)(p - buff),
+				     (unsigned int)(fr_time_delta_to_sec(lifetime) + 1));
+		status = fr_redis_command_status(conn, reply);
+	}
+	talloc_free(buff);
+	talloc_free(rkey);
+
+	if (s_ret != REDIS_RCODE_SUCCESS) {
+		RPERROR("Failed storing session-state");
+		fr_redis_reply_free(&reply);
+		return -1;
+	}
+
+	if (reply && (reply->type == REDIS_REPLY_STATUS)) ret = 0;
+	fr_redis_reply_free(&reply);
+
+	return ret;
+}
+
+/** Retrieve and remove session-state from Redis
+ *
+ * The GET and DEL are performed in a single transaction, so only one
+ * server can ever restore a given entry.
+ */
+static int redis_state_fetch(TALLOC_CTX *ctx, VALUE_PAIR **out, void *uctx, REQUEST *request,
+			     uint8_t const *key, size_t key_len)
+{
+	rlm_redis_state_t const		*inst = talloc_get_type_abort_const(uctx, rlm_redis_state_t);
+	fr_redis_cluster_state_t	state;
+	fr_redis_conn_t			*conn;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL, *value;
+	redisReply			*replies[4];	/* MULTI, GET, DEL, EXEC */
+	size_t				reply_cnt = 0, i;
+	unsigned int			pipelined = 0;
+	int				s_ret;
+
+	fr_cursor_t			cursor;
+	uint8_t const			*p, *end;
+	uint8_t				*rkey;
+	size_t				rkey_len;
+	int				ret = -1;
+
+	rkey = redis_state_key(request, &rkey_len, inst, key, key_len);
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, rkey, rkey_len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
+		RDEBUG3("MULTI");
+		if (redisAppendCommand(conn->handle, "MULTI") != REDIS_OK) {
+		append_error:
+			RERROR("Failed appending Redis command to output buffer: %s", conn->handle->errstr);
+			talloc_free(rkey);
+			return -1;
+		}
+		pipelined++;
+
+		RDEBUG3("GET \"%pV\"", fr_box_octets(rkey, rkey_len));
+		if (redisAppendCommand(conn->handle, "GET %b", rkey, rkey_len) != REDIS_OK) goto append_error;
+		pipelined++;
+
+		RDEBUG3("DEL \"%pV\"", fr_box_octets(rkey, rkey_len));
+		if (redisAppendCommand(conn->handle, "DEL %b", rkey, rkey_len) != REDIS_OK) goto append_error;
+		pipelined++;
+
+		RDEBUG3("EXEC");
+		if (redisAppendCommand(conn->handle, "EXEC") != REDIS_OK) goto append_error;
+		pipelined++;
+
+		reply_cnt = fr_redis_pipeline_result(&pipelined, &status,
+						     replies, NUM_ELEMENTS(replies),
+						     conn);
+		reply = replies[0];
+	}
+	talloc_free(rkey);
+
+	if (s_ret != REDIS_RCODE_SUCCESS) {
+		RPERROR("Failed retrieving session-state");
+		return -1;
+	}
+
+	if (RDEBUG_ENABLED3) for (i = 0; i < reply_cnt; i++) fr_redis_reply_print(L_DBG_LVL_3, replies[i], request, i);
+
+	/*
+	 *	The EXEC result contains the results of the
+	 *	GET and the DEL.
+	 */
+	if (reply_cnt != NUM_ELEMENTS(replies)) {
+		REDEBUG("Expected %zu results, got %zu", NUM_ELEMENTS(replies), reply_cnt);
+		goto finish;
+	}
+
+	reply = replies[reply_cnt - 1];
+	if ((reply->type != REDIS_REPLY_ARRAY) || (reply->elements != 2)) {
+		REDEBUG("Bad result type, expected array, got %s",
+			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
+		goto finish;
+	}
+
+	value = reply->element[0];
+	switch (value->type) {
+	case REDIS_REPLY_NIL:
+		ret = 0;
+		goto finish;
+
+	case REDIS_REPLY_STRING:
+		break;
+
+	default:
+		REDEBUG("Bad result type, expected string, got %s",
+			fr_table_str_by_value(redis_reply_types, value->type, "<UNKNOWN>"));
+		goto finish;
+	}
+
+	p = (uint8_t const *)value->str;
+	end = p + value->len;
+
+	fr_cursor_init(&cursor, out);
+	while (p < end) {
+		fr_dict_t const	*dict;
+		ssize_t		slen;
+
+		switch (*p++) {
+		case REDIS_STATE_DICT_INTERNAL:
+			dict = dict_freeradius;
+			break;
+
+		case REDIS_STATE_DICT_RADIUS:
+			dict = dict_radius;
+			break;
+
+		default:
+			REDEBUG("Unknown dictionary in session-state entry");
+			goto decode_error;
+		}
+
+		slen = fr_internal_decode_pair(ctx, &cursor, dict, p, end - p, NULL);
+		if (slen <= 0) {
+			RPERROR("Failed decoding session-state");
+		decode_error:
+			fr_cursor_head(&cursor);
+			fr_cursor_free_list(&cursor);
+			goto finish;
+		}
+		p += slen;
+	}
+	ret = 1;
+
+finish:
+	fr_redis_pipeline_free(replies, reply_cnt);
+
+	return ret;
+}
+
+/** Remove session-state from Redis
+ *
+ */
+static int redis_state_discard(void *uctx, REQUEST *request, uint8_t const *key, size_t key_len)
+{
+	rlm_redis_state_t const		*inst = talloc_get_type_abort_const(uctx, rlm_redis_state_t);
+	fr_redis_cluster_state_t	state;
+	fr_redis_conn_t			*conn;
+	fr_redis_rcode_t		status;
+	redisReply			*reply = NULL;
+	int				s_ret;
+
+	uint8_t				*rkey;
+	size_t				rkey_len;
+
+	rkey = redis_state_key(request, &rkey_len, inst, key, key_len);
+
+	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, rkey, rkey_len, false);
+	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
+	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
+		reply = redisCommand(conn->handle, "DEL %b", rkey, rkey_len);
+		status = fr_redis_command_status(conn, reply);
+	}
+	talloc_free(rkey);
+	fr_redis_reply_free(&reply);
+
+	if (s_ret != REDIS_RCODE_SUCCESS) {
+		RPERROR("Failed discarding session-state");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
+{
+	rlm_redis_state_t *inst = instance;
+
+	inst->cs = conf;
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	/*
+	 *	Publish the backend so that proto_* modules
+	 *	can find it with "session { backend = <name> }".
+	 */
+	MEM(inst->backend = talloc_zero(inst, fr_state_backend_t));
+	inst->backend->name = inst->name;
+	inst->backend->insert = redis_state_insert;
+	inst->backend->fetch = redis_state_fetch;
+	inst->backend->discard = redis_state_discard;
+	inst->backend->uctx = inst;
+
+	if (!cf_data_add(conf, inst->backend, NULL, false)) {
+		cf_log_err(conf, "Failed registering session-state backend");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_redis_state_t *inst = instance;
+
+	inst->cluster = fr_redis_cluster_alloc(inst, conf, &inst->conf, true, NULL, NULL, NULL);
+	if (!inst->cluster) return -1;
+
+	return 0;
+}
+
+static int mod_load(void)
+{
+	fr_redis_version_print();
+
+	return 0;
+}
+
+extern module_t rlm_redis_state;
+module_t rlm_redis_state = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "redis_state",
+	.type		= RLM_TYPE_THREAD_SAFE,
+	.inst_size	= sizeof(rlm_redis_state_t),
+	.config		= module_config,
+	.onload		= mod_load,
+	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
+};
@@ -35,6 +35,8 @@ RCSID("$Id$")
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
+#include <freeradius-devel/unlang/base.h>
 
 typedef struct {
 	fr_redis_conf_t		conf;		//!< Connection parameters for the Redis server.
@@ -51,8 +53,38 @@ typedef struct {
 	char const		*insert;	//!< Command for inserting session data
 	char const		*trim;		//!< Command for trimming the session list.
 	char const		*expire;	//!< Command for expiring entries.
+
+	bool			pipeline;	//!< Send each packet's commands together over
+						//!< pipelined connections.
+	fr_trunk_conf_t		trunk_conf;	//!< For the pipelined connections.
 } rlm_rediswho_t;
 
+/** Thread specific data for rlm_rediswho
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster;	//!< Pipelined connections to the cluster's nodes.
+} rlm_rediswho_thread_t;
+
+/** An expanded command
+ *
+ */
+typedef struct {
+	int			argc;		//!< Number of arguments, 0 if there's no command.
+	char const		*argv[MAX_REDIS_ARGS];	//!< Arguments, pointing into argv_buf.
+	char			argv_buf[MAX_REDIS_COMMAND_LEN];
+} rediswho_cmd_t;
+
+/** The commands for an accounting packet
+ *
+ */
+typedef enum {
+	REDISWHO_INSERT = 0,
+	REDISWHO_TRIM,
+	REDISWHO_EXPIRE,
+	REDISWHO_MAX
+} rediswho_cmd_type_t;
+
 static CONF_PARSER section_config[] = {
 	{ FR_CONF_OFFSET("insert", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_rediswho_t, insert) },
 	{ FR_CONF_OFFSET("trim", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_rediswho_t, trim) }, /* required only if trim_count > 0 */
@@ -62,6 +94,8 @@ static CONF_PARSER section_config[] = {
 
 static CONF_PARSER module_config[] = {
 	REDIS_COMMON_CONFIG,
+	{ FR_CONF_OFFSET("pipeline", FR_TYPE_BOOL, rlm_rediswho_t, pipeline), .dflt = "no" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_rediswho_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 
 	{ FR_CONF_OFFSET("trim_count", FR_TYPE_INT32, rlm_rediswho_t, trim_count), .dflt = "-1" },
 
@@ -95,60 +129,65 @@ fr_dict_attr_autoload_t rlm_rediswho_dict_attr[] = {
 	{ NULL }
 };
 
-/*
- *	Query the database executing a command with no result rows
+/** Expand a command, splitting it into arguments
+ *
+ * @param[out] cmd	to populate.  argc is 0 if there's no command.
+ * @param[in] request	The current request.
+ * @param[in] fmt	Command to expand.  May be NULL.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, char const *fmt)
+static int rediswho_expand(rediswho_cmd_t *cmd, REQUEST *request, char const *fmt)
 {
-	fr_redis_conn_t		*conn;
-
-	int 			ret = -1;
-
-	fr_redis_cluster_state_t	state;
-	fr_redis_rcode_t		status;
-	redisReply		*reply = NULL;
-	int			s_ret;
-
-	uint8_t	const		*key = NULL;
-	size_t			key_len = 0;
-
-	int			argc;
-	char const		*argv[MAX_REDIS_ARGS];
-	char			argv_buf[MAX_REDIS_COMMAND_LEN];
+	cmd->argc = 0;
 
 	if (!fmt || !*fmt) return 0;
 
-	argc = rad_expand_xlat(request, fmt, MAX_REDIS_ARGS, argv, false, sizeof(argv_buf), argv_buf);
-	if (argc < 0) {
+	cmd->argc = rad_expand_xlat(request, fmt, MAX_REDIS_ARGS, cmd->argv, false,
+				    sizeof(cmd->argv_buf), cmd->argv_buf);
+	if (cmd->argc < 0) {
 		RPEDEBUG("Invalid command: %s", fmt);
+		cmd->argc = 0;
 		return -1;
 	}
 
-	/*
-	 *	If we've got multiple arguments, the second one is usually the key.
-	 *	The Redis docs say commands should be analysed first to get key
-	 *	positions, but this involves sending them to the server, which is
-	 *	just as expensive as sending them to the wrong server and receiving
-	 *	a redirect.
-	 */
-	if (argc > 1) {
-		key = (uint8_t const *)argv[1];
-	 	key_len = strlen((char const *)key);
-	}
+	return 0;
+}
 
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
-		reply = redisCommandArgv(conn->handle, argc, argv, NULL);
-		status = fr_redis_command_status(conn, reply);
-	}
-	if (s_ret != REDIS_RCODE_SUCCESS) {
-		RERROR("Failed inserting accounting data");
-	error:
-		fr_redis_reply_free(&reply);
-		return -1;
+/** Return the key for a command
+ *
+ * If we've got multiple arguments, the second one is usually the key.
+ * The Redis docs say commands should be analysed first to get key
+ * positions, but this involves sending them to the server, which is
+ * just as expensive as sending them to the wrong server and receiving
+ * a redirect.
+ */
+static inline void rediswho_key(uint8_t const **key, size_t *key_len, rediswho_cmd_t const *cmd)
+{
+	if (cmd->argc > 1) {
+		*key = (uint8_t const *)cmd->argv[1];
+		*key_len = strlen(cmd->argv[1]);
+		return;
 	}
-	if (!fr_cond_assert(reply)) goto error;
+
+	*key = NULL;
+	*key_len = 0;
+}
+
+/** Interpret the reply to a command
+ *
+ * @param[in] request	The current request.
+ * @param[in] reply	to the command.
+ * @param[in] uctx	Where to write the (positive) integer the server returned,
+ *			0 if the server returned a status such as "OK", or -1 on
+ *			error, or if the result wasn't a positive integer.
+ * @return REDIS_RCODE_SUCCESS.
+ */
+static fr_redis_rcode_t rediswho_reply(REQUEST *request, redisReply *reply, void *uctx)
+{
+	int	*out = uctx;
+	int	ret = -1;
 
 	/*
 	 *	Write the response to the debug log
@@ -163,6 +202,13 @@ static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, char c
 		if (reply->integer > 0) ret = reply->integer;
 		break;
 
+	/*
+	 *	e.g. "OK" from LTRIM.
+	 */
+	case REDIS_REPLY_STATUS:
+		ret = 0;
+		break;
+
 	/*
 	 *	We don't know to interpret this, the user has probably messed
 	 *	up the queries, so print an error message and fail.
@@ -172,38 +218,250 @@ static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, char c
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
 		break;
 	}
-	fr_redis_reply_free(&reply);
+
+	*out = ret;
+
+	return REDIS_RCODE_SUCCESS;
+}
+
+/*
+ *	Query the database executing a command with no result rows
+ */
+static int rediswho_command(rlm_rediswho_t const *inst, REQUEST *request, rediswho_cmd_t const *cmd)
+{
+	int			ret = -1;
+	uint8_t	const		*key;
+	size_t			key_len;
+
+	if (cmd->argc == 0) return 0;
+
+	rediswho_key(&key, &key_len, cmd);
+
+	if (fr_redis_trunk_sync(inst->cluster, request, key, key_len, cmd->argc, (char const **)cmd->argv,
+				rediswho_reply, &ret) != REDIS_RCODE_SUCCESS) {
+		RERROR("Failed inserting accounting data");
+		return -1;
+	}
 
 	return ret;
 }
 
-static rlm_rcode_t mod_accounting_all(rlm_rediswho_t const *inst, REQUEST *request,
-				      char const *insert,
-				      char const *trim,
-				      char const *expire)
+static rlm_rcode_t mod_accounting_all(rlm_rediswho_t const *inst, REQUEST *request, rediswho_cmd_t const cmd[])
 {
 	int ret;
 
-	ret = rediswho_command(inst, request, insert);
+	ret = rediswho_command(inst, request, &cmd[REDISWHO_INSERT]);
 	if (ret < 0) return RLM_MODULE_FAIL;
 
 	/* Only trim if necessary */
 	if ((inst->trim_count >= 0) && (ret > inst->trim_count)) {
-		if (rediswho_command(inst, request, trim) < 0) return RLM_MODULE_FAIL;
+		if (rediswho_command(inst, request, &cmd[REDISWHO_TRIM]) < 0) return RLM_MODULE_FAIL;
 	}
 
-	if (rediswho_command(inst, request, expire) < 0) return RLM_MODULE_FAIL;
+	if (rediswho_command(inst, request, &cmd[REDISWHO_EXPIRE]) < 0) return RLM_MODULE_FAIL;
 	return RLM_MODULE_OK;
 }
 
-static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+/** Asynchronous accounting state
+ *
+ */
+typedef struct {
+	rlm_rediswho_t const	*inst;		//!< Module instance.
+	fr_redis_command_set_t	*cmds;		//!< Commands in flight, NULL once the trunk has
+						//!< called us back.
+
+	rediswho_cmd_t		cmd[REDISWHO_MAX];	//!< Expanded commands.
+	bool			sent[REDISWHO_MAX];	//!< Which commands are in the command set.
+	bool			replied[REDISWHO_MAX];	//!< Which commands we've received replies for.
+
+	fr_redis_rcode_t	status;		//!< Of the first command which failed, or success.
+	int			ret[REDISWHO_MAX];	//!< Results of the commands.
+} rediswho_async_t;
+
+/** Process the replies to the commands for an accounting packet
+ *
+ */
+static void rediswho_async_complete(REQUEST *request, fr_dlist_head_t *completed, void *uctx)
+{
+	rediswho_async_t	*rctx = talloc_get_type_abort(uctx, rediswho_async_t);
+	fr_redis_command_t	*cmd = fr_dlist_head(completed);
+	int			i;
+
+	rctx->cmds = NULL;	/* Freed by the trunk */
+	rctx->status = REDIS_RCODE_SUCCESS;
+
+	for (i = 0; i < REDISWHO_MAX; i++) {
+		redisReply *reply;
+
+		if (!rctx->sent[i]) continue;
+
+		rctx->status = fr_redis_command_reply(&reply, request, cmd);
+		if (rctx->status != REDIS_RCODE_SUCCESS) break;
+
+		rediswho_reply(request, reply, &rctx->ret[i]);
+		rctx->replied[i] = true;
+		cmd = fr_dlist_next(completed, cmd);
+	}
+
+	unlang_interpret_resumable(request);
+}
+
+/** Record that the commands for an accounting packet couldn't be sent
+ *
+ */
+static void rediswho_async_fail(REQUEST *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	rediswho_async_t	*rctx = talloc_get_type_abort(uctx, rediswho_async_t);
+
+	rctx->cmds = NULL;	/* Freed by the trunk */
+	rctx->status = REDIS_RCODE_RECONNECT;
+
+	unlang_interpret_resumable(request);
+}
+
+/** Continue processing an accounting packet once the replies have been received
+ *
+ * Only the insert decides the result.  The trim and expire are
+ * housekeeping, and the trim is sent whether or not it's needed.
+ */
+static rlm_rcode_t mod_accounting_resume(void *instance, UNUSED void *thread, REQUEST *request, void *uctx)
 {
 	rlm_rediswho_t const	*inst = instance;
+	rediswho_async_t	*rctx = talloc_get_type_abort(uctx, rediswho_async_t);
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	int			i;
+
+	if (rctx->status != REDIS_RCODE_SUCCESS) {
+		if (!fr_redis_trunk_retry(rctx->status)) {
+			RERROR("Failed inserting accounting data");
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+
+		/*
+		 *	Commands we have replies for have already been
+		 *	run, and re-running the insert would add a
+		 *	duplicate entry.
+		 */
+		RDEBUG2("Pipelined commands failed, retrying those without replies");
+		for (i = 0; i < REDISWHO_MAX; i++) {
+			if (!rctx->sent[i] || rctx->replied[i]) continue;
+
+			rctx->ret[i] = rediswho_command(inst, request, &rctx->cmd[i]);
+		}
+	}
+
+	if (rctx->sent[REDISWHO_INSERT] && (rctx->ret[REDISWHO_INSERT] < 0)) {
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	if (rctx->sent[REDISWHO_TRIM] && (rctx->ret[REDISWHO_TRIM] < 0)) RWDEBUG("Failed trimming session list");
+	if (rctx->sent[REDISWHO_EXPIRE] && (rctx->ret[REDISWHO_EXPIRE] < 0)) RWDEBUG("Failed setting session list expiry");
+
+finish:
+	talloc_free(rctx);
+
+	return rcode;
+}
+
+/** Stop the commands for an accounting packet if the request is cancelled
+ *
+ */
+static void mod_accounting_signal(UNUSED void *instance, UNUSED void *thread, UNUSED REQUEST *request, void *uctx,
+				  fr_state_signal_t action)
+{
+	rediswho_async_t	*rctx = talloc_get_type_abort(uctx, rediswho_async_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (rctx->cmds) {
+		fr_redis_command_set_cancel(rctx->cmds);	/* Trunk frees the command set */
+		rctx->cmds = NULL;
+	}
+	talloc_free(rctx);
+}
+
+/** Send all the commands for an accounting packet as a single pipelined set
+ *
+ * The trim is sent unconditionally, as we don't know the length of the
+ * list until the insert completes.  Trimming a list which is already
+ * short enough doesn't change it.
+ */
+static rlm_rcode_t mod_accounting_async(rlm_rediswho_t const *inst, rlm_rediswho_thread_t *t, REQUEST *request,
+					char const *insert, char const *trim, char const *expire)
+{
+	rediswho_async_t	*rctx;
+	fr_redis_command_set_t	*cmds;
+	fr_redis_trunk_t	*trunk;
+	uint8_t const		*key;
+	size_t			key_len;
+	int			i;
 	rlm_rcode_t		rcode;
+
+	MEM(rctx = talloc_zero(request, rediswho_async_t));
+	rctx->inst = inst;
+
+	if ((rediswho_expand(&rctx->cmd[REDISWHO_INSERT], request, insert) < 0) ||
+	    (rediswho_expand(&rctx->cmd[REDISWHO_TRIM], request, trim) < 0) ||
+	    (rediswho_expand(&rctx->cmd[REDISWHO_EXPIRE], request, expire) < 0)) {
+	error:
+		talloc_free(rctx);
+		return RLM_MODULE_FAIL;
+	}
+
+	rctx->sent[REDISWHO_INSERT] = (rctx->cmd[REDISWHO_INSERT].argc > 0);
+	rctx->sent[REDISWHO_TRIM] = (inst->trim_count >= 0) && (rctx->cmd[REDISWHO_TRIM].argc > 0);
+	rctx->sent[REDISWHO_EXPIRE] = (rctx->cmd[REDISWHO_EXPIRE].argc > 0);
+
+	/*
+	 *	All the commands normally operate on the same
+	 *	key, so they go to the node serving the insert.
+	 */
+	rediswho_key(&key, &key_len, &rctx->cmd[REDISWHO_INSERT]);
+	trunk = fr_redis_cluster_trunk_by_key(t->cluster, inst->cluster, request, key, key_len);
+	if (!trunk) {
+		RDEBUG2("No pipelined connections available");
+		goto sync;
+	}
+
+	cmds = fr_redis_command_set_alloc(NULL, request, rediswho_async_complete, rediswho_async_fail, rctx);
+	for (i = 0; i < REDISWHO_MAX; i++) {
+		if (!rctx->sent[i]) continue;
+
+		if (fr_redis_command_argv_add(cmds, rctx->cmd[i].argc, rctx->cmd[i].argv, NULL) != FR_REDIS_PIPELINE_OK) {
+			RPEDEBUG("Invalid command");
+			talloc_free(cmds);
+			goto error;
+		}
+	}
+
+	if (redis_command_set_enqueue(trunk, cmds) != FR_REDIS_PIPELINE_OK) {
+		RDEBUG2("Failed enqueuing pipelined commands");
+		talloc_free(cmds);
+		goto sync;
+	}
+	rctx->cmds = cmds;
+
+	return unlang_module_yield(request, mod_accounting_resume, mod_accounting_signal, rctx);
+
+sync:
+	rcode = mod_accounting_all(inst, request, rctx->cmd);
+	talloc_free(rctx);
+
+	return rcode;
+}
+
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, void *thread, REQUEST *request)
+{
+	rlm_rediswho_t const	*inst = instance;
+	rlm_rediswho_thread_t	*t = talloc_get_type_abort(thread, rlm_rediswho_thread_t);
 	VALUE_PAIR		*vp;
 	fr_dict_enum_t		*dv;
 	CONF_SECTION		*cs;
 	char const		*insert, *trim, *expire;
+	rediswho_cmd_t		*cmd;
+	rlm_rcode_t		rcode;
 
 	vp = fr_pair_find_by_da(request->packet->vps, attr_acct_status_type, TAG_ANY);
 	if (!vp) {
@@ -227,7 +485,21 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 	trim = cf_pair_value(cf_pair_find(cs, "trim"));
 	expire = cf_pair_value(cf_pair_find(cs, "expire"));
 
-	rcode = mod_accounting_all(inst, request, insert, trim, expire);
+	if (inst->pipeline) return mod_accounting_async(inst, t, request, insert, trim, expire);
+
+	/*
+	 *	The expanded commands are too large for the stack.
+	 */
+	MEM(cmd = talloc_array(request, rediswho_cmd_t, REDISWHO_MAX));
+	if ((rediswho_expand(&cmd[REDISWHO_INSERT], request, insert) < 0) ||
+	    (rediswho_expand(&cmd[REDISWHO_TRIM], request, trim) < 0) ||
+	    (rediswho_expand(&cmd[REDISWHO_EXPIRE], request, expire) < 0)) {
+		talloc_free(cmd);
+		return RLM_MODULE_FAIL;
+	}
+
+	rcode = mod_accounting_all(inst, request, cmd);
+	talloc_free(cmd);
 
 	return rcode;
 }
@@ -250,6 +522,27 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->cluster = fr_redis_cluster_alloc(inst, conf, &inst->conf, true, NULL, NULL, NULL);
 	if (!inst->cluster) return -1;
 
+	/*
+	 *	Pipelined connections don't authenticate
+	 *	or select a database.
+	 */
+	if (inst->pipeline && (inst->conf.password || inst->conf.database)) {
+		cf_log_err(conf, "'pipeline' does not support 'password' or 'database'");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_rediswho_t		*inst = talloc_get_type_abort(instance, rlm_rediswho_t);
+	rlm_rediswho_thread_t	*t = talloc_get_type_abort(thread, rlm_rediswho_thread_t);
+
+	if (!inst->pipeline) return 0;
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, el, &inst->trunk_conf);
+
 	return 0;
 }
 
@@ -270,6 +563,9 @@ module_t rlm_rediswho = {
 	.onload		= mod_load,
 	.instantiate	= mod_instantiate,
 	.bootstrap	= mod_bootstrap,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_inst_size	= sizeof(rlm_rediswho_thread_t),
+	.thread_inst_type	= "rlm_rediswho_thread_t",
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting
 	},
@@ -36,6 +36,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/util/base.h>
 #include <freeradius-devel/server/pool.h>
+#include <freeradius-devel/server/trace.h>
 
 #include "rest.h"
 
@@ -551,7 +552,7 @@ static size_t rest_encode_json(void *out, size_t size, size_t nmemb, void *userd
 		if (!encoded) return -1;
 
 		data->start = data->p = encoded;
-		data->len = strlen(encoded);
+		data->len = talloc_array_length(encoded) - 1;
 
 		RDEBUG3("JSON Data: %s", encoded);
 		RDEBUG3("Returning %zd bytes of JSON data", data->len);
@@ -1176,12 +1177,106 @@ static int json_pair_alloc(rlm_rest_t const *instance, rlm_rest_section_t const
 	return max - max_attrs;
 }
 
+/** Incremental JSON decoder state
+ *
+ * Lives in rlm_rest_response_t->decoder for the duration of a single transfer.
+ */
+typedef struct {
+	json_tokener		*tok;		//!< Tokener fed with each chunk of body data.
+	json_object		*root;		//!< Root object, once the tokener has seen all of it.
+	bool			started;	//!< Whether we've seen anything other than whitespace.
+	bool			failed;		//!< Body was malformed, and should not be decoded.
+} rest_json_decoder_t;
+
+static int _rest_json_decoder_free(rest_json_decoder_t *decoder)
+{
+	if (decoder->root) json_object_put(decoder->root);
+	if (decoder->tok) json_tokener_free(decoder->tok);
+
+	return 0;
+}
+
+/** Feed a chunk of body data to the incremental JSON decoder
+ *
+ * Called from rest_response_body as each chunk of body data is received,
+ * so that tokenisation overlaps with the transfer, and we don't need to
+ * hold a copy of the complete body before decoding it.
+ *
+ * @param[in] ctx	response context.
+ * @param[in] in	chunk of body data.
+ * @param[in] inlen	length of the chunk.
+ * @return
+ *	- 0 on success (or if more data is needed).
+ *	- -1 if the body was malformed.
+ */
+static int rest_response_body_json(rlm_rest_response_t *ctx, char const *in, size_t inlen)
+{
+	REQUEST			*request = ctx->request; /* Used by RDEBUG */
+	rest_json_decoder_t	*decoder = ctx->decoder;
+	char const		*p = in, *end = in + inlen;
+	enum json_tokener_error	jerr;
+
+	if (!decoder) {
+		MEM(decoder = talloc_zero(NULL, rest_json_decoder_t));
+		talloc_set_destructor(decoder, _rest_json_decoder_free);
+		MEM(decoder->tok = json_tokener_new());
+		ctx->decoder = decoder;
+	}
+
+	if (decoder->failed) return -1;
+
+	/*
+	 *  Skip leading whitespace so that a whitespace
+	 *  only body is treated the same as an empty one.
+	 */
+	if (!decoder->started) {
+		while ((p < end) && isspace((uint8_t)*p)) p++;
+		if (p == end) return 0;
+		decoder->started = true;
+	}
+
+	/*
+	 *  Anything after the root object should be whitespace.
+	 */
+	if (decoder->root) {
+	trailing:
+		while ((p < end) && isspace((uint8_t)*p)) p++;
+		if (p == end) return 0;
+
+		REDEBUG("Malformed JSON data, unexpected data after root object: \"%pV\"",
+			fr_box_strvalue_len(p, end - p));
+		goto error;
+	}
+
+	decoder->root = json_tokener_parse_ex(decoder->tok, p, end - p);
+	jerr = json_tokener_get_error(decoder->tok);
+	switch (jerr) {
+	case json_tokener_continue:
+		return 0;
+
+	case json_tokener_success:
+		if (!decoder->root) {
+			REDEBUG("Malformed JSON data, got null root object");
+			goto error;
+		}
+		RDEBUG3("Tokenised JSON body (%zu bytes)", ctx->received);
+		p += decoder->tok->char_offset;
+		goto trailing;
+
+	default:
+		REDEBUG("Malformed JSON data: %s", json_tokener_error_desc(jerr));
+	error:
+		decoder->failed = true;
+		return -1;
+	}
+}
+
 /** Converts JSON response into VALUE_PAIRs and adds them to the request.
  *
- * Converts the raw JSON string into a json-c object tree and passes it to
- * json_pair_alloc. After the tree has been parsed json_object_put is called
- * which decrements the reference count of the root node by one, and frees
- * the entire tree.
+ * The body has already been tokenised by rest_response_body_json as it was
+ * received, so all that's left to do here is check the tokener saw a complete
+ * object, and pass it to json_pair_alloc.  The tree is freed along with the
+ * decoder in rest_request_cleanup.
  *
  * @see rest_encode_json
  * @see json_pair_alloc
@@ -1190,41 +1285,27 @@ static int json_pair_alloc(rlm_rest_t const *instance, rlm_rest_section_t const
  * @param[in] section	configuration data.
  * @param[in,out] request Current request.
  * @param[in] randle	REST handle.
- * @param[in] raw	buffer containing JSON data.
- * @param[in] rawlen	Length of data in raw buffer.
+ * @param[in] decoder	holding the tokenised JSON body.
  * @return
  *	- The number of #VALUE_PAIR processed.
  *	- -1 on unrecoverable error.
  */
 static int rest_decode_json(rlm_rest_t const *instance, rlm_rest_section_t const *section,
-			    REQUEST *request, UNUSED fr_curl_io_request_t *randle, char *raw, UNUSED size_t rawlen)
+			    REQUEST *request, UNUSED fr_curl_io_request_t *randle, rest_json_decoder_t *decoder)
 {
-	char const *p = raw;
-
-	struct json_object *json;
-
-	int ret;
-
 	/*
 	 *  Empty response?
 	 */
-	fr_skip_whitespace(p);
-	if (*p == '\0') return 0;
+	if (!decoder || !decoder->started) return 0;
+
+	if (decoder->failed) return -1;
 
-	json = json_tokener_parse(p);
-	if (!json) {
-		REDEBUG("Malformed JSON data \"%s\"", raw);
+	if (!decoder->root) {
+		REDEBUG("Malformed JSON data, body truncated");
 		return -1;
 	}
 
-	ret = json_pair_alloc(instance, section, request, json, 0, REST_BODY_MAX_ATTRS);
-
-	/*
-	 *  Decrement reference count for root object, should free entire JSON tree.
-	 */
-	json_object_put(json);
-
-	return ret;
+	return json_pair_alloc(instance, section, request, decoder->root, 0, REST_BODY_MAX_ATTRS);
 }
 #endif
 
@@ -1448,6 +1529,10 @@ static size_t rest_response_header(void *in, size_t size, size_t nmemb, void *us
  * Writes incoming body data to an intermediary buffer for later parsing by
  * one of the decode functions.
  *
+ * JSON bodies are instead fed to an incremental tokener as each chunk arrives.
+ * They're only copied to the intermediary buffer if the body will be needed
+ * later for error or debug output.
+ *
  * @param[in] in	Char buffer where inbound header data is written
  * @param[in] size	Multiply by nmemb to get the length of ptr.
  * @param[in] nmemb	Multiply by size to get the length of ptr.
@@ -1505,13 +1590,28 @@ static size_t rest_response_body(void *in, size_t size, size_t nmemb, void *user
 	{
 		char *out_p;
 
-		if ((ctx->section->max_body_in > 0) && ((ctx->used + (end - p)) > ctx->section->max_body_in)) {
+		if ((ctx->section->max_body_in > 0) && ((ctx->received + (end - p)) > ctx->section->max_body_in)) {
 			REDEBUG("Incoming data (%zu bytes) exceeds max_body_in (%zu bytes).  "
-				"Forcing body to type 'invalid'", ctx->used + (end - p), ctx->section->max_body_in);
+				"Forcing body to type 'invalid'", ctx->received + (end - p), ctx->section->max_body_in);
 			ctx->type = REST_HTTP_BODY_INVALID;
 			TALLOC_FREE(ctx->buffer);
+			TALLOC_FREE(ctx->decoder);
 			break;
 		}
+		ctx->received += (end - p);
+
+#ifdef HAVE_JSON
+		if (ctx->type == REST_HTTP_BODY_JSON) {
+			(void) rest_response_body_json(ctx, p, end - p);
+
+			/*
+			 *  Only keep a raw copy if it's going to be
+			 *  printed, i.e. as error lines for failed
+			 *  responses, or at debug level 3.
+			 */
+			if ((ctx->code >= 200) && (ctx->code < 300) && !RDEBUG_ENABLED3) break;
+		}
+#endif
 
 		needed = ROUND_UP(ctx->used + (end - p), REST_BODY_ALLOC_CHUNK);
 		if (needed > ctx->alloc) {
@@ -1604,7 +1704,9 @@ static void rest_response_init(rlm_rest_section_t const *section,
 	ctx->state = WRITE_STATE_INIT;
 	ctx->alloc = 0;
 	ctx->used = 0;
+	ctx->received = 0;
 	TALLOC_FREE(ctx->buffer);
+	TALLOC_FREE(ctx->decoder);
 }
 
 /** Extracts pointer to buffer containing response data
@@ -1840,6 +1942,17 @@ int rest_request_config(rlm_rest_t const *inst, rlm_rest_thread_t *t, rlm_rest_s
 	 */
 	if (inst->http_negotiation != CURL_HTTP_VERSION_NONE) FR_CURL_SET_OPTION(CURLOPT_HTTP_VERSION, inst->http_negotiation);
 
+#if CURL_AT_LEAST_VERSION(7,43,0)
+	/*
+	 *	Wait for an existing HTTP/2 connection to be able
+	 *	to take another stream, instead of opening a new
+	 *	connection (and performing another TLS handshake)
+	 *	for every request that arrives while the first
+	 *	connection is being established.
+	 */
+	if (inst->multiplex) FR_CURL_SET_OPTION(CURLOPT_PIPEWAIT, 1L);
+#endif
+
 	/*
 	 *	Setup any header options and generic headers.
 	 */
@@ -1892,6 +2005,22 @@ int rest_request_config(rlm_rest_t const *inst, rlm_rest_thread_t *t, rlm_rest_s
 	ctx->headers = curl_slist_append(ctx->headers, buffer);
 	if (!ctx->headers) goto error_header;
 
+	/*
+	 *	Let the backend continue the trace, with this
+	 *	module call as the parent span.
+	 */
+	if (request->trace) {
+		size_t len = strlcpy(buffer, "traceparent: ", sizeof(buffer));
+
+		if (fr_trace_context_print(buffer + len, sizeof(buffer) - len, request) > 0) {
+			RINDENT();
+			RDEBUG3("%s", buffer);
+			REXDENT();
+			ctx->headers = curl_slist_append(ctx->headers, buffer);
+			if (!ctx->headers) goto error_header;
+		}
+	}
+
 	for (header =  fr_cursor_iter_by_da_init(&headers, &request->control, attr_rest_http_header);
 	     header;
 	     header = fr_cursor_next(&headers)) {
@@ -2164,6 +2293,16 @@ int rest_response_decode(rlm_rest_t const *instance, rlm_rest_section_t const *s
 
 	int ret = -1;	/* -Wsometimes-uninitialized */
 
+#ifdef HAVE_JSON
+	/*
+	 *  JSON bodies are tokenised as they're received,
+	 *  so there may be no raw buffer to check.
+	 */
+	if (ctx->response.type == REST_HTTP_BODY_JSON) {
+		return rest_decode_json(instance, section, request, randle, ctx->response.decoder);
+	}
+#endif
+
 	if (!ctx->response.buffer) {
 		RDEBUG2("Skipping attribute processing, no valid body data received");
 		return 0;
@@ -2181,12 +2320,6 @@ int rest_response_decode(rlm_rest_t const *instance, rlm_rest_section_t const *s
 		ret = rest_decode_post(instance, section, request, randle, ctx->response.buffer, ctx->response.used);
 		break;
 
-#ifdef HAVE_JSON
-	case REST_HTTP_BODY_JSON:
-		ret = rest_decode_json(instance, section, request, randle, ctx->response.buffer, ctx->response.used);
-		break;
-#endif
-
 	case REST_HTTP_BODY_UNSUPPORTED:
 	case REST_HTTP_BODY_UNAVAILABLE:
 	case REST_HTTP_BODY_INVALID:
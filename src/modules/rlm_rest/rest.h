@@ -164,6 +164,8 @@ typedef struct {
 	bool			multiplex;	//!< Whether to perform multiple requests using a single
 						///< connection.
 
+	fr_curl_conn_conf_t	conn_conf;	//!< Limits on the connections each thread caches.
+
 	fr_pool_t		*pool;		//!< Pointer to the connection pool.
 
 	rlm_rest_section_t	xlat;		//!< Configuration specific to xlat.
@@ -247,6 +249,7 @@ typedef struct {
 	char 			*buffer;	//!< Raw incoming HTTP data.
 	size_t		 	alloc;		//!< Space allocated for buffer.
 	size_t		 	used;		//!< Space used in buffer.
+	size_t			received;	//!< Total body bytes received, whether buffered or not.
 
 	int		 	code;		//!< HTTP Status Code.
 	http_body_type_t	type;		//!< HTTP Content Type.
@@ -114,6 +114,7 @@ static const CONF_PARSER module_config[] = {
 #ifdef CURLPIPE_MULTIPLEX
 	{ FR_CONF_OFFSET("multiplex", FR_TYPE_BOOL, rlm_rest_t, multiplex), .dflt = "yes" },
 #endif
+	{ FR_CONF_OFFSET("connection", FR_TYPE_SUBSECTION, rlm_rest_t, conn_conf), .subcs = (void const *) fr_curl_conn_config },
 
 #ifndef NDEBUG
 	{ FR_CONF_OFFSET("fail_header_decode", FR_TYPE_BOOL, rlm_rest_t, fail_header_decode), .dflt = "no" },
@@ -1044,7 +1045,7 @@ static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_e
 		return -1;
 	}
 
-	mhandle = fr_curl_io_init(t, el, inst->multiplex);
+	mhandle = fr_curl_io_init(t, el, inst->multiplex, &inst->conn_conf);
 	if (!mhandle) return -1;
 
 	t->mhandle = mhandle;
@@ -103,37 +103,56 @@ static void _sigtran_pipe_error(UNUSED fr_event_list_t *el, int fd, UNUSED int f
 	fr_assert(0);
 }
 
-/** Drain any data we received
+/** Resume the requests whose transactions have completed
  *
- * We don't care about this data, we just don't want the kernel to
- * signal the other side that our read buffer's full.
+ * Many transactions may be in flight for each worker, so we read all
+ * the completions which are available, not just one.
  */
 static void _sigtran_pipe_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, UNUSED void *uctx)
 {
+	uint8_t			buff[sizeof(void *) * 64];
 	ssize_t			len;
-	void			*ptr;
-	sigtran_transaction_t	*txn;
+	size_t			used, i;
 
-	len = read(fd, &ptr, sizeof(ptr));
+	len = read(fd, buff, sizeof(buff));
 	if (len < 0) {
 		ERROR("worker - ctrl_pipe (%i) read failed : %s", fd, fr_syserror(errno));
 		return;
 	}
-
-	if (len != sizeof(ptr)) {
-		ERROR("worker - ctrl_pipe (%i) data too short, expected %zu bytes, got %zi bytes",
-		      fd, sizeof(ptr), len);
-		return;
-	}
+	used = (size_t)len;
 
 	/*
-	 *	Check talloc header is still OK
+	 *	The osmocom thread always writes whole pointers,
+	 *	so wait for the rest of a partial one.
 	 */
-	txn = talloc_get_type_abort(ptr, sigtran_transaction_t);
-	if (txn->ctx.defunct) return;		/* Request was stopped */
+	while ((used % sizeof(void *)) != 0) {
+		len = read(fd, buff + used, sizeof(void *) - (used % sizeof(void *)));
+		if (len <= 0) {
+			ERROR("worker - ctrl_pipe (%i) data too short, expected %zu bytes, got %zu bytes",
+			      fd, ROUND_UP(used, sizeof(void *)), used);
+			return;
+		}
+		used += len;
+	}
+
+	for (i = 0; i < used; i += sizeof(void *)) {
+		void			*ptr;
+		sigtran_transaction_t	*txn;
+
+		memcpy(&ptr, buff + i, sizeof(ptr));
 
-	fr_assert(txn->ctx.request);
-	unlang_interpret_resumable(txn->ctx.request);	/* Continue processing */
+		/*
+		 *	Check talloc header is still OK
+		 */
+		txn = talloc_get_type_abort(ptr, sigtran_transaction_t);
+		if (txn->ctx.defunct) {			/* Request was stopped */
+			talloc_free(txn);
+			continue;
+		}
+
+		fr_assert(txn->ctx.request);
+		unlang_interpret_resumable(txn->ctx.request);	/* Continue processing */
+	}
 }
 
 /** Called by a new thread to register a new req_pipe
@@ -466,9 +485,11 @@ rlm_rcode_t sigtran_client_map_send_auth_info(rlm_sigtran_t const *inst, REQUEST
 	}
 
 	/*
-	 *	FIXME - We shouldn't assume the pipe is always writable
+	 *	Never block the worker.  The osmocom thread reads
+	 *	requests as soon as they arrive, and queues them
+	 *	itself, so a full pipe means it's stuck.
 	 */
-	if (write(fd, &txn, sizeof(txn)) < 0) {
+	if (send(fd, &txn, sizeof(txn), MSG_DONTWAIT) != sizeof(txn)) {
 		REDEBUG("worker - ctrl_pipe (%i) write failed: %s", fd, fr_syserror(errno));
 		goto error;
 	}
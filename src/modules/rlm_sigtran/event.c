@@ -214,7 +214,7 @@ static int event_link_up(TALLOC_CTX *ctx, sigtran_conn_t **out, sigtran_conn_con
 	/*
 	 *	Patch in our SCCP receive function
 	 */
-	sigtran_sscp_init(conn);
+	if (sigtran_sscp_init(conn) < 0) return -1;
 	mtp_link_set_sccp_data_available_cb(mtp3_link_set, sigtran_sccp_incoming);
 
 	MEM(mtp3_link = conn->mtp3_link = mtp_link_alloc(mtp3_link_set));
@@ -268,6 +268,7 @@ static int event_link_up(TALLOC_CTX *ctx, sigtran_conn_t **out, sigtran_conn_con
  */
 static int event_link_down(sigtran_conn_t *conn)
 {
+	sigtran_tcap_conn_flush(conn);
 	talloc_free(conn);
 	return 0;
 }
@@ -428,11 +429,14 @@ static int event_process_request(struct osmo_fd *ofd, unsigned int what)
 	{
 		sigtran_map_send_auth_info_req_t *req = talloc_get_type_abort(txn->request.data,
 									      sigtran_map_send_auth_info_req_t);
+		sigtran_conn_t *conn;
+
 		DEBUG3("osmocom thread - Processing map send auth info");
-		if (sigtran_tcap_outgoing(NULL, req->conn, txn, ofd) < 0) {
+		memcpy(&conn, &req->conn, sizeof(conn));	/* Only the osmocom thread may modify it */
+		if (sigtran_tcap_submit(conn, txn) < 0) {
 			txn->response.type = SIGTRAN_RESPONSE_FAIL;
 		} else {
-			return 0;	/* Keep caller blocked until we get a response */
+			return 0;	/* Caller is resumed when we get a response */
 		}
 	}
 		break;
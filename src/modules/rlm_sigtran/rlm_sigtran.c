@@ -140,6 +140,7 @@ static const CONF_PARSER sccp_config[] = {
 
 static const CONF_PARSER map_config[] = {
 	{ FR_CONF_OFFSET("version", FR_TYPE_TMPL, rlm_sigtran_t, conn_conf.map_version), .dflt = "2", .quote = T_BARE_WORD},
+	{ FR_CONF_OFFSET("window", FR_TYPE_UINT32, rlm_sigtran_t, conn_conf.map_window), .dflt = "32" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -335,6 +336,14 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
+	inst->conn_conf.name = inst->name;
+
+	/*
+	 *	Transaction IDs are 8 bits, and shared by all
+	 *	connections.
+	 */
+	FR_INTEGER_BOUND_CHECK("window", inst->conn_conf.map_window, >=, 1);
+	FR_INTEGER_BOUND_CHECK("window", inst->conn_conf.map_window, <=, UINT8_MAX);
 
 	/*
 	 *	Translate traffic mode string to integer
@@ -71,9 +71,47 @@ static int sigtran_txn_cmp(void const *a, void const *b)
 	return 0;
 }
 
+/** Tell the worker a transaction failed
+ *
+ */
+static void sigtran_tcap_fail(sigtran_transaction_t *txn)
+{
+	txn->response.type = SIGTRAN_RESPONSE_FAIL;
+
+	if (sigtran_event_submit(txn->ctx.ofd, txn) < 0) {
+		ERROR("Failed informing event client of result: %s", fr_syserror(errno));
+	}
+}
+
+/** Release a transaction's slot in the window, and send queued transactions
+ *
+ * @param[in] conn	the transaction was sent on.
+ */
+static void sigtran_tcap_window_release(sigtran_conn_t *conn)
+{
+	fr_assert(conn->outstanding > 0);
+	conn->outstanding--;
+
+	while ((conn->outstanding < conn->conf->map_window) && !llist_empty(&conn->queue)) {
+		sigtran_transaction_t *txn = llist_entry(conn->queue.next, sigtran_transaction_t, ctx.entry);
+
+		llist_del(&txn->ctx.entry);
+		conn->num_queued--;
+
+		if (sigtran_tcap_outgoing(NULL, conn, txn, txn->ctx.ofd) < 0) {
+			fr_metric_inc(conn->stats.failures, 1);
+			sigtran_tcap_fail(txn);
+		}
+	}
+
+	fr_metric_set(conn->stats.outstanding, conn->outstanding);
+	fr_metric_set(conn->stats.queued, conn->num_queued);
+}
+
 static void sigtran_tcap_timeout(void *data)
 {
-	sigtran_transaction_t *txn = talloc_get_type_abort(data, sigtran_transaction_t);
+	sigtran_transaction_t	*txn = talloc_get_type_abort(data, sigtran_transaction_t);
+	sigtran_conn_t		*conn = txn->ctx.conn;
 
 	ERROR("OTID %u Invoke ID %u timeout", txn->ctx.otid, txn->ctx.invoke_id);
 
@@ -82,12 +120,43 @@ static void sigtran_tcap_timeout(void *data)
 	 */
 	if (!rbtree_deletebydata(txn_tree, txn)) ERROR("Transaction removed before timeout");
 
-	txn->response.type = SIGTRAN_RESPONSE_FAIL;
+	fr_metric_inc(conn->stats.timeouts, 1);
+	sigtran_tcap_fail(txn);
 
-	if (sigtran_event_submit(txn->ctx.ofd, txn) < 0) {
-		ERROR("Failed informing event client of result: %s", fr_syserror(errno));
-		return;
+	sigtran_tcap_window_release(conn);
+}
+
+/** Send a transaction, or queue it if the connection's window is full
+ *
+ * Transactions are pipelined, up to map_window of them may be waiting
+ * for a response from the HLR at any one time.  Queued transactions
+ * are sent, in order, as responses arrive or transactions time out.
+ *
+ * @param[in] conn	to send the transaction on.
+ * @param[in] txn	to send.
+ * @return
+ *	- 0 if the transaction was sent or queued.
+ *	- -1 on failure.
+ */
+int sigtran_tcap_submit(sigtran_conn_t *conn, sigtran_transaction_t *txn)
+{
+	txn->ctx.conn = conn;
+
+	if (conn->outstanding >= conn->conf->map_window) {
+		DEBUG3("Window full (%u outstanding), queueing request", conn->outstanding);
+
+		llist_add_tail(&txn->ctx.entry, &conn->queue);
+		conn->num_queued++;
+		fr_metric_set(conn->stats.queued, conn->num_queued);
+		return 0;
 	}
+
+	if (sigtran_tcap_outgoing(NULL, conn, txn, txn->ctx.ofd) < 0) {
+		fr_metric_inc(conn->stats.failures, 1);
+		return -1;
+	}
+
+	return 0;
 }
 
 /** Send a request with static MAP data in it
@@ -176,13 +245,26 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 		return -1;
 	}
 
+	txn->ctx.invoke_id++;						/* Needs to be two operations */
+	txn->ctx.invoke_id &= 0x7f;					/* Invoke ID is 7bits */
+
 	/*
-	 *	Set the transaction ID
+	 *	Set the transaction ID.  With many transactions
+	 *	in flight, skip IDs which are still in use.
 	 */
-	txn->ctx.otid = (last_txn_id++) & UINT8_MAX;			/* 8 bit for now */
+	{
+		sigtran_transaction_t	find;
+		unsigned int		i;
 
-	txn->ctx.invoke_id++;						/* Needs to be two operations */
-	txn->ctx.invoke_id &= 0x7f;					/* Invoke ID is 7bits */
+		memset(&find, 0, sizeof(find));
+		find.ctx.invoke_id = txn->ctx.invoke_id;
+
+		for (i = 0; i <= UINT8_MAX; i++) {
+			find.ctx.otid = (last_txn_id++) & UINT8_MAX;	/* 8 bit for now */
+			if (!rbtree_finddata(txn_tree, &find)) break;
+		}
+		txn->ctx.otid = find.ctx.otid;
+	}
 	DEBUG2("Sending request with OTID %u Invoke ID %u", txn->ctx.otid, txn->ctx.invoke_id);
 
 	if (!rbtree_insert(txn_tree, txn)) {
@@ -208,6 +290,11 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 
 	osmo_timer_schedule(&txn->ctx.timer, 1, 0);
 
+	txn->ctx.conn = conn;
+	txn->ctx.sent = fr_time();
+	conn->outstanding++;
+	fr_metric_set(conn->stats.outstanding, conn->outstanding);
+
 	return 0;
 }
 
@@ -229,7 +316,9 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 	sigtran_map_send_auth_info_res_t *res;
 
 	struct osmo_fd		*ofd;
+	sigtran_conn_t		*conn;
 	sigtran_vector_t	**last;
+	int			ret = 0;
 
 	memset(&find, 0, sizeof(find));
 
@@ -263,8 +352,12 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 	txn = talloc_get_type_abort(found, sigtran_transaction_t);
 	req = talloc_get_type_abort(txn->request.data, sigtran_map_send_auth_info_req_t);
 	ofd = txn->ctx.ofd;
+	conn = txn->ctx.conn;
 	osmo_timer_del(&txn->ctx.timer);			/* Remove the timeout timer */
 
+	fr_metric_observe(conn->stats.latency, fr_time() - txn->ctx.sent);
+	fr_metric_inc(conn->stats.responses, 1);
+
 	MEM(res = talloc_zero(txn, sigtran_map_send_auth_info_res_t));
 	txn->response.type = SIGTRAN_RESPONSE_OK;
 	txn->response.data = res;
@@ -276,7 +369,7 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 		DEBUG4("Start 0x%02x len %u", (unsigned int)(tcap - p), p[0]); \
 		if (p[0] >= (len - (p - tcap))) { \
 			ERROR("Invalid length %u specified for vector component", p[0]); \
-			return -1; \
+			goto error; \
 		} \
 		vec->_x = talloc_memdup(vec, p + 1, p[0]); \
 		talloc_set_type(vec->_x, uint8_t); \
@@ -324,12 +417,26 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 		*last = vec;
 	}
 
+	/*
+	 *	The worker must always be told, or its
+	 *	request would never be resumed.
+	 */
+	if (0) {
+	error:
+		talloc_free(res);
+		txn->response.type = SIGTRAN_RESPONSE_FAIL;
+		txn->response.data = NULL;
+		ret = -1;
+	}
+
 	if (sigtran_event_submit(ofd, txn) < 0) {
 		ERROR("Failed informing event client of result: %s", fr_syserror(errno));
-		return -1;
+		ret = -1;
 	}
 
-	return 0;
+	sigtran_tcap_window_release(conn);
+
+	return ret;
 }
 
 /** Wrapper to pass data down to MTP3 layer for processing
@@ -357,11 +464,105 @@ void sigtran_sccp_incoming(UNUSED struct mtp_link_set *set, struct msgb *msg, UN
 	sccp_system_incoming(msg);
 }
 
+typedef struct {
+	sigtran_conn_t		*conn;			//!< To find the transactions of.
+	sigtran_transaction_t	**found;		//!< Transactions outstanding on conn.
+	size_t			num_found;
+} sigtran_txn_find_t;
+
+static int _sigtran_txn_conn_find(void *data, void *uctx)
+{
+	sigtran_transaction_t	*txn = talloc_get_type_abort(data, sigtran_transaction_t);
+	sigtran_txn_find_t	*find = uctx;
+
+	if (txn->ctx.conn != find->conn) return 0;
+
+	fr_assert(find->num_found < talloc_array_length(find->found));
+	find->found[find->num_found++] = txn;
+
+	return 0;
+}
+
+/** Fail all the transactions queued, or outstanding on a connection
+ *
+ * Called before the connection is freed.
+ */
+void sigtran_tcap_conn_flush(sigtran_conn_t *conn)
+{
+	sigtran_txn_find_t	find = { .conn = conn };
+	size_t			i;
+
+	while (!llist_empty(&conn->queue)) {
+		sigtran_transaction_t *txn = llist_entry(conn->queue.next, sigtran_transaction_t, ctx.entry);
+
+		llist_del(&txn->ctx.entry);
+		conn->num_queued--;
+		sigtran_tcap_fail(txn);
+	}
+
+	if (!txn_tree || !conn->outstanding) return;
+
+	/*
+	 *	Can't delete from the tree whilst walking it.
+	 */
+	MEM(find.found = talloc_array(conn, sigtran_transaction_t *, conn->outstanding));
+	(void) rbtree_walk(txn_tree, RBTREE_IN_ORDER, _sigtran_txn_conn_find, &find);
+
+	for (i = 0; i < find.num_found; i++) {
+		(void) rbtree_deletebydata(txn_tree, find.found[i]);
+		osmo_timer_del(&find.found[i]->ctx.timer);
+		sigtran_tcap_fail(find.found[i]);
+	}
+	conn->outstanding = 0;
+
+	talloc_free(find.found);
+}
+
 /** Initialise libscctp
  *
  */
 int sigtran_sscp_init(sigtran_conn_t *conn)
 {
+	static fr_metric_t	*latency, *transactions, *outstanding, *queued;
+	char			name[128], labels[192];
+
+	INIT_LLIST_HEAD(&conn->queue);
+
+	/*
+	 *	Series belong to the osmocom thread, which is
+	 *	the only thing that updates them.
+	 */
+	if (!latency) {
+		latency = fr_metric_register("freeradius_sigtran_map_latency",
+					     "Time from sending a MAP request to receiving its response.",
+					     FR_METRIC_HISTOGRAM);
+		transactions = fr_metric_register("freeradius_sigtran_map_transactions",
+						  "MAP transactions by result.", FR_METRIC_COUNTER);
+		outstanding = fr_metric_register("freeradius_sigtran_map_outstanding",
+						 "MAP transactions waiting for a response.", FR_METRIC_GAUGE);
+		queued = fr_metric_register("freeradius_sigtran_map_queued",
+					    "MAP transactions waiting for a free slot in the window.", FR_METRIC_GAUGE);
+		if (!latency || !transactions || !outstanding || !queued) {
+			PERROR("Failed registering metrics");
+			latency = NULL;
+			return -1;
+		}
+	}
+
+	fr_metric_label_escape(name, sizeof(name), conn->conf->name);
+
+	snprintf(labels, sizeof(labels), "instance=\"%s\"", name);
+	conn->stats.latency = fr_metric_series(latency, labels);
+	conn->stats.outstanding = fr_metric_series(outstanding, labels);
+	conn->stats.queued = fr_metric_series(queued, labels);
+
+	snprintf(labels, sizeof(labels), "instance=\"%s\",result=\"response\"", name);
+	conn->stats.responses = fr_metric_series(transactions, labels);
+	snprintf(labels, sizeof(labels), "instance=\"%s\",result=\"timeout\"", name);
+	conn->stats.timeouts = fr_metric_series(transactions, labels);
+	snprintf(labels, sizeof(labels), "instance=\"%s\",result=\"fail\"", name);
+	conn->stats.failures = fr_metric_series(transactions, labels);
+
 	sccp_set_log_area(DSCCP);
 
 	sccp_system_init(sigtran_sccp_outgoing, NULL);					/* Set write callback */
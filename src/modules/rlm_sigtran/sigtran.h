@@ -87,6 +87,10 @@ typedef struct sigtran_transaction {
 		struct osmo_fd		*ofd;				//!< The FD the txn was received on.
 		struct osmo_timer_list	timer;				//!< Timer data.
 
+		struct sigtran_conn	*conn;				//!< Connection the txn is sent on.
+		struct llist_head	entry;				//!< Entry in the connection's queue.
+		fr_time_t		sent;				//!< When the txn was sent.
+
 
 		uint32_t		otid;				//!< Transaction ID.
 		uint8_t			invoke_id;			//!< Sequence number (within transaction).
@@ -169,6 +173,11 @@ typedef struct sigtran_conn_conf {
 	struct sockaddr_sccp		sccp_called_sockaddr;		//!< Parsed version of the above
 
 	vp_tmpl_t			*map_version;			//!< Application context version.
+	uint32_t			map_window;			//!< Maximum transactions outstanding
+									///< on this connection.
+
+	char const			*name;				//!< Of the module instance, used to
+									///< label metrics.
 } sigtran_conn_conf_t;
 
 /** Represents a connection to a remote SS7 entity
@@ -181,6 +190,23 @@ typedef struct sigtran_conn {
 	struct bsc_data		*bsc_data;
 	struct mtp_link_set	*mtp3_link_set;
 	struct mtp_link		*mtp3_link;
+
+	/*
+	 *	Only accessed by the osmocom thread.
+	 */
+	uint32_t		outstanding;				//!< Transactions waiting for a response.
+	uint32_t		num_queued;				//!< Transactions waiting for a free slot
+									///< in the window.
+	struct llist_head	queue;					//!< Of transactions waiting to be sent.
+
+	struct {
+		fr_metric_series_t	*latency;			//!< Time from sending a txn to its response.
+		fr_metric_series_t	*responses;			//!< Transactions which got a response.
+		fr_metric_series_t	*timeouts;			//!< Transactions which timed out.
+		fr_metric_series_t	*failures;			//!< Transactions which couldn't be sent.
+		fr_metric_series_t	*outstanding;			//!< Gauge of outstanding transactions.
+		fr_metric_series_t	*queued;			//!< Gauge of queued transactions.
+	} stats;
 } sigtran_conn_t;
 
 /** MAP send auth info request.
@@ -270,6 +296,10 @@ int	sigtran_event_submit(struct osmo_fd *ofd, sigtran_transaction_t *txn);
  */
 int	sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transaction_t *txn, struct osmo_fd *ofd);
 
+int	sigtran_tcap_submit(sigtran_conn_t *conn, sigtran_transaction_t *txn);
+
+void	sigtran_tcap_conn_flush(sigtran_conn_t *conn);
+
 void	sigtran_sccp_incoming(struct mtp_link_set *set, struct msgb *msg, int sls);
 
 int	sigtran_sscp_init(sigtran_conn_t *conn);
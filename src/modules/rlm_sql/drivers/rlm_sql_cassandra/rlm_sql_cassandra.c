@@ -38,17 +38,49 @@
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/util/debug.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#include <sys/socket.h>
+
 #include <cassandra.h>
 
 #include "rlm_sql.h"
 
+/** Wakes the event loop when a future completes
+ *
+ * Futures complete in libcassandra's IO threads, which write a byte
+ * to one end of a socket pair.  The other end is what the SQL trunk
+ * watches.
+ *
+ * The write end is shared between the connection and any callbacks
+ * still outstanding, so it's reference counted, and whichever lets
+ * go of it last closes it.  This way a connection can be freed while
+ * a callback is running, without the callback writing to a closed
+ * (or reused) fd.
+ */
+typedef struct {
+	_Atomic(uint32_t)	refs;				//!< Connection + outstanding callbacks.
+	int			fd;				//!< Write end of the socket pair.
+} rlm_sql_cassandra_notify_t;
+
 /** Cassandra cluster connection
  *
  */
 typedef struct {
+	CassFuture		*future;			//!< Future for the in progress query.
 	CassResult const	*result;			//!< Result from executing a query.
 	CassIterator		*iterator;			//!< Row set iterator.
 
+	int			fd;				//!< Read end of the socket pair, -1 if the
+								///< connection isn't used asynchronously.
+	rlm_sql_cassandra_notify_t *notify;			//!< Shared write end of the socket pair.
+
+	sql_stmt_cache_t	*stmts;				//!< Statements prepared on this connection.
+
 	TALLOC_CTX		*log_ctx;			//!< Prevent unneeded memory allocation by keeping a
 								//!< permanent pool, to store log entries.
 	sql_log_entry_t		last_error;
@@ -365,13 +397,62 @@ static void sql_set_last_error_printf(rlm_sql_cassandra_conn_t *conn, char const
 	conn->last_error.type = L_ERR;
 }
 
+/** Release a reference to the notification socket, closing it if it was the last
+ *
+ */
+static void sql_notify_release(rlm_sql_cassandra_notify_t *notify)
+{
+	if (atomic_fetch_sub_explicit(&notify->refs, 1, memory_order_acq_rel) != 1) return;
+
+	close(notify->fd);
+	free(notify);
+}
+
+/** Called by libcassandra when a future completes
+ *
+ * Runs in one of libcassandra's IO threads, or in the caller's thread
+ * if the future had already completed when the callback was set.
+ */
+static void _sql_future_ready(UNUSED CassFuture *future, void *data)
+{
+	rlm_sql_cassandra_notify_t	*notify = data;
+	uint8_t				c = 0;
+
+	/*
+	 *	If the socket is full there's already a
+	 *	wakeup pending, so EAGAIN can be ignored.
+	 */
+	if (write(notify->fd, &c, sizeof(c)) < 0) {
+		/* nothing */
+	}
+
+	sql_notify_release(notify);
+}
+
 static int _sql_socket_destructor(rlm_sql_cassandra_conn_t *conn)
 {
 	DEBUG2("Socket destructor called, closing socket");
 
+	/*
+	 *	Don't leave a query running with nothing
+	 *	to collect the result.
+	 */
+	if (conn->future) {
+		cass_future_wait(conn->future);
+		cass_future_free(conn->future);
+	}
 	if (conn->iterator) cass_iterator_free(conn->iterator);
 	if (conn->result) cass_result_free(conn->result);
 
+	/*
+	 *	Free prepared statements before the
+	 *	connection they reference is gone.
+	 */
+	TALLOC_FREE(conn->stmts);
+
+	if (conn->fd >= 0) close(conn->fd);
+	if (conn->notify) sql_notify_release(conn->notify);
+
 	return 0;
 }
 
@@ -381,6 +462,7 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *c
 	rlm_sql_cassandra_t		*inst = config->driver;
 
 	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_cassandra_conn_t));
+	conn->fd = -1;
 	talloc_set_destructor(conn, _sql_socket_destructor);
 
 	/*
@@ -424,43 +506,310 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *c
 	return RLM_SQL_OK;
 }
 
-static sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query)
+/** Convert the error from a failed future to an rcode
+ *
+ */
+static sql_rcode_t sql_future_error(rlm_sql_cassandra_conn_t *conn, CassFuture *future, CassError ret)
+{
+	char const	*error;
+	size_t		len;
+
+	cass_future_error_message(future, &error, &len);
+	sql_set_last_error(conn, error, len);
+
+	switch (ret) {
+	case CASS_ERROR_SERVER_SYNTAX_ERROR:
+	case CASS_ERROR_SERVER_INVALID_QUERY:
+		return RLM_SQL_QUERY_INVALID;
+
+	default:
+		return RLM_SQL_ERROR;
+	}
+}
+
+/** Collect the result of a completed query
+ *
+ */
+static sql_rcode_t sql_query_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_cassandra_conn_t	*conn = handle->conn;
-	rlm_sql_cassandra_t	*conf = config->driver;
-	CassStatement			*statement;
-	CassFuture			*future;
+	CassFuture			*future = conn->future;
 	CassError			ret;
+	sql_rcode_t			rcode = RLM_SQL_OK;
 
-	statement = cass_statement_new_n(query, talloc_array_length(query) - 1, 0);
-	if (conf->consistency_str) cass_statement_set_consistency(statement, conf->consistency);
-
-	future = cass_session_execute(conf->session, statement);
-	cass_statement_free(statement);
+	conn->future = NULL;
+	handle->io_wait = 0;
 
 	ret = cass_future_error_code(future);
 	if (ret != CASS_OK) {
-		char const	*error;
-		size_t		len;
+		rcode = sql_future_error(conn, future, ret);
+	} else {
+		conn->result = cass_future_get_result(future);
+	}
+	cass_future_free(future);
 
-		cass_future_error_message(future, &error, &len);
-		sql_set_last_error(conn, error, len);
-		cass_future_free(future);
+	return rcode;
+}
 
-		switch (ret) {
-		case CASS_ERROR_SERVER_SYNTAX_ERROR:
-		case CASS_ERROR_SERVER_INVALID_QUERY:
-			return RLM_SQL_QUERY_INVALID;
+/** Execute a statement, without waiting for it to complete
+ *
+ * If the connection is being used asynchronously, we're told via the
+ * notification socket when the query completes.
+ */
+static sql_rcode_t sql_statement_execute(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					 CassStatement *statement)
+{
+	rlm_sql_cassandra_conn_t	*conn = handle->conn;
+	rlm_sql_cassandra_t		*inst = config->driver;
 
-		default:
+	if (inst->consistency_str) cass_statement_set_consistency(statement, inst->consistency);
+
+	fr_assert(!conn->future);
+	conn->future = cass_session_execute(inst->session, statement);
+	cass_statement_free(statement);
+
+	if (conn->notify) {
+		CassError ret;
+
+		atomic_fetch_add_explicit(&conn->notify->refs, 1, memory_order_relaxed);
+		ret = cass_future_set_callback(conn->future, _sql_future_ready, conn->notify);
+		if (ret != CASS_OK) {
+			sql_notify_release(conn->notify);
+			sql_set_last_error_printf(conn, "Failed setting future callback: %s", cass_error_desc(ret));
+			cass_future_free(conn->future);
+			conn->future = NULL;
 			return RLM_SQL_ERROR;
 		}
+		handle->io_wait = SQL_IO_WAIT_READ;
 	}
 
-	conn->result = cass_future_get_result(future);
-	cass_future_free(future);
+	return RLM_SQL_IN_PROGRESS;
+}
 
-	return RLM_SQL_OK;
+static sql_rcode_t sql_query_start(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query)
+{
+	return sql_statement_execute(handle, config, cass_statement_new_n(query, talloc_array_length(query) - 1, 0));
+}
+
+static sql_rcode_t sql_query_resume(rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	rlm_sql_cassandra_conn_t	*conn = handle->conn;
+	uint8_t				buffer[64];
+
+	/*
+	 *	Drain the notification socket.  There may be
+	 *	more than one byte, and there may be none if
+	 *	we were woken up spuriously.
+	 */
+	while (read(conn->fd, buffer, sizeof(buffer)) > 0);
+
+	if (!conn->future) return RLM_SQL_ERROR;
+	if (!cass_future_ready(conn->future)) return RLM_SQL_IN_PROGRESS;
+
+	return sql_query_result(handle, config);
+}
+
+/** Return the fd the SQL trunk should watch
+ *
+ * libcassandra doesn't expose its sockets, and multiplexes queries
+ * from every connection over the session's own connections to each
+ * node, so we give the trunk one end of a socket pair, and write to
+ * the other end from future callbacks.
+ *
+ * Only connections used by the trunk call this, so only they pay
+ * for the socket pair and the callbacks.
+ */
+static int sql_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_cassandra_conn_t	*conn = handle->conn;
+	int				fds[2];
+
+	if (conn->fd >= 0) return conn->fd;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		ERROR("Failed creating notification socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if ((fr_nonblock(fds[0]) < 0) || (fr_nonblock(fds[1]) < 0)) {
+		ERROR("Failed setting notification socket non-blocking: %s", fr_syserror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	MEM(conn->notify = malloc(sizeof(*conn->notify)));
+	atomic_init(&conn->notify->refs, 1);
+	conn->notify->fd = fds[1];
+	conn->fd = fds[0];
+
+	return conn->fd;
+}
+
+static sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query)
+{
+	rlm_sql_cassandra_conn_t	*conn = handle->conn;
+	sql_rcode_t			ret;
+
+	ret = sql_query_start(handle, config, query);
+	if (ret != RLM_SQL_IN_PROGRESS) return ret;
+
+	cass_future_wait(conn->future);
+
+	return sql_query_result(handle, config);
+}
+
+/** Release a statement prepared with cass_session_prepare
+ *
+ */
+static void sql_stmt_free(void *stmt, UNUSED void *uctx)
+{
+	cass_prepared_free(stmt);
+}
+
+/** Bind a parameter, converting it to the type the server expects
+ *
+ * Unlike other databases, Cassandra won't coerce strings to the type
+ * of the column, so we use the types from the prepared statement's
+ * metadata.
+ */
+static CassError sql_bind_param(CassStatement *statement, CassPrepared const *prepared, size_t i, char const *value)
+{
+	CassDataType const	*type = cass_prepared_parameter_data_type(prepared, i);
+	char			*end;
+
+	if (!value) return cass_statement_bind_null(statement, i);
+
+	switch (type ? cass_data_type_type(type) : CASS_VALUE_TYPE_UNKNOWN) {
+	case CASS_VALUE_TYPE_INT:
+	{
+		long	num = strtol(value, &end, 10);
+
+		if (*end || (num < INT32_MIN) || (num > INT32_MAX)) return CASS_ERROR_LIB_INVALID_VALUE_TYPE;
+		return cass_statement_bind_int32(statement, i, (cass_int32_t)num);
+	}
+
+	case CASS_VALUE_TYPE_BIGINT:
+	case CASS_VALUE_TYPE_COUNTER:
+	case CASS_VALUE_TYPE_TIMESTAMP:
+	{
+		long long	num = strtoll(value, &end, 10);
+
+		if (*end) return CASS_ERROR_LIB_INVALID_VALUE_TYPE;
+		return cass_statement_bind_int64(statement, i, (cass_int64_t)num);
+	}
+
+	case CASS_VALUE_TYPE_BOOLEAN:
+		return cass_statement_bind_bool(statement, i,
+						((strcmp(value, "1") == 0) || (strcasecmp(value, "true") == 0)) ?
+						cass_true : cass_false);
+
+	case CASS_VALUE_TYPE_DOUBLE:
+		return cass_statement_bind_double(statement, i, strtod(value, NULL));
+
+	case CASS_VALUE_TYPE_FLOAT:
+		return cass_statement_bind_float(statement, i, strtof(value, NULL));
+
+	case CASS_VALUE_TYPE_UUID:
+	case CASS_VALUE_TYPE_TIMEUUID:
+	{
+		CassUuid	uuid;
+		CassError	ret;
+
+		ret = cass_uuid_from_string(value, &uuid);
+		if (ret != CASS_OK) return ret;
+		return cass_statement_bind_uuid(statement, i, uuid);
+	}
+
+	case CASS_VALUE_TYPE_INET:
+	{
+		CassInet	inet;
+		CassError	ret;
+
+		ret = cass_inet_from_string(value, &inet);
+		if (ret != CASS_OK) return ret;
+		return cass_statement_bind_inet(statement, i, inet);
+	}
+
+	default:
+		return cass_statement_bind_string(statement, i, value);
+	}
+}
+
+/** Send a query with parameters, preparing it first if this connection hasn't seen it before
+ *
+ * Prepared statements carry the indexes of the table's partition key
+ * columns, which lets token aware routing send the query directly to
+ * a replica of the partition being written, instead of to whichever
+ * node the load balancing policy picks.
+ */
+static sql_rcode_t sql_query_params_start(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					  char const *query, char const * const params[], size_t num_params)
+{
+	rlm_sql_cassandra_conn_t	*conn = handle->conn;
+	rlm_sql_cassandra_t		*inst = config->driver;
+	CassPrepared const		*prepared;
+	CassStatement			*statement;
+	size_t				i;
+
+	if (!conn->stmts) {
+		MEM(conn->stmts = sql_stmt_cache_alloc(conn, config->prepared_statement_cache_size,
+						       sql_stmt_free, conn));
+	}
+
+	prepared = sql_stmt_cache_find(conn->stmts, query);
+	if (!prepared) {
+		CassFuture	*future;
+		CassError	ret;
+		void		*stmt;
+
+		DEBUG2("Preparing statement");
+		future = cass_session_prepare_n(inst->session, query, talloc_array_length(query) - 1);
+		ret = cass_future_error_code(future);
+		if (ret != CASS_OK) {
+			sql_rcode_t rcode;
+
+			rcode = sql_future_error(conn, future, ret);
+			cass_future_free(future);
+			return rcode;
+		}
+		prepared = cass_future_get_prepared(future);
+		cass_future_free(future);
+
+		memcpy(&stmt, &prepared, sizeof(stmt));
+		if (sql_stmt_cache_add(conn->stmts, query, stmt) < 0) {
+			cass_prepared_free(prepared);
+			return RLM_SQL_ERROR;
+		}
+	}
+
+	statement = cass_prepared_bind(prepared);
+	for (i = 0; i < num_params; i++) {
+		CassError ret;
+
+		ret = sql_bind_param(statement, prepared, i, params[i]);
+		if (ret != CASS_OK) {
+			sql_set_last_error_printf(conn, "Failed binding parameter %zu: %s", i + 1, cass_error_desc(ret));
+			cass_statement_free(statement);
+			return RLM_SQL_QUERY_INVALID;
+		}
+	}
+
+	return sql_statement_execute(handle, config, statement);
+}
+
+static sql_rcode_t sql_query_params(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+				    char const *query, char const * const params[], size_t num_params)
+{
+	rlm_sql_cassandra_conn_t	*conn = handle->conn;
+	sql_rcode_t			ret;
+
+	ret = sql_query_params_start(handle, config, query, params, num_params);
+	if (ret != RLM_SQL_IN_PROGRESS) return ret;
+
+	cass_future_wait(conn->future);
+
+	return sql_query_result(handle, config);
 }
 
 static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
@@ -967,5 +1316,10 @@ rlm_sql_driver_t rlm_sql_cassandra = {
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
-	.sql_finish_select_query	= sql_finish_query
+	.sql_finish_select_query	= sql_finish_query,
+	.sql_fd				= sql_fd,
+	.sql_query_start		= sql_query_start,
+	.sql_query_resume		= sql_query_resume,
+	.sql_query_params		= sql_query_params,
+	.sql_query_params_start		= sql_query_params_start
 };
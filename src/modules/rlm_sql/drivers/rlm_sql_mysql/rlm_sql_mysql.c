@@ -69,6 +69,13 @@ DIAG_ON(strict-prototypes)
 #define HAVE_TLS_VERIFY_OPTIONS 0
 #endif
 
+/*
+ *	MariaDB's client library provides a non-blocking API
+ */
+#ifdef MYSQL_WAIT_READ
+#  define HAVE_MYSQL_NONBLOCK 1
+#endif
+
 #include "rlm_sql.h"
 
 typedef enum {
@@ -88,6 +95,11 @@ typedef struct {
 	MYSQL		db;
 	MYSQL		*sock;
 	MYSQL_RES	*result;
+	sql_stmt_cache_t *stmts;	//!< Statements prepared on this connection.
+	MYSQL_STMT	*stmt;		//!< Statement executed by the last query, if any.
+#ifdef HAVE_MYSQL_NONBLOCK
+	int		async_status;	//!< Return value of the last *_start or *_cont call.
+#endif
 } rlm_sql_mysql_conn_t;
 
 typedef struct {
@@ -160,6 +172,12 @@ static int _sql_socket_destructor(rlm_sql_mysql_conn_t *conn)
 {
 	DEBUG2("Socket destructor called, closing socket");
 
+	/*
+	 *	Statements must be closed before the
+	 *	connection they were prepared on.
+	 */
+	TALLOC_FREE(conn->stmts);
+
 	if (conn->sock){
 		mysql_close(conn->sock);
 	}
@@ -273,6 +291,14 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *c
 
 	mysql_options(&(conn->db), MYSQL_READ_DEFAULT_GROUP, "freeradius");
 
+#ifdef HAVE_MYSQL_NONBLOCK
+	/*
+	 *	The blocking API continues to work on
+	 *	non-blocking connections.
+	 */
+	mysql_options(&(conn->db), MYSQL_OPT_NONBLOCK, 0);
+#endif
+
 	/*
 	 *	We need to know about connection errors, and are capable
 	 *	of reconnecting automatically.
@@ -441,6 +467,150 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return RLM_SQL_OK;
 }
 
+/** Close a statement prepared with mysql_stmt_prepare
+ *
+ */
+static void sql_stmt_free(void *stmt, UNUSED void *uctx)
+{
+	mysql_stmt_close(stmt);
+}
+
+static sql_rcode_t sql_query_params(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query,
+				    char const * const params[], size_t num_params)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	MYSQL_STMT		*stmt;
+	MYSQL_BIND		*bind;
+	size_t			i;
+	int			ret;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!conn->stmts) {
+		MEM(conn->stmts = sql_stmt_cache_alloc(conn, config->prepared_statement_cache_size,
+						       sql_stmt_free, NULL));
+	}
+
+	stmt = sql_stmt_cache_find(conn->stmts, query);
+	if (!stmt) {
+		stmt = mysql_stmt_init(conn->sock);
+		if (!stmt) return sql_check_error(conn->sock, 0);
+
+		if (mysql_stmt_prepare(stmt, query, strlen(query)) != 0) {
+			sql_rcode_t rcode = sql_check_error(NULL, mysql_stmt_errno(stmt));
+
+			ERROR("Failed preparing query: ERROR %u (%s): %s", mysql_stmt_errno(stmt),
+			      mysql_stmt_error(stmt), mysql_stmt_sqlstate(stmt));
+			mysql_stmt_close(stmt);
+
+			return (rcode == RLM_SQL_OK) ? RLM_SQL_ERROR : rcode;
+		}
+
+		if (sql_stmt_cache_add(conn->stmts, query, stmt) < 0) {
+			mysql_stmt_close(stmt);
+			return RLM_SQL_ERROR;
+		}
+	}
+
+	if (mysql_stmt_param_count(stmt) != num_params) {
+		ERROR("Statement expects %lu parameters, got %zu", mysql_stmt_param_count(stmt), num_params);
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	MEM(bind = talloc_zero_array(conn, MYSQL_BIND, num_params ? num_params : 1));
+	for (i = 0; i < num_params; i++) {
+		char *value;
+
+		memcpy(&value, &params[i], sizeof(value));
+
+		bind[i].buffer_type = MYSQL_TYPE_STRING;
+		bind[i].buffer = value;
+		bind[i].buffer_length = strlen(value);
+	}
+
+	conn->stmt = stmt;
+	ret = mysql_stmt_bind_param(stmt, bind);
+	if (ret == 0) ret = mysql_stmt_execute(stmt);
+	talloc_free(bind);
+
+	if (ret != 0) return sql_check_error(NULL, mysql_stmt_errno(stmt));
+
+	return RLM_SQL_OK;
+}
+
+#ifdef HAVE_MYSQL_NONBLOCK
+/** Map what the client library is waiting for, to what we're waiting for
+ *
+ */
+static sql_rcode_t sql_query_async_status(rlm_sql_handle_t *handle, int status)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	sql_rcode_t		rcode;
+	char const		*info;
+
+	conn->async_status = status;
+
+	/*
+	 *	Timeouts are enforced by the caller
+	 */
+	if (status != 0) {
+		handle->io_wait = 0;
+		if (status & MYSQL_WAIT_READ) handle->io_wait |= SQL_IO_WAIT_READ;
+		if (status & MYSQL_WAIT_WRITE) handle->io_wait |= SQL_IO_WAIT_WRITE;
+		if (status & MYSQL_WAIT_EXCEPT) handle->io_wait |= SQL_IO_WAIT_READ;
+
+		return RLM_SQL_IN_PROGRESS;
+	}
+	handle->io_wait = 0;
+
+	rcode = sql_check_error(conn->sock, 0);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	/* Only returns non-null string for INSERTS */
+	info = mysql_info(conn->sock);
+	if (info) DEBUG2("%s", info);
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_query_start(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, char const *query)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	int			err = 0;
+	int			status;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	status = mysql_real_query_start(&err, conn->sock, query, strlen(query));
+
+	return sql_query_async_status(handle, status);
+}
+
+static sql_rcode_t sql_query_resume(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	int			err = 0;
+	int			status;
+
+	status = mysql_real_query_cont(&err, conn->sock, conn->async_status);
+
+	return sql_query_async_status(handle, status);
+}
+
+static int sql_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+
+	return mysql_get_socket(conn->sock);
+}
+#endif
+
 static sql_rcode_t sql_store_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
@@ -712,14 +882,23 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen,
 	fr_assert(conn && conn->sock);
 	fr_assert(outlen > 0);
 
-	error = mysql_error(conn->sock);
-
 	/*
-	 *	Grab the error now in case it gets cleared on the next operation.
+	 *	Errors from executing a prepared statement
+	 *	are recorded against the statement.
 	 */
-	if (error && (error[0] != '\0')) {
-		error = talloc_typed_asprintf(ctx, "ERROR %u (%s): %s", mysql_errno(conn->sock), error,
-					mysql_sqlstate(conn->sock));
+	if (conn->stmt && mysql_stmt_errno(conn->stmt)) {
+		error = talloc_typed_asprintf(ctx, "ERROR %u (%s): %s", mysql_stmt_errno(conn->stmt),
+					      mysql_stmt_error(conn->stmt), mysql_stmt_sqlstate(conn->stmt));
+	} else {
+		error = mysql_error(conn->sock);
+
+		/*
+		 *	Grab the error now in case it gets cleared on the next operation.
+		 */
+		if (error && (error[0] != '\0')) {
+			error = talloc_typed_asprintf(ctx, "ERROR %u (%s): %s", mysql_errno(conn->sock), error,
+						mysql_sqlstate(conn->sock));
+		}
 	}
 
 	/*
@@ -773,11 +952,23 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen,
  */
 static sql_rcode_t sql_finish_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config)
 {
-#if (MYSQL_VERSION_ID >= 40100)
 	rlm_sql_mysql_conn_t	*conn = handle->conn;
+#if (MYSQL_VERSION_ID >= 40100)
 	int			ret;
 	MYSQL_RES		*result;
+#endif
 
+	/*
+	 *	Prepared statements keep their results
+	 *	separately from the connection.
+	 */
+	if (conn->stmt) {
+		mysql_stmt_free_result(conn->stmt);
+		conn->stmt = NULL;
+		return RLM_SQL_OK;
+	}
+
+#if (MYSQL_VERSION_ID >= 40100)
 	/*
 	 *	If there's no result associated with the
 	 *	connection handle, assume the first result in the
@@ -821,6 +1012,8 @@ static int sql_affected_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) return mysql_stmt_affected_rows(conn->stmt);
+
 	return mysql_affected_rows(conn->sock);
 }
 
@@ -864,5 +1057,11 @@ rlm_sql_driver_t rlm_sql_mysql = {
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
 	.sql_finish_select_query	= sql_finish_query,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_query_params		= sql_query_params,
+#ifdef HAVE_MYSQL_NONBLOCK
+	.sql_fd				= sql_fd,
+	.sql_query_start		= sql_query_start,
+	.sql_query_resume		= sql_query_resume
+#endif
 };
@@ -62,6 +62,7 @@ RCSID("$Id$")
 typedef struct {
 	char const	*db_string;		//!< Text based configuration string.
 	bool		send_application_name;	//!< Whether we send the application name to PostgreSQL.
+	char const	*application_name;	//!< Sent to PostgreSQL if send_application_name is true.
 	fr_trie_t	*states;		//!< sql state trie.
 } rlm_sql_postgres_t;
 
@@ -72,6 +73,13 @@ typedef struct {
 	int		num_fields;
 	int		affected_rows;
 	char		**row;
+	sql_stmt_cache_t *stmts;		//!< Statements prepared on this connection.
+
+	bool		batch;			//!< Collecting the results of a batch.
+	sql_rcode_t	batch_rcode;		//!< Result of the first query in the batch to fail.
+	int		*batch_affected;	//!< Rows affected by each query in the batch.
+	size_t		batch_num;		//!< Number of queries in the batch.
+	size_t		batch_done;		//!< Number of results received.
 } rlm_sql_postgres_conn_t;
 
 static CONF_PARSER driver_config[] = {
@@ -222,20 +230,111 @@ static int _sql_socket_destructor(rlm_sql_postgres_conn_t *conn)
 	/* PQfinish also frees the memory used by the PGconn structure */
 	PQfinish(conn->db);
 
+	/*
+	 *	The server releases prepared statements
+	 *	when the connection closes.
+	 */
+	conn->db = NULL;
+
 	return 0;
 }
 
+/** Build a libpq connection string from the module's configuration
+ *
+ * @param[in] ctx	to allocate the string in.
+ * @param[in] inst	of the driver.
+ * @param[in] config	of the primary, or of a replica.
+ * @return The connection string.
+ */
+static char const *sql_db_string(TALLOC_CTX *ctx, rlm_sql_postgres_t const *inst, rlm_sql_config_t const *config)
+{
+	char *db_string;
+
+	/*
+	 *	Old style database name
+	 *
+	 *	Append options if they were set in the config
+	 */
+	if (!strchr(config->sql_db, '=')) {
+		db_string = talloc_typed_asprintf(ctx, "dbname='%s'", config->sql_db);
+
+		if (config->sql_server[0] != '\0') {
+			db_string = talloc_asprintf_append(db_string, " host='%s'", config->sql_server);
+		}
+
+		if (config->sql_port) {
+			db_string = talloc_asprintf_append(db_string, " port=%i", config->sql_port);
+		}
+
+		if (config->sql_login[0] != '\0') {
+			db_string = talloc_asprintf_append(db_string, " user='%s'", config->sql_login);
+		}
+
+		if (config->sql_password[0] != '\0') {
+			db_string = talloc_asprintf_append(db_string, " password='%s'", config->sql_password);
+		}
+
+		if (config->query_timeout) {
+			db_string = talloc_asprintf_append(db_string, " connect_timeout=%d", config->query_timeout);
+		}
+
+		if (inst->send_application_name) {
+			db_string = talloc_asprintf_append(db_string, " application_name='%s'", inst->application_name);
+		}
+
+	/*
+	 *	New style parameter string
+	 *
+	 *	Only append options when not already present
+	 */
+	} else {
+		db_string = talloc_typed_strdup(ctx, config->sql_db);
+
+		if ((config->sql_server[0] != '\0') && !strstr(db_string, "host=")) {
+			db_string = talloc_asprintf_append(db_string, " host='%s'", config->sql_server);
+		}
+
+		if (config->sql_port && !strstr(db_string, "port=")) {
+			db_string = talloc_asprintf_append(db_string, " port=%i", config->sql_port);
+		}
+
+		if ((config->sql_login[0] != '\0') && !strstr(db_string, "user=")) {
+			db_string = talloc_asprintf_append(db_string, " user='%s'", config->sql_login);
+		}
+
+		if ((config->sql_password[0] != '\0') && !strstr(db_string, "password=")) {
+			db_string = talloc_asprintf_append(db_string, " password='%s'", config->sql_password);
+		}
+
+		if ((config->query_timeout) && !strstr(db_string, "connect_timeout=")) {
+			db_string = talloc_asprintf_append(db_string, " connect_timeout=%d", config->query_timeout);
+		}
+
+		if (inst->send_application_name && !strstr(db_string, "application_name=")) {
+			db_string = talloc_asprintf_append(db_string, " application_name='%s'", inst->application_name);
+		}
+	}
+
+	return db_string;
+}
+
 static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
 					    UNUSED fr_time_delta_t timeout)
 {
 	rlm_sql_postgres_t *inst = config->driver;
 	rlm_sql_postgres_conn_t *conn;
+	char const *db_string = inst->db_string;
 
 	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_postgres_conn_t));
 	talloc_set_destructor(conn, _sql_socket_destructor);
 
-	DEBUG2("Connecting using parameters: %s", inst->db_string);
-	conn->db = PQconnectdb(inst->db_string);
+	/*
+	 *	Replicas have their own server and credentials
+	 */
+	if (handle->replica) db_string = sql_db_string(conn, inst, config);
+
+	DEBUG2("Connecting using parameters: %s", db_string);
+	conn->db = PQconnectdb(db_string);
 	if (!conn->db) {
 		ERROR("Connection failed: Out of memory");
 		return -1;
@@ -254,69 +353,17 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	return 0;
 }
 
-static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
-					      char const *query)
+/** Retrieve and classify the result of a query which is no longer busy
+ *
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_result(rlm_sql_handle_t *handle, rlm_sql_config_t *config)
 {
 	rlm_sql_postgres_conn_t	*conn = handle->conn;
 	rlm_sql_postgres_t	*inst = config->driver;
-	fr_time_delta_t		timeout = fr_time_delta_from_sec(config->query_timeout);
-	fr_time_t		start;
-	int			sockfd;
 	PGresult		*tmp_result;
 	int			numfields = 0;
 	ExecStatusType		status;
 
-	if (!conn->db) {
-		ERROR("Socket not connected");
-		return RLM_SQL_RECONNECT;
-	}
-
-	sockfd = PQsocket(conn->db);
-	if (sockfd < 0) {
-		ERROR("Unable to obtain socket: %s", PQerrorMessage(conn->db));
-		return RLM_SQL_RECONNECT;
-	}
-
-	if (!PQsendQuery(conn->db, query)) {
-		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
-		return RLM_SQL_RECONNECT;
-	}
-
-	/*
-	 *  We try to avoid blocking by waiting until the driver indicates that
-	 *  the result is ready or our timeout expires
-	 */
-	start = fr_time();
-	while (PQisBusy(conn->db)) {
-		int		r;
-		fd_set		read_fd;
-		fr_time_delta_t	elapsed = 0;
-
-		FD_ZERO(&read_fd);
-		FD_SET(sockfd, &read_fd);
-
-		if (config->query_timeout) {
-			elapsed = fr_time() - start;
-			if (elapsed >= timeout) goto too_long;
-		}
-
-		r = select(sockfd + 1, &read_fd, NULL, NULL, config->query_timeout ? &fr_time_delta_to_timeval(timeout - elapsed) : NULL);
-		if (r == 0) {
-		too_long:
-			ERROR("Socket read timeout after %d seconds", config->query_timeout);
-			return RLM_SQL_RECONNECT;
-		}
-		if (r < 0) {
-			if (errno == EINTR) continue;
-			ERROR("Failed in select: %s", fr_syserror(errno));
-			return RLM_SQL_RECONNECT;
-		}
-		if (!PQconsumeInput(conn->db)) {
-			ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
-			return RLM_SQL_RECONNECT;
-		}
-	}
-
 	/*
 	 *  Returns a PGresult pointer or possibly a null pointer.
 	 *  A non-null pointer will generally be returned except in
@@ -388,6 +435,312 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_
 	return sql_classify_error(inst, status, conn->result);;
 }
 
+static CC_HINT(nonnull) sql_rcode_t sql_query_start(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						    char const *query)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!PQsendQuery(conn->db, query)) {
+		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *  libpq flushes the query before PQsendQuery returns
+	 *  on a blocking connection, so we only need to wait
+	 *  for the result.
+	 */
+	handle->io_wait = SQL_IO_WAIT_READ;
+
+	return RLM_SQL_IN_PROGRESS;
+}
+
+/** Collect the results of a batch
+ *
+ * Multiple statements sent in a single query run in an implicit
+ * transaction, so if any statement fails, none of the statements
+ * are committed, and the error is returned for the whole batch.
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_batch_resume(rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	rlm_sql_postgres_t	*inst = config->driver;
+	PGresult		*result;
+	ExecStatusType		status;
+
+	while (!PQisBusy(conn->db)) {
+		result = PQgetResult(conn->db);
+		if (!result) {
+			conn->batch = false;
+			handle->io_wait = 0;
+
+			if ((conn->batch_rcode == RLM_SQL_OK) && (conn->batch_done != conn->batch_num)) {
+				WARN("Batch of %zu queries returned %zu results", conn->batch_num, conn->batch_done);
+			}
+
+			return conn->batch_rcode;
+		}
+
+		status = PQresultStatus(result);
+		switch (status) {
+		case PGRES_COMMAND_OK:
+#ifdef HAVE_PGRES_SINGLE_TUPLE
+		case PGRES_SINGLE_TUPLE:
+#endif
+		case PGRES_TUPLES_OK:
+			conn->affected_rows = (status == PGRES_COMMAND_OK) ? affected_rows(result) : PQntuples(result);
+			if (conn->batch_done < conn->batch_num) {
+				conn->batch_affected[conn->batch_done] = conn->affected_rows;
+			}
+			conn->batch_done++;
+			PQclear(result);
+			break;
+
+		default:
+			if (conn->batch_rcode == RLM_SQL_OK) {
+				conn->batch_rcode = sql_classify_error(inst, status, result);
+				if (conn->batch_rcode == RLM_SQL_OK) conn->batch_rcode = RLM_SQL_ERROR;
+			}
+
+			/*
+			 *  Keep the first failure so the error can be
+			 *  retrieved, it's freed by sql_free_result.
+			 */
+			if (!conn->result) {
+				conn->result = result;
+			} else {
+				PQclear(result);
+			}
+			break;
+		}
+	}
+
+	return RLM_SQL_IN_PROGRESS;
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query_resume(rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!PQconsumeInput(conn->db)) {
+		ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (conn->batch) return sql_batch_resume(handle, config);
+
+	if (PQisBusy(conn->db)) return RLM_SQL_IN_PROGRESS;
+
+	handle->io_wait = 0;
+
+	return sql_query_result(handle, config);
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_batch_start(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+						    char const *query, size_t num_queries)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	sql_rcode_t		ret;
+
+	TALLOC_FREE(conn->batch_affected);
+	MEM(conn->batch_affected = talloc_zero_array(conn, int, num_queries));
+	conn->batch_num = num_queries;
+	conn->batch_done = 0;
+	conn->batch_rcode = RLM_SQL_OK;
+
+	ret = sql_query_start(handle, config, query);
+	if (ret == RLM_SQL_IN_PROGRESS) conn->batch = true;
+
+	return ret;
+}
+
+static int sql_batch_affected_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, size_t idx)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (idx >= conn->batch_num) return 0;
+
+	return conn->batch_affected[idx];
+}
+
+static int sql_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	return PQsocket(conn->db);
+}
+
+/** Wait for a query started with sql_query_start or sql_query_params_start to complete
+ *
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_wait(rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	fr_time_delta_t		timeout = fr_time_delta_from_sec(config->query_timeout);
+	fr_time_t		start;
+	int			sockfd;
+
+	sockfd = PQsocket(conn->db);
+	if (sockfd < 0) {
+		ERROR("Unable to obtain socket: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *  We try to avoid blocking by waiting until the driver indicates that
+	 *  the result is ready or our timeout expires
+	 */
+	start = fr_time();
+	while (PQisBusy(conn->db)) {
+		int		r;
+		fd_set		read_fd;
+		fr_time_delta_t	elapsed = 0;
+
+		FD_ZERO(&read_fd);
+		FD_SET(sockfd, &read_fd);
+
+		if (config->query_timeout) {
+			elapsed = fr_time() - start;
+			if (elapsed >= timeout) goto too_long;
+		}
+
+		r = select(sockfd + 1, &read_fd, NULL, NULL, config->query_timeout ? &fr_time_delta_to_timeval(timeout - elapsed) : NULL);
+		if (r == 0) {
+		too_long:
+			ERROR("Socket read timeout after %d seconds", config->query_timeout);
+			return RLM_SQL_RECONNECT;
+		}
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			ERROR("Failed in select: %s", fr_syserror(errno));
+			return RLM_SQL_RECONNECT;
+		}
+		if (!PQconsumeInput(conn->db)) {
+			ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
+			return RLM_SQL_RECONNECT;
+		}
+	}
+	handle->io_wait = 0;
+
+	return sql_query_result(handle, config);
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					      char const *query)
+{
+	sql_rcode_t		ret;
+
+	ret = sql_query_start(handle, config, query);
+	if (ret != RLM_SQL_IN_PROGRESS) return ret;
+
+	return sql_query_wait(handle, config);
+}
+
+/** Release a statement prepared with PQprepare
+ *
+ */
+static void sql_stmt_free(void *stmt, void *uctx)
+{
+	rlm_sql_postgres_conn_t	*conn = talloc_get_type_abort(uctx, rlm_sql_postgres_conn_t);
+	char			*name = stmt;
+
+	if (conn->db) {
+		char		*deallocate;
+		PGresult	*result;
+
+		MEM(deallocate = talloc_typed_asprintf(NULL, "DEALLOCATE %s", name));
+		result = PQexec(conn->db, deallocate);
+		if (result) PQclear(result);
+		talloc_free(deallocate);
+	}
+
+	talloc_free(name);
+}
+
+/** Send a query with parameters, preparing it first if this connection hasn't seen it before
+ *
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_params_start(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+							   char const *query,
+							   char const * const params[], size_t num_params)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	rlm_sql_postgres_t	*inst = config->driver;
+	char const		*name;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!conn->stmts) {
+		MEM(conn->stmts = sql_stmt_cache_alloc(conn, config->prepared_statement_cache_size,
+						       sql_stmt_free, conn));
+	}
+
+	name = sql_stmt_cache_find(conn->stmts, query);
+	if (!name) {
+		char		*new_name;
+		PGresult	*result;
+		ExecStatusType	status;
+
+		MEM(new_name = talloc_typed_asprintf(conn, "frs_%u", sql_stmt_cache_next_id(conn->stmts)));
+
+		DEBUG2("Preparing statement %s", new_name);
+		result = PQprepare(conn->db, new_name, query, 0, NULL);
+		if (!result) {
+			ERROR("Failed preparing query: %s", PQerrorMessage(conn->db));
+			talloc_free(new_name);
+			return RLM_SQL_RECONNECT;
+		}
+
+		status = PQresultStatus(result);
+		if (status != PGRES_COMMAND_OK) {
+			talloc_free(new_name);
+
+			/*
+			 *  Keep the result so the error can be
+			 *  retrieved, it's freed by sql_free_result.
+			 */
+			conn->result = result;
+			return sql_classify_error(inst, status, result);
+		}
+		PQclear(result);
+
+		if (sql_stmt_cache_add(conn->stmts, query, new_name) < 0) {
+			sql_stmt_free(new_name, conn);
+			return RLM_SQL_ERROR;
+		}
+		name = new_name;
+	}
+
+	if (!PQsendQueryPrepared(conn->db, name, (int) num_params, params, NULL, NULL, 0)) {
+		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	handle->io_wait = SQL_IO_WAIT_READ;
+
+	return RLM_SQL_IN_PROGRESS;
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query_params(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+						     char const *query,
+						     char const * const params[], size_t num_params)
+{
+	sql_rcode_t		ret;
+
+	ret = sql_query_params_start(handle, config, query, params, num_params);
+	if (ret != RLM_SQL_IN_PROGRESS) return ret;
+
+	return sql_query_wait(handle, config);
+}
+
 static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t *config, char const *query)
 {
 	return sql_query(handle, config, query);
@@ -535,8 +888,6 @@ static size_t sql_escape_func(REQUEST *request, char *out, size_t outlen, char c
 static int mod_instantiate(rlm_sql_config_t const *config, void *instance, CONF_SECTION *conf)
 {
 	rlm_sql_postgres_t	*inst = instance;
-	char 			application_name[NAMEDATALEN];
-	char			*db_string;
 
 	/*
 	 *	Allow the user to set their own, or disable it
@@ -544,6 +895,7 @@ static int mod_instantiate(rlm_sql_config_t const *config, void *instance, CONF_
 	if (inst->send_application_name) {
 		CONF_SECTION	*cs;
 		char const	*name;
+		char 		application_name[NAMEDATALEN];
 
 		cs = cf_item_to_section(cf_parent(conf));
 
@@ -552,73 +904,10 @@ static int mod_instantiate(rlm_sql_config_t const *config, void *instance, CONF_
 
 		snprintf(application_name, sizeof(application_name),
 			 "FreeRADIUS " RADIUSD_VERSION_STRING " - %s (%s)", main_config->name, name);
+		inst->application_name = talloc_typed_strdup(inst, application_name);
 	}
 
-	/*
-	 *	Old style database name
-	 *
-	 *	Append options if they were set in the config
-	 */
-	if (!strchr(config->sql_db, '=')) {
-		db_string = talloc_typed_asprintf(inst, "dbname='%s'", config->sql_db);
-
-		if (config->sql_server[0] != '\0') {
-			db_string = talloc_asprintf_append(db_string, " host='%s'", config->sql_server);
-		}
-
-		if (config->sql_port) {
-			db_string = talloc_asprintf_append(db_string, " port=%i", config->sql_port);
-		}
-
-		if (config->sql_login[0] != '\0') {
-			db_string = talloc_asprintf_append(db_string, " user='%s'", config->sql_login);
-		}
-
-		if (config->sql_password[0] != '\0') {
-			db_string = talloc_asprintf_append(db_string, " password='%s'", config->sql_password);
-		}
-
-		if (config->query_timeout) {
-			db_string = talloc_asprintf_append(db_string, " connect_timeout=%d", config->query_timeout);
-		}
-
-		if (inst->send_application_name) {
-			db_string = talloc_asprintf_append(db_string, " application_name='%s'", application_name);
-		}
-
-	/*
-	 *	New style parameter string
-	 *
-	 *	Only append options when not already present
-	 */
-	} else {
-		db_string = talloc_typed_strdup(inst, config->sql_db);
-
-		if ((config->sql_server[0] != '\0') && !strstr(db_string, "host=")) {
-			db_string = talloc_asprintf_append(db_string, " host='%s'", config->sql_server);
-		}
-
-		if (config->sql_port && !strstr(db_string, "port=")) {
-			db_string = talloc_asprintf_append(db_string, " port=%i", config->sql_port);
-		}
-
-		if ((config->sql_login[0] != '\0') && !strstr(db_string, "user=")) {
-			db_string = talloc_asprintf_append(db_string, " user='%s'", config->sql_login);
-		}
-
-		if ((config->sql_password[0] != '\0') && !strstr(db_string, "password=")) {
-			db_string = talloc_asprintf_append(db_string, " password='%s'", config->sql_password);
-		}
-
-		if ((config->query_timeout) && !strstr(db_string, "connect_timeout=")) {
-			db_string = talloc_asprintf_append(db_string, " connect_timeout=%d", config->query_timeout);
-		}
-
-		if (inst->send_application_name && !strstr(db_string, "application_name=")) {
-			db_string = talloc_asprintf_append(db_string, " application_name='%s'", application_name);
-		}
-	}
-	inst->db_string = db_string;
+	inst->db_string = sql_db_string(inst, inst, config);
 
 	inst->states = sql_state_trie_alloc(inst);
 
@@ -657,7 +946,7 @@ extern rlm_sql_driver_t rlm_sql_postgresql;
 rlm_sql_driver_t rlm_sql_postgresql = {
 	.name				= "rlm_sql_postgresql",
 	.magic				= RLM_MODULE_INIT,
-	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY,
+	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY | RLM_SQL_FLAGS_NUMBERED_PARAMS,
 	.inst_size			= sizeof(rlm_sql_postgres_t),
 	.onload				= mod_load,
 	.config				= driver_config,
@@ -672,5 +961,12 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 	.sql_finish_query		= sql_free_result,
 	.sql_finish_select_query	= sql_free_result,
 	.sql_affected_rows		= sql_affected_rows,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_fd				= sql_fd,
+	.sql_query_start		= sql_query_start,
+	.sql_query_resume		= sql_query_resume,
+	.sql_query_params		= sql_query_params,
+	.sql_query_params_start		= sql_query_params_start,
+	.sql_batch_start		= sql_batch_start,
+	.sql_batch_affected_rows	= sql_batch_affected_rows
 };
@@ -29,6 +29,8 @@ RCSID("$Id$")
 #include <freeradius-devel/util/debug.h>
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 
 #include <sqlite3.h>
@@ -49,20 +51,76 @@ RCSID("$Id$")
 typedef sqlite_int64 sqlite3_int64;
 #endif
 
+typedef enum {
+	SQLITE_WRITE_QUEUED = 0,			//!< Waiting for the writer thread.
+	SQLITE_WRITE_RUNNING,				//!< Being executed by the writer thread.
+	SQLITE_WRITE_DONE				//!< Result is available.
+} rlm_sql_sqlite_write_state_t;
+
+/** A query queued for the writer thread
+ *
+ * Owned by the connection which queued it, unless the connection is
+ * freed whilst the writer is executing it, in which case the writer
+ * frees it.
+ */
+typedef struct {
+	fr_dlist_t			entry;		//!< Entry in the writer's queue.
+	rlm_sql_sqlite_write_state_t	state;		//!< Protected by the writer's mutex.
+	bool				orphaned;	//!< Connection was freed, nothing wants the result.
+	int				fd;		//!< To write to when the query completes.
+
+	char const			*query;		//!< Query to execute.
+	char const * const		*params;	//!< Parameters to bind, NULL if not prepared.
+	size_t				num_params;	//!< Number of parameters.
+
+	sql_rcode_t			rcode;		//!< Result of the query.
+	int				changes;	//!< Rows changed by the query.
+	char				error[256];	//!< Error from SQLite, if the query failed.
+} rlm_sql_sqlite_write_t;
+
+/** The writer thread, and the queue feeding it
+ *
+ * Allocated outside of the driver instance, as the instance data is
+ * read only once the module is instantiated.
+ */
+typedef struct {
+	sqlite3			*db;			//!< Handle only used by the writer thread.
+	sql_stmt_cache_t	*stmts;			//!< Statements prepared by the writer thread.
+
+	pthread_t		thread;			//!< Executing writes.
+	bool			started;		//!< Whether the thread was started.
+
+	pthread_mutex_t		mutex;			//!< Protects the queue, and the state of writes.
+	pthread_cond_t		cond;			//!< Signalled when writes are queued.
+	fr_dlist_head_t		queue;			//!< Writes waiting to be executed.
+	bool			stop;			//!< Tell the thread to exit.
+} rlm_sql_sqlite_writer_t;
+
 typedef struct {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
 	int col_count;
+	sql_stmt_cache_t *stmts;	//!< Statements prepared on this connection.
+	bool statement_cached;		//!< statement belongs to stmts, and must be reset, not finalized.
+
+	int fd;				//!< Read end of the socket pair the writer signals on, -1 if unused.
+	int notify_fd;			//!< Write end of the socket pair.
+	rlm_sql_sqlite_write_t *write;	//!< Write queued by this connection.
+	rlm_sql_sqlite_writer_t *writer; //!< Writer the write was queued with.
 } rlm_sql_sqlite_conn_t;
 
 typedef struct {
 	char const	*filename;
 	uint32_t	busy_timeout;
+	bool		wal;		//!< Use write-ahead logging, and a single writer thread.
+
+	rlm_sql_sqlite_writer_t	*writer;	//!< Writer thread, if wal is enabled.
 } rlm_sql_sqlite_t;
 
 static const CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_REQUIRED, rlm_sql_sqlite_t, filename) },
 	{ FR_CONF_OFFSET("busy_timeout", FR_TYPE_UINT32, rlm_sql_sqlite_t, busy_timeout), .dflt = "200" },
+	{ FR_CONF_OFFSET("wal", FR_TYPE_BOOL, rlm_sql_sqlite_t, wal), .dflt = "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -384,6 +442,40 @@ static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 
 	DEBUG2("Socket destructor called, closing socket");
 
+	/*
+	 *	If the writer is executing our query, it
+	 *	frees the write once it's done.
+	 */
+	if (conn->write) {
+		pthread_mutex_lock(&conn->writer->mutex);
+		switch (conn->write->state) {
+		case SQLITE_WRITE_QUEUED:
+			fr_dlist_remove(&conn->writer->queue, conn->write);
+			/* FALL-THROUGH */
+
+		case SQLITE_WRITE_DONE:
+			talloc_free(conn->write);
+			break;
+
+		case SQLITE_WRITE_RUNNING:
+			conn->write->orphaned = true;
+			break;
+		}
+		conn->write = NULL;
+		pthread_mutex_unlock(&conn->writer->mutex);
+	}
+
+	if (conn->fd >= 0) {
+		close(conn->fd);
+		close(conn->notify_fd);
+	}
+
+	/*
+	 *	sqlite3_close fails if there are
+	 *	unfinalized statements.
+	 */
+	TALLOC_FREE(conn->stmts);
+
 	if (conn->db) {
 		status = sqlite3_close(conn->db);
 		if (status != SQLITE_OK) WARN("Got SQLite error when closing socket: %s",
@@ -417,6 +509,8 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	int status;
 
 	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_sqlite_conn_t));
+	conn->fd = -1;
+	conn->notify_fd = -1;
 	talloc_set_destructor(conn, _sql_socket_destructor);
 
 	INFO("Opening SQLite database \"%s\"", inst->filename);
@@ -500,6 +594,267 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return sql_check_error(conn->db, status);
 }
 
+/** Finalize a statement prepared by sql_query_params
+ *
+ */
+static void sql_stmt_free(void *stmt, UNUSED void *uctx)
+{
+	(void) sqlite3_finalize(stmt);
+}
+
+static sql_rcode_t sql_query_params(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query,
+				    char const * const params[], size_t num_params)
+{
+	sql_rcode_t		rcode;
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	sqlite3_stmt		*statement;
+	size_t			i;
+	int			status;
+
+	if (!conn->stmts) {
+		MEM(conn->stmts = sql_stmt_cache_alloc(conn, config->prepared_statement_cache_size,
+						       sql_stmt_free, NULL));
+	}
+
+	statement = sql_stmt_cache_find(conn->stmts, query);
+	if (!statement) {
+		char const *z_tail;
+
+#ifdef HAVE_SQLITE3_PREPARE_V2
+		status = sqlite3_prepare_v2(conn->db, query, strlen(query), &statement, &z_tail);
+#else
+		status = sqlite3_prepare(conn->db, query, strlen(query), &statement, &z_tail);
+#endif
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+
+		if (sql_stmt_cache_add(conn->stmts, query, statement) < 0) {
+			(void) sqlite3_finalize(statement);
+			return RLM_SQL_ERROR;
+		}
+	}
+
+	conn->statement = statement;
+	conn->statement_cached = true;
+
+	if ((size_t) sqlite3_bind_parameter_count(statement) != num_params) {
+		ERROR("Statement expects %i parameters, got %zu", sqlite3_bind_parameter_count(statement), num_params);
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	for (i = 0; i < num_params; i++) {
+		status = sqlite3_bind_text(statement, i + 1, params[i], -1, SQLITE_TRANSIENT);
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+	}
+
+	status = sqlite3_step(statement);
+	return sql_check_error(conn->db, status);
+}
+
+/** Execute a queued write using the writer's handle
+ *
+ */
+static void sql_writer_execute(rlm_sql_sqlite_writer_t *writer, rlm_sql_sqlite_write_t *item)
+{
+	sqlite3_stmt	*statement;
+	char const	*z_tail;
+	int		status;
+	size_t		i;
+
+	if (item->params) {
+		statement = sql_stmt_cache_find(writer->stmts, item->query);
+		if (!statement) {
+			status = sqlite3_prepare_v2(writer->db, item->query, strlen(item->query), &statement, &z_tail);
+			if (status != SQLITE_OK) goto done;
+
+			if (sql_stmt_cache_add(writer->stmts, item->query, statement) < 0) {
+				(void) sqlite3_finalize(statement);
+				status = SQLITE_NOMEM;
+				goto done;
+			}
+		}
+
+		for (i = 0; i < item->num_params; i++) {
+			status = sqlite3_bind_text(statement, i + 1, item->params[i], -1, SQLITE_STATIC);
+			if (status != SQLITE_OK) break;
+		}
+		if (i == item->num_params) status = sqlite3_step(statement);
+
+		(void) sqlite3_reset(statement);
+		(void) sqlite3_clear_bindings(statement);
+	} else {
+		status = sqlite3_prepare_v2(writer->db, item->query, strlen(item->query), &statement, &z_tail);
+		if (status == SQLITE_OK) {
+			status = sqlite3_step(statement);
+			(void) sqlite3_finalize(statement);
+		}
+	}
+
+done:
+	item->rcode = sql_error_to_rcode(status);
+	if (item->rcode == RLM_SQL_OK) {
+		item->changes = sqlite3_changes(writer->db);
+	} else {
+		strlcpy(item->error, sqlite3_errmsg(writer->db), sizeof(item->error));
+	}
+}
+
+/** Execute writes from all connections, one at a time
+ *
+ * In WAL mode readers never block on the writer, and because
+ * there's only one writer, writes never have to retry because
+ * another connection holds the write lock.
+ */
+static void *sql_writer_main(void *arg)
+{
+	rlm_sql_sqlite_writer_t	*writer = arg;
+	rlm_sql_sqlite_write_t	*item;
+
+	pthread_mutex_lock(&writer->mutex);
+	while (!writer->stop) {
+		item = fr_dlist_head(&writer->queue);
+		if (!item) {
+			pthread_cond_wait(&writer->cond, &writer->mutex);
+			continue;
+		}
+		fr_dlist_remove(&writer->queue, item);
+		item->state = SQLITE_WRITE_RUNNING;
+		pthread_mutex_unlock(&writer->mutex);
+
+		sql_writer_execute(writer, item);
+
+		pthread_mutex_lock(&writer->mutex);
+		if (item->orphaned) {
+			talloc_free(item);
+			continue;
+		}
+		item->state = SQLITE_WRITE_DONE;
+
+		/*
+		 *	If the socket is full there's already a
+		 *	wakeup pending, so EAGAIN can be ignored.
+		 */
+		if (write(item->fd, "", 1) < 0) {
+			/* nothing */
+		}
+	}
+	pthread_mutex_unlock(&writer->mutex);
+
+	return NULL;
+}
+
+/** Queue a write for the writer thread
+ *
+ * The query and parameters are copied, as the writer may still be
+ * executing the query after the caller has freed them.
+ */
+static sql_rcode_t sql_write_start(rlm_sql_handle_t *handle, rlm_sql_sqlite_t const *inst, char const *query,
+				   char const * const params[], size_t num_params)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	rlm_sql_sqlite_writer_t	*writer = inst->writer;
+	rlm_sql_sqlite_write_t	*item;
+
+	fr_assert(!conn->write);
+
+	MEM(item = talloc_zero(NULL, rlm_sql_sqlite_write_t));
+	item->fd = conn->notify_fd;
+	MEM(item->query = talloc_typed_strdup(item, query));
+	if (params) {
+		char	**copy;
+		size_t	i;
+
+		MEM(copy = talloc_array(item, char *, num_params));
+		for (i = 0; i < num_params; i++) copy[i] = params[i] ? talloc_typed_strdup(copy, params[i]) : NULL;
+		item->params = (char const * const *)copy;
+		item->num_params = num_params;
+	}
+
+	conn->write = item;
+	conn->writer = writer;
+
+	pthread_mutex_lock(&writer->mutex);
+	fr_dlist_insert_tail(&writer->queue, item);
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+
+	handle->io_wait = SQL_IO_WAIT_READ;
+
+	return RLM_SQL_IN_PROGRESS;
+}
+
+/** Start a query, queueing it for the writer thread if we're in WAL mode
+ *
+ * Otherwise the query is executed immediately, on this connection.
+ */
+static sql_rcode_t sql_query_start(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query)
+{
+	rlm_sql_sqlite_t	*inst = config->driver;
+
+	if (!inst->writer) return sql_query(handle, config, query);
+
+	return sql_write_start(handle, inst, query, NULL, 0);
+}
+
+static sql_rcode_t sql_query_params_start(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query,
+					  char const * const params[], size_t num_params)
+{
+	rlm_sql_sqlite_t	*inst = config->driver;
+
+	if (!inst->writer) return sql_query_params(handle, config, query, params, num_params);
+
+	return sql_write_start(handle, inst, query, params, num_params);
+}
+
+static sql_rcode_t sql_query_resume(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	rlm_sql_sqlite_write_state_t	state;
+	uint8_t			buffer[64];
+
+	while (read(conn->fd, buffer, sizeof(buffer)) > 0);
+
+	if (!conn->write) return RLM_SQL_ERROR;
+
+	pthread_mutex_lock(&conn->writer->mutex);
+	state = conn->write->state;
+	pthread_mutex_unlock(&conn->writer->mutex);
+
+	if (state != SQLITE_WRITE_DONE) return RLM_SQL_IN_PROGRESS;
+
+	handle->io_wait = 0;
+
+	return conn->write->rcode;
+}
+
+/** Return a socket the SQL trunk can watch for completed writes
+ *
+ */
+static int sql_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	int			fds[2];
+
+	if (conn->fd >= 0) return conn->fd;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		ERROR("Failed creating notification socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if ((fr_nonblock(fds[0]) < 0) || (fr_nonblock(fds[1]) < 0)) {
+		ERROR("Failed setting notification socket non-blocking: %s", fr_syserror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	conn->fd = fds[0];
+	conn->notify_fd = fds[1];
+
+	return conn->fd;
+}
+
 static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
@@ -620,7 +975,17 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_conf
 	if (conn->statement) {
 		TALLOC_FREE(handle->row);
 
-		(void) sqlite3_finalize(conn->statement);
+		/*
+		 *	Cached statements are reused by the
+		 *	next query, so only reset them.
+		 */
+		if (conn->statement_cached) {
+			(void) sqlite3_reset(conn->statement);
+			(void) sqlite3_clear_bindings(conn->statement);
+			conn->statement_cached = false;
+		} else {
+			(void) sqlite3_finalize(conn->statement);
+		}
 		conn->statement = NULL;
 		conn->col_count = 0;
 	}
@@ -654,6 +1019,15 @@ static size_t sql_error(UNUSED TALLOC_CTX *ctx, sql_log_entry_t out[], NDEBUG_UN
 
 	fr_assert(outlen > 0);
 
+	if (conn->write) {
+		if (!conn->write->error[0]) return 0;
+
+		out[0].type = L_ERR;
+		out[0].msg = conn->write->error;
+
+		return 1;
+	}
+
 	error = sqlite3_errmsg(conn->db);
 	if (!error) return 0;
 
@@ -665,6 +1039,13 @@ static size_t sql_error(UNUSED TALLOC_CTX *ctx, sql_log_entry_t out[], NDEBUG_UN
 
 static sql_rcode_t sql_finish_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config)
 {
+	rlm_sql_sqlite_conn_t *conn = handle->conn;
+
+	/*
+	 *	The writer is done with it, so it's ours to free.
+	 */
+	if (conn->write && (conn->write->state == SQLITE_WRITE_DONE)) TALLOC_FREE(conn->write);
+
 	return sql_free_result(handle, config);
 }
 
@@ -673,11 +1054,103 @@ static int sql_affected_rows(rlm_sql_handle_t *handle,
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
 
+	if (conn->write) return conn->write->changes;
+
 	if (conn->db) return sqlite3_changes(conn->db);
 
 	return -1;
 }
 
+static int _sql_writer_free(rlm_sql_sqlite_writer_t *writer)
+{
+	rlm_sql_sqlite_write_t *item;
+
+	if (writer->started) {
+		pthread_mutex_lock(&writer->mutex);
+		writer->stop = true;
+		pthread_cond_signal(&writer->cond);
+		pthread_mutex_unlock(&writer->mutex);
+
+		pthread_join(writer->thread, NULL);
+	}
+
+	while ((item = fr_dlist_head(&writer->queue))) {
+		fr_dlist_remove(&writer->queue, item);
+		talloc_free(item);
+	}
+
+	TALLOC_FREE(writer->stmts);
+	if (writer->db) (void) sqlite3_close(writer->db);
+
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->mutex);
+
+	return 0;
+}
+
+#ifdef HAVE_SQLITE3_OPEN_V2
+/** Switch the database to WAL mode and start the writer thread
+ *
+ */
+static int sql_writer_start(rlm_sql_config_t const *config, rlm_sql_sqlite_t *inst)
+{
+	rlm_sql_sqlite_writer_t	*writer;
+	char			*errmsg = NULL;
+	int			status;
+
+	MEM(writer = talloc_zero(NULL, rlm_sql_sqlite_writer_t));
+	pthread_mutex_init(&writer->mutex, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+	fr_dlist_talloc_init(&writer->queue, rlm_sql_sqlite_write_t, entry);
+	talloc_set_destructor(writer, _sql_writer_free);
+
+	status = sqlite3_open_v2(inst->filename, &writer->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL);
+	if (!writer->db || (sql_check_error(writer->db, status) != RLM_SQL_OK)) {
+		sql_print_error(writer->db, status, "Error opening SQLite database \"%s\"", inst->filename);
+	error:
+		talloc_free(writer);
+		return -1;
+	}
+	(void) sqlite3_busy_timeout(writer->db, inst->busy_timeout);
+
+	/*
+	 *	The journal mode is stored in the database, so
+	 *	this applies to every connection, not just ours.
+	 *	synchronous = NORMAL is durable in WAL mode
+	 *	except against power loss, and avoids an fsync
+	 *	per transaction.
+	 */
+	status = sqlite3_exec(writer->db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;",
+			      NULL, NULL, &errmsg);
+	if (status != SQLITE_OK) {
+		ERROR("Failed enabling WAL mode: %s", errmsg ? errmsg : "unknown error");
+		sqlite3_free(errmsg);
+		goto error;
+	}
+
+	MEM(writer->stmts = sql_stmt_cache_alloc(writer, config->prepared_statement_cache_size, sql_stmt_free, NULL));
+
+	if (pthread_create(&writer->thread, NULL, sql_writer_main, writer) != 0) {
+		ERROR("Failed creating writer thread: %s", fr_syserror(errno));
+		goto error;
+	}
+	writer->started = true;
+
+	inst->writer = writer;
+
+	return 0;
+}
+#endif
+
+static int mod_detach(void *instance)
+{
+	rlm_sql_sqlite_t	*inst = instance;
+
+	TALLOC_FREE(inst->writer);
+
+	return 0;
+}
+
 static int mod_instantiate(rlm_sql_config_t const *config, void *instance, CONF_SECTION *cs)
 {
 	bool			exists;
@@ -786,6 +1259,15 @@ static int mod_instantiate(rlm_sql_config_t const *config, void *instance, CONF_
 #endif
 	}
 
+	if (inst->wal) {
+#ifdef HAVE_SQLITE3_OPEN_V2
+		if (sql_writer_start(config, inst) < 0) return -1;
+#else
+		ERROR("'wal' requires SQLite >= 3.7.0");
+		return -1;
+#endif
+	}
+
 	return 0;
 }
 
@@ -810,6 +1292,7 @@ rlm_sql_driver_t rlm_sql_sqlite = {
 	.config				= driver_config,
 	.onload				= mod_load,
 	.mod_instantiate		= mod_instantiate,
+	.detach				= mod_detach,
 	.sql_socket_init		= sql_socket_init,
 	.sql_query			= sql_query,
 	.sql_select_query		= sql_select_query,
@@ -820,5 +1303,10 @@ rlm_sql_driver_t rlm_sql_sqlite = {
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
-	.sql_finish_select_query	= sql_finish_query
+	.sql_finish_select_query	= sql_finish_query,
+	.sql_query_params		= sql_query_params,
+	.sql_fd				= sql_fd,
+	.sql_query_start		= sql_query_start,
+	.sql_query_resume		= sql_query_resume,
+	.sql_query_params_start		= sql_query_params_start
 };
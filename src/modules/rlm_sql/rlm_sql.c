@@ -36,6 +36,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/map_proc.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/pairmove.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/table.h>
 
@@ -82,6 +83,19 @@ static const CONF_PARSER postauth_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER replica_config[] = {
+	{ FR_CONF_OFFSET("server", FR_TYPE_STRING | FR_TYPE_REQUIRED, sql_replica_t, sql_server) },
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT32, sql_replica_t, sql_port), .dflt = "0" },
+	{ FR_CONF_OFFSET("login", FR_TYPE_STRING, sql_replica_t, sql_login) },
+	{ FR_CONF_OFFSET("password", FR_TYPE_STRING | FR_TYPE_SECRET, sql_replica_t, sql_password) },
+	{ FR_CONF_OFFSET("radius_db", FR_TYPE_STRING, sql_replica_t, sql_db) },
+
+	{ FR_CONF_OFFSET("lag_query", FR_TYPE_STRING | FR_TYPE_NOT_EMPTY, sql_replica_t, lag_query) },
+	{ FR_CONF_OFFSET("max_lag", FR_TYPE_UINT32, sql_replica_t, max_lag), .dflt = "30" },
+	{ FR_CONF_OFFSET("check_interval", FR_TYPE_TIME_DELTA, sql_replica_t, check_interval), .dflt = "10" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", FR_TYPE_STRING, rlm_sql_config_t, sql_driver_name), .dflt = "rlm_sql_null" },
 	{ FR_CONF_OFFSET("server", FR_TYPE_STRING, rlm_sql_config_t, sql_server), .dflt = "" },	/* Must be zero length so drivers can determine if it was set */
@@ -110,12 +124,45 @@ static const CONF_PARSER module_config[] = {
 	 */
 	{ FR_CONF_OFFSET("query_timeout", FR_TYPE_UINT32, rlm_sql_config_t, query_timeout) },
 
+	{ FR_CONF_OFFSET("prepared_statements", FR_TYPE_BOOL, rlm_sql_config_t, prepared_statements), .dflt = "no" },
+	{ FR_CONF_OFFSET("prepared_statement_cache_size", FR_TYPE_UINT32, rlm_sql_config_t, prepared_statement_cache_size), .dflt = "64" },
+
 	{ FR_CONF_POINTER("accounting", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) acct_config },
 
 	{ FR_CONF_POINTER("post-auth", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) postauth_config },
+
+	/*
+	 *	Only used by drivers supporting asynchronous queries.
+	 */
+	{ FR_CONF_OFFSET("batch_size", FR_TYPE_UINT32, rlm_sql_config_t, batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("batch_delay", FR_TYPE_TIME_DELTA, rlm_sql_config_t, batch_delay), .dflt = "0.01" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_sql_config_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+
+	{ FR_CONF_OFFSET("replica", FR_TYPE_SUBSECTION | FR_TYPE_MULTI, rlm_sql_config_t, replicas),
+	  .subcs_size = sizeof(sql_replica_t), .subcs_type = "sql_replica_t",
+	  .subcs = (void const *) replica_config, .ident2 = CF_IDENT_ANY },
 	CONF_PARSER_TERMINATOR
 };
 
+/** Per-thread instance data
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;			//!< Instance of rlm_sql.
+	fr_trunk_t		*trunk;			//!< Trunk used for accounting and post-auth queries.
+							///< NULL if the driver doesn't support asynchronous queries.
+} rlm_sql_thread_t;
+
+/** Resume context for asynchronous accounting and post-auth queries
+ *
+ */
+typedef struct {
+	sql_acct_section_t	*section;		//!< Section the queries are being run from.
+	CONF_PAIR		*pair;			//!< Query currently being run.
+	char const		*attr;			//!< Name of the query template.
+	sql_trunk_query_t	query;			//!< Query state shared with the trunk.
+} sql_acct_rctx_t;
+
 static fr_dict_t const *dict_freeradius;
 static fr_dict_t const *dict_radius;
 
@@ -180,11 +227,7 @@ static ssize_t sql_xlat(UNUSED TALLOC_CTX *ctx, char **out, UNUSED size_t outlen
 	sql_rcode_t		rcode;
 	ssize_t			ret = 0;
 	char const		*p;
-
-	handle = fr_pool_connection_get(inst->pool, request);	/* connection pool should produce error */
-	if (!handle) return 0;
-
-	rlm_sql_query_log(inst, request, NULL, fmt);
+	bool			write;
 
 	p = fmt;
 
@@ -193,13 +236,27 @@ static ssize_t sql_xlat(UNUSED TALLOC_CTX *ctx, char **out, UNUSED size_t outlen
 	 */
 	fr_skip_whitespace(p);
 
+	write = ((strncasecmp(p, "insert", 6) == 0) ||
+		 (strncasecmp(p, "update", 6) == 0) ||
+		 (strncasecmp(p, "delete", 6) == 0));
+
+	/*
+	 *	Only writes need to go to the primary
+	 */
+	if (write) {
+		handle = fr_pool_connection_get(inst->pool, request);	/* connection pool should produce error */
+	} else {
+		handle = sql_read_handle_get(inst, request);
+	}
+	if (!handle) return 0;
+
+	rlm_sql_query_log(inst, request, NULL, fmt);
+
 	/*
 	 *	If the query starts with any of the following prefixes,
 	 *	then return the number of rows affected
 	 */
-	if ((strncasecmp(p, "insert", 6) == 0) ||
-	    (strncasecmp(p, "update", 6) == 0) ||
-	    (strncasecmp(p, "delete", 6) == 0)) {
+	if (write) {
 		int numaffected;
 
 		rcode = rlm_sql_query(inst, request, &handle, fmt);
@@ -259,7 +316,7 @@ static ssize_t sql_xlat(UNUSED TALLOC_CTX *ctx, char **out, UNUSED size_t outlen
 	(inst->driver->sql_finish_select_query)(handle, inst->config);
 
 finish:
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
 
 	return ret;
 }
@@ -356,8 +413,12 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	int			field_index[MAX_SQL_FIELD_INDEX];
 	bool			found_field = false;	/* Did we find any matching fields in the result set ? */
 
+	map_batch_t		batch;
+
 	fr_assert(inst->driver->sql_fields);		/* Should have been caught during validation... */
 
+	map_batch_init(&batch, request);
+
 	if (!*query) {
 		REDEBUG("Query cannot be (null)");
 		return RLM_MODULE_FAIL;
@@ -378,7 +439,7 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	 */
 	sql_set_user(inst, request, NULL);
 
-	handle = fr_pool_connection_get(inst->pool, request);		/* connection pool should produce error */
+	handle = sql_read_handle_get(inst, request);		/* connection pool should produce error */
 	if (!handle) {
 		rcode = RLM_MODULE_FAIL;
 		goto finish;
@@ -468,6 +529,9 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	 *
 	 *	Note: Not all SQL client libraries provide a row count,
 	 *	so we have to do the count here.
+	 *
+	 *	The pairs from all rows are added to their lists
+	 *	together, when the batch is committed.
 	 */
 	while (((ret = rlm_sql_fetch_row(&row, inst, request, &handle)) == RLM_SQL_OK)) {
 		rows++;
@@ -475,7 +539,7 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 		     map && (j < MAX_SQL_FIELD_INDEX);
 		     map = map->next, j++) {
 			if (field_index[j] < 0) continue;	/* We didn't find the map RHS in the field set */
-			if (map_to_request(request, map, _sql_map_proc_get_value, row[field_index[j]]) < 0) goto error;
+			if (map_batch_add(&batch, map, _sql_map_proc_get_value, row[field_index[j]]) < 0) goto error;
 		}
 	}
 
@@ -489,8 +553,9 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, REQUEST
 	(inst->driver->sql_finish_select_query)(handle, inst->config);
 
 finish:
+	map_batch_commit(&batch);
 	talloc_free(fields);
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
 
 	return rcode;
 }
@@ -762,7 +827,7 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 	/*
 	 *	Get a socket for this lookup
 	 */
-	handle = fr_pool_connection_get(inst->pool, request);
+	handle = sql_read_handle_get(inst, request);
 	if (!handle) {
 		return 1;
 	}
@@ -772,7 +837,7 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 	 */
 	if (sql_get_grouplist(inst, &handle, request, &head) < 0) {
 		REDEBUG("Error getting group membership");
-		fr_pool_connection_release(inst->pool, request, handle);
+		sql_handle_release(inst, request, handle);
 		return 1;
 	}
 
@@ -781,14 +846,14 @@ static int sql_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req
 			RDEBUG2("sql_groupcmp finished: User is a member of group %s",
 			       check->vp_strvalue);
 			talloc_free(head);
-			fr_pool_connection_release(inst->pool, request, handle);
+			sql_handle_release(inst, request, handle);
 			return 0;
 		}
 	}
 
 	/* Free the grouplist */
 	talloc_free(head);
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
 
 	RDEBUG2("sql_groupcmp finished: User is NOT a member of group %pV", &check->data);
 
@@ -962,6 +1027,7 @@ static int mod_detach(void *instance)
 {
 	rlm_sql_t	*inst = talloc_get_type_abort(instance, rlm_sql_t);
 
+	sql_replicas_free(inst);
 	if (inst->pool) fr_pool_free(inst->pool);
 
 	/*
@@ -1157,6 +1223,16 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 				inst->driver->sql_escape_func :
 				sql_escape_func;
 
+	/*
+	 *	Prepared statements need driver support.
+	 */
+	if (inst->config->prepared_statements && !inst->driver->sql_query_params) {
+		WARN("Driver %s does not support prepared statements, ignoring 'prepared_statements = yes'",
+		     inst->driver->name);
+		inst->config->prepared_statements = false;
+	}
+	FR_INTEGER_BOUND_CHECK("prepared_statement_cache_size", inst->config->prepared_statement_cache_size, >=, 1);
+
 	inst->ef = module_exfile_init(inst, conf, 256, 30, true, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err(conf, "Failed creating log file context");
@@ -1171,9 +1247,57 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->pool = module_connection_pool_init(inst->cs, inst, sql_mod_conn_create, NULL, NULL, NULL, NULL);
 	if (!inst->pool) return -1;
 
+	if (sql_replicas_init(inst, conf) < 0) return -1;
+
+	/*
+	 *	Database connections can only run one
+	 *	query at a time.
+	 */
+	if (inst->driver->sql_query_start) {
+		inst->config->trunk_conf.max_req_per_conn = 1;
+		inst->config->trunk_conf.target_req_per_conn = 1;
+	}
+
+	/*
+	 *	Batches queue on a connection until
+	 *	they're full, or batch_delay passes.
+	 */
+	if (inst->config->batch_size > 1) {
+		if (!inst->driver->sql_query_start || !inst->driver->sql_batch_start) {
+			WARN("Driver %s does not support batching queries, ignoring 'batch_size'", inst->driver->name);
+			inst->config->batch_size = 0;
+		} else {
+			FR_INTEGER_BOUND_CHECK("batch_size", inst->config->batch_size, <=, 1000);
+			FR_TIME_DELTA_BOUND_CHECK("batch_delay", inst->config->batch_delay, >=, fr_time_delta_from_msec(1));
+			FR_TIME_DELTA_BOUND_CHECK("batch_delay", inst->config->batch_delay, <=, fr_time_delta_from_sec(1));
+
+			if (inst->config->prepared_statements) {
+				WARN("Batched queries are not sent as prepared statements");
+			}
+
+			inst->config->trunk_conf.max_req_per_conn = inst->config->batch_size;
+			inst->config->trunk_conf.target_req_per_conn = inst->config->batch_size;
+		}
+	}
+
 	return RLM_MODULE_OK;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_sql_t		*inst = talloc_get_type_abort(instance, rlm_sql_t);
+	rlm_sql_thread_t	*t = talloc_get_type_abort(thread, rlm_sql_thread_t);
+
+	t->inst = inst;
+
+	if (!inst->driver->sql_query_start) return 0;
+
+	t->trunk = sql_trunk_alloc(t, inst, el);
+	if (!t->trunk) return -1;
+
+	return 0;
+}
+
 static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
 static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
 {
@@ -1215,7 +1339,7 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 	 *	After this point use goto error or goto release to cleanup socket temporary pairlists and
 	 *	temporary attributes.
 	 */
-	handle = fr_pool_connection_get(inst->pool, request);
+	handle = sql_read_handle_get(inst, request);
 	if (!handle) {
 		sql_unset_user(inst, request);
 		return RLM_MODULE_FAIL;
@@ -1238,7 +1362,7 @@ static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *r
 			fr_pair_list_free(&reply_tmp);
 			sql_unset_user(inst, request);
 
-			fr_pool_connection_release(inst->pool, request, handle);
+			sql_handle_release(inst, request, handle);
 
 			return rcode;
 		}
@@ -1410,47 +1534,37 @@ skip_reply:
 release:
 	if (!user_found) rcode = RLM_MODULE_NOTFOUND;
 
-	fr_pool_connection_release(inst->pool, request, handle);
+	sql_handle_release(inst, request, handle);
 	sql_unset_user(inst, request);
 
 	return rcode;
 }
 
-/*
- *	Generic function for failing between a bunch of queries.
+/** Find the query template to use for accounting or post-auth
  *
- *	Uses the same principle as rlm_linelog, expanding the 'reference' config
- *	item using xlat to figure out what query it should execute.
- *
- *	If the reference matches multiple config items, and a query fails or
- *	doesn't update any rows, the next matching config item is used.
+ * Expands the 'reference' config item in the section, and finds the
+ * config pair it points to.
  *
+ * @param[out] out	The first query in the template.
+ * @param[in] request	The current request.
+ * @param[in] section	to find the query in.
+ * @return
+ *	- RLM_MODULE_OK if a query was found.
+ *	- RLM_MODULE_NOOP if the reference didn't match a query.
+ *	- RLM_MODULE_FAIL if the reference couldn't be expanded.
  */
-static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section)
+static rlm_rcode_t acct_query_find(CONF_PAIR **out, REQUEST *request, sql_acct_section_t *section)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_OK;
-
-	rlm_sql_handle_t	*handle = NULL;
-	int			sql_ret;
-	int			numaffected = 0;
-
 	CONF_ITEM		*item;
-	CONF_PAIR 		*pair;
-	char const		*attr = NULL;
-	char const		*value;
-
 	char			path[FR_MAX_STRING_LEN];
 	char			*p = path;
-	char			*expanded = NULL;
 
 	fr_assert(section);
 
 	if (section->reference[0] != '.') *p++ = '.';
 
 	if (xlat_eval(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) {
-		rcode = RLM_MODULE_FAIL;
-
-		goto finish;
+		return RLM_MODULE_FAIL;
 	}
 
 	/*
@@ -1460,18 +1574,47 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 	item = cf_reference_item(NULL, section->cs, path);
 	if (!item) {
 		RWDEBUG("No such configuration item %s", path);
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
+		return RLM_MODULE_NOOP;
 	}
 	if (cf_item_is_section(item)){
 		RWDEBUG("Sections are not supported as references");
-		rcode = RLM_MODULE_NOOP;
-
-		goto finish;
+		return RLM_MODULE_NOOP;
 	}
 
-	pair = cf_item_to_pair(item);
+	*out = cf_item_to_pair(item);
+
+	return RLM_MODULE_OK;
+}
+
+/*
+ *	Generic function for failing between a bunch of queries.
+ *
+ *	Uses the same principle as rlm_linelog, expanding the 'reference' config
+ *	item using xlat to figure out what query it should execute.
+ *
+ *	If the reference matches multiple config items, and a query fails or
+ *	doesn't update any rows, the next matching config item is used.
+ *
+ */
+static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+
+	rlm_sql_handle_t	*handle = NULL;
+	int			sql_ret;
+	int			numaffected = 0;
+
+	CONF_PAIR 		*pair;
+	char const		*attr = NULL;
+	char const		*value;
+
+	char			*expanded = NULL;
+	char			**params = NULL;
+	ssize_t			num_params = 0;
+
+	rcode = acct_query_find(&pair, request, section);
+	if (rcode != RLM_MODULE_OK) goto finish;
+
 	attr = cf_pair_attr(pair);
 
 	RDEBUG2("Using query template '%s'", attr);
@@ -1494,7 +1637,18 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 			goto finish;
 		}
 
-		if (xlat_aeval(request, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
+		/*
+		 *	With prepared statements the logfile records
+		 *	the query with placeholders, not the values.
+		 */
+		if (inst->config->prepared_statements) {
+			num_params = sql_query_parameterise(request, &expanded, &params, inst, request, handle, value);
+			if (num_params < 0) {
+				rcode = RLM_MODULE_FAIL;
+
+				goto finish;
+			}
+		} else if (xlat_aeval(request, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
 			rcode = RLM_MODULE_FAIL;
 
 			goto finish;
@@ -1509,8 +1663,14 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 
 		rlm_sql_query_log(inst, request, section, expanded);
 
-		sql_ret = rlm_sql_query(inst, request, &handle, expanded);
+		if (params) {
+			sql_ret = rlm_sql_query_params(inst, request, &handle, expanded,
+						       (char const * const *) params, num_params);
+		} else {
+			sql_ret = rlm_sql_query(inst, request, &handle, expanded);
+		}
 		TALLOC_FREE(expanded);
+		TALLOC_FREE(params);
 		RDEBUG2("SQL query returned: %s", fr_table_str_by_value(sql_rcode_description_table, sql_ret, "<INVALID>"));
 
 		switch (sql_ret) {
@@ -1578,23 +1738,183 @@ static int acct_redundant(rlm_sql_t const *inst, REQUEST *request, sql_acct_sect
 
 finish:
 	talloc_free(expanded);
+	talloc_free(params);
 	fr_pool_connection_release(inst->pool, request, handle);
 	sql_unset_user(inst, request);
 
 	return rcode;
 }
 
+static rlm_rcode_t acct_redundant_start(rlm_sql_t const *inst, rlm_sql_thread_t *t,
+					REQUEST *request, sql_acct_rctx_t *rctx);
+
+/** Process the result of an asynchronous accounting or post-auth query
+ *
+ * Follows the same logic as acct_redundant, moving onto the next
+ * query in the set if the query failed or didn't update anything.
+ */
+static rlm_rcode_t mod_acct_resume(void *instance, void *thread, REQUEST *request, void *rctx)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(instance, rlm_sql_t);
+	rlm_sql_thread_t	*t = talloc_get_type_abort(thread, rlm_sql_thread_t);
+	sql_acct_rctx_t		*r = talloc_get_type_abort(rctx, sql_acct_rctx_t);
+	sql_trunk_query_t	*q = &r->query;
+	rlm_rcode_t		rcode;
+
+	if (q->ignored) {
+		rcode = RLM_MODULE_NOOP;
+		goto finish;
+	}
+
+	RDEBUG2("SQL query returned: %s", fr_table_str_by_value(sql_rcode_description_table, q->rcode, "<INVALID>"));
+
+	switch (q->rcode) {
+	/*
+	 *  Query was a success! Now we just need to check if it did anything.
+	 */
+	case RLM_SQL_OK:
+		break;
+
+	/*
+	 *  Query was invalid, this is a terminal error.
+	 */
+	case RLM_SQL_QUERY_INVALID:
+		rcode = RLM_MODULE_INVALID;
+		goto finish;
+
+	/*
+	 *  Driver found an error (like a unique key constraint violation)
+	 *  that hinted it might be a good idea to try an alternative query.
+	 */
+	case RLM_SQL_ALT_QUERY:
+		goto next;
+
+	/*
+	 *  A general, unrecoverable server fault, or we
+	 *  couldn't get a connection.
+	 */
+	default:
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	/*
+	 *  We need to have updated something for the query to have been
+	 *  counted as successful.
+	 */
+	RDEBUG2("%i record(s) updated", q->affected_rows);
+	if (q->affected_rows > 0) {
+		rcode = RLM_MODULE_OK;
+		goto finish;
+	}
+
+next:
+	/*
+	 *  We assume all entries with the same name form a redundant
+	 *  set of queries.
+	 */
+	r->pair = cf_pair_find_next(r->section->cs, r->pair, r->attr);
+	if (!r->pair) {
+		RDEBUG2("No additional queries configured");
+		rcode = RLM_MODULE_NOOP;
+		goto finish;
+	}
+
+	RDEBUG2("Trying next query...");
+
+	return acct_redundant_start(inst, t, request, r);
+
+finish:
+	talloc_free(r);
+	sql_unset_user(inst, request);
+
+	return rcode;
+}
+
+static void mod_acct_signal(void *instance, UNUSED void *thread, REQUEST *request,
+			    void *rctx, fr_state_signal_t action)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(instance, rlm_sql_t);
+	sql_acct_rctx_t		*r = talloc_get_type_abort(rctx, sql_acct_rctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	sql_trunk_query_cancel(&r->query);
+	talloc_free(r);
+	sql_unset_user(inst, request);
+}
+
+/** Queue the current query of an asynchronous accounting or post-auth section
+ *
+ */
+static rlm_rcode_t acct_redundant_start(rlm_sql_t const *inst, rlm_sql_thread_t *t,
+					REQUEST *request, sql_acct_rctx_t *rctx)
+{
+	rlm_rcode_t		rcode;
+
+	rctx->query.query = cf_pair_value(rctx->pair);
+	if (!rctx->query.query) {
+		RDEBUG2("Ignoring null query");
+		rcode = RLM_MODULE_NOOP;
+		goto finish;
+	}
+
+	if (sql_trunk_query_enqueue(&rctx->query, t->trunk, request) < 0) {
+		RERROR("Failed queueing query");
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	return unlang_module_yield(request, mod_acct_resume, mod_acct_signal, rctx);
+
+finish:
+	talloc_free(rctx);
+	sql_unset_user(inst, request);
+
+	return rcode;
+}
+
+/** Asynchronous version of acct_redundant, used when the driver supports it
+ *
+ */
+static rlm_rcode_t acct_redundant_async(rlm_sql_t const *inst, rlm_sql_thread_t *t,
+					REQUEST *request, sql_acct_section_t *section)
+{
+	sql_acct_rctx_t		*rctx;
+	CONF_PAIR		*pair;
+	rlm_rcode_t		rcode;
+
+	rcode = acct_query_find(&pair, request, section);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	MEM(rctx = talloc_zero(request, sql_acct_rctx_t));
+	rctx->section = section;
+	rctx->pair = pair;
+	rctx->attr = cf_pair_attr(pair);
+	rctx->query.inst = inst;
+	rctx->query.section = section;
+
+	RDEBUG2("Using query template '%s'", rctx->attr);
+
+	sql_set_user(inst, request, NULL);
+
+	return acct_redundant_start(inst, t, request, rctx);
+}
+
 #ifdef WITH_ACCOUNTING
 
 /*
  *	Accounting: Insert or update session data in our sql table
  */
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_accounting(void *instance, void *thread, REQUEST *request)
 {
-	rlm_sql_t const *inst = instance;
+	rlm_sql_t const		*inst = instance;
+	rlm_sql_thread_t	*t = talloc_get_type_abort(thread, rlm_sql_thread_t);
 
 	if (inst->config->accounting.reference_cp) {
+		if (t->trunk) return acct_redundant_async(inst, t, request, &inst->config->accounting);
+
 		return acct_redundant(inst, request, &inst->config->accounting);
 	}
 
@@ -1606,12 +1926,15 @@ static rlm_rcode_t mod_accounting(void *instance, UNUSED void *thread, REQUEST *
 /*
  *	Postauth: Write a record of the authentication attempt
  */
-static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t mod_post_auth(void *instance, void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_post_auth(void *instance, void *thread, REQUEST *request)
 {
-	rlm_sql_t const *inst = talloc_get_type_abort_const(instance, rlm_sql_t);
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(instance, rlm_sql_t);
+	rlm_sql_thread_t	*t = talloc_get_type_abort(thread, rlm_sql_thread_t);
 
 	if (inst->config->postauth.reference_cp) {
+		if (t->trunk) return acct_redundant_async(inst, t, request, &inst->config->postauth);
+
 		return acct_redundant(inst, request, &inst->config->postauth);
 	}
 
@@ -1627,12 +1950,14 @@ static rlm_rcode_t mod_post_auth(void *instance, UNUSED void *thread, REQUEST *r
 module_t rlm_sql = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "sql",
-	.type		= RLM_TYPE_THREAD_SAFE,
+	.type		= RLM_TYPE_THREAD_SAFE | RLM_TYPE_PARALLEL,
 	.inst_size	= sizeof(rlm_sql_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_sql_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 #ifdef WITH_ACCOUNTING
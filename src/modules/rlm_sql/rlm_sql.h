@@ -29,9 +29,16 @@ RCSIDH(rlm_sql_h, "$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/pool.h>
+#include <freeradius-devel/server/trunk.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/exfile.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 #define FR_ITEM_CHECK 0
 #define FR_ITEM_REPLY 1
 
@@ -46,8 +53,16 @@ typedef enum {
 	RLM_SQL_RECONNECT = 1,		//!< Stale connection, should reconnect.
 	RLM_SQL_ALT_QUERY,		//!< Key constraint violation, use an alternative query.
 	RLM_SQL_NO_MORE_ROWS,		//!< No more rows available
+	RLM_SQL_IN_PROGRESS,		//!< Query has been sent, and the driver is waiting
+					///< for the server to respond.
 } sql_rcode_t;
 
+/*
+ *	What an in progress asynchronous query is waiting for
+ */
+#define SQL_IO_WAIT_READ	0x01				//!< Driver needs the socket to become readable.
+#define SQL_IO_WAIT_WRITE	0x02				//!< Driver needs the socket to become writable.
+
 typedef enum {
 	FALL_THROUGH_NO = 0,
 	FALL_THROUGH_YES,
@@ -85,6 +100,8 @@ typedef struct {
 	char const		**query;			/* for xlat parsing */
 } sql_acct_section_t;
 
+typedef struct sql_replica_s sql_replica_t;
+
 typedef struct {
 	char const 		*sql_driver_name;		//!< SQL driver module name e.g. rlm_sql_sqlite.
 	char const 		*sql_server;			//!< Server to connect to.
@@ -125,6 +142,22 @@ typedef struct {
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
 
+	bool			prepared_statements;		//!< Pass expansions as bind parameters, and
+								///< cache the resulting statements per connection.
+	uint32_t		prepared_statement_cache_size;	//!< Maximum number of statements to keep
+								///< prepared on each connection.
+
+	uint32_t		batch_size;			//!< Maximum number of queries to send to the
+								///< database in a single round trip.
+	fr_time_delta_t		batch_delay;			//!< How long to wait for a batch to fill.
+
+	fr_trunk_conf_t		trunk_conf;			//!< Configuration for the per-thread connection
+								///< trunk used by drivers supporting asynchronous
+								///< queries.
+
+	sql_replica_t		**replicas;			//!< Read replicas.  Read only queries are sent
+								///< to these in preference to the primary.
+
 	void			*driver;			//!< Where drivers should write a
 								//!< pointer to their configurations.
 
@@ -148,6 +181,11 @@ typedef struct {
 	rlm_sql_t const		*inst;				//!< The rlm_sql instance this connection belongs to.
 	TALLOC_CTX		*log_ctx;			//!< Talloc pool used to avoid allocing memory
 								//!< when log strings need to be copied.
+	int			io_wait;			//!< What an in progress asynchronous query is
+								///< waiting for, one or more SQL_IO_WAIT_* flags.
+	sql_replica_t		*replica;			//!< Replica this connection is to.  NULL if the
+								///< connection is to the primary.
+	fr_time_t		acquired;			//!< When the connection was reserved from the pool.
 } rlm_sql_handle_t;
 
 extern fr_table_num_sorted_t const sql_rcode_description_table[];
@@ -160,6 +198,7 @@ extern size_t sql_rcode_table_len;
  */
 #define RLM_SQL_RCODE_FLAGS_ALT_QUERY	1			//!< Can distinguish between other errors and those
 								//!< resulting from a unique key violation.
+#define RLM_SQL_FLAGS_NUMBERED_PARAMS	2			//!< Placeholders are written as $1, $2 ... instead of ?.
 
 /** Retrieve errors from the last query operation
  *
@@ -211,6 +250,35 @@ typedef struct {
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 
 	xlat_escape_t	sql_escape_func;
+
+	/*
+	 *	Optional asynchronous interface.  Drivers providing
+	 *	sql_query_start run accounting and post-auth queries
+	 *	on a per-thread connection trunk instead of the pool.
+	 */
+	int (*sql_fd)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+	sql_rcode_t (*sql_query_start)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, char const *query);
+	sql_rcode_t (*sql_query_resume)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+
+	/*
+	 *	Optional prepared statement interface.  The query contains
+	 *	placeholders, and the driver keeps the prepared statement
+	 *	for the lifetime of the connection.
+	 */
+	sql_rcode_t (*sql_query_params)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					char const *query, char const * const params[], size_t num_params);
+	sql_rcode_t (*sql_query_params_start)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					      char const *query, char const * const params[], size_t num_params);
+
+	/*
+	 *	Optional batching interface.  Multiple queries, separated
+	 *	by semicolons, are sent in one round trip and are either all
+	 *	committed or all rolled back.  Completion is signalled via
+	 *	sql_query_resume.
+	 */
+	sql_rcode_t (*sql_batch_start)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+				       char const *query, size_t num_queries);
+	int (*sql_batch_affected_rows)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, size_t idx);
 } rlm_sql_driver_t;
 
 struct sql_inst {
@@ -236,6 +304,49 @@ struct sql_inst {
 	fr_dict_attr_t const	*group_da;		//!< Group dictionary attribute.
 };
 
+/** An accounting or post-auth query being run on the trunk
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;			//!< Instance the query belongs to.
+	char const		*query;			//!< Unexpanded query.  Expanded by the muxer
+							///< so the driver's escape function has a handle.
+	sql_acct_section_t	*section;		//!< Section the query came from, for logging.
+
+	sql_rcode_t		rcode;			//!< Result of the query.
+	int			affected_rows;		//!< How many rows the query updated.
+	bool			ignored;		//!< Query expanded to nothing, and was not run.
+
+	fr_trunk_request_t	*treq;			//!< Trunk request, NULL once the query has
+							///< completed or failed.
+} sql_trunk_query_t;
+
+/** A read replica of the primary database
+ *
+ */
+struct sql_replica_s {
+	char const		*sql_server;			//!< Server to connect to.
+	uint32_t		sql_port;			//!< Port to connect to.
+	char const		*sql_login;			//!< Login credentials to use.
+	char const		*sql_password;			//!< Login password to use.
+	char const		*sql_db;			//!< Database to run queries against.
+
+	char const		*lag_query;			//!< Query returning replication lag in seconds.
+	uint32_t		max_lag;			//!< Maximum lag before the replica is taken
+								///< out of rotation.
+	fr_time_delta_t		check_interval;			//!< How often to check replication lag.
+
+	char const		*name;				//!< Of the replica section.
+	rlm_sql_t const		*inst;				//!< Module instance the replica belongs to.
+	rlm_sql_config_t	config;				//!< Copy of the module's config with the
+								///< connection details of the replica.
+	fr_pool_t		*pool;				//!< Connections to the replica.
+
+	atomic_int_fast64_t	latency;			//!< Moving average of query latency in nanoseconds.
+	atomic_int_fast64_t	next_check;			//!< When the replica should next be checked.
+	atomic_bool		healthy;			//!< Whether the replica is in rotation.
+};
+
 typedef struct rlm_sql_grouplist_s rlm_sql_grouplist_t;
 struct rlm_sql_grouplist_s {
 	char			*name;
@@ -243,6 +354,8 @@ struct rlm_sql_grouplist_s {
 };
 
 void		*sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
+rlm_sql_handle_t *sql_conn_create(TALLOC_CTX *ctx, rlm_sql_t const *inst, sql_replica_t *replica,
+				  fr_time_delta_t timeout);
 int		sql_fr_pair_list_afrom_str(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **first_pair, rlm_sql_row_t row);
 int		sql_read_realms(rlm_sql_handle_t *handle);
 int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, VALUE_PAIR **pair, char const *query);
@@ -250,10 +363,45 @@ int		sql_dict_init(rlm_sql_handle_t *handle);
 void 		rlm_sql_query_log(rlm_sql_t const *inst, REQUEST *request, sql_acct_section_t *section, char const *query) CC_HINT(nonnull (1, 2, 4));
 sql_rcode_t	rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
 sql_rcode_t	rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
+sql_rcode_t	rlm_sql_query_params(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				     char const *query, char const * const params[], size_t num_params) CC_HINT(nonnull (1, 3, 4));
 int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle);
 void		rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, bool force_debug);
 int		sql_set_user(rlm_sql_t const *inst, REQUEST *request, char const *username);
 
+/*
+ *	sql_replica.c
+ */
+int		sql_replicas_init(rlm_sql_t *inst, CONF_SECTION *conf);
+void		sql_replicas_free(rlm_sql_t *inst);
+fr_pool_t	*sql_handle_pool(rlm_sql_t const *inst, rlm_sql_handle_t *handle);
+rlm_sql_handle_t *sql_read_handle_get(rlm_sql_t const *inst, REQUEST *request);
+void		sql_handle_release(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle);
+
+/*
+ *	sql_trunk.c
+ */
+fr_trunk_t	*sql_trunk_alloc(TALLOC_CTX *ctx, rlm_sql_t *inst, fr_event_list_t *el);
+int		sql_trunk_query_enqueue(sql_trunk_query_t *q, fr_trunk_t *trunk, REQUEST *request);
+void		sql_trunk_query_cancel(sql_trunk_query_t *q);
+
+/*
+ *	sql_prepare.c
+ */
+typedef struct sql_stmt_cache_s sql_stmt_cache_t;
+
+/** Release a driver's prepared statement handle
+ *
+ */
+typedef void (*sql_stmt_free_t)(void *stmt, void *uctx);
+
+sql_stmt_cache_t *sql_stmt_cache_alloc(TALLOC_CTX *ctx, uint32_t max, sql_stmt_free_t free_func, void *uctx);
+void		*sql_stmt_cache_find(sql_stmt_cache_t *cache, char const *query);
+int		sql_stmt_cache_add(sql_stmt_cache_t *cache, char const *query, void *stmt);
+uint32_t	sql_stmt_cache_next_id(sql_stmt_cache_t *cache);
+ssize_t		sql_query_parameterise(TALLOC_CTX *ctx, char **query_out, char ***params_out,
+				       rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, char const *fmt);
+
 /*
  *	sql_state.c
  */
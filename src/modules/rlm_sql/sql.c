@@ -44,6 +44,7 @@ RCSID("$Id$")
  *	readable reason strings.
  */
 fr_table_num_sorted_t const sql_rcode_description_table[] = {
+	{ "in progress",	RLM_SQL_IN_PROGRESS	},
 	{ "need alt query",	RLM_SQL_ALT_QUERY	},
 	{ "no connection",	RLM_SQL_RECONNECT	},
 	{ "no more rows",	RLM_SQL_NO_MORE_ROWS	},
@@ -63,11 +64,22 @@ fr_table_num_sorted_t const sql_rcode_table[] = {
 };
 size_t sql_rcode_table_len = NUM_ELEMENTS(sql_rcode_table);
 
-void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout)
+/** Open a connection to the primary, or to a replica
+ *
+ * @param[in] ctx	to allocate the handle in.
+ * @param[in] inst	of rlm_sql.
+ * @param[in] replica	to connect to.  NULL for the primary.
+ * @param[in] timeout	for establishing the connection.
+ * @return
+ *	- A new handle.
+ *	- NULL on error.
+ */
+rlm_sql_handle_t *sql_conn_create(TALLOC_CTX *ctx, rlm_sql_t const *inst, sql_replica_t *replica,
+				  fr_time_delta_t timeout)
 {
 	int rcode;
-	rlm_sql_t *inst = instance;
 	rlm_sql_handle_t *handle;
+	rlm_sql_config_t *config = replica ? &replica->config : inst->config;
 
 	/*
 	 *	Connections cannot be alloced from the inst or
@@ -87,8 +99,9 @@ void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeo
 	 *	destructor has access to the module configuration.
 	 */
 	handle->inst = inst;
+	handle->replica = replica;
 
-	rcode = (inst->driver->sql_socket_init)(handle, inst->config, timeout);
+	rcode = (inst->driver->sql_socket_init)(handle, config, timeout);
 	if (rcode != 0) {
 	fail:
 		/*
@@ -106,6 +119,11 @@ void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeo
 	return handle;
 }
 
+void *sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout)
+{
+	return sql_conn_create(ctx, instance, NULL, timeout);
+}
+
 /*************************************************************************
  *
  *	Function: sql_fr_pair_list_afrom_str
@@ -317,26 +335,15 @@ void rlm_sql_print_error(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle
 	talloc_free_children(handle->log_ctx);
 }
 
-/** Call the driver's sql_query method, reconnecting if necessary.
- *
- * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
- *	after they're done with the result.
+/** Call the driver's sql_query or sql_query_params method, reconnecting if necessary
  *
- * @param handle to query the database with. *handle should not be NULL, as this indicates
- * 	previous reconnection attempt has failed.
- * @param request Current request.
- * @param inst #rlm_sql_t instance data.
- * @param query to execute. Should not be zero length.
- * @return
- *	- #RLM_SQL_OK on success.
- *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
- *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
- *	- #RLM_SQL_ALT_QUERY on constraints violation.
  */
-sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query)
+static sql_rcode_t sql_query_run(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				 char const *query, char const * const params[], size_t num_params, bool prepared)
 {
 	int ret = RLM_SQL_ERROR;
 	int i, count;
+	fr_pool_t *pool;
 
 	/* Caller should check they have a valid handle */
 	fr_assert(*handle);
@@ -348,9 +355,10 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 	}
 
 	/*
-	 *  inst->pool may be NULL is this function is called by sql_mod_conn_create.
+	 *  The pool may be NULL is this function is called by sql_conn_create.
 	 */
-	count = inst->pool ? fr_pool_state(inst->pool)->num : 0;
+	pool = sql_handle_pool(inst, *handle);
+	count = pool ? fr_pool_state(pool)->num : 0;
 
 	/*
 	 *  Here we try with each of the existing connections, then try to create
@@ -359,7 +367,17 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 	for (i = 0; i < (count + 1); i++) {
 		ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query);
 
-		ret = (inst->driver->sql_query)(*handle, inst->config, query);
+		if (prepared) {
+			size_t j;
+
+			for (j = 0; j < num_params; j++) {
+				ROPTIONAL(RDEBUG3, DEBUG3, "Parameter %zu: \"%pV\"", j + 1,
+					  fr_box_strvalue(params[j]));
+			}
+			ret = (inst->driver->sql_query_params)(*handle, inst->config, query, params, num_params);
+		} else {
+			ret = (inst->driver->sql_query)(*handle, inst->config, query);
+		}
 		switch (ret) {
 		case RLM_SQL_OK:
 			break;
@@ -369,7 +387,7 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 		 *	sockets in the pool and fail to establish a *new* connection.
 		 */
 		case RLM_SQL_RECONNECT:
-			*handle = fr_pool_connection_reconnect(inst->pool, request, *handle);
+			*handle = fr_pool_connection_reconnect(pool, request, *handle);
 			/* Reconnection failed */
 			if (!*handle) return RLM_SQL_RECONNECT;
 			/* Reconnection succeeded, try again with the new handle */
@@ -419,6 +437,52 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handl
 	return RLM_SQL_ERROR;
 }
 
+/** Call the driver's sql_query method, reconnecting if necessary.
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ * 	previous reconnection attempt has failed.
+ * @param request Current request.
+ * @param inst #rlm_sql_t instance data.
+ * @param query to execute. Should not be zero length.
+ * @return
+ *	- #RLM_SQL_OK on success.
+ *	- #RLM_SQL_RECONNECT if a new handle is required (also sets *handle = NULL).
+ *	- #RLM_SQL_QUERY_INVALID, #RLM_SQL_ERROR on invalid query or connection error.
+ *	- #RLM_SQL_ALT_QUERY on constraints violation.
+ */
+sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle, char const *query)
+{
+	return sql_query_run(inst, request, handle, query, NULL, 0, false);
+}
+
+/** Call the driver's sql_query_params method, reconnecting if necessary.
+ *
+ * The driver prepares the query (or reuses a statement it prepared
+ * previously on this connection), and binds the parameters to it.
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ * 	previous reconnection attempt has failed.
+ * @param request Current request.
+ * @param inst #rlm_sql_t instance data.
+ * @param query with placeholders, as produced by #sql_query_parameterise.
+ * @param params values to bind to the placeholders.
+ * @param num_params how many parameters there are.
+ * @return The same values as #rlm_sql_query.
+ */
+sql_rcode_t rlm_sql_query_params(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t **handle,
+				 char const *query, char const * const params[], size_t num_params)
+{
+	fr_assert(inst->driver->sql_query_params);
+
+	return sql_query_run(inst, request, handle, query, params, num_params, true);
+}
+
 /** Call the driver's sql_select_query method, reconnecting if necessary.
  *
  * @note Caller must call ``(inst->driver->sql_finish_select_query)(handle, inst->config);``
@@ -438,6 +502,7 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 {
 	int ret = RLM_SQL_ERROR;
 	int i, count;
+	fr_pool_t *pool;
 
 	/* Caller should check they have a valid handle */
 	fr_assert(*handle);
@@ -450,9 +515,10 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 	}
 
 	/*
-	 *  inst->pool may be NULL is this function is called by sql_mod_conn_create.
+	 *  The pool may be NULL is this function is called by sql_conn_create.
 	 */
-	count = inst->pool ? fr_pool_state(inst->pool)->num : 0;
+	pool = sql_handle_pool(inst, *handle);
+	count = pool ? fr_pool_state(pool)->num : 0;
 
 	/*
 	 *  For sanity, for when no connections are viable, and we can't make a new one
@@ -470,7 +536,7 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, REQUEST *request, rlm_sq
 		 *	sockets in the pool and fail to establish a *new* connection.
 		 */
 		case RLM_SQL_RECONNECT:
-			*handle = fr_pool_connection_reconnect(inst->pool, request, *handle);
+			*handle = fr_pool_connection_reconnect(pool, request, *handle);
 			/* Reconnection failed */
 			if (!*handle) return RLM_SQL_RECONNECT;
 			/* Reconnection succeeded, try again with the new handle */
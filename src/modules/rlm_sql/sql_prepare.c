@@ -0,0 +1,413 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file sql_prepare.c
+ * @brief Parameterised queries, and a per-connection prepared statement cache.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_sql (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+
+#include <ctype.h>
+
+#include "rlm_sql.h"
+
+/** A prepared statement
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+	uint32_t		hash;		//!< Of the query text.
+	char const		*query;		//!< Query text the statement was prepared from.
+	void			*stmt;		//!< Driver specific statement handle.
+} sql_stmt_entry_t;
+
+struct sql_stmt_cache_s {
+	fr_hash_table_t		*ht;		//!< Statements indexed by query text.
+	fr_dlist_head_t		lru;		//!< Most recently used at the head.
+	uint32_t		max;		//!< Maximum number of statements to keep.
+	uint32_t		next_id;	//!< For drivers which need to name statements.
+	sql_stmt_free_t		free;		//!< Releases a driver statement handle.
+	void			*uctx;		//!< Passed to free.
+};
+
+static uint32_t sql_stmt_entry_hash(void const *data)
+{
+	sql_stmt_entry_t const *a = data;
+
+	return a->hash;
+}
+
+static int sql_stmt_entry_cmp(void const *one, void const *two)
+{
+	sql_stmt_entry_t const *a = one, *b = two;
+
+	if (a->hash != b->hash) return (a->hash < b->hash) - (a->hash > b->hash);
+
+	return strcmp(a->query, b->query);
+}
+
+/** Call the driver's free function for every statement in the cache
+ *
+ */
+static int _sql_stmt_cache_free(sql_stmt_cache_t *cache)
+{
+	sql_stmt_entry_t *entry = NULL;
+
+	while ((entry = fr_dlist_next(&cache->lru, entry))) cache->free(entry->stmt, cache->uctx);
+
+	return 0;
+}
+
+/** Allocate a cache of prepared statements for a connection
+ *
+ * @param[in] ctx	to allocate the cache in.  Usually the driver's connection struct.
+ * @param[in] max	Maximum number of statements to keep prepared.  The least
+ *			recently used statement is released when this is exceeded.
+ * @param[in] free_func	to release driver statement handles.
+ * @param[in] uctx	to pass to free_func.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+sql_stmt_cache_t *sql_stmt_cache_alloc(TALLOC_CTX *ctx, uint32_t max, sql_stmt_free_t free_func, void *uctx)
+{
+	sql_stmt_cache_t *cache;
+
+	fr_assert(max > 0);
+
+	cache = talloc_zero(ctx, sql_stmt_cache_t);
+	if (!cache) return NULL;
+
+	cache->ht = fr_hash_table_create(cache, sql_stmt_entry_hash, sql_stmt_entry_cmp, NULL);
+	if (!cache->ht) {
+		talloc_free(cache);
+		return NULL;
+	}
+	fr_dlist_talloc_init(&cache->lru, sql_stmt_entry_t, entry);
+	cache->max = max;
+	cache->free = free_func;
+	cache->uctx = uctx;
+	talloc_set_destructor(cache, _sql_stmt_cache_free);
+
+	return cache;
+}
+
+/** Find the statement prepared from a query
+ *
+ * @param[in] cache	to search.
+ * @param[in] query	text with placeholders.
+ * @return
+ *	- The driver's statement handle.
+ *	- NULL if the query has not been prepared on this connection.
+ */
+void *sql_stmt_cache_find(sql_stmt_cache_t *cache, char const *query)
+{
+	sql_stmt_entry_t	find, *found;
+
+	find.hash = fr_hash_string(query);
+	find.query = query;
+
+	found = fr_hash_table_finddata(cache->ht, &find);
+	if (!found) return NULL;
+
+	fr_dlist_remove(&cache->lru, found);
+	fr_dlist_insert_head(&cache->lru, found);
+
+	return found->stmt;
+}
+
+/** Add a newly prepared statement to the cache
+ *
+ * If the cache is full the least recently used statement is released.
+ *
+ * @param[in] cache	to add the statement to.
+ * @param[in] query	the statement was prepared from.
+ * @param[in] stmt	Driver's statement handle.  Released with the cache's
+ *			free function.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The caller is still responsible for stmt.
+ */
+int sql_stmt_cache_add(sql_stmt_cache_t *cache, char const *query, void *stmt)
+{
+	sql_stmt_entry_t	*entry;
+
+	entry = talloc_zero(cache, sql_stmt_entry_t);
+	if (!entry) return -1;
+
+	entry->hash = fr_hash_string(query);
+	entry->query = talloc_strdup(entry, query);
+	entry->stmt = stmt;
+
+	if (!entry->query || !fr_hash_table_insert(cache->ht, entry)) {
+		talloc_free(entry);
+		return -1;
+	}
+	fr_dlist_insert_head(&cache->lru, entry);
+
+	if (fr_hash_table_num_elements(cache->ht) > cache->max) {
+		sql_stmt_entry_t *lru = fr_dlist_tail(&cache->lru);
+
+		fr_hash_table_delete(cache->ht, lru);
+		fr_dlist_remove(&cache->lru, lru);
+		cache->free(lru->stmt, cache->uctx);
+		talloc_free(lru);
+	}
+
+	return 0;
+}
+
+/** Return a number for naming a new statement, unique within the cache
+ *
+ */
+uint32_t sql_stmt_cache_next_id(sql_stmt_cache_t *cache)
+{
+	return cache->next_id++;
+}
+
+/** Find the length of an expansion
+ *
+ * @param[in] p	pointing to the '%' of the expansion.
+ * @return
+ *	- The length of the expansion.
+ *	- -1 if the expansion is unterminated.
+ */
+static ssize_t sql_expansion_len(char const *p)
+{
+	char const	*q;
+	int		depth = 1;
+
+	if (p[1] != '{') return p[1] ? 2 : -1;
+
+	for (q = p + 2; *q; q++) {
+		if (*q == '\\') {
+			if (!q[1]) return -1;
+			q++;
+			continue;
+		}
+
+		if (q[0] == '%') {
+			if (q[1] == '{') depth++;
+			if (q[1]) q++;
+			continue;
+		}
+
+		if ((*q == '}') && (--depth == 0)) return (q + 1) - p;
+	}
+
+	return -1;
+}
+
+/** Expand one expansion, without escaping
+ *
+ */
+static char *sql_expansion_eval(TALLOC_CTX *ctx, REQUEST *request, char const *p, size_t len)
+{
+	char	*fmt, *out = NULL;
+
+	MEM(fmt = talloc_bstrndup(ctx, p, len));
+	if (xlat_aeval(ctx, &out, request, fmt, NULL, NULL) < 0) {
+		talloc_free(fmt);
+		return NULL;
+	}
+	talloc_free(fmt);
+
+	return out;
+}
+
+/** Whether a value can be bound in place of an unquoted expansion
+ *
+ */
+static bool sql_value_is_number(char const *p)
+{
+	if (*p == '-') p++;
+	if (!isdigit((uint8_t) *p)) return false;
+	while (isdigit((uint8_t) *p)) p++;
+
+	if (*p == '.') {
+		p++;
+		if (!isdigit((uint8_t) *p)) return false;
+		while (isdigit((uint8_t) *p)) p++;
+	}
+
+	return (*p == '\0');
+}
+
+/** Expand a query, turning expansions into bind parameters where possible
+ *
+ * - A string literal containing only an expansion, e.g. `'%{User-Name}'`,
+ *   becomes a parameter.
+ * - An expansion outside of a string literal becomes a parameter if it
+ *   expands to a number, e.g. `%{Acct-Session-Time}`.
+ * - Any other expansion is escaped and written into the query, as
+ *   it would be for a normal query.
+ *
+ * This means the query text only varies when the query would change
+ * meaning, and so can be prepared once per connection.
+ *
+ * @param[in] ctx		to allocate the query and parameters in.
+ * @param[out] query_out	Query text with placeholders.
+ * @param[out] params_out	Array of parameter values.
+ * @param[in] inst		of rlm_sql.
+ * @param[in] request		to expand the query for.
+ * @param[in] handle		passed to the escape function.
+ * @param[in] fmt		Unexpanded query.
+ * @return
+ *	- >= 0 the number of parameters.
+ *	- -1 on error.
+ */
+ssize_t sql_query_parameterise(TALLOC_CTX *ctx, char **query_out, char ***params_out,
+			       rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle, char const *fmt)
+{
+	char const	*p = fmt;
+	char		*query, *value;
+	char		**params;
+	size_t		num = 0, max = 0;
+	ssize_t		slen;
+	bool		in_quote = false;
+	bool		numbered = (inst->driver->flags & RLM_SQL_FLAGS_NUMBERED_PARAMS);
+
+	/*
+	 *	Every parameter starts with a '%',
+	 *	so this is the most we can have.
+	 */
+	for (p = fmt; *p; p++) if (*p == '%') max++;
+
+	MEM(query = talloc_strdup(ctx, ""));
+	MEM(params = talloc_array(ctx, char *, max));
+
+#define PARAM_ADD(_value) \
+do { \
+	params[num++] = _value; \
+	if (numbered) { \
+		MEM(query = talloc_asprintf_append_buffer(query, "$%zu", num)); \
+	} else { \
+		MEM(query = talloc_strdup_append_buffer(query, "?")); \
+	} \
+} while (0)
+
+	p = fmt;
+	while (*p) {
+		switch (*p) {
+		case '\\':
+			MEM(query = talloc_strndup_append_buffer(query, p, p[1] ? 2 : 1));
+			p += p[1] ? 2 : 1;
+			continue;
+
+		case '\'':
+			if (in_quote) {
+				/*
+				 *	Doubled quotes are an escaped quote
+				 */
+				if (p[1] == '\'') {
+					MEM(query = talloc_strndup_append_buffer(query, p, 2));
+					p += 2;
+					continue;
+				}
+				in_quote = false;
+				break;
+			}
+
+			/*
+			 *	String literal which contains only
+			 *	an expansion.  Replace the whole
+			 *	literal with a parameter.
+			 */
+			if ((p[1] == '%') && p[2] && (p[2] != '%') && (p[2] != '}')) {
+				slen = sql_expansion_len(p + 1);
+				if (slen < 0) goto unterminated;
+
+				if ((p[slen + 1] == '\'') && (p[slen + 2] != '\'')) {
+					value = sql_expansion_eval(params, request, p + 1, slen);
+					if (!value) goto error;
+
+					PARAM_ADD(value);
+					p += slen + 2;
+					continue;
+				}
+			}
+			in_quote = true;
+			break;
+
+		case '%':
+			if ((p[1] == '%') || (p[1] == '}')) {
+				MEM(query = talloc_strndup_append_buffer(query, p + 1, 1));
+				p += 2;
+				continue;
+			}
+
+			slen = sql_expansion_len(p);
+			if (slen < 0) {
+			unterminated:
+				REDEBUG("Unterminated expansion in query");
+				goto error;
+			}
+
+			value = sql_expansion_eval(params, request, p, slen);
+			if (!value) goto error;
+			p += slen;
+
+			if (!in_quote && sql_value_is_number(value)) {
+				PARAM_ADD(value);
+				continue;
+			}
+
+			/*
+			 *	Anything else is escaped, and
+			 *	becomes part of the query.
+			 */
+			{
+				size_t	len = talloc_array_length(value) - 1;
+				char	*escaped;
+
+				MEM(escaped = talloc_array(query, char, (len * 3) + 1));
+				inst->sql_escape_func(request, escaped, talloc_array_length(escaped), value, handle);
+				MEM(query = talloc_strdup_append_buffer(query, escaped));
+				talloc_free(escaped);
+				talloc_free(value);
+			}
+			continue;
+
+		default:
+			break;
+		}
+
+		MEM(query = talloc_strndup_append_buffer(query, p, 1));
+		p++;
+	}
+
+	*query_out = query;
+	*params_out = params;
+
+	return num;
+
+error:
+	talloc_free(query);
+	talloc_free(params);
+
+	return -1;
+}
@@ -0,0 +1,310 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file sql_replica.c
+ * @brief Route read only queries to read replicas.
+ *
+ * Each replica has its own connection pool.  Read only queries are sent
+ * to the healthy replica with the lowest average query latency, and to
+ * the primary if no replica is available.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_sql (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module.h>
+#include <freeradius-devel/util/debug.h>
+
+#include "rlm_sql.h"
+
+/*
+ *	Weight given to each new latency sample, as a power of 2.
+ */
+#define SQL_REPLICA_LATENCY_SHIFT	3
+
+static void *_sql_replica_conn_create(TALLOC_CTX *ctx, void *opaque, fr_time_delta_t timeout)
+{
+	sql_replica_t *replica = talloc_get_type_abort(opaque, sql_replica_t);
+
+	return sql_conn_create(ctx, replica->inst, replica, timeout);
+}
+
+/** Create connection pools for any replicas in the module's configuration
+ *
+ * @param[in] inst	of rlm_sql.
+ * @param[in] conf	Module's configuration section.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sql_replicas_init(rlm_sql_t *inst, CONF_SECTION *conf)
+{
+	CONF_SECTION	*cs = NULL;
+	size_t		i, num;
+	char		log_prefix[128];
+
+	num = talloc_array_length(inst->config->replicas);
+	for (i = 0; i < num; i++) {
+		sql_replica_t *replica = inst->config->replicas[i];
+
+		cs = cf_section_find_next(conf, cs, "replica", CF_IDENT_ANY);
+		if (!fr_cond_assert(cs)) return -1;
+
+		replica->name = cf_section_name2(cs);
+		if (!replica->name) replica->name = replica->sql_server;
+		replica->inst = inst;
+
+		/*
+		 *	Everything other than the connection
+		 *	details is shared with the primary.
+		 */
+		replica->config = *inst->config;
+		replica->config.sql_server = replica->sql_server;
+		if (replica->sql_port) replica->config.sql_port = replica->sql_port;
+		if (replica->sql_login) replica->config.sql_login = replica->sql_login;
+		if (replica->sql_password) replica->config.sql_password = replica->sql_password;
+		if (replica->sql_db) replica->config.sql_db = replica->sql_db;
+
+		FR_TIME_DELTA_BOUND_CHECK("check_interval", replica->check_interval, >=, fr_time_delta_from_sec(1));
+
+		atomic_init(&replica->latency, 0);
+		atomic_init(&replica->next_check, 0);
+		atomic_init(&replica->healthy, true);
+
+		INFO("Attempting to connect to replica \"%s\"", replica->name);
+
+		snprintf(log_prefix, sizeof(log_prefix), "rlm_sql (%s) - replica %s", inst->name, replica->name);
+		replica->pool = module_connection_pool_init(cs, replica, _sql_replica_conn_create, NULL,
+							   log_prefix, "modules.sql.replica.pool", NULL);
+		if (!replica->pool) return -1;
+	}
+
+	return 0;
+}
+
+/** Free the connection pools of all replicas
+ *
+ */
+void sql_replicas_free(rlm_sql_t *inst)
+{
+	size_t i, num;
+
+	num = talloc_array_length(inst->config->replicas);
+	for (i = 0; i < num; i++) {
+		sql_replica_t *replica = inst->config->replicas[i];
+
+		if (!replica->pool) continue;
+
+		fr_pool_free(replica->pool);
+		replica->pool = NULL;
+	}
+}
+
+/** Return the pool a handle was reserved from
+ *
+ */
+fr_pool_t *sql_handle_pool(rlm_sql_t const *inst, rlm_sql_handle_t *handle)
+{
+	if (handle->replica) return handle->replica->pool;
+
+	return inst->pool;
+}
+
+/** Run the replica's lag_query, and check the result against max_lag
+ *
+ * @return
+ *	- true if the replica is in sync with the primary.
+ *	- false if it's lagging, or the query failed.
+ */
+static bool sql_replica_lag_ok(sql_replica_t *replica, REQUEST *request)
+{
+	rlm_sql_t const		*inst = replica->inst;
+	rlm_sql_handle_t	*handle;
+	rlm_sql_row_t		row;
+	double			lag = 0;
+	bool			ok = false;
+
+	handle = fr_pool_connection_get(replica->pool, request);
+	if (!handle) return false;
+
+	if (rlm_sql_select_query(inst, request, &handle, replica->lag_query) != RLM_SQL_OK) goto finish;
+
+	switch (rlm_sql_fetch_row(&row, inst, request, &handle)) {
+	case RLM_SQL_OK:
+		/*
+		 *	NULL means the server doesn't know
+		 *	its lag, which usually means it's
+		 *	not replicating from anything.
+		 */
+		if (row[0]) {
+			char *end;
+
+			lag = strtod(row[0], &end);
+			if ((end == row[0]) || (*end != '\0')) {
+				ROPTIONAL(RWARN, WARN, "Replica \"%s\" lag_query returned invalid value \"%s\"",
+					  replica->name, row[0]);
+				break;
+			}
+		}
+
+		ok = (lag <= replica->max_lag);
+		if (!ok) {
+			ROPTIONAL(RWARN, WARN, "Replica \"%s\" is %.1f seconds behind the primary, "
+				  "taking it out of rotation", replica->name, lag);
+		}
+		break;
+
+	default:
+		ROPTIONAL(RWARN, WARN, "Replica \"%s\" lag_query returned no rows", replica->name);
+		break;
+	}
+
+	if (handle) (inst->driver->sql_finish_select_query)(handle, inst->config);
+
+finish:
+	fr_pool_connection_release(replica->pool, request, handle);
+
+	return ok;
+}
+
+/** Check whether a replica should be in rotation
+ *
+ * Checks are run at most once per check_interval, by whichever
+ * thread notices the check is due first.
+ */
+static void sql_replica_check(sql_replica_t *replica, REQUEST *request, fr_time_t now)
+{
+	rlm_sql_t const	*inst = replica->inst;
+	int_fast64_t	next = atomic_load(&replica->next_check);
+	bool		healthy;
+
+	if (now < next) return;
+
+	if (!atomic_compare_exchange_strong(&replica->next_check, &next, now + replica->check_interval)) return;
+
+	/*
+	 *	Without a lag_query, replicas only leave rotation
+	 *	when we can't get a connection to them.  Give
+	 *	them another chance.
+	 */
+	if (!replica->lag_query) {
+		atomic_store(&replica->healthy, true);
+		return;
+	}
+
+	healthy = sql_replica_lag_ok(replica, request);
+	if (healthy && !atomic_load(&replica->healthy)) {
+		ROPTIONAL(RINFO, INFO, "Replica \"%s\" is back in rotation", replica->name);
+	}
+	atomic_store(&replica->healthy, healthy);
+}
+
+/** Reserve a connection for a read only query
+ *
+ * Picks the healthy replica with the lowest average latency, falling
+ * back to the primary if there are no replicas, or none of them are
+ * usable.
+ *
+ * @param[in] inst	of rlm_sql.
+ * @param[in] request	the query is being run for.
+ * @return
+ *	- A connection handle.  Must be released with #sql_handle_release.
+ *	- NULL if no connections are available.
+ */
+rlm_sql_handle_t *sql_read_handle_get(rlm_sql_t const *inst, REQUEST *request)
+{
+	rlm_sql_handle_t	*handle;
+	sql_replica_t		*best = NULL;
+	int_fast64_t		best_latency = 0;
+	size_t			i, num;
+	fr_time_t		now;
+
+	num = talloc_array_length(inst->config->replicas);
+	if (!num) goto primary;
+
+	now = fr_time();
+	for (i = 0; i < num; i++) {
+		sql_replica_t	*replica = inst->config->replicas[i];
+		int_fast64_t	latency;
+
+		sql_replica_check(replica, request, now);
+		if (!atomic_load(&replica->healthy)) continue;
+
+		latency = atomic_load_explicit(&replica->latency, memory_order_relaxed);
+		if (!best || (latency < best_latency)) {
+			best = replica;
+			best_latency = latency;
+		}
+	}
+
+	if (best) {
+		handle = fr_pool_connection_get(best->pool, request);
+		if (handle) {
+			RDEBUG3("Using replica \"%s\"", best->name);
+			handle->acquired = fr_time();
+			return handle;
+		}
+
+		RWARN("No connections available to replica \"%s\", taking it out of rotation", best->name);
+		atomic_store(&best->healthy, false);
+		atomic_store(&best->next_check, now + best->check_interval);
+	}
+
+primary:
+	handle = fr_pool_connection_get(inst->pool, request);
+	if (handle) handle->acquired = fr_time();
+
+	return handle;
+}
+
+/** Release a connection reserved with #sql_read_handle_get
+ *
+ * Updates the average latency of the replica the connection is to.
+ *
+ * @param[in] inst	of rlm_sql.
+ * @param[in] request	the query was run for.
+ * @param[in] handle	to release.  May be NULL.
+ */
+void sql_handle_release(rlm_sql_t const *inst, REQUEST *request, rlm_sql_handle_t *handle)
+{
+	sql_replica_t	*replica;
+	int_fast64_t	sample, latency;
+
+	if (!handle) return;
+
+	replica = handle->replica;
+	if (!replica) {
+		fr_pool_connection_release(inst->pool, request, handle);
+		return;
+	}
+
+	sample = fr_time() - handle->acquired;
+	latency = atomic_load_explicit(&replica->latency, memory_order_relaxed);
+	if (!latency) {
+		latency = sample;
+	} else {
+		latency += (sample - latency) >> SQL_REPLICA_LATENCY_SHIFT;
+	}
+	atomic_store_explicit(&replica->latency, latency, memory_order_relaxed);
+
+	fr_pool_connection_release(replica->pool, request, handle);
+}
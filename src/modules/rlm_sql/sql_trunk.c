@@ -0,0 +1,823 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file sql_trunk.c
+ * @brief Run queries asynchronously on a per-thread connection trunk.
+ *
+ * Used for drivers which provide the sql_query_start and sql_query_resume
+ * methods.  Each connection runs at most one query at a time, the trunk
+ * spreads queries over as many connections as are required.
+ *
+ * If batching is enabled, and the driver provides sql_batch_start, queries
+ * are held on the connection until batch_size are pending, or batch_delay
+ * has passed, then sent together in a single round trip.  A batch is
+ * committed or rolled back as a unit, and requests are only resumed once
+ * the fate of their batch is known.  If a batch fails, its queries are
+ * retried one at a time, so each request sees the result of its own query.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_sql (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+
+#include "rlm_sql.h"
+
+/** A connection in the trunk
+ *
+ */
+typedef struct {
+	rlm_sql_t const			*inst;		//!< Instance this connection belongs to.
+	fr_trunk_connection_t		*tconn;		//!< Trunk connection wrapping us.
+	fr_event_list_t			*el;		//!< Event list I/O events are inserted into.
+	rlm_sql_handle_t		*handle;	//!< Driver's connection handle.
+	int				fd;		//!< Driver's socket.
+
+	fr_trunk_connection_event_t	notify_on;	//!< Events the trunk is interested in.
+	bool				events;		//!< Whether we have events inserted for fd.
+
+	bool				busy;		//!< A query is in progress on this connection.
+	fr_trunk_request_t		**treqs;	//!< The treqs the in progress query or batch belongs to.
+							///< Entries are NULL if the treq was cancelled, in
+							///< which case the result is discarded.
+	char				**queries;	//!< Expanded queries, kept so a failed batch can be
+							///< retried one query at a time.
+	uint32_t			num;		//!< Number of treqs in the in progress query or batch.
+
+	bool				retrying;	//!< Running the queries of a failed batch individually.
+	uint32_t			retry;		//!< Index of the query being retried.
+
+	fr_event_timer_t const		*batch_ev;	//!< Sends a partial batch when batch_delay expires.
+	bool				batch_wait;	//!< Waiting for more requests before sending a batch.
+	bool				batch_flush;	//!< Send pending requests without waiting for more.
+} sql_conn_t;
+
+/** Whether queries should be sent in batches
+ *
+ */
+static inline bool sql_batching(rlm_sql_t const *inst)
+{
+	return (inst->config->batch_size > 1);
+}
+
+static void sql_conn_events_update(sql_conn_t *c);
+
+/** Connect to the database
+ *
+ * The driver's connection functions are blocking, so the connection will
+ * be open by the time we've returned.  We still signal it as connected
+ * via the fd so the state machine runs as it would for any other connection.
+ */
+static fr_connection_state_t sql_conn_init(void **h_out, fr_connection_t *conn, void *uctx)
+{
+	rlm_sql_t		*inst = talloc_get_type_abort(uctx, rlm_sql_t);
+	sql_conn_t		*c;
+
+	MEM(c = talloc_zero(conn, sql_conn_t));
+	c->inst = inst;
+	c->el = conn->el;
+	c->fd = -1;
+	MEM(c->treqs = talloc_zero_array(c, fr_trunk_request_t *, sql_batching(inst) ? inst->config->batch_size : 1));
+	MEM(c->queries = talloc_zero_array(c, char *, sql_batching(inst) ? inst->config->batch_size : 1));
+
+	c->handle = sql_mod_conn_create(c, inst, inst->config->trunk_conf.conn_conf->connection_timeout);
+	if (!c->handle) {
+	error:
+		talloc_free(c);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	c->fd = inst->driver->sql_fd(c->handle, inst->config);
+	if (c->fd < 0) {
+		ERROR("Failed getting connection socket");
+		goto error;
+	}
+
+	fr_connection_signal_on_fd(conn, c->fd);
+
+	*h_out = c;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+static void sql_conn_close(UNUSED fr_event_list_t *el, void *h, UNUSED void *uctx)
+{
+	sql_conn_t		*c = talloc_get_type_abort(h, sql_conn_t);
+
+	if (c->events) {
+		fr_event_fd_delete(c->el, c->fd, FR_EVENT_FILTER_IO);
+		c->events = false;
+	}
+
+	talloc_free(c);
+}
+
+static fr_connection_t *sql_conn_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+				       fr_connection_conf_t const *conf,
+				       char const *log_prefix, void *uctx)
+{
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(uctx, rlm_sql_t);
+	fr_connection_t		*conn;
+
+	conn = fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+					.init = sql_conn_init,
+					.close = sql_conn_close
+				   },
+				   conf,
+				   log_prefix,
+				   uctx);
+	if (!conn) {
+		PERROR("Failed allocating state handler for new connection");
+		return NULL;
+	}
+
+	return conn;
+}
+
+static void _sql_conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	sql_conn_t		*c = talloc_get_type_abort(uctx, sql_conn_t);
+
+	fr_trunk_connection_signal_readable(c->tconn);
+}
+
+/** The socket is writable
+ *
+ * If the driver is part way through sending a query we call the demuxer
+ * so it can continue, otherwise the trunk can give us another query.
+ */
+static void _sql_conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	sql_conn_t		*c = talloc_get_type_abort(uctx, sql_conn_t);
+
+	if (c->busy) {
+		fr_trunk_connection_signal_readable(c->tconn);
+		return;
+	}
+
+	fr_trunk_connection_signal_writable(c->tconn);
+}
+
+static void _sql_conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	sql_conn_t		*c = talloc_get_type_abort(uctx, sql_conn_t);
+	rlm_sql_t const		*inst = c->inst;
+
+	ERROR("Connection failed: %s", fr_syserror(fd_errno));
+
+	fr_trunk_connection_signal_reconnect(c->tconn, FR_CONNECTION_FAILED);
+}
+
+/** Insert the I/O events for the connection
+ *
+ * While a query is in progress we only care about what the driver is
+ * waiting for.  The rest of the time we use what the trunk asked for.
+ */
+static void sql_conn_events_update(sql_conn_t *c)
+{
+	rlm_sql_t const		*inst = c->inst;
+	fr_event_fd_cb_t	read_fn = NULL;
+	fr_event_fd_cb_t	write_fn = NULL;
+
+	if (c->busy) {
+		if (c->handle->io_wait & SQL_IO_WAIT_READ) read_fn = _sql_conn_readable;
+		if (c->handle->io_wait & SQL_IO_WAIT_WRITE) write_fn = _sql_conn_writable;
+	} else {
+		if (c->notify_on & FR_TRUNK_CONN_EVENT_READ) read_fn = _sql_conn_readable;
+
+		/*
+		 *	Whilst waiting for a batch to fill we'd
+		 *	otherwise be told the socket is writable
+		 *	continuously.
+		 */
+		if ((c->notify_on & FR_TRUNK_CONN_EVENT_WRITE) && !c->batch_wait) write_fn = _sql_conn_writable;
+	}
+
+	if (!read_fn && !write_fn) {
+		if (c->events) {
+			fr_event_fd_delete(c->el, c->fd, FR_EVENT_FILTER_IO);
+			c->events = false;
+		}
+		return;
+	}
+
+	if (fr_event_fd_insert(c, c->el, c->fd, read_fn, write_fn, _sql_conn_error, c) < 0) {
+		PERROR("Failed inserting FD event");
+
+		/*
+		 *	May free the connection!
+		 */
+		fr_trunk_connection_signal_reconnect(c->tconn, FR_CONNECTION_FAILED);
+		return;
+	}
+	c->events = true;
+}
+
+static void sql_conn_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+			    UNUSED fr_event_list_t *el,
+			    fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	sql_conn_t		*c = talloc_get_type_abort(conn->h, sql_conn_t);
+
+	c->tconn = tconn;
+	c->notify_on = notify_on;
+
+	sql_conn_events_update(c);
+}
+
+/** Deal with the result of a completed query
+ *
+ * Mirrors the error handling in rlm_sql_query.
+ *
+ * @param[in] c		connection the query ran on.
+ * @param[in] q		query to record the result in.  NULL if the
+ *			request was cancelled.
+ * @param[in] request	the query was run for.  May be NULL.
+ * @param[in] ret	from the driver.
+ */
+static void sql_query_done(sql_conn_t *c, sql_trunk_query_t *q, REQUEST *request, sql_rcode_t ret)
+{
+	rlm_sql_t const		*inst = c->inst;
+
+	switch (ret) {
+	case RLM_SQL_OK:
+		if (q) q->affected_rows = (inst->driver->sql_affected_rows)(c->handle, inst->config);
+		break;
+
+	case RLM_SQL_QUERY_INVALID:
+		rlm_sql_print_error(inst, request, c->handle, false);
+		break;
+
+	case RLM_SQL_ERROR:
+		if (inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY) {
+			rlm_sql_print_error(inst, request, c->handle, false);
+			break;
+		}
+		ret = RLM_SQL_ALT_QUERY;
+		/* FALL-THROUGH */
+
+	case RLM_SQL_ALT_QUERY:
+		rlm_sql_print_error(inst, request, c->handle, true);
+		break;
+
+	default:
+		break;
+	}
+
+	(inst->driver->sql_finish_query)(c->handle, inst->config);
+
+	if (q) q->rcode = ret;
+}
+
+/** Expand the query for a request
+ *
+ * @param[out] out		Expanded query.
+ * @param[out] params_out	Parameters, if the query is to be run as a prepared
+ *				statement.  May be NULL if prepared statements can't be used.
+ * @param[out] num_params	Number of parameters.
+ * @param[in] c			Connection the query will run on.
+ * @param[in] treq		to expand the query for.
+ * @return
+ *	- 1 if the query should be run.
+ *	- 0 if the query expanded to nothing.  The treq has been completed.
+ *	- -1 on error.  The treq has been failed.
+ */
+static int sql_query_expand(char **out, char ***params_out, ssize_t *num_params,
+			    sql_conn_t *c, fr_trunk_request_t *treq)
+{
+	rlm_sql_t const		*inst = c->inst;
+	sql_trunk_query_t	*q = treq->preq;
+	REQUEST			*request = treq->request;
+	char			*expanded = NULL;
+
+	/*
+	 *	The escape function may need the connection
+	 *	handle, so we can't expand until now.
+	 */
+	if (params_out) {
+		*num_params = sql_query_parameterise(c, &expanded, params_out, inst, request, c->handle, q->query);
+		if (*num_params < 0) {
+			fr_trunk_request_signal_fail(treq);
+			return -1;
+		}
+	} else if (xlat_aeval(c, &expanded, request, q->query, inst->sql_escape_func, c->handle) < 0) {
+		fr_trunk_request_signal_fail(treq);
+		return -1;
+	}
+
+	if (!*expanded) {
+		RDEBUG2("Ignoring null query");
+		talloc_free(expanded);
+		if (params_out) TALLOC_FREE(*params_out);
+		q->ignored = true;
+		fr_trunk_request_signal_complete(treq);
+		return 0;
+	}
+
+	rlm_sql_query_log(inst, request, q->section, expanded);
+
+	*out = expanded;
+
+	return 1;
+}
+
+/** Forget about the query or batch which was running on the connection
+ *
+ */
+static void sql_conn_reset(sql_conn_t *c)
+{
+	uint32_t i;
+
+	for (i = 0; i < c->num; i++) {
+		c->treqs[i] = NULL;
+		TALLOC_FREE(c->queries[i]);
+	}
+	c->num = 0;
+	c->retrying = false;
+	c->busy = false;
+}
+
+/** Handle the return code from starting a query
+ *
+ * @return
+ *	- true if the query is now in progress, or the connection is reconnecting.
+ *	- false if the query completed immediately.
+ */
+static bool sql_query_started(sql_conn_t *c, fr_trunk_connection_t *tconn, REQUEST *request, sql_rcode_t ret)
+{
+	rlm_sql_t const		*inst = c->inst;
+
+	switch (ret) {
+	case RLM_SQL_IN_PROGRESS:
+		c->busy = true;
+		sql_conn_events_update(c);
+		return true;
+
+	/*
+	 *	Reconnecting requeues any requests
+	 *	on another connection.
+	 */
+	case RLM_SQL_RECONNECT:
+		rlm_sql_print_error(inst, request, c->handle, false);
+		sql_conn_reset(c);
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/** Run the queries from a failed batch one at a time
+ *
+ * Called after each query completes, starts the next one which
+ * still has a request waiting for it.
+ */
+static void sql_batch_retry(sql_conn_t *c, fr_trunk_connection_t *tconn)
+{
+	rlm_sql_t const		*inst = c->inst;
+
+	while (c->retry < c->num) {
+		fr_trunk_request_t	*treq = c->treqs[c->retry];
+		REQUEST			*request;
+		sql_rcode_t		ret;
+
+		/*
+		 *	Cancelled, no need to run the query.
+		 */
+		if (!treq) {
+			c->retry++;
+			continue;
+		}
+		request = treq->request;
+
+		RDEBUG2("Executing query: %s", c->queries[c->retry]);
+
+		c->handle->io_wait = 0;
+		ret = (inst->driver->sql_query_start)(c->handle, inst->config, c->queries[c->retry]);
+		if (sql_query_started(c, tconn, request, ret)) return;
+
+		sql_query_done(c, treq->preq, request, ret);
+		c->treqs[c->retry++] = NULL;
+		fr_trunk_request_signal_complete(treq);
+	}
+
+	sql_conn_reset(c);
+	sql_conn_events_update(c);
+}
+
+/** Send the pending requests as a single batch
+ *
+ */
+static void sql_batch_mux(sql_conn_t *c, fr_trunk_connection_t *tconn)
+{
+	rlm_sql_t const		*inst = c->inst;
+	fr_trunk_request_t	*treq;
+	char			*batch;
+	sql_rcode_t		ret;
+	uint32_t		i;
+
+	while (c->num < inst->config->batch_size) {
+		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) break;
+		if (!treq) break;
+
+		if (sql_query_expand(&c->queries[c->num], NULL, NULL, c, treq) <= 0) continue;
+		c->treqs[c->num++] = treq;
+	}
+	if (c->num == 0) return;
+
+	/*
+	 *	Not worth batching
+	 */
+	if (c->num == 1) {
+		REQUEST *request = c->treqs[0]->request;
+
+		RDEBUG2("Executing query: %s", c->queries[0]);
+
+		c->handle->io_wait = 0;
+		ret = (inst->driver->sql_query_start)(c->handle, inst->config, c->queries[0]);
+		if (ret == RLM_SQL_IN_PROGRESS) fr_trunk_request_signal_sent(c->treqs[0]);
+		if (sql_query_started(c, tconn, request, ret)) return;
+
+		treq = c->treqs[0];
+		sql_query_done(c, treq->preq, request, ret);
+		sql_conn_reset(c);
+		fr_trunk_request_signal_complete(treq);
+		return;
+	}
+
+	MEM(batch = talloc_strdup(c, c->queries[0]));
+	for (i = 1; i < c->num; i++) MEM(batch = talloc_asprintf_append_buffer(batch, ";\n%s", c->queries[i]));
+
+	DEBUG2("Executing batch of %u queries", c->num);
+	for (i = 0; i < c->num; i++) {
+		REQUEST *request = c->treqs[i]->request;
+
+		RDEBUG2("Executing query (batched): %s", c->queries[i]);
+	}
+
+	c->handle->io_wait = 0;
+	ret = (inst->driver->sql_batch_start)(c->handle, inst->config, batch, c->num);
+	talloc_free(batch);
+
+	if (ret == RLM_SQL_IN_PROGRESS) {
+		for (i = 0; i < c->num; i++) fr_trunk_request_signal_sent(c->treqs[i]);
+	}
+	if (sql_query_started(c, tconn, NULL, ret)) return;
+
+	/*
+	 *	Failed to start, nothing was run,
+	 *	so run the queries individually.
+	 */
+	rlm_sql_print_error(inst, NULL, c->handle, false);
+	(inst->driver->sql_finish_query)(c->handle, inst->config);
+
+	for (i = 0; i < c->num; i++) fr_trunk_request_signal_sent(c->treqs[i]);
+	c->retrying = true;
+	c->retry = 0;
+	sql_batch_retry(c, tconn);
+}
+
+/** Send a partial batch because batch_delay has passed
+ *
+ */
+static void _sql_batch_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	sql_conn_t		*c = talloc_get_type_abort(uctx, sql_conn_t);
+
+	c->batch_wait = false;
+	c->batch_flush = (fr_trunk_request_count_by_connection(c->tconn, FR_TRUNK_REQUEST_STATE_PENDING) > 0);
+	sql_conn_events_update(c);
+
+	fr_trunk_connection_signal_writable(c->tconn);
+}
+
+/** Expand a query and start it on the connection
+ *
+ */
+static void sql_request_mux(UNUSED fr_event_list_t *el,
+			    fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	sql_conn_t		*c = talloc_get_type_abort(conn->h, sql_conn_t);
+	rlm_sql_t const		*inst = c->inst;
+	fr_trunk_request_t	*treq;
+	sql_trunk_query_t	*q;
+	REQUEST			*request;
+	char			*expanded = NULL;
+	char			**params = NULL;
+	ssize_t			num_params = 0;
+	bool			prepared;
+	sql_rcode_t		ret;
+
+	if (c->busy) return;
+
+	if (sql_batching(inst)) {
+		/*
+		 *	Wait for the batch to fill, or for
+		 *	batch_delay to pass.
+		 */
+		if (!c->batch_flush &&
+		    (fr_trunk_request_count_by_connection(tconn, FR_TRUNK_REQUEST_STATE_PENDING) < inst->config->batch_size)) {
+			if (c->batch_ev || (fr_event_timer_in(c, c->el, &c->batch_ev, inst->config->batch_delay,
+							      _sql_batch_timeout, c) == 0)) {
+				c->batch_wait = true;
+				sql_conn_events_update(c);
+				return;
+			}
+			PERROR("Failed inserting batch timer, sending batch now");
+		}
+		fr_event_timer_delete(&c->batch_ev);
+		c->batch_wait = false;
+		c->batch_flush = false;
+
+		sql_batch_mux(c, tconn);
+		return;
+	}
+
+	if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) return;
+	if (!treq) return;
+
+	q = treq->preq;
+	request = treq->request;
+
+	prepared = inst->config->prepared_statements && inst->driver->sql_query_params_start;
+	if (sql_query_expand(&expanded, prepared ? &params : NULL, &num_params, c, treq) <= 0) return;
+
+	RDEBUG2("Executing query: %s", expanded);
+
+	c->handle->io_wait = 0;
+	if (prepared) {
+		ret = (inst->driver->sql_query_params_start)(c->handle, inst->config, expanded,
+							     (char const * const *) params, num_params);
+	} else {
+		ret = (inst->driver->sql_query_start)(c->handle, inst->config, expanded);
+	}
+	talloc_free(expanded);
+	talloc_free(params);
+
+	c->treqs[0] = treq;
+	c->num = 1;
+
+	if (ret == RLM_SQL_IN_PROGRESS) fr_trunk_request_signal_sent(treq);
+	if (sql_query_started(c, tconn, request, ret)) return;
+
+	sql_query_done(c, q, request, ret);
+	sql_conn_reset(c);
+	fr_trunk_request_signal_complete(treq);
+}
+
+/** Record the results of a batch which committed
+ *
+ */
+static void sql_batch_done(sql_conn_t *c)
+{
+	rlm_sql_t const		*inst = c->inst;
+	uint32_t		i;
+
+	for (i = 0; i < c->num; i++) {
+		fr_trunk_request_t	*treq = c->treqs[i];
+		sql_trunk_query_t	*q;
+
+		if (!treq) continue;
+
+		q = treq->preq;
+		q->rcode = RLM_SQL_OK;
+		q->affected_rows = (inst->driver->sql_batch_affected_rows)(c->handle, inst->config, i);
+		c->treqs[i] = NULL;
+		fr_trunk_request_signal_complete(treq);
+	}
+	(inst->driver->sql_finish_query)(c->handle, inst->config);
+}
+
+/** Continue the in progress query
+ *
+ */
+static void sql_request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	sql_conn_t		*c = talloc_get_type_abort(conn->h, sql_conn_t);
+	rlm_sql_t const		*inst = c->inst;
+	fr_trunk_request_t	*treq;
+	sql_rcode_t		ret;
+
+	if (!c->busy) return;
+
+	ret = (inst->driver->sql_query_resume)(c->handle, inst->config);
+	if (ret == RLM_SQL_IN_PROGRESS) {
+		sql_conn_events_update(c);
+		return;
+	}
+
+	treq = c->treqs[c->retrying ? c->retry : 0];
+
+	if (ret == RLM_SQL_RECONNECT) {
+		rlm_sql_print_error(inst, treq ? treq->request : NULL, c->handle, false);
+		sql_conn_reset(c);
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	/*
+	 *	A batch committed, or was rolled back.  If it
+	 *	was rolled back, run each query on its own.
+	 */
+	if ((c->num > 1) && !c->retrying) {
+		if (ret == RLM_SQL_OK) {
+			sql_batch_done(c);
+			sql_conn_reset(c);
+			sql_conn_events_update(c);
+			return;
+		}
+
+		ERROR("Batch of %u queries failed, retrying them individually", c->num);
+		rlm_sql_print_error(inst, NULL, c->handle, false);
+		(inst->driver->sql_finish_query)(c->handle, inst->config);
+
+		c->retrying = true;
+		c->retry = 0;
+		sql_batch_retry(c, tconn);
+		return;
+	}
+
+	/*
+	 *	Request was cancelled whilst the query
+	 *	was running, discard the result.
+	 */
+	if (!treq) {
+		sql_query_done(c, NULL, NULL, ret);
+	} else {
+		sql_query_done(c, treq->preq, treq->request, ret);
+	}
+
+	if (c->retrying) {
+		c->treqs[c->retry++] = NULL;
+		if (treq) fr_trunk_request_signal_complete(treq);
+		sql_batch_retry(c, tconn);
+		return;
+	}
+
+	sql_conn_reset(c);
+	if (treq) fr_trunk_request_signal_complete(treq);
+
+	sql_conn_events_update(c);
+}
+
+/** Remove a treq from the in progress query or batch
+ *
+ */
+static void sql_conn_forget(sql_conn_t *c, void *preq)
+{
+	uint32_t i;
+
+	for (i = 0; i < c->num; i++) {
+		if (c->treqs[i] && (c->treqs[i]->preq == preq)) {
+			c->treqs[i] = NULL;
+			return;
+		}
+	}
+}
+
+/** Forget about the treq, the query will be allowed to complete, but the result is discarded
+ *
+ */
+static void sql_request_cancel(fr_connection_t *conn, void *preq, UNUSED fr_trunk_cancel_reason_t reason,
+			       UNUSED void *uctx)
+{
+	sql_conn_t		*c = talloc_get_type_abort(conn->h, sql_conn_t);
+
+	sql_conn_forget(c, preq);
+}
+
+static void sql_request_conn_release(fr_connection_t *conn, void *preq, UNUSED void *uctx)
+{
+	sql_conn_t		*c = talloc_get_type_abort(conn->h, sql_conn_t);
+
+	sql_conn_forget(c, preq);
+}
+
+static void sql_request_complete(REQUEST *request, void *preq, UNUSED void *rctx, UNUSED void *uctx)
+{
+	sql_trunk_query_t	*q = preq;
+
+	q->treq = NULL;
+
+	unlang_interpret_resumable(request);
+}
+
+static void sql_request_fail(REQUEST *request, void *preq, UNUSED void *rctx,
+			     UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	sql_trunk_query_t	*q = preq;
+
+	q->treq = NULL;
+	q->rcode = RLM_SQL_ERROR;
+
+	unlang_interpret_resumable(request);
+}
+
+/** Allocate a per-thread trunk for running queries
+ *
+ * @param[in] ctx	to allocate the trunk in.
+ * @param[in] inst	of rlm_sql.  The driver must provide sql_query_start.
+ * @param[in] el	to run the trunk in.
+ * @return
+ *	- A new trunk.
+ *	- NULL on error.
+ */
+fr_trunk_t *sql_trunk_alloc(TALLOC_CTX *ctx, rlm_sql_t *inst, fr_event_list_t *el)
+{
+	static fr_trunk_io_funcs_t	io_funcs = {
+						.connection_alloc = sql_conn_alloc,
+						.connection_notify = sql_conn_notify,
+						.request_mux = sql_request_mux,
+						.request_demux = sql_request_demux,
+						.request_cancel = sql_request_cancel,
+						.request_conn_release = sql_request_conn_release,
+						.request_complete = sql_request_complete,
+						.request_fail = sql_request_fail
+					};
+
+	fr_assert(inst->driver->sql_query_start && inst->driver->sql_query_resume && inst->driver->sql_fd);
+
+	return fr_trunk_alloc(ctx, el, &io_funcs, &inst->config->trunk_conf, inst->name, inst, false);
+}
+
+/** Queue a query on the trunk
+ *
+ * When the query completes or fails the request is marked as resumable,
+ * and the result is available in q.
+ *
+ * @param[in] q		to run.  Must be allocated in a context which outlives
+ *			the query, usually the module's rctx.
+ * @param[in] trunk	to queue the query on.
+ * @param[in] request	the query is being run for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sql_trunk_query_enqueue(sql_trunk_query_t *q, fr_trunk_t *trunk, REQUEST *request)
+{
+	fr_trunk_request_t	*treq;
+
+	q->rcode = RLM_SQL_ERROR;
+	q->affected_rows = 0;
+	q->ignored = false;
+
+	treq = fr_trunk_request_alloc(trunk, request);
+	if (!treq) return -1;
+
+	if (fr_trunk_request_enqueue(&treq, trunk, request, q, q) < 0) {
+		fr_trunk_request_free(&treq);
+		return -1;
+	}
+	q->treq = treq;
+
+	/*
+	 *	Send the batch as soon as it's full,
+	 *	rather than waiting for batch_delay.
+	 */
+	if (sql_batching(q->inst) && treq->tconn &&
+	    (fr_trunk_request_count_by_connection(treq->tconn,
+						  FR_TRUNK_REQUEST_STATE_PENDING) >= q->inst->config->batch_size)) {
+		sql_conn_t	*c = talloc_get_type_abort(treq->tconn->conn->h, sql_conn_t);
+
+		c->batch_wait = false;
+		c->batch_flush = true;
+		sql_conn_events_update(c);
+		fr_trunk_connection_signal_writable(treq->tconn);
+	}
+
+	return 0;
+}
+
+/** Tell the trunk we're no longer interested in the result of a query
+ *
+ */
+void sql_trunk_query_cancel(sql_trunk_query_t *q)
+{
+	if (!q->treq) return;
+
+	fr_trunk_request_signal_cancel(q->treq);
+	q->treq = NULL;
+}
@@ -29,11 +29,20 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 
 #include <ctype.h>
+#include <pthread.h>
 
 #define MAX_QUERY_LEN 1024
 
+/*
+ *	Maximum number of open sessions we track per key.  Past
+ *	this, the counter is re-read from SQL instead.
+ */
+#define SQLCOUNTER_MAX_SESSIONS	32
+
 /*
  *	Note: When your counter spans more than 1 period (ie 3 months
  *	or 2 weeks), this module probably does NOT do what you want! It
@@ -52,6 +61,31 @@ RCSID("$Id$")
  *	Reset Time.
  */
 
+/** The last value seen for an open session
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the sessions list.
+	char const		*id;			//!< Session identifier.
+	uint64_t		value;			//!< Last cumulative value reported for the session.
+} sqlcounter_session_t;
+
+/** A running counter for one key
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+	char const		*key;			//!< What the counter is for, usually the user.
+
+	uint64_t		counter;		//!< Current value of the counter.
+	fr_time_t		period;			//!< Start of the period the counter is for.
+	fr_time_t		reconciled;		//!< When the counter was last read from SQL.
+	bool			stale;			//!< Accounting data we couldn't apply was seen.
+							///< The counter must be re-read from SQL.
+
+	fr_dlist_head_t		sessions;		//!< Open sessions, with the last value seen.
+} sqlcounter_entry_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -71,8 +105,27 @@ typedef struct {
 
 	fr_time_t	reset_time;
 	fr_time_t	last_reset;
+
+	bool		cache_enable;		//!< Keep running counters in memory.
+	uint32_t	cache_max_entries;	//!< Maximum number of keys to keep counters for.
+	fr_time_delta_t	reconcile_interval;	//!< How often to re-read counters from SQL.
+	vp_tmpl_t	*session_id;		//!< Identifies the session in accounting packets.
+	vp_tmpl_t	*value;			//!< Cumulative value for the session in accounting packets.
+
+	pthread_mutex_t	mutex;			//!< Protects the cache.
+	fr_hash_table_t	*cache;			//!< Counters by key.  Entries are allocated in its ctx.
+	fr_dlist_head_t	lru;			//!< Most recently used at the head.
 } rlm_sqlcounter_t;
 
+static const CONF_PARSER cache_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, rlm_sqlcounter_t, cache_enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_sqlcounter_t, cache_max_entries), .dflt = "16384" },
+	{ FR_CONF_OFFSET("reconcile_interval", FR_TYPE_TIME_DELTA, rlm_sqlcounter_t, reconcile_interval), .dflt = "300" },
+	{ FR_CONF_OFFSET("session_id", FR_TYPE_TMPL, rlm_sqlcounter_t, session_id), .dflt = "&Acct-Unique-Session-Id", .quote = T_BARE_WORD },
+	{ FR_CONF_OFFSET("value", FR_TYPE_TMPL, rlm_sqlcounter_t, value), .dflt = "&Acct-Session-Time", .quote = T_BARE_WORD },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("sql_module_instance", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_sqlcounter_t, sqlmod_inst) },
 
@@ -88,6 +141,8 @@ static const CONF_PARSER module_config[] = {
 
 	/* Attribute to write remaining session to */
 	{ FR_CONF_OFFSET("reply_name", FR_TYPE_TMPL | FR_TYPE_ATTRIBUTE, rlm_sqlcounter_t, reply_attr) },
+
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -101,11 +156,13 @@ fr_dict_autoload_t rlm_sqlcounter_dict[] = {
 	{ NULL }
 };
 
+static fr_dict_attr_t const *attr_acct_status_type;
 static fr_dict_attr_t const *attr_reply_message;
 static fr_dict_attr_t const *attr_session_timeout;
 
 extern fr_dict_attr_autoload_t rlm_sqlcounter_dict_attr[];
 fr_dict_attr_autoload_t rlm_sqlcounter_dict_attr[] = {
+	{ .out = &attr_acct_status_type, .name = "Acct-Status-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ .out = &attr_reply_message, .name = "Reply-Message", .type = FR_TYPE_STRING, .dict = &dict_radius },
 	{ .out = &attr_session_timeout, .name = "Session-Timeout", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ NULL }
@@ -337,44 +394,191 @@ static ssize_t sqlcounter_expand(char *out, int outlen, rlm_sqlcounter_t const *
 }
 
 
-/*
- *	See if the counter matches.
+/** Read the current value of the counter from SQL
+ *
+ * @param[out] out	The value of the counter.
+ * @param[in] inst	of rlm_sqlcounter.
+ * @param[in] request	The current request.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static int counter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req , VALUE_PAIR *check,
-		       UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
+static int sqlcounter_query(uint64_t *out, rlm_sqlcounter_t const *inst, REQUEST *request)
 {
-	rlm_sqlcounter_t const *inst = instance;
-	uint64_t counter;
-
-	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
-	char *expanded = NULL;
-	size_t len;
+	char	query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
+	char	*expanded = NULL;
+	size_t	len;
 
 	/* First, expand %k, %b and %e in query */
 	if (sqlcounter_expand(subst, sizeof(subst), inst, request, inst->query) <= 0) {
 		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
 	/* Then combine that with the name of the module were using to do the query */
 	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= sizeof(query) - 1) {
+	if (len >= (sizeof(query) - 1)) {
 		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
 	/* Finally, xlat resulting SQL query */
-	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
-	}
+	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) return -1;
 
-	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in string \"%s\"", expanded);
+	if (sscanf(expanded, "%" PRIu64, out) != 1) {
+		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
+			expanded);
+		*out = 0;
 	}
 	talloc_free(expanded);
 
+	return 0;
+}
+
+static uint32_t sqlcounter_entry_hash(void const *data)
+{
+	sqlcounter_entry_t const *entry = data;
+
+	return fr_hash_string(entry->key);
+}
+
+static int sqlcounter_entry_cmp(void const *one, void const *two)
+{
+	sqlcounter_entry_t const *a = one, *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+/** Find the running counter for a key
+ *
+ * @note Must be called with the cache locked.
+ */
+static sqlcounter_entry_t *sqlcounter_cache_find(rlm_sqlcounter_t *inst, char const *key)
+{
+	sqlcounter_entry_t	find = { .key = key };
+
+	return fr_hash_table_finddata(inst->cache, &find);
+}
+
+/** Find the open session in an entry
+ *
+ */
+static sqlcounter_session_t *sqlcounter_session_find(sqlcounter_entry_t *entry, char const *id)
+{
+	sqlcounter_session_t	*session = NULL;
+
+	while ((session = fr_dlist_next(&entry->sessions, session))) {
+		if (strcmp(session->id, id) == 0) return session;
+	}
+
+	return NULL;
+}
+
+/** Record the counter read from SQL, creating the entry if needed
+ *
+ * Open sessions are kept, SQL has counted them up to the last value
+ * we saw, so later deltas still apply.
+ *
+ * @note Must be called with the cache locked.
+ */
+static void sqlcounter_cache_store(rlm_sqlcounter_t *inst, char const *key, uint64_t counter, fr_time_t now)
+{
+	sqlcounter_entry_t	*entry, *evict;
+
+	entry = sqlcounter_cache_find(inst, key);
+	if (entry) {
+		fr_dlist_remove(&inst->lru, entry);
+	} else {
+		while ((fr_dlist_num_elements(&inst->lru) >= inst->cache_max_entries) &&
+		       (evict = fr_dlist_tail(&inst->lru))) {
+			fr_dlist_remove(&inst->lru, evict);
+			fr_hash_table_delete(inst->cache, evict);
+			talloc_free(evict);
+		}
+
+		MEM(entry = talloc_zero(inst->cache, sqlcounter_entry_t));
+		entry->key = talloc_typed_strdup(entry, key);
+		fr_dlist_talloc_init(&entry->sessions, sqlcounter_session_t, entry);
+
+		if (!fr_hash_table_insert(inst->cache, entry)) {
+			talloc_free(entry);
+			return;
+		}
+	}
+	fr_dlist_insert_head(&inst->lru, entry);
+
+	entry->counter = counter;
+	entry->period = inst->last_reset;
+	entry->reconciled = now;
+	entry->stale = false;
+}
+
+/** Get the current value of the counter, from the cache if we can
+ *
+ * Entries are re-read from SQL when they belong to a previous period,
+ * when accounting data was seen which couldn't be applied to them,
+ * or every reconcile_interval to correct any drift.
+ *
+ * @param[out] out	The value of the counter.
+ * @param[in] inst	of rlm_sqlcounter.
+ * @param[in] request	The current request.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int sqlcounter_read(uint64_t *out, rlm_sqlcounter_t *inst, REQUEST *request)
+{
+	sqlcounter_entry_t	*entry;
+	char			buffer[256];
+	char const		*key;
+	fr_time_t		now = fr_time();
+
+	if (!inst->cache_enable) return sqlcounter_query(out, inst, request);
+
+	if (tmpl_expand(&key, buffer, sizeof(buffer), request, inst->key, NULL, NULL) < 0) {
+		RPEDEBUG("Failed expanding key");
+		return -1;
+	}
+
+	pthread_mutex_lock(&inst->mutex);
+	entry = sqlcounter_cache_find(inst, key);
+	if (entry && !entry->stale && (entry->period == inst->last_reset) &&
+	    ((now - entry->reconciled) < inst->reconcile_interval)) {
+		*out = entry->counter;
+		fr_dlist_remove(&inst->lru, entry);
+		fr_dlist_insert_head(&inst->lru, entry);
+		pthread_mutex_unlock(&inst->mutex);
+
+		RDEBUG2("Using cached counter value (%" PRIu64 ") for \"%s\"", *out, key);
+		return 0;
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	/*
+	 *	Don't hold the lock over the query.  Accounting
+	 *	data which arrives in the meantime may be lost or
+	 *	counted twice, that's fixed at the next reconcile.
+	 */
+	if (sqlcounter_query(out, inst, request) < 0) return -1;
+
+	pthread_mutex_lock(&inst->mutex);
+	sqlcounter_cache_store(inst, key, *out, now);
+	pthread_mutex_unlock(&inst->mutex);
+
+	return 0;
+}
+
+/*
+ *	See if the counter matches.
+ */
+static int counter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req , VALUE_PAIR *check,
+		       UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
+{
+	rlm_sqlcounter_t	*inst = instance;
+	uint64_t		counter;
+
+	if (sqlcounter_read(&counter, inst, request) < 0) return RLM_MODULE_FAIL;
+
 	if (counter < check->vp_uint64) return -1;
 	if (counter > check->vp_uint64) return 1;
 	return 0;
@@ -395,11 +599,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 	char			msg[128];
 	int			ret;
 
-	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
-	char *expanded = NULL;
-
-	size_t len;
-
 	/*
 	 *	Before doing anything else, see if we have to reset
 	 *	the counters.
@@ -417,32 +616,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 		return RLM_MODULE_NOOP;
 	}
 
-	/* First, expand %k, %b and %e in query */
-	if (sqlcounter_expand(subst, sizeof(subst), inst, request, inst->query) <= 0) {
-		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
-	}
-
-	/* Then combine that with the name of the module were using to do the query */
-	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= (sizeof(query) - 1)) {
-		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
-	}
-
-	/* Finally, xlat resulting SQL query */
-	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
-	}
-	talloc_free(expanded);
-
-	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
-			expanded);
-		counter = 0;
-	}
+	if (sqlcounter_read(&counter, inst, request) < 0) return RLM_MODULE_FAIL;
 
 	/*
 	 *	Check if check item > counter
@@ -522,6 +696,108 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 	return RLM_MODULE_OK;
 }
 
+/*
+ *	Apply the usage reported in accounting packets to the
+ *	running counters, so authorize doesn't need to query SQL.
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *thread, REQUEST *request)
+{
+	rlm_sqlcounter_t	*inst = instance;
+	VALUE_PAIR		*vp;
+	sqlcounter_entry_t	*entry;
+	sqlcounter_session_t	*session;
+	char			key_buff[256], id_buff[256], value_buff[64];
+	char const		*key, *id;
+	uint64_t		value, delta = 0;
+	uint32_t		status;
+	bool			have_value = true;
+
+	if (!inst->cache_enable) return RLM_MODULE_NOOP;
+
+	vp = fr_pair_find_by_da(request->packet->vps, attr_acct_status_type, TAG_ANY);
+	if (!vp) {
+		RDEBUG2("No Acct-Status-Type attribute in request");
+		return RLM_MODULE_NOOP;
+	}
+	status = vp->vp_uint32;
+
+	if ((status != FR_STATUS_START) && (status != FR_STATUS_ALIVE) && (status != FR_STATUS_STOP)) {
+		return RLM_MODULE_NOOP;
+	}
+
+	if (tmpl_expand(&key, key_buff, sizeof(key_buff), request, inst->key, NULL, NULL) < 0) {
+		RPEDEBUG("Failed expanding key");
+		return RLM_MODULE_FAIL;
+	}
+
+	if (tmpl_expand(&id, id_buff, sizeof(id_buff), request, inst->session_id, NULL, NULL) < 0) {
+		RWDEBUG("Can't determine session for \"%s\", ignoring", key);
+		return RLM_MODULE_NOOP;
+	}
+
+	/*
+	 *	Start packets usually have no usage in them.
+	 */
+	if (tmpl_expand(&value, value_buff, sizeof(value_buff), request, inst->value, NULL, NULL) < 0) {
+		value = 0;
+		have_value = (status == FR_STATUS_START);
+	}
+
+	pthread_mutex_lock(&inst->mutex);
+	entry = sqlcounter_cache_find(inst, key);
+	if (!entry) {
+		pthread_mutex_unlock(&inst->mutex);
+		RDEBUG2("No running counter for \"%s\"", key);
+		return RLM_MODULE_NOOP;
+	}
+
+	session = sqlcounter_session_find(entry, id);
+	if (!have_value) {
+		entry->stale = true;
+		RDEBUG2("No usage found in packet, counter for \"%s\" will be re-read", key);
+
+	} else if (session) {
+		if (value > session->value) delta = value - session->value;
+		session->value = value;
+
+	/*
+	 *	We don't know what SQL has counted for sessions
+	 *	which started before the counter was read, or
+	 *	which we stopped tracking.  Remember where they
+	 *	are now, and re-read the counter.
+	 */
+	} else {
+		if (status == FR_STATUS_START) {
+			delta = value;
+		} else {
+			entry->stale = true;
+			RDEBUG2("Unknown session \"%s\", counter for \"%s\" will be re-read", id, key);
+		}
+
+		if (status != FR_STATUS_STOP) {
+			if (fr_dlist_num_elements(&entry->sessions) >= SQLCOUNTER_MAX_SESSIONS) {
+				entry->stale = true;
+			} else {
+				MEM(session = talloc_zero(entry, sqlcounter_session_t));
+				session->id = talloc_typed_strdup(session, id);
+				session->value = value;
+				fr_dlist_insert_tail(&entry->sessions, session);
+			}
+		}
+	}
+
+	if (session && (status == FR_STATUS_STOP)) {
+		fr_dlist_remove(&entry->sessions, session);
+		talloc_free(session);
+	}
+
+	entry->counter += delta;
+	RDEBUG2("Counter for \"%s\" is now %" PRIu64 " (+%" PRIu64 ")", key, entry->counter, delta);
+	pthread_mutex_unlock(&inst->mutex);
+
+	return RLM_MODULE_OK;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -557,6 +833,33 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->cache_enable) {
+		if (inst->cache_max_entries == 0) {
+			cf_log_err(conf, "cache.max_entries must be greater than 0");
+			return -1;
+		}
+
+		inst->cache = fr_hash_table_create(inst, sqlcounter_entry_hash, sqlcounter_entry_cmp, NULL);
+		if (!inst->cache) {
+			cf_log_err(conf, "Failed creating counter cache");
+			return -1;
+		}
+		fr_dlist_talloc_init(&inst->lru, sqlcounter_entry_t, entry);
+		pthread_mutex_init(&inst->mutex, NULL);
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_sqlcounter_t	*inst = instance;
+
+	if (!inst->cache) return 0;
+
+	TALLOC_FREE(inst->cache);
+	pthread_mutex_destroy(&inst->mutex);
+
 	return 0;
 }
 
@@ -619,8 +922,10 @@ module_t rlm_sqlcounter = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
-		[MOD_AUTHORIZE]		= mod_authorize
+		[MOD_AUTHORIZE]		= mod_authorize,
+		[MOD_ACCOUNTING]	= mod_accounting
 	},
 };
 
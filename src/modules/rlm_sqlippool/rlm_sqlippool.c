@@ -30,12 +30,48 @@ RCSID("$Id$")
 
 #include <rlm_sql.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/rbtree.h>
 
 #include <ctype.h>
 
 
 #define MAX_QUERY_LEN 4096
 
+typedef struct sqlippool_pool_s sqlippool_pool_t;
+
+/** An address in a pool held in memory
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< In the pool's free or used list.
+	sqlippool_pool_t	*pool;		//!< Pool the address belongs to.
+	fr_ipaddr_t		ipaddr;		//!< Parsed address, for lookups by accounting packets.
+	char			*addr;		//!< Address as returned by SQL.
+	fr_ipaddr_t		nas;		//!< NAS the address was allocated to.
+	time_t			expires;	//!< When the lease expires.  0 if the address is free.
+} sqlippool_lease_t;
+
+/** A pool held in memory
+ *
+ */
+struct sqlippool_pool_s {
+	char const		*name;		//!< Pool-Name.
+	fr_dlist_head_t		free;		//!< Addresses not in use.  Allocated from the head,
+						//!< released to the tail.
+	fr_dlist_head_t		used;		//!< Leased addresses, ordered by expiry.
+};
+
+/** Pools held in memory
+ *
+ * Shared by all worker threads, so protected by the mutex.
+ */
+typedef struct {
+	pthread_mutex_t		mutex;
+	rbtree_t		*pools;		//!< Of sqlippool_pool_t, by name.
+	rbtree_t		*leases;	//!< Of sqlippool_lease_t, by address.
+} sqlippool_memory_t;
+
 /*
  *	Define a structure for our module configuration.
  */
@@ -94,8 +130,25 @@ typedef struct {
 						/* Reserved to handle 255.255.255.254 Requests */
 	char const	*defaultpool;		//!< Default Pool-Name if there is none in the check items.
 
+						/* In-memory allocation */
+	bool		memory;			//!< Allocate from pools held in memory.
+	char const	*memory_load;		//!< SQL query to load a pool into memory.
+	fr_time_delta_t	flush_interval;		//!< How often queued lease updates are written.
+	uint32_t	flush_batch;		//!< Write queued lease updates once there are this many.
+	sqlippool_memory_t *mem;		//!< Pools loaded so far.
 } rlm_sqlippool_t;
 
+/** Per thread lease updates waiting to be written
+ *
+ */
+typedef struct {
+	rlm_sqlippool_t		*inst;		//!< Module instance.
+	fr_event_list_t		*el;		//!< This thread's event list.
+	fr_event_timer_t const	*ev;		//!< Flush timer.
+	char			**queue;	//!< Expanded allocate_update queries.
+	uint32_t		queued;		//!< How many queries are in the queue.
+} rlm_sqlippool_thread_t;
+
 static CONF_PARSER message_config[] = {
 	{ FR_CONF_OFFSET("exists", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, log_exists) },
 	{ FR_CONF_OFFSET("success", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, log_success) },
@@ -105,6 +158,13 @@ static CONF_PARSER message_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static CONF_PARSER memory_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, rlm_sqlippool_t, memory), .dflt = "no" },
+	{ FR_CONF_OFFSET("flush_interval", FR_TYPE_TIME_DELTA, rlm_sqlippool_t, flush_interval), .dflt = "1.0" },
+	{ FR_CONF_OFFSET("flush_batch", FR_TYPE_UINT32, rlm_sqlippool_t, flush_batch), .dflt = "100" },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("sql_module_instance", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_sqlippool_t, sql_instance_name), .dflt = "sql" },
 
@@ -166,6 +226,10 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("off_commit", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, off_commit), .dflt = "COMMIT" },
 
 	{ FR_CONF_POINTER("messages", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) message_config },
+
+	{ FR_CONF_OFFSET("memory_load", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, memory_load), .dflt = "" },
+
+	{ FR_CONF_POINTER("memory", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) memory_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -182,12 +246,14 @@ fr_dict_autoload_t rlm_sqlippool_dict[] = {
 static fr_dict_attr_t const *attr_pool_name;
 static fr_dict_attr_t const *attr_module_success_message;
 static fr_dict_attr_t const *attr_acct_status_type;
+static fr_dict_attr_t const *attr_nas_ip_address;
 
 extern fr_dict_attr_autoload_t rlm_sqlippool_dict_attr[];
 fr_dict_attr_autoload_t rlm_sqlippool_dict_attr[] = {
 	{ .out = &attr_module_success_message, .name = "Module-Success-Message", .type = FR_TYPE_STRING, .dict = &dict_freeradius },
 	{ .out = &attr_pool_name, .name = "Pool-Name", .type = FR_TYPE_STRING, .dict = &dict_freeradius },
 	{ .out = &attr_acct_status_type, .name = "Acct-Status-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ .out = &attr_nas_ip_address, .name = "NAS-IP-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_radius },
 
 	{ NULL }
 };
@@ -397,6 +463,34 @@ finish:
 	return retval;
 }
 
+static int sqlippool_pool_cmp(void const *one, void const *two)
+{
+	sqlippool_pool_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcmp(a->name, b->name);
+	return (ret > 0) - (ret < 0);
+}
+
+static int sqlippool_lease_cmp(void const *one, void const *two)
+{
+	sqlippool_lease_t const *a = one, *b = two;
+	int ret;
+
+	ret = fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+	return (ret > 0) - (ret < 0);
+}
+
+static int mod_bootstrap(void *instance, UNUSED CONF_SECTION *conf)
+{
+	rlm_sqlippool_t		*inst = instance;
+
+	/*
+	 *	We use the SQL module's instance data
+	 */
+	return module_instance_depends(inst, inst->sql_instance_name);
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -452,6 +546,22 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->memory) {
+		if (!inst->memory_load || !*inst->memory_load) {
+			cf_log_err(conf, "'memory_load' must be set when 'memory { enable = yes }'");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("flush_batch", inst->flush_batch, >=, 1);
+		FR_TIME_DELTA_BOUND_CHECK("flush_interval", inst->flush_interval, >=, fr_time_delta_from_msec(10));
+
+		MEM(inst->mem = talloc_zero(inst, sqlippool_memory_t));
+		pthread_mutex_init(&inst->mem->mutex, NULL);
+		inst->mem->pools = rbtree_talloc_create(inst->mem, sqlippool_pool_cmp, sqlippool_pool_t, NULL, 0);
+		inst->mem->leases = rbtree_talloc_create(inst->mem, sqlippool_lease_cmp, sqlippool_lease_t, NULL, 0);
+		if (!inst->mem->pools || !inst->mem->leases) return -1;
+	}
+
 	return 0;
 }
 
@@ -475,11 +585,465 @@ static int do_logging(UNUSED rlm_sqlippool_t *inst, REQUEST *request, char const
 	return rcode;
 }
 
+static int sqlippool_lease_expires_cmp(void const *one, void const *two)
+{
+	sqlippool_lease_t const *a = *((sqlippool_lease_t const * const *)one);
+	sqlippool_lease_t const *b = *((sqlippool_lease_t const * const *)two);
+
+	return (a->expires > b->expires) - (a->expires < b->expires);
+}
+
+/** Read a pool's addresses from SQL
+ *
+ * The memory_load query must return the address, and the number of seconds
+ * until its lease expires.  Addresses with no time remaining are free.
+ *
+ * @param[out] out	The loaded pool.  Not yet visible to other threads.
+ * @param[in] inst	of rlm_sqlippool.
+ * @param[in] request	The current request.
+ * @param[in] handle	SQL connection handle.
+ * @param[in] name	of the pool.
+ * @return
+ *	- 1 if the pool was loaded.
+ *	- 0 if the pool has no addresses.
+ *	- -1 on error.
+ */
+static int sqlippool_memory_load(sqlippool_pool_t **out, rlm_sqlippool_t *inst, REQUEST *request,
+				 rlm_sql_handle_t **handle, char const *name)
+{
+	char			query[MAX_QUERY_LEN];
+	char			*expanded = NULL;
+	rlm_sql_row_t		row;
+	sqlippool_pool_t	*pool;
+	sqlippool_lease_t	**used;
+	time_t			now = time(NULL);
+	size_t			count = 0, num_used = 0, i;
+	int			ret;
+
+	*out = NULL;
+
+	sqlippool_expand(query, sizeof(query), inst->memory_load, inst, NULL, 0);
+	if (xlat_aeval(request, &expanded, request, query, inst->sql_inst->sql_escape_func, *handle) < 0) return -1;
+
+	ret = inst->sql_inst->sql_select_query(inst->sql_inst, request, handle, expanded);
+	talloc_free(expanded);
+	if ((ret != 0) || !*handle) {
+		REDEBUG("Failed loading pool \"%s\"", name);
+		return -1;
+	}
+
+	MEM(pool = talloc_zero(NULL, sqlippool_pool_t));
+	pool->name = talloc_typed_strdup(pool, name);
+	fr_dlist_talloc_init(&pool->free, sqlippool_lease_t, entry);
+	fr_dlist_talloc_init(&pool->used, sqlippool_lease_t, entry);
+	MEM(used = talloc_array(pool, sqlippool_lease_t *, 16));
+
+	while ((inst->sql_inst->sql_fetch_row(&row, inst->sql_inst, request, handle) == 0) && row) {
+		sqlippool_lease_t	*lease;
+		long			remaining;
+
+		if (!row[0]) continue;
+
+		MEM(lease = talloc_zero(pool, sqlippool_lease_t));
+		if (fr_inet_pton(&lease->ipaddr, row[0], -1, AF_UNSPEC, false, true) < 0) {
+			RWDEBUG("Ignoring invalid address \"%s\" in pool \"%s\"", row[0], name);
+			talloc_free(lease);
+			continue;
+		}
+		lease->pool = pool;
+		lease->addr = talloc_typed_strdup(lease, row[0]);
+
+		remaining = row[1] ? strtol(row[1], NULL, 10) : 0;
+		if (remaining > 0) {
+			lease->expires = now + remaining;
+			if (num_used >= talloc_array_length(used)) {
+				MEM(used = talloc_realloc(pool, used, sqlippool_lease_t *, num_used * 2));
+			}
+			used[num_used++] = lease;
+		} else {
+			fr_dlist_insert_tail(&pool->free, lease);
+		}
+		count++;
+	}
+
+	if (*handle) (inst->sql_inst->driver->sql_finish_select_query)(*handle, inst->sql_inst->config);
+
+	/*
+	 *	Leases allocated from here on are always the last
+	 *	to expire, so only the existing ones need sorting.
+	 */
+	qsort(used, num_used, sizeof(used[0]), sqlippool_lease_expires_cmp);
+	for (i = 0; i < num_used; i++) fr_dlist_insert_tail(&pool->used, used[i]);
+	talloc_free(used);
+
+	if (!count) {
+		talloc_free(pool);
+		return 0;
+	}
+
+	RDEBUG2("Loaded %zu addresses (%zu free) into pool \"%s\"", count, fr_dlist_num_elements(&pool->free), name);
+	*out = pool;
+
+	return 1;
+}
+
+/** Make a loaded pool visible to all threads
+ *
+ * @return the pool to allocate from.  If another thread loaded the same pool
+ *	first, that pool is returned, and the one passed in is freed.
+ */
+static sqlippool_pool_t *sqlippool_memory_add(rlm_sqlippool_t *inst, sqlippool_pool_t *pool)
+{
+	sqlippool_memory_t	*mem = inst->mem;
+	sqlippool_pool_t	*found;
+	sqlippool_lease_t	*lease, *next;
+
+	pthread_mutex_lock(&mem->mutex);
+	found = rbtree_finddata(mem->pools, pool);
+	if (found) {
+		pthread_mutex_unlock(&mem->mutex);
+		talloc_free(pool);
+		return found;
+	}
+
+	/*
+	 *	Addresses must be unique across pools, so that
+	 *	accounting packets can find their lease.
+	 */
+	for (lease = fr_dlist_head(&pool->free); lease; lease = next) {
+		next = fr_dlist_next(&pool->free, lease);
+		if (rbtree_insert(mem->leases, lease)) continue;
+
+		WARN("Ignoring address %s in pool \"%s\", it's already in another pool", lease->addr, pool->name);
+		fr_dlist_remove(&pool->free, lease);
+		talloc_free(lease);
+	}
+	for (lease = fr_dlist_head(&pool->used); lease; lease = next) {
+		next = fr_dlist_next(&pool->used, lease);
+		if (rbtree_insert(mem->leases, lease)) continue;
+
+		WARN("Ignoring address %s in pool \"%s\", it's already in another pool", lease->addr, pool->name);
+		fr_dlist_remove(&pool->used, lease);
+		talloc_free(lease);
+	}
+
+	talloc_steal(mem, pool);
+	rbtree_insert(mem->pools, pool);
+	pthread_mutex_unlock(&mem->mutex);
+
+	return pool;
+}
+
+/** Write the queued lease updates for this thread
+ *
+ * All queued updates are written in a single transaction.  If any of them
+ * fail the connection is closed, and the updates are retried later.
+ */
+static void sqlippool_flush(rlm_sqlippool_t *inst, rlm_sqlippool_thread_t *t)
+{
+	rlm_sql_handle_t	*handle;
+	char			query[MAX_QUERY_LEN];
+	uint32_t		i;
+
+	if (!t->queued) return;
+
+	handle = fr_pool_connection_get(inst->sql_inst->pool, NULL);
+	if (!handle) {
+		ERROR("Failed reserving SQL connection, delaying %u lease updates", t->queued);
+		return;
+	}
+
+	if (inst->allocate_begin && *inst->allocate_begin) {
+		sqlippool_expand(query, sizeof(query), inst->allocate_begin, inst, NULL, 0);
+		if (inst->sql_inst->sql_query(inst->sql_inst, NULL, &handle, query) < 0) goto error;
+		(inst->sql_inst->driver->sql_finish_query)(handle, inst->sql_inst->config);
+	}
+
+	for (i = 0; i < t->queued; i++) {
+		if (inst->sql_inst->sql_query(inst->sql_inst, NULL, &handle, t->queue[i]) < 0) goto error;
+		(inst->sql_inst->driver->sql_finish_query)(handle, inst->sql_inst->config);
+	}
+
+	if (inst->allocate_commit && *inst->allocate_commit) {
+		sqlippool_expand(query, sizeof(query), inst->allocate_commit, inst, NULL, 0);
+		if (inst->sql_inst->sql_query(inst->sql_inst, NULL, &handle, query) < 0) goto error;
+		(inst->sql_inst->driver->sql_finish_query)(handle, inst->sql_inst->config);
+	}
+
+	DEBUG2("Wrote %u lease updates", t->queued);
+
+	for (i = 0; i < t->queued; i++) talloc_free(t->queue[i]);
+	t->queued = 0;
+
+	fr_pool_connection_release(inst->sql_inst->pool, NULL, handle);
+	return;
+
+error:
+	ERROR("Failed writing %u lease updates, will retry", t->queued);
+
+	/*
+	 *	Don't leave a half finished transaction
+	 *	on a connection someone else will use.
+	 */
+	if (handle) fr_pool_connection_close(inst->sql_inst->pool, NULL, handle);
+}
+
+static void sqlippool_flush_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(uctx, rlm_sqlippool_thread_t);
+	rlm_sqlippool_t		*inst = t->inst;
+
+	sqlippool_flush(inst, t);
+
+	if (fr_event_timer_in(t, t->el, &t->ev, inst->flush_interval, sqlippool_flush_timer, t) < 0) {
+		ERROR("Failed inserting lease update timer");
+	}
+}
+
+/** Queue an expanded allocate_update query, writing the queue if it's full
+ *
+ */
+static void sqlippool_queue(rlm_sqlippool_t *inst, rlm_sqlippool_thread_t *t, char *query)
+{
+	if (t->queued >= talloc_array_length(t->queue)) {
+		MEM(t->queue = talloc_realloc(t, t->queue, char *, t->queued * 2));
+	}
+	t->queue[t->queued++] = talloc_steal(t->queue, query);
+
+	if (t->queued >= inst->flush_batch) sqlippool_flush(inst, t);
+}
+
+/** Allocate an address from a pool held in memory
+ *
+ * The pool is loaded from SQL the first time it's used.  The lease is
+ * written to SQL later, along with other leases allocated by this thread.
+ */
+static rlm_rcode_t sqlippool_memory_allocate(rlm_sqlippool_t *inst, rlm_sqlippool_thread_t *t,
+					     REQUEST *request, char const *pool_name)
+{
+	sqlippool_memory_t	*mem = inst->mem;
+	sqlippool_pool_t	find = { .name = pool_name }, *pool;
+	sqlippool_lease_t	*lease;
+	rlm_sql_handle_t	*handle;
+	VALUE_PAIR		*vp;
+	char			query[MAX_QUERY_LEN];
+	char			*expanded = NULL;
+	time_t			now = time(NULL);
+
+	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
+	if (!handle) {
+		REDEBUG("Failed reserving SQL connection");
+		return RLM_MODULE_FAIL;
+	}
+
+	if (inst->sql_inst->sql_set_user(inst->sql_inst, request, NULL) < 0) {
+	fail:
+		if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+		return RLM_MODULE_FAIL;
+	}
+
+	pthread_mutex_lock(&mem->mutex);
+	pool = rbtree_finddata(mem->pools, &find);
+	pthread_mutex_unlock(&mem->mutex);
+
+	if (!pool) {
+		switch (sqlippool_memory_load(&pool, inst, request, &handle, pool_name)) {
+		case 0:
+			fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+			RDEBUG2("IP address could not be allocated as no pool exists with that name");
+			return RLM_MODULE_NOOP;
+
+		case 1:
+			pool = sqlippool_memory_add(inst, pool);
+			break;
+
+		default:
+			goto fail;
+		}
+	}
+
+	/*
+	 *	Free addresses first, then any lease which
+	 *	has expired without being released.
+	 */
+	pthread_mutex_lock(&mem->mutex);
+	lease = fr_dlist_head(&pool->free);
+	if (lease) {
+		fr_dlist_remove(&pool->free, lease);
+	} else {
+		lease = fr_dlist_head(&pool->used);
+		if (lease && (lease->expires <= now)) {
+			fr_dlist_remove(&pool->used, lease);
+		} else {
+			lease = NULL;
+		}
+	}
+	if (lease) {
+		lease->expires = now + inst->lease_duration;
+		vp = fr_pair_find_by_da(request->packet->vps, attr_nas_ip_address, TAG_ANY);
+		if (vp) {
+			lease->nas = vp->vp_ip;
+		} else {
+			memset(&lease->nas, 0, sizeof(lease->nas));
+		}
+		fr_dlist_insert_tail(&pool->used, lease);
+	}
+	pthread_mutex_unlock(&mem->mutex);
+
+	if (!lease) {
+		fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+		RDEBUG2("pool appears to be full");
+		return do_logging(inst, request, inst->log_failed, RLM_MODULE_NOTFOUND);
+	}
+
+	MEM(vp = fr_pair_afrom_da(request->reply, inst->framed_ip_address));
+	if (fr_pair_value_from_str(vp, lease->addr, strlen(lease->addr), '\0', true) < 0) {
+		talloc_free(vp);
+		fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+
+		RDEBUG2("Invalid IP number [%s] in pool", lease->addr);
+		return do_logging(inst, request, inst->log_failed, RLM_MODULE_NOOP);
+	}
+
+	RDEBUG2("Allocated IP %s", lease->addr);
+	fr_pair_add(&request->reply->vps, vp);
+
+	/*
+	 *	Expand the update now, as it refers to the
+	 *	request, but write it later.
+	 */
+	if (inst->allocate_update && *inst->allocate_update) {
+		sqlippool_expand(query, sizeof(query), inst->allocate_update, inst,
+				 lease->addr, strlen(lease->addr));
+		if (xlat_aeval(t, &expanded, request, query, inst->sql_inst->sql_escape_func, handle) < 0) {
+			RPWDEBUG("Failed expanding allocate_update, lease will not be written");
+		} else {
+			sqlippool_queue(inst, t, expanded);
+		}
+	}
+
+	fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+
+	return do_logging(inst, request, inst->log_success, RLM_MODULE_OK);
+}
+
+static int _sqlippool_nas_clear(void *data, void *uctx)
+{
+	sqlippool_pool_t	*pool = data;
+	fr_ipaddr_t const	*nas = uctx;
+	sqlippool_lease_t	*lease, *next;
+
+	for (lease = fr_dlist_head(&pool->used); lease; lease = next) {
+		next = fr_dlist_next(&pool->used, lease);
+
+		if (fr_ipaddr_cmp(&lease->nas, nas) != 0) continue;
+
+		fr_dlist_remove(&pool->used, lease);
+		lease->expires = 0;
+		fr_dlist_insert_tail(&pool->free, lease);
+	}
+
+	return 0;
+}
+
+/** Apply an accounting packet to the leases held in memory
+ *
+ */
+static void sqlippool_memory_update(rlm_sqlippool_t *inst, REQUEST *request, int acct_status_type)
+{
+	sqlippool_memory_t	*mem = inst->mem;
+	sqlippool_lease_t	find, *lease;
+	VALUE_PAIR		*vp;
+	time_t			now = time(NULL);
+
+	switch (acct_status_type) {
+	/*
+	 *	The NAS has rebooted, all of its leases are free.
+	 */
+	case FR_STATUS_ACCOUNTING_ON:
+	case FR_STATUS_ACCOUNTING_OFF:
+		vp = fr_pair_find_by_da(request->packet->vps, attr_nas_ip_address, TAG_ANY);
+		if (!vp) return;
+
+		pthread_mutex_lock(&mem->mutex);
+		rbtree_walk(mem->pools, RBTREE_IN_ORDER, _sqlippool_nas_clear, &vp->vp_ip);
+		pthread_mutex_unlock(&mem->mutex);
+		return;
+
+	default:
+		break;
+	}
+
+	vp = fr_pair_find_by_da(request->packet->vps, inst->framed_ip_address, TAG_ANY);
+	if (!vp) return;
+
+	memset(&find, 0, sizeof(find));
+	find.ipaddr = vp->vp_ip;
+
+	pthread_mutex_lock(&mem->mutex);
+	lease = rbtree_finddata(mem->leases, &find);
+	if (lease) {
+		fr_dlist_remove(lease->expires ? &lease->pool->used : &lease->pool->free, lease);
+
+		if (acct_status_type == FR_STATUS_STOP) {
+			lease->expires = 0;
+			fr_dlist_insert_tail(&lease->pool->free, lease);
+		} else {
+			lease->expires = now + inst->lease_duration;
+			fr_dlist_insert_tail(&lease->pool->used, lease);
+		}
+	}
+	pthread_mutex_unlock(&mem->mutex);
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_sqlippool_t		*inst = talloc_get_type_abort(instance, rlm_sqlippool_t);
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(thread, rlm_sqlippool_thread_t);
+
+	t->inst = inst;
+	t->el = el;
+
+	if (!inst->memory) return 0;
+
+	MEM(t->queue = talloc_array(t, char *, inst->flush_batch));
+	if (fr_event_timer_in(t, el, &t->ev, inst->flush_interval, sqlippool_flush_timer, t) < 0) {
+		ERROR("Failed inserting lease update timer");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Write any lease updates still queued when the thread exits
+ *
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(thread, rlm_sqlippool_thread_t);
+	rlm_sqlippool_t		*inst = t->inst;
+
+	if (!inst->memory) return 0;
+
+	sqlippool_flush(inst, t);
+	if (t->queued) ERROR("Discarding %u lease updates", t->queued);
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_sqlippool_t		*inst = instance;
+
+	if (inst->mem) pthread_mutex_destroy(&inst->mem->mutex);
+
+	return 0;
+}
 
 /*
  *	Allocate an IP number from the pool.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, void *thread, REQUEST *request)
 {
 	rlm_sqlippool_t *inst = instance;
 	char allocation[FR_MAX_STRING_LEN];
@@ -497,12 +1061,15 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, UNUSED void *t
 		return do_logging(inst, request, inst->log_exists, RLM_MODULE_NOOP);
 	}
 
-	if (fr_pair_find_by_da(request->control, attr_pool_name, TAG_ANY) == NULL) {
+	vp = fr_pair_find_by_da(request->control, attr_pool_name, TAG_ANY);
+	if (!vp) {
 		RDEBUG2("No Pool-Name defined");
 
 		return do_logging(inst, request, inst->log_nopool, RLM_MODULE_NOOP);
 	}
 
+	if (inst->memory) return sqlippool_memory_allocate(inst, thread, request, vp->vp_strvalue);
+
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -732,7 +1299,9 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, UNUSED void *
 		rcode = mod_accounting_off(&handle, inst, request);
 		break;
 	}
-	fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+	if (handle) fr_pool_connection_release(inst->sql_inst->pool, request, handle);
+
+	if (inst->memory) sqlippool_memory_update(inst, request, acct_status_type);
 
 	return rcode;
 }
@@ -753,7 +1322,13 @@ module_t rlm_sqlippool = {
 	.type		= RLM_TYPE_THREAD_SAFE,
 	.inst_size	= sizeof(rlm_sqlippool_t),
 	.config		= module_config,
+	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
+	.thread_inst_size	= sizeof(rlm_sqlippool_thread_t),
+	.thread_inst_type	= "rlm_sqlippool_thread_t",
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_POST_AUTH]		= mod_post_auth
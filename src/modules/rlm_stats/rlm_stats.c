@@ -26,7 +26,6 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/io/listen.h>
-#include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/debug.h>
 
 #include <freeradius-devel/protocol/radius/freeradius.h>
@@ -38,43 +37,80 @@ RCSID("$Id$")
  *		statistics.
  */
 
-#include <pthread.h>
-
+/** Module instance
+ *
+ * The counters themselves are metrics, so each thread updates its own
+ * copy without locking, and they're only summed when a Status-Server
+ * request asks for them.  They're also available via "show metrics".
+ *
+ * Latency is recorded the same way, in histograms, and percentiles are
+ * estimated from the merged histograms when they're asked for.
+ */
 typedef struct {
-	pthread_mutex_t		mutex;
-	fr_dict_attr_t const	*type_da;			//!< FreeRADIUS-Stats4-Type
-	fr_dict_attr_t const	*ipv4_da;			//!< FreeRADIUS-Stats4-IPv4-Address
-	fr_dict_attr_t const	*ipv6_da;			//!< FreeRADIUS-Stats4-IPv6-Address
-	fr_dlist_head_t		list;				//!< for threads to know about each other
-
-	uint64_t		stats[FR_RADIUS_MAX_PACKET_CODE];
+	char const		*name;				//!< Instance name, escaped for use as a label.
+	fr_metric_t		*global;			//!< Packets by type.
+	fr_metric_t		*client;			//!< Packets by source address and type.
+	fr_metric_t		*listener;			//!< Packets by destination address and type.
+
+	struct {
+		bool		by_client;			//!< Record latency by client.
+		bool		by_address;			//!< Record latency by source and destination address.
+
+		fr_metric_t	*global;			//!< Latency by request type.
+		fr_metric_t	*client;			//!< Latency by client and request type.
+		fr_metric_t	*src;				//!< Latency by source address and request type.
+		fr_metric_t	*dst;				//!< Latency by destination address and request type.
+	} latency;
 } rlm_stats_t;
 
 typedef struct {
 	fr_ipaddr_t		ipaddr;				//!< IP address of this thing
 	fr_time_t		created;			//!< when it was created
 	fr_time_t		last_packet;			//!< when we last saw a packet
-	uint64_t		stats[FR_RADIUS_MAX_PACKET_CODE];	//!< actual statistic
+	fr_metric_series_t	*stats[FR_RADIUS_MAX_PACKET_CODE];	//!< actual statistic, created on first use
+	fr_metric_series_t	*latency[FR_RADIUS_MAX_PACKET_CODE];	//!< by request type, created on first use
 } rlm_stats_data_t;
 
 typedef struct {
-	rlm_stats_t		*inst;
+	char const		*name;				//!< Short name of the client.
+	fr_metric_series_t	*latency[FR_RADIUS_MAX_PACKET_CODE];	//!< by request type, created on first use
+} rlm_stats_client_t;
 
-	fr_time_t		last_global_update;
-	fr_dlist_t		entry;				//!< for threads to know about each other
-
-	fr_time_t		last_manage;			//!< when we deleted old things
+typedef struct {
+	rlm_stats_t		*inst;
 
-	rbtree_t		*src;				//!< stats by source
-	rbtree_t		*dst;				//!< stats by destination
+	rbtree_t		*src;				//!< stats by source, only used by this thread
+	rbtree_t		*dst;				//!< stats by destination, only used by this thread
+	rbtree_t		*clients;			//!< latency by client, only used by this thread
 
-	uint64_t		stats[FR_RADIUS_MAX_PACKET_CODE];
+	fr_metric_series_t	*stats[FR_RADIUS_MAX_PACKET_CODE];	//!< created on first use
+	fr_metric_series_t	*latency[FR_RADIUS_MAX_PACKET_CODE];	//!< created on first use
 } rlm_stats_thread_t;
 
+static const CONF_PARSER latency_config[] = {
+	{ FR_CONF_OFFSET("by_client", FR_TYPE_BOOL, rlm_stats_t, latency.by_client), .dflt = "yes" },
+	{ FR_CONF_OFFSET("by_address", FR_TYPE_BOOL, rlm_stats_t, latency.by_address), .dflt = "no" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
+	{ FR_CONF_POINTER("latency", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) latency_config },
 	CONF_PARSER_TERMINATOR
 };
 
+/** Percentiles returned in Status-Server responses
+ *
+ */
+static struct {
+	double		q;
+	char const	*name;
+} const stats_quantiles[] = {
+	{ 0.5,		"P50" },
+	{ 0.9,		"P90" },
+	{ 0.99,		"P99" },
+	{ 0.999,	"P999" },
+};
+
 static fr_dict_t const *dict_radius;
 
 extern fr_dict_autoload_t rlm_stats_dict[];
@@ -85,59 +121,289 @@ fr_dict_autoload_t rlm_stats_dict[] = {
 
 static fr_dict_attr_t const *attr_freeradius_stats4_ipv4_address;
 static fr_dict_attr_t const *attr_freeradius_stats4_ipv6_address;
+static fr_dict_attr_t const *attr_freeradius_stats4_name;
 static fr_dict_attr_t const *attr_freeradius_stats4_type;
 
 extern fr_dict_attr_autoload_t rlm_stats_dict_attr[];
 fr_dict_attr_autoload_t rlm_stats_dict_attr[] = {
 	{ .out = &attr_freeradius_stats4_ipv4_address, .name = "FreeRADIUS-Stats4-IPv4-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_radius },
 	{ .out = &attr_freeradius_stats4_ipv6_address, .name = "FreeRADIUS-Stats4-IPv6-Address", .type = FR_TYPE_IPV6_ADDR, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_name, .name = "FreeRADIUS-Stats4-Name", .type = FR_TYPE_STRING, .dict = &dict_radius },
 	{ .out = &attr_freeradius_stats4_type, .name = "FreeRADIUS-Stats4-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ NULL }
 };
 
-static void coalesce(uint64_t final_stats[FR_RADIUS_MAX_PACKET_CODE], rlm_stats_thread_t *t,
-		     size_t tree_offset, rlm_stats_data_t *mydata)
+/** Print the labels for a counter
+ *
+ * @param[out] out	Where to write the labels.
+ * @param[in] outlen	Size of out.
+ * @param[in] inst	Module instance.
+ * @param[in] ipaddr	Source or destination address.  NULL for the global counters.
+ * @param[in] client	Name of the client.  NULL unless this is for the per-client latency.
+ * @param[in] code	Packet code.
+ */
+static void stats_labels(char *out, size_t outlen, rlm_stats_t const *inst, fr_ipaddr_t const *ipaddr,
+			 char const *client, int code)
 {
-	rlm_stats_data_t *stats;
-	rlm_stats_thread_t *other;
-	rbtree_t **tree;
-	uint64_t local_stats[FR_RADIUS_MAX_PACKET_CODE];
+	char const	*type = fr_packet_codes[code];
+	char		buffer[FR_IPADDR_STRLEN], number[16];
 
-	tree = (rbtree_t **) (((uint8_t *) t) + tree_offset);
+	if (!type || !*type) {
+		snprintf(number, sizeof(number), "%i", code);
+		type = number;
+	}
 
-	/*
-	 *	Bootstrap with my statistics, where we don't need a
-	 *	lock.
-	 */
-	stats = rbtree_finddata(*tree, mydata);
+	if (client) {
+		char name[128];
+
+		fr_metric_label_escape(name, sizeof(name), client);
+		snprintf(out, outlen, "instance=\"%s\",client=\"%s\",type=\"%s\"", inst->name, name, type);
+		return;
+	}
+
+	if (!ipaddr) {
+		snprintf(out, outlen, "instance=\"%s\",type=\"%s\"", inst->name, type);
+		return;
+	}
+
+	snprintf(out, outlen, "instance=\"%s\",address=\"%s\",type=\"%s\"", inst->name,
+		 fr_inet_ntop(buffer, sizeof(buffer), ipaddr), type);
+}
+
+/** Increment a counter, creating the series if this thread hasn't used it before
+ *
+ */
+static void stats_inc(fr_metric_series_t **series, rlm_stats_t const *inst, fr_metric_t *metric,
+		      fr_ipaddr_t const *ipaddr, int code)
+{
+	if (!*series) {
+		char labels[256];
+
+		stats_labels(labels, sizeof(labels), inst, ipaddr, NULL, code);
+		*series = fr_metric_series(metric, labels);
+	}
+
+	fr_metric_inc(*series, 1);
+}
+
+/** Record the latency of a request, creating the series if this thread hasn't used it before
+ *
+ */
+static void stats_observe(fr_metric_series_t **series, rlm_stats_t const *inst, fr_metric_t *metric,
+			  fr_ipaddr_t const *ipaddr, char const *client, int code, fr_time_delta_t latency)
+{
+	if (!*series) {
+		char labels[384];
+
+		stats_labels(labels, sizeof(labels), inst, ipaddr, client, code);
+		*series = fr_metric_series(metric, labels);
+	}
+
+	fr_metric_observe(*series, latency);
+}
+
+/** Update the per-address statistics
+ *
+ * @param[in] request		being counted.
+ * @param[in] t			Thread instance.
+ * @param[in] tree		of per-address statistics.
+ * @param[in] metric		Packet counters for the addresses.
+ * @param[in] latency_metric	Latency for the addresses.  NULL if latency isn't recorded by address.
+ * @param[in] ipaddr		Source or destination address of the request.
+ * @param[in] src_code		Code of the request.
+ * @param[in] dst_code		Code of the reply.
+ * @param[in] latency		Of the request.
+ */
+static void stats_data_inc(REQUEST *request, rlm_stats_thread_t *t, rbtree_t *tree, fr_metric_t *metric,
+			   fr_metric_t *latency_metric, fr_ipaddr_t const *ipaddr, int src_code, int dst_code,
+			   fr_time_delta_t latency)
+{
+	rlm_stats_data_t mydata, *stats;
+
+	mydata.ipaddr = *ipaddr;
+	stats = rbtree_finddata(tree, &mydata);
 	if (!stats) {
-		memset(final_stats, 0, sizeof(uint64_t) * FR_RADIUS_MAX_PACKET_CODE);
-	} else {
-		memcpy(final_stats, stats->stats, sizeof(stats->stats));
+		MEM(stats = talloc_zero(t, rlm_stats_data_t));
+
+		stats->ipaddr = *ipaddr;
+		stats->created = request->async->recv_time;
+
+		(void) rbtree_insert(tree, stats);
 	}
 
-	/*
-	 *	Loop over all of the other thread instances, locking
-	 *	them, and adding their statistics in.
-	 */
-	for (other = fr_dlist_head(&t->inst->list);
-	     other != NULL;
-	     other = fr_dlist_next(&t->inst->list, other)) {
-		int i;
+	stats->last_packet = request->async->recv_time;
+	stats_inc(&stats->stats[src_code], t->inst, metric, &stats->ipaddr, src_code);
+	stats_inc(&stats->stats[dst_code], t->inst, metric, &stats->ipaddr, dst_code);
+
+	if (latency_metric) {
+		stats_observe(&stats->latency[src_code], t->inst, latency_metric, &stats->ipaddr, NULL,
+			      src_code, latency);
+	}
+}
 
-		if (other == t) continue;
+/** Update the per-client latency
+ *
+ */
+static void stats_client_observe(rlm_stats_thread_t *t, char const *name, int code, fr_time_delta_t latency)
+{
+	rlm_stats_client_t myclient, *client;
 
-		tree = (rbtree_t **) (((uint8_t *) other) + tree_offset);
-		stats = rbtree_finddata(*tree, mydata);
-		if (!stats) {
+	myclient.name = name;
+	client = rbtree_finddata(t->clients, &myclient);
+	if (!client) {
+		MEM(client = talloc_zero(t, rlm_stats_client_t));
+		client->name = talloc_typed_strdup(client, name);
+
+		(void) rbtree_insert(t->clients, client);
+	}
+
+	stats_observe(&client->latency[code], t->inst, t->inst->latency.client, NULL, client->name, code, latency);
+}
+
+/** Sum the counters for each packet code across all threads
+ *
+ */
+static void stats_sum(uint64_t final_stats[FR_RADIUS_MAX_PACKET_CODE], rlm_stats_t const *inst,
+		      fr_metric_t const *metric, fr_ipaddr_t const *ipaddr)
+{
+	int	i;
+	char	labels[256];
+
+	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
+		/*
+		 *	There's no attribute to report these in.
+		 */
+		if (!fr_packet_codes[i] || !*fr_packet_codes[i]) {
+			final_stats[i] = 0;
 			continue;
 		}
-		memcpy(&local_stats, stats->stats, sizeof(stats->stats));
 
-		for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
-			final_stats[i] += local_stats[i];
+		stats_labels(labels, sizeof(labels), inst, ipaddr, NULL, i);
+		final_stats[i] = fr_metric_sum(metric, labels);
+	}
+}
+
+/** Add latency percentiles for each type of request to the reply
+ *
+ */
+static void stats_latency_add(REQUEST *request, fr_cursor_t *cursor, rlm_stats_t const *inst,
+			      fr_metric_t const *metric, fr_ipaddr_t const *ipaddr, char const *client)
+{
+	int	i;
+	size_t	j;
+	char	labels[384];
+	char	buffer[128];
+
+	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
+		if (!fr_packet_codes[i] || !*fr_packet_codes[i]) continue;
+
+		stats_labels(labels, sizeof(labels), inst, ipaddr, client, i);
+
+		for (j = 0; j < NUM_ELEMENTS(stats_quantiles); j++) {
+			fr_dict_attr_t const	*da;
+			fr_time_delta_t		latency;
+			VALUE_PAIR		*vp;
+
+			snprintf(buffer, sizeof(buffer), "FreeRADIUS-Stats4-Latency-%s-%s",
+				 stats_quantiles[j].name, fr_packet_codes[i]);
+			da = fr_dict_attr_by_name(dict_radius, buffer);
+			if (!da) break;		/* Not a request type */
+
+			latency = fr_metric_quantile(metric, labels, stats_quantiles[j].q);
+			if (latency < 0) break;	/* No requests of this type */
+
+			MEM(vp = fr_pair_afrom_da(request->reply, da));
+			vp->vp_uint64 = fr_time_delta_to_usec(latency);
+
+			fr_cursor_append(cursor, vp);
+			(void) fr_cursor_tail(cursor);
+		}
+	}
+}
+
+/** Return a latency percentile, in microseconds
+ *
+ * The argument is a percentile, a request type, and optionally a client
+ * name, or a source or destination address.
+ *
+@verbatim
+%{stats:p99 Access-Request}
+%{stats:p99.9 Access-Request client <name>}
+%{stats:p50 Accounting-Request src <address>}
+%{stats:p50 Accounting-Request dst <address>}
+@endverbatim
+ *
+ * Expands to nothing if no requests of that type have been seen.
+ *
+ * @ingroup xlat_functions
+ */
+static ssize_t stats_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
+			  void const *mod_inst, UNUSED void const *xlat_inst,
+			  REQUEST *request, char const *fmt)
+{
+	rlm_stats_t const	*inst = mod_inst;
+	char			*argv[4], *end;
+	char			buffer[256], labels[384];
+	int			argc, code;
+	double			percentile;
+	fr_metric_t const	*metric = inst->latency.global;
+	fr_ipaddr_t		ipaddr, *ipaddr_p = NULL;
+	char const		*client = NULL;
+	fr_time_delta_t		latency;
+
+	strlcpy(buffer, fmt, sizeof(buffer));
+	argc = fr_dict_str_to_argv(buffer, argv, NUM_ELEMENTS(argv));
+	if ((argc != 2) && (argc != 4)) {
+	usage:
+		REDEBUG("Expected 'p<percentile> <type> [client <name>|src <address>|dst <address>]', got '%s'", fmt);
+		return -1;
+	}
+
+	if ((argv[0][0] != 'p') && (argv[0][0] != 'P')) goto usage;
+	percentile = strtod(argv[0] + 1, &end);
+	if (*end || (end == (argv[0] + 1)) || (percentile < 0) || (percentile > 100)) goto usage;
+
+	for (code = 1; code < FR_RADIUS_MAX_PACKET_CODE; code++) {
+		if (fr_packet_codes[code] && (strcasecmp(fr_packet_codes[code], argv[1]) == 0)) break;
+	}
+	if (code == FR_RADIUS_MAX_PACKET_CODE) {
+		REDEBUG("Unknown packet type '%s'", argv[1]);
+		return -1;
+	}
+
+	if (argc == 4) {
+		if (strcmp(argv[2], "client") == 0) {
+			if (!inst->latency.by_client) {
+				REDEBUG("Latency is not recorded by client");
+				return -1;
+			}
+			metric = inst->latency.client;
+			client = argv[3];
+
+		} else if ((strcmp(argv[2], "src") == 0) || (strcmp(argv[2], "dst") == 0)) {
+			if (!inst->latency.by_address) {
+				REDEBUG("Latency is not recorded by address");
+				return -1;
+			}
+			metric = (argv[2][0] == 's') ? inst->latency.src : inst->latency.dst;
+
+			if (fr_inet_pton(&ipaddr, argv[3], -1, AF_UNSPEC, false, true) < 0) {
+				RPEDEBUG("Invalid address '%s'", argv[3]);
+				return -1;
+			}
+			ipaddr_p = &ipaddr;
+
+		} else {
+			goto usage;
 		}
 	}
+
+	stats_labels(labels, sizeof(labels), inst, ipaddr_p, client, code);
+
+	latency = fr_metric_quantile(metric, labels, percentile / 100);
+	if (latency < 0) return 0;
+
+	return snprintf(*out, outlen, "%" PRId64, fr_time_delta_to_usec(latency));
 }
 
 
@@ -150,11 +416,13 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(void *instance, void *thread, REQU
 	uint32_t stats_type;
 	rlm_stats_thread_t *t = thread;
 	rlm_stats_t *inst = instance;
-	VALUE_PAIR *vp;
-	rlm_stats_data_t mydata, *stats;
+	VALUE_PAIR *vp, *name_vp = NULL;
 	fr_cursor_t cursor;
 	char buffer[64];
-	uint64_t local_stats[NUM_ELEMENTS(inst->stats)];
+	uint64_t local_stats[FR_RADIUS_MAX_PACKET_CODE];
+	fr_metric_t const *latency_metric = NULL;
+	fr_ipaddr_t const *latency_ipaddr = NULL;
+	char const *latency_client = NULL;
 
 	/*
 	 *	Increment counters only in "send foo" sections.
@@ -162,7 +430,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(void *instance, void *thread, REQU
 	 *	i.e. only when we have a reply to send.
 	 */
 	if (request->request_state == REQUEST_SEND) {
-		int src_code, dst_code;
+		int		src_code, dst_code;
+		fr_time_delta_t	latency;
 
 		src_code = request->packet->code;
 		if (src_code >= FR_RADIUS_MAX_PACKET_CODE) src_code = 0;
@@ -170,62 +439,32 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(void *instance, void *thread, REQU
 		dst_code = request->reply->code;
 		if (dst_code >= FR_RADIUS_MAX_PACKET_CODE) dst_code = 0;
 
-		t->stats[src_code]++;
-		t->stats[dst_code]++;
+		latency = fr_time() - request->async->recv_time;
 
-		/*
-		 *	Update source statistics
-		 */
-		mydata.ipaddr = request->packet->src_ipaddr;
-		stats = rbtree_finddata(t->src, &mydata);
-		if (!stats) {
-			MEM(stats = talloc_zero(t, rlm_stats_data_t));
-
-			stats->ipaddr = request->packet->src_ipaddr;
-			stats->created = request->async->recv_time;
+		stats_inc(&t->stats[src_code], inst, inst->global, NULL, src_code);
+		stats_inc(&t->stats[dst_code], inst, inst->global, NULL, dst_code);
+		stats_observe(&t->latency[src_code], inst, inst->latency.global, NULL, NULL, src_code, latency);
 
-			(void) rbtree_insert(t->src, stats);
+		if (inst->latency.by_client && request->client && request->client->shortname) {
+			stats_client_observe(t, request->client->shortname, src_code, latency);
 		}
 
-		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
+		/*
+		 *	Update source statistics
+		 */
+		stats_data_inc(request, t, t->src, inst->client, inst->latency.src,
+			       &request->packet->src_ipaddr, src_code, dst_code, latency);
 
 		/*
 		 *	Update destination statistics
 		 */
-		mydata.ipaddr = request->packet->dst_ipaddr;
-		stats = rbtree_finddata(t->dst, &mydata);
-		if (!stats) {
-			MEM(stats = talloc_zero(t, rlm_stats_data_t));
-
-			stats->ipaddr = request->packet->dst_ipaddr;
-			stats->created = request->async->recv_time;
-
-			(void) rbtree_insert(t->dst, stats);
-		}
-
-		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
+		stats_data_inc(request, t, t->dst, inst->listener, inst->latency.dst,
+			       &request->packet->dst_ipaddr, src_code, dst_code, latency);
 
 		/*
 		 *	@todo - periodically clean up old entries.
 		 */
 
-		if ((t->last_global_update + NSEC) > request->async->recv_time) {
-			return RLM_MODULE_UPDATED;
-		}
-
-		t->last_global_update = request->async->recv_time;
-
-		pthread_mutex_lock(&inst->mutex);
-		for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
-			inst->stats[i] += t->stats[i];
-			t->stats[i] = 0;
-		}
-		pthread_mutex_unlock(&inst->mutex);
-
 		return RLM_MODULE_UPDATED;
 	}
 
@@ -254,29 +493,36 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(void *instance, void *thread, REQU
 
 	switch (stats_type) {
 	case FR_FREERADIUS_STATS4_TYPE_VALUE_GLOBAL:			/* global */
-		/*
-		 *	Merge our stats with the global stats, and then copy
-		 *	the global stats to a thread-local variable.
-		 *
-		 *	The copy helps minimize mutex contention.
-		 */
-		pthread_mutex_lock(&inst->mutex);
-		for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
-			inst->stats[i] += t->stats[i];
-			t->stats[i] = 0;
-		}
-		memcpy(&local_stats, inst->stats, sizeof(inst->stats));
-		pthread_mutex_unlock(&inst->mutex);
+		stats_sum(local_stats, inst, inst->global, NULL);
+		latency_metric = inst->latency.global;
 		vp = NULL;
 		break;
 
 	case FR_FREERADIUS_STATS4_TYPE_VALUE_CLIENT:			/* src */
+		/*
+		 *	Latency can also be asked for by client name,
+		 *	but the counters are only kept by address.
+		 */
+		name_vp = fr_pair_find_by_da(request->packet->vps, attr_freeradius_stats4_name, TAG_ANY);
+		if (name_vp && inst->latency.by_client) {
+			latency_metric = inst->latency.client;
+			latency_client = name_vp->vp_strvalue;
+		}
+
 		vp = fr_pair_find_by_da(request->packet->vps, attr_freeradius_stats4_ipv4_address, TAG_ANY);
 		if (!vp) vp = fr_pair_find_by_da(request->packet->vps, attr_freeradius_stats4_ipv6_address, TAG_ANY);
-		if (!vp) return RLM_MODULE_NOOP;
+		if (!vp) {
+			if (!latency_client) return RLM_MODULE_NOOP;
+
+			memset(local_stats, 0, sizeof(local_stats));
+			break;
+		}
 
-		mydata.ipaddr = vp->vp_ip;
-		coalesce(local_stats, t, offsetof(rlm_stats_thread_t, src), &mydata);
+		stats_sum(local_stats, inst, inst->client, &vp->vp_ip);
+		if (!latency_client && inst->latency.by_address) {
+			latency_metric = inst->latency.src;
+			latency_ipaddr = &vp->vp_ip;
+		}
 		break;
 
 	case FR_FREERADIUS_STATS4_TYPE_VALUE_LISTENER:			/* dst */
@@ -284,8 +530,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(void *instance, void *thread, REQU
 		if (!vp) vp = fr_pair_find_by_da(request->packet->vps, attr_freeradius_stats4_ipv6_address, TAG_ANY);
 		if (!vp) return RLM_MODULE_NOOP;
 
-		mydata.ipaddr = vp->vp_ip;
-		coalesce(local_stats, t, offsetof(rlm_stats_thread_t, dst), &mydata);
+		stats_sum(local_stats, inst, inst->listener, &vp->vp_ip);
+		if (inst->latency.by_address) {
+			latency_metric = inst->latency.dst;
+			latency_ipaddr = &vp->vp_ip;
+		}
 		break;
 
 	default:
@@ -301,6 +550,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(void *instance, void *thread, REQU
 		}
 	}
 
+	if (latency_client) {
+		vp = fr_pair_copy(request->reply, name_vp);
+		if (vp) {
+			fr_cursor_append(&cursor, vp);
+			(void) fr_cursor_tail(&cursor);
+		}
+	}
+
 	strcpy(buffer, "FreeRADIUS-Stats4-");
 
 	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
@@ -319,6 +576,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_stats(void *instance, void *thread, REQU
 		(void) fr_cursor_tail(&cursor);
 	}
 
+	if (latency_metric) stats_latency_add(request, &cursor, inst, latency_metric, latency_ipaddr, latency_client);
+
 	return RLM_MODULE_OK;
 }
 
@@ -331,6 +590,14 @@ static int data_cmp(const void *one, const void *two)
 	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
 }
 
+static int client_cmp(const void *one, const void *two)
+{
+	rlm_stats_client_t const *a = one;
+	rlm_stats_client_t const *b = two;
+
+	return strcmp(a->name, b->name);
+}
+
 /** Instantiate thread data for the submodule.
  *
  */
@@ -343,57 +610,77 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
 
 	t->inst = inst;
 
-	t->src = rbtree_talloc_create(t, data_cmp, rlm_stats_data_t, NULL, RBTREE_FLAG_LOCK);
-	t->dst = rbtree_talloc_create(t, data_cmp, rlm_stats_data_t, NULL, RBTREE_FLAG_LOCK);
-
-	pthread_mutex_lock(&inst->mutex);
-	fr_dlist_insert_head(&inst->list, t);
-	pthread_mutex_unlock(&inst->mutex);
+	t->src = rbtree_talloc_create(t, data_cmp, rlm_stats_data_t, NULL, RBTREE_FLAG_NONE);
+	t->dst = rbtree_talloc_create(t, data_cmp, rlm_stats_data_t, NULL, RBTREE_FLAG_NONE);
+	t->clients = rbtree_talloc_create(t, client_cmp, rlm_stats_client_t, NULL, RBTREE_FLAG_NONE);
 
 	return 0;
 }
 
-
-/** Destroy thread data for the submodule.
- *
- */
-static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
-	rlm_stats_thread_t *t = talloc_get_type_abort(thread, rlm_stats_thread_t);
-	rlm_stats_t *inst = t->inst;
-	int i;
-
-	pthread_mutex_lock(&inst->mutex);
-	for (i = 0; i < FR_RADIUS_MAX_PACKET_CODE; i++) {
-		inst->stats[i] += t->stats[i];
+	rlm_stats_t	*inst = instance;
+	char const	*name;
+	char		buffer[128];
+
+	name = cf_section_name2(conf);
+	if (!name) name = cf_section_name1(conf);
+
+	fr_metric_label_escape(buffer, sizeof(buffer), name);
+	inst->name = talloc_typed_strdup(inst, buffer);
+
+	inst->global = fr_metric_register("freeradius_stats_packets",
+					  "Packets seen by the stats module, by type.",
+					  FR_METRIC_COUNTER);
+	inst->client = fr_metric_register("freeradius_stats_client_packets",
+					  "Packets seen by the stats module, by source address and type.",
+					  FR_METRIC_COUNTER);
+	inst->listener = fr_metric_register("freeradius_stats_listener_packets",
+					    "Packets seen by the stats module, by destination address and type.",
+					    FR_METRIC_COUNTER);
+	if (!inst->global || !inst->client || !inst->listener) {
+	error:
+		cf_log_perr(conf, "Failed registering metrics");
+		return -1;
 	}
-	fr_dlist_remove(&inst->list, t);
-	pthread_mutex_unlock(&inst->mutex);
-
-	return 0;
-}
 
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
-{
-	rlm_stats_t	*inst = instance;
+	inst->latency.global = fr_metric_register("freeradius_stats_latency_seconds",
+						  "Time from receiving a request to sending the reply, by request type.",
+						  FR_METRIC_HISTOGRAM);
+	if (!inst->latency.global) goto error;
+
+	if (inst->latency.by_client) {
+		inst->latency.client = fr_metric_register("freeradius_stats_client_latency_seconds",
+							  "Time from receiving a request to sending the reply, "
+							  "by client and request type.",
+							  FR_METRIC_HISTOGRAM);
+		if (!inst->latency.client) goto error;
+	}
 
-	pthread_mutex_init(&inst->mutex, NULL);
-	fr_dlist_init(&inst->list, rlm_stats_thread_t, entry);
+	if (inst->latency.by_address) {
+		inst->latency.src = fr_metric_register("freeradius_stats_source_latency_seconds",
+						       "Time from receiving a request to sending the reply, "
+						       "by source address and request type.",
+						       FR_METRIC_HISTOGRAM);
+		inst->latency.dst = fr_metric_register("freeradius_stats_listener_latency_seconds",
+						       "Time from receiving a request to sending the reply, "
+						       "by destination address and request type.",
+						       FR_METRIC_HISTOGRAM);
+		if (!inst->latency.src || !inst->latency.dst) goto error;
+	}
 
 	return 0;
 }
 
-/*
- *	Only free memory we allocated.  The strings allocated via
- *	cf_section_parse() do not need to be freed.
- */
-static int mod_detach(void *instance)
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
-	rlm_stats_t *inst = talloc_get_type_abort(instance, rlm_stats_t);
+	char const *name;
+
+	name = cf_section_name2(conf);
+	if (!name) name = cf_section_name1(conf);
 
-	pthread_mutex_destroy(&inst->mutex);
+	xlat_register(instance, name, stats_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN, true);
 
-	/* free things here */
 	return 0;
 }
 
@@ -414,10 +701,9 @@ module_t rlm_stats = {
 	.inst_size		= sizeof(rlm_stats_t),
 	.thread_inst_size	= sizeof(rlm_stats_thread_t),
 	.config			= module_config,
+	.bootstrap		= mod_bootstrap,
 	.instantiate		= mod_instantiate,
-	.detach			= mod_detach,
 	.thread_instantiate	= mod_thread_instantiate,
-	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_stats, /* @mod_stats_query */
 		[MOD_POST_AUTH]		= mod_stats,
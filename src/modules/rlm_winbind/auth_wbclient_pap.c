@@ -35,100 +35,124 @@ RCSID("$Id$")
 #include "rlm_winbind.h"
 #include "auth_wbclient_pap.h"
 
-/** PAP authentication direct to winbind via Samba's libwbclient library
- *
- * @param[in] inst Module instance
- * @param[in] request The current request
- * @param[in] password the User-Password
+/** Copy everything a PAP authentication needs out of the request
  *
+ * @param[in] ctx	to allocate the authentication context in.
+ * @param[in] inst	Module instance.
+ * @param[in] request	The current request.
+ * @param[in] password	the User-Password.
  * @return
- *	- 0	Success
- *	- -1	Authentication failure
- *	- -648	Password expired
- *
+ *	- The authentication context.
+ *	- NULL if the username or domain couldn't be expanded.
  */
-int do_auth_wbclient_pap(rlm_winbind_t const *inst, REQUEST *request, VALUE_PAIR *password)
+winbind_auth_ctx_t *winbind_auth_prepare(TALLOC_CTX *ctx, rlm_winbind_t const *inst, REQUEST *request,
+					 VALUE_PAIR *password)
 {
-	int rcode = -1;
-	struct wbcContext *wb_ctx;
-	struct wbcAuthUserParams authparams;
-	wbcErr err;
-	int len;
-	struct wbcAuthUserInfo *info = NULL;
-	struct wbcAuthErrorInfo *error = NULL;
-	char user_name_buf[500];
-	char domain_name_buf[500];
+	winbind_auth_ctx_t		*actx;
+	struct wbcAuthUserParams	*authparams;
+	ssize_t				slen;
 
 	/*
-	 * Clear the auth parameters - this is important, as
-	 * there are options that will cause wbcAuthenticateUserEx
-	 * to bomb out if not zero.
+	 * wb_username must be set for this function to be called
 	 */
-	memset(&authparams, 0, sizeof(authparams));
+	fr_assert(inst->wb_username);
 
 	/*
-	 * wb_username must be set for this function to be called
+	 * Zeroing clears the auth parameters - this is important,
+	 * as there are options that will cause wbcAuthenticateUserEx
+	 * to bomb out if not zero.
 	 */
-	fr_assert(inst->wb_username);
+	MEM(actx = talloc_zero(ctx, winbind_auth_ctx_t));
+	authparams = &actx->authparams;
 
 	/*
 	 * Get the username and domain from the configuration
 	 */
-	len = tmpl_expand(&authparams.account_name, user_name_buf, sizeof(user_name_buf),
-			  request, inst->wb_username, NULL, NULL);
-	if (len < 0) {
+	slen = tmpl_aexpand(actx, &authparams->account_name, request, inst->wb_username, NULL, NULL);
+	if (slen < 0) {
 		REDEBUG2("Unable to expand winbind_username");
-		goto done;
+		goto error;
 	}
 
 	if (inst->wb_domain) {
-		len = tmpl_expand(&authparams.domain_name, domain_name_buf, sizeof(domain_name_buf),
-				  request, inst->wb_domain, NULL, NULL);
-		if (len < 0) {
+		slen = tmpl_aexpand(actx, &authparams->domain_name, request, inst->wb_domain, NULL, NULL);
+		if (slen < 0) {
 			REDEBUG2("Unable to expand winbind_domain");
-			goto done;
+		error:
+			talloc_free(actx);
+			return NULL;
 		}
 	} else {
 		RWDEBUG2("No domain specified; authentication may fail because of this");
 	}
 
-
 	/*
 	 * Build the wbcAuthUserParams structure with what we know
 	 */
-	authparams.level = WBC_AUTH_USER_LEVEL_PLAIN;
-	authparams.password.plaintext = password->data.vb_strvalue;
+	authparams->level = WBC_AUTH_USER_LEVEL_PLAIN;
+	MEM(authparams->password.plaintext = talloc_bstrndup(actx, password->vp_strvalue, password->vp_length));
 
 	/*
 	 * Parameters documented as part of the MSV1_0_SUBAUTH_LOGON structure
 	 * at https://msdn.microsoft.com/aa378767.aspx
 	 */
-	authparams.parameter_control |= WBC_MSV1_0_CLEARTEXT_PASSWORD_ALLOWED |
-					WBC_MSV1_0_ALLOW_WORKSTATION_TRUST_ACCOUNT |
-					WBC_MSV1_0_ALLOW_SERVER_TRUST_ACCOUNT;
+	authparams->parameter_control |= WBC_MSV1_0_CLEARTEXT_PASSWORD_ALLOWED |
+					 WBC_MSV1_0_ALLOW_WORKSTATION_TRUST_ACCOUNT |
+					 WBC_MSV1_0_ALLOW_SERVER_TRUST_ACCOUNT;
 
-	/*
-	 * Send auth request across to winbind
-	 */
-	wb_ctx = fr_pool_connection_get(inst->wb_pool, request);
-	if (wb_ctx == NULL) {
-		RERROR("Unable to get winbind connection from pool");
-		goto done;
-	}
+	RDEBUG2("Sending authentication request user='%s' domain='%s'", authparams->account_name,
+									authparams->domain_name);
 
-	RDEBUG2("Sending authentication request user='%s' domain='%s'", authparams.account_name,
-									authparams.domain_name);
+	return actx;
+}
 
-	err = wbcCtxAuthenticateUserEx(wb_ctx, &authparams, &info, &error);
+/** Send a prepared PAP authentication to winbind
+ *
+ * Doesn't access the request, so may be run by a winbind executor thread.
+ *
+ * @param[in] wb_ctx	libwbclient context to use.
+ * @param[in] actx	Prepared authentication.  Updated with the result.
+ * @return The wbcErr.
+ */
+int winbind_auth_run(struct wbcContext *wb_ctx, winbind_auth_ctx_t *actx)
+{
+	struct wbcAuthUserInfo	*info = NULL;
+	struct wbcAuthErrorInfo	*error = NULL;
 
-	fr_pool_connection_release(inst->wb_pool, request, wb_ctx);
+	actx->err = wbcCtxAuthenticateUserEx(wb_ctx, &actx->authparams, &info, &error);
+	if (error) {
+		actx->have_error = true;
+		actx->nt_status = error->nt_status;
+		if (error->display_string) {
+			strlcpy(actx->display_string, error->display_string, sizeof(actx->display_string));
+			actx->have_display_string = true;
+		}
+	}
+
+	if (info) wbcFreeMemory(info);
+	if (error) wbcFreeMemory(error);
 
+	return actx->err;
+}
+
+/** Process the result of a PAP authentication
+ *
+ * @param[in] request	The current request.
+ * @param[in] actx	Authentication run by #winbind_auth_run.
+ * @return
+ *	- 0	Success
+ *	- -1	Authentication failure
+ *	- -648	Password expired
+ */
+int winbind_auth_result(REQUEST *request, winbind_auth_ctx_t *actx)
+{
+	int rcode = -1;
 
 	/*
 	 * Try and give some useful feedback on what happened. There are only
 	 * a few errors that can actually be returned from wbcCtxAuthenticateUserEx.
 	 */
-	switch (err) {
+	switch (actx->err) {
 	case WBC_ERR_SUCCESS:
 		rcode = 0;
 		RDEBUG2("Authenticated successfully");
@@ -145,7 +169,7 @@ int do_auth_wbclient_pap(rlm_winbind_t const *inst, REQUEST *request, VALUE_PAIR
 		break;
 
 	case WBC_ERR_AUTH_ERROR:
-		if (!error) {
+		if (!actx->have_error) {
 			REDEBUG2("Authentication failed");
 			break;
 		}
@@ -153,18 +177,18 @@ int do_auth_wbclient_pap(rlm_winbind_t const *inst, REQUEST *request, VALUE_PAIR
 		/*
 		 * The password needs to be changed, set rcode appropriately.
 		 */
-		if (error->nt_status == NT_STATUS_PASSWORD_EXPIRED ||
-		    error->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE) {
+		if (actx->nt_status == NT_STATUS_PASSWORD_EXPIRED ||
+		    actx->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE) {
 			rcode = -648;
 		}
 
 		/*
 		 * Return the NT_STATUS human readable error string, if there is one.
 		 */
-		if (error->display_string) {
-			REDEBUG2("%s [0x%X]", error->display_string, error->nt_status);
+		if (actx->have_display_string) {
+			REDEBUG2("%s [0x%X]", actx->display_string, actx->nt_status);
 		} else {
-			REDEBUG2("Unknown authentication failure [0x%X]", error->nt_status);
+			REDEBUG2("Unknown authentication failure [0x%X]", actx->nt_status);
 		}
 		break;
 
@@ -175,19 +199,57 @@ int do_auth_wbclient_pap(rlm_winbind_t const *inst, REQUEST *request, VALUE_PAIR
 		 *   WBC_ERR_NO_MEMORY
 		 * neither of which are particularly likely.
 		 */
-		if (error && error->display_string) {
-			REDEBUG2("Failed authenticating user: %s (%s)", error->display_string, wbcErrorString(err));
+		if (actx->have_display_string) {
+			REDEBUG2("Failed authenticating user: %s (%s)", actx->display_string, wbcErrorString(actx->err));
 		} else {
-			REDEBUG2("Failed authenticating user: Winbind error (%s)", wbcErrorString(err));
+			REDEBUG2("Failed authenticating user: Winbind error (%s)", wbcErrorString(actx->err));
 		}
 		break;
 	}
 
+	return rcode;
+}
 
-done:
-	if (info) wbcFreeMemory(info);
-	if (error) wbcFreeMemory(error);
+/** PAP authentication direct to winbind via Samba's libwbclient library
+ *
+ * Blocks the worker until winbind responds.  Used when no winbind
+ * executor threads are configured.
+ *
+ * @param[in] inst Module instance
+ * @param[in] request The current request
+ * @param[in] password the User-Password
+ *
+ * @return
+ *	- 0	Success
+ *	- -1	Authentication failure
+ *	- -648	Password expired
+ *
+ */
+int do_auth_wbclient_pap(rlm_winbind_t const *inst, REQUEST *request, VALUE_PAIR *password)
+{
+	int			rcode;
+	struct wbcContext	*wb_ctx;
+	winbind_auth_ctx_t	*actx;
+
+	actx = winbind_auth_prepare(NULL, inst, request, password);
+	if (!actx) return -1;
+
+	/*
+	 * Send auth request across to winbind
+	 */
+	wb_ctx = fr_pool_connection_get(inst->wb_pool, request);
+	if (wb_ctx == NULL) {
+		RERROR("Unable to get winbind connection from pool");
+		talloc_free(actx);
+		return -1;
+	}
+
+	winbind_auth_run(wb_ctx, actx);
+
+	fr_pool_connection_release(inst->wb_pool, request, wb_ctx);
+
+	rcode = winbind_auth_result(request, actx);
+	talloc_free(actx);
 
 	return rcode;
 }
-
@@ -4,4 +4,24 @@
 
 RCSIDH(auth_wbclient_h, "$Id$")
 
+/** A PAP authentication, prepared in the worker, and run by a winbind executor
+ *
+ */
+typedef struct {
+	struct wbcAuthUserParams	authparams;		//!< Strings are children of this struct.
+
+	wbcErr				err;			//!< Result of the call.
+	bool				have_error;		//!< Whether winbind returned error info.
+	uint32_t			nt_status;		//!< From the error info.
+	char				display_string[256];	//!< From the error info.
+	bool				have_display_string;	//!< Whether display_string is valid.
+} winbind_auth_ctx_t;
+
+winbind_auth_ctx_t *winbind_auth_prepare(TALLOC_CTX *ctx, rlm_winbind_t const *inst, REQUEST *request,
+					 VALUE_PAIR *password);
+
+int winbind_auth_run(struct wbcContext *wb_ctx, winbind_auth_ctx_t *actx);
+
+int winbind_auth_result(REQUEST *request, winbind_auth_ctx_t *actx);
+
 int do_auth_wbclient_pap(rlm_winbind_t const *inst, REQUEST *request, VALUE_PAIR *password);
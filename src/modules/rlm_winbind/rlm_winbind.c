@@ -29,6 +29,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 
 #include "rlm_winbind.h"
@@ -47,6 +48,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("username", FR_TYPE_TMPL, rlm_winbind_t, wb_username) },
 	{ FR_CONF_OFFSET("domain", FR_TYPE_TMPL, rlm_winbind_t, wb_domain) },
 	{ FR_CONF_POINTER("group", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) group_config },
+	{ FR_CONF_OFFSET("async", FR_TYPE_SUBSECTION, rlm_winbind_t, async), .subcs = (void const *) fr_offload_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -315,6 +317,33 @@ static void *mod_conn_create(TALLOC_CTX *ctx, UNUSED void *instance, UNUSED fr_t
 }
 
 
+/** Create a winbind executor's context
+ *
+ * @param[in] uctx	unused.
+ * @return libwbclient context, or NULL on error.
+ */
+static void *mod_offload_resource_alloc(UNUSED void *uctx)
+{
+	struct wbcContext *wb_ctx;
+
+	wb_ctx = wbcCtxCreate();
+	if (!wb_ctx) fr_strerror_printf("Failed to create winbind context");
+
+	return wb_ctx;
+}
+
+
+/** Free a winbind executor's context
+ *
+ * @param[in] resource	libwbclient context.
+ * @param[in] uctx	unused.
+ */
+static void mod_offload_resource_free(void *resource, UNUSED void *uctx)
+{
+	wbcCtxFree(resource);
+}
+
+
 /** Bootstrap this module
  *
  * Register pair compare function for Winbind-Group fake attribute
@@ -385,6 +414,23 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	/*
+	 *	Hand authentications to dedicated threads, so
+	 *	workers don't block waiting for the DC.
+	 */
+	if (inst->async.num_threads) {
+		CONF_SECTION *async_cs = cf_section_find(conf, "async", NULL);
+
+		if (fr_offload_conf_check(async_cs ? async_cs : conf, &inst->async) < 0) return -1;
+
+		inst->offload = fr_offload_alloc(inst, &inst->async, inst->name,
+						 mod_offload_resource_alloc, mod_offload_resource_free, NULL);
+		if (!inst->offload) {
+			cf_log_perr(conf, "Unable to initialise winbind executors");
+			return -1;
+		}
+	}
+
 	/*
 	 *	If the domain has not been specified, try and find
 	 *	out what it is from winbind.
@@ -431,6 +477,34 @@ no_domain:
 }
 
 
+/** Connect this thread to the winbind executors
+ *
+ * @param[in] conf	Module configuration.
+ * @param[in] instance	This module's instance.
+ * @param[in] el	Thread's event list.
+ * @param[in] thread	Thread specific data.
+ *
+ * @return
+ *	- 0	success
+ *	- -1	failure
+ */
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_winbind_t		*inst = instance;
+	rlm_winbind_thread_t	*t = talloc_get_type_abort(thread, rlm_winbind_thread_t);
+
+	if (!inst->offload) return 0;
+
+	t->offload = fr_offload_thread_alloc(t, inst->offload, el);
+	if (!t->offload) {
+		cf_log_perr(conf, "Failed connecting to winbind executors");
+		return -1;
+	}
+
+	return 0;
+}
+
+
 /** Tidy up module instance
  *
  * Frees up the libwbclient connection pool.
@@ -478,7 +552,67 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 }
 
 
+static void mod_authenticate_complete(REQUEST *request, UNUSED fr_offload_req_t *oreq, UNUSED void *uctx)
+{
+	unlang_interpret_resumable(request);
+}
+
+static int _mod_authenticate_run(void *resource, void *data)
+{
+	return winbind_auth_run(resource, talloc_get_type_abort(data, winbind_auth_ctx_t));
+}
+
+/** Process the result of an authentication run by a winbind executor
+ *
+ * @param[in] instance	Module instance.
+ * @param[in] thread	Thread specific data.
+ * @param[in] request	The current request.
+ * @param[in] rctx	The offloaded call.
+ *
+ * @return One of the RLM_MODULE_* values
+ */
+static rlm_rcode_t mod_authenticate_resume(UNUSED void *instance, UNUSED void *thread, REQUEST *request, void *rctx)
+{
+	fr_offload_req_t	*oreq = talloc_get_type_abort(rctx, fr_offload_req_t);
+	rlm_rcode_t		rcode = RLM_MODULE_REJECT;
+	void			*data;
+
+	switch (fr_offload_req_result(NULL, &data, oreq)) {
+	case FR_OFFLOAD_REQ_DONE:
+		if (winbind_auth_result(request, talloc_get_type_abort(data, winbind_auth_ctx_t)) == 0) {
+			REDEBUG2("User authenticated successfully using winbind");
+			rcode = RLM_MODULE_OK;
+		}
+		break;
+
+	case FR_OFFLOAD_REQ_TIMEOUT:
+		REDEBUG("Timeout waiting for winbind");
+		rcode = RLM_MODULE_FAIL;
+		break;
+
+	default:
+		REDEBUG("Winbind call failed");
+		rcode = RLM_MODULE_FAIL;
+		break;
+	}
+
+	talloc_free(oreq);
+
+	return rcode;
+}
+
+static void mod_authenticate_signal(UNUSED void *instance, UNUSED void *thread, UNUSED REQUEST *request,
+				    void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(rctx);
+}
+
 /** Authenticate the user via libwbclient and winbind
+ *
+ * If executor threads are configured, the call is queued for them
+ * and the request yields.  Otherwise the worker blocks.
  *
  * @param[in] instance	Module instance
  * @param[in] thread	Thread specific data.
@@ -486,9 +620,10 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
  *
  * @return One of the RLM_MODULE_* values
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, void *thread, REQUEST *request)
 {
 	rlm_winbind_t const *inst = instance;
+	rlm_winbind_thread_t *t = talloc_get_type_abort(thread, rlm_winbind_thread_t);
 	VALUE_PAIR *username, *password;
 
 	username = fr_pair_find_by_da(request->packet->vps, attr_user_name, TAG_ANY);
@@ -525,6 +660,24 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 		RDEBUG2("Login attempt with password");
 	}
 
+	if (t->offload) {
+		winbind_auth_ctx_t	*actx;
+		fr_offload_req_t	*oreq;
+
+		actx = winbind_auth_prepare(NULL, inst, request, password);
+		if (!actx) return RLM_MODULE_REJECT;
+
+		/*
+		 *	Concurrency is limited per domain, so one
+		 *	unresponsive DC can't starve the others.
+		 */
+		oreq = fr_offload_enqueue(t->offload, request, actx->authparams.domain_name,
+					  _mod_authenticate_run, actx, mod_authenticate_complete, NULL);
+		if (!oreq) return RLM_MODULE_FAIL;
+
+		return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, oreq);
+	}
+
 	/*
 	 *	Authenticate and return OK if successful. No need for
 	 *	many debug outputs or errors as the auth function is
@@ -553,8 +706,10 @@ module_t rlm_winbind = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "winbind",
 	.inst_size	= sizeof(rlm_winbind_t),
+	.thread_inst_size	= sizeof(rlm_winbind_thread_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.bootstrap	= mod_bootstrap,
 	.detach		= mod_detach,
 	.methods = {
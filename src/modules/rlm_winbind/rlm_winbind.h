@@ -3,6 +3,7 @@
 
 #include "config.h"
 #include <wbclient.h>
+#include <freeradius-devel/server/offload.h>
 #include <freeradius-devel/server/pool.h>
 
 /*
@@ -17,8 +18,16 @@ typedef struct {
 	vp_tmpl_t		*wb_username;
 	vp_tmpl_t		*wb_domain;
 
+	/* async config */
+	fr_offload_conf_t	async;		//!< Winbind executor configuration.
+	fr_offload_t		*offload;	//!< Winbind executors.  NULL if calls are synchronous.
+
 	/* group config */
 	vp_tmpl_t		*group_username;
 	bool			group_add_domain;
 	char const		*group_attribute;
 } rlm_winbind_t;
+
+typedef struct {
+	fr_offload_thread_t	*offload;	//!< This thread's handle for the winbind executors.
+} rlm_winbind_thread_t;
@@ -0,0 +1,334 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_yubikey/replay.c
+ * @brief Replay detection shared between servers, using Redis.
+ *
+ * The highest counter accepted for each token is stored in Redis, and
+ * checked and updated atomically by a script, so an OTP accepted by one
+ * server is rejected by every other server using the same Redis cluster.
+ *
+ * Each thread also remembers the counters it has seen recently.  An OTP
+ * whose counter is no higher than one of those can't be valid, so it's
+ * rejected without asking Redis.
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_yubikey (%s) - "
+#define LOG_PREFIX_ARGS inst->name
+
+#include "rlm_yubikey.h"
+
+#ifdef WITH_YUBIKEY_REPLAY
+#include <freeradius-devel/util/debug.h>
+
+/** Record a counter if it's higher than the last one seen for the token
+ *
+ * - KEYS[1] the token.
+ * - ARGV[1] the counter from the OTP.
+ * - ARGV[2] how long to keep the counter for, 0 for forever.
+ *
+ * Returns -1 if the counter was recorded, else the last counter seen.
+ */
+static char const replay_script[] =
+	"local last = tonumber(redis.call('GET', KEYS[1]))\n"
+	"if last and (last >= tonumber(ARGV[1])) then\n"
+	"  return last\n"
+	"end\n"
+	"if tonumber(ARGV[2]) > 0 then\n"
+	"  redis.call('SET', KEYS[1], ARGV[1], 'EX', ARGV[2])\n"
+	"else\n"
+	"  redis.call('SET', KEYS[1], ARGV[1])\n"
+	"end\n"
+	"return -1\n";
+
+/** The last counter a thread saw for a token
+ *
+ */
+typedef struct {
+	uint32_t		counter;	//!< Highest counter seen.
+} yubikey_counter_t;
+
+/** A check against the shared replay cache
+ *
+ */
+struct yubikey_replay_s {
+	rlm_yubikey_t const	*inst;		//!< Module instance.
+	fr_redis_command_set_t	*cmds;		//!< Commands in flight, NULL once the trunk has
+						//!< called us back.
+
+	char			key[256];	//!< Identifies the token.
+	uint32_t		counter;	//!< From the OTP.
+	char			counter_str[16];
+	char			ttl_str[16];
+	char const		*argv[6];	//!< EVAL command.
+
+	bool			synced;		//!< Whether we've used the connection pool.
+	fr_redis_rcode_t	status;		//!< Of the command.
+	int64_t			last;		//!< Counter Redis had, or -1 if ours was recorded.
+};
+
+/** Record the highest counter seen for a token
+ *
+ */
+static void replay_counter_update(rlm_yubikey_thread_t *t, char const *key, uint32_t counter)
+{
+	yubikey_counter_t	*found;
+
+	found = fr_lru_insert(t->counters, key, yubikey_counter_t);
+	if (found && (counter > found->counter)) found->counter = counter;
+}
+
+/** Interpret the reply to the script
+ *
+ */
+static fr_redis_rcode_t replay_reply(REQUEST *request, redisReply *reply, void *uctx)
+{
+	yubikey_replay_t	*replay = talloc_get_type_abort(uctx, yubikey_replay_t);
+
+	fr_redis_reply_print(L_DBG_LVL_3, reply, request, 0);
+
+	if (reply->type != REDIS_REPLY_INTEGER) {
+		REDEBUG("Expected type \"integer\" got type \"%s\"",
+			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
+		return REDIS_RCODE_ERROR;
+	}
+
+	replay->last = reply->integer;
+
+	return REDIS_RCODE_SUCCESS;
+}
+
+/** Run the script over the connection pool
+ *
+ */
+static fr_redis_rcode_t replay_sync(yubikey_replay_t *replay, REQUEST *request)
+{
+	replay->synced = true;
+
+	return fr_redis_trunk_sync(replay->inst->replay.cluster, request,
+				   (uint8_t const *)replay->key, strlen(replay->key),
+				   NUM_ELEMENTS(replay->argv), replay->argv, replay_reply, replay);
+}
+
+static void replay_async_complete(REQUEST *request, fr_dlist_head_t *completed, void *uctx)
+{
+	yubikey_replay_t	*replay = talloc_get_type_abort(uctx, yubikey_replay_t);
+	redisReply		*reply;
+
+	replay->cmds = NULL;	/* Freed by the trunk */
+
+	replay->status = fr_redis_command_reply(&reply, request, fr_dlist_head(completed));
+	if (replay->status == REDIS_RCODE_SUCCESS) replay->status = replay_reply(request, reply, replay);
+
+	unlang_interpret_resumable(request);
+}
+
+static void replay_async_fail(REQUEST *request, UNUSED fr_dlist_head_t *completed, void *uctx)
+{
+	yubikey_replay_t	*replay = talloc_get_type_abort(uctx, yubikey_replay_t);
+
+	replay->cmds = NULL;	/* Freed by the trunk */
+	replay->status = REDIS_RCODE_RECONNECT;
+
+	unlang_interpret_resumable(request);
+}
+
+/** Check an OTP's counter against the shared replay cache
+ *
+ * @param[out] out		Set to the check in progress if the caller should
+ *				yield, and call #rlm_yubikey_replay_result when resumed.
+ *				NULL if the check completed without waiting for Redis.
+ * @param[in] inst		Module configuration.
+ * @param[in] t			Thread specific data.
+ * @param[in] request		The current request.
+ * @param[in] public_id		modhex Public ID from the OTP.
+ * @param[in] public_id_len	Length of public_id.
+ * @param[in] private_id	decrypted from the OTP.
+ * @param[in] private_id_len	Length of private_id.
+ * @param[in] counter		decrypted from the OTP.
+ * @return
+ *	- RLM_MODULE_OK if out was set, or the counter was recorded.
+ *	- RLM_MODULE_REJECT if the OTP has been seen before.
+ *	- RLM_MODULE_FAIL if Redis couldn't be queried.
+ */
+rlm_rcode_t rlm_yubikey_replay_check(yubikey_replay_t **out, rlm_yubikey_t const *inst, rlm_yubikey_thread_t *t,
+				     REQUEST *request, char const *public_id, size_t public_id_len,
+				     uint8_t const *private_id, size_t private_id_len, uint32_t counter)
+{
+	yubikey_replay_t	*replay;
+	yubikey_counter_t	*found;
+	fr_redis_command_set_t	*cmds;
+	fr_redis_trunk_t	*trunk;
+	char			hex[(YUBIKEY_TOKEN_LEN * 2) + 1];
+
+	*out = NULL;
+
+	MEM(replay = talloc_zero(request, yubikey_replay_t));
+	replay->inst = inst;
+	replay->counter = counter;
+
+	/*
+	 *	The Private ID is covered by the token's CRC,
+	 *	so an attacker can't avoid detection by changing
+	 *	the Public ID in front of a captured OTP.
+	 */
+	if (private_id_len > YUBIKEY_TOKEN_LEN) private_id_len = YUBIKEY_TOKEN_LEN;
+	fr_bin2hex(hex, private_id, private_id_len);
+	if ((size_t)snprintf(replay->key, sizeof(replay->key), "%s%.*s:%s",
+			     inst->replay.key_prefix, (int)public_id_len, public_id, hex) >= sizeof(replay->key)) {
+		REDEBUG("Replay cache key too long");
+		talloc_free(replay);
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	We've already accepted this OTP, or a later one.
+	 */
+	found = fr_lru_find(t->counters, replay->key);
+	if (found && (counter <= found->counter)) {
+		REDEBUG("Replay attack detected! Counter value %u, is lt or eq to last seen counter value %u",
+			counter, found->counter);
+		talloc_free(replay);
+		return RLM_MODULE_REJECT;
+	}
+
+	snprintf(replay->counter_str, sizeof(replay->counter_str), "%u", counter);
+	snprintf(replay->ttl_str, sizeof(replay->ttl_str), "%u", inst->replay.ttl);
+	replay->argv[0] = "EVAL";
+	replay->argv[1] = replay_script;
+	replay->argv[2] = "1";
+	replay->argv[3] = replay->key;
+	replay->argv[4] = replay->counter_str;
+	replay->argv[5] = replay->ttl_str;
+
+	RDEBUG2("Checking counter %u for \"%s\" against replay cache", counter, replay->key);
+
+	trunk = fr_redis_cluster_trunk_by_key(t->cluster, inst->replay.cluster, request,
+					      (uint8_t const *)replay->key, strlen(replay->key));
+	if (!trunk) {
+		RDEBUG2("No pipelined connections available");
+	sync:
+		replay->status = replay_sync(replay, request);
+		return rlm_yubikey_replay_result(t, request, replay);
+	}
+
+	cmds = fr_redis_command_set_alloc(NULL, request, replay_async_complete, replay_async_fail, replay);
+	if (fr_redis_command_argv_add(cmds, NUM_ELEMENTS(replay->argv), replay->argv, NULL) != FR_REDIS_PIPELINE_OK) {
+		RPEDEBUG("Invalid command");
+		talloc_free(cmds);
+		talloc_free(replay);
+		return RLM_MODULE_FAIL;
+	}
+
+	if (redis_command_set_enqueue(trunk, cmds) != FR_REDIS_PIPELINE_OK) {
+		RDEBUG2("Failed enqueuing pipelined commands");
+		talloc_free(cmds);
+		goto sync;
+	}
+	replay->cmds = cmds;
+	*out = replay;
+
+	return RLM_MODULE_OK;
+}
+
+/** Process the result of a check against the shared replay cache
+ *
+ * @param[in] t		Thread specific data.
+ * @param[in] request	The current request.
+ * @param[in] replay	Check to process.  Will be freed.
+ * @return
+ *	- RLM_MODULE_OK if the counter was recorded.
+ *	- RLM_MODULE_REJECT if the OTP has been seen before.
+ *	- RLM_MODULE_FAIL if Redis couldn't be queried.
+ */
+rlm_rcode_t rlm_yubikey_replay_result(rlm_yubikey_thread_t *t, REQUEST *request, yubikey_replay_t *replay)
+{
+	rlm_rcode_t		rcode;
+
+	if ((replay->status != REDIS_RCODE_SUCCESS) && !replay->synced && fr_redis_trunk_retry(replay->status)) {
+		RDEBUG2("Pipelined command failed, retrying");
+		replay->status = replay_sync(replay, request);
+	}
+
+	if (replay->status != REDIS_RCODE_SUCCESS) {
+		REDEBUG("Failed checking replay cache");
+		talloc_free(replay);
+		return RLM_MODULE_FAIL;
+	}
+
+	if (replay->last < 0) {
+		RDEBUG2("Counter %u recorded", replay->counter);
+		replay_counter_update(t, replay->key, replay->counter);
+		rcode = RLM_MODULE_OK;
+	} else {
+		REDEBUG("Replay attack detected! Counter value %u, is lt or eq to last seen counter value %" PRId64,
+			replay->counter, replay->last);
+		if (replay->last <= UINT32_MAX) replay_counter_update(t, replay->key, (uint32_t)replay->last);
+		rcode = RLM_MODULE_REJECT;
+	}
+
+	talloc_free(replay);
+
+	return rcode;
+}
+
+/** Stop waiting for a check against the shared replay cache
+ *
+ * @param[in] replay	Check to cancel.  Will be freed.
+ */
+void rlm_yubikey_replay_cancel(yubikey_replay_t *replay)
+{
+	if (replay->cmds) fr_redis_command_set_cancel(replay->cmds);	/* Trunk frees the command set */
+	talloc_free(replay);
+}
+
+/** Connect to the Redis servers holding the counters
+ *
+ */
+int rlm_yubikey_replay_init(CONF_SECTION *conf, rlm_yubikey_t *inst)
+{
+	/*
+	 *	Pipelined connections don't authenticate
+	 *	or select a database.
+	 */
+	if (inst->replay.conf.password || inst->replay.conf.database) {
+		cf_log_err(conf, "'replay' does not support 'password' or 'database'");
+		return -1;
+	}
+
+	inst->replay.cluster = fr_redis_cluster_alloc(inst, conf, &inst->replay.conf, false, NULL, NULL, NULL);
+	if (!inst->replay.cluster) return -1;
+
+	return 0;
+}
+
+/** Create this thread's pipelined connections, and counter cache
+ *
+ */
+int rlm_yubikey_replay_thread_init(rlm_yubikey_t const *inst, rlm_yubikey_thread_t *t)
+{
+	t->cluster = fr_redis_cluster_thread_alloc(t, t->el, &inst->replay.trunk_conf);
+	t->counters = fr_lru_alloc(t, inst->replay.local_entries);
+	if (!t->counters) return -1;
+
+	return 0;
+}
+#endif
@@ -31,6 +31,18 @@ RCSID("$Id$")
 static const CONF_PARSER validation_config[] = {
 	{ FR_CONF_OFFSET("client_id", FR_TYPE_UINT32, rlm_yubikey_t, client_id), .dflt = 0 },
 	{ FR_CONF_OFFSET("api_key", FR_TYPE_STRING | FR_TYPE_SECRET, rlm_yubikey_t, api_key) },
+	{ FR_CONF_OFFSET("async", FR_TYPE_SUBSECTION, rlm_yubikey_t, async), .subcs = (void const *) fr_offload_config },
+	CONF_PARSER_TERMINATOR
+};
+#endif
+
+#ifdef WITH_YUBIKEY_REPLAY
+static const CONF_PARSER replay_config[] = {
+	REDIS_COMMON_CONFIG,
+	{ FR_CONF_OFFSET("key_prefix", FR_TYPE_STRING, rlm_yubikey_replay_t, key_prefix), .dflt = "yubikey_counter:" },
+	{ FR_CONF_OFFSET("ttl", FR_TYPE_UINT32, rlm_yubikey_replay_t, ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("local_entries", FR_TYPE_UINT32, rlm_yubikey_replay_t, local_entries), .dflt = "4096" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_yubikey_replay_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 	CONF_PARSER_TERMINATOR
 };
 #endif
@@ -42,6 +54,10 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("validate", FR_TYPE_BOOL, rlm_yubikey_t, validate), .dflt = "no" },
 #ifdef HAVE_YKCLIENT
 	{ FR_CONF_POINTER("validation", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) validation_config },
+#endif
+#ifdef WITH_YUBIKEY_REPLAY
+	{ FR_CONF_OFFSET("replay", FR_TYPE_SUBSECTION | FR_TYPE_OK_MISSING, rlm_yubikey_t, replay),
+	  .subcs = (void const *) replay_config },
 #endif
 	CONF_PARSER_TERMINATOR
 };
@@ -215,6 +231,44 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 #endif
 	}
 
+#ifdef WITH_YUBIKEY_REPLAY
+	{
+		CONF_SECTION *cs;
+
+		cs = cf_section_find(conf, "replay", NULL);
+		if (cs) {
+			if (!inst->decrypt) {
+				cf_log_err(cs, "Requires 'decrypt = yes', counters are only available after decryption");
+				return -1;
+			}
+
+			if (rlm_yubikey_replay_init(cs, inst) < 0) return -1;
+			inst->replay_check = true;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+#if defined(HAVE_YKCLIENT) || defined(WITH_YUBIKEY_REPLAY)
+	rlm_yubikey_t const	*inst = instance;
+#endif
+	rlm_yubikey_thread_t	*t = talloc_get_type_abort(thread, rlm_yubikey_thread_t);
+
+	t->el = el;
+
+#ifdef HAVE_YKCLIENT
+	if (inst->validate && (rlm_yubikey_validate_thread_init(inst, t) < 0)) return -1;
+#endif
+
+#ifdef WITH_YUBIKEY_REPLAY
+	if (inst->replay_check && (rlm_yubikey_replay_thread_init(inst, t) < 0)) return -1;
+#endif
+
 	return 0;
 }
 
@@ -351,29 +405,108 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
 }
 
 
+/** Find the attribute containing the OTP
+ *
+ */
+static VALUE_PAIR const *yubikey_otp_find(REQUEST *request)
+{
+	VALUE_PAIR const *vp;
+
+	vp = fr_pair_find_by_da(request->packet->vps, attr_yubikey_otp, TAG_ANY);
+	if (vp) return vp;
+
+	RDEBUG2("No Yubikey-OTP attribute found, falling back to User-Password");
+
+	return fr_pair_find_by_da(request->packet->vps, attr_user_password, TAG_ANY);
+}
+
+/** Validate the OTP against the validation servers, if that's enabled
+ *
+ */
+static rlm_rcode_t mod_authenticate_validate(UNUSED rlm_yubikey_t const *inst, UNUSED rlm_yubikey_thread_t *t,
+					     UNUSED REQUEST *request, UNUSED char const *passcode, rlm_rcode_t rcode)
+{
+#ifdef HAVE_YKCLIENT
+	if (inst->validate) {
+		return rlm_yubikey_validate_async(inst, t, request, passcode);
+	}
+#endif
+	return rcode;
+}
+
+#ifdef WITH_YUBIKEY_REPLAY
+/** Continue authentication once the shared replay cache has been checked
+ *
+ */
+static rlm_rcode_t mod_authenticate_replay_resume(void *instance, void *thread, REQUEST *request, void *rctx)
+{
+	rlm_yubikey_t const	*inst = instance;
+	rlm_yubikey_thread_t	*t = talloc_get_type_abort(thread, rlm_yubikey_thread_t);
+	VALUE_PAIR const	*vp;
+	rlm_rcode_t		rcode;
+
+	rcode = rlm_yubikey_replay_result(t, request, rctx);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	vp = yubikey_otp_find(request);
+	if (!vp) return RLM_MODULE_INVALID;
+
+	return mod_authenticate_validate(inst, t, request, vp->vp_strvalue, rcode);
+}
+
+static void mod_authenticate_replay_signal(UNUSED void *instance, UNUSED void *thread, UNUSED REQUEST *request,
+					   void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	rlm_yubikey_replay_cancel(rctx);
+}
+
+/** Check the decrypted counter against the shared replay cache
+ *
+ */
+static rlm_rcode_t mod_authenticate_replay(rlm_yubikey_t const *inst, rlm_yubikey_thread_t *t,
+					   REQUEST *request, char const *passcode)
+{
+	yubikey_replay_t	*replay;
+	VALUE_PAIR const	*private_id, *counter;
+	rlm_rcode_t		rcode;
+
+	private_id = fr_pair_find_by_da(request->packet->vps, attr_yubikey_private_id, TAG_ANY);
+	counter = fr_pair_find_by_da(request->packet->vps, attr_yubikey_counter, TAG_ANY);
+	if (!fr_cond_assert(private_id && counter)) return RLM_MODULE_FAIL;
+
+	rcode = rlm_yubikey_replay_check(&replay, inst, t, request, passcode, inst->id_len,
+					 private_id->vp_octets, private_id->vp_length, counter->vp_uint32);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	if (replay) return unlang_module_yield(request, mod_authenticate_replay_resume,
+					       mod_authenticate_replay_signal, replay);
+
+	return mod_authenticate_validate(inst, t, request, passcode, rcode);
+}
+#endif
+
 /*
  *	Authenticate the user with the given password.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void *thread, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, void *thread, REQUEST *request)
 {
 	rlm_rcode_t rcode = RLM_MODULE_NOOP;
 	rlm_yubikey_t const *inst = instance;
+	rlm_yubikey_thread_t *t = talloc_get_type_abort(thread, rlm_yubikey_thread_t);
 	char const *passcode = NULL;
 	VALUE_PAIR const *vp;
 	size_t len;
 	int ret;
 
-	vp = fr_pair_find_by_da(request->packet->vps, attr_yubikey_otp, TAG_ANY);
+	/*
+	 *	Can't do yubikey auth if there's no password.
+	 */
+	vp = yubikey_otp_find(request);
 	if (!vp) {
-		RDEBUG2("No Yubikey-OTP attribute found, falling back to User-Password");
-		/*
-		 *	Can't do yubikey auth if there's no password.
-		 */
-		vp = fr_pair_find_by_da(request->packet->vps, attr_user_password, TAG_ANY);
-		if (!vp) {
-			REDEBUG("No User-Password in the request. Can't do Yubikey authentication");
-			return RLM_MODULE_INVALID;
-		}
+		REDEBUG("No User-Password in the request. Can't do Yubikey authentication");
+		return RLM_MODULE_INVALID;
 	}
 
 	passcode = vp->vp_strvalue;
@@ -407,16 +540,15 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, UNUSED void
 		if (rcode != RLM_MODULE_OK) {
 			return rcode;
 		}
+
+#ifdef WITH_YUBIKEY_REPLAY
+		if (inst->replay_check) return mod_authenticate_replay(inst, t, request, passcode);
+#endif
 		/* Fall-Through to doing ykclient auth in addition to local auth */
 	}
 #endif
 
-#ifdef HAVE_YKCLIENT
-	if (inst->validate) {
-		return rlm_yubikey_validate(inst, request, passcode);
-	}
-#endif
-	return rcode;
+	return mod_authenticate_validate(inst, t, request, passcode, rcode);
 }
 
 /*
@@ -434,9 +566,12 @@ module_t rlm_yubikey = {
 	.name		= "yubikey",
 	.type		= RLM_TYPE_THREAD_SAFE,
 	.inst_size	= sizeof(rlm_yubikey_t),
+	.thread_inst_size	= sizeof(rlm_yubikey_thread_t),
+	.thread_inst_type	= "rlm_yubikey_thread_t",
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 #ifdef HAVE_YKCLIENT
 	.detach		= mod_detach,
 #endif
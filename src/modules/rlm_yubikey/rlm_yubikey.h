@@ -16,6 +16,8 @@
  */
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/offload.h>
+#include <freeradius-devel/unlang/base.h>
 #include <ctype.h>
 
 #include "config.h"
@@ -28,8 +30,32 @@
 #include <yubikey.h>
 #endif
 
+#ifdef WITH_YUBIKEY_REPLAY
+#include <freeradius-devel/redis/base.h>
+#include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
+#include <freeradius-devel/util/lru.h>
+#endif
+
 #define YUBIKEY_TOKEN_LEN 32
 
+#ifdef WITH_YUBIKEY_REPLAY
+/** Configuration for the shared replay cache
+ *
+ */
+typedef struct {
+	fr_redis_conf_t		conf;			//!< Connection parameters for the Redis server.
+							//!< Must be first field in this struct.
+
+	char const		*key_prefix;		//!< Prepended to the token's IDs to form the key.
+	uint32_t		ttl;			//!< How long counters are kept, 0 for forever.
+	uint32_t		local_entries;		//!< Counters each thread remembers.
+	fr_trunk_conf_t		trunk_conf;		//!< For the pipelined connections.
+
+	fr_redis_cluster_t	*cluster;		//!< Redis servers holding the counters.
+} rlm_yubikey_replay_t;
+#endif
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -51,9 +77,34 @@ typedef struct {
 	char const		*api_key;		//!< Validation API signing key.
 	ykclient_t		*ykc;			//!< ykclient configuration.
 	fr_pool_t	*pool;			//!< Connection pool instance.
+
+	fr_offload_conf_t	async;			//!< Executors for validation requests.
+	fr_offload_t		*offload;		//!< Executors, NULL if validation requests are
+							//!< made by the workers.
+#endif
+
+#ifdef WITH_YUBIKEY_REPLAY
+	bool			replay_check;		//!< Check counters against the shared replay cache.
+	rlm_yubikey_replay_t	replay;			//!< Shared replay cache.
 #endif
 } rlm_yubikey_t;
 
+/** Thread specific data for rlm_yubikey
+ *
+ */
+typedef struct {
+	fr_event_list_t		*el;			//!< This thread's event list.
+
+#ifdef HAVE_YKCLIENT
+	fr_offload_thread_t	*offload;		//!< This thread's handle for the validation executors.
+#endif
+
+#ifdef WITH_YUBIKEY_REPLAY
+	fr_redis_cluster_thread_t	*cluster;	//!< Pipelined connections to the cluster's nodes.
+	fr_lru_t		*counters;		//!< Last counters seen, keyed by token.
+#endif
+} rlm_yubikey_thread_t;
+
 
 /*
  *	decrypt.c - Decryption functions
@@ -68,3 +119,27 @@ int rlm_yubikey_ykclient_init(CONF_SECTION *conf, rlm_yubikey_t *inst);
 int rlm_yubikey_ykclient_detach(rlm_yubikey_t *inst);
 
 rlm_rcode_t rlm_yubikey_validate(rlm_yubikey_t const *inst, REQUEST *request, char const *passcode);
+
+int rlm_yubikey_validate_thread_init(rlm_yubikey_t const *inst, rlm_yubikey_thread_t *t);
+
+rlm_rcode_t rlm_yubikey_validate_async(rlm_yubikey_t const *inst, rlm_yubikey_thread_t *t,
+				       REQUEST *request, char const *passcode);
+
+#ifdef WITH_YUBIKEY_REPLAY
+/*
+ *	replay.c - Shared replay cache
+ */
+typedef struct yubikey_replay_s yubikey_replay_t;
+
+int rlm_yubikey_replay_init(CONF_SECTION *conf, rlm_yubikey_t *inst);
+
+int rlm_yubikey_replay_thread_init(rlm_yubikey_t const *inst, rlm_yubikey_thread_t *t);
+
+rlm_rcode_t rlm_yubikey_replay_check(yubikey_replay_t **out, rlm_yubikey_t const *inst, rlm_yubikey_thread_t *t,
+				     REQUEST *request, char const *public_id, size_t public_id_len,
+				     uint8_t const *private_id, size_t private_id_len, uint32_t counter);
+
+rlm_rcode_t rlm_yubikey_replay_result(rlm_yubikey_thread_t *t, REQUEST *request, yubikey_replay_t *replay);
+
+void rlm_yubikey_replay_cancel(yubikey_replay_t *replay);
+#endif
@@ -56,6 +56,35 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_del
 	return yandle;
 }
 
+/** Create an executor's ykclient handle
+ *
+ */
+static void *mod_offload_resource_alloc(void *uctx)
+{
+	rlm_yubikey_t const	*inst = uctx;
+	ykclient_rc		status;
+	ykclient_handle_t	*yandle;
+
+	status = ykclient_handle_init(inst->ykc, &yandle);
+	if (status != YKCLIENT_OK) {
+		ERROR("%s", ykclient_strerror(status));
+
+		return NULL;
+	}
+
+	return yandle;
+}
+
+/** Free an executor's ykclient handle
+ *
+ */
+static void mod_offload_resource_free(void *resource, UNUSED void *uctx)
+{
+	ykclient_handle_t	*yandle = resource;
+
+	ykclient_handle_done(&yandle);
+}
+
 int rlm_yubikey_ykclient_init(CONF_SECTION *conf, rlm_yubikey_t *inst)
 {
 	ykclient_rc status;
@@ -128,6 +157,31 @@ init:
 		return -1;
 	}
 
+	/*
+	 *	ykclient only has a blocking API, so requests
+	 *	to the validation servers are made by dedicated
+	 *	threads, each with its own handle.
+	 */
+	if (inst->async.num_threads) {
+		CONF_SECTION *async_cs = cf_section_find(conf, "async", NULL);
+
+		if (fr_offload_conf_check(async_cs ? async_cs : conf, &inst->async) < 0) {
+		error:
+			ykclient_done(&inst->ykc);
+
+			return -1;
+		}
+
+		inst->offload = fr_offload_alloc(inst, &inst->async, inst->name,
+						 mod_offload_resource_alloc, mod_offload_resource_free, inst);
+		if (!inst->offload) {
+			cf_log_perr(conf, "Unable to initialise validation executors");
+			goto error;
+		}
+
+		return 0;
+	}
+
 	inst->pool = module_connection_pool_init(conf, inst, mod_conn_create, NULL, inst->name, NULL, NULL);
 	if (!inst->pool) {
 		ykclient_done(&inst->ykc);
@@ -140,6 +194,11 @@ init:
 
 int rlm_yubikey_ykclient_detach(rlm_yubikey_t *inst)
 {
+	/*
+	 *	Executors must have exited before their
+	 *	handles' configuration is freed.
+	 */
+	TALLOC_FREE(inst->offload);
 	fr_pool_free(inst->pool);
 	ykclient_done(&inst->ykc);
 	ykclient_global_done();
@@ -147,9 +206,30 @@ int rlm_yubikey_ykclient_detach(rlm_yubikey_t *inst)
 	return 0;
 }
 
+/** Convert the result of a validation request to a module return code
+ *
+ */
+static rlm_rcode_t yubikey_validate_rcode(REQUEST *request, ykclient_rc status)
+{
+	if (status == YKCLIENT_OK) return RLM_MODULE_OK;
+
+	REDEBUG("%s", ykclient_strerror(status));
+	switch (status) {
+	case YKCLIENT_BAD_OTP:
+	case YKCLIENT_REPLAYED_OTP:
+		return RLM_MODULE_REJECT;
+
+	case YKCLIENT_NO_SUCH_CLIENT:
+		return RLM_MODULE_NOTFOUND;
+
+	default:
+		return RLM_MODULE_FAIL;
+	}
+}
+
 rlm_rcode_t rlm_yubikey_validate(rlm_yubikey_t const *inst, REQUEST *request, char const *passcode)
 {
-	rlm_rcode_t rcode = RLM_MODULE_OK;
+	rlm_rcode_t rcode;
 	ykclient_rc status;
 	ykclient_handle_t *yandle;
 
@@ -173,25 +253,119 @@ rlm_rcode_t rlm_yubikey_validate(rlm_yubikey_t const *inst, REQUEST *request, ch
 	ykclient_handle_cleanup(yandle);
 
 	status = ykclient_request_process(inst->ykc, yandle, passcode);
-	if (status != YKCLIENT_OK) {
-		REDEBUG("%s", ykclient_strerror(status));
-		switch (status) {
-		case YKCLIENT_BAD_OTP:
-		case YKCLIENT_REPLAYED_OTP:
-			rcode = RLM_MODULE_REJECT;
-			break;
-
-		case YKCLIENT_NO_SUCH_CLIENT:
-			rcode = RLM_MODULE_NOTFOUND;
-			break;
-
-		default:
-			rcode = RLM_MODULE_FAIL;
-		}
-	}
+	rcode = yubikey_validate_rcode(request, status);
 
 	fr_pool_connection_release(inst->pool, request, yandle);
 
 	return rcode;
 }
+
+/** A validation request, copied out of the request so it can be made by an executor
+ *
+ */
+typedef struct {
+	rlm_yubikey_t const	*inst;		//!< Module instance.
+	char const		*passcode;	//!< OTP to validate.
+	ykclient_rc		status;		//!< Result of the validation request.
+} rlm_yubikey_validate_t;
+
+static int _mod_validate_run(void *resource, void *data)
+{
+	rlm_yubikey_validate_t	*v = talloc_get_type_abort(data, rlm_yubikey_validate_t);
+	ykclient_handle_t	*yandle = resource;
+
+	/*
+	 *	Executors are dedicated to a handle, so
+	 *	the same reasoning about delaying cleanup
+	 *	applies as with the connection pool.
+	 */
+	ykclient_handle_cleanup(yandle);
+
+	v->status = ykclient_request_process(v->inst->ykc, yandle, v->passcode);
+
+	return 0;
+}
+
+static void mod_validate_complete(REQUEST *request, UNUSED fr_offload_req_t *oreq, UNUSED void *uctx)
+{
+	unlang_interpret_resumable(request);
+}
+
+/** Process the result of a validation request made by an executor
+ *
+ */
+static rlm_rcode_t mod_validate_resume(UNUSED void *instance, UNUSED void *thread, REQUEST *request, void *rctx)
+{
+	fr_offload_req_t	*oreq = talloc_get_type_abort(rctx, fr_offload_req_t);
+	rlm_rcode_t		rcode;
+	void			*data;
+
+	switch (fr_offload_req_result(NULL, &data, oreq)) {
+	case FR_OFFLOAD_REQ_DONE:
+		rcode = yubikey_validate_rcode(request, talloc_get_type_abort(data, rlm_yubikey_validate_t)->status);
+		break;
+
+	case FR_OFFLOAD_REQ_TIMEOUT:
+		REDEBUG("Timeout waiting for validation servers");
+		rcode = RLM_MODULE_FAIL;
+		break;
+
+	default:
+		REDEBUG("Validation request failed");
+		rcode = RLM_MODULE_FAIL;
+		break;
+	}
+
+	talloc_free(oreq);
+
+	return rcode;
+}
+
+static void mod_validate_signal(UNUSED void *instance, UNUSED void *thread, UNUSED REQUEST *request,
+				void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(rctx);
+}
+
+/** Connect this thread to the validation executors
+ *
+ */
+int rlm_yubikey_validate_thread_init(rlm_yubikey_t const *inst, rlm_yubikey_thread_t *t)
+{
+	if (!inst->offload) return 0;
+
+	t->offload = fr_offload_thread_alloc(t, inst->offload, t->el);
+	if (!t->offload) {
+		PERROR("Failed connecting to validation executors");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Validate an OTP against the validation servers
+ *
+ * If executor threads are configured, the request to the validation
+ * servers is queued for them and the request yields.  Otherwise the
+ * worker blocks, using a handle from the connection pool.
+ */
+rlm_rcode_t rlm_yubikey_validate_async(rlm_yubikey_t const *inst, rlm_yubikey_thread_t *t,
+				       REQUEST *request, char const *passcode)
+{
+	rlm_yubikey_validate_t	*v;
+	fr_offload_req_t	*oreq;
+
+	if (!t->offload) return rlm_yubikey_validate(inst, request, passcode);
+
+	MEM(v = talloc_zero(NULL, rlm_yubikey_validate_t));
+	v->inst = inst;
+	MEM(v->passcode = talloc_typed_strdup(v, passcode));
+
+	oreq = fr_offload_enqueue(t->offload, request, NULL, _mod_validate_run, v, mod_validate_complete, NULL);
+	if (!oreq) return RLM_MODULE_FAIL;
+
+	return unlang_module_yield(request, mod_validate_resume, mod_validate_signal, oreq);
+}
 #endif
@@ -343,25 +343,27 @@ invalid:
 	return packet_len;
 }
 
-/** Sign a previously encoded packet
+/** Get a packet ready for its Message-Authenticator to be calculated
  *
- * Calculates the request/response authenticator for packets which need it, and fills
- * in the message-authenticator value if the attribute is present in the encoded packet.
+ * Sets the Request Authenticator field to what the HMAC should be
+ * calculated over, and zeroes the Message-Authenticator value.
  *
  * @param[in,out] packet	(request or response).
  * @param[in] original		request (only if this is a response).
- * @param[in] secret		to sign the packet with.
  * @param[in] secret_len	The length of the secret.
+ * @param[out] msg_p		Where to write a pointer to the Message-Authenticator
+ *				attribute, or NULL if there isn't one.
  * @return
  *	- <0 on error
  *	- 0 on success
  */
-int fr_radius_sign(uint8_t *packet, uint8_t const *original,
-		   uint8_t const *secret, size_t secret_len)
+static int radius_sign_msg_prepare(uint8_t *packet, uint8_t const *original, size_t secret_len, uint8_t **msg_p)
 {
 	uint8_t		*msg, *end;
 	size_t		packet_len = (packet[2] << 8) | packet[3];
 
+	*msg_p = NULL;
+
 	/*
 	 *	No real limit on secret length, this is just
 	 *	to catch uninitialised fields.
@@ -424,7 +426,11 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 		case FR_CODE_ACCESS_REJECT:
 		case FR_CODE_ACCESS_CHALLENGE:
 		do_ack:
-			if (!original) goto need_original;
+			if (!original) {
+			need_original:
+				fr_strerror_printf("Cannot sign response packet without a request packet");
+				return -1;
+			}
 			memcpy(packet + 4, original + 4, RADIUS_AUTH_VECTOR_LENGTH);
 			break;
 
@@ -434,19 +440,34 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 			break;
 
 		default:
-			goto bad_packet;
+			fr_strerror_printf("Cannot sign unknown packet code %u", packet[0]);
+			return -1;
 		}
 
 		/*
-		 *	Force Message-Authenticator to be zero,
-		 *	calculate the HMAC, and put it into the
-		 *	Message-Authenticator attribute.
+		 *	Force Message-Authenticator to be zero.  The
+		 *	caller calculates the HMAC, and puts it into
+		 *	the Message-Authenticator attribute.
 		 */
 		memset(msg + 2, 0, RADIUS_AUTH_VECTOR_LENGTH);
-		fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+		*msg_p = msg;
 		break;
 	}
 
+	return 0;
+}
+
+/** Get a packet ready for its Request / Response Authenticator to be calculated
+ *
+ * @param[in,out] packet	(request or response).
+ * @param[in] original		request (only if this is a response).
+ * @return
+ *	- <0 on error
+ *	- 0 if the packet doesn't need an authenticator calculating.
+ *	- 1 if the authenticator is MD5(packet + secret)
+ */
+static int radius_sign_auth_prepare(uint8_t *packet, uint8_t const *original)
+{
 	/*
 	 *	Initialize the request authenticator.
 	 */
@@ -467,7 +488,6 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 	case FR_CODE_COA_NAK:
 	case FR_CODE_PROTOCOL_ERROR:
 		if (!original) {
-		need_original:
 			fr_strerror_printf("Cannot sign response packet without a request packet");
 			return -1;
 		}
@@ -484,11 +504,40 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 		return 0;
 
 	default:
-	bad_packet:
 		fr_strerror_printf("Cannot sign unknown packet code %u", packet[0]);
 		return -1;
 	}
 
+	return 1;
+}
+
+/** Sign a previously encoded packet
+ *
+ * Calculates the request/response authenticator for packets which need it, and fills
+ * in the message-authenticator value if the attribute is present in the encoded packet.
+ *
+ * @param[in,out] packet	(request or response).
+ * @param[in] original		request (only if this is a response).
+ * @param[in] secret		to sign the packet with.
+ * @param[in] secret_len	The length of the secret.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_sign(uint8_t *packet, uint8_t const *original,
+		   uint8_t const *secret, size_t secret_len)
+{
+	int		rcode;
+	uint8_t		*msg;
+	size_t		packet_len = (packet[2] << 8) | packet[3];
+
+	if (radius_sign_msg_prepare(packet, original, secret_len, &msg) < 0) return -1;
+
+	if (msg) fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+
+	rcode = radius_sign_auth_prepare(packet, original);
+	if (rcode <= 0) return rcode;
+
 	/*
 	 *	Request / Response Authenticator = MD5(packet + secret)
 	 */
@@ -505,6 +554,79 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 	return 0;
 }
 
+/** Sign many previously encoded packets at once
+ *
+ * Does the same as calling fr_radius_sign() for each packet, but the
+ * HMAC-MD5 and MD5 digests for the packets are calculated together with
+ * fr_hmac_md5_multi() and fr_md5_calc_multi(), which is much faster
+ * when there are several packets to sign.
+ *
+ * @param[in,out] batch		The packets to sign.  The result of signing
+ *				each packet is written to batch[i].rcode.
+ * @param[in] num		The number of packets.
+ * @return
+ *	- The number of packets which could not be signed.
+ */
+int fr_radius_sign_batch(fr_radius_batch_t *batch, int num)
+{
+	int			i, j, lanes, num_hmac, num_md5, failed = 0;
+	fr_radius_batch_t	*p;
+	uint8_t			*msg;
+	fr_hmac_md5_multi_t	hmac[FR_MD5_MULTI_LANES];
+	fr_md5_multi_t		md5[FR_MD5_MULTI_LANES];
+
+	for (i = 0; i < num; i += lanes) {
+		lanes = num - i;
+		if (lanes > FR_MD5_MULTI_LANES) lanes = FR_MD5_MULTI_LANES;
+
+		/*
+		 *	Message-Authenticator has to be calculated
+		 *	first, as it's part of what the Request /
+		 *	Response Authenticator is calculated over.
+		 */
+		num_hmac = 0;
+		for (j = 0; j < lanes; j++) {
+			p = &batch[i + j];
+
+			p->rcode = radius_sign_msg_prepare(p->packet, p->original, p->secret_len, &msg);
+			if ((p->rcode < 0) || !msg) continue;
+
+			hmac[num_hmac++] = (fr_hmac_md5_multi_t) {
+				.out = msg + 2,
+				.in = p->packet,
+				.inlen = (p->packet[2] << 8) | p->packet[3],
+				.key = p->secret,
+				.key_len = p->secret_len
+			};
+		}
+		fr_hmac_md5_multi(hmac, num_hmac);
+
+		num_md5 = 0;
+		for (j = 0; j < lanes; j++) {
+			p = &batch[i + j];
+
+			if (p->rcode < 0) {
+				failed++;
+				continue;
+			}
+
+			p->rcode = radius_sign_auth_prepare(p->packet, p->original);
+			if (p->rcode < 0) failed++;
+			if (p->rcode <= 0) continue;
+
+			p->rcode = 0;
+			md5[num_md5++] = (fr_md5_multi_t) {
+				.out = p->packet + 4,
+				.in = { p->packet, p->secret },
+				.inlen = { (p->packet[2] << 8) | p->packet[3], p->secret_len }
+			};
+		}
+		fr_md5_calc_multi(md5, num_md5);
+	}
+
+	return failed;
+}
+
 
 /** See if the data pointed to by PTR is a valid RADIUS packet.
  *
@@ -771,35 +893,30 @@ finish:
 }
 
 
-/** Verify a request / response packet
+/** Save the authenticators from a packet, before fr_radius_sign() overwrites them
  *
- *  This function does its work by calling fr_radius_sign(), and then
- *  comparing the signature in the packet with the one we calculated.
- *  If they differ, there's a problem.
- *
- * @param packet the raw RADIUS packet (request or response)
- * @param original the raw original request (if this is a response)
- * @param secret the shared secret
- * @param secret_len the length of the secret
+ * @param[in] packet			the raw RADIUS packet (request or response)
+ * @param[out] msg_p			Where to write a pointer to the Message-Authenticator
+ *					attribute.  Points to the end of the packet if there isn't one.
+ * @param[out] request_authenticator	copy of the Request / Response Authenticator.
+ * @param[out] message_authenticator	copy of the Message-Authenticator.
  * @return
  *	- <0 on error
  *	- 0 on success
  */
-int fr_radius_verify(uint8_t *packet, uint8_t const *original,
-		     uint8_t const *secret, size_t secret_len)
+static int radius_verify_prepare(uint8_t *packet, uint8_t **msg_p,
+				 uint8_t request_authenticator[static RADIUS_AUTH_VECTOR_LENGTH],
+				 uint8_t message_authenticator[static RADIUS_AUTH_VECTOR_LENGTH])
 {
-	int rcode;
 	uint8_t *msg, *end;
 	size_t packet_len = (packet[2] << 8) | packet[3];
-	uint8_t request_authenticator[RADIUS_AUTH_VECTOR_LENGTH];
-	uint8_t message_authenticator[RADIUS_AUTH_VECTOR_LENGTH];
 
 	if (packet_len < RADIUS_HEADER_LENGTH) {
 		fr_strerror_printf("invalid packet length %zd", packet_len);
 		return -1;
 	}
 
-	memcpy(request_authenticator, packet + 4, sizeof(request_authenticator));
+	memcpy(request_authenticator, packet + 4, RADIUS_AUTH_VECTOR_LENGTH);
 
 	/*
 	 *	Find Message-Authenticator.  Its value has to be
@@ -832,21 +949,33 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 		/*
 		 *	Found it, save a copy.
 		 */
-		memcpy(message_authenticator, msg + 2, sizeof(message_authenticator));
+		memcpy(message_authenticator, msg + 2, RADIUS_AUTH_VECTOR_LENGTH);
 		break;
 	}
 
-	/*
-	 *	Implement verification as a signature, followed by
-	 *	checking our signature against the sent one.  This is
-	 *	slightly more CPU work than having verify-specific
-	 *	functions, but it ends up being cleaner in the code.
-	 */
-	rcode = fr_radius_sign(packet, original, secret, secret_len);
-	if (rcode < 0) {
-		fr_strerror_printf_push("Failed calculating correct authenticator");
-		return -1;
-	}
+	*msg_p = msg;
+	return 0;
+}
+
+/** Compare the authenticators calculated by fr_radius_sign() with the ones the packet had
+ *
+ * If they differ, the original values are put back into the packet.
+ *
+ * @param[in,out] packet		the raw RADIUS packet (request or response)
+ * @param[in] original			the raw original request (if this is a response)
+ * @param[in] msg			the Message-Authenticator attribute, as found by
+ *					radius_verify_prepare().
+ * @param[in] request_authenticator	saved by radius_verify_prepare().
+ * @param[in] message_authenticator	saved by radius_verify_prepare().
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+static int radius_verify_check(uint8_t *packet, uint8_t const *original, uint8_t *msg,
+			       uint8_t const request_authenticator[static RADIUS_AUTH_VECTOR_LENGTH],
+			       uint8_t const message_authenticator[static RADIUS_AUTH_VECTOR_LENGTH])
+{
+	uint8_t *end = packet + ((packet[2] << 8) | packet[3]);
 
 	/*
 	 *	Check the Message-Authenticator first.
@@ -856,9 +985,9 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 	 *	fields.
 	 */
 	if ((msg < end) &&
-	    (fr_digest_cmp(message_authenticator, msg + 2, sizeof(message_authenticator)) != 0)) {
-		memcpy(msg + 2, message_authenticator, sizeof(message_authenticator));
-		memcpy(packet + 4, request_authenticator, sizeof(request_authenticator));
+	    (fr_digest_cmp(message_authenticator, msg + 2, RADIUS_AUTH_VECTOR_LENGTH) != 0)) {
+		memcpy(msg + 2, message_authenticator, RADIUS_AUTH_VECTOR_LENGTH);
+		memcpy(packet + 4, request_authenticator, RADIUS_AUTH_VECTOR_LENGTH);
 
 		fr_strerror_printf("invalid Message-Authenticator (shared secret is incorrect)");
 		return -1;
@@ -875,8 +1004,8 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 	/*
 	 *	Check the Request Authenticator.
 	 */
-	if (fr_digest_cmp(request_authenticator, packet + 4, sizeof(request_authenticator)) != 0) {
-		memcpy(packet + 4, request_authenticator, sizeof(request_authenticator));
+	if (fr_digest_cmp(request_authenticator, packet + 4, RADIUS_AUTH_VECTOR_LENGTH) != 0) {
+		memcpy(packet + 4, request_authenticator, RADIUS_AUTH_VECTOR_LENGTH);
 		if (original) {
 			fr_strerror_printf("invalid Response Authenticator (shared secret is incorrect)");
 		} else {
@@ -888,30 +1017,207 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 	return 0;
 }
 
-/** Encode VPS into a raw RADIUS packet.
+/** Verify a request / response packet
  *
+ *  This function does its work by calling fr_radius_sign(), and then
+ *  comparing the signature in the packet with the one we calculated.
+ *  If they differ, there's a problem.
+ *
+ * @param packet the raw RADIUS packet (request or response)
+ * @param original the raw original request (if this is a response)
+ * @param secret the shared secret
+ * @param secret_len the length of the secret
+ * @return
+ *	- <0 on error
+ *	- 0 on success
  */
-ssize_t fr_radius_encode(uint8_t *packet, size_t packet_len, uint8_t const *original,
-			 char const *secret, UNUSED size_t secret_len, int code, int id, VALUE_PAIR *vps)
+int fr_radius_verify(uint8_t *packet, uint8_t const *original,
+		     uint8_t const *secret, size_t secret_len)
+{
+	uint8_t *msg;
+	uint8_t request_authenticator[RADIUS_AUTH_VECTOR_LENGTH];
+	uint8_t message_authenticator[RADIUS_AUTH_VECTOR_LENGTH];
+
+	if (radius_verify_prepare(packet, &msg, request_authenticator, message_authenticator) < 0) return -1;
+
+	/*
+	 *	Implement verification as a signature, followed by
+	 *	checking our signature against the sent one.  This is
+	 *	slightly more CPU work than having verify-specific
+	 *	functions, but it ends up being cleaner in the code.
+	 */
+	if (fr_radius_sign(packet, original, secret, secret_len) < 0) {
+		fr_strerror_printf_push("Failed calculating correct authenticator");
+		return -1;
+	}
+
+	return radius_verify_check(packet, original, msg, request_authenticator, message_authenticator);
+}
+
+/** Verify many request / response packets at once
+ *
+ * Does the same as calling fr_radius_verify() for each packet, but
+ * signs the packets with fr_radius_sign_batch().
+ *
+ * @param[in,out] batch		The packets to verify.  The result of verifying
+ *				each packet is written to batch[i].rcode.
+ * @param[in] num		The number of packets.
+ * @return
+ *	- The number of packets which failed verification.
+ */
+int fr_radius_verify_batch(fr_radius_batch_t *batch, int num)
+{
+	int			i, j, lanes, num_sign, failed = 0;
+	fr_radius_batch_t	*p;
+	uint8_t			*msg[FR_MD5_MULTI_LANES];
+	uint8_t			request_authenticator[FR_MD5_MULTI_LANES][RADIUS_AUTH_VECTOR_LENGTH];
+	uint8_t			message_authenticator[FR_MD5_MULTI_LANES][RADIUS_AUTH_VECTOR_LENGTH];
+	fr_radius_batch_t	sign[FR_MD5_MULTI_LANES];
+
+	for (i = 0; i < num; i += lanes) {
+		lanes = num - i;
+		if (lanes > FR_MD5_MULTI_LANES) lanes = FR_MD5_MULTI_LANES;
+
+		num_sign = 0;
+		for (j = 0; j < lanes; j++) {
+			p = &batch[i + j];
+
+			p->rcode = radius_verify_prepare(p->packet, &msg[j],
+							 request_authenticator[j], message_authenticator[j]);
+			if (p->rcode < 0) continue;
+
+			sign[num_sign++] = *p;
+		}
+
+		(void) fr_radius_sign_batch(sign, num_sign);
+
+		num_sign = 0;
+		for (j = 0; j < lanes; j++) {
+			p = &batch[i + j];
+
+			if (p->rcode < 0) {
+				failed++;
+				continue;
+			}
+
+			if (sign[num_sign++].rcode < 0) {
+				fr_strerror_printf_push("Failed calculating correct authenticator");
+				p->rcode = -1;
+				failed++;
+				continue;
+			}
+
+			p->rcode = radius_verify_check(p->packet, p->original, msg[j],
+						       request_authenticator[j], message_authenticator[j]);
+			if (p->rcode < 0) failed++;
+		}
+	}
+
+	return failed;
+}
+
+/** Encode the wire attributes in a list
+ *
+ * The dbuff is advanced past each attribute as it's encoded.
+ */
+static ssize_t radius_encode_pairs(fr_dbuff_t *work_dbuff, VALUE_PAIR *vps, fr_radius_ctx_t *packet_ctx)
 {
 	ssize_t			slen;
 	VALUE_PAIR const	*vp;
 	fr_cursor_t		cursor;
-	fr_radius_ctx_t		packet_ctx;
-	uint8_t			*out_p, *out_end;
 
-	packet_ctx.secret = secret;
-	packet_ctx.vector = packet + 4;
-	packet_ctx.rand_ctx.a = fr_rand();
-	packet_ctx.rand_ctx.b = fr_rand();
+	/*
+	 *	Loop over the reply attributes for the packet.
+	 */
+	fr_cursor_talloc_iter_init(&cursor, &vps, fr_proto_next_encodable, dict_radius, VALUE_PAIR);
+	while ((vp = fr_cursor_current(&cursor))) {
+		VP_VERIFY(vp);
+
+		/*
+		 *	Ignore non-wire attributes, but allow extended
+		 *	attributes.
+		 */
+		if (vp->da->flags.internal) {
+#ifndef NDEBUG
+			/*
+			 *	Permit the admin to send BADLY formatted
+			 *	attributes with a debug build.
+			 */
+			if (vp->da == attr_raw_attribute) {
+				/*
+				 *	Skip really badly formatted attributes
+				 */
+				if (vp->vp_length > (RADIUS_MAX_STRING_LENGTH + 2)) {
+					fr_cursor_next(&cursor);
+					continue;
+				}
+
+				FR_DBUFF_MEMCPY_IN_RETURN(work_dbuff, vp->vp_octets, vp->vp_length);
+				fr_cursor_next(&cursor);
+				continue;
+			}
+#endif
+			/*
+			 *	Skip internal attributes...
+			 */
+			fr_cursor_next(&cursor);
+			continue;
+		}
+
+		/*
+		 *	Encode an individual VP, the work dbuff
+		 *	is advanced past it.
+		 */
+		slen = fr_radius_encode_pair_dbuff(work_dbuff, &cursor, packet_ctx);
+		if (slen < 0) {
+			if (slen == PAIR_ENCODE_SKIPPED) continue;
+			return slen;
+		}
+	} /* done looping over all attributes */
+
+	return 0;
+}
+
+/** Encode VPS into a raw RADIUS packet, after attributes which were encoded earlier
+ *
+ * The packet is written directly into the dbuff, which is advanced past
+ * it only if the whole packet was encoded.
+ *
+ * @param[in] dbuff		to write the packet to.
+ * @param[in] original		request, if the packet is a response.
+ * @param[in] secret		shared secret.
+ * @param[in] secret_len	length of the secret.
+ * @param[in] code		of the packet.
+ * @param[in] id		of the packet.
+ * @param[in] preencoded	attributes from #fr_radius_preencode, which are
+ *				copied into the packet before vps.  May be NULL.
+ * @param[in] preencoded_len	length of the preencoded attributes.
+ * @param[in] vps		to encode.
+ * @return
+ *	- The length of the packet.
+ *	- <0 on error.
+ */
+ssize_t fr_radius_encode_dbuff_preencoded(fr_dbuff_t *dbuff, uint8_t const *original,
+					  char const *secret, UNUSED size_t secret_len, int code, int id,
+					  uint8_t const *preencoded, size_t preencoded_len, VALUE_PAIR *vps)
+{
+	ssize_t			slen;
+	fr_radius_ctx_t		packet_ctx;
+	fr_dbuff_t		work_dbuff;
+	uint8_t			*packet;
 
 	/*
 	 *	The RADIUS header can't do more than 64K of data.
 	 */
-	if (packet_len > 65535) packet_len = 65535;
+	fr_dbuff_reservation_init(&work_dbuff, dbuff, 65535);
+	packet = work_dbuff.p;
 
-	out_p = packet;
-	out_end = packet + packet_len;
+	CHECK_FREESPACE(fr_dbuff_freespace(&work_dbuff), RADIUS_HEADER_LENGTH);
+
+	packet_ctx.secret = secret;
+	packet_ctx.vector = packet + 4;
+	packet_ctx.rand_ctx.a = fr_rand();
+	packet_ctx.rand_ctx.b = fr_rand();
 
 	switch (code) {
 	case FR_CODE_ACCESS_REQUEST:
@@ -951,17 +1257,12 @@ ssize_t fr_radius_encode(uint8_t *packet, size_t packet_len, uint8_t const *orig
 		return -1;
 	}
 
-	CHECK_FREESPACE(out_end - out_p, RADIUS_HEADER_LENGTH);
-
-	*out_p++ = code;
-	*out_p++ = id;
-	*out_p++ = 0;
-	*out_p++ = RADIUS_HEADER_LENGTH;
+	FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, code, id, 0, RADIUS_HEADER_LENGTH);
 
 	/*
 	 *	Skip over the auth vector
 	 */
-	out_p += RADIUS_AUTH_VECTOR_LENGTH;
+	FR_DBUFF_ADVANCE_RETURN(&work_dbuff, RADIUS_AUTH_VECTOR_LENGTH);
 
 	/*
 	 *	If we're sending Protocol-Error, add in
@@ -969,82 +1270,113 @@ ssize_t fr_radius_encode(uint8_t *packet, size_t packet_len, uint8_t const *orig
 	 *	later themselves, well, too bad.
 	 */
 	if (code == FR_CODE_PROTOCOL_ERROR) {
-		CHECK_FREESPACE(out_end - out_p, 7);
-
-		*out_p++ = 241;
-		*out_p++ = 7;
-		*out_p++ = 4;	/* Original-Packet-Code */
-		*out_p++ = 0;
-		*out_p++ = 0;
-		*out_p++ = 0;
-		*out_p++ = original[0];
+		FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, 241, 7, 4,	/* Original-Packet-Code */
+					 0, 0, 0, original[0]);
 	}
 
 	/*
-	 *	Loop over the reply attributes for the packet.
+	 *	Attributes which are the same in every packet
+	 *	were encoded earlier, and are copied as-is.
 	 */
-	fr_cursor_talloc_iter_init(&cursor, &vps, fr_proto_next_encodable, dict_radius, VALUE_PAIR);
-	while ((vp = fr_cursor_current(&cursor))) {
-		VP_VERIFY(vp);
+	if (preencoded_len) FR_DBUFF_MEMCPY_IN_RETURN(&work_dbuff, preencoded, preencoded_len);
 
-		/*
-		 *	Ignore non-wire attributes, but allow extended
-		 *	attributes.
-		 */
-		if (vp->da->flags.internal) {
-#ifndef NDEBUG
-			/*
-			 *	Permit the admin to send BADLY formatted
-			 *	attributes with a debug build.
-			 */
-			if (vp->da == attr_raw_attribute) {
-				CHECK_FREESPACE(vp->vp_length, vp->vp_length);
+	slen = radius_encode_pairs(&work_dbuff, vps, &packet_ctx);
+	if (slen < 0) return slen;
 
-				/*
-				 *	Skip really badly formatted attributes
-				 */
-				if (vp->vp_length > (RADIUS_MAX_STRING_LENGTH + 2)) {
-					fr_cursor_next(&cursor);
-					continue;
-				}
+	/*
+	 *	Fill in the length field we zeroed out earlier.
+	 *
+	 */
+	fr_net_from_uint16(packet + 2, fr_dbuff_used(&work_dbuff));
 
-				memcpy(out_p, vp->vp_octets, vp->vp_length);
-				out_p += vp->vp_length;
-				fr_cursor_next(&cursor);
-				continue;
-			}
-#endif
-			/*
-			 *	Skip internal attributes...
-			 */
-			fr_cursor_next(&cursor);
-			continue;
-		}
+	FR_PROTO_HEX_DUMP(packet, fr_dbuff_used(&work_dbuff), "%s encoded packet", __FUNCTION__);
 
-		/*
-		 *	Encode an individual VP
-		 */
-		slen = fr_radius_encode_pair(out_p, out_end - out_p, &cursor, &packet_ctx);
-		if (slen < 0) {
-			if (slen == PAIR_ENCODE_SKIPPED) continue;
-			return slen;
+	return fr_dbuff_commit(dbuff, &work_dbuff);
+}
+
+/** Encode VPS into a raw RADIUS packet.
+ *
+ * The packet is written directly into the dbuff, which is advanced past
+ * it only if the whole packet was encoded.
+ */
+ssize_t fr_radius_encode_dbuff(fr_dbuff_t *dbuff, uint8_t const *original,
+			       char const *secret, size_t secret_len, int code, int id, VALUE_PAIR *vps)
+{
+	return fr_radius_encode_dbuff_preencoded(dbuff, original, secret, secret_len, code, id, NULL, 0, vps);
+}
+
+/** Encode attributes which are the same in every packet
+ *
+ * Replies often contain the same set of attributes, with only one or two
+ * which change.  Encoding the constant ones once, and copying the result
+ * into each packet with #fr_radius_encode_dbuff_preencoded avoids walking
+ * the dictionary for them every time.
+ *
+ * Attributes which are encrypted depend on the packet's authenticator,
+ * so they can't be preencoded.  Preencoded attributes are placed before
+ * the per-packet attributes.
+ *
+ * @param[in] ctx	to allocate the encoded attributes in.
+ * @param[out] out	the encoded attributes.  The length is given by
+ *			talloc_array_length().  NULL if there were none.
+ * @param[in] vps	to encode.
+ * @return
+ *	- The length of the encoded attributes.
+ *	- <0 on error.
+ */
+ssize_t fr_radius_preencode(TALLOC_CTX *ctx, uint8_t **out, VALUE_PAIR *vps)
+{
+	uint8_t			buffer[RADIUS_MAX_PACKET_SIZE - RADIUS_HEADER_LENGTH];
+	fr_dbuff_t		dbuff;
+	fr_radius_ctx_t		packet_ctx = {};
+	VALUE_PAIR		*vp;
+	fr_cursor_t		cursor;
+	ssize_t			slen;
+
+	*out = NULL;
+
+	for (vp = fr_cursor_init(&cursor, &vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		if (vp->da->flags.extra) continue;
+
+		switch (vp->da->flags.subtype) {
+		case FLAG_ENCRYPT_USER_PASSWORD:
+		case FLAG_ENCRYPT_TUNNEL_PASSWORD:
+		case FLAG_ENCRYPT_ASCEND_SECRET:
+			fr_strerror_printf("Attribute %s is encrypted, and cannot be preencoded", vp->da->name);
+			return -1;
+
+		default:
+			break;
 		}
+	}
 
-		/*
-		 *	Advance position in the output buffer
-		 */
-		out_p += slen;
-	} /* done looping over all attributes */
+	packet_ctx.vector = nullvector;
 
-	/*
-	 *	Fill in the length field we zeroed out earlier.
-	 *
-	 */
-	fr_net_from_uint16(packet + 2, out_p - packet);
+	fr_dbuff_init(&dbuff, buffer, sizeof(buffer));
+	slen = radius_encode_pairs(&dbuff, vps, &packet_ctx);
+	if (slen < 0) return slen;
+
+	if (!fr_dbuff_used(&dbuff)) return 0;
 
-	FR_PROTO_HEX_DUMP(packet, out_p - packet, "%s encoded packet", __FUNCTION__);
+	*out = talloc_memdup(ctx, buffer, fr_dbuff_used(&dbuff));
+	if (!*out) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
 
-	return out_p - packet;
+	return fr_dbuff_used(&dbuff);
+}
+
+/** Encode VPS into a raw RADIUS packet.
+ *
+ */
+ssize_t fr_radius_encode(uint8_t *packet, size_t packet_len, uint8_t const *original,
+			 char const *secret, size_t secret_len, int code, int id, VALUE_PAIR *vps)
+{
+	return fr_radius_encode_dbuff(FR_DBUFF_TMP(packet, packet_len), original,
+				      secret, secret_len, code, id, vps);
 }
 
 /** Decode a raw RADIUS packet into VPs.
@@ -445,8 +445,8 @@ ssize_t fr_radius_decode_tlv(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_t con
 			/*
 			 *	Build an unknown attr
 			 */
-			child = fr_dict_unknown_afrom_fields(packet_ctx->tmp_ctx, parent,
-							     fr_dict_vendor_num_by_da(parent), p[0]);
+			child = fr_dict_unknown_cached_by_fields(packet_ctx->tmp_ctx, parent,
+								 fr_dict_vendor_num_by_da(parent), p[0]);
 			if (!child) {
 			error:
 				fr_pair_list_free(&head);
@@ -548,7 +548,7 @@ static ssize_t decode_vsa_internal(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict
 	 *	See if the VSA is known.
 	 */
 	da = fr_dict_attr_child_by_num(parent, attribute);
-	if (!da) da = fr_dict_unknown_afrom_fields(packet_ctx->tmp_ctx, parent, dv->pen, attribute);
+	if (!da) da = fr_dict_unknown_cached_by_fields(packet_ctx->tmp_ctx, parent, dv->pen, attribute);
 	if (!da) return -1;
 	FR_PROTO_TRACE("decode context changed %s -> %s", da->parent->name, da->name);
 
@@ -698,7 +698,7 @@ static ssize_t decode_wimax(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_t cons
 	if (((size_t) (data[5] + 4)) != attr_len) return -1;
 
 	da = fr_dict_attr_child_by_num(parent, data[4]);
-	if (!da) da = fr_dict_unknown_afrom_fields(packet_ctx->tmp_ctx, parent, vendor, data[4]);
+	if (!da) da = fr_dict_unknown_cached_by_fields(packet_ctx->tmp_ctx, parent, vendor, data[4]);
 	if (!da) return -1;
 	FR_PROTO_TRACE("decode context changed %s -> %s", da->parent->name, da->name);
 
@@ -1282,7 +1282,7 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dic
 		 *	and succeed, instead of failing.  So we don't
 		 *	need to handle that case here.
 		 */
-		child = fr_dict_unknown_afrom_fields(packet_ctx->tmp_ctx, parent, 0, p[0]);
+		child = fr_dict_unknown_cached_by_fields(packet_ctx->tmp_ctx, parent, 0, p[0]);
 		if (!child) goto raw;
 
 		/*
@@ -1328,14 +1328,14 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dic
 				 *	If there's no child, it means the vendor is unknown
 				 *	which means the child attribute is unknown too.
 				 *
-				 *	fr_dict_unknown_afrom_fields will do the right thing
+				 *	fr_dict_unknown_cached_by_fields will do the right thing
 				 *	and create both an unknown vendor and an unknown
 				 *	attr.
 				 *
 				 *	This can be used later by the encoder to rebuild
 				 *	the attribute header.
 				 */
-				parent = fr_dict_unknown_afrom_fields(packet_ctx->tmp_ctx, parent, vendor, p[4]);
+				parent = fr_dict_unknown_cached_by_fields(packet_ctx->tmp_ctx, parent, vendor, p[4]);
 				p += 5;
 				data_len -= 5;
 				break;
@@ -1345,10 +1345,10 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dic
 			if (!child) {
 				/*
 				 *	Vendor exists but child didn't, again
-				 *	fr_dict_unknown_afrom_fields will do the right thing
+				 *	fr_dict_unknown_cached_by_fields will do the right thing
 				 *	and only create the unknown attr.
 				 */
-				parent = fr_dict_unknown_afrom_fields(packet_ctx->tmp_ctx, parent, vendor, p[4]);
+				parent = fr_dict_unknown_cached_by_fields(packet_ctx->tmp_ctx, parent, vendor, p[4]);
 				p += 5;
 				data_len -= 5;
 				break;
@@ -1583,7 +1583,7 @@ ssize_t fr_radius_decode_pair(TALLOC_CTX *ctx, fr_cursor_t *cursor, fr_dict_t co
 	da = fr_dict_attr_child_by_num(fr_dict_root(dict), data[0]);
 	if (!da) {
 		FR_PROTO_TRACE("Unknown attribute %u", data[0]);
-		da = fr_dict_unknown_afrom_fields(packet_ctx->tmp_ctx, fr_dict_root(dict), 0, data[0]);
+		da = fr_dict_unknown_cached_by_fields(packet_ctx->tmp_ctx, fr_dict_root(dict), 0, data[0]);
 	}
 	if (!da) return -1;
 	FR_PROTO_TRACE("decode context changed %s -> %s",da->parent->name, da->name);
@@ -31,15 +31,19 @@ RCSID("$Id$")
 #include <freeradius-devel/io/test_point.h>
 #include "attrs.h"
 
-static ssize_t encode_value(uint8_t *out, size_t outlen,
+static ssize_t encode_value(fr_dbuff_t *dbuff,
 			    fr_da_stack_t *da_stack, unsigned int depth,
 			    fr_cursor_t *cursor, void *encoder_ctx);
 
-static ssize_t encode_rfc_hdr_internal(uint8_t *out, size_t outlen,
+static ssize_t encode_value_raw(uint8_t *out, size_t outlen,
+				fr_da_stack_t *da_stack, unsigned int depth,
+				fr_cursor_t *cursor, void *encoder_ctx);
+
+static ssize_t encode_rfc_hdr_internal(fr_dbuff_t *dbuff,
 				       fr_da_stack_t *da_stack, unsigned int depth,
 				       fr_cursor_t *cursor, void *encoder_ctx);
 
-static ssize_t encode_tlv_hdr(uint8_t *out, size_t outlen,
+static ssize_t encode_tlv_hdr(fr_dbuff_t *dbuff,
 			      fr_da_stack_t *da_stack, unsigned int depth,
 			      fr_cursor_t *cursor, void *encoder_ctx);
 
@@ -82,9 +86,10 @@ void fr_radius_encode_chap_password(uint8_t out[static 1 + RADIUS_CHAP_CHALLENGE
 
 /** "encrypt" a password RADIUS style
  *
- * Input and output buffers can be identical if in-place encryption is needed.
+ * The input may point to the same memory as the output dbuff, if
+ * in-place encryption is needed.
  */
-static ssize_t encode_password(uint8_t *out, ssize_t outlen, uint8_t const *input, size_t inlen,
+static ssize_t encode_password(fr_dbuff_t *dbuff, uint8_t const *input, size_t inlen,
 			       char const *secret, uint8_t const *vector)
 {
 	fr_md5_ctx_t	*md5_ctx, *md5_ctx_old;
@@ -134,17 +139,14 @@ static ssize_t encode_password(uint8_t *out, ssize_t outlen, uint8_t const *inpu
 	fr_md5_ctx_free(&md5_ctx_old);
 
 	/*
-	 *	Return how many bytes we would have needed
+	 *	Returns how many bytes we would have needed
+	 *	if there isn't enough room.
 	 */
-	if (len > (size_t) outlen) return -(len - outlen);
-
-	memcpy(out, passwd, len);
-
-	return len;
+	return fr_dbuff_memcpy_in(dbuff, passwd, len);
 }
 
 
-static ssize_t encode_tunnel_password(uint8_t *out, size_t outlen,
+static ssize_t encode_tunnel_password(fr_dbuff_t *dbuff,
 				      uint8_t const *in, size_t inlen, void *encoder_ctx)
 {
 	fr_md5_ctx_t	*md5_ctx, *md5_ctx_old;
@@ -155,6 +157,13 @@ static ssize_t encode_tunnel_password(uint8_t *out, size_t outlen,
 	fr_radius_ctx_t	*packet_ctx = encoder_ctx;
 	uint32_t	r;
 	size_t		len;
+	size_t		outlen = fr_dbuff_freespace(dbuff);
+
+	/*
+	 *	We always need room for the salt, and the
+	 *	encoded "length" field.
+	 */
+	CHECK_FREESPACE(outlen, 3);
 
 	/*
 	 *	The password gets encoded with a 1-byte "length"
@@ -250,45 +259,37 @@ static ssize_t encode_tunnel_password(uint8_t *out, size_t outlen,
 	fr_md5_ctx_free(&md5_ctx);
 	fr_md5_ctx_free(&md5_ctx_old);
 
-	memcpy(out, tpasswd, len);
-
-	return len;
+	return fr_dbuff_memcpy_in(dbuff, tpasswd, len);
 }
 
-static ssize_t encode_tlv_hdr_internal(uint8_t *out, size_t outlen,
+static ssize_t encode_tlv_hdr_internal(fr_dbuff_t *dbuff,
 				       fr_da_stack_t *da_stack, unsigned int depth,
 				       fr_cursor_t *cursor, void *encoder_ctx)
 {
 	ssize_t			slen;
-	uint8_t			*p = out;
+	fr_dbuff_t		work_dbuff;
 	VALUE_PAIR const	*vp = fr_cursor_current(cursor);
 	fr_dict_attr_t const	*da = da_stack->da[depth];
 
-	while (outlen >= 5) {
-		size_t sublen;
+	fr_dbuff_reservation_init(&work_dbuff, dbuff, SIZE_MAX);
+
+	while (fr_dbuff_freespace(&work_dbuff) >= 5) {
 		FR_PROTO_STACK_PRINT(da_stack, depth);
 
 		/*
 		 *	This attribute carries sub-TLVs.  The sub-TLVs
 		 *	can only carry 255 bytes of data.
-		 */
-		sublen = outlen;
-		if (sublen > 255) sublen = 255;
-
-		/*
+		 *
 		 *	Determine the nested type and call the appropriate encoder
 		 */
 		if (da_stack->da[depth + 1]->type == FR_TYPE_TLV) {
-			slen = encode_tlv_hdr(p, sublen, da_stack, depth + 1, cursor, encoder_ctx);
+			slen = encode_tlv_hdr(FR_DBUFF_MAX(&work_dbuff, 255), da_stack, depth + 1, cursor, encoder_ctx);
 		} else {
-			slen = encode_rfc_hdr_internal(p, sublen, da_stack, depth + 1, cursor, encoder_ctx);
+			slen = encode_rfc_hdr_internal(FR_DBUFF_MAX(&work_dbuff, 255), da_stack, depth + 1, cursor, encoder_ctx);
 		}
 
 		if (slen <= 0) return slen;
 
-		p += slen;
-		outlen -= slen;				/* Subtract from the buffer we have available */
-
 		/*
 		 *	If nothing updated the attribute, stop
 		 */
@@ -303,14 +304,16 @@ static ssize_t encode_tlv_hdr_internal(uint8_t *out, size_t outlen,
 		vp = fr_cursor_current(cursor);
 	}
 
-	return p - out;
+	return fr_dbuff_commit(dbuff, &work_dbuff);
 }
 
-static ssize_t encode_tlv_hdr(uint8_t *out, size_t outlen,
+static ssize_t encode_tlv_hdr(fr_dbuff_t *dbuff,
 			      fr_da_stack_t *da_stack, unsigned int depth,
 			      fr_cursor_t *cursor, void *encoder_ctx)
 {
 	ssize_t			slen;
+	fr_dbuff_t		work_dbuff;
+	uint8_t			*hdr;
 
 	VP_VERIFY(fr_cursor_current(cursor));
 	FR_PROTO_STACK_PRINT(da_stack, depth);
@@ -326,22 +329,35 @@ static ssize_t encode_tlv_hdr(uint8_t *out, size_t outlen,
 		return PAIR_ENCODE_SKIPPED;
 	}
 
-	CHECK_FREESPACE(outlen, 5);
+	fr_dbuff_reservation_init(&work_dbuff, dbuff, UINT8_MAX);
+	CHECK_FREESPACE(fr_dbuff_freespace(&work_dbuff), 5);
 
 	/*
 	 *	Encode the first level of TLVs
 	 */
-	out[0] = da_stack->da[depth]->attr & 0xff;
-	out[1] = 2;	/* TLV header */
-
-	if (outlen > 255) outlen = 255;
+	hdr = work_dbuff.p;
+	FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, da_stack->da[depth]->attr & 0xff, 2);	/* TLV header */
 
-	slen = encode_tlv_hdr_internal(out + out[1], outlen - out[1], da_stack, depth, cursor, encoder_ctx);
+	slen = encode_tlv_hdr_internal(&work_dbuff, da_stack, depth, cursor, encoder_ctx);
 	if (slen <= 0) return slen;
 
-	out[1] += slen;
+	hdr[1] += slen;
 
-	return out[1];
+	return fr_dbuff_commit(dbuff, &work_dbuff);
+}
+
+/** Adapts encode_value for the raw buffer callback used by fr_struct_to_network
+ *
+ */
+static ssize_t encode_value_raw(uint8_t *out, size_t outlen,
+				fr_da_stack_t *da_stack, unsigned int depth,
+				fr_cursor_t *cursor, void *encoder_ctx)
+{
+	fr_dbuff_t	dbuff;
+
+	fr_dbuff_init(&dbuff, out, outlen);
+
+	return encode_value(&dbuff, da_stack, depth, cursor, encoder_ctx);
 }
 
 /** Encodes the data portion of an attribute
@@ -354,7 +370,7 @@ static ssize_t encode_tlv_hdr(uint8_t *out, size_t outlen,
  *	PAIR_ENCODE_FATAL_ERROR - Abort encoding the packet.
  *	PAIR_ENCODE_SKIPPED - Unencodable value
  */
-static ssize_t encode_value(uint8_t *out, size_t outlen,
+static ssize_t encode_value(fr_dbuff_t *dbuff,
 			    fr_da_stack_t *da_stack, unsigned int depth,
 			    fr_cursor_t *cursor, void *encoder_ctx)
 {
@@ -364,9 +380,8 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 	fr_dict_attr_t const	*da = da_stack->da[depth];
 	fr_radius_ctx_t		*packet_ctx = encoder_ctx;
 
-	uint8_t			*out_p = out;
-	uint8_t			*out_end = out + outlen;
-	uint8_t			*value_start = out_p;
+	fr_dbuff_t		work_dbuff, value_dbuff;
+	uint8_t			*value_start, *value_end;
 
 	VP_VERIFY(vp);
 	FR_PROTO_STACK_PRINT(da_stack, depth);
@@ -383,21 +398,23 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 	 *	It's a little weird to consider a TLV as a value,
 	 *	but it seems to work OK.
 	 */
-	if (da->type == FR_TYPE_TLV) return encode_tlv_hdr(out_p, out_end - out_p,
-							   da_stack, depth, cursor, encoder_ctx);
+	if (da->type == FR_TYPE_TLV) return encode_tlv_hdr(dbuff, da_stack, depth, cursor, encoder_ctx);
+
+	fr_dbuff_reservation_init(&work_dbuff, dbuff, SIZE_MAX);
 
 	/*
 	 *	This has special requirements.
 	 */
 	if (da->type == FR_TYPE_STRUCT) {
-		slen = fr_struct_to_network(out_p, out_end - out_p, da_stack, depth, cursor, encoder_ctx, encode_value);
+		slen = fr_struct_to_network(work_dbuff.p, fr_dbuff_freespace(&work_dbuff),
+					    da_stack, depth, cursor, encoder_ctx, encode_value_raw);
 		if (slen <= 0) return slen;
 
+		FR_DBUFF_ADVANCE_RETURN(&work_dbuff, slen);
+
 		vp = fr_cursor_current(cursor);
 		fr_proto_da_stack_build(da_stack, vp ? vp->da : NULL);
 
-		out_p += slen;
-
 		/*
 		 *	Encode any TLV, attributes which are part of this structure.
 		 *
@@ -410,17 +427,16 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 		 *	TLV to be encoded here.  It's number is just
 		 *	the field number in the struct.
 		 */
-		while (vp && (da_stack->da[depth] == da) && (da_stack->depth >= da->depth) && (out_p < out_end)) {
-			slen = encode_tlv_hdr_internal(out_p, out_end - out_p, da_stack, depth + 1, cursor, encoder_ctx);
+		while (vp && (da_stack->da[depth] == da) && (da_stack->depth >= da->depth) &&
+		       (fr_dbuff_freespace(&work_dbuff) > 0)) {
+			slen = encode_tlv_hdr_internal(&work_dbuff, da_stack, depth + 1, cursor, encoder_ctx);
 			if (slen < 0) return slen;
 
-			out_p += slen;
-
 			vp = fr_cursor_current(cursor);
 			fr_proto_da_stack_build(da_stack, vp ? vp->da : NULL);
 		}
 
-		return out_p - out;
+		return fr_dbuff_commit(dbuff, &work_dbuff);
 	}
 
 	/*
@@ -463,10 +479,9 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 	 *	is zero.
 	 */
 	if ((vp->da->type == FR_TYPE_STRING) && vp->da->flags.has_tag && (TAG_VALID(vp->tag) || TAG_VALID_ZERO(vp->vp_strvalue[0]))) {
-		CHECK_FREESPACE(out_end - out_p, 1);
-		*out_p++ = vp->tag;
-		value_start = out_p;
+		FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, vp->tag);
 	}
+	value_start = work_dbuff.p;
 
 	/*
 	 *	Set up the default sources for the data.
@@ -486,7 +501,7 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 	 *	For everything else, return the number of
 	 *	additional bytes we need.
 	 */
-	CHECK_FREESPACE(out_end - out_p, len);
+	CHECK_FREESPACE(fr_dbuff_freespace(&work_dbuff), len);
 
 	switch (da->type) {
 	/*
@@ -495,21 +510,18 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 	 */
 	case FR_TYPE_OCTETS:
 	case FR_TYPE_STRING:
-		memcpy(out_p, vp->vp_ptr, len);
-		out_p += len;
+		FR_DBUFF_MEMCPY_IN_RETURN(&work_dbuff, vp->vp_ptr, len);
 		break;
 
 	case FR_TYPE_ABINARY:
-		memcpy(out_p, vp->vp_filter, len);
-		out_p += len;
+		FR_DBUFF_MEMCPY_IN_RETURN(&work_dbuff, (uint8_t const *) vp->vp_filter, len);
 		break;
 
 	/*
 	 *	Common encoder might add scope byte
 	 */
 	case FR_TYPE_IPV6_ADDR:
-		memcpy(out_p, vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
-		out_p += len;
+		FR_DBUFF_MEMCPY_IN_RETURN(&work_dbuff, vp->vp_ipv6addr, sizeof(vp->vp_ipv6addr));
 		break;
 
 	/*
@@ -518,22 +530,18 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 	case FR_TYPE_IPV6_PREFIX:
 		len = vp->vp_ip.prefix >> 3;		/* Convert bits to whole bytes */
 
-		CHECK_FREESPACE(out_end - out_p, 2 + len);
+		CHECK_FREESPACE(fr_dbuff_freespace(&work_dbuff), 2 + len);
 
-		*out_p++ = 0;
-		*out_p++ = vp->vp_ip.prefix;
-		memcpy(out_p, vp->vp_ipv6addr, len);	/* Only copy the minimum number of address bytes required */
-		out_p += len;
+		FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, 0, vp->vp_ip.prefix);
+		FR_DBUFF_MEMCPY_IN_RETURN(&work_dbuff, vp->vp_ipv6addr, len);	/* Only copy the minimum number of address bytes required */
 		break;
 
 	/*
 	 *	Common encoder doesn't add reserved byte
 	 */
 	case FR_TYPE_IPV4_PREFIX:
-		*out_p++ = 0;
-		*out_p++ = vp->vp_ip.prefix;
-		memcpy(out_p, &vp->vp_ipv4addr, sizeof(vp->vp_ipv4addr));
-		out_p += sizeof(vp->vp_ipv4addr);
+		FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, 0, vp->vp_ip.prefix);
+		FR_DBUFF_MEMCPY_IN_RETURN(&work_dbuff, (uint8_t const *) &vp->vp_ipv4addr, sizeof(vp->vp_ipv4addr));
 		break;
 
 	/*
@@ -558,10 +566,11 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 	{
 		size_t need = 0;
 
-		slen = fr_value_box_to_network(&need, out_p, out_end - out_p, &vp->data);
+		slen = fr_value_box_to_network(&need, work_dbuff.p, fr_dbuff_freespace(&work_dbuff), &vp->data);
 		if (slen < 0) return slen;
 		if (need > 0) return -(need);
-		out_p += slen;
+
+		FR_DBUFF_ADVANCE_RETURN(&work_dbuff, slen);
 	}
 		break;
 
@@ -585,63 +594,57 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 	 *	No data: don't encode the value.  The type and length should still
 	 *	be written.
 	 */
-	if (out_p == out) {
+	if (fr_dbuff_used(&work_dbuff) == 0) {
 		vp = fr_cursor_next(cursor);
 		fr_proto_da_stack_build(da_stack, vp ? vp->da : NULL);
 		return 0;
 	}
 
-	/*
-	 *	Shouldn't happen, but if it does return how much
-	 *	the overrun was.
-	 */
-	if (!fr_cond_assert(out_p <= out_end)) return -((out_end - out_p) + 1);
+	value_end = work_dbuff.p;
 
 	/*
 	 *	Encrypt the various password styles
 	 *
 	 *	Attributes with encrypted values MUST be less than
 	 *	128 bytes long.
+	 *
+	 *	The cipher text is written over the plain text, which
+	 *	is still in the free space of the reservation.
 	 */
 	if (!da->flags.extra) switch (vp->da->flags.subtype) {
 	case FLAG_ENCRYPT_USER_PASSWORD:
-	{
-		uint8_t *value_end = out_p;
-
-		out_p = value_start;	/* Reset */
+		fr_dbuff_init(&value_dbuff, value_start, work_dbuff.end);
 
 		/*
 		 *	Encode the password in place
 		 */
-		slen = encode_password(out_p, out_end - out_p,
+		slen = encode_password(&value_dbuff,
 				       value_start, value_end - value_start,
 				       packet_ctx->secret, packet_ctx->vector);
 		if (slen < 0) return slen;
 
-		out_p += slen;
-	}
+		value_end = value_dbuff.p;
 		break;
 
 	case FLAG_ENCRYPT_TUNNEL_PASSWORD:
-	{
-		uint8_t *value_end = out_p;
-
-		out_p = value_start;	/* Reset */
-
 		/*
 		 *	Hack - Always encode the tag even if it's zero.
 		 *
 		 *	Not sure why we do this, but the old code did...
 		 */
-		if (vp->da->flags.has_tag && !TAG_VALID(vp->tag)) out_p++;
+		if (vp->da->flags.has_tag && !TAG_VALID(vp->tag)) {
+			fr_dbuff_init(&value_dbuff, value_start + 1, work_dbuff.end);
+		} else {
+			fr_dbuff_init(&value_dbuff, value_start, work_dbuff.end);
+		}
 
-		slen = encode_tunnel_password(out_p, out_end - out_p,
+		slen = encode_tunnel_password(&value_dbuff,
 					      value_start, value_end - value_start, packet_ctx);
 		if (slen < 0) {
 			/*
 			 *	This is an un-encodable tunnel_password_attribute
 			 */
-			if (outlen >= RADIUS_MAX_STRING_LENGTH) {
+			if (fr_dbuff_len(&work_dbuff) >= RADIUS_MAX_STRING_LENGTH) {
 				fr_strerror_printf("%s too long", vp->da->name);
 				return PAIR_ENCODE_SKIPPED;
 			}
@@ -654,8 +657,7 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 		 */
 		if (vp->da->flags.has_tag && !TAG_VALID(vp->tag)) *value_start = 0x00;
 
-		out_p += slen;
-	}
+		value_end = value_dbuff.p;
 		break;
 
 	/*
@@ -663,18 +665,12 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 	 *	always fits.
 	 */
 	case FLAG_ENCRYPT_ASCEND_SECRET:
-	{
-		uint8_t *value_end = out_p;
-
-		out_p = value_start;	/* Reset */
-
-		slen = fr_radius_ascend_secret(out_p, out_end - out_p,
+		slen = fr_radius_ascend_secret(value_start, work_dbuff.end - value_start,
 					       value_start, value_end - value_start,
 					       packet_ctx->secret, packet_ctx->vector);
 		if (slen < 0) return slen;
-		out_p += slen;
 
-	}
+		value_end = value_start + slen;
 		break;
 	}
 
@@ -698,7 +694,7 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 		value_start[0] = vp->tag;
 	}
 
-	FR_PROTO_HEX_DUMP(out, out_p - out, "value %s",
+	FR_PROTO_HEX_DUMP(work_dbuff.start, value_end - work_dbuff.start, "value %s",
 			  fr_table_str_by_value(fr_value_box_type_table, vp->vp_type, "<UNKNOWN>"));
 
 	/*
@@ -707,68 +703,73 @@ static ssize_t encode_value(uint8_t *out, size_t outlen,
 	vp = fr_cursor_next(cursor);
 	fr_proto_da_stack_build(da_stack, vp ? vp->da : NULL);
 
-	return out_p - out;
+	/*
+	 *	The value may have grown or shrunk when it was
+	 *	encrypted, so commit exactly what's there now.
+	 */
+	return fr_dbuff_advance(dbuff, value_end - work_dbuff.start);
 }
 
-static ssize_t attr_shift(uint8_t const *start, uint8_t const *end,
-			  uint8_t *ptr, int hdr_len, ssize_t len,
-			  int flag_offset, int vsa_offset)
+/** Split an attribute which is longer than 255 bytes into fragments
+ *
+ * The work dbuff holds the first attribute header, followed by "len"
+ * bytes of data.  A copy of the first "hdr_len" bytes of the header
+ * is inserted before each 255 - hdr_len chunk of data past the first
+ * fragment, and the length and flag fields are fixed up.
+ *
+ * Fragments are built from the last one to the first, so that every
+ * byte of data is moved exactly once.
+ *
+ * @param[in] work		Reservation holding the attribute.  Is advanced
+ *				past the inserted headers.
+ * @param[in] hdr_len		Length of the header repeated in each continuation.
+ * @param[in] len		Length of the data following the first header.
+ * @param[in] flag_offset	Offset of the flags byte which carries the "more" bit.
+ * @param[in] vsa_offset	Offset of an inner length field, or 0 if there isn't one.
+ * @return
+ *	- >0 the total length of the fragments.
+ *	- <0 how many additional bytes we'd need.
+ */
+static ssize_t encode_fragment(fr_dbuff_t *work, size_t hdr_len, size_t len, int flag_offset, int vsa_offset)
 {
-	int check_len = len - ptr[1];
-	int total = len + hdr_len;
+	uint8_t		*hdr = work->start;
+	size_t		first = 255 - hdr[1];
+	size_t		frag_max = 255 - hdr_len;
+	size_t		num, i, frag_len;
+	uint8_t		vsa_base = vsa_offset ? hdr[vsa_offset] : 0;
 
-	/*
-	 *	Pass 1: Check if the addition of the headers
-	 *	overflows the available freespace.  If so, return
-	 *	what we were capable of encoding.
-	 */
+	fr_assert(len > first);
 
-	while (check_len > (255 - hdr_len)) {
-		total += hdr_len;
-		check_len -= (255 - hdr_len);
-	}
+	num = ((len - first) + (frag_max - 1)) / frag_max;
 
-	/*
-	 *	Note that this results in a number of attributes maybe
-	 *	being marked as "encoded", but which aren't in the
-	 *	packet.  Oh well.  The solution is to fix the
-	 *	"encode_value" function to take into account the header
-	 *	lengths.
-	 */
-	if ((ptr + ptr[1] + total) > end) return (ptr + ptr[1]) - start;
+	CHECK_FREESPACE(fr_dbuff_freespace(work), num * hdr_len);
 
-	/*
-	 *	Pass 2: Now that we know there's enough freespace,
-	 *	re-arrange the data to form a set of valid
-	 *	RADIUS attributes.
-	 */
-	while (1) {
-		int sublen = 255 - ptr[1];
+	for (i = num; i > 0; i--) {
+		uint8_t *frag = hdr + (i * 255);
 
-		if (len <= sublen) break;
+		frag_len = (i < num) ? frag_max : (len - first) - ((num - 1) * frag_max);
 
-		len -= sublen;
-		memmove(ptr + 255 + hdr_len, ptr + 255, sublen);
-		memmove(ptr + 255, ptr, hdr_len);
-		ptr[1] += sublen;
-		if (vsa_offset) ptr[vsa_offset] += sublen;
-		ptr[flag_offset] |= 0x80;
+		memmove(frag + hdr_len, hdr + 255 + ((i - 1) * frag_max), frag_len);
+		memcpy(frag, hdr, hdr_len);
 
-		ptr += 255;
-		ptr[1] = hdr_len;
-		if (vsa_offset) ptr[vsa_offset] = 3;
+		frag[1] = hdr_len + frag_len;
+		if (i < num) frag[flag_offset] |= 0x80;
+		if (vsa_offset) frag[vsa_offset] = vsa_base + frag_len;
 	}
 
-	ptr[1] += len;
-	if (vsa_offset) ptr[vsa_offset] += len;
+	hdr[1] = 255;
+	hdr[flag_offset] |= 0x80;
+	if (vsa_offset) hdr[vsa_offset] = vsa_base + first;
+
+	FR_DBUFF_ADVANCE_RETURN(work, num * hdr_len);
 
-	return (ptr + ptr[1]) - start;
+	return fr_dbuff_used(work);
 }
 
 /** Encode an "extended" attribute
  *
  */
-static ssize_t encode_extended_hdr(uint8_t *out, size_t outlen,
+static ssize_t encode_extended_hdr(fr_dbuff_t *dbuff,
 				   fr_da_stack_t *da_stack, unsigned int depth,
 				   fr_cursor_t *cursor, void *encoder_ctx)
 {
@@ -779,7 +780,8 @@ static ssize_t encode_extended_hdr(uint8_t *out, size_t outlen,
 	int			jump = 3;
 #endif
 	int			extra;
-	uint8_t			*start = out;
+	fr_dbuff_t		work_dbuff;
+	uint8_t			*hdr;
 	VALUE_PAIR const	*vp = fr_cursor_current(cursor);
 
 	VP_VERIFY(vp);
@@ -798,21 +800,28 @@ static ssize_t encode_extended_hdr(uint8_t *out, size_t outlen,
 	}
 #endif
 
+	/*
+	 *	Only the "long" extended type can be larger than
+	 *	255 bytes.
+	 */
+	fr_dbuff_reservation_init(&work_dbuff, dbuff, extra ? SIZE_MAX : UINT8_MAX);
+	hdr = work_dbuff.p;
+
 	/*
 	 *	Encode the header for "short" or "long" attributes
 	 */
 	switch (attr_type) {
 	case FR_TYPE_EXTENDED:
-		CHECK_FREESPACE(outlen, 3 + extra);
+		CHECK_FREESPACE(fr_dbuff_freespace(&work_dbuff), 3 + extra);
 
 		/*
 		 *	Encode which extended attribute it is.
 		 */
-		out[0] = da_stack->da[depth++]->attr & 0xff;
-		out[1] = 3 + extra;
-		out[2] = da_stack->da[depth]->attr & 0xff;
+		FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, da_stack->da[depth]->attr & 0xff, 3 + extra,
+					 da_stack->da[depth + 1]->attr & 0xff);
+		depth++;
 
-		if (extra) out[3] = 0;	/* flags start off at zero */
+		if (extra) FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, 0);	/* flags start off at zero */
 		break;
 
 	default:
@@ -828,60 +837,56 @@ static ssize_t encode_extended_hdr(uint8_t *out, size_t outlen,
 	 *	Handle VSA as "VENDOR + attr"
 	 */
 	if (da_stack->da[depth]->type == FR_TYPE_VSA) {
-		uint8_t *evs = out + out[1];
-		uint32_t lvalue;
+		uint8_t evs[5];
 
-		CHECK_FREESPACE(outlen, (out[1] + 5));
+		CHECK_FREESPACE(fr_dbuff_freespace(&work_dbuff), 5);
 
 		depth++;
 
-		lvalue = htonl(da_stack->da[depth++]->attr);
-		memcpy(evs, &lvalue, 4);
-
+		fr_net_from_uint32(evs, da_stack->da[depth++]->attr);
 		evs[4] = da_stack->da[depth]->attr & 0xff;
 
-		out[1] += 5;
+		FR_DBUFF_MEMCPY_IN_RETURN(&work_dbuff, evs, sizeof(evs));
+
+		hdr[1] += 5;
 
 		FR_PROTO_STACK_PRINT(da_stack, depth);
-		FR_PROTO_HEX_DUMP(out, out[1], "header extended vendor specific");
+		FR_PROTO_HEX_DUMP(hdr, hdr[1], "header extended vendor specific");
 	} else {
-		FR_PROTO_HEX_DUMP(out, out[1], "header extended");
+		FR_PROTO_HEX_DUMP(hdr, hdr[1], "header extended");
 	}
 
-	/*
-	 *	"outlen" can be larger than 255 here, but only for the
-	 *	"long" extended type.
-	 */
-	if ((attr_type == FR_TYPE_EXTENDED) && !extra && (outlen > 255)) outlen = 255;
-
 	if (da_stack->da[depth]->type == FR_TYPE_TLV) {
-		slen = encode_tlv_hdr_internal(out + out[1], outlen - out[1], da_stack, depth, cursor, encoder_ctx);
+		slen = encode_tlv_hdr_internal(&work_dbuff, da_stack, depth, cursor, encoder_ctx);
 	} else {
-		slen = encode_value(out + out[1], outlen - out[1], da_stack, depth, cursor, encoder_ctx);
+		slen = encode_value(&work_dbuff, da_stack, depth, cursor, encoder_ctx);
 	}
 	if (slen <= 0) return slen;
 
 	/*
 	 *	There may be more than 255 octets of data encoded in
-	 *	the attribute.  If so, move the data up in the packet,
-	 *	and copy the existing header over.  Set the "M" flag ONLY
-	 *	after copying the rest of the data.
+	 *	the attribute.  If so, split the data into fragments,
+	 *	each with a copy of the existing header.  The "M" flag
+	 *	is set on all but the last fragment.
 	 */
-	if (slen > (255 - out[1])) {
-		return attr_shift(start, start + outlen, out, 4, slen, 3, 0);
+	if (slen > (255 - hdr[1])) {
+		slen = encode_fragment(&work_dbuff, 4, slen, 3, 0);
+		if (slen < 0) return slen;
+
+		return fr_dbuff_commit(dbuff, &work_dbuff);
 	}
 
-	out[1] += slen;
+	hdr[1] += slen;
 
 #ifndef NDEBUG
 	if (fr_debug_lvl > 3) {
 		if (vsa_type == FR_TYPE_VENDOR) jump += 5;
 
-		FR_PROTO_HEX_DUMP(out, jump, "header extended");
+		FR_PROTO_HEX_DUMP(hdr, jump, "header extended");
 	}
 #endif
 
-	return (out + out[1]) - start;
+	return fr_dbuff_commit(dbuff, &work_dbuff);
 }
 
 /** Encode an RFC format attribute, with the "concat" flag set
@@ -892,26 +897,25 @@ static ssize_t encode_extended_hdr(uint8_t *out, size_t outlen,
  * The attribute is split on 253 byte boundaries, with a header
  * prepended to each chunk.
  */
-static ssize_t encode_concat(uint8_t *out, size_t outlen,
+static ssize_t encode_concat(fr_dbuff_t *dbuff,
 			     fr_da_stack_t *da_stack, unsigned int depth,
 			     fr_cursor_t *cursor, UNUSED void *encoder_ctx)
 {
-	uint8_t			*ptr = out;
 	uint8_t			const *p;
 	size_t			left;
 	ssize_t			slen;
+	fr_dbuff_t		work_dbuff;
 	VALUE_PAIR const	*vp = fr_cursor_current(cursor);
 
 	FR_PROTO_STACK_PRINT(da_stack, depth);
 
+	fr_dbuff_reservation_init(&work_dbuff, dbuff, SIZE_MAX);
+
 	p = vp->vp_octets;
 	slen = fr_radius_attr_len(vp);
 
 	while (slen > 0) {
-		if (outlen <= 2) break;
-
-		ptr[0] = da_stack->da[depth]->attr & 0xff;
-		ptr[1] = 2;
+		if (fr_dbuff_freespace(&work_dbuff) <= 2) break;
 
 		left = slen;
 
@@ -919,17 +923,15 @@ static ssize_t encode_concat(uint8_t *out, size_t outlen,
 		if (left > 253) left = 253;
 
 		/* no more than "freespace" octets */
-		if (outlen < (left + 2)) left = outlen - 2;
+		if (fr_dbuff_freespace(&work_dbuff) < (left + 2)) left = fr_dbuff_freespace(&work_dbuff) - 2;
 
-		memcpy(ptr + 2, p, left);
+		FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, da_stack->da[depth]->attr & 0xff, 2 + left);
+		FR_DBUFF_MEMCPY_IN_RETURN(&work_dbuff, p, left);
 
-		FR_PROTO_HEX_DUMP(ptr + 2, left, "concat value octets");
-		FR_PROTO_HEX_DUMP(ptr, 2, "concat header rfc");
+		FR_PROTO_HEX_DUMP(work_dbuff.p - left, left, "concat value octets");
+		FR_PROTO_HEX_DUMP(work_dbuff.p - left - 2, 2, "concat header rfc");
 
-		ptr[1] += left;
-		ptr += ptr[1];
 		p += left;
-		outlen -= left;
 		slen -= left;
 	}
 
@@ -941,7 +943,7 @@ static ssize_t encode_concat(uint8_t *out, size_t outlen,
 	 */
 	fr_proto_da_stack_build(da_stack, vp ? vp->da : NULL);
 
-	return ptr - out;
+	return fr_dbuff_commit(dbuff, &work_dbuff);
 }
 
 /** Encode an RFC format TLV.
@@ -950,11 +952,13 @@ static ssize_t encode_concat(uint8_t *out, size_t outlen,
  * If it's a standard attribute, then vp->da->attr == attribute.
  * Otherwise, attribute may be something else.
  */
-static ssize_t encode_rfc_hdr_internal(uint8_t *out, size_t outlen,
+static ssize_t encode_rfc_hdr_internal(fr_dbuff_t *dbuff,
 				       fr_da_stack_t *da_stack, unsigned int depth,
 				       fr_cursor_t *cursor, void *encoder_ctx)
 {
-	ssize_t slen;
+	ssize_t		slen;
+	fr_dbuff_t	work_dbuff;
+	uint8_t		*hdr;
 
 	FR_PROTO_STACK_PRINT(da_stack, depth);
 
@@ -975,21 +979,19 @@ static ssize_t encode_rfc_hdr_internal(uint8_t *out, size_t outlen,
 		break;
 	}
 
-	CHECK_FREESPACE(outlen, 2);
-
-	out[0] = da_stack->da[depth]->attr & 0xff;
-	out[1] = 2;
+	fr_dbuff_reservation_init(&work_dbuff, dbuff, UINT8_MAX);
+	hdr = work_dbuff.p;
 
-	if (outlen > 255) outlen = 255;
+	FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, da_stack->da[depth]->attr & 0xff, 2);
 
-	slen = encode_value(out + out[1], outlen - out[1], da_stack, depth, cursor, encoder_ctx);
+	slen = encode_value(&work_dbuff, da_stack, depth, cursor, encoder_ctx);
 	if (slen <= 0) return slen;
 
-	out[1] += slen;
+	hdr[1] += slen;
 
-	FR_PROTO_HEX_DUMP(out, 2, "header rfc");
+	FR_PROTO_HEX_DUMP(hdr, 2, "header rfc");
 
-	return out[1];
+	return fr_dbuff_commit(dbuff, &work_dbuff);
 }
 
 
@@ -997,12 +999,14 @@ static ssize_t encode_rfc_hdr_internal(uint8_t *out, size_t outlen,
  *
  * If it's in the RFC format, call encode_rfc_hdr_internal.  Otherwise, encode it here.
  */
-static ssize_t encode_vendor_attr_hdr(uint8_t *out, size_t outlen,
+static ssize_t encode_vendor_attr_hdr(fr_dbuff_t *dbuff,
 				      fr_da_stack_t *da_stack, unsigned int depth,
 				      fr_cursor_t *cursor, void *encoder_ctx)
 {
 	ssize_t			slen;
 	size_t			hdr_len;
+	fr_dbuff_t		work_dbuff;
+	uint8_t			*hdr;
 	fr_dict_attr_t const	*da, *dv;
 
 	FR_PROTO_STACK_PRINT(da_stack, depth);
@@ -1017,11 +1021,14 @@ static ssize_t encode_vendor_attr_hdr(uint8_t *out, size_t outlen,
 	da = da_stack->da[depth];
 
 	if ((da->type != FR_TYPE_TLV) && (dv->flags.type_size == 1) && (dv->flags.length == 1)) {
-		return encode_rfc_hdr_internal(out, outlen, da_stack, depth, cursor, encoder_ctx);
+		return encode_rfc_hdr_internal(dbuff, da_stack, depth, cursor, encoder_ctx);
 	}
 
 	hdr_len = dv->flags.type_size + dv->flags.length;
 
+	fr_dbuff_reservation_init(&work_dbuff, dbuff, UINT8_MAX);
+	hdr = work_dbuff.p;
+
 	/*
 	 *	Vendors use different widths for their
 	 *	attribute number fields.
@@ -1033,15 +1040,16 @@ static ssize_t encode_vendor_attr_hdr(uint8_t *out, size_t outlen,
 
 
 	case 4:
-		fr_net_from_uint32(out, da->attr);
+		FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, (da->attr >> 24) & 0xff, (da->attr >> 16) & 0xff,
+					 (da->attr >> 8) & 0xff, da->attr & 0xff);
 		break;
 
 	case 2:
-		fr_net_from_uint16(out, da->attr);
+		FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, (da->attr >> 8) & 0xff, da->attr & 0xff);
 		break;
 
 	case 1:
-		out[0] = da->attr & 0xff;
+		FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, da->attr & 0xff);
 		break;
 	}
 
@@ -1054,57 +1062,61 @@ static ssize_t encode_vendor_attr_hdr(uint8_t *out, size_t outlen,
 		break;
 
 	case 2:
-		out[dv->flags.type_size] = 0;
-		out[dv->flags.type_size + 1] = dv->flags.type_size + 2;
+		FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, 0, dv->flags.type_size + 2);
 		break;
 
 	case 1:
-		out[dv->flags.type_size] = dv->flags.type_size + 1;
+		FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, dv->flags.type_size + 1);
 		break;
 
 	}
 
-	if (outlen > 255) outlen = 255;
-
 	/*
 	 *	Because we've now encoded the attribute header,
 	 *	if this is a TLV, we must process it via the
 	 *	internal tlv function, else we get a double TLV header.
 	 */
 	if (da_stack->da[depth]->type == FR_TYPE_TLV) {
-		slen = encode_tlv_hdr_internal(out + hdr_len, outlen - hdr_len, da_stack, depth, cursor, encoder_ctx);
+		slen = encode_tlv_hdr_internal(&work_dbuff, da_stack, depth, cursor, encoder_ctx);
 	} else {
-		slen = encode_value(out + hdr_len, outlen - hdr_len, da_stack, depth, cursor, encoder_ctx);
+		slen = encode_value(&work_dbuff, da_stack, depth, cursor, encoder_ctx);
 	}
 	if (slen <= 0) return slen;
 
-	if (dv->flags.length) out[hdr_len - 1] += slen;
+	if (dv->flags.length) hdr[hdr_len - 1] += slen;
 
-	FR_PROTO_HEX_DUMP(out, hdr_len, "header vsa");
+	FR_PROTO_HEX_DUMP(hdr, hdr_len, "header vsa");
 
-	return hdr_len + slen;
+	return fr_dbuff_commit(dbuff, &work_dbuff);
 }
 
 /** Encode a WiMAX attribute
  *
  */
-static ssize_t encode_wimax_hdr(uint8_t *out, size_t outlen,
+static ssize_t encode_wimax_hdr(fr_dbuff_t *dbuff,
 				fr_da_stack_t *da_stack, unsigned int depth,
 				fr_cursor_t *cursor, void *encoder_ctx)
 {
 	ssize_t			slen;
-	uint32_t		lvalue;
-	uint8_t			*start = out;
+	fr_dbuff_t		work_dbuff;
+	uint8_t			*hdr;
+	uint8_t			vendor[4];
 	VALUE_PAIR const	*vp = fr_cursor_current(cursor);
 
 	VP_VERIFY(vp);
 	FR_PROTO_STACK_PRINT(da_stack, depth);
 
+	/*
+	 *	"outlen" can be larger than 255 because of the "continuation" byte.
+	 */
+	fr_dbuff_reservation_init(&work_dbuff, dbuff, SIZE_MAX);
+	hdr = work_dbuff.p;
+
 	/*
 	 *	Not enough freespace for:
 	 *		attr, len, vendor-id, vsa, vsalen, continuation
 	 */
-	CHECK_FREESPACE(outlen, 9);
+	CHECK_FREESPACE(fr_dbuff_freespace(&work_dbuff), 9);
 
 	if (da_stack->da[depth++]->attr != FR_VENDOR_SPECIFIC) {
 		fr_strerror_printf("%s: level[1] of da_stack is incorrect, must be Vendor-Specific (26)",
@@ -1123,56 +1135,56 @@ static ssize_t encode_wimax_hdr(uint8_t *out, size_t outlen,
 	/*
 	 *	Build the Vendor-Specific header
 	 */
-	out = start;
-	out[0] = FR_VENDOR_SPECIFIC;
-	out[1] = 9;
-	lvalue = htonl(fr_dict_vendor_num_by_da(vp->da));
-	memcpy(out + 2, &lvalue, 4);
+	FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, FR_VENDOR_SPECIFIC, 9);
+	fr_net_from_uint32(vendor, fr_dict_vendor_num_by_da(vp->da));
+	FR_DBUFF_MEMCPY_IN_RETURN(&work_dbuff, vendor, sizeof(vendor));
 
 	/*
-	 *	Encode the first attribute
-	 */
-	out[6] = da_stack->da[depth]->attr;
-	out[7] = 3;
-	out[8] = 0;		/* continuation byte */
-
-	/*
-	 *	"outlen" can be larger than 255 because of the "continuation" byte.
+	 *	Encode the first attribute, followed by
+	 *	the continuation byte.
 	 */
+	FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, da_stack->da[depth]->attr & 0xff, 3, 0);
 
 	if (da_stack->da[depth]->type == FR_TYPE_TLV) {
-		slen = encode_tlv_hdr_internal(out + out[1], outlen - out[1], da_stack, depth, cursor, encoder_ctx);
+		slen = encode_tlv_hdr_internal(&work_dbuff, da_stack, depth, cursor, encoder_ctx);
 		if (slen <= 0) return slen;
 	} else {
-		slen = encode_value(out + out[1], outlen - out[1], da_stack, depth, cursor, encoder_ctx);
+		slen = encode_value(&work_dbuff, da_stack, depth, cursor, encoder_ctx);
 		if (slen <= 0) return slen;
 	}
 
 	/*
 	 *	There may be more than 252 octets of data encoded in
-	 *	the attribute.  If so, move the data up in the packet,
-	 *	and copy the existing header over.  Set the "C" flag
-	 *	ONLY after copying the rest of the data.
+	 *	the attribute.  If so, split the data into fragments,
+	 *	each with a copy of the existing header.  The "C" flag
+	 *	is set on all but the last fragment.
 	 */
-	if (slen > (255 - out[1])) return attr_shift(start, start + outlen, out, out[1], slen, 8, 7);
+	if (slen > (255 - hdr[1])) {
+		slen = encode_fragment(&work_dbuff, hdr[1], slen, 8, 7);
+		if (slen < 0) return slen;
 
-	out[1] += slen;
-	out[7] += slen;
+		return fr_dbuff_commit(dbuff, &work_dbuff);
+	}
 
-	FR_PROTO_HEX_DUMP(out, 9, "header wimax");
+	hdr[1] += slen;
+	hdr[7] += slen;
 
-	return (out + out[1]) - start;
+	FR_PROTO_HEX_DUMP(hdr, 9, "header wimax");
+
+	return fr_dbuff_commit(dbuff, &work_dbuff);
 }
 
 /** Encode a Vendor-Specific attribute
  *
  */
-static ssize_t encode_vsa_hdr(uint8_t *out, size_t outlen,
+static ssize_t encode_vsa_hdr(fr_dbuff_t *dbuff,
 			      fr_da_stack_t *da_stack, unsigned int depth,
 			      fr_cursor_t *cursor, void *encoder_ctx)
 {
 	ssize_t			slen;
-	uint32_t		lvalue;
+	fr_dbuff_t		work_dbuff;
+	uint8_t			*hdr;
+	uint8_t			vendor[4];
 	fr_dict_attr_t const	*da = da_stack->da[depth];
 
 	FR_PROTO_STACK_PRINT(da_stack, depth);
@@ -1187,19 +1199,21 @@ static ssize_t encode_vsa_hdr(uint8_t *out, size_t outlen,
 	 *	Double-check for WiMAX format
 	 */
 	if (fr_dict_vendor_num_by_da(da_stack->da[depth + 1]) == VENDORPEC_WIMAX) {
-		return encode_wimax_hdr(out, outlen, da_stack, depth, cursor, encoder_ctx);
+		return encode_wimax_hdr(dbuff, da_stack, depth, cursor, encoder_ctx);
 	}
 
+	fr_dbuff_reservation_init(&work_dbuff, dbuff, UINT8_MAX);
+	hdr = work_dbuff.p;
+
 	/*
 	 *	Not enough freespace for: attr, len, vendor-id
 	 */
-	CHECK_FREESPACE(outlen, 6);
+	CHECK_FREESPACE(fr_dbuff_freespace(&work_dbuff), 6);
 
 	/*
 	 *	Build the Vendor-Specific header
 	 */
-	out[0] = FR_VENDOR_SPECIFIC;
-	out[1] = 6;
+	FR_DBUFF_BYTES_IN_RETURN(&work_dbuff, FR_VENDOR_SPECIFIC, 6);
 
 	/*
 	 *	Now process the vendor ID part (which is one attribute deeper)
@@ -1213,25 +1227,23 @@ static ssize_t encode_vsa_hdr(uint8_t *out, size_t outlen,
 		return PAIR_ENCODE_FATAL_ERROR;
 	}
 
-	lvalue = htonl(da->attr);
-	memcpy(out + 2, &lvalue, 4);	/* Copy in the 32bit vendor ID */
+	fr_net_from_uint32(vendor, da->attr);
+	FR_DBUFF_MEMCPY_IN_RETURN(&work_dbuff, vendor, sizeof(vendor));	/* Copy in the 32bit vendor ID */
 
-	if (outlen > 255) outlen = 255;
-
-	slen = encode_vendor_attr_hdr(out + out[1], outlen - out[1], da_stack, depth, cursor, encoder_ctx);
+	slen = encode_vendor_attr_hdr(&work_dbuff, da_stack, depth, cursor, encoder_ctx);
 	if (slen < 0) return slen;
 
-	out[1] += slen;
+	hdr[1] += slen;
 
-	FR_PROTO_HEX_DUMP(out, 6, "header vsa");
+	FR_PROTO_HEX_DUMP(hdr, 6, "header vsa");
 
-	return out[1];
+	return fr_dbuff_commit(dbuff, &work_dbuff);
 }
 
 /** Encode an RFC standard attribute 1..255
  *
  */
-static ssize_t encode_rfc_hdr(uint8_t *out, size_t outlen, fr_da_stack_t *da_stack, unsigned int depth,
+static ssize_t encode_rfc_hdr(fr_dbuff_t *dbuff, fr_da_stack_t *da_stack, unsigned int depth,
 			      fr_cursor_t *cursor, void *encoder_ctx)
 {
 	VALUE_PAIR const *vp = fr_cursor_current(cursor);
@@ -1270,35 +1282,34 @@ static ssize_t encode_rfc_hdr(uint8_t *out, size_t outlen, fr_da_stack_t *da_sta
 	 *	Thank you, WiMAX!
 	 */
 	if ((vp->da == attr_chargeable_user_identity) && (vp->vp_length == 0)) {
-		out[0] = (uint8_t)vp->da->attr;
-		out[1] = 2;
+		FR_DBUFF_BYTES_IN_RETURN(dbuff, (uint8_t)vp->da->attr, 2);
 
-		FR_PROTO_HEX_DUMP(out, 2, "header rfc");
+		FR_PROTO_HEX_DUMP(dbuff->p - 2, 2, "header rfc");
 
 		vp = fr_cursor_next(cursor);
 		fr_proto_da_stack_build(da_stack, vp ? vp->da : NULL);
-		return out[1];
+		return 2;
 	}
 
 	/*
 	 *	Message-Authenticator is hard-coded.
 	 */
 	if (vp->da == attr_message_authenticator) {
-		CHECK_FREESPACE(outlen, 18);
+		CHECK_FREESPACE(fr_dbuff_freespace(dbuff), 18);
 
-		out[0] = (uint8_t)vp->da->attr;
-		out[1] = 18;
-		memset(out + 2, 0, 16);
+		FR_DBUFF_BYTES_IN_RETURN(dbuff, (uint8_t)vp->da->attr, 18);
+		FR_DBUFF_MEMSET_RETURN(dbuff, 0, RADIUS_MESSAGE_AUTHENTICATOR_LENGTH);
 
-		FR_PROTO_HEX_DUMP(out + 2, RADIUS_MESSAGE_AUTHENTICATOR_LENGTH, "message-authenticator");
-		FR_PROTO_HEX_DUMP(out, 2, "header rfc");
+		FR_PROTO_HEX_DUMP(dbuff->p - RADIUS_MESSAGE_AUTHENTICATOR_LENGTH,
+				  RADIUS_MESSAGE_AUTHENTICATOR_LENGTH, "message-authenticator");
+		FR_PROTO_HEX_DUMP(dbuff->p - 18, 2, "header rfc");
 
 		vp = fr_cursor_next(cursor);
 		fr_proto_da_stack_build(da_stack, vp ? vp->da : NULL);
-		return out[1];
+		return 18;
 	}
 
-	return encode_rfc_hdr_internal(out, outlen, da_stack, depth, cursor, encoder_ctx);
+	return encode_rfc_hdr_internal(dbuff, da_stack, depth, cursor, encoder_ctx);
 }
 
 /** Encode a data structure into a RADIUS attribute
@@ -1307,25 +1318,26 @@ static ssize_t encode_rfc_hdr(uint8_t *out, size_t outlen, fr_da_stack_t *da_sta
  * we use for tracking our TLV/VSA nesting and then calls the appropriate
  * dispatch function.
  *
- * @param[out] out		Where to write encoded data.
- * @param[in] outlen		Length of the out buffer.
+ * The attribute is written directly into the dbuff, which is only advanced
+ * if the attribute is encoded successfully.
+ *
+ * @param[out] dbuff		Where to write encoded data.
  * @param[in] cursor		Specifying attribute to encode.
  * @param[in] encoder_ctx	Additional data such as the shared secret to use.
  * @return
- *	- >0 The number of bytes written to out.
+ *	- >0 The number of bytes written to the dbuff.
  *	- 0 Nothing to encode (or attribute skipped).
  *	- <0 an error occurred.
  */
-ssize_t fr_radius_encode_pair(uint8_t *out, size_t outlen, fr_cursor_t *cursor, void *encoder_ctx)
+ssize_t fr_radius_encode_pair_dbuff(fr_dbuff_t *dbuff, fr_cursor_t *cursor, void *encoder_ctx)
 {
 	VALUE_PAIR const	*vp;
 	int			ret;
-	size_t			attr_len;
 
 	fr_da_stack_t		da_stack;
 	fr_dict_attr_t const	*da = NULL;
 
-	if (!cursor || !out || (outlen <= 2)) return PAIR_ENCODE_FATAL_ERROR;
+	if (!cursor || (fr_dbuff_freespace(dbuff) <= 2)) return PAIR_ENCODE_FATAL_ERROR;
 
 	vp = fr_cursor_current(cursor);
 	if (!vp) return 0;
@@ -1355,12 +1367,11 @@ ssize_t fr_radius_encode_pair(uint8_t *out, size_t outlen, fr_cursor_t *cursor,
 
 	/*
 	 *	Nested structures of attributes can't be longer than
-	 *	255 bytes, so each call to an encode function can
-	 *	only use 255 bytes of buffer space at a time.
-	 */
-	attr_len = (outlen > UINT8_MAX) ? UINT8_MAX : outlen;
-
-	/*
+	 *	255 bytes, so each encode function reserves at most
+	 *	255 bytes of buffer space for its header and data.
+	 *	Only "concat", "long extended" and WiMAX attributes
+	 *	can be longer, as they're split into fragments.
+	 *
 	 *	Fast path for the common case.
 	 */
 	if (vp->da->parent->flags.is_root && !vp->da->flags.concat && (vp->vp_type != FR_TYPE_TLV)) {
@@ -1368,7 +1379,7 @@ ssize_t fr_radius_encode_pair(uint8_t *out, size_t outlen, fr_cursor_t *cursor,
 		da_stack.da[1] = NULL;
 		da_stack.depth = 1;
 		FR_PROTO_STACK_PRINT(&da_stack, 0);
-		return encode_rfc_hdr(out, attr_len, &da_stack, 0, cursor, encoder_ctx);
+		return encode_rfc_hdr(dbuff, &da_stack, 0, cursor, encoder_ctx);
 	}
 
 	/*
@@ -1387,10 +1398,10 @@ ssize_t fr_radius_encode_pair(uint8_t *out, size_t outlen, fr_cursor_t *cursor,
 			 *	using a different scheme than the "long
 			 *	extended" one.
 			 */
-			ret = encode_concat(out, outlen, &da_stack, 0, cursor, encoder_ctx);
+			ret = encode_concat(dbuff, &da_stack, 0, cursor, encoder_ctx);
 			break;
 		}
-		ret = encode_rfc_hdr(out, attr_len, &da_stack, 0, cursor, encoder_ctx);
+		ret = encode_rfc_hdr(dbuff, &da_stack, 0, cursor, encoder_ctx);
 		break;
 
 	case FR_TYPE_VSA:
@@ -1401,18 +1412,18 @@ ssize_t fr_radius_encode_pair(uint8_t *out, size_t outlen, fr_cursor_t *cursor,
 			 *	attributes by fragmenting them inside
 			 *	of the WiMAX VSA space.
 			 */
-			ret = encode_wimax_hdr(out, outlen, &da_stack, 0, cursor, encoder_ctx);
+			ret = encode_wimax_hdr(dbuff, &da_stack, 0, cursor, encoder_ctx);
 			break;
 		}
-		ret = encode_vsa_hdr(out, attr_len, &da_stack, 0, cursor, encoder_ctx);
+		ret = encode_vsa_hdr(dbuff, &da_stack, 0, cursor, encoder_ctx);
 		break;
 
 	case FR_TYPE_TLV:
-		ret = encode_tlv_hdr(out, attr_len, &da_stack, 0, cursor, encoder_ctx);
+		ret = encode_tlv_hdr(dbuff, &da_stack, 0, cursor, encoder_ctx);
 		break;
 
 	case FR_TYPE_EXTENDED:
-		ret = encode_extended_hdr(out, attr_len, &da_stack, 0, cursor, encoder_ctx);
+		ret = encode_extended_hdr(dbuff, &da_stack, 0, cursor, encoder_ctx);
 		break;
 
 	case FR_TYPE_INVALID:
@@ -1435,6 +1446,24 @@ ssize_t fr_radius_encode_pair(uint8_t *out, size_t outlen, fr_cursor_t *cursor,
 	return ret;
 }
 
+/** Encode a data structure into a RADIUS attribute
+ *
+ * @param[out] out		Where to write encoded data.
+ * @param[in] outlen		Length of the out buffer.
+ * @param[in] cursor		Specifying attribute to encode.
+ * @param[in] encoder_ctx	Additional data such as the shared secret to use.
+ * @return
+ *	- >0 The number of bytes written to out.
+ *	- 0 Nothing to encode (or attribute skipped).
+ *	- <0 an error occurred.
+ */
+ssize_t fr_radius_encode_pair(uint8_t *out, size_t outlen, fr_cursor_t *cursor, void *encoder_ctx)
+{
+	if (!out) return PAIR_ENCODE_FATAL_ERROR;
+
+	return fr_radius_encode_pair_dbuff(FR_DBUFF_TMP(out, outlen), cursor, encoder_ctx);
+}
+
 static int _test_ctx_free(UNUSED fr_radius_ctx_t *ctx)
 {
 	fr_radius_free();
@@ -25,6 +25,7 @@
  */
 #include <freeradius-devel/radius/defs.h>
 #include <freeradius-devel/util/cursor.h>
+#include <freeradius-devel/util/dbuff.h>
 #include <freeradius-devel/util/packet.h>
 #include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/util/log.h>
@@ -89,6 +90,17 @@ enum {
 	FLAG_EXTENDED_ATTR,				//!< the attribute is an extended attribute
 };
 
+/** One packet for fr_radius_sign_batch() or fr_radius_verify_batch()
+ *
+ */
+typedef struct {
+	uint8_t			*packet;	//!< The raw RADIUS packet (request or response).
+	uint8_t const		*original;	//!< The raw original request (only if this is a response).
+	uint8_t const		*secret;	//!< The shared secret.
+	size_t			secret_len;	//!< The length of the secret.
+	int			rcode;		//!< 0 on success, <0 on error.
+} fr_radius_batch_t;
+
 /*
  *	protocols/radius/base.c
  */
@@ -96,8 +108,10 @@ size_t		fr_radius_attr_len(VALUE_PAIR const *vp);
 
 int		fr_radius_sign(uint8_t *packet, uint8_t const *original,
 			       uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
+int		fr_radius_sign_batch(fr_radius_batch_t *batch, int num) CC_HINT(nonnull);
 int		fr_radius_verify(uint8_t *packet, uint8_t const *original,
 				 uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
+int		fr_radius_verify_batch(fr_radius_batch_t *batch, int num) CC_HINT(nonnull);
 bool		fr_radius_ok(uint8_t const *packet, size_t *packet_len_p,
 			     uint32_t max_attributes, bool require_ma, decode_fail_t *reason) CC_HINT(nonnull (1,2));
 
@@ -109,6 +123,15 @@ ssize_t		fr_radius_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, uint16_t *sr
 ssize_t		fr_radius_encode(uint8_t *packet, size_t packet_len, uint8_t const *original,
 				 char const *secret, UNUSED size_t secret_len, int code, int id, VALUE_PAIR *vps);
 
+ssize_t		fr_radius_encode_dbuff(fr_dbuff_t *dbuff, uint8_t const *original,
+				       char const *secret, UNUSED size_t secret_len, int code, int id, VALUE_PAIR *vps);
+
+ssize_t		fr_radius_encode_dbuff_preencoded(fr_dbuff_t *dbuff, uint8_t const *original,
+						  char const *secret, UNUSED size_t secret_len, int code, int id,
+						  uint8_t const *preencoded, size_t preencoded_len, VALUE_PAIR *vps);
+
+ssize_t		fr_radius_preencode(TALLOC_CTX *ctx, uint8_t **out, VALUE_PAIR *vps) CC_HINT(nonnull(2));
+
 ssize_t		fr_radius_decode(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len, uint8_t const *original,
 				 char const *secret, UNUSED size_t secret_len, VALUE_PAIR **vps) CC_HINT(nonnull(1,2,5,7));
 
@@ -158,6 +181,8 @@ void		fr_radius_encode_chap_password(uint8_t out[static 1 + RADIUS_CHAP_CHALLENG
 
 ssize_t		fr_radius_encode_pair(uint8_t *out, size_t outlen, fr_cursor_t *cursor, void *encoder_ctx);
 
+ssize_t		fr_radius_encode_pair_dbuff(fr_dbuff_t *dbuff, fr_cursor_t *cursor, void *encoder_ctx);
+
 /*
  *	protocols/radius/decode.c
  */
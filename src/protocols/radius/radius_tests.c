@@ -0,0 +1,96 @@
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/conf.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include "radius.h"
+#include "attrs.h"
+
+#ifndef TEST_DICT_DIR
+#  define TEST_DICT_DIR "share/dictionary"
+#endif
+
+static TALLOC_CTX	*test_ctx;
+static fr_dict_t	*test_dict_internal;
+
+static void test_init(void)
+{
+	if (test_ctx) return;
+
+	test_ctx = talloc_autofree_context();
+
+	if (!fr_dict_global_ctx_init(test_ctx, TEST_DICT_DIR) ||
+	    (fr_dict_internal_afrom_file(&test_dict_internal, FR_DICTIONARY_INTERNAL_DIR) < 0)) {
+		fr_perror("radius_tests");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/** Decode a single attribute, returning the unknown attribute it was decoded with
+ *
+ */
+static fr_dict_attr_t const *test_decode_unknown(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len)
+{
+	fr_radius_ctx_t		packet_ctx = { .tmp_ctx = ctx };
+	fr_cursor_t		cursor;
+	VALUE_PAIR		*vps = NULL, *vp;
+
+	fr_cursor_init(&cursor, &vps);
+	TEST_CHECK(fr_radius_decode_pair(ctx, &cursor, dict_radius, data, data_len, &packet_ctx) == (ssize_t)data_len);
+
+	vp = fr_cursor_head(&cursor);
+	TEST_CHECK(vp != NULL);
+	if (!vp) return NULL;
+
+	TEST_CHECK(vp->da->flags.is_unknown);
+	TEST_CHECK(vp->da->attr == data[0]);
+
+	/*
+	 *	The pair has its own copy, get the one the decoder used.
+	 */
+	return fr_dict_unknown_cached_by_fields(ctx, fr_dict_root(dict_radius), 0, data[0]);
+}
+
+static void test_unknown_reload(void)
+{
+	TALLOC_CTX		*ctx;
+	fr_dict_attr_t const	*first, *da;
+	uint8_t const		data[] = { 192, 3, 'x' };	/* Not defined by any vendor-less dictionary */
+
+	test_init();
+
+	TEST_CASE("Unknown attributes are cached");
+	TEST_CHECK(fr_radius_init() == 0);
+	ctx = talloc_init_const("first");
+
+	first = test_decode_unknown(ctx, data, sizeof(data));
+	TEST_CHECK(first != NULL);
+	TEST_CHECK(test_decode_unknown(ctx, data, sizeof(data)) == first);
+
+	talloc_free(ctx);
+	fr_radius_free();
+
+	/*
+	 *	The new dictionary may well be allocated where the
+	 *	old one was, which would have made the stale entry
+	 *	look valid.
+	 */
+	TEST_CASE("Freeing the dictionary empties the cache");
+	TEST_CHECK(fr_radius_init() == 0);
+	ctx = talloc_init_const("second");
+
+	da = test_decode_unknown(ctx, data, sizeof(data));
+	TEST_CHECK(da != NULL);
+	if (da) {
+		TEST_CHECK(da != first);
+		TEST_CHECK(da->dict == dict_radius);
+		TEST_CHECK(da->parent == fr_dict_root(dict_radius));
+	}
+
+	talloc_free(ctx);
+	fr_radius_free();
+}
+
+TEST_LIST = {
+	{ "Unknown - Reload",		test_unknown_reload },
+	{ NULL }
+};
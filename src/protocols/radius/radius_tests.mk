@@ -0,0 +1,9 @@
+TARGET		:= radius_tests
+
+SOURCES		:= radius_tests.c
+
+TGT_LDLIBS	:= $(LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-radius.a
+SRC_CFLAGS	+= -DTEST_DICT_DIR=\"$(top_srcdir)/share/dictionary\"
@@ -300,6 +300,40 @@ static int tacacs_xor(RADIUS_PACKET * const packet, char const *secret, size_t s
 	return 0;
 }
 
+/** Find the length of the TACACS+ packet at the start of a stream buffer
+ *
+ * Many packets for different sessions may be sent back to back over
+ * a single-connect TCP connection.  This lets the reader split them
+ * up without decoding them.
+ *
+ * @param[in] buffer		data read from the connection.
+ * @param[in] buffer_len	how much data was read.
+ * @return
+ *	- >0 the length of the first packet, including the header.
+ *	- 0 more data is needed to find the length.
+ *	- <0 the header is invalid.
+ */
+ssize_t fr_tacacs_length(uint8_t const *buffer, size_t buffer_len)
+{
+	fr_tacacs_packet_hdr_t const	*hdr = (fr_tacacs_packet_hdr_t const *) buffer;
+	size_t				packet_len;
+
+	if (buffer_len < sizeof(fr_tacacs_packet_hdr_t)) return 0;
+
+	if (hdr->ver.major != TAC_PLUS_MAJOR_VER) {
+		fr_strerror_printf("Discarding packet: Unsupported major version %u", hdr->ver.major);
+		return -1;
+	}
+
+	packet_len = ntohl(hdr->length);
+	if (packet_len + sizeof(fr_tacacs_packet_hdr_t) > TACACS_MAX_PACKET_SIZE) {
+		fr_strerror_printf("Discarding packet: Larger than limitation of " STRINGIFY(TACACS_MAX_PACKET_SIZE) " bytes");
+		return -1;
+	}
+
+	return packet_len + sizeof(fr_tacacs_packet_hdr_t);
+}
+
 /*
  *	Receives a packet, assuming that the RADIUS_PACKET structure
  *	has been filled out already.
@@ -322,8 +356,7 @@ int fr_tacacs_packet_recv(RADIUS_PACKET * const packet, char const * const secre
 	 *	a temporary buffer.
 	 */
 	if (!packet->data) {
-		fr_tacacs_packet_hdr_t *hdr;
-		size_t packet_len;
+		ssize_t packet_len;
 
 		/* borrow vector to bring in the header for later talloc */
 		fr_assert(sizeof(fr_tacacs_packet_hdr_t) <= RADIUS_AUTH_VECTOR_LENGTH);
@@ -357,23 +390,8 @@ int fr_tacacs_packet_recv(RADIUS_PACKET * const packet, char const * const secre
 		 *	We now have the full packet header.  Let's go
 		 *	check it.
 		 */
-		hdr = (fr_tacacs_packet_hdr_t *)packet->vector;
-
-		packet_len = ntohl(hdr->length);
-
-#ifdef __COVERITY__
-		if (!packet_len) {
-			fr_strerror_printf("Discarding packet: It contains no data");
-			return -1;
-		}
-#endif
-
-		if (packet_len + sizeof(fr_tacacs_packet_hdr_t) > TACACS_MAX_PACKET_SIZE) {
-			fr_strerror_printf("Discarding packet: Larger than limitation of " STRINGIFY(MAX_PACKET_LEN) " bytes");
-			return -1;
-		}
-
-		packet_len += sizeof(fr_tacacs_packet_hdr_t);
+		packet_len = fr_tacacs_length(packet->vector, packet->data_len);
+		if (packet_len <= 0) return -1;
 
 		packet->data = talloc_array(packet, uint8_t, packet_len);
 		if (!packet->data) {
@@ -238,6 +238,8 @@ char const	*tacacs_packet_code(RADIUS_PACKET const * const packet);
 
 uint32_t	tacacs_session_id(RADIUS_PACKET const * const packet);
 
+ssize_t		fr_tacacs_length(uint8_t const *buffer, size_t buffer_len);
+
 int		fr_tacacs_packet_recv(RADIUS_PACKET * const packet, char const * const secret, size_t secret_len);
 
 int		fr_tacacs_packet_decode(RADIUS_PACKET * const packet);
@@ -0,0 +1 @@
+SUBMAKEFILES := heap.mk test.mk
@@ -0,0 +1,19 @@
+TARGET		:= heap
+
+SRC_CFLAGS	:= -DTESTING
+SOURCES		:= heap.c
+TGT_LDLIBS	:= $(LIBS)
+TGT_PREREQS	:= libfreeradius-util.a
+
+#
+#  The build system maps one source file to one object file.  So in
+#  order to build a test binary, we need to create a new source file.
+#
+#  The test code lives in the heap library, so that it can check the
+#  internals of the heap.
+#
+src/tests/heap/heap.c: ${top_srcdir}/src/lib/util/heap.c
+	@[ -e $@ ] || ln -s $^ $(dir $@)
+
+${top_srcdir}/src/tests/heap/heap.c: ${top_srcdir}/src/lib/util/heap.c
+	@[ -e $@ ] || ln -s $^ $(dir $@)
@@ -0,0 +1,25 @@
+#
+#  Create the output directory
+#
+.PHONY: $(BUILD_DIR)/tests/heap
+$(BUILD_DIR)/tests/heap:
+	${Q}mkdir -p $@
+
+#
+#  Check 2, 4 and 8-ary heaps, with and without extracting from
+#  the middle.  "heap -b" runs the benchmarks, which are too slow
+#  to run on every build.
+#
+$(BUILD_DIR)/tests/heap/heap: $(TESTBINDIR)/heap | $(BUILD_DIR)/tests/heap
+	@echo HEAP-TEST
+	${Q}$(TESTBIN)/heap
+	${Q}$(TESTBIN)/heap -s 3
+	${Q}touch $@
+
+test.heap: $(BUILD_DIR)/tests/heap/heap
+
+.PHONY: clean.test.heap
+clean.test.heap:
+	${Q}rm -rf $(BUILD_DIR)/tests/heap/
+
+clean.test: clean.test.heap
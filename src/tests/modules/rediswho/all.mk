@@ -0,0 +1,11 @@
+#
+#  Test the "rediswho" module
+#
+
+#  MODULE.test is the main target for this module.
+
+# Don't test rediswho if REDISWHO_TEST_SERVER ENV is not set
+rediswho_require_test_server := 1
+
+rediswho.test:
+	${Q}echo OK: rediswho.test
@@ -1,4 +1,4 @@
-SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk 
+SUBMAKEFILES := ring_buffer_test.mk message_set_test.mk atomic_queue_test.mk track_table_test.mk hash_test.mk btree_test.mk md5_test.mk value_cast_test.mk
 
 #
 #  This uses an old API, and we don't have time to fix it.
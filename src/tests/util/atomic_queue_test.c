@@ -26,13 +26,17 @@ RCSID("$Id$")
 #include <stdint.h>
 #include <string.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/time.h>
 
 #ifdef HAVE_GETOPT_H
 #	include <getopt.h>
 #endif
 
 #define OFFSET	(1024)
+#define BATCH	(32)
 
 static int		debug_lvl = 0;
 
@@ -63,9 +67,216 @@ int talloc_const_free(void const *ptr)
 /**********************************************************************/
 
 
+/** Push and pop in batches, wrapping around the end of the queue
+ *
+ */
+static void test_batch(TALLOC_CTX *ctx, int size, bool spsc)
+{
+	int			i, pass;
+	size_t			n, want, used = 0;
+	intptr_t		val, next_push, next_pop;
+	void			*in[BATCH], *out[BATCH];
+	fr_atomic_queue_t	*aq;
+
+	aq = fr_atomic_queue_create(ctx, size);
+	next_push = next_pop = OFFSET;
+
+	for (pass = 0; pass < 4; pass++) {
+		/*
+		 *	Fill the queue, BATCH at a time.
+		 */
+		for (;;) {
+			for (i = 0; i < BATCH; i++) {
+				val = next_push + i;
+				in[i] = (void *) val;
+			}
+
+			n = spsc ? fr_atomic_queue_spsc_push_n(aq, in, BATCH) : fr_atomic_queue_push_n(aq, in, BATCH);
+			if (n == 0) break;
+
+			next_push += n;
+			used += n;
+		}
+
+		if (used != (size_t) size) {
+			fprintf(stderr, "Batch push left %zu entries in a queue of size %d\n", used, size);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		/*
+		 *	Pop half of it, so that the next pass wraps
+		 *	around the end of the array.  Then empty it.
+		 */
+		want = (pass < 3) ? (used / 2) : used;
+		while (want > 0) {
+			n = (want < BATCH) ? want : BATCH;
+			n = spsc ? fr_atomic_queue_spsc_pop_n(aq, out, n) : fr_atomic_queue_pop_n(aq, out, n);
+			if (n == 0) {
+				fprintf(stderr, "Batch pop failed with %zu entries left\n", used);
+				fr_exit_now(EXIT_FAILURE);
+			}
+			want -= n;
+			used -= n;
+
+			for (i = 0; i < (int) n; i++) {
+				val = (intptr_t) out[i];
+				if (val != next_pop) {
+					fprintf(stderr, "Batch pop expected %d, got %d\n", (int) next_pop, (int) val);
+					fr_exit_now(EXIT_FAILURE);
+				}
+				next_pop++;
+			}
+		}
+	}
+
+	n = spsc ? fr_atomic_queue_spsc_pop_n(aq, out, BATCH) : fr_atomic_queue_pop_n(aq, out, BATCH);
+	if (n != 0) {
+		fprintf(stderr, "Batch popped %zu entries past the end of the queue.\n", n);
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	talloc_free(aq);
+}
+
+#define BENCH_ITEMS	(10 * 1000 * 1000)
+
+typedef enum {
+	BENCH_MPMC = 0,
+	BENCH_MPMC_N,
+	BENCH_SPSC,
+	BENCH_SPSC_N,
+} bench_mode_t;
+
+static char const *bench_name[] = {
+	"mpmc push/pop",
+	"mpmc push_n/pop_n",
+	"spsc push/pop",
+	"spsc push_n/pop_n",
+};
+
+typedef struct {
+	fr_atomic_queue_t	*aq;
+	bench_mode_t		mode;
+} bench_t;
+
+/** Push BENCH_ITEMS pointers, in one thread
+ *
+ */
+static void *bench_producer(void *arg)
+{
+	bench_t		*b = arg;
+	intptr_t	val = 1;
+	void		*in[BATCH];
+	int		i;
+	size_t		n;
+
+	while (val <= BENCH_ITEMS) {
+		n = 0;
+
+		switch (b->mode) {
+		case BENCH_MPMC:
+			n = fr_atomic_queue_push(b->aq, (void *) val);
+			break;
+
+		case BENCH_SPSC:
+			n = fr_atomic_queue_spsc_push(b->aq, (void *) val);
+			break;
+
+		case BENCH_MPMC_N:
+		case BENCH_SPSC_N:
+			for (i = 0; (i < BATCH) && ((val + i) <= BENCH_ITEMS); i++) in[i] = (void *) (val + i);
+
+			n = (b->mode == BENCH_MPMC_N) ? fr_atomic_queue_push_n(b->aq, in, i) :
+							fr_atomic_queue_spsc_push_n(b->aq, in, i);
+			break;
+		}
+
+		/*
+		 *	Queue is full.  Let the consumer run, in case
+		 *	we're both on the same CPU.
+		 */
+		if (!n) sched_yield();
+		val += n;
+	}
+
+	return NULL;
+}
+
+/** Pop BENCH_ITEMS pointers, in another thread, and check their order
+ *
+ */
+static void *bench_consumer(void *arg)
+{
+	bench_t		*b = arg;
+	intptr_t	expected = 1;
+	void		*out[BATCH];
+	size_t		i, n;
+
+	while (expected <= BENCH_ITEMS) {
+		switch (b->mode) {
+		case BENCH_MPMC:
+			n = fr_atomic_queue_pop(b->aq, &out[0]);
+			break;
+
+		case BENCH_SPSC:
+			n = fr_atomic_queue_spsc_pop(b->aq, &out[0]);
+			break;
+
+		case BENCH_MPMC_N:
+			n = fr_atomic_queue_pop_n(b->aq, out, BATCH);
+			break;
+
+		case BENCH_SPSC_N:
+		default:
+			n = fr_atomic_queue_spsc_pop_n(b->aq, out, BATCH);
+			break;
+		}
+
+		if (!n) sched_yield();
+
+		for (i = 0; i < n; i++) {
+			if ((intptr_t) out[i] != expected) {
+				fprintf(stderr, "%s: expected %d, got %d\n", bench_name[b->mode],
+					(int) expected, (int) (intptr_t) out[i]);
+				fr_exit_now(EXIT_FAILURE);
+			}
+			expected++;
+		}
+	}
+
+	return NULL;
+}
+
+/** Compare the throughput of the queue operations, with one producer and one consumer thread
+ *
+ */
+static void bench(TALLOC_CTX *ctx, int size)
+{
+	bench_t		b;
+	pthread_t	producer, consumer;
+	fr_time_t	start, end;
+
+	for (b.mode = BENCH_MPMC; b.mode <= BENCH_SPSC_N; b.mode++) {
+		b.aq = fr_atomic_queue_create(ctx, size);
+
+		start = fr_time();
+		(void) pthread_create(&consumer, NULL, bench_consumer, &b);
+		(void) pthread_create(&producer, NULL, bench_producer, &b);
+		(void) pthread_join(producer, NULL);
+		(void) pthread_join(consumer, NULL);
+		end = fr_time();
+
+		printf("%-20s %d items, %.2f ns/item\n", bench_name[b.mode], BENCH_ITEMS,
+		       ((double) (end - start)) / BENCH_ITEMS);
+
+		talloc_free(b.aq);
+	}
+}
+
 static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: atomic_queue_test [OPTS]\n");
+	fprintf(stderr, "  -b                     Benchmark the queue operations.\n");
 	fprintf(stderr, "  -s size                set queue size.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
@@ -80,10 +291,15 @@ int main(int argc, char *argv[])
 	void			*data;
 	fr_atomic_queue_t	*aq;
 	TALLOC_CTX		*autofree = talloc_autofree_context();
+	bool			do_bench = false;
 
 	size = 4;
 
-	while ((c = getopt(argc, argv, "hs:tx")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "bhs:tx")) != -1) switch (c) {
+		case 'b':
+			do_bench = true;
+			break;
+
 		case 's':
 			size = atoi(optarg);
 			break;
@@ -101,6 +317,12 @@ int main(int argc, char *argv[])
 	argv += (optind - 1);
 #endif
 
+	if (do_bench) {
+		fr_time_start();
+		bench(autofree, (size > 4) ? size : 1024);
+		return 0;
+	}
+
 	aq = fr_atomic_queue_create(autofree, size);
 
 #ifndef NDEBUG
@@ -190,6 +412,12 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+	/*
+	 *	The batch and SPSC operations should behave the same.
+	 */
+	test_batch(autofree, size, false);
+	test_batch(autofree, size, true);
+
 	return rcode;
 }
 
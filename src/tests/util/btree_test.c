@@ -0,0 +1,326 @@
+/*
+ * btree_test.c	Tests for the B+tree
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/btree.h>
+#include <freeradius-devel/util/rbtree.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/time.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define BENCH_LOOKUPS	(1 << 22)
+
+static int		debug_lvl = 0;
+
+typedef struct {
+	uint32_t	num;
+	uint32_t	last;
+} walk_ctx_t;
+
+static int entry_cmp(void const *one, void const *two)
+{
+	uint32_t const *a = one;
+	uint32_t const *b = two;
+
+	return (*a > *b) - (*a < *b);
+}
+
+/*
+ *	Entries are poisoned when they're freed, so any separator
+ *	still pointing at a freed entry makes lookups go wrong.
+ */
+static void entry_free(void *data)
+{
+	*(uint32_t *) data = UINT32_MAX;
+}
+
+static int entry_walk(void *data, void *uctx)
+{
+	walk_ctx_t	*ctx = uctx;
+	uint32_t	value = *(uint32_t *) data;
+
+	if (ctx->num && (value <= ctx->last)) return -1;
+
+	ctx->last = value;
+	ctx->num++;
+
+	return 0;
+}
+
+static int entry_walk_delete(void *data, UNUSED void *uctx)
+{
+	return ((*(uint32_t *) data % 5) == 0) ? 2 : 0;
+}
+
+/** Check every entry is, or isn't, in the tree
+ *
+ */
+static void test_find(fr_btree_t *tree, uint32_t num, bool const *deleted, char const *when)
+{
+	uint32_t	i;
+	uint32_t	*found;
+
+	for (i = 0; i < num; i++) {
+		found = fr_btree_finddata(tree, &i);
+		if (deleted[i] ? (found != NULL) : (!found || (*found != i))) {
+			fprintf(stderr, "wrong result finding %u %s\n", i, when);
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+}
+
+/** Insert entries in a random order, delete them in a random order, and check walks and ranges
+ *
+ */
+static void test_tree(TALLOC_CTX *ctx, uint32_t num)
+{
+	uint32_t		i, j, tmp, live, key, *entries, *order, *found;
+	bool			*deleted;
+	fr_btree_t		*tree;
+	fr_btree_iter_t		iter;
+	walk_ctx_t		walk;
+
+	entries = talloc_array(ctx, uint32_t, num);
+	order = talloc_array(ctx, uint32_t, num);
+	deleted = talloc_zero_array(ctx, bool, num);
+
+	for (i = 0; i < num; i++) order[i] = i;
+	for (i = num - 1; i > 0; i--) {
+		j = fr_rand() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	tree = fr_btree_create(ctx, entry_cmp, entry_free, RBTREE_FLAG_NONE);
+	if (!tree) {
+		fprintf(stderr, "Failed allocating tree\n");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < num; i++) {
+		entries[order[i]] = order[i];
+		if (!fr_btree_insert(tree, &entries[order[i]])) {
+			fprintf(stderr, "failed inserting %u\n", order[i]);
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	/*
+	 *	Duplicates are refused.
+	 */
+	key = num / 2;
+	if (fr_btree_insert(tree, &key)) {
+		fprintf(stderr, "inserted a duplicate\n");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	test_find(tree, num, deleted, "after inserts");
+
+	memset(&walk, 0, sizeof(walk));
+	if ((fr_btree_walk(tree, RBTREE_IN_ORDER, entry_walk, &walk) != 0) || (walk.num != num)) {
+		fprintf(stderr, "walk returned entries out of order\n");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Delete half the entries, in a random order.
+	 */
+	for (i = 0; i < num / 2; i++) {
+		key = order[i];
+		if (!fr_btree_deletebydata(tree, &key)) {
+			fprintf(stderr, "failed deleting %u\n", key);
+			fr_exit_now(EXIT_FAILURE);
+		}
+		deleted[key] = true;
+
+		if (fr_btree_deletebydata(tree, &key)) {
+			fprintf(stderr, "deleted %u twice\n", key);
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	test_find(tree, num, deleted, "after deletes");
+
+	/*
+	 *	An iterator starting at any key should return the
+	 *	next entry which is still in the tree.
+	 */
+	key = num / 4;
+	for (i = key; (i < num) && deleted[i]; i++);
+	found = fr_btree_iter_init(tree, &iter, &key);
+	if ((i < num) ? (!found || (*found != i)) : (found != NULL)) {
+		fprintf(stderr, "range iteration started at the wrong entry\n");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	for (live = 0, found = fr_btree_iter_init(tree, &iter, NULL); found; found = fr_btree_iter_next(tree, &iter)) live++;
+	if (live != fr_btree_num_elements(tree)) {
+		fprintf(stderr, "iterator returned %u entries, expected %u\n", live, fr_btree_num_elements(tree));
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	(void) fr_btree_walk(tree, RBTREE_DELETE_ORDER, entry_walk_delete, NULL);
+	for (i = 0; i < num; i += 5) deleted[i] = true;
+
+	test_find(tree, num, deleted, "after delete walk");
+
+	for (i = 0; i < num; i++) {
+		if (deleted[i]) continue;
+
+		if (!fr_btree_deletebydata(tree, &i)) {
+			fprintf(stderr, "failed deleting %u\n", i);
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	if (fr_btree_num_elements(tree) != 0) {
+		fprintf(stderr, "tree not empty\n");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	talloc_free(tree);
+	talloc_free(deleted);
+	talloc_free(order);
+	talloc_free(entries);
+}
+
+/** Compare lookup cost of the B+tree and the rbtree
+ *
+ */
+static void bench(TALLOC_CTX *ctx, uint32_t max)
+{
+	uint32_t		num, i, key, found;
+	uint32_t		*entries;
+	fr_btree_t		*btree;
+	rbtree_t		*rbtree;
+	fr_time_t		start, end;
+
+	for (num = 1000; num <= max; num *= 10) {
+		entries = talloc_array(ctx, uint32_t, num);
+		btree = fr_btree_create(ctx, entry_cmp, NULL, RBTREE_FLAG_NONE);
+		rbtree = rbtree_create(ctx, entry_cmp, NULL, RBTREE_FLAG_NONE);
+
+		for (i = 0; i < num; i++) {
+			entries[i] = i;
+			(void) fr_btree_insert(btree, &entries[i]);
+			(void) rbtree_insert(rbtree, &entries[i]);
+		}
+
+		/*
+		 *	Step through the keys with a large odd
+		 *	stride, so lookups don't walk memory in order.
+		 */
+		found = 0;
+		start = fr_time();
+		for (i = 0; i < BENCH_LOOKUPS; i++) {
+			key = (i * 2654435761U) % num;
+			if (fr_btree_finddata(btree, &key)) found++;
+		}
+		end = fr_time();
+
+		printf("%8u entries  btree  %.2f ns/lookup\n", num, ((double) (end - start)) / BENCH_LOOKUPS);
+
+		start = fr_time();
+		for (i = 0; i < BENCH_LOOKUPS; i++) {
+			key = (i * 2654435761U) % num;
+			if (rbtree_finddata(rbtree, &key)) found++;
+		}
+		end = fr_time();
+
+		printf("%8u entries  rbtree %.2f ns/lookup\n", num, ((double) (end - start)) / BENCH_LOOKUPS);
+
+		if (found != (2 * BENCH_LOOKUPS)) {
+			fprintf(stderr, "Missed %u lookups\n", (2 * BENCH_LOOKUPS) - found);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		talloc_free(rbtree);
+		talloc_free(btree);
+		talloc_free(entries);
+	}
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: btree_test [OPTS]\n");
+	fprintf(stderr, "  -b                     Benchmark lookups against an rbtree.\n");
+	fprintf(stderr, "  -m max                 Largest number of entries to benchmark.\n");
+	fprintf(stderr, "  -s size                set number of entries.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	int			size;
+	uint32_t		max = 1000000;
+	TALLOC_CTX		*autofree = talloc_autofree_context();
+	bool			do_bench = false;
+
+	size = 10000;
+
+	while ((c = getopt(argc, argv, "bhm:s:x")) != -1) switch (c) {
+		case 'b':
+			do_bench = true;
+			break;
+
+		case 'm':
+			max = atoi(optarg);
+			break;
+
+		case 's':
+			size = atoi(optarg);
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (do_bench) {
+		fr_time_start();
+		bench(autofree, max);
+		return 0;
+	}
+
+	if (size < 2) size = 2;
+
+	test_tree(autofree, size);
+	if (debug_lvl) printf("Passed with %d entries\n", size);
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := btree_test
+
+SOURCES		:= btree_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
@@ -26,13 +26,13 @@ RCSID("$Id$")
 #include <freeradius-devel/io/control.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/kqueue.h>
 
 #ifdef HAVE_GETOPT_H
 #  include <getopt.h>
 #endif
 
 #include <pthread.h>
-#include <sys/event.h>
 
 #define MAX_MESSAGES		(2048)
 #define MAX_CONTROL_PLANE	(1024)
@@ -572,8 +572,8 @@ int main(int argc, char *argv[])
 	(void) pthread_join(master_id, NULL);
 	(void) pthread_join(worker_id, NULL);
 
-	close(kq_master);
-	close(kq_worker);
+	fr_kqueue_close(kq_master);
+	fr_kqueue_close(kq_worker);
 
 	fr_channel_debug(channel, stdout);
 
@@ -26,8 +26,8 @@ RCSID("$Id$")
 #include <freeradius-devel/util/time.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/kqueue.h>
 
-#include <sys/event.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
@@ -235,7 +235,7 @@ int main(int argc, char *argv[])
 	(void) pthread_join(master_id, NULL);
 	(void) pthread_join(worker_id, NULL);
 
-	close(kq);
+	fr_kqueue_close(kq);
 
 	fr_exit_now(EXIT_SUCCESS);
 }
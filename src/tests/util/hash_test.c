@@ -0,0 +1,322 @@
+/*
+ * hash_test.c	Tests for the chained, flat and frozen hash tables
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/time.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define BENCH_LOOKUPS	(1 << 22)
+
+static int		debug_lvl = 0;
+
+static uint32_t entry_hash(void const *data)
+{
+	return fr_hash(data, sizeof(uint32_t));
+}
+
+static int entry_cmp(void const *one, void const *two)
+{
+	uint32_t const *a = one;
+	uint32_t const *b = two;
+
+	return (*a > *b) - (*a < *b);
+}
+
+static int entry_walk(void *ctx, UNUSED void *data)
+{
+	uint32_t *count = talloc_get_type_abort(ctx, uint32_t);
+
+	(*count)++;
+
+	return 0;
+}
+
+/*
+ *	Delete every entry divisible by 3, to check that walks
+ *	can delete the entry they're given.
+ */
+static int entry_walk_delete(void *ctx, void *data)
+{
+	fr_hash_table_t *ht = ctx;
+
+	if ((*(uint32_t *) data % 3) == 0) (void) fr_hash_table_delete(ht, data);
+
+	return 0;
+}
+
+/** Insert, find, walk and delete entries, checking the table agrees with what we expect
+ *
+ */
+static void test_table(TALLOC_CTX *ctx, uint32_t num, int flags)
+{
+	uint32_t		i, pass, key, *count;
+	uint32_t		*entries;
+	fr_hash_table_t		*ht;
+	fr_hash_iter_t		iter;
+	void			*p;
+
+	entries = talloc_array(ctx, uint32_t, num);
+	for (i = 0; i < num; i++) entries[i] = i;
+
+	count = talloc_zero(ctx, uint32_t);
+
+	/*
+	 *	Several passes, so that later inserts land on the
+	 *	slots left by earlier deletes.
+	 */
+	for (pass = 0; pass < 4; pass++) {
+		ht = fr_hash_table_create_flags(ctx, entry_hash, entry_cmp, NULL, flags);
+		if (!ht) {
+			fprintf(stderr, "Failed allocating table\n");
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < num; i++) {
+			if (!fr_hash_table_insert(ht, &entries[i])) {
+				fprintf(stderr, "pass %u: failed inserting %u\n", pass, i);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+
+		/*
+		 *	Duplicates are refused.
+		 */
+		key = num / 2;
+		if (fr_hash_table_insert(ht, &key)) {
+			fprintf(stderr, "pass %u: inserted a duplicate\n", pass);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < num; i++) {
+			if (fr_hash_table_finddata(ht, &i) != &entries[i]) {
+				fprintf(stderr, "pass %u: failed finding %u\n", pass, i);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+
+		/*
+		 *	Frozen tables should find the same entries,
+		 *	and nothing else.  The deletes below then
+		 *	check the table still works once it's thawed.
+		 */
+		if (fr_hash_table_freeze(ht) < 0) {
+			fprintf(stderr, "pass %u: failed freezing table\n", pass);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < num * 2; i++) {
+			p = fr_hash_table_finddata(ht, &i);
+
+			if ((i < num) ? (p != &entries[i]) : (p != NULL)) {
+				fprintf(stderr, "pass %u: wrong result finding %u in frozen table\n", pass, i);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+
+		/*
+		 *	Delete every other entry, check the rest can
+		 *	still be found, and then put them back.
+		 */
+		for (i = pass & 1; i < num; i += 2) {
+			if (!fr_hash_table_delete(ht, &entries[i])) {
+				fprintf(stderr, "pass %u: failed deleting %u\n", pass, i);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+
+		for (i = 0; i < num; i++) {
+			p = fr_hash_table_finddata(ht, &i);
+
+			if (((i & 1) == (pass & 1)) ? (p != NULL) : (p != &entries[i])) {
+				fprintf(stderr, "pass %u: wrong result finding %u after deletes\n", pass, i);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+
+		for (i = pass & 1; i < num; i += 2) (void) fr_hash_table_insert(ht, &entries[i]);
+
+		if ((uint32_t) fr_hash_table_num_elements(ht) != num) {
+			fprintf(stderr, "pass %u: expected %u elements, got %d\n", pass, num,
+				fr_hash_table_num_elements(ht));
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		*count = 0;
+		(void) fr_hash_table_walk(ht, entry_walk, count);
+		if (*count != num) {
+			fprintf(stderr, "pass %u: walk returned %u entries\n", pass, *count);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		*count = 0;
+		for (p = fr_hash_table_iter_init(ht, &iter); p; p = fr_hash_table_iter_next(ht, &iter)) (*count)++;
+		if (*count != num) {
+			fprintf(stderr, "pass %u: iterator returned %u entries\n", pass, *count);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		(void) fr_hash_table_walk(ht, entry_walk_delete, ht);
+		for (i = 0; i < num; i++) {
+			p = fr_hash_table_finddata(ht, &i);
+
+			if ((i % 3) == 0 ? (p != NULL) : (p != &entries[i])) {
+				fprintf(stderr, "pass %u: wrong result finding %u after walk\n", pass, i);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+
+		fr_hash_table_free(ht);
+	}
+
+	talloc_free(count);
+	talloc_free(entries);
+}
+
+/** Compare insert and lookup cost of the chained and flat tables
+ *
+ */
+static void bench(TALLOC_CTX *ctx, uint32_t max)
+{
+	uint32_t		num, i, key, found;
+	uint32_t		*entries;
+	int			flags;
+	fr_hash_table_t		*ht;
+	fr_time_t		start, end;
+
+	for (num = 1000; num <= max; num *= 100) {
+		entries = talloc_array(ctx, uint32_t, num);
+		for (i = 0; i < num; i++) entries[i] = i;
+
+		for (flags = FR_HASH_TABLE_FLAG_NONE; flags <= FR_HASH_TABLE_FLAG_FLAT; flags++) {
+			char const *name = (flags & FR_HASH_TABLE_FLAG_FLAT) ? "flat   " : "chained";
+
+			ht = fr_hash_table_create_flags(ctx, entry_hash, entry_cmp, NULL, flags);
+
+			start = fr_time();
+			for (i = 0; i < num; i++) (void) fr_hash_table_insert(ht, &entries[i]);
+			end = fr_time();
+
+			printf("%8u entries  %s  %.2f ns/insert\n", num, name, ((double) (end - start)) / num);
+
+			/*
+			 *	Step through the keys with a large odd
+			 *	stride, so lookups don't walk memory in order.
+			 */
+			found = 0;
+			start = fr_time();
+			for (i = 0; i < BENCH_LOOKUPS; i++) {
+				key = (i * 2654435761U) % num;
+				if (fr_hash_table_finddata(ht, &key)) found++;
+			}
+			end = fr_time();
+
+			printf("%8u entries  %s  %.2f ns/lookup\n", num, name, ((double) (end - start)) / BENCH_LOOKUPS);
+
+			(void) fr_hash_table_freeze(ht);
+
+			start = fr_time();
+			for (i = 0; i < BENCH_LOOKUPS; i++) {
+				key = (i * 2654435761U) % num;
+				if (fr_hash_table_finddata(ht, &key)) found++;
+			}
+			end = fr_time();
+
+			printf("%8u entries  %s  %.2f ns/lookup (frozen)\n", num, name, ((double) (end - start)) / BENCH_LOOKUPS);
+
+			if (found != (2 * BENCH_LOOKUPS)) {
+				fprintf(stderr, "Missed %u lookups\n", (2 * BENCH_LOOKUPS) - found);
+				fr_exit_now(EXIT_FAILURE);
+			}
+
+			fr_hash_table_free(ht);
+		}
+
+		talloc_free(entries);
+	}
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: hash_test [OPTS]\n");
+	fprintf(stderr, "  -b                     Benchmark the chained, flat and frozen tables.\n");
+	fprintf(stderr, "  -m max                 Largest number of entries to benchmark.\n");
+	fprintf(stderr, "  -s size                set number of entries.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	int			size;
+	uint32_t		max = 10000000;
+	TALLOC_CTX		*autofree = talloc_autofree_context();
+	bool			do_bench = false;
+
+	size = 1000;
+
+	while ((c = getopt(argc, argv, "bhm:s:x")) != -1) switch (c) {
+		case 'b':
+			do_bench = true;
+			break;
+
+		case 'm':
+			max = atoi(optarg);
+			break;
+
+		case 's':
+			size = atoi(optarg);
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (do_bench) {
+		fr_time_start();
+		bench(autofree, max);
+		return 0;
+	}
+
+	if (size < 2) size = 2;
+
+	test_table(autofree, size, FR_HASH_TABLE_FLAG_NONE);
+	test_table(autofree, size, FR_HASH_TABLE_FLAG_FLAT);
+	if (debug_lvl) printf("Passed with %d entries\n", size);
+
+	return 0;
+}
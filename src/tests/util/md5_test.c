@@ -0,0 +1,204 @@
+/*
+ * md5_test.c	Tests for the multi-buffer MD5 and HMAC-MD5 functions
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/md5.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/time.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MAX_BUFFERS	(40)
+#define MAX_DATA	(600)
+#define MAX_KEY		(100)
+#define BENCH_ROUNDS	(1 << 16)
+
+static int		debug_lvl = 0;
+
+static uint8_t		data[MAX_BUFFERS][MAX_DATA];
+static uint8_t		key[MAX_BUFFERS][MAX_KEY];
+static uint8_t		multi[MAX_BUFFERS][MD5_DIGEST_LENGTH];
+static uint8_t		single[MAX_BUFFERS][MD5_DIGEST_LENGTH];
+
+static void fill(uint8_t *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) p[i] = fr_rand();
+}
+
+/** Check the multi-buffer digests against the single buffer ones
+ *
+ * Uses random numbers of buffers, so that there are partly filled
+ * batches, and random lengths, so that buffers finish at different
+ * blocks.  Lengths close to the block size are the interesting ones.
+ */
+static void test_md5(int rounds)
+{
+	int			r, i, num;
+	size_t			len;
+	fr_md5_multi_t		md5[MAX_BUFFERS];
+	fr_hmac_md5_multi_t	hmac[MAX_BUFFERS];
+
+	for (r = 0; r < rounds; r++) {
+		num = 1 + (fr_rand() % MAX_BUFFERS);
+
+		for (i = 0; i < num; i++) {
+			fill(data[i], MAX_DATA);
+
+			md5[i].out = multi[i];
+			md5[i].inlen[0] = fr_rand() % (MAX_DATA / 2);
+			md5[i].inlen[1] = fr_rand() % (MAX_DATA / 2);
+			md5[i].in[0] = data[i];
+			md5[i].in[1] = data[i] + md5[i].inlen[0];
+
+			fr_md5_calc(single[i], data[i], md5[i].inlen[0] + md5[i].inlen[1]);
+		}
+
+		fr_md5_calc_multi(md5, num);
+
+		for (i = 0; i < num; i++) {
+			if (memcmp(multi[i], single[i], MD5_DIGEST_LENGTH) != 0) {
+				fprintf(stderr, "MD5 of buffer %d (%zu + %zu bytes) is wrong\n",
+					i, md5[i].inlen[0], md5[i].inlen[1]);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+
+		for (i = 0; i < num; i++) {
+			len = fr_rand() % MAX_KEY;
+			fill(key[i], len);
+
+			hmac[i].out = multi[i];
+			hmac[i].in = data[i];
+			hmac[i].inlen = fr_rand() % MAX_DATA;
+			hmac[i].key = key[i];
+			hmac[i].key_len = len;
+
+			fr_hmac_md5(single[i], hmac[i].in, hmac[i].inlen, hmac[i].key, hmac[i].key_len);
+		}
+
+		fr_hmac_md5_multi(hmac, num);
+
+		for (i = 0; i < num; i++) {
+			if (memcmp(multi[i], single[i], MD5_DIGEST_LENGTH) != 0) {
+				fprintf(stderr, "HMAC-MD5 of buffer %d (%zu bytes, %zu byte key) is wrong\n",
+					i, hmac[i].inlen, hmac[i].key_len);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+	}
+}
+
+/** Compare the cost of hashing packet sized buffers one at a time, and together
+ *
+ */
+static void bench(size_t len)
+{
+	int			r, i;
+	fr_md5_multi_t		md5[FR_MD5_MULTI_LANES];
+	fr_time_t		start, end;
+
+	for (i = 0; i < FR_MD5_MULTI_LANES; i++) {
+		fill(data[i], len);
+		md5[i] = (fr_md5_multi_t) {
+			.out = multi[i],
+			.in = { data[i], NULL },
+			.inlen = { len, 0 }
+		};
+	}
+
+	start = fr_time();
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		for (i = 0; i < FR_MD5_MULTI_LANES; i++) fr_md5_calc(single[i], data[i], len);
+	}
+	end = fr_time();
+
+	printf("%4zu bytes  single  %.2f ns/buffer\n", len,
+	       ((double) (end - start)) / (BENCH_ROUNDS * FR_MD5_MULTI_LANES));
+
+	start = fr_time();
+	for (r = 0; r < BENCH_ROUNDS; r++) fr_md5_calc_multi(md5, FR_MD5_MULTI_LANES);
+	end = fr_time();
+
+	printf("%4zu bytes  multi   %.2f ns/buffer\n", len,
+	       ((double) (end - start)) / (BENCH_ROUNDS * FR_MD5_MULTI_LANES));
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: md5_test [OPTS]\n");
+	fprintf(stderr, "  -b                     Benchmark single and multi-buffer MD5.\n");
+	fprintf(stderr, "  -l length              Length of the buffers to benchmark.\n");
+	fprintf(stderr, "  -r rounds              set number of test rounds.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	int			rounds = 1000;
+	size_t			len = 200;
+	bool			do_bench = false;
+
+	while ((c = getopt(argc, argv, "bhl:r:x")) != -1) switch (c) {
+		case 'b':
+			do_bench = true;
+			break;
+
+		case 'l':
+			len = atoi(optarg);
+			if (len > MAX_DATA) len = MAX_DATA;
+			break;
+
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (do_bench) {
+		fr_time_start();
+		bench(len);
+		return 0;
+	}
+
+	test_md5(rounds);
+	if (debug_lvl) printf("Passed %d rounds\n", rounds);
+
+	return 0;
+}
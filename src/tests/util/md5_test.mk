@@ -0,0 +1,6 @@
+TARGET := md5_test
+
+SOURCES		:= md5_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
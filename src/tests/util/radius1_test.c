@@ -32,6 +32,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/log.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/kqueue.h>
 
 #ifdef HAVE_GETOPT_H
 #  include <getopt.h>
@@ -40,7 +41,6 @@ RCSID("$Id$")
 #include <pthread.h>
 #include <signal.h>
 
-#include <sys/event.h>
 
 #define MAX_MESSAGES		(2048)
 #define MAX_CONTROL_PLANE	(1024)
@@ -0,0 +1,299 @@
+/*
+ * track_table_test.c	Tests for the packet tracking table
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/io/track.h>
+#include <freeradius-devel/util/rbtree.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/time.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define BENCH_LOOKUPS	(1 << 22)
+
+static int		debug_lvl = 0;
+
+
+/**********************************************************************/
+typedef struct fr_request_s REQUEST;
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx);
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request);
+int talloc_const_free(void const *ptr);
+
+REQUEST *request_alloc(UNUSED TALLOC_CTX *ctx)
+{
+	return NULL;
+}
+
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED REQUEST *request)
+{
+}
+
+int talloc_const_free(void const *ptr)
+{
+	void *tmp;
+	if (!ptr) return 0;
+
+	memcpy(&tmp, &ptr, sizeof(tmp));
+	return talloc_free(tmp);
+}
+/**********************************************************************/
+
+/*
+ *	Looks like the start of a RADIUS packet: code, ID, and
+ *	authenticator.
+ */
+typedef struct {
+	uint8_t		key[20];
+} track_entry_t;
+
+static uint32_t entry_hash(void const *data)
+{
+	track_entry_t const *a = data;
+
+	return fr_hash(a->key, sizeof(a->key));
+}
+
+static int entry_cmp(void const *one, void const *two)
+{
+	track_entry_t const *a = one;
+	track_entry_t const *b = two;
+
+	return memcmp(a->key, b->key, sizeof(a->key));
+}
+
+static void entry_init(track_entry_t *entry, uint32_t i)
+{
+	memset(entry, 0, sizeof(*entry));
+	entry->key[0] = 1;
+	entry->key[1] = i & 0xff;
+	memcpy(entry->key + 4, &i, sizeof(i));
+}
+
+/** Insert, find, and delete entries, checking the table agrees with what we expect
+ *
+ */
+static void test_table(TALLOC_CTX *ctx, uint32_t num)
+{
+	uint32_t		i, pass;
+	track_entry_t		*entries, key;
+	fr_io_track_table_t	*table;
+
+	entries = talloc_array(ctx, track_entry_t, num);
+	table = fr_io_track_table_alloc(ctx, entry_hash, entry_cmp);
+	if (!table) {
+		fprintf(stderr, "Failed allocating table: %s\n", fr_strerror());
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < num; i++) entry_init(&entries[i], i);
+
+	/*
+	 *	Several passes, so that later inserts land on the
+	 *	tombstones left by earlier deletes.
+	 */
+	for (pass = 0; pass < 4; pass++) {
+		for (i = 0; i < num; i++) {
+			if (fr_io_track_table_insert(table, &entries[i]) < 0) {
+				fprintf(stderr, "pass %u: failed inserting %u\n", pass, i);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+
+		if (fr_io_track_table_num_elements(table) != num) {
+			fprintf(stderr, "pass %u: expected %u elements, got %u\n", pass, num,
+				fr_io_track_table_num_elements(table));
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		/*
+		 *	Duplicates are refused.
+		 */
+		entry_init(&key, num / 2);
+		if (fr_io_track_table_insert(table, &key) == 0) {
+			fprintf(stderr, "pass %u: inserted a duplicate\n", pass);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < num; i++) {
+			entry_init(&key, i);
+			if (fr_io_track_table_find(table, &key) != &entries[i]) {
+				fprintf(stderr, "pass %u: failed finding %u\n", pass, i);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+
+		/*
+		 *	Delete every other entry, and check the rest
+		 *	can still be found.
+		 */
+		for (i = pass & 1; i < num; i += 2) {
+			if (!fr_io_track_table_delete(table, &entries[i])) {
+				fprintf(stderr, "pass %u: failed deleting %u\n", pass, i);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+
+		for (i = 0; i < num; i++) {
+			void *found;
+
+			entry_init(&key, i);
+			found = fr_io_track_table_find(table, &key);
+
+			if (((i & 1) == (pass & 1)) ? (found != NULL) : (found != &entries[i])) {
+				fprintf(stderr, "pass %u: wrong result finding %u after deletes\n", pass, i);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+
+		/*
+		 *	Deleting something which isn't there fails.
+		 */
+		if (fr_io_track_table_delete(table, &entries[pass & 1])) {
+			fprintf(stderr, "pass %u: deleted an entry twice\n", pass);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		for (i = (pass & 1) ^ 1; i < num; i += 2) (void) fr_io_track_table_delete(table, &entries[i]);
+
+		if (fr_io_track_table_num_elements(table) != 0) {
+			fprintf(stderr, "pass %u: table not empty\n", pass);
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	talloc_free(table);
+	talloc_free(entries);
+}
+
+/** Compare lookup cost of the tracking table and an rbtree, as the number of outstanding packets grows
+ *
+ */
+static void bench(TALLOC_CTX *ctx)
+{
+	uint32_t		num, i, found;
+	track_entry_t		*entries, key;
+	fr_io_track_table_t	*table;
+	rbtree_t		*tree;
+	fr_time_t		start, end;
+
+	for (num = 16; num <= 65536; num *= 4) {
+		entries = talloc_array(ctx, track_entry_t, num);
+		table = fr_io_track_table_alloc(ctx, entry_hash, entry_cmp);
+		tree = rbtree_create(ctx, entry_cmp, NULL, 0);
+
+		for (i = 0; i < num; i++) {
+			entry_init(&entries[i], i);
+			(void) fr_io_track_table_insert(table, &entries[i]);
+			(void) rbtree_insert(tree, &entries[i]);
+		}
+
+		/*
+		 *	Step through the keys with a large odd
+		 *	stride, so lookups don't walk memory in order.
+		 */
+		found = 0;
+		start = fr_time();
+		for (i = 0; i < BENCH_LOOKUPS; i++) {
+			entry_init(&key, (i * 2654435761U) % num);
+			if (fr_io_track_table_find(table, &key)) found++;
+		}
+		end = fr_time();
+
+		printf("%6u entries  table  %.2f ns/lookup\n", num, ((double) (end - start)) / BENCH_LOOKUPS);
+
+		start = fr_time();
+		for (i = 0; i < BENCH_LOOKUPS; i++) {
+			entry_init(&key, (i * 2654435761U) % num);
+			if (rbtree_finddata(tree, &key)) found++;
+		}
+		end = fr_time();
+
+		printf("%6u entries  rbtree %.2f ns/lookup\n", num, ((double) (end - start)) / BENCH_LOOKUPS);
+
+		if (found != (2 * BENCH_LOOKUPS)) {
+			fprintf(stderr, "Missed %u lookups\n", (2 * BENCH_LOOKUPS) - found);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		talloc_free(tree);
+		talloc_free(table);
+		talloc_free(entries);
+	}
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: track_table_test [OPTS]\n");
+	fprintf(stderr, "  -b                     Benchmark lookups against an rbtree.\n");
+	fprintf(stderr, "  -s size                set number of entries.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	int			size;
+	TALLOC_CTX		*autofree = talloc_autofree_context();
+	bool			do_bench = false;
+
+	size = 1000;
+
+	while ((c = getopt(argc, argv, "bhs:x")) != -1) switch (c) {
+		case 'b':
+			do_bench = true;
+			break;
+
+		case 's':
+			size = atoi(optarg);
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (do_bench) {
+		fr_time_start();
+		bench(autofree);
+		return 0;
+	}
+
+	if (size < 2) size = 2;
+
+	test_table(autofree, size);
+	if (debug_lvl) printf("Passed with %d entries\n", size);
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := track_table_test
+
+SOURCES		:= track_table_test.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-io.a libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,258 @@
+/*
+ * value_cast_test.c	Tests for the specialised value box cast kernels
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2020 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/value.h>
+#include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/time.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define BENCH_CASTS	(1 << 20)
+
+static int		debug_lvl = 0;
+
+/** Strings which take the fast path, and strings which don't
+ *
+ */
+static char const *str_inputs[] = {
+	"0", "1", "007", "127", "128", "255", "256", "-1", "-128", "-129",
+	"65535", "65536", "-32768", "2147483647", "2147483648", "-2147483648",
+	"4294967295", "4294967296", "9223372036854775807", "-9223372036854775807",
+	"-9223372036854775808", "18446744073709551615", "18446744073709551616",
+	"0x10", " 12", "12 ", "12a", "-", "",
+	"192.0.2.1", "0.0.0.0", "255.255.255.255", "10.0.10.100", "256.1.1.1",
+	"1.2.3", "1.2.3.4.5", "1..2.3", "1.2.3.", "0001.2.3.4", "192.0.2.1/32", "*"
+};
+
+static fr_type_t const str_to_types[] = {
+	FR_TYPE_UINT8, FR_TYPE_UINT16, FR_TYPE_UINT32, FR_TYPE_UINT64,
+	FR_TYPE_INT8, FR_TYPE_INT16, FR_TYPE_INT32, FR_TYPE_INT64,
+	FR_TYPE_IPV4_ADDR
+};
+
+/** Cast with the kernel and with fr_value_box_cast, and check the results match
+ *
+ */
+static void test_cast(TALLOC_CTX *ctx, fr_type_t dst_type, fr_value_box_t const *src)
+{
+	fr_value_box_t			a, b;
+	int				ret_a, ret_b;
+	fr_value_box_cast_func_t	func = fr_value_box_cast_func(dst_type, src->type);
+	char				buffer[256];
+
+	ret_a = fr_value_box_cast(ctx, &a, dst_type, NULL, src);
+	ret_b = func(ctx, &b, dst_type, NULL, src);
+
+	fr_value_box_snprint(buffer, sizeof(buffer), src, '\0');
+
+	if (ret_a != ret_b) {
+		fprintf(stderr, "casting %s \"%s\" to %s returned %d, expected %d\n",
+			fr_table_str_by_value(fr_value_box_type_table, src->type, "<INVALID>"), buffer,
+			fr_table_str_by_value(fr_value_box_type_table, dst_type, "<INVALID>"), ret_b, ret_a);
+		fr_exit_now(EXIT_FAILURE);
+	}
+	if (ret_a < 0) return;
+
+	if ((a.type != b.type) || (a.datum.length != b.datum.length) || (a.tainted != b.tainted) ||
+	    (a.enumv != b.enumv) || (fr_value_box_cmp(&a, &b) != 0)) {
+		fprintf(stderr, "casting %s \"%s\" to %s produced a different result\n",
+			fr_table_str_by_value(fr_value_box_type_table, src->type, "<INVALID>"), buffer,
+			fr_table_str_by_value(fr_value_box_type_table, dst_type, "<INVALID>"));
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (debug_lvl > 1) {
+		fr_value_box_snprint(buffer, sizeof(buffer), &b, '\0');
+		printf("%s -> %s \"%s\"\n",
+		       fr_table_str_by_value(fr_value_box_type_table, src->type, "<INVALID>"),
+		       fr_table_str_by_value(fr_value_box_type_table, dst_type, "<INVALID>"), buffer);
+	}
+
+	fr_value_box_clear(&a);
+	fr_value_box_clear(&b);
+}
+
+static void test_kernels(TALLOC_CTX *ctx)
+{
+	size_t		i, j;
+	fr_value_box_t	*src;
+	fr_ipaddr_t	addr = { .af = AF_INET, .prefix = 32 };
+	uint8_t		octets[] = { 'a', 'b', 0x00, 'c' };
+
+	for (i = 0; i < NUM_ELEMENTS(str_inputs); i++) {
+		src = fr_box_strvalue(str_inputs[i]);
+		src->tainted = (i & 0x01);
+
+		for (j = 0; j < NUM_ELEMENTS(str_to_types); j++) test_cast(ctx, str_to_types[j], src);
+	}
+
+	test_cast(ctx, FR_TYPE_STRING, fr_box_uint8(0));
+	test_cast(ctx, FR_TYPE_STRING, fr_box_uint8(UINT8_MAX));
+	test_cast(ctx, FR_TYPE_STRING, fr_box_uint16(UINT16_MAX));
+	test_cast(ctx, FR_TYPE_STRING, fr_box_uint32(UINT32_MAX));
+	test_cast(ctx, FR_TYPE_STRING, fr_box_uint64(UINT64_MAX));
+	test_cast(ctx, FR_TYPE_STRING, fr_box_int8(INT8_MIN));
+	test_cast(ctx, FR_TYPE_STRING, fr_box_int16(INT16_MIN));
+	test_cast(ctx, FR_TYPE_STRING, fr_box_int32(-1));
+	test_cast(ctx, FR_TYPE_STRING, fr_box_int64(INT64_MIN));
+	test_cast(ctx, FR_TYPE_STRING, fr_box_int64(INT64_MAX));
+
+	for (i = 0; i < 4; i++) {
+		addr.addr.v4.s_addr = htonl((uint32_t []){ 0, 0xc0000201, 0x0a000a64, 0xffffffff }[i]);
+		test_cast(ctx, FR_TYPE_STRING, fr_box_ipv4addr(addr));
+	}
+
+	test_cast(ctx, FR_TYPE_STRING, fr_box_octets(octets, sizeof(octets)));
+	test_cast(ctx, FR_TYPE_STRING, fr_box_octets(octets, 0));
+
+	test_cast(ctx, FR_TYPE_UINT32, fr_box_uint8(UINT8_MAX));
+	test_cast(ctx, FR_TYPE_UINT32, fr_box_uint16(UINT16_MAX));
+	test_cast(ctx, FR_TYPE_UINT64, fr_box_uint8(UINT8_MAX));
+	test_cast(ctx, FR_TYPE_UINT64, fr_box_uint16(UINT16_MAX));
+	test_cast(ctx, FR_TYPE_UINT64, fr_box_uint32(UINT32_MAX));
+
+	/*
+	 *	Pairs without a kernel use the generic function.
+	 */
+	if ((fr_value_box_cast_func(FR_TYPE_DATE, FR_TYPE_STRING) != fr_value_box_cast) ||
+	    (fr_value_box_cast_func(FR_TYPE_STRING, FR_TYPE_STRING) != fr_value_box_cast)) {
+		fprintf(stderr, "expected generic cast function\n");
+		fr_exit_now(EXIT_FAILURE);
+	}
+}
+
+/** Time a cast with the kernel and with fr_value_box_cast
+ *
+ */
+static void bench_cast(TALLOC_CTX *ctx, fr_type_t dst_type, fr_value_box_t const *src)
+{
+	fr_value_box_t			dst;
+	fr_value_box_cast_func_t	func = fr_value_box_cast_func(dst_type, src->type);
+	fr_time_t			start, mid, end;
+	uint32_t			i;
+
+	start = fr_time();
+	for (i = 0; i < BENCH_CASTS; i++) {
+		if (fr_value_box_cast(ctx, &dst, dst_type, NULL, src) < 0) fr_exit_now(EXIT_FAILURE);
+		fr_value_box_clear(&dst);
+	}
+	mid = fr_time();
+	for (i = 0; i < BENCH_CASTS; i++) {
+		if (func(ctx, &dst, dst_type, NULL, src) < 0) fr_exit_now(EXIT_FAILURE);
+		fr_value_box_clear(&dst);
+	}
+	end = fr_time();
+
+	printf("%-10s -> %-10s  generic %6.2f ns/cast  kernel %6.2f ns/cast\n",
+	       fr_table_str_by_value(fr_value_box_type_table, src->type, "<INVALID>"),
+	       fr_table_str_by_value(fr_value_box_type_table, dst_type, "<INVALID>"),
+	       ((double) (mid - start)) / BENCH_CASTS, ((double) (end - mid)) / BENCH_CASTS);
+}
+
+/** Benchmark the type pairs with kernels
+ *
+ */
+static void bench(TALLOC_CTX *ctx)
+{
+	fr_ipaddr_t	addr = { .af = AF_INET, .prefix = 32 };
+	uint8_t		octets[] = "some octets";
+
+	addr.addr.v4.s_addr = htonl(0xc0000201);
+
+	bench_cast(ctx, FR_TYPE_UINT8, fr_box_strvalue("200"));
+	bench_cast(ctx, FR_TYPE_UINT16, fr_box_strvalue("1812"));
+	bench_cast(ctx, FR_TYPE_UINT32, fr_box_strvalue("86400"));
+	bench_cast(ctx, FR_TYPE_UINT64, fr_box_strvalue("1234567890123"));
+	bench_cast(ctx, FR_TYPE_INT32, fr_box_strvalue("-300"));
+	bench_cast(ctx, FR_TYPE_INT64, fr_box_strvalue("-1234567890123"));
+	bench_cast(ctx, FR_TYPE_IPV4_ADDR, fr_box_strvalue("192.0.2.1"));
+
+	bench_cast(ctx, FR_TYPE_STRING, fr_box_uint8(200));
+	bench_cast(ctx, FR_TYPE_STRING, fr_box_uint16(1812));
+	bench_cast(ctx, FR_TYPE_STRING, fr_box_uint32(86400));
+	bench_cast(ctx, FR_TYPE_STRING, fr_box_uint64(1234567890123));
+	bench_cast(ctx, FR_TYPE_STRING, fr_box_int32(-300));
+	bench_cast(ctx, FR_TYPE_STRING, fr_box_int64(-1234567890123));
+	bench_cast(ctx, FR_TYPE_STRING, fr_box_ipv4addr(addr));
+	bench_cast(ctx, FR_TYPE_STRING, fr_box_octets(octets, sizeof(octets) - 1));
+
+	bench_cast(ctx, FR_TYPE_UINT32, fr_box_uint8(200));
+	bench_cast(ctx, FR_TYPE_UINT32, fr_box_uint16(1812));
+	bench_cast(ctx, FR_TYPE_UINT64, fr_box_uint8(200));
+	bench_cast(ctx, FR_TYPE_UINT64, fr_box_uint16(1812));
+	bench_cast(ctx, FR_TYPE_UINT64, fr_box_uint32(86400));
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: value_cast_test [OPTS]\n");
+	fprintf(stderr, "  -b                     Benchmark kernels against fr_value_box_cast.\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	TALLOC_CTX		*autofree = talloc_autofree_context();
+	bool			do_bench = false;
+
+	while ((c = getopt(argc, argv, "bhx")) != -1) switch (c) {
+		case 'b':
+			do_bench = true;
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	/*
+	 *	Strings which aren't addresses would otherwise be
+	 *	looked up as hostnames by the generic cast.
+	 */
+	fr_hostname_lookups = false;
+
+	if (do_bench) {
+		fr_time_start();
+		bench(autofree);
+		return 0;
+	}
+
+	test_kernels(autofree);
+	if (debug_lvl) printf("Passed\n");
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := value_cast_test
+
+SOURCES		:= value_cast_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a
+TGT_LDLIBS	:= $(LIBS)
@@ -27,6 +27,7 @@ RCSID("$Id$")
 #include <freeradius-devel/io/worker.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/kqueue.h>
 
 #ifdef HAVE_GETOPT_H
 #  include <getopt.h>
@@ -35,7 +36,6 @@ RCSID("$Id$")
 #include <pthread.h>
 #include <signal.h>
 
-#include <sys/event.h>
 
 #define MAX_MESSAGES		(2048)
 #define MAX_CONTROL_PLANE	(1024)
@@ -557,7 +557,7 @@ int main(int argc, char *argv[])
 
 	master_process();
 
-	close(kq_master);
+	fr_kqueue_close(kq_master);
 
 	return EXIT_SUCCESS;
 }